@@ -24,6 +24,9 @@
 #define AVRO_MAGIC_SIZE 4
 #define SYNC_MARKER_SIZE 16
 
+/** Maximum byte size of an encoded integer value */
+#define MAX_INTEGER_SIZE 10
+
 /** The file magic */
 static const char avro_magic[] = {0x4f, 0x62, 0x6a, 0x01};
 
@@ -49,12 +52,65 @@ typedef struct
     enum maxavro_value_type type;
 } MAXAVRO_SCHEMA_FIELD;
 
+struct maxavro_file;
+
+/** A reusable buffer where records are written as JSON text */
+typedef struct
+{
+    char *data; /*< The JSON text, not null-terminated */
+    size_t len; /*< Length of the JSON text */
+    size_t size; /*< Size of the buffer */
+    char *scratch; /*< Buffer for the raw values of strings */
+    size_t scratch_size; /*< Size of the scratch buffer */
+} MAXAVRO_JSONBUF;
+
+/** Writes the value of a field as JSON text. The integer values are also
+ * stored in @c integer if it is not NULL. */
+typedef bool (*maxavro_write_fn)(struct maxavro_file *file, const MAXAVRO_SCHEMA_FIELD *field,
+                                 MAXAVRO_JSONBUF *buf, uint64_t *integer);
+
+/** A compiled step of decoding a record into JSON text, one for each field */
+typedef struct
+{
+    maxavro_write_fn write; /*< Writes the value of the field */
+    const MAXAVRO_SCHEMA_FIELD *field; /*< The field */
+    char *key; /*< The JSON text before the value e.g. <code>, "name": </code> */
+    size_t key_len; /*< Length of @c key */
+} MAXAVRO_DECODE_OP;
+
+enum maxavro_skip_type
+{
+    MAXAVRO_SKIP_FIXED, /*< A run of fixed size values */
+    MAXAVRO_SKIP_INTEGER, /*< A run of variable length integers */
+    MAXAVRO_SKIP_STRING, /*< A run of strings or bytes */
+    MAXAVRO_SKIP_INVALID /*< A value of an unimplemented type */
+};
+
+/** A compiled step of skipping a record. Consecutive fields with the same
+ * encoding are skipped in one step. */
+typedef struct
+{
+    enum maxavro_skip_type type;
+    size_t count; /*< Number of bytes for fixed runs, number of values otherwise */
+} MAXAVRO_SKIP_OP;
+
 typedef struct
 {
     MAXAVRO_SCHEMA_FIELD *fields;
     size_t num_fields;
+    MAXAVRO_DECODE_OP *decode_ops; /*< Record decoder, one step per field */
+    MAXAVRO_SKIP_OP *skip_ops; /*< Record skipper */
+    size_t num_skip_ops;
 } MAXAVRO_SCHEMA;
 
+/** Compression codecs of the data blocks */
+enum maxavro_codec
+{
+    MAXAVRO_CODEC_NULL,
+    MAXAVRO_CODEC_DEFLATE,
+    MAXAVRO_CODEC_UNKNOWN
+};
+
 enum maxavro_error
 {
     MAXAVRO_ERR_NONE,
@@ -63,7 +119,27 @@ enum maxavro_error
     MAXAVRO_ERR_VALUE_OVERFLOW
 };
 
+/** A data block of an Avro file */
+typedef struct
+{
+    long pos; /*< Offset of the block, the same as @c block_start_pos */
+    uint64_t number; /*< Number of blocks before this block */
+    uint64_t first_record; /*< Number of records before this block */
+    uint64_t bytes_before; /*< Total size of the blocks before this block */
+    uint64_t records; /*< Number of records in the block */
+    uint64_t size; /*< Size of the block data in bytes */
+} MAXAVRO_BLOCK_INFO;
+
+/** The offsets of the complete data blocks of a file */
 typedef struct
+{
+    MAXAVRO_BLOCK_INFO *blocks;
+    size_t num_blocks;
+    size_t capacity; /*< Allocated size of @c blocks */
+    long end_pos; /*< Offset after the sync marker of the last indexed block */
+} MAXAVRO_BLOCK_INDEX;
+
+typedef struct maxavro_file
 {
     FILE* file;
     char* filename; /*< The filename */
@@ -86,8 +162,19 @@ typedef struct
                          * to know when to read it and when not to.  */
     enum maxavro_error last_error; /*< Last error */
     uint8_t sync[SYNC_MARKER_SIZE];
+    enum maxavro_codec codec; /*< Compression codec of the data blocks */
+    FILE* block_stream; /*< The decompressed data of the current block, NULL
+                         * if the data is read directly from the file */
+    uint8_t* block_data; /*< Buffer for the decompressed data */
+    size_t block_data_size; /*< Size of the buffer */
+    MAXAVRO_BLOCK_INDEX index; /*< Index of the data blocks, built when it is
+                                * first needed and extended as the file grows */
 } MAXAVRO_FILE;
 
+/** The stream where the values of the records are read from. With compressed
+ * data blocks, it is the decompressed data of the current block. */
+#define MAXAVRO_DATA_STREAM(f) ((f)->block_stream ? (f)->block_stream : (f)->file)
+
 /** A record field value */
 typedef union
 {
@@ -113,6 +200,8 @@ typedef struct
     size_t datasize; /*< size of written data */
     uint64_t records; /*< Number of successfully written records */
     MAXAVRO_FILE *avrofile; /*< The current open file */
+    uint8_t *zbuffer; /*< Buffer for the compressed data */
+    size_t zbuffersize; /*< Size of the compressed data buffer */
 } MAXAVRO_DATABLOCK;
 
 typedef struct avro_map_value
@@ -136,6 +225,20 @@ bool maxavro_datablock_add_integer(MAXAVRO_DATABLOCK *file, uint64_t val);
 bool maxavro_datablock_add_string(MAXAVRO_DATABLOCK *file, const char* str);
 bool maxavro_datablock_add_float(MAXAVRO_DATABLOCK *file, float val);
 bool maxavro_datablock_add_double(MAXAVRO_DATABLOCK *file, double val);
+bool maxavro_datablock_add_bytes(MAXAVRO_DATABLOCK *file, const void* data, size_t len);
+
+/** Encoding values in-memory */
+uint64_t maxavro_encode_integer(uint8_t* buffer, uint64_t val);
+uint64_t maxavro_encode_string(uint8_t* dest, const char* str);
+uint64_t maxavro_encode_bytes(uint8_t* dest, const void* data, size_t len);
+uint64_t maxavro_encode_float(uint8_t* dest, float val);
+uint64_t maxavro_encode_double(uint8_t* dest, double val);
+
+/** Writing values straight to disk*/
+bool maxavro_write_integer(FILE *file, uint64_t val);
+bool maxavro_write_string(FILE *file, const char* str);
+bool maxavro_write_float(FILE *file, float val);
+bool maxavro_write_double(FILE *file, double val);
 
 /** Reading primitives */
 bool maxavro_read_integer(MAXAVRO_FILE *file, uint64_t *val);
@@ -150,6 +253,8 @@ void maxavro_map_free(MAXAVRO_MAP *value);
 
 /** Reading and seeking records */
 json_t* maxavro_record_read_json(MAXAVRO_FILE *file);
+json_t* maxavro_record_decode_json(MAXAVRO_SCHEMA *schema, const uint8_t *data, size_t len);
+bool maxavro_record_read_text(MAXAVRO_FILE *file, MAXAVRO_JSONBUF *buf, uint64_t *integers);
 GWBUF* maxavro_record_read_binary(MAXAVRO_FILE *file);
 bool maxavro_record_seek(MAXAVRO_FILE *file, uint64_t offset);
 bool maxavro_record_set_pos(MAXAVRO_FILE *file, long pos);
@@ -157,9 +262,20 @@ bool maxavro_next_block(MAXAVRO_FILE *file);
 
 /** File operations */
 MAXAVRO_FILE* maxavro_file_open(const char* filename);
+MAXAVRO_FILE* maxavro_file_create(const char* filename, const char* schema,
+                                  enum maxavro_codec codec);
+enum maxavro_codec maxavro_codec_from_string(const char* name);
+const char* maxavro_codec_to_string(enum maxavro_codec codec);
 void maxavro_file_close(MAXAVRO_FILE *file);
 GWBUF* maxavro_file_binary_header(MAXAVRO_FILE *file);
 
+/** Data block index */
+bool maxavro_index_update(MAXAVRO_FILE *file);
+bool maxavro_index_find_block(MAXAVRO_FILE *file, long pos, MAXAVRO_BLOCK_INFO *dest);
+bool maxavro_index_find_record(MAXAVRO_FILE *file, uint64_t record, MAXAVRO_BLOCK_INFO *dest);
+bool maxavro_index_goto_block(MAXAVRO_FILE *file, const MAXAVRO_BLOCK_INFO *block);
+void maxavro_index_free(MAXAVRO_BLOCK_INDEX *index);
+
 /** File error functions */
 enum maxavro_error maxavro_get_error(MAXAVRO_FILE *file);
 const char* maxavro_get_error_string(MAXAVRO_FILE *file);
@@ -167,5 +283,10 @@ const char* maxavro_get_error_string(MAXAVRO_FILE *file);
 /** Schema creation */
 MAXAVRO_SCHEMA* maxavro_schema_alloc(const char* json);
 void maxavro_schema_free(MAXAVRO_SCHEMA* schema);
+int maxavro_schema_field_index(MAXAVRO_SCHEMA* schema, const char *name);
+
+/** JSON text buffers */
+bool maxavro_jsonbuf_append(MAXAVRO_JSONBUF *buf, const char *data, size_t len);
+void maxavro_jsonbuf_free(MAXAVRO_JSONBUF *buf);
 
 #endif
@@ -15,25 +15,23 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <zlib.h>
 
 /**
- * @file maxavro_datablock.c - Experimental Avro interface for storing data
+ * @file maxavro_datablock.c - Avro interface for storing data
  *
- * TODO: Fix the code and take it into use if the Avro C client library is removed
+ * The values of the records are encoded into the memory buffer of the data
+ * block. The whole data block is written to the file when it is finalized,
+ * compressed with the codec of the file.
  */
 
-/** Encoding values in-memory */
-uint64_t maxavro_encode_integer(uint8_t* buffer, uint64_t val);
-uint64_t maxavro_encode_string(uint8_t* dest, const char* str);
-uint64_t maxavro_encode_float(uint8_t* dest, float val);
-uint64_t maxavro_encode_double(uint8_t* dest, double val);
-
-/** Writing values straight to disk*/
-bool maxavro_write_integer(FILE *file, uint64_t val);
-bool maxavro_write_string(FILE *file, const char* str);
-bool maxavro_write_float(FILE *file, float val);
-bool maxavro_write_double(FILE *file, double val);
-
+/**
+ * @brief Allocate a data block
+ *
+ * @param file File where the data block is written
+ * @param buffersize Initial size of the buffer, the buffer grows as needed
+ * @return New data block or NULL if memory allocation failed
+ */
 MAXAVRO_DATABLOCK* maxavro_datablock_allocate(MAXAVRO_FILE *file, size_t buffersize)
 {
     MAXAVRO_DATABLOCK *datablock = malloc(sizeof(MAXAVRO_DATABLOCK));
@@ -44,6 +42,13 @@ MAXAVRO_DATABLOCK* maxavro_datablock_allocate(MAXAVRO_FILE *file, size_t buffers
         datablock->avrofile = file;
         datablock->datasize = 0;
         datablock->records = 0;
+        datablock->zbuffer = NULL;
+        datablock->zbuffersize = 0;
+    }
+    else
+    {
+        free(datablock);
+        datablock = NULL;
     }
 
     return datablock;
@@ -54,54 +59,150 @@ void maxavro_datablock_free(MAXAVRO_DATABLOCK* block)
     if (block)
     {
         free(block->buffer);
+        free(block->zbuffer);
         free(block);
     }
 }
 
+/**
+ * @brief Compress the data of a block with the deflate codec
+ *
+ * The data is stored as raw deflate data without the zlib header and checksum.
+ *
+ * @param block Data block to compress
+ * @param size Set to the size of the compressed data
+ * @return True if the data was compressed into the compression buffer
+ */
+static bool deflate_datablock(MAXAVRO_DATABLOCK* block, size_t *size)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return false;
+    }
+
+    size_t bound = deflateBound(&strm, block->datasize);
+
+    if (bound > block->zbuffersize)
+    {
+        void *tmp = realloc(block->zbuffer, bound);
+
+        if (tmp == NULL)
+        {
+            deflateEnd(&strm);
+            return false;
+        }
+
+        block->zbuffer = tmp;
+        block->zbuffersize = bound;
+    }
+
+    strm.next_in = block->buffer;
+    strm.avail_in = block->datasize;
+    strm.next_out = block->zbuffer;
+    strm.avail_out = block->zbuffersize;
+
+    int rc = deflate(&strm, Z_FINISH);
+    *size = strm.total_out;
+    deflateEnd(&strm);
+    return rc == Z_STREAM_END;
+}
+
+/**
+ * @brief Write the data block to the file
+ *
+ * A data block without records is not written. After the block is written,
+ * the data block is empty and can be used for new records.
+ *
+ * @param block Data block to write
+ * @return True if the block was written and flushed to the file
+ */
 bool maxavro_datablock_finalize(MAXAVRO_DATABLOCK* block)
 {
     bool rval = true;
     FILE *file = block->avrofile->file;
 
+    if (block->records == 0)
+    {
+        return true;
+    }
+
+    uint8_t *data = block->buffer;
+    size_t size = block->datasize;
+
+    if (block->avrofile->codec == MAXAVRO_CODEC_DEFLATE)
+    {
+        if (!deflate_datablock(block, &size))
+        {
+            block->avrofile->last_error = MAXAVRO_ERR_MEMORY;
+            return false;
+        }
+        data = block->zbuffer;
+    }
+
     /** Store the current position so we can truncate the file if a write fails */
     long pos = ftell(file);
 
     if (!maxavro_write_integer(file, block->records) ||
-        !maxavro_write_integer(file, block->datasize) ||
-        fwrite(block->buffer, 1, block->datasize, file) != block->datasize ||
-        fwrite(block->avrofile->sync, 1, SYNC_MARKER_SIZE, file) != SYNC_MARKER_SIZE)
+        !maxavro_write_integer(file, size) ||
+        fwrite(data, 1, size, file) != size ||
+        fwrite(block->avrofile->sync, 1, SYNC_MARKER_SIZE, file) != SYNC_MARKER_SIZE ||
+        fflush(file) != 0)
     {
         int fd = fileno(file);
         ftruncate(fd, pos);
         fseek(file, 0, SEEK_END);
+        block->avrofile->last_error = MAXAVRO_ERR_IO;
         rval = false;
     }
     else
     {
         /** The current block is successfully written, reset datablock for
          * a new write. */
-        block->buffersize = 0;
+        block->datasize = 0;
         block->records = 0;
     }
     return rval;
 }
 
-static bool reallocate_datablock(MAXAVRO_DATABLOCK *block)
+/**
+ * @brief Make room for more data in the data block
+ *
+ * @param block Data block
+ * @param len Number of bytes needed
+ * @return True if the block has room for @c len more bytes
+ */
+static bool reserve_datablock(MAXAVRO_DATABLOCK *block, size_t len)
 {
-    void *tmp = realloc(block->buffer, block->buffersize * 2);
-    if (tmp == NULL)
+    size_t size = block->buffersize ? block->buffersize : len;
+
+    while (block->datasize + len > size)
     {
-        return false;
+        size *= 2;
+    }
+
+    if (size != block->buffersize)
+    {
+        void *tmp = realloc(block->buffer, size);
+        if (tmp == NULL)
+        {
+            block->avrofile->last_error = MAXAVRO_ERR_MEMORY;
+            return false;
+        }
+
+        block->buffer = tmp;
+        block->buffersize = size;
     }
 
-    block->buffer = tmp;
-    block->buffersize *= 2;
     return true;
 }
 
 bool maxavro_datablock_add_integer(MAXAVRO_DATABLOCK *block, uint64_t val)
 {
-    if (block->datasize + 9 >= block->buffersize && !reallocate_datablock(block))
+    if (!reserve_datablock(block, MAX_INTEGER_SIZE))
     {
         return false;
     }
@@ -113,19 +214,24 @@ bool maxavro_datablock_add_integer(MAXAVRO_DATABLOCK *block, uint64_t val)
 
 bool maxavro_datablock_add_string(MAXAVRO_DATABLOCK *block, const char* str)
 {
-    if (block->datasize + 9 + strlen(str) >= block->buffersize && !reallocate_datablock(block))
+    return maxavro_datablock_add_bytes(block, str, strlen(str));
+}
+
+bool maxavro_datablock_add_bytes(MAXAVRO_DATABLOCK *block, const void* data, size_t len)
+{
+    if (!reserve_datablock(block, MAX_INTEGER_SIZE + len))
     {
         return false;
     }
 
-    uint64_t added = maxavro_encode_string(block->buffer + block->datasize, str);
+    uint64_t added = maxavro_encode_bytes(block->buffer + block->datasize, data, len);
     block->datasize += added;
     return true;
 }
 
 bool maxavro_datablock_add_float(MAXAVRO_DATABLOCK *block, float val)
 {
-    if (block->datasize + sizeof(val) >= block->buffersize && !reallocate_datablock(block))
+    if (!reserve_datablock(block, sizeof(val)))
     {
         return false;
     }
@@ -137,7 +243,7 @@ bool maxavro_datablock_add_float(MAXAVRO_DATABLOCK *block, float val)
 
 bool maxavro_datablock_add_double(MAXAVRO_DATABLOCK *block, double val)
 {
-    if (block->datasize + sizeof(val) >= block->buffersize && !reallocate_datablock(block))
+    if (!reserve_datablock(block, sizeof(val)))
     {
         return false;
     }
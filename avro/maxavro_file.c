@@ -16,6 +16,9 @@
 #include <errno.h>
 #include <string.h>
 #include <log_manager.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <random_jkiss.h>
 
 static bool maxavro_read_sync(FILE *file, uint8_t* sync)
 {
@@ -85,8 +88,186 @@ bool maxavro_verify_block(MAXAVRO_FILE *file)
     return true;
 }
 
+/**
+ * @brief Convert a codec name to a codec
+ *
+ * @param name Name of the codec as stored in the file header
+ * @return The codec or MAXAVRO_CODEC_UNKNOWN if the codec is not supported
+ */
+enum maxavro_codec maxavro_codec_from_string(const char* name)
+{
+    if (strcmp(name, "null") == 0)
+    {
+        return MAXAVRO_CODEC_NULL;
+    }
+    else if (strcmp(name, "deflate") == 0)
+    {
+        return MAXAVRO_CODEC_DEFLATE;
+    }
+
+    return MAXAVRO_CODEC_UNKNOWN;
+}
+
+/**
+ * @brief Get the name of a codec
+ *
+ * @param codec The codec
+ * @return The name of the codec as stored in the file header
+ */
+const char* maxavro_codec_to_string(enum maxavro_codec codec)
+{
+    switch (codec)
+    {
+        case MAXAVRO_CODEC_NULL:
+            return "null";
+
+        case MAXAVRO_CODEC_DEFLATE:
+            return "deflate";
+
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ * @brief Release the decompressed data of the current block
+ *
+ * @param file File whose block stream is closed
+ */
+static void close_block_stream(MAXAVRO_FILE* file)
+{
+    if (file->block_stream)
+    {
+        fclose(file->block_stream);
+        file->block_stream = NULL;
+    }
+}
+
+/**
+ * @brief Decompress a deflate compressed data block
+ *
+ * The Avro deflate codec stores the data as raw deflate data without the zlib
+ * header and checksum. The output buffer of the file grows until the whole
+ * block fits into it.
+ *
+ * @param file File where the data is decompressed
+ * @param data The compressed data
+ * @param len Length of the compressed data
+ * @param size Set to the size of the decompressed data
+ * @return True if the data was decompressed
+ */
+static bool inflate_block(MAXAVRO_FILE* file, uint8_t* data, size_t len, size_t *size)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    if (inflateInit2(&strm, -MAX_WBITS) != Z_OK)
+    {
+        file->last_error = MAXAVRO_ERR_MEMORY;
+        return false;
+    }
+
+    strm.next_in = data;
+    strm.avail_in = len;
+    int rc = Z_OK;
+
+    while (rc == Z_OK)
+    {
+        if (strm.total_out == file->block_data_size)
+        {
+            size_t newsize = file->block_data_size ? file->block_data_size * 2 : len * 4;
+            uint8_t* tmp = realloc(file->block_data, newsize);
+
+            if (tmp == NULL)
+            {
+                file->last_error = MAXAVRO_ERR_MEMORY;
+                break;
+            }
+
+            file->block_data = tmp;
+            file->block_data_size = newsize;
+        }
+
+        strm.next_out = file->block_data + strm.total_out;
+        strm.avail_out = file->block_data_size - strm.total_out;
+        rc = inflate(&strm, Z_NO_FLUSH);
+    }
+
+    if (rc != Z_STREAM_END && file->last_error == MAXAVRO_ERR_NONE)
+    {
+        MXS_ERROR("Failed to decompress data block at offset %ld in '%s': %s",
+                  file->block_start_pos, file->filename, strm.msg ? strm.msg : "corrupt data");
+        file->last_error = MAXAVRO_ERR_IO;
+    }
+
+    *size = strm.total_out;
+    inflateEnd(&strm);
+    return rc == Z_STREAM_END;
+}
+
+/**
+ * @brief Prepare the data of the current block for reading values
+ *
+ * With compressed files, the data of the block is read and decompressed the
+ * first time the values of the block are read. Clients that only send the
+ * blocks as they are never decompress them. If the block is not yet
+ * completely written, the file position is left at the start of the data.
+ *
+ * @param file File to read
+ * @return True if the values of the block can be read
+ */
+bool maxavro_read_block_data(MAXAVRO_FILE* file)
+{
+    if (file->codec == MAXAVRO_CODEC_NULL || file->block_stream)
+    {
+        return true;
+    }
+
+    bool rval = false;
+    uint8_t* data = malloc(file->block_size);
+    size_t size = 0;
+
+    if (data == NULL)
+    {
+        file->last_error = MAXAVRO_ERR_MEMORY;
+    }
+    else if (fread(data, 1, file->block_size, file->file) != file->block_size)
+    {
+        if (ferror(file->file))
+        {
+            char err[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to read data block from '%s': %d, %s", file->filename,
+                      errno, strerror_r(errno, err, sizeof(err)));
+            file->last_error = MAXAVRO_ERR_IO;
+        }
+        else
+        {
+            clearerr(file->file);
+            fseek(file->file, file->data_start_pos, SEEK_SET);
+        }
+    }
+    else if (inflate_block(file, data, file->block_size, &size))
+    {
+        /** An empty block has no values to read */
+        if ((file->block_stream = fmemopen(file->block_data, size ? size : 1, "rb")))
+        {
+            rval = true;
+        }
+        else
+        {
+            file->last_error = MAXAVRO_ERR_MEMORY;
+        }
+    }
+
+    free(data);
+    return rval;
+}
+
 bool maxavro_read_datablock_start(MAXAVRO_FILE* file)
 {
+    /** The values of the previous block are no longer read */
+    close_block_stream(file);
+
     /** The actual start of the binary block */
     file->block_start_pos = ftell(file->file);
     file->metadata_read = false;
@@ -134,13 +315,22 @@ static char* read_schema(MAXAVRO_FILE* file)
     char *rval = NULL;
     MAXAVRO_MAP* head = maxavro_map_read(file);
     MAXAVRO_MAP* map = head;
+    bool error = false;
+
+    /** A file without a codec uses the null codec */
+    file->codec = MAXAVRO_CODEC_NULL;
 
     while (map)
     {
-        if (strcmp(map->key, "avro.schema") == 0)
+        if (strcmp(map->key, "avro.schema") == 0 && rval == NULL)
         {
             rval = strdup(map->value);
-            break;
+        }
+        else if (strcmp(map->key, "avro.codec") == 0 &&
+                 (file->codec = maxavro_codec_from_string(map->value)) == MAXAVRO_CODEC_UNKNOWN)
+        {
+            MXS_ERROR("Unsupported codec '%s' in '%s'.", map->value, file->filename);
+            error = true;
         }
         map = map->next;
     }
@@ -149,6 +339,11 @@ static char* read_schema(MAXAVRO_FILE* file)
     {
         MXS_ERROR("No schema found from Avro header.");
     }
+    else if (error)
+    {
+        free(rval);
+        rval = NULL;
+    }
 
     maxavro_map_free(head);
     return rval;
@@ -240,6 +435,148 @@ MAXAVRO_FILE* maxavro_file_open(const char* filename)
     return avrofile;
 }
 
+/**
+ * @brief Read the header of an Avro file that is opened for writing
+ *
+ * The new data blocks are written with the codec of the file.
+ *
+ * @param file File positioned at the start of the header
+ * @return True if the header was read, the sync marker and the codec are
+ * stored in @c file
+ */
+static bool maxavro_read_header(MAXAVRO_FILE *file)
+{
+    char magic[AVRO_MAGIC_SIZE];
+
+    if (fread(magic, 1, AVRO_MAGIC_SIZE, file->file) != AVRO_MAGIC_SIZE ||
+        memcmp(magic, avro_magic, AVRO_MAGIC_SIZE) != 0)
+    {
+        MXS_ERROR("Avro magic marker bytes are not correct in '%s'.", file->filename);
+        return false;
+    }
+
+    bool rval = true;
+    MAXAVRO_MAP* head = maxavro_map_read(file);
+
+    for (MAXAVRO_MAP* map = head; map; map = map->next)
+    {
+        if (strcmp(map->key, "avro.codec") == 0 &&
+            (file->codec = maxavro_codec_from_string(map->value)) == MAXAVRO_CODEC_UNKNOWN)
+        {
+            MXS_ERROR("File '%s' uses the unsupported '%s' codec.", file->filename, map->value);
+            rval = false;
+        }
+        else if (strcmp(map->key, "avro.schema") == 0 && file->schema == NULL)
+        {
+            file->schema = maxavro_schema_alloc(map->value);
+        }
+    }
+
+    maxavro_map_free(head);
+
+    if (file->schema == NULL)
+    {
+        MXS_ERROR("No schema found from Avro header of '%s'.", file->filename);
+        rval = false;
+    }
+
+    return rval && maxavro_read_sync(file->file, file->sync);
+}
+
+/**
+ * @brief Write the header of a new Avro file
+ *
+ * @param file File to write to
+ * @param schema The schema of the file in JSON format
+ * @return True if the header was written
+ */
+static bool maxavro_write_header(MAXAVRO_FILE *file, const char* schema)
+{
+    for (int i = 0; i < SYNC_MARKER_SIZE; i += sizeof(unsigned int))
+    {
+        unsigned int val = random_jkiss();
+        memcpy(file->sync + i, &val, sizeof(val));
+    }
+
+    /** The metadata is a map with one block of two key-value pairs */
+    return fwrite(avro_magic, 1, AVRO_MAGIC_SIZE, file->file) == AVRO_MAGIC_SIZE &&
+           maxavro_write_integer(file->file, 2) &&
+           maxavro_write_string(file->file, "avro.codec") &&
+           maxavro_write_string(file->file, maxavro_codec_to_string(file->codec)) &&
+           maxavro_write_string(file->file, "avro.schema") &&
+           maxavro_write_string(file->file, schema) &&
+           maxavro_write_integer(file->file, 0) &&
+           fwrite(file->sync, 1, SYNC_MARKER_SIZE, file->file) == SYNC_MARKER_SIZE &&
+           fflush(file->file) == 0;
+}
+
+/**
+ * @brief Open an Avro file for writing
+ *
+ * If the file exists, new data blocks are appended to it with the codec of
+ * the file. Otherwise a new file is created with @c schema as its schema and
+ * @c codec as its codec. The data blocks are written to the file with a
+ * @c MAXAVRO_DATABLOCK.
+ *
+ * @param filename File to open
+ * @param schema The schema of the file in JSON format
+ * @param codec Compression codec of a new file
+ * @return Pointer to opened file or NULL if an error occurred
+ */
+MAXAVRO_FILE* maxavro_file_create(const char* filename, const char* schema,
+                                  enum maxavro_codec codec)
+{
+    MAXAVRO_FILE* avrofile = calloc(1, sizeof(MAXAVRO_FILE));
+    char *my_filename = strdup(filename);
+    struct stat st;
+    bool error = true;
+
+    if (avrofile == NULL || my_filename == NULL)
+    {
+        free(avrofile);
+        free(my_filename);
+        return NULL;
+    }
+
+    avrofile->filename = my_filename;
+    avrofile->last_error = MAXAVRO_ERR_NONE;
+    avrofile->codec = codec;
+
+    if (stat(filename, &st) == 0 && st.st_size > 0)
+    {
+        if ((avrofile->file = fopen(filename, "r+b")) &&
+            maxavro_read_header(avrofile))
+        {
+            avrofile->header_end_pos = ftell(avrofile->file);
+            error = fseek(avrofile->file, 0, SEEK_END) != 0;
+        }
+    }
+    else if ((avrofile->file = fopen(filename, "wb")) &&
+             (avrofile->schema = maxavro_schema_alloc(schema)))
+    {
+        error = !maxavro_write_header(avrofile, schema);
+        avrofile->header_end_pos = ftell(avrofile->file);
+    }
+
+    if (error)
+    {
+        char err[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to open file '%s' for writing: %d, %s", filename, errno,
+                  strerror_r(errno, err, sizeof(err)));
+
+        if (avrofile->file)
+        {
+            fclose(avrofile->file);
+        }
+        maxavro_schema_free(avrofile->schema);
+        free(my_filename);
+        free(avrofile);
+        avrofile = NULL;
+    }
+
+    return avrofile;
+}
+
 /**
  * @brief Return the last error from the file
  * @param file File to check
@@ -284,8 +621,11 @@ void maxavro_file_close(MAXAVRO_FILE *file)
 {
     if (file)
     {
+        close_block_stream(file);
         fclose(file->file);
         free(file->filename);
+        free(file->block_data);
+        maxavro_index_free(&file->index);
         maxavro_schema_free(file->schema);
         free(file);
     }
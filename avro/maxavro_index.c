@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file maxavro_index.c - Index of the data blocks of an Avro file
+ *
+ * Each data block starts with its record count and size and ends with the
+ * sync marker of the file. The offsets of all blocks are found by reading
+ * only these headers and seeking over the data. The index is built with a
+ * separate file handle so that building it does not move the read position
+ * of the file.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/2016   MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include "maxavro.h"
+#include "skygw_utils.h"
+#include <errno.h>
+#include <string.h>
+#include <log_manager.h>
+
+/** Initial number of blocks the index is allocated for */
+#define INDEX_MIN_CAPACITY 64
+
+/** Result of reading a value of a block header */
+enum header_read
+{
+    HEADER_OK,
+    HEADER_END, /*< The file ends before the value */
+    HEADER_CORRUPT
+};
+
+/**
+ * @brief Read an Avro long from a block header
+ *
+ * @param file File to read from
+ * @param dest Where the value is stored
+ * @return HEADER_OK if the value was read
+ */
+static enum header_read read_header_integer(FILE *file, uint64_t *dest)
+{
+    uint64_t val = 0;
+
+    for (int nread = 0; nread < MAX_INTEGER_SIZE; nread++)
+    {
+        int c = getc(file);
+
+        if (c == EOF)
+        {
+            return ferror(file) ? HEADER_CORRUPT : HEADER_END;
+        }
+
+        val |= (uint64_t)(c & 0x7f) << (nread * 7);
+
+        if ((c & 0x80) == 0)
+        {
+            /** Zigzag decoding of the value */
+            *dest = (val >> 1) ^ -(val & 1);
+            return HEADER_OK;
+        }
+    }
+
+    return HEADER_CORRUPT;
+}
+
+/**
+ * @brief Add a block to the end of the index
+ *
+ * @param index Index to add to
+ * @param pos Offset of the block
+ * @param records Number of records in the block
+ * @param size Size of the block data
+ * @return True if the block was added, false if memory allocation failed
+ */
+static bool index_add(MAXAVRO_BLOCK_INDEX *index, long pos, uint64_t records, uint64_t size)
+{
+    if (index->num_blocks == index->capacity)
+    {
+        size_t capacity = index->capacity ? index->capacity * 2 : INDEX_MIN_CAPACITY;
+        MAXAVRO_BLOCK_INFO *blocks = realloc(index->blocks, capacity * sizeof(MAXAVRO_BLOCK_INFO));
+
+        if (blocks == NULL)
+        {
+            MXS_ERROR("Failed to allocate memory for the index of %lu data blocks.", capacity);
+            return false;
+        }
+
+        index->blocks = blocks;
+        index->capacity = capacity;
+    }
+
+    MAXAVRO_BLOCK_INFO *block = &index->blocks[index->num_blocks];
+    MAXAVRO_BLOCK_INFO *prev = index->num_blocks ? block - 1 : NULL;
+
+    block->pos = pos;
+    block->number = index->num_blocks;
+    block->first_record = prev ? prev->first_record + prev->records : 0;
+    block->bytes_before = prev ? prev->bytes_before + prev->size : 0;
+    block->records = records;
+    block->size = size;
+    index->num_blocks++;
+    return true;
+}
+
+/**
+ * @brief Add the new data blocks of a file to its index
+ *
+ * The index is built from the end of the last indexed block. A block that
+ * is not yet completely written ends the index but it is not an error.
+ *
+ * @param file File to index
+ * @return True if the index was updated, false if the file could not be read
+ * or a block is corrupted
+ */
+bool maxavro_index_update(MAXAVRO_FILE *file)
+{
+    MAXAVRO_BLOCK_INDEX *index = &file->index;
+    long pos = index->num_blocks ? index->end_pos : file->header_end_pos;
+    FILE *fp = fopen(file->filename, "rb");
+
+    if (fp == NULL || fseek(fp, pos, SEEK_SET) != 0)
+    {
+        char err[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to read '%s' for indexing: %d, %s", file->filename,
+                  errno, strerror_r(errno, err, sizeof(err)));
+
+        if (fp)
+        {
+            fclose(fp);
+        }
+        return false;
+    }
+
+    bool rval = true;
+
+    while (rval)
+    {
+        uint64_t records = 0;
+        uint64_t size = 0;
+        uint8_t sync[SYNC_MARKER_SIZE];
+        enum header_read rc = read_header_integer(fp, &records);
+
+        if (rc == HEADER_OK)
+        {
+            rc = read_header_integer(fp, &size);
+        }
+
+        if (rc != HEADER_OK)
+        {
+            if (rc == HEADER_CORRUPT)
+            {
+                MXS_ERROR("Corrupted data block header at offset %ld in '%s'.",
+                          pos, file->filename);
+                rval = false;
+            }
+            break;
+        }
+
+        if (fseek(fp, size, SEEK_CUR) != 0 ||
+            fread(sync, 1, SYNC_MARKER_SIZE, fp) != SYNC_MARKER_SIZE)
+        {
+            /** The rest of the block has not been written yet */
+            rval = !ferror(fp);
+            break;
+        }
+
+        if (memcmp(sync, file->sync, SYNC_MARKER_SIZE) != 0)
+        {
+            MXS_ERROR("Sync marker mismatch after the data block at offset %ld in '%s'.",
+                      pos, file->filename);
+            rval = false;
+        }
+        else if ((rval = index_add(index, pos, records, size)))
+        {
+            pos = ftell(fp);
+            index->end_pos = pos;
+        }
+    }
+
+    fclose(fp);
+    return rval;
+}
+
+/**
+ * @brief Find the block that starts at an offset
+ *
+ * @param file File to search
+ * @param pos Offset of the block, the block_start_pos of the file
+ * @param dest Where the block is copied
+ * @return True if the block was found
+ */
+bool maxavro_index_find_block(MAXAVRO_FILE *file, long pos, MAXAVRO_BLOCK_INFO *dest)
+{
+    MAXAVRO_BLOCK_INDEX *index = &file->index;
+
+    if ((index->num_blocks == 0 || pos >= index->end_pos) && !maxavro_index_update(file))
+    {
+        return false;
+    }
+
+    size_t low = 0;
+    size_t high = index->num_blocks;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+
+        if (index->blocks[mid].pos < pos)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    if (low < index->num_blocks && index->blocks[low].pos == pos)
+    {
+        *dest = index->blocks[low];
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Find the block that has a record
+ *
+ * If the record is right after the last record of the file, the last block
+ * is returned.
+ *
+ * @param file File to search
+ * @param record Number of records before the record
+ * @param dest Where the block is copied
+ * @return True if the block was found
+ */
+bool maxavro_index_find_record(MAXAVRO_FILE *file, uint64_t record, MAXAVRO_BLOCK_INFO *dest)
+{
+    MAXAVRO_BLOCK_INDEX *index = &file->index;
+    MAXAVRO_BLOCK_INFO *last = index->num_blocks ? &index->blocks[index->num_blocks - 1] : NULL;
+
+    if ((last == NULL || record >= last->first_record + last->records) &&
+        !maxavro_index_update(file))
+    {
+        return false;
+    }
+
+    if (index->num_blocks == 0)
+    {
+        return false;
+    }
+
+    last = &index->blocks[index->num_blocks - 1];
+
+    if (record >= last->first_record + last->records)
+    {
+        if (record == last->first_record + last->records)
+        {
+            *dest = *last;
+            return true;
+        }
+        return false;
+    }
+
+    /** The first block whose records extend past the record */
+    size_t low = 0;
+    size_t high = index->num_blocks - 1;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+
+        if (index->blocks[mid].first_record + index->blocks[mid].records <= record)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    *dest = index->blocks[low];
+    return true;
+}
+
+/**
+ * @brief Move to the start of an indexed block
+ *
+ * The read counters of the file are set as if all blocks before it were read.
+ *
+ * @param file File to move
+ * @param block The block
+ * @return True if the file is at the first record of the block
+ */
+bool maxavro_index_goto_block(MAXAVRO_FILE *file, const MAXAVRO_BLOCK_INFO *block)
+{
+    if (!maxavro_record_set_pos(file, block->pos))
+    {
+        return false;
+    }
+
+    file->blocks_read = block->number;
+    file->records_read = block->first_record;
+    file->bytes_read = block->bytes_before;
+    return true;
+}
+
+/**
+ * @brief Free the memory of a block index
+ *
+ * @param index Index to free
+ */
+void maxavro_index_free(MAXAVRO_BLOCK_INDEX *index)
+{
+    free(index->blocks);
+    memset(index, 0, sizeof(*index));
+}
@@ -17,9 +17,12 @@
 #include <skygw_debug.h>
 #include <log_manager.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <math.h>
 
 bool maxavro_read_datablock_start(MAXAVRO_FILE *file);
 bool maxavro_verify_block(MAXAVRO_FILE *file);
+bool maxavro_read_block_data(MAXAVRO_FILE *file);
 const char* type_to_string(enum maxavro_value_type type);
 
 /**
@@ -38,7 +41,7 @@ static json_t* read_and_pack_value(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *fie
         case MAXAVRO_TYPE_BOOL:
         {
             int i = 0;
-            if (fread(&i, 1, 1, file->file) == 1)
+            if (fread(&i, 1, 1, MAXAVRO_DATA_STREAM(file)) == 1)
             {
                 value = json_pack("b", i);
             }
@@ -115,40 +118,6 @@ static json_t* read_and_pack_value(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *fie
     return value;
 }
 
-static void skip_value(MAXAVRO_FILE *file, enum maxavro_value_type type)
-{
-    switch (type)
-    {
-        case MAXAVRO_TYPE_INT:
-        case MAXAVRO_TYPE_LONG:
-        case MAXAVRO_TYPE_ENUM:
-        {
-            uint64_t val = 0;
-            maxavro_read_integer(file, &val);
-        }
-        break;
-
-        case MAXAVRO_TYPE_FLOAT:
-        case MAXAVRO_TYPE_DOUBLE:
-        {
-            double d = 0;
-            maxavro_read_double(file, &d);
-        }
-        break;
-
-        case MAXAVRO_TYPE_BYTES:
-        case MAXAVRO_TYPE_STRING:
-        {
-            maxavro_skip_string(file);
-        }
-        break;
-
-        default:
-            MXS_ERROR("Unimplemented type: %d - %s", type, type_to_string(type));
-            break;
-    }
-}
-
 /**
  * @brief Read a record and convert in into JSON
  *
@@ -158,7 +127,8 @@ static void skip_value(MAXAVRO_FILE *file, enum maxavro_value_type type)
  */
 json_t* maxavro_record_read_json(MAXAVRO_FILE *file)
 {
-    if (!file->metadata_read && !maxavro_read_datablock_start(file))
+    if ((!file->metadata_read && !maxavro_read_datablock_start(file)) ||
+        !maxavro_read_block_data(file))
     {
         return NULL;
     }
@@ -180,7 +150,7 @@ json_t* maxavro_record_read_json(MAXAVRO_FILE *file)
                 }
                 else
                 {
-                    long pos = ftell(file->file);
+                    long pos = ftell(MAXAVRO_DATA_STREAM(file));
                     MXS_ERROR("Failed to read field value '%s', type '%s' at "
                               "file offset %ld, record numer %lu.",
                               file->schema->fields[i].name,
@@ -199,12 +169,712 @@ json_t* maxavro_record_read_json(MAXAVRO_FILE *file)
     return object;
 }
 
+/**
+ * @brief Decode one record from memory into JSON
+ *
+ * This is used to convert the records that are being written instead of
+ * reading them back from the file.
+ *
+ * @param schema Schema of the record
+ * @param data The Avro binary encoding of the record
+ * @param len Length of @c data
+ * @return JSON object or NULL if an error occurred
+ */
+json_t* maxavro_record_decode_json(MAXAVRO_SCHEMA *schema, const uint8_t *data, size_t len)
+{
+    MAXAVRO_FILE file;
+    memset(&file, 0, sizeof(file));
+    file.filename = "<memory>";
+    file.schema = schema;
+
+    if ((file.block_stream = fmemopen((void*)data, len, "rb")) == NULL)
+    {
+        char err[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to open a memory stream: %d, %s", errno,
+                  strerror_r(errno, err, sizeof(err)));
+        return NULL;
+    }
+
+    json_t* object = json_object();
+
+    for (size_t i = 0; object && i < schema->num_fields; i++)
+    {
+        json_t* value = read_and_pack_value(&file, &schema->fields[i]);
+
+        if (value)
+        {
+            json_object_set_new(object, schema->fields[i].name, value);
+        }
+        else
+        {
+            MXS_ERROR("Failed to decode field value '%s', type '%s'.",
+                      schema->fields[i].name, type_to_string(schema->fields[i].type));
+            json_decref(object);
+            object = NULL;
+        }
+    }
+
+    fclose(file.block_stream);
+    return object;
+}
+
+/** Initial size of a JSON text buffer */
+#define JSONBUF_MIN_SIZE 1024
+
+/**
+ * @brief Make room for more data in a JSON text buffer
+ *
+ * @param buf Buffer to grow
+ * @param len Number of bytes that are going to be appended
+ * @return True if the buffer has room for @c len more bytes
+ */
+static bool jsonbuf_reserve(MAXAVRO_JSONBUF *buf, size_t len)
+{
+    if (buf->len + len > buf->size)
+    {
+        size_t size = buf->size ? buf->size * 2 : JSONBUF_MIN_SIZE;
+
+        while (size < buf->len + len)
+        {
+            size *= 2;
+        }
+
+        char *data = realloc(buf->data, size);
+
+        if (data == NULL)
+        {
+            MXS_ERROR("Failed to allocate %lu bytes for JSON text.", size);
+            return false;
+        }
+
+        buf->data = data;
+        buf->size = size;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Append raw text to a JSON text buffer
+ *
+ * @param buf Buffer to append to
+ * @param data Text to append
+ * @param len Length of @c data
+ * @return True if the text was appended, false if memory allocation failed
+ */
+bool maxavro_jsonbuf_append(MAXAVRO_JSONBUF *buf, const char *data, size_t len)
+{
+    if (!jsonbuf_reserve(buf, len))
+    {
+        return false;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+/**
+ * @brief Free the memory of a JSON text buffer
+ *
+ * The buffer can be reused after this.
+ *
+ * @param buf Buffer to free
+ */
+void maxavro_jsonbuf_free(MAXAVRO_JSONBUF *buf)
+{
+    free(buf->data);
+    free(buf->scratch);
+    memset(buf, 0, sizeof(*buf));
+}
+
+/**
+ * @brief Check a multi-byte UTF-8 sequence
+ *
+ * @param str Start of the sequence
+ * @param len Bytes left in the string
+ * @return Length of the sequence or 0 if it is not valid UTF-8
+ */
+static size_t utf8_sequence_length(const uint8_t *str, size_t len)
+{
+    size_t n;
+    uint32_t value;
+
+    if (str[0] < 0xc2 || str[0] > 0xf4)
+    {
+        return 0;
+    }
+    else if (str[0] < 0xe0)
+    {
+        n = 2;
+        value = str[0] & 0x1f;
+    }
+    else if (str[0] < 0xf0)
+    {
+        n = 3;
+        value = str[0] & 0x0f;
+    }
+    else
+    {
+        n = 4;
+        value = str[0] & 0x07;
+    }
+
+    if (n > len)
+    {
+        return 0;
+    }
+
+    for (size_t i = 1; i < n; i++)
+    {
+        if ((str[i] & 0xc0) != 0x80)
+        {
+            return 0;
+        }
+        value = (value << 6) | (str[i] & 0x3f);
+    }
+
+    /** Overlong encodings, surrogates and values above the Unicode range */
+    if ((n == 3 && value < 0x800) || (n == 4 && value < 0x10000) ||
+        (value >= 0xd800 && value <= 0xdfff) || value > 0x10ffff)
+    {
+        return 0;
+    }
+
+    return n;
+}
+
+/**
+ * @brief Append a quoted and escaped JSON string
+ *
+ * The escaping is the same that json_dumps() does without any flags.
+ *
+ * @param buf Buffer to append to
+ * @param str The string
+ * @param len Length of @c str
+ * @return True if the string was appended, false if memory allocation failed
+ * or the string is not valid UTF-8
+ */
+static bool jsonbuf_append_string(MAXAVRO_JSONBUF *buf, const char *str, size_t len)
+{
+    const uint8_t *ptr = (const uint8_t*)str;
+    const uint8_t *end = ptr + len;
+    const uint8_t *run = ptr;
+    bool ok = maxavro_jsonbuf_append(buf, "\"", 1);
+
+    while (ok && ptr < end)
+    {
+        if (*ptr >= 0x80)
+        {
+            size_t n = utf8_sequence_length(ptr, end - ptr);
+
+            if (n == 0)
+            {
+                return false;
+            }
+
+            ptr += n;
+        }
+        else if (*ptr >= 0x20 && *ptr != '"' && *ptr != '\\')
+        {
+            ptr++;
+        }
+        else
+        {
+            char seq[7];
+            const char *esc = seq;
+            size_t esc_len = 2;
+
+            switch (*ptr)
+            {
+                case '"':
+                    esc = "\\\"";
+                    break;
+
+                case '\\':
+                    esc = "\\\\";
+                    break;
+
+                case '\b':
+                    esc = "\\b";
+                    break;
+
+                case '\f':
+                    esc = "\\f";
+                    break;
+
+                case '\n':
+                    esc = "\\n";
+                    break;
+
+                case '\r':
+                    esc = "\\r";
+                    break;
+
+                case '\t':
+                    esc = "\\t";
+                    break;
+
+                default:
+                    esc_len = snprintf(seq, sizeof(seq), "\\u%04X", *ptr);
+                    break;
+            }
+
+            ok = maxavro_jsonbuf_append(buf, (const char*)run, ptr - run) &&
+                 maxavro_jsonbuf_append(buf, esc, esc_len);
+            run = ++ptr;
+        }
+    }
+
+    return ok && maxavro_jsonbuf_append(buf, (const char*)run, ptr - run) &&
+           maxavro_jsonbuf_append(buf, "\"", 1);
+}
+
+/**
+ * @brief Append a JSON real
+ *
+ * The value is formatted the same way jansson formats it: the value always
+ * has a decimal point or an exponent and the exponent has no plus sign or
+ * leading zeros.
+ *
+ * @param buf Buffer to append to
+ * @param value The value
+ * @return True if the value was appended
+ */
+static bool jsonbuf_append_real(MAXAVRO_JSONBUF *buf, double value)
+{
+    /** JSON has no representation for these, json_real() refuses them as well */
+    if (!isfinite(value))
+    {
+        return false;
+    }
+
+    char str[32];
+    snprintf(str, sizeof(str) - 2, "%.17g", value);
+
+    char *exp = strchr(str, 'e');
+
+    if (exp)
+    {
+        char *start = exp + 1;
+        char *digits = start + 1;
+
+        if (*start == '-')
+        {
+            start++;
+        }
+
+        while (*digits == '0')
+        {
+            digits++;
+        }
+
+        memmove(start, digits, strlen(digits) + 1);
+    }
+    else if (strchr(str, '.') == NULL)
+    {
+        strcat(str, ".0");
+    }
+
+    return maxavro_jsonbuf_append(buf, str, strlen(str));
+}
+
+static bool write_integer(MAXAVRO_FILE *file, const MAXAVRO_SCHEMA_FIELD *field,
+                          MAXAVRO_JSONBUF *buf, uint64_t *integer)
+{
+    uint64_t val = 0;
+
+    if (!maxavro_read_integer(file, &val))
+    {
+        return false;
+    }
+
+    if (integer)
+    {
+        *integer = val;
+    }
+
+    char str[24];
+    int len = snprintf(str, sizeof(str), "%" PRId64, (int64_t)val);
+    return maxavro_jsonbuf_append(buf, str, len);
+}
+
+static bool write_bool(MAXAVRO_FILE *file, const MAXAVRO_SCHEMA_FIELD *field,
+                       MAXAVRO_JSONBUF *buf, uint64_t *integer)
+{
+    int c = getc(MAXAVRO_DATA_STREAM(file));
+
+    if (c == EOF)
+    {
+        if (ferror(MAXAVRO_DATA_STREAM(file)))
+        {
+            file->last_error = MAXAVRO_ERR_IO;
+        }
+        return false;
+    }
+
+    return c ? maxavro_jsonbuf_append(buf, "true", 4) : maxavro_jsonbuf_append(buf, "false", 5);
+}
+
+static bool write_float(MAXAVRO_FILE *file, const MAXAVRO_SCHEMA_FIELD *field,
+                        MAXAVRO_JSONBUF *buf, uint64_t *integer)
+{
+    float f = 0;
+    return maxavro_read_float(file, &f) && jsonbuf_append_real(buf, f);
+}
+
+static bool write_double(MAXAVRO_FILE *file, const MAXAVRO_SCHEMA_FIELD *field,
+                         MAXAVRO_JSONBUF *buf, uint64_t *integer)
+{
+    double d = 0;
+    return maxavro_read_double(file, &d) && jsonbuf_append_real(buf, d);
+}
+
+static bool write_string(MAXAVRO_FILE *file, const MAXAVRO_SCHEMA_FIELD *field,
+                         MAXAVRO_JSONBUF *buf, uint64_t *integer)
+{
+    uint64_t len = 0;
+
+    if (!maxavro_read_integer(file, &len))
+    {
+        return false;
+    }
+
+    /** The raw value is read into the scratch buffer which is reused for all values */
+    if (len > buf->scratch_size)
+    {
+        char *scratch = realloc(buf->scratch, len);
+
+        if (scratch == NULL)
+        {
+            file->last_error = MAXAVRO_ERR_MEMORY;
+            return false;
+        }
+
+        buf->scratch = scratch;
+        buf->scratch_size = len;
+    }
+
+    size_t nread = len > 0 ? fread(buf->scratch, 1, len, MAXAVRO_DATA_STREAM(file)) : 0;
+
+    if (nread != len)
+    {
+        if (nread != 0)
+        {
+            file->last_error = MAXAVRO_ERR_IO;
+        }
+        return false;
+    }
+
+    /** A value with a null byte is cut short at it as json_string() would do */
+    return jsonbuf_append_string(buf, buf->scratch, len > 0 ? strnlen(buf->scratch, len) : 0);
+}
+
+static bool write_enum(MAXAVRO_FILE *file, const MAXAVRO_SCHEMA_FIELD *field,
+                       MAXAVRO_JSONBUF *buf, uint64_t *integer)
+{
+    uint64_t val = 0;
+    json_t *arr = field->extra;
+    ss_dassert(json_is_array(arr));
+
+    if (!maxavro_read_integer(file, &val) || val >= json_array_size(arr))
+    {
+        return false;
+    }
+
+    const char *symbol = json_string_value(json_array_get(arr, val));
+    ss_dassert(symbol);
+    return jsonbuf_append_string(buf, symbol, strlen(symbol));
+}
+
+static bool write_null(MAXAVRO_FILE *file, const MAXAVRO_SCHEMA_FIELD *field,
+                       MAXAVRO_JSONBUF *buf, uint64_t *integer)
+{
+    return maxavro_jsonbuf_append(buf, "null", 4);
+}
+
+static bool write_unimplemented(MAXAVRO_FILE *file, const MAXAVRO_SCHEMA_FIELD *field,
+                                MAXAVRO_JSONBUF *buf, uint64_t *integer)
+{
+    MXS_ERROR("Unimplemented type: %d", field->type);
+    return false;
+}
+
+/**
+ * @brief Get the step that skips a value
+ *
+ * @param type Type of the value
+ * @param count Where the number of bytes (fixed size types) or values (other
+ * types) the step skips is stored
+ * @return How the value is skipped
+ */
+static enum maxavro_skip_type value_skip_type(enum maxavro_value_type type, size_t *count)
+{
+    *count = 1;
+
+    switch (type)
+    {
+        case MAXAVRO_TYPE_INT:
+        case MAXAVRO_TYPE_LONG:
+        case MAXAVRO_TYPE_ENUM:
+            return MAXAVRO_SKIP_INTEGER;
+
+        case MAXAVRO_TYPE_BOOL:
+            return MAXAVRO_SKIP_FIXED;
+
+        case MAXAVRO_TYPE_FLOAT:
+            *count = sizeof(float);
+            return MAXAVRO_SKIP_FIXED;
+
+        case MAXAVRO_TYPE_DOUBLE:
+            *count = sizeof(double);
+            return MAXAVRO_SKIP_FIXED;
+
+        case MAXAVRO_TYPE_NULL:
+            *count = 0;
+            return MAXAVRO_SKIP_FIXED;
+
+        case MAXAVRO_TYPE_BYTES:
+        case MAXAVRO_TYPE_STRING:
+            return MAXAVRO_SKIP_STRING;
+
+        default:
+            return MAXAVRO_SKIP_INVALID;
+    }
+}
+
+static maxavro_write_fn value_writer(enum maxavro_value_type type)
+{
+    switch (type)
+    {
+        case MAXAVRO_TYPE_INT:
+        case MAXAVRO_TYPE_LONG:
+            return write_integer;
+
+        case MAXAVRO_TYPE_BOOL:
+            return write_bool;
+
+        case MAXAVRO_TYPE_FLOAT:
+            return write_float;
+
+        case MAXAVRO_TYPE_DOUBLE:
+            return write_double;
+
+        case MAXAVRO_TYPE_BYTES:
+        case MAXAVRO_TYPE_STRING:
+            return write_string;
+
+        case MAXAVRO_TYPE_ENUM:
+            return write_enum;
+
+        case MAXAVRO_TYPE_NULL:
+            return write_null;
+
+        default:
+            return write_unimplemented;
+    }
+}
+
+/**
+ * @brief Free the compiled decoder of a schema
+ *
+ * @param schema Schema whose decoder is freed
+ */
+void maxavro_schema_compiled_free(MAXAVRO_SCHEMA *schema)
+{
+    if (schema->decode_ops)
+    {
+        for (size_t i = 0; i < schema->num_fields; i++)
+        {
+            free(schema->decode_ops[i].key);
+        }
+    }
+
+    free(schema->decode_ops);
+    free(schema->skip_ops);
+    schema->decode_ops = NULL;
+    schema->skip_ops = NULL;
+    schema->num_skip_ops = 0;
+}
+
+/**
+ * @brief Compile the decoder of a schema
+ *
+ * The type of each field is resolved once into the function that writes its
+ * value and the JSON text of the field name is formatted in advance. For
+ * skipping, consecutive fields with the same encoding are merged into one
+ * step so that e.g. a run of doubles is skipped with a single seek.
+ *
+ * @param schema Schema to compile
+ * @return True if the schema was compiled, false if memory allocation failed
+ */
+bool maxavro_schema_compile(MAXAVRO_SCHEMA *schema)
+{
+    size_t n = schema->num_fields ? schema->num_fields : 1;
+    schema->decode_ops = calloc(n, sizeof(MAXAVRO_DECODE_OP));
+    schema->skip_ops = calloc(n, sizeof(MAXAVRO_SKIP_OP));
+    schema->num_skip_ops = 0;
+
+    if (schema->decode_ops == NULL || schema->skip_ops == NULL)
+    {
+        MXS_ERROR("Memory allocation failed.");
+        maxavro_schema_compiled_free(schema);
+        return false;
+    }
+
+    for (size_t i = 0; i < schema->num_fields; i++)
+    {
+        MAXAVRO_SCHEMA_FIELD *field = &schema->fields[i];
+        MAXAVRO_DECODE_OP *op = &schema->decode_ops[i];
+        MAXAVRO_JSONBUF key;
+        memset(&key, 0, sizeof(key));
+
+        if (!maxavro_jsonbuf_append(&key, i == 0 ? "{" : ", ", i == 0 ? 1 : 2) ||
+            !jsonbuf_append_string(&key, field->name, strlen(field->name)) ||
+            !maxavro_jsonbuf_append(&key, ": ", 2))
+        {
+            MXS_ERROR("Failed to compile the decoder of field '%s'.", field->name);
+            maxavro_jsonbuf_free(&key);
+            maxavro_schema_compiled_free(schema);
+            return false;
+        }
+
+        op->key = key.data;
+        op->key_len = key.len;
+        op->field = field;
+        op->write = value_writer(field->type);
+
+        size_t count;
+        enum maxavro_skip_type type = value_skip_type(field->type, &count);
+        MAXAVRO_SKIP_OP *prev = schema->num_skip_ops ? &schema->skip_ops[schema->num_skip_ops - 1] : NULL;
+
+        if (prev && prev->type == type && type != MAXAVRO_SKIP_INVALID)
+        {
+            prev->count += count;
+        }
+        else
+        {
+            schema->skip_ops[schema->num_skip_ops].type = type;
+            schema->skip_ops[schema->num_skip_ops].count = count;
+            schema->num_skip_ops++;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Read a record as JSON text
+ *
+ * The record is decoded with the compiled decoder of the schema and appended
+ * to the buffer as one line of JSON. The text is the same json_dumps() would
+ * produce from the object maxavro_record_read_json() returns but no JSON
+ * objects are created.
+ *
+ * @param file File to read from
+ * @param buf Buffer where the record is appended
+ * @param integers If not NULL, an array with one element per schema field
+ * where the values of the integer fields are stored
+ * @return True if a record was read, false if no records were left or an
+ * error occurred. On error, the buffer is left as it was.
+ */
+bool maxavro_record_read_text(MAXAVRO_FILE *file, MAXAVRO_JSONBUF *buf, uint64_t *integers)
+{
+    if ((!file->metadata_read && !maxavro_read_datablock_start(file)) ||
+        !maxavro_read_block_data(file) ||
+        file->records_read_from_block >= file->records_in_block)
+    {
+        return false;
+    }
+
+    MAXAVRO_SCHEMA *schema = file->schema;
+    size_t start = buf->len;
+
+    for (size_t i = 0; i < schema->num_fields; i++)
+    {
+        MAXAVRO_DECODE_OP *op = &schema->decode_ops[i];
+
+        if (!maxavro_jsonbuf_append(buf, op->key, op->key_len) ||
+            !op->write(file, op->field, buf, integers ? &integers[i] : NULL))
+        {
+            long pos = ftell(MAXAVRO_DATA_STREAM(file));
+            MXS_ERROR("Failed to read field value '%s', type '%s' at "
+                      "file offset %ld, record numer %lu.",
+                      op->field->name, type_to_string(op->field->type),
+                      pos, file->records_read);
+            buf->len = start;
+            return false;
+        }
+    }
+
+    if (!(schema->num_fields ? maxavro_jsonbuf_append(buf, "}\n", 2) :
+          maxavro_jsonbuf_append(buf, "{}\n", 3)))
+    {
+        buf->len = start;
+        return false;
+    }
+
+    file->records_read_from_block++;
+    file->records_read++;
+    return true;
+}
+
+/**
+ * @brief Skip a record with the compiled skip steps of the schema
+ *
+ * @param file File to read from
+ */
 static void skip_record(MAXAVRO_FILE *file)
 {
-    for (size_t i = 0; i < file->schema->num_fields; i++)
+    if (!maxavro_read_block_data(file))
+    {
+        return;
+    }
+
+    MAXAVRO_SCHEMA *schema = file->schema;
+
+    for (size_t i = 0; i < schema->num_skip_ops; i++)
     {
-        skip_value(file, file->schema->fields[i].type);
+        MAXAVRO_SKIP_OP *op = &schema->skip_ops[i];
+        bool ok = true;
+
+        switch (op->type)
+        {
+            case MAXAVRO_SKIP_FIXED:
+                if (op->count > 0 && fseek(MAXAVRO_DATA_STREAM(file), op->count, SEEK_CUR) != 0)
+                {
+                    file->last_error = MAXAVRO_ERR_IO;
+                    ok = false;
+                }
+                break;
+
+            case MAXAVRO_SKIP_INTEGER:
+                for (size_t j = 0; ok && j < op->count; j++)
+                {
+                    ok = maxavro_read_integer(file, NULL);
+                }
+                break;
+
+            case MAXAVRO_SKIP_STRING:
+                for (size_t j = 0; ok && j < op->count; j++)
+                {
+                    ok = maxavro_skip_string(file);
+                }
+                break;
+
+            default:
+                MXS_ERROR("Cannot skip a record of '%s', the schema has a value of "
+                          "an unimplemented type.", file->filename);
+                ok = false;
+                break;
+        }
+
+        if (!ok)
+        {
+            return;
+        }
     }
+
     file->records_read_from_block++;
     file->records_read++;
 }
@@ -237,10 +907,41 @@ bool maxavro_next_block(MAXAVRO_FILE *file)
     return false;
 }
 
+/**
+ * @brief Move to the block that has a record with the block index
+ *
+ * @param file File to move
+ * @param offset Number of records to skip from the current position. On
+ * success, set to the number of records to skip in the new block.
+ * @return True if the file was moved, false if the index could not be used
+ */
+static bool seek_with_index(MAXAVRO_FILE *file, uint64_t *offset)
+{
+    MAXAVRO_BLOCK_INFO current;
+    MAXAVRO_BLOCK_INFO target;
+
+    if (maxavro_index_find_block(file, file->block_start_pos, &current))
+    {
+        uint64_t record = current.first_record + file->records_read_from_block + *offset;
+
+        if (maxavro_index_find_record(file, record, &target) &&
+            maxavro_index_goto_block(file, &target))
+        {
+            *offset = record - target.first_record;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /**
  * @brief Seek to a position in the Avro file
  *
  * This moves the current position of the file, skipping data blocks if necessary.
+ * When the position is in another block, the block index of the file is used
+ * to move straight to it. The blocks are walked one by one only if the index
+ * can't be used.
  *
  * @param file
  * @param position
@@ -250,15 +951,8 @@ bool maxavro_record_seek(MAXAVRO_FILE *file, uint64_t offset)
 {
     bool rval = true;
 
-    if (offset < file->records_in_block - file->records_read_from_block)
-    {
-        /** Seek to the end of the block or to the position we want */
-        while (offset-- > 0)
-        {
-            skip_record(file);
-        }
-    }
-    else
+    if (offset >= file->records_in_block - file->records_read_from_block &&
+        !seek_with_index(file, &offset))
     {
         /** We're seeking past a block boundary */
         offset -= (file->records_in_block - file->records_read_from_block);
@@ -268,16 +962,16 @@ bool maxavro_record_seek(MAXAVRO_FILE *file, uint64_t offset)
         {
             /** Skip full blocks that don't have the position we want */
             offset -= file->records_in_block;
-            fseek(file->file, file->block_size, SEEK_CUR);
             maxavro_next_block(file);
         }
 
         ss_dassert(offset <= file->records_in_block);
+    }
 
-        while (offset-- > 0)
-        {
-            skip_record(file);
-        }
+    /** Seek to the end of the block or to the position we want */
+    while (offset-- > 0)
+    {
+        skip_record(file);
     }
 
     return rval;
@@ -17,6 +17,9 @@
 #include <skygw_debug.h>
 #include <log_manager.h>
 
+bool maxavro_schema_compile(MAXAVRO_SCHEMA *schema);
+void maxavro_schema_compiled_free(MAXAVRO_SCHEMA *schema);
+
 static const MAXAVRO_SCHEMA_FIELD types[MAXAVRO_TYPE_MAX] =
 {
     {"int", NULL, MAXAVRO_TYPE_INT},
@@ -91,6 +94,12 @@ static enum maxavro_value_type unpack_to_type(json_t *object,
         type = tmp;
     }
 
+    /** A primitive type is only the name of the type */
+    if (json_is_string(object))
+    {
+        type = object;
+    }
+
     if (type && json_is_string(type))
     {
         const char *value = json_string_value(type);
@@ -177,6 +186,11 @@ MAXAVRO_SCHEMA* maxavro_schema_alloc(const char* json)
             free(rval);
             rval = NULL;
         }
+        else if (!maxavro_schema_compile(rval))
+        {
+            maxavro_schema_free(rval);
+            rval = NULL;
+        }
     }
     else
     {
@@ -210,7 +224,28 @@ void maxavro_schema_free(MAXAVRO_SCHEMA* schema)
         {
             maxavro_schema_field_free(&schema->fields[i]);
         }
+        maxavro_schema_compiled_free(schema);
         free(schema->fields);
         free(schema);
     }
 }
+
+/**
+ * @brief Find a field of a schema
+ *
+ * @param schema Schema to search
+ * @param name Name of the field
+ * @return Index of the field or -1 if the schema has no such field
+ */
+int maxavro_schema_field_index(MAXAVRO_SCHEMA* schema, const char *name)
+{
+    for (int i = 0; i < schema->num_fields; i++)
+    {
+        if (strcmp(schema->fields[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
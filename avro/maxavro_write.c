@@ -20,10 +20,10 @@
 
 /**
  * @file maxavro_write.c - Avro value writing
- *
- * Currently these functions aren't in use
  */
 
+#define encode_long(n) (((uint64_t)(n) << 1) ^ (uint64_t)((int64_t)(n) >> 63))
+
 /**
  * @brief Encode an integer value in Avro format
  * @param buffer Buffer where the encoded value is stored
@@ -35,7 +35,7 @@ uint64_t maxavro_encode_integer(uint8_t* buffer, uint64_t val)
     uint64_t encval = encode_long(val);
     uint8_t nbytes = 0;
 
-    while (more_bytes(encval))
+    while (encval > 0x7f)
     {
         buffer[nbytes++] = 0x80 | (0x7f & encval);
         encval >>= 7;
@@ -62,10 +62,25 @@ bool maxavro_write_integer(FILE *file, uint64_t val)
  */
 uint64_t maxavro_encode_string(uint8_t* dest, const char* str)
 {
-    uint64_t slen = strlen(str);
-    uint64_t ilen = maxavro_encode_integer(dest, slen);
-    memcpy(dest, str, slen);
-    return slen + ilen;
+    return maxavro_encode_bytes(dest, str, strlen(str));
+}
+
+/**
+ * @brief Encode bytes in Avro format
+ *
+ * Strings are encoded the same way as bytes, so this can also be used to
+ * encode strings that are not null-terminated.
+ *
+ * @param dest Destination buffer where the bytes are stored
+ * @param data Data to store
+ * @param len Length of @c data
+ * @return number of bytes stored
+ */
+uint64_t maxavro_encode_bytes(uint8_t* dest, const void* data, size_t len)
+{
+    uint64_t ilen = maxavro_encode_integer(dest, len);
+    memcpy(dest + ilen, data, len);
+    return len + ilen;
 }
 
 bool maxavro_write_string(FILE *file, const char* str)
@@ -119,12 +134,12 @@ uint64_t avro_map_encode(uint8_t *dest, MAXAVRO_MAP* map)
 
     while (map)
     {
-        len += maxavro_encode_string(dest, map->key);
-        len += maxavro_encode_string(dest, map->value);
+        len += maxavro_encode_string(dest + len, map->key);
+        len += maxavro_encode_string(dest + len, map->value);
         map = map->next;
     }
 
     /** Maps end with an empty block i.e. a zero integer value */
-    len += maxavro_encode_integer(dest, 0);
+    len += maxavro_encode_integer(dest + len, 0);
     return len;
 }
@@ -23,12 +23,150 @@
 #include <errno.h>
 #include <limits.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <skygw_debug.h>
 
 static int verbose = 0;
 static uint64_t seekto = 0;
 static int64_t num_rows = -1;
 static bool dump = false;
+static int threads = 1;
+
+/** The blocks one thread validates */
+typedef struct
+{
+    const char *filename;
+    const MAXAVRO_BLOCK_INFO *blocks; /*< The blocks of the file */
+    size_t first; /*< First block to validate */
+    size_t last; /*< One past the last block to validate */
+    bool ok; /*< Whether all the blocks were valid */
+} SCAN_RANGE;
+
+/**
+ * @brief Validate a range of data blocks
+ *
+ * Each thread opens the file on its own and decodes all records of its blocks.
+ *
+ * @param data The SCAN_RANGE to validate
+ * @return Always NULL
+ */
+static void* scan_blocks(void *data)
+{
+    SCAN_RANGE *range = data;
+    MAXAVRO_FILE *file = maxavro_file_open(range->filename);
+    MAXAVRO_JSONBUF text = {0};
+
+    range->ok = file != NULL;
+
+    for (size_t i = range->first; range->ok && i < range->last; i++)
+    {
+        const MAXAVRO_BLOCK_INFO *block = &range->blocks[i];
+
+        if (!maxavro_index_goto_block(file, block))
+        {
+            printf("Failed to read the data block at offset %ld.\n", block->pos);
+            range->ok = false;
+            break;
+        }
+
+        while (maxavro_record_read_text(file, &text, NULL))
+        {
+            text.len = 0;
+        }
+
+        if (file->records_read_from_block != block->records ||
+            maxavro_get_error(file) != MAXAVRO_ERR_NONE)
+        {
+            printf("Failed to read record %lu of the data block at offset %ld.\n",
+                   file->records_read_from_block, block->pos);
+            range->ok = false;
+        }
+        else if (file->codec == MAXAVRO_CODEC_NULL &&
+                 ftell(file->file) != file->data_start_pos + (long)block->size)
+        {
+            printf("The records of the data block at offset %ld do not fill the block.\n",
+                   block->pos);
+            range->ok = false;
+        }
+    }
+
+    maxavro_jsonbuf_free(&text);
+    maxavro_file_close(file);
+    return NULL;
+}
+
+/**
+ * @brief Validate a file with multiple threads
+ *
+ * The blocks are first indexed which checks the sync marker of each block.
+ * The blocks are then split into ranges which are decoded in parallel.
+ *
+ * @param file The opened file
+ * @param filename Name of the file
+ * @return 0 if the file is valid
+ */
+static int check_file_parallel(MAXAVRO_FILE *file, const char* filename)
+{
+    if (!maxavro_index_update(file))
+    {
+        printf("Failed to index the data blocks of %s.\n", filename);
+        return 1;
+    }
+
+    MAXAVRO_BLOCK_INDEX *index = &file->index;
+    size_t n_threads = (size_t)threads < index->num_blocks ? (size_t)threads : index->num_blocks;
+    SCAN_RANGE ranges[n_threads + 1];
+    pthread_t tids[n_threads + 1];
+    size_t started = 0;
+    int rval = 0;
+
+    for (size_t i = 0; i < n_threads; i++)
+    {
+        ranges[i].filename = filename;
+        ranges[i].blocks = index->blocks;
+        ranges[i].first = index->num_blocks * i / n_threads;
+        ranges[i].last = index->num_blocks * (i + 1) / n_threads;
+        ranges[i].ok = false;
+
+        if (pthread_create(&tids[i], NULL, scan_blocks, &ranges[i]) != 0)
+        {
+            printf("Failed to start a thread: %d, %s\n", errno, strerror(errno));
+            rval = 1;
+            break;
+        }
+        started++;
+    }
+
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(tids[i], NULL);
+
+        if (!ranges[i].ok)
+        {
+            rval = 1;
+        }
+    }
+
+    struct stat st;
+    long end = index->num_blocks ? index->end_pos : file->header_end_pos;
+
+    if (rval == 0 && stat(filename, &st) == 0 && st.st_size > end)
+    {
+        printf("Found %ld bytes after the last complete data block.\n", st.st_size - end);
+        rval = 1;
+    }
+
+    if (rval == 0)
+    {
+        MAXAVRO_BLOCK_INFO *last = index->num_blocks ? &index->blocks[index->num_blocks - 1] : NULL;
+        printf("%s: %lu blocks, %lu records and %lu bytes\n", filename, index->num_blocks,
+               last ? last->first_record + last->records : 0,
+               last ? last->bytes_before + last->size : 0);
+    }
+
+    return rval;
+}
 
 int check_file(const char* filename)
 {
@@ -40,6 +178,7 @@ int check_file(const char* filename)
     }
 
     int rval = 0;
+    MAXAVRO_JSONBUF text = {0};
 
     if (!dump)
     {
@@ -51,6 +190,13 @@ int check_file(const char* filename)
         printf("\n");
     }
 
+    if (threads > 1 && !dump && verbose == 0 && seekto == 0)
+    {
+        rval = check_file_parallel(file, filename);
+        maxavro_file_close(file);
+        return rval;
+    }
+
     /** After the header come the data blocks. Each data block has the number of records
      * in this block and the size of the compressed block encoded as Avro long values
      * followed by the actual data. Each data block ends with an identical, 16 byte sync marker
@@ -65,23 +211,14 @@ int check_file(const char* filename)
 
         if (verbose > 1 || dump)
         {
-            json_t* row;
-            while (num_rows != 0 && (row = maxavro_record_read_json(file)))
+            while (num_rows != 0 && maxavro_record_read_text(file, &text, NULL))
             {
-                char *json = json_dumps(row, JSON_PRESERVE_ORDER);
-                if (json)
-                {
-                    printf("%s\n", json);
-                    json_decref(row);
-                    if (num_rows > 0)
-                    {
-                        num_rows--;
-                    }
-                }
-                else
+                fwrite(text.data, 1, text.len, stdout);
+                text.len = 0;
+
+                if (num_rows > 0)
                 {
-                    printf("Failed to read JSON value.\n");
-                    return 1;
+                    num_rows--;
                 }
             }
         }
@@ -107,7 +244,7 @@ int check_file(const char* filename)
                file->blocks_read, file->records_read, file->bytes_read);
     }
 
-
+    maxavro_jsonbuf_free(&text);
     maxavro_file_close(file);
     return rval;
 }
@@ -118,6 +255,7 @@ static struct option long_options[] =
     {"dump",  no_argument, 0, 'd'},
     {"from",  no_argument, 0, 'f'},
     {"count", no_argument, 0, 'c'},
+    {"threads", required_argument, 0, 'j'},
     {0, 0, 0, 0}
 };
 
@@ -133,7 +271,7 @@ int main(int argc, char** argv)
     char c;
     int option_index;
 
-    while ((c = getopt_long(argc, argv, "vdf:c:", long_options, &option_index)) >= 0)
+    while ((c = getopt_long(argc, argv, "vdf:c:j:", long_options, &option_index)) >= 0)
     {
         switch (c)
         {
@@ -149,6 +287,9 @@ int main(int argc, char** argv)
             case 'c':
                 num_rows = strtol(optarg, NULL, 10);
                 break;
+            case 'j':
+                threads = strtol(optarg, NULL, 10);
+                break;
         }
     }
 
@@ -44,3 +44,4 @@
   check_include_files(sys/un.h HAVE_SYS_UN)
   check_include_files(time.h HAVE_TIME)
   check_include_files(unistd.h HAVE_UNISTD)
+  check_include_files(linux/io_uring.h HAVE_LINUX_IO_URING)
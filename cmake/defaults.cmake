@@ -53,3 +53,15 @@ set(WITH_TCMALLOC FALSE CACHE BOOL "Use tcmalloc as the memory allocator")
 
 # Use jemalloc as the memory allocator
 set(WITH_JEMALLOC FALSE CACHE BOOL "Use jemalloc as the memory allocator")
+
+# Allocate buffers from per-thread pools
+set(WITH_BUFFER_POOL TRUE CACHE BOOL "Allocate buffers from per-thread buffer pools")
+
+# Directory of the baselines the perfcheck target compares the benchmarks to
+set(PERFCHECK_BASELINES "${CMAKE_SOURCE_DIR}/server/core/test/perf" CACHE PATH "Directory of the perfcheck baselines")
+
+# Growth of the mean time of a benchmark that perfcheck tolerates, in percent
+set(PERFCHECK_TOLERANCE 5 CACHE STRING "Tolerated growth of the perfcheck benchmarks in percent")
+
+# Module directory of an installed MaxScale, enables the routing benchmarks of perfcheck
+set(PERFCHECK_MODULES "" CACHE PATH "Module directory of an installed MaxScale for perfcheck")
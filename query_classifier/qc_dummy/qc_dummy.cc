@@ -14,7 +14,7 @@
 #include <modules.h>
 #include <query_classifier.h>
 
-qc_parse_result_t qc_parse(GWBUF* querybuf)
+qc_parse_result_t qc_parse(GWBUF* querybuf, uint32_t collect)
 {
     return QC_QUERY_INVALID;
 }
@@ -61,6 +61,12 @@ char** qc_get_database_names(GWBUF* querybuf, int* size)
     return NULL;
 }
 
+QC_FIELD_VALUE* qc_get_field_values(GWBUF* querybuf, int* size)
+{
+    *size = 0;
+    return NULL;
+}
+
 qc_query_op_t qc_get_operation(GWBUF* querybuf)
 {
     return QUERY_OP_UNDEFINED;
@@ -127,6 +133,7 @@ extern "C"
         qc_query_has_clause,
         qc_get_affected_fields,
         qc_get_database_names,
+        qc_get_field_values,
     };
 
     QUERY_CLASSIFIER* GetModuleObject()
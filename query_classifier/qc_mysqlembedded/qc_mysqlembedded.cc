@@ -124,7 +124,7 @@ bool ensure_query_is_parsed(GWBUF* query)
     return parsed;
 }
 
-qc_parse_result_t qc_parse(GWBUF* querybuf)
+qc_parse_result_t qc_parse(GWBUF* querybuf, uint32_t collect)
 {
     bool parsed = ensure_query_is_parsed(querybuf);
 
@@ -1981,6 +1981,197 @@ retblock:
     return databases;
 }
 
+/**
+ * Appends a value to an array of field values.
+ *
+ * @param values   The array, reallocated as needed.
+ * @param n        The number of values, updated.
+ * @param capacity The capacity of the array, updated.
+ * @param table    The table qualifying the column, may be NULL.
+ * @param column   The column.
+ * @param value    The value.
+ * @param len      The length of the value.
+ *
+ * @return True, if the value could be added.
+ */
+static bool add_field_value(QC_FIELD_VALUE** values, int* n, int* capacity,
+                            const char* table, const char* column,
+                            const char* value, size_t len)
+{
+    if (*n == *capacity)
+    {
+        int new_capacity = *capacity ? *capacity * 2 : 4;
+        QC_FIELD_VALUE* tmp = (QC_FIELD_VALUE*) realloc(*values, new_capacity * sizeof(QC_FIELD_VALUE));
+
+        if (tmp == NULL)
+        {
+            MXS_ERROR("Memory allocation failed.");
+            return false;
+        }
+
+        *values = tmp;
+        *capacity = new_capacity;
+    }
+
+    QC_FIELD_VALUE* field_value = &(*values)[*n];
+
+    field_value->table = (table && *table) ? strdup(table) : NULL;
+    field_value->column = strdup(column);
+    field_value->value = strndup(value, len);
+    ++(*n);
+
+    return true;
+}
+
+/**
+ * Returns whether an item is a literal whose value can be reported.
+ *
+ * @param item An item.
+ *
+ * @return True, if the item is a number or a string.
+ */
+static bool is_field_value(Item* item)
+{
+    return item->basic_const_item() && (item->type() != Item::NULL_ITEM);
+}
+
+/**
+ * Adds the value of a literal to an array of field values.
+ *
+ * @see add_field_value
+ */
+static bool add_item_value(QC_FIELD_VALUE** values, int* n, int* capacity,
+                           Item_field* field_item, Item* value_item)
+{
+    String buffer;
+    String* str = value_item->val_str(&buffer);
+
+    return str && add_field_value(values, n, capacity,
+                                  field_item->table_name, field_item->field_name,
+                                  str->ptr(), str->length());
+}
+
+/**
+ * Collects the values of the columns that are restricted by a WHERE clause.
+ * Only the "column = value" and "column IN (value, ...)" conditions that are
+ * combined with AND at the top level of the clause are considered.
+ *
+ * @see add_field_value
+ */
+static void collect_field_values(Item* item, QC_FIELD_VALUE** values, int* n, int* capacity)
+{
+    if (item->type() == Item::COND_ITEM)
+    {
+        Item_cond* cond_item = static_cast<Item_cond*>(item);
+
+        if (cond_item->functype() == Item_func::COND_AND_FUNC)
+        {
+            List_iterator<Item> ilist(*cond_item->argument_list());
+
+            for (item = (Item*) ilist.next(); item != NULL; item = (Item*) ilist.next())
+            {
+                collect_field_values(item, values, n, capacity);
+            }
+        }
+    }
+    else if (item->type() == Item::FUNC_ITEM)
+    {
+        Item_func* func_item = static_cast<Item_func*>(item);
+        Item** items = func_item->arguments();
+        size_t n_items = func_item->argument_count();
+
+        switch (func_item->functype())
+        {
+        case Item_func::EQ_FUNC:
+            if (n_items == 2)
+            {
+                if ((items[0]->type() == Item::FIELD_ITEM) && is_field_value(items[1]))
+                {
+                    add_item_value(values, n, capacity, static_cast<Item_field*>(items[0]), items[1]);
+                }
+                else if ((items[1]->type() == Item::FIELD_ITEM) && is_field_value(items[0]))
+                {
+                    add_item_value(values, n, capacity, static_cast<Item_field*>(items[1]), items[0]);
+                }
+            }
+            break;
+
+        case Item_func::IN_FUNC:
+            if ((n_items > 1) && (items[0]->type() == Item::FIELD_ITEM))
+            {
+                size_t i = 1;
+
+                while ((i < n_items) && is_field_value(items[i]))
+                {
+                    ++i;
+                }
+
+                // Unless all values are literals, the column can have any value.
+                if (i == n_items)
+                {
+                    for (i = 1; i < n_items; ++i)
+                    {
+                        add_item_value(values, n, capacity, static_cast<Item_field*>(items[0]), items[i]);
+                    }
+                }
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+/**
+ * Returns the literal values of the columns of a statement.
+ *
+ * @see qc_get_field_values in query_classifier.c
+ */
+QC_FIELD_VALUE* qc_get_field_values(GWBUF* querybuf, int* size)
+{
+    LEX* lex;
+    QC_FIELD_VALUE* values = NULL;
+    int n = 0;
+    int capacity = 0;
+
+    if (querybuf && ensure_query_is_parsed(querybuf) && ((lex = get_lex(querybuf)) != NULL))
+    {
+        if ((lex->sql_command == SQLCOM_INSERT) || (lex->sql_command == SQLCOM_REPLACE))
+        {
+            // "INSERT ... VALUES (...), (...)" and "INSERT ... SET col = value, ..."
+            List_iterator<List_item> rows(lex->many_values);
+            List_item* row;
+
+            while ((row = rows++) != NULL)
+            {
+                if (row->elements == lex->field_list.elements)
+                {
+                    List_iterator<Item> fields(lex->field_list);
+                    List_iterator<Item> row_values(*row);
+                    Item* field;
+                    Item* value;
+
+                    while (((field = fields++) != NULL) && ((value = row_values++) != NULL))
+                    {
+                        if ((field->type() == Item::FIELD_ITEM) && is_field_value(value))
+                        {
+                            add_item_value(&values, &n, &capacity, static_cast<Item_field*>(field), value);
+                        }
+                    }
+                }
+            }
+        }
+        else if (lex->select_lex.where && !lex->select_lex.next_select())
+        {
+            collect_field_values(lex->select_lex.where, &values, &n, &capacity);
+        }
+    }
+
+    *size = n;
+    return values;
+}
+
 qc_query_op_t qc_get_operation(GWBUF* querybuf)
 {
     qc_query_op_t operation = QUERY_OP_UNDEFINED;
@@ -2228,6 +2419,7 @@ static QUERY_CLASSIFIER qc =
     qc_query_has_clause,
     qc_get_affected_fields,
     qc_get_database_names,
+    qc_get_field_values,
 };
 
  /* @see function load_module in load_utils.c for explanation of the following
@@ -13,6 +13,7 @@
 
 #include <sqliteInt.h>
 
+#include <ctype.h>
 #include <signal.h>
 #include <string.h>
 #include <log_manager.h>
@@ -22,6 +23,7 @@
 #include <query_classifier.h>
 #include <skygw_utils.h>
 #include <modutil.h>
+#include <memusage.h>
 #include "builtin_functions.h"
 
 //#define QC_TRACE_ENABLED
@@ -54,6 +56,7 @@ static inline bool qc_info_was_parsed(qc_parse_result_t status)
 typedef struct qc_sqlite_info
 {
     qc_parse_result_t status;        // The validity of the information in this structure.
+    uint32_t collect;                // What information should be collected.
     const char* query;               // The query passed to sqlite.
     size_t query_len;                // The length of the query.
 
@@ -75,11 +78,36 @@ typedef struct qc_sqlite_info
     char** database_names;           // Array of database names used in the query.
     size_t database_names_len;       // The used entries in database_names.
     size_t database_names_capacity;  // The capacity of database_names.
+    QC_FIELD_VALUE* field_values;    // The literal values of fields.
+    size_t field_values_len;         // The used entries in field_values.
+    size_t field_values_capacity;    // The capacity of field_values.
     int keyword_1;                   // The first encountered keyword.
     int keyword_2;                   // The second encountered keyword.
     bool initializing;               // Whether we are initializing sqlite3.
+    char* data;                      // The block holding the collected names and values,
+                                     // when it was not allocated together with the info.
+    size_t data_size;                // The size of data.
+    size_t block_size;               // The size of the block allocated together with the info.
 } QC_SQLITE_INFO;
 
+/**
+ * A block of the arena of a thread. What is collected from a statement is
+ * allocated from the arena while the statement is parsed. Nothing is freed
+ * individually, the arena is reset once the statement has been parsed and
+ * the information has been copied to a single block of memory.
+ */
+typedef struct qc_sqlite_arena_block
+{
+    struct qc_sqlite_arena_block* next; // The previously used block.
+    size_t size;                        // The size of data.
+    size_t used;                        // The used bytes of data.
+    char data[];                        // The memory handed out.
+} QC_SQLITE_ARENA_BLOCK;
+
+#define QC_SQLITE_ARENA_BLOCK_SIZE 4096       // The starting size of the arena.
+#define QC_SQLITE_ARENA_MAX_SIZE   (64 * 1024) // The largest arena kept between statements.
+#define QC_SQLITE_ARENA_ALIGN(n)   (((n) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
 typedef enum qc_log_level
 {
     QC_LOG_NOTHING = 0,
@@ -106,6 +134,9 @@ static thread_local struct
     bool initialized;
     sqlite3* db;      // Thread specific database handle.
     QC_SQLITE_INFO* info;
+    QC_SQLITE_ARENA_BLOCK* arena;              // The newest block of the arena.
+    uint64_t n_fast_path;                      // Statements classified without sqlite3.
+    uint64_t n_status[QC_QUERY_PARSED + 1];    // Statements given to sqlite3, by result.
 } this_thread;
 
 
@@ -166,6 +197,131 @@ static char* mxs_strdup(const char* s1)
     return s2;
 }
 
+/**
+ * Allocates memory from the arena of the thread.
+ *
+ * @param size The size of the memory.
+ *
+ * @return The memory, valid until the arena is reset.
+ */
+static void* arena_alloc(size_t size)
+{
+    QC_SQLITE_ARENA_BLOCK* block = this_thread.arena;
+
+    size = QC_SQLITE_ARENA_ALIGN(size);
+
+    if (!block || (block->size - block->used < size))
+    {
+        size_t block_size = size > QC_SQLITE_ARENA_BLOCK_SIZE ? size : QC_SQLITE_ARENA_BLOCK_SIZE;
+
+        block = (QC_SQLITE_ARENA_BLOCK*) mxs_malloc(sizeof(*block) + block_size);
+        block->next = this_thread.arena;
+        block->size = block_size;
+        block->used = 0;
+        this_thread.arena = block;
+    }
+
+    void* p = block->data + block->used;
+    block->used += size;
+
+    return p;
+}
+
+/**
+ * Enlarges memory allocated from the arena. The last allocation is enlarged
+ * in place if the block has room for it.
+ *
+ * @param p        Memory from arena_alloc or NULL.
+ * @param old_size The size p was allocated with.
+ * @param size     The new size.
+ *
+ * @return The memory, with the contents of p.
+ */
+static void* arena_realloc(void* p, size_t old_size, size_t size)
+{
+    QC_SQLITE_ARENA_BLOCK* block = this_thread.arena;
+
+    if (p && block && ((char*) p + QC_SQLITE_ARENA_ALIGN(old_size) == block->data + block->used))
+    {
+        size_t offset = (char*) p - block->data;
+
+        if (offset + size <= block->size)
+        {
+            block->used = offset + QC_SQLITE_ARENA_ALIGN(size);
+            return p;
+        }
+    }
+
+    void* q = arena_alloc(size);
+
+    if (p)
+    {
+        memcpy(q, p, old_size);
+    }
+
+    return q;
+}
+
+static char* arena_strdup(const char* s)
+{
+    size_t len = strlen(s) + 1;
+    char* z = (char*) arena_alloc(len);
+
+    memcpy(z, s, len);
+
+    return z;
+}
+
+/**
+ * Resets the arena of the thread. If the last statement needed more than one
+ * block, the blocks are replaced with one that is large enough.
+ */
+static void arena_reset()
+{
+    QC_SQLITE_ARENA_BLOCK* block = this_thread.arena;
+
+    if (block && (block->next || (block->size > QC_SQLITE_ARENA_MAX_SIZE)))
+    {
+        size_t total = 0;
+
+        while (block)
+        {
+            QC_SQLITE_ARENA_BLOCK* next = block->next;
+            total += block->size;
+            free(block);
+            block = next;
+        }
+
+        this_thread.arena = NULL;
+
+        if (total <= QC_SQLITE_ARENA_MAX_SIZE)
+        {
+            arena_alloc(total);
+        }
+
+        block = this_thread.arena;
+    }
+
+    if (block)
+    {
+        block->used = 0;
+    }
+}
+
+static void arena_free()
+{
+    QC_SQLITE_ARENA_BLOCK* block = this_thread.arena;
+
+    while (block)
+    {
+        QC_SQLITE_ARENA_BLOCK* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    this_thread.arena = NULL;
+}
+
 
 /**
  * HELPERS
@@ -179,18 +335,25 @@ typedef enum qc_token_position
 } qc_token_position_t;
 
 static void append_affected_field(QC_SQLITE_INFO* info, const char* s);
+static void append_field_value(QC_SQLITE_INFO* info,
+                               const char* zTable,
+                               const char* zColumn,
+                               char* zValue);
 static void buffer_object_free(void* data);
 static char** copy_string_array(char** strings, int* pn);
 static void enlarge_string_array(size_t n, size_t len, char*** ppzStrings, size_t* pCapacity);
-static bool ensure_query_is_parsed(GWBUF* query);
-static void free_string_array(char** sa);
-static QC_SQLITE_INFO* get_query_info(GWBUF* query);
-static QC_SQLITE_INFO* info_alloc(void);
+static bool ensure_query_is_parsed(GWBUF* query, uint32_t collect);
+static bool get_field_name(const Expr* pExpr, const char** pzTable, const char** pzColumn);
+static char* get_field_value(const Expr* pExpr);
+static QC_SQLITE_INFO* get_query_info(GWBUF* query, uint32_t collect);
 static void info_finish(QC_SQLITE_INFO* info);
 static void info_free(QC_SQLITE_INFO* info);
-static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info);
+static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info, uint32_t collect);
+static QC_SQLITE_INFO* info_intern(const QC_SQLITE_INFO* info, QC_SQLITE_INFO* target);
 static void log_invalid_data(GWBUF* query, const char* message);
-static bool parse_query(GWBUF* query);
+static bool parse_query(GWBUF* query, uint32_t collect);
+static void parse_query_into(GWBUF* query, QC_SQLITE_INFO* info);
+static bool parse_query_fast(QC_SQLITE_INFO* info, const char* query, size_t len);
 static void parse_query_string(const char* query, size_t len);
 static bool query_is_parsed(GWBUF* query);
 static bool should_exclude(const char* zName, const ExprList* pExclude);
@@ -206,6 +369,10 @@ static void update_affected_fields_from_idlist(QC_SQLITE_INFO* info,
 static void update_affected_fields_from_select(QC_SQLITE_INFO* info,
                                                const Select* pSelect, const ExprList* pExclude);
 static void update_database_names(QC_SQLITE_INFO* info, const char* name);
+static void update_field_values(QC_SQLITE_INFO* info, const Expr* pExpr);
+static void update_field_values_from_insert(QC_SQLITE_INFO* info,
+                                            const Select* pSelect,
+                                            const IdList* pColumns);
 static void update_names(QC_SQLITE_INFO* info, const char* zDatabase, const char* zTable);
 static void update_names_from_srclist(QC_SQLITE_INFO* info, const SrcList* pSrc);
 
@@ -282,44 +449,50 @@ static void enlarge_string_array(size_t n, size_t len, char*** ppzStrings, size_
     {
         int capacity = *pCapacity ? *pCapacity * 2 : 4;
 
-        *ppzStrings = (char**) mxs_realloc(*ppzStrings, capacity * sizeof(char**));
+        *ppzStrings = (char**) arena_realloc(*ppzStrings, *pCapacity * sizeof(char**),
+                                             capacity * sizeof(char**));
         *pCapacity = capacity;
     }
 }
 
-static bool ensure_query_is_parsed(GWBUF* query)
+static bool ensure_query_is_parsed(GWBUF* query, uint32_t collect)
 {
     bool parsed = query_is_parsed(query);
 
-    if (!parsed)
+    if (parsed)
     {
-        parsed = parse_query(query);
-    }
+        QC_SQLITE_INFO* info = (QC_SQLITE_INFO*) gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO);
+        ss_dassert(info);
 
-    return parsed;
-}
+        if (info && ((~info->collect & collect) != 0))
+        {
+            // The statement has been parsed, but what is now asked for was not
+            // collected at that point. So we parse it again, collecting both.
+            QC_SQLITE_INFO collected;
 
-static void free_string_array(char** sa)
-{
-    if (sa)
-    {
-        char** s = sa;
+            collect |= info->collect;
 
-        while (*s)
-        {
-            free(*s);
-            ++s;
-        }
+            info_init(&collected, collect);
+            parse_query_into(query, &collected);
 
-        free(sa);
+            info_finish(info);
+            info_intern(&collected, info);
+            arena_reset();
+        }
     }
+    else
+    {
+        parsed = parse_query(query, collect);
+    }
+
+    return parsed;
 }
 
-static QC_SQLITE_INFO* get_query_info(GWBUF* query)
+static QC_SQLITE_INFO* get_query_info(GWBUF* query, uint32_t collect)
 {
     QC_SQLITE_INFO* info = NULL;
 
-    if (ensure_query_is_parsed(query))
+    if (ensure_query_is_parsed(query, collect))
     {
         info = (QC_SQLITE_INFO*) gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO);
         ss_dassert(info);
@@ -328,22 +501,12 @@ static QC_SQLITE_INFO* get_query_info(GWBUF* query)
     return info;
 }
 
-static QC_SQLITE_INFO* info_alloc(void)
-{
-    QC_SQLITE_INFO* info = mxs_malloc(sizeof(*info));
-
-    info_init(info);
-
-    return info;
-}
-
 static void info_finish(QC_SQLITE_INFO* info)
 {
-    free(info->affected_fields);
-    free_string_array(info->table_names);
-    free_string_array(info->table_fullnames);
-    free(info->created_table_name);
-    free_string_array(info->database_names);
+    memusage_add(MEMUSAGE_QC, -(int64_t)info->data_size, 0);
+    free(info->data);
+    info->data = NULL;
+    info->data_size = 0;
 }
 
 static void info_free(QC_SQLITE_INFO* info)
@@ -351,15 +514,17 @@ static void info_free(QC_SQLITE_INFO* info)
     if (info)
     {
         info_finish(info);
+        memusage_free(MEMUSAGE_QC, sizeof(*info) + info->block_size);
         free(info);
     }
 }
 
-static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info)
+static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info, uint32_t collect)
 {
     memset(info, 0, sizeof(*info));
 
     info->status = QC_QUERY_INVALID;
+    info->collect = collect;
 
     info->types = QUERY_TYPE_UNKNOWN;
     info->operation = QUERY_OP_UNDEFINED;
@@ -379,13 +544,164 @@ static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info)
     info->database_names = NULL;
     info->database_names_len = 0;
     info->database_names_capacity = 0;
+    info->field_values = NULL;
+    info->field_values_len = 0;
+    info->field_values_capacity = 0;
     info->keyword_1 = 0; // Sqlite3 starts numbering tokens from 1, so 0 means
     info->keyword_2 = 0; // that we have not seen a keyword.
     info->initializing = false;
+    info->data = NULL;
 
     return info;
 }
 
+static size_t string_array_size(char** strings, size_t n, size_t* pArrays)
+{
+    size_t size = 0;
+
+    if (strings)
+    {
+        *pArrays += (n + 1) * sizeof(char*);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            size += strlen(strings[i]) + 1;
+        }
+    }
+
+    return size;
+}
+
+static char* intern_string(const char* s, char** pzNext)
+{
+    char* z = NULL;
+
+    if (s)
+    {
+        size_t len = strlen(s) + 1;
+
+        z = *pzNext;
+        memcpy(z, s, len);
+        *pzNext += len;
+    }
+
+    return z;
+}
+
+static char** intern_string_array(char** strings, size_t n, char*** ppNext, char** pzNext)
+{
+    char** ss = NULL;
+
+    if (strings)
+    {
+        ss = *ppNext;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            ss[i] = intern_string(strings[i], pzNext);
+        }
+
+        ss[n] = NULL;
+        *ppNext += n + 1;
+    }
+
+    return ss;
+}
+
+/**
+ * Copies the information collected into the arena to a single block of memory.
+ * The arrays come first in the block and the strings after them.
+ *
+ * @param info   An info object whose names and values are in the arena.
+ * @param target The info object to copy to. If NULL, the info object is
+ *               allocated together with the block.
+ *
+ * @return The info object copied to.
+ */
+static QC_SQLITE_INFO* info_intern(const QC_SQLITE_INFO* info, QC_SQLITE_INFO* target)
+{
+    size_t arrays = info->field_values_len * sizeof(QC_FIELD_VALUE);
+    size_t size = string_array_size(info->table_names, info->table_names_len, &arrays) +
+        string_array_size(info->table_fullnames, info->table_fullnames_len, &arrays) +
+        string_array_size(info->database_names, info->database_names_len, &arrays);
+
+    if (info->affected_fields)
+    {
+        size += info->affected_fields_len + 1;
+    }
+
+    if (info->created_table_name)
+    {
+        size += strlen(info->created_table_name) + 1;
+    }
+
+    for (size_t i = 0; i < info->field_values_len; ++i)
+    {
+        const QC_FIELD_VALUE* value = &info->field_values[i];
+
+        size += (value->table ? strlen(value->table) + 1 : 0) +
+            strlen(value->column) + 1 + strlen(value->value) + 1;
+    }
+
+    char* block;
+
+    size += arrays;
+
+    if (target)
+    {
+        // The block allocated together with the target stays allocated.
+        size_t block_size = target->block_size;
+
+        *target = *info;
+        block = size ? mxs_malloc(size) : NULL;
+        target->data = block;
+        target->data_size = block ? size : 0;
+        target->block_size = block_size;
+        memusage_add(MEMUSAGE_QC, target->data_size, 0);
+    }
+    else
+    {
+        target = (QC_SQLITE_INFO*) mxs_malloc(sizeof(*target) + size);
+        *target = *info;
+        block = (char*) (target + 1);
+        target->data = NULL;
+        target->data_size = 0;
+        target->block_size = size;
+        memusage_alloc(MEMUSAGE_QC, sizeof(*target) + size);
+    }
+
+    QC_FIELD_VALUE* values = (QC_FIELD_VALUE*) block;
+    char** ppNext = (char**) (values + info->field_values_len);
+    char* data = block + arrays;
+
+    target->table_names = intern_string_array(info->table_names, info->table_names_len,
+                                              &ppNext, &data);
+    target->table_fullnames = intern_string_array(info->table_fullnames, info->table_fullnames_len,
+                                                  &ppNext, &data);
+    target->database_names = intern_string_array(info->database_names, info->database_names_len,
+                                                 &ppNext, &data);
+
+    for (size_t i = 0; i < info->field_values_len; ++i)
+    {
+        values[i].table = intern_string(info->field_values[i].table, &data);
+        values[i].column = intern_string(info->field_values[i].column, &data);
+        values[i].value = intern_string(info->field_values[i].value, &data);
+    }
+
+    target->field_values = info->field_values ? values : NULL;
+    target->affected_fields = intern_string(info->affected_fields, &data);
+    target->created_table_name = intern_string(info->created_table_name, &data);
+
+    // Nothing is added once the statement has been parsed.
+    target->affected_fields_capacity = target->affected_fields ? target->affected_fields_len + 1 : 0;
+    target->table_names_capacity = target->table_names_len;
+    target->table_fullnames_capacity = target->table_fullnames_len;
+    target->database_names_capacity = target->database_names_len;
+    target->field_values_capacity = target->field_values_len;
+
+    return target;
+}
+
 static void parse_query_string(const char* query, size_t len)
 {
     sqlite3_stmt* stmt = NULL;
@@ -450,77 +766,622 @@ static void parse_query_string(const char* query, size_t len)
                 break;
             }
 
-            if (log_warning)
-            {
-                MXS_WARNING(format, sqlite3_errstr(rc), sqlite3_errmsg(this_thread.db), l, query, suffix);
-            }
-        }
+            if (log_warning)
+            {
+                MXS_WARNING(format, sqlite3_errstr(rc), sqlite3_errmsg(this_thread.db), l, query, suffix);
+            }
+        }
+    }
+    else
+    {
+        if (qc_info_was_tokenized(this_thread.info->status))
+        {
+            // This suggests a callback from the parser into this module is not made.
+            format =
+                "qc_sqlite: Statement was classified only based on keywords, "
+                "even though the statement was parsed: \"%.*s%s\"";
+
+            MXS_WARNING(format, l, query, suffix);
+        }
+        else if (!qc_info_was_parsed(this_thread.info->status))
+        {
+            // This suggests there are keywords that should be recognized but are not,
+            // a tentative classification cannot be (or is not) made using the keywords
+            // seen and/or a callback from the parser into this module is not made.
+            format = "qc_sqlite: Statement was parsed, but not classified: \"%.*s%s\"";
+
+            MXS_ERROR(format, l, query, suffix);
+        }
+    }
+
+    if (stmt)
+    {
+        sqlite3_finalize(stmt);
+    }
+}
+
+/**
+ * The token types recognized by the fast path tokenizer.
+ */
+typedef enum qc_fast_token_type
+{
+    QC_FAST_END,     // End of the statement.
+    QC_FAST_WORD,    // A keyword or an unquoted identifier.
+    QC_FAST_INTEGER, // An unsigned integer literal.
+    QC_FAST_STRING,  // A single-quoted string literal without escapes.
+    QC_FAST_PARAM,   // A '?' placeholder.
+    QC_FAST_VAR,     // A system variable, @@name.
+    QC_FAST_CHAR,    // One of the characters in QC_FAST_CHARS.
+    QC_FAST_ERROR    // Anything else; the fast path gives up.
+} qc_fast_token_type_t;
+
+#define QC_FAST_CHARS      "=,.*"
+#define QC_FAST_MAX_NAME   64 // Longer identifiers are left to sqlite3.
+#define QC_FAST_MAX_FIELDS 16 // Longer select lists are left to sqlite3.
+
+typedef struct qc_fast_token
+{
+    qc_fast_token_type_t type;
+    const char* z;   // Start of the token.
+    size_t n;        // Length of the token.
+} QC_FAST_TOKEN;
+
+typedef struct qc_fast_scanner
+{
+    const char* z;   // The current position.
+    const char* end; // The end of the statement.
+} QC_FAST_SCANNER;
+
+static inline bool qc_fast_is_name_char(char c)
+{
+    return isalnum((unsigned char)c) || (c == '_');
+}
+
+/**
+ * Returns the next token of a statement. Comments, quoted identifiers,
+ * escapes and anything else the fast path does not handle are returned
+ * as QC_FAST_ERROR, so that the statement is given to sqlite3.
+ *
+ * @param scanner The scanner.
+ * @param token   On return, the token.
+ */
+static void qc_fast_next(QC_FAST_SCANNER* scanner, QC_FAST_TOKEN* token)
+{
+    const char* z = scanner->z;
+    const char* end = scanner->end;
+
+    while ((z < end) && isspace((unsigned char)*z))
+    {
+        ++z;
+    }
+
+    if ((z < end) && (*z == ';'))
+    {
+        // A terminating ';' is fine, but nothing may follow it.
+        ++z;
+
+        while ((z < end) && isspace((unsigned char)*z))
+        {
+            ++z;
+        }
+
+        token->type = (z == end) ? QC_FAST_END : QC_FAST_ERROR;
+        token->z = z;
+        token->n = 0;
+        scanner->z = end;
+        return;
+    }
+
+    token->z = z;
+
+    if (z == end)
+    {
+        token->type = QC_FAST_END;
+    }
+    else if (isdigit((unsigned char)*z))
+    {
+        while ((z < end) && isdigit((unsigned char)*z))
+        {
+            ++z;
+        }
+
+        token->type = ((z < end) && qc_fast_is_name_char(*z)) ? QC_FAST_ERROR : QC_FAST_INTEGER;
+    }
+    else if (isalpha((unsigned char)*z) || (*z == '_'))
+    {
+        while ((z < end) && qc_fast_is_name_char(*z))
+        {
+            ++z;
+        }
+
+        token->type = QC_FAST_WORD;
+    }
+    else if ((*z == '@') && (z + 2 < end) && (z[1] == '@') && isalpha((unsigned char)z[2]))
+    {
+        z += 2;
+
+        while ((z < end) && qc_fast_is_name_char(*z))
+        {
+            ++z;
+        }
+
+        token->type = QC_FAST_VAR;
+    }
+    else if (*z == '\'')
+    {
+        ++z;
+
+        while ((z < end) && (*z != '\'') && (*z != '\\'))
+        {
+            ++z;
+        }
+
+        if ((z < end) && (*z == '\'') && ((z + 1 == end) || (z[1] != '\'')))
+        {
+            ++z;
+            token->type = QC_FAST_STRING;
+        }
+        else
+        {
+            token->type = QC_FAST_ERROR;
+        }
+    }
+    else if (*z == '?')
+    {
+        ++z;
+        token->type = QC_FAST_PARAM;
+    }
+    else if (strchr(QC_FAST_CHARS, *z))
+    {
+        ++z;
+        token->type = QC_FAST_CHAR;
+    }
+    else
+    {
+        token->type = QC_FAST_ERROR;
+    }
+
+    token->n = z - token->z;
+    scanner->z = z;
+}
+
+static inline bool qc_fast_is_char(const QC_FAST_TOKEN* token, char c)
+{
+    return (token->type == QC_FAST_CHAR) && (*token->z == c);
+}
+
+static inline bool qc_fast_is_word(const QC_FAST_TOKEN* token, const char* word)
+{
+    return (token->type == QC_FAST_WORD) &&
+           (strlen(word) == token->n) &&
+           (strncasecmp(token->z, word, token->n) == 0);
+}
+
+static inline bool qc_fast_at_end(QC_FAST_SCANNER* scanner)
+{
+    QC_FAST_TOKEN token;
+    qc_fast_next(scanner, &token);
+
+    return token.type == QC_FAST_END;
+}
+
+/**
+ * Copies a word token into a buffer, provided it is a name that sqlite3 would
+ * treat as a plain identifier.
+ *
+ * @param token  The token.
+ * @param buffer Buffer of at least QC_FAST_MAX_NAME + 1 bytes.
+ *
+ * @return True, if the token is a plain identifier.
+ */
+static bool qc_fast_get_name(const QC_FAST_TOKEN* token, char* buffer)
+{
+    bool rv = false;
+
+    if ((token->type == QC_FAST_WORD) && (token->n <= QC_FAST_MAX_NAME))
+    {
+        memcpy(buffer, token->z, token->n);
+        buffer[token->n] = 0;
+
+        // Keywords may be interpreted by the grammar and "true" and "false" are
+        // treated specially when collecting the affected fields.
+        rv = (sqlite3_test_control(SQLITE_TESTCTRL_ISKEYWORD, buffer) == 0) &&
+             (strcasecmp(buffer, "true") != 0) &&
+             (strcasecmp(buffer, "false") != 0);
+    }
+
+    return rv;
+}
+
+/**
+ * Classifies "SET [@@]autocommit = {0|1}".
+ */
+static bool parse_query_fast_set(QC_SQLITE_INFO* info, QC_FAST_SCANNER* scanner)
+{
+    QC_FAST_TOKEN token;
+    qc_fast_next(scanner, &token);
+
+    const char* zName = token.z;
+    size_t nName = token.n;
+
+    if (token.type == QC_FAST_VAR)
+    {
+        zName += 2;
+        nName -= 2;
+    }
+    else if (token.type != QC_FAST_WORD)
+    {
+        return false;
+    }
+
+    if ((nName != 10) || (strncasecmp(zName, "autocommit", nName) != 0))
+    {
+        return false;
+    }
+
+    qc_fast_next(scanner, &token);
+
+    if (!qc_fast_is_char(&token, '='))
+    {
+        return false;
+    }
+
+    qc_fast_next(scanner, &token);
+
+    if ((token.type != QC_FAST_INTEGER) || (token.n != 1) || ((*token.z != '0') && (*token.z != '1')))
+    {
+        return false;
+    }
+
+    bool enable = (*token.z == '1');
+
+    if (!qc_fast_at_end(scanner))
+    {
+        return false;
+    }
+
+    // As in maxscaleSet().
+    info->types = QUERY_TYPE_GSYSVAR_WRITE;
+
+    if (enable)
+    {
+        info->types |= (QUERY_TYPE_ENABLE_AUTOCOMMIT | QUERY_TYPE_COMMIT);
+    }
+    else
+    {
+        info->types |= (QUERY_TYPE_BEGIN_TRX | QUERY_TYPE_DISABLE_AUTOCOMMIT);
+    }
+
+    return true;
+}
+
+/**
+ * Classifies "SELECT <integers>" and
+ * "SELECT {*|<columns>} FROM [db.]tbl [WHERE column = <literal>]".
+ */
+static bool parse_query_fast_select(QC_SQLITE_INFO* info, QC_FAST_SCANNER* scanner)
+{
+    QC_FAST_TOKEN fields[QC_FAST_MAX_FIELDS];
+    int n_fields = 0;
+    bool has_names = false;
+    QC_FAST_TOKEN token;
+
+    // The select list.
+    do
+    {
+        if (n_fields == QC_FAST_MAX_FIELDS)
+        {
+            return false;
+        }
+
+        qc_fast_next(scanner, &fields[n_fields]);
+
+        QC_FAST_TOKEN* field = &fields[n_fields];
+
+        if ((field->type == QC_FAST_WORD) && !qc_fast_is_word(field, "FROM"))
+        {
+            char name[QC_FAST_MAX_NAME + 1];
+
+            if (!qc_fast_get_name(field, name))
+            {
+                return false;
+            }
+
+            has_names = true;
+        }
+        else if (qc_fast_is_char(field, '*'))
+        {
+            // "SELECT *" is fine, but "*" combined with something else is not.
+            if (n_fields != 0)
+            {
+                return false;
+            }
+
+            has_names = true;
+        }
+        else if (field->type != QC_FAST_INTEGER)
+        {
+            return false;
+        }
+
+        ++n_fields;
+        qc_fast_next(scanner, &token);
+    }
+    while (qc_fast_is_char(&token, ',') && !qc_fast_is_char(&fields[0], '*'));
+
+    char database[QC_FAST_MAX_NAME + 1];
+    char table[QC_FAST_MAX_NAME + 1];
+    bool has_database = false;
+    bool has_table = false;
+    char where[QC_FAST_MAX_NAME + 1];
+    QC_FAST_TOKEN where_value = { QC_FAST_END, NULL, 0 };
+    bool has_where = false;
+
+    if (qc_fast_is_word(&token, "FROM"))
+    {
+        qc_fast_next(scanner, &token);
+
+        if (!qc_fast_get_name(&token, table))
+        {
+            return false;
+        }
+
+        has_table = true;
+
+        qc_fast_next(scanner, &token);
+
+        if (qc_fast_is_char(&token, '.'))
+        {
+            strcpy(database, table);
+            has_database = true;
+
+            qc_fast_next(scanner, &token);
+
+            if (!qc_fast_get_name(&token, table))
+            {
+                return false;
+            }
+
+            qc_fast_next(scanner, &token);
+        }
+
+        if (qc_fast_is_word(&token, "WHERE"))
+        {
+            qc_fast_next(scanner, &token);
+
+            if (!qc_fast_get_name(&token, where))
+            {
+                return false;
+            }
+
+            qc_fast_next(scanner, &token);
+
+            if (!qc_fast_is_char(&token, '='))
+            {
+                return false;
+            }
+
+            qc_fast_next(scanner, &token);
+
+            if ((token.type != QC_FAST_INTEGER) &&
+                (token.type != QC_FAST_STRING) &&
+                (token.type != QC_FAST_PARAM))
+            {
+                return false;
+            }
+
+            where_value = token;
+            has_where = true;
+            qc_fast_next(scanner, &token);
+        }
+    }
+    else if (has_names)
+    {
+        // Columns without a table are left to sqlite3.
+        return false;
+    }
+
+    if (token.type != QC_FAST_END)
+    {
+        return false;
+    }
+
+    // The information collected is the same, and in the same order, as what
+    // mxs_sqlite3Select() and update_affected_fields_from_select() produce.
+    info->types = QUERY_TYPE_READ;
+    info->operation = QUERY_OP_SELECT;
+
+    if (has_table)
+    {
+        update_names(info, has_database ? database : NULL, table);
+        info->is_real_query = true;
+    }
+
+    bool exclude_where = false;
+
+    for (int i = 0; i < n_fields; ++i)
+    {
+        const QC_FAST_TOKEN* field = &fields[i];
+
+        if (qc_fast_is_char(field, '*'))
+        {
+            append_affected_field(info, "*");
+        }
+        else if (field->type == QC_FAST_WORD)
+        {
+            char name[QC_FAST_MAX_NAME + 1];
+            memcpy(name, field->z, field->n);
+            name[field->n] = 0;
+
+            append_affected_field(info, name);
+
+            if (has_where && (strcasecmp(name, where) == 0))
+            {
+                exclude_where = true;
+            }
+        }
+    }
+
+    if (has_where)
+    {
+        info->has_clause = true;
+
+        if (!exclude_where)
+        {
+            append_affected_field(info, where);
+        }
+
+        if (where_value.type != QC_FAST_PARAM)
+        {
+            // The fast path strings have no escapes, only the quotes are removed.
+            bool is_string = (where_value.type == QC_FAST_STRING);
+            size_t n = is_string ? where_value.n - 2 : where_value.n;
+            char value[n + 1];
+            memcpy(value, is_string ? where_value.z + 1 : where_value.z, n);
+            value[n] = 0;
+
+            append_field_value(info, NULL, where, value);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Attempts to classify a statement without involving sqlite3. Only statements
+ * of a few trivial and very frequent shapes are recognized, and for those the
+ * information is made identical to what the full parse would produce. The
+ * tokenizer does not allocate memory; any allocations are for the results.
+ *
+ * @param info  The info object to fill in.
+ * @param query The statement.
+ * @param len   The length of the statement.
+ *
+ * @return True, if the statement was classified. If false is returned,
+ *         @c info has not been modified.
+ */
+static bool parse_query_fast(QC_SQLITE_INFO* info, const char* query, size_t len)
+{
+    bool classified = false;
+    QC_FAST_SCANNER scanner = { query, query + len };
+    QC_FAST_TOKEN token;
+
+    qc_fast_next(&scanner, &token);
+
+    if (qc_fast_is_word(&token, "SELECT"))
+    {
+        classified = parse_query_fast_select(info, &scanner);
     }
-    else
+    else if (qc_fast_is_word(&token, "BEGIN") ||
+             qc_fast_is_word(&token, "COMMIT") ||
+             qc_fast_is_word(&token, "ROLLBACK"))
     {
-        if (qc_info_was_tokenized(this_thread.info->status))
+        uint32_t types = qc_fast_is_word(&token, "BEGIN") ? QUERY_TYPE_BEGIN_TRX :
+                         qc_fast_is_word(&token, "COMMIT") ? QUERY_TYPE_COMMIT :
+                         QUERY_TYPE_ROLLBACK;
+
+        qc_fast_next(&scanner, &token);
+
+        if (qc_fast_is_word(&token, "TRANSACTION"))
         {
-            // This suggests a callback from the parser into this module is not made.
-            format =
-                "qc_sqlite: Statement was classified only based on keywords, "
-                "even though the statement was parsed: \"%.*s%s\"";
+            qc_fast_next(&scanner, &token);
+        }
 
-            MXS_WARNING(format, l, query, suffix);
+        if (token.type == QC_FAST_END)
+        {
+            info->types = types;
+            classified = true;
         }
-        else if (!qc_info_was_parsed(this_thread.info->status))
+    }
+    else if (qc_fast_is_word(&token, "START"))
+    {
+        qc_fast_next(&scanner, &token);
+
+        if (qc_fast_is_word(&token, "TRANSACTION") && qc_fast_at_end(&scanner))
         {
-            // This suggests there are keywords that should be recognized but are not,
-            // a tentative classification cannot be (or is not) made using the keywords
-            // seen and/or a callback from the parser into this module is not made.
-            format = "qc_sqlite: Statement was parsed, but not classified: \"%.*s%s\"";
+            info->types = QUERY_TYPE_BEGIN_TRX;
+            classified = true;
+        }
+    }
+    else if (qc_fast_is_word(&token, "SET"))
+    {
+        classified = parse_query_fast_set(info, &scanner);
+    }
+    else if (qc_fast_is_word(&token, "USE"))
+    {
+        char name[QC_FAST_MAX_NAME + 1];
 
-            MXS_ERROR(format, l, query, suffix);
+        qc_fast_next(&scanner, &token);
+
+        if (qc_fast_get_name(&token, name) && qc_fast_at_end(&scanner))
+        {
+            info->types = QUERY_TYPE_SESSION_WRITE;
+            info->operation = QUERY_OP_CHANGE_DB;
+            classified = true;
         }
     }
 
-    if (stmt)
+    if (classified)
     {
-        sqlite3_finalize(stmt);
+        info->status = QC_QUERY_PARSED;
+    }
+    else
+    {
+        // A partially recognized SELECT may have left something behind.
+        ss_dassert(info->affected_fields_len == 0 && info->table_names_len == 0);
     }
+
+    return classified;
 }
 
-static bool parse_query(GWBUF* query)
+static void parse_query_into(GWBUF* query, QC_SQLITE_INFO* info)
 {
-    bool parsed = false;
-    ss_dassert(!query_is_parsed(query));
-
-    QC_SQLITE_INFO* info = info_alloc();
+    this_thread.info = info;
 
-    if (info)
-    {
-        this_thread.info = info;
+    // TODO: Somewhere it needs to be ensured that this buffer is contiguous.
+    // TODO: Where is it checked that the GWBUF really contains a query?
+    uint8_t* data = (uint8_t*) GWBUF_DATA(query);
+    size_t len = MYSQL_GET_PACKET_LEN(data) - 1; // Subtract 1 for packet type byte.
 
-        // TODO: Somewhere it needs to be ensured that this buffer is contiguous.
-        // TODO: Where is it checked that the GWBUF really contains a query?
-        uint8_t* data = (uint8_t*) GWBUF_DATA(query);
-        size_t len = MYSQL_GET_PACKET_LEN(data) - 1; // Subtract 1 for packet type byte.
-
-        const char* s = (const char*) &data[5]; // TODO: Are there symbolic constants somewhere?
+    const char* s = (const char*) &data[5]; // TODO: Are there symbolic constants somewhere?
 
+    if (parse_query_fast(info, s, len))
+    {
+        ++this_thread.n_fast_path;
+    }
+    else
+    {
         this_thread.info->query = s;
         this_thread.info->query_len = len;
         parse_query_string(s, len);
         this_thread.info->query = NULL;
         this_thread.info->query_len = 0;
 
-        // TODO: Add return value to gwbuf_add_buffer_object.
-        // Always added; also when it was not recognized. If it was not recognized now,
-        // it won't be if we try a second time.
-        gwbuf_add_buffer_object(query, GWBUF_PARSING_INFO, info, buffer_object_free);
-        parsed = true;
-
-        this_thread.info = NULL;
-    }
-    else
-    {
-        MXS_ERROR("qc_sqlite: Could not allocate structure for containing parse data.");
+        ++this_thread.n_status[this_thread.info->status];
     }
 
+    this_thread.info = NULL;
+}
+
+static bool parse_query(GWBUF* query, uint32_t collect)
+{
+    bool parsed = false;
+    ss_dassert(!query_is_parsed(query));
+
+    QC_SQLITE_INFO collected;
+
+    info_init(&collected, collect);
+    parse_query_into(query, &collected);
+
+    QC_SQLITE_INFO* info = info_intern(&collected, NULL);
+    arena_reset();
+
+    // TODO: Add return value to gwbuf_add_buffer_object.
+    // Always added; also when it was not recognized. If it was not recognized now,
+    // it won't be if we try a second time.
+    gwbuf_add_buffer_object(query, GWBUF_PARSING_INFO, info, buffer_object_free);
+    parsed = true;
+
     return parsed;
 }
 
@@ -558,6 +1419,11 @@ static void log_invalid_data(GWBUF* query, const char* message)
 
 static void append_affected_field(QC_SQLITE_INFO* info, const char* s)
 {
+    if ((info->collect & QC_COLLECT_FIELDS) == 0)
+    {
+        return;
+    }
+
     size_t len = strlen(s);
     size_t required_len = info->affected_fields_len + len + 1; // 1 for NULL
 
@@ -568,6 +1434,8 @@ static void append_affected_field(QC_SQLITE_INFO* info, const char* s)
 
     if (required_len > info->affected_fields_capacity)
     {
+        size_t old_capacity = info->affected_fields_capacity;
+
         if (info->affected_fields_capacity == 0)
         {
             info->affected_fields_capacity = 32;
@@ -578,7 +1446,8 @@ static void append_affected_field(QC_SQLITE_INFO* info, const char* s)
             info->affected_fields_capacity *= 2;
         }
 
-        info->affected_fields = mxs_realloc(info->affected_fields, info->affected_fields_capacity);
+        info->affected_fields = arena_realloc(info->affected_fields, old_capacity,
+                                              info->affected_fields_capacity);
     }
 
     if (info->affected_fields_len != 0)
@@ -591,6 +1460,131 @@ static void append_affected_field(QC_SQLITE_INFO* info, const char* s)
     info->affected_fields_len += len;
 }
 
+static void append_field_value(QC_SQLITE_INFO* info,
+                               const char* zTable,
+                               const char* zColumn,
+                               char* zValue)
+{
+    if ((info->collect & QC_COLLECT_FIELD_VALUES) == 0)
+    {
+        return;
+    }
+
+    if (info->field_values_len == info->field_values_capacity)
+    {
+        size_t old_capacity = info->field_values_capacity;
+
+        info->field_values_capacity = info->field_values_capacity ? 2 * info->field_values_capacity : 4;
+        info->field_values = arena_realloc(info->field_values,
+                                           old_capacity * sizeof(QC_FIELD_VALUE),
+                                           info->field_values_capacity * sizeof(QC_FIELD_VALUE));
+    }
+
+    QC_FIELD_VALUE* value = &info->field_values[info->field_values_len++];
+
+    value->table = zTable ? arena_strdup(zTable) : NULL;
+    value->column = arena_strdup(zColumn);
+    value->value = zValue;
+}
+
+/**
+ * Returns the name of the column an expression refers to.
+ *
+ * @param pExpr    An expression.
+ * @param pzTable  On return, the table qualifying the column or NULL.
+ * @param pzColumn On return, the column.
+ *
+ * @return True, if the expression is a plain column reference.
+ */
+static bool get_field_name(const Expr* pExpr, const char** pzTable, const char** pzColumn)
+{
+    bool rv = false;
+
+    if ((pExpr->op == TK_ID) && !ExprHasProperty(pExpr, EP_DblQuoted))
+    {
+        *pzTable = NULL;
+        *pzColumn = pExpr->u.zToken;
+        rv = true;
+    }
+    else if ((pExpr->op == TK_DOT) && (pExpr->pLeft->op == TK_ID))
+    {
+        const Expr* pRight = pExpr->pRight;
+
+        // "X.Y" is DOT(X, Y) and "X.Y.Z" is DOT(X, DOT(Y, Z)).
+        if (pRight->op == TK_ID)
+        {
+            *pzTable = pExpr->pLeft->u.zToken;
+            *pzColumn = pRight->u.zToken;
+            rv = true;
+        }
+        else if ((pRight->op == TK_DOT) &&
+                 (pRight->pLeft->op == TK_ID) &&
+                 (pRight->pRight->op == TK_ID))
+        {
+            *pzTable = pRight->pLeft->u.zToken;
+            *pzColumn = pRight->pRight->u.zToken;
+            rv = true;
+        }
+    }
+
+    return rv;
+}
+
+/**
+ * Returns the value of a literal expression.
+ *
+ * @param pExpr An expression.
+ *
+ * @return The value of an integer, float or string literal, or NULL if the
+ *         expression is something else. The value is in the arena.
+ */
+static char* get_field_value(const Expr* pExpr)
+{
+    char* zValue = NULL;
+
+    switch (pExpr->op)
+    {
+    case TK_INTEGER:
+        if (ExprHasProperty(pExpr, EP_IntValue))
+        {
+            char buffer[32];
+            sprintf(buffer, "%d", pExpr->u.iValue);
+            zValue = arena_strdup(buffer);
+        }
+        else
+        {
+            zValue = arena_strdup(pExpr->u.zToken);
+        }
+        break;
+
+    case TK_ID:
+        // In MySQL, "..." is a string and not an identifier.
+        if (!ExprHasProperty(pExpr, EP_DblQuoted))
+        {
+            break;
+        }
+        // Fallthrough intended.
+    case TK_FLOAT:
+    case TK_STRING:
+        zValue = arena_strdup(pExpr->u.zToken);
+        break;
+
+    case TK_UMINUS:
+        if ((pExpr->pLeft->op == TK_INTEGER) || (pExpr->pLeft->op == TK_FLOAT))
+        {
+            char* zOperand = get_field_value(pExpr->pLeft);
+            zValue = arena_alloc(strlen(zOperand) + 2);
+            sprintf(zValue, "-%s", zOperand);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return zValue;
+}
+
 static bool should_exclude(const char* zName, const ExprList* pExclude)
 {
     int i;
@@ -845,7 +1839,7 @@ static void update_affected_fields_from_select(QC_SQLITE_INFO* info,
 
 static void update_database_names(QC_SQLITE_INFO* info, const char* zDatabase)
 {
-    char* zCopy = mxs_strdup(zDatabase);
+    char* zCopy = arena_strdup(zDatabase);
     exposed_sqlite3Dequote(zCopy);
 
     enlarge_string_array(1, info->database_names_len,
@@ -854,36 +1848,150 @@ static void update_database_names(QC_SQLITE_INFO* info, const char* zDatabase)
     info->database_names[info->database_names_len] = NULL;
 }
 
-static void update_names(QC_SQLITE_INFO* info, const char* zDatabase, const char* zTable)
+/**
+ * Collects the values of the columns that are restricted by a WHERE clause.
+ * Only the "column = value" and "column IN (value, ...)" conditions that are
+ * combined with AND at the top level of the clause are considered.
+ *
+ * @param info  The info object.
+ * @param pExpr The WHERE clause, or a part of it.
+ */
+static void update_field_values(QC_SQLITE_INFO* info, const Expr* pExpr)
 {
-    char* zCopy = mxs_strdup(zTable);
-    // TODO: Is this call really needed. Check also sqlite3Dequote.
-    exposed_sqlite3Dequote(zCopy);
+    const char* zTable;
+    const char* zColumn;
+
+    switch (pExpr->op)
+    {
+    case TK_AND:
+        update_field_values(info, pExpr->pLeft);
+        update_field_values(info, pExpr->pRight);
+        break;
+
+    case TK_EQ:
+        {
+            const Expr* pValue = pExpr->pRight;
+
+            if (!get_field_name(pExpr->pLeft, &zTable, &zColumn))
+            {
+                // "value = column"
+                pValue = pExpr->pLeft;
+
+                if (!get_field_name(pExpr->pRight, &zTable, &zColumn))
+                {
+                    break;
+                }
+            }
+
+            char* zValue = get_field_value(pValue);
+
+            if (zValue)
+            {
+                append_field_value(info, zTable, zColumn, zValue);
+            }
+        }
+        break;
+
+    case TK_IN:
+        if (!ExprHasProperty(pExpr, EP_xIsSelect) && pExpr->x.pList &&
+            get_field_name(pExpr->pLeft, &zTable, &zColumn))
+        {
+            const ExprList* pList = pExpr->x.pList;
+            int n = pList->nExpr;
+            char* azValues[n];
+            int i = 0;
+
+            while ((i < n) && ((azValues[i] = get_field_value(pList->a[i].pExpr)) != NULL))
+            {
+                ++i;
+            }
+
+            // Unless all values are literals, the column can have any value.
+            bool all_literals = (i == n);
+
+            for (int j = 0; all_literals && (j < i); ++j)
+            {
+                append_field_value(info, zTable, zColumn, azValues[j]);
+            }
+        }
+        break;
 
-    enlarge_string_array(1, info->table_names_len, &info->table_names, &info->table_names_capacity);
-    info->table_names[info->table_names_len++] = zCopy;
-    info->table_names[info->table_names_len] = NULL;
+    default:
+        break;
+    }
+}
 
-    if (zDatabase)
+/**
+ * Collects the values of the columns of the rows of an INSERT. The values
+ * are known only if the columns are listed explicitly.
+ *
+ * @param info     The info object.
+ * @param pSelect  The VALUES of the INSERT.
+ * @param pColumns The columns of the INSERT.
+ */
+static void update_field_values_from_insert(QC_SQLITE_INFO* info,
+                                            const Select* pSelect,
+                                            const IdList* pColumns)
+{
+    // With several rows, each row is a select of its own and they are
+    // linked from the last to the first.
+    for (const Select* pRow = pSelect; pRow; pRow = pRow->pPrior)
     {
-        zCopy = mxs_malloc(strlen(zDatabase) + 1 + strlen(zTable) + 1);
+        const ExprList* pEList = pRow->pEList;
 
-        strcpy(zCopy, zDatabase);
-        strcat(zCopy, ".");
-        strcat(zCopy, zTable);
-        exposed_sqlite3Dequote(zCopy);
+        if (((pRow->selFlags & SF_Values) == 0) || !pEList || (pEList->nExpr != pColumns->nId))
+        {
+            break;
+        }
 
-        update_database_names(info, zDatabase);
+        for (int i = 0; i < pEList->nExpr; ++i)
+        {
+            char* zValue = get_field_value(pEList->a[i].pExpr);
+
+            if (zValue)
+            {
+                append_field_value(info, NULL, pColumns->a[i].zName, zValue);
+            }
+        }
     }
-    else
+}
+
+static void update_names(QC_SQLITE_INFO* info, const char* zDatabase, const char* zTable)
+{
+    if (info->collect & QC_COLLECT_TABLES)
     {
-        zCopy = mxs_strdup(zCopy);
+        char* zCopy = arena_strdup(zTable);
+        // TODO: Is this call really needed. Check also sqlite3Dequote.
+        exposed_sqlite3Dequote(zCopy);
+
+        enlarge_string_array(1, info->table_names_len, &info->table_names, &info->table_names_capacity);
+        info->table_names[info->table_names_len++] = zCopy;
+        info->table_names[info->table_names_len] = NULL;
+
+        if (zDatabase)
+        {
+            zCopy = arena_alloc(strlen(zDatabase) + 1 + strlen(zTable) + 1);
+
+            strcpy(zCopy, zDatabase);
+            strcat(zCopy, ".");
+            strcat(zCopy, zTable);
+            exposed_sqlite3Dequote(zCopy);
+        }
+        else
+        {
+            zCopy = arena_strdup(zCopy);
+        }
+
+        enlarge_string_array(1, info->table_fullnames_len,
+                             &info->table_fullnames, &info->table_fullnames_capacity);
+        info->table_fullnames[info->table_fullnames_len++] = zCopy;
+        info->table_fullnames[info->table_fullnames_len] = NULL;
     }
 
-    enlarge_string_array(1, info->table_fullnames_len,
-                         &info->table_fullnames, &info->table_fullnames_capacity);
-    info->table_fullnames[info->table_fullnames_len++] = zCopy;
-    info->table_fullnames[info->table_fullnames_len] = NULL;
+    if ((info->collect & QC_COLLECT_DATABASES) && zDatabase)
+    {
+        update_database_names(info, zDatabase);
+    }
 }
 
 static void update_names_from_srclist(QC_SQLITE_INFO* info, const SrcList* pSrc)
@@ -1151,6 +2259,7 @@ void mxs_sqlite3DeleteFrom(Parse* pParse, SrcList* pTabList, Expr* pWhere, SrcLi
     if (pWhere)
     {
         update_affected_fields(info, 0, pWhere, QC_TOKEN_MIDDLE, 0);
+        update_field_values(info, pWhere);
     }
 
     exposed_sqlite3ExprDelete(pParse->db, pWhere);
@@ -1266,11 +2375,22 @@ void mxs_sqlite3Insert(Parse* pParse,
     if (pSelect)
     {
         update_affected_fields_from_select(info, pSelect, NULL);
+
+        if (pColumns)
+        {
+            update_field_values_from_insert(info, pSelect, pColumns);
+        }
     }
 
     if (pSet)
     {
         update_affected_fields_from_exprlist(info, pSet, NULL);
+
+        // "INSERT INTO t SET a = 1, b = 2"
+        for (int i = 0; i < pSet->nExpr; ++i)
+        {
+            update_field_values(info, pSet->a[i].pExpr);
+        }
     }
 
     exposed_sqlite3SrcListDelete(pParse->db, pTabList);
@@ -1304,6 +2424,11 @@ int mxs_sqlite3Select(Parse* pParse, Select* p, SelectDest* pDest)
         info->operation = QUERY_OP_SELECT;
 
         maxscaleCollectInfoFromSelect(pParse, p);
+
+        if (p->pWhere && !p->pPrior)
+        {
+            update_field_values(info, p->pWhere);
+        }
         // NOTE: By convention, the select is deleted in parse.y.
     }
     else
@@ -1362,7 +2487,9 @@ void mxs_sqlite3StartTable(Parse *pParse,   /* Parser context */
             update_names(info, NULL, name);
         }
 
-        info->created_table_name = mxs_strdup(info->table_names[0]);
+        // The name is needed also when the table names are not collected.
+        info->created_table_name = arena_strdup(name);
+        exposed_sqlite3Dequote(info->created_table_name);
     }
     else
     {
@@ -1402,6 +2529,7 @@ void mxs_sqlite3Update(Parse* pParse, SrcList* pTabList, ExprList* pChanges, Exp
     if (pWhere)
     {
         update_affected_fields(info, 0, pWhere, QC_TOKEN_MIDDLE, NULL);
+        update_field_values(info, pWhere);
     }
 
     exposed_sqlite3SrcListDelete(pParse->db, pTabList);
@@ -2340,7 +3468,7 @@ static bool qc_sqlite_init(const char* args);
 static void qc_sqlite_end(void);
 static bool qc_sqlite_thread_init(void);
 static void qc_sqlite_thread_end(void);
-static qc_parse_result_t qc_sqlite_parse(GWBUF* query);
+static qc_parse_result_t qc_sqlite_parse(GWBUF* query, uint32_t collect);
 static uint32_t qc_sqlite_get_type(GWBUF* query);
 static qc_query_op_t qc_sqlite_get_operation(GWBUF* query);
 static char* qc_sqlite_get_created_table_name(GWBUF* query);
@@ -2351,6 +3479,7 @@ static char* qc_sqlite_get_canonical(GWBUF* query);
 static bool qc_sqlite_query_has_clause(GWBUF* query);
 static char* qc_sqlite_get_affected_fields(GWBUF* query);
 static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep);
+static QC_FIELD_VALUE* qc_sqlite_get_field_values(GWBUF* query, int* sizep);
 
 static bool get_key_and_value(char* arg, const char** pkey, const char** pvalue)
 {
@@ -2488,35 +3617,32 @@ static bool qc_sqlite_thread_init(void)
         MXS_INFO("qc_sqlite: In-memory sqlite database successfully opened for thread %lu.",
                  (unsigned long) pthread_self());
 
-        QC_SQLITE_INFO* info = info_alloc();
+        QC_SQLITE_INFO info;
 
-        if (info)
-        {
-            this_thread.info = info;
+        info_init(&info, QC_COLLECT_ALL);
+        this_thread.info = &info;
+
+        // With this statement we cause sqlite3 to initialize itself, so that it
+        // is not done as part of the actual classification of data.
+        const char* s = "CREATE TABLE __maxscale__internal__ (int field UNIQUE)";
+        size_t len = strlen(s);
 
-            // With this statement we cause sqlite3 to initialize itself, so that it
-            // is not done as part of the actual classification of data.
-            const char* s = "CREATE TABLE __maxscale__internal__ (int field UNIQUE)";
-            size_t len = strlen(s);
+        this_thread.info->query = s;
+        this_thread.info->query_len = len;
+        this_thread.info->initializing = true;
+        parse_query_string(s, len);
+        this_thread.info->initializing = false;
+        this_thread.info->query = NULL;
+        this_thread.info->query_len = 0;
 
-            this_thread.info->query = s;
-            this_thread.info->query_len = len;
-            this_thread.info->initializing = true;
-            parse_query_string(s, len);
-            this_thread.info->initializing = false;
-            this_thread.info->query = NULL;
-            this_thread.info->query_len = 0;
+        this_thread.info = NULL;
+        arena_reset();
 
-            info_free(this_thread.info);
-            this_thread.info = NULL;
+        // From now on statements are only parsed, no VDBE program is generated
+        // for them as they are never executed.
+        this_thread.db->parseOnly = 1;
 
-            this_thread.initialized = true;
-        }
-        else
-        {
-            sqlite3_close(this_thread.db);
-            this_thread.db = NULL;
-        }
+        this_thread.initialized = true;
     }
     else
     {
@@ -2542,17 +3668,28 @@ static void qc_sqlite_thread_end(void)
                     rc, sqlite3_errstr(rc));
     }
 
+    MXS_INFO("qc_sqlite: Thread %lu classified %lu statements without parsing; of the parsed "
+             "ones %lu were parsed, %lu partially parsed, %lu tokenized and %lu not recognized.",
+             (unsigned long) pthread_self(),
+             (unsigned long) this_thread.n_fast_path,
+             (unsigned long) this_thread.n_status[QC_QUERY_PARSED],
+             (unsigned long) this_thread.n_status[QC_QUERY_PARTIALLY_PARSED],
+             (unsigned long) this_thread.n_status[QC_QUERY_TOKENIZED],
+             (unsigned long) this_thread.n_status[QC_QUERY_INVALID]);
+
+    arena_free();
+
     this_thread.db = NULL;
     this_thread.initialized = false;
 }
 
-static qc_parse_result_t qc_sqlite_parse(GWBUF* query)
+static qc_parse_result_t qc_sqlite_parse(GWBUF* query, uint32_t collect)
 {
     QC_TRACE();
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, collect);
 
     return info ? info->status : QC_QUERY_INVALID;
 }
@@ -2564,7 +3701,7 @@ static uint32_t qc_sqlite_get_type(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     uint32_t types = QUERY_TYPE_UNKNOWN;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2592,7 +3729,7 @@ static qc_query_op_t qc_sqlite_get_operation(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     qc_query_op_t op = QUERY_OP_UNDEFINED;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2620,7 +3757,7 @@ static char* qc_sqlite_get_created_table_name(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     char* created_table_name = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2651,7 +3788,7 @@ static bool qc_sqlite_is_drop_table_query(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool is_drop_table = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2679,7 +3816,7 @@ static bool qc_sqlite_is_real_query(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool is_real_query = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2707,7 +3844,7 @@ static char** qc_sqlite_get_table_names(GWBUF* query, int* tblsize, bool fullnam
     ss_dassert(this_thread.initialized);
 
     char** table_names = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_TABLES);
 
     if (info)
     {
@@ -2762,7 +3899,7 @@ static bool qc_sqlite_query_has_clause(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool has_clause = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2790,7 +3927,7 @@ static char* qc_sqlite_get_affected_fields(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     char* affected_fields = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_FIELDS);
 
     if (info)
     {
@@ -2823,7 +3960,7 @@ static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep)
     ss_dassert(this_thread.initialized);
 
     char** database_names = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_DATABASES);
 
     if (info)
     {
@@ -2847,6 +3984,51 @@ static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep)
     return database_names;
 }
 
+static QC_FIELD_VALUE* qc_sqlite_get_field_values(GWBUF* query, int* sizep)
+{
+    QC_TRACE();
+    ss_dassert(this_unit.initialized);
+    ss_dassert(this_thread.initialized);
+
+    QC_FIELD_VALUE* field_values = NULL;
+    *sizep = 0;
+
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_FIELD_VALUES);
+
+    if (info)
+    {
+        if (qc_info_is_valid(info->status))
+        {
+            if (info->field_values_len != 0)
+            {
+                size_t n = info->field_values_len;
+                field_values = (QC_FIELD_VALUE*) mxs_malloc(n * sizeof(QC_FIELD_VALUE));
+
+                for (size_t i = 0; i < n; ++i)
+                {
+                    const QC_FIELD_VALUE* value = &info->field_values[i];
+
+                    field_values[i].table = value->table ? mxs_strdup(value->table) : NULL;
+                    field_values[i].column = mxs_strdup(value->column);
+                    field_values[i].value = mxs_strdup(value->value);
+                }
+
+                *sizep = n;
+            }
+        }
+        else if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        {
+            log_invalid_data(query, "cannot report the values of the fields");
+        }
+    }
+    else
+    {
+        MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
+    }
+
+    return field_values;
+}
+
 /**
  * EXPORTS
  */
@@ -2870,6 +4052,7 @@ static QUERY_CLASSIFIER qc =
     qc_sqlite_query_has_clause,
     qc_sqlite_get_affected_fields,
     qc_sqlite_get_database_names,
+    qc_sqlite_get_field_values,
 };
 
 
@@ -139,6 +139,18 @@ void sqlite3FinishCoding(Parse *pParse){
     return;
   }
 
+#ifdef MAXSCALE
+  /* In parse-only mode the statement is never run, the information
+  ** is collected by the mxs_ callbacks invoked by the parser. So no
+  ** VDBE program is created. The statements run when the schema is
+  ** read are still coded.
+  */
+  if( db->parseOnly && db->init.busy==0 ){
+    pParse->rc = SQLITE_DONE;
+    return;
+  }
+#endif
+
   /* Begin by generating some termination code at the end of the
   ** vdbe program
   */
@@ -0,0 +1,566 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Measures the speed of the query classifiers. The statements of the given
+ * mysqltest files are classified with qc_parse, qc_get_type and
+ * qc_get_table_names, as a router would do it. The time and the number of
+ * allocations are reported per statement for each file and classifier.
+ *
+ * The results can be saved and later used as a baseline that a run must not
+ * be slower than, which makes it possible to catch regressions. With -j, the
+ * mean and the standard deviation of the time of each category are written
+ * in the form perfcompare of the core tests reads.
+ */
+
+#include <unistd.h>
+#include <time.h>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <gwdirs.h>
+#include <log_manager.h>
+#include <mysql_client_server_protocol.h>
+#include <query_classifier.h>
+#include "testreader.hh"
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::ifstream;
+using std::map;
+using std::ofstream;
+using std::string;
+using std::vector;
+
+#if defined(__GLIBC__)
+/**
+ * The allocations are counted by wrapping the allocation functions of the C
+ * library. As the classifiers are loaded into this process, their allocations
+ * come here as well, including those made with operator new.
+ */
+extern "C"
+{
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+static size_t n_allocations = 0;
+
+void* malloc(size_t size)
+{
+    ++n_allocations;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    ++n_allocations;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    ++n_allocations;
+    return __libc_realloc(ptr, size);
+}
+}
+#define ALLOCATIONS_COUNTED true
+#else
+static size_t n_allocations = 0;
+#define ALLOCATIONS_COUNTED false
+#endif
+
+namespace
+{
+
+char USAGE[] =
+    "usage: benchmark [-r rounds] [-c classifier]... [-s file] [-b file] [-p percent]\n"
+    "                 [-j file] file...\n\n"
+    "-r    classify each statement the specified number of times, default is 10\n"
+    "-c    a classifier to measure, can be given many times,\n"
+    "      default qc_mysqlembedded and qc_sqlite\n"
+    "-s    save the results to a file\n"
+    "-b    compare the results to a file saved earlier, fail if the time or the\n"
+    "      allocations of a statement have grown by more than the tolerance\n"
+    "-p    the tolerance in percent, default is 10\n"
+    "-j    write the times to a file as JSON\n\n"
+    "Each file is a category of its own, named after the file.\n";
+
+/**
+ * The measurements of one category of one classifier
+ */
+struct Result
+{
+    Result()
+        : n_statements(0)
+        , n_allocations(0)
+    {
+    }
+
+    size_t n_statements;    // Statements in the category.
+    size_t n_allocations;   // Allocations made when classifying them.
+    vector<long> times;     // Nanoseconds of each classification.
+
+    double ns_per_statement() const
+    {
+        long total = 0;
+
+        for (vector<long>::const_iterator i = times.begin(); i != times.end(); ++i)
+        {
+            total += *i;
+        }
+
+        return times.empty() ? 0 : (double)total / times.size();
+    }
+
+    double stddev() const
+    {
+        double mean = ns_per_statement();
+        double squares = 0;
+
+        for (vector<long>::const_iterator i = times.begin(); i != times.end(); ++i)
+        {
+            squares += (*i - mean) * (*i - mean);
+        }
+
+        return times.size() > 1 ? sqrt(squares / (times.size() - 1)) : 0;
+    }
+
+    double allocations_per_statement() const
+    {
+        return times.empty() ? 0 : (double)n_allocations / times.size();
+    }
+
+    long p99() const
+    {
+        vector<long> sorted(times);
+        std::sort(sorted.begin(), sorted.end());
+        return sorted.empty() ? 0 : sorted[(sorted.size() - 1) * 99 / 100];
+    }
+};
+
+/**
+ * The saved results of a classifier and category
+ */
+struct Baseline
+{
+    double ns;
+    double allocations;
+};
+
+typedef map<string, Baseline> BaselineMap;
+
+GWBUF* create_gwbuf(const string& s)
+{
+    size_t len = s.length() + 1;
+    GWBUF* gwbuf = gwbuf_alloc(MYSQL_HEADER_LEN + len);
+
+    if (gwbuf)
+    {
+        uint8_t* data = (uint8_t*)GWBUF_DATA(gwbuf);
+        gw_mysql_set_byte3(data, len);
+        data[3] = 0x00;
+        data[4] = MYSQL_COM_QUERY;
+        memcpy(data + 5, s.c_str(), s.length());
+    }
+
+    return gwbuf;
+}
+
+QUERY_CLASSIFIER* get_classifier(const char* zName)
+{
+    size_t len = strlen(zName);
+    char libdir[len + 4];
+
+    sprintf(libdir, "../%s", zName);
+    set_libdir(strdup(libdir));
+
+    QUERY_CLASSIFIER* pClassifier = qc_load(zName);
+
+    if (!pClassifier)
+    {
+        cerr << "error: Could not load classifier " << zName << "." << endl;
+    }
+    else if (!pClassifier->qc_init(NULL))
+    {
+        cerr << "error: Could not init classifier " << zName << "." << endl;
+        qc_unload(pClassifier);
+        pClassifier = NULL;
+    }
+
+    return pClassifier;
+}
+
+void put_classifier(QUERY_CLASSIFIER* pClassifier)
+{
+    pClassifier->qc_end();
+    qc_unload(pClassifier);
+}
+
+long ns_between(const timespec& start, const timespec& finish)
+{
+    return (finish.tv_sec - start.tv_sec) * 1000000000L + (finish.tv_nsec - start.tv_nsec);
+}
+
+/**
+ * Classify a statement as a router does
+ *
+ * @param pClassifier The classifier
+ * @param pStmt       The statement, the classification is stored in it
+ */
+void classify(QUERY_CLASSIFIER* pClassifier, GWBUF* pStmt)
+{
+    int n_tables = 0;
+
+    pClassifier->qc_parse(pStmt, QC_COLLECT_ALL);
+    pClassifier->qc_get_type(pStmt);
+
+    char** tables = pClassifier->qc_get_table_names(pStmt, &n_tables, true);
+
+    for (int i = 0; i < n_tables; ++i)
+    {
+        free(tables[i]);
+    }
+    free(tables);
+}
+
+/**
+ * Measure a category with a classifier. The statements are classified once
+ * before the measurement so that the caches of the classifier are warm.
+ *
+ * @param pClassifier The classifier
+ * @param statements  The statements of the category
+ * @param rounds      How many times each statement is classified
+ * @param result      The result
+ */
+void measure(QUERY_CLASSIFIER* pClassifier, const vector<string>& statements,
+             size_t rounds, Result* result)
+{
+    result->n_statements = statements.size();
+    result->times.reserve(statements.size() * rounds);
+
+    for (size_t round = 0; round <= rounds; ++round)
+    {
+        for (vector<string>::const_iterator i = statements.begin(); i != statements.end(); ++i)
+        {
+            GWBUF* pStmt = create_gwbuf(*i);
+            timespec start;
+            timespec finish;
+
+            size_t allocations = n_allocations;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            classify(pClassifier, pStmt);
+            clock_gettime(CLOCK_MONOTONIC, &finish);
+            allocations = n_allocations - allocations;
+
+            if (round > 0)
+            {
+                result->times.push_back(ns_between(start, finish));
+                result->n_allocations += allocations;
+            }
+
+            gwbuf_free(pStmt);
+        }
+    }
+}
+
+bool read_statements(const char* zFile, vector<string>* statements)
+{
+    ifstream in(zFile);
+
+    if (!in)
+    {
+        cerr << "error: Could not open " << zFile << "." << endl;
+        return false;
+    }
+
+    TestReader reader(in);
+    string stmt;
+    TestReader::result_t result;
+
+    while ((result = reader.get_statement(stmt)) == TestReader::RESULT_STMT)
+    {
+        statements->push_back(stmt);
+    }
+
+    return result == TestReader::RESULT_EOF;
+}
+
+string category_of(const string& file)
+{
+    string name = file.substr(file.find_last_of('/') + 1);
+    size_t dot = name.rfind(".test");
+
+    return dot == string::npos ? name : name.substr(0, dot);
+}
+
+bool read_baseline(const char* zFile, BaselineMap* baseline)
+{
+    ifstream in(zFile);
+
+    if (!in)
+    {
+        cerr << "error: Could not open " << zFile << "." << endl;
+        return false;
+    }
+
+    string line;
+
+    while (std::getline(in, line))
+    {
+        std::istringstream is(line);
+        string classifier;
+        string category;
+        Baseline base;
+        long p99;
+
+        if (is >> classifier >> category >> base.ns >> p99 >> base.allocations)
+        {
+            (*baseline)[classifier + " " + category] = base;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Check a result against the baseline
+ *
+ * @return True if the result is at most the tolerance worse than the baseline
+ */
+bool check(const BaselineMap& baseline, const string& key, const Result& result, double tolerance)
+{
+    BaselineMap::const_iterator i = baseline.find(key);
+    bool ok = true;
+
+    if (i != baseline.end())
+    {
+        double limit = 1 + tolerance / 100;
+
+        if (result.ns_per_statement() > i->second.ns * limit)
+        {
+            cout << "REGRESSION: " << key << ": " << std::fixed << std::setprecision(0)
+                 << result.ns_per_statement() << " ns/statement, was " << i->second.ns << endl;
+            ok = false;
+        }
+
+        if (result.allocations_per_statement() > i->second.allocations * limit + 0.5)
+        {
+            cout << "REGRESSION: " << key << ": " << std::fixed << std::setprecision(1)
+                 << result.allocations_per_statement() << " allocations/statement, was "
+                 << i->second.allocations << endl;
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    int rc = EXIT_SUCCESS;
+    vector<const char*> classifiers;
+    const char* zSave = NULL;
+    const char* zBaseline = NULL;
+    const char* zJson = NULL;
+    double tolerance = 10;
+    size_t rounds = 10;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:c:s:b:p:j:")) != -1)
+    {
+        switch (c)
+        {
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+
+        case 'c':
+            classifiers.push_back(optarg);
+            break;
+
+        case 's':
+            zSave = optarg;
+            break;
+
+        case 'b':
+            zBaseline = optarg;
+            break;
+
+        case 'p':
+            tolerance = atof(optarg);
+            break;
+
+        case 'j':
+            zJson = optarg;
+            break;
+
+        default:
+            rc = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    if (rc != EXIT_SUCCESS || optind == argc || rounds == 0)
+    {
+        cout << USAGE << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (classifiers.empty())
+    {
+        classifiers.push_back("qc_mysqlembedded");
+        classifiers.push_back("qc_sqlite");
+    }
+
+    map<string, vector<string> > categories;
+    vector<string> order;
+
+    for (int i = optind; i < argc; ++i)
+    {
+        string category = category_of(argv[i]);
+
+        if (categories.find(category) == categories.end())
+        {
+            order.push_back(category);
+        }
+
+        if (!read_statements(argv[i], &categories[category]))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    BaselineMap baseline;
+
+    if (zBaseline && !read_baseline(zBaseline, &baseline))
+    {
+        return EXIT_FAILURE;
+    }
+
+    set_datadir(strdup("/tmp"));
+    set_langdir(strdup("."));
+    set_process_datadir(strdup("/tmp"));
+
+    if (!mxs_log_init(NULL, ".", MXS_LOG_TARGET_DEFAULT))
+    {
+        cerr << "error: Could not initialize log." << endl;
+        return EXIT_FAILURE;
+    }
+
+    ofstream save;
+
+    if (zSave)
+    {
+        save.open(zSave);
+
+        if (!save)
+        {
+            cerr << "error: Could not open " << zSave << "." << endl;
+            rc = EXIT_FAILURE;
+        }
+    }
+
+    ofstream json;
+    const char* zSeparator = "";
+
+    if (zJson)
+    {
+        json.open(zJson);
+
+        if (!json)
+        {
+            cerr << "error: Could not open " << zJson << "." << endl;
+            rc = EXIT_FAILURE;
+        }
+
+        json << "{ \"benchmark\": \"qc\", \"results\": [";
+    }
+
+    if (!ALLOCATIONS_COUNTED)
+    {
+        cout << "Allocations are not counted with this C library." << endl;
+    }
+
+    cout << std::left << std::setw(18) << "Classifier" << std::setw(14) << "Category"
+         << std::right << std::setw(11) << "Statements" << std::setw(12) << "ns/stmt"
+         << std::setw(12) << "p99 ns" << std::setw(13) << "allocs/stmt" << endl;
+
+    for (size_t i = 0; rc == EXIT_SUCCESS && i < classifiers.size(); ++i)
+    {
+        QUERY_CLASSIFIER* pClassifier = get_classifier(classifiers[i]);
+
+        if (!pClassifier)
+        {
+            rc = EXIT_FAILURE;
+            break;
+        }
+
+        for (vector<string>::iterator j = order.begin(); j != order.end(); ++j)
+        {
+            Result result;
+            measure(pClassifier, categories[*j], rounds, &result);
+
+            cout << std::left << std::setw(18) << classifiers[i] << std::setw(14) << *j
+                 << std::right << std::setw(11) << result.n_statements
+                 << std::setw(12) << std::fixed << std::setprecision(0) << result.ns_per_statement()
+                 << std::setw(12) << result.p99()
+                 << std::setw(13) << std::setprecision(1) << result.allocations_per_statement()
+                 << endl;
+
+            string key = string(classifiers[i]) + " " + *j;
+
+            if (save.is_open())
+            {
+                save << key << " " << std::fixed << std::setprecision(0)
+                     << result.ns_per_statement() << " " << result.p99() << " "
+                     << std::setprecision(1) << result.allocations_per_statement() << endl;
+            }
+
+            if (json.is_open())
+            {
+                json << zSeparator << "\n    { \"name\": \"" << classifiers[i] << "/" << *j
+                     << "\", \"unit\": \"ns\", \"n\": " << result.times.size()
+                     << ", \"mean\": " << std::fixed << std::setprecision(2) << result.ns_per_statement()
+                     << ", \"stddev\": " << result.stddev() << " }";
+                zSeparator = ",";
+            }
+
+            if (!check(baseline, key, result, tolerance))
+            {
+                rc = EXIT_FAILURE;
+            }
+        }
+
+        put_classifier(pClassifier);
+    }
+
+    if (json.is_open())
+    {
+        json << "\n] }" << endl;
+    }
+
+    mxs_log_finish();
+
+    return rc;
+}
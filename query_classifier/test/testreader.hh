@@ -0,0 +1,65 @@
+#ifndef TESTREADER_HH
+#define TESTREADER_HH
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+#include <istream>
+#include <string>
+
+/**
+ * Reads the statements of a mysqltest file. The commands of mysqltest are
+ * skipped, as are the statements that are expected to fail.
+ */
+class TestReader
+{
+public:
+    enum result_t
+    {
+        RESULT_ERROR, // The file has something that cannot be handled.
+        RESULT_EOF,   // There are no more statements.
+        RESULT_STMT   // A statement was returned.
+    };
+
+    /**
+     * Create a reader
+     *
+     * @param in    The stream to read from
+     */
+    TestReader(std::istream& in);
+
+    /**
+     * Get the next statement
+     *
+     * @param stmt  The statement, without the delimiter if it is not ';'
+     * @return RESULT_STMT if a statement was returned
+     */
+    result_t get_statement(std::string& stmt);
+
+    /**
+     * @return The number of the last line read
+     */
+    size_t line() const
+    {
+        return m_line;
+    }
+
+private:
+    void skip_block();
+
+    std::istream& m_in;
+    size_t m_line;
+    char m_delimiter;
+    bool m_skip;
+};
+
+#endif
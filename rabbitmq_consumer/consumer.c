@@ -17,6 +17,9 @@
 #include <string.h>
 #include <ini.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 #include <amqp_tcp_socket.h>
 #include <amqp.h>
 #include <amqp_framing.h>
@@ -26,27 +29,65 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+/** The default number of messages written in one transaction */
+#define DEFAULT_BATCH_SIZE 100
+
+/** The most messages the broker can be asked to send without an ack */
+#define MAX_PREFETCH 65535
+
+/** The types of the messages */
+enum
+{
+    MSG_INVALID,
+    MSG_QUERY,
+    MSG_REPLY
+};
+
 typedef struct delivery_t
 {
     uint64_t dtag;
     amqp_message_t* message;
+    int type;                   /*< MSG_QUERY, MSG_REPLY or MSG_INVALID */
+    char *tag, *text, *date;    /*< The escaped fields of the message */
     struct delivery_t *next, *prev;
 } DELIVERY;
 
 typedef struct consumer_t
 {
     char *hostname, *vhost, *user, *passwd, *queue, *dbserver, *dbname, *dbuser, *dbpasswd;
-    DELIVERY* query_stack;
     int port, dbport;
+    int batch_size;             /*< Messages written in one transaction */
+    int prefetch;               /*< Unacknowledged messages the broker may send */
+    int threads;                /*< Number of consumer threads */
 } CONSUMER;
 
-static int all_ok;
+/**
+ * A consumer thread, each one has its own broker and database connections
+ */
+typedef struct worker_t
+{
+    pthread_t thread;
+    int failed;                 /*< The thread stopped because of an error */
+    DELIVERY *batch, *batch_tail; /*< The messages not yet written */
+    int batch_len;
+    time_t batch_start;         /*< When the first message of the batch arrived */
+} WORKER;
+
+/** A growing query string */
+typedef struct qbuf_t
+{
+    char* data;
+    size_t len, size;
+} QBUF;
+
+static volatile int all_ok;
 static FILE* out_fd;
 static CONSUMER* c_inst;
 static char* DB_DATABASE = "CREATE DATABASE IF NOT EXISTS %s;";
 static char* DB_TABLE =
     "CREATE TABLE IF NOT EXISTS pairs (tag VARCHAR(64) PRIMARY KEY NOT NULL, query VARCHAR(2048), reply VARCHAR(2048), date_in DATETIME NOT NULL, date_out DATETIME DEFAULT NULL, counter INT DEFAULT 1)";
-static char* DB_INSERT = "INSERT INTO pairs(tag, query, date_in) VALUES ('%s','%s',FROM_UNIXTIME(%s))";
+static char* DB_INSERT = "INSERT INTO pairs(tag, query, date_in) VALUES ";
+static char* DB_INSERT_ROW = "('%s','%s',FROM_UNIXTIME(%s))";
 static char* DB_UPDATE = "UPDATE pairs SET reply='%s', date_out=FROM_UNIXTIME(%s) WHERE tag='%s'";
 static char* DB_INCREMENT =
     "UPDATE pairs SET counter = counter+1, date_out=FROM_UNIXTIME(%s) WHERE query='%s'";
@@ -114,6 +155,18 @@ int handler(void* user, const char* section, const char* name,
         {
             out_fd = fopen(value, "ab");
         }
+        else if (strcmp(name, "batch_size") == 0)
+        {
+            c_inst->batch_size = atoi(value);
+        }
+        else if (strcmp(name, "prefetch") == 0)
+        {
+            c_inst->prefetch = atoi(value);
+        }
+        else if (strcmp(name, "threads") == 0)
+        {
+            c_inst->threads = atoi(value);
+        }
 
     }
 
@@ -197,91 +250,333 @@ int connectToServer(MYSQL* server)
     return 1;
 }
 
-int sendMessage(MYSQL* server, amqp_message_t* msg)
+/**
+ * Append formatted text to a query string
+ *
+ * @param buf The query string
+ * @param fmt The format string
+ * @return 1 on success, 0 if memory allocation failed
+ */
+static int qbufAppend(QBUF* buf, const char* fmt, ...)
 {
-    int buffsz = (int)((msg->body.len + 1) * 2 + 1) +
-                 (int)((msg->properties.correlation_id.len + 1) * 2 + 1) +
-                 strlen(DB_INSERT),
-                 rval = 0;
-    char* saved;
-    char *qstr = calloc(buffsz, sizeof(char)),
-          *rawmsg = calloc((msg->body.len + 1), sizeof(char)),
-           *clnmsg = calloc(((msg->body.len + 1) * 2 + 1), sizeof(char)),
-            *rawdate = calloc((msg->body.len + 1), sizeof(char)),
-             *clndate = calloc(((msg->body.len + 1) * 2 + 1), sizeof(char)),
-              *rawtag = calloc((msg->properties.correlation_id.len + 1), sizeof(char)),
-               *clntag = calloc(((msg->properties.correlation_id.len + 1) * 2 + 1), sizeof(char));
-
-
-
-    sprintf(qstr, "%.*s", (int)msg->body.len, (char *)msg->body.bytes);
-    fprintf(out_fd, "Received: %s\n", qstr);
-    char *ptr = strtok_r(qstr, "|", &saved);
-    sprintf(rawdate, "%s", ptr);
-    ptr = strtok_r(NULL, "\n\0", &saved);
-    if (ptr == NULL)
+    va_list args;
+
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (buf->len + n + 1 > buf->size)
+    {
+        size_t size = buf->size ? buf->size : 1024;
+
+        while (buf->len + n + 1 > size)
+        {
+            size *= 2;
+        }
+
+        char* data = realloc(buf->data, size);
+
+        if (!data)
+        {
+            fprintf(stderr, "Fatal Error: Cannot allocate enough memory.\n");
+            return 0;
+        }
+
+        buf->data = data;
+        buf->size = size;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, args);
+    va_end(args);
+    buf->len += n;
+
+    return 1;
+}
+
+/**
+ * Send a query to the SQL server and log the error if it fails
+ *
+ * @return 0 on success, 1 on error
+ */
+static int runQuery(MYSQL* server, const char* query)
+{
+    if (mysql_query(server, query))
+    {
+        fprintf(stderr, "Could not send query to SQL server:%s\n", mysql_error(server));
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Split a message into its fields and escape them. The body of the message
+ * is the timestamp and the text separated by a '|'. The caller frees the
+ * fields, also when the message is not valid.
+ *
+ * @return MSG_QUERY, MSG_REPLY or MSG_INVALID
+ */
+static int parseMessage(MYSQL* server, amqp_message_t* msg, char** tag, char** text, char** date)
+{
+    size_t bodysz = msg->body.len + 1;
+    size_t tagsz = msg->properties.correlation_id.len + 1;
+    char *body = calloc(bodysz, sizeof(char)), *saved, *rawdate, *rawtext;
+    int rval = MSG_INVALID;
+
+    *tag = calloc(tagsz * 2 + 1, sizeof(char));
+    *text = calloc(bodysz * 2 + 1, sizeof(char));
+    *date = calloc(bodysz * 2 + 1, sizeof(char));
+
+    if (!body || !*tag || !*text || !*date)
+    {
+        fprintf(stderr, "Fatal Error: Cannot allocate enough memory.\n");
+        goto cleanup;
+    }
+
+    sprintf(body, "%.*s", (int)msg->body.len, (char *)msg->body.bytes);
+    fprintf(out_fd, "Received: %s\n", body);
+
+    if ((rawdate = strtok_r(body, "|", &saved)) == NULL ||
+        (rawtext = strtok_r(NULL, "\n\0", &saved)) == NULL)
     {
         fprintf(out_fd, "Message content not valid.\n");
-        rval = 1;
         goto cleanup;
     }
-    sprintf(rawmsg, "%s", ptr);
-    sprintf(rawtag, "%.*s", (int)msg->properties.correlation_id.len,
-            (char *)msg->properties.correlation_id.bytes);
-    memset(qstr, 0, buffsz);
 
-    mysql_real_escape_string(server, clnmsg, rawmsg, strnlen(rawmsg, msg->body.len + 1));
-    mysql_real_escape_string(server, clndate, rawdate, strnlen(rawdate, msg->body.len + 1));
-    mysql_real_escape_string(server, clntag, rawtag, strnlen(rawtag, msg->properties.correlation_id.len + 1));
+    mysql_real_escape_string(server, *text, rawtext, strlen(rawtext));
+    mysql_real_escape_string(server, *date, rawdate, strlen(rawdate));
+    mysql_real_escape_string(server, *tag, msg->properties.correlation_id.bytes,
+                             strnlen(msg->properties.correlation_id.bytes,
+                                     msg->properties.correlation_id.len));
 
     if (strncmp(msg->properties.message_id.bytes,
                 "query", msg->properties.message_id.len) == 0)
     {
+        rval = MSG_QUERY;
+    }
+    else if (strncmp(msg->properties.message_id.bytes,
+                     "reply", msg->properties.message_id.len) == 0)
+    {
+        rval = MSG_REPLY;
+    }
+
+cleanup:
+    free(body);
+    return rval;
+}
 
-        sprintf(qstr, DB_INCREMENT, clndate, clnmsg);
-        rval = mysql_query(server, qstr);
+/**
+ * Write one message with autocommit
+ *
+ * @return 0 on success, 1 on error
+ */
+static int writeMessage(MYSQL* server, DELIVERY* d)
+{
+    QBUF qstr = {NULL, 0, 0};
+    int rval = 1;
 
-        if (mysql_affected_rows(server) == 0)
+    if (d->type == MSG_QUERY)
+    {
+        if (qbufAppend(&qstr, DB_INCREMENT, d->date, d->text) &&
+            (rval = runQuery(server, qstr.data)) == 0 &&
+            mysql_affected_rows(server) == 0)
         {
-            memset(qstr, 0, buffsz);
-            sprintf(qstr, DB_INSERT, clntag, clnmsg, clndate);
-            rval = mysql_query(server, qstr);
+            qstr.len = 0;
+            rval = qbufAppend(&qstr, "%s", DB_INSERT) &&
+                   qbufAppend(&qstr, DB_INSERT_ROW, d->tag, d->text, d->date) ?
+                   runQuery(server, qstr.data) : 1;
         }
-
     }
-    else if (strncmp(msg->properties.message_id.bytes,
-                     "reply", msg->properties.message_id.len) == 0)
+    else if (d->type == MSG_REPLY)
     {
+        rval = qbufAppend(&qstr, DB_UPDATE, d->text, d->date, d->tag) ?
+               runQuery(server, qstr.data) : 1;
+    }
+
+    free(qstr.data);
+    return rval;
+}
 
-        sprintf(qstr, DB_UPDATE, clnmsg, clndate, clntag);
-        rval = mysql_query(server, qstr);
+/**
+ * Send the rows collected for a multi-row insert
+ *
+ * @return 0 on success, 1 on error
+ */
+static int insertRows(MYSQL* server, QBUF* rows)
+{
+    int rval = rows->len ? runQuery(server, rows->data) : 0;
+    rows->len = 0;
+    return rval;
+}
+
+/**
+ * Write the messages of a batch in one transaction. New queries are inserted
+ * with multi-row inserts. The collected rows are sent before a reply or a
+ * repeated query is processed as those refer to the rows.
+ *
+ * @return 0 if the transaction was committed, 1 on error
+ */
+static int writeBatch(MYSQL* server, WORKER* worker)
+{
+    QBUF rows = {NULL, 0, 0};
+    QBUF qstr = {NULL, 0, 0};
+    const char** pending = calloc(worker->batch_len, sizeof(char*));
+    int n_pending = 0, rval = 1;
+    unsigned long thread_id = mysql_thread_id(server);
 
+    if (!pending)
+    {
+        fprintf(stderr, "Fatal Error: Cannot allocate enough memory.\n");
+        return 1;
     }
-    else
+
+    if (runQuery(server, "START TRANSACTION"))
     {
-        rval = 1;
         goto cleanup;
     }
 
+    for (DELIVERY* d = worker->batch; d; d = d->next)
+    {
+        if (d->type == MSG_INVALID)
+        {
+            continue;
+        }
+
+        int repeated = 0;
+
+        for (int i = 0; i < n_pending && !repeated; i++)
+        {
+            repeated = strcmp(pending[i], d->text) == 0;
+        }
+
+        if (d->type == MSG_REPLY || repeated)
+        {
+            if (insertRows(server, &rows))
+            {
+                goto rollback;
+            }
+            n_pending = 0;
+        }
+
+        qstr.len = 0;
+
+        if (d->type == MSG_QUERY)
+        {
+            if (!qbufAppend(&qstr, DB_INCREMENT, d->date, d->text) ||
+                runQuery(server, qstr.data))
+            {
+                goto rollback;
+            }
 
-    if (rval)
+            if (mysql_affected_rows(server) == 0)
+            {
+                if (!qbufAppend(&rows, "%s", rows.len ? "," : DB_INSERT) ||
+                    !qbufAppend(&rows, DB_INSERT_ROW, d->tag, d->text, d->date))
+                {
+                    goto rollback;
+                }
+                pending[n_pending++] = d->text;
+            }
+        }
+        else if (!qbufAppend(&qstr, DB_UPDATE, d->text, d->date, d->tag) ||
+                 runQuery(server, qstr.data))
+        {
+            goto rollback;
+        }
+    }
+
+    if (insertRows(server, &rows) || runQuery(server, "COMMIT"))
     {
-        fprintf(stderr, "Could not send query to SQL server:%s\n", mysql_error(server));
-        goto cleanup;
+        goto rollback;
     }
 
-cleanup:
-    free(qstr);
-    free(rawmsg);
-    free(clnmsg);
-    free(rawdate);
-    free(clndate);
-    free(rawtag);
-    free(clntag);
+    /** An automatic reconnect in the middle of the batch loses the transaction */
+    rval = mysql_thread_id(server) != thread_id;
+    goto cleanup;
 
+rollback:
+    mysql_query(server, "ROLLBACK");
+cleanup:
+    free(pending);
+    free(rows.data);
+    free(qstr.data);
     return rval;
 }
 
+/**
+ * Free the messages of a batch
+ */
+static void freeBatch(WORKER* worker)
+{
+    while (worker->batch)
+    {
+        DELIVERY* d = worker->batch->next;
+        amqp_destroy_message(worker->batch->message);
+        free(worker->batch->message);
+        free(worker->batch->tag);
+        free(worker->batch->text);
+        free(worker->batch->date);
+        free(worker->batch);
+        worker->batch = d;
+    }
+
+    worker->batch_tail = NULL;
+    worker->batch_len = 0;
+}
+
+/**
+ * Write a batch to the SQL server and acknowledge it with one multiple ack.
+ * If the transaction fails, the messages are written one at a time and
+ * acknowledged separately. Malformed messages are rejected.
+ */
+static void flushBatch(WORKER* worker, MYSQL* server, amqp_connection_state_t conn, int channel)
+{
+    if (writeBatch(server, worker) == 0)
+    {
+        uint64_t last = 0;
+
+        for (DELIVERY* d = worker->batch; d; d = d->next)
+        {
+            if (d->type == MSG_INVALID)
+            {
+                fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Received malformed message.\n");
+                amqp_basic_reject(conn, channel, d->dtag, 0);
+            }
+            else
+            {
+                last = d->dtag;
+            }
+        }
+
+        if (last)
+        {
+            amqp_basic_ack(conn, channel, last, 1);
+        }
+    }
+    else
+    {
+        fprintf(out_fd, "Could not write a batch of %d messages, writing them one at a time.\n",
+                worker->batch_len);
+
+        for (DELIVERY* d = worker->batch; d; d = d->next)
+        {
+            if (d->type == MSG_INVALID || writeMessage(server, d))
+            {
+                fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Received malformed message.\n");
+                amqp_basic_reject(conn, channel, d->dtag, 0);
+            }
+            else
+            {
+                amqp_basic_ack(conn, channel, d->dtag, 0);
+            }
+        }
+    }
+
+    freeBatch(worker);
+    amqp_maybe_release_buffers(conn);
+}
+
 int sendToServer(MYSQL* server, amqp_message_t* a, amqp_message_t* b)
 {
 
@@ -392,16 +687,178 @@ int sendToServer(MYSQL* server, amqp_message_t* a, amqp_message_t* b)
     free(qstr);
     return 1;
 }
-int main(int argc, char** argv)
+/**
+ * The consumer thread. Messages are collected into batches that are written
+ * when the batch is full, when the first message of it is a second old or
+ * when no more messages arrive.
+ *
+ * @param data The WORKER of the thread
+ */
+static void* consumeMessages(void* data)
 {
-    int channel = 1, status = AMQP_STATUS_OK, cnfnlen;
+    WORKER* worker = (WORKER*)data;
+    int channel = 1, status = AMQP_STATUS_OK;
     amqp_socket_t *socket = NULL;
-    amqp_connection_state_t conn;
+    amqp_connection_state_t conn = NULL;
     amqp_rpc_reply_t ret;
-    amqp_message_t *reply = NULL;
     amqp_frame_t frame;
     struct timeval timeout;
     MYSQL db_inst;
+
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+
+    mysql_thread_init();
+    connectToServer(&db_inst);
+
+    if ((conn = amqp_new_connection()) == NULL ||
+        (socket = amqp_tcp_socket_new(conn)) == NULL)
+    {
+        fprintf(stderr, "Fatal Error: Cannot create connection object or socket.\n");
+        goto error;
+    }
+
+    if (amqp_socket_open(socket, c_inst->hostname, c_inst->port))
+    {
+        fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Cannot open socket.\n");
+        goto error;
+    }
+
+    ret = amqp_login(conn, c_inst->vhost, 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, c_inst->user, c_inst->passwd);
+
+    if (ret.reply_type != AMQP_RESPONSE_NORMAL)
+    {
+        fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Cannot login to server.\n");
+        goto error;
+    }
+
+    amqp_channel_open(conn, channel);
+    ret = amqp_get_rpc_reply(conn);
+
+    if (ret.reply_type != AMQP_RESPONSE_NORMAL)
+    {
+        fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Cannot open channel.\n");
+        goto error;
+    }
+
+    if (amqp_basic_qos(conn, channel, 0, (uint16_t)c_inst->prefetch, 0) == NULL)
+    {
+        fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Cannot set the prefetch count.\n");
+        goto error;
+    }
+
+    amqp_basic_consume(conn, channel, amqp_cstring_bytes(c_inst->queue), amqp_empty_bytes, 0, 0, 0,
+                       amqp_empty_table);
+
+    while (all_ok)
+    {
+
+        status = amqp_simple_wait_frame_noblock(conn, &frame, &timeout);
+
+        /**No frames to read from server, possibly out of messages*/
+        if (status == AMQP_STATUS_TIMEOUT)
+        {
+            if (worker->batch)
+            {
+                flushBatch(worker, &db_inst, conn, channel);
+            }
+            continue;
+        }
+
+        if (status != AMQP_STATUS_OK)
+        {
+            fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Cannot read from server: %s\n",
+                    amqp_error_string2(status));
+            goto error;
+        }
+
+        if (frame.payload.method.id == AMQP_BASIC_DELIVER_METHOD)
+        {
+
+            amqp_basic_deliver_t* decoded = (amqp_basic_deliver_t*)frame.payload.method.decoded;
+            DELIVERY* d = calloc(1, sizeof(DELIVERY));
+            amqp_message_t* msg = malloc(sizeof(amqp_message_t));
+
+            if (!d || !msg)
+            {
+                fprintf(stderr, "Error: Cannot allocate enough memory.\n");
+                free(d);
+                free(msg);
+                goto error;
+            }
+
+            d->dtag = decoded->delivery_tag;
+
+            ret = amqp_read_message(conn, channel, msg, 0);
+
+            if (ret.reply_type != AMQP_RESPONSE_NORMAL)
+            {
+                fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Cannot read message from server.\n");
+                free(d);
+                free(msg);
+                goto error;
+            }
+
+            d->message = msg;
+            d->type = parseMessage(&db_inst, msg, &d->tag, &d->text, &d->date);
+
+            if (worker->batch_tail)
+            {
+                d->prev = worker->batch_tail;
+                worker->batch_tail->next = d;
+            }
+            else
+            {
+                worker->batch = d;
+                worker->batch_start = time(NULL);
+            }
+
+            worker->batch_tail = d;
+
+            if (++worker->batch_len >= c_inst->batch_size ||
+                time(NULL) - worker->batch_start >= 1)
+            {
+                flushBatch(worker, &db_inst, conn, channel);
+            }
+
+        }
+        else
+        {
+            fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Received method from server: %s\n",
+                    amqp_method_name(frame.payload.method.id));
+            goto error;
+        }
+
+    }
+
+    if (worker->batch)
+    {
+        flushBatch(worker, &db_inst, conn, channel);
+    }
+    goto cleanup;
+
+error:
+    worker->failed = 1;
+    all_ok = 0;
+cleanup:
+    freeBatch(worker);
+    mysql_close(&db_inst);
+
+    if (conn)
+    {
+        amqp_channel_close(conn, channel, AMQP_REPLY_SUCCESS);
+        amqp_connection_close(conn, AMQP_REPLY_SUCCESS);
+        amqp_destroy_connection(conn);
+    }
+
+    mysql_thread_end();
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    int cnfnlen, started = 0;
+    WORKER* workers = NULL;
     char ch, *cnfname = NULL, *cnfpath = NULL;
     static const char* fname = "consumer.cnf";
     const char* default_path = "@CMAKE_INSTALL_PREFIX@/etc";
@@ -412,6 +869,9 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    c_inst->batch_size = DEFAULT_BATCH_SIZE;
+    c_inst->threads = 1;
+
     if (signal(SIGINT, sighndl) == SIG_IGN)
     {
         signal(SIGINT, SIG_IGN);
@@ -453,8 +913,6 @@ int main(int argc, char** argv)
 
     strcat(cnfname, fname);
 
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
     all_ok = 1;
     out_fd = NULL;
 
@@ -489,114 +947,72 @@ int main(int argc, char** argv)
         goto fatal_error;
     }
 
-    connectToServer(&db_inst);
-
-    if ((conn = amqp_new_connection()) == NULL ||
-        (socket = amqp_tcp_socket_new(conn)) == NULL)
+    if (c_inst->batch_size < 1 || c_inst->batch_size > MAX_PREFETCH)
     {
-        fprintf(stderr, "Fatal Error: Cannot create connection object or socket.\n");
+        fprintf(stderr, "Fatal Error: batch_size must be between 1 and %d.\n", MAX_PREFETCH);
         goto fatal_error;
     }
 
-    if (amqp_socket_open(socket, c_inst->hostname, c_inst->port))
+    if (c_inst->threads < 1)
     {
-        fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Cannot open socket.\n");
-        goto error;
+        fprintf(stderr, "Fatal Error: threads must be at least 1.\n");
+        goto fatal_error;
     }
 
-    ret = amqp_login(conn, c_inst->vhost, 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, c_inst->user, c_inst->passwd);
-
-    if (ret.reply_type != AMQP_RESPONSE_NORMAL)
+    /** A batch can only fill up if the broker may send that many messages */
+    if (c_inst->prefetch < c_inst->batch_size)
     {
-        fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Cannot login to server.\n");
-        goto error;
+        if (c_inst->prefetch)
+        {
+            fprintf(out_fd, "Raising prefetch from %d to the batch size %d.\n",
+                    c_inst->prefetch, c_inst->batch_size);
+            c_inst->prefetch = c_inst->batch_size;
+        }
+        else
+        {
+            c_inst->prefetch = c_inst->batch_size * 2 < MAX_PREFETCH ?
+                               c_inst->batch_size * 2 : MAX_PREFETCH;
+        }
     }
-
-    amqp_channel_open(conn, channel);
-    ret = amqp_get_rpc_reply(conn);
-
-    if (ret.reply_type != AMQP_RESPONSE_NORMAL)
+    else if (c_inst->prefetch > MAX_PREFETCH)
     {
-        fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Cannot open channel.\n");
-        goto error;
+        c_inst->prefetch = MAX_PREFETCH;
     }
 
-    reply = malloc(sizeof(amqp_message_t));
-    if (!reply)
+    if (mysql_library_init(0, NULL, NULL) ||
+        (workers = calloc(c_inst->threads, sizeof(WORKER))) == NULL)
     {
-        fprintf(stderr, "Error: Cannot allocate enough memory.\n");
-        goto error;
+        fprintf(stderr, "Fatal Error: Cannot initialize the consumer threads.\n");
+        goto fatal_error;
     }
-    amqp_basic_consume(conn, channel, amqp_cstring_bytes(c_inst->queue), amqp_empty_bytes, 0, 0, 0,
-                       amqp_empty_table);
 
-    while (all_ok)
+    for (started = 0; started < c_inst->threads; started++)
     {
-
-        status = amqp_simple_wait_frame_noblock(conn, &frame, &timeout);
-
-        /**No frames to read from server, possibly out of messages*/
-        if (status == AMQP_STATUS_TIMEOUT)
-        {
-            sleep(timeout.tv_sec);
-            continue;
-        }
-
-        if (frame.payload.method.id == AMQP_BASIC_DELIVER_METHOD)
-        {
-
-            amqp_basic_deliver_t* decoded = (amqp_basic_deliver_t*)frame.payload.method.decoded;
-
-            amqp_read_message(conn, channel, reply, 0);
-
-            if (sendMessage(&db_inst, reply))
-            {
-
-                fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Received malformed message.\n");
-                amqp_basic_reject(conn, channel, decoded->delivery_tag, 0);
-                amqp_destroy_message(reply);
-
-            }
-            else
-            {
-
-                amqp_basic_ack(conn, channel, decoded->delivery_tag, 0);
-                amqp_destroy_message(reply);
-
-            }
-
-        }
-        else
+        if (pthread_create(&workers[started].thread, NULL, consumeMessages, &workers[started]))
         {
-            fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Received method from server: %s\n",
-                    amqp_method_name(frame.payload.method.id));
+            fprintf(stderr, "Fatal Error: Cannot start consumer thread.\n");
+            workers[started].failed = 1;
             all_ok = 0;
-            goto error;
+            break;
         }
-
     }
 
-    fprintf(out_fd, "Shutting down...\n");
-error:
+    int failed = started < c_inst->threads;
 
-    mysql_close(&db_inst);
-    mysql_library_end();
-    if (c_inst && c_inst->query_stack)
+    for (int i = 0; i < started; i++)
     {
+        pthread_join(workers[i].thread, NULL);
+        failed |= workers[i].failed;
+    }
 
-        while (c_inst->query_stack)
-        {
-            DELIVERY* d = c_inst->query_stack->next;
-            amqp_destroy_message(c_inst->query_stack->message);
-            free(c_inst->query_stack);
-            c_inst->query_stack = d;
-        }
+    fprintf(out_fd, "Shutting down...\n");
 
-    }
+    /** The exit status is zero only after an interrupt */
+    all_ok = failed;
+
+    free(workers);
+    mysql_library_end();
 
-    amqp_channel_close(conn, channel, AMQP_REPLY_SUCCESS);
-    amqp_connection_close(conn, AMQP_REPLY_SUCCESS);
-    amqp_destroy_connection(conn);
 fatal_error:
 
     if (out_fd)
@@ -621,7 +1037,8 @@ fatal_error:
 
     }
 
-
+    free(cnfname);
+    free(cnfpath);
 
     return all_ok;
 }
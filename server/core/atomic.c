@@ -23,6 +23,8 @@
  * @endverbatim
  */
 
+#include <atomic.h>
+
 /**
  * Implementation of an atomic add operation for the GCC environment, or the
  * X86 processor.  If we are working within GNU C then we can use the GCC
@@ -53,3 +55,177 @@ atomic_add(int *variable, int value)
     return value;
 #endif
 }
+
+/**
+ * Implementation of an atomic add operation for 64-bit integers.
+ *
+ * @param variable      Pointer the the variable to add to
+ * @param value         Value to be added
+ * @return              The value of variable before the add occurred
+ */
+int64_t
+atomic_add_int64(int64_t *variable, int64_t value)
+{
+    return __sync_fetch_and_add(variable, value);
+}
+
+/**
+ * Atomically read a 64-bit integer.
+ *
+ * @param variable      Pointer to the variable to read
+ * @return              The value of the variable
+ */
+int64_t
+atomic_load_int64(int64_t *variable)
+{
+    return __sync_fetch_and_add(variable, 0);
+}
+
+/**
+ * Atomically store a new value into a 64-bit integer.
+ *
+ * @param variable      Pointer to the variable to modify
+ * @param value         The new value
+ */
+void
+atomic_store_int64(int64_t *variable, int64_t value)
+{
+    int64_t old;
+
+    do
+    {
+        old = *(volatile int64_t*)variable;
+    }
+    while (!__sync_bool_compare_and_swap(variable, old, value));
+}
+
+/**
+ * Atomically bitwise-or a value into the location pointed to by the first
+ * parameter.
+ *
+ * @param variable      Pointer to the variable to modify
+ * @param value         The bits to set
+ * @return              The value of variable before the operation
+ */
+uint32_t
+atomic_or_uint32(uint32_t *variable, uint32_t value)
+{
+    return __sync_fetch_and_or(variable, value);
+}
+
+/**
+ * Atomically replace the contents of a location with a new value.
+ *
+ * @param variable      Pointer to the variable to modify
+ * @param value         The new value
+ * @return              The value of variable before the operation
+ */
+uint32_t
+atomic_swap_uint32(uint32_t *variable, uint32_t value)
+{
+    uint32_t old;
+
+    do
+    {
+        old = *(volatile uint32_t*)variable;
+    }
+    while (!__sync_bool_compare_and_swap(variable, old, value));
+
+    return old;
+}
+
+/**
+ * Atomically store a new value into a location if it currently holds the
+ * expected value.
+ *
+ * @param variable      Pointer to the variable to modify
+ * @param expected      The value the variable is expected to hold
+ * @param value         The new value
+ * @return              True if the value was stored
+ */
+bool
+atomic_cas_int(int *variable, int expected, int value)
+{
+    return __sync_bool_compare_and_swap(variable, expected, value);
+}
+
+/**
+ * Atomically store a new 64-bit value into a location if it currently holds
+ * the expected value.
+ *
+ * @param variable      Pointer to the variable to modify
+ * @param expected      The value the variable is expected to hold
+ * @param value         The new value
+ * @return              True if the value was stored
+ */
+bool
+atomic_cas_int64(int64_t *variable, int64_t expected, int64_t value)
+{
+    return __sync_bool_compare_and_swap(variable, expected, value);
+}
+
+/**
+ * Atomically replace a pointer with a new value.
+ *
+ * @param variable      Pointer to the pointer to modify
+ * @param value         The new pointer value
+ * @return              The pointer value before the operation
+ */
+void *
+atomic_swap_ptr(void **variable, void *value)
+{
+    void *old;
+
+    do
+    {
+        old = *(void * volatile *)variable;
+    }
+    while (!__sync_bool_compare_and_swap(variable, old, value));
+
+    return old;
+}
+
+/**
+ * Atomically store a new pointer value if the pointer currently holds the
+ * expected value.
+ *
+ * @param variable      Pointer to the pointer to modify
+ * @param expected      The value the pointer is expected to hold
+ * @param value         The new pointer value
+ * @return              True if the value was stored
+ */
+bool
+atomic_cas_ptr(void **variable, void *expected, void *value)
+{
+    return __sync_bool_compare_and_swap(variable, expected, value);
+}
+
+/**
+ * Read a pointer that another thread may store at the same time. The memory
+ * the pointer refers to is read only after the pointer itself.
+ *
+ * @param variable      Pointer to the pointer to read
+ * @return              The pointer value
+ */
+void *
+atomic_load_ptr(void **variable)
+{
+    void *value = *(void * volatile *)variable;
+    __sync_synchronize();
+    return value;
+}
+
+/**
+ * Store a pointer that other threads may read at the same time. Everything
+ * written before the store is visible to a thread that reads the new value
+ * with atomic_load_ptr().
+ *
+ * @param variable      Pointer to the pointer to modify
+ * @param value         The new pointer value
+ */
+void
+atomic_store_ptr(void **variable, void *value)
+{
+    __sync_synchronize();
+    *(void * volatile *)variable = value;
+}
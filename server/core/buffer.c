@@ -34,16 +34,20 @@
  *                                      accessed by "show buffers" maxadmin command
  * 20/12/2015   Martin Brampton         Change gwbuf_free to free the whole list; add the
  *                                      gwbuf_count and gwbuf_alloc_and_load functions.
+ * 14/10/2016   MariaDB Corporation     Account the memory of the shared buffers
  *
  * @endverbatim
  */
 #include <stdlib.h>
+#include <pthread.h>
+#include <platform.h>
 #include <buffer.h>
 #include <atomic.h>
 #include <skygw_debug.h>
 #include <skygw_utils.h>
 #include <spinlock.h>
 #include <hint.h>
+#include <memusage.h>
 #include <log_manager.h>
 #include <errno.h>
 
@@ -58,6 +62,335 @@ static void gwbuf_free_one(GWBUF *buf);
 static buffer_object_t* gwbuf_remove_buffer_object(GWBUF*           buf,
                                                    buffer_object_t* bufobj);
 
+/**
+ * The buffer pools
+ *
+ * Each thread has a pool of its own from which the GWBUF structures and the
+ * shared buffers are allocated. The SHARED_BUF header and the data are
+ * allocated as one block, which is rounded up to one of the size classes
+ * of the pool if the data fits into the largest size class. Freed blocks are
+ * cached in the pool of the thread that frees them so no locking is needed
+ * in the allocation and free paths. The amount of memory cached by a pool is
+ * bounded, blocks that do not fit into the pool are returned with free().
+ *
+ * Define GWBUF_NO_POOL to allocate every buffer directly with malloc, for
+ * example when debugging memory problems with Valgrind.
+ */
+#define GWBUF_N_SIZE_CLASSES    8                       /*< 128 to 16384 bytes of data */
+#define GWBUF_MIN_CLASS_SHIFT   7                       /*< log2 of the smallest class */
+#define GWBUF_POOL_CLASS_BYTES  (512 * 1024)            /*< Cached bytes per size class */
+#define GWBUF_POOL_MAX_HEADERS  1024                    /*< Cached GWBUF structures */
+
+#define GWBUF_CLASS_SIZE(c)     (1U << ((c) + GWBUF_MIN_CLASS_SHIFT))
+#define GWBUF_CLASS_MAX_FREE(c) (GWBUF_POOL_CLASS_BYTES / GWBUF_CLASS_SIZE(c))
+
+typedef struct gwbuf_block
+{
+    struct gwbuf_block  *next;
+} GWBUF_BLOCK;
+
+typedef struct gwbuf_pool
+{
+    GWBUF_BLOCK         *blocks[GWBUF_N_SIZE_CLASSES];   /*< Free shared buffers */
+    int                 n_blocks[GWBUF_N_SIZE_CLASSES];  /*< Number of free shared buffers */
+    GWBUF_BLOCK         *headers;                        /*< Free GWBUF structures */
+    int                 n_headers;                       /*< Number of free GWBUF structures */
+    GWBUF_POOL_STATS    stats;                           /*< Statistics of this pool */
+    bool                in_use;                          /*< Whether a thread owns the pool */
+    struct gwbuf_pool   *next;                           /*< The next pool */
+} GWBUF_POOL;
+
+/**
+ * A shared buffer that refers to data that is not owned by the buffer
+ */
+typedef struct gwbuf_external
+{
+    SHARED_BUF          sbuf;                            /*< The shared buffer */
+    void                (*release)(void *);              /*< Called when the data is released */
+    void                *arg;                            /*< Argument of the release function */
+    int                 fd;                              /*< File that contains the data or -1 */
+    off_t               offset;                          /*< File offset of the data */
+} GWBUF_EXTERNAL;
+
+static GWBUF_POOL *all_pools = NULL;            /*< All the pools ever created */
+static SPINLOCK pools_lock = SPINLOCK_INIT;     /*< Protects all_pools */
+static pthread_key_t pool_key;                  /*< Releases the pool when a thread exits */
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static thread_local GWBUF_POOL *thread_pool = NULL;
+
+/**
+ * Return the size class for a given data size
+ *
+ * @param size  The size of the data
+ * @return      The size class or -1 if the data is too large to be pooled
+ */
+static inline int
+gwbuf_size_class(unsigned int size)
+{
+    if (size <= GWBUF_CLASS_SIZE(0))
+    {
+        return 0;
+    }
+
+    int c = (32 - __builtin_clz(size - 1)) - GWBUF_MIN_CLASS_SHIFT;
+    return c < GWBUF_N_SIZE_CLASSES ? c : -1;
+}
+
+/**
+ * Free all the memory cached in a pool when the owning thread exits. The
+ * pool itself is kept so that its statistics are retained and it can be
+ * taken over by a new thread.
+ *
+ * @param data  The pool of the exiting thread
+ */
+static void
+gwbuf_pool_release(void *data)
+{
+    GWBUF_POOL *pool = (GWBUF_POOL*)data;
+    GWBUF_BLOCK *block;
+
+    for (int i = 0; i < GWBUF_N_SIZE_CLASSES; i++)
+    {
+        while ((block = pool->blocks[i]))
+        {
+            pool->blocks[i] = block->next;
+            free(block);
+        }
+        pool->n_blocks[i] = 0;
+    }
+    while ((block = pool->headers))
+    {
+        pool->headers = block->next;
+        free(block);
+    }
+    pool->n_headers = 0;
+    pool->stats.cached_bytes = 0;
+
+    spinlock_acquire(&pools_lock);
+    pool->in_use = false;
+    spinlock_release(&pools_lock);
+    thread_pool = NULL;
+}
+
+static void
+gwbuf_pool_key_init()
+{
+    pthread_key_create(&pool_key, gwbuf_pool_release);
+}
+
+/**
+ * Return the pool of the calling thread, creating it if needed
+ *
+ * @return The pool or NULL if memory allocation failed
+ */
+static inline GWBUF_POOL *
+gwbuf_pool_get()
+{
+#if defined(GWBUF_NO_POOL)
+    return NULL;
+#else
+    if (thread_pool == NULL)
+    {
+        GWBUF_POOL *pool;
+
+        pthread_once(&pool_key_once, gwbuf_pool_key_init);
+
+        spinlock_acquire(&pools_lock);
+        for (pool = all_pools; pool && pool->in_use; pool = pool->next)
+        {
+            ;
+        }
+        if (pool == NULL && (pool = (GWBUF_POOL*)calloc(1, sizeof(GWBUF_POOL))))
+        {
+            pool->next = all_pools;
+            all_pools = pool;
+        }
+        if (pool)
+        {
+            pool->in_use = true;
+        }
+        spinlock_release(&pools_lock);
+
+        if (pool)
+        {
+            pthread_setspecific(pool_key, pool);
+        }
+        thread_pool = pool;
+    }
+    return thread_pool;
+#endif
+}
+
+/**
+ * Allocate a GWBUF structure
+ *
+ * @return A new, uninitialised GWBUF structure or NULL on memory allocation failure
+ */
+static inline GWBUF *
+gwbuf_alloc_header()
+{
+    GWBUF_POOL *pool = gwbuf_pool_get();
+
+    if (pool && pool->headers)
+    {
+        GWBUF_BLOCK *block = pool->headers;
+        pool->headers = block->next;
+        pool->n_headers--;
+        pool->stats.alloc_pooled++;
+        pool->stats.cached_bytes -= sizeof(GWBUF);
+        return (GWBUF*)block;
+    }
+
+    if (pool)
+    {
+        pool->stats.alloc_system++;
+    }
+    return (GWBUF*)malloc(sizeof(GWBUF));
+}
+
+/**
+ * Free a GWBUF structure
+ *
+ * @param buf   The structure to free
+ */
+static inline void
+gwbuf_free_header(GWBUF *buf)
+{
+    GWBUF_POOL *pool = gwbuf_pool_get();
+
+    if (pool && pool->n_headers < GWBUF_POOL_MAX_HEADERS)
+    {
+        GWBUF_BLOCK *block = (GWBUF_BLOCK*)buf;
+        block->next = pool->headers;
+        pool->headers = block;
+        pool->n_headers++;
+        pool->stats.free_pooled++;
+        pool->stats.cached_bytes += sizeof(GWBUF);
+    }
+    else
+    {
+        if (pool)
+        {
+            pool->stats.free_system++;
+        }
+        free(buf);
+    }
+}
+
+/**
+ * Allocate a shared buffer with room for the given amount of data. The data
+ * area follows the SHARED_BUF header in the same memory block.
+ *
+ * @param size  The size of the data area
+ * @return      The shared buffer or NULL on memory allocation failure
+ */
+static inline SHARED_BUF *
+gwbuf_alloc_shared(unsigned int size)
+{
+    GWBUF_POOL *pool = gwbuf_pool_get();
+    int size_class = pool ? gwbuf_size_class(size) : -1;
+    SHARED_BUF *sbuf;
+
+    if (size_class >= 0 && pool->blocks[size_class])
+    {
+        GWBUF_BLOCK *block = pool->blocks[size_class];
+        pool->blocks[size_class] = block->next;
+        pool->n_blocks[size_class]--;
+        pool->stats.alloc_pooled++;
+        pool->stats.cached_bytes -= sizeof(SHARED_BUF) + GWBUF_CLASS_SIZE(size_class);
+        sbuf = (SHARED_BUF*)block;
+    }
+    else
+    {
+        size_t alloc_size = sizeof(SHARED_BUF) + (size_class >= 0 ? GWBUF_CLASS_SIZE(size_class) : size);
+
+        if ((sbuf = (SHARED_BUF*)malloc(alloc_size)) == NULL)
+        {
+            return NULL;
+        }
+        if (pool)
+        {
+            pool->stats.alloc_system++;
+        }
+    }
+
+    sbuf->data = (unsigned char*)(sbuf + 1);
+    sbuf->refcount = 1;
+    sbuf->size_class = size_class;
+    sbuf->size = size_class >= 0 ? GWBUF_CLASS_SIZE(size_class) : size;
+    memusage_alloc(MEMUSAGE_BUFFER, sbuf->size);
+    return sbuf;
+}
+
+/**
+ * Free a shared buffer whose reference count has dropped to zero
+ *
+ * @param sbuf  The shared buffer
+ */
+static inline void
+gwbuf_free_shared(SHARED_BUF *sbuf)
+{
+    GWBUF_POOL *pool = gwbuf_pool_get();
+    int size_class = sbuf->size_class;
+
+    if (size_class != GWBUF_EXTERNAL_DATA)
+    {
+        memusage_free(MEMUSAGE_BUFFER, sbuf->size);
+    }
+
+    if (size_class == GWBUF_EXTERNAL_DATA)
+    {
+        GWBUF_EXTERNAL *ext = (GWBUF_EXTERNAL*)sbuf;
+
+        if (ext->release)
+        {
+            ext->release(ext->arg);
+        }
+        free(ext);
+    }
+    else if (pool && size_class >= 0 && pool->n_blocks[size_class] < GWBUF_CLASS_MAX_FREE(size_class))
+    {
+        GWBUF_BLOCK *block = (GWBUF_BLOCK*)sbuf;
+        block->next = pool->blocks[size_class];
+        pool->blocks[size_class] = block;
+        pool->n_blocks[size_class]++;
+        pool->stats.free_pooled++;
+        pool->stats.cached_bytes += sizeof(SHARED_BUF) + GWBUF_CLASS_SIZE(size_class);
+    }
+    else
+    {
+        if (pool)
+        {
+            pool->stats.free_system++;
+        }
+        free(sbuf);
+    }
+}
+
+/**
+ * Get the statistics of the buffer pools. The values are summed over the
+ * pools of all threads without locking so they are approximate.
+ *
+ * @param stats The structure where the statistics are stored
+ */
+void
+gwbuf_get_pool_stats(GWBUF_POOL_STATS *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    spinlock_acquire(&pools_lock);
+    for (GWBUF_POOL *pool = all_pools; pool; pool = pool->next)
+    {
+        stats->alloc_pooled += pool->stats.alloc_pooled;
+        stats->alloc_system += pool->stats.alloc_system;
+        stats->free_pooled += pool->stats.free_pooled;
+        stats->free_system += pool->stats.free_system;
+        stats->cached_bytes += pool->stats.cached_bytes;
+        stats->n_pools++;
+    }
+    spinlock_release(&pools_lock);
+}
+
 #if defined(BUFFER_TRACE)
 static void gwbuf_add_to_hashtable(GWBUF *buf);
 static int bhashfn (void *key);
@@ -68,9 +401,8 @@ static void gwbuf_remove_from_hashtable(GWBUF *buf);
 /**
  * Allocate a new gateway buffer structure of size bytes.
  *
- * For now we allocate memory directly from malloc for buffer the management
- * structure and the actual data buffer itself. We may swap at a future date
- * to a more efficient mechanism.
+ * The buffer structure and the shared data buffer are allocated from the
+ * buffer pool of the calling thread.
  *
  * @param       size The size in bytes of the data area required
  * @return      Pointer to the buffer structure or NULL if memory could not
@@ -83,32 +415,22 @@ gwbuf_alloc(unsigned int size)
     SHARED_BUF *sbuf;
 
     /* Allocate the buffer header */
-    if ((rval = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+    if ((rval = gwbuf_alloc_header()) == NULL)
     {
         goto retblock;
     }
 
-    /* Allocate the shared data buffer */
-    if ((sbuf = (SHARED_BUF *)malloc(sizeof(SHARED_BUF))) == NULL)
+    /* Allocate the shared data buffer together with the space for the data */
+    if ((sbuf = gwbuf_alloc_shared(size)) == NULL)
     {
-        free(rval);
-        rval = NULL;
-        goto retblock;
-    }
-
-    /* Allocate the space for the actual data */
-    if ((sbuf->data = (unsigned char *)malloc(size)) == NULL)
-    {
-        ss_dassert(sbuf->data != NULL);
-        free(rval);
-        free(sbuf);
+        ss_dassert(sbuf != NULL);
+        gwbuf_free_header(rval);
         rval = NULL;
         goto retblock;
     }
     spinlock_init(&rval->gwbuf_lock);
     rval->start = sbuf->data;
     rval->end = (void *)((char *)rval->start + size);
-    sbuf->refcount = 1;
     rval->sbuf = sbuf;
     rval->next = NULL;
     rval->tail = rval;
@@ -153,6 +475,126 @@ gwbuf_alloc_and_load(unsigned int size, void *data)
     return rval;
 }
 
+/**
+ * Allocate a gateway buffer that refers to existing data without copying it.
+ *
+ * The data must stay valid until the release function is called, which is
+ * done when the last buffer that refers to the data is freed. The buffer
+ * functions never modify the data so it can be read-only memory, for example
+ * a memory mapped file. Users of the buffer must not modify it either.
+ *
+ * @param       size    The size of the data
+ * @param       data    Pointer to the data
+ * @param       release Function that releases the data, or NULL
+ * @param       arg     Argument passed to the release function
+ * @return      Pointer to the buffer structure or NULL if memory could not
+ *              be allocated.
+ */
+GWBUF *
+gwbuf_alloc_external(unsigned int size, void *data, void (*release)(void *), void *arg)
+{
+    GWBUF          *rval;
+    GWBUF_EXTERNAL *ext;
+
+    if ((rval = gwbuf_alloc_header()) == NULL)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Memory allocation failed due to %s.",
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        return NULL;
+    }
+
+    if ((ext = (GWBUF_EXTERNAL*)malloc(sizeof(GWBUF_EXTERNAL))) == NULL)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Memory allocation failed due to %s.",
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        gwbuf_free_header(rval);
+        return NULL;
+    }
+
+    ext->sbuf.data = (unsigned char*)data;
+    ext->sbuf.refcount = 1;
+    ext->sbuf.size_class = GWBUF_EXTERNAL_DATA;
+    ext->sbuf.size = size;
+    ext->release = release;
+    ext->arg = arg;
+    ext->fd = -1;
+    ext->offset = 0;
+
+    spinlock_init(&rval->gwbuf_lock);
+    rval->start = data;
+    rval->end = (void *)((char *)data + size);
+    rval->sbuf = &ext->sbuf;
+    rval->next = NULL;
+    rval->tail = rval;
+    rval->hint = NULL;
+    rval->properties = NULL;
+    rval->gwbuf_type = GWBUF_TYPE_UNDEFINED;
+    rval->gwbuf_info = GWBUF_INFO_NONE;
+    rval->gwbuf_bufobj = NULL;
+    CHK_GWBUF(rval);
+#if defined(BUFFER_TRACE)
+    gwbuf_add_to_hashtable(rval);
+#endif
+    return rval;
+}
+
+/**
+ * Record the file that an external buffer was loaded from. The data of the
+ * buffer must be identical to the file contents at the offset. This allows
+ * the buffer to be written with sendfile() instead of from memory.
+ *
+ * The file descriptor must stay open until the release function of the
+ * buffer is called.
+ *
+ * @param buf       A buffer created with gwbuf_alloc_external()
+ * @param fd        The file descriptor
+ * @param offset    File offset of the start of the data
+ * @return          True if the file was set, false if the buffer is not external
+ */
+bool
+gwbuf_set_file(GWBUF *buf, int fd, off_t offset)
+{
+    if (buf->sbuf->size_class != GWBUF_EXTERNAL_DATA)
+    {
+        return false;
+    }
+
+    GWBUF_EXTERNAL *ext = (GWBUF_EXTERNAL*)buf->sbuf;
+    ext->fd = fd;
+    ext->offset = offset - ((unsigned char*)buf->start - ext->sbuf.data);
+    return true;
+}
+
+/**
+ * Get the file range that contains the data of a single buffer
+ *
+ * @param buf       The buffer
+ * @param fd        Set to the file descriptor
+ * @param offset    Set to the file offset of the first byte of the buffer
+ * @return          True if the data of the buffer is in a file
+ */
+bool
+gwbuf_get_file_range(GWBUF *buf, int *fd, off_t *offset)
+{
+    if (buf->sbuf->size_class != GWBUF_EXTERNAL_DATA)
+    {
+        return false;
+    }
+
+    GWBUF_EXTERNAL *ext = (GWBUF_EXTERNAL*)buf->sbuf;
+
+    if (ext->fd == -1)
+    {
+        return false;
+    }
+
+    *fd = ext->fd;
+    *offset = ext->offset + ((unsigned char*)buf->start - ext->sbuf.data);
+    return true;
+}
+
 #if defined(BUFFER_TRACE)
 /**
  * Store a trace of buffer creation
@@ -283,8 +725,7 @@ gwbuf_free_one(GWBUF *buf)
 
     if (atomic_add(&buf->sbuf->refcount, -1) == 1)
     {
-        free(buf->sbuf->data);
-        free(buf->sbuf);
+        gwbuf_free_shared(buf->sbuf);
         bo = buf->gwbuf_bufobj;
 
         while (bo != NULL)
@@ -311,7 +752,7 @@ gwbuf_free_one(GWBUF *buf)
 #if defined(BUFFER_TRACE)
     gwbuf_remove_from_hashtable(buf);
 #endif
-    free(buf);
+    gwbuf_free_header(buf);
 }
 
 /**
@@ -329,7 +770,7 @@ gwbuf_clone(GWBUF *buf)
 {
     GWBUF *rval;
 
-    if ((rval = (GWBUF *)calloc(1, sizeof(GWBUF))) == NULL)
+    if ((rval = gwbuf_alloc_header()) == NULL)
     {
         ss_dassert(rval != NULL);
         char errbuf[STRERROR_BUFLEN];
@@ -338,6 +779,7 @@ gwbuf_clone(GWBUF *buf)
         return NULL;
     }
 
+    memset(rval, 0, sizeof(GWBUF));
     atomic_add(&buf->sbuf->refcount, 1);
     rval->sbuf = buf->sbuf;
     rval->start = buf->start;
@@ -393,7 +835,7 @@ static GWBUF *gwbuf_clone_portion(GWBUF *buf,
     CHK_GWBUF(buf);
     ss_dassert(start_offset + length <= GWBUF_LENGTH(buf));
 
-    if ((clonebuf = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+    if ((clonebuf = gwbuf_alloc_header()) == NULL)
     {
         ss_dassert(clonebuf != NULL);
         char errbuf[STRERROR_BUFLEN];
@@ -401,6 +843,7 @@ static GWBUF *gwbuf_clone_portion(GWBUF *buf,
                   strerror_r(errno, errbuf, sizeof(errbuf)));
         return NULL;
     }
+    spinlock_init(&clonebuf->gwbuf_lock);
     atomic_add(&buf->sbuf->refcount, 1);
     clonebuf->sbuf = buf->sbuf;
     clonebuf->gwbuf_type = buf->gwbuf_type; /*< clone info bits too */
@@ -752,8 +1195,11 @@ void gwbuf_add_buffer_object(GWBUF* buf,
         p_b = &(*p_b)->bo_next;
     }
     *p_b = newb;
-    /** Set flag */
-    buf->gwbuf_info |= GWBUF_INFO_PARSED;
+    /** Set flag, the other objects do not mean that the buffer was parsed */
+    if (id == GWBUF_PARSING_INFO)
+    {
+        buf->gwbuf_info |= GWBUF_INFO_PARSED;
+    }
     /** Unlock */
     spinlock_release(&buf->gwbuf_lock);
 }
@@ -41,6 +41,7 @@
  * 22/04/15     Martin Brampton         Added disable_master_role_setting parameter
  * 26/01/16     Martin Brampton         Transfer SSL processing to listener
  * 31/05/16     Martin Brampton         Implement connection throttling, initially no queue
+ * 14/10/16     MariaDB Corporation     Reload router options, filters and listeners
  *
  * @endverbatim
  */
@@ -48,6 +49,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <ctype.h>
 #include <ini.h>
 #include <maxconfig.h>
@@ -61,6 +63,7 @@
 #include <mysql.h>
 #include <sys/utsname.h>
 #include <sys/fcntl.h>
+#include <sched.h>
 #include <glob.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
@@ -72,6 +75,7 @@
 #include <sys/utsname.h>
 #include <dbusers.h>
 #include <gw.h>
+#include <governor.h>
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
@@ -85,8 +89,11 @@ static const char *config_get_value_string(CONFIG_PARAMETER *, const char *);
 static int handle_global_item(const char *, const char *);
 static int handle_feedback_item(const char *, const char *);
 static void global_defaults();
+static bool config_parse_size(const char *value, int64_t max, int64_t *size);
+static bool config_parse_cpu_list(const char *value);
 static void feedback_defaults();
 static bool check_config_objects(CONFIG_CONTEXT *context);
+static void preload_modules(CONFIG_CONTEXT *context);
 static int maxscale_getline(char** dest, int* size, FILE* file);
 static SSL_LISTENER *make_ssl_structure(CONFIG_CONTEXT *obj, bool require_cert, int *error_count);
 
@@ -138,6 +145,13 @@ static char *service_params[] =
     "log_auth_warnings",
     "source", /**< Avrorouter only */
     "retry_on_failure",
+    "dedicated_threads",
+    "max_active_queries",
+    "max_active_queries_per_user",
+    "max_queued_queries",
+    "high_priority_users",
+    "max_execution_time",
+    "local_probes",
     NULL
 };
 
@@ -150,6 +164,10 @@ static char *listener_params[] =
     "address",
     "socket",
     "authenticator",
+    "accept_rate",
+    "accept_batch",
+    "compression",
+    "compression_level",
     "ssl_cert",
     "ssl_ca_cert",
     "ssl",
@@ -177,9 +195,15 @@ static char *monitor_params[] =
     "backend_connect_timeout",
     "backend_read_timeout",
     "backend_write_timeout",
+    "script_timeout",
+    "script_max_concurrency",
     "available_when_donor",
     "disable_master_role_setting",
     "use_priority",
+    "fast_detection_interval",
+    "fast_detection_ping",
+    "heartbeat_interval",
+    "load_metrics",
     NULL
 };
 
@@ -193,6 +217,8 @@ static char *server_params[] =
     "monitorpw",
     "persistpoolmax",
     "persistmaxtime",
+    "persistreset",
+    "compression",
     "ssl_cert",
     "ssl_ca_cert",
     "ssl",
@@ -412,15 +438,99 @@ config_load(char *file)
 
     config_file = file;
 
-    if (check_config_objects(config.next) && process_config_context(config.next))
+    if (check_config_objects(config.next))
     {
-        rval = true;
+        preload_modules(config.next);
+
+        if (process_config_context(config.next))
+        {
+            rval = true;
+        }
     }
 
     free_config_context(config.next);
     return rval;
 }
 
+/**
+ * Load the modules used by the objects of the configuration with several
+ * threads, the objects then find their modules already loaded.
+ *
+ * @param context The parsed configuration context
+ */
+static void
+preload_modules(CONFIG_CONTEXT *context)
+{
+    int n_modules = 0;
+
+    for (CONFIG_CONTEXT *obj = context; obj; obj = obj->next)
+    {
+        n_modules += 2;
+    }
+
+    const char *modules[n_modules > 0 ? n_modules : 1];
+    const char *types[n_modules > 0 ? n_modules : 1];
+
+    n_modules = 0;
+
+    for (CONFIG_CONTEXT *obj = context; obj; obj = obj->next)
+    {
+        char *type = config_get_value(obj->parameters, "type");
+        char *module = NULL;
+        char *second = NULL;
+        const char *module_type = NULL;
+
+        if (type == NULL)
+        {
+            continue;
+        }
+        else if (strcmp(type, "service") == 0)
+        {
+            module = config_get_value(obj->parameters, "router");
+            module_type = MODULE_ROUTER;
+        }
+        else if (strcmp(type, "listener") == 0)
+        {
+            module = config_get_value(obj->parameters, "protocol");
+            second = config_get_value(obj->parameters, "authenticator");
+            module_type = MODULE_PROTOCOL;
+        }
+        else if (strcmp(type, "server") == 0)
+        {
+            module = config_get_value(obj->parameters, "protocol");
+            second = config_get_value(obj->parameters, "authenticator");
+            module_type = MODULE_PROTOCOL;
+        }
+        else if (strcmp(type, "monitor") == 0)
+        {
+            module = config_get_value(obj->parameters, "module");
+            module_type = MODULE_MONITOR;
+        }
+        else if (strcmp(type, "filter") == 0)
+        {
+            module = config_get_value(obj->parameters, "module");
+            module_type = MODULE_FILTER;
+        }
+
+        if (module)
+        {
+            modules[n_modules] = module;
+            types[n_modules++] = module_type;
+        }
+
+        if (second)
+        {
+            modules[n_modules] = second;
+            types[n_modules++] = MODULE_AUTHENTICATOR;
+        }
+    }
+
+    if (n_modules > 0)
+    {
+        load_modules(modules, types, n_modules, config_threadcount());
+    }
+}
+
 /**
  * Reload the configuration file for the MaxScale
  *
@@ -840,6 +950,222 @@ config_threadcount()
     return gateway.n_threads;
 }
 
+/**
+ * Return whether each polling thread should have an epoll instance and an
+ * event queue of its own instead of sharing one between all threads.
+ *
+ * @return True if per-thread event queues are enabled
+ */
+bool
+config_thread_event_queues()
+{
+    return gateway.thread_event_queues;
+}
+
+/**
+ * Return whether idle polling threads may process events queued for busy
+ * threads. Only used together with per-thread event queues.
+ *
+ * @return True if work stealing is enabled
+ */
+bool
+config_thread_work_stealing()
+{
+    return gateway.thread_work_stealing;
+}
+
+/**
+ * Return whether each polling thread should accept connections from a
+ * listening socket of its own. Only used together with per-thread event
+ * queues.
+ *
+ * @return True if SO_REUSEPORT listeners are enabled
+ */
+bool
+config_listener_reuseport()
+{
+    return gateway.listener_reuseport;
+}
+
+/**
+ * Return the CPU that a polling thread should be bound to. The threads are
+ * assigned the configured CPUs in order, starting again from the first CPU
+ * if there are more threads than CPUs.
+ *
+ * @param thread_id The ID of the polling thread
+ * @return The CPU number or -1 if the thread is not bound to a CPU
+ */
+int
+config_thread_cpu(int thread_id)
+{
+    if (gateway.n_thread_cpus == 0 || thread_id < 0)
+    {
+        return -1;
+    }
+
+    return gateway.thread_cpus[thread_id % gateway.n_thread_cpus];
+}
+
+/**
+ * Return whether sockets are read directly into adaptively sized buffers
+ * instead of first querying the number of readable bytes
+ *
+ * @return True if direct reads are enabled
+ */
+bool
+config_direct_reads()
+{
+    return gateway.direct_reads;
+}
+
+/**
+ * Return whether the encryption of established SSL connections should be
+ * offloaded to the kernel when the kernel and OpenSSL support it
+ *
+ * @return True if kernel TLS is enabled
+ */
+bool
+config_ssl_ktls()
+{
+    return gateway.ssl_ktls;
+}
+
+/**
+ * Return the I/O engine the polling threads use
+ *
+ * @return The I/O engine
+ */
+io_engine_t
+config_io_engine()
+{
+    return gateway.io_engine;
+}
+
+/**
+ * Return the UNIX socket through which the listeners are handed off to a new
+ * process in a hot restart
+ *
+ * @return The path of the socket or NULL if hot restart is not used
+ */
+const char*
+config_hot_restart_socket()
+{
+    return gateway.hot_restart_socket;
+}
+
+/**
+ * Return how long a process that handed off its listeners waits for its
+ * client connections to close before it shuts down
+ *
+ * @return The timeout in seconds, 0 for no timeout
+ */
+int
+config_hot_restart_drain_timeout()
+{
+    return gateway.hot_restart_drain_timeout;
+}
+
+/**
+ * Return the number of threads that do the SSL handshakes of clients instead
+ * of the polling threads
+ *
+ * @return The number of handshake threads, 0 if the polling threads do them
+ */
+int
+config_ssl_handshake_threads()
+{
+    return gateway.ssl_handshake_threads;
+}
+
+/**
+ * Return the number of threads that start the services at startup
+ *
+ * @return The number of threads, at least 1
+ */
+int
+config_service_start_threads()
+{
+    return gateway.service_start_threads;
+}
+
+/**
+ * Return the number of entries in the query classification cache of a thread
+ *
+ * @return The number of entries, 0 if the cache is disabled
+ */
+int
+config_qc_cache_size()
+{
+    return gateway.qc_cache_size;
+}
+
+/**
+ * Return the size of the largest statement that is classified
+ *
+ * @return The size in bytes, 0 if there is no limit
+ */
+int
+config_qc_max_size()
+{
+    return gateway.qc_max_size;
+}
+
+/**
+ * Return how often the queries are traced
+ *
+ * @return One query in this many is traced, 0 if tracing is disabled
+ */
+int
+config_trace_sample_rate()
+{
+    return gateway.trace_sample_rate;
+}
+
+/**
+ * Return the size of the write queue of a client connection above which
+ * reading from the backend connections of the session is paused
+ *
+ * @return The size in bytes, 0 if reads are never paused
+ */
+int
+config_writeq_high_water()
+{
+    return gateway.writeq_high_water;
+}
+
+/**
+ * Return the total size of the write queues of all connections above which
+ * reading from the backend connections of the sessions whose clients have
+ * queued data is paused
+ *
+ * @return The size in bytes, 0 if there is no limit
+ */
+int64_t
+config_writeq_memory_limit()
+{
+    return gateway.writeq_memory_limit;
+}
+
+/**
+ * Return the size of the write queue of a client connection below which
+ * paused reads from the backend connections are resumed. If no valid value
+ * smaller than the high water mark is configured, half of the high water
+ * mark is used.
+ *
+ * @return The size in bytes
+ */
+int
+config_writeq_low_water()
+{
+    if (gateway.writeq_high_water &&
+        (gateway.writeq_low_water <= 0 || gateway.writeq_low_water >= gateway.writeq_high_water))
+    {
+        return gateway.writeq_high_water > 1 ? gateway.writeq_high_water / 2 : 1;
+    }
+
+    return gateway.writeq_low_water;
+}
+
 /**
  * Return the number of non-blocking polls to be done before a blocking poll
  * is issued.
@@ -864,6 +1190,41 @@ config_pollsleep()
     return gateway.pollsleep;
 }
 
+/**
+ * Return whether the polling threads tune their spins and blocking waits
+ * from the rate of the events they receive
+ *
+ * @return True if adaptive polling is enabled
+ */
+bool
+config_adaptive_polling()
+{
+    return gateway.adaptive_polling;
+}
+
+/**
+ * Return the longest time a polling thread spins in non-blocking polls
+ * with adaptive polling
+ *
+ * @return The time in microseconds
+ */
+int
+config_adaptive_poll_max_spin()
+{
+    return gateway.adaptive_poll_max_spin;
+}
+
+/**
+ * Return the SO_BUSY_POLL value of the client and server sockets
+ *
+ * @return The busy poll time in microseconds, 0 if busy polling is not used
+ */
+int
+config_busy_poll()
+{
+    return gateway.busy_poll;
+}
+
 /**
  * Return the feedback config data pointer
  *
@@ -941,10 +1302,213 @@ handle_global_item(const char *name, const char *value)
     {
         gateway.pollsleep = atoi(value);
     }
+    else if (strcmp(name, "adaptive_polling") == 0)
+    {
+        gateway.adaptive_polling = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "adaptive_poll_max_spin") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.adaptive_poll_max_spin = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'adaptive_poll_max_spin': %s", value);
+        }
+    }
+    else if (strcmp(name, "busy_poll") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.busy_poll = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'busy_poll': %s", value);
+        }
+    }
+    else if (strcmp(name, "thread_event_queues") == 0)
+    {
+        gateway.thread_event_queues = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "thread_work_stealing") == 0)
+    {
+        gateway.thread_work_stealing = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "listener_reuseport") == 0)
+    {
+        gateway.listener_reuseport = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "thread_affinity") == 0)
+    {
+        if (!config_parse_cpu_list(value))
+        {
+            MXS_WARNING("Invalid value for 'thread_affinity': %s", value);
+        }
+    }
+    else if (strcmp(name, "direct_reads") == 0)
+    {
+        gateway.direct_reads = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "ssl_ktls") == 0)
+    {
+        gateway.ssl_ktls = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "hot_restart_socket") == 0)
+    {
+        free(gateway.hot_restart_socket);
+        gateway.hot_restart_socket = *value ? strdup(value) : NULL;
+    }
+    else if (strcmp(name, "hot_restart_drain_timeout") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.hot_restart_drain_timeout = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'hot_restart_drain_timeout': %s", value);
+        }
+    }
+    else if (strcmp(name, "io_engine") == 0)
+    {
+        if (strcmp(value, "epoll") == 0)
+        {
+            gateway.io_engine = IO_ENGINE_EPOLL;
+    free(gateway.hot_restart_socket);
+    gateway.hot_restart_socket = NULL;
+    gateway.hot_restart_drain_timeout = DEFAULT_HOT_RESTART_DRAIN_TIMEOUT;
+        }
+        else if (strcmp(value, "io_uring") == 0)
+        {
+            gateway.io_engine = IO_ENGINE_URING;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'io_engine': %s", value);
+        }
+    }
+    else if (strcmp(name, "ssl_handshake_threads") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.ssl_handshake_threads = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'ssl_handshake_threads': %s", value);
+        }
+    }
+    else if (strcmp(name, "service_start_threads") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0)
+        {
+            gateway.service_start_threads = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'service_start_threads': %s", value);
+        }
+    }
+    else if (strcmp(name, "query_classifier_cache_size") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.qc_cache_size = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'query_classifier_cache_size': %s", value);
+        }
+    }
+    else if (strcmp(name, "query_classifier_max_size") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.qc_max_size = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'query_classifier_max_size': %s", value);
+        }
+    }
+    else if (strcmp(name, "trace_sample_rate") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.trace_sample_rate = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'trace_sample_rate': %s", value);
+        }
+    }
+    else if (strcmp(name, "writeq_high_water") == 0 ||
+             strcmp(name, "writeq_low_water") == 0 ||
+             strcmp(name, "writeq_memory_limit") == 0)
+    {
+        int64_t size;
+
+        if (!config_parse_size(value, strcmp(name, "writeq_memory_limit") == 0 ?
+                               INT64_MAX : INT_MAX, &size))
+        {
+            MXS_WARNING("Invalid value for '%s': %s", name, value);
+        }
+        else if (strcmp(name, "writeq_high_water") == 0)
+        {
+            gateway.writeq_high_water = size;
+        }
+        else if (strcmp(name, "writeq_low_water") == 0)
+        {
+            gateway.writeq_low_water = size;
+        }
+        else
+        {
+            gateway.writeq_memory_limit = size;
+        }
+    }
     else if (strcmp(name, "ms_timestamp") == 0)
     {
         mxs_log_set_highprecision_enabled(config_truth_value((char*)value));
     }
+    else if (strcmp(name, "log_throttling") == 0)
+    {
+        char* endptr;
+        int count = strtol(value, &endptr, 0);
+        int window = 0;
+
+        if (*endptr == ',')
+        {
+            window = strtol(endptr + 1, &endptr, 0);
+        }
+
+        if (*endptr == '\0' && count >= 0 && window > 0)
+        {
+            mxs_log_set_throttling(count, window);
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'log_throttling', expected "
+                        "<count>,<milliseconds>: %s", value);
+        }
+    }
     else if (strcmp(name, "auth_connect_timeout") == 0)
     {
         char* endptr;
@@ -1034,6 +1598,10 @@ free_ssl_structure(SSL_LISTENER *ssl)
 {
     if (ssl)
     {
+        if (ssl->session)
+        {
+            SSL_SESSION_free(ssl->session);
+        }
         SSL_CTX_free(ssl->ctx);
         free(ssl->ssl_key);
         free(ssl->ssl_cert);
@@ -1068,6 +1636,7 @@ make_ssl_structure (CONFIG_CONTEXT *obj, bool require_cert, int *error_count)
                 return NULL;
             }
             new_ssl->ssl_method_type = SERVICE_SSL_TLS_MAX;
+            spinlock_init(&new_ssl->session_lock);
             ssl_cert = config_get_value(obj->parameters, "ssl_cert");
             ssl_key = config_get_value(obj->parameters, "ssl_key");
             ssl_ca_cert = config_get_value(obj->parameters, "ssl_ca_cert");
@@ -1198,15 +1767,151 @@ handle_feedback_item(const char *name, const char *value)
     {
         feedback.feedback_timeout = atoi(value);
     }
-    if (strcmp(name, "feedback_connect_timeout") == 0)
+    if (strcmp(name, "feedback_connect_timeout") == 0)
+    {
+        feedback.feedback_connect_timeout = atoi(value);
+    }
+    if (strcmp(name, "feedback_frequency") == 0)
+    {
+        feedback.feedback_frequency = atoi(value);
+    }
+    return 1;
+}
+
+/**
+ * Parse a size in bytes. The value may have a K, M or G suffix.
+ *
+ * @param value The value to parse
+ * @param max   The largest allowed size
+ * @param size  Where the size is stored
+ * @return True if the value was valid and stored in size
+ */
+static bool
+config_parse_size(const char *value, int64_t max, int64_t *size)
+{
+    char *endptr;
+    long long val = strtoll(value, &endptr, 0);
+
+    switch (*endptr)
+    {
+        case 'G':
+        case 'g':
+            val *= 1024;
+        /* fallthrough */
+        case 'M':
+        case 'm':
+            val *= 1024;
+        /* fallthrough */
+        case 'K':
+        case 'k':
+            val *= 1024;
+            endptr++;
+            break;
+
+        default:
+            break;
+    }
+
+    if (endptr == value || *endptr != '\0' || val < 0 || val > max)
+    {
+        return false;
+    }
+
+    *size = val;
+    return true;
+}
+
+/**
+ * Parse the value of the thread_affinity parameter into the list of CPUs of
+ * the polling threads. The value is either a comma separated list of CPU
+ * numbers and ranges of CPU numbers, e.g. 0-3,8-11, or auto, which uses the
+ * CPUs that the process is allowed to run on.
+ *
+ * @param value The parameter value
+ * @return True if the value was valid
+ */
+static bool
+config_parse_cpu_list(const char *value)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    if (strcmp(value, "auto") == 0)
+    {
+        if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        const char *ptr = value;
+
+        while (*ptr)
+        {
+            char *end;
+            long first = strtol(ptr, &end, 10);
+            long last = first;
+
+            if (end == ptr)
+            {
+                return false;
+            }
+
+            if (*end == '-')
+            {
+                ptr = end + 1;
+                last = strtol(ptr, &end, 10);
+
+                if (end == ptr)
+                {
+                    return false;
+                }
+            }
+
+            if (first < 0 || last < first || last >= CPU_SETSIZE)
+            {
+                return false;
+            }
+
+            for (long cpu = first; cpu <= last; cpu++)
+            {
+                CPU_SET(cpu, &set);
+            }
+
+            ptr = end;
+
+            if (*ptr == ',')
+            {
+                ptr++;
+            }
+            else if (*ptr != '\0')
+            {
+                return false;
+            }
+        }
+    }
+
+    int n_cpus = CPU_COUNT(&set);
+    int *cpus;
+
+    if (n_cpus == 0 || (cpus = malloc(n_cpus * sizeof(int))) == NULL)
     {
-        feedback.feedback_connect_timeout = atoi(value);
+        return false;
     }
-    if (strcmp(name, "feedback_frequency") == 0)
+
+    for (int cpu = 0, i = 0; i < n_cpus; cpu++)
     {
-        feedback.feedback_frequency = atoi(value);
+        if (CPU_ISSET(cpu, &set))
+        {
+            cpus[i++] = cpu;
+        }
     }
-    return 1;
+
+    free(gateway.thread_cpus);
+    gateway.thread_cpus = cpus;
+    gateway.n_thread_cpus = n_cpus;
+    return true;
 }
 
 /**
@@ -1220,6 +1925,26 @@ global_defaults()
     gateway.n_threads = DEFAULT_NTHREADS;
     gateway.n_nbpoll = DEFAULT_NBPOLLS;
     gateway.pollsleep = DEFAULT_POLLSLEEP;
+    gateway.adaptive_polling = 0;
+    gateway.adaptive_poll_max_spin = DEFAULT_ADAPTIVE_POLL_MAX_SPIN;
+    gateway.busy_poll = 0;
+    gateway.thread_event_queues = 0;
+    gateway.thread_work_stealing = 0;
+    gateway.listener_reuseport = 0;
+    free(gateway.thread_cpus);
+    gateway.thread_cpus = NULL;
+    gateway.n_thread_cpus = 0;
+    gateway.direct_reads = 0;
+    gateway.ssl_ktls = 0;
+    gateway.io_engine = IO_ENGINE_EPOLL;
+    gateway.ssl_handshake_threads = 0;
+    gateway.service_start_threads = DEFAULT_SERVICE_START_THREADS;
+    gateway.qc_cache_size = 0;
+    gateway.qc_max_size = 0;
+    gateway.trace_sample_rate = 0;
+    gateway.writeq_high_water = 0;
+    gateway.writeq_low_water = 0;
+    gateway.writeq_memory_limit = 0;
     gateway.auth_conn_timeout = DEFAULT_AUTH_CONNECT_TIMEOUT;
     gateway.auth_read_timeout = DEFAULT_AUTH_READ_TIMEOUT;
     gateway.auth_write_timeout = DEFAULT_AUTH_WRITE_TIMEOUT;
@@ -1282,6 +2007,214 @@ feedback_defaults()
     feedback.mac_sha1 = gateway.mac_sha1;
 }
 
+/**
+ * Check whether the servers of a service differ from the configured ones
+ *
+ * @param service The service
+ * @param servers The comma separated list of servers in the configuration
+ * @return True if the service has other servers than the configuration
+ */
+static bool
+service_servers_changed(SERVICE *service, char *servers)
+{
+    char *lasts;
+    char *s = servers ? strtok_r(servers, ",", &lasts) : NULL;
+    int n = 0;
+    int n_refs = 0;
+
+    while (s)
+    {
+        SERVER *server = server_find_by_unique_name(trim(s));
+
+        if (server == NULL || !serviceHasBackend(service, server))
+        {
+            return true;
+        }
+
+        n++;
+        s = strtok_r(NULL, ",", &lasts);
+    }
+
+    for (SERVER_REF *ref = service->dbref; ref; ref = ref->next)
+    {
+        n_refs++;
+    }
+
+    return n != n_refs;
+}
+
+/**
+ * Apply the changes of the router options, the filters and the servers of a
+ * running service
+ *
+ * @param service The service
+ * @param obj     The service configuration context
+ */
+static void
+reload_service(SERVICE *service, CONFIG_CONTEXT *obj)
+{
+    if (serviceUpdateRouterOptions(service, config_get_value(obj->parameters, "router_options")))
+    {
+        MXS_NOTICE("Router options of service '%s' changed, the routers that refresh "
+                   "their configuration use them for the new sessions.", service->name);
+    }
+
+    if (serviceUpdateFilters(service, config_get_value(obj->parameters, "filters")))
+    {
+        MXS_NOTICE("Filters of service '%s' changed, the new sessions use the new filters.",
+                   service->name);
+    }
+
+    if (service_servers_changed(service, config_get_value(obj->parameters, "servers")))
+    {
+        MXS_WARNING("The servers of service '%s' have changed. The router uses the servers "
+                    "it was started with, restart MaxScale to use the new servers.",
+                    service->name);
+    }
+}
+
+/**
+ * Start a listener that was added to the configuration or restart one that
+ * was removed and then added back
+ *
+ * @param service  The service of the listener
+ * @param obj      The listener configuration context
+ * @param protocol The protocol of the listener
+ * @param address  The address or the socket of the listener
+ * @param port     The port of the listener, 0 for a socket
+ * @return True if the listener is not running and must be created
+ */
+static bool
+reload_listener_port(SERVICE *service, CONFIG_CONTEXT *obj, char *protocol,
+                     char *address, unsigned short port)
+{
+    SERV_LISTENER *listener = serviceFindListener(service, protocol, address, port);
+
+    if (listener == NULL)
+    {
+        return true;
+    }
+
+    if (serviceRestartListener(listener))
+    {
+        MXS_NOTICE("Restarted listener '%s' of service '%s'.", obj->object, service->name);
+    }
+
+    return false;
+}
+
+/**
+ * Start the listeners that were added to the configuration
+ *
+ * @param obj The listener configuration context
+ */
+static void
+reload_listener(CONFIG_CONTEXT *obj)
+{
+    char *service_name = config_get_value(obj->parameters, "service");
+    char *protocol = config_get_value(obj->parameters, "protocol");
+    char *address = config_get_value(obj->parameters, "address");
+    char *port = config_get_value(obj->parameters, "port");
+    char *socket = config_get_value(obj->parameters, "socket");
+    SERVICE *service = service_name ? service_find(service_name) : NULL;
+
+    if (service == NULL || protocol == NULL)
+    {
+        MXS_WARNING("Listener '%s' has no running service, it is not started.", obj->object);
+        return;
+    }
+
+    bool create = (socket && reload_listener_port(service, obj, protocol, socket, 0)) ||
+                  (port && reload_listener_port(service, obj, protocol, address, atoi(port)));
+
+    if (create)
+    {
+        if (create_new_listener(obj, true) == 0)
+        {
+            MXS_NOTICE("Started new listener '%s' of service '%s'.", obj->object, service->name);
+        }
+        else
+        {
+            MXS_ERROR("Failed to start new listener '%s' of service '%s'.",
+                      obj->object, service->name);
+        }
+    }
+}
+
+/**
+ * Check whether a listener of a service is in the configuration
+ *
+ * @param context  The configuration context
+ * @param service  The service
+ * @param listener The listener
+ * @return True if a listener section defines the listener
+ */
+static bool
+listener_in_config(CONFIG_CONTEXT *context, SERVICE *service, SERV_LISTENER *listener)
+{
+    for (CONFIG_CONTEXT *obj = context; obj; obj = obj->next)
+    {
+        char *type = config_get_value(obj->parameters, "type");
+        char *service_name = config_get_value(obj->parameters, "service");
+        char *protocol = config_get_value(obj->parameters, "protocol");
+
+        if (type && strcmp(type, "listener") == 0 && service_name && protocol &&
+            strcmp(service_name, service->name) == 0 && strcmp(protocol, listener->protocol) == 0)
+        {
+            char *address = config_get_value(obj->parameters, "address");
+            char *port = config_get_value(obj->parameters, "port");
+            char *socket = config_get_value(obj->parameters, "socket");
+
+            if (listener->port == 0)
+            {
+                if (socket && listener->address && strcmp(socket, listener->address) == 0)
+                {
+                    return true;
+                }
+            }
+            else if (port && atoi(port) == listener->port &&
+                     ((address && listener->address && strcmp(address, listener->address) == 0) ||
+                      (address == NULL && listener->address == NULL)))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Stop the listeners of the running services that were removed from the
+ * configuration. The sessions that were created through them are not affected.
+ *
+ * @param context The configuration context
+ */
+static void
+stop_removed_listeners(CONFIG_CONTEXT *context)
+{
+    for (CONFIG_CONTEXT *obj = context; obj; obj = obj->next)
+    {
+        char *type = config_get_value(obj->parameters, "type");
+        SERVICE *service;
+
+        if (type && strcmp(type, "service") == 0 && (service = service_find(obj->object)))
+        {
+            for (SERV_LISTENER *listener = service->ports; listener; listener = listener->next)
+            {
+                if (!listener_in_config(context, service, listener) &&
+                    serviceStopListener(listener))
+                {
+                    MXS_NOTICE("Stopped the listener of service '%s' at %s:%d, it was "
+                               "removed from the configuration.", service->name,
+                               listener->address ? listener->address : "0.0.0.0",
+                               listener->port);
+                }
+            }
+        }
+    }
+}
+
 /**
  * Process a configuration context update and turn it into the set of object
  * we need.
@@ -1295,6 +2228,22 @@ process_config_update(CONFIG_CONTEXT *context)
     SERVICE        *service;
     SERVER         *server;
 
+    /**
+     * Create the new filters first so that the services can use them
+     */
+    for (obj = context; obj; obj = obj->next)
+    {
+        char *type = config_get_value(obj->parameters, "type");
+
+        if (type && !strcmp(type, "filter") && filter_find(obj->object) == NULL)
+        {
+            if (create_new_filter(obj) == 0)
+            {
+                MXS_NOTICE("Created new filter '%s'.", obj->object);
+            }
+        }
+    }
+
     /**
      * Process the data and create the services and servers defined
      * in the data.
@@ -1494,6 +2443,7 @@ process_config_update(CONFIG_CONTEXT *context)
                         }
                     }
 
+                    reload_service(service, obj);
                     obj->element = service;
                 }
                 else
@@ -1530,6 +2480,22 @@ process_config_update(CONFIG_CONTEXT *context)
         obj = obj->next;
     }
 
+    /**
+     * The listeners are processed after the servers so that the users of
+     * the services that are started now can be loaded from the new servers.
+     */
+    for (obj = context; obj; obj = obj->next)
+    {
+        char *type = config_get_value(obj->parameters, "type");
+
+        if (type && !strcmp(type, "listener"))
+        {
+            reload_listener(obj);
+        }
+    }
+
+    stop_removed_listeners(context);
+
     return 1;
 }
 
@@ -2227,6 +3193,83 @@ int create_new_service(CONFIG_CONTEXT *obj)
         serviceEnableRootUser(obj->element, config_truth_value(enable_root_user));
     }
 
+    char *dedicated_threads = config_get_value(obj->parameters, "dedicated_threads");
+    if (dedicated_threads)
+    {
+        char *endptr;
+        long threads = strtol(dedicated_threads, &endptr, 10);
+
+        if (*endptr == '\0' && threads >= 0 && threads <= config_threadcount())
+        {
+            service->dedicated_threads = threads;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'dedicated_threads' of service '%s': %s",
+                      obj->object, dedicated_threads);
+            error_count++;
+        }
+    }
+
+    char *max_execution_time = config_get_value(obj->parameters, "max_execution_time");
+    if (max_execution_time)
+    {
+        char *endptr;
+        long timeout = strtol(max_execution_time, &endptr, 10);
+
+        if (*max_execution_time && *endptr == '\0' && timeout >= 0 && timeout <= INT_MAX)
+        {
+            service->max_execution_time = timeout;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'max_execution_time' of service '%s': %s",
+                      obj->object, max_execution_time);
+            error_count++;
+        }
+    }
+
+    char *local_probes = config_get_value(obj->parameters, "local_probes");
+    if (local_probes && !serviceSetLocalProbes(service, local_probes))
+    {
+        error_count++;
+    }
+
+    const char *governor_params[] = {"max_active_queries", "max_active_queries_per_user",
+                                     "max_queued_queries"};
+    int governor_values[] = {0, 0, GOVERNOR_DEFAULT_MAX_QUEUED};
+
+    for (size_t i = 0; i < sizeof(governor_params) / sizeof(governor_params[0]); i++)
+    {
+        char *value = config_get_value(obj->parameters, governor_params[i]);
+        if (value)
+        {
+            char *endptr;
+            long limit = strtol(value, &endptr, 10);
+
+            if (*value && *endptr == '\0' && limit >= 0 && limit <= INT_MAX)
+            {
+                governor_values[i] = limit;
+            }
+            else
+            {
+                MXS_ERROR("Invalid value for '%s' of service '%s': %s",
+                          governor_params[i], obj->object, value);
+                error_count++;
+            }
+        }
+    }
+
+    if (governor_values[0] > 0 || governor_values[1] > 0)
+    {
+        service->governor = governor_alloc(governor_values[0], governor_values[1], governor_values[2],
+                                           config_get_value(obj->parameters, "high_priority_users"));
+        if (service->governor == NULL)
+        {
+            error_count++;
+        }
+    }
+
     char *connection_timeout = config_get_value(obj->parameters, "connection_timeout");
     if (connection_timeout)
     {
@@ -2488,6 +3531,45 @@ int create_new_server(CONFIG_CONTEXT *obj)
             }
         }
 
+        const char *persistreset = config_get_value_string(obj->parameters, "persistreset");
+        if (*persistreset)
+        {
+            if (strcmp(persistreset, "none") == 0)
+            {
+                server->persistreset = PERSIST_RESET_NONE;
+            }
+            else if (strcmp(persistreset, "change_user") == 0)
+            {
+                server->persistreset = PERSIST_RESET_CHANGE_USER;
+            }
+            else if (strcmp(persistreset, "reset_connection") == 0)
+            {
+                server->persistreset = PERSIST_RESET_CONNECTION;
+            }
+            else
+            {
+                MXS_ERROR("Invalid value for 'persistreset' for server %s: %s",
+                          server->unique_name, persistreset);
+                error_count++;
+            }
+        }
+
+        const char *compression = config_get_value_string(obj->parameters, "compression");
+        if (*compression)
+        {
+            int truth = config_truth_value((char*)compression);
+            if (truth == -1)
+            {
+                MXS_ERROR("Invalid value for 'compression' for server %s: %s",
+                          server->unique_name, compression);
+                error_count++;
+            }
+            else
+            {
+                server->compression = truth;
+            }
+        }
+
         CONFIG_PARAMETER *params = obj->parameters;
 
         server->server_ssl = make_ssl_structure(obj, false, &error_count);
@@ -2678,6 +3760,26 @@ int create_new_monitor(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj, HASHTABLE*
             }
         }
 
+        char *script_timeout = config_get_value(obj->parameters, "script_timeout");
+        if (script_timeout)
+        {
+            if (!monitorSetScriptTimeout(obj->element, atoi(script_timeout)))
+            {
+                MXS_ERROR("Failed to set script_timeout");
+                error_count++;
+            }
+        }
+
+        char *script_concurrency = config_get_value(obj->parameters, "script_max_concurrency");
+        if (script_concurrency)
+        {
+            if (!monitorSetScriptMaxConcurrency(obj->element, atoi(script_concurrency)))
+            {
+                MXS_ERROR("Failed to set script_max_concurrency");
+                error_count++;
+            }
+        }
+
         /* get the servers to monitor */
         char *s, *lasts;
         s = strtok_r(servers, ",", &lasts);
@@ -2742,8 +3844,31 @@ int create_new_listener(CONFIG_CONTEXT *obj, bool startnow)
     char *protocol = config_get_value(obj->parameters, "protocol");
     char *socket = config_get_value(obj->parameters, "socket");
     char *authenticator = config_get_value(obj->parameters, "authenticator");
+    char *accept_rate = config_get_value(obj->parameters, "accept_rate");
+    char *accept_batch = config_get_value(obj->parameters, "accept_batch");
+    int rate = accept_rate ? atoi(accept_rate) : 0;
+    int batch = accept_batch ? atoi(accept_batch) : 0;
+    char *compression = config_get_value(obj->parameters, "compression");
+    char *compression_level = config_get_value(obj->parameters, "compression_level");
+    int level = compression_level ? atoi(compression_level) : LISTENER_DEFAULT_COMPRESSION_LEVEL;
+
+    if (compression == NULL || !config_truth_value(compression))
+    {
+        level = 0;
+    }
 
-    if (service_name && protocol && (socket || port))
+    if (rate < 0 || batch < 0)
+    {
+        MXS_ERROR("Listener '%s' has a negative accept_rate or accept_batch.", obj->object);
+        error_count++;
+    }
+    else if (compression_level && (atoi(compression_level) < 1 || atoi(compression_level) > 9))
+    {
+        MXS_ERROR("Listener '%s' has an invalid compression_level '%s', "
+                  "the value must be between 1 and 9.", obj->object, compression_level);
+        error_count++;
+    }
+    else if (service_name && protocol && (socket || port))
     {
         SERVICE *service = service_find(service_name);
         if (service)
@@ -2759,7 +3884,12 @@ int create_new_listener(CONFIG_CONTEXT *obj, bool startnow)
                 }
                 else
                 {
-                    serviceAddProtocol(service, protocol, socket, 0, authenticator, ssl_info);
+                    if (serviceAddProtocol(service, protocol, socket, 0, authenticator, ssl_info))
+                    {
+                        /** The new listener is added to the head of the list */
+                        listener_set_accept_limits(service->ports, rate, batch);
+                        listener_set_compression(service->ports, level);
+                    }
                     if (startnow)
                     {
                         serviceStartProtocol(service, protocol, 0);
@@ -2779,7 +3909,12 @@ int create_new_listener(CONFIG_CONTEXT *obj, bool startnow)
                 }
                 else
                 {
-                    serviceAddProtocol(service, protocol, address, atoi(port), authenticator, ssl_info);
+                    if (serviceAddProtocol(service, protocol, address, atoi(port), authenticator, ssl_info))
+                    {
+                        /** The new listener is added to the head of the list */
+                        listener_set_accept_limits(service->ports, rate, batch);
+                        listener_set_compression(service->ports, level);
+                    }
                     if (startnow)
                     {
                         serviceStartProtocol(service, protocol, atoi(port));
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file counter_blocks.c  - Per-thread blocks of counters
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <counter_blocks.h>
+#include <skygw_debug.h>
+
+/**
+ * Allocate the block of the calling thread. A thread whose block can not be
+ * allocated is given the shared block.
+ *
+ * @param cb           The counters
+ * @param thread_block Where the block of the thread is stored
+ * @return The block of the thread
+ */
+COUNTER_BLOCK *
+counter_blocks_thread(COUNTER_BLOCKS *cb, COUNTER_BLOCK **thread_block)
+{
+    COUNTER_BLOCK *block = calloc(1, sizeof(COUNTER_BLOCK));
+
+    if (block)
+    {
+        spinlock_acquire(&cb->lock);
+        block->next = cb->blocks;
+        cb->blocks = block;
+        spinlock_release(&cb->lock);
+    }
+    else
+    {
+        block = &cb->shared;
+    }
+
+    *thread_block = block;
+    return block;
+}
+
+/**
+ * Return a chunk of a block, the chunk is allocated if it is not in use yet
+ *
+ * @param cb    The counters
+ * @param block The block
+ * @param chunk The index of the chunk
+ * @return The counters of the chunk or NULL if memory allocation failed
+ */
+int64_t *
+counter_blocks_chunk(COUNTER_BLOCKS *cb, COUNTER_BLOCK *block, int chunk)
+{
+    ss_dassert(chunk >= 0 && chunk < cb->n_chunks && cb->n_chunks <= COUNTER_BLOCK_MAX_CHUNKS);
+
+    void **slot = (void **)&block->chunks[chunk];
+    int64_t *counters = atomic_load_ptr(slot);
+
+    if (counters == NULL && (counters = calloc(cb->chunk_counters, sizeof(int64_t))) != NULL)
+    {
+        /** Another thread may have allocated the chunk of the shared block */
+        if (!atomic_cas_ptr(slot, NULL, counters))
+        {
+            free(counters);
+            counters = atomic_load_ptr(slot);
+        }
+    }
+
+    return counters;
+}
+
+/**
+ * Add the sums of consecutive counters over all threads. The counters must be
+ * in the same chunk.
+ *
+ * @param cb      The counters
+ * @param counter The first counter
+ * @param n       Number of counters
+ * @param sums    Where the sums are added
+ */
+void
+counter_blocks_sum(COUNTER_BLOCKS *cb, int counter, int n, int64_t *sums)
+{
+    int chunk = counter / cb->chunk_counters;
+    int offset = counter % cb->chunk_counters;
+
+    ss_dassert(offset + n <= cb->chunk_counters);
+
+    spinlock_acquire(&cb->lock);
+    COUNTER_BLOCK *blocks = cb->blocks;
+    spinlock_release(&cb->lock);
+
+    /** New blocks are added to the head, the rest of the list does not change */
+    for (COUNTER_BLOCK *block = blocks; block; block = block->next)
+    {
+        int64_t *counters = atomic_load_ptr((void **)&block->chunks[chunk]);
+
+        for (int i = 0; counters && i < n; i++)
+        {
+            sums[i] += counters[offset + i];
+        }
+    }
+
+    int64_t *counters = atomic_load_ptr((void **)&cb->shared.chunks[chunk]);
+
+    for (int i = 0; counters && i < n; i++)
+    {
+        sums[i] += counters[offset + i];
+    }
+}
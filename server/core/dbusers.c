@@ -31,6 +31,9 @@
  * 13/10/14     Massimiliano Pinto  Added (user@host)@db authentication
  * 04/12/14     Massimiliano Pinto  Added support for IPv$ wildcard hosts: a.%, a.%.% and a.b.%
  * 25/05/16     Massimiliano Pinto  Removed log message for duplicate entry while adding an user
+ * 14/10/16     MariaDB Corporation Added the user@host lookup index
+ * 14/10/16     MariaDB Corporation Skip the reload of unchanged users with a fingerprint
+ * 14/10/16     MariaDB Corporation Binary users cache file
  *
  * @endverbatim
  */
@@ -50,6 +53,57 @@
 #include <mysqld_error.h>
 #include <regex.h>
 #include <mysql_utils.h>
+#include <atomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** The netmasks of the hosts in the order they are matched against the client */
+static const int mysql_user_netmasks[] = {32, 24, 16, 8, 0};
+
+/** Number of the matched netmasks */
+#define MYSQL_USER_N_NETMASKS (sizeof(mysql_user_netmasks) / sizeof(mysql_user_netmasks[0]))
+
+/** Minimum number of slots in the user table of the lookup index */
+#define MYSQL_USER_INDEX_MIN_SIZE 8
+
+/**
+ * A user@host entry of the lookup index
+ */
+typedef struct mysql_user_index_host
+{
+    uint32_t addr;              /**< The network address of the host */
+    MYSQL_USER_HOST *key;       /**< The key in the users table */
+    char *auth;                 /**< The authentication data of the key */
+} MYSQL_USER_INDEX_HOST;
+
+/**
+ * The hosts of one user in the lookup index
+ */
+typedef struct mysql_user_index_user
+{
+    const char *user;                   /**< The user name, NULL for an empty slot */
+    unsigned int hash;                  /**< Hash of the user name */
+    MYSQL_USER_INDEX_HOST *hosts;       /**< The network hosts sorted by address */
+    int n_hosts;                        /**< Number of network hosts */
+    MYSQL_USER_INDEX_HOST *wildcards;   /**< The hosts with single character wildcards */
+    int n_wildcards;                    /**< Number of wildcard hosts */
+} MYSQL_USER_INDEX_USER;
+
+/**
+ * The lookup index of a MySQL users table. The index is built from the
+ * table when it is first used and it is not modified after that. If users
+ * are added to the table, a new index replaces it.
+ */
+typedef struct mysql_user_index
+{
+    int n_adds;                         /**< Value of n_adds of the table for this index */
+    unsigned int mask;                  /**< Size of the user table minus one */
+    MYSQL_USER_INDEX_USER *users;       /**< Open addressing table of the users */
+    MYSQL_USER_INDEX_HOST *hosts;       /**< All of the hosts, grouped by user */
+    struct mysql_user_index *retired;   /**< The replaced index, freed with the table */
+} MYSQL_USER_INDEX;
 
 /** Don't include the root user */
 #define USERS_QUERY_NO_ROOT " AND user.user NOT IN ('root')"
@@ -111,6 +165,24 @@
 #define MAX_QUERY_STR_LEN strlen(MYSQL_USERS_COUNT_TEMPLATE_START MYSQL_USERS_COUNT_TEMPLATE_END \
     MYSQL_USERS_DB_QUERY_TEMPLATE) + strlen(USERS_QUERY_NO_ROOT) * 2 + strlen(MYSQL57_PASSWORD) * 4 + 1
 
+/**
+ * Query template for the fingerprint of the tables the users are loaded from
+ *
+ * The row counts and the sums of the row checksums change whenever a user, a
+ * grant or a database is added, removed or modified, so the users only need to
+ * be loaded when the fingerprint differs. The parameter is the 'password'
+ * column name.
+ */
+#define MYSQL_USERS_FINGERPRINT_TEMPLATE "SELECT \
+    (SELECT CONCAT(COUNT(1), ':', COALESCE(SUM(CRC32(CONCAT_WS('@', \
+     user, host, %s, Select_priv))), 0)) FROM mysql.user), \
+    (SELECT CONCAT(COUNT(1), ':', COALESCE(SUM(CRC32(CONCAT_WS('@', \
+     user, host, db))), 0)) FROM mysql.db), \
+    (SELECT CONCAT(COUNT(1), ':', COALESCE(SUM(CRC32(CONCAT_WS('@', \
+     user, host, db, table_name))), 0)) FROM mysql.tables_priv), \
+    (SELECT CONCAT(COUNT(1), ':', COALESCE(SUM(CRC32(schema_name)), 0)) \
+     FROM INFORMATION_SCHEMA.SCHEMATA)"
+
 #define LOAD_MYSQL_DATABASE_NAMES "SELECT * \
     FROM ( (SELECT COUNT(1) AS ndbs \
     FROM INFORMATION_SCHEMA.SCHEMATA) AS tbl1, \
@@ -130,7 +202,7 @@ static void *dbusers_valueread(int fd);
 static int dbusers_valuewrite(int fd, void *value);
 static int get_all_users(SERVICE *service, USERS *users);
 static int get_databases(SERVICE *, MYSQL *);
-static int get_users(SERVICE *service, USERS *users);
+static int get_users(SERVICE *service, USERS *users, const unsigned char *fingerprint);
 static MYSQL *gw_mysql_init(void);
 static int gw_mysql_set_timeouts(MYSQL* handle);
 static bool host_has_singlechar_wildcard(const char *host);
@@ -144,6 +216,8 @@ static HASHTABLE *resource_alloc();
 static void *resource_fetch(HASHTABLE *, char *);
 static void resource_free(HASHTABLE *resource);
 static int uh_cmpfun(void* v1, void* v2);
+static int uh_rescmp(MYSQL_USER_HOST *hu1, MYSQL_USER_HOST *hu2);
+static void mysql_users_index_free(void *data);
 static int uh_hfun(void* key);
 static void *uh_keydup(void* key);
 static void uh_keyfree(void* key);
@@ -245,7 +319,7 @@ static bool host_matches_singlechar_wildcard(const char* user, const char* wild)
 int
 load_mysql_users(SERVICE *service)
 {
-    return get_users(service, service->users);
+    return get_users(service, service->users, NULL);
 }
 
 /**
@@ -269,7 +343,7 @@ reload_mysql_users(SERVICE *service)
 
     oldresources = service->resources;
 
-    i = get_users(service, newusers);
+    i = get_users(service, newusers, NULL);
 
     spinlock_acquire(&service->spin);
     oldusers = service->users;
@@ -289,7 +363,9 @@ reload_mysql_users(SERVICE *service)
 /**
  * Replace the user/passwd form mysql.user table into the service users' hashtable
  * environment.
- * The replacement is succesful only if the users' table checksums differ
+ * The replacement is succesful only if the users' table checksums differ. The
+ * users are not loaded at all if the fingerprint of the source tables has not
+ * changed since the current users were loaded.
  *
  * @param service   The current service
  * @return      -1 on any error or the number of users inserted (0 means no users at all)
@@ -300,6 +376,8 @@ replace_mysql_users(SERVICE *service)
     int i;
     USERS *newusers, *oldusers;
     HASHTABLE *oldresources;
+    unsigned char fingerprint[SHA_DIGEST_LENGTH];
+    bool has_fingerprint = false;
 
     if ((newusers = mysql_users_alloc()) == NULL)
     {
@@ -308,8 +386,16 @@ replace_mysql_users(SERVICE *service)
 
     oldresources = service->resources;
 
+    spinlock_acquire(&service->spin);
+    if (service->users && service->users->has_fingerprint)
+    {
+        memcpy(fingerprint, service->users->fingerprint, SHA_DIGEST_LENGTH);
+        has_fingerprint = true;
+    }
+    spinlock_release(&service->spin);
+
     /* load db users ad db grants */
-    i = get_users(service, newusers);
+    i = get_users(service, newusers, has_fingerprint ? fingerprint : NULL);
 
     if (i <= 0)
     {
@@ -330,6 +416,10 @@ replace_mysql_users(SERVICE *service)
         MXS_DEBUG("%lu [replace_mysql_users] users' tables not switched, checksum is the same",
                   pthread_self());
 
+        /* the users were loaded, keep the fingerprint they were loaded with */
+        memcpy(oldusers->fingerprint, newusers->fingerprint, SHA_DIGEST_LENGTH);
+        oldusers->has_fingerprint = newusers->has_fingerprint;
+
         /* free the new table */
         users_free(newusers);
         i = 0;
@@ -1231,8 +1321,62 @@ cleanup:
  * @param users     The users table into which to load the users
  * @return          -1 on any error or the number of users inserted
  */
+/**
+ * Calculate the fingerprint of the tables the users are loaded from
+ *
+ * @param service The service
+ * @param con Connection to the server the users are loaded from
+ * @param server The server
+ * @param fingerprint Buffer of SHA_DIGEST_LENGTH bytes where the fingerprint
+ * is stored
+ * @return True if the fingerprint was calculated, false if the service user
+ * cannot read all of the tables
+ */
+static bool
+get_users_fingerprint(SERVICE *service, MYSQL *con, SERVER *server, unsigned char *fingerprint)
+{
+    const char *password = strstr(server->server_string, "5.7.") ?
+                           MYSQL57_PASSWORD : MYSQL_PASSWORD;
+    char query[sizeof(MYSQL_USERS_FINGERPRINT_TEMPLATE) + sizeof(MYSQL57_PASSWORD)];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    bool rval = false;
+
+    snprintf(query, sizeof(query), MYSQL_USERS_FINGERPRINT_TEMPLATE, password);
+
+    if (mysql_query(con, query) == 0 && (result = mysql_store_result(con)))
+    {
+        if ((row = mysql_fetch_row(result)) && mysql_num_fields(result) == 4 &&
+            row[0] && row[1] && row[2] && row[3])
+        {
+            SHA_CTX ctx;
+            SHA1_Init(&ctx);
+            SHA1_Update(&ctx, server->unique_name, strlen(server->unique_name));
+            SHA1_Update(&ctx, service->enable_root ? "1" : "0", 1);
+
+            for (int i = 0; i < 4; i++)
+            {
+                SHA1_Update(&ctx, "/", 1);
+                SHA1_Update(&ctx, row[i], strlen(row[i]));
+            }
+
+            SHA1_Final(fingerprint, &ctx);
+            rval = true;
+        }
+
+        mysql_free_result(result);
+    }
+    else
+    {
+        MXS_DEBUG("%s: Failed to calculate the fingerprint of the users: %s",
+                  service->name, mysql_error(con));
+    }
+
+    return rval;
+}
+
 static int
-get_users(SERVICE *service, USERS *users)
+get_users(SERVICE *service, USERS *users, const unsigned char *fingerprint)
 {
     MYSQL *con = NULL;
     MYSQL_ROW row;
@@ -1372,6 +1516,19 @@ get_users(SERVICE *service, USERS *users)
         }
     }
 
+    /** Don't load the users if the source tables have not changed */
+    users->has_fingerprint = get_users_fingerprint(service, con, server->server,
+                                                   users->fingerprint);
+
+    if (fingerprint && users->has_fingerprint &&
+        memcmp(fingerprint, users->fingerprint, SHA_DIGEST_LENGTH) == 0)
+    {
+        MXS_DEBUG("%lu [get_users] users' tables not loaded, fingerprint is the same",
+                  pthread_self());
+        mysql_close(con);
+        return 0;
+    }
+
     char querybuffer[MAX_QUERY_STR_LEN];
     const char *usercount = get_usercount_query(server->server->server_string,
                                                 service->enable_root, querybuffer);
@@ -1691,8 +1848,8 @@ mysql_users_alloc()
         return NULL;
     }
 
-    if ((rval->data = hashtable_alloc(USERS_HASHTABLE_DEFAULT_SIZE, uh_hfun,
-                                      uh_cmpfun)) == NULL)
+    if ((rval->data = hashtable_alloc_read_mostly(USERS_HASHTABLE_DEFAULT_SIZE, uh_hfun,
+                                                  uh_cmpfun)) == NULL)
     {
         free(rval);
         return NULL;
@@ -1700,6 +1857,7 @@ mysql_users_alloc()
 
     /* set the MySQL user@host print routine for the debug interface */
     rval->usersCustomUserFormat = mysql_format_user_entry;
+    rval->usersIndexFree = mysql_users_index_free;
 
     /* the key is handled by uh_keydup/uh_keyfree.
      * the value is a (char *): it's handled by strdup/free
@@ -1753,6 +1911,331 @@ char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key)
     return hashtable_fetch(users->data, key);
 }
 
+/**
+ * Hash a user name for the lookup index
+ *
+ * @param user  The user name
+ * @return      The hash of the name
+ */
+static unsigned int mysql_users_index_hash(const char *user)
+{
+    unsigned int hash = 5381;
+
+    while (*user)
+    {
+        hash = hash * 33 + (unsigned char)*user++;
+    }
+
+    return hash;
+}
+
+/**
+ * Compare the addresses of two hosts of the lookup index
+ */
+static int mysql_users_index_hostcmp(const void *a, const void *b)
+{
+    uint32_t addr_a = ((const MYSQL_USER_INDEX_HOST*)a)->addr;
+    uint32_t addr_b = ((const MYSQL_USER_INDEX_HOST*)b)->addr;
+
+    return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
+/**
+ * Free a lookup index and the indexes it replaced
+ *
+ * @param data  The index to free
+ */
+static void mysql_users_index_free(void *data)
+{
+    MYSQL_USER_INDEX *index = (MYSQL_USER_INDEX*)data;
+
+    while (index)
+    {
+        MYSQL_USER_INDEX *retired = index->retired;
+        free(index->users);
+        free(index->hosts);
+        free(index);
+        index = retired;
+    }
+}
+
+/**
+ * Find the slot of a user in the lookup index
+ *
+ * @param index The index
+ * @param user  The user name
+ * @param hash  Hash of the user name
+ * @return      The slot of the user or the empty slot where it would be added
+ */
+static MYSQL_USER_INDEX_USER *mysql_users_index_slot(MYSQL_USER_INDEX *index,
+                                                     const char *user, unsigned int hash)
+{
+    unsigned int i = hash & index->mask;
+
+    while (index->users[i].user &&
+           (index->users[i].hash != hash || strcmp(index->users[i].user, user) != 0))
+    {
+        i = (i + 1) & index->mask;
+    }
+
+    return &index->users[i];
+}
+
+/**
+ * Build the lookup index of a MySQL users table
+ *
+ * The hosts of each user are divided into network hosts, which are found
+ * with a binary search by the address, and the rare hosts with single
+ * character wildcards that must be matched against the client hostname.
+ *
+ * @param users The users table
+ * @return      The new index or NULL on memory allocation failure
+ */
+static MYSQL_USER_INDEX *mysql_users_index_build(USERS *users)
+{
+    MYSQL_USER_INDEX *index = calloc(1, sizeof(MYSQL_USER_INDEX));
+    int n_adds = users->stats.n_adds;
+    int n_entries = hashtable_size(users->data);
+    unsigned int size = MYSQL_USER_INDEX_MIN_SIZE;
+    HASHITERATOR *iter;
+    MYSQL_USER_HOST *key;
+    int n = 0;
+
+    while (size < (unsigned int)n_entries * 2)
+    {
+        size *= 2;
+    }
+
+    if (index == NULL ||
+        (index->users = calloc(size, sizeof(MYSQL_USER_INDEX_USER))) == NULL ||
+        (index->hosts = malloc((n_entries + 1) * sizeof(MYSQL_USER_INDEX_HOST))) == NULL ||
+        (iter = hashtable_iterator(users->data)) == NULL)
+    {
+        mysql_users_index_free(index);
+        return NULL;
+    }
+
+    index->n_adds = n_adds;
+    index->mask = size - 1;
+
+    /** Count the hosts of each user */
+    while ((key = hashtable_next(iter)) && n < n_entries)
+    {
+        char *auth = hashtable_iterator_value(iter);
+        unsigned int hash = mysql_users_index_hash(key->user);
+        MYSQL_USER_INDEX_USER *user = mysql_users_index_slot(index, key->user, hash);
+
+        user->user = key->user;
+        user->hash = hash;
+
+        if (key->hostname[0])
+        {
+            user->n_wildcards++;
+        }
+        else
+        {
+            user->n_hosts++;
+        }
+
+        index->hosts[n].addr = key->ipv4.sin_addr.s_addr;
+        index->hosts[n].key = key;
+        index->hosts[n].auth = auth;
+        n++;
+    }
+
+    hashtable_iterator_free(iter);
+
+    /** Assign each user its part of the host array and sort it */
+    MYSQL_USER_INDEX_HOST *hosts = malloc((n + 1) * sizeof(MYSQL_USER_INDEX_HOST));
+
+    if (hosts == NULL)
+    {
+        mysql_users_index_free(index);
+        return NULL;
+    }
+
+    MYSQL_USER_INDEX_HOST *next = hosts;
+
+    for (unsigned int i = 0; i < size; i++)
+    {
+        MYSQL_USER_INDEX_USER *user = &index->users[i];
+
+        if (user->user)
+        {
+            user->hosts = next;
+            user->wildcards = next + user->n_hosts;
+            next += user->n_hosts + user->n_wildcards;
+            user->n_hosts = 0;
+            user->n_wildcards = 0;
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        MYSQL_USER_INDEX_HOST *host = &index->hosts[i];
+        MYSQL_USER_INDEX_USER *user = mysql_users_index_slot(index, host->key->user,
+                                                            mysql_users_index_hash(host->key->user));
+
+        if (host->key->hostname[0])
+        {
+            user->wildcards[user->n_wildcards++] = *host;
+        }
+        else
+        {
+            user->hosts[user->n_hosts++] = *host;
+        }
+    }
+
+    for (unsigned int i = 0; i < size; i++)
+    {
+        if (index->users[i].user)
+        {
+            qsort(index->users[i].hosts, index->users[i].n_hosts,
+                  sizeof(MYSQL_USER_INDEX_HOST), mysql_users_index_hostcmp);
+        }
+    }
+
+    free(index->hosts);
+    index->hosts = hosts;
+
+    return index;
+}
+
+/**
+ * Get the lookup index of a MySQL users table, building it if needed
+ *
+ * @param users The users table
+ * @return      The index or NULL on memory allocation failure
+ */
+static MYSQL_USER_INDEX *mysql_users_get_index(USERS *users)
+{
+    MYSQL_USER_INDEX *index = users->index;
+
+    while (index == NULL || index->n_adds != users->stats.n_adds)
+    {
+        MYSQL_USER_INDEX *new_index = mysql_users_index_build(users);
+
+        if (new_index == NULL)
+        {
+            return NULL;
+        }
+
+        /** The replaced index can still be in use, it is freed with the table */
+        new_index->retired = index;
+
+        if (atomic_cas_ptr(&users->index, index, new_index))
+        {
+            index = new_index;
+        }
+        else
+        {
+            new_index->retired = NULL;
+            mysql_users_index_free(new_index);
+            index = users->index;
+        }
+    }
+
+    return index;
+}
+
+/**
+ * Find the authentication data of a client from a MySQL users table
+ *
+ * The hosts of the user are matched in the same order as the authenticator
+ * used to look them up: the address of the client, its class C, B and A
+ * networks and finally the hosts that match any address. Each network is
+ * found with a binary search in the hosts of the user.
+ *
+ * @param users                 The MySQL users table
+ * @param key                   The user, the address and hostname of the client
+ *                              and the database the client connects to
+ * @param localhost_match_any   Whether 127.0.0.1 can match the wildcard hosts
+ * @return The authentication data or NULL if the client is not allowed to log in
+ */
+char *mysql_users_find(USERS *users, MYSQL_USER_HOST *key, bool localhost_match_any)
+{
+    if (key == NULL || key->user == NULL)
+    {
+        return NULL;
+    }
+
+    MYSQL_USER_INDEX *index = mysql_users_get_index(users);
+
+    if (index == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the index of the users table.");
+        return NULL;
+    }
+
+    atomic_add(&users->stats.n_fetches, 1);
+
+    MYSQL_USER_INDEX_USER *user = mysql_users_index_slot(index, key->user,
+                                                         mysql_users_index_hash(key->user));
+    uint32_t client = key->ipv4.sin_addr.s_addr;
+    int n_netmasks = MYSQL_USER_N_NETMASKS;
+
+    if (user->user == NULL)
+    {
+        return NULL;
+    }
+
+    /** Skip the wildcard hosts for localhost */
+    if (client == 0x0100007F && !localhost_match_any)
+    {
+        n_netmasks = 1;
+    }
+
+    for (int i = 0; i < n_netmasks; i++)
+    {
+        int netmask = mysql_user_netmasks[i];
+        /** The address is in network byte order, the class C network of
+         * a.b.c.d keeps the bytes a, b and c */
+        uint32_t mask = netmask == 32 ? 0xFFFFFFFF : (1U << netmask) - 1;
+        uint32_t addr = client & mask;
+        int lo = 0, hi = user->n_hosts;
+
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+
+            if (user->hosts[mid].addr < addr)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+
+        for (int j = lo; j < user->n_hosts && user->hosts[j].addr == addr; j++)
+        {
+            if (user->hosts[j].key->netmask <= netmask &&
+                uh_rescmp(key, user->hosts[j].key) == 0)
+            {
+                return user->hosts[j].auth;
+            }
+        }
+
+        if (netmask == 0)
+        {
+            for (int j = 0; j < user->n_wildcards; j++)
+            {
+                MYSQL_USER_HOST *wild = user->wildcards[j].key;
+
+                if ((key->hostname[0] == '\0' ||
+                     host_matches_singlechar_wildcard(key->hostname, wild->hostname)) &&
+                    uh_rescmp(key, wild) == 0)
+                {
+                    return user->wildcards[j].auth;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
 /**
  * The hash function we use for storing MySQL users as: users@hosts.
  * Currently only IPv4 addresses are supported
@@ -1776,6 +2259,79 @@ static int uh_hfun(void* key)
     }
 }
 
+/**
+ * Compare the database of a client to the database grants of a user@host entry
+ *
+ * @param hu1   The key of the client, the resource is the database of the client
+ * @param hu2   The key in the users table
+ * @return      0 if the client can access the database, 1 if it cannot
+ */
+static int uh_rescmp(MYSQL_USER_HOST *hu1, MYSQL_USER_HOST *hu2)
+{
+    /* if no database name was passed, auth is ok */
+    if (hu1->resource == NULL || (hu1->resource && !strlen(hu1->resource)))
+    {
+        return 0;
+    }
+    else
+    {
+        /* (1) check for no database grants at all and deny auth */
+        if (hu2->resource == NULL)
+        {
+            return 1;
+        }
+        /* (2) check for ANY database grant and allow auth */
+        if (!strlen(hu2->resource))
+        {
+            return 0;
+        }
+        /* (3) check for database name specific grant and allow auth */
+        if (hu1->resource && hu2->resource && strcmp(hu1->resource,
+                                                     hu2->resource) == 0)
+        {
+            return 0;
+        }
+
+        if (hu2->resource && strlen(hu2->resource) && strchr(hu2->resource, '%') != NULL)
+        {
+            regex_t re;
+            char db[MYSQL_DATABASE_MAXLEN * 2 + 1];
+            strcpy(db, hu2->resource);
+            int len = strlen(db);
+            char* ptr = strrchr(db, '%');
+
+            if (ptr == NULL)
+            {
+                return 1;
+            }
+
+            while (ptr)
+            {
+                memmove(ptr + 1, ptr, (len - (ptr - db)) + 1);
+                *ptr = '.';
+                *(ptr + 1) = '*';
+                len = strlen(db);
+                ptr = strrchr(db, '%');
+            }
+
+            if ((regcomp(&re, db, REG_ICASE | REG_NOSUB)))
+            {
+                return 1;
+            }
+
+            if (regexec(&re, hu1->resource, 0, NULL, 0) == 0)
+            {
+                regfree(&re);
+                return 0;
+            }
+            regfree(&re);
+        }
+
+        /* no matches, deny auth */
+        return 1;
+    }
+}
+
 /**
  * The compare function we use for compare MySQL users as: users@hosts.
  * Currently only IPv4 addresses are supported
@@ -1813,68 +2369,7 @@ static int uh_cmpfun(void* v1, void* v2)
          (!wildcard_host && (hu1->ipv4.sin_addr.s_addr == hu2->ipv4.sin_addr.s_addr) &&
           (hu1->netmask >= hu2->netmask))))
     {
-        /* if no database name was passed, auth is ok */
-        if (hu1->resource == NULL || (hu1->resource && !strlen(hu1->resource)))
-        {
-            return 0;
-        }
-        else
-        {
-            /* (1) check for no database grants at all and deny auth */
-            if (hu2->resource == NULL)
-            {
-                return 1;
-            }
-            /* (2) check for ANY database grant and allow auth */
-            if (!strlen(hu2->resource))
-            {
-                return 0;
-            }
-            /* (3) check for database name specific grant and allow auth */
-            if (hu1->resource && hu2->resource && strcmp(hu1->resource,
-                                                         hu2->resource) == 0)
-            {
-                return 0;
-            }
-
-            if (hu2->resource && strlen(hu2->resource) && strchr(hu2->resource, '%') != NULL)
-            {
-                regex_t re;
-                char db[MYSQL_DATABASE_MAXLEN * 2 + 1];
-                strcpy(db, hu2->resource);
-                int len = strlen(db);
-                char* ptr = strrchr(db, '%');
-
-                if (ptr == NULL)
-                {
-                    return 1;
-                }
-
-                while (ptr)
-                {
-                    memmove(ptr + 1, ptr, (len - (ptr - db)) + 1);
-                    *ptr = '.';
-                    *(ptr + 1) = '*';
-                    len = strlen(db);
-                    ptr = strrchr(db, '%');
-                }
-
-                if ((regcomp(&re, db, REG_ICASE | REG_NOSUB)))
-                {
-                    return 1;
-                }
-
-                if (regexec(&re, hu1->resource, 0, NULL, 0) == 0)
-                {
-                    regfree(&re);
-                    return 0;
-                }
-                regfree(&re);
-            }
-
-            /* no matches, deny auth */
-            return 1;
-        }
+        return uh_rescmp(hu1, hu2);
     }
     else
     {
@@ -2450,30 +2945,266 @@ dbusers_valueread(int fd)
     return (void *) value;
 }
 
+/** Magic number of the binary users cache file */
+#define DBUSERS_CACHE_MAGIC "MXSUSERS"
+
+/** Version of the binary users cache file */
+#define DBUSERS_CACHE_VERSION 1
+
+/** The offset of a missing string in the cache file */
+#define DBUSERS_CACHE_NULL UINT32_MAX
+
+/** The header of the binary users cache file */
+typedef struct
+{
+    char     magic[8];                       /*< DBUSERS_CACHE_MAGIC */
+    uint32_t version;                        /*< DBUSERS_CACHE_VERSION */
+    uint32_t n_entries;                      /*< Number of entries */
+    uint64_t size;                           /*< Size of the whole file */
+    unsigned char cksum[SHA_DIGEST_LENGTH];  /*< Checksum of the users table */
+} DBUSERS_CACHE_HEADER;
+
+/** One user in the binary users cache file, the strings are stored after
+ * the entries and the offsets are relative to the start of the strings */
+typedef struct
+{
+    uint32_t user;                           /*< Offset of the user */
+    uint32_t resource;                       /*< Offset of the database */
+    uint32_t password;                       /*< Offset of the password */
+    uint32_t netmask;                        /*< Netmask of the host */
+    struct sockaddr_in ipv4;                 /*< Address of the host */
+} DBUSERS_CACHE_ENTRY;
+
 /**
- * Save the dbusers data to a hashtable file
+ * Save the dbusers data to a binary cache file
+ *
+ * The file is written into a temporary file which then replaces the old one,
+ * so a partially written file is never loaded.
  *
  * @param users     The hashtable that stores the user data
  * @param filename  The filename to save the data in
- * @return      The number of entries saved
+ * @return      The number of entries saved or -1 on error
  */
 int
 dbusers_save(USERS *users, const char *filename)
 {
-    return hashtable_save(users->data, filename, dbusers_keywrite, dbusers_valuewrite);
+    int n_entries = 0;
+    size_t strings_size = 0;
+    HASHITERATOR *iter;
+    MYSQL_USER_HOST *key;
+
+    /** Calculate the size of the strings */
+    if ((iter = hashtable_iterator(users->data)) == NULL)
+    {
+        return -1;
+    }
+
+    while ((key = hashtable_next(iter)))
+    {
+        char *password = hashtable_iterator_value(iter);
+        strings_size += strlen(key->user) + 1 + strlen(password) + 1;
+
+        if (key->resource)
+        {
+            strings_size += strlen(key->resource) + 1;
+        }
+        n_entries++;
+    }
+
+    hashtable_iterator_free(iter);
+
+    size_t size = sizeof(DBUSERS_CACHE_HEADER) + n_entries * sizeof(DBUSERS_CACHE_ENTRY) + strings_size;
+    char *data = calloc(1, size);
+
+    if (data == NULL || (iter = hashtable_iterator(users->data)) == NULL)
+    {
+        free(data);
+        return -1;
+    }
+
+    DBUSERS_CACHE_HEADER *header = (DBUSERS_CACHE_HEADER *)data;
+    DBUSERS_CACHE_ENTRY *entries = (DBUSERS_CACHE_ENTRY *)(header + 1);
+    char *strings = (char *)(entries + n_entries);
+    uint32_t offset = 0;
+    int n = 0;
+
+    while ((key = hashtable_next(iter)) && n < n_entries)
+    {
+        char *password = hashtable_iterator_value(iter);
+
+        entries[n].user = offset;
+        offset += sprintf(strings + offset, "%s", key->user) + 1;
+        entries[n].password = offset;
+        offset += sprintf(strings + offset, "%s", password) + 1;
+
+        if (key->resource)
+        {
+            entries[n].resource = offset;
+            offset += sprintf(strings + offset, "%s", key->resource) + 1;
+        }
+        else
+        {
+            entries[n].resource = DBUSERS_CACHE_NULL;
+        }
+
+        entries[n].netmask = key->netmask;
+        entries[n].ipv4 = key->ipv4;
+        n++;
+    }
+
+    hashtable_iterator_free(iter);
+
+    memcpy(header->magic, DBUSERS_CACHE_MAGIC, sizeof(header->magic));
+    header->version = DBUSERS_CACHE_VERSION;
+    header->n_entries = n;
+    header->size = sizeof(DBUSERS_CACHE_HEADER) + n * sizeof(DBUSERS_CACHE_ENTRY) + offset;
+    memcpy(header->cksum, users->cksum, SHA_DIGEST_LENGTH);
+
+    /** Fewer entries than counted means the strings come right after them */
+    if (n < n_entries)
+    {
+        memmove(entries + n, strings, offset);
+    }
+
+    char tmpname[strlen(filename) + sizeof(".tmp")];
+    sprintf(tmpname, "%s.tmp", filename);
+
+    int fd = open(tmpname, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    int rval = -1;
+
+    if (fd == -1)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to open users cache file '%s': %d, %s", tmpname,
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+    else
+    {
+        bool written = write(fd, data, header->size) == (ssize_t)header->size;
+
+        if (close(fd) == 0 && written && rename(tmpname, filename) == 0)
+        {
+            rval = n;
+        }
+        else
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to write users cache file '%s': %d, %s", filename,
+                      errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+            unlink(tmpname);
+        }
+    }
+
+    free(data);
+    return rval;
+}
+
+/**
+ * Check that a string of the binary users cache file is inside the file
+ *
+ * @param strings   The strings of the file
+ * @param size      Size of the strings
+ * @param offset    Offset of the string
+ * @return True if the string is terminated inside the file
+ */
+static bool
+dbusers_cache_valid_string(const char *strings, size_t size, uint32_t offset)
+{
+    return offset < size && memchr(strings + offset, '\0', size - offset) != NULL;
 }
 
 /**
- * Load the dbusers data from a saved hashtable file
+ * Load the dbusers data from a cache file
+ *
+ * The binary cache file is mapped into memory and its entries are added
+ * directly to the users table. Cache files written with the old format of
+ * hashtable_save() are still loaded.
  *
  * @param users     The hashtable that stores the user data
  * @param filename  The filename to laod the data from
- * @return      The number of entries loaded
+ * @return      The number of entries loaded or -1 on error
  */
 int
 dbusers_load(USERS *users, const char *filename)
 {
-    return hashtable_load(users->data, filename, dbusers_keyread, dbusers_valueread);
+    int fd = open(filename, O_RDONLY);
+    struct stat statb;
+
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &statb) == -1 || statb.st_size < (off_t)sizeof(DBUSERS_CACHE_HEADER))
+    {
+        close(fd);
+        return hashtable_load(users->data, filename, dbusers_keyread, dbusers_valueread);
+    }
+
+    void *data = mmap(NULL, statb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    const DBUSERS_CACHE_HEADER *header = data;
+
+    if (memcmp(header->magic, DBUSERS_CACHE_MAGIC, sizeof(header->magic)) != 0)
+    {
+        munmap(data, statb.st_size);
+        return hashtable_load(users->data, filename, dbusers_keyread, dbusers_valueread);
+    }
+
+    const DBUSERS_CACHE_ENTRY *entries = (const DBUSERS_CACHE_ENTRY *)(header + 1);
+    const char *strings = (const char *)(entries + header->n_entries);
+    size_t entries_size = sizeof(DBUSERS_CACHE_HEADER) +
+                          (size_t)header->n_entries * sizeof(DBUSERS_CACHE_ENTRY);
+
+    if (header->version != DBUSERS_CACHE_VERSION || header->size != (uint64_t)statb.st_size ||
+        entries_size > header->size)
+    {
+        MXS_ERROR("Users cache file '%s' is not valid.", filename);
+        munmap(data, statb.st_size);
+        return -1;
+    }
+
+    size_t strings_size = header->size - entries_size;
+    int rval = 0;
+
+    for (uint32_t i = 0; i < header->n_entries; i++)
+    {
+        const DBUSERS_CACHE_ENTRY *entry = &entries[i];
+
+        if (!dbusers_cache_valid_string(strings, strings_size, entry->user) ||
+            !dbusers_cache_valid_string(strings, strings_size, entry->password) ||
+            (entry->resource != DBUSERS_CACHE_NULL &&
+             !dbusers_cache_valid_string(strings, strings_size, entry->resource)))
+        {
+            MXS_ERROR("Users cache file '%s' is not valid.", filename);
+            rval = -1;
+            break;
+        }
+
+        MYSQL_USER_HOST key;
+        key.user = (char *)strings + entry->user;
+        key.resource = entry->resource == DBUSERS_CACHE_NULL ? NULL :
+                       (char *)strings + entry->resource;
+        key.netmask = entry->netmask;
+        key.ipv4 = entry->ipv4;
+        key.hostname[0] = '\0';
+
+        rval += mysql_users_add(users, &key, (char *)strings + entry->password);
+    }
+
+    if (rval > 0)
+    {
+        memcpy(users->cksum, header->cksum, SHA_DIGEST_LENGTH);
+    }
+
+    munmap(data, statb.st_size);
+    return rval;
 }
 
 /**
@@ -59,6 +59,30 @@
  * 07/02/2016   Martin Brampton         Make dcb_read_SSL & dcb_create_SSL internal,
  *                                      further small SSL logic changes
  * 31/05/2016   Martin Brampton         Implement connection throttling
+ * 14/10/2016   MariaDB Corporation     Free DCBs are kept in free lists, one per
+ *                                      thread and a shared one, instead of
+ *                                      being searched from the list of all DCBs
+ * 14/10/2016   MariaDB Corporation     Zombies are reclaimed by epochs instead of
+ *                                      thread bitmasks
+ * 14/10/2016   MariaDB Corporation     SO_REUSEPORT listening sockets for each
+ *                                      thread, accept with accept4
+ * 14/10/2016   MariaDB Corporation     Accept rate and batch limits of listeners
+ * 14/10/2016   MariaDB Corporation     Listeners are polled by the threads of their service
+ * 14/10/2016   MariaDB Corporation     Resume the SSL sessions of backend connections,
+ *                                      count full and resumed handshakes,
+ *                                      write directly with kernel TLS
+ * 14/10/2016   MariaDB Corporation     Client SSL handshakes can be done by
+ *                                      the handshake threads
+ * 14/10/2016   MariaDB Corporation     The sockets of the threads prefer the
+ *                                      connections of the CPUs of the threads
+ * 14/10/2016   MariaDB Corporation     Diagnostics read the list of all DCBs
+ *                                      without locking, listings have pages
+ * 14/10/2016   MariaDB Corporation     Allocated DCBs are counted in the memory usage
+ * 14/10/2016   MariaDB Corporation     The epochs of the threads are on separate cache lines
+ * 14/10/2016   MariaDB Corporation     Write queues may be sent through an io_uring
+ * 14/10/2016   MariaDB Corporation     Client sockets may be busy polled
+ * 14/10/2016   MariaDB Corporation     Listeners may take over the sockets of a previous process
+ * 14/10/2016   MariaDB Corporation     Client bytes are counted in the resource usage
  *
  * @endverbatim
  */
@@ -84,22 +108,87 @@
 #include <hashtable.h>
 #include <listener.h>
 #include <hk_heartbeat.h>
+#include <maxconfig.h>
 #include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <platform.h>
+#include <memusage.h>
+#include <usage.h>
+#include <uring.h>
+#include <hot_restart.h>
+
+/** Number of free DCBs a thread keeps before returning them to the shared list */
+#define DCB_THREAD_FREE_MAX 64
 
 static  DCB             *allDCBs = NULL;        /* Diagnostics need a list of DCBs */
 static  DCB             *lastDCB = NULL;
-static  DCB             *wasfreeDCB = NULL;
-static  int             freeDCBcount = 0;
+static  DCB             *freeDCBs = NULL;       /* Free DCBs shared by all threads */
+static  thread_local DCB *thread_freeDCBs = NULL; /* Free DCBs of this thread */
+static  thread_local int thread_nfreeDCBs = 0;
 static  int             nDCBs = 0;
 static  int             maxDCBs = 0;
 static  DCB             *zombies = NULL;
 static  int             nzombies = 0;
 static  int             maxzombies = 0;
 static  SPINLOCK        dcbspin = SPINLOCK_INIT;
-static  SPINLOCK        zombiespin = SPINLOCK_INIT;
+static  SPINLOCK        zombiespin = SPINLOCK_INIT;  /* Protects the zombie markers */
+
+/**
+ * The epoch a polling thread has seen. Each thread stores its epoch on every
+ * polling cycle, so each one has a cache line of its own.
+ */
+typedef struct
+{
+    int64_t epoch;
+    char    pad[64 - sizeof(int64_t)];
+} DCB_THREAD_EPOCH;
+
+static  int64_t         zombie_epoch = 1;       /* The epoch of the newest zombie */
+static  DCB_THREAD_EPOCH *thread_epochs = NULL; /* The epoch each polling thread has seen */
+static  DCB             **thread_zombies = NULL; /* The zombies taken by each polling thread */
+static  DCB             *local_zombies = NULL;  /* The zombies when there are no polling threads */
+static  int             n_epoch_threads = 0;
+static  thread_local int accept_batch_count = 0; /* Connections accepted for the current event */
+
+/** The epoch of a thread that is not polling, it never holds back the zombies */
+#define DCB_EPOCH_INACTIVE INT64_MAX
+static  int64_t         writeq_total = 0;       /* Bytes in the write queues of all DCBs */
+static  int             n_throttled_reads = 0;  /* No. of times reading from a DCB was paused */
+
+/**
+ * The maximum number of buffers in a write queue that are written with one
+ * writev call
+ */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define DCB_WRITE_MAX_IOV IOV_MAX
+#else
+#define DCB_WRITE_MAX_IOV 1024
+#endif
+
+/**
+ * Buffers whose data is in a file are written with sendfile if they are at
+ * least this large. Smaller ones are cheaper to write from memory.
+ */
+#define DCB_SENDFILE_MIN_LEN 16384
+
+/**
+ * Size of the buffer in which small buffers are combined before they are
+ * written to an SSL connection. This is the largest payload of a TLS record.
+ */
+#define DCB_SSL_COALESCE_SIZE 16384
+
+static thread_local unsigned char *ssl_coalesce_buf = NULL;
+
+/** The limits of the adaptive read size used with direct reads */
+#define DCB_READ_SIZE_MIN 1024
+#define DCB_READ_SIZE_MAX MAX_BUFFER_SIZE
 
 static void dcb_final_free(DCB *dcb);
 static void dcb_call_callback(DCB *dcb, DCB_REASON reason);
@@ -107,7 +196,9 @@ static int  dcb_null_write(DCB *dcb, GWBUF *buf);
 static int  dcb_null_auth(DCB *dcb, SERVER *server, SESSION *session, GWBUF *buf);
 static inline int  dcb_isvalid_nolock(DCB *dcb);
 static inline DCB * dcb_find_in_list(DCB *dcb);
-static inline void dcb_process_victim_queue(DCB *listofdcb);
+static inline void dcb_process_victim_queue(DCB *listofdcb, DCB **zombielist);
+static void dcb_add_to_zombies(DCB *dcb);
+static void dcb_count_zombie();
 static void dcb_stop_polling_and_shutdown (DCB *dcb);
 static bool dcb_maybe_add_persistent(DCB *);
 static inline bool dcb_write_parameter_check(DCB *dcb, GWBUF *queue);
@@ -117,21 +208,44 @@ static int dcb_create_SSL(DCB* dcb, SSL_LISTENER *ssl);
 static int dcb_read_SSL(DCB *dcb, GWBUF **head);
 static GWBUF *dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *nsingleread);
 static GWBUF *dcb_basic_read_SSL(DCB *dcb, int *nsingleread);
+static int dcb_read_direct(DCB *dcb, GWBUF **head, int maxbytes, int nreadtotal);
 #if defined(FAKE_CODE)
 static inline void dcb_write_fake_code(DCB *dcb);
 #endif
 static void dcb_log_write_failure(DCB *dcb, GWBUF *queue, int eno);
 static inline void dcb_write_tidy_up(DCB *dcb, bool below_water);
+static void dcb_resume_throttled_reads(SESSION *session);
 static int gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing);
 static int gw_write_SSL(DCB *dcb, GWBUF *writeq, bool *stop_writing);
 static int dcb_log_errors_SSL (DCB *dcb, const char *called_by, int ret);
 static int dcb_accept_one_connection(DCB *listener, struct sockaddr *client_conn);
-static int dcb_listen_create_socket_inet(const char *config_bind);
+static int dcb_listen_create_socket_inet(const char *config_bind, bool reuseport);
+static bool dcb_listen_thread_sockets(DCB *listener, const char *config, const char *protocol_name,
+                                      int *inherited, int n_inherited);
+static void dcb_close_inherited(int *fds, int from, int to);
 static int dcb_listen_create_socket_unix(const char *config_bind);
 static int dcb_set_socket_option(int sockfd, int level, int optname, void *optval, socklen_t optlen);
 static void dcb_add_to_all_list(DCB *dcb);
 static DCB *dcb_find_free();
 static GWBUF *dcb_grab_writeq(DCB *dcb, bool first_time);
+static void dcb_writeq_written(DCB *dcb, int written, bool above_water);
+
+/**
+ * The list of all DCBs only grows and its DCBs are never freed, so the
+ * diagnostics follow it without dcbspin while new DCBs are appended. The
+ * strings a DCB refers to are freed only after every polling thread has left
+ * the epoch of the zombie, so they stay valid while a polling thread prints
+ * the DCB.
+ */
+static inline DCB *dcb_list_first()
+{
+    return atomic_load_ptr((void **)&allDCBs);
+}
+
+static inline DCB *dcb_list_next(DCB *dcb)
+{
+    return atomic_load_ptr((void **)&dcb->next);
+}
 
 size_t dcb_get_session_id(
     DCB *dcb)
@@ -189,19 +303,18 @@ DCB *
 dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
 {
     DCB *newdcb;
+    int n, max;
 
-    spinlock_acquire(&dcbspin);
     if ((newdcb = dcb_find_free()) == NULL)
     {
-        spinlock_release(&dcbspin);
         return NULL;
     }
-    nDCBs++;
-    if (nDCBs > maxDCBs)
+
+    n = atomic_add(&nDCBs, 1) + 1;
+    while (n > (max = maxDCBs) && !atomic_cas_int(&maxDCBs, max, n))
     {
-        maxDCBs = nDCBs;
+        /** Another thread updated the maximum */
     }
-    spinlock_release(&dcbspin);
 
     newdcb->dcb_chk_top = CHK_NUM_DCB;
     newdcb->dcb_chk_tail = CHK_NUM_DCB;
@@ -225,14 +338,20 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
     newdcb->evq.prev = NULL;
     newdcb->evq.pending_events = 0;
     newdcb->evq.processing = 0;
+    newdcb->evq.handoff_next = NULL;
+    newdcb->evq.handoff_events = 0;
+    newdcb->evq.handoff_queued = 0;
     spinlock_init(&newdcb->evq.eventqlock);
+    newdcb->poll_thread = -1;
+    newdcb->read_size = DCB_READ_SIZE_MIN;
 
     memset(&newdcb->stats, 0, sizeof(DCBSTATS));        // Zero the statistics
     newdcb->state = DCB_STATE_ALLOC;
-    bitmask_init(&newdcb->memdata.bitmask);
     newdcb->writeqlen = 0;
     newdcb->high_water = 0;
     newdcb->low_water = 0;
+    newdcb->writeq_full = false;
+    newdcb->read_throttled = false;
     newdcb->session = NULL;
     newdcb->server = NULL;
     newdcb->service = NULL;
@@ -256,10 +375,8 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
  * Must be called with the general DCB lock held.
  *
  * A pointer, lastDCB, is held to find the end of the list, and the new DCB
- * is linked to the end of the list.  The pointer, wasfreeDCB, that is used to
- * search for a free DCB is initialised if not already set. There cannot be
- * any free DCBs until this routine has been called at least once, so
- * wasfreeDCB will not be referred to before it is initialised.
+ * is linked to the end of the list. DCBs are never removed from the list, it
+ * is only used for diagnostics and a free DCB is found from the free lists.
  *
  * @param dcb    The DCB to be added to the list
  */
@@ -268,75 +385,93 @@ dcb_add_to_all_list(DCB *dcb)
 {
     if (allDCBs == NULL)
     {
-        allDCBs = dcb;
+        atomic_store_ptr((void **)&allDCBs, dcb);
     }
     else
     {
-        lastDCB->next = dcb;
+        atomic_store_ptr((void **)&lastDCB->next, dcb);
     }
     lastDCB = dcb;
-    if (NULL == wasfreeDCB)
-    {
-        wasfreeDCB = dcb;
-    }
 }
 
 /**
  * Find a free DCB or allocate memory for a new one.
  *
- * This routine looks to see whether there are free DCB memory areas.
- * If not, new memory is allocated, if possible, and the new DCB is added to
- * the list of all DCBs.
- *
- * Must be called with the general DCB lock held.
+ * A free DCB is taken from the free list of the calling thread, or if it is
+ * empty, from the shared free list. If both are empty, new memory is
+ * allocated, if possible, and the new DCB is added to the list of all DCBs.
  *
  * @return An available DCB or NULL if none could be allocated.
  */
 static DCB *
 dcb_find_free()
 {
-    DCB *nextdcb;
-    int loopcount = 0;
+    DCB *dcb = thread_freeDCBs;
 
-    if (freeDCBcount <= 0)
+    if (dcb)
+    {
+        thread_freeDCBs = dcb->free_next;
+        thread_nfreeDCBs--;
+    }
+    else
     {
-        DCB *newdcb;
-        if ((newdcb = calloc(1, sizeof(DCB))) == NULL)
+        spinlock_acquire(&dcbspin);
+        if ((dcb = freeDCBs) != NULL)
         {
-            return NULL;
+            freeDCBs = dcb->free_next;
         }
-        newdcb->next = NULL;
-        dcb_add_to_all_list(newdcb);
-        newdcb->dcb_is_in_use = true;
-        return newdcb;
+        spinlock_release(&dcbspin);
     }
-    /* Starting at the last place a free DCB was found, loop through the */
-    /* list of DCBs searching for one that is not in use. */
-    while (wasfreeDCB->dcb_is_in_use)
+
+    if (dcb == NULL)
     {
-        wasfreeDCB = wasfreeDCB->next;
-        if (NULL == wasfreeDCB)
+        if ((dcb = calloc(1, sizeof(DCB))) == NULL)
         {
-            loopcount++;
-            if (loopcount > 1)
-            {
-                /* Shouldn't need to loop round more than once */
-                MXS_ERROR("Find free DCB failed to find a free DCB even"
-                          " though the free count was positive");
-                return NULL;
-            }
-            wasfreeDCB = allDCBs;
+            return NULL;
         }
+        /** DCBs are never freed, they are reused from the free lists */
+        memusage_alloc(MEMUSAGE_DCB, sizeof(DCB));
+        dcb->dcb_is_in_use = true;
+        spinlock_acquire(&dcbspin);
+        dcb_add_to_all_list(dcb);
+        spinlock_release(&dcbspin);
+        return dcb;
+    }
+
+    ss_dassert(!dcb->dcb_is_in_use);
+    /* Clear the old data but not the link of the list of all DCBs, which
+     * may be followed by another thread at the same time */
+    memset(dcb, 0, offsetof(DCB, next));
+    memset((char*)dcb + offsetof(DCB, next) + sizeof(dcb->next), 0,
+           sizeof(DCB) - offsetof(DCB, next) - sizeof(dcb->next));
+    dcb->dcb_is_in_use = true;
+    return dcb;
+}
+
+/**
+ * Put a DCB that is no longer in use to a free list. The DCB is kept by the
+ * calling thread unless it already has enough free DCBs.
+ *
+ * @param dcb The DCB
+ */
+static void
+dcb_add_to_free_list(DCB *dcb)
+{
+    dcb->dcb_is_in_use = false;
+
+    if (thread_nfreeDCBs < DCB_THREAD_FREE_MAX)
+    {
+        dcb->free_next = thread_freeDCBs;
+        thread_freeDCBs = dcb;
+        thread_nfreeDCBs++;
+    }
+    else
+    {
+        spinlock_acquire(&dcbspin);
+        dcb->free_next = freeDCBs;
+        freeDCBs = dcb;
+        spinlock_release(&dcbspin);
     }
-    /* Dropping out of the loop means we have found a DCB that is not in use */
-    freeDCBcount--;
-    ss_dassert(freeDCBcount >= 0);
-    /* Clear the old data, then reset the list forward link */
-    nextdcb = wasfreeDCB->next;
-    memset(wasfreeDCB, 0, sizeof(DCB));
-    wasfreeDCB->next = nextdcb;
-    wasfreeDCB->dcb_is_in_use = true;
-    return wasfreeDCB;
 }
 
 
@@ -468,6 +603,10 @@ dcb_free_all_memory(DCB *dcb)
     {
         free(dcb->protoname);
     }
+    if (dcb->thread_fds)
+    {
+        free(dcb->thread_fds);
+    }
     if (dcb->remote)
     {
         free(dcb->remote);
@@ -485,6 +624,7 @@ dcb_free_all_memory(DCB *dcb)
     }
     if (dcb->writeq)
     {
+        atomic_add_int64(&writeq_total, -dcb->writeqlen);
         gwbuf_free(dcb->writeq);
         dcb->writeq = NULL;
     }
@@ -505,132 +645,252 @@ dcb_free_all_memory(DCB *dcb)
     {
         SSL_free(dcb->ssl);
     }
-    bitmask_free(&dcb->memdata.bitmask);
 
     /* We never free the actual DCB, it is available for reuse*/
-    spinlock_acquire(&dcbspin);
-    dcb->dcb_is_in_use = false;
-    freeDCBcount++;
-    nDCBs--;
-    spinlock_release(&dcbspin);
+    dcb_add_to_free_list(dcb);
+    atomic_add(&nDCBs, -1);
 
 }
 
+/**
+ * Allocate the zombie lists and the epochs of the polling threads
+ *
+ * Until this is called, all zombies are processed as if there were no
+ * polling threads that could refer to them.
+ *
+ * @param       n_threads       Number of polling threads
+ */
+void
+dcb_zombies_init(int n_threads)
+{
+    if (posix_memalign((void **)&thread_epochs, sizeof(DCB_THREAD_EPOCH),
+                       n_threads * sizeof(DCB_THREAD_EPOCH)) != 0 ||
+        (thread_zombies = calloc(n_threads, sizeof(DCB *))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        thread_epochs[i].epoch = DCB_EPOCH_INACTIVE;
+    }
+    n_epoch_threads = n_threads;
+}
+
+/**
+ * Called by a polling thread before it starts to poll. From now on the
+ * zombies are not freed before the thread has seen their epoch.
+ *
+ * @param       threadid        The thread ID of the caller
+ */
+void
+dcb_epoch_enter(int threadid)
+{
+    if (thread_epochs)
+    {
+        atomic_store_int64(&thread_epochs[threadid].epoch, atomic_load_int64(&zombie_epoch));
+    }
+}
+
+/**
+ * Called by a polling thread when it stops polling. The zombies of the thread
+ * are given back to the other threads.
+ *
+ * @param       threadid        The thread ID of the caller
+ */
+void
+dcb_epoch_leave(int threadid)
+{
+    if (thread_epochs)
+    {
+        atomic_store_int64(&thread_epochs[threadid].epoch, DCB_EPOCH_INACTIVE);
+
+        DCB *dcb = thread_zombies[threadid];
+        thread_zombies[threadid] = NULL;
+
+        while (dcb)
+        {
+            DCB *next = dcb->memdata.next;
+            dcb_add_to_zombies(dcb);
+            dcb = next;
+        }
+    }
+}
+
+/**
+ * Advance the zombie epoch
+ *
+ * @return The new epoch
+ */
+static inline int64_t
+dcb_next_epoch()
+{
+    return atomic_add_int64(&zombie_epoch, 1) + 1;
+}
+
+/**
+ * Count a new zombie
+ */
+static void
+dcb_count_zombie()
+{
+    int n = atomic_add(&nzombies, 1) + 1;
+    int max;
+
+    while (n > (max = maxzombies) && !atomic_cas_int(&maxzombies, max, n))
+    {
+        /** Another thread updated the maximum */
+    }
+}
+
+/**
+ * Add a DCB to the list of new zombies. The list is shared by all threads
+ * and is updated without a lock.
+ *
+ * @param       dcb     The DCB
+ */
+static void
+dcb_add_to_zombies(DCB *dcb)
+{
+    DCB *head;
+
+    do
+    {
+        head = zombies;
+        dcb->memdata.next = head;
+    }
+    while (!atomic_cas_ptr((void **)&zombies, head, dcb));
+}
+
+/**
+ * Return the oldest epoch that a running polling thread has seen
+ *
+ * @return The oldest epoch or DCB_EPOCH_INACTIVE if no thread is polling
+ */
+static int64_t
+dcb_oldest_epoch()
+{
+    int64_t oldest = DCB_EPOCH_INACTIVE;
+
+    for (int i = 0; i < n_epoch_threads; i++)
+    {
+        int64_t epoch = atomic_load_int64(&thread_epochs[i].epoch);
+
+        if (epoch < oldest)
+        {
+            oldest = epoch;
+        }
+    }
+
+    return oldest;
+}
+
 /**
  * Process the DCB zombie queue
  *
- * This routine is called by each of the polling threads with
- * the thread id of the polling thread. It must clear the bit in
- * the memdata bitmask for the polling thread that calls it. If the
- * operation of clearing this bit means that no bits are set in
- * the memdata.bitmask then the DCB is no longer able to be
- * referenced and it can be finally removed.
+ * This routine is called by each of the polling threads with the thread
+ * id of the polling thread at the end of the polling loop, when the thread
+ * no longer refers to any DCB. The thread records the current epoch and
+ * takes all new zombies to its own zombie list. The DCBs in the list whose
+ * epoch every running polling thread has seen can no longer be referenced
+ * and they are finally removed.
  *
  * @param       threadid        The thread ID of the caller
+ * @return      The zombies of the calling thread that are still waiting
  */
 DCB *
 dcb_process_zombies(int threadid)
 {
-    DCB *zombiedcb;
-    DCB *previousdcb = NULL, *nextdcb;
+    DCB **zombielist = thread_zombies ? &thread_zombies[threadid] : &local_zombies;
+    DCB *zombiedcb, *nextdcb;
+    DCB *previousdcb = NULL;
     DCB *listofdcb = NULL;
+    int64_t oldest;
+
+    if (thread_epochs)
+    {
+        atomic_store_int64(&thread_epochs[threadid].epoch, atomic_load_int64(&zombie_epoch));
+    }
 
     /**
-     * Perform a dirty read to see if there is anything in the queue.
-     * This avoids threads hitting the queue spinlock when the queue
-     * is empty. This will really help when the only entry is being
-     * freed, since the queue is updated before the expensive call to
-     * dcb_final_free.
+     * Perform a dirty read to see if there are new zombies. This avoids
+     * the atomic exchange when there are none.
      */
-    if (!zombies)
+    if (zombies && (zombiedcb = atomic_swap_ptr((void **)&zombies, NULL)))
+    {
+        while (zombiedcb)
+        {
+            nextdcb = zombiedcb->memdata.next;
+            zombiedcb->memdata.next = *zombielist;
+            *zombielist = zombiedcb;
+            zombiedcb = nextdcb;
+        }
+    }
+
+    if (*zombielist == NULL)
     {
         return NULL;
     }
 
-    /*
-     * Process the zombie queue and create a list of DCB's that can be
-     * finally freed. This processing is down under a spinlock that
-     * will prevent new entries being added to the zombie queue. Therefore
-     * we do not want to do any expensive operations under this spinlock
-     * as it will block other threads. The expensive operations will be
-     * performed on the victim queue within holding the zombie queue
-     * spinlock.
-     */
-    spinlock_acquire(&zombiespin);
-    zombiedcb = zombies;
+    oldest = dcb_oldest_epoch();
+    zombiedcb = *zombielist;
+
     while (zombiedcb)
     {
         CHK_DCB(zombiedcb);
         nextdcb = zombiedcb->memdata.next;
         /*
          * Skip processing of DCB's that are
-         * in the event queue waiting to be processed.
+         * in the event queue waiting to be processed,
+         * that another thread has handed off to
+         * the owning thread, whose SSL handshake a
+         * handshake thread is doing, that have sends in
+         * flight in an io_uring or whose epoch has not
+         * been seen by all threads.
          */
-        if (zombiedcb->evq.next || zombiedcb->evq.prev)
+        if (zombiedcb->evq.next || zombiedcb->evq.prev || DCB_HANDOFF_BUSY(zombiedcb) ||
+            DCB_SSL_ASYNC_BUSY(zombiedcb) || DCB_URING_BUSY(zombiedcb) ||
+            zombiedcb->memdata.epoch > oldest)
         {
             previousdcb = zombiedcb;
         }
         else
         {
-
-            if (bitmask_clear_without_spinlock(&zombiedcb->memdata.bitmask, threadid))
+            /**
+             * Remove the DCB from the zombie list of the thread and
+             * move it to the linked list of victim dcbs.
+             */
+            if (NULL == previousdcb)
             {
-                /**
-                 * Remove the DCB from the zombie queue
-                 * and call the final free routine for the
-                 * DCB
-                 *
-                 * zombiedcb is the DCB we are processing
-                 * previousdcb is the previous DCB on the zombie
-                 * queue or NULL if the DCB is at the head of the
-                 * queue.  Remove zombiedcb from the zombies list.
-                 */
-                if (NULL == previousdcb)
-                {
-                    zombies = zombiedcb->memdata.next;
-                }
-                else
-                {
-                    previousdcb->memdata.next = zombiedcb->memdata.next;
-                }
-
-                MXS_DEBUG("%lu [%s] Remove dcb "
-                          "%p fd %d in state %s from the "
-                          "list of zombies.",
-                          pthread_self(),
-                          __func__,
-                          zombiedcb,
-                          zombiedcb->fd,
-                          STRDCBSTATE(zombiedcb->state));
-                /*<
-                 * Move zombie dcb to linked list of victim dcbs.
-                 * The variable dcb is used to hold the last DCB
-                 * to have been added to the linked list, or NULL
-                 * if none has yet been added.  If the list
-                 * (listofdcb) is not NULL, then it follows that
-                 * dcb will also not be null.
-                 */
-                nzombies--;
-                zombiedcb->memdata.next = listofdcb;
-                listofdcb = zombiedcb;
+                *zombielist = nextdcb;
             }
             else
             {
-                /* Since we didn't remove this dcb from the zombies
-                   list, we need to advance the previous pointer */
-                previousdcb = zombiedcb;
+                previousdcb->memdata.next = nextdcb;
             }
+
+            MXS_DEBUG("%lu [%s] Remove dcb "
+                      "%p fd %d in state %s from the "
+                      "list of zombies.",
+                      pthread_self(),
+                      __func__,
+                      zombiedcb,
+                      zombiedcb->fd,
+                      STRDCBSTATE(zombiedcb->state));
+            atomic_add(&nzombies, -1);
+            zombiedcb->memdata.next = listofdcb;
+            listofdcb = zombiedcb;
         }
         zombiedcb = nextdcb;
     }
-    spinlock_release(&zombiespin);
 
     if (listofdcb)
     {
-        dcb_process_victim_queue(listofdcb);
+        dcb_process_victim_queue(listofdcb, zombielist);
     }
 
-    return zombies;
+    return *zombielist;
 }
 
 /**
@@ -638,12 +898,14 @@ dcb_process_zombies(int threadid)
  *
  * These are the DCBs that are not in use by any thread.  The corresponding
  * file descriptor is closed, the DCB marked as disconnected and the DCB
- * itself is finally freed.
+ * itself is finally freed. A DCB that is still polled is removed from the
+ * poll set and put back to the zombie list of the calling thread.
  *
  * @param       listofdcb       The first victim DCB
+ * @param       zombielist      The zombie list of the calling thread
  */
 static inline void
-dcb_process_victim_queue(DCB *listofdcb)
+dcb_process_victim_queue(DCB *listofdcb, DCB **zombielist)
 {
     DCB *dcb = listofdcb;
 
@@ -680,17 +942,12 @@ dcb_process_victim_queue(DCB *listofdcb)
                 {
                     DCB *next2dcb;
                     dcb_stop_polling_and_shutdown(dcb);
-                    spinlock_acquire(&zombiespin);
-                    bitmask_copy(&dcb->memdata.bitmask, poll_bitmask());
+                    /** Wait for the threads to pass a new epoch before the DCB is freed */
                     next2dcb = dcb->memdata.next;
-                    dcb->memdata.next = zombies;
-                    zombies = dcb;
-                    nzombies++;
-                    if (nzombies > maxzombies)
-                    {
-                        maxzombies = nzombies;
-                    }
-                    spinlock_release(&zombiespin);
+                    dcb->memdata.epoch = dcb_next_epoch();
+                    dcb->memdata.next = *zombielist;
+                    *zombielist = dcb;
+                    dcb_count_zombie();
                     dcb = next2dcb;
                     continue;
                 }
@@ -719,6 +976,12 @@ dcb_process_victim_queue(DCB *listofdcb)
             atomic_add(&dcb->server->stats.n_current, -1);
         }
 
+        /** The listening sockets of the other threads */
+        for (int i = 1; i < dcb->n_thread_fds; i++)
+        {
+            close(dcb->thread_fds[i]);
+        }
+
         if (dcb->fd > 0)
         {
             /*<
@@ -933,6 +1196,22 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
     return dcb;
 }
 
+/**
+ * Count the bytes a client sent or received in the resource usage of its user
+ *
+ * @param dcb     The DCB
+ * @param counter USAGE_BYTES_IN or USAGE_BYTES_OUT
+ * @param bytes   The number of bytes
+ */
+static inline void
+dcb_count_usage(DCB *dcb, usage_counter_t counter, int bytes)
+{
+    if (bytes > 0 && dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER && dcb->session)
+    {
+        usage_add(dcb->session, counter, bytes);
+    }
+}
+
 /**
  * General purpose read routine to read data from a socket in the
  * Descriptor Control Block and append it to a linked list of buffers.
@@ -978,6 +1257,11 @@ int dcb_read(DCB   *dcb,
         return 0;
     }
 
+    if (config_direct_reads())
+    {
+        return dcb_read_direct(dcb, head, maxbytes, nreadtotal);
+    }
+
     while (0 == maxbytes || nreadtotal < maxbytes)
     {
         int bytes_available;
@@ -998,6 +1282,7 @@ int dcb_read(DCB   *dcb,
             if (buffer)
             {
                 nreadtotal += nsingleread;
+                dcb_count_usage(dcb, USAGE_BYTES_IN, nsingleread);
                 /* <editor-fold defaultstate="collapsed" desc=" Debug Logging "> */
                 MXS_DEBUG("%lu [dcb_read] Read %d bytes from dcb %p in state %s "
                           "fd %d.",
@@ -1020,6 +1305,99 @@ int dcb_read(DCB   *dcb,
     return nreadtotal;
 }
 
+/**
+ * Read data from the DCB's socket without first querying the number of
+ * readable bytes. The data is read into buffers of an adaptive size which
+ * grows when a read fills the whole buffer and shrinks when the reads are
+ * much smaller than the buffer. The buffers are appended to the list as they
+ * are; the protocol modules split them by reference with gwbuf_split.
+ *
+ * @param dcb           The DCB to read from
+ * @param head          Pointer to linked list to append data to
+ * @param maxbytes      Maximum bytes to read (0 = no limit)
+ * @param nreadtotal    Number of bytes already in the list
+ * @return              -1 on error, otherwise the total number of bytes read
+ */
+static int
+dcb_read_direct(DCB *dcb, GWBUF **head, int maxbytes, int nreadtotal)
+{
+    while (0 == maxbytes || nreadtotal < maxbytes)
+    {
+        int bufsize = dcb->read_size;
+        GWBUF *buffer;
+
+        if (maxbytes)
+        {
+            bufsize = MIN(bufsize, maxbytes - nreadtotal);
+        }
+
+        if ((buffer = gwbuf_alloc(bufsize)) == NULL)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("%lu [dcb_read] Error : Failed to allocate read buffer "
+                      "for dcb %p fd %d, due %d, %s.",
+                      pthread_self(),
+                      dcb,
+                      dcb->fd,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+            break;
+        }
+
+        int nread = read(dcb->fd, GWBUF_DATA(buffer), bufsize);
+        dcb->stats.n_reads++;
+
+        if (nread <= 0)
+        {
+            int eno = errno;
+            gwbuf_free(buffer);
+
+            if (nread < 0 && eno != EAGAIN && eno != EWOULDBLOCK)
+            {
+                char errbuf[STRERROR_BUFLEN];
+                MXS_ERROR("%lu [dcb_read] Error : Read failed, dcb %p in state "
+                          "%s fd %d, due %d, %s.",
+                          pthread_self(),
+                          dcb,
+                          STRDCBSTATE(dcb->state),
+                          dcb->fd,
+                          eno,
+                          strerror_r(eno, errbuf, sizeof(errbuf)));
+                return nreadtotal > 0 ? nreadtotal : -1;
+            }
+            break;
+        }
+
+        dcb->last_read = hkheartbeat;
+        nreadtotal += nread;
+        dcb_count_usage(dcb, USAGE_BYTES_IN, nread);
+
+        if (nread < bufsize)
+        {
+            buffer = gwbuf_rtrim(buffer, bufsize - nread);
+        }
+        *head = gwbuf_append(*head, buffer);
+
+        if (nread == dcb->read_size)
+        {
+            /** The socket may have more data, read more at a time */
+            dcb->read_size = MIN(dcb->read_size * 2, DCB_READ_SIZE_MAX);
+        }
+        else if (nread < dcb->read_size / 4)
+        {
+            dcb->read_size = MAX(dcb->read_size / 2, DCB_READ_SIZE_MIN);
+        }
+
+        if (nread < bufsize)
+        {
+            /** The socket has been drained */
+            break;
+        }
+    }
+
+    return nreadtotal;
+}
+
 /**
  * Find the number of bytes available for the DCB's socket
  *
@@ -1203,6 +1581,7 @@ dcb_read_SSL(DCB *dcb, GWBUF **head)
     }
 
     ss_dassert(gwbuf_length(*head) == (start_length + nreadtotal));
+    dcb_count_usage(dcb, USAGE_BYTES_IN, nreadtotal);
 
     return nsingleread < 0 ? nsingleread : nreadtotal;
 }
@@ -1393,9 +1772,12 @@ dcb_write(DCB *dcb, GWBUF *queue)
      * If it did not already have data, we call the drain write queue
      * function immediately to attempt to write the data.
      */
-    atomic_add(&dcb->writeqlen, gwbuf_length(queue));
+    int len = gwbuf_length(queue);
+    atomic_add(&dcb->writeqlen, len);
+    atomic_add_int64(&writeq_total, len);
     dcb->writeq = gwbuf_append(dcb->writeq, queue);
     spinlock_release(&dcb->writeqlock);
+    dcb_count_usage(dcb, USAGE_BYTES_OUT, len);
     dcb->stats.n_buffered++;
     MXS_DEBUG("%lu [dcb_write] Append to writequeue. %d writes "
               "buffered for dcb %p in state %s fd %d",
@@ -1577,13 +1959,190 @@ dcb_log_write_failure(DCB *dcb, GWBUF *queue, int eno)
 static inline void
 dcb_write_tidy_up(DCB *dcb, bool below_water)
 {
-    if (dcb->high_water && dcb->writeqlen > dcb->high_water && below_water)
+    int64_t limit;
+
+    if (dcb->high_water && dcb->writeqlen > dcb->high_water)
+    {
+        dcb->writeq_full = true;
+
+        if (below_water)
+        {
+            atomic_add(&dcb->stats.n_high_water, 1);
+            dcb_call_callback(dcb, DCB_REASON_HIGH_WATER);
+        }
+    }
+    else if (dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER && dcb->writeqlen > dcb->low_water &&
+             (limit = config_writeq_memory_limit()) && writeq_total > limit && !dcb->writeq_full)
     {
-        atomic_add(&dcb->stats.n_high_water, 1);
-        dcb_call_callback(dcb, DCB_REASON_HIGH_WATER);
+        /**
+         * All the write queues together use too much memory. The reads for
+         * clients that have data waiting are paused until it is written.
+         */
+        dcb->writeq_full = true;
+
+        /**
+         * If the write queue was drained by another thread before the flag
+         * was set, nothing else would clear it. The atomic read makes sure
+         * that either this thread sees the drained queue or the thread
+         * draining it sees the flag.
+         */
+        if (atomic_add(&dcb->writeqlen, 0) <= dcb->low_water)
+        {
+            dcb->writeq_full = false;
+
+            if (dcb->session)
+            {
+                dcb_resume_throttled_reads(dcb->session);
+            }
+        }
     }
 }
 
+/**
+ * Check whether reading from a backend DCB must be paused because the client
+ * DCB of its session has more data waiting to be written than its high water
+ * mark allows, or because the write queues of all DCBs together exceed the
+ * configured memory limit. If so, the DCB is no longer polled for reads until
+ * the client's write queue has drained below the low water mark.
+ *
+ * @param dcb   The DCB that is about to be read
+ * @return      True if the DCB must not be read now
+ */
+bool
+dcb_throttle_read(DCB *dcb)
+{
+    DCB *client_dcb = dcb->session ? dcb->session->client_dcb : NULL;
+    bool throttle = false;
+
+    if (client_dcb && client_dcb != dcb && client_dcb->writeq_full)
+    {
+        /**
+         * The flag is set under the same lock that dcb_resume_throttled_reads
+         * takes after the client's write queue has drained, so either the
+         * drained queue is seen here or the flag is seen there.
+         */
+        bool paused = false;
+
+        spinlock_acquire(&dcb->dcb_initlock);
+        if (client_dcb->writeq_full)
+        {
+            if (!dcb->read_throttled)
+            {
+                /** Don't wake up for the data that arrives while the reads are paused */
+                poll_enable_read(dcb, false);
+                dcb->read_throttled = true;
+                paused = true;
+            }
+            throttle = true;
+        }
+        spinlock_release(&dcb->dcb_initlock);
+
+        if (paused)
+        {
+            atomic_add(&n_throttled_reads, 1);
+            MXS_DEBUG("%lu [dcb_throttle_read] Pausing reads from dcb %p, the write "
+                      "queue of client dcb %p holds %d bytes.",
+                      pthread_self(), dcb, client_dcb, client_dcb->writeqlen);
+        }
+    }
+
+    return throttle;
+}
+
+/**
+ * Return the number of bytes queued for writing in all DCBs
+ *
+ * @return      The number of bytes
+ */
+int64_t
+dcb_writeq_total()
+{
+    return writeq_total;
+}
+
+/**
+ * Sum the bytes queued for writing in the DCBs of the sessions of each of the
+ * given services. The DCB list is read without locking, so the sums are
+ * approximate.
+ *
+ * @param services The services
+ * @param bytes    The sums, one for each service
+ * @param n        Number of services
+ */
+void
+dcb_writeq_by_service(SERVICE **services, int64_t *bytes, int n)
+{
+    memset(bytes, 0, n * sizeof(*bytes));
+
+    for (DCB *dcb = dcb_list_first(); dcb; dcb = dcb_list_next(dcb))
+    {
+        SESSION *session = dcb->session;
+        int writeqlen = dcb->writeqlen;
+
+        if (dcb->dcb_is_in_use && writeqlen > 0 && session)
+        {
+            SERVICE *service = session->service;
+
+            for (int i = 0; i < n; i++)
+            {
+                if (services[i] == service)
+                {
+                    bytes[i] += writeqlen;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Return the number of times reading from a DCB has been paused because the
+ * client could not keep up with the data
+ *
+ * @return      The number of paused reads
+ */
+int
+dcb_throttled_read_count()
+{
+    return n_throttled_reads;
+}
+
+/**
+ * Resume reading from the DCBs of a session that were throttled because the
+ * write queue of the client DCB had grown too long.
+ *
+ * @param session       The session whose client DCB has drained
+ */
+static void
+dcb_resume_throttled_reads(SESSION *session)
+{
+    DCB *dcb;
+
+    spinlock_acquire(&dcbspin);
+    dcb = allDCBs;
+
+    while (dcb != NULL)
+    {
+        if (dcb->dcb_is_in_use && dcb->session == session && dcb->read_throttled)
+        {
+            spinlock_acquire(&dcb->dcb_initlock);
+            if (dcb->read_throttled)
+            {
+                dcb->read_throttled = false;
+
+                /** A read event is generated if data arrived while paused */
+                if (dcb->state == DCB_STATE_POLLING && poll_enable_read(dcb, true) != 0)
+                {
+                    poll_fake_read_event(dcb);
+                }
+            }
+            spinlock_release(&dcb->dcb_initlock);
+        }
+        dcb = dcb->next;
+    }
+    spinlock_release(&dcbspin);
+}
+
 /**
  * Drain the write queue of a DCB. This is called as part of the EPOLLOUT handling
  * of a socket and will try to send any buffered data from the write queue
@@ -1634,10 +2193,18 @@ dcb_drain_writeq(DCB *dcb)
             bool stop_writing = false;
             int written;
             /* The value put into written will be >= 0 */
-            if (dcb->ssl)
+            if (dcb->ssl && !dcb->ssl_ktls_send)
             {
                 written = gw_write_SSL(dcb, local_writeq, &stop_writing);
             }
+            else if (uring_write(dcb, local_writeq))
+            {
+                /**
+                 * The completion of the send puts the rest of the queue back
+                 * and goes on draining, the DCB stays marked as draining
+                 */
+                goto wrap_up;
+            }
             else
             {
                 written = gw_write(dcb, local_writeq, &stop_writing);
@@ -1685,14 +2252,27 @@ dcb_drain_writeq(DCB *dcb)
     dcb_call_callback(dcb, DCB_REASON_DRAINED);
 
 wrap_up:
+    dcb_writeq_written(dcb, total_written, above_water);
+    return total_written;
+}
 
-    /*
-     * If nothing has been written, the callback events cannot have occurred
-     * and there is no need to adjust the length of the write queue.
-     */
-    if (total_written)
+/**
+ * Account for bytes written from the write queue of a DCB
+ *
+ * If nothing has been written, the callback events cannot have occurred
+ * and there is no need to adjust the length of the write queue.
+ *
+ * @param dcb           The DCB
+ * @param written       Number of bytes written
+ * @param above_water   Whether the queue was above the low water mark before the write
+ */
+static void
+dcb_writeq_written(DCB *dcb, int written, bool above_water)
+{
+    if (written)
     {
-        atomic_add(&dcb->writeqlen, -total_written);
+        atomic_add(&dcb->writeqlen, -written);
+        atomic_add_int64(&writeq_total, -written);
 
         /* Check if the draining has taken us from above water to below water */
         if (above_water && dcb->writeqlen < dcb->low_water)
@@ -1701,8 +2281,72 @@ wrap_up:
             dcb_call_callback(dcb, DCB_REASON_LOW_WATER);
         }
 
+        if (dcb->writeq_full && dcb->writeqlen <= dcb->low_water)
+        {
+            dcb->writeq_full = false;
+
+            if (dcb->session)
+            {
+                dcb_resume_throttled_reads(dcb->session);
+            }
+        }
     }
-    return total_written;
+}
+
+/**
+ * Handle the completion of a send that dcb_drain_writeq left to an io_uring
+ *
+ * The written bytes are consumed and the rest of the queue is put back in
+ * front of the write queue. The draining goes on if the send wrote something
+ * or if the DCB was drained while the send was in flight, otherwise the queue
+ * waits for EPOLLOUT.
+ *
+ * @param dcb   The DCB
+ * @param queue The write queue the send was from
+ * @param res   Number of bytes written or a negative errno
+ */
+void
+dcb_uring_write_done(DCB *dcb, GWBUF *queue, int res)
+{
+    int written = res > 0 ? res : 0;
+    bool above_water = (dcb->low_water && dcb->writeqlen > dcb->low_water);
+    bool again;
+
+    if (res < 0 && res != -EAGAIN && res != -EWOULDBLOCK)
+    {
+#if !defined(SS_DEBUG)
+        if (res != -EPIPE)
+#endif
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Write to dcb %p "
+                      "in state %s fd %d failed due errno %d, %s",
+                      dcb,
+                      STRDCBSTATE(dcb->state),
+                      dcb->fd,
+                      -res,
+                      strerror_r(-res, errbuf, sizeof(errbuf)));
+        }
+    }
+
+    queue = gwbuf_consume(queue, written);
+
+    spinlock_acquire(&dcb->writeqlock);
+    dcb->writeq = gwbuf_append(queue, dcb->writeq);
+    again = res > 0 || dcb->drain_called_while_busy;
+    dcb->drain_called_while_busy = false;
+    dcb->draining_flag = false;
+    spinlock_release(&dcb->writeqlock);
+
+    dcb_writeq_written(dcb, written, above_water);
+
+    if (again && dcb->state == DCB_STATE_POLLING)
+    {
+        dcb_drain_writeq(dcb);
+    }
+
+    /** The DCB may be freed once the count is zero */
+    atomic_add(&dcb->uring_inflight, -1);
 }
 
 /**
@@ -1827,32 +2471,26 @@ dcb_close(DCB *dcb)
         if (DCB_ROLE_BACKEND_HANDLER == dcb->dcb_role && 0 == dcb->persistentstart
             && dcb->server && DCB_STATE_POLLING == dcb->state)
         {
-            /* May be a candidate for persistence, so save user name */
+            /**
+             * May be a candidate for persistence, so save user name. A pooled
+             * DCB that was not reset is still authenticated as its old user.
+             */
             char *user;
             user = session_getUser(dcb->session);
-            if (user && strlen(user) && !dcb->user)
+            if (user && strlen(user) && !dcb->user && !(dcb->flags & DCBF_RESET))
             {
                 dcb->user = strdup(user);
             }
         }
         /*<
-         * Add closing dcb to the top of the list, setting zombie marker
+         * Add closing dcb to the top of the list, setting zombie marker.
+         * A backend DCB waits for the polling threads to pass its epoch
+         * before it is removed from the poll set.
          */
         dcb->dcb_is_zombie = true;
-        dcb->memdata.next = zombies;
-        zombies = dcb;
-        nzombies++;
-        if (nzombies > maxzombies)
-        {
-            maxzombies = nzombies;
-        }
-        /*< Set bit for each maxscale thread. This should be done before
-         * the state is changed, so as to protect the DCB from premature
-         * destruction. */
-        if (dcb->server)
-        {
-            bitmask_copy(&dcb->memdata.bitmask, poll_bitmask());
-        }
+        dcb->memdata.epoch = dcb->server ? dcb_next_epoch() : 0;
+        dcb_add_to_zombies(dcb);
+        dcb_count_zombie();
     }
     spinlock_release(&zombiespin);
 }
@@ -1868,6 +2506,15 @@ static bool
 dcb_maybe_add_persistent(DCB *dcb)
 {
     int  poolcount = -1;
+    SERVER_PERSISTENT_POOL *pool = NULL;
+
+    if (dcb->server)
+    {
+        /** The DCB stays with the thread whose epoll instance it is in */
+        pool = server_persistent_pool(dcb->server, dcb->poll_thread != -1 ?
+                                      dcb->poll_thread : poll_current_thread());
+    }
+
     if (dcb->user != NULL
         && strlen(dcb->user)
         && dcb->server
@@ -1875,7 +2522,9 @@ dcb_maybe_add_persistent(DCB *dcb)
         && (dcb->server->status & SERVER_RUNNING)
         && !dcb->dcb_errhandle_called
         && !(dcb->flags & DCBF_HUNG)
-        && (poolcount = dcb_persistent_clean_count(dcb, false)) < dcb->server->persistpoolmax)
+        && !dcb->read_throttled
+        && (poolcount = dcb_persistent_clean_pool(dcb->server, pool, false)) <
+        server_persistent_pool_limit(dcb->server))
     {
         DCB_CALLBACK *loopcallback;
         MXS_DEBUG("%lu [dcb_maybe_add_persistent] Adding DCB to persistent pool, user %s.\n",
@@ -1903,10 +2552,11 @@ dcb_maybe_add_persistent(DCB *dcb)
             free(loopcallback);
         }
         spinlock_release(&dcb->cb_lock);
-        spinlock_acquire(&dcb->server->persistlock);
-        dcb->nextpersistent = dcb->server->persistent;
-        dcb->server->persistent = dcb;
-        spinlock_release(&dcb->server->persistlock);
+        spinlock_acquire(&pool->lock);
+        dcb->nextpersistent = pool->dcbs;
+        pool->dcbs = dcb;
+        pool->n_dcbs++;
+        spinlock_release(&pool->lock);
         atomic_add(&dcb->server->stats.n_persistent, 1);
         atomic_add(&dcb->server->stats.n_current, -1);
         return true;
@@ -2007,14 +2657,10 @@ void printAllDCBs()
 {
     DCB *dcb;
 
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
-    while (dcb)
+    for (dcb = dcb_list_first(); dcb; dcb = dcb_list_next(dcb))
     {
         printDCB(dcb);
-        dcb = dcb->next;
     }
-    spinlock_release(&dcbspin);
 }
 
 /**
@@ -2083,14 +2729,14 @@ dprintOneDCB(DCB *pdcb, DCB *dcb)
         dcb_printf(pdcb, "\tRole:                     %s\n", rolename);
         free(rolename);
     }
-    if (!bitmask_isallclear(&dcb->memdata.bitmask))
+    if (dcb->ssl_state == SSL_ESTABLISHED)
     {
-        char *bitmasktext = bitmask_render_readable(&dcb->memdata.bitmask);
-        if (bitmasktext)
-        {
-            dcb_printf(pdcb, "\tBitMask:                %s\n", bitmasktext);
-            free(bitmasktext);
-        }
+        dcb_printf(pdcb, "\tSSL writes:               %s\n",
+                   dcb->ssl_ktls_send ? "Kernel TLS" : "OpenSSL");
+    }
+    if (dcb->dcb_is_zombie && dcb->memdata.epoch)
+    {
+        dcb_printf(pdcb, "\tZombie epoch:             %" PRId64 "\n", dcb->memdata.epoch);
     }
     dcb_printf(pdcb, "\tStatistics:\n");
     dcb_printf(pdcb, "\t\tNo. of Reads:             %d\n", dcb->stats.n_reads);
@@ -2119,23 +2765,49 @@ dprintOneDCB(DCB *pdcb, DCB *dcb)
  */
 void
 dprintAllDCBs(DCB *pdcb)
+{
+    dprintDCBsPage(pdcb, 0, INT_MAX);
+}
+
+/**
+ * Diagnostic to print a page of the DCBs allocated in the system
+ *
+ * @param       pdcb    DCB to print results to
+ * @param       first   The index of the first DCB to print, from 0
+ * @param       count   The maximum number of DCBs to print
+ */
+void
+dprintDCBsPage(DCB *pdcb, int first, int count)
 {
     DCB *dcb;
+    int index = 0;
+    int more = 0;
 
-    spinlock_acquire(&dcbspin);
 #if SPINLOCK_PROFILE
     dcb_printf(pdcb, "DCB List Spinlock Statistics:\n");
     spinlock_stats(&dcbspin, spin_reporter, pdcb);
     dcb_printf(pdcb, "Zombie Queue Lock Statistics:\n");
     spinlock_stats(&zombiespin, spin_reporter, pdcb);
 #endif
-    dcb = allDCBs;
-    while (dcb)
+    for (dcb = dcb_list_first(); dcb; dcb = dcb_list_next(dcb))
     {
-        dprintOneDCB(pdcb, dcb);
-        dcb = dcb->next;
+        if (dcb->dcb_is_in_use)
+        {
+            if (index >= first && index - first < count)
+            {
+                dprintOneDCB(pdcb, dcb);
+            }
+            else if (index >= first)
+            {
+                more++;
+            }
+            index++;
+        }
+    }
+    if (more)
+    {
+        dcb_printf(pdcb, "%d more DCBs follow.\n", more);
     }
-    spinlock_release(&dcbspin);
 }
 
 /**
@@ -2145,29 +2817,53 @@ dprintAllDCBs(DCB *pdcb)
  */
 void
 dListDCBs(DCB *pdcb)
+{
+    dListDCBsPage(pdcb, 0, INT_MAX);
+}
+
+/**
+ * Diagnostic routine to print a page of the DCB data in a tabular form.
+ *
+ * @param       pdcb    DCB to print results to
+ * @param       first   The index of the first DCB to list, from 0
+ * @param       count   The maximum number of DCBs to list
+ */
+void
+dListDCBsPage(DCB *pdcb, int first, int count)
 {
     DCB *dcb;
+    int index = 0;
+    int more = 0;
 
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
     dcb_printf(pdcb, "Descriptor Control Blocks\n");
     dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n");
     dcb_printf(pdcb, " %-16s | %-26s | %-18s | %s\n",
                "DCB", "State", "Service", "Remote");
     dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n");
-    while (dcb)
+    for (dcb = dcb_list_first(); dcb; dcb = dcb_list_next(dcb))
     {
         if (dcb->dcb_is_in_use && dcb->state == DCB_STATE_POLLING)
         {
-            dcb_printf(pdcb, " %-16p | %-26s | %-18s | %s\n",
-                       dcb, gw_dcb_state2string(dcb->state),
-                       ((dcb->session && dcb->session->service) ? dcb->session->service->name : ""),
-                       (dcb->remote ? dcb->remote : ""));
+            if (index >= first && index - first < count)
+            {
+                dcb_printf(pdcb, " %-16p | %-26s | %-18s | %s\n",
+                           dcb, gw_dcb_state2string(dcb->state),
+                           ((dcb->session && dcb->session->service) ? dcb->session->service->name : ""),
+                           (dcb->remote ? dcb->remote : ""));
+            }
+            else if (index >= first)
+            {
+                more++;
+            }
+            index++;
         }
-        dcb = dcb->next;
     }
-    dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n\n");
-    spinlock_release(&dcbspin);
+    dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n");
+    if (more)
+    {
+        dcb_printf(pdcb, "%d more DCBs follow.\n", more);
+    }
+    dcb_printf(pdcb, "\n");
 }
 
 /**
@@ -2177,31 +2873,56 @@ dListDCBs(DCB *pdcb)
  */
 void
 dListClients(DCB *pdcb)
+{
+    dListClientsPage(pdcb, 0, INT_MAX);
+}
+
+/**
+ * Diagnostic routine to print a page of the client DCB data in a tabular form.
+ *
+ * @param       pdcb    DCB to print results to
+ * @param       first   The index of the first client to list, from 0
+ * @param       count   The maximum number of clients to list
+ */
+void
+dListClientsPage(DCB *pdcb, int first, int count)
 {
     DCB *dcb;
+    int index = 0;
+    int more = 0;
 
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
     dcb_printf(pdcb, "Client Connections\n");
     dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n");
     dcb_printf(pdcb, " %-15s | %-16s | %-20s | %s\n",
                "Client", "DCB", "Service", "Session");
     dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n");
-    while (dcb)
+    for (dcb = dcb_list_first(); dcb; dcb = dcb_list_next(dcb))
     {
+        SESSION *session = dcb->session;
+
         if (dcb->dcb_is_in_use && dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER &&
-            dcb->state == DCB_STATE_POLLING)
+            dcb->state == DCB_STATE_POLLING && session)
         {
-            dcb_printf(pdcb, " %-15s | %16p | %-20s | %10p\n",
-                       (dcb->remote ? dcb->remote : ""),
-                       dcb, (dcb->session->service ?
-                             dcb->session->service->name : ""),
-                       dcb->session);
+            if (index >= first && index - first < count)
+            {
+                dcb_printf(pdcb, " %-15s | %16p | %-20s | %10p\n",
+                           (dcb->remote ? dcb->remote : ""),
+                           dcb, (session->service ? session->service->name : ""),
+                           session);
+            }
+            else if (index >= first)
+            {
+                more++;
+            }
+            index++;
         }
-        dcb = dcb->next;
     }
-    dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n\n");
-    spinlock_release(&dcbspin);
+    dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n");
+    if (more)
+    {
+        dcb_printf(pdcb, "%d more clients follow.\n", more);
+    }
+    dcb_printf(pdcb, "\n");
 }
 
 
@@ -2399,6 +3120,10 @@ void dcb_hashtable_stats(
  * linked from the DCB. All communication is encrypted and done via the SSL
  * structure. Data is written from the DCB write queue.
  *
+ * If the first buffers of the write queue are small, they are combined into
+ * one buffer so that they are sent in a single TLS record. A write that has
+ * to be retried is repeated with the same data at the start of the queue.
+ *
  * @param dcb           The DCB having an SSL connection
  * @param writeq        A buffer list containing the data to be written
  * @param stop_writing  Set to true if the caller should stop writing, false otherwise
@@ -2408,8 +3133,31 @@ static int
 gw_write_SSL(DCB *dcb, GWBUF *writeq, bool *stop_writing)
 {
     int written;
+    void *buf = GWBUF_DATA(writeq);
+    int nbytes = GWBUF_LENGTH(writeq);
+
+    if (nbytes < DCB_SSL_COALESCE_SIZE && writeq->next)
+    {
+        if (ssl_coalesce_buf == NULL)
+        {
+            ssl_coalesce_buf = (unsigned char*)malloc(DCB_SSL_COALESCE_SIZE);
+        }
+
+        if (ssl_coalesce_buf)
+        {
+            nbytes = 0;
 
-    written = SSL_write(dcb->ssl, GWBUF_DATA(writeq), GWBUF_LENGTH(writeq));
+            for (GWBUF *b = writeq; b && nbytes < DCB_SSL_COALESCE_SIZE; b = b->next)
+            {
+                int len = MIN(GWBUF_LENGTH(b), DCB_SSL_COALESCE_SIZE - nbytes);
+                memcpy(ssl_coalesce_buf + nbytes, GWBUF_DATA(b), len);
+                nbytes += len;
+            }
+            buf = ssl_coalesce_buf;
+        }
+    }
+
+    written = SSL_write(dcb->ssl, buf, nbytes);
 
     *stop_writing = false;
     switch ((SSL_get_error(dcb->ssl, written)))
@@ -2461,9 +3209,44 @@ gw_write_SSL(DCB *dcb, GWBUF *writeq, bool *stop_writing)
     return written > 0 ? written : 0;
 }
 
+/**
+ * Write a file range to a DCB with sendfile
+ *
+ * @param dcb           The DCB to write to
+ * @param file_fd       The file to send
+ * @param offset        File offset of the data
+ * @param nbytes        Number of bytes to send
+ * @param stop_writing  Set to true if the caller should stop writing, false otherwise
+ * @return              Number of written bytes
+ */
+static int
+gw_sendfile(DCB *dcb, int file_fd, off_t offset, size_t nbytes, bool *stop_writing)
+{
+    ssize_t written = sendfile(dcb->fd, file_fd, &offset, nbytes);
+    int saved_errno = errno;
+
+    *stop_writing = written < 0;
+
+    if (written < 0 && saved_errno != EAGAIN && saved_errno != EWOULDBLOCK &&
+        saved_errno != EPIPE)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Sendfile to dcb %p in state %s fd %d failed due errno %d, %s",
+                  dcb, STRDCBSTATE(dcb->state), dcb->fd, saved_errno,
+                  strerror_r(saved_errno, errbuf, sizeof(errbuf)));
+    }
+
+    return written > 0 ? written : 0;
+}
+
 /**
  * Write data to a DCB. The data is taken from the DCB's write queue.
  *
+ * Up to DCB_WRITE_MAX_IOV buffers of the write queue are written with a
+ * single writev call. The written bytes may end in the middle of a buffer.
+ * A large buffer whose data is in a file is sent with sendfile once the
+ * buffers in front of it have been written.
+ *
  * @param dcb           The DCB to write buffer
  * @param writeq        A buffer list containing the data to be written
  * @param stop_writing  Set to true if the caller should stop writing, false otherwise
@@ -2477,6 +3260,32 @@ gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing)
     size_t nbytes = GWBUF_LENGTH(writeq);
     void *buf = GWBUF_DATA(writeq);
     int saved_errno;
+    struct iovec iov[DCB_WRITE_MAX_IOV];
+    int iovcnt = 0;
+    size_t total = 0;
+    int file_fd;
+    off_t offset;
+
+    if (nbytes >= DCB_SENDFILE_MIN_LEN && gwbuf_get_file_range(writeq, &file_fd, &offset))
+    {
+        return gw_sendfile(dcb, file_fd, offset, nbytes, stop_writing);
+    }
+
+    for (GWBUF *b = writeq; b && iovcnt < DCB_WRITE_MAX_IOV && total < SSIZE_MAX / 2; b = b->next)
+    {
+        if (GWBUF_LENGTH(b) >= DCB_SENDFILE_MIN_LEN && gwbuf_get_file_range(b, &file_fd, &offset))
+        {
+            break;
+        }
+
+        if (GWBUF_LENGTH(b) > 0)
+        {
+            iov[iovcnt].iov_base = GWBUF_DATA(b);
+            iov[iovcnt].iov_len = GWBUF_LENGTH(b);
+            total += GWBUF_LENGTH(b);
+            iovcnt++;
+        }
+    }
 
     errno = 0;
 
@@ -2494,12 +3303,14 @@ gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing)
     }
     else if (fd > 0)
     {
-        written = write(fd, buf, nbytes);
+        written = writev(fd, iov, iovcnt);
+        dcb->stats.n_writes++;
     }
 #else
     if (fd > 0)
     {
-        written = write(fd, buf, nbytes);
+        written = writev(fd, iov, iovcnt);
+        dcb->stats.n_writes++;
     }
 #endif /* FAKE_CODE */
 
@@ -2750,9 +3561,7 @@ dcb_isvalid(DCB *dcb)
 
     if (dcb)
     {
-        spinlock_acquire(&dcbspin);
         rval = dcb_isvalid_nolock(dcb);
-        spinlock_release(&dcbspin);
     }
 
     return rval;
@@ -2770,10 +3579,10 @@ dcb_find_in_list (DCB *dcb)
     DCB *ptr = NULL;
     if (dcb)
     {
-        ptr = allDCBs;
+        ptr = dcb_list_first();
         while (ptr && (false == ptr->dcb_is_in_use || ptr != dcb))
         {
-            ptr = ptr->next;
+            ptr = dcb_list_next(ptr);
         }
     }
     return ptr;
@@ -2781,7 +3590,6 @@ dcb_find_in_list (DCB *dcb)
 
 /**
  * Check the passed DCB to ensure it is in the list of allDCBS.
- * Requires that the DCB list is already locked before call.
  *
  * @param       dcb     The DCB to check
  * @return      1 if the DCB is in the list, otherwise 0
@@ -2924,60 +3732,83 @@ dcb_persistent_clean_count(DCB *dcb, bool cleanall)
     if (dcb && dcb->server)
     {
         SERVER *server = dcb->server;
-        DCB *previousdcb = NULL;
-        DCB *persistentdcb, *nextdcb;
-        DCB *disposals = NULL;
 
         CHK_SERVER(server);
-        spinlock_acquire(&server->persistlock);
-        persistentdcb = server->persistent;
-        while (persistentdcb)
-        {
-            CHK_DCB(persistentdcb);
-            nextdcb = persistentdcb->nextpersistent;
-            if (cleanall
-                || persistentdcb-> dcb_errhandle_called
-                || count >= server->persistpoolmax
-                || persistentdcb->server == NULL
-                || !(persistentdcb->server->status & SERVER_RUNNING)
-                || (time(NULL) - persistentdcb->persistentstart) > server->persistmaxtime)
+        for (int i = 0; i < server->n_persistent_pools; i++)
+        {
+            count += dcb_persistent_clean_pool(server, &server->persistent[i], cleanall);
+        }
+    }
+    return count;
+}
+
+/**
+ * Check the persistent pool of one thread for expiry or excess size and count
+ *
+ * @param server        The server the pool belongs to
+ * @param pool          The pool to check
+ * @param cleanall      Boolean, if true the whole pool is cleared
+ * @return              A count of the DCBs remaining in the pool
+ */
+int
+dcb_persistent_clean_pool(SERVER *server, SERVER_PERSISTENT_POOL *pool, bool cleanall)
+{
+    int count = 0;
+    int limit = server_persistent_pool_limit(server);
+    DCB *previousdcb = NULL;
+    DCB *persistentdcb, *nextdcb;
+    DCB *disposals = NULL;
+
+    spinlock_acquire(&pool->lock);
+    persistentdcb = pool->dcbs;
+    while (persistentdcb)
+    {
+        CHK_DCB(persistentdcb);
+        nextdcb = persistentdcb->nextpersistent;
+        if (cleanall
+            || persistentdcb-> dcb_errhandle_called
+            || count >= limit
+            || persistentdcb->server == NULL
+            || !(persistentdcb->server->status & SERVER_RUNNING)
+            || (time(NULL) - persistentdcb->persistentstart) > server->persistmaxtime)
+        {
+            /* Remove from persistent pool */
+            if (previousdcb)
             {
-                /* Remove from persistent pool */
-                if (previousdcb)
-                {
-                    previousdcb->nextpersistent = nextdcb;
-                }
-                else
-                {
-                    server->persistent = nextdcb;
-                }
-                /* Add removed DCBs to disposal list for processing outside spinlock */
-                persistentdcb->nextpersistent = disposals;
-                disposals = persistentdcb;
-                atomic_add(&server->stats.n_persistent, -1);
+                previousdcb->nextpersistent = nextdcb;
             }
             else
             {
-                count++;
-                previousdcb = persistentdcb;
+                pool->dcbs = nextdcb;
             }
-            persistentdcb = nextdcb;
+            /* Add removed DCBs to disposal list for processing outside spinlock */
+            persistentdcb->nextpersistent = disposals;
+            disposals = persistentdcb;
+            pool->n_evictions++;
+            atomic_add(&server->stats.n_persistent, -1);
+        }
+        else
+        {
+            count++;
+            previousdcb = persistentdcb;
         }
-        server->persistmax = MAX(server->persistmax, count);
-        spinlock_release(&server->persistlock);
-        /** Call possible callback for this DCB in case of close */
-        while (disposals)
+        persistentdcb = nextdcb;
+    }
+    pool->n_dcbs = count;
+    spinlock_release(&pool->lock);
+    /** Call possible callback for this DCB in case of close */
+    while (disposals)
+    {
+        nextdcb = disposals->nextpersistent;
+        disposals->persistentstart = -1;
+        if (DCB_STATE_POLLING == disposals->state)
         {
-            nextdcb = disposals->nextpersistent;
-            disposals->persistentstart = -1;
-            if (DCB_STATE_POLLING == disposals->state)
-            {
-                dcb_stop_polling_and_shutdown(disposals);
-            }
-            dcb_close(disposals);
-            disposals = nextdcb;
+            dcb_stop_polling_and_shutdown(disposals);
         }
+        dcb_close(disposals);
+        disposals = nextdcb;
     }
+    server->persistmax = MAX(server->persistmax, server->stats.n_persistent);
     return count;
 }
 
@@ -3065,15 +3896,67 @@ dcb_create_SSL(DCB* dcb, SSL_LISTENER *ssl)
         return -1;
     }
 
+    /** Retried writes may come from the coalescing buffer, see gw_write_SSL */
+    SSL_set_mode(dcb->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
     return 0;
 }
 
+/**
+ * Record a completed SSL handshake. A new session of a backend connection
+ * is kept so that the next connection to the same server can resume it.
+ *
+ * @param dcb           The DCB whose handshake completed
+ * @param ssl           The SSL configuration of the listener or the server
+ * @param is_client     True if MaxScale is the client of the connection
+ */
+static void
+dcb_SSL_handshake_done(DCB *dcb, SSL_LISTENER *ssl, bool is_client)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+    /**
+     * If the kernel encrypts the writes, the socket can be written like
+     * one without SSL. The reads still go through OpenSSL as the socket
+     * may also receive records that are not application data.
+     */
+    dcb->ssl_ktls_send = BIO_get_ktls_send(SSL_get_wbio(dcb->ssl));
+#endif
+
+    if (SSL_session_reused(dcb->ssl))
+    {
+        atomic_add(&ssl->n_resumed, 1);
+    }
+    else
+    {
+        atomic_add(&ssl->n_handshakes, 1);
+
+        SSL_SESSION *session;
+
+        if (is_client && (session = SSL_get1_session(dcb->ssl)) != NULL)
+        {
+            spinlock_acquire(&ssl->session_lock);
+            SSL_SESSION *old = ssl->session;
+            ssl->session = session;
+            spinlock_release(&ssl->session_lock);
+
+            if (old)
+            {
+                SSL_SESSION_free(old);
+            }
+        }
+    }
+}
+
 /**
  * Accept a SSL connection and do the SSL authentication handshake.
  * This function accepts a client connection to a DCB. It assumes that the SSL
  * structure has the underlying method of communication set and this method is ready
  * for usage. It then proceeds with the SSL handshake and stops only if an error
  * occurs or the client has not yet written enough data to complete the handshake.
+ *
+ * When the handshake threads are running, the handshake is queued to them and
+ * the function returns 0. The thread fakes a read event for the DCB when the
+ * handshake completes and a hangup event when it fails.
  * @param dcb DCB which should accept the SSL connection
  * @return 1 if the handshake was successfully completed, 0 if the handshake is
  * still ongoing and another call to dcb_SSL_accept should be made or -1 if an
@@ -3081,16 +3964,32 @@ dcb_create_SSL(DCB* dcb, SSL_LISTENER *ssl)
  */
 int dcb_accept_SSL(DCB* dcb)
 {
-    int ssl_rval;
-    char *remote;
-    char *user;
-
     if ((NULL == dcb->listener || NULL == dcb->listener->ssl) ||
         (NULL == dcb->ssl && dcb_create_SSL(dcb, dcb->listener->ssl) != 0))
     {
         return -1;
     }
 
+    if (ssl_handshake_submit(dcb))
+    {
+        return 0;
+    }
+
+    return dcb_accept_SSL_handshake(dcb);
+}
+
+/**
+ * Do the SSL handshake of a client connection in the calling thread. The SSL
+ * structure of the DCB must have been created.
+ * @param dcb DCB which should accept the SSL connection
+ * @return As dcb_accept_SSL
+ */
+int dcb_accept_SSL_handshake(DCB* dcb)
+{
+    int ssl_rval;
+    char *remote;
+    char *user;
+
     remote = dcb->remote ? dcb->remote : "";
     user = dcb->user ? dcb->user : "";
 
@@ -3102,6 +4001,7 @@ int dcb_accept_SSL(DCB* dcb)
             MXS_DEBUG("SSL_accept done for %s@%s", user, remote);
             dcb->ssl_state = SSL_ESTABLISHED;
             dcb->ssl_read_want_write = false;
+            dcb_SSL_handshake_done(dcb, dcb->listener->ssl, false);
             return 1;
 
         case SSL_ERROR_WANT_READ:
@@ -3168,6 +4068,19 @@ int dcb_connect_SSL(DCB* dcb)
         ss_dassert((NULL != dcb->server) && (NULL != dcb->server->server_ssl));
         return -1;
     }
+
+    if (dcb->ssl_state != SSL_HANDSHAKE_REQUIRED)
+    {
+        /** Resume the session of an earlier connection to the same server */
+        SSL_LISTENER *ssl = dcb->server->server_ssl;
+
+        spinlock_acquire(&ssl->session_lock);
+        if (ssl->session)
+        {
+            SSL_set_session(dcb->ssl, ssl->session);
+        }
+        spinlock_release(&ssl->session_lock);
+    }
     dcb->ssl_state = SSL_HANDSHAKE_REQUIRED;
     ssl_rval = SSL_connect(dcb->ssl);
     switch (SSL_get_error(dcb->ssl, ssl_rval))
@@ -3176,6 +4089,7 @@ int dcb_connect_SSL(DCB* dcb)
             MXS_DEBUG("SSL_connect done for %s", dcb->remote);
             dcb->ssl_state = SSL_ESTABLISHED;
             dcb->ssl_read_want_write = false;
+            dcb_SSL_handshake_done(dcb, dcb->server->server_ssl, true);
             return_code = 1;
             break;
 
@@ -3252,9 +4166,38 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
     socklen_t optlen = sizeof(sendbuf);
     char errbuf[STRERROR_BUFLEN];
 
-    if ((c_sock = dcb_accept_one_connection(listener, (struct sockaddr *)&client_conn)) >= 0)
+    if (listener->listener && (listener->listener->accept_rate || listener->listener->accept_batch))
+    {
+        SERV_LISTENER *port = listener->listener;
+        int delay = listener_accept_delay(port);
+
+        if (delay == 0 && port->accept_batch && accept_batch_count >= port->accept_batch)
+        {
+            /** Let the other events be processed before accepting more */
+            delay = 1;
+        }
+
+        if (delay > 0)
+        {
+            /** The rest of the connections wait in the backlog of the socket */
+            accept_batch_count = 0;
+            listener_resume_accept(port, delay);
+            return NULL;
+        }
+    }
+
+    if ((c_sock = dcb_accept_one_connection(listener, (struct sockaddr *)&client_conn)) < 0)
+    {
+        accept_batch_count = 0;
+    }
+    else
     {
-        listener->stats.n_accepts++;
+        accept_batch_count++;
+        if (listener->listener)
+        {
+            listener_accepted(listener->listener);
+        }
+        atomic_add(&listener->stats.n_accepts, 1);
 #if defined(SS_DEBUG)
         MXS_DEBUG("%lu [gw_MySQLAccept] Accepted fd %d.",
                   pthread_self(),
@@ -3279,7 +4222,8 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
             MXS_ERROR("Failed to set socket options. Error %d: %s",
                       errno, strerror_r(errno, errbuf, sizeof(errbuf)));
         }
-        setnonblocking(c_sock);
+
+        dcb_set_busy_poll(c_sock);
 
         client_dcb = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, listener->listener);
 
@@ -3296,6 +4240,8 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
             client_dcb->service = listener->session->service;
             client_dcb->session = session_set_dummy(client_dcb);
             client_dcb->fd = c_sock;
+            client_dcb->high_water = config_writeq_high_water();
+            client_dcb->low_water = config_writeq_low_water();
 
             // get client address
             if (((struct sockaddr *)&client_conn)->sa_family == AF_UNIX)
@@ -3377,6 +4323,14 @@ static int
 dcb_accept_one_connection(DCB *listener, struct sockaddr *client_conn)
 {
     int c_sock;
+    int listener_fd = listener->fd;
+    int thread_id = poll_current_thread();
+
+    /** With SO_REUSEPORT, each thread accepts from a socket of its own */
+    if (thread_id >= 0 && thread_id < listener->n_thread_fds)
+    {
+        listener_fd = listener->thread_fds[thread_id];
+    }
 
     /* Try up to 10 times to get a file descriptor by use of accept */
     for (int i = 0; i < 10; i++)
@@ -3396,10 +4350,11 @@ dcb_accept_one_connection(DCB *listener, struct sockaddr *client_conn)
             fail_accept_errno = 0;
 #endif /* FAKE_CODE */
 
-            /* new connection from client */
-            c_sock = accept(listener->fd,
-                            client_conn,
-                            &client_len);
+            /* new connection from client, already in non-blocking mode */
+            c_sock = accept4(listener_fd,
+                             client_conn,
+                             &client_len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
             eno = errno;
             errno = 0;
 #if defined(FAKE_CODE)
@@ -3483,15 +4438,33 @@ int
 dcb_listen(DCB *listener, const char *config, const char *protocol_name)
 {
     int listener_socket;
+    bool reuseport = false;
+    int *inherited = NULL;
+    int n_inherited = 0;
 
     listener->fd = -1;
-    if (strchr(config, '/'))
+#ifdef SO_REUSEPORT
+    reuseport = !strchr(config, '/') && config_listener_reuseport() &&
+        config_thread_event_queues() && config_threadcount() > 1;
+#endif
+    if (hot_restart_take_listener(config, &inherited, &n_inherited))
+    {
+        /** The socket of the previous process keeps its queued connections */
+        MXS_NOTICE("Took over the listening socket at %s", config);
+        listener_socket = inherited[0];
+
+        if (!reuseport)
+        {
+            dcb_close_inherited(inherited, 1, n_inherited);
+        }
+    }
+    else if (strchr(config, '/'))
     {
         listener_socket = dcb_listen_create_socket_unix(config);
     }
     else
     {
-        listener_socket = dcb_listen_create_socket_inet(config);
+        listener_socket = dcb_listen_create_socket_inet(config, reuseport);
     }
     if (listener_socket < 0)
     {
@@ -3514,6 +4487,8 @@ dcb_listen(DCB *listener, const char *config, const char *protocol_name)
                   errno,
                   strerror_r(errno, errbuf, sizeof(errbuf)));
         close(listener_socket);
+        dcb_close_inherited(inherited, 1, n_inherited);
+        free(inherited);
         return -1;
     }
 
@@ -3522,6 +4497,17 @@ dcb_listen(DCB *listener, const char *config, const char *protocol_name)
     // assign listener_socket to dcb
     listener->fd = listener_socket;
 
+    if (reuseport && !dcb_listen_thread_sockets(listener, config, protocol_name,
+                                                inherited, n_inherited))
+    {
+        close(listener_socket);
+        listener->fd = -1;
+        free(inherited);
+        return -1;
+    }
+
+    free(inherited);
+
     // add listening socket to poll structure
     if (poll_add_dcb(listener) != 0)
     {
@@ -3535,6 +4521,134 @@ dcb_listen(DCB *listener, const char *config, const char *protocol_name)
     return 0;
 }
 
+/**
+ * @brief Create a listening socket for each polling thread
+ *
+ * The threads are the ones of the thread group of the service of the
+ * listener. The first socket is the one already in the listener DCB. The other
+ * sockets are bound to the same address with SO_REUSEPORT, so that the
+ * kernel distributes the new connections over them. When the threads are
+ * bound to CPUs, each socket is marked with the CPU of its thread so that
+ * the kernel gives it the connections whose packets were received on that
+ * CPU, keeping the processing of a connection on one NUMA node.
+ *
+ * @param listener Listener DCB whose first socket is listening
+ * @param config Configuration for port to listen on
+ * @param protocol_name Name of protocol that is listening
+ * @return True if all sockets are listening
+ */
+static bool
+dcb_listen_thread_sockets(DCB *listener, const char *config, const char *protocol_name,
+                          int *inherited, int n_inherited)
+{
+    int first;
+    int n_fds = poll_listener_threads(listener, &first);
+    int *fds = malloc(n_fds * sizeof(int));
+
+    if (fds == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the listening sockets of '%s'.", config);
+        dcb_close_inherited(inherited, 1, n_inherited);
+        return false;
+    }
+
+    fds[0] = listener->fd;
+
+    /** The connections queued in the sockets of extra threads are lost */
+    dcb_close_inherited(inherited, n_fds, n_inherited);
+
+    for (int i = 1; i < n_fds; i++)
+    {
+        if (i < n_inherited)
+        {
+            fds[i] = inherited[i];
+        }
+        else if ((fds[i] = dcb_listen_create_socket_inet(config, true)) < 0 ||
+                 listen(fds[i], INT_MAX) != 0)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to start listening on '%s' with protocol '%s': %d, %s",
+                      config,
+                      protocol_name,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+
+            for (int j = 1; j <= i; j++)
+            {
+                if (fds[j] >= 0)
+                {
+                    close(fds[j]);
+                }
+            }
+            dcb_close_inherited(inherited, i + 1, MIN(n_inherited, n_fds));
+            free(fds);
+            return false;
+        }
+    }
+
+#ifdef SO_INCOMING_CPU
+    for (int i = 0; i < n_fds; i++)
+    {
+        int cpu = config_thread_cpu(first + i);
+
+        if (cpu >= 0 &&
+            dcb_set_socket_option(fds[i], SOL_SOCKET, SO_INCOMING_CPU, (char *) &cpu, sizeof(cpu)) != 0)
+        {
+            MXS_WARNING("Failed to set the CPU of the listening socket of thread %d at %s.",
+                        first + i, config);
+        }
+    }
+#endif
+
+    MXS_NOTICE("Each of the %d threads listens at %s with a socket of its own.", n_fds, config);
+    listener->thread_fds = fds;
+    listener->n_thread_fds = n_fds;
+    return true;
+}
+
+/**
+ * Close a range of the sockets taken over from the previous process
+ *
+ * @param fds   The sockets, may be NULL if none were taken over
+ * @param from  First socket to close
+ * @param to    One past the last socket to close
+ */
+static void
+dcb_close_inherited(int *fds, int from, int to)
+{
+    for (int i = from; fds && i < to; i++)
+    {
+        close(fds[i]);
+    }
+}
+
+/**
+ * Close the sockets of a listener that a new process has taken over
+ *
+ * The listener must have been removed from polling. The DCB itself is left
+ * as it is, the listener is closed with the service.
+ *
+ * @param listener The listener DCB
+ */
+void
+dcb_listener_close_sockets(DCB *listener)
+{
+    for (int i = 1; i < listener->n_thread_fds; i++)
+    {
+        close(listener->thread_fds[i]);
+    }
+
+    free(listener->thread_fds);
+    listener->thread_fds = NULL;
+    listener->n_thread_fds = 0;
+
+    if (listener->fd > 0)
+    {
+        close(listener->fd);
+        listener->fd = DCBFD_CLOSED;
+    }
+}
+
 /**
  * @brief Create a listening socket, TCP
  *
@@ -3542,10 +4656,11 @@ dcb_listen(DCB *listener, const char *config, const char *protocol_name)
  * Set options, set non-blocking and bind to the socket.
  *
  * @param config_bind The configuration information
+ * @param reuseport Whether other sockets may bind to the same address
  * @return socket if successful, -1 otherwise
  */
 static int
-dcb_listen_create_socket_inet(const char *config_bind)
+dcb_listen_create_socket_inet(const char *config_bind, bool reuseport)
 {
     int listener_socket;
     struct sockaddr_in server_address;
@@ -3575,6 +4690,14 @@ dcb_listen_create_socket_inet(const char *config_bind)
         return -1;
     }
 
+#ifdef SO_REUSEPORT
+    if (reuseport &&
+        dcb_set_socket_option(listener_socket, SOL_SOCKET, SO_REUSEPORT, (char *) &one, sizeof(one)) != 0)
+    {
+        return -1;
+    }
+#endif
+
     // set NONBLOCKING mode
     if (setnonblocking(listener_socket) != 0)
     {
@@ -3677,6 +4800,33 @@ dcb_listen_create_socket_unix(const char *config_bind)
     return listener_socket;
 }
 
+/**
+ * Enable busy polling of a client or a server socket if busy_poll is set
+ *
+ * With SO_BUSY_POLL, the kernel polls the device queue of the socket for a
+ * while when a read finds no data, instead of waiting for the interrupt. A
+ * value above net.core.busy_read requires CAP_NET_ADMIN. A failure is only
+ * logged once, the socket works without busy polling.
+ *
+ * @param fd The socket
+ */
+void
+dcb_set_busy_poll(int fd)
+{
+#ifdef SO_BUSY_POLL
+    static bool warned = false;
+    int usec = config_busy_poll();
+
+    if (usec > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) != 0 && !warned)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        warned = true;
+        MXS_WARNING("Failed to enable busy polling of sockets, error %d: %s",
+                    errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+#endif
+}
+
 /**
  * @brief Set socket options, log an error if fails
  *
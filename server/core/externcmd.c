@@ -178,12 +178,17 @@ int externcmd_execute(EXTERNCMD* cmd)
     }
     else if (pid == 0)
     {
-        /** Child process, execute command */
+        /** Child process, execute command in its own process group so that
+         * the command and the processes it starts can be killed together. The
+         * caller is responsible for reaping the child with waitpid(). */
+        setpgid(0, 0);
         execvp(cmd->argv[0], cmd->argv);
         _exit(1);
     }
     else
     {
+        /** Also set in the parent so that the group exists when this returns */
+        setpgid(pid, pid);
         cmd->child = pid;
         cmd->n_exec++;
         MXS_DEBUG("[monitor_exec_cmd] Forked child process %d : %s.", pid, cmd->argv[0]);
@@ -30,10 +30,11 @@
 #include <session.h>
 #include <modules.h>
 #include <spinlock.h>
+#include <rwlock.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
-static SPINLOCK filter_spin = SPINLOCK_INIT;    /**< Protects the list of all filters */
+static RWLOCK filter_lock = RWLOCK_INIT;    /**< Protects the list of all filters */
 static FILTER_DEF *allFilters = NULL;           /**< The list of all filters */
 
 static void filter_free_parameters(FILTER_DEF *filter);
@@ -65,10 +66,10 @@ filter_alloc(char *name, char *module)
 
     spinlock_init(&filter->spin);
 
-    spinlock_acquire(&filter_spin);
+    rwlock_write_acquire(&filter_lock);
     filter->next = allFilters;
     allFilters = filter;
-    spinlock_release(&filter_spin);
+    rwlock_write_release(&filter_lock);
 
     return filter;
 }
@@ -88,7 +89,7 @@ filter_free(FILTER_DEF *filter)
     if (filter)
     {
         /* First of all remove from the linked list */
-        spinlock_acquire(&filter_spin);
+        rwlock_write_acquire(&filter_lock);
         if (allFilters == filter)
         {
             allFilters = filter->next;
@@ -105,7 +106,7 @@ filter_free(FILTER_DEF *filter)
                 ptr->next = filter->next;
             }
         }
-        spinlock_release(&filter_spin);
+        rwlock_write_release(&filter_lock);
 
         /* Clean up session and free the memory */
         free(filter->name);
@@ -138,7 +139,7 @@ filter_find(char *name)
 {
     FILTER_DEF *filter;
 
-    spinlock_acquire(&filter_spin);
+    rwlock_read_acquire(&filter_lock);
     filter = allFilters;
     while (filter)
     {
@@ -148,7 +149,7 @@ filter_find(char *name)
         }
         filter = filter->next;
     }
-    spinlock_release(&filter_spin);
+    rwlock_read_release(&filter_lock);
     return filter;
 }
 
@@ -179,7 +180,7 @@ dprintAllFilters(DCB *dcb)
     FILTER_DEF *ptr;
     int        i;
 
-    spinlock_acquire(&filter_spin);
+    rwlock_read_acquire(&filter_lock);
     ptr = allFilters;
     while (ptr)
     {
@@ -204,7 +205,7 @@ dprintAllFilters(DCB *dcb)
         }
         ptr = ptr->next;
     }
-    spinlock_release(&filter_spin);
+    rwlock_read_release(&filter_lock);
 }
 
 /**
@@ -245,7 +246,7 @@ dListFilters(DCB *dcb)
     FILTER_DEF      *ptr;
     int     i;
 
-    spinlock_acquire(&filter_spin);
+    rwlock_read_acquire(&filter_lock);
     ptr = allFilters;
     if (ptr)
     {
@@ -271,7 +272,7 @@ dListFilters(DCB *dcb)
         dcb_printf(dcb,
                    "--------------------+-----------------+----------------------------------------\n\n");
     }
-    spinlock_release(&filter_spin);
+    rwlock_read_release(&filter_lock);
 }
 
 /**
@@ -32,6 +32,8 @@
  * 29/06/14     Massimiliano Pinto      Addition of pidfile
  * 10/08/15     Markus Makela           Added configurable directory locations
  * 19/01/16     Markus Makela           Set cwd to log directory
+ * 14/10/16     MariaDB Corporation     Hot restart hands the listeners to a new process
+ * 14/10/16     MariaDB Corporation     Initialize the resource usage accounting
  * @endverbatim
  */
 #define _XOPEN_SOURCE 700
@@ -84,6 +86,9 @@
 #include <sys/prctl.h>
 #include <sys/file.h>
 #include <statistics.h>
+#include <trace.h>
+#include <usage.h>
+#include <hot_restart.h>
 
 #define STRING_BUFFER_SIZE 1024
 #define PIDFD_CLOSED -1
@@ -313,13 +318,12 @@ sigchld_handler (int i)
     int exit_status = 0;
     pid_t child = -1;
 
-    if ((child = wait(&exit_status)) == -1)
-    {
-        char errbuf[STRERROR_BUFLEN];
-        MXS_ERROR("Failed to wait child process: %d %s",
-                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
-    }
-    else
+    /**
+     * Only the children in the process group of MaxScale are reaped here. The
+     * external commands run in their own process groups and are reaped by the
+     * monitor script executor which reports their exit status.
+     */
+    while ((child = waitpid(0, &exit_status, WNOHANG)) > 0)
     {
         if (WIFEXITED(exit_status))
         {
@@ -1901,8 +1905,12 @@ int main(int argc, char **argv)
     }
     libmysql_initialized = TRUE;
 
+    /** Take over the listeners of a running process in a hot restart */
+    bool hot_restart = config_hot_restart_socket() &&
+                       hot_restart_receive(config_hot_restart_socket());
+
     /** Check if a MaxScale process is already running */
-    if (pid_file_exists())
+    if (!hot_restart && pid_file_exists())
     {
         /** There is a process with the PID of the maxscale.pid file running.
          * Assuming that this is an already running MaxScale process, we
@@ -1920,10 +1928,15 @@ int main(int argc, char **argv)
 
     /** Initialize statistics */
     ts_stats_init();
+    trace_init();
+    usage_init();
 
     /* Init MaxScale poll system */
     poll_init();
 
+    /** Start the SSL handshake threads before any client can connect */
+    ssl_handshake_threads_start(config_ssl_handshake_threads());
+
     /**
      * Init mysql thread context for main thread as well. Needed when users
      * are queried from backends.
@@ -1961,6 +1974,14 @@ int main(int argc, char **argv)
      */
     hkinit();
 
+    /** Close the sockets of the previous process that no listener took */
+    hot_restart_close_unused();
+
+    if (config_hot_restart_socket())
+    {
+        hot_restart_listen(config_hot_restart_socket(), pidfd);
+    }
+
     /*<
      * Start the polling threads, note this is one less than is
      * configured as the main thread will also poll.
@@ -2009,6 +2030,8 @@ int main(int argc, char **argv)
      */
     thread_wait(log_flush_thr);
 
+    ssl_handshake_threads_stop();
+
     /*< Stop all the monitors */
     monitorStopAll();
 
@@ -2024,9 +2047,12 @@ int main(int argc, char **argv)
     MXS_NOTICE("MaxScale shutdown completed.");
 
     unload_all_modules();
-    /* Remove Pidfile */
-    unlock_pidfile();
-    unlink_pidfile();
+    /* Remove Pidfile, unless a new process took it over in a hot restart */
+    if (!hot_restart_handed_off())
+    {
+        unlock_pidfile();
+        unlink_pidfile();
+    }
 
 return_main:
 
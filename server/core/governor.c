@@ -0,0 +1,580 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file governor.c  - The concurrency governor of a service
+ *
+ * A session holds at most one slot, the protocols send one query at a time and
+ * wait for its reply. A session that waits for a slot keeps the queries it
+ * sends meanwhile with the first one so that they are routed in order. When a
+ * slot is given to a waiting session, its queries are put back into the read
+ * queue of its client DCB and a read event is added for the DCB, so that the
+ * queries are routed again by the thread that owns the DCB.
+ *
+ * The slot is released when a backend has read the complete reply. A query
+ * that is not written to a backend, such as one answered from a cache or by
+ * the router itself, releases its slot when the reply is written to the
+ * client. The commands that get no reply do not take a slot at all.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * 14/10/16     MariaDB Corporation     Commands without a reply and local replies
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <governor.h>
+#include <session.h>
+#include <service.h>
+#include <dcb.h>
+#include <atomic.h>
+#include <maxscale/poll.h>
+#include <statistics.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <mysql_client_server_protocol.h>
+
+/** The size of the hashtable of the users */
+#define GOVERNOR_USERS_HASH_SIZE 64
+
+/**
+ * Allocate a governor
+ *
+ * @param max_active      Maximum active queries, 0 for no limit
+ * @param max_active_user Maximum active queries of a user, 0 for no limit
+ * @param max_queued      Maximum queued queries
+ * @param high_users      Comma separated list of the users whose queries are
+ *                        queued with a high priority, or NULL
+ * @return The governor or NULL if memory allocation failed
+ */
+GOVERNOR *
+governor_alloc(int max_active, int max_active_user, int max_queued, const char *high_users)
+{
+    GOVERNOR *governor = (GOVERNOR *)calloc(1, sizeof(GOVERNOR));
+
+    if (governor == NULL ||
+        (governor->users = hashtable_alloc(GOVERNOR_USERS_HASH_SIZE, simple_str_hash, strcmp)) == NULL ||
+        (high_users && (governor->high_users = strdup(high_users)) == NULL))
+    {
+        MXS_ERROR("Failed to allocate memory for the concurrency governor.");
+        governor_free(governor);
+        return NULL;
+    }
+
+    hashtable_memory_fns(governor->users, (HASHMEMORYFN)strdup, NULL,
+                         (HASHMEMORYFN)free, (HASHMEMORYFN)free);
+    spinlock_init(&governor->lock);
+    governor->max_active = max_active;
+    governor->max_active_user = max_active_user;
+    governor->max_queued = max_queued;
+
+    return governor;
+}
+
+/**
+ * Free a governor, it must not have any sessions
+ *
+ * @param governor The governor or NULL
+ */
+void
+governor_free(GOVERNOR *governor)
+{
+    if (governor)
+    {
+        if (governor->users)
+        {
+            hashtable_free(governor->users);
+        }
+        free(governor->high_users);
+        free(governor);
+    }
+}
+
+/**
+ * Check whether a user is in a comma separated list of users
+ */
+static bool
+governor_list_has_user(const char *list, const char *user)
+{
+    size_t len = strlen(user);
+
+    while (list && *list)
+    {
+        while (*list == ' ' || *list == ',')
+        {
+            list++;
+        }
+
+        const char *end = list;
+
+        while (*end && *end != ',' && *end != ' ')
+        {
+            end++;
+        }
+
+        if (end > list && (size_t)(end - list) == len && strncmp(list, user, len) == 0)
+        {
+            return true;
+        }
+
+        list = end;
+    }
+
+    return false;
+}
+
+/**
+ * Return the counters of the user of a session. The caller must hold the
+ * lock of the governor.
+ *
+ * @return The counters or NULL if memory allocation failed, in which case the
+ *         user is not limited
+ */
+static GOVERNOR_USER *
+governor_get_user(GOVERNOR *governor, SESSION *session)
+{
+    if (session->gov_user == NULL)
+    {
+        char *name = session_getUser(session);
+        GOVERNOR_USER *user;
+
+        name = name ? name : "";
+
+        if ((user = hashtable_fetch(governor->users, name)) == NULL &&
+            (user = (GOVERNOR_USER *)calloc(1, sizeof(GOVERNOR_USER))) != NULL)
+        {
+            user->high = governor_list_has_user(governor->high_users, name);
+
+            if (!hashtable_add(governor->users, name, user))
+            {
+                free(user);
+                user = NULL;
+            }
+        }
+
+        session->gov_user = user;
+    }
+
+    return session->gov_user;
+}
+
+/**
+ * Check whether the server sends a reply to a command
+ *
+ * @param query The command
+ * @return False for the commands that get no reply
+ */
+static bool
+governor_has_reply(GWBUF *query)
+{
+    uint8_t command;
+
+    if (gwbuf_copy_data(query, MYSQL_HEADER_LEN, 1, &command) != 1)
+    {
+        return true;
+    }
+
+    return command != MYSQL_COM_QUIT && command != MYSQL_COM_STMT_CLOSE &&
+           command != MYSQL_COM_STMT_SEND_LONG_DATA;
+}
+
+static inline bool
+governor_has_room(GOVERNOR *governor)
+{
+    return governor->max_active == 0 || governor->n_active < governor->max_active;
+}
+
+static inline bool
+governor_user_has_room(GOVERNOR *governor, GOVERNOR_USER *user)
+{
+    return governor->max_active_user == 0 || user == NULL ||
+           user->n_active < governor->max_active_user;
+}
+
+static void
+governor_take_slot(GOVERNOR *governor, SESSION *session)
+{
+    session->gov_state = GOVERNOR_ACTIVE;
+    session->gov_backend = false;
+    governor->n_active++;
+
+    if (session->gov_user)
+    {
+        session->gov_user->n_active++;
+    }
+}
+
+static void
+governor_release_slot(GOVERNOR *governor, SESSION *session)
+{
+    session->gov_state = GOVERNOR_IDLE;
+    session->gov_backend = false;
+    governor->n_active--;
+
+    if (session->gov_user)
+    {
+        session->gov_user->n_active--;
+    }
+}
+
+/**
+ * Remove a session from a list of waiting sessions
+ *
+ * @return True if the session was in the list
+ */
+static bool
+governor_unlink(SESSION **head, SESSION **tail, SESSION *session)
+{
+    SESSION *prev = NULL;
+
+    for (SESSION *s = *head; s; prev = s, s = s->gov_next)
+    {
+        if (s == session)
+        {
+            if (prev)
+            {
+                prev->gov_next = s->gov_next;
+            }
+            else
+            {
+                *head = s->gov_next;
+            }
+
+            if (*tail == s)
+            {
+                *tail = prev;
+            }
+
+            s->gov_next = NULL;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Give the free slots to the waiting sessions of a list, in the order they
+ * started to wait. A session whose user has no room is skipped. The caller
+ * must hold the lock of the governor.
+ *
+ * @param governor The governor
+ * @param head     The head of the list
+ * @param tail     The tail of the list
+ * @param granted  The sessions that got a slot are added to this list
+ */
+static void
+governor_grant_list(GOVERNOR *governor, SESSION **head, SESSION **tail, SESSION **granted)
+{
+    SESSION *s = *head;
+    uint64_t now = ts_clock_us();
+
+    while (s && governor_has_room(governor))
+    {
+        SESSION *next = s->gov_next;
+
+        if (governor_user_has_room(governor, s->gov_user))
+        {
+            governor_unlink(head, tail, s);
+            governor->n_queued--;
+            governor->wait_us += now - s->gov_wait_start;
+            governor_take_slot(governor, s);
+
+            /** The reference is released once the queries have been given to the DCB */
+            atomic_add(&s->refcount, 1);
+            s->gov_next = *granted;
+            *granted = s;
+        }
+
+        s = next;
+    }
+}
+
+/**
+ * Route the queries of the sessions that got a slot. This must be called
+ * without holding the lock of the governor.
+ *
+ * @param granted The sessions that got a slot
+ */
+static void
+governor_dispatch(SESSION *granted)
+{
+    while (granted)
+    {
+        SESSION *session = granted;
+        GWBUF *queued = session->gov_queued;
+        DCB *dcb = session->client_dcb;
+
+        granted = session->gov_next;
+        session->gov_next = NULL;
+        session->gov_queued = NULL;
+
+        if (dcb && dcb->state == DCB_STATE_POLLING && queued)
+        {
+            poll_add_epollin_event_to_dcb(dcb, queued);
+        }
+        else
+        {
+            /** The client is gone, the slot goes to the next session */
+            gwbuf_free(queued);
+            governor_query_done(session);
+        }
+
+        session_free(session);
+    }
+}
+
+/**
+ * Decide whether a query of a session can be routed now
+ *
+ * A session that already holds a slot routes its queries. Otherwise the
+ * session gets a slot if there is room for it, or waits for one if there is
+ * room in the queue. The queries of a session that waits are queued after
+ * the first one. A command that gets no reply is routed without a slot.
+ *
+ * @param session The session
+ * @param query   The query, owned by the governor when it is queued
+ * @param rest    Data that was read after the query, queued after it, or NULL
+ * @return Whether the query can be routed, was queued or must be rejected
+ */
+governor_result_t
+governor_admit(SESSION *session, GWBUF *query, GWBUF *rest)
+{
+    GOVERNOR *governor = session->service->governor;
+    governor_result_t rval = GOVERNOR_ADMIT;
+
+    spinlock_acquire(&governor->lock);
+
+    if (session->gov_state == GOVERNOR_ACTIVE)
+    {
+        governor->n_admitted++;
+    }
+    else if (session->gov_state == GOVERNOR_WAITING)
+    {
+        session->gov_queued = gwbuf_append(gwbuf_append(session->gov_queued, query), rest);
+        rval = GOVERNOR_QUEUE;
+    }
+    else if (!governor_has_reply(query))
+    {
+        /** Nothing would release the slot */
+        governor->n_admitted++;
+    }
+    else
+    {
+        GOVERNOR_USER *user = governor_get_user(governor, session);
+
+        if (governor_has_room(governor) && governor_user_has_room(governor, user))
+        {
+            governor_take_slot(governor, session);
+            governor->n_admitted++;
+        }
+        else if (governor->n_queued < governor->max_queued)
+        {
+            SESSION **head = user && user->high ? &governor->high_head : &governor->normal_head;
+            SESSION **tail = user && user->high ? &governor->high_tail : &governor->normal_tail;
+
+            session->gov_state = GOVERNOR_WAITING;
+            session->gov_queued = gwbuf_append(query, rest);
+            session->gov_wait_start = ts_clock_us();
+            session->gov_next = NULL;
+
+            if (*tail)
+            {
+                (*tail)->gov_next = session;
+            }
+            else
+            {
+                *head = session;
+            }
+            *tail = session;
+
+            governor->n_queued++;
+            governor->n_waited++;
+            rval = GOVERNOR_QUEUE;
+        }
+        else
+        {
+            governor->n_rejected++;
+            rval = GOVERNOR_REJECT;
+        }
+    }
+
+    spinlock_release(&governor->lock);
+
+    return rval;
+}
+
+/**
+ * Release the slot of a session
+ *
+ * This is called when the reply to the query of the session has been read
+ * completely. The free slot is given to the next waiting session.
+ *
+ * @param session The session
+ */
+void
+governor_query_done(SESSION *session)
+{
+    GOVERNOR *governor = session->service ? session->service->governor : NULL;
+    SESSION *granted = NULL;
+
+    /** A dirty read is enough, the state only changes to active by the session itself */
+    if (governor == NULL || session->gov_state != GOVERNOR_ACTIVE)
+    {
+        return;
+    }
+
+    spinlock_acquire(&governor->lock);
+
+    if (session->gov_state == GOVERNOR_ACTIVE)
+    {
+        governor_release_slot(governor, session);
+        governor_grant_list(governor, &governor->high_head, &governor->high_tail, &granted);
+        governor_grant_list(governor, &governor->normal_head, &governor->normal_tail, &granted);
+    }
+
+    spinlock_release(&governor->lock);
+
+    governor_dispatch(granted);
+}
+
+/**
+ * Note that a query of a session is written to a backend
+ *
+ * The slot of the session is then released when the backend has read the
+ * reply instead of when a reply is written to the client.
+ *
+ * @param session The session
+ * @param query   The written data
+ */
+void
+governor_backend_write(SESSION *session, GWBUF *query)
+{
+    GOVERNOR *governor = session->service ? session->service->governor : NULL;
+
+    if (governor == NULL || session->gov_state != GOVERNOR_ACTIVE || !governor_has_reply(query))
+    {
+        return;
+    }
+
+    spinlock_acquire(&governor->lock);
+
+    if (session->gov_state == GOVERNOR_ACTIVE)
+    {
+        session->gov_backend = true;
+    }
+
+    spinlock_release(&governor->lock);
+}
+
+/**
+ * Release the slot of a session whose query was answered without a backend
+ *
+ * This is called when a reply is written to the client. If the query of the
+ * slot was not written to a backend, the reply was generated locally and the
+ * query is done.
+ *
+ * @param session The session
+ */
+void
+governor_client_write(SESSION *session)
+{
+    GOVERNOR *governor = session->service ? session->service->governor : NULL;
+    bool done = false;
+
+    /** A dirty read is enough, see governor_query_done() */
+    if (governor == NULL || session->gov_state != GOVERNOR_ACTIVE)
+    {
+        return;
+    }
+
+    spinlock_acquire(&governor->lock);
+    done = session->gov_state == GOVERNOR_ACTIVE && !session->gov_backend;
+    spinlock_release(&governor->lock);
+
+    if (done)
+    {
+        governor_query_done(session);
+    }
+}
+
+/**
+ * Remove a session that is being freed from the governor
+ *
+ * @param session The session
+ */
+void
+governor_session_close(SESSION *session)
+{
+    GOVERNOR *governor = session->service ? session->service->governor : NULL;
+    GWBUF *queued = NULL;
+
+    if (governor == NULL || session->gov_state == GOVERNOR_IDLE)
+    {
+        session->gov_user = NULL;
+        return;
+    }
+
+    spinlock_acquire(&governor->lock);
+
+    if (session->gov_state == GOVERNOR_WAITING)
+    {
+        if (governor_unlink(&governor->high_head, &governor->high_tail, session) ||
+            governor_unlink(&governor->normal_head, &governor->normal_tail, session))
+        {
+            governor->n_queued--;
+        }
+
+        queued = session->gov_queued;
+        session->gov_queued = NULL;
+        session->gov_state = GOVERNOR_IDLE;
+    }
+
+    spinlock_release(&governor->lock);
+
+    gwbuf_free(queued);
+    governor_query_done(session);
+    session->gov_user = NULL;
+}
+
+/**
+ * Print the state of a governor
+ *
+ * @param dcb      The DCB to print to
+ * @param governor The governor
+ */
+void
+governor_dprint(DCB *dcb, GOVERNOR *governor)
+{
+    spinlock_acquire(&governor->lock);
+    int n_active = governor->n_active;
+    int n_queued = governor->n_queued;
+    uint64_t n_admitted = governor->n_admitted;
+    uint64_t n_waited = governor->n_waited;
+    uint64_t n_rejected = governor->n_rejected;
+    uint64_t wait_us = governor->wait_us;
+    spinlock_release(&governor->lock);
+
+    dcb_printf(dcb, "\tActive queries:                      %d, limit %d, %d per user\n",
+               n_active, governor->max_active, governor->max_active_user);
+    dcb_printf(dcb, "\tQueued queries:                      %d, limit %d\n",
+               n_queued, governor->max_queued);
+    dcb_printf(dcb, "\tQueries routed without waiting:      %lu\n", n_admitted);
+    dcb_printf(dcb, "\tQueries that waited for a slot:      %lu, %.3f ms on average\n",
+               n_waited, n_waited ? wait_us / 1000.0 / n_waited : 0.0);
+    dcb_printf(dcb, "\tQueries rejected, the queue was full: %lu\n", n_rejected);
+}
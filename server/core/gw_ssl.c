@@ -22,6 +22,7 @@
  *
  * Date         Who                     Description
  * 02/02/16     Martin Brampton         Initial implementation
+ * 14/10/16     MariaDB Corporation     Handshake threads
  *
  * @endverbatim
  */
@@ -32,8 +33,30 @@
 #include <dcb.h>
 #include <service.h>
 #include <log_manager.h>
+#include <atomic.h>
+#include <thread.h>
+#include <maxscale/poll.h>
 #include <sys/ioctl.h>
 
+/**
+ * The threads that do the SSL handshakes of clients. The DCBs are queued by
+ * the polling threads and handed back to them with fake events, so that the
+ * expensive key exchanges do not delay the processing of the other DCBs of
+ * the polling threads.
+ */
+typedef struct ssl_handshake_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;            /**< Signaled when a DCB is queued */
+    DCB *head;                      /**< First queued DCB */
+    DCB *tail;                      /**< Last queued DCB */
+    bool shutdown;
+    int n_threads;
+    THREAD threads[SSL_MAX_HANDSHAKE_THREADS];
+} SSL_HANDSHAKE_POOL;
+
+static SSL_HANDSHAKE_POOL *handshake_pool = NULL;
+
 /**
  * @brief Check client's SSL capability and start SSL if appropriate.
  *
@@ -214,3 +237,212 @@ const char* ssl_method_type_to_string(ssl_method_type_t method_type)
         return "Unknown";
     }
 }
+
+/**
+ * Do the handshake of a DCB in a handshake thread. If more data arrived while
+ * the handshake was waiting for it, the handshake is continued. When the
+ * handshake completes, a read event is faked so that the polling thread reads
+ * the data that follows the handshake. A failed handshake has faked a hangup
+ * event. The DCB must not be used after it has been marked idle as the
+ * polling thread may then free it.
+ *
+ * @param dcb Client DCB whose handshake is done
+ */
+static void ssl_handshake_run(DCB *dcb)
+{
+    int rc;
+
+    do
+    {
+        /** The data that arrived before this point is read by the handshake */
+        atomic_cas_int(&dcb->ssl_async, SSL_ASYNC_AGAIN, SSL_ASYNC_BUSY);
+        rc = dcb_accept_SSL_handshake(dcb);
+    }
+    while (rc == 0 && !atomic_cas_int(&dcb->ssl_async, SSL_ASYNC_BUSY, SSL_ASYNC_IDLE));
+
+    if (rc != 0)
+    {
+        if (rc == 1)
+        {
+            poll_fake_read_event(dcb);
+        }
+
+        int state;
+
+        do
+        {
+            state = dcb->ssl_async;
+        }
+        while (!atomic_cas_int(&dcb->ssl_async, state, SSL_ASYNC_IDLE));
+    }
+}
+
+/**
+ * The main function of a handshake thread
+ *
+ * @param data The handshake pool
+ */
+static void ssl_handshake_thread(void *data)
+{
+    SSL_HANDSHAKE_POOL *pool = (SSL_HANDSHAKE_POOL*)data;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (!pool->shutdown)
+    {
+        DCB *dcb = pool->head;
+
+        if (dcb)
+        {
+            pool->head = dcb->ssl_async_next;
+            if (pool->head == NULL)
+            {
+                pool->tail = NULL;
+            }
+            dcb->ssl_async_next = NULL;
+            pthread_mutex_unlock(&pool->lock);
+
+            ssl_handshake_run(dcb);
+
+            pthread_mutex_lock(&pool->lock);
+        }
+        else
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Start the threads that do the SSL handshakes of clients. This must be
+ * called before the polling threads are started.
+ *
+ * @param n_threads Number of threads, 0 for doing the handshakes in the
+ *                  polling threads
+ * @return False if the threads could not be started
+ */
+bool ssl_handshake_threads_start(int n_threads)
+{
+    if (n_threads <= 0)
+    {
+        return true;
+    }
+
+    if (n_threads > SSL_MAX_HANDSHAKE_THREADS)
+    {
+        MXS_WARNING("At most %d SSL handshake threads can be used, %d were configured.",
+                    SSL_MAX_HANDSHAKE_THREADS, n_threads);
+        n_threads = SSL_MAX_HANDSHAKE_THREADS;
+    }
+
+    SSL_HANDSHAKE_POOL *pool = calloc(1, sizeof(SSL_HANDSHAKE_POOL));
+
+    if (pool == NULL)
+    {
+        return false;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+
+    while (pool->n_threads < n_threads &&
+           thread_start(&pool->threads[pool->n_threads], ssl_handshake_thread, pool))
+    {
+        pool->n_threads++;
+    }
+
+    if (pool->n_threads == 0)
+    {
+        MXS_ERROR("Failed to start the SSL handshake threads, the handshakes "
+                  "are done by the polling threads.");
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        return false;
+    }
+
+    handshake_pool = pool;
+    MXS_NOTICE("Started %d SSL handshake threads.", pool->n_threads);
+    return true;
+}
+
+/**
+ * Stop the handshake threads. This must be called after the polling threads
+ * have stopped.
+ */
+void ssl_handshake_threads_stop()
+{
+    SSL_HANDSHAKE_POOL *pool = handshake_pool;
+
+    if (pool)
+    {
+        handshake_pool = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = true;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (int i = 0; i < pool->n_threads; i++)
+        {
+            thread_wait(pool->threads[i]);
+        }
+
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+    }
+}
+
+/**
+ * Queue the SSL handshake of a client to the handshake threads. If a
+ * handshake thread is already using the DCB, it is told to continue the
+ * handshake with the data that has arrived.
+ *
+ * @param dcb Client DCB whose SSL structure has been created
+ * @return True if the handshake threads do the handshake, false if the
+ *         caller must do it
+ */
+bool ssl_handshake_submit(DCB *dcb)
+{
+    SSL_HANDSHAKE_POOL *pool = handshake_pool;
+
+    if (pool == NULL)
+    {
+        return false;
+    }
+
+    while (true)
+    {
+        int state = dcb->ssl_async;
+
+        if (state == SSL_ASYNC_IDLE)
+        {
+            if (atomic_cas_int(&dcb->ssl_async, SSL_ASYNC_IDLE, SSL_ASYNC_BUSY))
+            {
+                pthread_mutex_lock(&pool->lock);
+                if (pool->tail)
+                {
+                    pool->tail->ssl_async_next = dcb;
+                }
+                else
+                {
+                    pool->head = dcb;
+                }
+                pool->tail = dcb;
+                pthread_cond_signal(&pool->work);
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+        }
+        else if (state == SSL_ASYNC_AGAIN ||
+                 atomic_cas_int(&dcb->ssl_async, SSL_ASYNC_BUSY, SSL_ASYNC_AGAIN))
+        {
+            break;
+        }
+    }
+
+    return true;
+}
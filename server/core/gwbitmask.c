@@ -14,6 +14,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <gwbitmask.h>
+#include <skygw_debug.h>
 
 /**
  * @file gwbitmask.c  Implementation of bitmask operations for the gateway
@@ -46,6 +47,7 @@
  * 17/10/15     Martin Brampton     Added display of bitmask
  * 04/01/16     Martin Brampton     Changed bitmask_clear to not lock and return
  *                                  whether bitmask is clear; added bitmask_clear_with_lock.
+ * 14/10/16     MariaDB Corporation Added fixed size atomic bitsets.
  *
  * @endverbatim
  */
@@ -385,3 +387,137 @@ bitmask_count_bits_set(GWBITMASK *bitmask)
     }
     return result;
 }
+
+/**
+ * Initialise a fixed size bitset. All the bits are clear.
+ *
+ * @param set           Bitset to initialise
+ * @param length        Number of bits in the bitset
+ * @return              True if the bitset was initialised, false if memory
+ *                      allocation failed
+ */
+bool
+bitset_init(GWBITSET *set, int length)
+{
+    int n_lines = (length + BITSET_LINE_BITS - 1) / BITSET_LINE_BITS;
+    size_t size = (n_lines ? n_lines : 1) * (BITSET_LINE_BITS / 8);
+    void *bits;
+
+    if (posix_memalign(&bits, BITSET_LINE_BITS / 8, size) != 0)
+    {
+        set->bits = NULL;
+        set->length = 0;
+        set->n_words = 0;
+        return false;
+    }
+
+    memset(bits, 0, size);
+    set->bits = bits;
+    set->length = length;
+    set->n_words = size / sizeof(uint64_t);
+    return true;
+}
+
+/**
+ * Free the bits of a bitset
+ *
+ * @param set           Bitset to free
+ */
+void
+bitset_free(GWBITSET *set)
+{
+    free(set->bits);
+    set->bits = NULL;
+    set->length = 0;
+    set->n_words = 0;
+}
+
+/**
+ * Set a bit of a bitset
+ *
+ * @param set           The bitset
+ * @param bit           Bit to set, less than the length of the bitset
+ * @return              True if the bit was already set
+ */
+bool
+bitset_set(GWBITSET *set, int bit)
+{
+    ss_dassert(bit >= 0 && bit < set->length);
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    return (__sync_fetch_and_or(&set->bits[bit / 64], mask) & mask) != 0;
+}
+
+/**
+ * Clear a bit of a bitset
+ *
+ * @param set           The bitset
+ * @param bit           Bit to clear, less than the length of the bitset
+ * @return              True if the bit was set
+ */
+bool
+bitset_clear(GWBITSET *set, int bit)
+{
+    ss_dassert(bit >= 0 && bit < set->length);
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    return (__sync_fetch_and_and(&set->bits[bit / 64], ~mask) & mask) != 0;
+}
+
+/**
+ * Test a bit of a bitset
+ *
+ * @param set           The bitset
+ * @param bit           Bit to test
+ * @return              True if the bit is set, false if it is clear or
+ *                      beyond the length of the bitset
+ */
+bool
+bitset_isset(GWBITSET *set, int bit)
+{
+    if (bit < 0 || bit >= set->length)
+    {
+        return false;
+    }
+
+    uint64_t word = *(volatile uint64_t *)&set->bits[bit / 64];
+    return (word & ((uint64_t)1 << (bit % 64))) != 0;
+}
+
+/**
+ * Test whether all the bits of a bitset are clear. Each word is read
+ * atomically, a bit that is changed during the call may or may not be seen.
+ *
+ * @param set           The bitset
+ * @return              True if no bit is set
+ */
+bool
+bitset_isallclear(GWBITSET *set)
+{
+    for (int i = 0; i < set->n_words; i++)
+    {
+        if (*(volatile uint64_t *)&set->bits[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Count the set bits of a bitset
+ *
+ * @param set           The bitset
+ * @return              Number of set bits
+ */
+int
+bitset_count(GWBITSET *set)
+{
+    int count = 0;
+
+    for (int i = 0; i < set->n_words; i++)
+    {
+        count += __builtin_popcountll(*(volatile uint64_t *)&set->bits[i]);
+    }
+
+    return count;
+}
@@ -17,7 +17,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <platform.h>
 #include <hashtable.h>
+#include <memusage.h>
 
 /**
  * @file hashtable.c General purpose hashtable routines
@@ -40,10 +42,15 @@
  * the key and the value, if the actions required are different the called functions
  * must understand how to differenate the key and value.
  *
- * The hash table implements a single write, multiple reader locking policy by
- * using a pair of counters and a spinlock. The spinlock is used to protect the
- * number of readers and writers counters when taking out locks. Releasing of
- * locks uses pure atomic actions and thus does not require spinlock protection.
+ * The hash table implements a single write, multiple reader locking policy with
+ * a readers-writer lock.
+ *
+ * A read-mostly hashtable replaces the shared reader counter with a set of
+ * reader counters, each on a cache line of its own. A thread only updates the
+ * counter of its own slot when it takes a read lock, so concurrent readers on
+ * different threads do not contend for the same memory. A writer has to wait
+ * for the counters of all slots to drop to zero which makes the updates more
+ * expensive.
  *
  * @verbatim
  * Revision History
@@ -55,6 +62,8 @@
  *                                      it's possible to copy and free different data types via
  *                                      kcopyfn/kfreefn, vcopyfn/vfreefn
  * 06/02/2015   Mark Riddoch            Addition of hashtable_save and hashtable_load
+ * 14/10/2016   MariaDB Corporation     Readers-writer lock instead of the spinlock
+ * 14/10/2016   MariaDB Corporation     Tables and entries are counted in the memory usage
  *
  * @endverbatim
  */
@@ -63,6 +72,17 @@ static  void hashtable_read_lock(HASHTABLE *table);
 static  void hashtable_read_unlock(HASHTABLE *table);
 static  void hashtable_write_lock(HASHTABLE *table);
 static  void hashtable_write_unlock(HASHTABLE *table);
+
+/** The number of reader slots in a read-mostly hashtable */
+#define HASHTABLE_READER_SLOTS 32
+
+struct hashreader
+{
+    int n_readers;                /**< Number of readers in this slot */
+} __attribute__((aligned(64)));
+
+static int next_reader_slot = 0;
+static thread_local int reader_slot = -1;
 static HASHTABLE *hashtable_alloc_real(HASHTABLE* target,
                                        int size,
                                        int (*hashfn)(),
@@ -108,6 +128,37 @@ HASHTABLE* hashtable_alloc_flat(HASHTABLE* target,
     return hashtable_alloc_real(target, size, hashfn, cmpfn);
 }
 
+/**
+ * Allocate a new read-mostly hash table.
+ *
+ * The table behaves like one allocated with hashtable_alloc but lookups from
+ * different threads do not write to shared memory. Use this for tables that
+ * are read far more often than they are modified.
+ *
+ * @param size          The size of the hash table, must be > 0
+ * @param hashfn        The user supplied hash function
+ * @param cmpfn         The user supplied key comparison function
+ * @return The hashtable table
+ */
+HASHTABLE *
+hashtable_alloc_read_mostly(int size, int (*hashfn)(), int (*cmpfn)())
+{
+    HASHTABLE *rval = hashtable_alloc_real(NULL, size, hashfn, cmpfn);
+
+    if (rval)
+    {
+        if (posix_memalign((void**)&rval->readers, sizeof(struct hashreader),
+                           HASHTABLE_READER_SLOTS * sizeof(struct hashreader)) != 0)
+        {
+            hashtable_free(rval);
+            return NULL;
+        }
+        memset(rval->readers, 0, HASHTABLE_READER_SLOTS * sizeof(struct hashreader));
+    }
+
+    return rval;
+}
+
 static HASHTABLE *
 hashtable_alloc_real(HASHTABLE* target,
                      int        size,
@@ -141,16 +192,18 @@ hashtable_alloc_real(HASHTABLE* target,
     rval->vcopyfn = nullfn;
     rval->kfreefn = nullfn;
     rval->vfreefn = nullfn;
-    rval->n_readers = 0;
     rval->writelock = 0;
+    rval->readers = NULL;
     rval->n_elements = 0;
-    spinlock_init(&rval->spin);
+    rwlock_init(&rval->rwlock);
     if ((rval->entries = (HASHENTRIES **)calloc(rval->hashsize, sizeof(HASHENTRIES *))) == NULL)
     {
         free(rval);
         return NULL;
     }
     memset(rval->entries, 0, rval->hashsize * sizeof(HASHENTRIES *));
+    memusage_alloc(MEMUSAGE_HASHTABLE, rval->hashsize * sizeof(HASHENTRIES *) +
+                   (rval->ht_isflat ? 0 : sizeof(HASHTABLE)));
 
     return rval;
 }
@@ -184,9 +237,13 @@ hashtable_free(HASHTABLE *table)
             entry = ptr;
         }
     }
+    memusage_free(MEMUSAGE_HASHTABLE, table->hashsize * sizeof(HASHENTRIES *) +
+                  table->n_elements * sizeof(HASHENTRIES) +
+                  (table->ht_isflat ? 0 : sizeof(HASHTABLE)));
     free(table->entries);
 
     hashtable_write_unlock(table);
+    free(table->readers);
     if (!table->ht_isflat)
     {
         free(table);
@@ -309,6 +366,7 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
         table->entries[hashkey % table->hashsize] = ptr;
     }
     table->n_elements++;
+    memusage_add(MEMUSAGE_HASHTABLE, sizeof(HASHENTRIES), 0);
     hashtable_write_unlock(table);
 
     return 1;
@@ -383,6 +441,7 @@ hashtable_delete(HASHTABLE *table, void *key)
         free(entry);
     }
     table->n_elements--;
+    memusage_add(MEMUSAGE_HASHTABLE, -(int64_t)sizeof(HASHENTRIES), 0);
     assert(table->n_elements >= 0);
     hashtable_write_unlock(table);
     return 1;
@@ -530,87 +589,94 @@ void hashtable_get_stats(void* table,
 /**
  * Take a read lock on the hashtable.
  *
- * The hashtable support multiple readers and a single writer,
- * we have a spinlock to protect the two counts, n_readers and
- * writelock.
- *
- * We take the hashtable spinlock and then check that writelock
- * is set to zero. If not we release the spinlock and do dirty
- * reads of writelock until it goes to 0. Once it is zero we
- * acquire the spinlock again and test that writelock is still
- * 0.
- *
- * With writelock set to zero we increment n_readers with the
- * spinlock still held.
+ * The hashtable support multiple readers and a single writer. A read-mostly
+ * table increments the reader count of the slot of the thread and then checks
+ * that writelock is zero. If not, it decrements the count and does dirty
+ * reads of writelock until it goes to 0.
  *
  * @param table         The hashtable to lock.
  */
 static void
 hashtable_read_lock(HASHTABLE *table)
 {
-    spinlock_acquire(&table->spin);
-    while (table->writelock)
+    if (table->readers)
     {
-        spinlock_release(&table->spin);
-        while (table->writelock)
+        if (reader_slot == -1)
         {
-            ;
+            reader_slot = atomic_add(&next_reader_slot, 1) % HASHTABLE_READER_SLOTS;
         }
-        spinlock_acquire(&table->spin);
+
+        int *n_readers = &table->readers[reader_slot].n_readers;
+
+        /** The atomic increment is also a full memory barrier which orders
+         * it before the read of writelock */
+        while (atomic_add(n_readers, 1), table->writelock)
+        {
+            atomic_add(n_readers, -1);
+            while (*(volatile int*)&table->writelock)
+            {
+                ;
+            }
+        }
+        return;
     }
-    atomic_add(&table->n_readers, 1);
-    spinlock_release(&table->spin);
+
+    rwlock_read_acquire(&table->rwlock);
 }
 
 /**
  * Release a previously obtained readlock.
  *
- * Simply decrement the n_readers value for the hash table
- *
  * @param table         The hash table to unlock
  */
 static void
 hashtable_read_unlock(HASHTABLE *table)
 {
-    atomic_add(&table->n_readers, -1);
+    if (table->readers)
+    {
+        atomic_add(&table->readers[reader_slot].n_readers, -1);
+    }
+    else
+    {
+        rwlock_read_release(&table->rwlock);
+    }
 }
 
 /**
  * Obtain an exclusive write lock for the hash table.
  *
- * We acquire the hashtable spinlock, check for the number of
- * readers beign zero. If it is not we hold the spinlock and
- * loop waiting for the n_readers to reach zero. This will prevent
- * any new readers beign granted access but will not prevent current
- * readers releasing the read lock.
- *
- * Once we have no readers we increment writelock and test if we are
- * the only writelock holder, if not we repeat the process. We hold
- * the spinlock throughout the process since both read and write
- * locks do not require the spinlock to be acquired.
+ * A read-mostly table sets writelock, which prevents new readers from
+ * being granted access but does not prevent current readers from releasing
+ * the read lock, and then waits for the reader counts of all slots to reach
+ * zero.
  *
  * @param table The table to lock for updates
  */
 static void
 hashtable_write_lock(HASHTABLE *table)
 {
-    int available;
-
-    spinlock_acquire(&table->spin);
-    do
+    if (table->readers)
     {
-        while (table->n_readers)
+        /** Once writelock is set, new readers back off and the writer only
+         * has to wait for the current readers to release their locks */
+        while (!atomic_cas_int(&table->writelock, 0, 1))
         {
-            ;
+            while (*(volatile int*)&table->writelock)
+            {
+                ;
+            }
         }
-        available = atomic_add(&table->writelock, 1);
-        if (available != 0)
+        for (int i = 0; i < HASHTABLE_READER_SLOTS; i++)
         {
-            atomic_add(&table->writelock, -1);
+            while (*(volatile int*)&table->readers[i].n_readers)
+            {
+                ;
+            }
         }
+        return;
     }
-    while (available != 0);
-    spinlock_release(&table->spin);
+
+    rwlock_write_acquire(&table->rwlock);
 }
 
 /**
@@ -621,7 +687,14 @@ hashtable_write_lock(HASHTABLE *table)
 static void
 hashtable_write_unlock(HASHTABLE *table)
 {
-    atomic_add(&table->writelock, -1);
+    if (table->readers)
+    {
+        atomic_add(&table->writelock, -1);
+    }
+    else
+    {
+        rwlock_write_release(&table->rwlock);
+    }
 }
 
 /**
@@ -689,6 +762,41 @@ hashtable_next(HASHITERATOR *iter)
     return NULL;
 }
 
+/**
+ * Return the value of the key that was last returned by hashtable_next
+ *
+ * @param iter  The hashtable iterator
+ * @return      The value of the current key or NULL
+ */
+void *
+hashtable_iterator_value(HASHITERATOR *iter)
+{
+    int i;
+    HASHENTRIES *entries;
+    void *rval = NULL;
+
+    if (iter == NULL || iter->chain >= iter->table->hashsize)
+    {
+        return NULL;
+    }
+
+    hashtable_read_lock(iter->table);
+    entries = iter->table->entries[iter->chain];
+
+    for (i = 0; entries && i < iter->depth; i++)
+    {
+        entries = entries->next;
+    }
+
+    if (entries)
+    {
+        rval = entries->value;
+    }
+    hashtable_read_unlock(iter->table);
+
+    return rval;
+}
+
 /**
  * Free a hashtable iterator
  *
@@ -821,8 +929,5 @@ hashtable_load(HASHTABLE *table, const char *filename,
 int hashtable_size(HASHTABLE *table)
 {
     assert(table);
-    spinlock_acquire(&table->spin);
-    int rval = table->n_elements;
-    spinlock_release(&table->spin);
-    return rval;
+    return *(volatile int*)&table->n_elements;
 }
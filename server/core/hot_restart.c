@@ -0,0 +1,715 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file hot_restart.c  - Hand-off of the listening sockets to a new process
+ *
+ * The running process accepts the new process on the hot restart socket in
+ * a housekeeper task. The exchange is:
+ *
+ *   new -> old  HOT_RESTART_MAGIC
+ *   old -> new  for each listener, its sockets with SCM_RIGHTS in messages
+ *               of at most HOT_RESTART_MAX_FDS sockets, each message with
+ *               the number of sockets of the listener; the listeners are
+ *               removed from polling first
+ *   old -> new  0, the end of the listeners
+ *   new -> old  HOT_RESTART_ACK
+ *   old -> new  HOT_RESTART_DONE, once the PID file has been unlocked
+ *
+ * Until the acknowledgement is read, the old process can restart its
+ * listeners and go on as if nothing happened. After it, the old process
+ * closes its copies of the sockets, releases the PID file and drains: it
+ * shuts down once it has no client connections or when the drain timeout
+ * expires. The connections waiting in the accept queues are accepted by the
+ * new process, as the sockets themselves are not closed.
+ *
+ * The new process matches the received sockets with its listeners by their
+ * addresses. The sockets that no listener takes are closed once the services
+ * have been started.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * 14/10/16     MariaDB Corporation     Send the sockets of a listener in several messages
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <hot_restart.h>
+#include <dcb.h>
+#include <service.h>
+#include <listener.h>
+#include <housekeeper.h>
+#include <maxconfig.h>
+#include <spinlock.h>
+#include <gw.h>
+#include <log_manager.h>
+#include <skygw_utils.h>
+
+#define HOT_RESTART_MAGIC   "MAXSCALE-HOT-RESTART-1"
+#define HOT_RESTART_ACK     'K'
+#define HOT_RESTART_DONE    'D'
+
+/** How long the processes wait for each other during the hand-off */
+#define HOT_RESTART_TIMEOUT 10
+
+/** Most sockets sent in one message */
+#define HOT_RESTART_MAX_FDS 253
+
+/** The sockets of a listener of the previous process */
+typedef struct hot_restart_listener
+{
+    int                          *fds;   /*< The sockets, the first one is the main one */
+    int                           n_fds; /*< Number of sockets */
+    struct sockaddr_storage       addr;  /*< The address of the sockets */
+    socklen_t                     addrlen;
+    struct hot_restart_listener  *next;
+} HOT_RESTART_LISTENER;
+
+static SPINLOCK inherited_lock = SPINLOCK_INIT;
+static HOT_RESTART_LISTENER *inherited = NULL; /*< Sockets not yet taken by a listener */
+
+static int control_fd = -1;     /*< The hot restart socket of this process */
+static int pid_fd = -1;         /*< The locked PID file of this process */
+static bool handed_off = false; /*< The listeners were handed off to a new process */
+static time_t drain_start = 0;  /*< When the listeners were handed off */
+static bool shutting_down = false;
+
+static void hot_restart_check(void *data);
+
+/**
+ * Set the send and receive timeouts of a socket used in the hand-off
+ *
+ * @param fd The socket
+ */
+static void
+hot_restart_set_timeouts(int fd)
+{
+    struct timeval tv = {HOT_RESTART_TIMEOUT, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * Close sockets
+ *
+ * @param fds   The sockets
+ * @param n_fds Number of sockets
+ */
+static void
+hot_restart_close_fds(int *fds, int n_fds)
+{
+    for (int i = 0; i < n_fds; i++)
+    {
+        close(fds[i]);
+    }
+}
+
+/**
+ * Receive one message with sockets of a listener
+ *
+ * @param fd    The connection to the old process
+ * @param total Set to the number of sockets of the listener, 0 at the end of
+ *              the listeners
+ * @param fds   Array of at least HOT_RESTART_MAX_FDS elements for the sockets
+ * @return Number of sockets in the message, 0 at the end of the listeners or
+ *         -1 on error
+ */
+static int
+hot_restart_recv_fds(int fd, int *total, int *fds)
+{
+    char control[CMSG_SPACE(HOT_RESTART_MAX_FDS * sizeof(int))];
+    struct iovec iov = {total, sizeof(*total)};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(*total) || *total < 0)
+    {
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (cmsg == NULL)
+    {
+        return *total == 0 ? 0 : -1;
+    }
+
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len <= CMSG_LEN(0))
+    {
+        return -1;
+    }
+
+    int n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), n_fds * sizeof(int));
+
+    if ((msg.msg_flags & MSG_CTRUNC) || n_fds > *total)
+    {
+        hot_restart_close_fds(fds, n_fds);
+        return -1;
+    }
+
+    return n_fds;
+}
+
+/**
+ * Receive the sockets of one listener
+ *
+ * @param fd  The connection to the old process
+ * @param fds Set to the sockets, the caller frees the array
+ * @return Number of sockets received, 0 at the end of the listeners or -1 on error
+ */
+static int
+hot_restart_recv_listener(int fd, int **fds)
+{
+    int received[HOT_RESTART_MAX_FDS];
+    int total;
+    int n = hot_restart_recv_fds(fd, &total, received);
+
+    if (n <= 0)
+    {
+        return n;
+    }
+
+    int *all = malloc(total * sizeof(int));
+    int n_fds = 0;
+
+    if (all == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the listeners of the running process.");
+        hot_restart_close_fds(received, n);
+        return -1;
+    }
+
+    while (true)
+    {
+        memcpy(all + n_fds, received, n * sizeof(int));
+        n_fds += n;
+
+        if (n_fds == total)
+        {
+            break;
+        }
+
+        int next_total;
+
+        if ((n = hot_restart_recv_fds(fd, &next_total, received)) <= 0 ||
+            next_total != total || n > total - n_fds)
+        {
+            hot_restart_close_fds(received, MAX(n, 0));
+            hot_restart_close_fds(all, n_fds);
+            free(all);
+            return -1;
+        }
+    }
+
+    *fds = all;
+    return n_fds;
+}
+
+/**
+ * Take over the listening sockets of a running MaxScale process. This is
+ * called at startup, before the services are started.
+ *
+ * @param path The hot restart socket
+ * @return True if the sockets were taken over from a running process,
+ *         false if no process was running or the hand-off failed
+ */
+bool
+hot_restart_receive(const char *path)
+{
+    struct sockaddr_un addr;
+    char errbuf[STRERROR_BUFLEN];
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    {
+        MXS_ERROR("Failed to create a socket for hot restart: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        /** No process is running, this is a normal start */
+        if (errno != ENOENT && errno != ECONNREFUSED)
+        {
+            MXS_ERROR("Failed to connect to the hot restart socket '%s': %d, %s",
+                      path, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+        close(fd);
+        return false;
+    }
+
+    hot_restart_set_timeouts(fd);
+
+    if (write(fd, HOT_RESTART_MAGIC, sizeof(HOT_RESTART_MAGIC)) != sizeof(HOT_RESTART_MAGIC))
+    {
+        MXS_ERROR("Failed to request the listeners of the running MaxScale process: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        close(fd);
+        return false;
+    }
+
+    HOT_RESTART_LISTENER *received = NULL;
+    int *fds;
+    int n_listeners = 0;
+    int n_fds;
+    bool ok = true;
+
+    while ((n_fds = hot_restart_recv_listener(fd, &fds)) > 0)
+    {
+        HOT_RESTART_LISTENER *listener = calloc(1, sizeof(HOT_RESTART_LISTENER));
+
+        if (listener == NULL)
+        {
+            MXS_ERROR("Failed to allocate memory for the listeners of the running process.");
+            hot_restart_close_fds(fds, n_fds);
+            free(fds);
+            ok = false;
+            break;
+        }
+
+        listener->fds = fds;
+        listener->n_fds = n_fds;
+        listener->addrlen = sizeof(listener->addr);
+
+        if (getsockname(fds[0], (struct sockaddr*)&listener->addr, &listener->addrlen) == -1)
+        {
+            listener->addrlen = 0;
+        }
+
+        listener->next = received;
+        received = listener;
+        n_listeners++;
+    }
+
+    if (n_fds == -1)
+    {
+        MXS_ERROR("Failed to receive the listeners of the running MaxScale process: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        ok = false;
+    }
+
+    char ack = HOT_RESTART_ACK;
+
+    if (ok && write(fd, &ack, sizeof(ack)) != sizeof(ack))
+    {
+        MXS_ERROR("Failed to acknowledge the listeners of the running MaxScale process: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        ok = false;
+    }
+
+    /** The PID file is locked until the old process is done */
+    if (ok && (read(fd, &ack, sizeof(ack)) != sizeof(ack) || ack != HOT_RESTART_DONE))
+    {
+        MXS_WARNING("The running MaxScale process did not confirm the hot restart.");
+    }
+
+    close(fd);
+
+    if (!ok)
+    {
+        /** The old process restarts its listeners when it gets no acknowledgement */
+        inherited = received;
+        hot_restart_close_unused();
+        return false;
+    }
+
+    inherited = received;
+    MXS_NOTICE("Took over %d listeners from the running MaxScale process.", n_listeners);
+    return true;
+}
+
+/**
+ * Compare the address of received sockets with the address of a listener
+ *
+ * @param listener The received sockets
+ * @param config   The address of the listener, as given to dcb_listen
+ * @return True if the addresses are the same
+ */
+static bool
+hot_restart_same_address(HOT_RESTART_LISTENER *listener, const char *config)
+{
+    if (strchr(config, '/'))
+    {
+        struct sockaddr_un *addr = (struct sockaddr_un*)&listener->addr;
+        char path[sizeof(addr->sun_path)];
+        char *colon;
+
+        strncpy(path, config, sizeof(path) - 1);
+        path[sizeof(path) - 1] = '\0';
+
+        if ((colon = strrchr(path, ':')))
+        {
+            *colon = '\0';
+        }
+
+        return addr->sun_family == AF_UNIX && strcmp(addr->sun_path, path) == 0;
+    }
+    else
+    {
+        struct sockaddr_in *addr = (struct sockaddr_in*)&listener->addr;
+        struct sockaddr_in wanted;
+
+        memset(&wanted, 0, sizeof(wanted));
+
+        return parse_bindconfig(config, &wanted) && addr->sin_family == AF_INET &&
+               addr->sin_port == wanted.sin_port &&
+               addr->sin_addr.s_addr == wanted.sin_addr.s_addr;
+    }
+}
+
+/**
+ * Take the sockets received from the previous process for a listener
+ *
+ * @param config The address of the listener, as given to dcb_listen
+ * @param fds    Set to the sockets, the caller frees the array
+ * @param n_fds  Set to the number of sockets
+ * @return True if sockets with the address were received
+ */
+bool
+hot_restart_take_listener(const char *config, int **fds, int *n_fds)
+{
+    HOT_RESTART_LISTENER *found = NULL;
+
+    spinlock_acquire(&inherited_lock);
+
+    for (HOT_RESTART_LISTENER **prev = &inherited; *prev; prev = &(*prev)->next)
+    {
+        if ((*prev)->addrlen > 0 && hot_restart_same_address(*prev, config))
+        {
+            found = *prev;
+            *prev = found->next;
+            break;
+        }
+    }
+
+    spinlock_release(&inherited_lock);
+
+    if (found == NULL)
+    {
+        return false;
+    }
+
+    *fds = found->fds;
+    *n_fds = found->n_fds;
+    free(found);
+    return true;
+}
+
+/**
+ * Close the received sockets that no listener took, the ones of the
+ * listeners that were removed from the configuration
+ */
+void
+hot_restart_close_unused()
+{
+    spinlock_acquire(&inherited_lock);
+    HOT_RESTART_LISTENER *listener = inherited;
+    inherited = NULL;
+    spinlock_release(&inherited_lock);
+
+    while (listener)
+    {
+        HOT_RESTART_LISTENER *next = listener->next;
+
+        for (int i = 0; i < listener->n_fds; i++)
+        {
+            close(listener->fds[i]);
+        }
+
+        free(listener->fds);
+        free(listener);
+        listener = next;
+    }
+}
+
+/**
+ * Start waiting for a new process on the hot restart socket
+ *
+ * @param path  The hot restart socket
+ * @param pidfd The locked PID file, unlocked once the listeners are handed off
+ * @return True if the socket is listening
+ */
+bool
+hot_restart_listen(const char *path, int pidfd)
+{
+    struct sockaddr_un addr;
+    char errbuf[STRERROR_BUFLEN];
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if ((control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    {
+        MXS_ERROR("Failed to create the hot restart socket: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    if ((unlink(path) == -1 && errno != ENOENT) ||
+        bind(control_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        chmod(path, 0600) == -1 ||
+        listen(control_fd, 1) == -1)
+    {
+        MXS_ERROR("Failed to listen on the hot restart socket '%s': %d, %s",
+                  path, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        close(control_fd);
+        control_fd = -1;
+        return false;
+    }
+
+    pid_fd = pidfd;
+    hktask_add("Hot restart", hot_restart_check, NULL, 1);
+    return true;
+}
+
+/**
+ * Check whether the listeners were handed off to a new process. The process
+ * that handed them off leaves the PID file to the new one.
+ *
+ * @return True if the listeners were handed off
+ */
+bool
+hot_restart_handed_off()
+{
+    return handed_off;
+}
+
+/**
+ * Send one message with sockets of a listener
+ *
+ * @param fd        The connection to the new process
+ * @param total     Number of sockets of the listener, 0 for the end of the listeners
+ * @param fds       The sockets
+ * @param n_fds     Number of sockets in the message, at most HOT_RESTART_MAX_FDS
+ * @return True if the message was sent
+ */
+static bool
+hot_restart_send_fds(int fd, int total, int *fds, int n_fds)
+{
+    char control[CMSG_SPACE(HOT_RESTART_MAX_FDS * sizeof(int))];
+    struct iovec iov = {&total, sizeof(total)};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (n_fds > 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+    }
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(total);
+}
+
+/**
+ * Send the sockets of one listener
+ *
+ * @param fd        The connection to the new process
+ * @param fds       The sockets
+ * @param n_fds     Number of sockets, 0 for the end of the listeners
+ * @return True if the sockets were sent
+ */
+static bool
+hot_restart_send_listener(int fd, int *fds, int n_fds)
+{
+    int sent = 0;
+
+    do
+    {
+        int n = MIN(n_fds - sent, HOT_RESTART_MAX_FDS);
+
+        if (!hot_restart_send_fds(fd, n_fds, fds + sent, n))
+        {
+            return false;
+        }
+
+        sent += n;
+    }
+    while (sent < n_fds);
+
+    return true;
+}
+
+/**
+ * Hand the listeners off to a new process that connected to the hot restart
+ * socket. If the new process does not acknowledge them, the listeners are
+ * restarted.
+ *
+ * @param fd The connection to the new process
+ */
+static void
+hot_restart_hand_off(int fd)
+{
+    char magic[sizeof(HOT_RESTART_MAGIC)];
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    hot_restart_set_timeouts(fd);
+
+    /** Only a process of the same user may take the listeners */
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 || cred.uid != getuid())
+    {
+        MXS_ERROR("Refused a hot restart by a process of another user.");
+        return;
+    }
+
+    if (read(fd, magic, sizeof(magic)) != sizeof(magic) ||
+        memcmp(magic, HOT_RESTART_MAGIC, sizeof(magic)) != 0)
+    {
+        MXS_ERROR("Invalid hot restart request on the hot restart socket.");
+        return;
+    }
+
+    MXS_NOTICE("A new MaxScale process %d is taking over the listeners.", cred.pid);
+
+    int n_ports;
+    SERV_LISTENER **ports = serviceStopAllListeners(&n_ports);
+    bool ok = true;
+
+    for (int i = 0; i < n_ports && ok; i++)
+    {
+        DCB *listener = ports[i]->listener;
+
+        if (listener->n_thread_fds > 0)
+        {
+            ok = hot_restart_send_listener(fd, listener->thread_fds, listener->n_thread_fds);
+        }
+        else
+        {
+            ok = hot_restart_send_listener(fd, &listener->fd, 1);
+        }
+    }
+
+    char ack;
+
+    if (!ok || !hot_restart_send_listener(fd, NULL, 0) ||
+        read(fd, &ack, sizeof(ack)) != sizeof(ack) || ack != HOT_RESTART_ACK)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("The hot restart failed, restarting the listeners: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+
+        for (int i = 0; i < n_ports; i++)
+        {
+            serviceRestartListener(ports[i]);
+        }
+        free(ports);
+        return;
+    }
+
+    /** The new process owns the sockets now */
+    for (int i = 0; i < n_ports; i++)
+    {
+        dcb_listener_close_sockets(ports[i]->listener);
+    }
+    free(ports);
+
+    close(control_fd);
+    control_fd = -1;
+
+    if (pid_fd != -1)
+    {
+        flock(pid_fd, LOCK_UN);
+        close(pid_fd);
+        pid_fd = -1;
+    }
+
+    handed_off = true;
+    drain_start = time(NULL);
+
+    char done = HOT_RESTART_DONE;
+    if (write(fd, &done, sizeof(done)) != sizeof(done))
+    {
+        MXS_WARNING("Failed to confirm the hot restart to the new process.");
+    }
+
+    MXS_NOTICE("Handed off %d listeners, waiting for the client connections to close.",
+               n_ports);
+}
+
+/**
+ * The housekeeper task of hot restart: waits for a new process and, once the
+ * listeners have been handed off to it, shuts down when the client
+ * connections have closed or the drain timeout expires.
+ *
+ * @param data Not used
+ */
+static void
+hot_restart_check(void *data)
+{
+    if (!handed_off)
+    {
+        int fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd != -1)
+        {
+            hot_restart_hand_off(fd);
+            close(fd);
+        }
+    }
+    else if (!shutting_down)
+    {
+        int clients = dcb_count_by_usage(DCB_USAGE_CLIENT);
+        int timeout = config_hot_restart_drain_timeout();
+
+        if (clients == 0 || (timeout > 0 && time(NULL) - drain_start >= timeout))
+        {
+            if (clients > 0)
+            {
+                MXS_WARNING("Drain timeout of %d seconds expired, closing %d client "
+                            "connections.", timeout, clients);
+            }
+
+            MXS_NOTICE("The listeners were handed off to a new process, shutting down.");
+            shutting_down = true;
+            kill(getpid(), SIGTERM);
+        }
+    }
+}
@@ -26,6 +26,11 @@
  * shot task that will only be run once after a specified number of
  * seconds.
  *
+ * Each task has a timer in the timer wheel of the housekeeper which the
+ * housekeeper thread runs on every heartbeat. The tasks are also kept in
+ * a hashed index by name so that adding and removing a task does not need
+ * to walk all of the tasks.
+ *
  * The housekeeper also maintains a global variable, hkheartbeat, that
  * is incremented every 100ms.
  *
@@ -35,24 +40,58 @@
  * Date         Who             Description
  * 29/08/14     Mark Riddoch    Initial implementation
  * 22/10/14     Mark Riddoch    Addition of one-shot tasks
+ * 14/10/16     MariaDB Corporation Tasks are run from a timer wheel
  *
  * @endverbatim
  */
 
+/** Length of one tick of the timer wheel, one heartbeat */
+#define HK_TIMER_RESOLUTION 100
+
+/** Number of buckets in the name index of the tasks */
+#define HK_INDEX_SIZE 256
+
 /**
- * List of all tasks that need to be run
+ * List of all tasks that need to be run, in the order they were added
  */
 static HKTASK *tasks = NULL;
+static HKTASK *tasks_tail = NULL;
 /**
- * Spinlock to protect the tasks list
+ * The tasks hashed by their names
+ */
+static HKTASK *task_index[HK_INDEX_SIZE];
+/**
+ * Spinlock to protect the tasks list and the name index
  */
 static SPINLOCK tasklock = SPINLOCK_INIT;
+/**
+ * The timer wheel of the housekeeper thread and the task being run
+ */
+static TIMER_WHEEL hk_wheel;
+static bool hk_wheel_ready = false;
+static HKTASK *running_task = NULL;
 
 static int do_shutdown = 0;
 long hkheartbeat = 0; /*< One heartbeat is 100 milliseconds */
 static THREAD hk_thr_handle;
 
 static void hkthread(void *);
+static void hktask_run(void *);
+
+/**
+ * Initialise the timer wheel if it has not been initialised. Tasks can be
+ * added before the housekeeper thread is started. The caller must hold
+ * the tasklock.
+ */
+static void
+hk_wheel_init()
+{
+    if (!hk_wheel_ready)
+    {
+        timer_wheel_init(&hk_wheel, HK_TIMER_RESOLUTION);
+        hk_wheel_ready = true;
+    }
+}
 
 /**
  * Initialise the housekeeper thread
@@ -60,6 +99,10 @@ static void hkthread(void *);
 void
 hkinit()
 {
+    spinlock_acquire(&tasklock);
+    hk_wheel_init();
+    spinlock_release(&tasklock);
+
     if (thread_start(&hk_thr_handle, hkthread, NULL) == NULL)
     {
         MXS_ERROR("Failed to start housekeeper thread.");
@@ -67,73 +110,214 @@ hkinit()
 }
 
 /**
- * Add a new task to the housekeepers lists of tasks that should be
- * run periodically.
+ * Return the bucket of a task name in the name index
  *
- * The task will be first run frequency seconds after this call is
- * made and will the be executed repeatedly every frequency seconds
- * until the task is removed.
+ * @param name  The task name
+ * @return The bucket index
+ */
+static unsigned int
+hktask_hash(const char *name)
+{
+    unsigned int hash = 5381;
+
+    while (*name)
+    {
+        hash = hash * 33 + (unsigned char)*name++;
+    }
+
+    return hash % HK_INDEX_SIZE;
+}
+
+/**
+ * Find the oldest task with a name. The caller must hold the tasklock.
  *
- * Task names must be unique.
+ * @param name  The task name
+ * @return The task or NULL if no task has the name
+ */
+static HKTASK *
+hktask_find(const char *name)
+{
+    HKTASK *ptr = task_index[hktask_hash(name)];
+
+    while (ptr && strcmp(ptr->name, name) != 0)
+    {
+        ptr = ptr->hash_next;
+    }
+
+    return ptr;
+}
+
+/**
+ * Add a task to the task list and the name index. The caller must hold
+ * the tasklock.
  *
- * @param name          The unique name for this housekeeper task
+ * @param task  The task to add
+ */
+static void
+hktask_link(HKTASK *task)
+{
+    HKTASK **pptr = &task_index[hktask_hash(task->name)];
+
+    while (*pptr)
+    {
+        pptr = &(*pptr)->hash_next;
+    }
+    *pptr = task;
+
+    task->prev = tasks_tail;
+    if (tasks_tail)
+    {
+        tasks_tail->next = task;
+    }
+    else
+    {
+        tasks = task;
+    }
+    tasks_tail = task;
+}
+
+/**
+ * Remove a task from the task list and the name index. The caller must
+ * hold the tasklock.
+ *
+ * @param task  The task to remove
+ */
+static void
+hktask_unlink(HKTASK *task)
+{
+    HKTASK **pptr = &task_index[hktask_hash(task->name)];
+
+    while (*pptr != task)
+    {
+        pptr = &(*pptr)->hash_next;
+    }
+    *pptr = task->hash_next;
+
+    if (task->prev)
+    {
+        task->prev->next = task->next;
+    }
+    else
+    {
+        tasks = task->next;
+    }
+    if (task->next)
+    {
+        task->next->prev = task->prev;
+    }
+    else
+    {
+        tasks_tail = task->prev;
+    }
+}
+
+/**
+ * Allocate a new task
+ *
+ * @param name          The name of the task
  * @param taskfn        The function to call for the task
  * @param data          Data to pass to the task function
- * @param frequency     How often to run the task, expressed in seconds
- * @return              Return the time in seconds when the task will be first run
- *                      if the task was added, otherwise 0
+ * @param frequency     How often to run the task in seconds, 0 for one-shot tasks
+ * @param type          The task type
+ * @return The new task or NULL if memory allocation failed
  */
-int
-hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
+static HKTASK *
+hktask_alloc(const char *name, void (*taskfn)(void *), void *data, int frequency, HKTASK_TYPE type)
 {
-    HKTASK *task, *ptr;
+    HKTASK *task;
 
     if ((task = (HKTASK *)malloc(sizeof(HKTASK))) == NULL)
     {
-        return 0;
+        return NULL;
     }
     if ((task->name = strdup(name)) == NULL)
     {
         free(task);
-        return 0;
+        return NULL;
     }
     task->task = taskfn;
     task->data = data;
     task->frequency = frequency;
-    task->type = HK_REPEATED;
-    task->nextdue = time(0) + frequency;
+    task->type = type;
+    task->removed = false;
     task->next = NULL;
+    task->prev = NULL;
+    task->hash_next = NULL;
+    timer_init(&task->timer, hktask_run, task);
+    return task;
+}
+
+/**
+ * Free a task
+ *
+ * @param task  The task to free
+ */
+static void
+hktask_free(HKTASK *task)
+{
+    free(task->name);
+    free(task);
+}
+
+/**
+ * Link a task and start its timer
+ *
+ * @param task          The task
+ * @param when          Seconds until the task is first run
+ * @param unique        Whether the task name must be unique
+ * @return The time in seconds when the task will be first run or 0 if
+ *         another task has the same name
+ */
+static int
+hktask_start(HKTASK *task, int when, bool unique)
+{
     spinlock_acquire(&tasklock);
-    ptr = tasks;
-    while (ptr && ptr->next)
-    {
-        if (strcmp(ptr->name, name) == 0)
-        {
-            spinlock_release(&tasklock);
-            free(task->name);
-            free(task);
-            return 0;
-        }
-        ptr = ptr->next;
-    }
-    if (ptr)
+    hk_wheel_init();
+
+    if (unique && hktask_find(task->name))
     {
-        if (strcmp(ptr->name, name) == 0)
-        {
-            spinlock_release(&tasklock);
-            free(task->name);
-            free(task);
-            return 0;
-        }
-        ptr->next = task;
+        spinlock_release(&tasklock);
+        hktask_free(task);
+        return 0;
     }
-    else
+
+    task->nextdue = time(0) + when;
+    hktask_link(task);
+    timer_add(&hk_wheel, &task->timer, when * 1000, task->frequency * 1000);
+    int rval = task->nextdue;
+    spinlock_release(&tasklock);
+
+    return rval;
+}
+
+/**
+ * Add a new task to the housekeepers lists of tasks that should be
+ * run periodically.
+ *
+ * The task will be first run frequency seconds after this call is
+ * made and will the be executed repeatedly every frequency seconds
+ * until the task is removed.
+ *
+ * Task names must be unique.
+ *
+ * @param name          The unique name for this housekeeper task
+ * @param taskfn        The function to call for the task
+ * @param data          Data to pass to the task function
+ * @param frequency     How often to run the task, expressed in seconds
+ * @return              Return the time in seconds when the task will be first run
+ *                      if the task was added, otherwise 0
+ */
+int
+hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
+{
+    HKTASK *task;
+
+    if ((task = hktask_alloc(name, taskfn, data, frequency, HK_REPEATED)) == NULL)
     {
-        tasks = task;
+        return 0;
     }
-    spinlock_release(&tasklock);
 
-    return task->nextdue;
+    return hktask_start(task, frequency, true);
 }
 
 /**
@@ -152,149 +336,122 @@ hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
 int
 hktask_oneshot(const char *name, void (*taskfn)(void *), void *data, int when)
 {
-    HKTASK *task, *ptr;
+    HKTASK *task;
 
-    if ((task = (HKTASK *)malloc(sizeof(HKTASK))) == NULL)
-    {
-        return 0;
-    }
-    if ((task->name = strdup(name)) == NULL)
+    if ((task = hktask_alloc(name, taskfn, data, 0, HK_ONESHOT)) == NULL)
     {
-        free(task);
         return 0;
     }
-    task->task = taskfn;
-    task->data = data;
-    task->frequency = 0;
-    task->type = HK_ONESHOT;
-    task->nextdue = time(0) + when;
-    task->next = NULL;
-    spinlock_acquire(&tasklock);
-    ptr = tasks;
-    while (ptr && ptr->next)
-    {
-        ptr = ptr->next;
-    }
-    if (ptr)
-    {
-        ptr->next = task;
-    }
-    else
-    {
-        tasks = task;
-    }
-    spinlock_release(&tasklock);
 
-    return task->nextdue;
+    return hktask_start(task, when, false);
 }
 
 
 /**
  * Remove a named task from the housekeepers task list
  *
+ * If the task is being run, it is freed by the housekeeper thread once
+ * the task function returns.
+ *
  * @param name          The task name to remove
  * @return              Returns 0 if the task could not be removed
  */
 int
 hktask_remove(const char *name)
 {
-    HKTASK *ptr, *lptr = NULL;
+    HKTASK *ptr;
+    bool running;
 
     spinlock_acquire(&tasklock);
-    ptr = tasks;
-    while (ptr && strcmp(ptr->name, name) != 0)
+    if ((ptr = hktask_find(name)) == NULL)
     {
-        lptr = ptr;
-        ptr = ptr->next;
+        spinlock_release(&tasklock);
+        return 0;
     }
-    if (ptr && lptr)
+    hktask_unlink(ptr);
+    ptr->removed = true;
+    running = ptr == running_task;
+    spinlock_release(&tasklock);
+
+    if (!running)
     {
-        lptr->next = ptr->next;
+        /** Waits for the task function if it was just about to be called */
+        timer_cancel(&ptr->timer);
+        hktask_free(ptr);
     }
-    else if (ptr)
+
+    return 1;
+}
+
+/**
+ * Run a housekeeper task. Called by the timer wheel in the housekeeper thread.
+ *
+ * The task function is called without the tasklock being held, which allows
+ * the manipulation of the housekeeper tasks in the task function, including
+ * the removal of the task itself. A repeating task has already been added
+ * back to the wheel by the time the task function is called.
+ *
+ * @param data  The task
+ */
+static void
+hktask_run(void *data)
+{
+    HKTASK *task = (HKTASK *)data;
+    bool free_task = false;
+
+    spinlock_acquire(&tasklock);
+    if (task->removed)
     {
-        tasks = ptr->next;
+        /** The task is freed by the thread that removed it */
+        spinlock_release(&tasklock);
+        return;
     }
+    task->nextdue = time(0) + task->frequency;
+    running_task = task;
     spinlock_release(&tasklock);
 
-    if (ptr)
+    task->task(task->data);
+
+    spinlock_acquire(&tasklock);
+    running_task = NULL;
+    if (task->removed)
     {
-        free(ptr->name);
-        free(ptr);
-        return 1;
+        free_task = true;
     }
-    else
+    else if (task->type == HK_ONESHOT)
     {
-        return 0;
+        hktask_unlink(task);
+        free_task = true;
     }
-}
+    spinlock_release(&tasklock);
 
+    if (free_task)
+    {
+        timer_cancel(&task->timer);
+        hktask_free(task);
+    }
+}
 
 /**
  * The housekeeper thread implementation.
  *
- * This function is responsible for executing the housekeeper tasks.
- *
- * The implementation of the callng of the task functions is such that
- * the tasks are called without the tasklock spinlock being held. This
- * allows manipulation of the housekeeper task list during execution of
- * one of the tasks. The resutl is that upon completion of a task the
- * search for tasks to run must restart from the start of the queue.
- * It is vital that the task->nextdue tiem is updated before the task
- * is run.
+ * This function is responsible for maintaining the heartbeat and for
+ * running the timer wheel of the housekeeper tasks once every heartbeat.
  *
  * @param       data            Unused, here to satisfy the thread system
  */
 void
 hkthread(void *data)
 {
-    HKTASK *ptr;
-    time_t now;
-    void (*taskfn)(void *);
-    void *taskdata;
-    int i;
-
     for (;;)
     {
-        for (i = 0; i < 10; i++)
+        if (do_shutdown)
         {
-            if (do_shutdown)
-            {
-                return;
-            }
-            thread_millisleep(100);
-            hkheartbeat++;
+            return;
         }
-        now = time(0);
-        spinlock_acquire(&tasklock);
-        ptr = tasks;
-        while (ptr)
-        {
-            if (ptr->nextdue <= now)
-            {
-                ptr->nextdue = now + ptr->frequency;
-                taskfn = ptr->task;
-                taskdata = ptr->data;
-                // We need to copy type and name, in case hktask_remove is called from
-                // the callback. Otherwise we will access freed data.
-                HKTASK_TYPE type = ptr->type;
-                char name[strlen(ptr->name) + 1];
-                strcpy(name, ptr->name);
-                spinlock_release(&tasklock);
-                (*taskfn)(taskdata);
-                if (type == HK_ONESHOT)
-                {
-                    hktask_remove(name);
-                }
-                spinlock_acquire(&tasklock);
-                ptr = tasks;
-            }
-            else
-            {
-                ptr = ptr->next;
-            }
-        }
-        spinlock_release(&tasklock);
+        thread_millisleep(HK_TIMER_RESOLUTION);
+        hkheartbeat++;
+        timer_wheel_run(&hk_wheel);
     }
 }
 
@@ -24,6 +24,9 @@
  *
  * Date         Who                     Description
  * 26/01/16     Martin Brampton         Initial implementation
+ * 14/10/16     MariaDB Corporation     Admission control of new connections
+ * 14/10/16     MariaDB Corporation     Session resumption and kernel TLS
+ * 14/10/16     MariaDB Corporation     Compressed protocol for the clients
  *
  * @endverbatim
  */
@@ -34,6 +37,10 @@
 #include <gw_ssl.h>
 #include <gw_protocol.h>
 #include <log_manager.h>
+#include <dcb.h>
+#include <timer.h>
+#include <maxconfig.h>
+#include <maxscale/poll.h>
 
 static RSA *rsa_512 = NULL;
 static RSA *rsa_1024 = NULL;
@@ -62,10 +69,201 @@ listener_alloc(char *protocol, char *address, unsigned short port, char *authent
         proto->port = port;
         proto->authenticator = authenticator ? strdup(authenticator) : NULL;
         proto->ssl = ssl;
+        proto->accept_rate = 0;
+        proto->accept_batch = 0;
+        spinlock_init(&proto->accept_lock);
+        proto->accept_tokens = 0;
+        proto->accept_refilled = 0;
+        proto->accept_timers = NULL;
+        proto->compression = 0;
+        proto->compress_plain = 0;
+        proto->compress_sent = 0;
+        proto->decompress_read = 0;
+        proto->decompress_plain = 0;
+        proto->compress_cpu_ns = 0;
     }
     return proto;
 }
 
+/**
+ * Set the limits of accepting new connections
+ *
+ * Connections that are not accepted because of the limits wait in the
+ * backlog of the listening socket.
+ *
+ * @param listener      The listener
+ * @param rate          Maximum connections accepted per second, 0 for no limit
+ * @param batch         Maximum connections accepted for one event, 0 for no limit
+ */
+void
+listener_set_accept_limits(SERV_LISTENER *listener, int rate, int batch)
+{
+    spinlock_acquire(&listener->accept_lock);
+    listener->accept_rate = rate > 0 ? rate : 0;
+    listener->accept_batch = batch > 0 ? batch : 0;
+    listener->accept_tokens = 0;
+    listener->accept_refilled = 0;
+    spinlock_release(&listener->accept_lock);
+}
+
+/**
+ * Set the compression of the client connections
+ *
+ * The compressed protocol is offered to the clients that connect to the
+ * listener after this. Clients that do not ask for it are not affected.
+ *
+ * @param listener      The listener
+ * @param level         The zlib compression level, 0 to not offer compression
+ */
+void
+listener_set_compression(SERV_LISTENER *listener, int level)
+{
+    listener->compression = level > 9 ? 9 : level > 0 ? level : 0;
+}
+
+/**
+ * Add the accept tokens for the time passed since they were last added.
+ * The tokens cover at most a tenth of a second. The caller must hold the
+ * accept lock.
+ *
+ * @param listener      The listener
+ * @param now           The current time in milliseconds
+ */
+static void
+listener_refill_tokens(SERV_LISTENER *listener, long now)
+{
+    int capacity = listener->accept_rate / 10 > 0 ? listener->accept_rate / 10 : 1;
+    long tokens = (now - listener->accept_refilled) * listener->accept_rate / 1000;
+
+    if (tokens > 0)
+    {
+        if (listener->accept_tokens + tokens >= capacity)
+        {
+            listener->accept_tokens = capacity;
+            listener->accept_refilled = now;
+        }
+        else
+        {
+            /** Keep the fraction of a token that has not yet been added */
+            listener->accept_tokens += tokens;
+            listener->accept_refilled += tokens * 1000 / listener->accept_rate;
+        }
+    }
+}
+
+/**
+ * Check whether the accept rate of a listener allows a new connection now
+ *
+ * @param listener      The listener
+ * @return 0 if a connection may be accepted, otherwise the number of
+ *         milliseconds until one may be accepted
+ */
+int
+listener_accept_delay(SERV_LISTENER *listener)
+{
+    int delay = 0;
+
+    if (listener->accept_rate)
+    {
+        long now = timer_clock();
+
+        spinlock_acquire(&listener->accept_lock);
+        listener_refill_tokens(listener, now);
+
+        if (listener->accept_tokens <= 0)
+        {
+            delay = 1000 / listener->accept_rate - (now - listener->accept_refilled);
+
+            if (delay < 1)
+            {
+                delay = 1;
+            }
+        }
+        spinlock_release(&listener->accept_lock);
+    }
+
+    return delay;
+}
+
+/**
+ * Use an accept token of a listener for a new connection
+ *
+ * @param listener      The listener
+ */
+void
+listener_accepted(SERV_LISTENER *listener)
+{
+    if (listener->accept_rate)
+    {
+        spinlock_acquire(&listener->accept_lock);
+        if (listener->accept_tokens > 0)
+        {
+            listener->accept_tokens--;
+        }
+        spinlock_release(&listener->accept_lock);
+    }
+}
+
+/**
+ * Timer function that continues accepting the connections of a listener
+ *
+ * @param data The listener
+ */
+static void
+listener_accept_timer(void *data)
+{
+    SERV_LISTENER *listener = (SERV_LISTENER *)data;
+    DCB *dcb = listener->listener;
+
+    if (dcb && dcb->state == DCB_STATE_LISTENING && dcb->func.accept)
+    {
+        dcb->func.accept(dcb);
+    }
+}
+
+/**
+ * Continue accepting the connections of a listener later. The connections
+ * left in the backlog do not cause a new event, so the calling thread
+ * accepts them when the timer expires.
+ *
+ * @param listener      The listener
+ * @param delay         Milliseconds until accepting is continued
+ */
+void
+listener_resume_accept(SERV_LISTENER *listener, int delay)
+{
+    int thread_id = poll_current_thread();
+    TIMER *timer = NULL;
+
+    spinlock_acquire(&listener->accept_lock);
+    if (listener->accept_timers == NULL)
+    {
+        int n_threads = config_threadcount();
+
+        if ((listener->accept_timers = malloc(n_threads * sizeof(TIMER))) != NULL)
+        {
+            for (int i = 0; i < n_threads; i++)
+            {
+                timer_init(&listener->accept_timers[i], listener_accept_timer, listener);
+            }
+        }
+    }
+    if (listener->accept_timers)
+    {
+        timer = &listener->accept_timers[thread_id >= 0 ? thread_id : 0];
+    }
+    spinlock_release(&listener->accept_lock);
+
+    if (timer == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the accept timers of a listener.");
+    }
+    else if (!timer_pending(timer))
+    {
+        poll_add_timer(timer, delay, 0);
+    }
+}
+
 /**
  * Set the maximum SSL/TLS version the listener will support
  * @param ssl_listener Listener data to configure
@@ -178,6 +376,17 @@ listener_init_SSL(SSL_LISTENER *ssl_listener)
         /** Disable SSLv3 */
         SSL_CTX_set_options(ssl_listener->ctx, SSL_OP_NO_SSLv3);
 
+        if (config_ssl_ktls())
+        {
+#ifdef SSL_OP_ENABLE_KTLS
+            /** Let the kernel encrypt the established connections */
+            SSL_CTX_set_options(ssl_listener->ctx, SSL_OP_ENABLE_KTLS);
+#else
+            MXS_WARNING("Kernel TLS is not supported by this version of OpenSSL, "
+                        "the 'ssl_ktls' parameter is ignored.");
+#endif
+        }
+
         /** Generate the 512-bit and 1024-bit RSA keys */
         if (rsa_512 == NULL)
         {
@@ -242,6 +451,22 @@ listener_init_SSL(SSL_LISTENER *ssl_listener)
 
         /* Set the verification depth */
         SSL_CTX_set_verify_depth(ssl_listener->ctx, ssl_listener->ssl_cert_verify_depth);
+
+        /**
+         * Let reconnecting clients resume their sessions from the session
+         * cache or with session tickets. The session ID context is required
+         * for resuming when client certificates are verified.
+         */
+        SSL_CTX_set_session_cache_mode(ssl_listener->ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_clear_options(ssl_listener->ctx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_timeout(ssl_listener->ctx, SSL_SESSION_TIMEOUT);
+        if (!SSL_CTX_set_session_id_context(ssl_listener->ctx,
+                                            (const unsigned char *)SSL_SESSION_ID_CONTEXT,
+                                            sizeof(SSL_SESSION_ID_CONTEXT) - 1))
+        {
+            MXS_ERROR("Failed to set the SSL session ID context.");
+            return -1;
+        }
         ssl_listener->ssl_init_done = true;
     }
     return 0;
@@ -25,6 +25,8 @@
  *                                      Also updated to call fixed GetModuleObject
  * 02/06/14     Mark Riddoch            Addition of module info
  * 26/02/15     Massimiliano Pinto      Addition of module_feedback_send
+ * 14/10/16     MariaDB Corporation     Modules are found by name with a hashtable,
+ *                                      can be loaded by several threads at once
  *
  * @endverbatim
  */
@@ -45,8 +47,21 @@
 #include <openssl/sha.h>
 #include <gw.h>
 #include <gwdirs.h>
-
-static MODULES *registered = NULL;
+#include <hashtable.h>
+#include <atomic.h>
+#include <thread.h>
+#include <statistics.h>
+#include <pthread.h>
+
+/** The size of the hashtables of the modules */
+#define MODULES_HASH_SIZE 32
+
+static MODULES *registered = NULL;          /*< The list of the loaded modules */
+static HASHTABLE *modules_index = NULL;     /*< The loaded modules by name */
+static HASHTABLE *modules_loading = NULL;   /*< The names of the modules being loaded */
+static pthread_mutex_t modules_lock = PTHREAD_MUTEX_INITIALIZER; /*< Protects the above */
+static pthread_cond_t modules_loaded = PTHREAD_COND_INITIALIZER; /*< Signaled when a module
+                                                                  * has been loaded */
 
 static MODULES *find_module(const char *module);
 static void register_module(const char *module,
@@ -97,163 +112,281 @@ WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
 }
 
 /**
- * Load the dynamic library related to a gateway module. The routine
- * will look for library files in the current directory,
- * the configured folder and /usr/lib64/maxscale.
- *
- * Note that a number of entry points are standard for any module, as is
- * the data structure named "info".  They are only accessed by explicit
- * reference to the module, and so the fact that they are duplicated in
- * every module is not a problem.  The declarations are protected from
- * lint by suppressing error 14, since the duplication is a feature and
- * not an error.
+ * Load the shared object of a module and register the module
  *
  * @param module        Name of the module to load
  * @param type          Type of module, used purely for registration
  * @return              The module specific entry point structure or NULL
  */
-void *
-load_module(const char *module, const char *type)
+static void *
+load_module_file(const char *module, const char *type)
 {
-    char *home, *version;
+    char *version;
     char fname[MAXPATHLEN + 1];
     void *dlhandle, *sym;
     char *(*ver)();
     void *(*ep)(), *modobj;
-    MODULES *mod;
     MODULE_INFO *mod_info = NULL;
 
-    if (NULL == module || NULL == type)
+    snprintf(fname, MAXPATHLEN + 1, "%s/lib%s.so", get_libdir(), module);
+
+    if (access(fname, F_OK) == -1)
     {
+        MXS_ERROR("Unable to find library for "
+                  "module: %s. Module dir: %s",
+                  module, get_libdir());
         return NULL;
     }
 
-    if ((mod = find_module(module)) == NULL)
+    if ((dlhandle = dlopen(fname, RTLD_NOW | RTLD_LOCAL)) == NULL)
     {
-        /*<
-         * The module is not already loaded
-         *
-         * Search of the shared object.
-         */
+        MXS_ERROR("Unable to load library for module: "
+                  "%s\n\n\t\t      %s."
+                  "\n\n",
+                  module,
+                  dlerror());
+        return NULL;
+    }
 
-        snprintf(fname, MAXPATHLEN + 1, "%s/lib%s.so", get_libdir(), module);
+    if ((sym = dlsym(dlhandle, "version")) == NULL)
+    {
+        MXS_ERROR("Version interface not supported by "
+                  "module: %s\n\t\t\t      %s.",
+                  module,
+                  dlerror());
+        dlclose(dlhandle);
+        return NULL;
+    }
+    ver = sym;
+    version = ver();
 
-        if (access(fname, F_OK) == -1)
+    /*
+     * If the module has a ModuleInit function cal it now.
+     */
+    if ((sym = dlsym(dlhandle, "ModuleInit")) != NULL)
+    {
+        void (*ModuleInit)() = sym;
+        ModuleInit();
+    }
+
+    if ((sym = dlsym(dlhandle, "info")) != NULL)
+    {
+        int fatal = 0;
+        mod_info = sym;
+        if (strcmp(type, MODULE_PROTOCOL) == 0
+            && mod_info->modapi != MODULE_API_PROTOCOL)
         {
-            MXS_ERROR("Unable to find library for "
-                      "module: %s. Module dir: %s",
-                      module, get_libdir());
-            return NULL;
+            MXS_ERROR("Module '%s' does not implement the protocol API.", module);
+            fatal = 1;
         }
-
-        if ((dlhandle = dlopen(fname, RTLD_NOW | RTLD_LOCAL)) == NULL)
+        if (strcmp(type, MODULE_AUTHENTICATOR) == 0
+            && mod_info->modapi != MODULE_API_AUTHENTICATOR)
         {
-            MXS_ERROR("Unable to load library for module: "
-                      "%s\n\n\t\t      %s."
-                      "\n\n",
-                      module,
-                      dlerror());
-            return NULL;
+            MXS_ERROR("Module '%s' does not implement the authenticator API.", module);
+            fatal = 1;
         }
-
-        if ((sym = dlsym(dlhandle, "version")) == NULL)
+        if (strcmp(type, MODULE_ROUTER) == 0
+            && mod_info->modapi != MODULE_API_ROUTER)
         {
-            MXS_ERROR("Version interface not supported by "
-                      "module: %s\n\t\t\t      %s.",
-                      module,
-                      dlerror());
-            dlclose(dlhandle);
-            return NULL;
+            MXS_ERROR("Module '%s' does not implement the router API.", module);
+            fatal = 1;
         }
-        ver = sym;
-        version = ver();
-
-        /*
-         * If the module has a ModuleInit function cal it now.
-         */
-        if ((sym = dlsym(dlhandle, "ModuleInit")) != NULL)
+        if (strcmp(type, MODULE_MONITOR) == 0
+            && mod_info->modapi != MODULE_API_MONITOR)
         {
-            void (*ModuleInit)() = sym;
-            ModuleInit();
+            MXS_ERROR("Module '%s' does not implement the monitor API.", module);
+            fatal = 1;
         }
-
-        if ((sym = dlsym(dlhandle, "info")) != NULL)
+        if (strcmp(type, MODULE_FILTER) == 0
+            && mod_info->modapi != MODULE_API_FILTER)
         {
-            int fatal = 0;
-            mod_info = sym;
-            if (strcmp(type, MODULE_PROTOCOL) == 0
-                && mod_info->modapi != MODULE_API_PROTOCOL)
-            {
-                MXS_ERROR("Module '%s' does not implement the protocol API.", module);
-                fatal = 1;
-            }
-            if (strcmp(type, MODULE_AUTHENTICATOR) == 0
-                && mod_info->modapi != MODULE_API_AUTHENTICATOR)
-            {
-                MXS_ERROR("Module '%s' does not implement the authenticator API.", module);
-                fatal = 1;
-            }
-            if (strcmp(type, MODULE_ROUTER) == 0
-                && mod_info->modapi != MODULE_API_ROUTER)
-            {
-                MXS_ERROR("Module '%s' does not implement the router API.", module);
-                fatal = 1;
-            }
-            if (strcmp(type, MODULE_MONITOR) == 0
-                && mod_info->modapi != MODULE_API_MONITOR)
-            {
-                MXS_ERROR("Module '%s' does not implement the monitor API.", module);
-                fatal = 1;
-            }
-            if (strcmp(type, MODULE_FILTER) == 0
-                && mod_info->modapi != MODULE_API_FILTER)
-            {
-                MXS_ERROR("Module '%s' does not implement the filter API.", module);
-                fatal = 1;
-            }
-            if (strcmp(type, MODULE_QUERY_CLASSIFIER) == 0
-                && mod_info->modapi != MODULE_API_QUERY_CLASSIFIER)
-            {
-                MXS_ERROR("Module '%s' does not implement the query classifier API.", module);
-                fatal = 1;
-            }
-            if (fatal)
-            {
-                dlclose(dlhandle);
-                return NULL;
-            }
+            MXS_ERROR("Module '%s' does not implement the filter API.", module);
+            fatal = 1;
         }
-
-        if ((sym = dlsym(dlhandle, "GetModuleObject")) == NULL)
+        if (strcmp(type, MODULE_QUERY_CLASSIFIER) == 0
+            && mod_info->modapi != MODULE_API_QUERY_CLASSIFIER)
+        {
+            MXS_ERROR("Module '%s' does not implement the query classifier API.", module);
+            fatal = 1;
+        }
+        if (fatal)
         {
-            MXS_ERROR("Expected entry point interface missing "
-                      "from module: %s\n\t\t\t      %s.",
-                      module,
-                      dlerror());
             dlclose(dlhandle);
             return NULL;
         }
-        ep = sym;
-        modobj = ep();
+    }
 
-        MXS_NOTICE("Loaded module %s: %s from %s",
-                   module,
-                   version,
-                   fname);
-        register_module(module, type, dlhandle, version, modobj, mod_info);
+    if ((sym = dlsym(dlhandle, "GetModuleObject")) == NULL)
+    {
+        MXS_ERROR("Expected entry point interface missing "
+                  "from module: %s\n\t\t\t      %s.",
+                  module,
+                  dlerror());
+        dlclose(dlhandle);
+        return NULL;
     }
-    else
+    ep = sym;
+    modobj = ep();
+
+    MXS_NOTICE("Loaded module %s: %s from %s",
+               module,
+               version,
+               fname);
+    register_module(module, type, dlhandle, version, modobj, mod_info);
+
+    return modobj;
+}
+
+/**
+ * Load the dynamic library related to a gateway module. The routine
+ * will look for library files in the current directory,
+ * the configured folder and /usr/lib64/maxscale.
+ *
+ * Note that a number of entry points are standard for any module, as is
+ * the data structure named "info".  They are only accessed by explicit
+ * reference to the module, and so the fact that they are duplicated in
+ * every module is not a problem.  The declarations are protected from
+ * lint by suppressing error 14, since the duplication is a feature and
+ * not an error.
+ *
+ * A module is loaded only once. The function can be called by several threads
+ * at the same time, a thread that asks for a module that another thread is
+ * loading waits for the loading to end.
+ *
+ * @param module        Name of the module to load
+ * @param type          Type of module, used purely for registration
+ * @return              The module specific entry point structure or NULL
+ */
+void *
+load_module(const char *module, const char *type)
+{
+    MODULES *mod;
+    void *modobj = NULL;
+
+    if (NULL == module || NULL == type)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&modules_lock);
+
+    if (modules_loading == NULL &&
+        (modules_loading = hashtable_alloc(MODULES_HASH_SIZE, simple_str_hash, strcmp)) != NULL)
+    {
+        hashtable_memory_fns(modules_loading, (HASHMEMORYFN)strdup, NULL, (HASHMEMORYFN)free, NULL);
+    }
+
+    while ((mod = find_module(module)) == NULL && modules_loading &&
+           hashtable_fetch(modules_loading, (char *)module))
+    {
+        pthread_cond_wait(&modules_loaded, &modules_lock);
+    }
+
+    if (mod)
     {
         /*
          * The module is already loaded, get the entry points again and
          * return a reference to the already loaded module.
          */
         modobj = mod->modobj;
+        pthread_mutex_unlock(&modules_lock);
+    }
+    else if (modules_loading && hashtable_add(modules_loading, (char *)module, (void *)1))
+    {
+        /** The module is loaded without the lock so that other modules can be
+         * loaded at the same time */
+        pthread_mutex_unlock(&modules_lock);
+        modobj = load_module_file(module, type);
+
+        pthread_mutex_lock(&modules_lock);
+        hashtable_delete(modules_loading, (char *)module);
+        pthread_cond_broadcast(&modules_loaded);
+        pthread_mutex_unlock(&modules_lock);
+    }
+    else
+    {
+        pthread_mutex_unlock(&modules_lock);
+        MXS_ERROR("Failed to allocate memory for loading module %s.", module);
     }
 
     return modobj;
 }
 
+/**
+ * The loading of a set of modules
+ */
+typedef struct module_loader
+{
+    const char **modules;   /*< Names of the modules */
+    const char **types;     /*< Types of the modules */
+    int n_modules;          /*< Number of modules */
+    int next;               /*< Index of the next module to load */
+} MODULE_LOADER;
+
+/**
+ * Load modules until all modules of a loader have been loaded
+ *
+ * @param data The loader
+ */
+static void
+load_modules_thread(void *data)
+{
+    MODULE_LOADER *loader = (MODULE_LOADER *)data;
+    char fname[MAXPATHLEN + 1];
+    int i;
+
+    while ((i = atomic_add(&loader->next, 1)) < loader->n_modules)
+    {
+        snprintf(fname, sizeof(fname), "%s/lib%s.so", get_libdir(), loader->modules[i]);
+
+        /** A missing module is reported by the object that uses it */
+        if (access(fname, F_OK) == 0)
+        {
+            load_module(loader->modules[i], loader->types[i]);
+        }
+    }
+}
+
+/**
+ * Load a set of modules with several threads
+ *
+ * This is used at startup to load all the modules of the configuration before
+ * the objects that use them are created. A module that fails to load is loaded
+ * again by the object that uses it, which then reports the error.
+ *
+ * @param modules   Names of the modules, a name may appear several times
+ * @param types     Types of the modules
+ * @param n_modules Number of modules
+ * @param n_threads Maximum number of threads to use
+ */
+void
+load_modules(const char **modules, const char **types, int n_modules, int n_threads)
+{
+    MODULE_LOADER loader = {modules, types, n_modules, 0};
+    uint64_t start = ts_clock_us();
+
+    n_threads = MIN(n_threads, n_modules);
+    THREAD threads[n_threads > 1 ? n_threads - 1 : 1];
+    int started = 0;
+
+    /** The calling thread loads modules as well */
+    while (started < n_threads - 1 &&
+           thread_start(&threads[started], load_modules_thread, &loader) != NULL)
+    {
+        started++;
+    }
+
+    load_modules_thread(&loader);
+
+    for (int i = 0; i < started; i++)
+    {
+        thread_wait(threads[i]);
+    }
+
+    MXS_INFO("Loading %d modules took %.3f seconds with %d threads.", n_modules,
+             (ts_clock_us() - start) / 1000000.0, started + 1);
+}
+
 /**
  * Unload a module.
  *
@@ -265,21 +398,12 @@ load_module(const char *module, const char *type)
 void
 unload_module(const char *module)
 {
-    MODULES *mod = find_module(module);
-    void *handle;
-
-    if (!mod)
-    {
-        return;
-    }
-    handle = mod->handle;
     unregister_module(module);
-    dlclose(handle);
 }
 
 /**
  * Find a module that has been previously loaded and return the handle for that
- * library
+ * library. The caller must hold the modules lock.
  *
  * @param module        The name of the module
  * @return              The module handle or NULL if it was not found
@@ -287,21 +411,9 @@ unload_module(const char *module)
 static MODULES *
 find_module(const char *module)
 {
-    MODULES *mod = registered;
-
-    if (module)
+    if (module && modules_index)
     {
-        while (mod)
-        {
-            if (strcmp(mod->module, module) == 0)
-            {
-                return mod;
-            }
-            else
-            {
-                mod = mod->next;
-            }
-        }
+        return (MODULES *)hashtable_fetch(modules_index, (char *)module);
     }
     return NULL;
 }
@@ -336,9 +448,26 @@ register_module(const char *module,
     mod->handle = dlhandle;
     mod->version = strdup(version);
     mod->modobj = modobj;
-    mod->next = registered;
     mod->info = mod_info;
-    registered = mod;
+
+    pthread_mutex_lock(&modules_lock);
+
+    if (modules_index == NULL &&
+        (modules_index = hashtable_alloc_read_mostly(MODULES_HASH_SIZE, simple_str_hash, strcmp)) != NULL)
+    {
+        hashtable_memory_fns(modules_index, (HASHMEMORYFN)strdup, NULL, (HASHMEMORYFN)free, NULL);
+    }
+
+    if (modules_index)
+    {
+        hashtable_add(modules_index, mod->module, mod);
+    }
+
+    /** The list is read without the lock, the module is complete before it is added */
+    mod->next = registered;
+    atomic_store_ptr((void **)&registered, mod);
+
+    pthread_mutex_unlock(&modules_lock);
 }
 
 /**
@@ -349,13 +478,19 @@ register_module(const char *module,
 static void
 unregister_module(const char *module)
 {
-    MODULES *mod = find_module(module);
+    MODULES *mod;
     MODULES *ptr;
 
-    if (!mod)
+    pthread_mutex_lock(&modules_lock);
+
+    if ((mod = find_module(module)) == NULL)
     {
+        pthread_mutex_unlock(&modules_lock);
         return;         // Module not found
     }
+
+    hashtable_delete(modules_index, mod->module);
+
     if (registered == mod)
     {
         registered = mod->next;
@@ -377,6 +512,8 @@ unregister_module(const char *module)
         }
     }
 
+    pthread_mutex_unlock(&modules_lock);
+
     /*<
      * The module is now not in the linked list and all
      * memory related to it can be freed
@@ -21,10 +21,11 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <stddef.h>
 #include <syslog.h>
 #include <atomic.h>
 
-#include <mlist.h>
+#include <dlist.h>
 #include <skygw_debug.h>
 #include <skygw_types.h>
 #include <skygw_utils.h>
@@ -96,6 +97,12 @@ static simple_mutex_t msg_mutex;
  */
 static int DEFAULT_LOG_AUGMENTATION = 0;
 
+/**
+ * Default throttling, at most 10 errors or warnings per second from one place.
+ */
+static int DEFAULT_LOG_THROTTLE_COUNT = 10;
+static int DEFAULT_LOG_THROTTLE_WINDOW = 1000;
+
 static struct
 {
     int  augmentation;     // Can change during the lifetime of log_manager.
@@ -103,15 +110,42 @@ static struct
     bool do_syslog;        // Can change during the lifetime of log_manager.
     bool do_maxlog;        // Can change during the lifetime of log_manager.
     bool use_stdout;       // Can NOT changed during the lifetime of log_manager.
+    int  throttle_count;   // Can change during the lifetime of log_manager.
+    int  throttle_window;  // Can change during the lifetime of log_manager.
 } log_config =
 {
-    DEFAULT_LOG_AUGMENTATION, // augmentation
-    false,                    // do_highprecision
-    true,                     // do_syslog
-    true,                     // do_maxlog
-    false                     // use_stdout
+    DEFAULT_LOG_AUGMENTATION,    // augmentation
+    false,                       // do_highprecision
+    true,                        // do_syslog
+    true,                        // do_maxlog
+    false,                       // use_stdout
+    DEFAULT_LOG_THROTTLE_COUNT,  // throttle_count
+    DEFAULT_LOG_THROTTLE_WINDOW  // throttle_window
 };
 
+/** Number of places in the code whose messages can be throttled */
+#define LOG_THROTTLE_SLOTS 1024
+
+/**
+ * Token bucket of the errors and warnings logged from one place. The bucket
+ * holds at most throttle_count tokens and throttle_count tokens are added to it
+ * in throttle_window milliseconds. A message without a token is suppressed.
+ */
+typedef struct log_throttle
+{
+    const char* thr_file;       /**< File of the log call, NULL for a free slot */
+    int         thr_line;       /**< Line of the log call */
+    int         thr_lock;       /**< Protects the rest of the fields */
+    int         thr_tokens;     /**< Messages that can be logged */
+    int64_t     thr_refill;     /**< Time of the last refill, in milliseconds */
+    size_t      thr_suppressed; /**< Messages suppressed since the last logged one */
+} log_throttle_t;
+
+static log_throttle_t log_throttles[LOG_THROTTLE_SLOTS];
+
+/** Protects taking a free throttle slot into use */
+static int log_throttles_lock;
+
 /**
  * Variable holding the enabled priorities information.
  * Used from logging macros.
@@ -136,6 +170,24 @@ ssize_t mxs_log_session_count[LOG_DEBUG + 1] = {0};
  */
 #define MAX_LOGSTRLEN BUFSIZ
 
+/**
+ * Size of the log ring of a thread. A ring holds at least 16 messages of
+ * the maximum length.
+ */
+#define LOG_RING_SIZE (16 * MAX_LOGSTRLEN)
+
+/** Size of the buffer where the file writer formats the messages of the log rings */
+#define LOG_WRITER_BUFSIZE (8 * MAX_LOGSTRLEN)
+
+/** Length of a log record aligned to 8 bytes */
+#define LOG_RECORD_ALIGN(len) (((len) + 7) & ~((size_t)7))
+
+/** Flags of a log record */
+#define LOG_RECORD_FLUSH  0x01 /**< The file is flushed after the record */
+#define LOG_RECORD_HP     0x02 /**< Timestamp with millisecond precision */
+#define LOG_RECORD_SYSLOG 0x04 /**< Written to syslog */
+#define LOG_RECORD_MAXLOG 0x08 /**< Written to the log file */
+
 /**
  * Path to directory in which all files are stored to shared memory
  * by the OS.
@@ -178,6 +230,9 @@ struct filewriter
     /** fwr_clientmes is for messages to log clients */
     skygw_message_t*   fwr_clientmes;
     skygw_thread_t*    fwr_thread;
+    /** Messages of the log rings, formatted and waiting to be written */
+    size_t             fwr_buf_used;
+    char               fwr_buf[LOG_WRITER_BUFSIZE];
 #if defined(SS_DEBUG)
     skygw_chk_t        fwr_chk_tail;
 #endif
@@ -194,6 +249,7 @@ typedef struct blockbuf
 #endif
     blockbuf_state_t bb_state; /**State of the block buffer*/
     simple_mutex_t bb_mutex;    /**< bb_buf_used, bb_isfull */
+    DLIST_NODE     bb_node;     /**< Links of the logfile's list, protected by its mutex */
     int            bb_refcount; /**< protected by list mutex. #of clients */
 //        int            bb_blankcount; /**< # of blanks used btw strings */
     size_t         bb_buf_size;
@@ -205,6 +261,57 @@ typedef struct blockbuf
 #endif
 } blockbuf_t;
 
+/**
+ * A log record in a log ring. The header is followed by the message, including
+ * the terminating null. The timestamp and the session id are formatted by the
+ * file writer. A record with zero length marks the end of the ring and the
+ * next record is at the start of the ring.
+ */
+typedef struct log_record
+{
+    uint32_t       rec_len;        /**< Length of the record, aligned to 8 bytes */
+    uint16_t       rec_priority;   /**< Syslog priority */
+    uint16_t       rec_prefix_len; /**< Length of the prefix stripped when syslogging */
+    uint32_t       rec_str_len;    /**< Length of the message, including the terminating null */
+    uint32_t       rec_flags;      /**< LOG_RECORD_ flags */
+    size_t         rec_sesid;      /**< Session id or 0 */
+    struct timeval rec_time;       /**< Time of the message */
+} log_record_t;
+
+/**
+ * A single-producer, single-consumer ring of log records. Each thread that
+ * logs owns one ring and is its only writer, the file writer thread is its
+ * only reader. The positions only grow, the offset in the ring is the
+ * position modulo LOG_RING_SIZE. The rings are never freed, the ring of an
+ * exited thread is taken into use by the next new thread.
+ */
+typedef struct log_ring
+{
+    struct log_ring* rng_next;     /**< Next ring in the list of all rings */
+    int              rng_in_use;   /**< Whether a thread owns the ring */
+    int64_t          rng_reported; /**< Dropped messages already reported, file writer only */
+    int64_t          rng_head __attribute__((aligned(64)));    /**< Read position, file writer only */
+    int64_t          rng_tail __attribute__((aligned(64)));    /**< Write position, owner only */
+    int64_t          rng_dropped;  /**< Messages dropped because the ring was full, owner only */
+    char             rng_buf[LOG_RING_SIZE] __attribute__((aligned(64)));
+} log_ring_t;
+
+/** List of all log rings */
+static log_ring_t* log_rings;
+
+/** The log ring of the current thread */
+static __thread log_ring_t* log_ring_tls;
+
+/** Key whose destructor releases the log ring of an exiting thread */
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+
+/** Set when the file writer is about to wait for the next message */
+static int log_writer_idle;
+
+/** Total number of dropped messages, file writer only */
+static int64_t log_rings_dropped;
+
 /**
  * logfile object corresponds to physical file(s) where
  * certain log is written.
@@ -230,7 +337,9 @@ struct logfile
     int              lf_nfiles_max;
     size_t           lf_file_size;
     /** list of block-sized log buffers */
-    mlist_t          lf_blockbuf_list;
+    DLIST            lf_blockbuf_list;   /**< The block buffers */
+    simple_mutex_t   lf_blockbuf_mutex;  /**< Protects lf_blockbuf_list */
+    size_t           lf_blockbuf_versno; /**< Odd while the list is updated, 0 if not initialized */
     size_t           lf_buf_size;
     bool             lf_flushflag;
     bool                 lf_rotateflag;
@@ -322,12 +431,21 @@ static int logmanager_write_log(int            priority,
                                 const char*    str);
 
 static blockbuf_t* blockbuf_init();
-static void blockbuf_node_done(void* bb_data);
+static void blockbuf_done(blockbuf_t* bb);
 static char* blockbuf_get_writepos(blockbuf_t** p_bb,
                                    size_t       str_len,
                                    bool         flush);
 
 static void blockbuf_register(blockbuf_t* bb);
+static log_ring_t* log_ring_get(void);
+static bool log_ring_write(log_ring_t*    ring,
+                           int            priority,
+                           enum log_flush flush,
+                           size_t         prefix_len,
+                           size_t         str_len,
+                           const char*    str);
+static void log_rings_flush(filewriter_t* fwr, bool flush);
+static bool log_rings_pending(void);
 static void blockbuf_unregister(blockbuf_t* bb);
 static char* add_slash(char* str);
 
@@ -851,13 +969,10 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
                                    bool         flush)
 {
     logfile_t*     lf;
-    mlist_t*       bb_list;
+    DLIST*         bb_list;
     char*          pos = NULL;
-    mlist_node_t*  node;
+    DLIST_NODE*    node;
     blockbuf_t*    bb;
-#if defined(SS_DEBUG)
-    bool           succ;
-#endif
 
     CHK_LOGMANAGER(lm);
     lf = &lm->lm_logfile;
@@ -865,25 +980,22 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
     bb_list = &lf->lf_blockbuf_list;
 
     /** Lock list */
-    simple_mutex_lock(&bb_list->mlist_mutex, true);
-    CHK_MLIST(bb_list);
+    simple_mutex_lock(&lf->lf_blockbuf_mutex, true);
 
-    if (bb_list->mlist_nodecount > 0)
+    if (bb_list->count > 0)
     {
         /**
          * At least block buffer exists on the list.
          */
-        node = bb_list->mlist_first;
+        node = bb_list->first;
 
         /** Loop over blockbuf list to find write position */
         while (true)
         {
-            CHK_MLIST_NODE(node);
-
             /** Unlock list */
-            simple_mutex_unlock(&bb_list->mlist_mutex);
+            simple_mutex_unlock(&lf->lf_blockbuf_mutex);
 
-            bb = (blockbuf_t *)node->mlnode_data;
+            bb = DLIST_ENTRY(node, blockbuf_t, bb_node);
             CHK_BLOCKBUF(bb);
 
             /** Lock buffer */
@@ -906,29 +1018,29 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
                 simple_mutex_unlock(&bb->bb_mutex);
 
                 /** Lock list */
-                simple_mutex_lock(&bb_list->mlist_mutex, true);
+                simple_mutex_lock(&lf->lf_blockbuf_mutex, true);
 
 
                 /**
                  * If next node exists move forward. Else check if there is
                  * space for a new block buffer on the list.
                  */
-                if (node != bb_list->mlist_last)
+                if (node != bb_list->last)
                 {
-                    node = node->mlnode_next;
+                    node = node->next;
                     continue;
                 }
                 /**
                  * All buffers on the list are full.
                  */
-                if (bb_list->mlist_nodecount < bb_list->mlist_nodecount_max)
+                if (bb_list->count < MAXNBLOCKBUFS)
                 {
                     /**
                      * New node is created
                      */
                     if ((bb = blockbuf_init()) == NULL)
                     {
-                        simple_mutex_unlock(&bb_list->mlist_mutex);
+                        simple_mutex_unlock(&lf->lf_blockbuf_mutex);
                         return NULL;
                     }
 
@@ -938,17 +1050,16 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
                      * Increase version to odd to mark list update active
                      * update.
                      */
-                    bb_list->mlist_versno += 1;
-                    ss_dassert(bb_list->mlist_versno % 2 == 1);
+                    lf->lf_blockbuf_versno += 1;
+                    ss_dassert(lf->lf_blockbuf_versno % 2 == 1);
 
-                    ss_debug(succ = ) mlist_add_data_nomutex(bb_list, bb);
-                    ss_dassert(succ);
+                    dlist_append(bb_list, &bb->bb_node);
 
                     /**
                      * Increase version to even to mark completion of update.
                      */
-                    bb_list->mlist_versno += 1;
-                    ss_dassert(bb_list->mlist_versno % 2 == 0);
+                    lf->lf_blockbuf_versno += 1;
+                    ss_dassert(lf->lf_blockbuf_versno % 2 == 0);
                 }
                 else
                 {
@@ -957,10 +1068,10 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
                      * Reset to the beginning of the list, and wait until
                      * there is a block buffer with enough space.
                      */
-                    simple_mutex_unlock(&bb_list->mlist_mutex);
-                    simple_mutex_lock(&bb_list->mlist_mutex, true);
+                    simple_mutex_unlock(&lf->lf_blockbuf_mutex);
+                    simple_mutex_lock(&lf->lf_blockbuf_mutex, true);
 
-                    node = bb_list->mlist_first;
+                    node = bb_list->first;
                     continue;
                 }
 
@@ -973,39 +1084,43 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
                  */
 
                 simple_mutex_unlock(&bb->bb_mutex);
-                simple_mutex_lock(&bb_list->mlist_mutex, true);
+                simple_mutex_lock(&lf->lf_blockbuf_mutex, true);
 
-                if (node == bb_list->mlist_first)
+                if (node == bb_list->first)
                 {
 
-                    if ((bb_list->mlist_nodecount > 1) && (node != bb_list->mlist_last))
+                    if (node != bb_list->last)
                     {
-                        bb_list->mlist_last->mlnode_next = bb_list->mlist_first;
-                        bb_list->mlist_first = bb_list->mlist_first->mlnode_next;
-                        bb_list->mlist_last->mlnode_next->mlnode_next = NULL;
-                        bb_list->mlist_last = bb_list->mlist_last->mlnode_next;
+                        lf->lf_blockbuf_versno += 1;
+                        ss_dassert(lf->lf_blockbuf_versno % 2 == 1);
+
+                        dlist_remove(bb_list, node);
+                        dlist_append(bb_list, node);
+
+                        lf->lf_blockbuf_versno += 1;
+                        ss_dassert(lf->lf_blockbuf_versno % 2 == 0);
                     }
 
-                    ss_dassert(node == bb_list->mlist_last);
+                    ss_dassert(node == bb_list->last);
 
-                    simple_mutex_unlock(&bb_list->mlist_mutex);
+                    simple_mutex_unlock(&lf->lf_blockbuf_mutex);
                     simple_mutex_lock(&bb->bb_mutex, true);
 
                     bb->bb_state = BB_READY;
 
                     simple_mutex_unlock(&bb->bb_mutex);
-                    simple_mutex_lock(&bb_list->mlist_mutex, true);
-                    node = bb_list->mlist_first;
+                    simple_mutex_lock(&lf->lf_blockbuf_mutex, true);
+                    node = bb_list->first;
                 }
                 else
                 {
-                    if (node->mlnode_next)
+                    if (node->next)
                     {
-                        node = node->mlnode_next;
+                        node = node->next;
                     }
                     else
                     {
-                        node = bb_list->mlist_first;
+                        node = bb_list->first;
                     }
                     continue;
                 }
@@ -1029,6 +1144,7 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
 
         if ((bb = blockbuf_init()) == NULL)
         {
+            simple_mutex_unlock(&lf->lf_blockbuf_mutex);
             return NULL;
         }
 
@@ -1039,25 +1155,24 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
         /**
          * Increase version to odd to mark list update active update.
          */
-        bb_list->mlist_versno += 1;
-        ss_dassert(bb_list->mlist_versno % 2 == 1);
+        lf->lf_blockbuf_versno += 1;
+        ss_dassert(lf->lf_blockbuf_versno % 2 == 1);
 
-        ss_debug(succ = ) mlist_add_data_nomutex(bb_list, bb);
-        ss_dassert(succ);
+        dlist_append(bb_list, &bb->bb_node);
 
         /**
          * Increase version to even to mark completion of update.
          */
-        bb_list->mlist_versno += 1;
-        ss_dassert(bb_list->mlist_versno % 2 == 0);
+        lf->lf_blockbuf_versno += 1;
+        ss_dassert(lf->lf_blockbuf_versno % 2 == 0);
 
         /** Unlock list */
-        simple_mutex_unlock(&bb_list->mlist_mutex);
-    } /* if (bb_list->mlist_nodecount > 0) */
+        simple_mutex_unlock(&lf->lf_blockbuf_mutex);
+    } /* if (bb_list->count > 0) */
 
     ss_dassert(pos == NULL);
     ss_dassert(!(bb->bb_state == BB_FULL || bb->bb_buf_left < str_len));
-    ss_dassert(bb_list->mlist_nodecount <= bb_list->mlist_nodecount_max);
+    ss_dassert(bb_list->count <= MAXNBLOCKBUFS);
 
     /**
      * Registration to blockbuf adds reference for the write operation.
@@ -1101,10 +1216,10 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
     return pos;
 }
 
-static void blockbuf_node_done(void* bb_data)
+static void blockbuf_done(blockbuf_t* bb)
 {
-    blockbuf_t* bb = (blockbuf_t *)bb_data;
     simple_mutex_done(&bb->bb_mutex);
+    free(bb);
 }
 
 
@@ -1145,6 +1260,128 @@ void mxs_log_set_augmentation(int bits)
     log_config.augmentation = bits & MXS_LOG_AUGMENTATION_MASK;
 }
 
+/**
+ * Set log throttling. If more than count errors or warnings are logged from
+ * one place within window_ms milliseconds, the extra messages are suppressed.
+ *
+ * @param count     Number of messages, 0 disables throttling
+ * @param window_ms Length of the window in milliseconds
+ */
+void mxs_log_set_throttling(int count, int window_ms)
+{
+    log_config.throttle_count = count;
+    log_config.throttle_window = window_ms;
+}
+
+static int64_t log_throttle_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Find the throttle of a log call. The file name is compared by pointer as
+ * the name given by the logging macros is the same string for each call.
+ *
+ * @param file The file of the log call
+ * @param line The line of the log call
+ * @return The throttle or NULL if all slots are in use
+ */
+static log_throttle_t* log_throttle_get(const char* file, int line)
+{
+    size_t hash = ((size_t)file ^ ((size_t)line * 2654435761UL)) % LOG_THROTTLE_SLOTS;
+
+    for (size_t i = 0; i < LOG_THROTTLE_SLOTS; i++)
+    {
+        log_throttle_t* thr = &log_throttles[(hash + i) % LOG_THROTTLE_SLOTS];
+
+        if (thr->thr_file == NULL)
+        {
+            acquire_lock(&log_throttles_lock);
+
+            if (thr->thr_file == NULL)
+            {
+                thr->thr_line = line;
+                thr->thr_tokens = log_config.throttle_count;
+                thr->thr_refill = log_throttle_clock();
+                thr->thr_suppressed = 0;
+                atomic_swap_ptr((void**)&thr->thr_file, (void*)file);
+            }
+
+            release_lock(&log_throttles_lock);
+        }
+
+        if (thr->thr_file == file && thr->thr_line == line)
+        {
+            return thr;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Check whether a message can be logged or whether it is suppressed. Only
+ * errors and warnings are throttled.
+ *
+ * @param priority   The syslog priority of the message
+ * @param file       The file where the message is logged
+ * @param line       The line where the message is logged
+ * @param suppressed Set to the number of similar messages suppressed since the
+ *                   previous one that was logged
+ * @return True if the message should be logged
+ */
+static bool log_throttle_check(int priority, const char* file, int line, size_t* suppressed)
+{
+    int count = log_config.throttle_count;
+    int window = log_config.throttle_window;
+    log_throttle_t* thr;
+    bool rval = true;
+
+    *suppressed = 0;
+
+    if ((priority == LOG_ERR || priority == LOG_WARNING) && count > 0 && window > 0 &&
+        file && (thr = log_throttle_get(file, line)))
+    {
+        int64_t now = log_throttle_clock();
+
+        acquire_lock(&thr->thr_lock);
+
+        int64_t tokens = (now - thr->thr_refill) * count / window;
+
+        if (tokens > 0)
+        {
+            if (thr->thr_tokens + tokens >= count)
+            {
+                thr->thr_tokens = count;
+                thr->thr_refill = now;
+            }
+            else
+            {
+                thr->thr_tokens += tokens;
+                thr->thr_refill += tokens * window / count;
+            }
+        }
+
+        if (thr->thr_tokens > 0)
+        {
+            thr->thr_tokens--;
+            *suppressed = thr->thr_suppressed;
+            thr->thr_suppressed = 0;
+        }
+        else
+        {
+            thr->thr_suppressed++;
+            rval = false;
+        }
+
+        release_lock(&thr->thr_lock);
+    }
+
+    return rval;
+}
+
 /**
  * Helper for skygw_log_write and friends.
  *
@@ -1175,7 +1412,22 @@ static int log_write(int            priority,
     {
         CHK_LOGMANAGER(lm);
 
-        rv = logmanager_write_log(priority, flush, prefix_len, len, str);
+        log_ring_t* ring = log_ring_get();
+
+        if (ring && log_ring_write(ring, priority, flush, prefix_len, len, str))
+        {
+            rv = 0;
+        }
+        else if (ring && flush == LOG_FLUSH_NO)
+        {
+            /** The ring is full, the message is dropped and reported by the file writer */
+            atomic_store_int64(&ring->rng_dropped, ring->rng_dropped + 1);
+        }
+        else
+        {
+            /** Messages that are flushed are never dropped */
+            rv = logmanager_write_log(priority, flush, prefix_len, len, str);
+        }
 
         logmanager_unregister();
     }
@@ -1908,11 +2160,9 @@ static bool logfile_init(logfile_t*    logfile,
      * Create a block buffer list for log file. Clients' writes go to buffers
      * from where separate log flusher thread writes them to disk.
      */
-    if (mlist_init(&logfile->lf_blockbuf_list,
-                   NULL,
-                   strdup("logfile block buffer list"),
-                   blockbuf_node_done,
-                   MAXNBLOCKBUFS) == NULL)
+    dlist_init(&logfile->lf_blockbuf_list);
+
+    if (simple_mutex_init(&logfile->lf_blockbuf_mutex, "logfile block buffer list") == NULL)
     {
         ss_dfprintf(stderr,
                     "*\n* Error : Initializing buffers for log files "
@@ -1922,6 +2172,7 @@ static bool logfile_init(logfile_t*    logfile,
     }
 
     succ = true;
+    logfile->lf_blockbuf_versno = 2; /*< versno != 0 means that the list is initialized */
     logfile->lf_state = RUN;
     CHK_LOGFILE(logfile);
 
@@ -1963,9 +2214,16 @@ static void logfile_done(logfile_t* lf)
         /** fallthrough */
         case INIT:
             /** Test if list is initialized before freeing it */
-            if (lf->lf_blockbuf_list.mlist_versno != 0)
+            if (lf->lf_blockbuf_versno != 0)
             {
-                mlist_done(&lf->lf_blockbuf_list);
+                DLIST_NODE* node;
+
+                while ((node = dlist_pop_first(&lf->lf_blockbuf_list)) != NULL)
+                {
+                    blockbuf_done(DLIST_ENTRY(node, blockbuf_t, bb_node));
+                }
+                simple_mutex_done(&lf->lf_blockbuf_mutex);
+                lf->lf_blockbuf_versno = 0;
             }
             logfile_free_memory(lf);
             lf->lf_state = DONE;
@@ -2087,6 +2345,10 @@ static bool thr_flush_file(logmanager_t *lm, filewriter_t *fwr)
     lf->lf_flushflag  = false;
     lf->lf_rotateflag = false;
     release_lock(&lf->lf_spinlock);
+
+    /** The messages of the log rings are written before the block buffers */
+    log_rings_flush(fwr, flush_logfile || do_flushall);
+
     /**
      * Log rotation :
      * Close current, and open a new file for the log.
@@ -2126,20 +2388,18 @@ static bool thr_flush_file(logmanager_t *lm, filewriter_t *fwr)
     /**
      * get logfile's block buffer list
      */
-    mlist_t *bb_list = &lf->lf_blockbuf_list;
-#if defined(SS_DEBUG)
-    simple_mutex_lock(&bb_list->mlist_mutex, true);
-    CHK_MLIST(bb_list);
-    simple_mutex_unlock(&bb_list->mlist_mutex);
-#endif
-    mlist_node_t *node = bb_list->mlist_first;
+    DLIST *bb_list = &lf->lf_blockbuf_list;
+    volatile size_t *versno = &lf->lf_blockbuf_versno;
+
+    simple_mutex_lock(&lf->lf_blockbuf_mutex, true);
+    DLIST_NODE *node = bb_list->first;
+    simple_mutex_unlock(&lf->lf_blockbuf_mutex);
 
     while (node != NULL)
     {
         int err = 0;
 
-        CHK_MLIST_NODE(node);
-        blockbuf_t *bb = (blockbuf_t *)node->mlnode_data;
+        blockbuf_t *bb = DLIST_ENTRY(node, blockbuf_t, bb_node);
         CHK_BLOCKBUF(bb);
 
         /** Lock block buffer */
@@ -2196,17 +2456,20 @@ static bool thr_flush_file(logmanager_t *lm, filewriter_t *fwr)
 
         size_t vn1;
         size_t vn2;
+        DLIST_NODE *next;
         /** Consistent lock-free read on the list */
         do
         {
-            while ((vn1 = bb_list->mlist_versno) % 2 != 0)
+            while ((vn1 = *versno) % 2 != 0)
             {
                 continue;
             }
-            node = node->mlnode_next;
-            vn2 = bb_list->mlist_versno;
+            next = *(DLIST_NODE * volatile *)&node->next;
+            vn2 = *versno;
         }
-        while (vn1 != vn2 && node);
+        while (vn1 != vn2);
+
+        node = next;
 
     } /* while (node != NULL) */
 
@@ -2288,8 +2551,19 @@ static void* thr_filewriter_fun(void* data)
         /**
          * Wait until new log arrival message appears.
          * Reset message to avoid redundant calls.
+         *
+         * The log rings are checked once more after the writer has been
+         * marked idle. A thread that writes to its ring after that sees the
+         * mark and sends the message.
          */
-        skygw_message_wait(fwr->fwr_logmes);
+        atomic_cas_int(&log_writer_idle, 0, 1);
+
+        if (!log_rings_pending())
+        {
+            skygw_message_wait(fwr->fwr_logmes);
+        }
+
+        atomic_cas_int(&log_writer_idle, 1, 0);
         if (skygw_thread_must_exit(thr))
         {
             flushall_logfiles(true);
@@ -2733,6 +3007,333 @@ static enum log_flush priority_to_flush(int priority)
     }
 }
 
+/**
+ * Release the log ring of an exiting thread. The file writer still writes
+ * the messages that are left in the ring.
+ *
+ * @param data The log ring
+ */
+static void log_ring_release(void* data)
+{
+    log_ring_t* ring = (log_ring_t*)data;
+    atomic_cas_int(&ring->rng_in_use, 1, 0);
+}
+
+static void log_ring_key_init(void)
+{
+    pthread_key_create(&log_ring_key, log_ring_release);
+}
+
+/**
+ * Get the log ring of the current thread. On the first call of a thread
+ * a released ring is taken into use or a new one is allocated.
+ *
+ * @return The log ring or NULL if memory allocation failed
+ */
+static log_ring_t* log_ring_get(void)
+{
+    log_ring_t* ring = log_ring_tls;
+
+    if (ring == NULL)
+    {
+        pthread_once(&log_ring_once, log_ring_key_init);
+
+        for (ring = log_rings; ring; ring = ring->rng_next)
+        {
+            if (ring->rng_in_use == 0 && atomic_cas_int(&ring->rng_in_use, 0, 1))
+            {
+                break;
+            }
+        }
+
+        if (ring == NULL)
+        {
+            void* mem = NULL;
+
+            if (posix_memalign(&mem, 64, sizeof(log_ring_t)) != 0)
+            {
+                return NULL;
+            }
+
+            ring = (log_ring_t*)mem;
+            memset(ring, 0, offsetof(log_ring_t, rng_buf));
+            ring->rng_in_use = 1;
+
+            do
+            {
+                ring->rng_next = log_rings;
+            }
+            while (!atomic_cas_ptr((void**)&log_rings, ring->rng_next, ring));
+        }
+
+        pthread_setspecific(log_ring_key, ring);
+        log_ring_tls = ring;
+    }
+
+    return ring;
+}
+
+/**
+ * Copy a message to the log ring of the current thread. Only the timestamp
+ * is taken here, the rest of the formatting is done by the file writer.
+ *
+ * @param ring       The log ring of the current thread
+ * @param priority   Syslog priority
+ * @param flush      Whether the log file is flushed after the message
+ * @param prefix_len Length of prefix to be stripped away when syslogging
+ * @param str_len    Length of the message, including terminating NULL
+ * @param str        The message
+ *
+ * @return True if the message was stored, false if the ring is full
+ */
+static bool log_ring_write(log_ring_t*    ring,
+                           int            priority,
+                           enum log_flush flush,
+                           size_t         prefix_len,
+                           size_t         str_len,
+                           const char*    str)
+{
+    size_t len = LOG_RECORD_ALIGN(sizeof(log_record_t) + str_len);
+    int64_t tail = ring->rng_tail;
+    int64_t head = atomic_load_int64(&ring->rng_head);
+    size_t offset = tail % LOG_RING_SIZE;
+    size_t skip = LOG_RING_SIZE - offset < len ? LOG_RING_SIZE - offset : 0;
+
+    if (tail + skip + len - head > LOG_RING_SIZE)
+    {
+        return false;
+    }
+
+    if (skip)
+    {
+        /** The record does not fit at the end, mark the end of the ring */
+        ((log_record_t*)&ring->rng_buf[offset])->rec_len = 0;
+        tail += skip;
+        offset = 0;
+    }
+
+    log_record_t* rec = (log_record_t*)&ring->rng_buf[offset];
+
+    rec->rec_len = len;
+    rec->rec_priority = priority;
+    rec->rec_prefix_len = prefix_len;
+    rec->rec_str_len = str_len;
+    rec->rec_flags = (flush == LOG_FLUSH_YES ? LOG_RECORD_FLUSH : 0) |
+                     (log_config.do_highprecision ? LOG_RECORD_HP : 0) |
+                     (log_config.do_syslog ? LOG_RECORD_SYSLOG : 0) |
+                     (log_config.do_maxlog ? LOG_RECORD_MAXLOG : 0);
+    rec->rec_sesid = priority == LOG_INFO ? mxs_log_tls.li_sesid : 0;
+    gettimeofday(&rec->rec_time, NULL);
+    memcpy(rec + 1, str, str_len);
+
+    atomic_store_int64(&ring->rng_tail, tail + len);
+
+    /** Wake up the file writer if it is waiting */
+    if (log_writer_idle && atomic_cas_int(&log_writer_idle, 1, 0))
+    {
+        skygw_message_send(lm->lm_logmes);
+    }
+
+    return true;
+}
+
+/**
+ * Write the formatted messages to the log file.
+ *
+ * @param fwr   The file writer
+ * @param flush Whether the file is flushed
+ */
+static void log_writer_write(filewriter_t* fwr, bool flush)
+{
+    if (fwr->fwr_buf_used > 0)
+    {
+        int err = skygw_file_write(fwr->fwr_file, fwr->fwr_buf, fwr->fwr_buf_used, flush);
+
+        if (err)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            fprintf(stderr,
+                    "Error : Writing to the log-file %s failed due to (%d, %s). "
+                    "Disabling writing to the log.",
+                    fwr->fwr_logmgr->lm_logfile.lf_full_file_name,
+                    err,
+                    strerror_r(err, errbuf, sizeof(errbuf)));
+
+            mxs_log_set_maxlog_enabled(false);
+        }
+
+        fwr->fwr_buf_used = 0;
+    }
+}
+
+/**
+ * Format a log record the same way as logmanager_write_log() does and add it
+ * to the buffer of the file writer.
+ *
+ * @param fwr The file writer
+ * @param rec The log record
+ * @param str The message of the record
+ */
+static void log_record_format(filewriter_t* fwr, const log_record_t* rec, const char* str)
+{
+    if ((rec->rec_flags & LOG_RECORD_SYSLOG) && rec->rec_priority <= LOG_NOTICE)
+    {
+        syslog(rec->rec_priority, "%s", str + rec->rec_prefix_len);
+    }
+
+    if (rec->rec_flags & LOG_RECORD_MAXLOG)
+    {
+        if (LOG_WRITER_BUFSIZE - fwr->fwr_buf_used < MAX_LOGSTRLEN)
+        {
+            log_writer_write(fwr, false);
+        }
+
+        char* wp = &fwr->fwr_buf[fwr->fwr_buf_used];
+        size_t len;
+
+        if (rec->rec_flags & LOG_RECORD_HP)
+        {
+            len = snprint_timestamp_hp_tv(wp, get_timestamp_len_hp(), &rec->rec_time);
+        }
+        else
+        {
+            len = snprint_timestamp_tv(wp, get_timestamp_len(), &rec->rec_time);
+        }
+
+        if (rec->rec_sesid != 0)
+        {
+            len += sprintf(wp + len, "[%lu]  ", rec->rec_sesid);
+        }
+
+        size_t str_len = rec->rec_str_len;
+        bool overflow = false;
+
+        if (len + str_len > MAX_LOGSTRLEN)
+        {
+            str_len = MAX_LOGSTRLEN - len;
+            overflow = true;
+        }
+
+        memcpy(wp + len, str, str_len);
+        len += str_len;
+
+        /** Add an ellipsis to an overflowing message to signal truncation. */
+        if (overflow && len > 4)
+        {
+            memset(wp + len - 4, '.', 3);
+        }
+        /** remove double line feed */
+        if (wp[len - 2] == '\n')
+        {
+            wp[len - 2] = ' ';
+        }
+        wp[len - 1] = '\n';
+
+        fwr->fwr_buf_used += len;
+    }
+}
+
+/**
+ * Write the messages of one log ring.
+ *
+ * @param fwr  The file writer
+ * @param ring The log ring
+ *
+ * @return True if a message requested a flush
+ */
+static bool log_ring_flush(filewriter_t* fwr, log_ring_t* ring)
+{
+    int64_t head = ring->rng_head;
+    int64_t tail = atomic_load_int64(&ring->rng_tail);
+    bool flush = false;
+
+    while (head < tail)
+    {
+        size_t offset = head % LOG_RING_SIZE;
+        log_record_t* rec = (log_record_t*)&ring->rng_buf[offset];
+
+        if (rec->rec_len == 0)
+        {
+            head += LOG_RING_SIZE - offset;
+        }
+        else
+        {
+            log_record_format(fwr, rec, (const char*)(rec + 1));
+            flush = flush || (rec->rec_flags & LOG_RECORD_FLUSH);
+            head += rec->rec_len;
+        }
+    }
+
+    atomic_store_int64(&ring->rng_head, head);
+
+    return flush;
+}
+
+/**
+ * Write the messages of all log rings to the log file. Called only by the
+ * file writer thread. The number of dropped messages is logged if messages
+ * have been dropped since the previous call.
+ *
+ * @param fwr   The file writer
+ * @param flush Whether the file is flushed
+ */
+static void log_rings_flush(filewriter_t* fwr, bool flush)
+{
+    int64_t dropped = 0;
+
+    for (log_ring_t* ring = log_rings; ring; ring = ring->rng_next)
+    {
+        if (log_ring_flush(fwr, ring))
+        {
+            flush = true;
+        }
+
+        int64_t n = atomic_load_int64(&ring->rng_dropped);
+        dropped += n - ring->rng_reported;
+        ring->rng_reported = n;
+    }
+
+    if (dropped > 0)
+    {
+        log_rings_dropped += dropped;
+
+        char str[MAX_LOGSTRLEN];
+        log_record_t rec = {};
+
+        rec.rec_priority = LOG_WARNING;
+        rec.rec_prefix_len = sizeof(PREFIX_WARNING) - 1;
+        rec.rec_str_len = snprintf(str, sizeof(str), "%s%ld log messages were dropped because "
+                                   "the log buffer of a thread was full, %ld in total.",
+                                   PREFIX_WARNING, dropped, log_rings_dropped) + 1;
+        rec.rec_flags = (log_config.do_highprecision ? LOG_RECORD_HP : 0) |
+                        (log_config.do_syslog ? LOG_RECORD_SYSLOG : 0) |
+                        (log_config.do_maxlog ? LOG_RECORD_MAXLOG : 0);
+        gettimeofday(&rec.rec_time, NULL);
+        log_record_format(fwr, &rec, str);
+    }
+
+    log_writer_write(fwr, flush);
+}
+
+/**
+ * Check whether a log ring has messages that have not been written.
+ *
+ * @return True if there are messages to write
+ */
+static bool log_rings_pending(void)
+{
+    for (log_ring_t* ring = log_rings; ring; ring = ring->rng_next)
+    {
+        if (atomic_load_int64(&ring->rng_tail) != ring->rng_head ||
+            atomic_load_int64(&ring->rng_dropped) != ring->rng_reported)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /**
  * Log a message of a particular priority.
  *
@@ -2748,12 +3349,14 @@ int mxs_log_message(int priority,
                     const char* format, ...)
 {
     int err = 0;
+    size_t suppressed;
 
     assert((priority & ~LOG_PRIMASK) == 0);
 
     if ((priority & ~LOG_PRIMASK) == 0) // Check that the priority is ok,
     {
-        if (MXS_LOG_PRIORITY_IS_ENABLED(priority))
+        if (MXS_LOG_PRIORITY_IS_ENABLED(priority) &&
+            log_throttle_check(priority, file, line, &suppressed))
         {
             va_list valist;
 
@@ -2786,14 +3389,24 @@ int mxs_log_message(int priority,
                         break;
                 }
 
-                int buffer_len = prefix.len + augmentation_len + message_len + 1; // Trailing NULL
+                char suppressed_text[64] = "";
+                int suppressed_len = 0;
+
+                if (suppressed > 0)
+                {
+                    suppressed_len = snprintf(suppressed_text, sizeof(suppressed_text),
+                                              " (suppressed %lu similar messages)", suppressed);
+                }
+
+                // Trailing NULL
+                int buffer_len = prefix.len + augmentation_len + message_len + suppressed_len + 1;
 
                 if (buffer_len > MAX_LOGSTRLEN)
                 {
                     message_len -= (buffer_len - MAX_LOGSTRLEN);
                     buffer_len = MAX_LOGSTRLEN;
 
-                    assert(prefix.len + augmentation_len + message_len + 1 == buffer_len);
+                    assert(prefix.len + augmentation_len + message_len + suppressed_len + 1 == buffer_len);
                 }
 
                 char buffer[buffer_len];
@@ -2825,6 +3438,8 @@ int mxs_log_message(int priority,
                 vsnprintf(message_text, message_len + 1, format, valist);
                 va_end(valist);
 
+                strcpy(message_text + message_len, suppressed_text);
+
                 enum log_flush flush = priority_to_flush(priority);
 
                 err = log_write(priority, file, line, function, prefix.len, buffer_len, buffer, flush);
@@ -21,10 +21,19 @@
  *
  * Date       Who           Description
  * 30-10-2015 Markus Makela Initial implementation
+ * 14-10-2016 MariaDB Corporation Added JIT compilation and thread matching data
  * @endverbatim
  */
 
 #include <maxscale_pcre2.h>
+#include <platform.h>
+#include <log_manager.h>
+
+/** The matching data of the calling thread */
+static thread_local pcre2_match_data* this_match_data = NULL;
+
+/** Number of ovector pairs in the matching data of the calling thread */
+static thread_local uint32_t this_match_pairs = 0;
 
 /**
  * Utility wrapper for PCRE2 library function call pcre2_substitute.
@@ -132,3 +141,96 @@ mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subje
     }
     return rval;
 }
+
+/**
+ * Compile a pattern for matching
+ *
+ * The pattern is compiled with the JIT compiler if the PCRE2 library supports
+ * it. The pattern is still usable if the JIT compilation fails.
+ *
+ * @param pattern Pattern to compile
+ * @param options PCRE2 compilation options
+ * @return The compiled pattern or NULL if the pattern is invalid. The pattern
+ * must be freed with pcre2_code_free.
+ */
+pcre2_code* mxs_pcre2_compile(const char* pattern, uint32_t options)
+{
+    int err;
+    size_t erroff;
+    pcre2_code *re = pcre2_compile((PCRE2_SPTR) pattern, PCRE2_ZERO_TERMINATED,
+                                   options, &err, &erroff, NULL);
+
+    if (re == NULL)
+    {
+        PCRE2_UCHAR errbuf[512];
+        pcre2_get_error_message(err, errbuf, sizeof(errbuf));
+        MXS_ERROR("Failed to compile regular expression '%s' at offset %lu: %s",
+                  pattern, erroff, errbuf);
+    }
+    else if (pcre2_jit_compile(re, PCRE2_JIT_COMPLETE) != 0)
+    {
+        MXS_INFO("JIT compilation of regular expression '%s' failed, "
+                 "using the interpreter.", pattern);
+    }
+
+    return re;
+}
+
+/**
+ * Get the matching data of the calling thread
+ *
+ * The matching data is large enough for all the captured substrings of the
+ * pattern. It is reused by all matches of the thread, so it is only valid
+ * until the next call of this function or of mxs_pcre2_match.
+ *
+ * @param re The pattern the data is used with
+ * @return The matching data or NULL if memory allocation failed
+ */
+pcre2_match_data* mxs_pcre2_thread_match_data(const pcre2_code* re)
+{
+    uint32_t captures = 0;
+    pcre2_pattern_info(re, PCRE2_INFO_CAPTURECOUNT, &captures);
+
+    if (this_match_data == NULL || this_match_pairs < captures + 1)
+    {
+        pcre2_match_data* mdata = pcre2_match_data_create(captures + 1, NULL);
+
+        if (mdata == NULL)
+        {
+            return NULL;
+        }
+
+        pcre2_match_data_free(this_match_data);
+        this_match_data = mdata;
+        this_match_pairs = captures + 1;
+    }
+
+    return this_match_data;
+}
+
+/**
+ * Check if a subject string matches a pattern
+ *
+ * The matching data of the calling thread is used, so no memory is allocated
+ * and no locks are taken.
+ *
+ * @param re Compiled pattern
+ * @param subject Subject string
+ * @param length Length of the subject or PCRE2_ZERO_TERMINATED
+ * @return True if the subject matches the pattern
+ */
+bool mxs_pcre2_match(const pcre2_code* re, const char* subject, size_t length)
+{
+    if (this_match_data == NULL)
+    {
+        if ((this_match_data = pcre2_match_data_create(1, NULL)) == NULL)
+        {
+            return false;
+        }
+        this_match_pairs = 1;
+    }
+
+    /** A return value of zero means the match succeeded but the matching
+     * data was too small for the captured substrings */
+    return pcre2_match(re, (PCRE2_SPTR) subject, length, 0, 0, this_match_data, NULL) >= 0;
+}
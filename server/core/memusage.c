@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file memusage.c  - Accounting of the memory used by the subsystems
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * 14/10/16     MariaDB Corporation     Count into the shared per-thread counter blocks
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memusage.h>
+#include <platform.h>
+#include <counter_blocks.h>
+#include <buffer.h>
+#include <dcb.h>
+#include <service.h>
+#include <metrics.h>
+
+static const char *memusage_names[MEMUSAGE_N_SUBSYSTEMS] =
+{
+    "buffers",
+    "dcbs",
+    "sessions",
+    "session_commands",
+    "hashtables",
+    "query_classifier"
+};
+
+/** The bytes of the subsystems followed by their objects, in one chunk */
+static COUNTER_BLOCKS counters = COUNTER_BLOCKS_INIT(2 * MEMUSAGE_N_SUBSYSTEMS, 1);
+static thread_local COUNTER_BLOCK *thread_block = NULL;
+
+/**
+ * Count an allocation or a free of a subsystem
+ *
+ * @param subsystem The subsystem
+ * @param bytes     Bytes allocated, negative for freed bytes
+ * @param objects   Objects allocated, negative for freed objects
+ */
+void
+memusage_add(memusage_t subsystem, int64_t bytes, int64_t objects)
+{
+    counter_blocks_add(&counters, &thread_block, subsystem, bytes);
+    counter_blocks_add(&counters, &thread_block, MEMUSAGE_N_SUBSYSTEMS + subsystem, objects);
+}
+
+/**
+ * Get the memory used by the subsystems. The counters of the threads are read
+ * without locking them, so the values are approximate.
+ *
+ * @param usage Where the sums are stored
+ */
+void
+memusage_get(MEMUSAGE *usage)
+{
+    memset(usage, 0, sizeof(*usage));
+    counter_blocks_sum(&counters, 0, MEMUSAGE_N_SUBSYSTEMS, usage->bytes);
+    counter_blocks_sum(&counters, MEMUSAGE_N_SUBSYSTEMS, MEMUSAGE_N_SUBSYSTEMS, usage->objects);
+}
+
+/**
+ * Return the name of a subsystem
+ *
+ * @param subsystem The subsystem
+ * @return The name
+ */
+const char *
+memusage_name(memusage_t subsystem)
+{
+    return subsystem < MEMUSAGE_N_SUBSYSTEMS ? memusage_names[subsystem] : "unknown";
+}
+
+/**
+ * Print the memory used by the subsystems and by the services
+ *
+ * @param dcb The DCB to print to
+ */
+void
+dShowMemory(DCB *dcb)
+{
+    MEMUSAGE usage;
+    GWBUF_POOL_STATS pool;
+
+    memusage_get(&usage);
+    gwbuf_get_pool_stats(&pool);
+
+    dcb_printf(dcb, "Memory usage\n");
+    dcb_printf(dcb, "--------------------+-------------------+-------------\n");
+    dcb_printf(dcb, " %-18s | %17s | %s\n", "Subsystem", "Bytes", "Objects");
+    dcb_printf(dcb, "--------------------+-------------------+-------------\n");
+    for (int i = 0; i < MEMUSAGE_N_SUBSYSTEMS; i++)
+    {
+        dcb_printf(dcb, " %-18s | %17ld | %ld\n", memusage_names[i],
+                   usage.bytes[i], usage.objects[i]);
+    }
+    dcb_printf(dcb, "--------------------+-------------------+-------------\n");
+    dcb_printf(dcb, "Bytes in the write queues:        %ld\n", dcb_writeq_total());
+    dcb_printf(dcb, "Bytes cached in the buffer pools: %lu\n\n", pool.cached_bytes);
+
+    dprintServicesMemory(dcb);
+}
+
+/**
+ * Provide a row to the result set of the memory usage
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+memusageRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    MEMUSAGE usage;
+    RESULT_ROW *row;
+    char buf[40];
+
+    if (*rowno >= MEMUSAGE_N_SUBSYSTEMS)
+    {
+        free(data);
+        return NULL;
+    }
+
+    memusage_get(&usage);
+    row = resultset_make_row(set);
+    resultset_row_set(row, 0, (char *)memusage_names[*rowno]);
+    snprintf(buf, sizeof(buf), "%ld", usage.bytes[*rowno]);
+    resultset_row_set(row, 1, buf);
+    snprintf(buf, sizeof(buf), "%ld", usage.objects[*rowno]);
+    resultset_row_set(row, 2, buf);
+    (*rowno)++;
+
+    return row;
+}
+
+/**
+ * Return a result set with the memory used by the subsystems
+ *
+ * @return The result set or NULL on error
+ */
+RESULTSET *
+memusageGetList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(memusageRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Subsystem", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Bytes", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Objects", 20, COL_TYPE_VARCHAR);
+
+    return set;
+}
+
+/**
+ * Render the memory used by the subsystems as metrics
+ *
+ * @param metrics The metrics
+ */
+void
+memusage_metrics(METRICS *metrics)
+{
+    MEMUSAGE usage;
+    char labels[64];
+
+    memusage_get(&usage);
+
+    metrics_family(metrics, "maxscale_memory_bytes", METRICS_GAUGE,
+                   "Memory used by the subsystem");
+    for (int i = 0; i < MEMUSAGE_N_SUBSYSTEMS; i++)
+    {
+        snprintf(labels, sizeof(labels), "subsystem=\"%s\"", memusage_names[i]);
+        metrics_value(metrics, "maxscale_memory_bytes", labels, usage.bytes[i]);
+    }
+
+    metrics_family(metrics, "maxscale_memory_objects", METRICS_GAUGE,
+                   "Objects allocated by the subsystem");
+    for (int i = 0; i < MEMUSAGE_N_SUBSYSTEMS; i++)
+    {
+        snprintf(labels, sizeof(labels), "subsystem=\"%s\"", memusage_names[i]);
+        metrics_value(metrics, "maxscale_memory_objects", labels, usage.objects[i]);
+    }
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file metrics.c  - Rendering of the statistics in the Prometheus text format
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <metrics.h>
+
+/** The initial size of the text, enough for a small configuration */
+#define METRICS_INITIAL_SIZE 16384
+
+/** The latency histograms are rendered with a bucket for each power of two
+ * from 2^METRICS_LATENCY_MIN_EXP to 2^METRICS_LATENCY_MAX_EXP microseconds,
+ * that is from 16 microseconds to about 33 seconds */
+#define METRICS_LATENCY_MIN_EXP 4
+#define METRICS_LATENCY_MAX_EXP 25
+
+void metrics_init(METRICS *metrics)
+{
+    metrics->data = NULL;
+    metrics->len = 0;
+    metrics->size = 0;
+    metrics->failed = false;
+}
+
+void metrics_free(METRICS *metrics)
+{
+    free(metrics->data);
+    metrics_init(metrics);
+}
+
+/**
+ * Create a buffer with the text of the metrics
+ *
+ * @param metrics The metrics
+ * @return The buffer or NULL if the text could not be rendered completely
+ */
+GWBUF *metrics_to_gwbuf(METRICS *metrics)
+{
+    if (metrics->failed)
+    {
+        return NULL;
+    }
+
+    return gwbuf_alloc_and_load(metrics->len, metrics->data ? metrics->data : "");
+}
+
+/**
+ * Append formatted text to the metrics
+ *
+ * @param metrics The metrics
+ * @param fmt     The format of the text
+ */
+void metrics_printf(METRICS *metrics, const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    if (metrics->failed)
+    {
+        return;
+    }
+
+    va_start(args, fmt);
+    len = vsnprintf(metrics->data + metrics->len, metrics->size - metrics->len, fmt, args);
+    va_end(args);
+
+    if (len < 0)
+    {
+        metrics->failed = true;
+    }
+    else if (metrics->len + len >= metrics->size)
+    {
+        size_t size = metrics->size ? metrics->size : METRICS_INITIAL_SIZE;
+        char *data;
+
+        while (size <= metrics->len + len)
+        {
+            size *= 2;
+        }
+
+        if ((data = realloc(metrics->data, size)) == NULL)
+        {
+            metrics->failed = true;
+            return;
+        }
+
+        metrics->data = data;
+        metrics->size = size;
+
+        va_start(args, fmt);
+        vsnprintf(metrics->data + metrics->len, metrics->size - metrics->len, fmt, args);
+        va_end(args);
+        metrics->len += len;
+    }
+    else
+    {
+        metrics->len += len;
+    }
+}
+
+/**
+ * Escape the value of a label
+ *
+ * The backslashes, the double quotes and the line feeds are escaped. A value
+ * that does not fit is truncated.
+ *
+ * @param value The value
+ * @param dest  Where the escaped value is written
+ * @param size  Size of @c dest
+ * @return @c dest
+ */
+const char *metrics_escape(const char *value, char *dest, size_t size)
+{
+    size_t len = 0;
+
+    for (const char *p = value; *p && len + 1 < size; p++)
+    {
+        if (*p == '\\' || *p == '"' || *p == '\n')
+        {
+            if (len + 2 >= size)
+            {
+                break;
+            }
+
+            dest[len++] = '\\';
+            dest[len++] = *p == '\n' ? 'n' : *p;
+        }
+        else
+        {
+            dest[len++] = *p;
+        }
+    }
+
+    dest[len] = '\0';
+    return dest;
+}
+
+/**
+ * Start a metric family
+ *
+ * @param metrics The metrics
+ * @param name    The name of the family
+ * @param type    The type of the family
+ * @param help    The description of the family
+ */
+void metrics_family(METRICS *metrics, const char *name, METRICS_TYPE type, const char *help)
+{
+    const char *types[] = {"counter", "gauge", "histogram"};
+
+    metrics_printf(metrics, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, types[type]);
+}
+
+/**
+ * Add a sample of a counter or a gauge
+ *
+ * @param metrics The metrics
+ * @param name    The name of the metric
+ * @param labels  The labels of the sample, without the braces, or NULL
+ * @param value   The value
+ */
+void metrics_value(METRICS *metrics, const char *name, const char *labels, int64_t value)
+{
+    if (labels && *labels)
+    {
+        metrics_printf(metrics, "%s{%s} %ld\n", name, labels, value);
+    }
+    else
+    {
+        metrics_printf(metrics, "%s %ld\n", name, value);
+    }
+}
+
+/**
+ * Add a latency histogram
+ *
+ * The latencies are rendered in seconds with a bucket for each power of two
+ * microseconds. A bucket counts the latencies below its bound.
+ *
+ * @param metrics  The metrics
+ * @param name     The name of the histogram, without the _bucket suffix
+ * @param labels   The labels of the histogram, without the braces, or NULL
+ * @param snapshot The latencies
+ */
+void metrics_latency(METRICS *metrics, const char *name, const char *labels,
+                     const TS_LATENCY_SNAPSHOT *snapshot)
+{
+    const char *sep = labels && *labels ? "," : "";
+    uint64_t seen = 0;
+    int bucket = 0;
+
+    labels = labels ? labels : "";
+
+    for (int exp = METRICS_LATENCY_MIN_EXP; exp <= METRICS_LATENCY_MAX_EXP; exp++)
+    {
+        uint64_t bound = (uint64_t)1 << exp;
+
+        while (bucket < TS_LATENCY_BUCKETS && ts_latency_value(bucket) < bound)
+        {
+            seen += snapshot->hist[bucket++];
+        }
+
+        metrics_printf(metrics, "%s_bucket{%s%sle=\"%g\"} %lu\n",
+                       name, labels, sep, bound / 1000000.0, seen);
+    }
+
+    metrics_printf(metrics, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, snapshot->count);
+
+    if (*labels)
+    {
+        metrics_printf(metrics, "%s_sum{%s} %.6f\n%s_count{%s} %lu\n",
+                       name, labels, snapshot->total / 1000000.0, name, labels, snapshot->count);
+    }
+    else
+    {
+        metrics_printf(metrics, "%s_sum %.6f\n%s_count %lu\n",
+                       name, snapshot->total / 1000000.0, name, snapshot->count);
+    }
+}
@@ -21,6 +21,8 @@
  * 04/06/14     Mark Riddoch            Initial implementation
  * 24/10/14     Massimiliano Pinto      Added modutil_send_mysql_err_packet, modutil_create_mysql_err_msg
  * 04/01/16     Martin Brampton         Streamline code in modutil_get_complete_packets
+ * 14/10/16     MariaDB Corporation     Packets are found with an iterator that reads
+ *                                      the headers in place
  *
  * @endverbatim
  */
@@ -30,6 +32,25 @@
 #include <maxscale/poll.h>
 #include <modutil.h>
 #include <strings.h>
+#include <stddef.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * A copy of the SQL of a buffer, stored as a buffer object. The copy is
+ * dropped when the SQL of the buffer is replaced and made again when it
+ * is next asked for.
+ */
+typedef struct
+{
+    char *sql;      /*< Null terminated copy of the SQL or NULL */
+    int  length;    /*< Length of the SQL */
+} MODUTIL_SQL_COPY;
+
+/** Maximum number of bytes in the sets given to skip_to_set */
+#define MODUTIL_SKIP_SET_MAX 8
 
 /** These are used when converting MySQL wildcards to regular expressions */
 static SPINLOCK re_lock = SPINLOCK_INIT;
@@ -255,6 +276,15 @@ modutil_replace_SQL(GWBUF *orig, char *sql)
         orig->next = addition;
     }
 
+    MODUTIL_SQL_COPY *copy = (MODUTIL_SQL_COPY*)gwbuf_get_buffer_object_data(orig, GWBUF_SQL_COPY);
+
+    if (copy)
+    {
+        /** The copy no longer matches the SQL of the buffer */
+        free(copy->sql);
+        copy->sql = NULL;
+    }
+
     return orig;
 }
 
@@ -309,6 +339,135 @@ modutil_get_SQL(GWBUF *buf)
     return rval;
 }
 
+/**
+ * Check whether a buffer contains a packet that carries an SQL string, that is,
+ * a COM_QUERY, a COM_STMT_PREPARE or a COM_INIT_DB packet.
+ *
+ * @param buf   The buffer
+ * @return True if the packet carries an SQL string
+ */
+static bool
+modutil_has_SQL(GWBUF *buf)
+{
+    return GWBUF_LENGTH(buf) > MYSQL_HEADER_LEN &&
+        (modutil_is_SQL(buf) || modutil_is_SQL_prepare(buf) ||
+         MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(buf)));
+}
+
+static void
+modutil_sql_copy_free(void *data)
+{
+    MODUTIL_SQL_COPY *copy = (MODUTIL_SQL_COPY*)data;
+    free(copy->sql);
+    free(copy);
+}
+
+/**
+ * Return the copy of the SQL that is stored in the buffer, making it first
+ * if needed.
+ *
+ * @param buf   The buffer
+ * @return The copy or NULL if the packet carries no SQL or memory allocation failed
+ */
+static MODUTIL_SQL_COPY *
+modutil_sql_copy(GWBUF *buf)
+{
+    if (!modutil_has_SQL(buf))
+    {
+        return NULL;
+    }
+
+    MODUTIL_SQL_COPY *copy = (MODUTIL_SQL_COPY*)gwbuf_get_buffer_object_data(buf, GWBUF_SQL_COPY);
+
+    if (copy == NULL)
+    {
+        if ((copy = (MODUTIL_SQL_COPY*)calloc(1, sizeof(MODUTIL_SQL_COPY))) == NULL)
+        {
+            return NULL;
+        }
+        gwbuf_add_buffer_object(buf, GWBUF_SQL_COPY, copy, modutil_sql_copy_free);
+    }
+
+    if (copy->sql == NULL)
+    {
+        size_t length = MYSQL_GET_PACKET_LEN((uint8_t*)GWBUF_DATA(buf)) - 1;
+
+        if ((copy->sql = (char*)malloc(length + 1)) == NULL)
+        {
+            return NULL;
+        }
+        copy->length = gwbuf_copy_data(buf, MYSQL_HEADER_LEN + 1, length, (uint8_t*)copy->sql);
+        copy->sql[copy->length] = '\0';
+    }
+
+    return copy;
+}
+
+/**
+ * Return a read-only view of the SQL of a COM_QUERY, COM_STMT_PREPARE or
+ * COM_INIT_DB packet.
+ *
+ * If the whole statement is in the first buffer of the chain, @c sql points
+ * into the buffer and nothing is copied. Otherwise it points to a copy that is
+ * stored in the buffer and shared by all callers, see modutil_get_SQL_cached.
+ * The string is not null terminated when it points into the buffer. It is
+ * valid until the buffer is freed or its SQL is replaced and must not be
+ * modified.
+ *
+ * @param buf       The buffer
+ * @param sql       Set to point to the SQL
+ * @param length    Set to the length of the SQL
+ * @return True if the packet carries an SQL string
+ */
+bool
+modutil_get_SQL_view(GWBUF *buf, const char **sql, int *length)
+{
+    if (!modutil_has_SQL(buf))
+    {
+        return false;
+    }
+
+    uint8_t *ptr = (uint8_t*)GWBUF_DATA(buf);
+    size_t len = MYSQL_GET_PACKET_LEN(ptr) - 1;
+
+    if (GWBUF_LENGTH(buf) >= MYSQL_HEADER_LEN + 1 + len)
+    {
+        *sql = (const char*)ptr + MYSQL_HEADER_LEN + 1;
+        *length = len;
+        return true;
+    }
+
+    MODUTIL_SQL_COPY *copy = modutil_sql_copy(buf);
+
+    if (copy)
+    {
+        *sql = copy->sql;
+        *length = copy->length;
+    }
+
+    return copy != NULL;
+}
+
+/**
+ * Return a null terminated copy of the SQL of a COM_QUERY, COM_STMT_PREPARE or
+ * COM_INIT_DB packet that is stored in the buffer.
+ *
+ * The copy is made when it is first asked for and it is shared by everyone
+ * who handles the buffer, which is cheaper than calling modutil_get_SQL in
+ * each filter that needs a string. The copy is owned by the buffer, it is
+ * valid until the buffer is freed or its SQL is replaced and must not be
+ * modified or freed.
+ *
+ * @param buf   The buffer
+ * @return The SQL or NULL if the packet carries no SQL or memory allocation failed
+ */
+const char *
+modutil_get_SQL_cached(GWBUF *buf)
+{
+    MODUTIL_SQL_COPY *copy = modutil_sql_copy(buf);
+    return copy ? copy->sql : NULL;
+}
+
 /**
  * Copy query string from GWBUF buffer to separate memory area.
  *
@@ -493,9 +652,10 @@ GWBUF* modutil_get_next_MySQL_packet(GWBUF** p_readbuf)
     size_t   buflen;
     size_t   packetlen;
     size_t   totalbuflen;
-    uint8_t* data;
     size_t   nbytes_copied = 0;
     uint8_t* target;
+    MODUTIL_PACKET_ITER iter;
+    MODUTIL_PACKET packet;
 
     readbuf = *p_readbuf;
 
@@ -511,17 +671,28 @@ GWBUF* modutil_get_next_MySQL_packet(GWBUF** p_readbuf)
         packetbuf = NULL;
         goto return_packetbuf;
     }
-    totalbuflen = gwbuf_length(readbuf);
-    data        = (uint8_t *)GWBUF_DATA((readbuf));
-    packetlen   = MYSQL_GET_PACKET_LEN(data) + 4;
+    modutil_packet_iter_init(&iter, readbuf);
 
     /** packet is incomplete */
-    if (packetlen > totalbuflen)
+    if (!modutil_packet_next(&iter, &packet))
     {
         packetbuf = NULL;
         goto return_packetbuf;
     }
 
+    packetlen = packet.length;
+
+    /**
+     * A packet that is in the first buffer is split off by reference,
+     * only a packet that spans several buffers is copied.
+     */
+    if (packet.data && packet.buffer == readbuf)
+    {
+        packetbuf = gwbuf_split(p_readbuf, packetlen);
+        goto return_packetbuf;
+    }
+
+    totalbuflen = gwbuf_length(readbuf);
     packetbuf = gwbuf_alloc(packetlen);
     target    = GWBUF_DATA(packetbuf);
     packetbuf->gwbuf_type = readbuf->gwbuf_type; /*< Copy the type too */
@@ -556,52 +727,142 @@ return_packetbuf:
  */
 static size_t get_complete_packets_length(GWBUF *buffer)
 {
-    uint8_t packet_len[3];
-    uint32_t buflen = GWBUF_LENGTH(buffer);
-    size_t offset = 0;
-    size_t total = 0;
+    MODUTIL_PACKET_ITER iter;
+    MODUTIL_PACKET packet;
+
+    modutil_packet_iter_init(&iter, buffer);
 
-    while (buffer && gwbuf_copy_data(buffer, offset, 3, packet_len) == 3)
+    while (modutil_packet_next(&iter, &packet))
     {
-        uint32_t len = gw_mysql_get_byte3(packet_len) + MYSQL_HEADER_LEN;
+        ;
+    }
+
+    return iter.total;
+}
 
-        if (len < buflen)
+/**
+ * @brief Start iterating over the complete packets of a buffer chain
+ *
+ * @param iter   Iterator to initialise
+ * @param buffer Buffer chain to iterate over, may be NULL
+ */
+void modutil_packet_iter_init(MODUTIL_PACKET_ITER* iter, GWBUF* buffer)
+{
+    iter->buffer = buffer;
+    iter->offset = 0;
+    iter->total = 0;
+}
+
+/**
+ * @brief Find the next complete packet of a buffer chain
+ *
+ * The header of a packet is read in place when it is in one buffer and the
+ * buffers of a packet are only followed, never copied. When an incomplete
+ * packet is found, the iterator is left pointing at it so that the length of
+ * the complete packets before it is in the total of the iterator.
+ *
+ * @param iter   The iterator
+ * @param packet The view of the packet that is filled in
+ * @return True if a complete packet was found
+ */
+bool modutil_packet_next(MODUTIL_PACKET_ITER* iter, MODUTIL_PACKET* packet)
+{
+    GWBUF* buffer = iter->buffer;
+    size_t offset = iter->offset;
+
+    /** Skip the buffers that have been read to the end */
+    while (buffer && offset >= GWBUF_LENGTH(buffer))
+    {
+        offset -= GWBUF_LENGTH(buffer);
+        buffer = buffer->next;
+    }
+
+    if (buffer == NULL)
+    {
+        return false;
+    }
+
+    size_t buflen = GWBUF_LENGTH(buffer);
+    uint8_t* start = (uint8_t*)GWBUF_DATA(buffer) + offset;
+    uint8_t header_copy[MYSQL_HEADER_LEN];
+    uint8_t* header = start;
+
+    if (offset + MYSQL_HEADER_LEN > buflen)
+    {
+        /** The header is split between buffers */
+        if (gwbuf_copy_data(buffer, offset, MYSQL_HEADER_LEN, header_copy) < MYSQL_HEADER_LEN)
         {
-            offset += len;
-            total += len;
-            buflen -= len;
+            return false;
         }
-        /** The packet is spread across multiple buffers or a buffer ends with
-         * a complete packet. */
-        else
-        {
-            uint32_t read_len = len;
+        header = header_copy;
+    }
 
-            while (read_len >= buflen && buffer)
-            {
-                read_len -= buflen;
-                buffer = buffer->next;
-                buflen = buffer ? GWBUF_LENGTH(buffer) : 0;
-            }
+    uint32_t length = gw_mysql_get_byte3(header) + MYSQL_HEADER_LEN;
 
-            /** Either the buffer ended with a complete packet or the buffer
-             * contains more data than is required. */
-            if (read_len == 0 || (buffer && read_len < buflen))
-            {
-                total += len;
-                offset = read_len;
-                buflen -= read_len;
-            }
-            /** The buffer chain contains at least one incomplete packet */
-            else
-            {
-                ss_dassert(!buffer);
-                break;
-            }
+    packet->buffer = buffer;
+    packet->offset = offset;
+    packet->length = length;
+    packet->seqno = header[3];
+
+    if (offset + length <= buflen)
+    {
+        packet->data = start;
+        iter->offset = offset + length;
+    }
+    else
+    {
+        /** Follow the buffers to the end of the packet */
+        size_t left = length - (buflen - offset);
+        GWBUF* next = buffer->next;
+
+        while (next && left > GWBUF_LENGTH(next))
+        {
+            left -= GWBUF_LENGTH(next);
+            next = next->next;
         }
+
+        if (next == NULL)
+        {
+            iter->buffer = buffer;
+            iter->offset = offset;
+            return false;
+        }
+
+        packet->data = NULL;
+        buffer = next;
+        iter->offset = left;
     }
 
-    return total;
+    iter->buffer = buffer;
+    iter->total += length;
+    return true;
+}
+
+/**
+ * @brief Copy data of a packet
+ *
+ * @param packet The packet
+ * @param offset Offset in the packet, including the header
+ * @param len    Maximum number of bytes to copy
+ * @param dest   Where the data is copied to
+ * @return Number of bytes copied
+ */
+size_t modutil_packet_copy(const MODUTIL_PACKET* packet, size_t offset, size_t len, uint8_t* dest)
+{
+    if (offset >= packet->length)
+    {
+        return 0;
+    }
+
+    len = MIN(len, packet->length - offset);
+
+    if (packet->data)
+    {
+        memcpy(dest, packet->data + offset, len);
+        return len;
+    }
+
+    return gwbuf_copy_data(packet->buffer, packet->offset + offset, len, dest);
 }
 
 /**
@@ -791,6 +1052,54 @@ static void modutil_reply_routing_error(DCB*     backend_dcb,
     return;
 }
 
+/**
+ * Skip the bytes of a memory area that are not in a set of interesting bytes.
+ * With SSE2 the area is compared against the set 16 bytes at a time, the
+ * remaining bytes are compared one at a time.
+ * @param ptr Pointer to area of memory to inspect
+ * @param end End of the memory area
+ * @param set The interesting bytes
+ * @param n Number of bytes in the set
+ * @return Pointer to the first interesting byte or @p end if none is found
+ */
+static inline char* skip_to_set(char* ptr, char* end, const char* set, int n)
+{
+#if defined(__SSE2__)
+    __m128i needles[MODUTIL_SKIP_SET_MAX];
+
+    for (int i = 0; i < n; i++)
+    {
+        needles[i] = _mm_set1_epi8(set[i]);
+    }
+
+    while (end - ptr >= (ptrdiff_t)sizeof(__m128i))
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)ptr);
+        __m128i match = _mm_cmpeq_epi8(block, needles[0]);
+
+        for (int i = 1; i < n; i++)
+        {
+            match = _mm_or_si128(match, _mm_cmpeq_epi8(block, needles[i]));
+        }
+
+        int mask = _mm_movemask_epi8(match);
+
+        if (mask)
+        {
+            return ptr + __builtin_ctz(mask);
+        }
+        ptr += sizeof(__m128i);
+    }
+#endif
+
+    while (ptr < end && memchr(set, *ptr, n) == NULL)
+    {
+        ptr++;
+    }
+
+    return ptr;
+}
+
 /**
  * Find the first occurrence of a character in a string. This function ignores
  * escaped characters and all characters that are enclosed in single or double quotes.
@@ -804,11 +1113,27 @@ char* strnchr_esc(char* ptr, char c, int len)
 {
     char* p = (char*)ptr;
     char* start = p;
+    char* end = start + len;
     bool quoted = false, escaped = false;
-    char qc;
+    char qc = 0;
 
-    while (p < start + len)
+    while (p < end)
     {
+        if (!escaped)
+        {
+            /** Only backslashes, quotes and the character change the state */
+            char set[] = {'\\', '\'', '"', c};
+            char quoted_set[] = {'\\', qc};
+
+            p = quoted ? skip_to_set(p, end, quoted_set, sizeof(quoted_set)) :
+                skip_to_set(p, end, set, sizeof(set));
+
+            if (p == end)
+            {
+                break;
+            }
+        }
+
         if (escaped)
         {
             escaped = false;
@@ -851,10 +1176,41 @@ char* strnchr_esc_mysql(char* ptr, char c, int len)
     char* p = (char*) ptr;
     char* start = p, *end = start + len;
     bool quoted = false, escaped = false, backtick = false, comment = false;
-    char qc;
+    char qc = 0;
 
     while (p < end)
     {
+        if (!escaped)
+        {
+            /** Skip the bytes that the current state ignores */
+            char set[] = {'\\', '\'', '"', '/', '`', '#', '-', c};
+            char comment_set[] = {'*'};
+            char quoted_set[] = {qc};
+            char backtick_set[] = {'`'};
+
+            if (comment)
+            {
+                p = skip_to_set(p, end, comment_set, sizeof(comment_set));
+            }
+            else if (quoted)
+            {
+                p = skip_to_set(p, end, quoted_set, sizeof(quoted_set));
+            }
+            else if (backtick)
+            {
+                p = skip_to_set(p, end, backtick_set, sizeof(backtick_set));
+            }
+            else
+            {
+                p = skip_to_set(p, end, set, sizeof(set));
+            }
+
+            if (p == end)
+            {
+                break;
+            }
+        }
+
         if (escaped)
         {
             escaped = false;
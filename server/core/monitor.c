@@ -24,6 +24,10 @@
  * 30/10/14     Massimiliano Pinto      Addition of disable_master_failback parameter
  * 07/11/14     Massimiliano Pinto      Addition of monitor network timeouts
  * 08/05/15     Markus Makela           Moved common monitor variables to MONITOR struct
+ * 14/10/16     MariaDB Corporation     Concurrent probing of the servers
+ * 14/10/16     MariaDB Corporation     Asynchronous execution of monitor scripts
+ * 14/10/16     MariaDB Corporation     Monitoring cycle and probe statistics
+ * 14/10/16     MariaDB Corporation     Latency histograms of the core statistics
  *
  * @endverbatim
  */
@@ -40,6 +44,15 @@
 #include <externcmd.h>
 #include <mysqld_error.h>
 #include <mysql_utils.h>
+#include <thread.h>
+#include <atomic.h>
+#include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <errmsg.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 /*
  *  Create declarations of the enum for monitor events and also the array of
@@ -59,6 +72,10 @@ static MONITOR  *allMonitors = NULL;
 static SPINLOCK monLock = SPINLOCK_INIT;
 
 static void monitor_servers_free(MONITOR_SERVERS *servers);
+static bool mon_script_submit(MONITOR *monitor, EXTERNCMD *cmd, const char *script,
+                              const char *event, const char *server);
+static void mon_script_executor_diagnostics(DCB *dcb, MONITOR *monitor);
+static void mon_show_statistics(DCB *dcb, MONITOR *monitor);
 
 /**
  * Allocate a new monitor, load the associated module for the monitor
@@ -96,6 +113,13 @@ monitor_alloc(char *name, char *module)
     mon->connect_timeout = DEFAULT_CONNECT_TIMEOUT;
     mon->interval = MONITOR_INTERVAL;
     mon->parameters = NULL;
+    mon->probe_pool = NULL;
+    mon->script_timeout = DEFAULT_SCRIPT_TIMEOUT;
+    mon->script_max_concurrency = DEFAULT_SCRIPT_MAX_CONCURRENCY;
+    mon->script_executor = NULL;
+    mon->tick_start = 0;
+    memset(&mon->tick_latency, 0, sizeof(mon->tick_latency));
+    spinlock_init(&mon->stats_lock);
     spinlock_init(&mon->lock);
     spinlock_acquire(&monLock);
     mon->next = allMonitors;
@@ -117,6 +141,8 @@ monitor_free(MONITOR *mon)
     MONITOR *ptr;
 
     mon->module->stopMonitor(mon);
+    mon_probe_pool_free(mon);
+    mon_script_executor_free(mon);
     mon->state = MONITOR_STATE_FREED;
     spinlock_acquire(&monLock);
     if (allMonitors == mon)
@@ -176,7 +202,10 @@ void monitorStartAll()
     ptr = allMonitors;
     while (ptr)
     {
+        uint64_t start = ts_clock_us();
         monitorStart(ptr, ptr->parameters);
+        MXS_NOTICE("Starting monitor '%s' took %.3f seconds.", ptr->name,
+                   (ts_clock_us() - start) / 1000000.0);
         ptr = ptr->next;
     }
     spinlock_release(&monLock);
@@ -197,6 +226,8 @@ monitorStop(MONITOR *monitor)
     {
         monitor->state = MONITOR_STATE_STOPPING;
         monitor->module->stopMonitor(monitor);
+        mon_probe_pool_free(monitor);
+        mon_script_executor_free(monitor);
         monitor->state = MONITOR_STATE_STOPPED;
 
         MONITOR_SERVERS* db = monitor->databases;
@@ -255,6 +286,9 @@ monitorAddServer(MONITOR *mon, SERVER *server)
     db->mon_prev_status = -1;
     /* pending status is updated by get_replication_tree */
     db->pending_status = 0;
+    db->drained = false;
+    memset(&db->stats, 0, sizeof(db->stats));
+    spinlock_init(&db->stats.lock);
 
     spinlock_acquire(&mon->lock);
 
@@ -353,6 +387,19 @@ monitorShow(DCB *dcb, MONITOR *monitor)
     {
         dcb_printf(dcb, "\tMonitor failed\n");
     }
+
+    mon_show_statistics(dcb, monitor);
+
+    for (MONITOR_SERVERS *db = monitor->databases; db; db = db->next)
+    {
+        if (SERVER_IS_DRAINING(db->server))
+        {
+            dcb_printf(dcb, "\tDraining server %s:       %d connections left\n",
+                       db->server->unique_name, db->server->stats.n_current);
+        }
+    }
+
+    mon_script_executor_diagnostics(dcb, monitor);
 }
 
 /**
@@ -460,6 +507,48 @@ monitorSetNetworkTimeout(MONITOR *mon, int type, int value)
     return rval;
 }
 
+/**
+ * Set the time a monitor script may run before it is killed
+ *
+ * @param mon           The monitor instance
+ * @param value         The timeout in seconds
+ * @return True if the value was valid
+ */
+bool
+monitorSetScriptTimeout(MONITOR *mon, int value)
+{
+    if (value <= 0)
+    {
+        MXS_ERROR("Invalid value for the monitor script timeout: %d", value);
+        return false;
+    }
+
+    mon->script_timeout = value;
+    return true;
+}
+
+/**
+ * Set the maximum number of monitor scripts that run at the same time
+ *
+ * @param mon           The monitor instance
+ * @param value         The maximum number of scripts
+ * @return True if the value was valid
+ */
+bool
+monitorSetScriptMaxConcurrency(MONITOR *mon, int value)
+{
+    if (value <= 0 || value > MON_MAX_SCRIPT_CONCURRENCY)
+    {
+        MXS_ERROR("Invalid value for the maximum number of concurrent monitor "
+                  "scripts: %d. The value must be between 1 and %d.",
+                  value, MON_MAX_SCRIPT_CONCURRENCY);
+        return false;
+    }
+
+    mon->script_max_concurrency = value;
+    return true;
+}
+
 /**
  * Provide a row to the result set that defines the set of monitors
  *
@@ -829,7 +918,9 @@ mon_status_changed(MONITOR_SERVERS* mon_srv)
 {
     /* Previous status is -1 if not yet set */
     return (mon_srv->mon_prev_status != -1
-            && mon_srv->mon_prev_status != mon_srv->server->status
+            /** Draining is set by the administrator and is not a state change */
+            && (mon_srv->mon_prev_status & ~SERVER_DRAINING) !=
+               (mon_srv->server->status & ~SERVER_DRAINING)
             /** If the server is going into maintenance or coming out of it, don't trigger a state change */
             && ((mon_srv->mon_prev_status | mon_srv->server->status) & SERVER_MAINT) == 0);
 }
@@ -848,6 +939,11 @@ mon_print_fail_status(MONITOR_SERVERS* mon_srv)
 
 /**
  * Launch a script
+ *
+ * The arguments are substituted with the state of the servers at the time of
+ * the event and the script is handed to the script executor of the monitor,
+ * so the monitor does not wait for the script.
+ *
  * @param mon Owning monitor
  * @param ptr The server which has changed state
  * @param script Script to execute
@@ -908,6 +1004,12 @@ monitor_launch_script(MONITOR* mon, MONITOR_SERVERS* ptr, char* script)
         externcmd_substitute_arg(cmd, "[$]SYNCEDLIST", nodelist);
     }
 
+    if (mon_script_submit(mon, cmd, script, mon_get_event_name(ptr), ptr->server->unique_name))
+    {
+        return;
+    }
+
+    /** The executor could not be started, run the script without a timeout */
     if (externcmd_execute(cmd))
     {
         MXS_ERROR("Failed to execute script '%s' on server state change event '%s'.",
@@ -1021,9 +1123,99 @@ mon_connect_to_db(MONITOR* mon, MONITOR_SERVERS *database)
         rval = MONITOR_CONN_REFUSED;
     }
 
+    if (rval != MONITOR_CONN_OK)
+    {
+        spinlock_acquire(&database->stats.lock);
+        database->stats.n_connect_failures++;
+        spinlock_release(&database->stats.lock);
+    }
+
     return rval;
 }
 
+/**
+ * Check without blocking that an idle monitor connection is still open
+ *
+ * An idle monitor connection is never readable, so any event on it means
+ * that the server closed the connection or sent an error before closing it.
+ *
+ * @param database Monitored server with a connection
+ * @return False if the connection has failed
+ */
+bool
+mon_connection_is_alive(MONITOR_SERVERS *database)
+{
+    struct pollfd pfd;
+
+    pfd.fd = mysql_get_socket(database->con);
+    pfd.events = POLLIN | POLLRDHUP;
+    pfd.revents = 0;
+
+    if (pfd.fd < 0)
+    {
+        return false;
+    }
+
+    int rc = poll(&pfd, 1, 0);
+
+    return rc == 0 || (rc < 0 && errno == EINTR);
+}
+
+/**
+ * Connect to a database, keeping an open connection without pinging it
+ *
+ * Unlike mon_connect_to_db(), an existing connection is only checked without
+ * a round trip to the server. The queries on the connection must be done with
+ * mon_query_reconnect(), which reconnects if the connection turns out to be lost.
+ *
+ * @param mon Monitor
+ * @param database Monitored database
+ * @return MONITOR_CONN_OK if the connection is open
+ */
+connect_result_t
+mon_reuse_connection(MONITOR* mon, MONITOR_SERVERS *database)
+{
+    if (database->con && mon_connection_is_alive(database))
+    {
+        return MONITOR_CONN_OK;
+    }
+
+    return mon_connect_to_db(mon, database);
+}
+
+/**
+ * Execute a query on a monitor connection and store its result
+ *
+ * If the server has gone away, the connection is opened again and the query
+ * is retried once.
+ *
+ * @param mon Monitor
+ * @param database Monitored database with a connection
+ * @param query The query
+ * @param rval Set to the result of the reconnection if one was made
+ * @return The result or NULL if the query failed
+ */
+MYSQL_RES*
+mon_query_reconnect(MONITOR* mon, MONITOR_SERVERS *database, const char *query,
+                    connect_result_t *rval)
+{
+    if (mysql_query(database->con, query) == 0)
+    {
+        return mysql_store_result(database->con);
+    }
+
+    int err = mysql_errno(database->con);
+
+    if ((err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST) &&
+        (*rval = mon_connect_to_db(mon, database)) == MONITOR_CONN_OK &&
+        mysql_query(database->con, query) == 0)
+    {
+        return mysql_store_result(database->con);
+    }
+
+    return NULL;
+}
+
 /**
  * Log an error about the failure to connect to a backend server
  * and why it happened.
@@ -1054,6 +1246,21 @@ void mon_log_state_change(MONITOR_SERVERS *ptr)
                mon_get_event_name(ptr), prev, next);
     free(prev);
     free(next);
+
+    /**
+     * The change happened after the previous probe saw the old state, so the
+     * time since the start of that probe is an upper bound of the time it
+     * took to detect the change.
+     */
+    spinlock_acquire(&ptr->stats.lock);
+    if (ptr->stats.prev_probe_start)
+    {
+        uint64_t detect = ts_clock_us() - ptr->stats.prev_probe_start;
+        ptr->stats.last_detect = detect;
+        ptr->stats.max_detect = MAX(ptr->stats.max_detect, detect);
+    }
+    ptr->stats.n_state_changes++;
+    spinlock_release(&ptr->stats.lock);
 }
 
 void mon_hangup_failed_servers(MONITOR *monitor)
@@ -1068,3 +1275,1096 @@ void mon_hangup_failed_servers(MONITOR *monitor)
         }
     }
 }
+
+MON_LOAD_METRICS* mon_load_metrics_parse(const char *list)
+{
+    MON_LOAD_METRICS *metrics = calloc(1, sizeof(MON_LOAD_METRICS));
+    char *copy = strdup(list);
+    /** Each name is at most LOAD_METRIC_NAME_LEN - 1 characters and quoted */
+    size_t querylen = 100 + MAX_LOAD_METRICS * (LOAD_METRIC_NAME_LEN + 3);
+    char *query = malloc(querylen);
+
+    if (metrics == NULL || copy == NULL || query == NULL)
+    {
+        MXS_ERROR("Memory allocation failed when parsing the load metrics.");
+        free(metrics);
+        free(copy);
+        free(query);
+        return NULL;
+    }
+
+    strcpy(query, "SHOW GLOBAL STATUS WHERE Variable_name IN (");
+    bool error = false;
+    char *saved;
+
+    for (char *tok = strtok_r(copy, ", \t", &saved); tok && !error;
+         tok = strtok_r(NULL, ", \t", &saved))
+    {
+        size_t len = strlen(tok);
+        bool rate = len > 2 && strcmp(tok + len - 2, "/s") == 0;
+
+        if (rate)
+        {
+            len -= 2;
+            tok[len] = '\0';
+        }
+
+        for (char *ptr = tok; *ptr && !error; ptr++)
+        {
+            error = !isalnum((unsigned char)*ptr) && *ptr != '_';
+        }
+
+        if (error || len == 0 || len >= LOAD_METRIC_NAME_LEN)
+        {
+            MXS_ERROR("Invalid load metric '%s'.", tok);
+            error = true;
+        }
+        else if (metrics->n_metrics == MAX_LOAD_METRICS)
+        {
+            MXS_ERROR("Too many load metrics, at most %d can be used.", MAX_LOAD_METRICS);
+            error = true;
+        }
+        else
+        {
+            strcpy(metrics->names[metrics->n_metrics], tok);
+            metrics->rate[metrics->n_metrics] = rate;
+            sprintf(query + strlen(query), "%s'%s'", metrics->n_metrics ? "," : "", tok);
+            metrics->n_metrics++;
+        }
+    }
+
+    free(copy);
+    strcat(query, ")");
+    metrics->query = query;
+
+    if (!error && metrics->n_metrics == 0)
+    {
+        MXS_ERROR("No load metrics were given.");
+        error = true;
+    }
+
+    if (error)
+    {
+        mon_load_metrics_free(metrics);
+        metrics = NULL;
+    }
+
+    return metrics;
+}
+
+void mon_load_metrics_free(MON_LOAD_METRICS *metrics)
+{
+    if (metrics)
+    {
+        free(metrics->query);
+        free(metrics);
+    }
+}
+
+void mon_sample_load(MON_LOAD_METRICS *metrics, MONITOR_SERVERS *database)
+{
+    SERVER *server = database->server;
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    if (mysql_query(database->con, metrics->query) != 0 ||
+        (result = mysql_store_result(database->con)) == NULL)
+    {
+        MXS_ERROR("Failed to read the load metrics of server '%s': %s",
+                  server->unique_name, mysql_error(database->con));
+        atomic_store_int64(&server->load, -1);
+        return;
+    }
+
+    /** The metrics are reset if the monitored variables have changed */
+    for (int i = 0; i < metrics->n_metrics; i++)
+    {
+        SERVER_LOAD_METRIC *metric = &server->load_metrics[i];
+
+        if (i >= server->n_load_metrics || strcmp(metric->name, metrics->names[i]) != 0 ||
+            metric->rate != metrics->rate[i])
+        {
+            strcpy(metric->name, metrics->names[i]);
+            metric->rate = metrics->rate[i];
+            metric->value = 0;
+            metric->raw = 0;
+            metric->sampled = 0;
+        }
+    }
+
+    server->n_load_metrics = metrics->n_metrics;
+
+    while ((row = mysql_fetch_row(result)))
+    {
+        for (int i = 0; i < metrics->n_metrics; i++)
+        {
+            SERVER_LOAD_METRIC *metric = &server->load_metrics[i];
+
+            if (row[0] && row[1] && strcasecmp(row[0], metric->name) == 0)
+            {
+                int64_t value = strtoll(row[1], NULL, 10);
+
+                if (!metric->rate)
+                {
+                    metric->value = value;
+                }
+                else
+                {
+                    /** A counter that went backwards was reset by a restart */
+                    if (metric->sampled && now > metric->sampled && value >= metric->raw)
+                    {
+                        metric->value = (value - metric->raw) * 1000 / (int64_t)(now - metric->sampled);
+                    }
+
+                    metric->raw = value;
+                    metric->sampled = now;
+                }
+                break;
+            }
+        }
+    }
+
+    mysql_free_result(result);
+
+    int64_t load = 0;
+
+    for (int i = 0; i < server->n_load_metrics; i++)
+    {
+        load += server->load_metrics[i].value;
+    }
+
+    atomic_store_int64(&server->load, load);
+}
+
+void mon_sample_variables(MONITOR_SERVERS *database)
+{
+    SERVER *server = database->server;
+    char query[1024] = "SHOW GLOBAL VARIABLES WHERE Variable_name IN (";
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+
+    for (int i = 0; i < SERVER_N_VARIABLES; i++)
+    {
+        snprintf(query + strlen(query), sizeof(query) - strlen(query), "%s'%s'",
+                 i ? ", " : "", server_variable_name(i));
+    }
+    strcat(query, ")");
+
+    if (mysql_query(database->con, query) != 0 ||
+        (result = mysql_store_result(database->con)) == NULL)
+    {
+        MXS_ERROR("Failed to read the global variables of server '%s': %s",
+                  server->unique_name, mysql_error(database->con));
+        return;
+    }
+
+    bool found[SERVER_N_VARIABLES] = {false};
+
+    while ((row = mysql_fetch_row(result)))
+    {
+        int index = row[0] ? server_variable_index(row[0], strlen(row[0])) : -1;
+
+        if (index >= 0)
+        {
+            server_set_variable(server, index, row[1]);
+            found[index] = true;
+        }
+    }
+
+    mysql_free_result(result);
+
+    /** Variables that the server does not have are not answered for it */
+    for (int i = 0; i < SERVER_N_VARIABLES; i++)
+    {
+        if (!found[i])
+        {
+            server_set_variable(server, i, NULL);
+        }
+    }
+}
+
+void mon_publish_server_states(MONITOR *monitor)
+{
+    for (MONITOR_SERVERS *ptr = monitor->databases; ptr; ptr = ptr->next)
+    {
+        server_publish_state(ptr->server);
+
+        if (!SERVER_IS_DRAINING(ptr->server))
+        {
+            ptr->drained = false;
+        }
+        else if (!ptr->drained && ptr->server->stats.n_current == 0)
+        {
+            MXS_NOTICE("Server '%s' has been drained, it has no client connections left.",
+                       ptr->server->unique_name);
+            ptr->drained = true;
+        }
+    }
+}
+
+/**
+ * The threads that probe the servers of a monitor. A probing round hands out
+ * the servers one at a time to the threads until all have been probed.
+ */
+typedef struct monitor_probe_pool
+{
+    MONITOR *monitor;
+    pthread_mutex_t lock;
+    pthread_cond_t work;            /**< Signaled when a round starts */
+    pthread_cond_t done;            /**< Signaled when a round ends */
+    void (*probe)(MONITOR*, MONITOR_SERVERS*);
+    MONITOR_SERVERS *next;          /**< Next server to probe in this round */
+    int pending;                    /**< Servers not yet probed in this round */
+    bool shutdown;
+    int n_threads;
+    THREAD threads[MON_MAX_PROBE_THREADS];
+} MONITOR_PROBE_POOL;
+
+/**
+ * Probe servers of the current round until none are left
+ *
+ * The caller must hold the pool lock, it is released while probing.
+ *
+ * @param pool The probe pool
+ */
+static void mon_probe_next(MONITOR_PROBE_POOL *pool)
+{
+    MONITOR_SERVERS *database;
+
+    while ((database = pool->next))
+    {
+        pool->next = database->next;
+        pthread_mutex_unlock(&pool->lock);
+
+        uint64_t start = ts_clock_us();
+        pool->probe(pool->monitor, database);
+        mon_record_probe(database, start);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+        {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+}
+
+/**
+ * The main function of a probe thread
+ *
+ * @param data The probe pool
+ */
+static void mon_probe_thread(void *data)
+{
+    MONITOR_PROBE_POOL *pool = (MONITOR_PROBE_POOL*)data;
+
+    if (mysql_thread_init())
+    {
+        MXS_ERROR("mysql_thread_init failed in monitor probe thread.");
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (!pool->shutdown)
+    {
+        if (pool->next)
+        {
+            mon_probe_next(pool);
+        }
+        else
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    mysql_thread_end();
+}
+
+/**
+ * Create the probe threads of a monitor
+ *
+ * @param monitor Monitor object
+ * @param n_threads Number of threads to create
+ * @return The pool or NULL if no threads could be started
+ */
+static MONITOR_PROBE_POOL* mon_probe_pool_create(MONITOR *monitor, int n_threads)
+{
+    MONITOR_PROBE_POOL *pool = calloc(1, sizeof(MONITOR_PROBE_POOL));
+
+    if (pool)
+    {
+        pool->monitor = monitor;
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work, NULL);
+        pthread_cond_init(&pool->done, NULL);
+
+        while (pool->n_threads < n_threads &&
+               thread_start(&pool->threads[pool->n_threads], mon_probe_thread, pool))
+        {
+            pool->n_threads++;
+        }
+
+        if (pool->n_threads == 0)
+        {
+            MXS_ERROR("Failed to start the probe threads of monitor '%s', "
+                      "the servers are probed one at a time.", monitor->name);
+            pthread_cond_destroy(&pool->done);
+            pthread_cond_destroy(&pool->work);
+            pthread_mutex_destroy(&pool->lock);
+            free(pool);
+            pool = NULL;
+        }
+    }
+
+    return pool;
+}
+
+void mon_probe_pool_free(MONITOR *monitor)
+{
+    MONITOR_PROBE_POOL *pool = monitor->probe_pool;
+
+    if (pool)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = true;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (int i = 0; i < pool->n_threads; i++)
+        {
+            thread_wait(pool->threads[i]);
+        }
+
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        monitor->probe_pool = NULL;
+    }
+}
+
+void mon_probe_servers(MONITOR *monitor, void (*probe)(MONITOR*, MONITOR_SERVERS*))
+{
+    int n_servers = 0;
+
+    for (MONITOR_SERVERS *ptr = monitor->databases; ptr; ptr = ptr->next)
+    {
+        n_servers++;
+    }
+
+    /** The calling thread probes one server so one thread less is needed */
+    int n_threads = n_servers - 1 < MON_MAX_PROBE_THREADS ? n_servers - 1 : MON_MAX_PROBE_THREADS;
+
+    if (monitor->probe_pool && monitor->probe_pool->n_threads < n_threads)
+    {
+        /** Servers were added, create a larger pool */
+        mon_probe_pool_free(monitor);
+    }
+
+    if (monitor->probe_pool == NULL && n_threads > 0)
+    {
+        monitor->probe_pool = mon_probe_pool_create(monitor, n_threads);
+    }
+
+    MONITOR_PROBE_POOL *pool = monitor->probe_pool;
+
+    if (pool == NULL)
+    {
+        for (MONITOR_SERVERS *ptr = monitor->databases; ptr; ptr = ptr->next)
+        {
+            uint64_t start = ts_clock_us();
+            probe(monitor, ptr);
+            mon_record_probe(ptr, start);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->probe = probe;
+    pool->next = monitor->databases;
+    pool->pending = n_servers;
+    pthread_cond_broadcast(&pool->work);
+
+    mon_probe_next(pool);
+
+    while (pool->pending > 0)
+    {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/** How often the executor checks the running scripts, in milliseconds */
+#define MON_SCRIPT_POLL_MS 100
+
+/**
+ * A monitor script launched on a server state change event
+ */
+typedef struct monitor_script
+{
+    EXTERNCMD *cmd;                 /**< The command with the arguments substituted */
+    char *script;                   /**< The script as configured, for the log messages */
+    const char *event;              /**< Name of the event */
+    char *server;                   /**< Name of the server that initiated the event */
+    uint64_t started;               /**< When the script was started, in milliseconds */
+    bool killed;                    /**< The script was killed after the timeout */
+    struct monitor_script *next;
+} MONITOR_SCRIPT;
+
+/**
+ * The thread that runs the monitor scripts. The scripts are started in
+ * the order of the events, no more than script_max_concurrency at a time,
+ * and the ones that run longer than script_timeout seconds are killed.
+ */
+typedef struct monitor_script_executor
+{
+    MONITOR *monitor;
+    pthread_mutex_t lock;
+    pthread_cond_t work;            /**< Signaled when a script is queued */
+    MONITOR_SCRIPT *queue;          /**< Scripts waiting to be started */
+    MONITOR_SCRIPT **tail;
+    MONITOR_SCRIPT *running;        /**< Running scripts, only used by the executor thread */
+    int n_queued;
+    int n_running;
+    int n_completed;                /**< Scripts that exited with status 0 */
+    int n_failed;                   /**< Scripts that failed to start or exited with an error */
+    int n_timed_out;                /**< Scripts killed after the timeout */
+    bool shutdown;
+    THREAD thread;
+} MONITOR_SCRIPT_EXECUTOR;
+
+static void mon_script_free(MONITOR_SCRIPT *job)
+{
+    externcmd_free(job->cmd);
+    free(job->script);
+    free(job->server);
+    free(job);
+}
+
+/**
+ * Start a queued script
+ *
+ * @param executor The script executor
+ * @param job The script to start
+ * @return True if the script was started
+ */
+static bool mon_script_start(MONITOR_SCRIPT_EXECUTOR *executor, MONITOR_SCRIPT *job)
+{
+    if (externcmd_execute(job->cmd))
+    {
+        MXS_ERROR("Failed to execute script '%s' on server state change event '%s'.",
+                  job->script, job->event);
+        return false;
+    }
+
+    job->started = ts_clock_us() / 1000;
+    job->next = executor->running;
+    executor->running = job;
+    MXS_INFO("Started monitor script '%s' on event '%s' of server '%s', process %d.",
+             job->script, job->event, job->server, job->cmd->child);
+    return true;
+}
+
+/**
+ * Report the completion of a script
+ *
+ * @param executor The script executor
+ * @param job The script that exited
+ * @param status Exit status from waitpid()
+ */
+static void mon_script_report(MONITOR_SCRIPT_EXECUTOR *executor, MONITOR_SCRIPT *job, int status)
+{
+    double elapsed = (ts_clock_us() / 1000 - job->started) / 1000.0;
+    int *counter = &executor->n_failed;
+
+    if (job->killed)
+    {
+        MXS_ERROR("Monitor script '%s' on event '%s' of server '%s' was killed after "
+                  "it had run for %.1f seconds.", job->script, job->event, job->server, elapsed);
+        counter = &executor->n_timed_out;
+    }
+    else if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        MXS_NOTICE("Executed monitor script '%s' on event '%s' of server '%s' in %.1f seconds.",
+                   job->script, job->event, job->server, elapsed);
+        counter = &executor->n_completed;
+    }
+    else if (WIFEXITED(status))
+    {
+        MXS_ERROR("Monitor script '%s' on event '%s' of server '%s' exited with status %d "
+                  "after %.1f seconds.", job->script, job->event, job->server,
+                  WEXITSTATUS(status), elapsed);
+    }
+    else
+    {
+        MXS_ERROR("Monitor script '%s' on event '%s' of server '%s' was stopped by signal %d "
+                  "after %.1f seconds.", job->script, job->event, job->server,
+                  WIFSIGNALED(status) ? WTERMSIG(status) : 0, elapsed);
+    }
+
+    pthread_mutex_lock(&executor->lock);
+    (*counter)++;
+    executor->n_running--;
+    pthread_mutex_unlock(&executor->lock);
+}
+
+/**
+ * Reap the scripts that have exited and kill the ones that have timed out
+ *
+ * The scripts run in their own process groups so the whole group is killed,
+ * including the processes that the script started.
+ *
+ * @param executor The script executor
+ */
+static void mon_script_check_running(MONITOR_SCRIPT_EXECUTOR *executor)
+{
+    uint64_t timeout = (uint64_t)executor->monitor->script_timeout * 1000;
+    uint64_t now = ts_clock_us() / 1000;
+    MONITOR_SCRIPT **prev = &executor->running;
+
+    while (*prev)
+    {
+        MONITOR_SCRIPT *job = *prev;
+        int status = 0;
+        pid_t rc = waitpid(job->cmd->child, &status, WNOHANG);
+
+        if (rc == job->cmd->child || (rc == -1 && errno != EINTR))
+        {
+            *prev = job->next;
+            mon_script_report(executor, job, status);
+            mon_script_free(job);
+            continue;
+        }
+
+        if (!job->killed && now - job->started >= timeout)
+        {
+            MXS_WARNING("Monitor script '%s' on event '%s' of server '%s' has not exited "
+                        "in %d seconds, killing process %d.", job->script, job->event,
+                        job->server, executor->monitor->script_timeout, job->cmd->child);
+            kill(-job->cmd->child, SIGKILL);
+            job->killed = true;
+        }
+
+        prev = &job->next;
+    }
+}
+
+/**
+ * The main function of the script executor thread
+ *
+ * @param data The script executor
+ */
+static void mon_script_thread(void *data)
+{
+    MONITOR_SCRIPT_EXECUTOR *executor = (MONITOR_SCRIPT_EXECUTOR*)data;
+
+    pthread_mutex_lock(&executor->lock);
+
+    while (!executor->shutdown || executor->n_running > 0)
+    {
+        if (executor->shutdown)
+        {
+            while (executor->queue)
+            {
+                MONITOR_SCRIPT *job = executor->queue;
+                executor->queue = job->next;
+                executor->n_queued--;
+                MXS_WARNING("Monitor '%s' is stopping, discarding script '%s' on event '%s' "
+                            "of server '%s'.", executor->monitor->name, job->script,
+                            job->event, job->server);
+                mon_script_free(job);
+            }
+            executor->tail = &executor->queue;
+        }
+
+        while (executor->queue &&
+               executor->n_running < executor->monitor->script_max_concurrency)
+        {
+            MONITOR_SCRIPT *job = executor->queue;
+
+            if ((executor->queue = job->next) == NULL)
+            {
+                executor->tail = &executor->queue;
+            }
+
+            executor->n_queued--;
+            executor->n_running++;
+            pthread_mutex_unlock(&executor->lock);
+
+            bool started = mon_script_start(executor, job);
+
+            pthread_mutex_lock(&executor->lock);
+
+            if (!started)
+            {
+                executor->n_running--;
+                executor->n_failed++;
+                mon_script_free(job);
+            }
+        }
+
+        if (executor->n_running > 0)
+        {
+            pthread_mutex_unlock(&executor->lock);
+            mon_script_check_running(executor);
+            thread_millisleep(MON_SCRIPT_POLL_MS);
+            pthread_mutex_lock(&executor->lock);
+        }
+        else if (!executor->shutdown && executor->queue == NULL)
+        {
+            pthread_cond_wait(&executor->work, &executor->lock);
+        }
+    }
+
+    pthread_mutex_unlock(&executor->lock);
+}
+
+/**
+ * Queue a script for the script executor of a monitor
+ *
+ * The executor is started when the first script is launched.
+ *
+ * @param monitor Monitor object
+ * @param cmd The command to run, freed by the executor
+ * @param script The script as configured
+ * @param event Name of the event
+ * @param server Name of the server
+ * @return True if the script was queued, false if the executor could not be started
+ */
+static bool mon_script_submit(MONITOR *monitor, EXTERNCMD *cmd, const char *script,
+                              const char *event, const char *server)
+{
+    MONITOR_SCRIPT_EXECUTOR *executor = monitor->script_executor;
+
+    if (executor == NULL)
+    {
+        if ((executor = calloc(1, sizeof(MONITOR_SCRIPT_EXECUTOR))) == NULL)
+        {
+            return false;
+        }
+
+        executor->monitor = monitor;
+        executor->tail = &executor->queue;
+        pthread_mutex_init(&executor->lock, NULL);
+        pthread_cond_init(&executor->work, NULL);
+
+        if (thread_start(&executor->thread, mon_script_thread, executor) == NULL)
+        {
+            MXS_ERROR("Failed to start the script executor of monitor '%s', "
+                      "the scripts are run without a timeout.", monitor->name);
+            pthread_cond_destroy(&executor->work);
+            pthread_mutex_destroy(&executor->lock);
+            free(executor);
+            return false;
+        }
+
+        monitor->script_executor = executor;
+    }
+
+    MONITOR_SCRIPT *job = calloc(1, sizeof(MONITOR_SCRIPT));
+
+    if (job == NULL || (job->script = strdup(script)) == NULL ||
+        (job->server = strdup(server)) == NULL)
+    {
+        if (job)
+        {
+            free(job->script);
+            free(job);
+        }
+        return false;
+    }
+
+    job->cmd = cmd;
+    job->event = event;
+
+    pthread_mutex_lock(&executor->lock);
+    *executor->tail = job;
+    executor->tail = &job->next;
+    executor->n_queued++;
+    pthread_cond_signal(&executor->work);
+    pthread_mutex_unlock(&executor->lock);
+
+    return true;
+}
+
+void mon_script_executor_free(MONITOR *monitor)
+{
+    MONITOR_SCRIPT_EXECUTOR *executor = monitor->script_executor;
+
+    if (executor)
+    {
+        pthread_mutex_lock(&executor->lock);
+        executor->shutdown = true;
+        pthread_cond_signal(&executor->work);
+        pthread_mutex_unlock(&executor->lock);
+
+        thread_wait(executor->thread);
+
+        pthread_cond_destroy(&executor->work);
+        pthread_mutex_destroy(&executor->lock);
+        free(executor);
+        monitor->script_executor = NULL;
+    }
+}
+
+/**
+ * Print the script statistics of a monitor
+ *
+ * @param dcb DCB for printing output
+ * @param monitor Monitor object
+ */
+static void mon_script_executor_diagnostics(DCB *dcb, MONITOR *monitor)
+{
+    MONITOR_SCRIPT_EXECUTOR *executor = monitor->script_executor;
+
+    if (executor)
+    {
+        pthread_mutex_lock(&executor->lock);
+        dcb_printf(dcb, "\tScripts queued:         %d\n", executor->n_queued);
+        dcb_printf(dcb, "\tScripts running:        %d\n", executor->n_running);
+        dcb_printf(dcb, "\tScripts completed:      %d\n", executor->n_completed);
+        dcb_printf(dcb, "\tScripts failed:         %d\n", executor->n_failed);
+        dcb_printf(dcb, "\tScripts timed out:      %d\n", executor->n_timed_out);
+        pthread_mutex_unlock(&executor->lock);
+    }
+}
+
+/**
+ * The average of the latencies of a histogram
+ *
+ * @param latency The histogram
+ * @return The average in milliseconds
+ */
+static double mon_latency_avg_ms(const TS_LATENCY_SNAPSHOT *latency)
+{
+    return latency->count ? latency->total / (latency->count * 1000.0) : 0;
+}
+
+void mon_tick_start(MONITOR *monitor)
+{
+    monitor->tick_start = ts_clock_us();
+}
+
+void mon_tick_end(MONITOR *monitor)
+{
+    if (monitor->tick_start)
+    {
+        uint64_t duration = ts_clock_us() - monitor->tick_start;
+        spinlock_acquire(&monitor->stats_lock);
+        ts_latency_record(&monitor->tick_latency, duration);
+        spinlock_release(&monitor->stats_lock);
+        monitor->tick_start = 0;
+    }
+}
+
+void mon_record_probe(MONITOR_SERVERS *database, uint64_t start)
+{
+    uint64_t duration = ts_clock_us() - start;
+
+    spinlock_acquire(&database->stats.lock);
+    ts_latency_record(&database->stats.probe, duration);
+    database->stats.prev_probe_start = database->stats.probe_start;
+    database->stats.probe_start = start;
+    spinlock_release(&database->stats.lock);
+}
+
+/**
+ * Print the latencies of a histogram
+ *
+ * @param dcb DCB for printing output
+ * @param title Title of the line
+ * @param latency The histogram
+ */
+static void mon_print_latency(DCB *dcb, const char *title, const TS_LATENCY_SNAPSHOT *latency)
+{
+    dcb_printf(dcb, "%s%lu, avg %.1f, p50 %.1f, p95 %.1f, p99 %.1f, max %.1f\n",
+               title, latency->count, mon_latency_avg_ms(latency),
+               ts_latency_percentile(latency, 0.50) / 1000.0,
+               ts_latency_percentile(latency, 0.95) / 1000.0,
+               ts_latency_percentile(latency, 0.99) / 1000.0,
+               latency->max / 1000.0);
+}
+
+/**
+ * Print the cycle and probe statistics of a monitor
+ *
+ * The durations are in milliseconds.
+ *
+ * @param dcb DCB for printing output
+ * @param monitor Monitor object
+ */
+static void mon_show_statistics(DCB *dcb, MONITOR *monitor)
+{
+    TS_LATENCY_SNAPSHOT tick;
+
+    spinlock_acquire(&monitor->stats_lock);
+    tick = monitor->tick_latency;
+    spinlock_release(&monitor->stats_lock);
+
+    mon_print_latency(dcb, "\tMonitor cycles (ms):    ", &tick);
+
+    for (MONITOR_SERVERS *db = monitor->databases; db; db = db->next)
+    {
+        MON_SERVER_STATS stats;
+
+        spinlock_acquire(&db->stats.lock);
+        stats = db->stats;
+        spinlock_release(&db->stats.lock);
+
+        dcb_printf(dcb, "\tServer %s\n", db->server->unique_name);
+        mon_print_latency(dcb, "\t\tProbes (ms):            ", &stats.probe);
+        dcb_printf(dcb, "\t\tConnect failures:       %lu\n", stats.n_connect_failures);
+        dcb_printf(dcb, "\t\tState changes:          %lu\n", stats.n_state_changes);
+        dcb_printf(dcb, "\t\tTime to detect (ms):    last %.1f, max %.1f\n",
+                   stats.last_detect / 1000.0, stats.max_detect / 1000.0);
+    }
+}
+
+/**
+ * Render the cycle and probe statistics of the monitors in the Prometheus
+ * text format
+ *
+ * @param metrics The metrics
+ */
+void monitor_metrics(METRICS *metrics)
+{
+    char monitor_name[METRICS_LABEL_LEN];
+    char server_name[METRICS_LABEL_LEN];
+    char labels[2 * METRICS_LABEL_LEN + 32];
+    TS_LATENCY_SNAPSHOT snapshot;
+    MONITOR *monitor;
+
+    spinlock_acquire(&monLock);
+
+    metrics_family(metrics, "maxscale_monitor_cycle_seconds", METRICS_HISTOGRAM,
+                   "Duration of the monitoring cycles");
+    for (monitor = allMonitors; monitor; monitor = monitor->next)
+    {
+        spinlock_acquire(&monitor->stats_lock);
+        snapshot = monitor->tick_latency;
+        spinlock_release(&monitor->stats_lock);
+
+        snprintf(labels, sizeof(labels), "monitor=\"%s\"",
+                 metrics_escape(monitor->name, monitor_name, sizeof(monitor_name)));
+        metrics_latency(metrics, "maxscale_monitor_cycle_seconds", labels, &snapshot);
+    }
+
+    metrics_family(metrics, "maxscale_monitor_probe_seconds", METRICS_HISTOGRAM,
+                   "Duration of the probes of the servers");
+    for (monitor = allMonitors; monitor; monitor = monitor->next)
+    {
+        metrics_escape(monitor->name, monitor_name, sizeof(monitor_name));
+
+        for (MONITOR_SERVERS *db = monitor->databases; db; db = db->next)
+        {
+            spinlock_acquire(&db->stats.lock);
+            snapshot = db->stats.probe;
+            spinlock_release(&db->stats.lock);
+
+            snprintf(labels, sizeof(labels), "monitor=\"%s\",server=\"%s\"", monitor_name,
+                     metrics_escape(db->server->unique_name, server_name, sizeof(server_name)));
+            metrics_latency(metrics, "maxscale_monitor_probe_seconds", labels, &snapshot);
+        }
+    }
+
+    metrics_family(metrics, "maxscale_monitor_connect_failures_total", METRICS_COUNTER,
+                   "Failed connection attempts to the servers");
+    for (monitor = allMonitors; monitor; monitor = monitor->next)
+    {
+        metrics_escape(monitor->name, monitor_name, sizeof(monitor_name));
+
+        for (MONITOR_SERVERS *db = monitor->databases; db; db = db->next)
+        {
+            snprintf(labels, sizeof(labels), "monitor=\"%s\",server=\"%s\"", monitor_name,
+                     metrics_escape(db->server->unique_name, server_name, sizeof(server_name)));
+            metrics_value(metrics, "maxscale_monitor_connect_failures_total", labels,
+                          db->stats.n_connect_failures);
+        }
+    }
+
+    metrics_family(metrics, "maxscale_monitor_state_changes_total", METRICS_COUNTER,
+                   "Detected state changes of the servers");
+    for (monitor = allMonitors; monitor; monitor = monitor->next)
+    {
+        metrics_escape(monitor->name, monitor_name, sizeof(monitor_name));
+
+        for (MONITOR_SERVERS *db = monitor->databases; db; db = db->next)
+        {
+            snprintf(labels, sizeof(labels), "monitor=\"%s\",server=\"%s\"", monitor_name,
+                     metrics_escape(db->server->unique_name, server_name, sizeof(server_name)));
+            metrics_value(metrics, "maxscale_monitor_state_changes_total", labels,
+                          db->stats.n_state_changes);
+        }
+    }
+
+    spinlock_release(&monLock);
+}
+
+/**
+ * A row of the monitor statistics
+ */
+typedef struct mon_stats_row
+{
+    char *name;
+    char *type;
+    TS_LATENCY_SNAPSHOT latency;
+    MON_SERVER_STATS *server;       /**< NULL for the row of the monitor */
+} MON_STATS_ROW;
+
+typedef struct mon_stats_result
+{
+    int n_rows;
+    int index;
+    MON_STATS_ROW *rows;
+} MON_STATS_RESULT;
+
+static void mon_stats_result_free(MON_STATS_RESULT *result)
+{
+    for (int i = 0; i < result->n_rows; i++)
+    {
+        free(result->rows[i].name);
+        free(result->rows[i].server);
+    }
+
+    free(result->rows);
+    free(result);
+}
+
+/**
+ * Provide a row of the monitor statistics
+ *
+ * @param set The result set
+ * @param data The result set state
+ * @return The next row or NULL if there are no more rows
+ */
+static RESULT_ROW *
+monitorStatisticsRowCallback(RESULTSET *set, void *data)
+{
+    MON_STATS_RESULT *result = (MON_STATS_RESULT*)data;
+
+    if (result->index >= result->n_rows)
+    {
+        mon_stats_result_free(result);
+        return NULL;
+    }
+
+    MON_STATS_ROW *row = &result->rows[result->index++];
+    RESULT_ROW *res_row = resultset_make_row(set);
+    char buf[80];
+
+    if (res_row)
+    {
+        resultset_row_set(res_row, 0, row->name);
+        resultset_row_set(res_row, 1, row->type);
+        snprintf(buf, sizeof(buf), "%lu", row->latency.count);
+        resultset_row_set(res_row, 2, buf);
+        snprintf(buf, sizeof(buf), "%.3f", mon_latency_avg_ms(&row->latency));
+        resultset_row_set(res_row, 3, buf);
+        snprintf(buf, sizeof(buf), "%.3f", ts_latency_percentile(&row->latency, 0.50) / 1000.0);
+        resultset_row_set(res_row, 4, buf);
+        snprintf(buf, sizeof(buf), "%.3f", ts_latency_percentile(&row->latency, 0.95) / 1000.0);
+        resultset_row_set(res_row, 5, buf);
+        snprintf(buf, sizeof(buf), "%.3f", ts_latency_percentile(&row->latency, 0.99) / 1000.0);
+        resultset_row_set(res_row, 6, buf);
+        snprintf(buf, sizeof(buf), "%.3f", row->latency.max / 1000.0);
+        resultset_row_set(res_row, 7, buf);
+
+        if (row->server)
+        {
+            snprintf(buf, sizeof(buf), "%lu", row->server->n_connect_failures);
+            resultset_row_set(res_row, 8, buf);
+            snprintf(buf, sizeof(buf), "%lu", row->server->n_state_changes);
+            resultset_row_set(res_row, 9, buf);
+            snprintf(buf, sizeof(buf), "%.3f", row->server->max_detect / 1000.0);
+            resultset_row_set(res_row, 10, buf);
+        }
+    }
+
+    return res_row;
+}
+
+/**
+ * Return the cycle and probe statistics of a monitor as a result set
+ *
+ * The first row has the durations of the monitoring cycles and the other rows
+ * the durations of the probes of each server. The times are in milliseconds.
+ *
+ * @param monitor Monitor object
+ * @return The result set or NULL on memory allocation failure
+ */
+RESULTSET *
+monitorGetStatistics(MONITOR *monitor)
+{
+    MON_STATS_RESULT *result = calloc(1, sizeof(MON_STATS_RESULT));
+    RESULTSET *set;
+    int n_servers = 0;
+
+    for (MONITOR_SERVERS *db = monitor->databases; db; db = db->next)
+    {
+        n_servers++;
+    }
+
+    if (result == NULL || (result->rows = calloc(n_servers + 1, sizeof(MON_STATS_ROW))) == NULL)
+    {
+        free(result);
+        return NULL;
+    }
+
+    MON_STATS_ROW *row = &result->rows[0];
+
+    if ((row->name = strdup(monitor->name)))
+    {
+        row->type = "monitor";
+        spinlock_acquire(&monitor->stats_lock);
+        row->latency = monitor->tick_latency;
+        spinlock_release(&monitor->stats_lock);
+        result->n_rows++;
+    }
+
+    for (MONITOR_SERVERS *db = monitor->databases; db && result->n_rows <= n_servers; db = db->next)
+    {
+        row = &result->rows[result->n_rows];
+
+        if ((row->name = strdup(db->server->unique_name)) &&
+            (row->server = malloc(sizeof(MON_SERVER_STATS))))
+        {
+            row->type = "server";
+            spinlock_acquire(&db->stats.lock);
+            *row->server = db->stats;
+            spinlock_release(&db->stats.lock);
+            row->latency = row->server->probe;
+            result->n_rows++;
+        }
+        else
+        {
+            free(row->name);
+            row->name = NULL;
+        }
+    }
+
+    if ((set = resultset_create(monitorStatisticsRowCallback, result)) == NULL)
+    {
+        mon_stats_result_free(result);
+        return NULL;
+    }
+
+    resultset_add_column(set, "Name", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Type", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Count", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Average", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "P50", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "P95", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "P99", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Max", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Connect_failures", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "State_changes", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Max_detect", 20, COL_TYPE_VARCHAR);
+
+    return set;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file mpmc_ring.c  - Bounded lock-free multi-producer, multi-consumer ring
+ *
+ * Each cell has a sequence number that tells whose turn it is to use the
+ * cell. A cell at offset i of the ring is free for the push at position p
+ * when its sequence is p and holds the element of the pop at position p
+ * when its sequence is p + 1. A thread claims a position by advancing the
+ * push or the pop position with a compare-and-swap and then copies the
+ * element without holding anything, so the threads only contend on the
+ * positions. The positions only grow, the offset of a position is the
+ * position modulo the capacity.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <mpmc_ring.h>
+#include <atomic.h>
+#include <log_manager.h>
+
+/** The sequence number at the start of a cell */
+#define CELL_SEQ(ring, pos) ((volatile int64_t*)((ring)->cells + ((pos) % (ring)->capacity) * (ring)->cell_size))
+
+/** The element after the sequence number */
+#define CELL_DATA(seq) ((char*)(seq) + sizeof(int64_t))
+
+/**
+ * Initialize a ring
+ *
+ * @param ring      The ring
+ * @param capacity  Number of elements the ring holds
+ * @param elem_size Size of an element
+ * @return True if the ring was initialized, false if memory allocation failed
+ */
+bool mpmc_ring_init(MPMC_RING *ring, size_t capacity, size_t elem_size)
+{
+    ss_dassert(capacity > 0 && elem_size > 0);
+
+    /** The cells are aligned on the sequence number */
+    size_t cell_size = sizeof(int64_t) + elem_size;
+    cell_size = (cell_size + sizeof(int64_t) - 1) & ~(sizeof(int64_t) - 1);
+
+    memset(ring, 0, sizeof(*ring));
+
+    if ((ring->cells = malloc(capacity * cell_size)) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for a ring of %lu elements.", capacity);
+        return false;
+    }
+
+    ring->capacity = capacity;
+    ring->elem_size = elem_size;
+    ring->cell_size = cell_size;
+
+    for (size_t i = 0; i < capacity; i++)
+    {
+        *CELL_SEQ(ring, i) = i;
+    }
+
+    return true;
+}
+
+/**
+ * Free the memory of a ring. The elements left in it are discarded.
+ *
+ * @param ring The ring
+ */
+void mpmc_ring_done(MPMC_RING *ring)
+{
+    free(ring->cells);
+    ring->cells = NULL;
+    ring->capacity = 0;
+}
+
+/**
+ * Copy an element to the end of a ring
+ *
+ * @param ring The ring
+ * @param elem The element, elem_size bytes are copied
+ * @return True if the element was added, false if the ring is full
+ */
+bool mpmc_ring_push(MPMC_RING *ring, const void *elem)
+{
+    int64_t pos = *(volatile int64_t*)&ring->push_pos;
+    volatile int64_t *seq;
+
+    while (true)
+    {
+        seq = CELL_SEQ(ring, pos);
+        int64_t diff = *seq - pos;
+        __sync_synchronize();
+
+        if (diff == 0)
+        {
+            if (atomic_cas_int64(&ring->push_pos, pos, pos + 1))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            /** The element of the previous round has not been popped */
+            return false;
+        }
+
+        pos = *(volatile int64_t*)&ring->push_pos;
+    }
+
+    memcpy(CELL_DATA(seq), elem, ring->elem_size);
+    __sync_synchronize();
+    *seq = pos + 1;
+    return true;
+}
+
+/**
+ * Copy the first element of a ring out of it
+ *
+ * @param ring The ring
+ * @param dest Where the element is copied, elem_size bytes
+ * @return True if an element was removed, false if the ring is empty
+ */
+bool mpmc_ring_pop(MPMC_RING *ring, void *dest)
+{
+    int64_t pos = *(volatile int64_t*)&ring->pop_pos;
+    volatile int64_t *seq;
+
+    while (true)
+    {
+        seq = CELL_SEQ(ring, pos);
+        int64_t diff = *seq - (pos + 1);
+        __sync_synchronize();
+
+        if (diff == 0)
+        {
+            if (atomic_cas_int64(&ring->pop_pos, pos, pos + 1))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            /** The element has not been pushed yet */
+            return false;
+        }
+
+        pos = *(volatile int64_t*)&ring->pop_pos;
+    }
+
+    memcpy(dest, CELL_DATA(seq), ring->elem_size);
+    __sync_synchronize();
+    *seq = pos + ring->capacity;
+    return true;
+}
+
+/**
+ * Get the number of elements in a ring. The number may already be out of
+ * date when it is returned if other threads use the ring.
+ *
+ * @param ring The ring
+ * @return Number of elements in the ring
+ */
+size_t mpmc_ring_count(MPMC_RING *ring)
+{
+    int64_t pop_pos = *(volatile int64_t*)&ring->pop_pos;
+    int64_t push_pos = *(volatile int64_t*)&ring->push_pos;
+    int64_t count = push_pos - pop_pos;
+
+    return count < 0 ? 0 : count > (int64_t)ring->capacity ? ring->capacity : count;
+}
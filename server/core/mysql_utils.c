@@ -25,6 +25,23 @@
 #include <stdbool.h>
 #include <log_manager.h>
 #include <skygw_debug.h>
+#include <secrets.h>
+#include <service.h>
+#include <thread.h>
+
+/** Seconds the connection that kills a query may wait for the server */
+#define MXS_KILL_TIMEOUT 5
+
+/**
+ * A query to kill
+ */
+typedef struct mxs_kill
+{
+    SERVER        *server;    /*< The server running the query */
+    char          *user;      /*< The user of the service */
+    char          *passwd;    /*< The encrypted password of the user */
+    unsigned long tid;        /*< The thread id of the connection running the query */
+} MXS_KILL;
 
 /**
  * @brief Calculate the length of a length-encoded integer in bytes
@@ -166,3 +183,95 @@ MYSQL *mxs_mysql_real_connect(MYSQL *con, SERVER *server, const char *user, cons
 
     return mysql_real_connect(con, server->name, user, passwd, NULL, server->port, NULL, 0);
 }
+
+/**
+ * Kill a query with KILL QUERY from a connection of its own. This blocks and
+ * is run in a thread of its own.
+ *
+ * @param data The query to kill
+ */
+static void mxs_mysql_kill_thread(void *data)
+{
+    MXS_KILL *kill = (MXS_KILL *)data;
+    char *dpwd = decryptPassword(kill->passwd);
+    unsigned int timeout = MXS_KILL_TIMEOUT;
+    MYSQL *mysql = mysql_init(NULL);
+    char query[64];
+
+    snprintf(query, sizeof(query), "KILL QUERY %lu", kill->tid);
+
+    if (mysql && dpwd)
+    {
+        mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+        mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &timeout);
+        mysql_options(mysql, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+
+        if (mxs_mysql_real_connect(mysql, kill->server, kill->user, dpwd) == NULL ||
+            mysql_query(mysql, query) != 0)
+        {
+            MXS_ERROR("Failed to kill query of connection %lu on server '%s': %s",
+                      kill->tid, kill->server->unique_name, mysql_error(mysql));
+        }
+    }
+
+    if (mysql)
+    {
+        mysql_close(mysql);
+    }
+    free(dpwd);
+    free(kill->user);
+    free(kill->passwd);
+    free(kill);
+}
+
+/**
+ * Kill the query that a connection is running in a server. The query is
+ * killed with the credentials of a service by a thread of its own, as
+ * connecting to the server blocks.
+ *
+ * @param service The service whose user kills the query
+ * @param server  The server running the query
+ * @param tid     The thread id of the connection in the server
+ * @return True if the thread that kills the query was started
+ */
+bool mxs_mysql_kill_query(SERVICE *service, SERVER *server, unsigned long tid)
+{
+    MXS_KILL *kill;
+    char *user, *passwd;
+    THREAD thread;
+
+    if (serviceGetUser(service, &user, &passwd) == 0)
+    {
+        return false;
+    }
+
+    if ((kill = (MXS_KILL *)calloc(1, sizeof(MXS_KILL))) == NULL ||
+        (kill->user = strdup(user)) == NULL ||
+        (kill->passwd = strdup(passwd)) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for killing a query on server '%s'.",
+                  server->unique_name);
+        if (kill)
+        {
+            free(kill->user);
+        }
+        free(kill);
+        return false;
+    }
+
+    kill->server = server;
+    kill->tid = tid;
+
+    if (thread_start(&thread, mxs_mysql_kill_thread, kill) == NULL)
+    {
+        MXS_ERROR("Failed to start a thread for killing a query on server '%s'.",
+                  server->unique_name);
+        free(kill->user);
+        free(kill->passwd);
+        free(kill);
+        return false;
+    }
+
+    pthread_detach(thread);
+    return true;
+}
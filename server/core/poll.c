@@ -16,7 +16,10 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <errno.h>
 #include <maxscale/poll.h>
 #include <dcb.h>
@@ -28,11 +31,18 @@
 #include <maxconfig.h>
 #include <housekeeper.h>
 #include <maxconfig.h>
+#include <profiler.h>
 #include <mysql.h>
 #include <resultset.h>
 #include <session.h>
+#include <service.h>
 #include <statistics.h>
+#include <metrics.h>
 #include <query_classifier.h>
+#include <platform.h>
+#include <uring.h>
+#include <rdtsc.h>
+#include <usage.h>
 
 #define         PROFILE_POLL    0
 
@@ -46,6 +56,8 @@ MEMLOG  *plog;
 
 int number_poll_spins;
 int max_poll_sleep;
+static bool adaptive_polling = false; /*< Spins and waits follow the event rate */
+static int64_t adaptive_max_spin = 0; /*< Longest adaptive spin in microseconds */
 
 /**
  * @file poll.c  - Abstraction of the epoll functionality
@@ -69,6 +81,14 @@ int max_poll_sleep;
  * 07/07/15     Martin Brampton Simplified add and remove DCB, improve error handling.
  * 23/08/15     Martin Brampton Added test so only DCB with a session link can be added to the poll list
  * 07/02/16     Martin Brampton Added a small piece of SSL logic to EPOLLIN
+ * 14/10/16     MariaDB Corporation The threads take part in the epochs of the DCB zombies
+ * 14/10/16     MariaDB Corporation Listeners may have a socket for each thread
+ * 14/10/16     MariaDB Corporation The threads may be bound to CPUs
+ * 14/10/16     MariaDB Corporation The running threads are tracked in an atomic bitset
+ * 14/10/16     MariaDB Corporation Services may have a group of threads of their own
+ * 14/10/16     MariaDB Corporation The writes may be submitted through io_uring
+ * 14/10/16     MariaDB Corporation Adaptive polling tunes the spins and the waits of each thread
+ * 14/10/16     MariaDB Corporation The processing time of the events is counted in the resource usage
  *
  * @endverbatim
  */
@@ -80,20 +100,106 @@ int max_poll_sleep;
  */
 #define MUTEX_EPOLL     0
 
-static int epoll_fd = -1;    /*< The epoll file descriptor */
 static int do_shutdown = 0;  /*< Flag the shutdown of the poll subsystem */
-static GWBITMASK poll_mask;
+static GWBITSET poll_mask; /*< The running polling threads */
 #if MUTEX_EPOLL
 static simple_mutex_t epoll_wait_mutex; /*< serializes calls to epoll_wait */
 #endif
 static int n_waiting = 0;    /*< No. of threads in epoll_wait */
 
-static int process_pollq(int thread_id);
+/**
+ * A poll queue is an epoll instance together with the queue of DCBs that have
+ * events pending processing.
+ *
+ * By default a single poll queue is shared by all the polling threads and any
+ * thread may process the events of any DCB. When per-thread event queues are
+ * enabled each polling thread owns a poll queue of its own. A DCB is then pinned
+ * to the thread that added it to the poll set and only that thread processes
+ * its events. Events generated for the DCB by other threads are handed off to
+ * the owning thread through a lock-free list in the poll queue, after which the
+ * owner is woken up through an eventfd.
+ */
+typedef struct
+{
+    int      epoll_fd;    /*< The epoll file descriptor */
+    int      wakeup_fd;   /*< eventfd used to wake up the owning thread */
+    SPINLOCK lock;        /*< Protects the event queue */
+    DCB      *eventq;     /*< The queue of DCBs with pending events */
+    int      evq_length;  /*< Event queue length */
+    int      evq_pending; /*< Number of pending descriptors in event queue */
+    int      evq_max;     /*< Maximum event queue length */
+    DCB      *handoff;    /*< DCBs handed off by other threads, newest first */
+} __attribute__((aligned(64))) POLL_QUEUE;
+
+static POLL_QUEUE *poll_queues = NULL; /*< The poll queues */
+static int n_poll_queues = 0;          /*< No. of poll queues */
+static bool thread_queues = false;     /*< Whether each thread owns a poll queue */
+static bool work_stealing = false;     /*< Whether idle threads steal events from busy ones */
+
+/**
+ * A thread group is a range of polling threads. The listeners of a service
+ * with dedicated threads are polled only by the threads of its group and the
+ * client DCBs stay on the thread that accepted them, as do the backend DCBs of
+ * their sessions. The events of the sessions of the service are processed
+ * only by the threads of the group, which are not shared with other services.
+ *
+ * Group 0 has the threads that were not given to any service. The dedicated
+ * groups are taken from the end of its range. The groups are created before
+ * the polling threads are started and do not change after that.
+ */
+typedef struct
+{
+    char    *name;        /*< The name of the group */
+    int     first;        /*< The first thread of the group */
+    int     count;        /*< Number of threads in the group */
+    int     next;         /*< Round-robin owner for DCBs added by other threads */
+    int64_t last_busy;    /*< Busy time of the threads at the previous load sample */
+    double  utilization;  /*< Share of the time the threads were busy in the last interval */
+} POLL_GROUP;
+
+static POLL_GROUP *poll_groups = NULL; /*< The thread groups, the first is shared */
+static int n_poll_groups = 0;          /*< No. of thread groups */
+static int *thread_groups = NULL;      /*< The group of each thread */
+static int64_t last_load_sample = 0;   /*< When the utilization was last sampled */
+
+/**
+ * Each polling thread runs a timer wheel of its own. The timers are run after
+ * the events have been processed and the blocking epoll_wait returns in time
+ * for the next timer to expire.
+ */
+#define POLL_TIMER_RESOLUTION 10
+
+static TIMER_WHEEL *timer_wheels = NULL; /*< The timer wheels of the polling threads */
+static int next_timer_thread = 0;        /*< Round-robin thread for timers added by other threads */
+
+/** The ID of the polling thread running in this context, -1 for other threads */
+static thread_local int current_poll_thread = -1;
+
+/**
+ * The minimum number of DCBs with pending events a thread must have in its
+ * event queue before idle threads are allowed to steal work from it.
+ */
+#define POLL_STEAL_MIN_PENDING 2
+
+/** The events a DCB is polled for */
+#ifdef EPOLLRDHUP
+#define POLL_DCB_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLET)
+#else
+#define POLL_DCB_EVENTS (EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLET)
+#endif
+
+static int process_pollq(int thread_id, POLL_QUEUE *queue, bool steal);
+static int poll_steal_work(int thread_id);
 static void poll_add_event_to_dcb(DCB* dcb, GWBUF* buf, __uint32_t ev);
 static bool poll_dcb_session_check(DCB *dcb, const char *);
-
-DCB *eventq = NULL;
-SPINLOCK pollqlock = SPINLOCK_INIT;
+static bool process_dcb_events(int thread_id, DCB *dcb, uint32_t ev);
+static void poll_enqueue(POLL_QUEUE *queue, DCB *dcb, uint32_t ev);
+static void poll_queue_event(DCB *dcb, uint32_t ev);
+static void poll_handoff_event(DCB *dcb, uint32_t ev);
+static void poll_drain_handoff(POLL_QUEUE *queue);
+static void poll_wakeup_thread(int thread_id);
+static void poll_bind_thread(int thread_id);
+static int64_t poll_group_busy(POLL_GROUP *group);
 
 /**
  * Thread load average, this is the average number of descriptors in each
@@ -133,6 +239,9 @@ typedef struct
     int n_fds;          /*< No. of descriptors thread is processing */
     DCB *cur_dcb;       /*< Current DCB being processed */
     uint32_t event;     /*< Current event being processed */
+    int64_t busy;       /*< Microseconds spent processing events and timers */
+    int64_t event_interval; /*< Average microseconds between events, adaptive polling */
+    int64_t spin_time;  /*< Microseconds spun before a blocking poll, adaptive polling */
 } THREAD_DATA;
 
 static THREAD_DATA *thread_data = NULL;    /*< Status of each thread */
@@ -148,26 +257,28 @@ static THREAD_DATA *thread_data = NULL;    /*< Status of each thread */
  */
 #define MAXNFDS 10
 
+/** The bucket bounds of the n_fds histogram, the last bucket counts MAXNFDS or more */
+static const int64_t n_fds_bounds[MAXNFDS - 1] = {2, 3, 4, 5, 6, 7, 8, 9, 10};
+
 /**
  * The polling statistics
  */
 static struct
 {
-    ts_stats_t *n_read;         /*< Number of read events   */
-    ts_stats_t *n_write;        /*< Number of write events  */
-    ts_stats_t *n_error;        /*< Number of error events  */
-    ts_stats_t *n_hup;          /*< Number of hangup events */
-    ts_stats_t *n_accept;       /*< Number of accept events */
-    ts_stats_t *n_polls;        /*< Number of poll cycles   */
-    ts_stats_t *n_pollev;       /*< Number of polls returning events */
-    ts_stats_t *n_nbpollev;     /*< Number of polls returning events */
-    ts_stats_t *n_nothreads;    /*< Number of times no threads are polling */
-    int n_fds[MAXNFDS];         /*< Number of wakeups with particular n_fds value */
-    int evq_length;             /*< Event queue length */
-    int evq_pending;            /*< Number of pending descriptors in event queue */
-    int evq_max;                /*< Maximum event queue length */
-    int wake_evqpending;        /*< Woken from epoll_wait with pending events in queue */
-    ts_stats_t *blockingpolls;  /*< Number of epoll_waits with a timeout specified */
+    ts_stats_t n_read;          /*< Number of read events   */
+    ts_stats_t n_write;         /*< Number of write events  */
+    ts_stats_t n_error;         /*< Number of error events  */
+    ts_stats_t n_hup;           /*< Number of hangup events */
+    ts_stats_t n_accept;        /*< Number of accept events */
+    ts_stats_t n_polls;         /*< Number of poll cycles   */
+    ts_stats_t n_pollev;        /*< Number of polls returning events */
+    ts_stats_t n_nbpollev;      /*< Number of polls returning events */
+    ts_stats_t n_nothreads;     /*< Number of times no threads are polling */
+    TS_HISTOGRAM *n_fds;        /*< Number of wakeups with particular n_fds value */
+    ts_stats_t wake_evqpending; /*< Woken from epoll_wait with pending events in queue */
+    ts_stats_t n_handoff;       /*< Number of events handed off to another thread */
+    ts_stats_t n_steals;        /*< Number of DCBs processed for another thread */
+    ts_stats_t blockingpolls;   /*< Number of epoll_waits with a timeout specified */
 } pollStats;
 
 #define N_QUEUE_TIMES   30
@@ -197,6 +308,203 @@ static void poll_loadav(void *);
  */
 static int poll_resolve_error(DCB *, int, bool);
 
+/**
+ * Return the poll queue used by a DCB
+ *
+ * @param dcb   The DCB
+ * @return      The poll queue of the owning thread or the shared poll queue
+ */
+static inline POLL_QUEUE *
+poll_queue_of(DCB *dcb)
+{
+    return thread_queues ? &poll_queues[dcb->poll_thread] : &poll_queues[0];
+}
+
+/**
+ * Return the thread group that polls a DCB
+ *
+ * @param dcb   The DCB
+ * @return      The group of the service of the DCB or the shared group
+ */
+static inline POLL_GROUP *
+poll_group_of(DCB *dcb)
+{
+    SERVICE *service = dcb->service;
+
+    if (service == NULL && dcb->session)
+    {
+        service = dcb->session->service;
+    }
+
+    return &poll_groups[service && service->poll_group < n_poll_groups ? service->poll_group : 0];
+}
+
+/**
+ * Return the number of DCBs in all the event queues
+ */
+static int
+poll_evq_length()
+{
+    int total = 0;
+
+    for (int i = 0; i < n_poll_queues; i++)
+    {
+        total += poll_queues[i].evq_length;
+    }
+    return total;
+}
+
+/**
+ * Return the number of DCBs with pending events in all the event queues
+ */
+static int
+poll_evq_pending()
+{
+    int total = 0;
+
+    for (int i = 0; i < n_poll_queues; i++)
+    {
+        total += poll_queues[i].evq_pending;
+    }
+    return total;
+}
+
+/**
+ * Return the maximum event queue length. With per-thread event queues this
+ * is the largest of the per-thread maximums.
+ */
+static int
+poll_evq_max()
+{
+    int max = 0;
+
+    for (int i = 0; i < n_poll_queues; i++)
+    {
+        if (poll_queues[i].evq_max > max)
+        {
+            max = poll_queues[i].evq_max;
+        }
+    }
+    return max;
+}
+
+/**
+ * Select the polling thread that will own a DCB. DCBs added by a polling
+ * thread stay with that thread, DCBs that belong to a session are placed on
+ * the thread of the client connection and the rest are spread over all the
+ * threads.
+ *
+ * @param dcb   The DCB that needs an owner
+ * @return      The ID of the owning thread
+ */
+static int
+poll_select_thread(DCB *dcb)
+{
+    if (current_poll_thread != -1)
+    {
+        return current_poll_thread;
+    }
+
+    if (dcb->session && dcb->session->client_dcb &&
+        dcb->session->client_dcb != dcb &&
+        dcb->session->client_dcb->poll_thread != -1)
+    {
+        return dcb->session->client_dcb->poll_thread;
+    }
+
+    POLL_GROUP *group = poll_group_of(dcb);
+
+    return group->first + (unsigned int)atomic_add(&group->next, 1) % group->count;
+}
+
+/**
+ * Return the thread that owns a DCB, assigning one if the DCB has no owner
+ *
+ * @param dcb   The DCB
+ * @return      The ID of the owning thread
+ */
+static int
+poll_dcb_owner(DCB *dcb)
+{
+    if (dcb->poll_thread == -1)
+    {
+        atomic_cas_int(&dcb->poll_thread, -1, poll_select_thread(dcb));
+    }
+    return dcb->poll_thread;
+}
+
+/**
+ * Create an epoll instance for a poll queue.
+ *
+ * @param queue         The queue to initialise
+ * @param with_wakeup   Whether the queue needs an eventfd for cross-thread wakeups
+ */
+static void
+poll_queue_init(POLL_QUEUE *queue, bool with_wakeup)
+{
+    memset(queue, 0, sizeof(*queue));
+    spinlock_init(&queue->lock);
+    queue->wakeup_fd = -1;
+
+    if ((queue->epoll_fd = epoll_create(MAX_EVENTS)) == -1)
+    {
+        perror("epoll_create");
+        exit(-1);
+    }
+
+    if (with_wakeup)
+    {
+        struct epoll_event ev;
+
+        if ((queue->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        {
+            perror("eventfd");
+            exit(-1);
+        }
+
+        /** A NULL data pointer identifies the wakeup descriptor */
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+
+        if (epoll_ctl(queue->epoll_fd, EPOLL_CTL_ADD, queue->wakeup_fd, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            exit(-1);
+        }
+    }
+}
+
+/**
+ * Create the io_uring instances of the polling threads and poll their
+ * completions. The epoll engine is used if io_uring can not be used.
+ */
+static void
+poll_init_uring()
+{
+    if (!uring_init(n_threads))
+    {
+        MXS_WARNING("The io_uring I/O engine can not be used, using epoll instead.");
+        return;
+    }
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        struct epoll_event ev;
+        POLL_QUEUE *queue = thread_queues ? &poll_queues[i] : &poll_queues[0];
+
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = uring_event_ptr(i);
+
+        if (epoll_ctl(queue->epoll_fd, EPOLL_CTL_ADD, uring_fd(i), &ev) == -1)
+        {
+            perror("epoll_ctl");
+            exit(-1);
+        }
+    }
+
+    MXS_NOTICE("Using the io_uring I/O engine.");
+}
+
 /**
  * Initialise the polling system we are using for the gateway.
  *
@@ -207,27 +515,72 @@ poll_init()
 {
     int i;
 
-    if (epoll_fd != -1)
+    if (poll_queues != NULL)
     {
         return;
     }
-    if ((epoll_fd = epoll_create(MAX_EVENTS)) == -1)
-    {
-        perror("epoll_create");
-        exit(-1);
-    }
     memset(&pollStats, 0, sizeof(pollStats));
     memset(&queueStats, 0, sizeof(queueStats));
-    bitmask_init(&poll_mask);
     n_threads = config_threadcount();
+    if (!bitset_init(&poll_mask, n_threads))
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    thread_queues = config_thread_event_queues() && n_threads > 1;
+    n_poll_queues = thread_queues ? n_threads : 1;
+    work_stealing = thread_queues && config_thread_work_stealing();
+
+    if (posix_memalign((void**)&poll_queues, sizeof(POLL_QUEUE),
+                       n_poll_queues * sizeof(POLL_QUEUE)) != 0)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    for (i = 0; i < n_poll_queues; i++)
+    {
+        poll_queue_init(&poll_queues[i], thread_queues);
+    }
+    
+    if ((timer_wheels = (TIMER_WHEEL *)malloc(n_threads * sizeof(TIMER_WHEEL))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    for (i = 0; i < n_threads; i++)
+    {
+        timer_wheel_init(&timer_wheels[i], POLL_TIMER_RESOLUTION);
+    }
+
+    if (config_io_engine() == IO_ENGINE_URING)
+    {
+        poll_init_uring();
+    }
+
+    dcb_zombies_init(n_threads);
+
     if ((thread_data = (THREAD_DATA *)malloc(n_threads * sizeof(THREAD_DATA))) != NULL)
     {
         for (i = 0; i < n_threads; i++)
         {
             thread_data[i].state = THREAD_STOPPED;
+            thread_data[i].busy = 0;
+            thread_data[i].event_interval = 0;
+            thread_data[i].spin_time = 0;
         }
     }
 
+    if ((poll_groups = (POLL_GROUP *)calloc(1, sizeof(POLL_GROUP))) == NULL ||
+        (poll_groups[0].name = strdup("shared")) == NULL ||
+        (thread_groups = (int *)calloc(n_threads, sizeof(int))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    poll_groups[0].count = n_threads;
+    n_poll_groups = 1;
+    last_load_sample = ts_clock_us();
+
     if ((pollStats.n_read = ts_stats_alloc()) == NULL ||
         (pollStats.n_write = ts_stats_alloc()) == NULL ||
         (pollStats.n_error = ts_stats_alloc()) == NULL ||
@@ -237,7 +590,11 @@ poll_init()
         (pollStats.n_pollev = ts_stats_alloc()) == NULL ||
         (pollStats.n_nbpollev = ts_stats_alloc()) == NULL ||
         (pollStats.n_nothreads = ts_stats_alloc()) == NULL ||
-        (pollStats.blockingpolls = ts_stats_alloc()) == NULL)
+        (pollStats.n_handoff = ts_stats_alloc()) == NULL ||
+        (pollStats.n_steals = ts_stats_alloc()) == NULL ||
+        (pollStats.blockingpolls = ts_stats_alloc()) == NULL ||
+        (pollStats.wake_evqpending = ts_stats_alloc()) == NULL ||
+        (pollStats.n_fds = ts_histogram_alloc(n_fds_bounds, MAXNFDS - 1)) == NULL)
     {
         perror("Fatal error: Memory allocation failed.");
         exit(-1);
@@ -262,12 +619,91 @@ poll_init()
 
     number_poll_spins = config_nbpolls();
     max_poll_sleep = config_pollsleep();
+    adaptive_polling = config_adaptive_polling();
+    adaptive_max_spin = config_adaptive_poll_max_spin();
 
 #if PROFILE_POLL
     plog = memlog_create("EventQueueWaitTime", ML_LONG, 10000);
 #endif
 }
 
+/**
+ * Reserve polling threads for a service
+ *
+ * The threads are taken from the shared threads, at least one of which is
+ * always left for the other services. This must be called before the polling
+ * threads are started. Dedicated threads require per-thread event queues, as
+ * only then are the DCBs owned by a thread.
+ *
+ * @param name    The name of the group, the name of the service
+ * @param threads Number of threads to reserve
+ * @return The ID of the new group or 0, the shared group, if the threads
+ *         could not be reserved
+ */
+int
+poll_add_group(const char *name, int threads)
+{
+    POLL_GROUP *groups;
+
+    if (!thread_queues)
+    {
+        MXS_WARNING("Service '%s' can not have dedicated threads without per-thread event "
+                    "queues, enable 'thread_event_queues'. The shared threads are used.", name);
+        return 0;
+    }
+
+    if (threads >= poll_groups[0].count)
+    {
+        MXS_ERROR("Service '%s' wants %d dedicated threads but only %d threads are left and "
+                  "at least one of them must be shared. The shared threads are used.",
+                  name, threads, poll_groups[0].count);
+        return 0;
+    }
+
+    if ((groups = (POLL_GROUP *)realloc(poll_groups, (n_poll_groups + 1) * sizeof(POLL_GROUP))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the threads of service '%s'.", name);
+        return 0;
+    }
+    poll_groups = groups;
+
+    POLL_GROUP *group = &poll_groups[n_poll_groups];
+    memset(group, 0, sizeof(*group));
+    group->name = strdup(name);
+    group->count = threads;
+    poll_groups[0].count -= threads;
+    group->first = poll_groups[0].first + poll_groups[0].count;
+
+    for (int i = group->first; i < group->first + group->count; i++)
+    {
+        thread_groups[i] = n_poll_groups;
+    }
+
+    MXS_NOTICE("Service '%s' has the polling threads %d to %d of its own.",
+               name, group->first, group->first + group->count - 1);
+
+    return n_poll_groups++;
+}
+
+/**
+ * Return the threads that poll a listener
+ *
+ * A listener with a socket for each thread has one for each of these threads,
+ * in the same order.
+ *
+ * @param dcb   The listener DCB
+ * @param first The first of the threads
+ * @return Number of threads
+ */
+int
+poll_listener_threads(DCB *dcb, int *first)
+{
+    POLL_GROUP *group = poll_group_of(dcb);
+
+    *first = group->first;
+    return group->count;
+}
+
 /**
  * Add a DCB to the set of descriptors within the polling
  * environment.
@@ -285,11 +721,7 @@ poll_add_dcb(DCB *dcb)
 
     CHK_DCB(dcb);
 
-#ifdef EPOLLRDHUP
-    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLET;
-#else
-    ev.events = EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLET;
-#endif
+    ev.events = POLL_DCB_EVENTS;
     ev.data.ptr = dcb;
 
     /*<
@@ -334,11 +766,46 @@ poll_add_dcb(DCB *dcb)
      * The only possible failure that will not cause a crash is
      * running out of system resources.
      */
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dcb->fd, &ev);
-    if (rc)
+    if (thread_queues && new_state == DCB_STATE_LISTENING)
+    {
+        /**
+         * Listeners are added to the epoll instance of every thread in the
+         * group of the service so that any of them may accept new connections.
+         * The accepted client DCBs are then owned by the thread that accepted
+         * them.
+         */
+        POLL_GROUP *group = poll_group_of(dcb);
+#ifdef EPOLLEXCLUSIVE
+        if (dcb->n_thread_fds == 0)
+        {
+            ev.events |= EPOLLEXCLUSIVE;
+        }
+#endif
+        rc = 0;
+        for (int i = 0; i < group->count && rc == 0; i++)
+        {
+            /** A listener may have a SO_REUSEPORT socket for each thread */
+            int fd = i < dcb->n_thread_fds ? dcb->thread_fds[i] : dcb->fd;
+
+            if ((rc = epoll_ctl(poll_queues[group->first + i].epoll_fd, EPOLL_CTL_ADD, fd, &ev)))
+            {
+                rc = poll_resolve_error(dcb, errno, true);
+            }
+        }
+    }
+    else
     {
-        /* Some errors are actually considered acceptable */
-        rc = poll_resolve_error(dcb, errno, true);
+        if (thread_queues)
+        {
+            dcb->poll_thread = poll_select_thread(dcb);
+        }
+
+        rc = epoll_ctl(poll_queue_of(dcb)->epoll_fd, EPOLL_CTL_ADD, dcb->fd, &ev);
+        if (rc)
+        {
+            /* Some errors are actually considered acceptable */
+            rc = poll_resolve_error(dcb, errno, true);
+        }
     }
     if (0 == rc)
     {
@@ -401,19 +868,46 @@ poll_remove_dcb(DCB *dcb)
     spinlock_release(&dcb->dcb_initlock);
     if (dcbfd > 0)
     {
-        rc = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dcbfd, &ev);
-        /**
-         * The poll_resolve_error function will always
-         * return 0 or crash.  So if it returns non-zero result,
-         * things have gone wrong and we crash.
-         */
-        if (rc)
+        int first = 0;
+        int last = 0;
+
+        if (thread_queues)
         {
-            rc = poll_resolve_error(dcb, errno, false);
+            if (dcb->dcb_role == DCB_ROLE_SERVICE_LISTENER)
+            {
+                /** Listeners are in the epoll instances of all threads of the group */
+                POLL_GROUP *group = poll_group_of(dcb);
+                first = group->first;
+                last = group->first + group->count - 1;
+            }
+            else if (dcb->poll_thread != -1)
+            {
+                first = last = dcb->poll_thread;
+            }
+            else
+            {
+                return 0;
+            }
         }
-        if (rc)
+
+        for (int i = first; i <= last; i++)
         {
-            raise(SIGABRT);
+            int fd = i - first < dcb->n_thread_fds ? dcb->thread_fds[i - first] : dcbfd;
+
+            rc = epoll_ctl(poll_queues[i].epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+            /**
+             * The poll_resolve_error function will always
+             * return 0 or crash.  So if it returns non-zero result,
+             * things have gone wrong and we crash.
+             */
+            if (rc)
+            {
+                rc = poll_resolve_error(dcb, errno, false);
+            }
+            if (rc)
+            {
+                raise(SIGABRT);
+            }
         }
     }
     return rc;
@@ -497,6 +991,121 @@ poll_resolve_error(DCB *dcb, int errornum, bool adding)
                          *  debugging easier.
                          */
 
+/**
+ * Bind the calling polling thread to its configured CPU. This is done before
+ * the thread allocates any memory of its own, so that with the default memory
+ * policy of Linux the buffer pool, the persistent connections and the other
+ * memory the thread first touches are placed on the NUMA node of the CPU.
+ *
+ * @param thread_id The ID of the polling thread
+ */
+static void
+poll_bind_thread(int thread_id)
+{
+    int cpu = config_thread_cpu(thread_id);
+
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+        if (rc == 0)
+        {
+            MXS_INFO("Polling thread %d is bound to CPU %d.", thread_id, cpu);
+        }
+        else
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_WARNING("Failed to bind polling thread %d to CPU %d: %d, %s",
+                        thread_id, cpu, rc, strerror_r(rc, errbuf, sizeof(errbuf)));
+        }
+    }
+}
+
+/**
+ * Check whether a polling thread has done enough non-blocking polls
+ *
+ * With adaptive polling, a thread spins while an event is expected soon: for
+ * the spin time since its last event. Otherwise it does number_poll_spins
+ * non-blocking polls.
+ *
+ * @param spins         Number of non-blocking polls without events
+ * @param last_event    When the thread last received events
+ * @param spin_time     The spin time of the thread, adaptive polling
+ * @return True if the thread should do a blocking poll
+ */
+static inline bool
+poll_spun_enough(int spins, int64_t last_event, int64_t spin_time)
+{
+    if (adaptive_polling)
+    {
+        return (int64_t)ts_clock_us() - last_event >= spin_time;
+    }
+
+    return spins > number_poll_spins;
+}
+
+/**
+ * Update the event rate of a polling thread for adaptive polling
+ *
+ * The average time between the events is a moving average that ignores the
+ * gaps longer than the maximum blocking wait, so that a thread which was idle
+ * adapts to a new burst of events after a few of them. Spinning pays off only
+ * when the next event is expected within the longest spin, a thread that
+ * receives events less often blocks at once.
+ *
+ * @param thread_id     The polling thread
+ * @param interval      Microseconds since the previous events
+ * @param event_interval The average interval, updated
+ * @param spin_time     The spin time, updated
+ */
+static void
+poll_adapt(int thread_id, int64_t interval, int64_t *event_interval, int64_t *spin_time)
+{
+    int64_t max_interval = (int64_t)max_poll_sleep * 1000;
+
+    if (interval > max_interval)
+    {
+        interval = max_interval;
+    }
+
+    *event_interval += (interval - *event_interval) / 4;
+
+    if (*event_interval <= adaptive_max_spin)
+    {
+        *spin_time = MIN(2 * *event_interval, adaptive_max_spin);
+    }
+    else
+    {
+        *spin_time = 0;
+    }
+
+    if (thread_data)
+    {
+        thread_data[thread_id].event_interval = *event_interval;
+        thread_data[thread_id].spin_time = *spin_time;
+    }
+}
+
+/**
+ * Get the timeout of a blocking poll of a thread with adaptive polling. A
+ * thread that receives events often comes back soon to look at the queues,
+ * an idle thread waits for up to the maximum blocking wait.
+ *
+ * @param event_interval The average interval between the events of the thread
+ * @return The timeout in milliseconds
+ */
+static inline int
+poll_adaptive_timeout(int64_t event_interval)
+{
+    int64_t timeout = event_interval / 1000;
+
+    return timeout < 1 ? 1 : timeout > max_poll_sleep ? max_poll_sleep : timeout;
+}
+
 /**
  * The main polling loop
  *
@@ -555,11 +1164,20 @@ poll_waitevents(void *arg)
     int i, nfds, timeout_bias = 1;
     intptr_t thread_id = (intptr_t)arg;
     int poll_spins = 0;
+    int64_t last_event = ts_clock_us();
+    int64_t event_interval = (int64_t)max_poll_sleep * 1000;
+    int64_t spin_time = 0;
+    POLL_QUEUE *queue = thread_queues ? &poll_queues[thread_id] : &poll_queues[0];
+    TIMER_WHEEL *wheel = &timer_wheels[thread_id];
 
+    poll_bind_thread(thread_id);
     ts_stats_set_thread_id(thread_id);
+    current_poll_thread = thread_id;
+    profiler_thread_init(thread_id);
 
     /** Add this thread to the bitmask of running polling threads */
-    bitmask_set(&poll_mask, thread_id);
+    bitset_set(&poll_mask, thread_id);
+    dcb_epoch_enter(thread_id);
     if (thread_data)
     {
         thread_data[thread_id].state = THREAD_IDLE;
@@ -567,14 +1185,14 @@ poll_waitevents(void *arg)
 
     while (1)
     {
-        if (pollStats.evq_pending == 0 && timeout_bias < 10)
+        if (queue->evq_pending == 0 && timeout_bias < 10)
         {
             timeout_bias++;
         }
 
         atomic_add(&n_waiting, 1);
 #if BLOCKINGPOLL
-        nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        nfds = epoll_wait(queue->epoll_fd, events, MAX_EVENTS, -1);
         atomic_add(&n_waiting, -1);
 #else /* BLOCKINGPOLL */
 #if MUTEX_EPOLL
@@ -586,7 +1204,7 @@ poll_waitevents(void *arg)
         }
 
         ts_stats_add(pollStats.n_polls, 1);
-        if ((nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 0)) == -1)
+        if ((nfds = epoll_wait(queue->epoll_fd, events, MAX_EVENTS, 0)) == -1)
         {
             atomic_add(&n_waiting, -1);
             int eno = errno;
@@ -606,16 +1224,26 @@ poll_waitevents(void *arg)
          * We calculate a timeout bias to alter the length of the blocking
          * call based on the time since we last received an event to process
          */
-        else if (nfds == 0 && pollStats.evq_pending == 0 && poll_spins++ > number_poll_spins)
+        else if (nfds == 0 && queue->evq_pending == 0 && queue->handoff == NULL &&
+                 poll_spun_enough(poll_spins++, last_event, spin_time))
         {
+            int timeout = adaptive_polling ? poll_adaptive_timeout(event_interval) :
+                          (max_poll_sleep * timeout_bias) / 10;
+            int next_timer = timer_wheel_next(wheel);
+
+            if (next_timer >= 0 && next_timer < timeout)
+            {
+                timeout = next_timer;
+            }
+
             ts_stats_add(pollStats.blockingpolls, 1);
-            nfds = epoll_wait(epoll_fd,
+            nfds = epoll_wait(queue->epoll_fd,
                               events,
                               MAX_EVENTS,
-                              (max_poll_sleep * timeout_bias) / 10);
-            if (nfds == 0 && pollStats.evq_pending)
+                              timeout);
+            if (nfds == 0 && queue->evq_pending)
             {
-                atomic_add(&pollStats.wake_evqpending, 1);
+                ts_stats_add(pollStats.wake_evqpending, 1);
                 poll_spins = 0;
             }
         }
@@ -632,9 +1260,16 @@ poll_waitevents(void *arg)
         simple_mutex_unlock(&epoll_wait_mutex);
 #endif
 #endif /* BLOCKINGPOLL */
+        int64_t busy_start = ts_clock_us();
+
         if (nfds > 0)
         {
             timeout_bias = 1;
+            if (adaptive_polling)
+            {
+                poll_adapt(thread_id, busy_start - last_event, &event_interval, &spin_time);
+                last_event = busy_start;
+            }
             if (poll_spins <= number_poll_spins + 1)
             {
                 ts_stats_add(pollStats.n_nbpollev, 1);
@@ -652,7 +1287,7 @@ poll_waitevents(void *arg)
                 thread_data[thread_id].state = THREAD_PROCESSING;
             }
 
-            pollStats.n_fds[(nfds < MAXNFDS ? (nfds - 1) : MAXNFDS - 1)]++;
+            ts_histogram_add(pollStats.n_fds, nfds);
 
             load_average = (load_average * load_samples + nfds) / (load_samples + 1);
             atomic_add(&load_samples, 1);
@@ -672,59 +1307,67 @@ poll_waitevents(void *arg)
             {
                 DCB *dcb = (DCB *)events[i].data.ptr;
                 __uint32_t ev = events[i].events;
+                int ring;
 
-                spinlock_acquire(&pollqlock);
-                if (DCB_POLL_BUSY(dcb))
+                if (dcb && (ring = uring_event_thread(events[i].data.ptr)) != -1)
+                {
+                    /** Sends submitted by a thread have completed */
+                    uring_complete(ring);
+                }
+                else if (dcb == NULL)
                 {
-                    if (dcb->evq.pending_events == 0)
+                    /** Another thread has handed off events to this thread */
+                    uint64_t count;
+                    while (read(queue->wakeup_fd, &count, sizeof(count)) > 0)
                     {
-                        pollStats.evq_pending++;
-                        dcb->evq.inserted = hkheartbeat;
+                        ;
                     }
-                    dcb->evq.pending_events |= ev;
+                }
+                else if (thread_queues && dcb->state == DCB_STATE_LISTENING)
+                {
+                    /**
+                     * Listeners are polled by all threads so they can not
+                     * be placed on a thread's event queue. Accepting is
+                     * safe to do concurrently so the event is processed
+                     * immediately.
+                     */
+                    process_dcb_events(thread_id, dcb, ev);
+                    mxs_log_tls.li_sesid = 0;
                 }
                 else
                 {
-                    dcb->evq.pending_events = ev;
-                    if (eventq)
-                    {
-                        dcb->evq.prev = eventq->evq.prev;
-                        eventq->evq.prev->evq.next = dcb;
-                        eventq->evq.prev = dcb;
-                        dcb->evq.next = eventq;
-                    }
-                    else
-                    {
-                        eventq = dcb;
-                        dcb->evq.prev = dcb;
-                        dcb->evq.next = dcb;
-                    }
-                    pollStats.evq_length++;
-                    pollStats.evq_pending++;
-                    dcb->evq.inserted = hkheartbeat;
-                    if (pollStats.evq_length > pollStats.evq_max)
-                    {
-                        pollStats.evq_max = pollStats.evq_length;
-                    }
+                    spinlock_acquire(&queue->lock);
+                    poll_enqueue(queue, dcb, ev);
+                    spinlock_release(&queue->lock);
                 }
-                spinlock_release(&pollqlock);
             }
         }
 
+        if (thread_queues && queue->handoff)
+        {
+            poll_drain_handoff(queue);
+        }
+
         /*
          * Process of the queue of waiting requests
          * This is done without checking the evq_pending count as a
          * precautionary measure to avoid issues if the house keeping
          * of the count goes wrong.
          */
-        if (process_pollq(thread_id))
+        if (process_pollq(thread_id, queue, false))
         {
             timeout_bias = 1;
         }
+        else if (work_stealing && poll_steal_work(thread_id))
+        {
+            /** Other threads are busy, keep polling without blocking */
+            timeout_bias = 1;
+            poll_spins = 0;
+        }
 
-        if (check_timeouts && hkheartbeat >= next_timeout_check)
+        if (timer_wheel_run(wheel))
         {
-            process_idle_sessions();
+            timeout_bias = 1;
         }
 
         if (thread_data)
@@ -732,9 +1375,18 @@ poll_waitevents(void *arg)
             thread_data[thread_id].state = THREAD_ZPROCESSING;
         }
         dcb_process_zombies(thread_id);
+
+        if (uring_in_use())
+        {
+            /** The sends of this iteration are submitted with one system call */
+            uring_submit(thread_id);
+            uring_complete(thread_id);
+        }
+
         if (thread_data)
         {
             thread_data[thread_id].state = THREAD_IDLE;
+            thread_data[thread_id].busy += ts_clock_us() - busy_start;
         }
 
         if (do_shutdown)
@@ -747,7 +1399,8 @@ poll_waitevents(void *arg)
             {
                 thread_data[thread_id].state = THREAD_STOPPED;
             }
-            bitmask_clear(&poll_mask, thread_id);
+            dcb_epoch_leave(thread_id);
+            bitset_clear(&poll_mask, thread_id);
             return;
         }
         if (thread_data)
@@ -804,26 +1457,60 @@ poll_set_maxwait(unsigned int maxwait)
  * Thread local storage (tls_log_info_t) follows thread and is accessed every
  * time log is written to particular log.
  *
+ * When stealing work from the queue of another thread the queue lock is only
+ * tried, never waited for, and the DCB at the head of the queue is left for
+ * the owning thread. The DCB stays in the queue of its owner while it is
+ * processed so the processing flag still guarantees that only one thread
+ * at a time processes the events of a DCB.
+ *
  * @param thread_id     The thread ID of the calling thread
+ * @param queue         The poll queue to process
+ * @param steal         True if the queue belongs to another thread
  * @return              0 if no DCB's have been processed
  */
 static int
-process_pollq(int thread_id)
+process_pollq(int thread_id, POLL_QUEUE *queue, bool steal)
 {
     DCB *dcb;
     int found = 0;
     uint32_t ev;
     unsigned long qtime;
 
-    spinlock_acquire(&pollqlock);
-    if (eventq == NULL)
+    if (steal)
+    {
+        if (!spinlock_acquire_nowait(&queue->lock))
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        spinlock_acquire(&queue->lock);
+    }
+
+    if (queue->eventq == NULL)
     {
         /* Nothing to process */
-        spinlock_release(&pollqlock);
+        spinlock_release(&queue->lock);
         return 0;
     }
-    dcb = eventq;
-    if (dcb->evq.next == dcb->evq.prev && dcb->evq.processing == 0)
+    dcb = queue->eventq;
+    if (steal)
+    {
+        /** Leave the head of the queue for the owning thread */
+        do
+        {
+            dcb = dcb->evq.next;
+        }
+        while (dcb != queue->eventq && dcb->evq.processing == 1);
+
+        if (dcb != queue->eventq)
+        {
+            dcb->evq.processing = 1;
+            found = 1;
+        }
+    }
+    else if (dcb->evq.next == dcb->evq.prev && dcb->evq.processing == 0)
     {
         found = 1;
         dcb->evq.processing = 1;
@@ -831,7 +1518,7 @@ process_pollq(int thread_id)
     else if (dcb->evq.next == dcb->evq.prev)
     {
         /* Only item in queue is being processed */
-        spinlock_release(&pollqlock);
+        spinlock_release(&queue->lock);
         return 0;
     }
     else
@@ -840,7 +1527,7 @@ process_pollq(int thread_id)
         {
             dcb = dcb->evq.next;
         }
-        while (dcb != eventq && dcb->evq.processing == 1);
+        while (dcb != queue->eventq && dcb->evq.processing == 1);
 
         if (dcb->evq.processing == 0)
         {
@@ -854,10 +1541,10 @@ process_pollq(int thread_id)
         ev = dcb->evq.pending_events;
         dcb->evq.processing_events = ev;
         dcb->evq.pending_events = 0;
-        pollStats.evq_pending--;
-        ss_dassert(pollStats.evq_pending >= 0);
+        queue->evq_pending--;
+        ss_dassert(queue->evq_pending >= 0);
     }
-    spinlock_release(&pollqlock);
+    spinlock_release(&queue->lock);
 
     if (found == 0)
     {
@@ -883,7 +1570,146 @@ process_pollq(int thread_id)
         queueStats.maxqtime = qtime;
     }
 
+    CYCLES started = rdtsc();
+
+    if (!process_dcb_events(thread_id, dcb, ev))
+    {
+        return 0;
+    }
+
+    /** The session is freed only when its DCBs are, after the events are processed */
+    if (dcb->session)
+    {
+        usage_add(dcb->session, USAGE_PROXY_CYCLES, rdtsc() - started);
+    }
+
+    qtime = hkheartbeat - dcb->evq.started;
+
+    if (qtime > N_QUEUE_TIMES)
+    {
+        queueStats.exectimes[N_QUEUE_TIMES]++;
+    }
+    else
+    {
+        queueStats.exectimes[qtime % N_QUEUE_TIMES]++;
+    }
+    if (qtime > queueStats.maxexectime)
+    {
+        queueStats.maxexectime = qtime;
+    }
+
+    spinlock_acquire(&queue->lock);
+    dcb->evq.processing_events = 0;
+
+    if (dcb->evq.pending_events == 0)
+    {
+        /* No pending events so remove from the queue */
+        if (dcb->evq.prev != dcb)
+        {
+            dcb->evq.prev->evq.next = dcb->evq.next;
+            dcb->evq.next->evq.prev = dcb->evq.prev;
+            if (queue->eventq == dcb)
+            {
+                queue->eventq = dcb->evq.next;
+            }
+        }
+        else
+        {
+            queue->eventq = NULL;
+        }
+        dcb->evq.next = NULL;
+        dcb->evq.prev = NULL;
+        queue->evq_length--;
+    }
+    else
+    {
+        /*
+         * We have a pending event, move to the end of the queue
+         * if there are any other DCB's in the queue.
+         *
+         * If we are the first item on the queue this is easy, we
+         * just bump the eventq pointer.
+         */
+        if (dcb->evq.prev != dcb)
+        {
+            if (queue->eventq == dcb)
+            {
+                queue->eventq = dcb->evq.next;
+            }
+            else
+            {
+                dcb->evq.prev->evq.next = dcb->evq.next;
+                dcb->evq.next->evq.prev = dcb->evq.prev;
+                dcb->evq.prev = queue->eventq->evq.prev;
+                dcb->evq.next = queue->eventq;
+                queue->eventq->evq.prev = dcb;
+                dcb->evq.prev->evq.next = dcb;
+            }
+        }
+    }
+    dcb->evq.processing = 0;
+    /** Reset session id from thread's local storage */
+    mxs_log_tls.li_sesid = 0;
+    spinlock_release(&queue->lock);
+
+    return 1;
+}
+
+/**
+ * Process events from the queue of a busy thread. The queue of the thread with
+ * the most pending DCBs is chosen, provided it has at least
+ * POLL_STEAL_MIN_PENDING of them.
+ *
+ * @param thread_id     The thread ID of the calling thread
+ * @return              0 if no DCB's have been processed
+ */
+static int
+poll_steal_work(int thread_id)
+{
+    POLL_QUEUE *victim = NULL;
+    int max_pending = POLL_STEAL_MIN_PENDING - 1;
+
+    POLL_GROUP *group = &poll_groups[thread_groups[thread_id]];
+
+    /**
+     * Only the threads of the same group are helped, the threads of a
+     * service are not shared with the others. Dirty reads are enough here,
+     * the queue is checked again under its lock.
+     */
+    for (int i = 1; i < group->count; i++)
+    {
+        POLL_QUEUE *queue = &poll_queues[group->first + (thread_id - group->first + i) % group->count];
+
+        if (queue->evq_pending > max_pending)
+        {
+            max_pending = queue->evq_pending;
+            victim = queue;
+        }
+    }
+
+    if (victim && process_pollq(thread_id, victim, true))
+    {
+        ts_stats_add(pollStats.n_steals, 1);
+        return 1;
+    }
+
+    return 0;
+}
 
+/**
+ * Dispatch a set of events to the protocol functions of a DCB.
+ *
+ * The caller must guarantee that no other thread is processing events
+ * for the same DCB at the same time.
+ *
+ * @param thread_id     The thread ID of the calling thread
+ * @param dcb           The DCB to process
+ * @param ev            The events to process
+ * @return              False if the DCB was already disconnected
+ */
+static bool
+process_dcb_events(int thread_id, DCB *dcb, uint32_t ev)
+{
     CHK_DCB(dcb);
     if (thread_data)
     {
@@ -910,7 +1736,7 @@ process_pollq(int thread_id)
     /* ss_dassert(dcb->state != DCB_STATE_DISCONNECTED); */
     if (DCB_STATE_DISCONNECTED == dcb->state)
     {
-        return 0;
+        return false;
     }
     ss_debug(spinlock_release(&dcb->dcb_initlock));
 
@@ -1108,78 +1934,10 @@ process_pollq(int thread_id)
         {
             spinlock_release(&dcb->dcb_initlock);
         }
-    }
-#endif
-    qtime = hkheartbeat - dcb->evq.started;
-
-    if (qtime > N_QUEUE_TIMES)
-    {
-        queueStats.exectimes[N_QUEUE_TIMES]++;
-    }
-    else
-    {
-        queueStats.exectimes[qtime % N_QUEUE_TIMES]++;
-    }
-    if (qtime > queueStats.maxexectime)
-    {
-        queueStats.maxexectime = qtime;
-    }
-
-    spinlock_acquire(&pollqlock);
-    dcb->evq.processing_events = 0;
-
-    if (dcb->evq.pending_events == 0)
-    {
-        /* No pending events so remove from the queue */
-        if (dcb->evq.prev != dcb)
-        {
-            dcb->evq.prev->evq.next = dcb->evq.next;
-            dcb->evq.next->evq.prev = dcb->evq.prev;
-            if (eventq == dcb)
-            {
-                eventq = dcb->evq.next;
-            }
-        }
-        else
-        {
-            eventq = NULL;
-        }
-        dcb->evq.next = NULL;
-        dcb->evq.prev = NULL;
-        pollStats.evq_length--;
-    }
-    else
-    {
-        /*
-         * We have a pending event, move to the end of the queue
-         * if there are any other DCB's in the queue.
-         *
-         * If we are the first item on the queue this is easy, we
-         * just bump the eventq pointer.
-         */
-        if (dcb->evq.prev != dcb)
-        {
-            if (eventq == dcb)
-            {
-                eventq = dcb->evq.next;
-            }
-            else
-            {
-                dcb->evq.prev->evq.next = dcb->evq.next;
-                dcb->evq.next->evq.prev = dcb->evq.prev;
-                dcb->evq.prev = eventq->evq.prev;
-                dcb->evq.next = eventq;
-                eventq->evq.prev = dcb;
-                dcb->evq.prev->evq.next = dcb;
-            }
-        }
-    }
-    dcb->evq.processing = 0;
-    /** Reset session id from thread's local storage */
-    mxs_log_tls.li_sesid = 0;
-    spinlock_release(&pollqlock);
+    }
+#endif
 
-    return 1;
+    return true;
 }
 
 /**
@@ -1224,7 +1982,7 @@ poll_shutdown()
  *
  * @return The bitmask of the running polling threads
  */
-GWBITMASK *
+GWBITSET *
 poll_bitmask()
 {
     return &poll_mask;
@@ -1252,52 +2010,224 @@ void
 dprintPollStats(DCB *dcb)
 {
     int i;
+    ts_stats_t stats[] =
+    {
+        pollStats.n_polls, pollStats.blockingpolls, pollStats.n_pollev,
+        pollStats.n_nbpollev, pollStats.n_read, pollStats.n_write,
+        pollStats.n_error, pollStats.n_hup, pollStats.n_accept,
+        pollStats.n_nothreads, pollStats.wake_evqpending, pollStats.n_handoff,
+        pollStats.n_steals
+    };
+    int64_t values[sizeof(stats) / sizeof(stats[0])];
+    int64_t n_fds[TS_STATS_MAX_BUCKETS];
+
+    ts_stats_snapshot(stats, sizeof(stats) / sizeof(stats[0]), values);
+    ts_histogram_snapshot(pollStats.n_fds, n_fds);
 
     dcb_printf(dcb, "\nPoll Statistics.\n\n");
-    dcb_printf(dcb, "No. of epoll cycles:                           %d\n",
-               ts_stats_sum(pollStats.n_polls));
-    dcb_printf(dcb, "No. of epoll cycles with wait:                         %d\n",
-               ts_stats_sum(pollStats.blockingpolls));
-    dcb_printf(dcb, "No. of epoll calls returning events:           %d\n",
-               ts_stats_sum(pollStats.n_pollev));
-    dcb_printf(dcb, "No. of non-blocking calls returning events:    %d\n",
-               ts_stats_sum(pollStats.n_nbpollev));
-    dcb_printf(dcb, "No. of read events:                            %d\n",
-               ts_stats_sum(pollStats.n_read));
-    dcb_printf(dcb, "No. of write events:                           %d\n",
-               ts_stats_sum(pollStats.n_write));
-    dcb_printf(dcb, "No. of error events:                           %d\n",
-               ts_stats_sum(pollStats.n_error));
-    dcb_printf(dcb, "No. of hangup events:                          %d\n",
-               ts_stats_sum(pollStats.n_hup));
-    dcb_printf(dcb, "No. of accept events:                          %d\n",
-               ts_stats_sum(pollStats.n_accept));
-    dcb_printf(dcb, "No. of times no threads polling:               %d\n",
-               ts_stats_sum(pollStats.n_nothreads));
+    dcb_printf(dcb, "No. of epoll cycles:                           %ld\n", values[0]);
+    dcb_printf(dcb, "No. of epoll cycles with wait:                         %ld\n", values[1]);
+    dcb_printf(dcb, "No. of epoll calls returning events:           %ld\n", values[2]);
+    dcb_printf(dcb, "No. of non-blocking calls returning events:    %ld\n", values[3]);
+    dcb_printf(dcb, "No. of read events:                            %ld\n", values[4]);
+    dcb_printf(dcb, "No. of write events:                           %ld\n", values[5]);
+    dcb_printf(dcb, "No. of error events:                           %ld\n", values[6]);
+    dcb_printf(dcb, "No. of hangup events:                          %ld\n", values[7]);
+    dcb_printf(dcb, "No. of accept events:                          %ld\n", values[8]);
+    dcb_printf(dcb, "No. of times no threads polling:               %ld\n", values[9]);
     dcb_printf(dcb, "Current event queue length:                    %d\n",
-               pollStats.evq_length);
+               poll_evq_length());
     dcb_printf(dcb, "Maximum event queue length:                    %d\n",
-               pollStats.evq_max);
+               poll_evq_max());
     dcb_printf(dcb, "No. of DCBs with pending events:               %d\n",
-               pollStats.evq_pending);
-    dcb_printf(dcb, "No. of wakeups with pending queue:             %d\n",
-               pollStats.wake_evqpending);
+               poll_evq_pending());
+    dcb_printf(dcb, "No. of wakeups with pending queue:             %ld\n", values[10]);
+    if (uring_in_use())
+    {
+        uring_stats(dcb);
+    }
+    if (thread_queues)
+    {
+        dcb_printf(dcb, "No. of events handed off to other threads:     %ld\n", values[11]);
+        if (work_stealing)
+        {
+            dcb_printf(dcb, "No. of DCBs stolen from other threads:         %ld\n", values[12]);
+        }
+        dcb_printf(dcb, "Per-thread event queues\n");
+        dcb_printf(dcb, "\tThread\tLength\tPending\tMaximum\n");
+        for (i = 0; i < n_poll_queues; i++)
+        {
+            dcb_printf(dcb, "\t%2d\t%d\t%d\t%d\n", i, poll_queues[i].evq_length,
+                       poll_queues[i].evq_pending, poll_queues[i].evq_max);
+        }
+    }
+
+    GWBUF_POOL_STATS bstats;
+    gwbuf_get_pool_stats(&bstats);
+    dcb_printf(dcb, "No. of buffer allocations from pools:          %lu\n",
+               bstats.alloc_pooled);
+    dcb_printf(dcb, "No. of buffer allocations with malloc:         %lu\n",
+               bstats.alloc_system);
+    dcb_printf(dcb, "Bytes cached in buffer pools:                  %lu\n",
+               bstats.cached_bytes);
 
     dcb_printf(dcb, "No of poll completions with descriptors\n");
     dcb_printf(dcb, "\tNo. of descriptors\tNo. of poll completions.\n");
     for (i = 0; i < MAXNFDS - 1; i++)
     {
-        dcb_printf(dcb, "\t%2d\t\t\t%d\n", i + 1, pollStats.n_fds[i]);
+        dcb_printf(dcb, "\t%2d\t\t\t%ld\n", i + 1, n_fds[i]);
     }
-    dcb_printf(dcb, "\t>= %d\t\t\t%d\n", MAXNFDS,
-               pollStats.n_fds[MAXNFDS - 1]);
+    dcb_printf(dcb, "\t>= %d\t\t\t%ld\n", MAXNFDS, n_fds[MAXNFDS - 1]);
 
-#if SPINLOCK_PROFILE
-    dcb_printf(dcb, "Event queue lock statistics:\n");
-    spinlock_stats(&pollqlock, spin_reporter, dcb);
+#if SPINLOCK_COUNTERS || SPINLOCK_PROFILE
+    for (i = 0; i < n_poll_queues; i++)
+    {
+        dcb_printf(dcb, "Event queue %d lock statistics:\n", i);
+        spinlock_stats(&poll_queues[i].lock, spin_reporter, dcb);
+    }
 #endif
 }
 
+/**
+ * Render the polling statistics in the Prometheus text format
+ *
+ * @param metrics The metrics
+ */
+void
+poll_metrics(METRICS *metrics)
+{
+    const char *events[] = {"read", "write", "error", "hangup", "accept"};
+    ts_stats_t stats[] =
+    {
+        pollStats.n_read, pollStats.n_write, pollStats.n_error, pollStats.n_hup,
+        pollStats.n_accept, pollStats.n_polls, pollStats.blockingpolls, pollStats.n_pollev,
+        pollStats.n_nbpollev, pollStats.n_nothreads, pollStats.wake_evqpending,
+        pollStats.n_handoff, pollStats.n_steals
+    };
+    int64_t values[sizeof(stats) / sizeof(stats[0])];
+    int64_t n_fds[TS_STATS_MAX_BUCKETS];
+    char labels[64];
+    int i;
+
+    ts_stats_snapshot(stats, sizeof(stats) / sizeof(stats[0]), values);
+    ts_histogram_snapshot(pollStats.n_fds, n_fds);
+
+    metrics_family(metrics, "maxscale_poll_events_total", METRICS_COUNTER,
+                   "Events processed by the polling threads");
+    for (i = 0; i < sizeof(events) / sizeof(events[0]); i++)
+    {
+        snprintf(labels, sizeof(labels), "type=\"%s\"", events[i]);
+        metrics_value(metrics, "maxscale_poll_events_total", labels, values[i]);
+    }
+
+    metrics_family(metrics, "maxscale_poll_cycles_total", METRICS_COUNTER, "Epoll cycles");
+    metrics_value(metrics, "maxscale_poll_cycles_total", NULL, values[5]);
+    metrics_family(metrics, "maxscale_poll_blocking_cycles_total", METRICS_COUNTER,
+                   "Epoll cycles with wait");
+    metrics_value(metrics, "maxscale_poll_blocking_cycles_total", NULL, values[6]);
+    metrics_family(metrics, "maxscale_poll_cycles_with_events_total", METRICS_COUNTER,
+                   "Epoll calls that returned events");
+    metrics_value(metrics, "maxscale_poll_cycles_with_events_total", NULL, values[7]);
+    metrics_family(metrics, "maxscale_poll_nonblocking_cycles_with_events_total", METRICS_COUNTER,
+                   "Non-blocking epoll calls that returned events");
+    metrics_value(metrics, "maxscale_poll_nonblocking_cycles_with_events_total", NULL, values[8]);
+    metrics_family(metrics, "maxscale_poll_no_threads_total", METRICS_COUNTER,
+                   "Times no threads were polling");
+    metrics_value(metrics, "maxscale_poll_no_threads_total", NULL, values[9]);
+    metrics_family(metrics, "maxscale_poll_pending_wakeups_total", METRICS_COUNTER,
+                   "Wakeups with events pending in the queue");
+    metrics_value(metrics, "maxscale_poll_pending_wakeups_total", NULL, values[10]);
+    metrics_family(metrics, "maxscale_poll_handoffs_total", METRICS_COUNTER,
+                   "Events handed off to other threads");
+    metrics_value(metrics, "maxscale_poll_handoffs_total", NULL, values[11]);
+    metrics_family(metrics, "maxscale_poll_steals_total", METRICS_COUNTER,
+                   "DCBs stolen from other threads");
+    metrics_value(metrics, "maxscale_poll_steals_total", NULL, values[12]);
+
+    metrics_family(metrics, "maxscale_poll_completions_total", METRICS_COUNTER,
+                   "Epoll completions by the number of descriptors returned");
+    for (i = 0; i < MAXNFDS; i++)
+    {
+        snprintf(labels, sizeof(labels), "descriptors=\"%s%d\"", i == MAXNFDS - 1 ? ">=" : "", i + 1);
+        metrics_value(metrics, "maxscale_poll_completions_total", labels, n_fds[i]);
+    }
+
+    metrics_family(metrics, "maxscale_event_queue_length", METRICS_GAUGE,
+                   "Current length of the event queue");
+    metrics_value(metrics, "maxscale_event_queue_length", NULL, poll_evq_length());
+    metrics_family(metrics, "maxscale_event_queue_max_length", METRICS_GAUGE,
+                   "Maximum length of the event queue");
+    metrics_value(metrics, "maxscale_event_queue_max_length", NULL, poll_evq_max());
+    metrics_family(metrics, "maxscale_event_queue_pending", METRICS_GAUGE,
+                   "DCBs with pending events");
+    metrics_value(metrics, "maxscale_event_queue_pending", NULL, poll_evq_pending());
+
+    /**
+     * The queue and execution times are counted in heartbeats of 100 milliseconds,
+     * so a time of n heartbeats is below n + 1 of them. The sums are lower bounds.
+     */
+    unsigned int *times[] = {queueStats.qtimes, queueStats.exectimes};
+    const char *names[] = {"maxscale_event_queue_seconds", "maxscale_event_execution_seconds"};
+    const char *help[] = {"Time the events spent in the event queue",
+                          "Time spent processing the events"};
+
+    for (int t = 0; t < 2; t++)
+    {
+        uint64_t seen = 0;
+        uint64_t sum = 0;
+
+        metrics_family(metrics, names[t], METRICS_HISTOGRAM, help[t]);
+
+        for (i = 0; i < N_QUEUE_TIMES; i++)
+        {
+            seen += times[t][i];
+            sum += (uint64_t)times[t][i] * i;
+            metrics_printf(metrics, "%s_bucket{le=\"%.1f\"} %lu\n", names[t], (i + 1) / 10.0, seen);
+        }
+
+        seen += times[t][N_QUEUE_TIMES];
+        sum += (uint64_t)times[t][N_QUEUE_TIMES] * N_QUEUE_TIMES;
+        metrics_printf(metrics, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.1f\n%s_count %lu\n",
+                       names[t], seen, names[t], sum / 10.0, names[t], seen);
+    }
+
+    if (thread_data)
+    {
+        char name[METRICS_LABEL_LEN];
+        char group[METRICS_LABEL_LEN + 16];
+
+        metrics_family(metrics, "maxscale_thread_group_threads", METRICS_GAUGE,
+                       "Polling threads in the thread group");
+        for (i = 0; i < n_poll_groups; i++)
+        {
+            snprintf(group, sizeof(group), "group=\"%s\"",
+                     metrics_escape(poll_groups[i].name, name, sizeof(name)));
+            metrics_value(metrics, "maxscale_thread_group_threads", group, poll_groups[i].count);
+        }
+
+        metrics_family(metrics, "maxscale_thread_group_busy_seconds_total", METRICS_COUNTER,
+                       "Time the threads of the thread group have spent processing events");
+        for (i = 0; i < n_poll_groups; i++)
+        {
+            snprintf(group, sizeof(group), "group=\"%s\"",
+                     metrics_escape(poll_groups[i].name, name, sizeof(name)));
+            metrics_printf(metrics, "maxscale_thread_group_busy_seconds_total{%s} %.6f\n",
+                           group, poll_group_busy(&poll_groups[i]) / 1000000.0);
+        }
+    }
+
+    GWBUF_POOL_STATS bstats;
+    gwbuf_get_pool_stats(&bstats);
+
+    metrics_family(metrics, "maxscale_buffer_allocations_total", METRICS_COUNTER,
+                   "Buffer allocations by where they were served from");
+    metrics_value(metrics, "maxscale_buffer_allocations_total", "source=\"pool\"", bstats.alloc_pooled);
+    metrics_value(metrics, "maxscale_buffer_allocations_total", "source=\"system\"", bstats.alloc_system);
+    metrics_family(metrics, "maxscale_buffer_pool_bytes", METRICS_GAUGE,
+                   "Bytes cached in the buffer pools");
+    metrics_value(metrics, "maxscale_buffer_pool_bytes", NULL, bstats.cached_bytes);
+}
+
 /**
  * Convert an EPOLL event mask into a printable string
  *
@@ -1423,6 +2353,21 @@ dShowThreads(DCB *dcb)
     {
         return;
     }
+
+    dcb_printf(dcb, "Thread groups, utilization over the last %d seconds:\n\n", POLL_LOAD_FREQ);
+    dcb_printf(dcb, " Group                | Threads  | Utilization\n");
+    dcb_printf(dcb, "----------------------+----------+------------\n");
+    for (i = 0; i < n_poll_groups; i++)
+    {
+        char threads[24];
+
+        snprintf(threads, sizeof(threads), "%d-%d", poll_groups[i].first,
+                 poll_groups[i].first + poll_groups[i].count - 1);
+        dcb_printf(dcb, " %-20s | %-8s | %5.1f%%\n", poll_groups[i].name, threads,
+                   100 * poll_groups[i].utilization);
+    }
+    dcb_printf(dcb, "\n");
+
     dcb_printf(dcb, " ID | State      | # fds  | Descriptor       | Running  | Event\n");
     dcb_printf(dcb, "----+------------+--------+------------------+----------+---------------\n");
     for (i = 0; i < n_threads; i++)
@@ -1483,6 +2428,37 @@ dShowThreads(DCB *dcb)
             }
         }
     }
+
+    if (adaptive_polling)
+    {
+        dcb_printf(dcb, "\nAdaptive polling, longest spin %ldus:\n\n", adaptive_max_spin);
+        dcb_printf(dcb, " ID | Event interval | Spin time\n");
+        dcb_printf(dcb, "----+----------------+----------\n");
+        for (i = 0; i < n_threads; i++)
+        {
+            dcb_printf(dcb, " %2d | %12ldus | %7ldus\n", i,
+                       thread_data[i].event_interval, thread_data[i].spin_time);
+        }
+    }
+}
+
+/**
+ * Return the time the threads of a group have spent processing events
+ *
+ * @param group The group
+ * @return The sum of busy time of the threads in microseconds
+ */
+static int64_t
+poll_group_busy(POLL_GROUP *group)
+{
+    int64_t busy = 0;
+
+    for (int i = group->first; i < group->first + group->count; i++)
+    {
+        busy += thread_data[i].busy;
+    }
+
+    return busy;
 }
 
 /**
@@ -1511,8 +2487,24 @@ poll_loadav(void *data)
     {
         current_avg = 0.0;
     }
+    int64_t now = ts_clock_us();
+    int64_t elapsed = now - last_load_sample;
+    last_load_sample = now;
+
+    for (int i = 0; i < n_poll_groups && thread_data; i++)
+    {
+        POLL_GROUP *group = &poll_groups[i];
+        int64_t busy = poll_group_busy(group);
+
+        if (elapsed > 0 && group->count > 0)
+        {
+            group->utilization = (double)(busy - group->last_busy) / (elapsed * group->count);
+        }
+        group->last_busy = busy;
+    }
+
     avg_samples[next_sample] = current_avg;
-    evqp_samples[next_sample] = pollStats.evq_pending;
+    evqp_samples[next_sample] = poll_evq_pending();
     next_sample++;
     if (next_sample >= n_avg_samples)
     {
@@ -1549,43 +2541,193 @@ static void poll_add_event_to_dcb(DCB*       dcb,
     dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, buf);
     spinlock_release(&dcb->authlock);
 
-    spinlock_acquire(&pollqlock);
+    poll_queue_event(dcb, ev);
+}
 
-    /** Set event to DCB */
+/**
+ * Add an event to a DCB that is in the given poll queue. If the DCB is
+ * already on the event queue the event is merged with the pending events,
+ * otherwise the DCB is placed at the back of the queue.
+ *
+ * The caller must hold the lock of the poll queue.
+ *
+ * @param queue The poll queue of the DCB
+ * @param dcb   DCB where the event is added
+ * @param ev    The events to add
+ */
+static void
+poll_enqueue(POLL_QUEUE *queue, DCB *dcb, uint32_t ev)
+{
     if (DCB_POLL_BUSY(dcb))
     {
         if (dcb->evq.pending_events == 0)
         {
-            pollStats.evq_pending++;
+            queue->evq_pending++;
+            dcb->evq.inserted = hkheartbeat;
         }
         dcb->evq.pending_events |= ev;
     }
     else
     {
         dcb->evq.pending_events = ev;
-        /** Add DCB to eventqueue if it isn't already there */
-        if (eventq)
+        if (queue->eventq)
         {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
+            dcb->evq.prev = queue->eventq->evq.prev;
+            queue->eventq->evq.prev->evq.next = dcb;
+            queue->eventq->evq.prev = dcb;
+            dcb->evq.next = queue->eventq;
         }
         else
         {
-            eventq = dcb;
+            queue->eventq = dcb;
             dcb->evq.prev = dcb;
             dcb->evq.next = dcb;
         }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
+        queue->evq_length++;
+        queue->evq_pending++;
+        dcb->evq.inserted = hkheartbeat;
+        if (queue->evq_length > queue->evq_max)
+        {
+            queue->evq_max = queue->evq_length;
+        }
+    }
+}
+
+/**
+ * Add an event to a DCB from the current thread. With per-thread event queues
+ * events for DCBs owned by other threads are handed off to the owner.
+ *
+ * @param dcb   DCB where the event is added
+ * @param ev    The events to add
+ */
+static void
+poll_queue_event(DCB *dcb, uint32_t ev)
+{
+    if (thread_queues && poll_dcb_owner(dcb) != current_poll_thread)
+    {
+        poll_handoff_event(dcb, ev);
+    }
+    else
+    {
+        POLL_QUEUE *queue = poll_queue_of(dcb);
+
+        spinlock_acquire(&queue->lock);
+        poll_enqueue(queue, dcb, ev);
+        spinlock_release(&queue->lock);
+    }
+}
+
+/**
+ * Hand off an event to the thread that owns the DCB.
+ *
+ * The events are merged into the DCB and, unless the DCB already is in the
+ * handoff list of the owner, the DCB is pushed to the list and the owner is
+ * woken up. Pushing is a single compare-and-swap so any number of threads
+ * may hand off events concurrently without locking.
+ *
+ * @param dcb   DCB where the event is added
+ * @param ev    The events to add
+ */
+static void
+poll_handoff_event(DCB *dcb, uint32_t ev)
+{
+    POLL_QUEUE *queue = &poll_queues[dcb->poll_thread];
+
+    ts_stats_add(pollStats.n_handoff, 1);
+    atomic_or_uint32(&dcb->evq.handoff_events, ev);
+
+    if (atomic_cas_int(&dcb->evq.handoff_queued, 0, 1))
+    {
+        DCB *head;
+
+        do
+        {
+            head = queue->handoff;
+            dcb->evq.handoff_next = head;
+        }
+        while (!atomic_cas_ptr((void**)&queue->handoff, head, dcb));
+
+        if (head == NULL)
+        {
+            /**
+             * If the list was not empty, the thread that pushed the previous
+             * head has already woken up the owner.
+             */
+            poll_wakeup_thread(dcb->poll_thread);
+        }
+    }
+}
+
+/**
+ * Wake up a polling thread that owns a poll queue from a blocking epoll_wait.
+ *
+ * @param thread_id The ID of the polling thread
+ */
+static void
+poll_wakeup_thread(int thread_id)
+{
+    uint64_t one = 1;
+
+    if (write(poll_queues[thread_id].wakeup_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to wake up polling thread %d: %d, %s",
+                  thread_id, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+}
+
+/**
+ * Move the DCBs handed off by other threads to the event queue. Only the
+ * owning thread of the poll queue may call this.
+ *
+ * @param queue The poll queue of the calling thread
+ */
+static void
+poll_drain_handoff(POLL_QUEUE *queue)
+{
+    DCB *list = atomic_swap_ptr((void**)&queue->handoff, NULL);
+    DCB *fifo = NULL;
+
+    /** The list is in LIFO order, reverse it to keep the events fair */
+    while (list)
+    {
+        DCB *next = list->evq.handoff_next;
+        list->evq.handoff_next = fifo;
+        fifo = list;
+        list = next;
+    }
+
+    while (fifo)
+    {
+        DCB *dcb = fifo;
+        uint32_t ev;
+
+        fifo = dcb->evq.handoff_next;
+        dcb->evq.handoff_next = NULL;
+
+        /**
+         * The events are collected both before and after the DCB is released
+         * from the handoff list. Events added before the release would
+         * otherwise be lost as the thread adding them sees the DCB still
+         * queued and does not push it again.
+         */
+        ev = atomic_swap_uint32(&dcb->evq.handoff_events, 0);
+        spinlock_acquire(&queue->lock);
+        if (ev)
+        {
+            poll_enqueue(queue, dcb, ev);
+        }
+        spinlock_release(&queue->lock);
+
+        atomic_cas_int(&dcb->evq.handoff_queued, 1, 0);
 
-        if (pollStats.evq_length > pollStats.evq_max)
+        if ((ev = atomic_swap_uint32(&dcb->evq.handoff_events, 0)))
         {
-            pollStats.evq_max = pollStats.evq_length;
+            spinlock_acquire(&queue->lock);
+            poll_enqueue(queue, dcb, ev);
+            spinlock_release(&queue->lock);
         }
     }
-    spinlock_release(&pollqlock);
 }
 
 /*
@@ -1626,6 +2768,91 @@ poll_fake_read_event(DCB *dcb)
     poll_fake_event(dcb, EPOLLIN);
 }
 
+/**
+ * Return the ID of the calling polling thread
+ *
+ * @return The thread ID or -1 if the caller is not a polling thread
+ */
+int
+poll_current_thread()
+{
+    return current_poll_thread;
+}
+
+/**
+ * Add a timer to the timer wheel of a polling thread. The timer function is
+ * called by the polling thread that runs the wheel.
+ *
+ * A timer added by a polling thread is run by the same thread. A timer added
+ * by any other thread is given to the shared polling threads in round-robin
+ * order.
+ * Without per-thread event queues a sleeping polling thread can not be woken
+ * up and such a timer may be run up to maxwait milliseconds late.
+ *
+ * @param timer    An initialised timer
+ * @param delay    Milliseconds until the timer expires
+ * @param interval Milliseconds between the calls of a repeating timer or
+ *                 0 for a one-shot timer
+ */
+void
+poll_add_timer(TIMER *timer, int delay, int interval)
+{
+    int thread_id = current_poll_thread;
+
+    if (thread_id < 0)
+    {
+        thread_id = poll_groups[0].first +
+                    ((unsigned int)atomic_add(&next_timer_thread, 1)) % poll_groups[0].count;
+    }
+
+    timer_add(&timer_wheels[thread_id], timer, delay, interval);
+
+    if (thread_queues && thread_id != current_poll_thread)
+    {
+        poll_wakeup_thread(thread_id);
+    }
+}
+
+/**
+ * Stop or resume polling a DCB for readability. When polling is resumed, a
+ * read event is generated if data arrived while it was stopped.
+ *
+ * @param dcb           The DCB, it must be in the poll set
+ * @param enable        True to resume polling for reads, false to stop it
+ * @return              0 on success, -1 on error
+ */
+int
+poll_enable_read(DCB *dcb, bool enable)
+{
+    struct epoll_event ev;
+
+    ev.events = enable ? POLL_DCB_EVENTS : POLL_DCB_EVENTS & ~EPOLLIN;
+    ev.data.ptr = dcb;
+
+    if (epoll_ctl(poll_queue_of(dcb)->epoll_fd, EPOLL_CTL_MOD, dcb->fd, &ev) == -1)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to %s reads of dcb %p: %d, %s", enable ? "resume" : "pause",
+                  dcb, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Check whether the events of each DCB are processed only by the polling
+ * thread that owns the DCB. This is the case when per-thread event queues
+ * are in use and the threads do not steal work from each other.
+ *
+ * @return True if DCBs have thread affinity
+ */
+bool
+poll_thread_affinity()
+{
+    return thread_queues && !work_stealing;
+}
+
 /*
  * Insert a fake completion event for a DCB into the polling queue.
  *
@@ -1642,8 +2869,16 @@ poll_fake_read_event(DCB *dcb)
 void
 poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev)
 {
+    POLL_QUEUE *queue;
+
+    if (thread_queues && poll_dcb_owner(dcb) != current_poll_thread)
+    {
+        poll_handoff_event(dcb, ev);
+        return;
+    }
 
-    spinlock_acquire(&pollqlock);
+    queue = poll_queue_of(dcb);
+    spinlock_acquire(&queue->lock);
     /*
      * If the DCB is already on the queue, there are no pending events and
      * there are other events on the queue, then
@@ -1653,49 +2888,17 @@ poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev)
     {
         dcb->evq.prev->evq.next = dcb->evq.next;
         dcb->evq.next->evq.prev = dcb->evq.prev;
-        if (eventq == dcb)
+        if (queue->eventq == dcb)
         {
-            eventq = dcb->evq.next;
+            queue->eventq = dcb->evq.next;
         }
         dcb->evq.next = NULL;
         dcb->evq.prev = NULL;
-        pollStats.evq_length--;
+        queue->evq_length--;
     }
 
-    if (DCB_POLL_BUSY(dcb))
-    {
-        if (dcb->evq.pending_events == 0)
-        {
-            pollStats.evq_pending++;
-        }
-        dcb->evq.pending_events |= ev;
-    }
-    else
-    {
-        dcb->evq.pending_events = ev;
-        dcb->evq.inserted = hkheartbeat;
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-        dcb->evq.inserted = hkheartbeat;
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
-    }
-    spinlock_release(&pollqlock);
+    poll_enqueue(queue, dcb, ev);
+    spinlock_release(&queue->lock);
 }
 
 /*
@@ -1714,41 +2917,7 @@ poll_fake_hangup_event(DCB *dcb)
     uint32_t ev = EPOLLHUP;
 #endif
 
-    spinlock_acquire(&pollqlock);
-    if (DCB_POLL_BUSY(dcb))
-    {
-        if (dcb->evq.pending_events == 0)
-        {
-            pollStats.evq_pending++;
-        }
-        dcb->evq.pending_events |= ev;
-    }
-    else
-    {
-        dcb->evq.pending_events = ev;
-        dcb->evq.inserted = hkheartbeat;
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-        dcb->evq.inserted = hkheartbeat;
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
-    }
-    spinlock_release(&pollqlock);
+    poll_queue_event(dcb, ev);
 }
 
 /**
@@ -1762,30 +2931,42 @@ dShowEventQ(DCB *pdcb)
     DCB *dcb;
     char *tmp1, *tmp2;
 
-    spinlock_acquire(&pollqlock);
-    if (eventq == NULL)
+    for (int i = 0; i < n_poll_queues; i++)
     {
-        /* Nothing to process */
-        spinlock_release(&pollqlock);
-        return;
+        POLL_QUEUE *queue = &poll_queues[i];
+
+        spinlock_acquire(&queue->lock);
+        if (queue->eventq == NULL)
+        {
+            /* Nothing to process */
+            spinlock_release(&queue->lock);
+            continue;
+        }
+        dcb = queue->eventq;
+        if (thread_queues)
+        {
+            dcb_printf(pdcb, "\nEvent Queue of thread %d.\n", i);
+        }
+        else
+        {
+            dcb_printf(pdcb, "\nEvent Queue.\n");
+        }
+        dcb_printf(pdcb, "%-16s | %-10s | %-18s | %s\n", "DCB", "Status", "Processing Events",
+                   "Pending Events");
+        dcb_printf(pdcb, "-----------------+------------+--------------------+-------------------\n");
+        do
+        {
+            dcb_printf(pdcb, "%-16p | %-10s | %-18s | %-18s\n", dcb,
+                       dcb->evq.processing ? "Processing" : "Pending",
+                       (tmp1 = event_to_string(dcb->evq.processing_events)),
+                       (tmp2 = event_to_string(dcb->evq.pending_events)));
+            free(tmp1);
+            free(tmp2);
+            dcb = dcb->evq.next;
+        }
+        while (dcb != queue->eventq);
+        spinlock_release(&queue->lock);
     }
-    dcb = eventq;
-    dcb_printf(pdcb, "\nEvent Queue.\n");
-    dcb_printf(pdcb, "%-16s | %-10s | %-18s | %s\n", "DCB", "Status", "Processing Events",
-               "Pending Events");
-    dcb_printf(pdcb, "-----------------+------------+--------------------+-------------------\n");
-    do
-    {
-        dcb_printf(pdcb, "%-16p | %-10s | %-18s | %-18s\n", dcb,
-                   dcb->evq.processing ? "Processing" : "Pending",
-                   (tmp1 = event_to_string(dcb->evq.processing_events)),
-                   (tmp2 = event_to_string(dcb->evq.pending_events)));
-        free(tmp1);
-        free(tmp2);
-        dcb = dcb->evq.next;
-    }
-    while (dcb != eventq);
-    spinlock_release(&pollqlock);
 }
 
 
@@ -1802,8 +2983,8 @@ dShowEventStats(DCB *pdcb)
     dcb_printf(pdcb, "\nEvent statistics.\n");
     dcb_printf(pdcb, "Maximum queue time:           %3lu00ms\n", queueStats.maxqtime);
     dcb_printf(pdcb, "Maximum execution time:       %3lu00ms\n", queueStats.maxexectime);
-    dcb_printf(pdcb, "Maximum event queue length:   %3d\n", pollStats.evq_max);
-    dcb_printf(pdcb, "Current event queue length:   %3d\n", pollStats.evq_length);
+    dcb_printf(pdcb, "Maximum event queue length:   %3d\n", poll_evq_max());
+    dcb_printf(pdcb, "Current event queue length:   %3d\n", poll_evq_length());
     dcb_printf(pdcb, "\n");
     dcb_printf(pdcb, "               |    Number of events\n");
     dcb_printf(pdcb, "Duration       | Queued     | Executed\n");
@@ -1841,15 +3022,19 @@ poll_get_stat(POLL_STAT stat)
     case POLL_STAT_ACCEPT:
         return ts_stats_sum(pollStats.n_accept);
     case POLL_STAT_EVQ_LEN:
-        return pollStats.evq_length;
+        return poll_evq_length();
     case POLL_STAT_EVQ_PENDING:
-        return pollStats.evq_pending;
+        return poll_evq_pending();
     case POLL_STAT_EVQ_MAX:
-        return pollStats.evq_max;
+        return poll_evq_max();
     case POLL_STAT_MAX_QTIME:
         return (int)queueStats.maxqtime;
     case POLL_STAT_MAX_EXECTIME:
         return (int)queueStats.maxexectime;
+    case POLL_STAT_N_POLLS:
+        return ts_stats_sum(pollStats.n_polls);
+    case POLL_STAT_BLOCKING_POLLS:
+        return ts_stats_sum(pollStats.blockingpolls);
     }
     return 0;
 }
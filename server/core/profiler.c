@@ -0,0 +1,558 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file profiler.c - A sampling profiler of the polling threads
+ *
+ * A sample is stored in the buffer of the thread as the number of frames
+ * followed by the addresses of the frames, innermost first. Only the thread
+ * itself writes to its buffer, from the signal handler, and it publishes a
+ * sample by updating the used count of the buffer. The samples can be read
+ * while the profiler is running.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/2016   MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <profiler.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <dcb.h>
+#include <spinlock.h>
+#include <log_manager.h>
+#include <platform.h>
+#include <utils.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/**
+ * The profiling state of a thread
+ */
+typedef struct profile_thread
+{
+    int       id;         /*< The ID of the polling thread */
+    pid_t     tid;        /*< The kernel thread ID */
+    pthread_t thread;     /*< The thread */
+    uintptr_t stack_lo;   /*< Lowest address of the stack */
+    uintptr_t stack_hi;   /*< Highest address of the stack */
+    timer_t   timer;      /*< The timer sending SIGPROF to the thread */
+    bool      has_timer;  /*< Whether the timer has been created */
+    uintptr_t *buf;       /*< The samples */
+    size_t    used;       /*< Number of words used in buf */
+    unsigned long samples; /*< Number of samples recorded */
+    unsigned long dropped; /*< Number of samples dropped because buf was full */
+    struct profile_thread *next;
+} PROFILE_THREAD;
+
+static SPINLOCK profile_lock = SPINLOCK_INIT;
+static PROFILE_THREAD *profile_threads = NULL;
+static thread_local PROFILE_THREAD *current_thread = NULL;
+static volatile bool profile_active = false;
+static volatile bool profile_stacks = false;
+static bool handler_installed = false;
+
+/**
+ * The SIGPROF handler. Records the current stack of the thread.
+ */
+static void
+profiler_signal(int sig, siginfo_t *info, void *context)
+{
+    PROFILE_THREAD *thr = current_thread;
+    ucontext_t *uc = (ucontext_t *)context;
+    uintptr_t pc, fp;
+
+    if (thr == NULL || thr->buf == NULL || !profile_active)
+    {
+        return;
+    }
+
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+#else
+    return;
+#endif
+
+    int max_depth = profile_stacks ? PROFILER_MAX_DEPTH : 1;
+    size_t pos = thr->used;
+
+    if (pos + 1 + max_depth > PROFILER_BUFFER_WORDS)
+    {
+        thr->dropped++;
+        return;
+    }
+
+    uintptr_t *rec = &thr->buf[pos];
+    int depth = 0;
+    rec[1 + depth++] = pc;
+
+    /** Follow the frame pointers as long as they point upwards in the stack */
+    while (depth < max_depth && fp >= thr->stack_lo &&
+           fp + 2 * sizeof(uintptr_t) <= thr->stack_hi &&
+           (fp & (sizeof(uintptr_t) - 1)) == 0)
+    {
+        uintptr_t *frame = (uintptr_t *)fp;
+        uintptr_t next = frame[0];
+
+        if (frame[1] == 0)
+        {
+            break;
+        }
+        rec[1 + depth++] = frame[1];
+
+        if (next <= fp)
+        {
+            break;
+        }
+        fp = next;
+    }
+
+    rec[0] = depth;
+    thr->samples++;
+    __atomic_store_n(&thr->used, pos + 1 + depth, __ATOMIC_RELEASE);
+}
+
+/**
+ * Register the calling thread with the profiler. Called by each polling
+ * thread when it starts.
+ *
+ * @param thread_id The ID of the polling thread
+ */
+void
+profiler_thread_init(int thread_id)
+{
+    PROFILE_THREAD *thr = (PROFILE_THREAD *)calloc(1, sizeof(PROFILE_THREAD));
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+
+    if (thr == NULL)
+    {
+        return;
+    }
+
+    thr->id = thread_id;
+    thr->tid = syscall(SYS_gettid);
+    thr->thread = pthread_self();
+
+    if (pthread_getattr_np(thr->thread, &attr) == 0)
+    {
+        if (pthread_attr_getstack(&attr, &addr, &size) == 0)
+        {
+            thr->stack_lo = (uintptr_t)addr;
+            thr->stack_hi = (uintptr_t)addr + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    current_thread = thr;
+
+    spinlock_acquire(&profile_lock);
+    thr->next = profile_threads;
+    profile_threads = thr;
+    spinlock_release(&profile_lock);
+}
+
+/**
+ * Create and arm the profiling timer of a thread. Called with the
+ * profile_lock held.
+ *
+ * @param thr           The thread
+ * @param interval      The sampling interval
+ * @return True if the timer was started
+ */
+static bool
+profiler_start_thread(PROFILE_THREAD *thr, struct itimerspec *interval)
+{
+    struct sigevent sev;
+    clockid_t clock;
+    char errbuf[STRERROR_BUFLEN];
+    int err;
+
+    if (thr->buf == NULL &&
+        (thr->buf = (uintptr_t *)malloc(PROFILER_BUFFER_WORDS * sizeof(uintptr_t))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate the profiling buffer of thread %d.", thr->id);
+        return false;
+    }
+
+    thr->used = 0;
+    thr->samples = 0;
+    thr->dropped = 0;
+
+    if ((err = pthread_getcpuclockid(thr->thread, &clock)) != 0)
+    {
+        MXS_ERROR("Failed to get the CPU clock of thread %d: %d, %s",
+                  thr->id, err, strerror_r(err, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = thr->tid;
+
+    if (timer_create(clock, &sev, &thr->timer) != 0)
+    {
+        MXS_ERROR("Failed to create the profiling timer of thread %d: %d, %s",
+                  thr->id, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    thr->has_timer = true;
+
+    if (timer_settime(thr->timer, 0, interval, NULL) != 0)
+    {
+        MXS_ERROR("Failed to start the profiling timer of thread %d: %d, %s",
+                  thr->id, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Stop the profiling timers. Called with the profile_lock held.
+ */
+static void
+profiler_stop_threads()
+{
+    profile_active = false;
+
+    for (PROFILE_THREAD *thr = profile_threads; thr; thr = thr->next)
+    {
+        if (thr->has_timer)
+        {
+            timer_delete(thr->timer);
+            thr->has_timer = false;
+        }
+    }
+}
+
+/**
+ * Start profiling the registered threads. The samples of the previous
+ * profiling run are discarded.
+ *
+ * @param frequency     Samples per second of CPU time of each thread
+ * @param stacks        Whether to record the stacks or only the instruction pointers
+ * @return True if the profiler was started
+ */
+bool
+profiler_start(int frequency, bool stacks)
+{
+    struct itimerspec interval;
+    bool rval = true;
+
+    if (frequency <= 0 || frequency > PROFILER_MAX_FREQUENCY)
+    {
+        MXS_ERROR("Invalid profiling frequency %d, the frequency must be between 1 and %d.",
+                  frequency, PROFILER_MAX_FREQUENCY);
+        return false;
+    }
+
+    spinlock_acquire(&profile_lock);
+
+    if (profile_active)
+    {
+        spinlock_release(&profile_lock);
+        MXS_ERROR("The profiler is already running.");
+        return false;
+    }
+
+    if (!handler_installed)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = profiler_signal;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+
+        if (sigaction(SIGPROF, &sa, NULL) != 0)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            spinlock_release(&profile_lock);
+            MXS_ERROR("Failed to install the SIGPROF handler: %d, %s",
+                      errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+            return false;
+        }
+        handler_installed = true;
+    }
+
+    interval.it_interval.tv_sec = 0;
+    interval.it_interval.tv_nsec = 1000000000L / frequency;
+    interval.it_value = interval.it_interval;
+
+    profile_stacks = stacks;
+    profile_active = true;
+
+    for (PROFILE_THREAD *thr = profile_threads; thr && rval; thr = thr->next)
+    {
+        rval = profiler_start_thread(thr, &interval);
+    }
+
+    if (!rval)
+    {
+        profiler_stop_threads();
+    }
+
+    spinlock_release(&profile_lock);
+
+    if (rval)
+    {
+        MXS_NOTICE("Started profiling at %d samples per second%s.", frequency,
+                   stacks ? " with stacks" : "");
+    }
+
+    return rval;
+}
+
+/**
+ * Stop profiling. The recorded samples are kept until the profiler is
+ * started again.
+ */
+void
+profiler_stop()
+{
+    spinlock_acquire(&profile_lock);
+    bool was_active = profile_active;
+    profiler_stop_threads();
+    spinlock_release(&profile_lock);
+
+    if (was_active)
+    {
+        MXS_NOTICE("Stopped profiling.");
+    }
+}
+
+/**
+ * Check whether the profiler is running
+ *
+ * @return True if the profiler is running
+ */
+bool
+profiler_running()
+{
+    return profile_active;
+}
+
+/**
+ * A unique stack in the aggregated profile
+ */
+typedef struct
+{
+    uintptr_t *frames;  /*< The frames, innermost first */
+    int       depth;    /*< Number of frames */
+    unsigned long count; /*< Number of samples with the stack */
+    char      *folded;  /*< The names of the frames, outermost first */
+} PROFILE_STACK;
+
+static int
+profile_stack_cmp(const void *a, const void *b)
+{
+    return strcmp(((const PROFILE_STACK *)a)->folded, ((const PROFILE_STACK *)b)->folded);
+}
+
+static uint64_t
+profile_stack_hash(uintptr_t *frames, int depth)
+{
+    return mxs_fnv1a64(MXS_FNV1A64_INIT, frames, depth * sizeof(frames[0]));
+}
+
+/**
+ * Append the name of a frame to a folded stack line
+ *
+ * @param line  The line
+ * @param size  Size of the line
+ * @param len   Current length of the line
+ * @param addr  The address of the frame
+ * @param ret   Whether the address is a return address
+ * @return The new length of the line
+ */
+static int
+profile_frame_name(char *line, int size, int len, uintptr_t addr, bool ret)
+{
+    Dl_info info;
+    /** A return address may already be past the end of the calling function */
+    void *lookup = (void *)(ret ? addr - 1 : addr);
+    int n;
+
+    if (len >= size)
+    {
+        return len;
+    }
+
+    const char *sep = len ? ";" : "";
+    bool found = dladdr(lookup, &info) != 0;
+
+    if (found && info.dli_sname)
+    {
+        n = snprintf(line + len, size - len, "%s%s", sep, info.dli_sname);
+    }
+    else if (found && info.dli_fname)
+    {
+        const char *file = strrchr(info.dli_fname, '/');
+        n = snprintf(line + len, size - len, "%s%s+0x%lx", sep,
+                     file ? file + 1 : info.dli_fname,
+                     (unsigned long)((uintptr_t)lookup - (uintptr_t)info.dli_fbase));
+    }
+    else
+    {
+        n = snprintf(line + len, size - len, "%s0x%lx", sep, (unsigned long)addr);
+    }
+
+    return len + n < size ? len + n : size;
+}
+
+/**
+ * Print the recorded samples as folded stacks, one unique stack per line
+ * with the outermost frame first, followed by the number of samples.
+ *
+ * @param dcb   The DCB to print to
+ */
+void
+dprintProfile(DCB *dcb)
+{
+    size_t n_samples = 0;
+    unsigned long dropped = 0;
+
+    spinlock_acquire(&profile_lock);
+
+    for (PROFILE_THREAD *thr = profile_threads; thr; thr = thr->next)
+    {
+        n_samples += thr->samples;
+        dropped += thr->dropped;
+    }
+
+    size_t size = 64;
+    while (size < n_samples * 2)
+    {
+        size *= 2;
+    }
+
+    PROFILE_STACK *stacks = (PROFILE_STACK *)calloc(size, sizeof(PROFILE_STACK));
+
+    if (stacks == NULL)
+    {
+        spinlock_release(&profile_lock);
+        dcb_printf(dcb, "Failed to allocate memory for the profile.\n");
+        return;
+    }
+
+    size_t n_stacks = 0;
+
+    for (PROFILE_THREAD *thr = profile_threads; thr; thr = thr->next)
+    {
+        size_t used = thr->buf ? __atomic_load_n(&thr->used, __ATOMIC_ACQUIRE) : 0;
+        size_t pos = 0;
+
+        while (pos < used && n_stacks < size / 2)
+        {
+            int depth = thr->buf[pos];
+            uintptr_t *frames = &thr->buf[pos + 1];
+            size_t slot = profile_stack_hash(frames, depth) & (size - 1);
+
+            while (stacks[slot].frames &&
+                   (stacks[slot].depth != depth ||
+                    memcmp(stacks[slot].frames, frames, depth * sizeof(uintptr_t)) != 0))
+            {
+                slot = (slot + 1) & (size - 1);
+            }
+
+            if (stacks[slot].frames == NULL)
+            {
+                stacks[slot].frames = frames;
+                stacks[slot].depth = depth;
+                n_stacks++;
+            }
+            stacks[slot].count++;
+            pos += 1 + depth;
+        }
+    }
+
+    /** The buffers are never freed so the frames stay valid. The lock is
+     * released as resolving the symbols is slow. */
+    spinlock_release(&profile_lock);
+
+    if (n_stacks == 0)
+    {
+        dcb_printf(dcb, "No samples have been recorded, start the profiler with "
+                   "'enable profiler <frequency>'.\n");
+    }
+
+    /** Stacks that only differ by the addresses within the same functions
+     * have the same names, they are merged by sorting the names */
+    size_t n_named = 0;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (stacks[i].frames)
+        {
+            char line[PROFILER_MAX_DEPTH * 128];
+            int len = 0;
+
+            for (int j = stacks[i].depth - 1; j >= 0; j--)
+            {
+                len = profile_frame_name(line, sizeof(line), len, stacks[i].frames[j], j > 0);
+            }
+
+            if ((stacks[n_named].folded = strdup(line)) != NULL)
+            {
+                stacks[n_named].count = stacks[i].count;
+                n_named++;
+            }
+        }
+    }
+
+    qsort(stacks, n_named, sizeof(PROFILE_STACK), profile_stack_cmp);
+
+    for (size_t i = 0; i < n_named; i++)
+    {
+        unsigned long count = stacks[i].count;
+
+        while (i + 1 < n_named && strcmp(stacks[i].folded, stacks[i + 1].folded) == 0)
+        {
+            free(stacks[i].folded);
+            count += stacks[++i].count;
+        }
+
+        dcb_printf(dcb, "%s %lu\n", stacks[i].folded, count);
+        free(stacks[i].folded);
+    }
+
+    if (dropped)
+    {
+        MXS_WARNING("The profiling buffers were full, %lu samples were dropped.", dropped);
+    }
+
+    free(stacks);
+}
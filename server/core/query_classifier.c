@@ -11,10 +11,17 @@
  * Public License.
  */
 
+#include <ctype.h>
 #include <query_classifier.h>
 #include <log_manager.h>
 #include <modules.h>
 #include <modutil.h>
+#include <maxconfig.h>
+#include <platform.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <mysql_client_server_protocol.h>
+#include <utils.h>
 
 //#define QC_TRACE_ENABLED
 #undef QC_TRACE_ENABLED
@@ -29,6 +36,85 @@ static const char default_qc_name[] = "qc_sqlite";
 
 static QUERY_CLASSIFIER* classifier;
 
+/**
+ * The query classification cache
+ *
+ * Each thread has a bounded LRU cache of classification results keyed by the
+ * statement with its literals replaced by '?'. Only statements that were
+ * fully parsed and are real queries (SELECT, INSERT, UPDATE, DELETE and their
+ * variations) are cached; the classification of e.g. SET statements depends
+ * on the literals. When a buffer is classified, the cache entry is attached
+ * to it and the information requested later is served from the entry.
+ */
+#define QC_CACHE_MAX_KEY 2048 /*< Longer statements are not cached */
+
+typedef struct qc_cache_entry
+{
+    uint64_t hash;                   /*< The hash of the key */
+    char* key;                       /*< The statement with the literals stripped */
+    size_t key_len;                  /*< The length of the key */
+    int refcount;                    /*< References from the cache and buffers */
+    qc_parse_result_t parse_result;  /*< The result of parsing */
+    uint32_t types;                  /*< The types of the query */
+    qc_query_op_t operation;         /*< The operation of the query */
+    bool is_real_query;              /*< Whether the query is a real query */
+    bool has_clause;                 /*< Whether the query has a WHERE or HAVING clause */
+    bool is_drop_table;              /*< Whether the query is a DROP TABLE */
+    char* created_table_name;        /*< The name of a created table */
+    char** table_names;              /*< The table names, NULL terminated */
+    int n_table_names;               /*< Number of table names */
+    char** table_fullnames;          /*< The qualified table names, NULL terminated */
+    int n_table_fullnames;           /*< Number of qualified table names */
+    char* affected_fields;           /*< The affected fields */
+    char** database_names;           /*< The database names, NULL terminated */
+    int n_database_names;            /*< Number of database names */
+    struct qc_cache_entry* hnext;    /*< The next entry in the hash bucket */
+    struct qc_cache_entry* prev;     /*< The previous entry in LRU order */
+    struct qc_cache_entry* next;     /*< The next entry in LRU order */
+} QC_CACHE_ENTRY;
+
+typedef struct qc_cache
+{
+    QC_CACHE_ENTRY** buckets;        /*< The hash buckets */
+    size_t n_buckets;                /*< Number of hash buckets, a power of two */
+    size_t max_entries;              /*< Maximum number of entries */
+    QC_CACHE_ENTRY* head;            /*< The most recently used entry */
+    QC_CACHE_ENTRY* tail;            /*< The least recently used entry */
+    QC_CACHE_STATS stats;            /*< The statistics of the cache */
+    struct qc_cache* next;           /*< The next cache */
+} QC_CACHE;
+
+static QC_CACHE* all_caches = NULL;
+static SPINLOCK caches_lock = SPINLOCK_INIT;
+static thread_local QC_CACHE* this_cache = NULL;
+
+/**
+ * The canonical form of a statement
+ *
+ * A statement is scanned once, when it is looked up in the classification
+ * cache or when its canonical hash or literals are asked for. The scan
+ * replaces the literals with '?', records them and computes the hash of the
+ * result. What the scan found and the cache entry of the statement are
+ * attached to the buffer.
+ */
+typedef struct qc_canonical
+{
+    uint64_t hash;                   /*< The hash of the canonical form */
+    char* key;                       /*< The canonical form, NULL if too long to be cached */
+    size_t key_len;                  /*< The length of the key */
+    bool looked_up;                  /*< Whether the cache has been searched */
+    QC_CACHE_ENTRY* entry;           /*< The cache entry of the statement, if any */
+    int n_literals;                  /*< Number of literals */
+    QC_LITERAL literals[];           /*< The literals in the order they appear */
+} QC_CANONICAL;
+
+/** The literals found by the scan of the calling thread */
+static thread_local QC_LITERAL* scan_literals = NULL;
+static thread_local int scan_capacity = 0;
+
+static QC_CACHE_ENTRY* qc_cache_get(GWBUF* query);
+static bool qc_is_oversized(GWBUF* query);
+
 
 bool qc_init(const char* plugin_name, const char* plugin_args)
 {
@@ -83,12 +169,127 @@ void qc_unload(QUERY_CLASSIFIER* classifier)
     // TODO: actually can unload something.
 }
 
+static char** qc_cache_copy_names(char** names, int n)
+{
+    char** copy = NULL;
+
+    if (names && (copy = (char**) malloc((n + 1) * sizeof(char*))))
+    {
+        for (int i = 0; i < n; i++)
+        {
+            copy[i] = strdup(names[i]);
+        }
+        copy[n] = NULL;
+    }
+
+    return copy;
+}
+
+static void qc_cache_free_names(char** names, int n)
+{
+    if (names)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            free(names[i]);
+        }
+        free(names);
+    }
+}
+
+static void qc_cache_entry_release(void* data)
+{
+    QC_CACHE_ENTRY* entry = (QC_CACHE_ENTRY*) data;
+
+    if (atomic_add(&entry->refcount, -1) == 1)
+    {
+        free(entry->key);
+        free(entry->created_table_name);
+        qc_cache_free_names(entry->table_names, entry->n_table_names);
+        qc_cache_free_names(entry->table_fullnames, entry->n_table_fullnames);
+        free(entry->affected_fields);
+        qc_cache_free_names(entry->database_names, entry->n_database_names);
+        free(entry);
+    }
+}
+
+/**
+ * Create the query classification cache of the calling thread
+ *
+ * @return True if the cache is disabled or was created
+ */
+static bool qc_cache_thread_init(void)
+{
+    size_t max_entries = config_qc_cache_size();
+
+    if (max_entries == 0 || this_cache)
+    {
+        return true;
+    }
+
+    QC_CACHE* cache = (QC_CACHE*) calloc(1, sizeof(QC_CACHE));
+
+    if (cache)
+    {
+        cache->n_buckets = 1;
+        while (cache->n_buckets < 2 * max_entries)
+        {
+            cache->n_buckets <<= 1;
+        }
+
+        if ((cache->buckets = (QC_CACHE_ENTRY**) calloc(cache->n_buckets, sizeof(QC_CACHE_ENTRY*))))
+        {
+            cache->max_entries = max_entries;
+
+            spinlock_acquire(&caches_lock);
+            cache->next = all_caches;
+            all_caches = cache;
+            spinlock_release(&caches_lock);
+
+            this_cache = cache;
+            return true;
+        }
+
+        free(cache);
+    }
+
+    MXS_ERROR("Failed to allocate the query classification cache.");
+    return false;
+}
+
+/**
+ * Empty the query classification cache of the calling thread. The cache
+ * itself is kept so that its statistics remain available.
+ */
+static void qc_cache_thread_end(void)
+{
+    QC_CACHE* cache = this_cache;
+
+    if (cache)
+    {
+        QC_CACHE_ENTRY* entry = cache->head;
+
+        while (entry)
+        {
+            QC_CACHE_ENTRY* next = entry->next;
+            qc_cache_entry_release(entry);
+            entry = next;
+        }
+
+        memset(cache->buckets, 0, cache->n_buckets * sizeof(QC_CACHE_ENTRY*));
+        cache->head = NULL;
+        cache->tail = NULL;
+        cache->stats.entries = 0;
+        this_cache = NULL;
+    }
+}
+
 bool qc_thread_init(void)
 {
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_thread_init();
+    return classifier->qc_thread_init() && qc_cache_thread_init();
 }
 
 void qc_thread_end(void)
@@ -96,9 +297,473 @@ void qc_thread_end(void)
     QC_TRACE();
     ss_dassert(classifier);
 
+    qc_cache_thread_end();
+
+    free(scan_literals);
+    scan_literals = NULL;
+    scan_capacity = 0;
+
     return classifier->qc_thread_end();
 }
 
+/**
+ * The state of the scan of a statement
+ */
+typedef struct qc_scan
+{
+    char key[QC_CACHE_MAX_KEY];      /*< The start of the canonical form */
+    size_t key_len;                  /*< The length of the canonical form */
+    uint64_t hash;                   /*< The hash of the canonical form */
+    int n_literals;                  /*< Number of literals in scan_literals */
+} QC_SCAN;
+
+static inline void qc_scan_put(QC_SCAN* scan, char c)
+{
+    scan->hash = mxs_fnv1a64_byte(scan->hash, c);
+
+    if (scan->key_len < QC_CACHE_MAX_KEY)
+    {
+        scan->key[scan->key_len] = c;
+    }
+
+    scan->key_len++;
+}
+
+static bool qc_scan_add_literal(QC_SCAN* scan, qc_literal_type_t type, const char* value, size_t len)
+{
+    if (scan->n_literals == scan_capacity)
+    {
+        int capacity = scan_capacity ? 2 * scan_capacity : 16;
+        QC_LITERAL* literals = (QC_LITERAL*) realloc(scan_literals, capacity * sizeof(QC_LITERAL));
+
+        if (literals == NULL)
+        {
+            return false;
+        }
+
+        scan_literals = literals;
+        scan_capacity = capacity;
+    }
+
+    QC_LITERAL* literal = &scan_literals[scan->n_literals++];
+    literal->type = type;
+    literal->value = value;
+    literal->len = len;
+
+    return true;
+}
+
+/**
+ * Scan a statement, replacing the string and numeric literals with '?' and
+ * the comments with a space, so that quotes inside comments do not start
+ * literals. The command byte is included in the canonical form. The literals
+ * are recorded in scan_literals of the calling thread.
+ *
+ * @param scan    The state of the scan
+ * @param command The command of the packet
+ * @param sql     The statement
+ * @param len     The length of the statement
+ * @return True if the statement was scanned, false if memory allocation failed
+ */
+static bool qc_scan_statement(QC_SCAN* scan, uint8_t command, const char* sql, size_t len)
+{
+    const char* end = sql + len;
+    const char* p = sql;
+
+    scan->key_len = 0;
+    scan->hash = MXS_FNV1A64_INIT;
+    scan->n_literals = 0;
+
+    qc_scan_put(scan, command);
+
+    while (p < end)
+    {
+        unsigned char c = *p;
+
+        if (c == '\'')
+        {
+            /** A string literal, '' and \' do not end it */
+            const char* start = ++p;
+            while (p < end && !(*p == '\'' && (p + 1 == end || p[1] != '\'')))
+            {
+                p += (*p == '\\' || *p == '\'') && p + 1 < end ? 2 : 1;
+            }
+
+            if (!qc_scan_add_literal(scan, QC_LITERAL_STRING, start, (p < end ? p : end) - start))
+            {
+                return false;
+            }
+            p++;
+            qc_scan_put(scan, '?');
+        }
+        else if (isdigit(c) && (p == sql || !(isalnum((unsigned char)p[-1]) || p[-1] == '_' || p[-1] == '$')))
+        {
+            /** A numeric literal that is not the end of an identifier */
+            const char* start = p;
+            bool integer = true;
+            while (p < end && (isalnum((unsigned char)*p) || *p == '.'))
+            {
+                integer = integer && isdigit((unsigned char)*p);
+                p++;
+            }
+
+            qc_literal_type_t type = integer ? QC_LITERAL_INTEGER :
+                (p - start > 2 && start[0] == '0' && (start[1] == 'x' || start[1] == 'X')) ?
+                QC_LITERAL_HEX : QC_LITERAL_DECIMAL;
+
+            if (!qc_scan_add_literal(scan, type, start, p - start))
+            {
+                return false;
+            }
+            qc_scan_put(scan, '?');
+        }
+        else if (c == '/' && p + 1 < end && p[1] == '*' &&
+                 !(p + 2 < end && (p[2] == '!' || (p[2] == 'M' && p + 3 < end && p[3] == '!'))))
+        {
+            /** A comment, the executable comments are scanned as statement text */
+            p += 2;
+            while (p < end && !(*p == '*' && p + 1 < end && p[1] == '/'))
+            {
+                p++;
+            }
+            p = p < end ? p + 2 : end;
+            qc_scan_put(scan, ' ');
+        }
+        else if (c == '#' || (c == '-' && p + 2 <= end && p[1] == '-' &&
+                              (p + 2 == end || isspace((unsigned char)p[2]) || iscntrl((unsigned char)p[2]))))
+        {
+            /** A comment to the end of the line */
+            while (p < end && *p != '\n')
+            {
+                p++;
+            }
+            qc_scan_put(scan, ' ');
+        }
+        else if (c == '`' || c == '"')
+        {
+            /** A quoted identifier or a string that is kept as is */
+            qc_scan_put(scan, *p++);
+            while (p < end && *p != c)
+            {
+                qc_scan_put(scan, *p++);
+            }
+
+            if (p < end)
+            {
+                qc_scan_put(scan, *p++);
+            }
+        }
+        else
+        {
+            qc_scan_put(scan, c);
+            p++;
+        }
+    }
+
+    return true;
+}
+
+static void qc_canonical_free(void* data)
+{
+    QC_CANONICAL* canon = (QC_CANONICAL*) data;
+
+    if (canon->entry)
+    {
+        qc_cache_entry_release(canon->entry);
+    }
+
+    free(canon);
+}
+
+/**
+ * Get the canonical form of a statement. The statement is scanned once and the
+ * result is attached to the buffer.
+ *
+ * @param query The statement
+ * @return The canonical form or NULL if the buffer does not contain a COM_QUERY
+ *         or a COM_STMT_PREPARE, or if memory allocation failed
+ */
+static QC_CANONICAL* qc_canonical_get(GWBUF* query)
+{
+    QC_CANONICAL* canon = (QC_CANONICAL*) gwbuf_get_buffer_object_data(query, GWBUF_QC_CANONICAL);
+
+    if (canon || GWBUF_LENGTH(query) < MYSQL_HEADER_LEN + 1)
+    {
+        return canon;
+    }
+
+    uint8_t* data = (uint8_t*) GWBUF_DATA(query);
+    size_t len = MYSQL_GET_PACKET_LEN(data) - 1;
+
+    if (GWBUF_LENGTH(query) < MYSQL_HEADER_LEN + 1 + len ||
+        (data[MYSQL_HEADER_LEN] != MYSQL_COM_QUERY && data[MYSQL_HEADER_LEN] != MYSQL_COM_STMT_PREPARE))
+    {
+        return NULL;
+    }
+
+    QC_SCAN scan;
+
+    if (!qc_scan_statement(&scan, data[MYSQL_HEADER_LEN], (char*) &data[MYSQL_HEADER_LEN + 1], len))
+    {
+        return NULL;
+    }
+
+    /** Statements with a longer canonical form are not cached */
+    size_t key_len = scan.key_len < QC_CACHE_MAX_KEY ? scan.key_len : 0;
+    size_t literals_size = scan.n_literals * sizeof(QC_LITERAL);
+
+    if ((canon = (QC_CANONICAL*) malloc(sizeof(QC_CANONICAL) + literals_size + key_len)) == NULL)
+    {
+        return NULL;
+    }
+
+    canon->hash = scan.hash;
+    canon->key = key_len ? (char*) canon->literals + literals_size : NULL;
+    canon->key_len = key_len;
+    canon->looked_up = false;
+    canon->entry = NULL;
+    canon->n_literals = scan.n_literals;
+
+    if (literals_size)
+    {
+        memcpy(canon->literals, scan_literals, literals_size);
+    }
+
+    if (key_len)
+    {
+        memcpy(canon->key, scan.key, key_len);
+    }
+
+    gwbuf_add_buffer_object(query, GWBUF_QC_CANONICAL, canon, qc_canonical_free);
+
+    return canon;
+}
+
+static void qc_cache_unlink(QC_CACHE* cache, QC_CACHE_ENTRY* entry)
+{
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        cache->head = entry->next;
+    }
+
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        cache->tail = entry->prev;
+    }
+}
+
+static void qc_cache_push_front(QC_CACHE* cache, QC_CACHE_ENTRY* entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+
+    if (cache->head)
+    {
+        cache->head->prev = entry;
+    }
+    else
+    {
+        cache->tail = entry;
+    }
+
+    cache->head = entry;
+}
+
+static void qc_cache_evict(QC_CACHE* cache)
+{
+    QC_CACHE_ENTRY* entry = cache->tail;
+    QC_CACHE_ENTRY** pp = &cache->buckets[entry->hash & (cache->n_buckets - 1)];
+
+    while (*pp != entry)
+    {
+        pp = &(*pp)->hnext;
+    }
+
+    *pp = entry->hnext;
+    qc_cache_unlink(cache, entry);
+    cache->stats.entries--;
+    cache->stats.evictions++;
+    qc_cache_entry_release(entry);
+}
+
+/**
+ * Classify a statement with the classifier and store the results in a new
+ * cache entry
+ *
+ * @param query The statement
+ * @return A new entry or NULL if the statement cannot be cached
+ */
+static QC_CACHE_ENTRY* qc_cache_classify(GWBUF* query)
+{
+    QC_CACHE_ENTRY* entry = NULL;
+    // The entry is shared by all statements with the same key, so everything is collected.
+    qc_parse_result_t result = classifier->qc_parse(query, QC_COLLECT_ALL);
+
+    if (result == QC_QUERY_PARSED && classifier->qc_is_real_query(query) &&
+        (entry = (QC_CACHE_ENTRY*) calloc(1, sizeof(QC_CACHE_ENTRY))))
+    {
+        entry->parse_result = result;
+        entry->types = classifier->qc_get_type(query);
+        entry->operation = classifier->qc_get_operation(query);
+        entry->is_real_query = true;
+        entry->has_clause = classifier->qc_query_has_clause(query);
+        entry->is_drop_table = classifier->qc_is_drop_table_query(query);
+        entry->created_table_name = classifier->qc_get_created_table_name(query);
+        entry->table_names = classifier->qc_get_table_names(query, &entry->n_table_names, false);
+        entry->table_fullnames = classifier->qc_get_table_names(query, &entry->n_table_fullnames, true);
+        entry->affected_fields = classifier->qc_get_affected_fields(query);
+        entry->database_names = classifier->qc_get_database_names(query, &entry->n_database_names);
+    }
+
+    return entry;
+}
+
+/**
+ * Get the cache entry of a statement. If the statement has not been looked up
+ * yet, the cache of the calling thread is searched and on a miss, the
+ * statement is classified and added to the cache.
+ *
+ * @param query The statement
+ * @return The entry or NULL if the statement is not cached
+ */
+static QC_CACHE_ENTRY* qc_cache_get(GWBUF* query)
+{
+    QC_CACHE* cache = this_cache;
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    QC_CANONICAL* canon = (QC_CANONICAL*) gwbuf_get_buffer_object_data(query, GWBUF_QC_CANONICAL);
+
+    if (canon == NULL && (GWBUF_IS_PARSED(query) || (canon = qc_canonical_get(query)) == NULL))
+    {
+        /** Either already parsed by the classifier or not a statement that is cached */
+        return NULL;
+    }
+
+    if (canon->looked_up || canon->key == NULL)
+    {
+        return canon->entry;
+    }
+
+    /** The buffer will not be looked up again even if the statement cannot be cached */
+    canon->looked_up = true;
+
+    QC_CACHE_ENTRY* entry;
+    QC_CACHE_ENTRY** bucket = &cache->buckets[canon->hash & (cache->n_buckets - 1)];
+
+    for (entry = *bucket; entry; entry = entry->hnext)
+    {
+        if (entry->hash == canon->hash && entry->key_len == canon->key_len &&
+            memcmp(entry->key, canon->key, canon->key_len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (entry)
+    {
+        cache->stats.hits++;
+
+        if (entry != cache->head)
+        {
+            qc_cache_unlink(cache, entry);
+            qc_cache_push_front(cache, entry);
+        }
+    }
+    else
+    {
+        cache->stats.misses++;
+
+        if ((entry = qc_cache_classify(query)) == NULL)
+        {
+            return NULL;
+        }
+
+        if ((entry->key = (char*) malloc(canon->key_len)) == NULL)
+        {
+            entry->refcount = 1;
+            qc_cache_entry_release(entry);
+            return NULL;
+        }
+
+        memcpy(entry->key, canon->key, canon->key_len);
+        entry->key_len = canon->key_len;
+        entry->hash = canon->hash;
+        entry->refcount = 1;
+
+        if (cache->stats.entries >= cache->max_entries)
+        {
+            qc_cache_evict(cache);
+        }
+
+        entry->hnext = *bucket;
+        *bucket = entry;
+        qc_cache_push_front(cache, entry);
+        cache->stats.entries++;
+    }
+
+    atomic_add(&entry->refcount, 1);
+    canon->entry = entry;
+
+    return entry;
+}
+
+/**
+ * Check whether a statement is too large to be classified. Parsing a statement
+ * of several megabytes, e.g. a batch INSERT, takes long enough to stall the
+ * other sessions of the polling thread, so above the configured size the
+ * classifier is not used and the getters return conservative values instead:
+ * the statement is an unparsed write that modifies nothing that is known.
+ *
+ * @param query The statement
+ * @return True if the statement must not be classified
+ */
+static bool qc_is_oversized(GWBUF* query)
+{
+    int max_size = config_qc_max_size();
+
+    if (max_size > 0 && gwbuf_length(query) > (unsigned int)max_size)
+    {
+        MXS_INFO("Statement of %u bytes exceeds query_classifier_max_size, "
+                 "not classifying it.", gwbuf_length(query));
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Get the statistics of the query classification caches. The values are
+ * summed over the caches of all threads without locking the caches.
+ *
+ * @param stats Where the statistics are stored
+ */
+void qc_get_cache_stats(QC_CACHE_STATS* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    spinlock_acquire(&caches_lock);
+    for (QC_CACHE* cache = all_caches; cache; cache = cache->next)
+    {
+        stats->hits += cache->stats.hits;
+        stats->misses += cache->stats.misses;
+        stats->evictions += cache->stats.evictions;
+        stats->entries += cache->stats.entries;
+    }
+    spinlock_release(&caches_lock);
+}
+
 /**
  * Parses the query in the provided buffer and returns a value specifying
  * to what extent the query could be parsed.
@@ -108,17 +773,33 @@ void qc_thread_end(void)
  * a query is asked for, the query will be parsed if it has not been parsed
  * yet. Also, if the query in the provided buffer has been parsed already
  * then this function will only return the result of that parsing; the query
- * will not be parsed again.
+ * will not be parsed again, unless information that was not collected the
+ * first time is now asked for.
+ *
+ * The getters collect what they need themselves, so @c collect only needs to
+ * specify what the caller is going to ask for; collecting only the essentials
+ * makes e.g. the type mask considerably cheaper to obtain.
  *
- * @param query A GWBUF containing an SQL statement.
+ * A statement longer than query_classifier_max_size is not parsed at all and
+ * QC_QUERY_INVALID is returned for it.
+ *
+ * @param query   A GWBUF containing an SQL statement.
+ * @param collect A bitmask of qc_collect_info_t values.
  * @result To what extent the query could be parsed.
  */
-qc_parse_result_t qc_parse(GWBUF* query)
+qc_parse_result_t qc_parse(GWBUF* query, uint32_t collect)
 {
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_parse(query);
+    if (qc_is_oversized(query))
+    {
+        return QC_QUERY_INVALID;
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_get(query);
+
+    return entry ? entry->parse_result : classifier->qc_parse(query, collect);
 }
 
 /**
@@ -126,6 +807,9 @@ qc_parse_result_t qc_parse(GWBUF* query)
  * The result should be tested against specific qc_query_type_t values
  * using the bitwise & operator, never using the == operator.
  *
+ * A statement longer than query_classifier_max_size is always a write, so
+ * that it is routed to the master.
+ *
  * @param query A buffer containing a query.
  *
  * @return A bitmask of type bits.
@@ -135,7 +819,14 @@ uint32_t qc_get_type(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_get_type(query);
+    if (qc_is_oversized(query))
+    {
+        return QUERY_TYPE_WRITE;
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_get(query);
+
+    return entry ? entry->types : classifier->qc_get_type(query);
 }
 
 qc_query_op_t qc_get_operation(GWBUF* query)
@@ -143,7 +834,14 @@ qc_query_op_t qc_get_operation(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_get_operation(query);
+    if (qc_is_oversized(query))
+    {
+        return QUERY_OP_UNDEFINED;
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_get(query);
+
+    return entry ? entry->operation : classifier->qc_get_operation(query);
 }
 
 char* qc_get_created_table_name(GWBUF* query)
@@ -151,6 +849,18 @@ char* qc_get_created_table_name(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
+    if (qc_is_oversized(query))
+    {
+        return NULL;
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_get(query);
+
+    if (entry)
+    {
+        return entry->created_table_name ? strdup(entry->created_table_name) : NULL;
+    }
+
     return classifier->qc_get_created_table_name(query);
 }
 
@@ -159,7 +869,14 @@ bool qc_is_drop_table_query(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_is_drop_table_query(query);
+    if (qc_is_oversized(query))
+    {
+        return false;
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_get(query);
+
+    return entry ? entry->is_drop_table : classifier->qc_is_drop_table_query(query);
 }
 
 bool qc_is_real_query(GWBUF* query)
@@ -167,7 +884,14 @@ bool qc_is_real_query(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_is_real_query(query);
+    if (qc_is_oversized(query))
+    {
+        return true;
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_get(query);
+
+    return entry ? entry->is_real_query : classifier->qc_is_real_query(query);
 }
 
 char** qc_get_table_names(GWBUF* query, int* tblsize, bool fullnames)
@@ -175,9 +899,48 @@ char** qc_get_table_names(GWBUF* query, int* tblsize, bool fullnames)
     QC_TRACE();
     ss_dassert(classifier);
 
+    if (qc_is_oversized(query))
+    {
+        *tblsize = 0;
+        return NULL;
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_get(query);
+
+    if (entry)
+    {
+        *tblsize = fullnames ? entry->n_table_fullnames : entry->n_table_names;
+        return fullnames ?
+            qc_cache_copy_names(entry->table_fullnames, entry->n_table_fullnames) :
+            qc_cache_copy_names(entry->table_names, entry->n_table_names);
+    }
+
     return classifier->qc_get_table_names(query, tblsize, fullnames);
 }
 
+/**
+ * Returns the table names of a cached statement without copying them. The
+ * names belong to the cache entry, which the buffer keeps alive.
+ *
+ * @param query   The statement
+ * @param names   Where the names are stored, NULL if there are none
+ * @param tblsize Where the number of names is stored
+ * @return True if the statement is cached, false if the names must be
+ *         copied with qc_get_table_names
+ */
+bool qc_peek_table_names(GWBUF* query, const char* const** names, int* tblsize)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    QC_CACHE_ENTRY* entry = qc_is_oversized(query) ? NULL : qc_cache_get(query);
+
+    *names = entry ? (const char* const*) entry->table_names : NULL;
+    *tblsize = entry ? entry->n_table_names : 0;
+
+    return entry != NULL;
+}
+
 char* qc_get_canonical(GWBUF* query)
 {
     QC_TRACE();
@@ -192,12 +955,59 @@ char* qc_get_canonical(GWBUF* query)
     }
 }
 
+/**
+ * Returns the hash of the canonical form of a statement, that is, of the
+ * statement with its string and numeric literals replaced by '?'. Statements
+ * that only differ in the values of their literals have the same hash, which
+ * does not depend on the thread or the process.
+ *
+ * @param query A buffer containing a COM_QUERY or a COM_STMT_PREPARE.
+ * @return The hash, or 0 if the buffer contains something else or if
+ *         memory allocation failed.
+ */
+uint64_t qc_get_canonical_hash(GWBUF* query)
+{
+    QC_TRACE();
+
+    QC_CANONICAL* canon = qc_canonical_get(query);
+
+    return canon ? canon->hash : 0;
+}
+
+/**
+ * Returns the literals of a statement in the order they appear. They are
+ * found by the same scan that computes the canonical hash, and that the
+ * classification cache makes when the statement is classified.
+ *
+ * @param query A buffer containing a COM_QUERY or a COM_STMT_PREPARE.
+ * @param sizep On return, the number of literals.
+ * @return The literals, or NULL if there are none. They point to the
+ *         statement in the buffer and must not be freed.
+ */
+const QC_LITERAL* qc_get_literals(GWBUF* query, int* sizep)
+{
+    QC_TRACE();
+
+    QC_CANONICAL* canon = qc_canonical_get(query);
+
+    *sizep = canon ? canon->n_literals : 0;
+
+    return *sizep ? canon->literals : NULL;
+}
+
 bool qc_query_has_clause(GWBUF* query)
 {
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_query_has_clause(query);
+    if (qc_is_oversized(query))
+    {
+        return false;
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_get(query);
+
+    return entry ? entry->has_clause : classifier->qc_query_has_clause(query);
 }
 
 /**
@@ -254,6 +1064,18 @@ char* qc_get_affected_fields(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
+    if (qc_is_oversized(query))
+    {
+        return strdup("");
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_get(query);
+
+    if (entry)
+    {
+        return strdup(entry->affected_fields ? entry->affected_fields : "");
+    }
+
     return classifier->qc_get_affected_fields(query);
 }
 
@@ -262,9 +1084,324 @@ char** qc_get_database_names(GWBUF* query, int* sizep)
     QC_TRACE();
     ss_dassert(classifier);
 
+    if (qc_is_oversized(query))
+    {
+        *sizep = 0;
+        return NULL;
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_get(query);
+
+    if (entry)
+    {
+        *sizep = entry->n_database_names;
+        return qc_cache_copy_names(entry->database_names, entry->n_database_names);
+    }
+
     return classifier->qc_get_database_names(query, sizep);
 }
 
+/**
+ * Returns the literal values that restrict the columns of the rows a statement
+ * reads or modifies. These are the values of the "column = value" and
+ * "column IN (value, ...)" conditions that are combined with AND at the top
+ * level of the WHERE clause of a SELECT, UPDATE or DELETE, and the values of the
+ * columns of each row of an INSERT or REPLACE. Every row the statement uses has
+ * one of the listed values in the listed columns; a column that is not listed
+ * can have any value.
+ *
+ * The values are specific to each statement, so they are never cached.
+ *
+ * @param query The statement.
+ * @param sizep On return, the number of values.
+ * @return The values, or NULL if there are none. Free them with qc_free_field_values().
+ */
+QC_FIELD_VALUE* qc_get_field_values(GWBUF* query, int* sizep)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    *sizep = 0;
+
+    if (qc_is_oversized(query))
+    {
+        return NULL;
+    }
+
+    return classifier->qc_get_field_values ? classifier->qc_get_field_values(query, sizep) : NULL;
+}
+
+/**
+ * Frees the values returned by qc_get_field_values().
+ *
+ * @param values The values, may be NULL.
+ * @param size   The number of values.
+ */
+void qc_free_field_values(QC_FIELD_VALUE* values, int size)
+{
+    if (values)
+    {
+        for (int i = 0; i < size; i++)
+        {
+            free(values[i].table);
+            free(values[i].column);
+            free(values[i].value);
+        }
+
+        free(values);
+    }
+}
+
+/**
+ * The prepared statement registry
+ *
+ * The statements are kept in a hash table, keyed by the statement id, that is
+ * doubled when it has more statements than buckets. Each statement is a copy
+ * of its COM_STMT_PREPARE that has been classified with everything collected,
+ * so the information asked for it is served from the result of that
+ * classification.
+ */
+#define QC_PS_INITIAL_BUCKETS 16
+
+/** The statement id in COM_STMT_PREPARE_OK and in the commands referring to a statement */
+#define QC_PS_ID_OFFSET (MYSQL_HEADER_LEN + 1)
+
+typedef struct qc_ps
+{
+    uint32_t id;                     /*< The id the server gave the statement */
+    GWBUF* stmt;                     /*< The classified COM_STMT_PREPARE */
+    struct qc_ps* next;              /*< The next statement in the bucket */
+} QC_PS;
+
+struct qc_ps_registry
+{
+    QC_PS** buckets;                 /*< The hash buckets */
+    size_t n_buckets;                /*< Number of hash buckets, a power of two */
+    size_t n_stmts;                  /*< Number of statements */
+};
+
+/**
+ * Allocate a prepared statement registry
+ *
+ * @return A new registry or NULL if memory allocation failed
+ */
+QC_PS_REGISTRY* qc_ps_registry_alloc(void)
+{
+    QC_PS_REGISTRY* registry = (QC_PS_REGISTRY*) calloc(1, sizeof(QC_PS_REGISTRY));
+
+    if (registry)
+    {
+        if ((registry->buckets = (QC_PS**) calloc(QC_PS_INITIAL_BUCKETS, sizeof(QC_PS*))))
+        {
+            registry->n_buckets = QC_PS_INITIAL_BUCKETS;
+            return registry;
+        }
+
+        free(registry);
+    }
+
+    MXS_ERROR("Failed to allocate a prepared statement registry.");
+    return NULL;
+}
+
+/**
+ * Free a prepared statement registry and the statements in it
+ *
+ * @param registry The registry, may be NULL
+ */
+void qc_ps_registry_free(QC_PS_REGISTRY* registry)
+{
+    if (registry)
+    {
+        for (size_t i = 0; i < registry->n_buckets; i++)
+        {
+            QC_PS* ps = registry->buckets[i];
+
+            while (ps)
+            {
+                QC_PS* next = ps->next;
+                gwbuf_free(ps->stmt);
+                free(ps);
+                ps = next;
+            }
+        }
+
+        free(registry->buckets);
+        free(registry);
+    }
+}
+
+/**
+ * Find the link to a statement
+ *
+ * @param registry The registry
+ * @param id       The statement id
+ * @return The link pointing to the statement, or to NULL if it is not registered
+ */
+static QC_PS** qc_ps_find(QC_PS_REGISTRY* registry, uint32_t id)
+{
+    QC_PS** link = &registry->buckets[id & (registry->n_buckets - 1)];
+
+    while (*link && (*link)->id != id)
+    {
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+/**
+ * Double the number of buckets of a registry. If memory cannot be allocated,
+ * the registry is left as it is.
+ *
+ * @param registry The registry
+ */
+static void qc_ps_grow(QC_PS_REGISTRY* registry)
+{
+    size_t n_buckets = 2 * registry->n_buckets;
+    QC_PS** buckets = (QC_PS**) calloc(n_buckets, sizeof(QC_PS*));
+
+    if (buckets)
+    {
+        for (size_t i = 0; i < registry->n_buckets; i++)
+        {
+            QC_PS* ps = registry->buckets[i];
+
+            while (ps)
+            {
+                QC_PS* next = ps->next;
+                QC_PS** bucket = &buckets[ps->id & (n_buckets - 1)];
+                ps->next = *bucket;
+                *bucket = ps;
+                ps = next;
+            }
+        }
+
+        free(registry->buckets);
+        registry->buckets = buckets;
+        registry->n_buckets = n_buckets;
+    }
+}
+
+/**
+ * Get the statement id of a command
+ *
+ * @param command A COM_STMT_EXECUTE, COM_STMT_CLOSE or other command referring to a statement
+ * @param id      On return, the id
+ * @return True if the command was long enough to contain an id
+ */
+static bool qc_ps_get_id(GWBUF* command, uint32_t* id)
+{
+    uint8_t data[4];
+
+    if (gwbuf_copy_data(command, QC_PS_ID_OFFSET, sizeof(data), data) == sizeof(data))
+    {
+        *id = gw_mysql_get_byte4(data);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Add a statement the server has prepared to a registry. The statement is
+ * classified now and everything is collected; if the server reused the id,
+ * the earlier statement is replaced.
+ *
+ * @param registry The registry
+ * @param prepare  The COM_STMT_PREPARE, it is copied
+ * @param reply    The reply of the server to the COM_STMT_PREPARE
+ * @return True if the server prepared the statement and it was added
+ */
+bool qc_ps_add(QC_PS_REGISTRY* registry, GWBUF* prepare, GWBUF* reply)
+{
+    uint8_t ok;
+    uint32_t id;
+
+    if (gwbuf_copy_data(reply, MYSQL_HEADER_LEN, 1, &ok) != 1 || ok != 0x00 ||
+        !qc_ps_get_id(reply, &id))
+    {
+        return false;
+    }
+
+    size_t len = gwbuf_length(prepare);
+    GWBUF* stmt = gwbuf_alloc(len);
+    QC_PS* ps = (QC_PS*) malloc(sizeof(QC_PS));
+
+    if (stmt == NULL || ps == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for a prepared statement.");
+        gwbuf_free(stmt);
+        free(ps);
+        return false;
+    }
+
+    gwbuf_copy_data(prepare, 0, len, (uint8_t*) GWBUF_DATA(stmt));
+    qc_parse(stmt, QC_COLLECT_ALL);
+
+    QC_PS** link = qc_ps_find(registry, id);
+
+    if (*link)
+    {
+        gwbuf_free((*link)->stmt);
+        (*link)->stmt = stmt;
+        free(ps);
+    }
+    else
+    {
+        ps->id = id;
+        ps->stmt = stmt;
+        ps->next = NULL;
+        *link = ps;
+
+        if (++registry->n_stmts > registry->n_buckets)
+        {
+            qc_ps_grow(registry);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Get the statement a command refers to. The classification functions can
+ * be called on the returned COM_STMT_PREPARE and the information is served
+ * from the classification made when it was added.
+ *
+ * @param registry The registry
+ * @param command  A COM_STMT_EXECUTE, COM_STMT_CLOSE or other command referring to a statement
+ * @return The COM_STMT_PREPARE of the statement, owned by the registry, or
+ *         NULL if the statement is not registered
+ */
+GWBUF* qc_ps_get(QC_PS_REGISTRY* registry, GWBUF* command)
+{
+    uint32_t id;
+    QC_PS* ps = qc_ps_get_id(command, &id) ? *qc_ps_find(registry, id) : NULL;
+
+    return ps ? ps->stmt : NULL;
+}
+
+/**
+ * Remove the statement a command refers to, typically a COM_STMT_CLOSE.
+ *
+ * @param registry The registry
+ * @param command  A command referring to a statement
+ */
+void qc_ps_remove(QC_PS_REGISTRY* registry, GWBUF* command)
+{
+    uint32_t id;
+    QC_PS** link;
+
+    if (qc_ps_get_id(command, &id) && *(link = qc_ps_find(registry, id)))
+    {
+        QC_PS* ps = *link;
+        *link = ps->next;
+        gwbuf_free(ps->stmt);
+        free(ps);
+        registry->n_stmts--;
+    }
+}
+
 /**
  * Returns the string representation of a query operation.
  *
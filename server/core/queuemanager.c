@@ -22,12 +22,12 @@
  *
  * Date         Who                     Description
  * 27/04/16     Martin Brampton         Initial implementation
+ * 14/10/16     MariaDB Corporation     Lock-free queue
  *
  * @endverbatim
  */
 #include <stdlib.h>
 #include <queuemanager.h>
-#include <spinlock.h>
 #include <log_manager.h>
 #include <hk_heartbeat.h>
 
@@ -53,10 +53,14 @@ QUEUE_CONFIG
     new_queue = (QUEUE_CONFIG *)calloc(1, sizeof(QUEUE_CONFIG));
     if (new_queue)
     {
-        new_queue->queue_size = CONNECTION_QUEUE_LIMIT;
         new_queue->queue_limit = limit;
         new_queue->timeout = timeout;
-        spinlock_init(&new_queue->queue_lock);
+
+        if (!mpmc_ring_init(&new_queue->queue_ring, limit, sizeof(QUEUE_ENTRY)))
+        {
+            free(new_queue);
+            new_queue = NULL;
+        }
     }
     else
     {
@@ -75,17 +79,22 @@ QUEUE_CONFIG
  */
 void mxs_queue_free(QUEUE_CONFIG *queue_config)
 {
-    free(queue_config);
+    if (queue_config)
+    {
+        mpmc_ring_done(&queue_config->queue_ring);
+        free(queue_config);
+    }
 }
 
 /**
  * @brief Add an item to a queue
  *
- * Add a new item to a FIFO queue
+ * Add a new item to a FIFO queue. The queue takes no locks, any thread can
+ * add and remove items.
  *
  * @param queue_config  The configuration and anchor structure for the queue
  * @param new_entry     The new entry, to be added
- * @return bool         Whether the enqueue succeeded
+ * @return bool         Whether the enqueue succeeded, false if the queue is full
  */
 bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry)
 {
@@ -93,24 +102,10 @@ bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry)
 
     if (queue_config)
     {
-        spinlock_acquire(&queue_config->queue_lock);
-        if (queue_config->queue_limit < queue_config->queue_size
-            && mxs_queue_count(queue_config) < queue_config->queue_size)
-        {
-            queue_config->queue_array[queue_config->end].queued_object = new_entry;
-            queue_config->queue_array[queue_config->end].heartbeat = hkheartbeat;
-            queue_config->end++;
-            if (queue_config->end >= queue_config->queue_size)
-            {
-                queue_config->end = 0;
-            }
-            result = true;
-        }
-        else
-        {
-            result = false;
-        }
-        spinlock_release(&queue_config->queue_lock);
+        QUEUE_ENTRY entry;
+        entry.queued_object = new_entry;
+        entry.heartbeat = hkheartbeat;
+        result = mpmc_ring_push(&queue_config->queue_ring, &entry);
     }
     return result;
 }
@@ -121,22 +116,10 @@ bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry)
  * Remove an item from a FIFO queue
  *
  * @param queue_config  The configuration and anchor structure for the queue
- * @return QUEUE_ENTRY  A structure defining the removed entry
+ * @param entry         Where the removed entry is copied
+ * @return bool         Whether an entry was removed, false if the queue is empty
  */
-QUEUE_ENTRY *mxs_dequeue(QUEUE_CONFIG *queue_config)
+bool mxs_dequeue(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *entry)
 {
-    int count;
-    QUEUE_ENTRY *result = NULL;
-
-    spinlock_acquire(&queue_config->queue_lock);
-    if (NULL == result && (count = mxs_queue_count(queue_config)) > 0)
-    {
-        result = &(queue_config->queue_array[queue_config->start++]);
-        if (queue_config->start >= queue_config->queue_size)
-        {
-            queue_config->start = 0;
-        }
-    }
-    spinlock_release(&queue_config->queue_lock);
-    return result;
+    return mpmc_ring_pop(&queue_config->queue_ring, entry);
 }
@@ -22,6 +22,7 @@
  *
  * Date         Who             Description
  * 26/08/15     Martin Brampton Initial implementation
+ * 14/10/16     MariaDB Corporation Generator state per thread, no locking
  *
  * @endverbatim
  */
@@ -31,20 +32,33 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <spinlock.h>
+#include <atomic.h>
+#include <platform.h>
 #include <random_jkiss.h>
 
 /* Public domain code for JKISS RNG - Comment header added */
 
+/**
+ * The state of the generator. Each thread has a generator of its own, so
+ * that the numbers can be generated without locking.
+ */
+typedef struct
+{
+    unsigned int x, y, z, c; /*< Seed variables */
+} JKISS_STATE;
+
 /* If possible, the seed variables will be set from /dev/urandom but
  * should that fail, these arbitrary numbers will be used as a last resort.
  */
-static unsigned int x = 123456789, y = 987654321, z = 43219876, c = 6543217; /* Seed variables */
-static bool init = false;
+static const JKISS_STATE default_state = {123456789, 987654321, 43219876, 6543217};
 
-static SPINLOCK random_jkiss_spinlock = SPINLOCK_INIT;
+/** Makes the fallback seeds of the threads differ */
+static int thread_count = 0;
 
-static unsigned int random_jkiss_devrand(void);
+static thread_local JKISS_STATE state;
+static thread_local bool init = false;
+
+static bool random_jkiss_devrand(JKISS_STATE *seed);
 static void random_init_jkiss(void);
 
 /***
@@ -58,89 +72,87 @@ unsigned int
 random_jkiss(void)
 {
     unsigned long long t;
-    unsigned int result;
 
-    spinlock_acquire(&random_jkiss_spinlock);
     if (!init)
     {
         /* Must set init first because initialisation calls this function */
         init = true;
-        spinlock_release(&random_jkiss_spinlock);
         random_init_jkiss();
-        spinlock_acquire(&random_jkiss_spinlock);
     }
-    x = 314527869 * x + 1234567;
-    y ^= y << 5;
-    y ^= y >> 7;
-    y ^= y << 22;
-    t = 4294584393ULL * z + c;
-    c = t >> 32;
-    z = t;
-    result = x + y + z;
-    spinlock_release(&random_jkiss_spinlock);
-    return result;
+    state.x = 314527869 * state.x + 1234567;
+    state.y ^= state.y << 5;
+    state.y ^= state.y >> 7;
+    state.y ^= state.y << 22;
+    t = 4294584393ULL * state.z + state.c;
+    state.c = t >> 32;
+    state.z = t;
+    return state.x + state.y + state.z;
 }
 
 /* Own code adapted from http://www0.cs.ucl.ac.uk/staff/d.jones/GoodPracticeRNG.pdf */
 
 /***
  *
- * Obtain a seed random number from /dev/urandom if available.
+ * Obtain the seed from /dev/urandom if available.
  *
- * @return  uint    Random number
+ * @param seed  Where the seed is read
+ * @return  True if the seed was read
  *
  */
-static unsigned int
-random_jkiss_devrand(void)
+static bool
+random_jkiss_devrand(JKISS_STATE *seed)
 {
     int fn;
-    unsigned int r;
+    bool rval;
 
     if ((fn = open("/dev/urandom", O_RDONLY)) == -1)
     {
-        return 0;
+        return false;
     }
 
-    if (read(fn, &r, sizeof(r)) != sizeof(r))
-    {
-        r = 0;
-    }
+    rval = read(fn, seed, sizeof(*seed)) == sizeof(*seed);
     close(fn);
-    return r;
+    return rval;
 }
 
 /***
  *
- * Initialise the generator using /dev/urandom if available, and warm up
- * with 1000 iterations
+ * Initialise the generator of the calling thread using /dev/urandom if
+ * available, and warm up with 100 iterations
  *
  */
 static void
 random_init_jkiss(void)
 {
-    int newrand, i;
+    JKISS_STATE seed;
+    int i;
 
-    spinlock_acquire(&random_jkiss_spinlock);
-    if ((newrand = random_jkiss_devrand()) != 0)
-    {
-        x = newrand;
-    }
+    state = default_state;
 
-    if ((newrand = random_jkiss_devrand()) != 0)
+    if (random_jkiss_devrand(&seed))
     {
-        y = newrand;
+        if (seed.x)
+        {
+            state.x = seed.x;
+        }
+        if (seed.y)
+        {
+            /* The xorshift generator must not start from zero */
+            state.y = seed.y;
+        }
+        if (seed.z)
+        {
+            state.z = seed.z;
+        }
+        if (seed.c)
+        {
+            state.c = seed.c % 698769068 + 1; /* Should be less than 698769069 */
+        }
     }
-
-    if ((newrand = random_jkiss_devrand()) != 0)
-    {
-        z = newrand;
-    }
-
-    if ((newrand = random_jkiss_devrand()) != 0)
+    else
     {
-        c = newrand % 698769068 + 1; /* Should be less than 698769069 */
+        state.x += 2654435761U * (unsigned int)atomic_add(&thread_count, 1);
     }
-    spinlock_release(&random_jkiss_spinlock);
 
     /* "Warm up" our random number generator */
     for (i = 0; i < 100; i++)
@@ -19,21 +19,47 @@
  *
  * Date         Who             Description
  * 17/02/15     Mark Riddoch    Initial implementation
+ * 14/10/16     MariaDB Corporation     Rows are packed into batches
  *
  * @endverbatim
  */
 
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <resultset.h>
 #include <buffer.h>
 #include <dcb.h>
 
+/** The size of the buffers into which the packets of the rows are packed */
+#define RESULTSET_BATCH_SIZE 65536
 
-static int mysql_send_fieldcount(DCB *, int);
-static int mysql_send_columndef(DCB *, char *, int, int, uint8_t);
-static int mysql_send_eof(DCB *, int);
-static int mysql_send_row(DCB *, RESULT_ROW *, int);
+/** The length of the write queue after which the queue is drained before
+ * the next batch, if the DCB has no high water mark */
+#define RESULTSET_MAX_QUEUED (4 * RESULTSET_BATCH_SIZE)
+
+/**
+ * A batch of the result set being streamed. The packets are written into one
+ * buffer that is sent when it is full, instead of sending each packet in a
+ * buffer of its own.
+ */
+typedef struct
+{
+    DCB *dcb;       /*< The DCB to which the result set is streamed */
+    GWBUF *buf;     /*< The buffer being filled or NULL */
+    size_t used;    /*< The number of bytes used in the buffer */
+    bool failed;    /*< A buffer could not be allocated or written */
+} RESULTSET_BATCH;
+
+static void batch_init(RESULTSET_BATCH *, DCB *);
+static uint8_t *batch_reserve(RESULTSET_BATCH *, size_t);
+static void batch_printf(RESULTSET_BATCH *, const char *, ...) __attribute__((format(printf, 2, 3)));
+static void batch_flush(RESULTSET_BATCH *);
+static void mysql_send_fieldcount(RESULTSET_BATCH *, int);
+static void mysql_send_columndef(RESULTSET_BATCH *, char *, int, int, uint8_t);
+static void mysql_send_eof(RESULTSET_BATCH *, int);
+static void mysql_send_row(RESULTSET_BATCH *, RESULT_ROW *, int);
 
 
 /**
@@ -228,87 +254,194 @@ resultset_row_set(RESULT_ROW *row, int col, char *value)
     return 1;
 }
 
+/**
+ * Start a batch
+ *
+ * @param batch The batch
+ * @param dcb   The DCB to which the batch is sent
+ */
+static void
+batch_init(RESULTSET_BATCH *batch, DCB *dcb)
+{
+    batch->dcb = dcb;
+    batch->buf = NULL;
+    batch->used = 0;
+    batch->failed = false;
+}
+
+/**
+ * Send the filled part of the batch
+ *
+ * If the write queue of the DCB has grown long, as the client does not read
+ * the result as fast as it is generated, as much of the queue as the socket
+ * accepts is written before the next batch is generated.
+ *
+ * @param batch The batch
+ */
+static void
+batch_flush(RESULTSET_BATCH *batch)
+{
+    if (batch->buf)
+    {
+        DCB *dcb = batch->dcb;
+        GWBUF *buf = gwbuf_rtrim(batch->buf, GWBUF_LENGTH(batch->buf) - batch->used);
+        int max_queued = dcb->high_water ? dcb->high_water : RESULTSET_MAX_QUEUED;
+
+        batch->buf = NULL;
+        batch->used = 0;
+
+        if (buf && dcb->func.write(dcb, buf) == 0)
+        {
+            batch->failed = true;
+        }
+        else if (dcb->writeqlen > max_queued)
+        {
+            dcb_drain_writeq(dcb);
+        }
+    }
+}
+
+/**
+ * Reserve space for a packet from the batch
+ *
+ * @param batch The batch
+ * @param len   The length of the packet
+ * @return Where to write the packet or NULL if the batch has failed
+ */
+static uint8_t *
+batch_reserve(RESULTSET_BATCH *batch, size_t len)
+{
+    uint8_t *ptr;
+
+    if (batch->buf && batch->used + len > GWBUF_LENGTH(batch->buf))
+    {
+        batch_flush(batch);
+    }
+
+    if (batch->failed)
+    {
+        return NULL;
+    }
+
+    if (batch->buf == NULL &&
+        (batch->buf = gwbuf_alloc(len > RESULTSET_BATCH_SIZE ? len : RESULTSET_BATCH_SIZE)) == NULL)
+    {
+        batch->failed = true;
+        return NULL;
+    }
+
+    ptr = GWBUF_DATA(batch->buf) + batch->used;
+    batch->used += len;
+    return ptr;
+}
+
+/**
+ * Add formatted text to the batch
+ *
+ * @param batch The batch
+ * @param fmt   The format of the text
+ */
+static void
+batch_printf(RESULTSET_BATCH *batch, const char *fmt, ...)
+{
+    va_list args;
+    uint8_t *ptr;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    /** Room for the terminating null that is not sent */
+    if (len >= 0 && (ptr = batch_reserve(batch, len + 1)) != NULL)
+    {
+        va_start(args, fmt);
+        vsnprintf((char *)ptr, len + 1, fmt, args);
+        va_end(args);
+        batch->used--;
+    }
+}
+
 /**
  * Stream a result set using the MySQL protocol for encodign the result
  * set. Each row is retrieved by calling the function passed in the
  * argument list.
  *
+ * The packets are packed into buffers of RESULTSET_BATCH_SIZE bytes so that a
+ * large result set is sent with a few large writes.
+ *
  * @param set   The result set to stream
  * @param dcb   The connection to stream the result set to
  */
 void
 resultset_stream_mysql(RESULTSET *set, DCB *dcb)
 {
+    RESULTSET_BATCH batch;
     RESULT_COLUMN *col;
     RESULT_ROW *row;
     uint8_t seqno = 2;
 
-    mysql_send_fieldcount(dcb, set->n_cols);
+    batch_init(&batch, dcb);
+    mysql_send_fieldcount(&batch, set->n_cols);
 
     col = set->column;
     while (col)
     {
-        mysql_send_columndef(dcb, col->name, col->type, col->len, seqno++);
+        mysql_send_columndef(&batch, col->name, col->type, col->len, seqno++);
         col = col->next;
     }
-    mysql_send_eof(dcb, seqno++);
+    mysql_send_eof(&batch, seqno++);
     while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
     {
-        mysql_send_row(dcb, row, seqno++);
+        mysql_send_row(&batch, row, seqno++);
         resultset_free_row(row);
     }
-    mysql_send_eof(dcb, seqno);
+    mysql_send_eof(&batch, seqno);
+    batch_flush(&batch);
 }
 
 /**
  * Send the field count packet in a response packet sequence.
  *
- * @param dcb           DCB of connection to send result set to
+ * @param batch         The batch of the result set
  * @param count         Number of columns in the result set
- * @return              Non-zero on success
  */
-static int
-mysql_send_fieldcount(DCB *dcb, int count)
+static void
+mysql_send_fieldcount(RESULTSET_BATCH *batch, int count)
 {
-    GWBUF *pkt;
     uint8_t *ptr;
 
-    if ((pkt = gwbuf_alloc(5)) == NULL)
+    if ((ptr = batch_reserve(batch, 5)) == NULL)
     {
-        return 0;
+        return;
     }
-    ptr = GWBUF_DATA(pkt);
     *ptr++ = 0x01;                  // Payload length
     *ptr++ = 0x00;
     *ptr++ = 0x00;
     *ptr++ = 0x01;                  // Sequence number in response
     *ptr++ = count;                 // Length of result string
-    return dcb->func.write(dcb, pkt);
 }
 
 
 /**
  * Send the column definition packet in a response packet sequence.
  *
- * @param dcb           The DCB of the connection
+ * @param batch         The batch of the result set
  * @param name          Name of the column
  * @param type          Column type
  * @param len           Column length
  * @param seqno         Packet sequence number
- * @return              Non-zero on success
  */
-static int
-mysql_send_columndef(DCB *dcb, char *name, int type, int len, uint8_t seqno)
+static void
+mysql_send_columndef(RESULTSET_BATCH *batch, char *name, int type, int len, uint8_t seqno)
 {
-    GWBUF *pkt;
     uint8_t *ptr;
     int plen;
 
-    if ((pkt = gwbuf_alloc(26 + strlen(name))) == NULL)
+    if ((ptr = batch_reserve(batch, 26 + strlen(name))) == NULL)
     {
-        return 0;
+        return;
     }
-    ptr = GWBUF_DATA(pkt);
     plen = 22 + strlen(name);
     *ptr++ = plen & 0xff;
     *ptr++ = (plen >> 8) & 0xff;
@@ -347,28 +480,24 @@ mysql_send_columndef(DCB *dcb, char *name, int type, int len, uint8_t seqno)
     *ptr++ = 0;
     *ptr++ = 0;
     *ptr++ = 0;
-    return dcb->func.write(dcb, pkt);
 }
 
 
 /**
  * Send an EOF packet in a response packet sequence.
  *
- * @param dcb           The client connection
+ * @param batch         The batch of the result set
  * @param seqno         The sequence number of the EOF packet
- * @return              Non-zero on success
  */
-static int
-mysql_send_eof(DCB *dcb, int seqno)
+static void
+mysql_send_eof(RESULTSET_BATCH *batch, int seqno)
 {
-    GWBUF   *pkt;
     uint8_t *ptr;
 
-    if ((pkt = gwbuf_alloc(9)) == NULL)
+    if ((ptr = batch_reserve(batch, 9)) == NULL)
     {
-        return 0;
+        return;
     }
-    ptr = GWBUF_DATA(pkt);
     *ptr++ = 0x05;
     *ptr++ = 0x00;
     *ptr++ = 0x00;
@@ -378,7 +507,6 @@ mysql_send_eof(DCB *dcb, int seqno)
     *ptr++ = 0x00;
     *ptr++ = 0x02;                          // Autocommit enabled
     *ptr++ = 0x00;
-    return dcb->func.write(dcb, pkt);
 }
 
 
@@ -386,15 +514,13 @@ mysql_send_eof(DCB *dcb, int seqno)
 /**
  * Send a row packet in a response packet sequence.
  *
- * @param dcb           The client connection
+ * @param batch         The batch of the result set
  * @param row           The row to send
  * @param seqno         The sequence number of the EOF packet
- * @return              Non-zero on success
  */
-static int
-mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
+static void
+mysql_send_row(RESULTSET_BATCH *batch, RESULT_ROW *row, int seqno)
 {
-    GWBUF *pkt;
     int i, len = 4;
     uint8_t *ptr;
 
@@ -407,11 +533,10 @@ mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
         len++;
     }
 
-    if ((pkt = gwbuf_alloc(len)) == NULL)
+    if ((ptr = batch_reserve(batch, len)) == NULL)
     {
-        return 0;
+        return;
     }
-    ptr = GWBUF_DATA(pkt);
     len -= 4;
     *ptr++ = len & 0xff;
     *ptr++ = (len >> 8) & 0xff;
@@ -428,11 +553,9 @@ mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
         }
         else
         {
-            *ptr++ = 0;     // NULL column
+            *ptr++ = 0xfb;  // NULL column
         }
     }
-
-    return dcb->func.write(dcb, pkt);
 }
 
 /**
@@ -467,53 +590,59 @@ value_is_numeric(char *value)
  * Each row is retrieved by calling the function passed in the
  * argument list.
  *
+ * The text is packed into buffers of RESULTSET_BATCH_SIZE bytes so that a
+ * large result set is sent with a few large writes.
+ *
  * @param set   The result set to stream
  * @param dcb   The connection to stream the result set to
  */
 void
 resultset_stream_json(RESULTSET *set, DCB *dcb)
 {
+    RESULTSET_BATCH batch;
     RESULT_COLUMN *col;
     RESULT_ROW *row;
     int rowno = 0;
 
-    dcb_printf(dcb, "[ ");
+    batch_init(&batch, dcb);
+    batch_printf(&batch, "[ ");
     while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
     {
         int i = 0;
         if (rowno++ > 0)
         {
-            dcb_printf(dcb, ",\n");
+            batch_printf(&batch, ",\n");
         }
-        dcb_printf(dcb, "{ ");
+        batch_printf(&batch, "{ ");
         col = set->column;
         while (col)
         {
-            dcb_printf(dcb, "\"%s\" : ", col->name);
+            batch_printf(&batch, "\"%s\" : ", col->name);
             if (row->cols[i])
             {
                 if (value_is_numeric(row->cols[i]))
                 {
-                    dcb_printf(dcb, "%s", row->cols[i]);
+                    batch_printf(&batch, "%s", row->cols[i]);
                 }
                 else
                 {
-                    dcb_printf(dcb, "\"%s\"", row->cols[i]);
+                    batch_printf(&batch, "\"%s\"", row->cols[i]);
                 }
             }
             else
             {
-                dcb_printf(dcb, "null");
+                batch_printf(&batch, "null");
             }
             i++;
             col = col->next;
             if (col)
             {
-                dcb_printf(dcb, ", ");
+                batch_printf(&batch, ", ");
             }
         }
         resultset_free_row(row);
-        dcb_printf(dcb, "}");
+        batch_printf(&batch, "}");
     }
-    dcb_printf(dcb, "]\n");
+    batch_printf(&batch, "]\n");
+    batch_flush(&batch);
 }
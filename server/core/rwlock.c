@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file rwlock.c  -  Readers-writer and sequence locks
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <rwlock.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <skygw_debug.h>
+
+/** Number of rounds a thread spins before it sleeps on the lock */
+#define RWLOCK_SPIN_ROUNDS 16
+
+/** Maximum number of pauses between two attempts to take the lock */
+#define RWLOCK_MAX_BACKOFF 64
+
+#if defined(__i386__) || defined(__x86_64__)
+#define rwlock_pause() __builtin_ia32_pause()
+#else
+#define rwlock_pause() __sync_synchronize()
+#endif
+
+/**
+ * Initialise a readers-writer lock.
+ *
+ * @param lock The lock to initialise
+ */
+void
+rwlock_init(RWLOCK *lock)
+{
+    lock->state = 0;
+    lock->waiters = 0;
+#if SPINLOCK_COUNTERS
+    lock->contended = 0;
+#endif
+}
+
+/**
+ * Try to change the state of a lock
+ *
+ * @param lock   The lock
+ * @param writer Whether the write lock is taken
+ * @return True if the lock was taken
+ */
+static inline bool
+rwlock_try(RWLOCK *lock, bool writer)
+{
+    int state = *(volatile int*)&lock->state;
+
+    if (writer)
+    {
+        return state == 0 && __sync_bool_compare_and_swap(&lock->state, 0, -1);
+    }
+
+    return state >= 0 && __sync_bool_compare_and_swap(&lock->state, state, state + 1);
+}
+
+/**
+ * Wait until a lock can be taken. The thread spins with an exponential
+ * backoff and then sleeps until the state of the lock changes.
+ *
+ * A sleeper is registered before it checks the state for the last time and
+ * the releasing thread changes the state before it checks for sleepers, so
+ * either the sleeper sees the new state or the releasing thread sees the
+ * sleeper.
+ *
+ * @param lock   The lock
+ * @param writer Whether the write lock is taken
+ */
+static void
+rwlock_wait(RWLOCK *lock, bool writer)
+{
+    int backoff = 1;
+
+    for (int spins = 0; spins < RWLOCK_SPIN_ROUNDS; spins++)
+    {
+        for (int i = 0; i < backoff; i++)
+        {
+            rwlock_pause();
+        }
+
+        if (backoff < RWLOCK_MAX_BACKOFF)
+        {
+            backoff *= 2;
+        }
+
+        if (rwlock_try(lock, writer))
+        {
+            return;
+        }
+    }
+
+    while (!rwlock_try(lock, writer))
+    {
+        int state = *(volatile int*)&lock->state;
+
+        if ((writer && state != 0) || (!writer && state < 0))
+        {
+            __sync_fetch_and_add(&lock->waiters, 1);
+            syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, state, NULL, NULL, 0);
+            __sync_fetch_and_add(&lock->waiters, -1);
+        }
+    }
+}
+
+/**
+ * Wake up the threads sleeping on a lock. All of them are woken up as
+ * a released write lock can be taken by all of the waiting readers.
+ *
+ * @param lock The lock
+ */
+static inline void
+rwlock_wake(RWLOCK *lock)
+{
+    if (*(volatile int*)&lock->waiters)
+    {
+        syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Acquire a read lock. Waits only while a writer holds the lock.
+ *
+ * @param lock The lock
+ */
+void
+rwlock_read_acquire(RWLOCK *lock)
+{
+    if (!rwlock_try(lock, false))
+    {
+        rwlock_wait(lock, false);
+#if SPINLOCK_COUNTERS
+        __sync_fetch_and_add(&lock->contended, 1);
+#endif
+    }
+}
+
+/**
+ * Release a read lock.
+ *
+ * @param lock The lock
+ */
+void
+rwlock_read_release(RWLOCK *lock)
+{
+    ss_dassert(lock->state > 0);
+
+    if (__sync_sub_and_fetch(&lock->state, 1) == 0)
+    {
+        rwlock_wake(lock);
+    }
+}
+
+/**
+ * Acquire the write lock. Waits until there are no readers or writers.
+ *
+ * @param lock The lock
+ */
+void
+rwlock_write_acquire(RWLOCK *lock)
+{
+    if (!rwlock_try(lock, true))
+    {
+        rwlock_wait(lock, true);
+#if SPINLOCK_COUNTERS
+        lock->contended++;
+#endif
+    }
+}
+
+/**
+ * Release the write lock.
+ *
+ * @param lock The lock
+ */
+void
+rwlock_write_release(RWLOCK *lock)
+{
+    ss_dassert(lock->state == -1);
+
+    /** Full memory barrier */
+    __sync_bool_compare_and_swap(&lock->state, -1, 0);
+    rwlock_wake(lock);
+}
+
+/**
+ * Initialise a sequence lock.
+ *
+ * @param lock The lock to initialise
+ */
+void
+seqlock_init(SEQLOCK *lock)
+{
+    lock->sequence = 0;
+    spinlock_init(&lock->lock);
+}
+
+/**
+ * Start modifying the data protected by a sequence lock. Readers that read
+ * the data before seqlock_write_end is called read it again.
+ *
+ * @param lock The lock
+ */
+void
+seqlock_write_begin(SEQLOCK *lock)
+{
+    spinlock_acquire(&lock->lock);
+    __sync_fetch_and_add(&lock->sequence, 1);
+}
+
+/**
+ * Stop modifying the data protected by a sequence lock.
+ *
+ * @param lock The lock
+ */
+void
+seqlock_write_end(SEQLOCK *lock)
+{
+    ss_dassert(lock->sequence & 1);
+    __sync_fetch_and_add(&lock->sequence, 1);
+    spinlock_release(&lock->lock);
+}
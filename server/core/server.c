@@ -29,26 +29,56 @@
  * 30/10/14     Massimiliano Pinto      Addition of SERVER_MASTER_STICKINESS description
  * 01/06/15     Massimiliano Pinto      Addition of server_update_address/port
  * 19/06/15     Martin Brampton         Extra code for persistent connections
+ * 14/10/16     MariaDB Corporation     Publication of server state snapshots
+ * 14/10/16     MariaDB Corporation     Addition of the draining status
  *
  * @endverbatim
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <session.h>
 #include <server.h>
 #include <spinlock.h>
+#include <rwlock.h>
 #include <dcb.h>
 #include <maxscale/poll.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <gw_ssl.h>
+#include <maxconfig.h>
+#include <atomic.h>
 
 /** The latin1 charset */
 #define SERVER_DEFAULT_CHARSET 0x08
 
-static SPINLOCK server_spin = SPINLOCK_INIT;
+static RWLOCK server_lock = RWLOCK_INIT;
 static SERVER *allServers = NULL;
+static int status_generation = 0;            /*< Changed when a server status changes */
+
+/** The cached global variables, in the order of SERVER.variables */
+static const struct
+{
+    const char *name;   /*< Name of the variable */
+    bool session;       /*< The variable can be changed by a session */
+} server_variables[SERVER_N_VARIABLES] =
+{
+    {"init_connect", false},
+    {"version_comment", false},
+    {"version", false},
+    {"license", false},
+    {"lower_case_table_names", false},
+    {"max_allowed_packet", false},
+    {"system_time_zone", false},
+    {"query_cache_size", false},
+    {"tx_isolation", true},
+    {"sql_mode", true},
+    {"time_zone", true},
+    {"auto_increment_increment", true},
+    {"query_cache_type", true},
+    {"net_write_timeout", true}
+};
 
 static void spin_reporter(void *, char *, int);
 static void server_parameter_free(SERVER_PARAM *tofree);
@@ -82,23 +112,43 @@ server_alloc(char *servname, char *protocol, unsigned short port)
     server->status = SERVER_RUNNING;
     server->node_id = -1;
     server->rlag = -2;
+    server->rlag_us = -1;
+    server->state = NULL;
+    server->n_load_metrics = 0;
+    server->load = -1;
+    server->state_version = 0;
     server->master_id = -1;
     server->depth = -1;
     server->parameters = NULL;
     server->server_string = NULL;
     spinlock_init(&server->lock);
-    server->persistent = NULL;
     server->persistmax = 0;
     server->persistmaxtime = 0;
     server->persistpoolmax = 0;
+    server->persistreset = PERSIST_RESET_NONE;
     server->slave_configured = false;
     server->charset = SERVER_DEFAULT_CHARSET;
-    spinlock_init(&server->persistlock);
+    server->compression = false;
+    server->n_persistent_pools = MAX(config_threadcount(), 1);
+
+    if (posix_memalign((void**)&server->persistent, sizeof(SERVER_PERSISTENT_POOL),
+                       server->n_persistent_pools * sizeof(SERVER_PERSISTENT_POOL)) != 0)
+    {
+        free(server->protocol);
+        free(server->name);
+        free(server);
+        return NULL;
+    }
+    memset(server->persistent, 0, server->n_persistent_pools * sizeof(SERVER_PERSISTENT_POOL));
+    for (int i = 0; i < server->n_persistent_pools; i++)
+    {
+        spinlock_init(&server->persistent[i].lock);
+    }
 
-    spinlock_acquire(&server_spin);
+    rwlock_write_acquire(&server_lock);
     server->next = allServers;
     allServers = server;
-    spinlock_release(&server_spin);
+    rwlock_write_release(&server_lock);
 
     return server;
 }
@@ -116,7 +166,7 @@ server_free(SERVER *tofreeserver)
     SERVER *server;
 
     /* First of all remove from the linked list */
-    spinlock_acquire(&server_spin);
+    rwlock_write_acquire(&server_lock);
     if (allServers == tofreeserver)
     {
         allServers = tofreeserver->next;
@@ -133,7 +183,7 @@ server_free(SERVER *tofreeserver)
             server->next = tofreeserver->next;
         }
     }
-    spinlock_release(&server_spin);
+    rwlock_write_release(&server_lock);
 
     /* Clean up session and free the memory */
     free(tofreeserver->name);
@@ -142,16 +192,55 @@ server_free(SERVER *tofreeserver)
     free(tofreeserver->server_string);
     server_parameter_free(tofreeserver->parameters);
 
-    if (tofreeserver->persistent)
+    for (int i = 0; i < tofreeserver->n_persistent_pools; i++)
+    {
+        dcb_persistent_clean_pool(tofreeserver, &tofreeserver->persistent[i], true);
+    }
+    free(tofreeserver->persistent);
+    ts_latency_free(tofreeserver->latency);
+
+    for (int i = 0; i < SERVER_N_VARIABLES; i++)
     {
-        dcb_persistent_clean_count(tofreeserver->persistent, true);
+        free(tofreeserver->variables[i]);
     }
     free(tofreeserver);
     return 1;
 }
 
 /**
- * Get a DCB from the persistent connection pool, if possible
+ * Return the persistent connection pool of a thread
+ *
+ * @param       server      The server
+ * @param       thread_id   The ID of the polling thread, -1 for other threads
+ * @return      The pool used by the thread
+ */
+SERVER_PERSISTENT_POOL *
+server_persistent_pool(SERVER *server, int thread_id)
+{
+    return &server->persistent[thread_id >= 0 ? thread_id % server->n_persistent_pools : 0];
+}
+
+/**
+ * Return the maximum number of connections in one persistent connection pool.
+ * The configured pool size is divided evenly between the threads.
+ *
+ * @param       server      The server
+ * @return      The maximum number of connections in a pool of one thread
+ */
+int
+server_persistent_pool_limit(SERVER *server)
+{
+    return (server->persistpoolmax + server->n_persistent_pools - 1) / server->n_persistent_pools;
+}
+
+/**
+ * Get a DCB from the persistent connection pool of the calling thread,
+ * if possible
+ *
+ * A connection of the same user is preferred. If the connections of the server
+ * are reset when they are taken from the pool, a connection of another user is
+ * used when there is none and the DCB is flagged for the protocol to change it
+ * to the user of the new session.
  *
  * @param       server      The server to set the name on
  * @param       user        The name of the user needing the connection
@@ -161,37 +250,35 @@ DCB *
 server_get_persistent(SERVER *server, char *user, const char *protocol)
 {
     DCB *dcb, *previous = NULL;
+    DCB *other = NULL, *other_previous = NULL;
+    SERVER_PERSISTENT_POOL *pool = server_persistent_pool(server, poll_current_thread());
 
-    if (server->persistent
-        && dcb_persistent_clean_count(server->persistent, false)
-        && server->persistent
+    if (pool->dcbs
+        && dcb_persistent_clean_pool(server, pool, false)
+        && pool->dcbs
         && (server->status & SERVER_RUNNING))
     {
-        spinlock_acquire(&server->persistlock);
-        dcb = server->persistent;
+        spinlock_acquire(&pool->lock);
+        dcb = pool->dcbs;
         while (dcb)
         {
-            if (dcb->user
+            bool usable = dcb->user
                 && dcb->protoname
                 && !dcb-> dcb_errhandle_called
                 && !(dcb->flags & DCBF_HUNG)
-                && 0 == strcmp(dcb->user, user)
-                && 0 == strcmp(dcb->protoname, protocol))
+                && 0 == strcmp(dcb->protoname, protocol);
+
+            if (usable && 0 == strcmp(dcb->user, user))
             {
-                if (NULL == previous)
-                {
-                    server->persistent = dcb->nextpersistent;
-                }
-                else
+                break;
+            }
+            else if (usable && server->persistreset != PERSIST_RESET_NONE)
+            {
+                if (NULL == other)
                 {
-                    previous->nextpersistent = dcb->nextpersistent;
+                    other = dcb;
+                    other_previous = previous;
                 }
-                free(dcb->user);
-                dcb->user = NULL;
-                spinlock_release(&server->persistlock);
-                atomic_add(&server->stats.n_persistent, -1);
-                atomic_add(&server->stats.n_current, 1);
-                return dcb;
             }
             else
             {
@@ -210,7 +297,48 @@ server_get_persistent(SERVER *server, char *user, const char *protocol)
             previous = dcb;
             dcb = dcb->nextpersistent;
         }
-        spinlock_release(&server->persistlock);
+
+        if (dcb == NULL && other)
+        {
+            dcb = other;
+            previous = other_previous;
+        }
+
+        if (dcb)
+        {
+            if (NULL == previous)
+            {
+                pool->dcbs = dcb->nextpersistent;
+            }
+            else
+            {
+                previous->nextpersistent = dcb->nextpersistent;
+            }
+            pool->n_dcbs--;
+            pool->n_hits++;
+
+            if (server->persistreset != PERSIST_RESET_NONE)
+            {
+                dcb->flags |= DCBF_RESET;
+
+                if (dcb != other)
+                {
+                    dcb->flags |= DCBF_RESET_SAME_USER;
+                }
+            }
+            free(dcb->user);
+            dcb->user = NULL;
+            spinlock_release(&pool->lock);
+            atomic_add(&server->stats.n_persistent, -1);
+            atomic_add(&server->stats.n_current, 1);
+            return dcb;
+        }
+        spinlock_release(&pool->lock);
+    }
+
+    if (server->persistpoolmax)
+    {
+        atomic_add(&pool->n_misses, 1);
     }
     return NULL;
 }
@@ -240,7 +368,7 @@ server_find_by_unique_name(char *name)
 {
     SERVER *server;
 
-    spinlock_acquire(&server_spin);
+    rwlock_read_acquire(&server_lock);
     server = allServers;
     while (server)
     {
@@ -250,7 +378,7 @@ server_find_by_unique_name(char *name)
         }
         server = server->next;
     }
-    spinlock_release(&server_spin);
+    rwlock_read_release(&server_lock);
     return server;
 }
 
@@ -266,7 +394,7 @@ server_find(char *servname, unsigned short port)
 {
     SERVER  *server;
 
-    spinlock_acquire(&server_spin);
+    rwlock_read_acquire(&server_lock);
     server = allServers;
     while (server)
     {
@@ -276,7 +404,7 @@ server_find(char *servname, unsigned short port)
         }
         server = server->next;
     }
-    spinlock_release(&server_spin);
+    rwlock_read_release(&server_lock);
     return server;
 }
 
@@ -309,14 +437,14 @@ printAllServers()
 {
     SERVER *server;
 
-    spinlock_acquire(&server_spin);
+    rwlock_read_acquire(&server_lock);
     server = allServers;
     while (server)
     {
         printServer(server);
         server = server->next;
     }
-    spinlock_release(&server_spin);
+    rwlock_read_release(&server_lock);
 }
 
 /**
@@ -330,14 +458,14 @@ dprintAllServers(DCB *dcb)
 {
     SERVER *server;
 
-    spinlock_acquire(&server_spin);
+    rwlock_read_acquire(&server_lock);
     server = allServers;
     while (server)
     {
         dprintServer(dcb, server);
         server = server->next;
     }
-    spinlock_release(&server_spin);
+    rwlock_read_release(&server_lock);
 }
 
 /**
@@ -354,7 +482,7 @@ dprintAllServersJson(DCB *dcb)
     int len = 0;
     int el = 1;
 
-    spinlock_acquire(&server_spin);
+    rwlock_read_acquire(&server_lock);
     server = allServers;
     while (server)
     {
@@ -432,7 +560,7 @@ dprintAllServersJson(DCB *dcb)
         el++;
     }
     dcb_printf(dcb, "]\n");
-    spinlock_release(&server_spin);
+    rwlock_read_release(&server_lock);
 }
 
 
@@ -482,6 +610,13 @@ dprintServer(DCB *dcb, SERVER *server)
         {
             dcb_printf(dcb, "\tSlave delay:                         %d\n", server->rlag);
         }
+
+        int64_t rlag_us = atomic_load_int64(&server->rlag_us);
+
+        if (rlag_us >= 0)
+        {
+            dcb_printf(dcb, "\tSlave delay (milliseconds):          %.3f\n", rlag_us / 1000.0);
+        }
     }
     if (server->node_ts > 0)
     {
@@ -490,6 +625,44 @@ dprintServer(DCB *dcb, SERVER *server)
         dcb_printf(dcb, "\tLast Repl Heartbeat:                 %s",
                    asctime_r(localtime_r((time_t *)(&server->node_ts), &result), buf));
     }
+    SERVER_GTID gtids[MAX_GTID_DOMAINS];
+    int n_gtids;
+    if (server_get_gtid_pos(server, gtids, &n_gtids) && n_gtids > 0)
+    {
+        dcb_printf(dcb, "\tGTID Position:                       ");
+        for (int i = 0; i < n_gtids; i++)
+        {
+            dcb_printf(dcb, "%s%u-%u-%lu", i ? "," : "", gtids[i].domain,
+                       gtids[i].server_id, (unsigned long)gtids[i].sequence);
+        }
+        dcb_printf(dcb, "\n");
+    }
+    server_get_gtid_io_pos(server, gtids, &n_gtids);
+    if (n_gtids > 0)
+    {
+        dcb_printf(dcb, "\tSlave GTID IO Position:              ");
+        for (int i = 0; i < n_gtids; i++)
+        {
+            dcb_printf(dcb, "%s%u-%u-%lu", i ? "," : "", gtids[i].domain,
+                       gtids[i].server_id, (unsigned long)gtids[i].sequence);
+        }
+        dcb_printf(dcb, "\n");
+    }
+    if (server->compression)
+    {
+        dcb_printf(dcb, "\tCompressed protocol:                 enabled\n");
+    }
+    int64_t load = atomic_load_int64(&server->load);
+    if (load >= 0)
+    {
+        dcb_printf(dcb, "\tLoad:                                %ld\n", load);
+        for (int i = 0; i < server->n_load_metrics; i++)
+        {
+            dcb_printf(dcb, "\t                                       %s%s\t%ld\n",
+                       server->load_metrics[i].name, server->load_metrics[i].rate ? "/s" : "",
+                       server->load_metrics[i].value);
+        }
+    }
     SERVER_PARAM *param;
     if ((param = server->parameters))
     {
@@ -503,14 +676,44 @@ dprintServer(DCB *dcb, SERVER *server)
     dcb_printf(dcb, "\tNumber of connections:               %d\n", server->stats.n_connections);
     dcb_printf(dcb, "\tCurrent no. of conns:                %d\n", server->stats.n_current);
     dcb_printf(dcb, "\tCurrent no. of operations:           %d\n", server->stats.n_current_ops);
+    dprintLatency(dcb, "\tQuery latency (ms):                  ", server->latency);
     if (server->persistpoolmax)
     {
         dcb_printf(dcb, "\tPersistent pool size:                %d\n", server->stats.n_persistent);
-        dcb_printf(dcb, "\tPersistent measured pool size:       %d\n",
-                   dcb_persistent_clean_count(server->persistent, false));
+        int measured = 0;
+        for (int i = 0; i < server->n_persistent_pools; i++)
+        {
+            measured += dcb_persistent_clean_pool(server, &server->persistent[i], false);
+        }
+        dcb_printf(dcb, "\tPersistent measured pool size:       %d\n", measured);
         dcb_printf(dcb, "\tPersistent actual size max:          %d\n", server->persistmax);
         dcb_printf(dcb, "\tPersistent pool size limit:          %ld\n", server->persistpoolmax);
         dcb_printf(dcb, "\tPersistent max time (secs):          %ld\n", server->persistmaxtime);
+        dcb_printf(dcb, "\tPersistent connection reset:         %s\n",
+                   server->persistreset == PERSIST_RESET_CONNECTION ? "reset_connection" :
+                   server->persistreset == PERSIST_RESET_CHANGE_USER ? "change_user" : "none");
+
+        int hits = 0, misses = 0, evictions = 0;
+        for (int i = 0; i < server->n_persistent_pools; i++)
+        {
+            hits += server->persistent[i].n_hits;
+            misses += server->persistent[i].n_misses;
+            evictions += server->persistent[i].n_evictions;
+        }
+        dcb_printf(dcb, "\tPersistent pool hits:                %d\n", hits);
+        dcb_printf(dcb, "\tPersistent pool misses:              %d\n", misses);
+        dcb_printf(dcb, "\tPersistent pool evictions:           %d\n", evictions);
+        if (server->n_persistent_pools > 1)
+        {
+            dcb_printf(dcb, "\tPersistent pools per thread:\n");
+            dcb_printf(dcb, "\t\tThread\tSize\tHits\tMisses\tEvictions\n");
+            for (int i = 0; i < server->n_persistent_pools; i++)
+            {
+                SERVER_PERSISTENT_POOL *pool = &server->persistent[i];
+                dcb_printf(dcb, "\t\t%2d\t%d\t%d\t%d\t%d\n", i, pool->n_dcbs,
+                           pool->n_hits, pool->n_misses, pool->n_evictions);
+            }
+        }
     }
     if (server->server_ssl)
     {
@@ -526,6 +729,32 @@ dprintServer(DCB *dcb, SERVER *server)
                    l->ssl_key ? l->ssl_key : "null");
         dcb_printf(dcb, "\tSSL CA certificate:                  %s\n",
                    l->ssl_ca_cert ? l->ssl_ca_cert : "null");
+        dcb_printf(dcb, "\tSSL full handshakes:                 %d\n", l->n_handshakes);
+        dcb_printf(dcb, "\tSSL resumed sessions:                %d\n", l->n_resumed);
+    }
+}
+
+/**
+ * Print the percentiles of a latency histogram
+ *
+ * @param dcb     DCB to print to
+ * @param title   Title of the line
+ * @param latency The histogram, nothing is printed if it is NULL
+ */
+void
+dprintLatency(DCB *dcb, const char *title, TS_LATENCY *latency)
+{
+    if (latency)
+    {
+        TS_LATENCY_SNAPSHOT snapshot;
+        ts_latency_snapshot(latency, &snapshot);
+        dcb_printf(dcb, "%scount %lu p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+                   title, snapshot.count,
+                   ts_latency_percentile(&snapshot, 0.50) / 1000.0,
+                   ts_latency_percentile(&snapshot, 0.90) / 1000.0,
+                   ts_latency_percentile(&snapshot, 0.99) / 1000.0,
+                   ts_latency_percentile(&snapshot, 0.999) / 1000.0,
+                   snapshot.max / 1000.0);
     }
 }
 
@@ -553,18 +782,23 @@ dprintPersistentDCBs(DCB *pdcb, SERVER *server)
 {
     DCB *dcb;
 
-    spinlock_acquire(&server->persistlock);
+    for (int i = 0; i < server->n_persistent_pools; i++)
+    {
+        SERVER_PERSISTENT_POOL *pool = &server->persistent[i];
+
+        spinlock_acquire(&pool->lock);
 #if SPINLOCK_PROFILE
-    dcb_printf(pdcb, "DCB List Spinlock Statistics:\n");
-    spinlock_stats(&server->persistlock, spin_reporter, pdcb);
+        dcb_printf(pdcb, "DCB List Spinlock Statistics of thread %d:\n", i);
+        spinlock_stats(&pool->lock, spin_reporter, pdcb);
 #endif
-    dcb = server->persistent;
-    while (dcb)
-    {
-        dprintOneDCB(pdcb, dcb);
-        dcb = dcb->nextpersistent;
+        dcb = pool->dcbs;
+        while (dcb)
+        {
+            dprintOneDCB(pdcb, dcb);
+            dcb = dcb->nextpersistent;
+        }
+        spinlock_release(&pool->lock);
     }
-    spinlock_release(&server->persistlock);
 }
 
 /**
@@ -577,7 +811,7 @@ dListServers(DCB *dcb)
     SERVER  *server;
     char    *stat;
 
-    spinlock_acquire(&server_spin);
+    rwlock_read_acquire(&server_lock);
     server = allServers;
     if (server)
     {
@@ -601,7 +835,7 @@ dListServers(DCB *dcb)
     {
         dcb_printf(dcb, "-------------------+-----------------+-------+-------------+--------------------\n");
     }
-    spinlock_release(&server_spin);
+    rwlock_read_release(&server_lock);
 }
 
 /**
@@ -625,6 +859,10 @@ server_status(SERVER *server)
     {
         strcat(status, "Maintenance, ");
     }
+    if (server->status & SERVER_DRAINING)
+    {
+        strcat(status, "Draining, ");
+    }
     if (server->status & SERVER_MASTER)
     {
         strcat(status, "Master, ");
@@ -677,7 +915,11 @@ server_status(SERVER *server)
 void
 server_set_status(SERVER *server, int bit)
 {
-    server->status |= bit;
+    if ((server->status & bit) != bit)
+    {
+        server->status |= bit;
+        atomic_add(&status_generation, 1);
+    }
 
     /** clear error logged flag before the next failure */
     if (SERVER_IS_MASTER(server))
@@ -705,6 +947,7 @@ server_clear_set_status(SERVER *server, int specified_bits, int bits_to_set)
     if ((server->status & specified_bits) != bits_to_set)
     {
         server->status = (server->status & ~specified_bits) | bits_to_set;
+        atomic_add(&status_generation, 1);
     }
 }
 
@@ -717,7 +960,11 @@ server_clear_set_status(SERVER *server, int specified_bits, int bits_to_set)
 void
 server_clear_status(SERVER *server, int bit)
 {
-    server->status &= ~bit;
+    if (server->status & bit)
+    {
+        server->status &= ~bit;
+        atomic_add(&status_generation, 1);
+    }
 }
 
 /**
@@ -729,7 +976,25 @@ server_clear_status(SERVER *server, int bit)
 void
 server_transfer_status(SERVER *dest_server, SERVER *source_server)
 {
-    dest_server->status = source_server->status;
+    if (dest_server->status != source_server->status)
+    {
+        dest_server->status = source_server->status;
+        atomic_add(&status_generation, 1);
+    }
+}
+
+/**
+ * Return the generation of the server states. The generation changes
+ * whenever the status of a server is changed with the functions above or a
+ * published state changes the replication topology, which lets the routers
+ * cache what they derive from the server states.
+ *
+ * @return The current generation
+ */
+int
+server_status_generation()
+{
+    return status_generation;
 }
 
 /**
@@ -879,7 +1144,7 @@ serverRowCallback(RESULTSET *set, void *data)
     RESULT_ROW *row;
     SERVER *server;
 
-    spinlock_acquire(&server_spin);
+    rwlock_read_acquire(&server_lock);
     server = allServers;
     while (i < *rowno && server)
     {
@@ -888,7 +1153,7 @@ serverRowCallback(RESULTSET *set, void *data)
     }
     if (server == NULL)
     {
-        spinlock_release(&server_spin);
+        rwlock_read_release(&server_lock);
         free(data);
         return NULL;
     }
@@ -903,7 +1168,7 @@ serverRowCallback(RESULTSET *set, void *data)
     stat = server_status(server);
     resultset_row_set(row, 4, stat);
     free(stat);
-    spinlock_release(&server_spin);
+    rwlock_read_release(&server_lock);
     return row;
 }
 
@@ -937,6 +1202,224 @@ serverGetList()
     return set;
 }
 
+/**
+ * Add the query latency columns to a result set
+ *
+ * @param set The result set
+ */
+void
+latency_add_columns(RESULTSET *set)
+{
+    resultset_add_column(set, "Queries", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p50 (ms)", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p90 (ms)", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p99 (ms)", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p99.9 (ms)", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Max (ms)", 10, COL_TYPE_VARCHAR);
+}
+
+/**
+ * Set the values of the query latency columns of a row
+ *
+ * @param row     The row
+ * @param col     The first latency column
+ * @param latency The histogram, NULL if no latencies are recorded
+ */
+void
+latency_row_set(RESULT_ROW *row, int col, TS_LATENCY *latency)
+{
+    static const double fractions[] = {0.50, 0.90, 0.99, 0.999};
+    TS_LATENCY_SNAPSHOT snapshot;
+    char buf[40];
+
+    if (latency)
+    {
+        ts_latency_snapshot(latency, &snapshot);
+    }
+    else
+    {
+        memset(&snapshot, 0, sizeof(snapshot));
+    }
+
+    snprintf(buf, sizeof(buf), "%lu", snapshot.count);
+    resultset_row_set(row, col++, buf);
+
+    for (int i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++)
+    {
+        snprintf(buf, sizeof(buf), "%.3f", ts_latency_percentile(&snapshot, fractions[i]) / 1000.0);
+        resultset_row_set(row, col++, buf);
+    }
+
+    snprintf(buf, sizeof(buf), "%.3f", snapshot.max / 1000.0);
+    resultset_row_set(row, col, buf);
+}
+
+/**
+ * Provide a row to the result set of the server query latencies
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+serverLatencyRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    int i = 0;
+    RESULT_ROW *row;
+    SERVER *server;
+
+    rwlock_read_acquire(&server_lock);
+    server = allServers;
+    while (i < *rowno && server)
+    {
+        i++;
+        server = server->next;
+    }
+    if (server == NULL)
+    {
+        rwlock_read_release(&server_lock);
+        free(data);
+        return NULL;
+    }
+    (*rowno)++;
+    row = resultset_make_row(set);
+    resultset_row_set(row, 0, server->unique_name);
+    latency_row_set(row, 1, server->latency);
+    rwlock_read_release(&server_lock);
+    return row;
+}
+
+/**
+ * Return a resultset with the query latency percentiles of the servers
+ *
+ * @return A Result set
+ */
+RESULTSET *
+serverGetLatencyList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(serverLatencyRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Server", 20, COL_TYPE_VARCHAR);
+    latency_add_columns(set);
+
+    return set;
+}
+
+/**
+ * Render the statistics of the servers in the Prometheus text format
+ *
+ * @param metrics The metrics
+ */
+void
+server_metrics(METRICS *metrics)
+{
+    static const struct
+    {
+        const char *name;
+        const char *help;
+        size_t offset;
+        METRICS_TYPE type;
+    } stats[] =
+    {
+        { "maxscale_server_connections_total", "Connections created to the server",
+          offsetof(SERVER_STATS, n_connections), METRICS_COUNTER },
+        { "maxscale_server_connections", "Current connections to the server",
+          offsetof(SERVER_STATS, n_current), METRICS_GAUGE },
+        { "maxscale_server_operations", "Current operations on the server",
+          offsetof(SERVER_STATS, n_current_ops), METRICS_GAUGE },
+        { "maxscale_server_persistent_connections", "Connections in the persistent pool",
+          offsetof(SERVER_STATS, n_persistent), METRICS_GAUGE },
+    };
+    static const struct
+    {
+        const char *name;
+        unsigned int bit;
+    } states[] =
+    {
+        { "running", SERVER_RUNNING },
+        { "master", SERVER_MASTER },
+        { "slave", SERVER_SLAVE },
+        { "joined", SERVER_JOINED },
+        { "maintenance", SERVER_MAINT },
+        { "draining", SERVER_DRAINING },
+    };
+    char name[METRICS_LABEL_LEN];
+    char labels[METRICS_LABEL_LEN + 64];
+    SERVER *server;
+    int i;
+
+    rwlock_read_acquire(&server_lock);
+
+    for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+    {
+        metrics_family(metrics, stats[i].name, stats[i].type, stats[i].help);
+
+        for (server = allServers; server; server = server->next)
+        {
+            snprintf(labels, sizeof(labels), "server=\"%s\"",
+                     metrics_escape(server->unique_name, name, sizeof(name)));
+            metrics_value(metrics, stats[i].name, labels,
+                          *(int *)((char *)&server->stats + stats[i].offset));
+        }
+    }
+
+    metrics_family(metrics, "maxscale_server_state", METRICS_GAUGE,
+                   "Whether the server is in the state, 1 or 0");
+    for (server = allServers; server; server = server->next)
+    {
+        unsigned int status = server->status;
+
+        metrics_escape(server->unique_name, name, sizeof(name));
+
+        for (i = 0; i < sizeof(states) / sizeof(states[0]); i++)
+        {
+            snprintf(labels, sizeof(labels), "server=\"%s\",state=\"%s\"", name, states[i].name);
+            metrics_value(metrics, "maxscale_server_state", labels, (status & states[i].bit) != 0);
+        }
+    }
+
+    metrics_family(metrics, "maxscale_server_replication_lag_seconds", METRICS_GAUGE,
+                   "Smoothed replication lag of the server");
+    for (server = allServers; server; server = server->next)
+    {
+        int64_t lag = atomic_load_int64(&server->rlag_us);
+
+        if (lag >= 0)
+        {
+            metrics_printf(metrics, "maxscale_server_replication_lag_seconds{server=\"%s\"} %.6f\n",
+                           metrics_escape(server->unique_name, name, sizeof(name)), lag / 1000000.0);
+        }
+    }
+
+    metrics_family(metrics, "maxscale_server_query_latency_seconds", METRICS_HISTOGRAM,
+                   "Time from routing a query to the first packet of its reply");
+    for (server = allServers; server; server = server->next)
+    {
+        if (server->latency)
+        {
+            TS_LATENCY_SNAPSHOT snapshot;
+            ts_latency_snapshot(server->latency, &snapshot);
+            snprintf(labels, sizeof(labels), "server=\"%s\"",
+                     metrics_escape(server->unique_name, name, sizeof(name)));
+            metrics_latency(metrics, "maxscale_server_query_latency_seconds", labels, &snapshot);
+        }
+    }
+
+    rwlock_read_release(&server_lock);
+}
+
 /*
  * Update the address value of a specific server
  *
@@ -947,7 +1430,7 @@ serverGetList()
 void
 server_update_address(SERVER *server, char *address)
 {
-    spinlock_acquire(&server_spin);
+    rwlock_write_acquire(&server_lock);
     if (server && address)
     {
         if (server->name)
@@ -956,7 +1439,7 @@ server_update_address(SERVER *server, char *address)
         }
         server->name = strdup(address);
     }
-    spinlock_release(&server_spin);
+    rwlock_write_release(&server_lock);
 }
 
 /*
@@ -969,12 +1452,12 @@ server_update_address(SERVER *server, char *address)
 void
 server_update_port(SERVER *server, unsigned short port)
 {
-    spinlock_acquire(&server_spin);
+    rwlock_write_acquire(&server_lock);
     if (server && port > 0)
     {
         server->port = port;
     }
-    spinlock_release(&server_spin);
+    rwlock_write_release(&server_lock);
 }
 
 static struct
@@ -990,6 +1473,7 @@ static struct
     { "ndb",         SERVER_NDB },
     { "maintenance", SERVER_MAINT },
     { "maint",       SERVER_MAINT },
+    { "draining",    SERVER_DRAINING },
     { "stale",       SERVER_STALE_STATUS },
     { NULL,          0 }
 };
@@ -1035,3 +1519,447 @@ bool server_set_version_string(SERVER* server, const char* string)
     spinlock_release(&server->lock);
     return rval;
 }
+
+/**
+ * Parse a MariaDB GTID list with one GTID of the form domain-server_id-sequence
+ * for each replication domain. If a domain is listed more than once, the GTID
+ * with the largest sequence number is used.
+ *
+ * @param gtid_list Comma separated list of GTIDs, may be empty
+ * @param gtids     Array of MAX_GTID_DOMAINS elements where the GTIDs are stored
+ * @param n_gtids   The number of domains in the list
+ * @return True if the list could be parsed
+ */
+static bool parse_gtid_list(const char* gtid_list, SERVER_GTID* gtids, int* n_gtids_out)
+{
+    int n_gtids = 0;
+    const char* ptr = gtid_list;
+
+    while (*ptr)
+    {
+        char* end;
+        unsigned long domain = strtoul(ptr, &end, 10);
+
+        if (end == ptr || *end != '-')
+        {
+            return false;
+        }
+
+        ptr = end + 1;
+        unsigned long server_id = strtoul(ptr, &end, 10);
+
+        if (end == ptr || *end != '-')
+        {
+            return false;
+        }
+
+        ptr = end + 1;
+        unsigned long long sequence = strtoull(ptr, &end, 10);
+
+        if (end == ptr || (*end != ',' && *end != '\0'))
+        {
+            return false;
+        }
+
+        int i = 0;
+
+        while (i < n_gtids && gtids[i].domain != domain)
+        {
+            i++;
+        }
+
+        if (i == n_gtids)
+        {
+            if (n_gtids == MAX_GTID_DOMAINS)
+            {
+                return false;
+            }
+            n_gtids++;
+        }
+        else if (gtids[i].sequence >= sequence)
+        {
+            ptr = *end == ',' ? end + 1 : end;
+            continue;
+        }
+
+        gtids[i].domain = domain;
+        gtids[i].server_id = server_id;
+        gtids[i].sequence = sequence;
+
+        ptr = *end == ',' ? end + 1 : end;
+    }
+
+    *n_gtids_out = n_gtids;
+    return true;
+}
+
+/**
+ * Set the executed GTID position of the server. The position is a MariaDB
+ * GTID list, e.g. the value of @@gtid_current_pos, with one GTID of the form
+ * domain-server_id-sequence for each replication domain.
+ *
+ * @param server    Server to update
+ * @param gtid_list Comma separated list of GTIDs, may be empty
+ * @return True if the list could be parsed, false otherwise. The position of
+ * the server is not changed if the list could not be parsed.
+ */
+bool server_set_gtid_pos(SERVER* server, const char* gtid_list)
+{
+    SERVER_GTID gtids[MAX_GTID_DOMAINS];
+    int n_gtids;
+
+    if (!parse_gtid_list(gtid_list, gtids, &n_gtids))
+    {
+        return false;
+    }
+
+    spinlock_acquire(&server->lock);
+    memcpy(server->gtid_pos, gtids, n_gtids * sizeof(SERVER_GTID));
+    server->n_gtid_pos = n_gtids;
+    server->gtid_sample++;
+    spinlock_release(&server->lock);
+
+    return true;
+}
+
+/**
+ * Get the executed GTID position of the server.
+ *
+ * @param server  The server
+ * @param gtids   Array of MAX_GTID_DOMAINS elements where the position is copied
+ * @param n_gtids The number of domains in the position
+ * @return The number of the sample, or 0 if the position has never been set.
+ * A larger number means a more recent position.
+ */
+unsigned long server_get_gtid_pos(SERVER* server, SERVER_GTID* gtids, int* n_gtids)
+{
+    spinlock_acquire(&server->lock);
+    unsigned long sample = server->gtid_sample;
+    memcpy(gtids, server->gtid_pos, server->n_gtid_pos * sizeof(SERVER_GTID));
+    *n_gtids = server->n_gtid_pos;
+    spinlock_release(&server->lock);
+
+    return sample;
+}
+
+/**
+ * Set the GTID position the slave connections of the server have received
+ * from their masters, e.g. the Gtid_IO_Pos values of SHOW ALL SLAVES STATUS.
+ * Comparing the positions of the slaves shows which one is the most advanced.
+ *
+ * @param server    Server to update
+ * @param gtid_list Comma separated list of GTIDs, may be empty
+ * @return True if the list could be parsed, false otherwise. The position of
+ * the server is not changed if the list could not be parsed.
+ */
+bool server_set_gtid_io_pos(SERVER* server, const char* gtid_list)
+{
+    SERVER_GTID gtids[MAX_GTID_DOMAINS];
+    int n_gtids;
+
+    if (!parse_gtid_list(gtid_list, gtids, &n_gtids))
+    {
+        return false;
+    }
+
+    spinlock_acquire(&server->lock);
+    memcpy(server->gtid_io_pos, gtids, n_gtids * sizeof(SERVER_GTID));
+    server->n_gtid_io_pos = n_gtids;
+    spinlock_release(&server->lock);
+
+    return true;
+}
+
+/**
+ * Get the GTID position the slave connections of the server have received.
+ *
+ * @param server  The server
+ * @param gtids   Array of MAX_GTID_DOMAINS elements where the position is copied
+ * @param n_gtids The number of domains in the position
+ */
+void server_get_gtid_io_pos(SERVER* server, SERVER_GTID* gtids, int* n_gtids)
+{
+    spinlock_acquire(&server->lock);
+    memcpy(gtids, server->gtid_io_pos, server->n_gtid_io_pos * sizeof(SERVER_GTID));
+    *n_gtids = server->n_gtid_io_pos;
+    spinlock_release(&server->lock);
+}
+
+/**
+ * Check whether the server has executed the transactions of a GTID position.
+ *
+ * @param server  The server
+ * @param gtids   The position
+ * @param n_gtids The number of domains in the position
+ * @return True if, in every domain of the position, the server has executed
+ * a transaction with at least the same sequence number.
+ */
+bool server_gtid_pos_reached(SERVER* server, const SERVER_GTID* gtids, int n_gtids)
+{
+    bool rval = true;
+
+    spinlock_acquire(&server->lock);
+
+    if (server->gtid_sample == 0)
+    {
+        rval = false;
+    }
+
+    for (int i = 0; rval && i < n_gtids; i++)
+    {
+        int j = 0;
+
+        while (j < server->n_gtid_pos && server->gtid_pos[j].domain != gtids[i].domain)
+        {
+            j++;
+        }
+
+        rval = j < server->n_gtid_pos && server->gtid_pos[j].sequence >= gtids[i].sequence;
+    }
+
+    spinlock_release(&server->lock);
+
+    return rval;
+}
+
+/**
+ * Check if the values of a server differ from a published snapshot
+ *
+ * @param server The server, its lock must be held
+ * @param state  The snapshot
+ * @return True if a new snapshot would differ from the given one
+ */
+static bool server_state_changed(SERVER* server, SERVER_STATE* state)
+{
+    return state->status != server->status ||
+           state->rlag != server->rlag ||
+           state->rlag_us != server->rlag_us ||
+           state->node_id != server->node_id ||
+           state->master_id != server->master_id ||
+           state->depth != server->depth ||
+           state->n_current != server->stats.n_current ||
+           state->n_current_ops != server->stats.n_current_ops ||
+           state->load != server->load ||
+           state->n_gtid_pos != server->n_gtid_pos ||
+           state->n_gtid_io_pos != server->n_gtid_io_pos ||
+           memcmp(state->gtid_pos, server->gtid_pos,
+                  server->n_gtid_pos * sizeof(SERVER_GTID)) != 0 ||
+           memcmp(state->gtid_io_pos, server->gtid_io_pos,
+                  server->n_gtid_io_pos * sizeof(SERVER_GTID)) != 0;
+}
+
+/**
+ * Publish a snapshot of the current state of a server
+ *
+ * The snapshot is written to the oldest of the SERVER_STATE_SLOTS slots and
+ * then made the current one with a single pointer swap. The monitors call
+ * this after each monitoring cycle, when the status of the server is in a
+ * consistent state, and the administrative commands after changing it.
+ *
+ * Nothing is published if the state has not changed since the previous
+ * snapshot, the version of the state then stays the same and the readers
+ * can use it to tell that nothing has changed. A change in the replication
+ * topology also changes the status generation of the servers.
+ *
+ * @param server The server
+ */
+void server_publish_state(SERVER* server)
+{
+    spinlock_acquire(&server->lock);
+
+    SERVER_STATE* current = server->state;
+
+    if (current && !server_state_changed(server, current))
+    {
+        spinlock_release(&server->lock);
+        return;
+    }
+
+    if (current == NULL || current->status != server->status || current->depth != server->depth ||
+        current->master_id != server->master_id || current->node_id != server->node_id)
+    {
+        /** The status or the replication topology changed, the routers that
+         * derive the root master from the snapshots must evaluate it again */
+        atomic_add(&status_generation, 1);
+    }
+
+    uint64_t version = ++server->state_version;
+    SERVER_STATE* state = &server->states[version % SERVER_STATE_SLOTS];
+
+    /** Readers that copy this slot while it is rewritten see the version
+     * change and read the newest snapshot again */
+    state->version = 0;
+    __sync_synchronize();
+
+    state->status = server->status;
+    state->rlag = server->rlag;
+    state->rlag_us = server->rlag_us;
+    state->node_id = server->node_id;
+    state->master_id = server->master_id;
+    state->depth = server->depth;
+    state->n_current = server->stats.n_current;
+    state->n_current_ops = server->stats.n_current_ops;
+    state->load = server->load;
+    memcpy(state->gtid_pos, server->gtid_pos, server->n_gtid_pos * sizeof(SERVER_GTID));
+    state->n_gtid_pos = server->n_gtid_pos;
+    memcpy(state->gtid_io_pos, server->gtid_io_pos, server->n_gtid_io_pos * sizeof(SERVER_GTID));
+    state->n_gtid_io_pos = server->n_gtid_io_pos;
+
+    __sync_synchronize();
+    state->version = version;
+    atomic_swap_ptr((void**)&server->state, state);
+
+    spinlock_release(&server->lock);
+}
+
+/**
+ * Get a consistent copy of the state of a server
+ *
+ * The newest published snapshot is copied without locking. If no snapshot
+ * has been published, for example because the server is not monitored, the
+ * copy is made from the current values of the server.
+ *
+ * @param server The server
+ * @param state  Where the state is copied
+ * @return True if the state is from a published snapshot
+ */
+bool server_get_state(SERVER* server, SERVER_STATE* state)
+{
+    while (true)
+    {
+        SERVER_STATE* current = *(SERVER_STATE * volatile *)&server->state;
+
+        if (current == NULL)
+        {
+            break;
+        }
+
+        uint64_t version = *(volatile uint64_t*)&current->version;
+        __sync_synchronize();
+        memcpy(state, current, sizeof(*state));
+        __sync_synchronize();
+
+        if (version != 0 && version == *(volatile uint64_t*)&current->version)
+        {
+            state->version = version;
+            return true;
+        }
+    }
+
+    state->version = 0;
+    state->status = server->status;
+    state->rlag = server->rlag;
+    state->rlag_us = atomic_load_int64(&server->rlag_us);
+    state->node_id = server->node_id;
+    state->master_id = server->master_id;
+    state->depth = server->depth;
+    state->n_current = server->stats.n_current;
+    state->n_current_ops = server->stats.n_current_ops;
+    state->load = atomic_load_int64(&server->load);
+    state->n_gtid_pos = 0;
+    server_get_gtid_pos(server, state->gtid_pos, &state->n_gtid_pos);
+    server_get_gtid_io_pos(server, state->gtid_io_pos, &state->n_gtid_io_pos);
+
+    return false;
+}
+
+/**
+ * Return the name of a cached global variable
+ *
+ * @param index Index of the variable
+ * @return The name of the variable
+ */
+const char *server_variable_name(int index)
+{
+    ss_dassert(index >= 0 && index < SERVER_N_VARIABLES);
+    return server_variables[index].name;
+}
+
+/**
+ * Check whether a cached global variable can be changed by a session
+ *
+ * @param index Index of the variable
+ * @return True if the session value of the variable may differ from the global value
+ */
+bool server_variable_is_session(int index)
+{
+    ss_dassert(index >= 0 && index < SERVER_N_VARIABLES);
+    return server_variables[index].session;
+}
+
+/**
+ * Find a cached global variable by name
+ *
+ * @param name Name of the variable, case insensitive
+ * @param len  Length of the name
+ * @return The index of the variable or -1 if the variable is not cached
+ */
+int server_variable_index(const char* name, size_t len)
+{
+    for (int i = 0; i < SERVER_N_VARIABLES; i++)
+    {
+        if (strlen(server_variables[i].name) == len &&
+            strncasecmp(server_variables[i].name, name, len) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Set the value of a cached global variable
+ *
+ * @param server Server to update
+ * @param index  Index of the variable
+ * @param value  The value or NULL if it is not known
+ * @return True if the value was stored, false if memory allocation failed
+ */
+bool server_set_variable(SERVER* server, int index, const char* value)
+{
+    ss_dassert(index >= 0 && index < SERVER_N_VARIABLES);
+    bool rval = true;
+    char *copy = NULL;
+
+    if (value && (copy = strdup(value)) == NULL)
+    {
+        MXS_ERROR("Memory allocation failed.");
+        rval = false;
+    }
+
+    spinlock_acquire(&server->lock);
+    char *old = server->variables[index];
+    server->variables[index] = copy;
+    spinlock_release(&server->lock);
+
+    free(old);
+    return rval;
+}
+
+/**
+ * Get the value of a cached global variable
+ *
+ * @param server Server to query
+ * @param index  Index of the variable
+ * @param dest   Where the value is copied
+ * @param size   Size of dest
+ * @return True if the value is known and fits into dest
+ */
+bool server_get_variable(SERVER* server, int index, char* dest, size_t size)
+{
+    ss_dassert(index >= 0 && index < SERVER_N_VARIABLES);
+    bool rval = false;
+
+    spinlock_acquire(&server->lock);
+    const char *value = server->variables[index];
+
+    if (value && strlen(value) < size)
+    {
+        strcpy(dest, value);
+        rval = true;
+    }
+    spinlock_release(&server->lock);
+
+    return rval;
+}
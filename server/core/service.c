@@ -34,6 +34,11 @@
  * 03/03/15     Massimiliano Pinto      Added config_enable_feedback_task() call in serviceStartAll
  * 19/06/15     Martin Brampton         More meaningful names for temp variables
  * 31/05/16     Martin Brampton         Implement connection throttling
+ * 14/10/16     MariaDB Corporation     Added loading of users in the background
+ * 14/10/16     MariaDB Corporation     Services are started by several threads
+ * 14/10/16     MariaDB Corporation     Router options, filters and listeners can be reloaded
+ * 14/10/16     MariaDB Corporation     Services can have polling threads of their own
+ * 14/10/16     MariaDB Corporation     The listeners of all services can be stopped at once
  *
  * @endverbatim
  */
@@ -49,6 +54,7 @@
 #include <server.h>
 #include <router.h>
 #include <spinlock.h>
+#include <rwlock.h>
 #include <modules.h>
 #include <dcb.h>
 #include <users.h>
@@ -66,6 +72,10 @@
 #include <math.h>
 #include <version.h>
 #include <queuemanager.h>
+#include <thread.h>
+#include <mysql.h>
+#include <atomic.h>
+#include <governor.h>
 
 /** To be used with configuration type checks */
 typedef struct typelib_st
@@ -88,7 +98,11 @@ typelib_t sqlvar_target_type =
     sqlvar_target_strings
 };
 
-static SPINLOCK service_spin = SPINLOCK_INIT;
+/** How long the data replaced by a configuration reload is kept, in seconds.
+ * The sessions that are being created may still be reading it. */
+#define SERVICE_RETIRE_DELAY 60
+
+static RWLOCK service_lock = RWLOCK_INIT;
 static SERVICE  *allServices = NULL;
 
 static int find_type(typelib_t* tl, const char* needle, int maxlen);
@@ -166,10 +180,10 @@ service_alloc(const char *servname, const char *router)
     spinlock_init(&service->spin);
     spinlock_init(&service->users_table_spin);
 
-    spinlock_acquire(&service_spin);
+    rwlock_write_acquire(&service_lock);
     service->next = allServices;
     allServices = service;
-    spinlock_release(&service_spin);
+    rwlock_write_release(&service_lock);
 
     return service;
 }
@@ -186,7 +200,7 @@ service_isvalid(SERVICE *service)
     SERVICE *checkservice;
     int rval = 0;
 
-    spinlock_acquire(&service_spin);
+    rwlock_read_acquire(&service_lock);
     checkservice = allServices;
     while (checkservice)
     {
@@ -197,10 +211,60 @@ service_isvalid(SERVICE *service)
         }
         checkservice = checkservice->next;
     }
-    spinlock_release(&service_spin);
+    rwlock_read_release(&service_lock);
     return rval;
 }
 
+/**
+ * Get the path of the users cache file of a service
+ *
+ * @param service The service
+ * @param path Buffer where the path is written
+ * @param size Size of the buffer
+ */
+static void
+service_users_cache_path(SERVICE *service, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%s/.cache/dbusers", get_cachedir(), service->name);
+}
+
+/**
+ * Create a directory of the users cache if it does not exist
+ *
+ * @param path The directory
+ */
+static void
+service_users_cache_mkdir(const char *path)
+{
+    if (access(path, R_OK) == -1 && mkdir(path, 0777) && errno != EEXIST)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to create directory '%s': [%d] %s",
+                  path,
+                  errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+}
+
+/**
+ * Save the users of a service to the users cache file
+ *
+ * @param service The service
+ */
+static void
+service_save_users_cache(SERVICE *service)
+{
+    char path[PATH_MAX + 1];
+
+    snprintf(path, sizeof(path), "%s/%s", get_cachedir(), service->name);
+    service_users_cache_mkdir(path);
+    strncat(path, "/.cache", PATH_MAX - strlen(path));
+    service_users_cache_mkdir(path);
+    strncat(path, "/dbusers", PATH_MAX - strlen(path));
+
+    dbusers_save(service->users, path);
+}
+
 /**
  * Start an individual port/protocol pair
  *
@@ -230,6 +294,9 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
         goto retblock;
     }
 
+    /** The service decides which threads poll the listener */
+    port->listener->service = service;
+
     if (port->ssl)
     {
         listener_init_SSL(port->ssl);
@@ -241,13 +308,25 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
 
         if (service->users == NULL)
         {
+            char path[PATH_MAX + 1];
+            bool cached = false;
+
             /*
              * Allocate specific data for MySQL users
              * including hosts and db names
              */
             service->users = mysql_users_alloc();
+            service_users_cache_path(service, path, sizeof(path));
 
-            if ((loaded = load_mysql_users(service)) < 0)
+            /* Accept clients with the cached users while the users are loaded */
+            if (access(path, R_OK) == 0 && (loaded = dbusers_load(service->users, path)) > 0)
+            {
+                MXS_NOTICE("Loaded %d cached MySQL Users for service [%s], loading the "
+                           "users from the backend servers in the background.",
+                           loaded, service->name);
+                cached = true;
+            }
+            else if ((loaded = load_mysql_users(service)) < 0)
             {
                 MXS_ERROR("Unable to load users for "
                           "service %s listening at %s:%d.",
@@ -257,11 +336,6 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
 
                 {
                     /* Try loading authentication data from file cache */
-                    char *ptr, path[PATH_MAX + 1];
-                    strncpy(path, get_cachedir(), sizeof(path) - 1);
-                    strncat(path, "/", sizeof(path) - 1);
-                    strncat(path, service->name, sizeof(path) - 1);
-                    strncat(path, "/.cache/dbusers", sizeof(path) - 1);
                     loaded = dbusers_load(service->users, path);
                     if (loaded != -1)
                     {
@@ -278,49 +352,7 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
             else
             {
                 /* Save authentication data to file cache */
-                char *ptr, path[PATH_MAX + 1];
-                int mkdir_rval = 0;
-                strncpy(path, get_cachedir(), PATH_MAX);
-                strncat(path, "/", 4096);
-                strncat(path, service->name, PATH_MAX);
-                if (access(path, R_OK) == -1)
-                {
-                    mkdir_rval = mkdir(path, 0777);
-                }
-
-                if (mkdir_rval)
-                {
-                    if (errno != EEXIST)
-                    {
-                        char errbuf[STRERROR_BUFLEN];
-                        MXS_ERROR("Failed to create directory '%s': [%d] %s",
-                                  path,
-                                  errno,
-                                  strerror_r(errno, errbuf, sizeof(errbuf)));
-                    }
-                    mkdir_rval = 0;
-                }
-
-                strncat(path, "/.cache", PATH_MAX);
-                if (access(path, R_OK) == -1)
-                {
-                    mkdir_rval = mkdir(path, 0777);
-                }
-
-                if (mkdir_rval)
-                {
-                    if (errno != EEXIST)
-                    {
-                        char errbuf[STRERROR_BUFLEN];
-                        MXS_ERROR("Failed to create directory '%s': [%d] %s",
-                                  path,
-                                  errno,
-                                  strerror_r(errno, errbuf, sizeof(errbuf)));
-                    }
-                    mkdir_rval = 0;
-                }
-                strncat(path, "/dbusers", PATH_MAX);
-                dbusers_save(service->users, path);
+                service_save_users_cache(service);
             }
             if (loaded == 0)
             {
@@ -336,8 +368,15 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
             service->rate_limit.last = time(NULL) - USERS_REFRESH_TIME;
             service->rate_limit.nloads = 1;
 
-            MXS_NOTICE("Loaded %d MySQL Users for service [%s].",
-                       loaded, service->name);
+            if (cached)
+            {
+                service_refresh_users_async(service, NULL, NULL);
+            }
+            else
+            {
+                MXS_NOTICE("Loaded %d MySQL Users for service [%s].",
+                           loaded, service->name);
+            }
         }
     }
     else
@@ -562,34 +601,234 @@ serviceStartProtocol(SERVICE *service, char *protocol, int port)
 }
 
 
+/**
+ * The state shared by the threads that start the services
+ */
+typedef struct
+{
+    SPINLOCK lock;      /*< Protects the other fields */
+    SERVICE *next;      /*< The next service to start */
+    int      listeners; /*< The number of listeners started */
+    bool     error;     /*< A service failed to start */
+} SERVICE_STARTER;
+
+/**
+ * Take the next service to start
+ *
+ * @param starter The starter
+ * @return The service or NULL if all services have been taken
+ */
+static SERVICE *
+service_start_next(SERVICE_STARTER *starter)
+{
+    SERVICE *service;
+
+    spinlock_acquire(&starter->lock);
+    service = starter->next;
+    if (service && service->svc_do_shutdown)
+    {
+        service = NULL;
+    }
+    starter->next = service ? service->next : NULL;
+    spinlock_release(&starter->lock);
+
+    return service;
+}
+
+/**
+ * Start services until all have been started
+ *
+ * Each service opens its listeners as soon as its own users have been loaded,
+ * so the services that start quickly do not wait for the slow ones.
+ *
+ * @param starter The starter
+ */
+static void
+service_start_services(SERVICE_STARTER *starter)
+{
+    SERVICE *service;
+
+    while ((service = service_start_next(starter)) != NULL)
+    {
+        uint64_t start = ts_clock_us();
+        int listeners = serviceStart(service);
+
+        if (listeners == 0)
+        {
+            MXS_ERROR("Failed to start service '%s'.", service->name);
+        }
+        else
+        {
+            MXS_NOTICE("Starting service '%s' took %.3f seconds.", service->name,
+                       (ts_clock_us() - start) / 1000000.0);
+        }
+
+        spinlock_acquire(&starter->lock);
+        starter->listeners += listeners;
+        starter->error = starter->error || listeners == 0;
+        spinlock_release(&starter->lock);
+    }
+}
+
+/**
+ * The entry point of the additional threads that start the services
+ *
+ * @param data The starter
+ */
+static void
+service_start_thread(void *data)
+{
+    mysql_thread_init();
+    service_start_services((SERVICE_STARTER *)data);
+    mysql_thread_end();
+}
+
 /**
  * Start all the services
  *
+ * The services are started by up to service_start_threads threads at the
+ * same time, as starting a service waits for the users to be loaded from
+ * the backend servers.
+ *
  * @return Return the number of services started
  */
 int
 serviceStartAll()
 {
+    SERVICE_STARTER starter;
     SERVICE *ptr;
-    int n = 0, i;
-    bool error = false;
+    int n_services = 0;
+    int n_threads;
+    uint64_t start = ts_clock_us();
 
     config_enable_feedback_task();
 
-    ptr = allServices;
-    while (ptr && !ptr->svc_do_shutdown)
+    for (ptr = allServices; ptr; ptr = ptr->next)
+    {
+        /** The threads are reserved in the order of the configuration */
+        if (ptr->dedicated_threads > 0)
+        {
+            ptr->poll_group = poll_add_group(ptr->name, ptr->dedicated_threads);
+        }
+        n_services++;
+    }
+
+    spinlock_init(&starter.lock);
+    starter.next = allServices;
+    starter.listeners = 0;
+    starter.error = false;
+
+    n_threads = MIN(config_service_start_threads(), n_services);
+    THREAD threads[n_threads > 1 ? n_threads - 1 : 1];
+    int started = 0;
+
+    /** The calling thread starts services as well */
+    while (started < n_threads - 1 &&
+           thread_start(&threads[started], service_start_thread, &starter) != NULL)
     {
-        n += (i = serviceStart(ptr));
+        started++;
+    }
+
+    service_start_services(&starter);
+
+    for (int i = 0; i < started; i++)
+    {
+        thread_wait(threads[i]);
+    }
+
+    MXS_NOTICE("Starting %d services took %.3f seconds with %d threads.", n_services,
+               (ts_clock_us() - start) / 1000000.0, started + 1);
+
+    return starter.error ? 0 : starter.listeners;
+}
+
+/**
+ * Stop a listener of a service
+ *
+ * The listener stops accepting connections, the sessions that were created
+ * through it are not affected.
+ *
+ * @param port The listener to stop
+ * @return True if the listener was stopped
+ */
+bool
+serviceStopListener(SERV_LISTENER *port)
+{
+    if (port->listener && port->listener->session->state == SESSION_STATE_LISTENER &&
+        poll_remove_dcb(port->listener) == 0)
+    {
+        port->listener->session->state = SESSION_STATE_LISTENER_STOPPED;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Stop the listeners of all services
+ *
+ * @param n_ports Set to the number of listeners that were stopped
+ * @return Array of the stopped listeners, NULL if none were stopped or if
+ *         memory allocation failed. The caller frees the array.
+ */
+SERV_LISTENER **
+serviceStopAllListeners(int *n_ports)
+{
+    SERV_LISTENER **ports = NULL;
+    int n = 0;
+    int max = 0;
 
-        if (i == 0)
+    for (SERVICE *service = allServices; service; service = service->next)
+    {
+        for (SERV_LISTENER *port = service->ports; port; port = port->next)
         {
-            MXS_ERROR("Failed to start service '%s'.", ptr->name);
-            error = true;
+            if (n == max)
+            {
+                SERV_LISTENER **tmp = realloc(ports, (max + 16) * sizeof(*ports));
+
+                if (tmp == NULL)
+                {
+                    MXS_ERROR("Failed to allocate memory for the listeners of the services.");
+                    break;
+                }
+                ports = tmp;
+                max += 16;
+            }
+
+            if (serviceStopListener(port))
+            {
+                ports[n++] = port;
+            }
         }
+    }
 
-        ptr = ptr->next;
+    if (n == 0)
+    {
+        free(ports);
+        ports = NULL;
+    }
+
+    *n_ports = n;
+    return ports;
+}
+
+/**
+ * Restart a stopped listener of a service
+ *
+ * @param port The listener to restart
+ * @return True if the listener was restarted
+ */
+bool
+serviceRestartListener(SERV_LISTENER *port)
+{
+    if (port->listener && port->listener->session->state == SESSION_STATE_LISTENER_STOPPED &&
+        poll_add_dcb(port->listener) == 0)
+    {
+        port->listener->session->state = SESSION_STATE_LISTENER;
+        return true;
     }
-    return error ? 0 : n;
+
+    return false;
 }
 
 /**
@@ -609,13 +848,9 @@ serviceStop(SERVICE *service)
     port = service->ports;
     while (port)
     {
-        if (port->listener && port->listener->session->state == SESSION_STATE_LISTENER)
+        if (serviceStopListener(port))
         {
-            if (poll_remove_dcb(port->listener) == 0)
-            {
-                port->listener->session->state = SESSION_STATE_LISTENER_STOPPED;
-                listeners++;
-            }
+            listeners++;
         }
         port = port->next;
     }
@@ -641,13 +876,9 @@ serviceRestart(SERVICE *service)
     port = service->ports;
     while (port)
     {
-        if (port->listener && port->listener->session->state == SESSION_STATE_LISTENER_STOPPED)
+        if (serviceRestartListener(port))
         {
-            if (poll_add_dcb(port->listener) == 0)
-            {
-                port->listener->session->state = SESSION_STATE_LISTENER;
-                listeners++;
-            }
+            listeners++;
         }
         port = port->next;
     }
@@ -672,7 +903,7 @@ service_free(SERVICE *service)
         return 0;
     }
     /* First of all remove from the linked list */
-    spinlock_acquire(&service_spin);
+    rwlock_write_acquire(&service_lock);
     if (allServices == service)
     {
         allServices = service->next;
@@ -689,7 +920,7 @@ service_free(SERVICE *service)
             ptr->next = service->next;
         }
     }
-    spinlock_release(&service_spin);
+    rwlock_write_release(&service_lock);
 
     /* Clean up session and free the memory */
     while (service->dbref)
@@ -710,6 +941,8 @@ service_free(SERVICE *service)
     users_free(service->users);
     hashtable_free(service->resources);
     serviceClearRouterOptions(service);
+    ts_latency_free(service->latency);
+    governor_free(service->governor);
 
     free(service);
     return 1;
@@ -755,6 +988,21 @@ serviceAddProtocol(SERVICE *service, char *protocol, char *address, unsigned sho
  */
 int serviceHasProtocol(SERVICE *service, const char *protocol,
                        const char* address, unsigned short port)
+{
+    return serviceFindListener(service, protocol, address, port) != NULL;
+}
+
+/**
+ * Find a listener of a service
+ *
+ * @param service  The service
+ * @param protocol The name of the protocol module
+ * @param address  The address or the socket the listener uses, NULL for any address
+ * @param port     The port of the listener, 0 for a socket
+ * @return The listener or NULL if the service has no such listener
+ */
+SERV_LISTENER *serviceFindListener(SERVICE *service, const char *protocol,
+                                   const char* address, unsigned short port)
 {
     SERV_LISTENER *proto;
 
@@ -772,7 +1020,7 @@ int serviceHasProtocol(SERVICE *service, const char *protocol,
     }
     spinlock_release(&service->spin);
 
-    return proto != NULL;
+    return proto;
 }
 
 /**
@@ -886,6 +1134,112 @@ serviceClearRouterOptions(SERVICE *service)
     }
     spinlock_release(&service->spin);
 }
+/**
+ * Free data that was replaced by a configuration reload once the sessions
+ * that may still be reading it are done with it
+ *
+ * @param freefn The function that frees the data
+ * @param data   The data
+ */
+static void
+service_retire(void (*freefn)(void *), void *data)
+{
+    static int retired = 0;
+    char name[64];
+
+    snprintf(name, sizeof(name), "retired_service_data_%d", atomic_add(&retired, 1));
+
+    if (!hktask_oneshot(name, freefn, data, SERVICE_RETIRE_DELAY))
+    {
+        /** Leaking the data is safer than freeing it while it is in use */
+        MXS_WARNING("Failed to schedule the freeing of replaced service data.");
+    }
+}
+
+static void
+free_router_options(void *data)
+{
+    free_string_array((char **)data);
+}
+
+/**
+ * Replace the router options of a running service
+ *
+ * The configuration version of the service is incremented when the options
+ * change, the routers that refresh their configuration when the version
+ * changes apply the new options to the sessions that are created after this.
+ *
+ * @param service The service
+ * @param options The comma separated router options, NULL or empty for none
+ * @return True if the options changed
+ */
+bool
+serviceUpdateRouterOptions(SERVICE *service, char *options)
+{
+    char **array = NULL;
+    int n = 0;
+
+    if (options && *options)
+    {
+        char *lasts;
+        char *s = strtok_r(options, ",", &lasts);
+
+        while (s)
+        {
+            char **tmp = realloc(array, (n + 2) * sizeof(char *));
+
+            if (tmp == NULL || (tmp[n] = strdup(s)) == NULL)
+            {
+                MXS_ERROR("Out of memory updating the router options of service '%s'.",
+                          service->name);
+                array = tmp ? tmp : array;
+                if (array)
+                {
+                    array[n] = NULL;
+                }
+                free_string_array(array);
+                return false;
+            }
+
+            array = tmp;
+            array[++n] = NULL;
+            s = strtok_r(NULL, ",", &lasts);
+        }
+    }
+
+    spinlock_acquire(&service->spin);
+    char **old = service->routerOptions;
+    int i = 0;
+
+    while (old && old[i] && i < n && strcmp(old[i], array[i]) == 0)
+    {
+        i++;
+    }
+
+    bool changed = i != n || (old && old[i]);
+
+    if (changed)
+    {
+        service->routerOptions = array;
+        atomic_add(&service->svc_config_version, 1);
+    }
+    spinlock_release(&service->spin);
+
+    if (changed)
+    {
+        if (old)
+        {
+            service_retire(free_router_options, old);
+        }
+    }
+    else
+    {
+        free_string_array(array);
+    }
+
+    return changed;
+}
+
 /**
  * Set the service user that is used to log in to the backebd servers
  * associated with this service.
@@ -1000,6 +1354,72 @@ int serviceStripDbEsc(SERVICE* service, int action)
     return 1;
 }
 
+/** The names of the probe queries in the local_probes parameter */
+static const struct
+{
+    const char *name;
+    int value;
+} service_probe_names[] =
+{
+    {"variables", SERVICE_PROBE_VARIABLES},
+    {"database", SERVICE_PROBE_DATABASE},
+    {"set_names", SERVICE_PROBE_SET_NAMES},
+    {"all", SERVICE_PROBE_ALL},
+    {"none", 0}
+};
+
+#define SERVICE_N_PROBE_NAMES (sizeof(service_probe_names) / sizeof(service_probe_names[0]))
+
+/**
+ * Set the probe queries of the connectors that are answered without sending
+ * them to the backends.
+ *
+ * @param service Service to configure
+ * @param value   Comma separated list of variables, database, set_names, all
+ *                or none
+ * @return True if the list was valid
+ */
+bool serviceSetLocalProbes(SERVICE* service, const char* value)
+{
+    int probes = 0;
+    const char *ptr = value;
+
+    while (*ptr)
+    {
+        ptr += strspn(ptr, " \t,");
+        size_t len = strcspn(ptr, " \t,");
+
+        if (len == 0)
+        {
+            break;
+        }
+
+        size_t i;
+
+        for (i = 0; i < SERVICE_N_PROBE_NAMES; i++)
+        {
+            if (strlen(service_probe_names[i].name) == len &&
+                strncasecmp(service_probe_names[i].name, ptr, len) == 0)
+            {
+                probes |= service_probe_names[i].value;
+                break;
+            }
+        }
+
+        if (i == SERVICE_N_PROBE_NAMES)
+        {
+            MXS_ERROR("Unknown probe query '%.*s' for service '%s'.",
+                      (int)len, ptr, service->name);
+            return false;
+        }
+
+        ptr += len;
+    }
+
+    service->local_probes = probes;
+    return true;
+}
+
 
 /**
  * Sets the session timeout for the service.
@@ -1067,33 +1487,37 @@ void serviceSetRetryOnFailure(SERVICE *service, char* value)
 }
 
 /**
- * Set the filters used by the service
+ * Parse a list of filters
  *
- * @param service       The service itself
- * @param filters       ASCII string of filters to use
- * @return True if loading and creating all filters was successful. False if a
- * filter module was not found or the instance creation failed.
+ * The filters are looked up and loaded. The @c filters string is modified.
+ *
+ * @param service The service the filters are for
+ * @param filters The list of filters separated by |
+ * @param n       The number of filters in the list
+ * @return A NULL terminated array of the filters or NULL on error
  */
-bool
-serviceSetFilters(SERVICE *service, char *filters)
+static FILTER_DEF **
+service_parse_filters(SERVICE *service, char *filters, int *n)
 {
     FILTER_DEF **flist;
     char *ptr, *brkt;
-    int n = 0;
     bool rval = true;
 
+    *n = 0;
+
     if ((flist = (FILTER_DEF **) malloc(sizeof(FILTER_DEF *))) == NULL)
     {
         MXS_ERROR("Out of memory adding filters to service.\n");
-        return false;
+        return NULL;
     }
+    flist[0] = NULL;
     ptr = strtok_r(filters, "|", &brkt);
     while (ptr)
     {
-        n++;
+        (*n)++;
         FILTER_DEF **tmp;
         if ((tmp = (FILTER_DEF **) realloc(flist,
-                                           (n + 1) * sizeof(FILTER_DEF *))) == NULL)
+                                           (*n + 1) * sizeof(FILTER_DEF *))) == NULL)
         {
             MXS_ERROR("Out of memory adding filters to service.");
             rval = false;
@@ -1103,9 +1527,9 @@ serviceSetFilters(SERVICE *service, char *filters)
         flist = tmp;
         char *filter_name = trim(ptr);
 
-        if ((flist[n - 1] = filter_find(filter_name)))
+        if ((flist[*n - 1] = filter_find(filter_name)))
         {
-            if (!filter_load(flist[n - 1]))
+            if (!filter_load(flist[*n - 1]))
             {
                 MXS_ERROR("Failed to load filter '%s' for service '%s'.",
                           filter_name, service->name);
@@ -1121,21 +1545,107 @@ serviceSetFilters(SERVICE *service, char *filters)
             break;
         }
 
-        flist[n] = NULL;
+        flist[*n] = NULL;
         ptr = strtok_r(NULL, "|", &brkt);
     }
 
-    if (rval)
+    if (!rval)
     {
-        service->filters = flist;
-        service->n_filters = n;
+        free(flist);
+        flist = NULL;
+    }
+
+    return flist;
+}
+
+/**
+ * Make a list of filters the filters of a service
+ *
+ * The list is published before its length so that the sessions that are
+ * being created never read past its end. The old list is freed later.
+ *
+ * @param service The service
+ * @param flist   The NULL terminated list of filters
+ * @param n       The number of filters in the list
+ */
+static void
+service_publish_filters(SERVICE *service, FILTER_DEF **flist, int n)
+{
+    FILTER_DEF **old = service->filters;
+
+    atomic_store_ptr((void **)&service->filters, flist);
+    service->n_filters = n;
+
+    if (old)
+    {
+        service_retire(free, old);
+    }
+}
+
+/**
+ * Set the filters used by the service
+ *
+ * @param service       The service itself
+ * @param filters       ASCII string of filters to use
+ * @return True if loading and creating all filters was successful. False if a
+ * filter module was not found or the instance creation failed.
+ */
+bool
+serviceSetFilters(SERVICE *service, char *filters)
+{
+    int n;
+    FILTER_DEF **flist = service_parse_filters(service, filters, &n);
+
+    if (flist)
+    {
+        service_publish_filters(service, flist, n);
+    }
+
+    return flist != NULL;
+}
+
+/**
+ * Replace the filters of a running service
+ *
+ * The sessions that are created after this use the new filters, the existing
+ * sessions keep the filters they were created with.
+ *
+ * @param service The service
+ * @param filters The list of filters separated by |, NULL for none
+ * @return True if the filters changed
+ */
+bool
+serviceUpdateFilters(SERVICE *service, char *filters)
+{
+    char none[] = "";
+    int n;
+    FILTER_DEF **flist = service_parse_filters(service, filters ? filters : none, &n);
+
+    if (flist == NULL)
+    {
+        return false;
+    }
+
+    FILTER_DEF **old = service->filters;
+    int i = 0;
+
+    while (old && old[i] && i < n && old[i] == flist[i])
+    {
+        i++;
+    }
+
+    bool changed = i != n || (old && old[i]);
+
+    if (changed)
+    {
+        service_publish_filters(service, flist, n);
     }
     else
     {
         free(flist);
     }
 
-    return rval;
+    return changed;
 }
 
 /**
@@ -1149,13 +1659,13 @@ service_find(char *servname)
 {
     SERVICE *service;
 
-    spinlock_acquire(&service_spin);
+    rwlock_read_acquire(&service_lock);
     service = allServices;
     while (service && strcmp(service->name, servname) != 0)
     {
         service = service->next;
     }
-    spinlock_release(&service_spin);
+    rwlock_read_release(&service_lock);
 
     return service;
 }
@@ -1212,14 +1722,14 @@ printAllServices()
 {
     SERVICE *ptr;
 
-    spinlock_acquire(&service_spin);
+    rwlock_read_acquire(&service_lock);
     ptr = allServices;
     while (ptr)
     {
         printService(ptr);
         ptr = ptr->next;
     }
-    spinlock_release(&service_spin);
+    rwlock_read_release(&service_lock);
 }
 
 /**
@@ -1233,14 +1743,14 @@ dprintAllServices(DCB *dcb)
 {
     SERVICE *ptr;
 
-    spinlock_acquire(&service_spin);
+    rwlock_read_acquire(&service_lock);
     ptr = allServices;
     while (ptr)
     {
         dprintService(dcb, ptr);
         ptr = ptr->next;
     }
-    spinlock_release(&service_spin);
+    rwlock_read_release(&service_lock);
 }
 
 /**
@@ -1284,6 +1794,29 @@ void dprintService(DCB *dcb, SERVICE *service)
                asctime_r(localtime_r(&service->stats.started, &result), timebuf));
     dcb_printf(dcb, "\tRoot user access:                    %s\n",
                service->enable_root ? "Enabled" : "Disabled");
+    if (service->poll_group > 0)
+    {
+        dcb_printf(dcb, "\tDedicated polling threads:           %d\n",
+                   service->dedicated_threads);
+    }
+    if (service->max_execution_time)
+    {
+        dcb_printf(dcb, "\tMaximum query execution time:        %d ms\n",
+                   service->max_execution_time);
+    }
+    if (service->local_probes)
+    {
+        dcb_printf(dcb, "\tLocally answered probe queries:      %s%s%s\n",
+                   service->local_probes & SERVICE_PROBE_VARIABLES ? "variables " : "",
+                   service->local_probes & SERVICE_PROBE_DATABASE ? "database " : "",
+                   service->local_probes & SERVICE_PROBE_SET_NAMES ? "set_names" : "");
+        dcb_printf(dcb, "\tProbe queries answered:              %d\n",
+                   service->stats.n_probes);
+    }
+    if (service->governor)
+    {
+        governor_dprint(dcb, service->governor);
+    }
     if (service->n_filters)
     {
         dcb_printf(dcb, "\tFilter chain:                ");
@@ -1312,6 +1845,55 @@ void dprintService(DCB *dcb, SERVICE *service)
                service->stats.n_sessions);
     dcb_printf(dcb, "\tCurrently connected:                 %d\n",
                service->stats.n_current);
+    for (SERV_LISTENER *port = service->ports; port; port = port->next)
+    {
+        if (port->ssl)
+        {
+            dcb_printf(dcb, "\tSSL handshakes on port %-5d          %d full, %d resumed\n",
+                       port->port, port->ssl->n_handshakes, port->ssl->n_resumed);
+        }
+        if (port->compression)
+        {
+            int64_t plain = atomic_load_int64(&port->compress_plain);
+            int64_t sent = atomic_load_int64(&port->compress_sent);
+
+            dcb_printf(dcb, "\tCompression on port %-5d             level %d\n",
+                       port->port, port->compression);
+            dcb_printf(dcb, "\t\tBytes written to clients:    %ld, %ld compressed (ratio %.2f)\n",
+                       (long)plain, (long)sent, sent ? (double)plain / sent : 0.0);
+            dcb_printf(dcb, "\t\tBytes read from clients:     %ld, %ld compressed\n",
+                       (long)atomic_load_int64(&port->decompress_plain),
+                       (long)atomic_load_int64(&port->decompress_read));
+            dcb_printf(dcb, "\t\tCompression CPU time:        %.3f s\n",
+                       atomic_load_int64(&port->compress_cpu_ns) / 1e9);
+        }
+    }
+    dprintLatency(dcb, "\tQuery latency (ms):                  ", service->latency);
+}
+
+/**
+ * Record the latency of a query, from routing it to a server to the reply
+ *
+ * The latency is recorded for both the service and the server.
+ *
+ * @param service The service that routed the query
+ * @param server  The server that replied
+ * @param us      The latency in microseconds
+ */
+void
+service_record_latency(SERVICE *service, SERVER *server, uint64_t us)
+{
+    TS_LATENCY *latency;
+
+    if ((latency = ts_latency_get(&service->latency)))
+    {
+        ts_latency_add(latency, us);
+    }
+
+    if ((latency = ts_latency_get(&server->latency)))
+    {
+        ts_latency_add(latency, us);
+    }
 }
 
 /**
@@ -1324,7 +1906,7 @@ dListServices(DCB *dcb)
 {
     SERVICE *service;
 
-    spinlock_acquire(&service_spin);
+    rwlock_read_acquire(&service_lock);
     service = allServices;
     if (service)
     {
@@ -1346,7 +1928,52 @@ dListServices(DCB *dcb)
     {
         dcb_printf(dcb, "--------------------------+----------------------+--------+---------------\n\n");
     }
-    spinlock_release(&service_spin);
+    rwlock_read_release(&service_lock);
+}
+
+/**
+ * Print the memory used by the sessions of each service. The session bytes
+ * are the fixed size of the sessions, the buffers are accounted separately.
+ *
+ * @param dcb DCB to print to
+ */
+void
+dprintServicesMemory(DCB *dcb)
+{
+    SERVICE *service;
+    int n = 0;
+
+    rwlock_read_acquire(&service_lock);
+
+    for (service = allServices; service; service = service->next)
+    {
+        n++;
+    }
+
+    SERVICE *services[n > 0 ? n : 1];
+    int64_t writeq[n > 0 ? n : 1];
+
+    n = 0;
+    for (service = allServices; service; service = service->next)
+    {
+        services[n++] = service;
+    }
+
+    dcb_writeq_by_service(services, writeq, n);
+
+    dcb_printf(dcb, "Memory usage of the services\n");
+    dcb_printf(dcb, "--------------------------+----------+-------------------+-------------------\n");
+    dcb_printf(dcb, "%-25s | Sessions | %17s | %s\n", "Service Name", "Session Bytes", "Write Queue Bytes");
+    dcb_printf(dcb, "--------------------------+----------+-------------------+-------------------\n");
+    for (int i = 0; i < n; i++)
+    {
+        dcb_printf(dcb, "%-25s | %8d | %17lu | %ld\n", services[i]->name,
+                   services[i]->stats.n_current,
+                   (unsigned long)services[i]->stats.n_current * sizeof(SESSION), writeq[i]);
+    }
+    dcb_printf(dcb, "--------------------------+----------+-------------------+-------------------\n\n");
+
+    rwlock_read_release(&service_lock);
 }
 
 /**
@@ -1360,7 +1987,7 @@ dListListeners(DCB *dcb)
     SERVICE *service;
     SERV_LISTENER *lptr;
 
-    spinlock_acquire(&service_spin);
+    rwlock_read_acquire(&service_lock);
     service = allServices;
     if (service)
     {
@@ -1392,7 +2019,7 @@ dListListeners(DCB *dcb)
     {
         dcb_printf(dcb, "---------------------+--------------------+-----------------+-------+--------\n\n");
     }
-    spinlock_release(&service_spin);
+    rwlock_read_release(&service_lock);
 }
 
 /**
@@ -1437,16 +2064,17 @@ service_update(SERVICE *service, char *router, char *user, char *auth)
 }
 
 /**
- * Refresh the database users for the service
- * This function replaces the MySQL users used by the service with the latest
- * version found on the backend servers. There is a limit on how often the users
- * can be reloaded and if this limit is exceeded, the reload will fail.
+ * Check that the users of a service can be refreshed and take the refresh lock
+ *
+ * The caller must release the users_table_spin lock of the service once
+ * the users have been loaded.
+ *
  * @param service Service to reload
- * @return 0 on success and 1 on error
+ * @return True if the lock was taken, false if another thread is loading the
+ * users or if the refresh rate limit was exceeded
  */
-int service_refresh_users(SERVICE *service)
+static bool service_refresh_users_start(SERVICE *service)
 {
-    int ret = 1;
     /* check for another running getUsers request */
     if (!spinlock_acquire_nowait(&service->users_table_spin))
     {
@@ -1454,7 +2082,7 @@ int service_refresh_users(SERVICE *service)
                   "loading new users' table: another thread is loading users",
                   service->name);
 
-        return 1;
+        return false;
     }
 
     /* check if refresh rate limit has exceeded */
@@ -1465,7 +2093,7 @@ int service_refresh_users(SERVICE *service)
         MXS_ERROR("%s: Refresh rate limit exceeded for load of users' table.",
                   service->name);
 
-        return 1;
+        return false;
     }
 
     service->rate_limit.nloads++;
@@ -1477,6 +2105,26 @@ int service_refresh_users(SERVICE *service)
         service->rate_limit.last = time(NULL);
     }
 
+    return true;
+}
+
+/**
+ * Refresh the database users for the service
+ * This function replaces the MySQL users used by the service with the latest
+ * version found on the backend servers. There is a limit on how often the users
+ * can be reloaded and if this limit is exceeded, the reload will fail.
+ * @param service Service to reload
+ * @return 0 on success and 1 on error
+ */
+int service_refresh_users(SERVICE *service)
+{
+    int ret = 1;
+
+    if (!service_refresh_users_start(service))
+    {
+        return 1;
+    }
+
     ret = replace_mysql_users(service);
 
     /* remove lock */
@@ -1492,6 +2140,152 @@ int service_refresh_users(SERVICE *service)
     }
 }
 
+/**
+ * The thread that loads the users of a service in the background
+ *
+ * Once the users have been loaded, the packets of the waiting clients are
+ * delivered back to them as read events so that they are authenticated
+ * again with the new users.
+ *
+ * @param data The service
+ */
+static void service_load_users_thread(void *data)
+{
+    SERVICE *service = (SERVICE*)data;
+
+    if (mysql_thread_init())
+    {
+        MXS_ERROR("%s: mysql_thread_init failed when loading users.", service->name);
+    }
+    else
+    {
+        int loaded = replace_mysql_users(service);
+
+        if (loaded < 0)
+        {
+            MXS_ERROR("%s: Failed to load the users in the background.", service->name);
+        }
+        else if (loaded > 0)
+        {
+            /** The lock prevents the table from being replaced and freed
+             * while it is saved */
+            spinlock_acquire(&service->spin);
+            service_save_users_cache(service);
+            spinlock_release(&service->spin);
+        }
+        mysql_thread_end();
+    }
+
+    spinlock_release(&service->users_table_spin);
+
+    /** The lock is held while the packets are delivered so that a client
+     * cannot be closed before its packet has been queued */
+    spinlock_acquire(&service->spin);
+    SERVICE_USERS_WAITER *waiter = service->users_waiters;
+    service->users_waiters = NULL;
+    service->users_loading = false;
+
+    while (waiter)
+    {
+        SERVICE_USERS_WAITER *next = waiter->next;
+        poll_add_epollin_event_to_dcb(waiter->dcb, waiter->packet);
+        free(waiter);
+        waiter = next;
+    }
+    spinlock_release(&service->spin);
+}
+
+/**
+ * Refresh the database users for the service in the background
+ *
+ * The users are loaded in a separate thread so that the calling thread is
+ * not blocked by the queries. If a DCB is given, the packet is delivered to
+ * it as a read event once the users have been loaded. A refresh that is
+ * already in progress is joined without starting a new one.
+ *
+ * @param service Service to reload
+ * @param dcb Client DCB waiting for the users or NULL
+ * @param packet Packet delivered to the DCB, the refresh takes the ownership
+ * of it if true is returned
+ * @return True if the users are being loaded, false if the refresh could not
+ * be started
+ */
+bool service_refresh_users_async(SERVICE *service, DCB *dcb, GWBUF *packet)
+{
+    SERVICE_USERS_WAITER *waiter = NULL;
+    bool rval = true;
+
+    if (dcb && (waiter = malloc(sizeof(SERVICE_USERS_WAITER))) == NULL)
+    {
+        MXS_ERROR("%s: Memory allocation failed when waiting for users.", service->name);
+        return false;
+    }
+
+    spinlock_acquire(&service->spin);
+
+    if (!service->users_loading)
+    {
+        THREAD thd;
+
+        if (!service_refresh_users_start(service))
+        {
+            rval = false;
+        }
+        else if (thread_start(&thd, service_load_users_thread, service) == NULL)
+        {
+            MXS_ERROR("%s: Failed to start a thread for loading the users.", service->name);
+            spinlock_release(&service->users_table_spin);
+            rval = false;
+        }
+        else
+        {
+            pthread_detach(thd);
+            service->users_loading = true;
+        }
+    }
+
+    if (rval && waiter)
+    {
+        waiter->dcb = dcb;
+        waiter->packet = packet;
+        waiter->next = service->users_waiters;
+        service->users_waiters = waiter;
+        waiter = NULL;
+    }
+
+    spinlock_release(&service->spin);
+    free(waiter);
+
+    return rval;
+}
+
+/**
+ * Stop a client from waiting for the users of a service
+ *
+ * This must be called before a DCB that waits for the users is closed.
+ *
+ * @param service The service
+ * @param dcb The client DCB
+ */
+void service_refresh_users_cancel(SERVICE *service, DCB *dcb)
+{
+    spinlock_acquire(&service->spin);
+
+    for (SERVICE_USERS_WAITER **waiter = &service->users_waiters; *waiter; waiter = &(*waiter)->next)
+    {
+        if ((*waiter)->dcb == dcb)
+        {
+            SERVICE_USERS_WAITER *found = *waiter;
+            *waiter = found->next;
+            gwbuf_free(found->packet);
+            free(found);
+            break;
+        }
+    }
+
+    spinlock_release(&service->spin);
+}
+
 bool service_set_param_value(SERVICE*            service,
                              CONFIG_PARAMETER*   param,
                              char*               valstr,
@@ -1783,14 +2577,14 @@ serviceEnableLocalhostMatchWildcardHost(SERVICE *service, int action)
 void service_shutdown()
 {
     SERVICE* svc;
-    spinlock_acquire(&service_spin);
+    rwlock_read_acquire(&service_lock);
     svc = allServices;
     while (svc != NULL)
     {
         svc->svc_do_shutdown = true;
         svc = svc->next;
     }
-    spinlock_release(&service_spin);
+    rwlock_read_release(&service_lock);
 }
 
 /**
@@ -1804,14 +2598,14 @@ serviceSessionCountAll()
     SERVICE *service;
     int rval = 0;
 
-    spinlock_acquire(&service_spin);
+    rwlock_read_acquire(&service_lock);
     service = allServices;
     while (service)
     {
         rval += service->stats.n_current;
         service = service->next;
     }
-    spinlock_release(&service_spin);
+    rwlock_read_release(&service_lock);
     return rval;
 }
 
@@ -1833,7 +2627,7 @@ serviceListenerRowCallback(RESULTSET *set, void *data)
     SERVICE *service;
     SERV_LISTENER *lptr = NULL;
 
-    spinlock_acquire(&service_spin);
+    rwlock_read_acquire(&service_lock);
     service = allServices;
     if (service)
     {
@@ -1860,7 +2654,7 @@ serviceListenerRowCallback(RESULTSET *set, void *data)
     }
     if (lptr == NULL)
     {
-        spinlock_release(&service_spin);
+        rwlock_read_release(&service_lock);
         free(data);
         return NULL;
     }
@@ -1875,7 +2669,7 @@ serviceListenerRowCallback(RESULTSET *set, void *data)
                       (!lptr->listener || !lptr->listener->session ||
                        lptr->listener->session->state == SESSION_STATE_LISTENER_STOPPED) ?
                       "Stopped" : "Running");
-    spinlock_release(&service_spin);
+    rwlock_read_release(&service_lock);
     return row;
 }
 
@@ -1909,6 +2703,165 @@ serviceGetListenerList()
     return set;
 }
 
+/**
+ * Provide a row to the result set of the service query latencies
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+serviceLatencyRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    int i = 0;
+    RESULT_ROW *row;
+    SERVICE *service;
+
+    rwlock_read_acquire(&service_lock);
+    service = allServices;
+    while (i < *rowno && service)
+    {
+        i++;
+        service = service->next;
+    }
+    if (service == NULL)
+    {
+        rwlock_read_release(&service_lock);
+        free(data);
+        return NULL;
+    }
+    (*rowno)++;
+    row = resultset_make_row(set);
+    resultset_row_set(row, 0, service->name);
+    latency_row_set(row, 1, service->latency);
+    rwlock_read_release(&service_lock);
+    return row;
+}
+
+/**
+ * Return a result set with the query latency percentiles of the services
+ *
+ * @return A Result set
+ */
+RESULTSET *
+serviceGetLatencyList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(serviceLatencyRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Service Name", 25, COL_TYPE_VARCHAR);
+    latency_add_columns(set);
+
+    return set;
+}
+
+/**
+ * Render the statistics of the services and of the filters they use in the
+ * Prometheus text format
+ *
+ * @param metrics The metrics
+ */
+void
+service_metrics(METRICS *metrics)
+{
+    char name[METRICS_LABEL_LEN];
+    char router[METRICS_LABEL_LEN];
+    char filter[METRICS_LABEL_LEN];
+    char labels[3 * METRICS_LABEL_LEN];
+    SERVICE *service;
+
+    rwlock_read_acquire(&service_lock);
+
+    metrics_family(metrics, "maxscale_service_sessions_total", METRICS_COUNTER,
+                   "Sessions created on the service");
+    for (service = allServices; service; service = service->next)
+    {
+        snprintf(labels, sizeof(labels), "service=\"%s\",router=\"%s\"",
+                 metrics_escape(service->name, name, sizeof(name)),
+                 metrics_escape(service->routerModule, router, sizeof(router)));
+        metrics_value(metrics, "maxscale_service_sessions_total", labels, service->stats.n_sessions);
+    }
+
+    metrics_family(metrics, "maxscale_service_sessions", METRICS_GAUGE,
+                   "Current sessions of the service");
+    for (service = allServices; service; service = service->next)
+    {
+        snprintf(labels, sizeof(labels), "service=\"%s\",router=\"%s\"",
+                 metrics_escape(service->name, name, sizeof(name)),
+                 metrics_escape(service->routerModule, router, sizeof(router)));
+        metrics_value(metrics, "maxscale_service_sessions", labels, service->stats.n_current);
+    }
+
+    int n = 0;
+
+    for (service = allServices; service; service = service->next)
+    {
+        n++;
+    }
+
+    SERVICE *services[n > 0 ? n : 1];
+    int64_t writeq[n > 0 ? n : 1];
+
+    n = 0;
+    for (service = allServices; service; service = service->next)
+    {
+        services[n++] = service;
+    }
+
+    dcb_writeq_by_service(services, writeq, n);
+
+    metrics_family(metrics, "maxscale_service_write_queue_bytes", METRICS_GAUGE,
+                   "Bytes waiting in the write queues of the connections of the service");
+    for (int i = 0; i < n; i++)
+    {
+        snprintf(labels, sizeof(labels), "service=\"%s\",router=\"%s\"",
+                 metrics_escape(services[i]->name, name, sizeof(name)),
+                 metrics_escape(services[i]->routerModule, router, sizeof(router)));
+        metrics_value(metrics, "maxscale_service_write_queue_bytes", labels, writeq[i]);
+    }
+
+    metrics_family(metrics, "maxscale_filter_sessions", METRICS_GAUGE,
+                   "Current sessions of the service that pass through the filter");
+    for (service = allServices; service; service = service->next)
+    {
+        for (int i = 0; i < service->n_filters; i++)
+        {
+            snprintf(labels, sizeof(labels), "filter=\"%s\",module=\"%s\",service=\"%s\"",
+                     metrics_escape(service->filters[i]->name, filter, sizeof(filter)),
+                     metrics_escape(service->filters[i]->module, router, sizeof(router)),
+                     metrics_escape(service->name, name, sizeof(name)));
+            metrics_value(metrics, "maxscale_filter_sessions", labels, service->stats.n_current);
+        }
+    }
+
+    metrics_family(metrics, "maxscale_service_query_latency_seconds", METRICS_HISTOGRAM,
+                   "Time from routing a query to the first packet of its reply");
+    for (service = allServices; service; service = service->next)
+    {
+        if (service->latency)
+        {
+            TS_LATENCY_SNAPSHOT snapshot;
+            ts_latency_snapshot(service->latency, &snapshot);
+            snprintf(labels, sizeof(labels), "service=\"%s\"",
+                     metrics_escape(service->name, name, sizeof(name)));
+            metrics_latency(metrics, "maxscale_service_query_latency_seconds", labels, &snapshot);
+        }
+    }
+
+    rwlock_read_release(&service_lock);
+}
+
 /**
  * Provide a row to the result set that defines the set of services
  *
@@ -1925,7 +2878,7 @@ serviceRowCallback(RESULTSET *set, void *data)
     RESULT_ROW *row;
     SERVICE *service;
 
-    spinlock_acquire(&service_spin);
+    rwlock_read_acquire(&service_lock);
     service = allServices;
     while (i < *rowno && service)
     {
@@ -1934,7 +2887,7 @@ serviceRowCallback(RESULTSET *set, void *data)
     }
     if (service == NULL)
     {
-        spinlock_release(&service_spin);
+        rwlock_read_release(&service_lock);
         free(data);
         return NULL;
     }
@@ -1946,7 +2899,7 @@ serviceRowCallback(RESULTSET *set, void *data)
     resultset_row_set(row, 2, buf);
     sprintf(buf, "%d", service->stats.n_sessions);
     resultset_row_set(row, 3, buf);
-    spinlock_release(&service_spin);
+    rwlock_read_release(&service_lock);
     return row;
 }
 
@@ -1996,7 +2949,7 @@ static void service_internal_restart(void *data)
 bool service_all_services_have_listeners()
 {
     bool rval = true;
-    spinlock_acquire(&service_spin);
+    rwlock_read_acquire(&service_lock);
 
     SERVICE* service = allServices;
 
@@ -2010,6 +2963,6 @@ bool service_all_services_have_listeners()
         service = service->next;
     }
 
-    spinlock_release(&service_spin);
+    rwlock_read_release(&service_lock);
     return rval;
 }
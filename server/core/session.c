@@ -23,6 +23,13 @@
  * 29/05/14     Mark Riddoch            Addition of filter mechanism
  * 23/08/15     Martin Brampton         Tidying; slight improvement in safety
  * 17/09/15     Martin Brampton         Keep failed session in existence - leave DCBs to close
+ * 14/10/16     MariaDB Corporation     Idle sessions are found with a timer per session
+ * 14/10/16     MariaDB Corporation     Free sessions are kept in free lists
+ * 14/10/16     MariaDB Corporation     Memory arena of the session
+ * 14/10/16     MariaDB Corporation     Diagnostics read the session list without locking
+ * 14/10/16     MariaDB Corporation     Sessions leave the concurrency governor when freed
+ * 14/10/16     MariaDB Corporation     Sessions and arenas are counted in the memory usage
+ * 14/10/16     MariaDB Corporation     Sessions are given their key in the resource usage
  *
  * @endverbatim
  */
@@ -31,6 +38,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <platform.h>
 #include <session.h>
 #include <service.h>
 #include <router.h>
@@ -40,6 +50,9 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <housekeeper.h>
+#include <maxscale/poll.h>
+#include <memusage.h>
+#include <usage.h>
 
 /** Global session id; updated safely by holding session_spin */
 static size_t session_id;
@@ -47,24 +60,38 @@ static size_t session_id;
 static SPINLOCK session_spin = SPINLOCK_INIT;
 static SESSION *allSessions = NULL;
 static SESSION *lastSession = NULL;
-static SESSION *wasfreeSession = NULL;
-static int freeSessionCount = 0;
+static SESSION *freeSessions = NULL;               /* Free sessions shared by all threads */
+static thread_local SESSION *thread_freeSessions = NULL; /* Free sessions of this thread */
+static thread_local int thread_nfreeSessions = 0;
 
-static struct session session_dummy_struct;
-
-/**
- * These two are declared in session.h
- */
-bool check_timeouts = false;
-long next_timeout_check = 0;
+/** Number of free sessions a thread keeps before returning them to the shared list */
+#define SESSION_THREAD_FREE_MAX 64
 
-static SPINLOCK timeout_lock = SPINLOCK_INIT;
+static struct session session_dummy_struct;
 
 static int session_setup_filters(SESSION *session);
 static void session_simple_free(SESSION *session, DCB *dcb);
 static void session_add_to_all_list(SESSION *session);
 static SESSION *session_find_free();
 static void session_final_free(SESSION *session);
+static void session_arena_free(SESSION_ARENA *arena);
+static void session_start_idle_timer(SESSION *session, long delay);
+
+/**
+ * The list of all sessions only grows and its sessions are never freed, so
+ * the diagnostics follow it without session_spin while new sessions are
+ * appended. A session that is read may be freed and reused at the same time,
+ * which only makes the printed values stale.
+ */
+static inline SESSION *session_list_first()
+{
+    return atomic_load_ptr((void **)&allSessions);
+}
+
+static inline SESSION *session_list_next(SESSION *session)
+{
+    return atomic_load_ptr((void **)&session->next);
+}
 
 /**
  * Allocate a new session for a new client of the specified service.
@@ -82,9 +109,7 @@ session_alloc(SERVICE *service, DCB *client_dcb)
 {
     SESSION *session;
 
-    spinlock_acquire(&session_spin);
     session = session_find_free();
-    spinlock_release(&session_spin);
     ss_info_dassert(session != NULL, "Allocating memory for session failed.");
 
     if (session == NULL)
@@ -102,9 +127,12 @@ session_alloc(SERVICE *service, DCB *client_dcb)
 #endif
     session->ses_is_child = (bool) DCB_IS_CLONE(client_dcb);
     spinlock_init(&session->ses_lock);
+    spinlock_init(&session->arena.lock);
     session->service = service;
     session->client_dcb = client_dcb;
     session->n_filters = 0;
+    session->gov_state = GOVERNOR_IDLE;
+    session->usage_key = USAGE_KEY_UNKNOWN;
     memset(&session->stats, 0, sizeof(SESSION_STATS));
     session->stats.connect = time(0);
     session->state = SESSION_STATE_ALLOC;
@@ -207,6 +235,11 @@ session_alloc(SERVICE *service, DCB *client_dcb)
     atomic_add(&service->stats.n_current, 1);
     CHK_SESSION(session);
 
+    if (SESSION_STATE_ROUTER_READY == session->state)
+    {
+        session_start_idle_timer(session, service->conn_idle_timeout * 1000);
+    }
+
     client_dcb->session = session;
     return SESSION_STATE_TO_BE_FREED == session->state ? NULL : session;
 }
@@ -217,10 +250,8 @@ session_alloc(SERVICE *service, DCB *client_dcb)
  * Must be called with the general session lock held.
  *
  * A pointer, lastSession, is held to find the end of the list, and the new session
- * is linked to the end of the list.  The pointer, wasfreeSession, that is used to
- * search for a free session is initialised if not already set. There cannot be
- * any free sessions (or any at all) until this routine has been called at least
- * once. Hence it will not be referred to until after it is initialised.
+ * is linked to the end of the list. Sessions are never removed from the list,
+ * a free session is found from the free lists.
  *
  * @param session       The session to be added to the list
  */
@@ -229,74 +260,67 @@ session_add_to_all_list(SESSION *session)
 {
     if (allSessions == NULL)
     {
-        allSessions = session;
+        atomic_store_ptr((void **)&allSessions, session);
     }
     else
     {
-        lastSession->next = session;
+        atomic_store_ptr((void **)&lastSession->next, session);
     }
     lastSession = session;
-    if (NULL == wasfreeSession)
-    {
-        wasfreeSession = session;
-    }
 }
 
 /**
  * Find a free session or allocate memory for a new one.
  *
- * This routine looks to see whether there are free session memory areas.
- * If not, new memory is allocated, if possible, and the new session is added to
- * the list of all sessions.
- *
- * Must be called with the general session lock held.
+ * A free session is taken from the free list of the calling thread, or if it
+ * is empty, from the shared free list. If both are empty, new memory is
+ * allocated, if possible, and the new session is added to the list of all
+ * sessions.
  *
  * @return An available session or NULL if none could be allocated.
  */
 static SESSION *
 session_find_free()
 {
-    SESSION *nextsession;
+    SESSION *session = thread_freeSessions;
 
-    if (freeSessionCount <= 0)
+    if (session)
+    {
+        thread_freeSessions = session->free_next;
+        thread_nfreeSessions--;
+    }
+    else
     {
-        SESSION *newsession;
-        if ((newsession = calloc(1, sizeof(SESSION))) == NULL)
+        spinlock_acquire(&session_spin);
+        if ((session = freeSessions) != NULL)
         {
-            return NULL;
+            freeSessions = session->free_next;
         }
-        newsession->next = NULL;
-        session_add_to_all_list(newsession);
-        newsession->ses_is_in_use = true;
-        return newsession;
+        spinlock_release(&session_spin);
     }
-    /* Starting at the last place a free session was found, loop through the */
-    /* list of sessions searching for one that is not in use. */
-    while (wasfreeSession->ses_is_in_use)
+
+    if (session == NULL)
     {
-        int loopcount = 0;
-        wasfreeSession = wasfreeSession->next;
-        if (NULL == wasfreeSession)
+        if ((session = calloc(1, sizeof(SESSION))) == NULL)
         {
-            loopcount++;
-            if (loopcount > 1)
-            {
-                /* Shouldn't need to loop round more than once */
-                MXS_ERROR("Find free session failed to find a session even"
-                          " though free count was positive");
-                return NULL;
-            }
-            wasfreeSession = allSessions;
+            return NULL;
         }
+        memusage_alloc(MEMUSAGE_SESSION, sizeof(SESSION));
+        session->ses_is_in_use = true;
+        spinlock_acquire(&session_spin);
+        session_add_to_all_list(session);
+        spinlock_release(&session_spin);
+        return session;
     }
-    /* Dropping out of the loop means we have found a session that is not in use */
-    freeSessionCount--;
-    /* Clear the old data, then reset the list forward link */
-    nextsession = wasfreeSession->next;
-    memset(wasfreeSession, 0, sizeof(SESSION));
-    wasfreeSession->next = nextsession;
-    wasfreeSession->ses_is_in_use = true;
-    return wasfreeSession;
+
+    ss_dassert(!session->ses_is_in_use);
+    /* Clear the old data but not the link of the list of all sessions, which
+     * may be followed by another thread at the same time */
+    memset(session, 0, offsetof(SESSION, next));
+    memset((char*)session + offsetof(SESSION, next) + sizeof(session->next), 0,
+           sizeof(SESSION) - offsetof(SESSION, next) - sizeof(session->next));
+    session->ses_is_in_use = true;
+    return session;
 }
 
 /**
@@ -325,6 +349,7 @@ session_set_dummy(DCB *client_dcb)
     memset(&session->stats, 0, sizeof(SESSION_STATS));
     session->stats.connect = 0;
     session->state = SESSION_STATE_DUMMY;
+    session->usage_key = USAGE_KEY_NONE;
     session->refcount = 1;
     session->ses_id = 0;
     session->next = NULL;
@@ -448,10 +473,21 @@ session_free(SESSION *session)
         /* Must be one or more references left */
         return false;
     }
+    /** The state is changed under the lock so that enable_session_timeouts
+     * does not start the idle timer of a session that is being freed */
+    spinlock_acquire(&session_spin);
     session->state = SESSION_STATE_TO_BE_FREED;
+    spinlock_release(&session_spin);
+
+    /** Waits for the timer if it is being run, a running timer sees the new
+     * state and does not start itself again */
+    timer_cancel(&session->idle_timer);
 
     atomic_add(&session->service->stats.n_current, -1);
 
+    /** Gives the slot of the session to the next waiting session */
+    governor_session_close(session);
+
     /***
      *
      */
@@ -487,7 +523,6 @@ session_free(SESSION *session)
                                                              session->filters[i].session);
             }
         }
-        free(session->filters);
     }
 
     MXS_INFO("Stopped %s client session [%lu]",
@@ -509,11 +544,137 @@ session_free(SESSION *session)
 static void
 session_final_free(SESSION *session)
 {
-    /* We never free the actual session, it is available for reuse*/
-    spinlock_acquire(&session_spin);
+    /* We never free the actual session, it is available for reuse. It is
+     * kept by the calling thread unless it already has enough free sessions. */
+    session_arena_free(&session->arena);
     session->ses_is_in_use = false;
-    freeSessionCount++;
-    spinlock_release(&session_spin);
+
+    if (thread_nfreeSessions < SESSION_THREAD_FREE_MAX)
+    {
+        session->free_next = thread_freeSessions;
+        thread_freeSessions = session;
+        thread_nfreeSessions++;
+    }
+    else
+    {
+        spinlock_acquire(&session_spin);
+        session->free_next = freeSessions;
+        freeSessions = session;
+        spinlock_release(&session_spin);
+    }
+}
+
+/**
+ * Allocate memory that lives as long as the session. The memory is zeroed
+ * and must not be freed, it is freed when the session is freed. Small
+ * allocations share chunks of SESSION_ARENA_CHUNK_SIZE bytes, larger ones
+ * are given a chunk of their own.
+ *
+ * @param session       The session
+ * @param size          Number of bytes to allocate
+ * @return              The memory or NULL if it could not be allocated
+ */
+void *
+session_arena_alloc(SESSION *session, size_t size)
+{
+    SESSION_ARENA *arena = &session->arena;
+    size_t header = (sizeof(SESSION_ARENA_CHUNK) + SESSION_ARENA_ALIGN - 1) & ~(SESSION_ARENA_ALIGN - 1);
+    size_t aligned = (size + SESSION_ARENA_ALIGN - 1) & ~(SESSION_ARENA_ALIGN - 1);
+    void *ptr = NULL;
+
+    spinlock_acquire(&arena->lock);
+    SESSION_ARENA_CHUNK *chunk = arena->chunks;
+
+    if (chunk == NULL || chunk->size - chunk->used < aligned)
+    {
+        bool large = aligned > SESSION_ARENA_CHUNK_SIZE / 4;
+        size_t chunk_size = large ? aligned : SESSION_ARENA_CHUNK_SIZE;
+        SESSION_ARENA_CHUNK *new_chunk = malloc(header + chunk_size);
+
+        if (new_chunk)
+        {
+            new_chunk->size = chunk_size;
+            new_chunk->used = 0;
+
+            if (chunk && large)
+            {
+                /** The small allocations still fit in the first chunk */
+                new_chunk->next = chunk->next;
+                chunk->next = new_chunk;
+            }
+            else
+            {
+                new_chunk->next = chunk;
+                arena->chunks = new_chunk;
+            }
+            arena->allocated += chunk_size;
+            memusage_add(MEMUSAGE_SESSION, chunk_size, 0);
+        }
+        chunk = new_chunk;
+    }
+
+    if (chunk)
+    {
+        ptr = (char*)chunk + header + chunk->used;
+        chunk->used += aligned;
+        arena->used += aligned;
+    }
+    spinlock_release(&arena->lock);
+
+    if (ptr)
+    {
+        memset(ptr, 0, size);
+    }
+    else
+    {
+        MXS_ERROR("Failed to allocate %lu bytes for session %lu.", size, session->ses_id);
+    }
+
+    return ptr;
+}
+
+/**
+ * Free the chunks of a session arena
+ *
+ * @param arena         The arena
+ */
+static void
+session_arena_free(SESSION_ARENA *arena)
+{
+    SESSION_ARENA_CHUNK *chunk = arena->chunks;
+
+    while (chunk)
+    {
+        SESSION_ARENA_CHUNK *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    memusage_add(MEMUSAGE_SESSION, -(int64_t)arena->allocated, 0);
+    arena->chunks = NULL;
+    arena->used = 0;
+    arena->allocated = 0;
+}
+
+/**
+ * Return the memory used by a session: the session itself, its arena and
+ * the data queued for writing to the client. The memory the modules allocate
+ * outside the arena is not included.
+ *
+ * @param session       The session
+ * @return              The number of bytes
+ */
+size_t
+session_memory_usage(SESSION *session)
+{
+    size_t usage = sizeof(SESSION) + session->arena.allocated;
+
+    if (session->client_dcb)
+    {
+        usage += sizeof(DCB) + session->client_dcb->writeqlen;
+    }
+
+    return usage;
 }
 
 /**
@@ -528,18 +689,15 @@ session_isvalid(SESSION *session)
     SESSION *list_session;
     int rval = 0;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    while (list_session)
+    for (list_session = session_list_first(); list_session;
+         list_session = session_list_next(list_session))
     {
         if (list_session->ses_is_in_use && list_session == session)
         {
             rval = 1;
             break;
         }
-        list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
 
     return rval;
 }
@@ -574,17 +732,14 @@ printAllSessions()
 {
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    while (list_session)
+    for (list_session = session_list_first(); list_session;
+         list_session = session_list_next(list_session))
     {
         if (list_session->ses_is_in_use)
         {
             printSession(list_session);
         }
-        list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
 }
 
 
@@ -601,13 +756,11 @@ CheckSessions()
     int noclients = 0;
     int norouter = 0;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    while (list_session)
+    for (list_session = session_list_first(); list_session;
+         list_session = session_list_next(list_session))
     {
         if (false == list_session->ses_is_in_use)
         {
-            list_session = list_session->next;
             continue;
         }
         if (list_session->state != SESSION_STATE_LISTENER ||
@@ -624,20 +777,16 @@ CheckSessions()
                 noclients++;
             }
         }
-        list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
     if (noclients)
     {
         printf("%d Sessions have no clients\n", noclients);
     }
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    while (list_session)
+    for (list_session = session_list_first(); list_session;
+         list_session = session_list_next(list_session))
     {
         if (false == list_session->ses_is_in_use)
         {
-            list_session = list_session->next;
             continue;
         }
         if (list_session->state != SESSION_STATE_LISTENER ||
@@ -654,9 +803,7 @@ CheckSessions()
                 norouter++;
             }
         }
-        list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
     if (norouter)
     {
         printf("%d Sessions have no router session\n", norouter);
@@ -673,24 +820,48 @@ CheckSessions()
  */
 void
 dprintAllSessions(DCB *dcb)
+{
+    dprintSessionsPage(dcb, 0, INT_MAX);
+}
+
+/**
+ * Print a page of the sessions to a DCB
+ *
+ * The number of the sessions after the page is printed after it, so that
+ * the next page can be asked for.
+ *
+ * @param dcb   The DCB to print to
+ * @param first The index of the first session to print, from 0
+ * @param count The maximum number of sessions to print
+ */
+void
+dprintSessionsPage(DCB *dcb, int first, int count)
 {
     SESSION *list_session;
+    int index = 0;
+    int more = 0;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    while (list_session)
+    for (list_session = session_list_first(); list_session;
+         list_session = session_list_next(list_session))
     {
-        if (false == list_session->ses_is_in_use)
+        if (list_session->ses_is_in_use)
         {
-            list_session = list_session->next;
-            continue;
+            if (index >= first && index - first < count)
+            {
+                dprintSession(dcb, list_session);
+            }
+            else if (index >= first)
+            {
+                more++;
+            }
+            index++;
         }
+    }
 
-        dprintSession(dcb, list_session);
-
-        list_session = list_session->next;
+    if (more)
+    {
+        dcb_printf(dcb, "%d more sessions follow.\n", more);
     }
-    spinlock_release(&session_spin);
 }
 
 /**
@@ -731,6 +902,10 @@ dprintSession(DCB *dcb, SESSION *print_session)
         dcb_printf(dcb, "\tIdle:                %.0f seconds\n", idle);
     }
 
+    dcb_printf(dcb, "\tMemory:              %lu bytes\n", session_memory_usage(print_session));
+    dcb_printf(dcb, "\tArena:               %lu of %lu bytes used\n",
+               print_session->arena.used, print_session->arena.allocated);
+
     if (print_session->n_filters)
     {
         for (int i = 0; i < print_session->n_filters; i++)
@@ -755,36 +930,64 @@ dprintSession(DCB *dcb, SESSION *print_session)
 void
 dListSessions(DCB *dcb)
 {
-    SESSION *list_session;
+    dListSessionsPage(dcb, 0, INT_MAX);
+}
+
+/**
+ * List a page of the sessions in tabular form to a DCB
+ *
+ * The number of the sessions after the page is printed after the table, so
+ * that the next page can be asked for.
+ *
+ * @param dcb   The DCB to print to
+ * @param first The index of the first session to list, from 0
+ * @param count The maximum number of sessions to list
+ */
+void
+dListSessionsPage(DCB *dcb, int first, int count)
+{
+    SESSION *list_session = session_list_first();
+    int index = 0;
+    int more = 0;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
     if (list_session)
     {
         dcb_printf(dcb, "Sessions.\n");
-        dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
-        dcb_printf(dcb, "Session          | Client          | Service        | State\n");
-        dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
+        dcb_printf(dcb, "-----------------+-----------------+----------------+----------+--------------------------\n");
+        dcb_printf(dcb, "Session          | Client          | Service        | Memory   | State\n");
+        dcb_printf(dcb, "-----------------+-----------------+----------------+----------+--------------------------\n");
     }
-    while (list_session)
+    for (; list_session; list_session = session_list_next(list_session))
     {
         if (list_session->ses_is_in_use)
         {
-            dcb_printf(dcb, "%-16p | %-15s | %-14s | %s\n", list_session,
-                       ((list_session->client_dcb && list_session->client_dcb->remote)
-                        ? list_session->client_dcb->remote : ""),
-                       (list_session->service && list_session->service->name ? list_session->service->name
-                        : ""),
-                       session_state(list_session->state));
+            if (index >= first && index - first < count)
+            {
+                dcb_printf(dcb, "%-16p | %-15s | %-14s | %-8lu | %s\n", list_session,
+                           ((list_session->client_dcb && list_session->client_dcb->remote)
+                            ? list_session->client_dcb->remote : ""),
+                           (list_session->service && list_session->service->name ?
+                            list_session->service->name : ""),
+                           session_memory_usage(list_session),
+                           session_state(list_session->state));
+            }
+            else if (index >= first)
+            {
+                more++;
+            }
+            index++;
         }
-        list_session = list_session->next;
     }
-    if (allSessions)
+    if (session_list_first())
     {
         dcb_printf(dcb,
-                   "-----------------+-----------------+----------------+--------------------------\n\n");
+                   "-----------------+-----------------+----------------+----------+--------------------------\n");
+        if (more)
+        {
+            dcb_printf(dcb, "%d more sessions follow.\n", more);
+        }
+        dcb_printf(dcb, "\n");
     }
-    spinlock_release(&session_spin);
 }
 
 /**
@@ -847,6 +1050,10 @@ SESSION* get_session_by_router_ses(void* rses)
  * this head becomes the destination for the filter. The newly created
  * filter becomes the new head of the filter chain.
  *
+ * The filters of the service can be replaced by a configuration reload
+ * while the chain is set up, the list that was current when the setup
+ * started is used for the whole chain.
+ *
  * @param       session         The session that requires the chain
  * @return      0 if filter creation fails
  */
@@ -854,49 +1061,56 @@ static int
 session_setup_filters(SESSION *session)
 {
     SERVICE *service = session->service;
+    FILTER_DEF **filters = atomic_load_ptr((void **)&service->filters);
     DOWNSTREAM *head;
     UPSTREAM *tail;
+    int n_filters = 0;
     int i;
 
-    if ((session->filters = calloc(service->n_filters,
-                                   sizeof(SESSION_FILTER))) == NULL)
+    while (filters && filters[n_filters])
+    {
+        n_filters++;
+    }
+
+    if (n_filters == 0)
+    {
+        return 1;
+    }
+
+    if ((session->filters = session_arena_alloc(session, n_filters *
+                                                sizeof(SESSION_FILTER))) == NULL)
     {
         MXS_ERROR("Insufficient memory to allocate session filter "
                   "tracking.\n");
         return 0;
     }
-    session->n_filters = service->n_filters;
-    for (i = service->n_filters - 1; i >= 0; i--)
+    session->n_filters = n_filters;
+    for (i = n_filters - 1; i >= 0; i--)
     {
-        if (service->filters[i] == NULL)
-        {
-            MXS_ERROR("Service '%s' contians an unresolved filter.", service->name);
-            return 0;
-        }
-        if ((head = filterApply(service->filters[i], session,
+        if ((head = filterApply(filters[i], session,
                                 &session->head)) == NULL)
         {
             MXS_ERROR("Failed to create filter '%s' for "
                       "service '%s'.\n",
-                      service->filters[i]->name,
+                      filters[i]->name,
                       service->name);
             return 0;
         }
-        session->filters[i].filter = service->filters[i];
+        session->filters[i].filter = filters[i];
         session->filters[i].session = head->session;
         session->filters[i].instance = head->instance;
         session->head = *head;
         free(head);
     }
 
-    for (i = 0; i < service->n_filters; i++)
+    for (i = 0; i < n_filters; i++)
     {
-        if ((tail = filterUpstream(service->filters[i],
+        if ((tail = filterUpstream(filters[i],
                                    session->filters[i].session,
                                    &session->tail)) == NULL)
         {
             MXS_ERROR("Failed to create filter '%s' for service '%s'.",
-                      service->filters[i]->name,
+                      filters[i]->name,
                       service->name);
             return 0;
         }
@@ -994,51 +1208,90 @@ SESSION *get_all_sessions()
 }
 
 /**
- * Enable the timing out of idle connections.
+ * Check whether a session has been idle for too long.
  *
- * This will prevent unnecessary acquisitions of the session spinlock if no
- * service is configured with a session idle timeout.
+ * This is called by the idle timer of the session. The time of the last read
+ * is only stored in the client DCB when data is read, so the timer expires
+ * once every connection_timeout seconds for sessions that are not idle. If
+ * the session has received data since the timer was started, the timer is
+ * started again for the remaining time.
+ *
+ * @param data  The session
  */
-void enable_session_timeouts()
+static void
+session_idle_timeout(void *data)
 {
-    check_timeouts = true;
+    SESSION *session = (SESSION *)data;
+    DCB *dcb = session->client_dcb;
+    long timeout = session->service->conn_idle_timeout * 10;
+
+    if (SESSION_STATE_ROUTER_READY != session->state || timeout == 0 ||
+        dcb == NULL || dcb->state != DCB_STATE_POLLING)
+    {
+        return;
+    }
+
+    long idle = hkheartbeat - dcb->last_read;
+
+    if (idle > timeout)
+    {
+        dcb_close(dcb);
+    }
+    else
+    {
+        /** One heartbeat is 100 milliseconds */
+        session_start_idle_timer(session, (timeout - idle + 1) * 100);
+    }
 }
 
 /**
- * Close sessions that have been idle for too long.
+ * Start the idle timer of a client session if its service has a connection
+ * timeout.
  *
- * If the time since a session last sent data is greater than the set value in the
- * service, it is disconnected. The connection timeout is disabled by default.
+ * @param session       The session
+ * @param delay         Milliseconds until the idle time is checked
  */
-void process_idle_sessions()
+static void
+session_start_idle_timer(SESSION *session, long delay)
 {
-    if (spinlock_acquire_nowait(&timeout_lock))
+    DCB *dcb = session->client_dcb;
+
+    if (session->service->conn_idle_timeout && !session->ses_is_child &&
+        dcb && dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER)
     {
-        if (hkheartbeat >= next_timeout_check)
+        if (session->idle_timer.fn == NULL)
         {
-            /** Because the resolution of the timeout is one second, we only need to
-             * check for it once per second. One heartbeat is 100 milliseconds. */
-            next_timeout_check = hkheartbeat + 10;
-            spinlock_acquire(&session_spin);
-            SESSION *all_session = allSessions;
+            timer_init(&session->idle_timer, session_idle_timeout, session);
+        }
+        poll_add_timer(&session->idle_timer, delay < INT_MAX ? delay : INT_MAX, 0);
+    }
+}
 
-            while (all_session)
-            {
-                if (all_session->ses_is_in_use &&
-                    all_session->service && all_session->client_dcb &&
-                    all_session->client_dcb->state == DCB_STATE_POLLING &&
-                    all_session->service->conn_idle_timeout &&
-                    hkheartbeat - all_session->client_dcb->last_read > all_session->service->conn_idle_timeout * 10)
-                {
-                    dcb_close(all_session->client_dcb);
-                }
+/**
+ * Enable the timing out of idle connections.
+ *
+ * This is called when a service is configured with a session idle timeout.
+ * New sessions start their idle timers when they are created and this starts
+ * the timers of the sessions that were created before the timeout was set.
+ */
+void enable_session_timeouts()
+{
+    spinlock_acquire(&session_spin);
+    SESSION *all_session = allSessions;
 
-                all_session = all_session->next;
-            }
-            spinlock_release(&session_spin);
+    while (all_session)
+    {
+        if (all_session->ses_is_in_use &&
+            SESSION_STATE_ROUTER_READY == all_session->state &&
+            !timer_pending(&all_session->idle_timer))
+        {
+            session_start_idle_timer(all_session,
+                                     all_session->service->conn_idle_timeout * 1000);
         }
-        spinlock_release(&timeout_lock);
+
+        all_session = all_session->next;
     }
+    spinlock_release(&session_spin);
 }
 
 /**
@@ -1046,65 +1299,42 @@ void process_idle_sessions()
  */
 typedef struct
 {
-    int index;
+    SESSION *next;              /*< The session from which to look for the next row */
     SESSIONLISTFILTER filter;
 } SESSIONFILTER;
 
 /**
  * Provide a row to the result set that defines the set of sessions
  *
+ * The position in the list is kept in the callback data, which is safe as
+ * the sessions are never removed from the list, so that each row continues
+ * where the previous one ended.
+ *
  * @param set   The result set
- * @param data  The index of the row to send
+ * @param data  The position of the next row
  * @return The next row or NULL
  */
 static RESULT_ROW *
 sessionRowCallback(RESULTSET *set, void *data)
 {
     SESSIONFILTER *cbdata = (SESSIONFILTER *)data;
-    int i = 0;
     char buf[20];
     RESULT_ROW *row;
-    SESSION *list_session;
+    SESSION *list_session = cbdata->next;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    /* Skip to the first non-listener if not showing listeners */
-    while (false == list_session->ses_is_in_use ||
-           (list_session && cbdata->filter == SESSION_LIST_CONNECTION &&
-            list_session->state == SESSION_STATE_LISTENER))
-    {
-        list_session = list_session->next;
-    }
-    while (i < cbdata->index && list_session)
-    {
-        if (list_session->ses_is_in_use)
-        {
-            if (cbdata->filter == SESSION_LIST_CONNECTION &&
-                list_session->state !=  SESSION_STATE_LISTENER)
-            {
-                i++;
-            }
-            else if (cbdata->filter == SESSION_LIST_ALL)
-            {
-                i++;
-            }
-        }
-        list_session = list_session->next;
-    }
-    /* Skip to the next non-listener if not showing listeners */
+    /* Skip the free sessions and the listeners if not showing listeners */
     while (list_session && (false == list_session->ses_is_in_use ||
                             (cbdata->filter == SESSION_LIST_CONNECTION &&
                              list_session->state == SESSION_STATE_LISTENER)))
     {
-        list_session = list_session->next;
+        list_session = session_list_next(list_session);
     }
     if (list_session == NULL)
     {
-        spinlock_release(&session_spin);
         free(data);
         return NULL;
     }
-    cbdata->index++;
+    cbdata->next = session_list_next(list_session);
     row = resultset_make_row(set);
     snprintf(buf,19, "%p", list_session);
     buf[19] = '\0';
@@ -1114,7 +1344,6 @@ sessionRowCallback(RESULTSET *set, void *data)
     resultset_row_set(row, 2, (list_session->service && list_session->service->name
                                ? list_session->service->name : ""));
     resultset_row_set(row, 3, session_state(list_session->state));
-    spinlock_release(&session_spin);
     return row;
 }
 
@@ -1139,7 +1368,7 @@ sessionGetList(SESSIONLISTFILTER filter)
     {
         return NULL;
     }
-    data->index = 0;
+    data->next = session_list_first();
     data->filter = filter;
     if ((set = resultset_create(sessionRowCallback, data)) == NULL)
     {
@@ -19,6 +19,7 @@
  *
  * Date         Who             Description
  * 10/06/13     Mark Riddoch    Initial implementation
+ * 14/10/16     MariaDB Corporation     Backoff with pause and sleeping on a futex
  *
  * @endverbatim
  */
@@ -26,8 +27,23 @@
 #include <spinlock.h>
 #include <atomic.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <skygw_debug.h>
 
+/** Number of rounds a thread spins before it sleeps on the lock */
+#define SPINLOCK_SPIN_ROUNDS 16
+
+/** Maximum number of pauses between two attempts to take the lock */
+#define SPINLOCK_MAX_BACKOFF 64
+
+#if defined(__i386__) || defined(__x86_64__)
+#define spinlock_pause() __builtin_ia32_pause()
+#else
+#define spinlock_pause() __sync_synchronize()
+#endif
+
 /**
  * Initialise a spinlock.
  *
@@ -37,52 +53,94 @@ void
 spinlock_init(SPINLOCK *lock)
 {
     lock->lock = 0;
+#if SPINLOCK_COUNTERS || SPINLOCK_PROFILE
+    lock->contended = 0;
+    lock->parked = 0;
+#endif
 #if SPINLOCK_PROFILE
     lock->spins = 0;
     lock->acquired = 0;
     lock->waiting = 0;
     lock->max_waiting = 0;
-    lock->contended = 0;
 #endif
 }
 
 /**
  * Acquire a spinlock.
  *
+ * If the lock is taken, the thread spins with an exponentially growing number
+ * of pause instructions between the attempts to take it. After
+ * SPINLOCK_SPIN_ROUNDS attempts the lock is marked as having sleepers and the
+ * thread sleeps on a futex until the holder releases the lock.
+ *
  * @param lock The spinlock to acquire
  */
 void
 spinlock_acquire(SPINLOCK *lock)
 {
+    if (__sync_bool_compare_and_swap(&lock->lock, 0, 1))
+    {
 #if SPINLOCK_PROFILE
-    int spins = 0;
+        lock->acquired++;
+        lock->owner = thread_self();
+#endif
+        return;
+    }
 
+#if SPINLOCK_PROFILE
     atomic_add(&(lock->waiting), 1);
 #endif
 
-#ifdef __GNUC__
-    while (__sync_lock_test_and_set(&(lock->lock), 1))
-        while (lock->lock)
-        {
-#else
-    while (atomic_add(&(lock->lock), 1) != 0)
+    int spins = 0;
+    int backoff = 1;
+    bool acquired = false;
+
+    while (!acquired && spins < SPINLOCK_SPIN_ROUNDS)
     {
-        atomic_add(&(lock->lock), -1);
-#endif
-#if SPINLOCK_PROFILE
-            atomic_add(&(lock->spins), 1);
-            spins++;
-#endif
+        for (int i = 0; i < backoff; i++)
+        {
+            spinlock_pause();
         }
-#if SPINLOCK_PROFILE
-    if (spins)
+
+        if (backoff < SPINLOCK_MAX_BACKOFF)
+        {
+            backoff *= 2;
+        }
+
+        spins++;
+        acquired = lock->lock == 0 && __sync_bool_compare_and_swap(&lock->lock, 0, 1);
+    }
+
+    bool parked = false;
+
+    if (!acquired)
     {
-        lock->contended++;
-        if (lock->maxspins < spins)
+        /**
+         * The value 2 tells the releasing thread that it must wake up a
+         * sleeper. A thread that takes the lock this way keeps the value
+         * 2, as there may be other sleepers.
+         */
+        while (__sync_lock_test_and_set(&lock->lock, 2) != 0)
         {
-            lock->maxspins = spins;
+            syscall(SYS_futex, &lock->lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+            parked = true;
         }
     }
+
+#if SPINLOCK_COUNTERS || SPINLOCK_PROFILE
+    /** The lock is held, the counters need no atomic operations */
+    lock->contended++;
+    if (parked)
+    {
+        lock->parked++;
+    }
+#endif
+#if SPINLOCK_PROFILE
+    lock->spins += spins;
+    if (lock->maxspins < spins)
+    {
+        lock->maxspins = spins;
+    }
     lock->acquired++;
     lock->owner = thread_self();
     atomic_add(&(lock->waiting), -1);
@@ -98,18 +156,10 @@ spinlock_acquire(SPINLOCK *lock)
 int
 spinlock_acquire_nowait(SPINLOCK *lock)
 {
-#ifdef __GNUC__
-    if (__sync_lock_test_and_set(&(lock->lock), 1))
-    {
-        return FALSE;
-    }
-#else
-    if (atomic_add(&(lock->lock), 1) != 0)
+    if (!__sync_bool_compare_and_swap(&lock->lock, 0, 1))
     {
-        atomic_add(&(lock->lock), -1);
         return FALSE;
     }
-#endif
 #if SPINLOCK_PROFILE
     lock->acquired++;
     lock->owner = thread_self();
@@ -118,7 +168,8 @@ spinlock_acquire_nowait(SPINLOCK *lock)
 }
 
 /*
- * Release a spinlock.
+ * Release a spinlock. If threads may be sleeping on the lock, one of them
+ * is woken up.
  *
  * @param lock The spinlock to release
  */
@@ -132,17 +183,17 @@ spinlock_release(SPINLOCK *lock)
         lock->max_waiting = lock->waiting;
     }
 #endif
-#ifdef __GNUC__
-    __sync_synchronize(); /* Memory barrier. */
-    lock->lock = 0;
-#else
-    atomic_add(&(lock->lock), -1);
-#endif
+    /** Full memory barrier, returns the old value */
+    if (__sync_fetch_and_and(&lock->lock, 0) == 2)
+    {
+        syscall(SYS_futex, &lock->lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
 }
 
 /**
  * Report statistics on a spinlock. This only has an effect if the
- * spinlock code has been compiled with the SPINLOCK_PROFILE option set.
+ * spinlock code has been compiled with the SPINLOCK_COUNTERS or the
+ * SPINLOCK_PROFILE option set.
  *
  * NB A callback function is used to return the data rather than
  * merely printing to a DCB in order to avoid a dependency on the DCB
@@ -156,6 +207,10 @@ spinlock_release(SPINLOCK *lock)
 void
 spinlock_stats(SPINLOCK *lock, void (*reporter)(void *, char *, int), void *hdl)
 {
+#if SPINLOCK_COUNTERS && !SPINLOCK_PROFILE
+    reporter(hdl, "Contended locks", lock->contended);
+    reporter(hdl, "Sleeps on the lock", lock->parked);
+#endif
 #if SPINLOCK_PROFILE
     reporter(hdl, "Spinlock acquired", lock->acquired);
     if (lock->acquired)
@@ -172,6 +227,7 @@ spinlock_stats(SPINLOCK *lock, void (*reporter)(void *, char *, int), void *hdl)
         reporter(hdl, "Maximim no. of blocked threads",
                  lock->max_waiting);
         reporter(hdl, "Contended locks", lock->contended);
+        reporter(hdl, "Sleeps on the lock", lock->parked);
         reporter(hdl, "Contention percentage",
                  (lock->contended * 100) / lock->acquired);
     }
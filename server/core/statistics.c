@@ -14,13 +14,55 @@
 #include <statistics.h>
 #include <maxconfig.h>
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
 #include <platform.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <skygw_debug.h>
 
-thread_local int current_thread_id = 0;
+/** Id of the current thread, -1 for threads that use the shared block */
+thread_local int current_thread_id = -1;
+
+struct ts_histogram
+{
+    ts_stats_t buckets;                           /**< First slot of the buckets */
+    int        n_bounds;                          /**< Number of bucket bounds */
+    int64_t    bounds[TS_STATS_MAX_BUCKETS - 1];  /**< Lower bounds of the buckets after the first */
+};
+
+/** The latencies recorded by one thread */
+typedef struct ts_latency_thread
+{
+    TS_LATENCY_SNAPSHOT latency;
+} __attribute__((aligned(TS_STATS_CACHE_LINE))) TS_LATENCY_THREAD;
+
+struct ts_latency
+{
+    SPINLOCK           lock;    /**< Protects the shared block */
+    TS_LATENCY_THREAD *threads; /**< thread_count blocks followed by the shared block */
+};
 
 static int thread_count = 0;
 static bool initialized = false;
 
+/** The per-thread blocks, thread_count blocks followed by the shared block */
+static int64_t *blocks = NULL;
+static bool slot_used[TS_STATS_MAX_SLOTS];
+static SPINLOCK slot_lock = SPINLOCK_INIT;
+
+/**
+ * Get the slot of a thread
+ *
+ * @param stats  Slot in the block of the first thread
+ * @param thread Thread id, or thread_count for the shared block
+ * @return The slot of the thread
+ */
+static inline int64_t* ts_stats_slot(ts_stats_t stats, int thread)
+{
+    return (int64_t*)stats + (size_t)thread * TS_STATS_MAX_SLOTS;
+}
+
 /**
  * Initialize the statistics gathering
  */
@@ -28,6 +70,13 @@ void ts_stats_init()
 {
     ss_dassert(!initialized);
     thread_count = config_threadcount();
+
+    if (posix_memalign((void**)&blocks, TS_STATS_CACHE_LINE,
+                       (thread_count + 1) * TS_STATS_MAX_SLOTS * sizeof(int64_t)) != 0)
+    {
+        blocks = NULL;
+    }
+
     initialized = true;
 }
 
@@ -37,17 +86,96 @@ void ts_stats_init()
 void ts_stats_end()
 {
     ss_dassert(initialized);
+    free(blocks);
+    blocks = NULL;
+    memset(slot_used, 0, sizeof(slot_used));
+    initialized = false;
+}
+
+/**
+ * Reserve consecutive slots in the blocks of all threads
+ *
+ * @param n Number of slots
+ * @return The first slot in the block of the first thread or NULL if there
+ * are not enough free slots
+ */
+static ts_stats_t ts_stats_alloc_slots(int n)
+{
+    ts_stats_t rval = NULL;
+
+    if (blocks == NULL)
+    {
+        return NULL;
+    }
+
+    spinlock_acquire(&slot_lock);
+
+    for (int start = 0; start + n <= TS_STATS_MAX_SLOTS && rval == NULL; start++)
+    {
+        int i = 0;
+
+        while (i < n && !slot_used[start + i])
+        {
+            i++;
+        }
+
+        if (i == n)
+        {
+            rval = blocks + start;
+
+            for (i = 0; i < n; i++)
+            {
+                slot_used[start + i] = true;
+            }
+
+            for (int t = 0; t <= thread_count; t++)
+            {
+                memset(ts_stats_slot(rval, t), 0, n * sizeof(int64_t));
+            }
+        }
+        else
+        {
+            start += i;
+        }
+    }
+
+    spinlock_release(&slot_lock);
+
+    return rval;
+}
+
+/**
+ * Release slots reserved with ts_stats_alloc_slots
+ *
+ * @param stats First slot
+ * @param n Number of slots
+ */
+static void ts_stats_free_slots(ts_stats_t stats, int n)
+{
+    int start = (int64_t*)stats - blocks;
+
+    spinlock_acquire(&slot_lock);
+
+    for (int i = 0; i < n; i++)
+    {
+        slot_used[start + i] = false;
+    }
+
+    spinlock_release(&slot_lock);
 }
 
 /**
  * Create a new statistics object
  *
- * @return New stats_t object or NULL if memory allocation failed
+ * The object can be used as a counter with ts_stats_add or as a gauge with
+ * ts_stats_set.
+ *
+ * @return New stats_t object or NULL if no slots are available
  */
 ts_stats_t ts_stats_alloc()
 {
     ss_dassert(initialized);
-    return calloc(thread_count, sizeof(int));
+    return ts_stats_alloc_slots(1);
 }
 
 /**
@@ -58,7 +186,11 @@ ts_stats_t ts_stats_alloc()
 void ts_stats_free(ts_stats_t stats)
 {
     ss_dassert(initialized);
-    free(stats);
+
+    if (stats)
+    {
+        ts_stats_free_slots(stats, 1);
+    }
 }
 
 /**
@@ -70,32 +202,60 @@ void ts_stats_free(ts_stats_t stats)
 void ts_stats_set_thread_id(int id)
 {
     ss_dassert(initialized);
+    ss_dassert(id >= 0 && id < thread_count);
     current_thread_id = id;
 }
 
+/**
+ * Get the id of the current thread
+ *
+ * @return The thread id or -1 if the thread has not set one
+ */
+int ts_stats_get_thread_id()
+{
+    return current_thread_id;
+}
+
 /**
  * Add @c value to @c stats
  *
  * @param stats Statistics to add to
  * @param value Value to add
  */
-void ts_stats_add(ts_stats_t stats, int value)
+void ts_stats_add(ts_stats_t stats, int64_t value)
 {
     ss_dassert(initialized);
-    ((int*)stats)[current_thread_id] += value;
+
+    if (current_thread_id >= 0)
+    {
+        *ts_stats_slot(stats, current_thread_id) += value;
+    }
+    else
+    {
+        atomic_add_int64(ts_stats_slot(stats, thread_count), value);
+    }
 }
 
 /**
  * Assign a value to the statistics
  *
- * This sets the value for the current thread only.
+ * This sets the value for the current thread only. A gauge is read
+ * with ts_stats_sum or ts_stats_max.
  * @param stats Statistics to set
  * @param value Value to set to
  */
-void ts_stats_set(ts_stats_t stats, int value)
+void ts_stats_set(ts_stats_t stats, int64_t value)
 {
     ss_dassert(initialized);
-    ((int*)stats)[current_thread_id] = value;
+
+    if (current_thread_id >= 0)
+    {
+        *ts_stats_slot(stats, current_thread_id) = value;
+    }
+    else
+    {
+        atomic_store_int64(ts_stats_slot(stats, thread_count), value);
+    }
 }
 
 /**
@@ -104,13 +264,376 @@ void ts_stats_set(ts_stats_t stats, int value)
  * @param stats Statistics to read
  * @return Value of statistics
  */
-int ts_stats_sum(ts_stats_t stats)
+int64_t ts_stats_sum(ts_stats_t stats)
 {
     ss_dassert(initialized);
-    int sum = 0;
-    for (int i = 0; i < thread_count; i++)
+    int64_t sum = 0;
+    for (int i = 0; i <= thread_count; i++)
     {
-        sum += ((int*)stats)[i];
+        sum += *ts_stats_slot(stats, i);
     }
     return sum;
 }
+
+/**
+ * Read the largest value of a thread
+ *
+ * @param stats Statistics to read
+ * @return The largest value
+ */
+int64_t ts_stats_max(ts_stats_t stats)
+{
+    ss_dassert(initialized);
+    int64_t max = *ts_stats_slot(stats, 0);
+    for (int i = 1; i <= thread_count; i++)
+    {
+        int64_t value = *ts_stats_slot(stats, i);
+        if (value > max)
+        {
+            max = value;
+        }
+    }
+    return max;
+}
+
+/**
+ * Read the total values of several statistics objects
+ *
+ * The blocks are read one thread at a time, which is cheaper than summing
+ * each object separately when the objects were allocated together.
+ *
+ * @param stats   Statistics to read
+ * @param n_stats Number of statistics
+ * @param values  Array of @c n_stats elements where the values are stored
+ */
+void ts_stats_snapshot(ts_stats_t *stats, int n_stats, int64_t *values)
+{
+    ss_dassert(initialized);
+    memset(values, 0, n_stats * sizeof(int64_t));
+
+    for (int i = 0; i <= thread_count; i++)
+    {
+        for (int j = 0; j < n_stats; j++)
+        {
+            values[j] += *ts_stats_slot(stats[j], i);
+        }
+    }
+}
+
+/**
+ * Create a histogram
+ *
+ * The first bucket counts the values below bounds[0], bucket i the values
+ * from bounds[i - 1] to below bounds[i] and the last bucket the values from
+ * bounds[n_bounds - 1] upwards.
+ *
+ * @param bounds   Lower bounds of the buckets after the first, in ascending order
+ * @param n_bounds Number of bounds, less than TS_STATS_MAX_BUCKETS
+ * @return New histogram or NULL if memory allocation failed
+ */
+TS_HISTOGRAM* ts_histogram_alloc(const int64_t *bounds, int n_bounds)
+{
+    ss_dassert(initialized);
+    ss_dassert(n_bounds < TS_STATS_MAX_BUCKETS);
+    TS_HISTOGRAM *hist = malloc(sizeof(TS_HISTOGRAM));
+
+    if (hist && (hist->buckets = ts_stats_alloc_slots(n_bounds + 1)) == NULL)
+    {
+        free(hist);
+        hist = NULL;
+    }
+
+    if (hist)
+    {
+        memcpy(hist->bounds, bounds, n_bounds * sizeof(int64_t));
+        hist->n_bounds = n_bounds;
+    }
+
+    return hist;
+}
+
+/**
+ * Free a histogram
+ *
+ * @param hist Histogram to free
+ */
+void ts_histogram_free(TS_HISTOGRAM *hist)
+{
+    ss_dassert(initialized);
+
+    if (hist)
+    {
+        ts_stats_free_slots(hist->buckets, hist->n_bounds + 1);
+        free(hist);
+    }
+}
+
+/**
+ * Count a value in a histogram
+ *
+ * @param hist  The histogram
+ * @param value Value to count
+ */
+void ts_histogram_add(TS_HISTOGRAM *hist, int64_t value)
+{
+    int lo = 0, hi = hist->n_bounds;
+
+    /** Find the first bound that is larger than the value */
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (hist->bounds[mid] <= value)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    ts_stats_add((int64_t*)hist->buckets + lo, 1);
+}
+
+/**
+ * Read the counts of a histogram
+ *
+ * @param hist   The histogram
+ * @param counts Array of at least TS_STATS_MAX_BUCKETS elements where
+ * the counts of the buckets are stored
+ * @return Number of buckets
+ */
+int ts_histogram_snapshot(TS_HISTOGRAM *hist, int64_t *counts)
+{
+    ss_dassert(initialized);
+    int n = hist->n_bounds + 1;
+    memset(counts, 0, n * sizeof(int64_t));
+
+    for (int i = 0; i <= thread_count; i++)
+    {
+        int64_t *slots = ts_stats_slot(hist->buckets, i);
+
+        for (int j = 0; j < n; j++)
+        {
+            counts[j] += slots[j];
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Read the monotonic clock
+ *
+ * @return The time in microseconds
+ */
+uint64_t ts_clock_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Find the latency histogram bucket of a value
+ *
+ * @param us Latency in microseconds
+ * @return The bucket
+ */
+static int ts_latency_bucket(uint64_t us)
+{
+    if (us < 16)
+    {
+        return us;
+    }
+
+    int exp = 63 - __builtin_clzll(us);
+
+    if (exp > 40)
+    {
+        return TS_LATENCY_BUCKETS - 1;
+    }
+
+    return 16 + (exp - 4) * 8 + ((us >> (exp - 3)) & 7);
+}
+
+/**
+ * The smallest latency of a histogram bucket
+ *
+ * @param bucket The bucket
+ * @return Latency in microseconds
+ */
+uint64_t ts_latency_value(int bucket)
+{
+    if (bucket < 16)
+    {
+        return bucket;
+    }
+
+    int exp = (bucket - 16) / 8 + 4;
+    return (uint64_t)(8 + (bucket - 16) % 8) << (exp - 3);
+}
+
+/**
+ * Create a latency histogram
+ *
+ * @return New histogram or NULL if memory allocation failed
+ */
+TS_LATENCY* ts_latency_alloc()
+{
+    ss_dassert(initialized);
+    TS_LATENCY *latency = malloc(sizeof(TS_LATENCY));
+
+    if (latency && posix_memalign((void**)&latency->threads, TS_STATS_CACHE_LINE,
+                                  (thread_count + 1) * sizeof(TS_LATENCY_THREAD)) != 0)
+    {
+        free(latency);
+        latency = NULL;
+    }
+
+    if (latency)
+    {
+        memset(latency->threads, 0, (thread_count + 1) * sizeof(TS_LATENCY_THREAD));
+        spinlock_init(&latency->lock);
+    }
+
+    return latency;
+}
+
+/**
+ * Get a latency histogram, creating it on first use
+ *
+ * Objects that are created before the statistics are initialized, such as
+ * servers and services, create their histograms with this when the first
+ * latency is recorded.
+ *
+ * @param latency Pointer to the histogram, NULL if it is not yet created
+ * @return The histogram or NULL if memory allocation failed
+ */
+TS_LATENCY* ts_latency_get(TS_LATENCY **latency)
+{
+    TS_LATENCY *rval = *latency;
+
+    if (rval == NULL && (rval = ts_latency_alloc()) != NULL &&
+        !atomic_cas_ptr((void**)latency, NULL, rval))
+    {
+        ts_latency_free(rval);
+        rval = *latency;
+    }
+
+    return rval;
+}
+
+/**
+ * Free a latency histogram
+ *
+ * @param latency Histogram to free
+ */
+void ts_latency_free(TS_LATENCY *latency)
+{
+    if (latency)
+    {
+        free(latency->threads);
+        free(latency);
+    }
+}
+
+/**
+ * Record a latency in a histogram that is not shared by the threads
+ *
+ * The caller must make sure that the histogram is not modified concurrently.
+ *
+ * @param snapshot The histogram
+ * @param us       Latency in microseconds
+ */
+void ts_latency_record(TS_LATENCY_SNAPSHOT *snapshot, uint64_t us)
+{
+    snapshot->count++;
+    snapshot->total += us;
+    snapshot->max = us > snapshot->max ? us : snapshot->max;
+    snapshot->hist[ts_latency_bucket(us)]++;
+}
+
+/**
+ * Record a latency
+ *
+ * @param latency The histogram
+ * @param us      Latency in microseconds
+ */
+void ts_latency_add(TS_LATENCY *latency, uint64_t us)
+{
+    ss_dassert(initialized);
+
+    if (current_thread_id >= 0)
+    {
+        ts_latency_record(&latency->threads[current_thread_id].latency, us);
+    }
+    else
+    {
+        spinlock_acquire(&latency->lock);
+        ts_latency_record(&latency->threads[thread_count].latency, us);
+        spinlock_release(&latency->lock);
+    }
+}
+
+/**
+ * Merge the latencies recorded by all threads
+ *
+ * @param latency  The histogram
+ * @param snapshot Where the merged latencies are stored
+ */
+void ts_latency_snapshot(TS_LATENCY *latency, TS_LATENCY_SNAPSHOT *snapshot)
+{
+    ss_dassert(initialized);
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    for (int i = 0; i <= thread_count; i++)
+    {
+        ts_latency_merge(snapshot, &latency->threads[i].latency);
+    }
+}
+
+/**
+ * Add the latencies of one snapshot to another
+ *
+ * @param dest Snapshot to add to
+ * @param src  Snapshot to add
+ */
+void ts_latency_merge(TS_LATENCY_SNAPSHOT *dest, const TS_LATENCY_SNAPSHOT *src)
+{
+    dest->count += src->count;
+    dest->total += src->total;
+    dest->max = src->max > dest->max ? src->max : dest->max;
+
+    for (int i = 0; i < TS_LATENCY_BUCKETS; i++)
+    {
+        dest->hist[i] += src->hist[i];
+    }
+}
+
+/**
+ * Calculate a percentile of the latencies
+ *
+ * @param snapshot The latencies
+ * @param fraction The percentile as a fraction, e.g. 0.99
+ * @return The latency in microseconds, 0 if there are no samples
+ */
+uint64_t ts_latency_percentile(const TS_LATENCY_SNAPSHOT *snapshot, double fraction)
+{
+    uint64_t target = snapshot->count * fraction + 0.5;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < TS_LATENCY_BUCKETS; i++)
+    {
+        seen += snapshot->hist[i];
+
+        if (seen > 0 && seen >= target)
+        {
+            uint64_t value = ts_latency_value(i);
+            return value > snapshot->max ? snapshot->max : value;
+        }
+    }
+
+    return snapshot->max;
+}
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Measures the speed of the common buffer operations. Each operation is run
+ * on chains shaped like the data MaxScale handles: a single query, a result
+ * set read in several pieces and a large packet that spans many buffers.
+ * The time of each operation is reported per chain.
+ *
+ * In the allocation counting mode, the calls to malloc, calloc and realloc
+ * made by the operations are counted as well, together with the allocations
+ * the buffer pools served, so that the changes to buffer.c that are meant
+ * to save allocations can be evaluated.
+ *
+ * With -j, the mean and the standard deviation of the time of each batch are
+ * written to a file in the form perfcompare reads.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <buffer.h>
+#include <modutil.h>
+
+static bool count_allocations = false; /*< Whether the allocations are reported */
+static bool counting = false;          /*< Whether an operation is being measured */
+static uint64_t n_allocations = 0;
+
+#if defined(__GLIBC__)
+/**
+ * The allocations are counted by wrapping the allocation functions of the C
+ * library.
+ */
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size)
+{
+    n_allocations += counting;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    n_allocations += counting;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    n_allocations += counting;
+    return __libc_realloc(ptr, size);
+}
+#define ALLOCATIONS_COUNTED true
+#else
+#define ALLOCATIONS_COUNTED false
+#endif
+
+/** The number of chains an operation is timed with at a time */
+#define BATCH_SIZE 100
+
+/**
+ * The shape of a chain: the MySQL packets it contains and the size of the
+ * buffers they were read into.
+ */
+typedef struct
+{
+    const char *name;        /*< The name of the shape */
+    size_t packet_size;      /*< The size of each packet, including the header */
+    int n_packets;           /*< The number of packets */
+    size_t segment_size;     /*< The size of the buffers of the chain */
+} SHAPE;
+
+static const SHAPE SHAPES[] =
+{
+    { "query",     40,    1,  1024 },
+    { "resultset", 96,    80, 1024 },
+    { "large",     65540, 1,  16384 },
+};
+
+#define N_SHAPES (sizeof(SHAPES) / sizeof(SHAPES[0]))
+
+static uint8_t *shape_data = NULL;
+static uint8_t *copy_area = NULL;
+static FILE *json = NULL;             /*< Where the results are written with -j */
+static int n_json_results = 0;
+
+/**
+ * Fill the data of a shape with its packets
+ *
+ * @param shape The shape
+ */
+static void shape_fill(const SHAPE *shape)
+{
+    size_t payload = shape->packet_size - 4;
+
+    for (int i = 0; i < shape->n_packets; i++)
+    {
+        uint8_t *packet = shape_data + i * shape->packet_size;
+
+        packet[0] = payload;
+        packet[1] = payload >> 8;
+        packet[2] = payload >> 16;
+        packet[3] = i;
+        memset(packet + 4, 'x', payload);
+    }
+}
+
+static size_t shape_length(const SHAPE *shape)
+{
+    return shape->packet_size * shape->n_packets;
+}
+
+static GWBUF *shape_build(const SHAPE *shape)
+{
+    size_t len = shape_length(shape);
+    GWBUF *head = NULL;
+
+    for (size_t offset = 0; offset < len; offset += shape->segment_size)
+    {
+        size_t n = MIN(shape->segment_size, len - offset);
+        head = gwbuf_append(head, gwbuf_alloc_and_load(n, shape_data + offset));
+    }
+
+    return head;
+}
+
+static void op_alloc_free(GWBUF **bufs, int n, const SHAPE *shape)
+{
+    for (int i = 0; i < n; i++)
+    {
+        gwbuf_free(shape_build(shape));
+    }
+}
+
+static void op_clone(GWBUF **bufs, int n, const SHAPE *shape)
+{
+    for (int i = 0; i < n; i++)
+    {
+        gwbuf_free(gwbuf_clone_all(bufs[i]));
+    }
+}
+
+static void op_make_contiguous(GWBUF **bufs, int n, const SHAPE *shape)
+{
+    for (int i = 0; i < n; i++)
+    {
+        bufs[i] = gwbuf_make_contiguous(bufs[i]);
+    }
+}
+
+static void op_copy_data(GWBUF **bufs, int n, const SHAPE *shape)
+{
+    size_t len = shape_length(shape);
+
+    for (int i = 0; i < n; i++)
+    {
+        gwbuf_copy_data(bufs[i], 0, len, copy_area);
+    }
+}
+
+static void op_split_packets(GWBUF **bufs, int n, const SHAPE *shape)
+{
+    for (int i = 0; i < n; i++)
+    {
+        GWBUF *packet;
+
+        while ((packet = modutil_get_next_MySQL_packet(&bufs[i])))
+        {
+            gwbuf_free(packet);
+        }
+    }
+}
+
+typedef struct
+{
+    const char *name;                                     /*< The name of the operation */
+    bool prebuilt;                                        /*< Whether it is given the chains */
+    void (*run)(GWBUF **bufs, int n, const SHAPE *shape); /*< Runs the operation */
+} OPERATION;
+
+static const OPERATION OPERATIONS[] =
+{
+    { "alloc_free",      false, op_alloc_free },
+    { "clone",           true,  op_clone },
+    { "make_contiguous", true,  op_make_contiguous },
+    { "copy_data",       true,  op_copy_data },
+    { "split_packets",   true,  op_split_packets },
+};
+
+#define N_OPERATIONS (sizeof(OPERATIONS) / sizeof(OPERATIONS[0]))
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Measure an operation on a shape
+ *
+ * @param op     The operation
+ * @param shape  The shape of the chains
+ * @param rounds The number of batches to run, each is a sample
+ */
+static void measure(const OPERATION *op, const SHAPE *shape, int rounds)
+{
+    GWBUF *bufs[BATCH_SIZE];
+    GWBUF_POOL_STATS before;
+    GWBUF_POOL_STATS after;
+    uint64_t ns = 0;
+    double sum_squares = 0;
+    uint64_t allocations = 0;
+    uint64_t pooled = 0;
+    uint64_t system = 0;
+
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < BATCH_SIZE; i++)
+        {
+            bufs[i] = op->prebuilt ? shape_build(shape) : NULL;
+        }
+
+        gwbuf_get_pool_stats(&before);
+        n_allocations = 0;
+        counting = count_allocations;
+        uint64_t start = now_ns();
+
+        op->run(bufs, BATCH_SIZE, shape);
+
+        uint64_t batch = now_ns() - start;
+        counting = false;
+        ns += batch;
+        sum_squares += ((double)batch / BATCH_SIZE) * ((double)batch / BATCH_SIZE);
+        allocations += n_allocations;
+        gwbuf_get_pool_stats(&after);
+        pooled += after.alloc_pooled - before.alloc_pooled;
+        system += after.alloc_system - before.alloc_system;
+
+        for (int i = 0; i < BATCH_SIZE; i++)
+        {
+            gwbuf_free(bufs[i]);
+        }
+    }
+
+    double n = (double)rounds * BATCH_SIZE;
+
+    printf("%-16s %-10s %10.1f", op->name, shape->name, ns / n);
+
+    if (count_allocations)
+    {
+        if (ALLOCATIONS_COUNTED)
+        {
+            printf(" %10.2f", allocations / n);
+        }
+
+        printf(" %10.2f %10.2f", pooled / n, system / n);
+    }
+
+    printf("\n");
+
+    if (json)
+    {
+        double mean = ns / n;
+        double variance = rounds > 1 ? (sum_squares - rounds * mean * mean) / (rounds - 1) : 0;
+
+        fprintf(json, "%s\n    { \"name\": \"%s/%s\", \"unit\": \"ns\", \"n\": %d, "
+                "\"mean\": %.2f, \"stddev\": %.2f }", n_json_results++ ? "," : "",
+                op->name, shape->name, rounds, mean, variance > 0 ? sqrt(variance) : 0.0);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-a] [-r rounds] [-o operation]... [-s shape]... [-j file]\n"
+            "\n"
+            "-a  Count the allocations made by the operations\n"
+            "-r  The number of batches of %d chains each operation is run with, default 1000\n"
+            "-o  An operation to measure, can be given many times, default all\n"
+            "-s  A shape of chains to use, can be given many times, default all\n"
+            "-j  Write the times to a file as JSON, see perfcompare\n"
+            "\n"
+            "The time is in nanoseconds per chain. The allocations are the calls to\n"
+            "malloc, calloc and realloc per chain. The pooled and system columns are\n"
+            "the buffer allocations that were served by the pools and by malloc.\n",
+            name, BATCH_SIZE);
+}
+
+static int find_name(const char *name, const void *items, size_t n, size_t size)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (strcmp(*(const char **)((const char *)items + i * size), name) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    bool ops[N_OPERATIONS] = {false};
+    bool shapes[N_SHAPES] = {false};
+    bool any_op = false;
+    bool any_shape = false;
+    int rounds = 1000;
+    size_t max_len = 0;
+    int c;
+    int i;
+
+    while ((c = getopt(argc, argv, "ar:o:s:j:")) != -1)
+    {
+        switch (c)
+        {
+        case 'a':
+            count_allocations = true;
+            break;
+
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+
+        case 'o':
+            if ((i = find_name(optarg, OPERATIONS, N_OPERATIONS, sizeof(OPERATION))) < 0)
+            {
+                fprintf(stderr, "Unknown operation: %s\n", optarg);
+                return 1;
+            }
+            ops[i] = any_op = true;
+            break;
+
+        case 's':
+            if ((i = find_name(optarg, SHAPES, N_SHAPES, sizeof(SHAPE))) < 0)
+            {
+                fprintf(stderr, "Unknown shape: %s\n", optarg);
+                return 1;
+            }
+            shapes[i] = any_shape = true;
+            break;
+
+        case 'j':
+            if ((json = fopen(optarg, "w")) == NULL)
+            {
+                fprintf(stderr, "Failed to open %s\n", optarg);
+                return 1;
+            }
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (rounds <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < N_SHAPES; i++)
+    {
+        max_len = MAX(max_len, shape_length(&SHAPES[i]));
+    }
+
+    if ((shape_data = malloc(max_len)) == NULL || (copy_area = malloc(max_len)) == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("%-16s %-10s %10s", "Operation", "Shape", "ns");
+
+    if (count_allocations)
+    {
+        if (ALLOCATIONS_COUNTED)
+        {
+            printf(" %10s", "allocs");
+        }
+
+        printf(" %10s %10s", "pooled", "system");
+    }
+
+    printf("\n");
+
+    if (json)
+    {
+        fprintf(json, "{ \"benchmark\": \"buffer\", \"results\": [");
+    }
+
+    for (int s = 0; s < N_SHAPES; s++)
+    {
+        if (any_shape && !shapes[s])
+        {
+            continue;
+        }
+
+        shape_fill(&SHAPES[s]);
+
+        for (int o = 0; o < N_OPERATIONS; o++)
+        {
+            if (!any_op || ops[o])
+            {
+                measure(&OPERATIONS[o], &SHAPES[s], rounds);
+            }
+        }
+    }
+
+    if (json)
+    {
+        fprintf(json, "\n] }\n");
+        fclose(json);
+    }
+
+    free(copy_area);
+    free(shape_data);
+
+    return 0;
+}
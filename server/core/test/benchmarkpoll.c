@@ -0,0 +1,516 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Measures the throughput of the polling loop. The real polling threads are
+ * started and each connection is a client DCB whose session routes to a null
+ * router that answers every COM_QUERY with an OK packet. A client thread per
+ * connection sends a query, waits for the OK and sends the next one.
+ *
+ * The events processed per second, the I/O system calls per event, the
+ * latency percentiles of the round trips and the polling statistics,
+ * including the contention of the event queue locks, are reported, so that
+ * changes to the core, such as the per-thread event queues, can be compared.
+ *
+ * With -j, the mean and the standard deviation of the round trips are written
+ * to a file in the form perfcompare reads.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <maxscale/poll.h>
+#include <dcb.h>
+#include <session.h>
+#include <modutil.h>
+#include <maxconfig.h>
+#include <thread.h>
+#include <utils.h>
+#include <test_utils.h>
+
+/** The latencies are counted in buckets of a microsecond up to this */
+#define LATENCY_BUCKETS 10000
+
+typedef struct
+{
+    int fd;                                /*< The client end of the connection */
+    SESSION session;                       /*< The session of the server end */
+    DCB *dcb;                              /*< The server end of the connection */
+    uint64_t n_requests;                   /*< The round trips made */
+    uint64_t max_latency;                  /*< The longest round trip in nanoseconds */
+    double latency_sum;                    /*< The sum of the round trips in nanoseconds */
+    double latency_squares;                /*< The sum of their squares */
+    uint64_t latencies[LATENCY_BUCKETS + 1]; /*< The round trips, the last bucket is overflow */
+} CONNECTION;
+
+static volatile bool running = true;
+static int query_size = 16;
+
+static const uint8_t ok_packet[] = {0x07, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00};
+
+/**
+ * The null router, replies to each query with an OK packet
+ */
+static int null_route_query(void *instance, void *session, GWBUF *request)
+{
+    SESSION *ses = (SESSION *)session;
+    GWBUF *reply = gwbuf_alloc_and_load(sizeof(ok_packet), (void *)ok_packet);
+
+    gwbuf_free(request);
+
+    return reply ? dcb_write(ses->client_dcb, reply) : 0;
+}
+
+static int bench_read(DCB *dcb)
+{
+    GWBUF *buffer = NULL;
+    GWBUF *packet;
+
+    if (dcb_read(dcb, &buffer, 0) < 0)
+    {
+        gwbuf_free(buffer);
+        return 0;
+    }
+
+    while ((packet = modutil_get_next_MySQL_packet(&buffer)))
+    {
+        SESSION_ROUTE_QUERY(dcb->session, packet);
+    }
+
+    /** A partial packet is read again with the rest of it */
+    dcb->dcb_readqueue = buffer;
+
+    return 1;
+}
+
+static int bench_write_ready(DCB *dcb)
+{
+    return dcb_drain_writeq(dcb);
+}
+
+static int bench_ignore(DCB *dcb)
+{
+    return 0;
+}
+
+static int bench_print(DCB *dcb, GWBUF *buffer)
+{
+    fwrite(GWBUF_DATA(buffer), 1, GWBUF_LENGTH(buffer), stdout);
+    gwbuf_free(buffer);
+    return 1;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * The client of a connection, sends a query and waits for the OK
+ */
+static void client_main(void *arg)
+{
+    CONNECTION *conn = (CONNECTION *)arg;
+    int len = query_size + 5;
+    uint8_t *query = (uint8_t *)malloc(len);
+    uint8_t reply[sizeof(ok_packet)];
+
+    if (query == NULL)
+    {
+        return;
+    }
+
+    memset(query, ' ', len);
+    query[0] = (query_size + 1);
+    query[1] = (query_size + 1) >> 8;
+    query[2] = (query_size + 1) >> 16;
+    query[3] = 0;
+    query[4] = 0x03; /*< COM_QUERY */
+    memcpy(query + 5, "SELECT 1", MIN(query_size, 8));
+
+    while (running)
+    {
+        uint64_t start = now_ns();
+
+        if (write(conn->fd, query, len) != len)
+        {
+            break;
+        }
+
+        size_t n = 0;
+
+        while (n < sizeof(reply))
+        {
+            ssize_t rc = read(conn->fd, reply + n, sizeof(reply) - n);
+
+            if (rc <= 0)
+            {
+                free(query);
+                return;
+            }
+
+            n += rc;
+        }
+
+        uint64_t latency = now_ns() - start;
+        uint64_t bucket = latency / 1000;
+
+        conn->latencies[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS]++;
+        conn->max_latency = MAX(conn->max_latency, latency);
+        conn->latency_sum += latency;
+        conn->latency_squares += (double)latency * latency;
+        conn->n_requests++;
+    }
+
+    free(query);
+}
+
+/**
+ * Create the two ends of a connection
+ *
+ * @param tcp   Whether to use a loopback TCP connection instead of a socketpair
+ * @param fds   The client end is stored in the first and the server end in
+ *              the second element
+ * @return True on success
+ */
+static bool make_connection(bool tcp, int fds[2])
+{
+    if (!tcp)
+    {
+        return socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int one = 1;
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    bool ok = false;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (lfd >= 0 &&
+        bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        listen(lfd, 1) == 0 &&
+        getsockname(lfd, (struct sockaddr *)&addr, &addrlen) == 0 &&
+        (fds[0] = socket(AF_INET, SOCK_STREAM, 0)) >= 0)
+    {
+        if (connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+            (fds[1] = accept(lfd, NULL, NULL)) >= 0)
+        {
+            setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            ok = true;
+        }
+        else
+        {
+            close(fds[0]);
+        }
+    }
+
+    if (lfd >= 0)
+    {
+        close(lfd);
+    }
+
+    return ok;
+}
+
+static bool add_connection(CONNECTION *conn, bool tcp)
+{
+    static GWPROTOCOL protocol =
+    {
+        bench_read, dcb_write, bench_write_ready, bench_ignore, bench_ignore
+    };
+    int fds[2];
+
+    if (!make_connection(tcp, fds))
+    {
+        perror("Failed to create a connection");
+        return false;
+    }
+
+    conn->fd = fds[0];
+    setnonblocking(fds[1]);
+
+    if ((conn->dcb = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, NULL)) == NULL)
+    {
+        return false;
+    }
+
+#if defined(SS_DEBUG)
+    conn->session.ses_chk_top = CHK_NUM_SESSION;
+    conn->session.ses_chk_tail = CHK_NUM_SESSION;
+#endif
+    conn->session.state = SESSION_STATE_ROUTER_READY;
+    conn->session.client_dcb = conn->dcb;
+    conn->session.head.session = &conn->session;
+    conn->session.head.routeQuery = null_route_query;
+
+    conn->dcb->fd = fds[1];
+    conn->dcb->session = &conn->session;
+    memcpy(&conn->dcb->func, &protocol, sizeof(protocol));
+
+    return poll_add_dcb(conn->dcb) == 0;
+}
+
+static void print_latency(const char *name, CONNECTION *total, uint64_t n, double fraction)
+{
+    uint64_t rank = n * fraction;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS && seen + total->latencies[i] <= rank; i++)
+    {
+        seen += total->latencies[i];
+    }
+
+    if (i < LATENCY_BUCKETS)
+    {
+        printf("Latency %-5s            %d us\n", name, i + 1);
+    }
+    else
+    {
+        printf("Latency %-5s            > %d us\n", name, LATENCY_BUCKETS);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-t threads] [-c connections] [-d seconds] [-s size] [-l] [-q] [-w] [-r]\n"
+            "       [-j file]\n"
+            "\n"
+            "-t  The number of polling threads, default 4\n"
+            "-c  The number of connections, each with a client thread, default 16\n"
+            "-d  The duration of the run in seconds, default 10\n"
+            "-s  The size of the statement of a query, default 16\n"
+            "-l  Use loopback TCP connections instead of UNIX domain socketpairs\n"
+            "-q  Give each polling thread an event queue of its own\n"
+            "-w  Let idle threads steal events from busy ones, implies -q\n"
+            "-r  Read without probing the sockets with FIONREAD\n"
+            "-j  Write the round trip time to a file as JSON, see perfcompare\n"
+            "\n"
+            "The system calls counted are epoll_wait, read and writev. The probes made\n"
+            "for each event, FIONREAD and SO_ERROR, are not included.\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    int n_threads = 4;
+    int n_connections = 16;
+    int duration = 10;
+    bool tcp = false;
+    const char *json = NULL;
+    GATEWAY_CONF *cnf = config_get_global_options();
+    int c;
+
+    cnf->n_nbpoll = DEFAULT_NBPOLLS;
+    cnf->pollsleep = DEFAULT_POLLSLEEP;
+
+    while ((c = getopt(argc, argv, "t:c:d:s:lqwrj:")) != -1)
+    {
+        switch (c)
+        {
+        case 't':
+            n_threads = atoi(optarg);
+            break;
+
+        case 'c':
+            n_connections = atoi(optarg);
+            break;
+
+        case 'd':
+            duration = atoi(optarg);
+            break;
+
+        case 's':
+            query_size = atoi(optarg);
+            break;
+
+        case 'l':
+            tcp = true;
+            break;
+
+        case 'q':
+            cnf->thread_event_queues = 1;
+            break;
+
+        case 'w':
+            cnf->thread_event_queues = 1;
+            cnf->thread_work_stealing = 1;
+            break;
+
+        case 'r':
+            cnf->direct_reads = 1;
+            break;
+
+        case 'j':
+            json = optarg;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (n_threads <= 0 || n_connections <= 0 || duration <= 0 || query_size <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    cnf->n_threads = n_threads;
+    init_test_env(NULL);
+
+    CONNECTION *conns = (CONNECTION *)calloc(n_connections, sizeof(CONNECTION));
+    THREAD *poll_threads = (THREAD *)calloc(n_threads, sizeof(THREAD));
+    THREAD *client_threads = (THREAD *)calloc(n_connections, sizeof(THREAD));
+
+    if (conns == NULL || poll_threads == NULL || client_threads == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (intptr_t i = 0; i < n_threads; i++)
+    {
+        thread_start(&poll_threads[i], poll_waitevents, (void *)i);
+    }
+
+    for (int i = 0; i < n_connections; i++)
+    {
+        if (!add_connection(&conns[i], tcp))
+        {
+            fprintf(stderr, "Failed to add connection %d\n", i);
+            return 1;
+        }
+    }
+
+    int events_before = poll_get_stat(POLL_STAT_READ) + poll_get_stat(POLL_STAT_WRITE);
+    int polls_before = poll_get_stat(POLL_STAT_N_POLLS) + poll_get_stat(POLL_STAT_BLOCKING_POLLS);
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < n_connections; i++)
+    {
+        thread_start(&client_threads[i], client_main, &conns[i]);
+    }
+
+    sleep(duration);
+    running = false;
+
+    for (int i = 0; i < n_connections; i++)
+    {
+        thread_wait(client_threads[i]);
+    }
+
+    double seconds = (now_ns() - start) / 1000000000.0;
+    int events = poll_get_stat(POLL_STAT_READ) + poll_get_stat(POLL_STAT_WRITE) - events_before;
+    int polls = poll_get_stat(POLL_STAT_N_POLLS) + poll_get_stat(POLL_STAT_BLOCKING_POLLS) - polls_before;
+    uint64_t syscalls = polls;
+    CONNECTION *total = (CONNECTION *)calloc(1, sizeof(CONNECTION));
+
+    for (int i = 0; i < n_connections; i++)
+    {
+        syscalls += conns[i].dcb->stats.n_reads + conns[i].dcb->stats.n_writes;
+        total->n_requests += conns[i].n_requests;
+        total->max_latency = MAX(total->max_latency, conns[i].max_latency);
+        total->latency_sum += conns[i].latency_sum;
+        total->latency_squares += conns[i].latency_squares;
+
+        for (int j = 0; j <= LATENCY_BUCKETS; j++)
+        {
+            total->latencies[j] += conns[i].latencies[j];
+        }
+    }
+
+    printf("Threads                  %d\n", n_threads);
+    printf("Connections              %d (%s)\n", n_connections, tcp ? "TCP" : "socketpair");
+    printf("Event queues             %s\n", cnf->thread_event_queues ? "per thread" : "shared");
+    printf("Duration                 %.2f s\n", seconds);
+    printf("Queries                  %lu\n", total->n_requests);
+    printf("Queries/s                %.0f\n", total->n_requests / seconds);
+    printf("Events/s                 %.0f\n", events / seconds);
+    printf("Syscalls/event           %.2f\n", events ? (double)syscalls / events : 0.0);
+
+    if (total->n_requests)
+    {
+        print_latency("p50", total, total->n_requests, 0.50);
+        print_latency("p90", total, total->n_requests, 0.90);
+        print_latency("p99", total, total->n_requests, 0.99);
+        print_latency("p99.9", total, total->n_requests, 0.999);
+        printf("Latency max              %lu us\n", total->max_latency / 1000);
+    }
+
+    if (json)
+    {
+        FILE *file = fopen(json, "w");
+        double n = total->n_requests;
+        double mean = n ? total->latency_sum / n : 0;
+        double variance = n > 1 ? (total->latency_squares - n * mean * mean) / (n - 1) : 0;
+
+        if (file == NULL)
+        {
+            fprintf(stderr, "Failed to open %s\n", json);
+            return 1;
+        }
+
+        fprintf(file, "{ \"benchmark\": \"poll\", \"results\": [\n"
+                "    { \"name\": \"roundtrip\", \"unit\": \"ns\", \"n\": %lu, "
+                "\"mean\": %.2f, \"stddev\": %.2f }\n] }\n",
+                total->n_requests, mean, variance > 0 ? sqrt(variance) : 0.0);
+        fclose(file);
+    }
+
+    /** The polling statistics are printed through a DCB that writes to stdout */
+    DCB *out = dcb_alloc(DCB_ROLE_INTERNAL, NULL);
+
+    if (out)
+    {
+        out->func.write = bench_print;
+        dprintPollStats(out);
+    }
+
+    poll_shutdown();
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        thread_wait(poll_threads[i]);
+    }
+
+    /** The DCBs have sessions that were not allocated, so they are not closed */
+    for (int i = 0; i < n_connections; i++)
+    {
+        close(conns[i].fd);
+    }
+
+    free(total);
+    free(client_threads);
+    free(poll_threads);
+    free(conns);
+
+    return 0;
+}
@@ -0,0 +1,1371 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Measures the latency and the throughput MaxScale adds between the clients
+ * and the servers. The program starts mock MySQL servers of its own that
+ * answer every SELECT with the same canned result set, a MaxScale that runs a
+ * readconnroute, a readwritesplit and a schemarouter service in front of them
+ * and a client thread per connection that sends a query, waits for the result
+ * and repeats.
+ *
+ * The load is first run directly against a mock server and then through each
+ * service. For each configuration the queries per second, the queries per
+ * second per core of CPU time MaxScale used, the latency percentiles and the
+ * latency added to that of the direct connection are reported.
+ *
+ * The mock servers know just enough of the protocol for MaxScale: they accept
+ * any credentials, they return one user without a password when the users are
+ * loaded and they tell the monitor that the first server is the master of the
+ * rest.
+ *
+ * With -j, the mean and the standard deviation of the latency of each
+ * configuration are written to a file in the form perfcompare reads.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MOCK_VERSION "5.5.42-mock"
+#define BENCH_USER "bench"
+#define BENCH_QUERY "SELECT c FROM db1.t WHERE id = 1"
+#define BENCH_WRITE "INSERT INTO db1.t VALUES (1, 'x')"
+
+/** The latencies are counted in buckets of a microsecond up to this */
+#define LATENCY_BUCKETS 100000
+
+/** How long MaxScale is given to start and to find the master */
+#define STARTUP_TIMEOUT 30
+
+#define COM_QUIT  0x01
+#define COM_QUERY 0x03
+
+/**
+ * A buffer of outgoing packets
+ */
+typedef struct
+{
+    uint8_t *data; /*< The packets */
+    size_t len;    /*< Length of the packets */
+    size_t cap;    /*< Size of the buffer */
+    size_t start;  /*< Offset of the packet being written */
+    uint8_t seq;   /*< The sequence number of the next packet */
+} OUTBUF;
+
+/**
+ * The options of a run
+ */
+static int n_servers = 4;
+static int base_port = 4100;
+static int n_connections = 16;
+static int duration = 10;
+static int n_rows = 1;
+static int write_percent = 0;
+static int maxscale_threads = 4;
+static const char *maxscale_path = NULL;
+static const char *libdir = NULL;
+static const char *filter_module = NULL;
+static const char *classifier = NULL;
+static bool keep_files = false;
+
+/** The result set the mock servers return for the SELECTs of the benchmark */
+static OUTBUF canned_result;
+
+static volatile bool running = true;
+
+/**
+ * The outgoing packets
+ */
+
+static bool out_reserve(OUTBUF *out, size_t n)
+{
+    if (out->len + n > out->cap)
+    {
+        size_t cap = out->cap ? out->cap : 256;
+
+        while (cap < out->len + n)
+        {
+            cap *= 2;
+        }
+
+        uint8_t *data = (uint8_t *)realloc(out->data, cap);
+
+        if (data == NULL)
+        {
+            return false;
+        }
+
+        out->data = data;
+        out->cap = cap;
+    }
+
+    return true;
+}
+
+static void out_bytes(OUTBUF *out, const void *data, size_t n)
+{
+    if (out_reserve(out, n))
+    {
+        memcpy(out->data + out->len, data, n);
+        out->len += n;
+    }
+}
+
+static void out_byte(OUTBUF *out, uint8_t b)
+{
+    out_bytes(out, &b, 1);
+}
+
+static void out_int(OUTBUF *out, uint64_t value, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out_byte(out, (value >> (8 * i)) & 0xff);
+    }
+}
+
+static void out_lenenc(OUTBUF *out, uint64_t value)
+{
+    if (value < 251)
+    {
+        out_byte(out, value);
+    }
+    else if (value < 0x10000)
+    {
+        out_byte(out, 0xfc);
+        out_int(out, value, 2);
+    }
+    else if (value < 0x1000000)
+    {
+        out_byte(out, 0xfd);
+        out_int(out, value, 3);
+    }
+    else
+    {
+        out_byte(out, 0xfe);
+        out_int(out, value, 8);
+    }
+}
+
+static void out_lenenc_str(OUTBUF *out, const char *str)
+{
+    if (str)
+    {
+        size_t len = strlen(str);
+        out_lenenc(out, len);
+        out_bytes(out, str, len);
+    }
+    else
+    {
+        out_byte(out, 0xfb); /*< NULL */
+    }
+}
+
+static void out_begin(OUTBUF *out)
+{
+    out->start = out->len;
+    out_int(out, 0, 4);
+}
+
+static void out_end(OUTBUF *out)
+{
+    if (out->len >= out->start + 4)
+    {
+        size_t payload = out->len - out->start - 4;
+        uint8_t *hdr = out->data + out->start;
+
+        hdr[0] = payload;
+        hdr[1] = payload >> 8;
+        hdr[2] = payload >> 16;
+        hdr[3] = out->seq++;
+    }
+}
+
+static void out_reset(OUTBUF *out, uint8_t seq)
+{
+    out->len = 0;
+    out->seq = seq;
+}
+
+static void out_ok(OUTBUF *out)
+{
+    out_begin(out);
+    out_byte(out, 0x00);
+    out_lenenc(out, 0);
+    out_lenenc(out, 0);
+    out_int(out, 0x0002, 2); /*< SERVER_STATUS_AUTOCOMMIT */
+    out_int(out, 0, 2);
+    out_end(out);
+}
+
+static void out_error(OUTBUF *out, int code, const char *msg)
+{
+    out_begin(out);
+    out_byte(out, 0xff);
+    out_int(out, code, 2);
+    out_bytes(out, "#HY000", 6);
+    out_bytes(out, msg, strlen(msg));
+    out_end(out);
+}
+
+static void out_eof(OUTBUF *out)
+{
+    out_begin(out);
+    out_byte(out, 0xfe);
+    out_int(out, 0, 2);
+    out_int(out, 0x0002, 2);
+    out_end(out);
+}
+
+/**
+ * Add a text protocol result set
+ *
+ * @param out     Where the result set is added
+ * @param columns The names of the columns
+ * @param n_cols  The number of columns
+ * @param values  The values of the rows, the row after row
+ * @param n_rows  The number of rows
+ */
+static void out_resultset(OUTBUF *out, const char **columns, int n_cols,
+                          const char **values, int n_rows)
+{
+    out_begin(out);
+    out_lenenc(out, n_cols);
+    out_end(out);
+
+    for (int i = 0; i < n_cols; i++)
+    {
+        out_begin(out);
+        out_lenenc_str(out, "def");
+        out_lenenc_str(out, "");
+        out_lenenc_str(out, "");
+        out_lenenc_str(out, "");
+        out_lenenc_str(out, columns[i]);
+        out_lenenc_str(out, columns[i]);
+        out_byte(out, 0x0c);
+        out_int(out, 0x21, 2);   /*< utf8_general_ci */
+        out_int(out, 255, 4);
+        out_byte(out, 0xfd);     /*< MYSQL_TYPE_VAR_STRING */
+        out_int(out, 0, 2);
+        out_byte(out, 0);
+        out_int(out, 0, 2);
+        out_end(out);
+    }
+
+    out_eof(out);
+
+    for (int r = 0; r < n_rows; r++)
+    {
+        out_begin(out);
+
+        for (int i = 0; i < n_cols; i++)
+        {
+            out_lenenc_str(out, values[r * n_cols + i]);
+        }
+
+        out_end(out);
+    }
+
+    out_eof(out);
+}
+
+/**
+ * The socket I/O
+ */
+
+static bool write_all(int fd, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = read(fd, data, len);
+
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/**
+ * Read a packet
+ *
+ * @param fd   The socket
+ * @param buf  The buffer of the payload, grown as needed
+ * @param cap  The size of the buffer
+ * @param len  The length of the payload
+ * @param seq  The sequence number of the packet
+ * @return True if a packet was read
+ */
+static bool read_packet(int fd, uint8_t **buf, size_t *cap, size_t *len, uint8_t *seq)
+{
+    uint8_t hdr[4];
+
+    if (!read_all(fd, hdr, sizeof(hdr)))
+    {
+        return false;
+    }
+
+    *len = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16);
+    *seq = hdr[3];
+
+    if (*len + 1 > *cap)
+    {
+        uint8_t *data = (uint8_t *)realloc(*buf, *len + 1);
+
+        if (data == NULL)
+        {
+            return false;
+        }
+
+        *buf = data;
+        *cap = *len + 1;
+    }
+
+    if (!read_all(fd, *buf, *len))
+    {
+        return false;
+    }
+
+    (*buf)[*len] = '\0';
+    return true;
+}
+
+static int listen_on(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 1024) != 0)
+    {
+        fprintf(stderr, "Failed to listen on port %d: %s\n", port, strerror(errno));
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        return -1;
+    }
+
+    return fd;
+}
+
+static int connect_to(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/**
+ * The mock servers
+ */
+
+typedef struct
+{
+    int fd;    /*< The listening socket */
+    int id;    /*< The server_id, the first server is the master */
+} MOCK_SERVER;
+
+typedef struct
+{
+    MOCK_SERVER *server; /*< The server of the connection */
+    int fd;              /*< The client socket */
+} MOCK_CONNECTION;
+
+/**
+ * Answer a query. The queries of MaxScale are recognized from their text and
+ * everything else is either a SELECT or SHOW that gets the canned result set
+ * or a statement that gets an OK.
+ */
+static void mock_query(MOCK_SERVER *server, const char *sql, OUTBUF *out)
+{
+    char value[64];
+
+    if (strcasestr(sql, "@@server_id"))
+    {
+        const char *columns[] = {"@@server_id"};
+        const char *values[] = {value};
+        snprintf(value, sizeof(value), "%d", server->id);
+        out_resultset(out, columns, 1, values, 1);
+    }
+    else if (strcasestr(sql, "SHOW SLAVE STATUS"))
+    {
+        /** MaxScale reads Slave_IO_Running, Slave_SQL_Running and Master_Server_Id */
+        const char *columns[40];
+        const char *values[40];
+        char names[40][8];
+
+        for (int i = 0; i < 40; i++)
+        {
+            snprintf(names[i], sizeof(names[i]), "c%d", i);
+            columns[i] = names[i];
+            values[i] = "";
+        }
+
+        values[10] = "Yes";
+        values[11] = "Yes";
+        values[39] = "1";
+        out_resultset(out, columns, 40, values, server->id == 1 ? 0 : 1);
+    }
+    else if (strcasestr(sql, "SHOW DATABASES"))
+    {
+        const char *columns[] = {"Database"};
+        const char *values[] = {value};
+        snprintf(value, sizeof(value), "db%d", server->id);
+        out_resultset(out, columns, 1, values, 1);
+    }
+    else if (strcasestr(sql, "COUNT("))
+    {
+        const char *columns[] = {"nusers"};
+        const char *values[] = {"1"};
+        out_resultset(out, columns, 1, values, 1);
+    }
+    else if (strcasestr(sql, "mysql.user") || strcasestr(sql, "mysql.db"))
+    {
+        const char *columns[] = {"user", "host", "password", "userdata", "anydb", "db"};
+        const char *values[] = {BENCH_USER, "%", "", BENCH_USER "@%", "Y", NULL};
+        out_resultset(out, columns, 6, values, 1);
+    }
+    else if (strncasecmp(sql, "SELECT", 6) == 0 || strncasecmp(sql, "SHOW", 4) == 0)
+    {
+        out_bytes(out, canned_result.data, canned_result.len);
+    }
+    else
+    {
+        out_ok(out);
+    }
+}
+
+static void *mock_connection_main(void *arg)
+{
+    MOCK_CONNECTION *conn = (MOCK_CONNECTION *)arg;
+    OUTBUF out = {NULL, 0, 0, 0, 0};
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+    size_t len;
+    uint8_t seq;
+    int one = 1;
+
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    /** The handshake, any response to it is accepted */
+    out_begin(&out);
+    out_byte(&out, 10);
+    out_bytes(&out, MOCK_VERSION, sizeof(MOCK_VERSION));
+    out_int(&out, conn->fd, 4);
+    out_bytes(&out, "abcdefgh", 8);
+    out_byte(&out, 0);
+    out_int(&out, 0xf7ff, 2);    /*< The capabilities of MySQL 5.5 without SSL */
+    out_byte(&out, 0x21);
+    out_int(&out, 0x0002, 2);
+    out_int(&out, 0x0008, 2);    /*< CLIENT_PLUGIN_AUTH */
+    out_byte(&out, 21);
+    out_int(&out, 0, 10);
+    out_bytes(&out, "ijklmnopqrst", 13);
+    out_bytes(&out, "mysql_native_password", sizeof("mysql_native_password"));
+    out_end(&out);
+
+    if (write_all(conn->fd, out.data, out.len) &&
+        read_packet(conn->fd, &buf, &cap, &len, &seq))
+    {
+        out_reset(&out, seq + 1);
+        out_ok(&out);
+
+        while (write_all(conn->fd, out.data, out.len) &&
+               read_packet(conn->fd, &buf, &cap, &len, &seq) &&
+               len > 0 && buf[0] != COM_QUIT)
+        {
+            out_reset(&out, seq + 1);
+
+            if (buf[0] == COM_QUERY)
+            {
+                mock_query(conn->server, (char *)buf + 1, &out);
+            }
+            else if (buf[0] >= 0x16 && buf[0] <= 0x1c)
+            {
+                out_error(&out, 1295, "Prepared statements are not supported");
+            }
+            else
+            {
+                out_ok(&out);
+            }
+        }
+    }
+
+    close(conn->fd);
+    free(buf);
+    free(out.data);
+    free(conn);
+    return NULL;
+}
+
+static void *mock_server_main(void *arg)
+{
+    MOCK_SERVER *server = (MOCK_SERVER *)arg;
+    int fd;
+
+    while ((fd = accept(server->fd, NULL, NULL)) >= 0 || errno == EINTR)
+    {
+        MOCK_CONNECTION *conn;
+        pthread_t thr;
+
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        if ((conn = (MOCK_CONNECTION *)malloc(sizeof(MOCK_CONNECTION))) == NULL)
+        {
+            close(fd);
+            continue;
+        }
+
+        conn->server = server;
+        conn->fd = fd;
+
+        if (pthread_create(&thr, NULL, mock_connection_main, conn) == 0)
+        {
+            pthread_detach(thr);
+        }
+        else
+        {
+            close(fd);
+            free(conn);
+        }
+    }
+
+    return NULL;
+}
+
+static bool start_mock_servers()
+{
+    const char *columns[] = {"c"};
+    const char **values = (const char **)malloc(n_rows * sizeof(char *));
+
+    if (values == NULL)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < n_rows; i++)
+    {
+        values[i] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    }
+
+    out_reset(&canned_result, 1);
+    out_resultset(&canned_result, columns, 1, values, n_rows);
+    free(values);
+
+    for (int i = 0; i < n_servers; i++)
+    {
+        MOCK_SERVER *server = (MOCK_SERVER *)malloc(sizeof(MOCK_SERVER));
+        pthread_t thr;
+
+        if (server == NULL || (server->fd = listen_on(base_port + i)) < 0)
+        {
+            free(server);
+            return false;
+        }
+
+        server->id = i + 1;
+
+        if (pthread_create(&thr, NULL, mock_server_main, server) != 0)
+        {
+            return false;
+        }
+
+        pthread_detach(thr);
+    }
+
+    return true;
+}
+
+/**
+ * The clients
+ */
+
+typedef struct
+{
+    int port;                                /*< The port to connect to */
+    unsigned int seed;                       /*< Chooses between reads and writes */
+    uint64_t n_queries;                      /*< The queries made */
+    uint64_t n_errors;                       /*< The queries that failed */
+    uint64_t max_latency;                    /*< The longest round trip in nanoseconds */
+    double latency_sum;                      /*< The sum of the round trips in nanoseconds */
+    double latency_squares;                  /*< The sum of their squares */
+    uint64_t latencies[LATENCY_BUCKETS + 1]; /*< The round trips, the last bucket is overflow */
+} CLIENT;
+
+/**
+ * Connect to a port and authenticate as the benchmark user
+ *
+ * @param port The port
+ * @return The socket or -1 on error
+ */
+static int client_connect(int port)
+{
+    int fd = connect_to(port);
+    OUTBUF out = {NULL, 0, 0, 0, 0};
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+    size_t len;
+    uint8_t seq;
+    bool ok = false;
+
+    if (fd >= 0 && read_packet(fd, &buf, &cap, &len, &seq) && len > 0 && buf[0] == 10)
+    {
+        out_reset(&out, seq + 1);
+        out_begin(&out);
+        out_int(&out, 0x0003a205, 4); /*< PROTOCOL_41, SECURE_CONNECTION and the usual */
+        out_int(&out, 16777216, 4);
+        out_byte(&out, 0x21);
+        out_int(&out, 0, 23);
+        out_bytes(&out, BENCH_USER, sizeof(BENCH_USER));
+        out_byte(&out, 0);            /*< No password */
+        out_end(&out);
+
+        ok = write_all(fd, out.data, out.len) &&
+             read_packet(fd, &buf, &cap, &len, &seq) &&
+             len > 0 && buf[0] == 0x00;
+    }
+
+    free(buf);
+    free(out.data);
+
+    if (!ok && fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Send a query and read the result
+ *
+ * @param fd    The connection
+ * @param query The COM_QUERY packet
+ * @param len   Length of the packet
+ * @param buf   The read buffer
+ * @param cap   Size of the read buffer
+ * @return 1 if the query succeeded, 0 if it failed and -1 if the connection broke
+ */
+static int client_query(int fd, const uint8_t *query, size_t len, uint8_t **buf, size_t *cap)
+{
+    size_t plen;
+    uint8_t seq;
+    int n_eof = 0;
+
+    if (!write_all(fd, query, len) || !read_packet(fd, buf, cap, &plen, &seq))
+    {
+        return -1;
+    }
+
+    if (plen > 0 && ((*buf)[0] == 0x00 || (*buf)[0] == 0xff))
+    {
+        return (*buf)[0] == 0x00;
+    }
+
+    /** A result set ends with the EOF after the rows */
+    while (n_eof < 2)
+    {
+        if (!read_packet(fd, buf, cap, &plen, &seq))
+        {
+            return -1;
+        }
+
+        if (plen > 0 && plen < 9 && (*buf)[0] == 0xfe)
+        {
+            n_eof++;
+        }
+        else if (plen > 0 && (*buf)[0] == 0xff)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static size_t make_query(uint8_t *dest, const char *sql)
+{
+    size_t len = strlen(sql) + 1;
+
+    dest[0] = len;
+    dest[1] = len >> 8;
+    dest[2] = len >> 16;
+    dest[3] = 0;
+    dest[4] = COM_QUERY;
+    memcpy(dest + 5, sql, len - 1);
+    return len + 4;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *client_main(void *arg)
+{
+    CLIENT *client = (CLIENT *)arg;
+    uint8_t read_query[sizeof(BENCH_QUERY) + 4];
+    uint8_t write_query[sizeof(BENCH_WRITE) + 4];
+    size_t read_len = make_query(read_query, BENCH_QUERY);
+    size_t write_len = make_query(write_query, BENCH_WRITE);
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+    int fd = client_connect(client->port);
+
+    while (fd >= 0 && running)
+    {
+        bool is_write = (int)(rand_r(&client->seed) % 100) < write_percent;
+        uint64_t start = now_ns();
+        int rc = is_write ?
+                 client_query(fd, write_query, write_len, &buf, &cap) :
+                 client_query(fd, read_query, read_len, &buf, &cap);
+
+        if (rc < 0)
+        {
+            client->n_errors++;
+            break;
+        }
+
+        uint64_t latency = now_ns() - start;
+        uint64_t bucket = latency / 1000;
+
+        client->latencies[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS]++;
+        client->max_latency = latency > client->max_latency ? latency : client->max_latency;
+        client->latency_sum += latency;
+        client->latency_squares += (double)latency * latency;
+        client->n_queries++;
+        client->n_errors += (rc == 0);
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    else
+    {
+        client->n_errors++;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/**
+ * The results of a configuration
+ */
+typedef struct
+{
+    const char *name;   /*< The name of the configuration */
+    double qps;         /*< Queries per second */
+    double qps_core;    /*< Queries per second per core of MaxScale, 0 for direct */
+    uint64_t errors;    /*< The queries and connections that failed */
+    uint64_t n;         /*< The queries made */
+    double mean;        /*< The mean latency in nanoseconds */
+    double stddev;      /*< The standard deviation of the latency */
+    int p50;            /*< The latency percentiles in microseconds */
+    int p99;
+    int p999;
+} RESULT;
+
+static int percentile(const CLIENT *total, double fraction)
+{
+    uint64_t rank = total->n_queries * fraction;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS && seen + total->latencies[i] <= rank; i++)
+    {
+        seen += total->latencies[i];
+    }
+
+    return i + 1;
+}
+
+/**
+ * The CPU time a process has used
+ *
+ * @param pid The process
+ * @return The time in seconds
+ */
+static double process_cpu_time(pid_t pid)
+{
+    char path[64];
+    char line[1024];
+    double seconds = 0;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+
+    if ((file = fopen(path, "r")) != NULL)
+    {
+        if (fgets(line, sizeof(line), file))
+        {
+            /** The utime and stime are the 12th and 13th fields after the command */
+            char *p = strrchr(line, ')');
+            unsigned long utime, stime;
+
+            if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                            &utime, &stime) == 2)
+            {
+                seconds = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+            }
+        }
+
+        fclose(file);
+    }
+
+    return seconds;
+}
+
+/**
+ * Run the load against a port
+ *
+ * @param name   The name of the configuration
+ * @param port   The port to connect to
+ * @param pid    The MaxScale process, 0 for a direct connection
+ * @param result The results
+ * @return True if the clients could be started
+ */
+static bool run_load(const char *name, int port, pid_t pid, RESULT *result)
+{
+    CLIENT *clients = (CLIENT *)calloc(n_connections + 1, sizeof(CLIENT));
+    pthread_t *threads = (pthread_t *)calloc(n_connections, sizeof(pthread_t));
+    CLIENT *total;
+
+    if (clients == NULL || threads == NULL)
+    {
+        free(clients);
+        free(threads);
+        return false;
+    }
+
+    total = &clients[n_connections];
+    running = true;
+
+    double cpu_start = pid ? process_cpu_time(pid) : 0;
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < n_connections; i++)
+    {
+        clients[i].port = port;
+        clients[i].seed = i + 1;
+        pthread_create(&threads[i], NULL, client_main, &clients[i]);
+    }
+
+    sleep(duration);
+    running = false;
+
+    for (int i = 0; i < n_connections; i++)
+    {
+        pthread_join(threads[i], NULL);
+
+        total->n_queries += clients[i].n_queries;
+        total->n_errors += clients[i].n_errors;
+        total->latency_sum += clients[i].latency_sum;
+        total->latency_squares += clients[i].latency_squares;
+
+        for (int j = 0; j <= LATENCY_BUCKETS; j++)
+        {
+            total->latencies[j] += clients[i].latencies[j];
+        }
+    }
+
+    double seconds = (now_ns() - start) / 1000000000.0;
+    double cpu = pid ? process_cpu_time(pid) - cpu_start : 0;
+
+    result->name = name;
+    result->qps = total->n_queries / seconds;
+    result->qps_core = cpu > 0 ? total->n_queries / cpu : 0;
+    result->errors = total->n_errors;
+    result->n = total->n_queries;
+    result->mean = total->n_queries ? total->latency_sum / total->n_queries : 0;
+
+    double variance = total->n_queries > 1 ?
+                      (total->latency_squares - total->n_queries * result->mean * result->mean) /
+                      (total->n_queries - 1) : 0;
+    result->stddev = variance > 0 ? sqrt(variance) : 0;
+    result->p50 = percentile(total, 0.50);
+    result->p99 = percentile(total, 0.99);
+    result->p999 = percentile(total, 0.999);
+
+    free(threads);
+    free(clients);
+    return true;
+}
+
+/**
+ * MaxScale
+ */
+
+typedef struct
+{
+    const char *name;   /*< The name of the service */
+    const char *router; /*< The router of the service */
+    const char *extra;  /*< Extra parameters of the service */
+    int port;           /*< The port of the listener */
+} SERVICE_DEF;
+
+static SERVICE_DEF services[] =
+{
+    { "readconnroute",  "readconnroute",  "router_options=master\n", 100 },
+    { "readwritesplit", "readwritesplit", "max_slave_connections=100%\n", 101 },
+    { "schemarouter",   "schemarouter",   "", 102 },
+};
+
+#define N_SERVICES (sizeof(services) / sizeof(services[0]))
+
+static bool write_config(const char *path)
+{
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "[maxscale]\nthreads=%d\n", maxscale_threads);
+
+    if (libdir)
+    {
+        fprintf(file, "libdir=%s\n", libdir);
+    }
+
+    if (classifier)
+    {
+        fprintf(file, "query_classifier=%s\n", classifier);
+    }
+
+    fprintf(file, "\n");
+
+    for (int i = 0; i < n_servers; i++)
+    {
+        fprintf(file, "[server%d]\ntype=server\naddress=127.0.0.1\nport=%d\nprotocol=MySQLBackend\n\n",
+                i + 1, base_port + i);
+    }
+
+    fprintf(file, "[Monitor]\ntype=monitor\nmodule=mysqlmon\nuser=%s\npasswd=%s\n"
+            "monitor_interval=1000\nservers=", BENCH_USER, BENCH_USER);
+
+    for (int i = 0; i < n_servers; i++)
+    {
+        fprintf(file, "%sserver%d", i ? "," : "", i + 1);
+    }
+
+    fprintf(file, "\n\n");
+
+    if (filter_module)
+    {
+        fprintf(file, "[Filter]\ntype=filter\nmodule=%s\n\n", filter_module);
+    }
+
+    for (int i = 0; i < N_SERVICES; i++)
+    {
+        fprintf(file, "[%s]\ntype=service\nrouter=%s\nuser=%s\npasswd=%s\n%s%s",
+                services[i].name, services[i].router, BENCH_USER, BENCH_USER,
+                services[i].extra, filter_module ? "filters=Filter\n" : "");
+        fprintf(file, "servers=");
+
+        for (int j = 0; j < n_servers; j++)
+        {
+            fprintf(file, "%sserver%d", j ? "," : "", j + 1);
+        }
+
+        fprintf(file, "\n\n[%s Listener]\ntype=listener\nservice=%s\nprotocol=MySQLClient\n"
+                "address=127.0.0.1\nport=%d\n\n",
+                services[i].name, services[i].name, base_port + services[i].port);
+    }
+
+    fclose(file);
+    return true;
+}
+
+static pid_t start_maxscale(const char *dir)
+{
+    char config[PATH_MAX];
+    char log[PATH_MAX];
+    pid_t pid;
+
+    snprintf(config, sizeof(config), "%s/maxscale.cnf", dir);
+    snprintf(log, sizeof(log), "%s/maxscale.out", dir);
+
+    if (!write_config(config))
+    {
+        return -1;
+    }
+
+    if ((pid = fork()) == 0)
+    {
+        FILE *out = freopen(log, "w", stdout);
+
+        if (out)
+        {
+            dup2(fileno(out), STDERR_FILENO);
+        }
+
+        if (libdir)
+        {
+            execl(maxscale_path, maxscale_path, "-d", "-f", config, "-L", dir, "-D", dir,
+                  "-A", dir, "-P", dir, "-B", libdir, (char *)NULL);
+        }
+        else
+        {
+            execl(maxscale_path, maxscale_path, "-d", "-f", config, "-L", dir, "-D", dir,
+                  "-A", dir, "-P", dir, (char *)NULL);
+        }
+
+        fprintf(stderr, "Failed to run %s: %s\n", maxscale_path, strerror(errno));
+        _exit(1);
+    }
+
+    return pid;
+}
+
+/**
+ * Wait until every service answers both reads and writes, which means that
+ * MaxScale has started and that the monitor has found the master.
+ */
+static bool wait_for_maxscale(pid_t pid)
+{
+    uint8_t read_query[sizeof(BENCH_QUERY) + 4];
+    uint8_t write_query[sizeof(BENCH_WRITE) + 4];
+    size_t read_len = make_query(read_query, BENCH_QUERY);
+    size_t write_len = make_query(write_query, BENCH_WRITE);
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+    int ready = 0;
+
+    for (int t = 0; t < STARTUP_TIMEOUT * 10 && ready < N_SERVICES; t++)
+    {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            break;
+        }
+
+        usleep(100000);
+
+        for (ready = 0; ready < N_SERVICES; ready++)
+        {
+            int fd = client_connect(base_port + services[ready].port);
+            bool ok = fd >= 0 &&
+                      client_query(fd, read_query, read_len, &buf, &cap) == 1 &&
+                      client_query(fd, write_query, write_len, &buf, &cap) == 1;
+
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+
+            if (!ok)
+            {
+                break;
+            }
+        }
+    }
+
+    free(buf);
+    return ready == N_SERVICES;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-m maxscale] [-B libdir] [-F filter] [-q classifier] [-t threads]\n"
+            "       [-n servers] [-p port] [-c connections] [-d seconds] [-r rows] [-w percent]\n"
+            "       [-k] [-j file]\n"
+            "\n"
+            "-m  The MaxScale binary, without it only the mock servers are measured\n"
+            "-B  The directory of the MaxScale modules\n"
+            "-F  A filter module that needs no parameters to put in front of each router\n"
+            "-q  The query classifier of MaxScale, default that of MaxScale\n"
+            "-t  The number of MaxScale threads, default 4\n"
+            "-n  The number of mock servers, default 4\n"
+            "-p  The port of the first mock server, default 4100. The listeners of the\n"
+            "    services are at the port + 100, + 101 and + 102\n"
+            "-c  The number of connections, each with a client thread, default 16\n"
+            "-d  The duration of each run in seconds, default 10\n"
+            "-r  The number of rows the mock servers return to a SELECT, default 1\n"
+            "-w  The percentage of writes in the load, default 0\n"
+            "-k  Keep the configuration and the logs of MaxScale\n"
+            "-j  Write the latencies to a file as JSON, see perfcompare\n"
+            "\n"
+            "The latencies are in microseconds. The added latency is that of the\n"
+            "direct connection subtracted from that through the service.\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    RESULT results[N_SERVICES + 1];
+    int n_results = 0;
+    const char *json = NULL;
+    int rc = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "m:B:F:q:t:n:p:c:d:r:w:kj:")) != -1)
+    {
+        switch (c)
+        {
+        case 'm':
+            maxscale_path = optarg;
+            break;
+
+        case 'B':
+            libdir = optarg;
+            break;
+
+        case 'F':
+            filter_module = optarg;
+            break;
+
+        case 'q':
+            classifier = optarg;
+            break;
+
+        case 't':
+            maxscale_threads = atoi(optarg);
+            break;
+
+        case 'n':
+            n_servers = atoi(optarg);
+            break;
+
+        case 'p':
+            base_port = atoi(optarg);
+            break;
+
+        case 'c':
+            n_connections = atoi(optarg);
+            break;
+
+        case 'd':
+            duration = atoi(optarg);
+            break;
+
+        case 'r':
+            n_rows = atoi(optarg);
+            break;
+
+        case 'w':
+            write_percent = atoi(optarg);
+            break;
+
+        case 'k':
+            keep_files = true;
+            break;
+
+        case 'j':
+            json = optarg;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (maxscale_threads <= 0 || n_servers < 2 || n_servers > 100 || base_port <= 0 ||
+        n_connections <= 0 || duration <= 0 || n_rows < 0 || write_percent < 0 || write_percent > 100)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!start_mock_servers())
+    {
+        return 1;
+    }
+
+    if (!run_load("direct", base_port, 0, &results[n_results]))
+    {
+        return 1;
+    }
+
+    n_results++;
+
+    if (maxscale_path)
+    {
+        char dir[] = "/tmp/benchmark_proxy.XXXXXX";
+        pid_t pid;
+
+        if (mkdtemp(dir) == NULL || (pid = start_maxscale(dir)) < 0)
+        {
+            fprintf(stderr, "Failed to start MaxScale: %s\n", strerror(errno));
+            return 1;
+        }
+
+        if (wait_for_maxscale(pid))
+        {
+            for (int i = 0; i < N_SERVICES; i++)
+            {
+                if (run_load(services[i].name, base_port + services[i].port, pid, &results[n_results]))
+                {
+                    n_results++;
+                }
+            }
+        }
+        else
+        {
+            fprintf(stderr, "MaxScale did not become ready, see the log in %s\n", dir);
+            keep_files = true;
+            rc = 1;
+        }
+
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+
+        if (keep_files)
+        {
+            printf("The configuration and the logs of MaxScale are in %s\n", dir);
+        }
+        else
+        {
+            char command[PATH_MAX + 16];
+            snprintf(command, sizeof(command), "rm -rf %s", dir);
+
+            if (system(command) != 0)
+            {
+                fprintf(stderr, "Failed to remove %s\n", dir);
+            }
+        }
+    }
+
+    printf("Connections %d, rows %d, writes %d%%, MaxScale threads %d%s%s\n\n",
+           n_connections, n_rows, write_percent, maxscale_threads,
+           filter_module ? ", filter " : "", filter_module ? filter_module : "");
+    printf("%-16s %10s %10s %8s %8s %8s %8s %8s %8s %8s\n", "Configuration", "qps", "qps/core",
+           "p50", "p99", "p99.9", "+p50", "+p99", "+p99.9", "errors");
+
+    for (int i = 0; i < n_results; i++)
+    {
+        RESULT *r = &results[i];
+
+        printf("%-16s %10.0f %10.0f %8d %8d %8d %8d %8d %8d %8lu\n", r->name, r->qps, r->qps_core,
+               r->p50, r->p99, r->p999, r->p50 - results[0].p50, r->p99 - results[0].p99,
+               r->p999 - results[0].p999, r->errors);
+    }
+
+    if (json)
+    {
+        FILE *file = fopen(json, "w");
+
+        if (file == NULL)
+        {
+            fprintf(stderr, "Failed to open %s\n", json);
+            return 1;
+        }
+
+        fprintf(file, "{ \"benchmark\": \"proxy\", \"results\": [");
+
+        for (int i = 0; i < n_results; i++)
+        {
+            fprintf(file, "%s\n    { \"name\": \"%s/latency\", \"unit\": \"ns\", \"n\": %lu, "
+                    "\"mean\": %.2f, \"stddev\": %.2f }", i ? "," : "", results[i].name,
+                    results[i].n, results[i].mean, results[i].stddev);
+        }
+
+        fprintf(file, "\n] }\n");
+        fclose(file);
+    }
+
+    return rc;
+}
@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * Compares the results the benchmarks wrote with their -j option to stored
+ * baselines. This is what the perfcheck target runs after the benchmarks.
+ *
+ * A result is a regression when its mean time has grown by more than the
+ * tolerance and the growth is statistically significant according to Welch's
+ * t-test at the 0.1% level. Requiring both keeps the noise of a single run
+ * from failing the check while small but real slowdowns still accumulate to
+ * a failure over a couple of changes, if the baselines are not updated.
+ *
+ * The results are JSON objects of the form
+ *
+ * @code
+ * { "benchmark": "buffer", "results": [
+ *   { "name": "clone/query", "unit": "ns", "n": 1000, "mean": 51.2, "stddev": 3.1 },
+ *   ...
+ * ] }
+ * @endcode
+ *
+ * and only that form is understood.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * A measurement, the summary of the samples of one operation
+ */
+typedef struct
+{
+    char name[128]; /*< The name of the operation */
+    char unit[16];  /*< The unit of the samples */
+    double n;       /*< The number of samples */
+    double mean;    /*< The mean of the samples */
+    double stddev;  /*< The standard deviation of the samples */
+} RESULT;
+
+typedef struct
+{
+    RESULT *results; /*< The results */
+    int n_results;   /*< The number of results */
+} RESULTS;
+
+/**
+ * The one-sided critical values of Student's t distribution at the 0.1% level
+ * for 1 to 30 degrees of freedom. Above that the normal distribution is used.
+ */
+static const double T_CRITICAL[] =
+{
+    318.31, 22.327, 10.215, 7.173, 5.893, 5.208, 4.785, 4.501, 4.297, 4.144,
+    4.025, 3.930, 3.852, 3.787, 3.733, 3.686, 3.646, 3.610, 3.579, 3.552,
+    3.527, 3.505, 3.485, 3.467, 3.450, 3.435, 3.421, 3.408, 3.396, 3.385
+};
+
+#define T_CRITICAL_NORMAL 3.090
+
+static char *read_file(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char *data = NULL;
+    long len;
+
+    if (file)
+    {
+        if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) >= 0 &&
+            fseek(file, 0, SEEK_SET) == 0 && (data = malloc(len + 1)))
+        {
+            if (fread(data, 1, len, file) == (size_t)len)
+            {
+                data[len] = '\0';
+            }
+            else
+            {
+                free(data);
+                data = NULL;
+            }
+        }
+
+        fclose(file);
+    }
+
+    return data;
+}
+
+/**
+ * Find the value of a key in an object
+ *
+ * @param start The start of the object
+ * @param end   The end of the object
+ * @param key   The key
+ * @return The start of the value or NULL if the key is not in the object
+ */
+static const char *find_value(const char *start, const char *end, const char *key)
+{
+    size_t len = strlen(key);
+
+    for (const char *p = start; p + len + 2 < end; p++)
+    {
+        if (*p == '"' && strncmp(p + 1, key, len) == 0 && p[len + 1] == '"')
+        {
+            p += len + 2;
+
+            while (p < end && (*p == ' ' || *p == ':'))
+            {
+                p++;
+            }
+
+            return p < end ? p : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static bool get_string(const char *start, const char *end, const char *key, char *dest, size_t size)
+{
+    const char *value = find_value(start, end, key);
+    const char *close;
+
+    if (value == NULL || *value != '"' || (close = memchr(value + 1, '"', end - value - 1)) == NULL ||
+        (size_t)(close - value - 1) >= size)
+    {
+        return false;
+    }
+
+    memcpy(dest, value + 1, close - value - 1);
+    dest[close - value - 1] = '\0';
+    return true;
+}
+
+static bool get_number(const char *start, const char *end, const char *key, double *dest)
+{
+    const char *value = find_value(start, end, key);
+    char *number_end;
+
+    if (value == NULL)
+    {
+        return false;
+    }
+
+    *dest = strtod(value, &number_end);
+    return number_end != value;
+}
+
+/**
+ * Read the results of a benchmark
+ *
+ * @param path    The file
+ * @param results The results that were read
+ * @return True if the file was read, false if it does not exist or is malformed
+ */
+static bool read_results(const char *path, RESULTS *results)
+{
+    char *data = read_file(path);
+    const char *p;
+
+    results->results = NULL;
+    results->n_results = 0;
+
+    if (data == NULL)
+    {
+        fprintf(stderr, "error: Failed to read %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    bool ok = (p = strstr(data, "\"results\"")) != NULL;
+
+    while (ok && (p = strchr(p, '{')) != NULL)
+    {
+        const char *end = strchr(p, '}');
+        RESULT *result;
+
+        if (end == NULL ||
+            (result = realloc(results->results, (results->n_results + 1) * sizeof(RESULT))) == NULL)
+        {
+            ok = false;
+            break;
+        }
+
+        results->results = result;
+        result += results->n_results;
+
+        if (get_string(p, end, "name", result->name, sizeof(result->name)) &&
+            get_string(p, end, "unit", result->unit, sizeof(result->unit)) &&
+            get_number(p, end, "n", &result->n) &&
+            get_number(p, end, "mean", &result->mean) &&
+            get_number(p, end, "stddev", &result->stddev))
+        {
+            results->n_results++;
+        }
+        else
+        {
+            ok = false;
+        }
+
+        p = end;
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "error: %s is not a result file of a benchmark\n", path);
+    }
+
+    free(data);
+    return ok;
+}
+
+static const RESULT *find_result(const RESULTS *results, const char *name)
+{
+    for (int i = 0; i < results->n_results; i++)
+    {
+        if (strcmp(results->results[i].name, name) == 0)
+        {
+            return &results->results[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Check whether a result is a significant regression of the baseline
+ *
+ * @param base      The baseline
+ * @param result    The result
+ * @param tolerance The growth of the mean that is tolerated, in percent
+ * @param t         The t statistic of the difference of the means
+ * @return True if the result is a regression
+ */
+static bool is_regression(const RESULT *base, const RESULT *result, double tolerance, double *t)
+{
+    double v0 = base->n > 0 ? base->stddev * base->stddev / base->n : 0;
+    double v1 = result->n > 0 ? result->stddev * result->stddev / result->n : 0;
+    double diff = result->mean - base->mean;
+    double critical = T_CRITICAL_NORMAL;
+
+    if (v0 + v1 > 0)
+    {
+        /** The Welch-Satterthwaite approximation of the degrees of freedom */
+        double df = (v0 + v1) * (v0 + v1) /
+                    ((base->n > 1 ? v0 * v0 / (base->n - 1) : 0) +
+                     (result->n > 1 ? v1 * v1 / (result->n - 1) : 0));
+        int i = df <= 30 ? (int)df : 31;
+
+        *t = diff / sqrt(v0 + v1);
+
+        if (i >= 1 && i <= (int)(sizeof(T_CRITICAL) / sizeof(T_CRITICAL[0])))
+        {
+            critical = T_CRITICAL[i - 1];
+        }
+    }
+    else
+    {
+        *t = diff > 0 ? INFINITY : 0;
+    }
+
+    return diff > base->mean * tolerance / 100 && *t > critical;
+}
+
+/**
+ * Compare the results of a benchmark to its baseline
+ *
+ * @param baseline  The baseline file
+ * @param current   The result file
+ * @param tolerance The tolerance in percent
+ * @return True if there were no regressions
+ */
+static bool compare(const char *baseline, const char *current, double tolerance)
+{
+    RESULTS base;
+    RESULTS results;
+    bool ok = true;
+
+    if (!read_results(current, &results))
+    {
+        return false;
+    }
+
+    if (access(baseline, F_OK) != 0)
+    {
+        printf("%s: no baseline, run the perfcheck-baseline target to store one\n", current);
+        free(results.results);
+        return true;
+    }
+
+    if (!read_results(baseline, &base))
+    {
+        free(results.results);
+        return false;
+    }
+
+    for (int i = 0; i < results.n_results; i++)
+    {
+        const RESULT *result = &results.results[i];
+        const RESULT *old = find_result(&base, result->name);
+        double t;
+
+        if (old == NULL)
+        {
+            printf("%-40s %12.1f %-4s (new)\n", result->name, result->mean, result->unit);
+        }
+        else if (is_regression(old, result, tolerance, &t))
+        {
+            printf("%-40s %12.1f %-4s was %.1f, %+.1f%%, t = %.1f: REGRESSION\n",
+                   result->name, result->mean, result->unit, old->mean,
+                   100 * (result->mean - old->mean) / old->mean, t);
+            ok = false;
+        }
+        else
+        {
+            printf("%-40s %12.1f %-4s was %.1f, %+.1f%%\n",
+                   result->name, result->mean, result->unit, old->mean,
+                   old->mean ? 100 * (result->mean - old->mean) / old->mean : 0.0);
+        }
+    }
+
+    free(base.results);
+    free(results.results);
+    return ok;
+}
+
+static bool copy_file(const char *from, const char *to)
+{
+    char *data = read_file(from);
+    FILE *file;
+    bool ok = false;
+
+    if (data && (file = fopen(to, "w")))
+    {
+        ok = fputs(data, file) >= 0;
+        ok = fclose(file) == 0 && ok;
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "error: Failed to copy %s to %s: %s\n", from, to, strerror(errno));
+    }
+
+    free(data);
+    return ok;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-p percent] [-u] baselines results benchmark...\n"
+            "\n"
+            "-p  The growth of the mean time that is tolerated, in percent, default 5\n"
+            "-u  Store the results as the new baselines instead of comparing them\n"
+            "\n"
+            "The results of each benchmark are read from <results>/<benchmark>.json and\n"
+            "the baseline from <baselines>/<benchmark>.json. A benchmark without a\n"
+            "baseline is not compared. The exit code is 1 if there were regressions.\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    double tolerance = 5;
+    bool update = false;
+    bool ok = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:u")) != -1)
+    {
+        switch (c)
+        {
+        case 'p':
+            tolerance = atof(optarg);
+            break;
+
+        case 'u':
+            update = true;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind < 3 || tolerance < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int i = optind + 2; i < argc; i++)
+    {
+        char baseline[PATH_MAX];
+        char current[PATH_MAX];
+
+        snprintf(baseline, sizeof(baseline), "%s/%s.json", argv[optind], argv[i]);
+        snprintf(current, sizeof(current), "%s/%s.json", argv[optind + 1], argv[i]);
+
+        if (update)
+        {
+            RESULTS results;
+
+            if (read_results(current, &results) && copy_file(current, baseline))
+            {
+                printf("Stored %s\n", baseline);
+            }
+            else
+            {
+                ok = false;
+            }
+
+            free(results.results);
+        }
+        else
+        {
+            printf("%s:\n", argv[i]);
+            ok = compare(baseline, current, tolerance) && ok;
+            printf("\n");
+        }
+    }
+
+    return ok ? 0 : 1;
+}
@@ -20,6 +20,7 @@
  * 14/02/2014   Massimiliano Pinto  Initial implementation
  * 17/02/2014   Massimiliano Pinto  Added check ipv4
  * 03/10/2014   Massimiliano Pinto  Added check for wildcard hosts
+ * 14/10/2016   MariaDB Corporation Added check for the lookup index
  *
  * @endverbatim
  */
@@ -308,6 +309,61 @@ int set_and_get_mysql_users_wildcards(char *username, char *hostname, char *pass
     return ret;
 }
 
+/**
+ * Find a user from a table with several hosts for it, before and after
+ * more users are added to the table
+ *
+ * @return 0 if the right hosts were found
+ */
+int find_mysql_users_index()
+{
+    USERS *mysql_users = mysql_users_alloc();
+    MYSQL_USER_HOST key;
+    char *auth;
+    int ret = 0;
+
+    if (mysql_users == NULL)
+    {
+        return 1;
+    }
+
+    add_mysql_users_with_host_ipv4(mysql_users, "pippo", "%", "any", "Y", "");
+    add_mysql_users_with_host_ipv4(mysql_users, "pippo", "192.168.%.%", "classb", "Y", "");
+    add_mysql_users_with_host_ipv4(mysql_users, "pippo", "192.168.2.2", "exact", "Y", "");
+
+    memset(&key, 0, sizeof(key));
+    key.user = "pippo";
+    key.netmask = 32;
+    key.resource = "";
+    setipaddress(&key.ipv4.sin_addr, "192.168.2.2");
+    strcpy(key.hostname, "192.168.2.2");
+
+    auth = mysql_users_find(mysql_users, &key, false);
+    ret |= auth == NULL || strcmp(auth, "exact") != 0;
+
+    setipaddress(&key.ipv4.sin_addr, "192.168.5.2");
+    strcpy(key.hostname, "192.168.5.2");
+    auth = mysql_users_find(mysql_users, &key, false);
+    ret |= auth == NULL || strcmp(auth, "classb") != 0;
+
+    /** The index is built again after an addition */
+    add_mysql_users_with_host_ipv4(mysql_users, "pippo", "192.168.5.%", "classc", "Y", "");
+    auth = mysql_users_find(mysql_users, &key, false);
+    ret |= auth == NULL || strcmp(auth, "classc") != 0;
+
+    setipaddress(&key.ipv4.sin_addr, "10.0.0.1");
+    strcpy(key.hostname, "10.0.0.1");
+    auth = mysql_users_find(mysql_users, &key, false);
+    ret |= auth == NULL || strcmp(auth, "any") != 0;
+
+    key.user = "riccio";
+    ret |= mysql_users_find(mysql_users, &key, false) != NULL;
+
+    users_free(mysql_users);
+
+    return ret;
+}
+
 int main()
 {
     int ret;
@@ -521,6 +577,23 @@ int main()
     }
     assert(ret == 0);
 
+    ret = set_and_get_mysql_users_wildcards("pippo", "192.168.2._", "foo", "192.168.2.2", NULL, NULL, NULL);
+    if (!ret)
+    {
+        fprintf(stderr, "\t-- Expecting ok\n");
+    }
+    assert(ret == 0);
+
+    ret = set_and_get_mysql_users_wildcards("pippo", "192.168.3._", "foo", "192.168.2.2", NULL, NULL, NULL);
+    if (ret)
+    {
+        fprintf(stderr, "\t-- Expecting no match\n");
+    }
+    assert(ret == 1);
+
+    ret = find_mysql_users_index();
+    assert(ret == 0);
+
     ret = set_and_get_mysql_users_wildcards("riccio", "192.0.0.%", "foo", "192.134.0.2", NULL, NULL, NULL);
     if (ret)
     {
@@ -0,0 +1,69 @@
+#ifndef TEST_SESSIONS_H
+#define TEST_SESSIONS_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file test_sessions.h  - Sessions of users for the tests of the core
+ *
+ * The sessions are not created through the session API. Their client DCBs
+ * are not polled, so nothing is ever written to the clients.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/2016   MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <string.h>
+#include <session.h>
+#include <service.h>
+#include <dcb.h>
+#include <usage.h>
+
+#define N_SESSIONS 4
+
+static DCB dcbs[N_SESSIONS];
+static SESSION sessions[N_SESSIONS];
+
+/**
+ * Set up the sessions of users of a service. A session whose user is NULL
+ * is not authenticated yet.
+ *
+ * @param service The service of the sessions
+ * @param users   The user of each session
+ */
+static void
+init_test_sessions(SERVICE *service, const char **users)
+{
+    memset(dcbs, 0, sizeof(dcbs));
+    memset(sessions, 0, sizeof(sessions));
+
+    for (int i = 0; i < N_SESSIONS; i++)
+    {
+        dcbs[i].state = DCB_STATE_ALLOC;
+        dcbs[i].user = (char *)users[i];
+        sessions[i].ses_chk_top = CHK_NUM_SESSION;
+        sessions[i].ses_chk_tail = CHK_NUM_SESSION;
+        sessions[i].state = SESSION_STATE_ROUTER_READY;
+        sessions[i].service = service;
+        sessions[i].client_dcb = &dcbs[i];
+        sessions[i].refcount = 1;
+        sessions[i].usage_key = USAGE_KEY_UNKNOWN;
+    }
+}
+
+#endif
@@ -318,6 +318,75 @@ void test_consume()
  * test1    Allocate a buffer and do lots of things
  *
  */
+void test_pool()
+{
+    GWBUF_POOL_STATS before, after;
+    gwbuf_get_pool_stats(&before);
+
+    GWBUF* buffer = gwbuf_alloc(200);
+    ss_info_dassert(buffer, "Buffer should be allocated");
+    unsigned char* data = GWBUF_DATA(buffer);
+    memset(data, 0xab, 200);
+    GWBUF* clone = gwbuf_clone(buffer);
+    ss_info_dassert(clone && GWBUF_DATA(clone) == data, "Clone should share the data");
+    gwbuf_free(buffer);
+    ss_info_dassert(*((unsigned char*)GWBUF_DATA(clone) + 199) == 0xab,
+                    "Data should remain valid while a clone exists");
+    gwbuf_free(clone);
+
+    /** The freed buffer should be reused from the pool */
+    buffer = gwbuf_alloc(150);
+    ss_info_dassert(buffer, "Buffer should be allocated");
+    gwbuf_get_pool_stats(&after);
+#if !defined(GWBUF_NO_POOL)
+    ss_info_dassert(GWBUF_DATA(buffer) == data, "Shared buffer of the same size class should be reused");
+    ss_info_dassert(after.alloc_pooled > before.alloc_pooled, "Pooled allocations should increase");
+#endif
+    gwbuf_free(buffer);
+
+    /** Buffers larger than the largest size class are not pooled */
+    buffer = gwbuf_alloc(100000);
+    ss_info_dassert(buffer && buffer->sbuf->size_class == -1, "Large buffer should not be pooled");
+    gwbuf_free(buffer);
+}
+
+static int external_released = 0;
+
+static void release_external(void *arg)
+{
+    external_released += *(int*)arg;
+}
+
+void test_external()
+{
+    static const char data[] = "0123456789";
+    int one = 1;
+
+    GWBUF* buffer = gwbuf_alloc_external(10, (void*)data, release_external, &one);
+    ss_info_dassert(buffer, "Buffer should be allocated");
+    ss_info_dassert(GWBUF_DATA(buffer) == data, "Buffer should refer to the data");
+    ss_info_dassert(buffer->sbuf->size_class == GWBUF_EXTERNAL_DATA, "Buffer should be external");
+
+    int fd;
+    off_t offset;
+    ss_info_dassert(!gwbuf_get_file_range(buffer, &fd, &offset), "Buffer should not have a file");
+    ss_info_dassert(gwbuf_set_file(buffer, 5, 100), "File should be set");
+
+    GWBUF* clone = gwbuf_clone(buffer);
+    buffer = gwbuf_consume(buffer, 4);
+    ss_info_dassert(*((char*)GWBUF_DATA(buffer)) == '4', "First byte should be 4");
+    ss_info_dassert(gwbuf_get_file_range(buffer, &fd, &offset) && fd == 5 && offset == 104,
+                    "File offset should follow the consumed data");
+    gwbuf_free(buffer);
+    ss_info_dassert(external_released == 0, "Data should not be released while a clone exists");
+    gwbuf_free(clone);
+    ss_info_dassert(external_released == 1, "Data should be released once");
+
+    buffer = gwbuf_alloc(10);
+    ss_info_dassert(!gwbuf_set_file(buffer, 5, 0), "File can only be set for external buffers");
+    gwbuf_free(buffer);
+}
+
 static int
 test1()
 {
@@ -441,6 +510,8 @@ test1()
     test_split();
     test_load_and_copy();
     test_consume();
+    test_pool();
+    test_external();
 
     return 0;
 }
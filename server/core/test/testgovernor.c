@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/2016   MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <governor.h>
+#include <skygw_debug.h>
+#include <mysql_client_server_protocol.h>
+#include "test_sessions.h"
+
+/** The client DCBs of the sessions are not polled, so a query that gets a
+ * slot is freed and its slot released at once */
+static SERVICE service;
+
+/**
+ * Allocate a packet of ten bytes with a command
+ */
+static GWBUF *
+alloc_command(uint8_t command)
+{
+    GWBUF *buf = gwbuf_alloc(10);
+    uint8_t *data = GWBUF_DATA(buf);
+
+    memset(data, 0, 10);
+    data[0] = 6;
+    data[MYSQL_HEADER_LEN] = command;
+    return buf;
+}
+
+static GWBUF *
+alloc_query()
+{
+    return alloc_command(MYSQL_COM_QUERY);
+}
+
+/**
+ * test1    Admitting, queueing and rejecting queries with a service limit
+ */
+static int
+test1()
+{
+    const char *users[N_SESSIONS] = {"bob", "bob", "admin", "alice"};
+    GOVERNOR *governor = governor_alloc(1, 0, 2, "root, admin");
+
+    ss_info_dassert(governor, "The governor should be allocated");
+    service.governor = governor;
+    init_test_sessions(&service, users);
+
+    ss_info_dassert(governor_admit(&sessions[0], alloc_query(), NULL) == GOVERNOR_ADMIT,
+                    "The first query should get a slot");
+    ss_info_dassert(governor_admit(&sessions[0], alloc_query(), NULL) == GOVERNOR_ADMIT,
+                    "A session with a slot should route its queries");
+    ss_info_dassert(governor_admit(&sessions[1], alloc_query(), gwbuf_alloc(5)) == GOVERNOR_QUEUE,
+                    "A query without a slot should be queued");
+    ss_info_dassert(gwbuf_length(sessions[1].gov_queued) == 15,
+                    "The rest of the read data should be queued with the query");
+    ss_info_dassert(governor_admit(&sessions[1], alloc_query(), NULL) == GOVERNOR_QUEUE,
+                    "The queries of a waiting session should be queued");
+    ss_info_dassert(governor_admit(&sessions[2], alloc_query(), NULL) == GOVERNOR_QUEUE,
+                    "A query of a high priority user should be queued");
+    ss_info_dassert(governor->high_head == &sessions[2] && governor->normal_head == &sessions[1],
+                    "The high priority user should be queued apart");
+    ss_info_dassert(governor_admit(&sessions[3], alloc_query(), NULL) == GOVERNOR_REJECT,
+                    "A query should be rejected when the queue is full");
+    ss_info_dassert(governor->n_queued == 2 && governor->n_rejected == 1,
+                    "The counters should be updated");
+
+    governor_query_done(&sessions[0]);
+
+    for (int i = 0; i < N_SESSIONS; i++)
+    {
+        ss_info_dassert(sessions[i].gov_state == GOVERNOR_IDLE && sessions[i].gov_queued == NULL,
+                        "The waiting sessions should have got their slots after each other");
+        ss_info_dassert(sessions[i].refcount == 1, "The references should be released");
+    }
+
+    ss_info_dassert(governor->n_active == 0 && governor->n_queued == 0 &&
+                    governor->high_head == NULL && governor->normal_head == NULL,
+                    "The governor should be empty");
+
+    service.governor = NULL;
+    governor_free(governor);
+    return 0;
+}
+
+/**
+ * test2    Per user limits and closing sessions
+ */
+static int
+test2()
+{
+    const char *users[N_SESSIONS] = {"bob", "bob", "alice", "bob"};
+    GOVERNOR *governor = governor_alloc(0, 1, 10, NULL);
+
+    service.governor = governor;
+    init_test_sessions(&service, users);
+
+    ss_info_dassert(governor_admit(&sessions[0], alloc_query(), NULL) == GOVERNOR_ADMIT,
+                    "The first query of a user should get a slot");
+    ss_info_dassert(governor_admit(&sessions[1], alloc_query(), NULL) == GOVERNOR_QUEUE,
+                    "The second query of a user should wait");
+    ss_info_dassert(governor_admit(&sessions[2], alloc_query(), NULL) == GOVERNOR_ADMIT,
+                    "The query of another user should get a slot");
+    ss_info_dassert(governor_admit(&sessions[3], alloc_query(), NULL) == GOVERNOR_QUEUE,
+                    "The third query of a user should wait");
+
+    governor_session_close(&sessions[1]);
+    ss_info_dassert(governor->n_queued == 1 && governor->normal_head == &sessions[3],
+                    "A closed session should leave the queue");
+
+    governor_session_close(&sessions[2]);
+    ss_info_dassert(governor->n_active == 1 && governor->n_queued == 1,
+                    "A slot of another user should not be given to a waiting session");
+
+    governor_session_close(&sessions[0]);
+    ss_info_dassert(governor->n_active == 0 && governor->n_queued == 0,
+                    "The slot of the user should be given to the waiting session");
+
+    service.governor = NULL;
+    governor_free(governor);
+    return 0;
+}
+
+/**
+ * test3    Commands that get no reply
+ */
+static int
+test3()
+{
+    const char *users[N_SESSIONS] = {"bob", "bob", "bob", "bob"};
+    uint8_t commands[] = {MYSQL_COM_QUIT, MYSQL_COM_STMT_CLOSE, MYSQL_COM_STMT_SEND_LONG_DATA};
+    GOVERNOR *governor = governor_alloc(1, 0, 10, NULL);
+
+    service.governor = governor;
+    init_test_sessions(&service, users);
+
+    for (int i = 0; i < sizeof(commands); i++)
+    {
+        GWBUF *command = alloc_command(commands[i]);
+
+        ss_info_dassert(governor_admit(&sessions[i], command, NULL) == GOVERNOR_ADMIT,
+                        "A command without a reply should be routed");
+        ss_info_dassert(sessions[i].gov_state == GOVERNOR_IDLE && governor->n_active == 0,
+                        "A command without a reply should not take a slot");
+        gwbuf_free(command);
+    }
+
+    ss_info_dassert(governor_admit(&sessions[3], alloc_query(), NULL) == GOVERNOR_ADMIT &&
+                    governor_admit(&sessions[0], alloc_query(), NULL) == GOVERNOR_QUEUE,
+                    "A query should wait for the slot");
+    ss_info_dassert(governor_admit(&sessions[0], alloc_command(MYSQL_COM_QUIT), NULL) == GOVERNOR_QUEUE,
+                    "A command of a waiting session should be queued after its queries");
+
+    governor_session_close(&sessions[3]);
+    ss_info_dassert(governor->n_active == 0 && governor->n_queued == 0,
+                    "The governor should be empty");
+
+    service.governor = NULL;
+    governor_free(governor);
+    return 0;
+}
+
+/**
+ * test4    Replies that are generated without a backend
+ */
+static int
+test4()
+{
+    const char *users[N_SESSIONS] = {"bob", "bob", "bob", "bob"};
+    GOVERNOR *governor = governor_alloc(1, 0, 10, NULL);
+    GWBUF *query;
+
+    service.governor = governor;
+    init_test_sessions(&service, users);
+
+    query = alloc_query();
+    ss_info_dassert(governor_admit(&sessions[0], query, NULL) == GOVERNOR_ADMIT,
+                    "The query should get a slot");
+    ss_info_dassert(governor_admit(&sessions[1], alloc_query(), NULL) == GOVERNOR_QUEUE,
+                    "The second query should wait");
+
+    governor_backend_write(&sessions[0], query);
+    governor_client_write(&sessions[0]);
+    ss_info_dassert(sessions[0].gov_state == GOVERNOR_ACTIVE && governor->n_queued == 1,
+                    "A part of a reply from a backend should not release the slot");
+
+    governor_query_done(&sessions[0]);
+    ss_info_dassert(governor->n_active == 0 && governor->n_queued == 0,
+                    "The complete reply from the backend should release the slot");
+
+    ss_info_dassert(governor_admit(&sessions[0], query, NULL) == GOVERNOR_ADMIT,
+                    "The query should get a slot");
+    ss_info_dassert(governor_admit(&sessions[2], alloc_query(), NULL) == GOVERNOR_QUEUE,
+                    "The second query should wait");
+
+    governor_client_write(&sessions[0]);
+    ss_info_dassert(sessions[0].gov_state == GOVERNOR_IDLE && governor->n_active == 0 &&
+                    governor->n_queued == 0,
+                    "A reply written to the client without a backend should release the slot");
+
+    gwbuf_free(query);
+    service.governor = NULL;
+    governor_free(governor);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+    result += test3();
+    result += test4();
+
+    exit(result);
+}
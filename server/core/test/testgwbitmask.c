@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <gwbitmask.h>
 
@@ -75,11 +76,43 @@ test1()
 
 }
 
+/**
+ * test2    Fixed size atomic bitsets
+ */
+static int
+test2()
+{
+    GWBITSET set;
+
+    ss_dfprintf(stderr, "testgwbitmask : Initialise a bitset");
+    ss_info_dassert(bitset_init(&set, 600), "Bitset should be initialised.");
+    ss_info_dassert(((uintptr_t)set.bits % (BITSET_LINE_BITS / 8)) == 0,
+                    "Bits should start at a cache line.");
+    ss_info_dassert(set.n_words == 2 * BITSET_LINE_BITS / 64, "Bits should fill whole cache lines.");
+    ss_info_dassert(bitset_isallclear(&set), "Should be all clear");
+    ss_dfprintf(stderr, "\t..done\nSet and clear bits.");
+    ss_info_dassert(!bitset_set(&set, 0) && !bitset_set(&set, 599) && bitset_set(&set, 599),
+                    "Set should return the previous value.");
+    ss_info_dassert(bitset_isset(&set, 0) && bitset_isset(&set, 599) && !bitset_isset(&set, 1) &&
+                    !bitset_isset(&set, 600), "Only the set bits should be set.");
+    ss_info_dassert(bitset_count(&set) == 2 && !bitset_isallclear(&set), "Two bits should be set.");
+    ss_info_dassert(bitset_clear(&set, 0) && !bitset_clear(&set, 0) && bitset_clear(&set, 599),
+                    "Clear should return the previous value.");
+    ss_info_dassert(bitset_isallclear(&set), "Should be all clear");
+    ss_dfprintf(stderr, "\t..done\nFree the bitset.");
+    bitset_free(&set);
+    ss_info_dassert(0 == set.length, "Length should be zero after the bitset is freed.");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
+    result += test2();
 
     exit(result);
 }
@@ -40,22 +40,13 @@
 static void
 read_lock(HASHTABLE *table)
 {
-    spinlock_acquire(&table->spin);
-    while (table->writelock)
-    {
-        spinlock_release(&table->spin);
-        while (table->writelock)
-            ;
-        spinlock_acquire(&table->spin);
-    }
-    table->n_readers++;
-    spinlock_release(&table->spin);
+    rwlock_read_acquire(&table->rwlock);
 }
 
 static void
 read_unlock(HASHTABLE *table)
 {
-    atomic_add(&table->n_readers, -1);
+    rwlock_read_release(&table->rwlock);
 }
 
 static int hfun(void* key);
@@ -98,7 +89,8 @@ static double start;
  */
 static bool do_hashtest(
     int argelems,
-    int argsize)
+    int argsize,
+    bool read_mostly)
 {
     bool       succp = true;
     HASHTABLE* h;
@@ -118,7 +110,8 @@ static bool do_hashtest(
 
     val_arr = (int *)malloc(sizeof(void *)*argelems);
 
-    h = hashtable_alloc(argsize, hfun, cmpfun);
+    h = read_mostly ? hashtable_alloc_read_mostly(argsize, hfun, cmpfun) :
+        hashtable_alloc(argsize, hfun, cmpfun);
 
     ss_dfprintf(stderr, "\t..done\nAdd %d elements to hash table.", argelems);
 
@@ -147,6 +140,14 @@ static bool do_hashtest(
         ss_dfprintf(stderr, "\t..done\nOperation took %g", (double)clock() - start);
     }
 
+    ss_dfprintf(stderr, "\t..done\nValidate fetched values.");
+
+    for (i = 0; i < argelems; i++)
+    {
+        int *value = (int *)hashtable_fetch(h, (void *)&val_arr[i]);
+        ss_info_dassert(value && *value == i, "Fetched value should match the added value");
+    }
+
     ss_dfprintf(stderr, "\t..done\nValidate iterator.");
 
     HASHITERATOR *iterator = hashtable_iterator(h);
@@ -196,43 +197,51 @@ int main(void)
     int rc = 1;
     start = (double) clock();
 
-    if (!do_hashtest(0, 1))
+    if (!do_hashtest(0, 1, false))
+    {
+        goto return_rc;
+    }
+    if (!do_hashtest(10, 1, false))
+    {
+        goto return_rc;
+    }
+    if (!do_hashtest(1000, 10, false))
     {
         goto return_rc;
     }
-    if (!do_hashtest(10, 1))
+    if (!do_hashtest(10, 0, false))
     {
         goto return_rc;
     }
-    if (!do_hashtest(1000, 10))
+    if (!do_hashtest(10, -5, false))
     {
         goto return_rc;
     }
-    if (!do_hashtest(10, 0))
+    if (!do_hashtest(1500, 17, false))
     {
         goto return_rc;
     }
-    if (!do_hashtest(10, -5))
+    if (!do_hashtest(1, 1, false))
     {
         goto return_rc;
     }
-    if (!do_hashtest(1500, 17))
+    if (!do_hashtest(10000, 133, false))
     {
         goto return_rc;
     }
-    if (!do_hashtest(1, 1))
+    if (!do_hashtest(1000, 1000, false))
     {
         goto return_rc;
     }
-    if (!do_hashtest(10000, 133))
+    if (!do_hashtest(1000, 100000, false))
     {
         goto return_rc;
     }
-    if (!do_hashtest(1000, 1000))
+    if (!do_hashtest(10, 1, true))
     {
         goto return_rc;
     }
-    if (!do_hashtest(1000, 100000))
+    if (!do_hashtest(10000, 133, true))
     {
         goto return_rc;
     }
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/2016   MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <metrics.h>
+#include <skygw_debug.h>
+
+/**
+ * test1    Families, samples and escaping of labels
+ */
+static int
+test1()
+{
+    METRICS metrics;
+    char name[METRICS_LABEL_LEN];
+    char labels[METRICS_LABEL_LEN + 16];
+
+    metrics_init(&metrics);
+    metrics_family(&metrics, "test_total", METRICS_COUNTER, "A counter");
+    metrics_value(&metrics, "test_total", NULL, 3000000000LL);
+    snprintf(labels, sizeof(labels), "name=\"%s\"", metrics_escape("a\"b\\c\nd", name, sizeof(name)));
+    metrics_value(&metrics, "test_total", labels, 5);
+    metrics_printf(&metrics, "%c", '\0');
+
+    ss_info_dassert(!metrics.failed, "Rendering should succeed");
+    ss_info_dassert(strcmp(metrics.data,
+                           "# HELP test_total A counter\n"
+                           "# TYPE test_total counter\n"
+                           "test_total 3000000000\n"
+                           "test_total{name=\"a\\\"b\\\\c\\nd\"} 5\n") == 0,
+                    "Samples and labels should be in the text format");
+
+    metrics_escape("abcdef", name, 4);
+    ss_info_dassert(strcmp(name, "abc") == 0, "Long values should be truncated");
+
+    metrics_free(&metrics);
+    return 0;
+}
+
+/**
+ * test2    Growing the text and latency histograms
+ */
+static int
+test2()
+{
+    METRICS metrics;
+    TS_LATENCY_SNAPSHOT snapshot;
+
+    metrics_init(&metrics);
+
+    for (int i = 0; i < 10000; i++)
+    {
+        metrics_value(&metrics, "test_gauge", "a=\"b\"", i);
+    }
+
+    GWBUF *buf = metrics_to_gwbuf(&metrics);
+    ss_info_dassert(buf && gwbuf_length(buf) == metrics.len && metrics.len > 160000,
+                    "The text should grow to hold all samples");
+    gwbuf_free(buf);
+    metrics_free(&metrics);
+
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.count = 3;
+    snapshot.total = 1000 + 20 + 5;
+    snapshot.hist[5] = 1;           /*< 5 microseconds */
+    snapshot.hist[18] = 1;          /*< 20 microseconds */
+    snapshot.hist[63] = 1;          /*< 1000 microseconds */
+
+    metrics_init(&metrics);
+    metrics_latency(&metrics, "test_seconds", "s=\"x\"", &snapshot);
+    metrics_printf(&metrics, "%c", '\0');
+
+    ss_info_dassert(strstr(metrics.data, "test_seconds_bucket{s=\"x\",le=\"1.6e-05\"} 1\n"),
+                    "The first bucket should count the latencies below 16 microseconds");
+    ss_info_dassert(strstr(metrics.data, "test_seconds_bucket{s=\"x\",le=\"3.2e-05\"} 2\n"),
+                    "The buckets should be cumulative");
+    ss_info_dassert(strstr(metrics.data, "test_seconds_bucket{s=\"x\",le=\"0.001024\"} 3\n"),
+                    "A latency should be counted below the next power of two");
+    ss_info_dassert(strstr(metrics.data, "test_seconds_bucket{s=\"x\",le=\"+Inf\"} 3\n"),
+                    "The last bucket should count all latencies");
+    ss_info_dassert(strstr(metrics.data, "test_seconds_sum{s=\"x\"} 0.001025\n"),
+                    "The sum should be in seconds");
+    ss_info_dassert(strstr(metrics.data, "test_seconds_count{s=\"x\"} 3\n"),
+                    "The count should be the number of latencies");
+
+    metrics_free(&metrics);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+
+    exit(result);
+}
@@ -267,6 +267,14 @@ void test_strnchr_esc_mysql()
     char comment5[] = "This will fail/* . ";
     ss_info_dassert(strnchr_esc_mysql(comment5, '.', sizeof(comment5) - 1) == NULL, "Bad comment should fail");
 
+    /** Strings that are longer than the blocks that are scanned at once */
+    char long1[] = "SELECT a, b, c FROM long_table_name /* a very long comment; */ WHERE `a;b` = 'x;y'; SELECT 1";
+    ss_info_dassert(strnchr_esc_mysql(long1, ';', sizeof(long1) - 1) == strrchr(long1, ';'),
+                    "Character after long comments and quotes should be matched");
+
+    char long2[] = "SELECT 'a long quoted string that spans many blocks;' FROM t1 -- ; comment";
+    ss_info_dassert(strnchr_esc_mysql(long2, ';', sizeof(long2) - 1) == NULL,
+                    "Character in a long quoted string or a comment should return NULL");
 }
 
 void test_strnchr_esc()
@@ -290,6 +298,12 @@ void test_strnchr_esc()
     ss_info_dassert(strnchr_esc_mysql(esc1, '.', sizeof(esc1) - 1) == NULL,
                     "Only escaped character should return NULL");
 
+    char esc4[] = "A string that is longer than sixteen bytes\\. with an escaped dot.";
+    ss_info_dassert(strnchr_esc(esc4, '.', sizeof(esc4) - 1) == strrchr(esc4, '.'),
+                    "Escaped character in a long string should be ignored");
+    ss_info_dassert(strnchr_esc_mysql(esc4, '.', sizeof(esc4) - 1) == strrchr(esc4, '.'),
+                    "Escaped character in a long string should be ignored");
+
     /** Test escaped and quoted characters */
     char str1[] = "this \\. is a test.";
     ss_info_dassert(strnchr_esc(str1, '.', sizeof(str1) - 1) == strrchr(str1, '.'),
@@ -325,6 +339,85 @@ void test_strnchr_esc()
     ss_info_dassert(strnchr_esc_mysql(bad4, '.', sizeof(bad4) - 1) == NULL, "Different quote pairs should fail");
 }
 
+/**
+ * Split the test resultset into a chain of buffers of the given size
+ */
+static GWBUF* create_chain(size_t chunk, size_t len)
+{
+    GWBUF* head = NULL;
+
+    for (size_t total = 0; total < len; total += chunk)
+    {
+        size_t n = MIN(chunk, len - total);
+        head = gwbuf_append(head, gwbuf_alloc_and_load(n, resultset + total));
+    }
+
+    return head;
+}
+
+void test_packet_iterator()
+{
+    uint32_t lengths[] = {5, 38, 9, 9, 9};
+    int n_packets = sizeof(lengths) / sizeof(lengths[0]);
+
+    for (size_t chunk = 1; chunk <= sizeof(resultset); chunk++)
+    {
+        /** All packets, then all but the last byte */
+        for (int trim = 0; trim < 2; trim++)
+        {
+            GWBUF* head = create_chain(chunk, sizeof(resultset) - trim);
+            MODUTIL_PACKET_ITER iter;
+            MODUTIL_PACKET packet;
+            size_t offset = 0;
+            int n = 0;
+
+            modutil_packet_iter_init(&iter, head);
+
+            while (modutil_packet_next(&iter, &packet))
+            {
+                uint8_t data[sizeof(resultset)];
+                ss_info_dassert(n < n_packets, "Too many packets should not be found");
+                ss_info_dassert(packet.length == lengths[n], "Packet length should be correct");
+                ss_info_dassert(packet.seqno == n + 1, "Sequence number should be correct");
+                ss_info_dassert((packet.data != NULL) ==
+                                (offset / chunk == (offset + packet.length - 1) / chunk),
+                                "Packet in one buffer should be viewed in place");
+                ss_info_dassert(modutil_packet_copy(&packet, 0, sizeof(data), data) == packet.length,
+                                "The whole packet should be copied");
+                ss_info_dassert(memcmp(data, resultset + offset, packet.length) == 0,
+                                "Packet data should be OK");
+                offset += packet.length;
+                n++;
+            }
+
+            ss_info_dassert(n == n_packets - trim, "All complete packets should be found");
+            ss_info_dassert(iter.total == offset, "Total should be the length of the packets");
+            ss_info_dassert(!modutil_packet_next(&iter, &packet), "Iterator should stay at the end");
+            gwbuf_free(head);
+        }
+    }
+
+    /** Packets in the first buffer are split off without copying */
+    GWBUF* buffer = gwbuf_alloc_and_load(sizeof(resultset), resultset);
+    GWBUF* packet = modutil_get_next_MySQL_packet(&buffer);
+    ss_info_dassert(packet && buffer, "Both buffers should have data");
+    ss_info_dassert(packet->sbuf == buffer->sbuf, "The packet should share the data of the buffer");
+    ss_info_dassert(GWBUF_LENGTH(packet) == 5 && gwbuf_length(buffer) == sizeof(resultset) - 5,
+                    "The first packet should be split off");
+    gwbuf_free(packet);
+    gwbuf_free(buffer);
+
+    /** A packet spanning buffers is made contiguous */
+    buffer = create_chain(3, sizeof(resultset));
+    packet = modutil_get_next_MySQL_packet(&buffer);
+    ss_info_dassert(packet && packet->next == NULL && GWBUF_LENGTH(packet) == 5,
+                    "The packet should be in one buffer");
+    ss_info_dassert(memcmp(GWBUF_DATA(packet), resultset, 5) == 0, "Packet data should be OK");
+    ss_info_dassert(gwbuf_length(buffer) == sizeof(resultset) - 5, "The rest should be left");
+    gwbuf_free(packet);
+    gwbuf_free(buffer);
+}
+
 GWBUF* create_buffer(size_t size)
 {
     GWBUF* buffer = gwbuf_alloc(size + 4);
@@ -383,6 +476,45 @@ void test_large_packets()
     }
 }
 
+void test_sql_view()
+{
+    char query[] = "SELECT 1 FROM t1 WHERE a = 'b'";
+    const char *sql;
+    int length;
+
+    /** A contiguous statement is not copied */
+    GWBUF* buffer = modutil_create_query(query);
+    ss_info_dassert(modutil_get_SQL_view(buffer, &sql, &length), "Query should have SQL");
+    ss_info_dassert(sql == (char*)GWBUF_DATA(buffer) + 5, "SQL should point into the buffer");
+    ss_info_dassert(length == sizeof(query) - 1, "Length should be correct");
+
+    /** The copy is made once and dropped when the SQL is replaced */
+    const char *copy = modutil_get_SQL_cached(buffer);
+    ss_info_dassert(copy && strcmp(copy, query) == 0, "Copy should match the query");
+    ss_info_dassert(modutil_get_SQL_cached(buffer) == copy, "Copy should be reused");
+    ss_info_dassert(!GWBUF_IS_PARSED(buffer), "Copy should not mark the buffer parsed");
+
+    char newquery[] = "SELECT 2";
+    buffer = modutil_replace_SQL(buffer, newquery);
+    copy = modutil_get_SQL_cached(buffer);
+    ss_info_dassert(copy && strcmp(copy, newquery) == 0, "Copy should match the new query");
+
+    /** A split statement is read from the copy */
+    GWBUF* head = gwbuf_alloc_and_load(10, GWBUF_DATA(buffer));
+    buffer = gwbuf_consume(buffer, 10);
+    head = gwbuf_append(head, buffer);
+    ss_info_dassert(modutil_get_SQL_view(head, &sql, &length), "Split query should have SQL");
+    ss_info_dassert(length == sizeof(newquery) - 1 && memcmp(sql, newquery, length) == 0,
+                    "SQL of a split query should be correct");
+    gwbuf_free(head);
+
+    buffer = gwbuf_alloc(5);
+    memset(GWBUF_DATA(buffer), 0, 5);
+    ss_info_dassert(!modutil_get_SQL_view(buffer, &sql, &length), "COM_SLEEP should have no SQL");
+    ss_info_dassert(modutil_get_SQL_cached(buffer) == NULL, "COM_SLEEP should have no copy");
+    gwbuf_free(buffer);
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
@@ -394,5 +526,7 @@ int main(int argc, char **argv)
     test_strnchr_esc();
     test_strnchr_esc_mysql();
     test_large_packets();
+    test_packet_iterator();
+    test_sql_view();
     exit(result);
 }
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                 Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <mpmc_ring.h>
+#include <dlist.h>
+
+#define N_THREADS 4
+#define N_ITEMS   100000
+
+typedef struct
+{
+    int     value;
+    DLIST_NODE node;
+} ITEM;
+
+static MPMC_RING ring;
+static int64_t pushed_sum;
+static int64_t popped_sum;
+static int n_popped;
+
+/**
+ * test1    Elements come out in order and a full or an empty ring is detected
+ */
+static int
+test1()
+{
+    int value;
+
+    if (!mpmc_ring_init(&ring, 3, sizeof(int)))
+    {
+        fprintf(stderr, "mpmc_ring: test 1.1 failed, init.\n");
+        return 1;
+    }
+
+    for (int round = 0; round < 5; round++)
+    {
+        for (value = 0; value < 3; value++)
+        {
+            if (!mpmc_ring_push(&ring, &value))
+            {
+                fprintf(stderr, "mpmc_ring: test 1.2 failed, push %d.\n", value);
+                return 1;
+            }
+        }
+
+        if (mpmc_ring_push(&ring, &value) || mpmc_ring_count(&ring) != 3)
+        {
+            fprintf(stderr, "mpmc_ring: test 1.3 failed, full ring.\n");
+            return 1;
+        }
+
+        for (int i = 0; i < 3; i++)
+        {
+            if (!mpmc_ring_pop(&ring, &value) || value != i)
+            {
+                fprintf(stderr, "mpmc_ring: test 1.4 failed, pop %d.\n", i);
+                return 1;
+            }
+        }
+
+        if (mpmc_ring_pop(&ring, &value) || mpmc_ring_count(&ring) != 0)
+        {
+            fprintf(stderr, "mpmc_ring: test 1.5 failed, empty ring.\n");
+            return 1;
+        }
+    }
+
+    mpmc_ring_done(&ring);
+    return 0;
+}
+
+static void *
+producer(void *data)
+{
+    for (int64_t i = 1; i <= N_ITEMS; i++)
+    {
+        while (!mpmc_ring_push(&ring, &i))
+        {
+            sched_yield();
+        }
+        __sync_fetch_and_add(&pushed_sum, i);
+    }
+    return NULL;
+}
+
+static void *
+consumer(void *data)
+{
+    int64_t value;
+
+    while (__sync_fetch_and_add(&n_popped, 0) < N_THREADS * N_ITEMS)
+    {
+        if (mpmc_ring_pop(&ring, &value))
+        {
+            __sync_fetch_and_add(&popped_sum, value);
+            __sync_fetch_and_add(&n_popped, 1);
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * test2    Concurrent producers and consumers lose or duplicate no elements
+ */
+static int
+test2()
+{
+    pthread_t threads[N_THREADS * 2];
+
+    if (!mpmc_ring_init(&ring, 64, sizeof(int64_t)))
+    {
+        fprintf(stderr, "mpmc_ring: test 2.1 failed, init.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < N_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, producer, NULL);
+        pthread_create(&threads[N_THREADS + i], NULL, consumer, NULL);
+    }
+
+    for (int i = 0; i < N_THREADS * 2; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (pushed_sum != popped_sum || n_popped != N_THREADS * N_ITEMS ||
+        mpmc_ring_count(&ring) != 0)
+    {
+        fprintf(stderr, "mpmc_ring: test 2.2 failed, pushed %ld, popped %ld.\n",
+                pushed_sum, popped_sum);
+        return 1;
+    }
+
+    mpmc_ring_done(&ring);
+    return 0;
+}
+
+/**
+ * test3    Intrusive list operations keep the order and the links
+ */
+static int
+test3()
+{
+    ITEM items[4];
+    DLIST list;
+
+    dlist_init(&list);
+
+    for (int i = 0; i < 4; i++)
+    {
+        items[i].value = i;
+        dlist_append(&list, &items[i].node);
+    }
+
+    /** 1, 3, 0 */
+    dlist_remove(&list, &items[2].node);
+    dlist_remove(&list, &items[0].node);
+    dlist_append(&list, &items[0].node);
+
+    int expected[] = {1, 3, 0};
+    int n = 0;
+
+    for (DLIST_NODE *node = list.first; node; node = node->next)
+    {
+        if (n >= 3 || DLIST_ENTRY(node, ITEM, node)->value != expected[n] ||
+            (node->next && node->next->prev != node))
+        {
+            fprintf(stderr, "mpmc_ring: test 3.1 failed, node %d.\n", n);
+            return 1;
+        }
+        n++;
+    }
+
+    if (n != 3 || list.count != 3 || DLIST_ENTRY(list.last, ITEM, node)->value != 0)
+    {
+        fprintf(stderr, "mpmc_ring: test 3.2 failed, %d nodes.\n", n);
+        return 1;
+    }
+
+    while (dlist_pop_first(&list))
+    {
+        continue;
+    }
+
+    if (!dlist_is_empty(&list) || list.last != NULL || list.count != 0)
+    {
+        fprintf(stderr, "mpmc_ring: test 3.3 failed, list not empty.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+    result += test3();
+
+    exit(result);
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                 Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <rwlock.h>
+#include <thread.h>
+#include <atomic.h>
+
+#define THREADS 8
+#define ITERATIONS 100000
+
+static RWLOCK rwlock = RWLOCK_INIT;
+static SEQLOCK seqlock = SEQLOCK_INIT;
+static volatile long value_a, value_b;
+static volatile int writer_active;
+static int failures;
+
+/**
+ * test1    rwlock_read_acquire and rwlock_write_acquire tests
+ *
+ * Check that a read lock can be taken more than once, that the write lock
+ * can not be taken while it is held and that the write lock can be taken
+ * after the read locks are released.
+ */
+static int
+test1()
+{
+    RWLOCK lock;
+
+    rwlock_init(&lock);
+    rwlock_read_acquire(&lock);
+    rwlock_read_acquire(&lock);
+
+    if (lock.state != 2)
+    {
+        fprintf(stderr, "rwlock: test 1.1 failed.\n");
+        return 1;
+    }
+
+    rwlock_read_release(&lock);
+    rwlock_read_release(&lock);
+    rwlock_write_acquire(&lock);
+
+    if (!RWLOCK_IS_WRITE_LOCKED(&lock))
+    {
+        fprintf(stderr, "rwlock: test 1.2 failed.\n");
+        return 1;
+    }
+
+    rwlock_write_release(&lock);
+
+    if (lock.state != 0)
+    {
+        fprintf(stderr, "rwlock: test 1.3 failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void
+test2_helper(void *data)
+{
+    int n = *(int *)data;
+
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        if (n % 4 == 0)
+        {
+            rwlock_write_acquire(&rwlock);
+            writer_active++;
+            value_a++;
+            value_b++;
+            if (writer_active != 1)
+            {
+                failures++;
+            }
+            writer_active--;
+            rwlock_write_release(&rwlock);
+        }
+        else
+        {
+            rwlock_read_acquire(&rwlock);
+            if (value_a != value_b || writer_active)
+            {
+                failures++;
+            }
+            rwlock_read_release(&rwlock);
+        }
+    }
+}
+
+/**
+ * test2    concurrent readers and writers
+ *
+ * Start readers and writers. The writers update two values that the readers
+ * check to be equal. No reader may see a writer in its critical section and
+ * no two writers may be in it at the same time.
+ */
+static int
+test2()
+{
+    THREAD handle[THREADS];
+    int tnum[THREADS];
+
+    value_a = value_b = 0;
+    failures = 0;
+
+    for (int i = 0; i < THREADS; i++)
+    {
+        tnum[i] = i;
+        thread_start(&handle[i], test2_helper, &tnum[i]);
+    }
+
+    for (int i = 0; i < THREADS; i++)
+    {
+        thread_wait(handle[i]);
+    }
+
+    if (failures || value_a != (long)(THREADS / 4) * ITERATIONS || rwlock.state != 0)
+    {
+        fprintf(stderr, "rwlock: test 2 failed, %d failures, value is %ld.\n", failures, value_a);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int test3_entered;
+
+static void
+test3_helper(void *data)
+{
+    RWLOCK *lock = (RWLOCK *)data;
+
+    rwlock_read_acquire(lock);
+    test3_entered = 1;
+    rwlock_read_release(lock);
+}
+
+/**
+ * test3    rwlock_read_acquire blocks while the write lock is held
+ *
+ * Take the write lock, start a reader and check that it does not get the
+ * lock before the write lock is released.
+ */
+static int
+test3()
+{
+    RWLOCK lock = RWLOCK_INIT;
+    THREAD handle;
+    struct timespec sleeptime = {1, 0};
+
+    test3_entered = 0;
+    rwlock_write_acquire(&lock);
+    thread_start(&handle, test3_helper, &lock);
+    nanosleep(&sleeptime, NULL);
+
+    if (test3_entered)
+    {
+        fprintf(stderr, "rwlock: test 3.1 failed.\n");
+        return 1;
+    }
+
+    rwlock_write_release(&lock);
+    thread_wait(handle);
+
+    if (!test3_entered)
+    {
+        fprintf(stderr, "rwlock: test 3.2 failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void
+test4_helper(void *data)
+{
+    int n = *(int *)data;
+
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        if (n == 0)
+        {
+            seqlock_write_begin(&seqlock);
+            value_a++;
+            value_b = value_a * 2;
+            seqlock_write_end(&seqlock);
+        }
+        else
+        {
+            long a, b;
+            int seq;
+
+            do
+            {
+                seq = seqlock_read_begin(&seqlock);
+                a = value_a;
+                b = value_b;
+            }
+            while (seqlock_read_retry(&seqlock, seq));
+
+            if (b != a * 2)
+            {
+                atomic_add(&failures, 1);
+            }
+        }
+    }
+}
+
+/**
+ * test4    sequence lock
+ *
+ * One writer updates two values which the readers read with the sequence
+ * lock. A reader must never see the values of two different updates.
+ */
+static int
+test4()
+{
+    THREAD handle[THREADS];
+    int tnum[THREADS];
+
+    value_a = value_b = 0;
+    failures = 0;
+
+    for (int i = 0; i < THREADS; i++)
+    {
+        tnum[i] = i;
+        thread_start(&handle[i], test4_helper, &tnum[i]);
+    }
+
+    for (int i = 0; i < THREADS; i++)
+    {
+        thread_wait(handle[i]);
+    }
+
+    if (failures || value_a != ITERATIONS || (seqlock.sequence & 1))
+    {
+        fprintf(stderr, "seqlock: test 4 failed, %d failures.\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+    result += test3();
+    result += test4();
+
+    exit(result);
+}
@@ -89,6 +89,48 @@ test1()
     {
         free(status);
     }
+    ss_dfprintf(stderr, "\t..done\nTesting GTID position of Server.");
+    SERVER_GTID gtids[MAX_GTID_DOMAINS];
+    int n_gtids;
+    ss_info_dassert(0 == server_get_gtid_pos(server, gtids, &n_gtids), "Position should not be set.");
+    ss_info_dassert(!server_set_gtid_pos(server, "0-1"), "Invalid position should be rejected.");
+    ss_info_dassert(server_set_gtid_pos(server, "0-1-100,2-3-5"), "Position should be accepted.");
+    ss_info_dassert(1 == server_get_gtid_pos(server, gtids, &n_gtids) && 2 == n_gtids &&
+                    2 == gtids[1].domain && 3 == gtids[1].server_id && 5 == gtids[1].sequence,
+                    "Position should be returned correctly.");
+    gtids[0].sequence = 99;
+    ss_info_dassert(server_gtid_pos_reached(server, gtids, 1), "Older position should be reached.");
+    gtids[1].sequence = 6;
+    ss_info_dassert(!server_gtid_pos_reached(server, gtids, 2), "Newer position should not be reached.");
+    gtids[0].domain = 1;
+    ss_info_dassert(!server_gtid_pos_reached(server, gtids, 1), "Unknown domain should not be reached.");
+    ss_dfprintf(stderr, "\t..done\nTesting state snapshots of Server.");
+    SERVER_STATE state;
+    ss_info_dassert(!server_get_state(server, &state) && (state.status & SERVER_RUNNING),
+                    "State should be read from the server before it is published.");
+    server_set_status(server, SERVER_SLAVE);
+    int generation = server_status_generation();
+    for (int i = 0; i < SERVER_STATE_SLOTS + 1; i++)
+    {
+        server->rlag = i;
+        server_publish_state(server);
+    }
+    ss_info_dassert(server_status_generation() == generation + 1,
+                    "First published state should change the generation.");
+    server_publish_state(server);
+    ss_info_dassert(server_get_state(server, &state) && state.version == SERVER_STATE_SLOTS + 1,
+                    "Unchanged state should not be published.");
+    server->depth = 1;
+    server_publish_state(server);
+    ss_info_dassert(server_status_generation() == generation + 2,
+                    "Changed topology should change the generation.");
+    server_clear_status(server, SERVER_SLAVE);
+    ss_info_dassert(server_get_state(server, &state) && state.version == SERVER_STATE_SLOTS + 2 &&
+                    (state.status & SERVER_SLAVE) && state.n_gtid_pos == 2 && state.depth == 1,
+                    "Published state should be returned.");
+    server_publish_state(server);
+    ss_info_dassert(server_get_state(server, &state) && !(state.status & SERVER_SLAVE),
+                    "Newest published state should be returned.");
     ss_dfprintf(stderr, "\t..done\nRun Prints for Server and all Servers.");
     printServer(server);
     printAllServers();
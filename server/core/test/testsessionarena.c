@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                 Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <session.h>
+
+/**
+ * test1    Small allocations are aligned, zeroed and share a chunk
+ */
+static int
+test1(SESSION *session)
+{
+    char *prev = NULL;
+
+    for (int i = 1; i <= SESSION_ARENA_ALIGN; i++)
+    {
+        char *ptr = session_arena_alloc(session, i);
+
+        if (ptr == NULL || ((uintptr_t)ptr % SESSION_ARENA_ALIGN) != 0)
+        {
+            fprintf(stderr, "session_arena: test 1.1 failed, allocation %d.\n", i);
+            return 1;
+        }
+
+        for (int j = 0; j < i; j++)
+        {
+            if (ptr[j] != 0)
+            {
+                fprintf(stderr, "session_arena: test 1.2 failed, memory not zeroed.\n");
+                return 1;
+            }
+        }
+
+        memset(ptr, 0xff, i);
+
+        if (prev && ptr - prev < SESSION_ARENA_ALIGN)
+        {
+            fprintf(stderr, "session_arena: test 1.3 failed, allocations overlap.\n");
+            return 1;
+        }
+        prev = ptr;
+    }
+
+    if (session->arena.allocated != SESSION_ARENA_CHUNK_SIZE ||
+        session->arena.used != SESSION_ARENA_ALIGN * SESSION_ARENA_ALIGN)
+    {
+        fprintf(stderr, "session_arena: test 1.4 failed, %lu of %lu bytes used.\n",
+                session->arena.used, session->arena.allocated);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * test2    A large allocation gets its own chunk and the small ones
+ *          still come from the first chunk
+ */
+static int
+test2(SESSION *session)
+{
+    size_t allocated = session->arena.allocated;
+    SESSION_ARENA_CHUNK *first = session->arena.chunks;
+    char *large = session_arena_alloc(session, SESSION_ARENA_CHUNK_SIZE);
+
+    if (large == NULL || session->arena.allocated != allocated + SESSION_ARENA_CHUNK_SIZE)
+    {
+        fprintf(stderr, "session_arena: test 2.1 failed.\n");
+        return 1;
+    }
+
+    char *small = session_arena_alloc(session, 8);
+
+    if (small == NULL || session->arena.chunks != first ||
+        small < (char*)first || small >= (char*)first + sizeof(SESSION_ARENA_CHUNK) +
+        SESSION_ARENA_ALIGN + SESSION_ARENA_CHUNK_SIZE)
+    {
+        fprintf(stderr, "session_arena: test 2.2 failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * test3    The memory usage includes the session and its arena
+ */
+static int
+test3(SESSION *session)
+{
+    if (session_memory_usage(session) != sizeof(SESSION) + session->arena.allocated)
+    {
+        fprintf(stderr, "session_arena: test 3 failed, %lu bytes.\n",
+                session_memory_usage(session));
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+    SESSION *session = calloc(1, sizeof(SESSION));
+
+    spinlock_init(&session->arena.lock);
+    result += test1(session);
+    result += test2(session);
+    result += test3(session);
+
+    exit(result);
+}
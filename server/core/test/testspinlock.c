@@ -18,6 +18,7 @@
  *
  * Date         Who                 Description
  * 18/08-2014   Mark Riddoch        Initial implementation
+ * 14/10/2016   MariaDB Corporation Test under heavy contention
  *
  * @endverbatim
  */
@@ -245,6 +246,62 @@ test3()
     return 0 == failures ? 0 : 1;
 }
 
+/**
+ * test4    spinlock_acquire tests under heavy contention
+ *
+ * Start more threads than there are processors, increment a shared counter
+ * under the lock and verify that no increment was lost. With the
+ * SPINLOCK_COUNTERS option the contended acquires must have been counted.
+ */
+#define TEST4_THREADS 16
+#define TEST4_ITERATIONS 100000
+
+static SPINLOCK test4_lock = SPINLOCK_INIT;
+static long test4_counter;
+
+static void
+test4_helper(void *data)
+{
+    for (int i = 0; i < TEST4_ITERATIONS; i++)
+    {
+        spinlock_acquire(&test4_lock);
+        test4_counter++;
+        spinlock_release(&test4_lock);
+    }
+}
+
+static int
+test4()
+{
+    THREAD handle[TEST4_THREADS];
+
+    for (int i = 0; i < TEST4_THREADS; i++)
+    {
+        thread_start(&handle[i], test4_helper, NULL);
+    }
+
+    for (int i = 0; i < TEST4_THREADS; i++)
+    {
+        thread_wait(handle[i]);
+    }
+
+    if (test4_counter != (long)TEST4_THREADS * TEST4_ITERATIONS || SPINLOCK_IS_LOCKED(&test4_lock))
+    {
+        fprintf(stderr, "spinlock: test 4 failed, counter is %ld.\n", test4_counter);
+        return 1;
+    }
+#if SPINLOCK_COUNTERS
+    if (test4_lock.contended == 0)
+    {
+        fprintf(stderr, "spinlock: test 4 failed, no contended acquires were counted.\n");
+        return 1;
+    }
+    fprintf(stderr, "spinlock_test 4 had %d contended acquires and %d sleeps.\n",
+            test4_lock.contended, test4_lock.parked);
+#endif
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
@@ -252,6 +309,7 @@ int main(int argc, char **argv)
     result += test1();
     result += test2();
     result += test3();
+    result += test4();
 
     exit(result);
 }
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/2016   MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <statistics.h>
+#include <skygw_debug.h>
+
+/**
+ * test1    Counters, gauges and snapshots
+ */
+static int
+test1()
+{
+    ts_stats_t a = ts_stats_alloc();
+    ts_stats_t b = ts_stats_alloc();
+    ss_info_dassert(a && b && a != b, "Allocating statistics should succeed");
+
+    ts_stats_add(a, 5);
+    ts_stats_add(a, 3000000000LL);
+    ts_stats_set(b, 7);
+    ss_info_dassert(ts_stats_sum(a) == 3000000005LL, "Counters should not wrap at 32 bits");
+    ss_info_dassert(ts_stats_sum(b) == 7 && ts_stats_max(b) == 7, "Gauge should have the set value");
+
+    ts_stats_t stats[] = {b, a};
+    int64_t values[2];
+    ts_stats_snapshot(stats, 2, values);
+    ss_info_dassert(values[0] == 7 && values[1] == 3000000005LL, "Snapshot should read all values");
+
+    ts_stats_free(a);
+    a = ts_stats_alloc();
+    ss_info_dassert(a && ts_stats_sum(a) == 0, "A reused slot should be reset");
+
+    ts_stats_free(a);
+    ts_stats_free(b);
+    return 0;
+}
+
+/**
+ * test2    Histograms and running out of slots
+ */
+static int
+test2()
+{
+    int64_t bounds[] = {10, 100, 1000};
+    int64_t counts[TS_STATS_MAX_BUCKETS];
+    TS_HISTOGRAM *hist = ts_histogram_alloc(bounds, 3);
+    ss_info_dassert(hist, "Allocating a histogram should succeed");
+
+    int64_t values[] = { -5, 9, 10, 99, 100, 999, 1000, 5000};
+    for (int i = 0; i < 8; i++)
+    {
+        ts_histogram_add(hist, values[i]);
+    }
+
+    ss_info_dassert(ts_histogram_snapshot(hist, counts) == 4, "Histogram should have four buckets");
+    ss_info_dassert(counts[0] == 2 && counts[1] == 2 && counts[2] == 2 && counts[3] == 2,
+                    "Values should be counted in the right buckets");
+    ts_histogram_free(hist);
+
+    ts_stats_t stats[TS_STATS_MAX_SLOTS];
+    for (int i = 0; i < TS_STATS_MAX_SLOTS; i++)
+    {
+        stats[i] = ts_stats_alloc();
+        ss_info_dassert(stats[i], "Allocating all slots should succeed");
+    }
+    ss_info_dassert(ts_stats_alloc() == NULL, "Allocation should fail when the slots are used");
+
+    for (int i = 0; i < TS_STATS_MAX_SLOTS; i++)
+    {
+        ts_stats_free(stats[i]);
+    }
+    return 0;
+}
+
+/**
+ * test3    Latency histograms
+ */
+static int
+test3()
+{
+    TS_LATENCY *latency = NULL;
+    TS_LATENCY_SNAPSHOT snapshot, merged;
+
+    ss_info_dassert(ts_latency_get(&latency) && latency, "Histogram should be created on first use");
+    ss_info_dassert(ts_latency_get(&latency) == latency, "The same histogram should be returned");
+
+    for (uint64_t us = 1; us <= 1000; us++)
+    {
+        ts_latency_add(latency, us * 1000);
+    }
+
+    ts_latency_snapshot(latency, &snapshot);
+    ss_info_dassert(snapshot.count == 1000 && snapshot.max == 1000000, "All samples should be counted");
+
+    uint64_t p50 = ts_latency_percentile(&snapshot, 0.50);
+    uint64_t p99 = ts_latency_percentile(&snapshot, 0.99);
+    ss_info_dassert(p50 >= 500000 * 7 / 8 && p50 <= 500000, "p50 should be within 12.5%");
+    ss_info_dassert(p99 >= 990000 * 7 / 8 && p99 <= 990000, "p99 should be within 12.5%");
+
+    memset(&merged, 0, sizeof(merged));
+    ts_latency_merge(&merged, &snapshot);
+    ts_latency_merge(&merged, &snapshot);
+    ss_info_dassert(merged.count == 2000 && ts_latency_percentile(&merged, 0.50) == p50,
+                    "Merging should keep the percentiles");
+
+    memset(&merged, 0, sizeof(merged));
+    for (uint64_t us = 1; us <= 1000; us++)
+    {
+        ts_latency_record(&merged, us * 1000);
+    }
+    ss_info_dassert(memcmp(&merged, &snapshot, sizeof(merged)) == 0,
+                    "Recording into a snapshot should give the same histogram");
+
+    ts_latency_free(latency);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    ts_stats_init();
+    result += test1();
+    result += test2();
+    result += test3();
+    ts_stats_end();
+
+    exit(result);
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                 Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <timer.h>
+#include <thread.h>
+
+#define N_TIMERS 5
+
+static int order[N_TIMERS];
+static long fired_at[N_TIMERS];
+static int n_fired;
+
+static void
+test_fn(void *data)
+{
+    int n = (int)(intptr_t)data;
+
+    if (n_fired < N_TIMERS)
+    {
+        order[n_fired++] = n;
+    }
+    fired_at[n] = timer_clock();
+}
+
+/**
+ * Run a wheel until a number of timers have fired or a timeout is reached
+ *
+ * @param wheel     The wheel
+ * @param count     Number of timers to wait for
+ * @param timeout   Milliseconds to run the wheel for
+ */
+static void
+run_wheel(TIMER_WHEEL *wheel, int count, long timeout)
+{
+    long end = timer_clock() + timeout;
+
+    while (n_fired < count && timer_clock() < end)
+    {
+        timer_wheel_run(wheel);
+        thread_millisleep(1);
+    }
+}
+
+/**
+ * test1    Timers on the different levels expire in order
+ *
+ * Add timers that are placed on the first, second and third level of
+ * the wheel. Check that they are called in the order of their expiry
+ * and not before their expiry.
+ */
+static int
+test1()
+{
+    static TIMER_WHEEL wheel;
+    TIMER timers[N_TIMERS];
+    int delays[N_TIMERS] = {5000, 10, 300, 100, 70};
+    int expected[N_TIMERS] = {1, 4, 3, 2, 0};
+
+    timer_wheel_init(&wheel, 1);
+    n_fired = 0;
+
+    long start = timer_clock();
+
+    for (int i = 0; i < N_TIMERS; i++)
+    {
+        timer_init(&timers[i], test_fn, (void*)(intptr_t)i);
+        timer_add(&wheel, &timers[i], delays[i], 0);
+    }
+
+    run_wheel(&wheel, N_TIMERS, 10000);
+
+    if (n_fired != N_TIMERS)
+    {
+        fprintf(stderr, "timer: test 1.1 failed, %d timers fired.\n", n_fired);
+        return 1;
+    }
+
+    for (int i = 0; i < N_TIMERS; i++)
+    {
+        if (order[i] != expected[i])
+        {
+            fprintf(stderr, "timer: test 1.2 failed, timer %d fired as %d.\n", order[i], i);
+            return 1;
+        }
+
+        if (fired_at[i] - start < delays[i] - 1)
+        {
+            fprintf(stderr, "timer: test 1.3 failed, timer %d fired after %ld ms.\n",
+                    i, fired_at[i] - start);
+            return 1;
+        }
+
+        if (timer_pending(&timers[i]))
+        {
+            fprintf(stderr, "timer: test 1.4 failed.\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * test2    Cancelled timers do not expire
+ */
+static int
+test2()
+{
+    static TIMER_WHEEL wheel;
+    TIMER t1, t2;
+
+    timer_wheel_init(&wheel, 1);
+    n_fired = 0;
+
+    timer_init(&t1, test_fn, (void*)0);
+    timer_init(&t2, test_fn, (void*)1);
+    timer_add(&wheel, &t1, 20, 0);
+    timer_add(&wheel, &t2, 40, 0);
+
+    if (!timer_cancel(&t1) || timer_cancel(&t1))
+    {
+        fprintf(stderr, "timer: test 2.1 failed.\n");
+        return 1;
+    }
+
+    run_wheel(&wheel, 1, 1000);
+    run_wheel(&wheel, 2, 100);
+
+    if (n_fired != 1 || order[0] != 1)
+    {
+        fprintf(stderr, "timer: test 2.2 failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static TIMER repeating;
+static int repeat_count;
+
+static void
+repeat_fn(void *data)
+{
+    if (++repeat_count == 3)
+    {
+        timer_cancel(&repeating);
+    }
+    n_fired = repeat_count;
+}
+
+/**
+ * test3    A repeating timer expires until it cancels itself
+ */
+static int
+test3()
+{
+    static TIMER_WHEEL wheel;
+
+    timer_wheel_init(&wheel, 1);
+    n_fired = 0;
+    repeat_count = 0;
+
+    timer_init(&repeating, repeat_fn, NULL);
+    timer_add(&wheel, &repeating, 10, 10);
+    run_wheel(&wheel, 10, 200);
+
+    if (repeat_count != 3 || timer_pending(&repeating))
+    {
+        fprintf(stderr, "timer: test 3 failed, %d calls.\n", repeat_count);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+    result += test3();
+
+    exit(result);
+}
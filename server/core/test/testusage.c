@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/2016   MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <usage.h>
+#include <skygw_debug.h>
+#include "test_sessions.h"
+
+#define N_THREADS 4
+#define N_ADDS 100000
+
+static SERVICE services[2];
+
+/**
+ * test1    Keys of the service and user pairs
+ */
+static int
+test1()
+{
+    const char *users[N_SESSIONS] = {"bob", "bob", "bob", NULL};
+    SERVICE *service;
+    const char *user;
+    USAGE usage;
+
+    init_test_sessions(&services[0], users);
+    sessions[2].service = &services[1];
+
+    usage_add(&sessions[3], USAGE_QUERIES, 1);
+    ss_info_dassert(sessions[3].usage_key == USAGE_KEY_UNKNOWN,
+                    "A session without a user should not get a key");
+    ss_info_dassert(!usage_get(0, &service, &user, &usage), "No key should be in use");
+
+    usage_add(&sessions[0], USAGE_QUERIES, 1);
+    usage_add(&sessions[1], USAGE_QUERIES, 2);
+    usage_add(&sessions[2], USAGE_QUERIES, 4);
+    usage_add(&sessions[0], USAGE_BYTES_IN, 100);
+
+    ss_info_dassert(sessions[0].usage_key >= 0 && sessions[0].usage_key == sessions[1].usage_key,
+                    "The sessions of a user of a service should share the key");
+    ss_info_dassert(sessions[2].usage_key >= 0 && sessions[2].usage_key != sessions[0].usage_key,
+                    "The user of another service should get another key");
+
+    ss_info_dassert(usage_get(sessions[0].usage_key, &service, &user, &usage),
+                    "The key should be in use");
+    ss_info_dassert(service == &services[0] && strcmp(user, "bob") == 0,
+                    "The key should have the service and the user");
+    ss_info_dassert(usage.counters[USAGE_QUERIES] == 3 && usage.counters[USAGE_BYTES_IN] == 100 &&
+                    usage.counters[USAGE_BYTES_OUT] == 0,
+                    "The usage of the sessions of the user should be summed");
+
+    ss_info_dassert(usage_get(sessions[2].usage_key, &service, &user, &usage) &&
+                    usage.counters[USAGE_QUERIES] == 4,
+                    "The usage of the users of the services should be separate");
+
+    dcbs[3].user = "alice";
+    usage_add(&sessions[3], USAGE_QUERIES, 1);
+    ss_info_dassert(sessions[3].usage_key >= 0 && sessions[3].usage_key != sessions[0].usage_key,
+                    "The session should get a key once its user is known");
+
+    sessions[3].usage_key = USAGE_KEY_NONE;
+    usage_add(&sessions[3], USAGE_QUERIES, 1);
+    ss_info_dassert(sessions[3].usage_key == USAGE_KEY_NONE,
+                    "A session that is not accounted should not get a key");
+
+    return 0;
+}
+
+static void *
+add_thread(void *data)
+{
+    for (int i = 0; i < N_ADDS; i++)
+    {
+        usage_add(&sessions[i % N_SESSIONS], USAGE_BACKEND_CYCLES, 1);
+    }
+    return NULL;
+}
+
+/**
+ * test2    Sums of the counts of several threads
+ */
+static int
+test2()
+{
+    const char *users[N_SESSIONS] = {"carol", "dave", "carol", "dave"};
+    pthread_t threads[N_THREADS];
+    SERVICE *service;
+    const char *user;
+    USAGE usage;
+
+    init_test_sessions(&services[1], users);
+    usage_add(&sessions[0], USAGE_BACKEND_CYCLES, 0);
+    usage_add(&sessions[1], USAGE_BACKEND_CYCLES, 0);
+
+    for (int i = 0; i < N_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, add_thread, NULL);
+    }
+
+    for (int i = 0; i < N_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    ss_info_dassert(usage_get(sessions[0].usage_key, &service, &user, &usage) &&
+                    strcmp(user, "carol") == 0 &&
+                    usage.counters[USAGE_BACKEND_CYCLES] == N_THREADS * N_ADDS / 2,
+                    "The counts of all threads should be summed");
+    ss_info_dassert(usage_get(sessions[1].usage_key, &service, &user, &usage) &&
+                    strcmp(user, "dave") == 0 &&
+                    usage.counters[USAGE_BACKEND_CYCLES] == N_THREADS * N_ADDS / 2,
+                    "The counts of all threads should be summed");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+
+    exit(result);
+}
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file timer.c  -  A hierarchical timer wheel
+ *
+ * A timer that expires in less than TIMER_WHEEL_SLOTS ticks is placed on the
+ * first level in the slot of its expiry tick. A timer that expires later is
+ * placed on the lowest level that covers its expiry time in the slot indexed
+ * by the bits of the expiry tick that belong to that level. Timers further
+ * away than the wheel covers are placed on the last slot of the highest level
+ * and placed again when the slot is reached.
+ *
+ * The timers are called without the lock of the wheel being held, so the
+ * functions may add and cancel timers, including themselves.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <timer.h>
+#include <sched.h>
+#include <time.h>
+#include <skygw_debug.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/** The number of ticks covered by the wheel */
+#define TIMER_WHEEL_SPAN (1L << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+/**
+ * Return the value of the monotonic clock in milliseconds
+ *
+ * @return Milliseconds since an arbitrary point in time
+ */
+long
+timer_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Initialise a timer wheel
+ *
+ * @param wheel      The wheel to initialise
+ * @param resolution The length of one tick in milliseconds
+ */
+void
+timer_wheel_init(TIMER_WHEEL *wheel, int resolution)
+{
+    spinlock_init(&wheel->lock);
+    wheel->resolution = resolution > 0 ? resolution : 1;
+    wheel->current = timer_clock() / wheel->resolution;
+    wheel->count = 0;
+    wheel->running = NULL;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+        {
+            TIMER *head = &wheel->slots[level][i];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+}
+
+/**
+ * Initialise a timer
+ *
+ * @param timer The timer to initialise
+ * @param fn    The function to call when the timer expires
+ * @param data  Data passed to the function
+ */
+void
+timer_init(TIMER *timer, void (*fn)(void *), void *data)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->wheel = NULL;
+    timer->expires = 0;
+    timer->interval = 0;
+    timer->fn = fn;
+    timer->data = data;
+}
+
+/**
+ * Place a timer in the slot of its expiry tick. The caller must hold the
+ * lock of the wheel.
+ *
+ * @param wheel The wheel
+ * @param timer The timer
+ */
+static void
+timer_place(TIMER_WHEEL *wheel, TIMER *timer)
+{
+    long expires = timer->expires;
+    long delta = expires - wheel->current;
+    int level = 0;
+
+    if (delta < 0)
+    {
+        expires = wheel->current;
+    }
+    else if (delta >= TIMER_WHEEL_SPAN)
+    {
+        expires = wheel->current + TIMER_WHEEL_SPAN - 1;
+        level = TIMER_WHEEL_LEVELS - 1;
+    }
+    else
+    {
+        while (delta >= (1L << (TIMER_WHEEL_BITS * (level + 1))))
+        {
+            level++;
+        }
+    }
+
+    TIMER *head = &wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/**
+ * Remove a timer from its slot. The caller must hold the lock of the wheel.
+ *
+ * @param timer The timer
+ */
+static inline void
+timer_unlink(TIMER *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/**
+ * Move the timers of a slot to the slots of the lower levels.
+ *
+ * @param wheel The wheel
+ * @param level The level of the slot
+ * @return The index of the slot
+ */
+static int
+timer_cascade(TIMER_WHEEL *wheel, int level)
+{
+    int index = (wheel->current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    TIMER *head = &wheel->slots[level][index];
+
+    while (head->next != head)
+    {
+        TIMER *timer = head->next;
+        timer_unlink(timer);
+        timer_place(wheel, timer);
+    }
+
+    return index;
+}
+
+/**
+ * Add a timer to a wheel. A timer that is already pending is cancelled first.
+ * The timer function is called after delay milliseconds, rounded to the
+ * resolution of the wheel, when the wheel is next run.
+ *
+ * @param wheel    The wheel
+ * @param timer    An initialised timer
+ * @param delay    Milliseconds until the timer expires
+ * @param interval Milliseconds between the calls of a repeating timer or
+ *                 0 for a one-shot timer
+ */
+void
+timer_add(TIMER_WHEEL *wheel, TIMER *timer, int delay, int interval)
+{
+    if (timer->wheel && timer_pending(timer))
+    {
+        timer_cancel(timer);
+    }
+
+    long now = timer_clock() / wheel->resolution;
+
+    spinlock_acquire(&wheel->lock);
+
+    if (wheel->count == 0 && wheel->current < now)
+    {
+        wheel->current = now;
+    }
+
+    timer->wheel = wheel;
+    timer->interval = (interval + wheel->resolution - 1) / wheel->resolution;
+    timer->expires = now + (delay + wheel->resolution - 1) / wheel->resolution;
+
+    if (timer->expires < wheel->current)
+    {
+        timer->expires = wheel->current;
+    }
+
+    if (wheel->running && timer->expires == wheel->current)
+    {
+        /** The slot of the current tick is being processed */
+        timer->expires++;
+    }
+
+    timer_place(wheel, timer);
+    wheel->count++;
+    spinlock_release(&wheel->lock);
+}
+
+/**
+ * Cancel a timer. If the function of the timer is being called by another
+ * thread, waits until the call returns so that a timer that the function
+ * adds again is also cancelled. After this the timer may be freed unless
+ * the caller is the timer function itself.
+ *
+ * @param timer The timer
+ * @return True if the timer was pending
+ */
+bool
+timer_cancel(TIMER *timer)
+{
+    TIMER_WHEEL *wheel = timer->wheel;
+    bool pending = false;
+
+    if (wheel == NULL)
+    {
+        return false;
+    }
+
+    spinlock_acquire(&wheel->lock);
+
+    while (wheel->running == timer && !pthread_equal(wheel->runner, pthread_self()))
+    {
+        spinlock_release(&wheel->lock);
+        sched_yield();
+        spinlock_acquire(&wheel->lock);
+    }
+
+    if (timer->next)
+    {
+        timer_unlink(timer);
+        wheel->count--;
+        pending = true;
+    }
+
+    spinlock_release(&wheel->lock);
+    return pending;
+}
+
+/**
+ * Call the functions of the expired timers of a wheel. A wheel is run by
+ * one thread at a time.
+ *
+ * @param wheel The wheel
+ * @return Number of timers called
+ */
+int
+timer_wheel_run(TIMER_WHEEL *wheel)
+{
+    long now = timer_clock() / wheel->resolution;
+    int n = 0;
+
+    spinlock_acquire(&wheel->lock);
+
+    if (wheel->count == 0)
+    {
+        if (wheel->current <= now)
+        {
+            wheel->current = now + 1;
+        }
+        spinlock_release(&wheel->lock);
+        return 0;
+    }
+
+    while (wheel->current <= now)
+    {
+        int index = wheel->current & TIMER_WHEEL_MASK;
+
+        for (int level = 1; index == 0 && level < TIMER_WHEEL_LEVELS; level++)
+        {
+            index = timer_cascade(wheel, level);
+        }
+
+        TIMER *head = &wheel->slots[0][wheel->current & TIMER_WHEEL_MASK];
+
+        while (head->next != head)
+        {
+            TIMER *timer = head->next;
+            timer_unlink(timer);
+            wheel->count--;
+
+            if (timer->interval)
+            {
+                timer->expires += timer->interval;
+
+                if (timer->expires <= wheel->current)
+                {
+                    timer->expires = wheel->current + 1;
+                }
+
+                timer_place(wheel, timer);
+                wheel->count++;
+            }
+
+            void (*fn)(void *) = timer->fn;
+            void *data = timer->data;
+            wheel->running = timer;
+            wheel->runner = pthread_self();
+            spinlock_release(&wheel->lock);
+
+            fn(data);
+            n++;
+
+            spinlock_acquire(&wheel->lock);
+            wheel->running = NULL;
+        }
+
+        wheel->current++;
+    }
+
+    spinlock_release(&wheel->lock);
+    return n;
+}
+
+/**
+ * Return the time until the wheel needs to be run again. This is the expiry
+ * time of the first timer on the first level or the time when the first level
+ * wraps around and the timers of the higher levels are moved down.
+ *
+ * @param wheel The wheel
+ * @return Milliseconds until the next timer expires, -1 if the wheel is empty
+ */
+int
+timer_wheel_next(TIMER_WHEEL *wheel)
+{
+    long ticks = -1;
+
+    spinlock_acquire(&wheel->lock);
+
+    if (wheel->count > 0)
+    {
+        long tick = wheel->current;
+
+        do
+        {
+            TIMER *head = &wheel->slots[0][tick & TIMER_WHEEL_MASK];
+
+            if (head->next != head)
+            {
+                break;
+            }
+            tick++;
+        }
+        while (tick & TIMER_WHEEL_MASK);
+
+        ticks = tick;
+    }
+
+    spinlock_release(&wheel->lock);
+
+    if (ticks < 0)
+    {
+        return -1;
+    }
+
+    long ms = ticks * wheel->resolution - timer_clock();
+    return ms > 0 ? ms : 0;
+}
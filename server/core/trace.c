@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file trace.c - Sampled tracing of the stages of the request pipeline
+ *
+ * The time-stamp counter is calibrated against the monotonic clock when the
+ * tracing is initialized. The counters of the processors are assumed to be
+ * synchronized, as they are on processors with an invariant TSC, because the
+ * stages of one query can run on different threads.
+ *
+ * The events are written to the ring buffer of the thread without locking. A
+ * dump that is taken while queries are traced can contain an event that was
+ * being overwritten.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/2016   MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dcb.h>
+#include <resultset.h>
+#include <spinlock.h>
+#include <statistics.h>
+#include <maxconfig.h>
+#include <platform.h>
+#include <log_manager.h>
+
+/** The calibration measures the counter for this long */
+#define TRACE_CALIBRATION_US 20000
+
+/** One recorded stage of a traced query */
+typedef struct trace_event
+{
+    CYCLES   start;    /**< Counter value when the stage started */
+    CYCLES   duration; /**< Duration of the stage in counter cycles */
+    uint64_t session;  /**< Id of the session */
+    uint32_t stage;    /**< The stage, a trace_stage_t */
+} TRACE_EVENT;
+
+typedef struct trace_ring
+{
+    uint64_t    n_events;                 /**< Number of events ever written */
+    TRACE_EVENT events[TRACE_RING_SIZE];
+} __attribute__((aligned(TS_STATS_CACHE_LINE))) TRACE_RING;
+
+int trace_sample_rate = 0;
+
+static const char *stage_names[TRACE_N_STAGES] =
+{
+    "client", "filters", "classify", "route", "write", "backend", "reply"
+};
+
+static TRACE_RING *rings = NULL;   /**< thread_count rings followed by the shared ring */
+static int n_threads = 0;
+static SPINLOCK shared_lock = SPINLOCK_INIT;
+static TS_LATENCY *stage_latency[TRACE_N_STAGES]; /**< Stage durations in nanoseconds */
+static double cycles_per_ns = 1.0;
+static CYCLES base_cycles = 0;
+static thread_local int sample_counter = 0;
+
+static uint64_t trace_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Initialize the tracing
+ *
+ * The statistics must be initialized before this is called. Tracing stays
+ * disabled if the trace_sample_rate parameter is not set or if memory
+ * allocation fails.
+ */
+void trace_init()
+{
+    int rate = config_trace_sample_rate();
+
+    if (rate == 0)
+    {
+        return;
+    }
+
+    n_threads = config_threadcount();
+
+    if (posix_memalign((void**)&rings, TS_STATS_CACHE_LINE,
+                       (n_threads + 1) * sizeof(TRACE_RING)) != 0)
+    {
+        MXS_ERROR("Failed to allocate the trace buffers, tracing is disabled.");
+        rings = NULL;
+        return;
+    }
+
+    memset(rings, 0, (n_threads + 1) * sizeof(TRACE_RING));
+
+    for (int i = 0; i < TRACE_N_STAGES; i++)
+    {
+        if ((stage_latency[i] = ts_latency_alloc()) == NULL)
+        {
+            MXS_ERROR("Failed to allocate the trace statistics, tracing is disabled.");
+            return;
+        }
+    }
+
+    uint64_t ns = trace_clock_ns();
+    CYCLES cycles = rdtsc();
+    usleep(TRACE_CALIBRATION_US);
+    CYCLES elapsed = rdtsc() - cycles;
+    ns = trace_clock_ns() - ns;
+
+    cycles_per_ns = ns && elapsed ? (double)elapsed / ns : 1.0;
+    base_cycles = rdtsc();
+    trace_sample_rate = rate;
+
+    MXS_NOTICE("Tracing one query in %d, time-stamp counter at %.3f GHz.", rate, cycles_per_ns);
+}
+
+/**
+ * Decide whether the query that is read next is traced
+ *
+ * @param trace The trace of the session
+ */
+void trace_sample(TRACE_STATE *trace)
+{
+    if (trace->stage_start && trace->stage == TRACE_CLIENT)
+    {
+        trace->stage_start = rdtsc();
+    }
+    else
+    {
+        /** A query that is still traced had no reply or was pipelined */
+        trace->stage_start = 0;
+
+        if (++sample_counter >= trace_sample_rate)
+        {
+            sample_counter = 0;
+            trace->stage = TRACE_CLIENT;
+            trace->stage_start = rdtsc();
+        }
+    }
+}
+
+/**
+ * Record the current stage of a traced query
+ *
+ * @param trace   The trace of the session
+ * @param session Id of the session
+ * @param next    The next stage
+ * @param end     True if this was the last stage of the query
+ */
+void trace_record(TRACE_STATE *trace, uint64_t session, trace_stage_t next, bool end)
+{
+    CYCLES now = rdtsc();
+    CYCLES start = trace->stage_start;
+    trace_stage_t stage = trace->stage;
+
+    if (start == 0 || stage >= TRACE_N_STAGES)
+    {
+        return;
+    }
+
+    CYCLES duration = now > start ? now - start : 0;
+    int thread = ts_stats_get_thread_id();
+    bool shared = thread < 0;
+    TRACE_RING *ring = &rings[shared ? n_threads : thread];
+
+    if (shared)
+    {
+        spinlock_acquire(&shared_lock);
+    }
+
+    TRACE_EVENT *event = &ring->events[ring->n_events % TRACE_RING_SIZE];
+    event->start = start;
+    event->duration = duration;
+    event->session = session;
+    event->stage = stage;
+    ring->n_events++;
+
+    if (shared)
+    {
+        spinlock_release(&shared_lock);
+    }
+
+    ts_latency_add(stage_latency[stage], duration / cycles_per_ns);
+
+    if (end)
+    {
+        trace->stage_start = 0;
+    }
+    else
+    {
+        trace->stage = next;
+        trace->stage_start = now ? now : 1;
+    }
+}
+
+/**
+ * Print the recorded events in the Trace Event Format
+ *
+ * The output can be loaded into trace viewers such as chrome://tracing. The
+ * events of each thread are shown on a row of their own.
+ *
+ * @param dcb DCB to print to
+ */
+void dprintTrace(DCB *dcb)
+{
+    bool first = true;
+
+    dcb_printf(dcb, "{\"traceEvents\": [");
+
+    for (int t = 0; rings && t <= n_threads; t++)
+    {
+        TRACE_RING *ring = &rings[t];
+        uint64_t end = ring->n_events;
+        uint64_t start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+
+        for (uint64_t i = start; i < end; i++)
+        {
+            TRACE_EVENT event = ring->events[i % TRACE_RING_SIZE];
+            double ts = event.start > base_cycles ?
+                        (event.start - base_cycles) / cycles_per_ns / 1000.0 : 0;
+
+            dcb_printf(dcb, "%s\n{\"name\": \"%s\", \"cat\": \"query\", \"ph\": \"X\", "
+                       "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, "
+                       "\"args\": {\"session\": %lu}}", first ? "" : ",",
+                       event.stage < TRACE_N_STAGES ? stage_names[event.stage] : "unknown",
+                       ts, event.duration / cycles_per_ns / 1000.0, t, event.session);
+            first = false;
+        }
+    }
+
+    dcb_printf(dcb, "\n], \"displayTimeUnit\": \"ns\"}\n");
+}
+
+/**
+ * Provide a row to the result set of the stage statistics
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+traceStageRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    TS_LATENCY_SNAPSHOT snapshot;
+    RESULT_ROW *row;
+    char buf[40];
+
+    if (*rowno >= TRACE_N_STAGES || stage_latency[*rowno] == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+
+    ts_latency_snapshot(stage_latency[*rowno], &snapshot);
+    row = resultset_make_row(set);
+    resultset_row_set(row, 0, (char*)stage_names[*rowno]);
+    snprintf(buf, sizeof(buf), "%lu", snapshot.count);
+    resultset_row_set(row, 1, buf);
+    snprintf(buf, sizeof(buf), "%.3f", snapshot.total / 1000000.0);
+    resultset_row_set(row, 2, buf);
+    snprintf(buf, sizeof(buf), "%.3f", snapshot.count ? snapshot.total / 1000.0 / snapshot.count : 0);
+    resultset_row_set(row, 3, buf);
+    snprintf(buf, sizeof(buf), "%.3f", ts_latency_percentile(&snapshot, 0.50) / 1000.0);
+    resultset_row_set(row, 4, buf);
+    snprintf(buf, sizeof(buf), "%.3f", ts_latency_percentile(&snapshot, 0.99) / 1000.0);
+    resultset_row_set(row, 5, buf);
+    snprintf(buf, sizeof(buf), "%.3f", snapshot.max / 1000.0);
+    resultset_row_set(row, 6, buf);
+    (*rowno)++;
+
+    return row;
+}
+
+/**
+ * Return a result set with the time spent in each stage by the traced queries
+ *
+ * @return A result set, empty if tracing is disabled
+ */
+RESULTSET *
+traceGetStageList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(traceStageRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Stage", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Count", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Total (ms)", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Average (us)", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p50 (us)", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "p99 (us)", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Max (us)", 10, COL_TYPE_VARCHAR);
+
+    return set;
+}
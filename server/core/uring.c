@@ -0,0 +1,574 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file uring.c  - The io_uring I/O engine
+ *
+ * A polling thread that drains a write queue prepares a send of the buffers
+ * in its own submission queue instead of calling writev. Only the owning
+ * thread touches the submission queue, so it is not locked. The sends are
+ * non-blocking: a send to a full socket completes with EAGAIN and the rest
+ * of the write queue waits for EPOLLOUT as it does with the epoll engine.
+ *
+ * The completion queue is polled in epoll like a socket, so any thread may
+ * reap it. The reaping and the free list of the send slots are protected by
+ * the lock of the ring. The completions are copied out before they are
+ * handled, as handling one may prepare the next send of the DCB.
+ *
+ * At most URING_ENTRIES sends are in flight per ring and the completion
+ * queue is twice as large, so the completion queue never overflows.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <uring.h>
+#include <dcb.h>
+#include <buffer.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <maxscale/poll.h>
+#include <log_manager.h>
+#include <skygw_utils.h>
+
+#if defined(HAVE_LINUX_IO_URING)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/** Number of submission queue entries and send slots in a ring */
+#define URING_ENTRIES 256
+
+/** Maximum number of buffers in one send */
+#define URING_MAX_IOV 64
+
+/** Number of completions copied out of the ring at a time */
+#define URING_MAX_REAP 64
+
+/** Buffers in files are sent with sendfile by the epoll engine */
+#define URING_SENDFILE_MIN_LEN 16384
+
+/** A send in flight */
+typedef struct uring_send
+{
+    DCB               *dcb;       /*< The DCB, kept from being freed while the send is in flight */
+    GWBUF             *queue;     /*< The write queue the send is from */
+    struct msghdr      msg;       /*< The message given to the kernel */
+    struct iovec       iov[URING_MAX_IOV];
+    struct uring_send *next_free; /*< Next free slot */
+} URING_SEND;
+
+/** The ring of a polling thread */
+typedef struct uring
+{
+    int                  fd;          /*< The io_uring instance */
+    SPINLOCK             lock;        /*< Protects the completion queue and free_sends */
+    unsigned            *sq_head;     /*< Submission queue, written by the owning thread */
+    unsigned            *sq_tail;
+    unsigned             sq_mask;
+    unsigned             sq_entries;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned            *cq_head;     /*< Completion queue, reaped by any thread */
+    unsigned            *cq_tail;
+    unsigned             cq_mask;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;     /*< The mapped memory */
+    size_t               sq_ring_size;
+    void                *cq_ring;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+    URING_SEND          *sends;       /*< The send slots */
+    URING_SEND          *free_sends;  /*< The free send slots */
+    int64_t              n_sends;     /*< Sends prepared */
+    int64_t              n_submits;   /*< io_uring_enter calls */
+    int64_t              n_fallbacks; /*< Writes done with writev as the ring was full */
+} URING;
+
+static URING *rings = NULL; /*< The rings of the polling threads */
+static int n_rings = 0;     /*< No. of rings */
+
+static bool uring_setup(URING *ring);
+static void uring_free(URING *ring);
+
+/**
+ * Create the rings of the polling threads. If a ring can not be created,
+ * for example because the kernel is too old, no ring is used.
+ *
+ * @param n_threads Number of polling threads
+ * @return True if the rings were created
+ */
+bool
+uring_init(int n_threads)
+{
+    if (posix_memalign((void**)&rings, 64, n_threads * sizeof(URING)) != 0)
+    {
+        rings = NULL;
+        MXS_ERROR("Failed to allocate memory for the io_uring instances.");
+        return false;
+    }
+
+    memset(rings, 0, n_threads * sizeof(URING));
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        rings[i].fd = -1;
+    }
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        if (!uring_setup(&rings[i]))
+        {
+            for (int j = 0; j < n_threads; j++)
+            {
+                uring_free(&rings[j]);
+            }
+            free(rings);
+            rings = NULL;
+            return false;
+        }
+    }
+
+    n_rings = n_threads;
+    return true;
+}
+
+/**
+ * Create and map one ring
+ *
+ * @param ring The ring
+ * @return True if the ring was created
+ */
+static bool
+uring_setup(URING *ring)
+{
+    struct io_uring_params params;
+    char errbuf[STRERROR_BUFLEN];
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 2;
+    spinlock_init(&ring->lock);
+
+    if ((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) == -1)
+    {
+        MXS_ERROR("Failed to create an io_uring instance: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    /** The non-blocking sends are supported by the kernels that have this feature */
+    if ((params.features & IORING_FEAT_NODROP) == 0)
+    {
+        MXS_ERROR("The kernel does not support the io_uring features MaxScale uses.");
+        return false;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        MXS_ERROR("Failed to map the queues of an io_uring instance: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    if ((ring->sends = calloc(URING_ENTRIES, sizeof(URING_SEND))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the sends of an io_uring instance.");
+        return false;
+    }
+
+    for (int i = 0; i < URING_ENTRIES; i++)
+    {
+        ring->sends[i].next_free = ring->free_sends;
+        ring->free_sends = &ring->sends[i];
+    }
+
+    return true;
+}
+
+/**
+ * Unmap and close a ring that was partially or completely created
+ *
+ * @param ring The ring
+ */
+static void
+uring_free(URING *ring)
+{
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->fd != -1)
+    {
+        close(ring->fd);
+    }
+    free(ring->sends);
+}
+
+/**
+ * Check whether the io_uring engine is used
+ *
+ * @return True if the polling threads have rings
+ */
+bool
+uring_in_use()
+{
+    return rings != NULL;
+}
+
+/**
+ * Get the descriptor of a ring, which is readable when it has completions
+ *
+ * @param thread_id The polling thread
+ * @return The descriptor
+ */
+int
+uring_fd(int thread_id)
+{
+    return rings[thread_id].fd;
+}
+
+/**
+ * Get the epoll data pointer of the descriptor of a ring
+ *
+ * @param thread_id The polling thread
+ * @return The pointer that identifies the ring in the epoll events
+ */
+void *
+uring_event_ptr(int thread_id)
+{
+    return &rings[thread_id];
+}
+
+/**
+ * Check whether an epoll data pointer identifies a ring
+ *
+ * @param ptr The data pointer of an epoll event
+ * @return The polling thread of the ring or -1 if the pointer is not a ring
+ */
+int
+uring_event_thread(void *ptr)
+{
+    if (rings && (URING*)ptr >= rings && (URING*)ptr < rings + n_rings)
+    {
+        return (URING*)ptr - rings;
+    }
+
+    return -1;
+}
+
+/**
+ * Prepare the send of a write queue in the ring of the calling thread. The
+ * send is submitted by uring_submit and dcb_uring_write_done is called with
+ * the queue when it completes. The DCB must not have another send in flight.
+ *
+ * @param dcb   The DCB
+ * @param queue The write queue taken from the DCB
+ * @return True if the send was prepared, false if the caller writes the queue
+ */
+bool
+uring_write(DCB *dcb, GWBUF *queue)
+{
+    int thread_id = poll_current_thread();
+    int file_fd;
+    off_t offset;
+
+    if (rings == NULL || thread_id < 0 || thread_id >= n_rings || dcb->fd <= 0 ||
+        (GWBUF_LENGTH(queue) >= URING_SENDFILE_MIN_LEN &&
+         gwbuf_get_file_range(queue, &file_fd, &offset)))
+    {
+        return false;
+    }
+
+    URING *ring = &rings[thread_id];
+    unsigned tail = *ring->sq_tail;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        uring_submit(thread_id);
+
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        {
+            ring->n_fallbacks++;
+            return false;
+        }
+    }
+
+    spinlock_acquire(&ring->lock);
+    URING_SEND *send = ring->free_sends;
+    if (send)
+    {
+        ring->free_sends = send->next_free;
+    }
+    spinlock_release(&ring->lock);
+
+    if (send == NULL)
+    {
+        ring->n_fallbacks++;
+        return false;
+    }
+
+    int iovcnt = 0;
+
+    for (GWBUF *b = queue; b && iovcnt < URING_MAX_IOV; b = b->next)
+    {
+        if (GWBUF_LENGTH(b) >= URING_SENDFILE_MIN_LEN && gwbuf_get_file_range(b, &file_fd, &offset))
+        {
+            break;
+        }
+
+        if (GWBUF_LENGTH(b) > 0)
+        {
+            send->iov[iovcnt].iov_base = GWBUF_DATA(b);
+            send->iov[iovcnt].iov_len = GWBUF_LENGTH(b);
+            iovcnt++;
+        }
+    }
+
+    if (iovcnt == 0)
+    {
+        spinlock_acquire(&ring->lock);
+        send->next_free = ring->free_sends;
+        ring->free_sends = send;
+        spinlock_release(&ring->lock);
+        return false;
+    }
+
+    send->dcb = dcb;
+    send->queue = queue;
+    memset(&send->msg, 0, sizeof(send->msg));
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = iovcnt;
+
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = dcb->fd;
+    sqe->addr = (uintptr_t)&send->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)send;
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+
+    atomic_add(&dcb->uring_inflight, 1);
+    dcb->stats.n_writes++;
+    ring->n_sends++;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Submit the sends prepared by a polling thread. This is called by the
+ * thread itself once per iteration of the polling loop.
+ *
+ * @param thread_id The polling thread
+ */
+void
+uring_submit(int thread_id)
+{
+    URING *ring = &rings[thread_id];
+    unsigned pending = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (pending == 0)
+    {
+        return;
+    }
+
+    ring->n_submits++;
+
+    if (syscall(__NR_io_uring_enter, ring->fd, pending, 0, 0, NULL, 0) == -1 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to submit %u sends to io_uring: %d, %s", pending,
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+}
+
+/**
+ * Handle the completed sends of a ring. Any thread may call this.
+ *
+ * @param thread_id The polling thread of the ring
+ */
+void
+uring_complete(int thread_id)
+{
+    URING *ring = &rings[thread_id];
+    struct
+    {
+        DCB   *dcb;
+        GWBUF *queue;
+        int    res;
+    } done[URING_MAX_REAP];
+    int n_done;
+
+    do
+    {
+        n_done = 0;
+        spinlock_acquire(&ring->lock);
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail && n_done < URING_MAX_REAP)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            URING_SEND *send = (URING_SEND*)(uintptr_t)cqe->user_data;
+
+            done[n_done].dcb = send->dcb;
+            done[n_done].queue = send->queue;
+            done[n_done].res = cqe->res;
+            n_done++;
+
+            send->dcb = NULL;
+            send->queue = NULL;
+            send->next_free = ring->free_sends;
+            ring->free_sends = send;
+            head++;
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        spinlock_release(&ring->lock);
+
+        for (int i = 0; i < n_done; i++)
+        {
+            dcb_uring_write_done(done[i].dcb, done[i].queue, done[i].res);
+        }
+    }
+    while (n_done == URING_MAX_REAP);
+}
+
+/**
+ * Print the statistics of the rings
+ *
+ * @param pdcb The DCB to print to
+ */
+void
+uring_stats(DCB *pdcb)
+{
+    int64_t n_sends = 0;
+    int64_t n_submits = 0;
+    int64_t n_fallbacks = 0;
+
+    for (int i = 0; i < n_rings; i++)
+    {
+        n_sends += rings[i].n_sends;
+        n_submits += rings[i].n_submits;
+        n_fallbacks += rings[i].n_fallbacks;
+    }
+
+    dcb_printf(pdcb, "No. of io_uring sends:                         %ld\n", n_sends);
+    dcb_printf(pdcb, "No. of io_uring submissions:                   %ld\n", n_submits);
+    dcb_printf(pdcb, "No. of writes done without io_uring:           %ld\n", n_fallbacks);
+}
+
+#else
+
+bool
+uring_init(int n_threads)
+{
+    MXS_ERROR("MaxScale was built without io_uring support.");
+    return false;
+}
+
+bool
+uring_in_use()
+{
+    return false;
+}
+
+int
+uring_fd(int thread_id)
+{
+    return -1;
+}
+
+void *
+uring_event_ptr(int thread_id)
+{
+    return NULL;
+}
+
+int
+uring_event_thread(void *ptr)
+{
+    return -1;
+}
+
+bool
+uring_write(DCB *dcb, GWBUF *queue)
+{
+    return false;
+}
+
+void
+uring_submit(int thread_id)
+{
+}
+
+void
+uring_complete(int thread_id)
+{
+}
+
+void
+uring_stats(DCB *pdcb)
+{
+}
+
+#endif /* HAVE_LINUX_IO_URING */
@@ -0,0 +1,608 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file usage.c  - Accounting of the resources used by each user of a service
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * 14/10/16     MariaDB Corporation     Count into the shared per-thread counter blocks
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <usage.h>
+#include <platform.h>
+#include <spinlock.h>
+#include <counter_blocks.h>
+#include <hashtable.h>
+#include <rdtsc.h>
+#include <dcb.h>
+#include <service.h>
+#include <metrics.h>
+#include <log_manager.h>
+
+/** Number of keys in a chunk of counters */
+#define USAGE_CHUNK_KEYS 256
+
+/** Number of chunks needed for all keys */
+#define USAGE_N_CHUNKS (USAGE_MAX_KEYS / USAGE_CHUNK_KEYS)
+
+#if USAGE_N_CHUNKS > COUNTER_BLOCK_MAX_CHUNKS
+#error The counters of all keys do not fit in a counter block
+#endif
+
+/** Size of the hashtable of the keys */
+#define USAGE_KEYS_HASH_SIZE 256
+
+/** How long the time-stamp counter is calibrated, in microseconds */
+#define USAGE_CALIBRATION_US 20000
+
+/**
+ * The service and the user of a key
+ */
+typedef struct usage_key
+{
+    SERVICE *service;
+    char *user;
+} USAGE_KEY;
+
+static USAGE_KEY keys[USAGE_MAX_KEYS];          /*< The service and user of each key */
+static int n_keys = 0;                          /*< Number of keys given out */
+static HASHTABLE *key_hash = NULL;              /*< Keys by service and user */
+static SPINLOCK keys_lock = SPINLOCK_INIT;      /*< Protects the keys */
+static bool keys_full_logged = false;
+
+/** The counters of a key are consecutive, a chunk holds the counters of
+ * USAGE_CHUNK_KEYS keys */
+static COUNTER_BLOCKS counters = COUNTER_BLOCKS_INIT(USAGE_CHUNK_KEYS * USAGE_N_COUNTERS,
+                                                     USAGE_N_CHUNKS);
+static thread_local COUNTER_BLOCK *thread_block = NULL;
+
+static double cycles_per_ns = 1.0;
+
+static uint64_t usage_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Initialize the accounting. The time-stamp counter is calibrated against the
+ * monotonic clock so that the times can be shown in real units.
+ */
+void
+usage_init()
+{
+    uint64_t ns = usage_clock_ns();
+    CYCLES cycles = rdtsc();
+    usleep(USAGE_CALIBRATION_US);
+    CYCLES elapsed = rdtsc() - cycles;
+    ns = usage_clock_ns() - ns;
+
+    cycles_per_ns = ns && elapsed ? (double)elapsed / ns : 1.0;
+}
+
+/**
+ * Convert time-stamp counter cycles to microseconds
+ *
+ * @param cycles The cycles
+ * @return The microseconds
+ */
+uint64_t
+usage_cycles_to_us(uint64_t cycles)
+{
+    return cycles / cycles_per_ns / 1000.0;
+}
+
+/**
+ * Find or create the key of a service and user pair
+ *
+ * @param service The service
+ * @param user    The user
+ * @return The key or USAGE_KEY_NONE if all keys are in use or memory
+ * allocation failed
+ */
+static int
+usage_find_key(SERVICE *service, const char *user)
+{
+    char name[strlen(user) + 32];
+    int key = USAGE_KEY_NONE;
+
+    snprintf(name, sizeof(name), "%p %s", service, user);
+
+    spinlock_acquire(&keys_lock);
+
+    if (key_hash == NULL &&
+        (key_hash = hashtable_alloc(USAGE_KEYS_HASH_SIZE, simple_str_hash, strcmp)) != NULL)
+    {
+        hashtable_memory_fns(key_hash, (HASHMEMORYFN)strdup, NULL, (HASHMEMORYFN)free, NULL);
+    }
+
+    /** The value is the key plus one so that no entry is NULL */
+    intptr_t value = key_hash ? (intptr_t)hashtable_fetch(key_hash, name) : 0;
+
+    if (value)
+    {
+        key = value - 1;
+    }
+    else if (key_hash && n_keys < USAGE_MAX_KEYS)
+    {
+        char *copy = strdup(user);
+
+        if (copy && hashtable_add(key_hash, name, (void *)(intptr_t)(n_keys + 1)))
+        {
+            key = n_keys;
+            keys[key].service = service;
+            keys[key].user = copy;
+            /** Readers see the key only after its service and user */
+            __sync_synchronize();
+            n_keys++;
+        }
+        else
+        {
+            free(copy);
+        }
+    }
+    else if (key_hash && !keys_full_logged)
+    {
+        keys_full_logged = true;
+        MXS_WARNING("The resources of more than %d service and user pairs can not be "
+                    "accounted, the usage of the new users is not counted.", USAGE_MAX_KEYS);
+    }
+
+    spinlock_release(&keys_lock);
+
+    return key;
+}
+
+/**
+ * Resolve the key of a session. The key stays unknown until the user of the
+ * session is known.
+ *
+ * @param session The session
+ * @return The key of the session, USAGE_KEY_UNKNOWN or USAGE_KEY_NONE
+ */
+int
+usage_session_key(SESSION *session)
+{
+    if (session->usage_key == USAGE_KEY_UNKNOWN &&
+        session->service && session->state != SESSION_STATE_DUMMY)
+    {
+        char *user = session_getUser(session);
+
+        if (user && *user)
+        {
+            session->usage_key = usage_find_key(session->service, user);
+        }
+    }
+
+    return session->usage_key;
+}
+
+/**
+ * Count the use of a resource
+ *
+ * @param key     The key of the service and user
+ * @param counter The resource
+ * @param value   The amount used
+ */
+void
+usage_add_key(int key, usage_counter_t counter, uint64_t value)
+{
+    counter_blocks_add(&counters, &thread_block, key * USAGE_N_COUNTERS + counter, value);
+}
+
+/**
+ * Get the resources used by a service and user pair. The counters of the
+ * threads are read without locking them, so the values are approximate.
+ *
+ * @param key     The key
+ * @param service Where the service is stored
+ * @param user    Where the user is stored
+ * @param usage   Where the sums are stored
+ * @return True if the key is in use
+ */
+bool
+usage_get(int key, SERVICE **service, const char **user, USAGE *usage)
+{
+    int limit = n_keys;
+    __sync_synchronize();
+
+    if (key < 0 || key >= limit)
+    {
+        return false;
+    }
+
+    memset(usage, 0, sizeof(*usage));
+    counter_blocks_sum(&counters, key * USAGE_N_COUNTERS, USAGE_N_COUNTERS,
+                       (int64_t *)usage->counters);
+
+    *service = keys[key].service;
+    *user = keys[key].user;
+
+    return true;
+}
+
+/**
+ * The totals of one service
+ */
+typedef struct usage_service
+{
+    SERVICE *service;
+    int n_users;
+    USAGE usage;
+} USAGE_SERVICE;
+
+/**
+ * Sum the usage of the users of each service that has been accounted
+ *
+ * @param n_services Where the number of services is stored
+ * @return The totals of the services, NULL if memory allocation failed or no
+ * service has been accounted. The caller must free the array.
+ */
+static USAGE_SERVICE *
+usage_get_services(int *n_services)
+{
+    USAGE_SERVICE *services = NULL;
+    int n = 0;
+    SERVICE *service;
+    const char *user;
+    USAGE usage;
+
+    for (int key = 0; usage_get(key, &service, &user, &usage); key++)
+    {
+        int i = 0;
+
+        while (i < n && services[i].service != service)
+        {
+            i++;
+        }
+
+        if (i == n)
+        {
+            USAGE_SERVICE *tmp = realloc(services, (n + 1) * sizeof(USAGE_SERVICE));
+
+            if (tmp == NULL)
+            {
+                break;
+            }
+
+            services = tmp;
+            memset(&services[n], 0, sizeof(USAGE_SERVICE));
+            services[n++].service = service;
+        }
+
+        services[i].n_users++;
+
+        for (int j = 0; j < USAGE_N_COUNTERS; j++)
+        {
+            services[i].usage.counters[j] += usage.counters[j];
+        }
+    }
+
+    *n_services = n;
+    return services;
+}
+
+/**
+ * Return the proxy time per query in microseconds
+ *
+ * @param usage The usage
+ * @return The proxy time per query, 0 if there were no queries
+ */
+static double
+usage_proxy_us_per_query(const USAGE *usage)
+{
+    return usage->counters[USAGE_QUERIES] ?
+           (double)usage_cycles_to_us(usage->counters[USAGE_PROXY_CYCLES]) /
+           usage->counters[USAGE_QUERIES] : 0;
+}
+
+/**
+ * Print one line of usage
+ *
+ * @param dcb   The DCB to print to
+ * @param name  The name of the line
+ * @param usage The usage
+ */
+static void
+usage_print_line(DCB *dcb, const char *name, const USAGE *usage)
+{
+    dcb_printf(dcb, " %-30s | %10lu | %12lu | %12lu | %10lu | %10lu | %.1f\n", name,
+               usage->counters[USAGE_QUERIES],
+               usage->counters[USAGE_BYTES_IN],
+               usage->counters[USAGE_BYTES_OUT],
+               usage_cycles_to_us(usage->counters[USAGE_BACKEND_CYCLES]) / 1000,
+               usage_cycles_to_us(usage->counters[USAGE_PROXY_CYCLES]) / 1000,
+               usage_proxy_us_per_query(usage));
+}
+
+/**
+ * Print the header of a usage table
+ *
+ * @param dcb   The DCB to print to
+ * @param name  The title of the first column
+ */
+static void
+usage_print_header(DCB *dcb, const char *name)
+{
+    const char *line = "--------------------------------+------------+--------------"
+                       "+--------------+------------+------------+----------\n";
+
+    dcb_printf(dcb, "%s", line);
+    dcb_printf(dcb, " %-30s | %10s | %12s | %12s | %10s | %10s | %s\n", name, "Queries",
+               "Bytes In", "Bytes Out", "Backend ms", "Proxy ms", "Proxy us/query");
+    dcb_printf(dcb, "%s", line);
+}
+
+/**
+ * Print the resources used by the services and by their users
+ *
+ * @param dcb The DCB to print to
+ */
+void
+dShowUsage(DCB *dcb)
+{
+    int n_services;
+    USAGE_SERVICE *services = usage_get_services(&n_services);
+    SERVICE *service;
+    const char *user;
+    USAGE usage;
+    char name[60];
+
+    dcb_printf(dcb, "Resource usage by service\n");
+    usage_print_header(dcb, "Service");
+    for (int i = 0; i < n_services; i++)
+    {
+        usage_print_line(dcb, services[i].service->name, &services[i].usage);
+    }
+    free(services);
+
+    dcb_printf(dcb, "\nResource usage by user\n");
+    usage_print_header(dcb, "Service/User");
+    for (int key = 0; usage_get(key, &service, &user, &usage); key++)
+    {
+        snprintf(name, sizeof(name), "%s/%s", service->name, user);
+        usage_print_line(dcb, name, &usage);
+    }
+    dcb_printf(dcb, "\n");
+}
+
+/**
+ * Set the usage columns of a result set row
+ *
+ * @param row   The row
+ * @param col   The first usage column
+ * @param usage The usage
+ */
+static void
+usage_row_set(RESULT_ROW *row, int col, const USAGE *usage)
+{
+    char buf[40];
+
+    snprintf(buf, sizeof(buf), "%lu", usage->counters[USAGE_QUERIES]);
+    resultset_row_set(row, col++, buf);
+    snprintf(buf, sizeof(buf), "%lu", usage->counters[USAGE_BYTES_IN]);
+    resultset_row_set(row, col++, buf);
+    snprintf(buf, sizeof(buf), "%lu", usage->counters[USAGE_BYTES_OUT]);
+    resultset_row_set(row, col++, buf);
+    snprintf(buf, sizeof(buf), "%lu", usage_cycles_to_us(usage->counters[USAGE_BACKEND_CYCLES]));
+    resultset_row_set(row, col++, buf);
+    snprintf(buf, sizeof(buf), "%lu", usage_cycles_to_us(usage->counters[USAGE_PROXY_CYCLES]));
+    resultset_row_set(row, col++, buf);
+    snprintf(buf, sizeof(buf), "%.1f", usage_proxy_us_per_query(usage));
+    resultset_row_set(row, col++, buf);
+}
+
+/**
+ * Add the usage columns to a result set
+ *
+ * @param set The result set
+ */
+static void
+usage_add_columns(RESULTSET *set)
+{
+    resultset_add_column(set, "Queries", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Bytes In", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Bytes Out", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Backend Time (us)", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Proxy Time (us)", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Proxy Time per Query (us)", 20, COL_TYPE_VARCHAR);
+}
+
+/**
+ * Provide a row to the result set of the usage by user
+ *
+ * @param set   The result set
+ * @param data  The key of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+usageRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    SERVICE *service;
+    const char *user;
+    USAGE usage;
+    RESULT_ROW *row;
+
+    if (!usage_get(*rowno, &service, &user, &usage))
+    {
+        free(data);
+        return NULL;
+    }
+
+    row = resultset_make_row(set);
+    resultset_row_set(row, 0, service->name);
+    resultset_row_set(row, 1, (char *)user);
+    usage_row_set(row, 2, &usage);
+    (*rowno)++;
+
+    return row;
+}
+
+/**
+ * Return a result set with the resources used by each user of each service
+ *
+ * @return The result set or NULL on error
+ */
+RESULTSET *
+usageGetList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(usageRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Service", 40, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "User", 40, COL_TYPE_VARCHAR);
+    usage_add_columns(set);
+
+    return set;
+}
+
+/**
+ * The state of the result set of the usage by service
+ */
+typedef struct
+{
+    USAGE_SERVICE *services;
+    int n_services;
+    int rowno;
+} USAGE_SERVICE_ROWS;
+
+/**
+ * Provide a row to the result set of the usage by service
+ *
+ * @param set   The result set
+ * @param data  The totals of the services and the index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+usageServiceRowCallback(RESULTSET *set, void *data)
+{
+    USAGE_SERVICE_ROWS *rows = (USAGE_SERVICE_ROWS *)data;
+    RESULT_ROW *row;
+    char buf[20];
+
+    if (rows->rowno >= rows->n_services)
+    {
+        free(rows->services);
+        free(rows);
+        return NULL;
+    }
+
+    USAGE_SERVICE *service = &rows->services[rows->rowno++];
+    row = resultset_make_row(set);
+    resultset_row_set(row, 0, service->service->name);
+    snprintf(buf, sizeof(buf), "%d", service->n_users);
+    resultset_row_set(row, 1, buf);
+    usage_row_set(row, 2, &service->usage);
+
+    return row;
+}
+
+/**
+ * Return a result set with the resources used by each service
+ *
+ * @return The result set or NULL on error
+ */
+RESULTSET *
+usageGetServiceList()
+{
+    RESULTSET *set;
+    USAGE_SERVICE_ROWS *data;
+
+    if ((data = (USAGE_SERVICE_ROWS *)malloc(sizeof(USAGE_SERVICE_ROWS))) == NULL)
+    {
+        return NULL;
+    }
+    data->services = usage_get_services(&data->n_services);
+    data->rowno = 0;
+    if ((set = resultset_create(usageServiceRowCallback, data)) == NULL)
+    {
+        free(data->services);
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Service", 40, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Users", 20, COL_TYPE_VARCHAR);
+    usage_add_columns(set);
+
+    return set;
+}
+
+/**
+ * Render the resources used by each user of each service as metrics
+ *
+ * @param metrics The metrics
+ */
+void
+usage_metrics(METRICS *metrics)
+{
+    static const struct
+    {
+        const char *name;
+        const char *help;
+    } families[USAGE_N_COUNTERS] =
+    {
+        {"maxscale_user_queries_total", "Queries routed for the user"},
+        {"maxscale_user_received_bytes_total", "Bytes read from the clients of the user"},
+        {"maxscale_user_sent_bytes_total", "Bytes written to the clients of the user"},
+        {"maxscale_user_backend_microseconds_total", "Time the backends executed the queries of the user"},
+        {"maxscale_user_proxy_microseconds_total", "Time MaxScale processed the events of the user"}
+    };
+    char name[METRICS_LABEL_LEN];
+    char user_name[METRICS_LABEL_LEN];
+    char labels[2 * METRICS_LABEL_LEN + 32];
+    SERVICE *service;
+    const char *user;
+    USAGE usage;
+
+    for (int i = 0; i < USAGE_N_COUNTERS; i++)
+    {
+        metrics_family(metrics, families[i].name, METRICS_COUNTER, families[i].help);
+
+        for (int key = 0; usage_get(key, &service, &user, &usage); key++)
+        {
+            uint64_t value = usage.counters[i];
+
+            if (i == USAGE_BACKEND_CYCLES || i == USAGE_PROXY_CYCLES)
+            {
+                value = usage_cycles_to_us(value);
+            }
+
+            snprintf(labels, sizeof(labels), "service=\"%s\",user=\"%s\"",
+                     metrics_escape(service->name, name, sizeof(name)),
+                     metrics_escape(user, user_name, sizeof(user_name)));
+            metrics_value(metrics, families[i].name, labels, value);
+        }
+    }
+}
@@ -82,6 +82,10 @@ users_free(USERS *users)
     {
         hashtable_free(users->data);
     }
+    if (users->index && users->usersIndexFree)
+    {
+        users->usersIndexFree(users->index);
+    }
     free(users);
 }
 
@@ -26,9 +26,27 @@
  * @endverbatim
  */
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
-extern "C" int atomic_add(int *variable, int value);
-#else
+extern "C" {
+#endif
+
 extern int atomic_add(int *variable, int value);
+extern int64_t atomic_add_int64(int64_t *variable, int64_t value);
+extern int64_t atomic_load_int64(int64_t *variable);
+extern void atomic_store_int64(int64_t *variable, int64_t value);
+extern uint32_t atomic_or_uint32(uint32_t *variable, uint32_t value);
+extern uint32_t atomic_swap_uint32(uint32_t *variable, uint32_t value);
+extern bool atomic_cas_int(int *variable, int expected, int value);
+extern bool atomic_cas_int64(int64_t *variable, int64_t expected, int64_t value);
+extern void *atomic_swap_ptr(void **variable, void *value);
+extern bool atomic_cas_ptr(void **variable, void *expected, void *value);
+extern void *atomic_load_ptr(void **variable);
+extern void atomic_store_ptr(void **variable, void *value);
+
+#ifdef __cplusplus
+}
 #endif
 #endif
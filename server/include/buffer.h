@@ -47,6 +47,7 @@
 #include <hint.h>
 #include <spinlock.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 EXTERN_C_BLOCK_BEGIN
 
@@ -91,8 +92,27 @@ typedef struct
 {
     unsigned char   *data;                  /*< Physical memory that was allocated */
     int             refcount;               /*< Reference count on the buffer */
+    int             size_class;             /*< Pool size class, -1 if not pooled,
+                                             *  GWBUF_EXTERNAL_DATA if not owned */
+    unsigned int    size;                   /*< Size of the data area */
 } SHARED_BUF;
 
+/**
+ * Statistics of the buffer pools, summed over all threads
+ */
+/*< The size class of a shared buffer that refers to data owned by someone else */
+#define GWBUF_EXTERNAL_DATA     -2
+
+typedef struct
+{
+    uint64_t        alloc_pooled;           /*< Allocations served from a pool */
+    uint64_t        alloc_system;           /*< Allocations done with malloc */
+    uint64_t        free_pooled;            /*< Blocks returned to a pool */
+    uint64_t        free_system;            /*< Blocks returned with free */
+    uint64_t        cached_bytes;           /*< Bytes currently cached in the pools */
+    int             n_pools;                /*< Number of thread pools */
+} GWBUF_POOL_STATS;
+
 typedef enum
 {
     GWBUF_INFO_NONE         = 0x0,
@@ -109,7 +129,9 @@ typedef enum
  */
 typedef enum
 {
-    GWBUF_PARSING_INFO
+    GWBUF_PARSING_INFO,
+    GWBUF_QC_CANONICAL,
+    GWBUF_SQL_COPY
 } bufobj_id_t;
 
 typedef struct buffer_object_st buffer_object_t;
@@ -184,6 +206,10 @@ typedef struct gwbuf
  */
 extern GWBUF            *gwbuf_alloc(unsigned int size);
 extern GWBUF            *gwbuf_alloc_and_load(unsigned int size, void *data);
+extern GWBUF            *gwbuf_alloc_external(unsigned int size, void *data,
+                                              void (*release)(void *), void *arg);
+extern bool             gwbuf_set_file(GWBUF *buf, int fd, off_t offset);
+extern bool             gwbuf_get_file_range(GWBUF *buf, int *fd, off_t *offset);
 extern void             gwbuf_free(GWBUF *buf);
 extern GWBUF            *gwbuf_clone(GWBUF *buf);
 extern GWBUF            *gwbuf_append(GWBUF *head, GWBUF *tail);
@@ -202,6 +228,7 @@ extern int              gwbuf_add_property(GWBUF *buf, char *name, char *value);
 extern char             *gwbuf_get_property(GWBUF *buf, char *name);
 extern GWBUF            *gwbuf_make_contiguous(GWBUF *);
 extern int              gwbuf_add_hint(GWBUF *, HINT *);
+extern void             gwbuf_get_pool_stats(GWBUF_POOL_STATS *stats);
 
 void                    gwbuf_add_buffer_object(GWBUF* buf,
                                                 bufobj_id_t id,
@@ -0,0 +1,117 @@
+#ifndef _COUNTER_BLOCKS_H
+#define _COUNTER_BLOCKS_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file counter_blocks.h  - Per-thread blocks of counters
+ *
+ * Each thread that counts is given a block of counters of its own the first
+ * time it counts, so counting takes no locks. The counters of a block are in
+ * chunks that are allocated when a counter of the chunk is first counted,
+ * counters that are indexed by a sparse key only use memory for the chunks
+ * in use. The blocks are never freed, the block of a thread that exits keeps
+ * its counts.
+ *
+ * A thread whose block can not be allocated counts into a shared block with
+ * atomic operations. The sums are read without locking the blocks, so they
+ * are approximate.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdint.h>
+#include <spinlock.h>
+#include <atomic.h>
+
+/** Maximum number of chunks in a block */
+#define COUNTER_BLOCK_MAX_CHUNKS 256
+
+/**
+ * The counters of one thread
+ */
+typedef struct counter_block
+{
+    int64_t *chunks[COUNTER_BLOCK_MAX_CHUNKS];  /*< The chunks, NULL until used */
+    struct counter_block *next;                 /*< The next block */
+} COUNTER_BLOCK;
+
+/**
+ * A set of counters that each thread counts into a block of its own
+ */
+typedef struct counter_blocks
+{
+    int chunk_counters;         /*< Number of counters in a chunk */
+    int n_chunks;               /*< Number of chunks in a block */
+    SPINLOCK lock;              /*< Protects blocks */
+    COUNTER_BLOCK *blocks;      /*< The blocks of all threads */
+    COUNTER_BLOCK shared;       /*< Used with atomic operations when a block
+                                 * can not be allocated */
+} COUNTER_BLOCKS;
+
+/**
+ * Static initializer of a set of counters
+ *
+ * @param chunk_counters Number of counters in a chunk
+ * @param n_chunks       Number of chunks, at most COUNTER_BLOCK_MAX_CHUNKS
+ */
+#define COUNTER_BLOCKS_INIT(chunk_counters, n_chunks) {chunk_counters, n_chunks, SPINLOCK_INIT}
+
+extern COUNTER_BLOCK *counter_blocks_thread(COUNTER_BLOCKS *cb, COUNTER_BLOCK **thread_block);
+extern int64_t *counter_blocks_chunk(COUNTER_BLOCKS *cb, COUNTER_BLOCK *block, int chunk);
+extern void counter_blocks_sum(COUNTER_BLOCKS *cb, int counter, int n, int64_t *sums);
+
+/**
+ * Add to a counter
+ *
+ * The caller keeps the block of each thread in a thread_local pointer that
+ * is NULL until the thread first counts.
+ *
+ * @param cb           The counters
+ * @param thread_block The block of the calling thread
+ * @param counter      The counter
+ * @param value        The value to add
+ */
+static inline void counter_blocks_add(COUNTER_BLOCKS *cb, COUNTER_BLOCK **thread_block,
+                                      int counter, int64_t value)
+{
+    COUNTER_BLOCK *block = *thread_block ? *thread_block : counter_blocks_thread(cb, thread_block);
+    int64_t *chunk = counter_blocks_chunk(cb, block, counter / cb->chunk_counters);
+
+    if (chunk == NULL && block != &cb->shared)
+    {
+        block = &cb->shared;
+        chunk = counter_blocks_chunk(cb, block, counter / cb->chunk_counters);
+    }
+
+    if (chunk == NULL)
+    {
+        return;
+    }
+
+    if (block == &cb->shared)
+    {
+        atomic_add_int64(&chunk[counter % cb->chunk_counters], value);
+    }
+    else
+    {
+        chunk[counter % cb->chunk_counters] += value;
+    }
+}
+
+#endif
@@ -70,6 +70,7 @@ extern int load_mysql_users(SERVICE *service);
 extern int mysql_users_add(USERS *users, MYSQL_USER_HOST *key, char *auth);
 extern USERS *mysql_users_alloc();
 extern char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key);
+extern char *mysql_users_find(USERS *users, MYSQL_USER_HOST *key, bool localhost_match_any);
 extern int reload_mysql_users(SERVICE *service);
 extern int replace_mysql_users(SERVICE *service);
 
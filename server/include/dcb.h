@@ -12,6 +12,7 @@
  * of this software will be governed by version 2 or later of the General
  * Public License.
  */
+#include <stdint.h>
 #include <spinlock.h>
 #include <buffer.h>
 #include <gw_protocol.h>
@@ -26,6 +27,7 @@
 
 struct session;
 struct server;
+struct server_persistent_pool;
 struct service;
 struct servlistener;
 
@@ -57,6 +59,11 @@ struct servlistener;
  * 19/06/2015   Martin Brampton         Provision of persistent connections
  * 20/01/2016   Martin Brampton         Moved GWPROTOCOL to gw_protocol.h
  * 01/02/2016   Martin Brampton         Added fields for SSL and authentication
+ * 14/10/2016   MariaDB Corporation     Zombies are reclaimed by epochs
+ * 14/10/2016   MariaDB Corporation     Added the listening sockets of the threads
+ * 14/10/2016   MariaDB Corporation     Added the kernel TLS flag
+ * 14/10/2016   MariaDB Corporation     Added the state of offloaded SSL handshakes
+ * 14/10/2016   MariaDB Corporation     Added the count of io_uring sends in flight
  *
  * @endverbatim
  */
@@ -75,6 +82,9 @@ struct dcb;
  *      eventqlock              Spinlock to protect this structure
  *      inserted                Insertion time for logging purposes
  *      started                 Time that the processign started
+ *      handoff_next            The next DCB in the handoff list of the owning thread
+ *      handoff_events          Events handed off by other threads, not yet queued
+ *      handoff_queued          Flag to indicate the DCB is in a handoff list
  */
 typedef struct
 {
@@ -86,6 +96,9 @@ typedef struct
     SPINLOCK        eventqlock;
     unsigned long   inserted;
     unsigned long   started;
+    struct  dcb     *handoff_next;
+    uint32_t        handoff_events;
+    int             handoff_queued;
 } DCBEVENTQ;
 
 #define DCBFD_CLOSED -1
@@ -115,15 +128,16 @@ typedef struct dcbstats
  * processing an event that will access the DCB.
  *
  * We solve this issue by making the dcb_free routine merely mark a DCB as a zombie and
- * place it on a special zombie list. Before placing the DCB on the zombie list we create
- * a bitmask with a bit set in it for each active polling thread. Each thread will call
- * a routine to process the zombie list at the end of the polling loop. This routine
- * will clear the bit value that corresponds to the calling thread. Once the bitmask
- * is completely cleared the DCB can finally be freed and removed from the zombie list.
+ * place it on a special zombie list. When the DCB becomes a zombie the global zombie
+ * epoch is advanced and the DCB is stamped with the new epoch. Each polling thread
+ * records the current epoch at the end of the polling loop, when it no longer refers
+ * to any DCB, and moves the new zombies to a list of its own. Once every running
+ * polling thread has recorded an epoch that is at least that of the DCB the DCB can
+ * finally be freed and removed from the zombie list.
  */
 typedef struct
 {
-    GWBITMASK       bitmask;        /*< The bitmask of threads */
+    int64_t         epoch;          /*< The epoch when the DCB became a zombie */
     struct dcb      *next;          /*< Next pointer for the zombie list */
 } DCBMM;
 
@@ -206,7 +220,10 @@ typedef struct dcb
     dcb_role_t      dcb_role;
     SPINLOCK        dcb_initlock;
     DCBEVENTQ       evq;            /**< The event queue for this DCB */
+    int             poll_thread;    /**< Owning thread with per-thread event queues, -1 if none */
     int             fd;             /**< The descriptor */
+    int             *thread_fds;    /**< Listening sockets of the polling threads, the first is fd */
+    int             n_thread_fds;   /**< Number of listening sockets in thread_fds */
     dcb_state_t     state;          /**< Current descriptor state */
     SSL_STATE       ssl_state;      /**< Current state of SSL if in use */
     int             flags;          /**< DCB flags */
@@ -233,6 +250,7 @@ typedef struct dcb
     DCBSTATS        stats;          /**< DCB related statistics */
     unsigned int    dcb_server_status; /*< the server role indicator from SERVER */
     struct dcb      *next;          /**< Next DCB in the chain of allocated DCB's */
+    struct dcb      *free_next;     /**< Next DCB in a list of free DCBs */
     struct dcb      *nextpersistent;   /**< Next DCB in the persistent pool for SERVER */
     time_t          persistentstart;   /**< Time when DCB placed in persistent pool */
     struct service  *service;       /**< The related service */
@@ -248,14 +266,23 @@ typedef struct dcb
     int             polloutbusy;
     int             writecheck;
     long            last_read;      /*< Last time the DCB received data */
+    int             read_size;      /**< Size of the next read with direct reads */
     int             high_water;     /**< High water mark */
     int             low_water;      /**< Low water mark */
+    bool            writeq_full;    /**< The write queue has crossed the high water mark and
+                                     * has not yet drained below the low water mark */
+    bool            read_throttled; /**< Reading is paused until the write queue of the
+                                     * client DCB of the session drains */
     struct server   *server;        /**< The associated backend server */
     SSL*            ssl;            /*< SSL struct for connection */
     bool            ssl_read_want_read;    /*< Flag */
     bool            ssl_read_want_write;    /*< Flag */
     bool            ssl_write_want_read;    /*< Flag */
     bool            ssl_write_want_write;    /*< Flag */
+    bool            ssl_ktls_send;  /**< The kernel encrypts the writes, the socket is written directly */
+    int             ssl_async;      /**< State of a handshake done by the handshake threads */
+    struct dcb      *ssl_async_next; /**< Next DCB in the queue of the handshake threads */
+    int             uring_inflight; /**< Sends submitted to an io_uring and not yet completed */
     int             dcb_port;       /**< port of target server */
     skygw_chk_t     dcb_chk_tail;
 } DCB;
@@ -288,11 +315,14 @@ int           fail_accept_errno;
 #define DCB_ISZOMBIE(x)                 ((x)->state == DCB_STATE_ZOMBIE)
 #define DCB_WRITEQLEN(x)                (x)->writeqlen
 #define DCB_SET_LOW_WATER(x, lo)        (x)->low_water = (lo);
-#define DCB_SET_HIGH_WATER(x, hi)       (x)->low_water = (hi);
+#define DCB_SET_HIGH_WATER(x, hi)       (x)->high_water = (hi);
 #define DCB_BELOW_LOW_WATER(x)          ((x)->low_water && (x)->writeqlen < (x)->low_water)
 #define DCB_ABOVE_HIGH_WATER(x)         ((x)->high_water && (x)->writeqlen > (x)->high_water)
 
 #define DCB_POLL_BUSY(x)                ((x)->evq.next != NULL)
+#define DCB_HANDOFF_BUSY(x)             ((x)->evq.handoff_queued != 0)
+#define DCB_SSL_ASYNC_BUSY(x)           ((x)->ssl_async != SSL_ASYNC_IDLE)
+#define DCB_URING_BUSY(x)               ((x)->uring_inflight != 0)
 
 DCB *dcb_get_zombies(void);
 int dcb_write(DCB *, GWBUF *);
@@ -306,13 +336,19 @@ int dcb_read(DCB *, GWBUF **, int);
 int dcb_drain_writeq(DCB *);
 void dcb_close(DCB *);
 DCB *dcb_process_zombies(int);              /* Process Zombies except the one behind the pointer */
+void dcb_zombies_init(int);                  /* Allocate the zombie lists of the polling threads */
+void dcb_epoch_enter(int);                   /* A polling thread starts to refer to DCBs */
+void dcb_epoch_leave(int);                   /* A polling thread no longer refers to DCBs */
 void printAllDCBs();                         /* Debug to print all DCB in the system */
 void printDCB(DCB *);                        /* Debug print routine */
 void dprintAllDCBs(DCB *);                   /* Debug to print all DCB in the system */
+void dprintDCBsPage(DCB *, int, int);        /* Debug to print a page of the DCBs */
 void dprintOneDCB(DCB *, DCB *);             /* Debug to print one DCB */
 void dprintDCB(DCB *, DCB *);                /* Debug to print a DCB in the system */
 void dListDCBs(DCB *);                       /* List all DCBs in the system */
+void dListDCBsPage(DCB *, int, int);         /* List a page of the DCBs */
 void dListClients(DCB *);                    /* List al the client DCBs */
+void dListClientsPage(DCB *, int, int);      /* List a page of the client DCBs */
 const char *gw_dcb_state2string(dcb_state_t);              /* DCB state to string */
 void dcb_printf(DCB *, const char *, ...) __attribute__((format(printf, 2, 3))); /* DCB version of printf */
 void dcb_hashtable_stats(DCB *, void *);     /**< Print statisitics */
@@ -321,6 +357,7 @@ int dcb_remove_callback(DCB *, DCB_REASON, int (*)(struct dcb *, DCB_REASON, voi
 int dcb_isvalid(DCB *);                     /* Check the DCB is in the linked list */
 int dcb_count_by_usage(DCB_USAGE);          /* Return counts of DCBs */
 int dcb_persistent_clean_count(DCB *, bool);      /* Clean persistent and return count */
+int dcb_persistent_clean_pool(struct server *, struct server_persistent_pool *, bool);
 
 void dcb_call_foreach (struct server* server, DCB_REASON reason);
 void dcb_hangup_foreach (struct server* server);
@@ -328,9 +365,17 @@ size_t dcb_get_session_id(DCB* dcb);
 bool dcb_get_ses_log_info(DCB* dcb, size_t* sesid, int* enabled_logs);
 char *dcb_role_name(DCB *);                  /* Return the name of a role */
 int dcb_accept_SSL(DCB* dcb);
+int dcb_accept_SSL_handshake(DCB* dcb);
 int dcb_connect_SSL(DCB* dcb);
 int dcb_listen(DCB *listener, const char *config, const char *protocol_name);
 void dcb_append_readqueue(DCB *dcb, GWBUF *buffer);
+bool dcb_throttle_read(DCB *dcb);
+int64_t dcb_writeq_total();
+void dcb_writeq_by_service(struct service **services, int64_t *bytes, int n);
+int dcb_throttled_read_count();
+void dcb_uring_write_done(DCB *dcb, GWBUF *queue, int res);
+void dcb_set_busy_poll(int fd);
+void dcb_listener_close_sockets(DCB *listener);
 
 /**
  * DCB flags values
@@ -338,6 +383,8 @@ void dcb_append_readqueue(DCB *dcb, GWBUF *buffer);
 #define DCBF_CLONE              0x0001  /*< DCB is a clone */
 #define DCBF_HUNG               0x0002  /*< Hangup has been dispatched */
 #define DCBF_REPLIED    0x0004  /*< DCB was written to */
+#define DCBF_RESET              0x0008  /*< Pooled DCB must be reset for its new session */
+#define DCBF_RESET_SAME_USER    0x0010  /*< Pooled DCB was authenticated as the user of its new session */
 
 #define DCB_IS_CLONE(d) ((d)->flags & DCBF_CLONE)
 #define DCB_REPLIED(d) ((d)->flags & DCBF_REPLIED)
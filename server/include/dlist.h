@@ -0,0 +1,171 @@
+#ifndef _DLIST_H
+#define _DLIST_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file dlist.h  - Intrusive doubly-linked lists
+ *
+ * The links of a list are embedded in the objects that are on the list, so
+ * adding and removing an object allocates no memory. An object can be on as
+ * many lists as it has DLIST_NODE members. The lists do no locking, the
+ * owner of a list protects it with its own lock.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/** The links of an object on a list */
+typedef struct dlist_node
+{
+    struct dlist_node *prev; /*< Previous node or NULL if this is the first one */
+    struct dlist_node *next; /*< Next node or NULL if this is the last one */
+} DLIST_NODE;
+
+/** A list */
+typedef struct dlist
+{
+    DLIST_NODE *first; /*< The first node or NULL if the list is empty */
+    DLIST_NODE *last;  /*< The last node or NULL if the list is empty */
+    size_t count;      /*< Number of nodes on the list */
+} DLIST;
+
+/** The object that contains a node, e.g. DLIST_ENTRY(node, blockbuf_t, bb_node) */
+#define DLIST_ENTRY(node, type, member) ((type*)((char*)(node) - offsetof(type, member)))
+
+static inline void
+dlist_init(DLIST *list)
+{
+    list->first = NULL;
+    list->last = NULL;
+    list->count = 0;
+}
+
+static inline bool
+dlist_is_empty(const DLIST *list)
+{
+    return list->first == NULL;
+}
+
+/**
+ * Add a node to the end of a list
+ *
+ * The next pointer of the node is set before the node is linked so that a
+ * reader that follows the next pointers never sees an uninitialized one.
+ *
+ * @param list The list
+ * @param node Node that is not on any list
+ */
+static inline void
+dlist_append(DLIST *list, DLIST_NODE *node)
+{
+    node->next = NULL;
+    node->prev = list->last;
+
+    if (list->last)
+    {
+        list->last->next = node;
+    }
+    else
+    {
+        list->first = node;
+    }
+
+    list->last = node;
+    list->count++;
+}
+
+/**
+ * Add a node to the start of a list
+ *
+ * @param list The list
+ * @param node Node that is not on any list
+ */
+static inline void
+dlist_prepend(DLIST *list, DLIST_NODE *node)
+{
+    node->prev = NULL;
+    node->next = list->first;
+
+    if (list->first)
+    {
+        list->first->prev = node;
+    }
+    else
+    {
+        list->last = node;
+    }
+
+    list->first = node;
+    list->count++;
+}
+
+/**
+ * Remove a node from a list
+ *
+ * @param list The list
+ * @param node Node on the list
+ */
+static inline void
+dlist_remove(DLIST *list, DLIST_NODE *node)
+{
+    if (node->prev)
+    {
+        node->prev->next = node->next;
+    }
+    else
+    {
+        list->first = node->next;
+    }
+
+    if (node->next)
+    {
+        node->next->prev = node->prev;
+    }
+    else
+    {
+        list->last = node->prev;
+    }
+
+    node->prev = NULL;
+    node->next = NULL;
+    list->count--;
+}
+
+/**
+ * Remove the first node of a list
+ *
+ * @param list The list
+ * @return The removed node or NULL if the list is empty
+ */
+static inline DLIST_NODE *
+dlist_pop_first(DLIST *list)
+{
+    DLIST_NODE *node = list->first;
+
+    if (node)
+    {
+        dlist_remove(list, node);
+    }
+
+    return node;
+}
+
+#endif
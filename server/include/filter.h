@@ -20,11 +20,13 @@
  *
  * Date         Who                     Description
  * 27/05/2014   Mark Riddoch            Initial implementation
+ * 14/10/2016   MariaDB Corporation     Add the optional getStatistics entry point
  *
  */
 #include <dcb.h>
 #include <session.h>
 #include <buffer.h>
+#include <resultset.h>
 #include <stdint.h>
 
 /**
@@ -60,6 +62,8 @@ typedef struct
  *      clientReply             Called for each reply packet
  *      diagnostics             Called to force the filter to print
  *                              diagnostic output
+ *      getStatistics           Optional, called to get the filter
+ *                              specific statistics as a result set
  *
  * @endverbatim
  *
@@ -76,6 +80,7 @@ typedef struct filter_object
     int    (*routeQuery)(FILTER *instance, void *fsession, GWBUF *queue);
     int    (*clientReply)(FILTER *instance, void *fsession, GWBUF *queue);
     void   (*diagnostics)(FILTER *instance, void *fsession, DCB *dcb);
+    RESULTSET *(*getStatistics)(FILTER *instance);
 } FILTER_OBJECT;
 
 /**
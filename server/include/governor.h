@@ -0,0 +1,101 @@
+#ifndef _GOVERNOR_H
+#define _GOVERNOR_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file governor.h  - The concurrency governor of a service
+ *
+ * The governor limits the number of queries of a service, and of each user
+ * of the service, that are being executed by the backend servers at the same
+ * time. A session takes a slot when its query is routed and holds it until the
+ * backend protocol has read the complete reply, or until the reply is written
+ * to the client when no backend was needed. The queries that do not get
+ * a slot wait in a bounded queue, the queries of the high priority users
+ * before the others, and are routed in order when slots become free.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <buffer.h>
+#include <spinlock.h>
+#include <hashtable.h>
+
+struct session;
+struct dcb;
+
+/** The default maximum number of queued queries */
+#define GOVERNOR_DEFAULT_MAX_QUEUED 1000
+
+/** The state of a session in the governor */
+typedef enum
+{
+    GOVERNOR_IDLE,      /*< The session has no slot */
+    GOVERNOR_ACTIVE,    /*< The session has a slot */
+    GOVERNOR_WAITING    /*< The session is waiting for a slot */
+} governor_state_t;
+
+/** The decision on a query */
+typedef enum
+{
+    GOVERNOR_ADMIT,     /*< The query can be routed */
+    GOVERNOR_QUEUE,     /*< The query was queued, the governor owns it */
+    GOVERNOR_REJECT     /*< The queue is full, the query must be rejected */
+} governor_result_t;
+
+/** The active queries of a user */
+typedef struct governor_user
+{
+    int     n_active;   /*< Sessions of the user with a slot */
+    bool    high;       /*< The queries of the user are queued with a high priority */
+} GOVERNOR_USER;
+
+typedef struct governor
+{
+    SPINLOCK    lock;               /*< Protects the governor and the governor
+                                     * fields of its sessions */
+    int         max_active;         /*< Maximum active queries, 0 for no limit */
+    int         max_active_user;    /*< Maximum active queries of a user, 0 for no limit */
+    int         max_queued;         /*< Maximum queued queries */
+    char        *high_users;        /*< Comma separated high priority users */
+    HASHTABLE   *users;             /*< The GOVERNOR_USER of each user */
+    int         n_active;           /*< Sessions with a slot */
+    int         n_queued;           /*< Sessions waiting for a slot */
+    struct session *high_head;      /*< The waiting high priority sessions */
+    struct session *high_tail;
+    struct session *normal_head;    /*< The other waiting sessions */
+    struct session *normal_tail;
+    uint64_t    n_admitted;         /*< Queries routed without waiting */
+    uint64_t    n_waited;           /*< Queries that waited for a slot */
+    uint64_t    n_rejected;         /*< Queries rejected because the queue was full */
+    uint64_t    wait_us;            /*< Total time the queries waited, in microseconds */
+} GOVERNOR;
+
+extern GOVERNOR *governor_alloc(int max_active, int max_active_user, int max_queued,
+                                const char *high_users);
+extern void governor_free(GOVERNOR *governor);
+extern governor_result_t governor_admit(struct session *session, GWBUF *query, GWBUF *rest);
+extern void governor_query_done(struct session *session);
+extern void governor_backend_write(struct session *session, GWBUF *query);
+extern void governor_client_write(struct session *session);
+extern void governor_session_close(struct session *session);
+extern void governor_dprint(struct dcb *dcb, GOVERNOR *governor);
+
+#endif
@@ -23,11 +23,14 @@
  *
  * Date         Who                     Description
  * 27/01/16     Martin Brampton         Initial implementation
+ * 14/10/16     MariaDB Corporation     Session resumption and handshake counters
+ * 14/10/16     MariaDB Corporation     Handshake threads
  *
  * @endverbatim
  */
 
 #include <gw_protocol.h>
+#include <spinlock.h>
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -47,6 +50,22 @@ typedef enum ssl_method_type
     SERVICE_SSL_TLS_MAX
 } ssl_method_type_t;
 
+/** The session ID context of the listeners, needed for resuming the sessions */
+#define SSL_SESSION_ID_CONTEXT "MaxScale"
+
+/** Seconds a session of a client can be resumed */
+#define SSL_SESSION_TIMEOUT 3600
+
+/** Maximum number of threads that do the SSL handshakes of clients */
+#define SSL_MAX_HANDSHAKE_THREADS 16
+
+/**
+ * States of a client handshake that is done by the handshake threads
+ */
+#define SSL_ASYNC_IDLE  0 /*< No handshake thread is using the DCB */
+#define SSL_ASYNC_BUSY  1 /*< The DCB is queued or a handshake thread is using it */
+#define SSL_ASYNC_AGAIN 2 /*< As busy, and more data arrived meanwhile */
+
 /**
  * Return codes for SSL authentication checks
  */
@@ -69,6 +88,10 @@ typedef struct ssl_listener
     char *ssl_key;                      /*< SSL private key */
     char *ssl_ca_cert;                  /*< SSL CA certificate */
     bool ssl_init_done;                 /*< If SSL has already been initialized for this service */
+    SPINLOCK session_lock;              /*< Protects the session */
+    SSL_SESSION *session;               /*< Session of the last backend connection, reused by the next */
+    int n_handshakes;                   /*< Number of completed full handshakes */
+    int n_resumed;                      /*< Number of completed handshakes that resumed a session */
 } SSL_LISTENER;
 
 int ssl_authenticate_client(struct dcb *dcb, bool is_capable);
@@ -77,5 +100,8 @@ bool ssl_check_data_to_process(struct dcb *dcb);
 bool ssl_required_by_dcb(struct dcb *dcb);
 bool ssl_required_but_not_negotiated(struct dcb *dcb);
 const char* ssl_method_type_to_string(ssl_method_type_t method_type);
+bool ssl_handshake_threads_start(int n_threads);
+void ssl_handshake_threads_stop();
+bool ssl_handshake_submit(struct dcb *dcb);
 
 #endif /* _GW_SSL_H */
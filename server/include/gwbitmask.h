@@ -12,6 +12,8 @@
  * of this software will be governed by version 2 or later of the General
  * Public License.
  */
+#include <stdbool.h>
+#include <stdint.h>
 #include <spinlock.h>
 
 /**
@@ -23,6 +25,7 @@
  * Date         Who             Description
  * 28/06/13     Mark Riddoch    Initial implementation
  * 17/10/15     Martin Brampton Add bitmask_render_readable
+ * 14/10/16     MariaDB Corporation Add fixed size atomic bitsets
  *
  * @endverbatim
  */
@@ -53,4 +56,28 @@ extern int  bitmask_isallclear(GWBITMASK *);
 extern void bitmask_copy(GWBITMASK *, GWBITMASK *);
 extern char *bitmask_render_readable(GWBITMASK *);
 
+/** Number of bits in a cache line of a GWBITSET */
+#define BITSET_LINE_BITS        512
+
+/**
+ * A bitset whose size is fixed when it is initialized. The bits are changed
+ * and tested with atomic operations without locking. The bits start at a
+ * cache line and take whole cache lines, so the set shares no cache line
+ * with other data.
+ */
+typedef struct
+{
+    uint64_t *bits;         /**< The bits, BITSET_LINE_BITS per cache line */
+    int length;             /**< The number of bits in the bitset */
+    int n_words;            /**< The number of words in bits */
+} GWBITSET;
+
+extern bool bitset_init(GWBITSET *, int);
+extern void bitset_free(GWBITSET *);
+extern bool bitset_set(GWBITSET *, int);
+extern bool bitset_clear(GWBITSET *, int);
+extern bool bitset_isset(GWBITSET *, int);
+extern bool bitset_isallclear(GWBITSET *);
+extern int  bitset_count(GWBITSET *);
+
 #endif
@@ -30,6 +30,7 @@
  */
 #include <skygw_debug.h>
 #include <spinlock.h>
+#include <rwlock.h>
 #include <atomic.h>
 #include <dcb.h>
 
@@ -62,6 +63,11 @@ typedef struct hashiterator
  */
 typedef void *(*HASHMEMORYFN)(void *);
 
+/**
+ * The per-thread reader counts of a read-mostly hashtable
+ */
+struct hashreader;
+
 /**
  * The general purpose hashtable struct.
  */
@@ -78,9 +84,9 @@ typedef struct hashtable
     HASHMEMORYFN vcopyfn;         /**< Optional value copy function */
     HASHMEMORYFN kfreefn;         /**< Optional key free function */
     HASHMEMORYFN vfreefn;         /**< Optional value free function */
-    SPINLOCK spin;                /**< Internal spinlock for the hashtable */
-    int n_readers;                /**< Number of clients reading the table */
-    int writelock;                /**< The table is locked by a writer */
+    RWLOCK rwlock;                /**< Readers-writer lock, unless read-mostly */
+    int writelock;                /**< The read-mostly table is locked by a writer */
+    struct hashreader *readers;   /**< Per-thread reader counts, NULL unless read-mostly */
     bool ht_isflat;               /**< Indicates whether hashtable is in stack or heap */
     int n_elements;               /**< Number of added elements */
 #if defined(SS_DEBUG)
@@ -94,6 +100,8 @@ HASHTABLE *hashtable_alloc_flat(HASHTABLE* target,
                                 int (*hashfn)(),
                                 int (*cmpfn)());
 /**< Allocate a hashtable */
+extern HASHTABLE *hashtable_alloc_read_mostly(int, int (*hashfn)(), int (*cmpfn)());
+/**< Allocate a hashtable optimised for concurrent lookups */
 extern void hashtable_memory_fns(HASHTABLE   *table,
                                  HASHMEMORYFN kcopyfn,
                                  HASHMEMORYFN vcopyfn,
@@ -126,6 +134,8 @@ extern HASHITERATOR *hashtable_iterator(HASHTABLE *);
 /**< Allocate an iterator on the hashtable */
 extern void *hashtable_next(HASHITERATOR *);
 /**< Return the key of the hash table iterator */
+extern void *hashtable_iterator_value(HASHITERATOR *);
+/**< Return the value of the current key of the iterator */
 extern void hashtable_iterator_free(HASHITERATOR *);
 extern int hashtable_size(HASHTABLE *table);
 #endif
@@ -0,0 +1,46 @@
+#ifndef _HOT_RESTART_H
+#define _HOT_RESTART_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file hot_restart.h  - Hand-off of the listening sockets to a new process
+ *
+ * A MaxScale process with hot_restart_socket set waits for a new process
+ * on that UNIX socket. A new process that starts with the same setting
+ * takes over the listening sockets of the running one before it starts its
+ * services, so no connection attempt is refused during the restart. The old
+ * process stops accepting, lets its sessions end and exits.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdbool.h>
+#include <skygw_debug.h>
+
+EXTERN_C_BLOCK_BEGIN
+
+extern bool hot_restart_receive(const char *path);
+extern bool hot_restart_take_listener(const char *config, int **fds, int *n_fds);
+extern void hot_restart_close_unused();
+extern bool hot_restart_listen(const char *path, int pidfd);
+extern bool hot_restart_handed_off();
+
+EXTERN_C_BLOCK_END
+
+#endif
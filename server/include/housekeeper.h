@@ -15,6 +15,7 @@
 #include <time.h>
 #include <dcb.h>
 #include <hk_heartbeat.h>
+#include <timer.h>
 /**
  * @file housekeeper.h A mechanism to have task run periodically
  *
@@ -23,6 +24,7 @@
  *
  * Date         Who             Description
  * 29/08/14     Mark Riddoch    Initial implementation
+ * 14/10/16     MariaDB Corporation Tasks are run from a timer wheel
  *
  * @endverbatim
  */
@@ -44,7 +46,11 @@ typedef struct hktask
     int frequency;            /*< How often to call the tasks (seconds) */
     time_t nextdue;           /*< When the task should be next run */
     HKTASK_TYPE type;         /*< The task type */
+    TIMER timer;              /*< The timer that runs the task */
+    bool removed;             /*< The task was removed while it was running */
     struct hktask *next;      /*< Next task in the list */
+    struct hktask *prev;      /*< Previous task in the list */
+    struct hktask *hash_next; /*< Next task in the same bucket of the name index */
 } HKTASK;
 
 extern void hkinit();
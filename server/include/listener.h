@@ -23,14 +23,23 @@
  *
  * Date         Who                     Description
  * 19/01/16     Martin Brampton         Initial implementation
+ * 14/10/16     MariaDB Corporation     Admission control of new connections
+ * 14/10/16     MariaDB Corporation     Compressed protocol for the clients
  *
  * @endverbatim
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <gw_protocol.h>
 #include <gw_ssl.h>
+#include <spinlock.h>
 
 struct dcb;
+struct timer;
+
+/** The zlib level of the compressed protocol if compression_level is not set */
+#define LISTENER_DEFAULT_COMPRESSION_LEVEL 6
 
 /**
  * The servlistener structure is used to link a service to the protocols that
@@ -46,6 +55,18 @@ typedef struct servlistener
     char *authenticator;        /**< Name of authenticator */
     SSL_LISTENER *ssl;          /**< Structure of SSL data or NULL */
     struct dcb *listener;       /**< The DCB for the listener */
+    int accept_rate;            /**< Maximum connections accepted per second, 0 for no limit */
+    int accept_batch;           /**< Maximum connections accepted per event, 0 for no limit */
+    SPINLOCK accept_lock;       /**< Protects the accept tokens and timers */
+    int accept_tokens;          /**< Connections that may be accepted now */
+    long accept_refilled;       /**< When the tokens were last added, in milliseconds */
+    struct timer *accept_timers; /**< Resume accepting, one timer per polling thread */
+    int compression;            /**< zlib level of the compressed protocol, 0 if not offered */
+    int64_t compress_plain;     /**< Bytes written to the clients before compression */
+    int64_t compress_sent;      /**< Bytes written to the clients after compression */
+    int64_t decompress_read;    /**< Compressed bytes read from the clients */
+    int64_t decompress_plain;   /**< Bytes read from the clients after decompression */
+    int64_t compress_cpu_ns;    /**< CPU time spent in compression, nanoseconds */
     struct  servlistener *next; /**< Next service protocol */
 } SERV_LISTENER;
 
@@ -54,5 +75,10 @@ SERV_LISTENER *listener_alloc(char *protocol, char *address, unsigned short port
 int listener_set_ssl_version(SSL_LISTENER *ssl_listener, char* version);
 void listener_set_certificates(SSL_LISTENER *ssl_listener, char* cert, char* key, char* ca_cert);
 int listener_init_SSL(SSL_LISTENER *ssl_listener);
+void listener_set_accept_limits(SERV_LISTENER *listener, int rate, int batch);
+int listener_accept_delay(SERV_LISTENER *listener);
+void listener_accepted(SERV_LISTENER *listener);
+void listener_resume_accept(SERV_LISTENER *listener, int delay);
+void listener_set_compression(SERV_LISTENER *listener, int level);
 
 #endif
@@ -94,6 +94,7 @@ void mxs_log_set_syslog_enabled(bool enabled);
 void mxs_log_set_maxlog_enabled(bool enabled);
 void mxs_log_set_highprecision_enabled(bool enabled);
 void mxs_log_set_augmentation(int bits);
+void mxs_log_set_throttling(int count, int window_ms);
 
 int mxs_log_message(int priority,
                     const char* file, int line, const char* function,
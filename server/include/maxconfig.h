@@ -34,6 +34,9 @@
 
 #define DEFAULT_NBPOLLS         3       /**< Default number of non block polls before we block */
 #define DEFAULT_POLLSLEEP       1000    /**< Default poll wait time (milliseconds) */
+#define DEFAULT_ADAPTIVE_POLL_MAX_SPIN 50 /**< Default longest adaptive spin (microseconds) */
+#define DEFAULT_HOT_RESTART_DRAIN_TIMEOUT 300 /**< Default drain time of a hot restart (seconds) */
+#define DEFAULT_SERVICE_START_THREADS 8 /**< Default number of threads starting the services */
 #define _SYSNAME_STR_LENGTH     256     /**< sysname len */
 #define _RELEASE_STR_LENGTH     256     /**< release len */
 #define DEFAULT_NTHREADS        1 /**< Default number of polling threads */
@@ -102,6 +105,13 @@ typedef struct config_context
     struct config_context *next;       /**< Next pointer in the linked list */
 } CONFIG_CONTEXT;
 
+/** The I/O engines of the polling threads */
+typedef enum
+{
+    IO_ENGINE_EPOLL,    /**< The reads and the writes are system calls */
+    IO_ENGINE_URING     /**< The writes are submitted through io_uring */
+} io_engine_t;
+
 /**
  * The gateway global configuration data
  */
@@ -115,6 +125,27 @@ typedef struct
     unsigned long id;                                  /**< MaxScale ID */
     unsigned int  n_nbpoll;                            /**< Tune number of non-blocking polls */
     unsigned int  pollsleep;                           /**< Wait time in blocking polls */
+    int           adaptive_polling;                    /**< Tune the spins and the waits from the event rate */
+    int           adaptive_poll_max_spin;              /**< Longest spin of adaptive polling in microseconds */
+    int           busy_poll;                           /**< SO_BUSY_POLL of the sockets in microseconds */
+    int           thread_event_queues;                 /**< Per-thread epoll instances and event queues */
+    int           thread_work_stealing;                /**< Idle threads steal events from busy ones */
+    int           listener_reuseport;                  /**< A SO_REUSEPORT listening socket per thread */
+    int           *thread_cpus;                        /**< The CPUs the polling threads are bound to */
+    int           n_thread_cpus;                       /**< Number of entries in thread_cpus */
+    int           direct_reads;                        /**< Read without probing the socket with FIONREAD */
+    int           ssl_ktls;                            /**< Let the kernel encrypt SSL connections */
+    io_engine_t   io_engine;                           /**< The I/O engine of the polling threads */
+    char          *hot_restart_socket;                 /**< Socket for handing the listeners to a new process */
+    int           hot_restart_drain_timeout;           /**< Seconds the old process waits for its clients */
+    int           ssl_handshake_threads;               /**< Threads doing the SSL handshakes of clients */
+    int           service_start_threads;               /**< Threads starting the services at startup */
+    int           qc_cache_size;                       /**< Per-thread query classification cache entries */
+    int           qc_max_size;                         /**< Longer statements are not classified */
+    int           trace_sample_rate;                   /**< Trace one query in this many, 0 for none */
+    int           writeq_high_water;                   /**< Client write queue size that pauses backend reads */
+    int           writeq_low_water;                    /**< Client write queue size that resumes backend reads */
+    int64_t       writeq_memory_limit;                 /**< Total write queue size that pauses backend reads */
     int           syslog;                              /**< Log to syslog */
     int           maxlog;                              /**< Log to MaxScale's own logs */
     int           log_to_shm;                          /**< Write log-file to shared memory */
@@ -150,11 +181,31 @@ bool                config_load(char *);
 unsigned int        config_nbpolls();
 double              config_percentage_value(char *str);
 unsigned int        config_pollsleep();
+bool                config_adaptive_polling();
+int                 config_adaptive_poll_max_spin();
+int                 config_busy_poll();
 int                 config_reload();
 bool                config_set_qualified_param(CONFIG_PARAMETER* param,
                                                void* val,
                                                config_param_type_t type);
 int                 config_threadcount();
+bool                config_thread_event_queues();
+bool                config_thread_work_stealing();
+bool                config_listener_reuseport();
+int                 config_thread_cpu(int thread_id);
+bool                config_direct_reads();
+bool                config_ssl_ktls();
+io_engine_t         config_io_engine();
+const char*         config_hot_restart_socket();
+int                 config_hot_restart_drain_timeout();
+int                 config_ssl_handshake_threads();
+int                 config_service_start_threads();
+int                 config_qc_cache_size();
+int                 config_qc_max_size();
+int                 config_trace_sample_rate();
+int                 config_writeq_high_water();
+int                 config_writeq_low_water();
+int64_t             config_writeq_memory_limit();
 int                 config_truth_value(char *);
 void                free_config_parameter(CONFIG_PARAMETER* p1);
 bool                is_internal_service(const char *router);
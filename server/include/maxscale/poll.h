@@ -14,8 +14,10 @@
  */
 #include <dcb.h>
 #include <gwbitmask.h>
+#include <metrics.h>
 #include <resultset.h>
 #include <sys/epoll.h>
+#include <timer.h>
 
 /**
  * @file poll.h     The poll related functionality
@@ -26,6 +28,7 @@
  * Date         Who             Description
  * 19/06/13     Mark Riddoch    Initial implementation
  * 17/10/15     Martin Brampton Declare fake event functions
+ * 14/10/16     MariaDB Corporation Declare the thread group functions
  *
  * @endverbatim
  */
@@ -45,7 +48,9 @@ typedef enum
     POLL_STAT_EVQ_PENDING,
     POLL_STAT_EVQ_MAX,
     POLL_STAT_MAX_QTIME,
-    POLL_STAT_MAX_EXECTIME
+    POLL_STAT_MAX_EXECTIME,
+    POLL_STAT_N_POLLS,
+    POLL_STAT_BLOCKING_POLLS
 } POLL_STAT;
 
 extern  void            poll_init();
@@ -53,10 +58,11 @@ extern  int             poll_add_dcb(DCB *);
 extern  int             poll_remove_dcb(DCB *);
 extern  void            poll_waitevents(void *);
 extern  void            poll_shutdown();
-extern  GWBITMASK       *poll_bitmask();
+extern  GWBITSET        *poll_bitmask();
 extern  void            poll_set_maxwait(unsigned int);
 extern  void            poll_set_nonblocking_polls(unsigned int);
 extern  void            dprintPollStats(DCB *);
+extern  void            poll_metrics(METRICS *metrics);
 extern  void            dShowThreads(DCB *dcb);
 extern  void            poll_add_epollin_event_to_dcb(DCB* dcb, GWBUF* buf);
 extern  void            dShowEventQ(DCB *dcb);
@@ -67,4 +73,10 @@ extern  void            poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev);
 extern  void            poll_fake_hangup_event(DCB *dcb);
 extern  void            poll_fake_write_event(DCB *dcb);
 extern  void            poll_fake_read_event(DCB *dcb);
+extern  int             poll_current_thread();
+extern  void            poll_add_timer(TIMER *timer, int delay, int interval);
+extern  bool            poll_thread_affinity();
+extern  int             poll_enable_read(DCB *dcb, bool enable);
+extern  int             poll_add_group(const char *name, int threads);
+extern  int             poll_listener_threads(DCB *dcb, int *first);
 #endif
@@ -29,9 +29,12 @@
  *
  * Date       Who           Description
  * 30-10-2015 Markus Makela Initial implementation
+ * 14-10-2016 MariaDB Corporation Added JIT compilation and thread matching data
  * @endverbatim
  */
 
+#include <stdbool.h>
+
 typedef enum
 {
     MXS_PCRE2_MATCH,
@@ -43,5 +46,8 @@ mxs_pcre2_result_t mxs_pcre2_substitute(pcre2_code *re, const char *subject,
                                         const char *replace, char** dest, size_t* size);
 mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subject,
                                           int options, int* error);
+pcre2_code* mxs_pcre2_compile(const char* pattern, uint32_t options);
+pcre2_match_data* mxs_pcre2_thread_match_data(const pcre2_code* re);
+bool mxs_pcre2_match(const pcre2_code* re, const char* subject, size_t length);
 
 #endif
@@ -0,0 +1,92 @@
+#ifndef _MEMUSAGE_H
+#define _MEMUSAGE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file memusage.h  - Accounting of the memory used by the subsystems
+ *
+ * The main allocation sites count the bytes and the objects they allocate
+ * and free. Each thread counts into a block of its own, so an allocation
+ * only adds to two counters of the calling thread. A thread may free memory
+ * that another thread allocated, only the sums over all threads are
+ * meaningful.
+ *
+ * The counts cover the memory that the subsystems ask for, not the overhead
+ * of the allocator.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdint.h>
+#include <resultset.h>
+
+struct dcb;
+struct metrics;
+
+/** The accounted subsystems */
+typedef enum
+{
+    MEMUSAGE_BUFFER,        /*< Data of the GWBUFs */
+    MEMUSAGE_DCB,           /*< DCBs */
+    MEMUSAGE_SESSION,       /*< Sessions and their memory arenas */
+    MEMUSAGE_SESCMD,        /*< Session command properties of the routers */
+    MEMUSAGE_HASHTABLE,     /*< Hashtables and their entries */
+    MEMUSAGE_QC,            /*< Query classification info */
+    MEMUSAGE_N_SUBSYSTEMS
+} memusage_t;
+
+/**
+ * The memory used by the subsystems
+ */
+typedef struct memusage
+{
+    int64_t bytes[MEMUSAGE_N_SUBSYSTEMS];     /*< Bytes in use */
+    int64_t objects[MEMUSAGE_N_SUBSYSTEMS];   /*< Objects in use */
+} MEMUSAGE;
+
+extern void memusage_add(memusage_t subsystem, int64_t bytes, int64_t objects);
+extern void memusage_get(MEMUSAGE *usage);
+extern const char *memusage_name(memusage_t subsystem);
+extern void dShowMemory(struct dcb *dcb);
+extern RESULTSET *memusageGetList();
+extern void memusage_metrics(struct metrics *metrics);
+
+/**
+ * Count an allocation
+ *
+ * @param subsystem The subsystem
+ * @param bytes     Size of the allocation
+ */
+static inline void memusage_alloc(memusage_t subsystem, int64_t bytes)
+{
+    memusage_add(subsystem, bytes, 1);
+}
+
+/**
+ * Count a free
+ *
+ * @param subsystem The subsystem
+ * @param bytes     Size of the freed memory
+ */
+static inline void memusage_free(memusage_t subsystem, int64_t bytes)
+{
+    memusage_add(subsystem, -bytes, -1);
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file metrics.h  - Rendering of the statistics in the Prometheus text format
+ *
+ * The statistics are written into one growing text buffer that is sent as a
+ * single reply, so that rendering them allocates neither result set rows nor
+ * a network buffer per line. Each module that owns statistics renders its own
+ * metric families while it holds its own locks.
+ *
+ * All the samples of a metric family must follow its metrics_family() line.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <buffer.h>
+#include <statistics.h>
+
+/** Maximum length of the escaped value of a label */
+#define METRICS_LABEL_LEN 256
+
+/**
+ * The text of the metrics being rendered
+ */
+typedef struct metrics
+{
+    char *data;   /*< The text */
+    size_t len;   /*< Length of the text */
+    size_t size;  /*< Size of the allocated buffer */
+    bool failed;  /*< An allocation failed, the text is incomplete */
+} METRICS;
+
+typedef enum
+{
+    METRICS_COUNTER,
+    METRICS_GAUGE,
+    METRICS_HISTOGRAM
+} METRICS_TYPE;
+
+extern void metrics_init(METRICS *metrics);
+extern void metrics_free(METRICS *metrics);
+extern GWBUF *metrics_to_gwbuf(METRICS *metrics);
+extern void metrics_printf(METRICS *metrics, const char *fmt, ...)
+__attribute__((format(printf, 2, 3)));
+extern const char *metrics_escape(const char *value, char *dest, size_t size);
+extern void metrics_family(METRICS *metrics, const char *name, METRICS_TYPE type, const char *help);
+extern void metrics_value(METRICS *metrics, const char *name, const char *labels, int64_t value);
+extern void metrics_latency(METRICS *metrics, const char *name, const char *labels,
+                            const TS_LATENCY_SNAPSHOT *snapshot);
+
+#endif
@@ -34,6 +34,7 @@ EXTERN_C_BLOCK_BEGIN
  * 01/10/14 Mark Riddoch        Addition of call to unload all modules on shutdown
  * 19/02/15 Mark Riddoch        Addition of moduleGetList
  * 26/02/15 Massimiliano Pinto  Addition of module_feedback_send
+ * 14/10/16 MariaDB Corporation Addition of load_modules
  *
  * @endverbatim
  */
@@ -63,6 +64,7 @@ typedef struct modules
 
 
 extern  void    *load_module(const char *module, const char *type);
+extern  void    load_modules(const char **modules, const char **types, int n_modules, int n_threads);
 extern  void    unload_module(const char *module);
 extern  void    unload_all_modules();
 extern  void    printModules();
@@ -23,6 +23,7 @@
  * 04/06/14     Mark Riddoch            Initial implementation
  * 24/06/14     Mark Riddoch            Add modutil_MySQL_Query to enable multipacket queries
  * 24/10/14     Massimiliano Pinto      Add modutil_send_mysql_err_packet to send a mysql ERR_Packet
+ * 14/10/16     MariaDB Corporation     Add the packet iterator
  *
  * @endverbatim
  */
@@ -39,17 +40,47 @@
 #define IS_FULL_RESPONSE(buf) (modutil_count_signal_packets(buf,0,0) == 2)
 #define PTR_EOF_MORE_RESULTS(b) ((PTR_IS_EOF(b) && ptr[7] & 0x08))
 
+/**
+ * A view of a complete MySQL packet in a buffer chain. The packet is not
+ * copied, the view points to the buffers it was found in and is valid as
+ * long as the buffers are not modified.
+ */
+typedef struct modutil_packet
+{
+    GWBUF    *buffer;          /*< The buffer where the packet starts */
+    size_t   offset;           /*< Offset of the packet in the buffer */
+    uint32_t length;           /*< Length of the packet including the header */
+    uint8_t  seqno;            /*< Sequence number of the packet */
+    uint8_t  *data;            /*< The packet if it is contained in one buffer, NULL if
+                                *  it is spread over several buffers */
+} MODUTIL_PACKET;
+
+/**
+ * An iterator over the complete MySQL packets of a buffer chain
+ */
+typedef struct modutil_packet_iter
+{
+    GWBUF    *buffer;          /*< The buffer where the next packet starts */
+    size_t   offset;           /*< Offset of the next packet in the buffer */
+    size_t   total;            /*< Length of the packets iterated so far */
+} MODUTIL_PACKET_ITER;
+
 
 extern int      modutil_is_SQL(GWBUF *);
 extern int      modutil_is_SQL_prepare(GWBUF *);
 extern int      modutil_extract_SQL(GWBUF *, char **, int *);
 extern int      modutil_MySQL_Query(GWBUF *, char **, int *, int *);
 extern char*    modutil_get_SQL(GWBUF *);
+extern bool     modutil_get_SQL_view(GWBUF *, const char **, int *);
+extern const char* modutil_get_SQL_cached(GWBUF *);
 extern GWBUF*   modutil_replace_SQL(GWBUF *, char *);
 extern char*    modutil_get_query(GWBUF* buf);
 extern int      modutil_send_mysql_err_packet(DCB *, int, int, int, const char *, const char *);
 GWBUF*          modutil_get_next_MySQL_packet(GWBUF** p_readbuf);
 GWBUF*          modutil_get_complete_packets(GWBUF** p_readbuf);
+void            modutil_packet_iter_init(MODUTIL_PACKET_ITER* iter, GWBUF* buffer);
+bool            modutil_packet_next(MODUTIL_PACKET_ITER* iter, MODUTIL_PACKET* packet);
+size_t          modutil_packet_copy(const MODUTIL_PACKET* packet, size_t offset, size_t len, uint8_t* dest);
 int             modutil_MySQL_query_len(GWBUF* buf, int* nbytes_missing);
 void            modutil_reply_parse_error(DCB* backend_dcb, char* errstr, uint32_t flags);
 void            modutil_reply_auth_error(DCB* backend_dcb, char* errstr, uint32_t flags);
@@ -122,6 +122,10 @@ typedef enum
 #define DEFAULT_READ_TIMEOUT 1
 #define DEFAULT_WRITE_TIMEOUT 2
 
+#define DEFAULT_SCRIPT_TIMEOUT 90
+#define DEFAULT_SCRIPT_MAX_CONCURRENCY 1
+#define MON_MAX_SCRIPT_CONCURRENCY 64
+
 
 #define MONITOR_RUNNING 1
 #define MONITOR_STOPPING 2
@@ -150,6 +154,21 @@ typedef struct monitor_def_s
 
 extern const monitor_def_t monitor_event_definitions[];
 
+/**
+ * The probing statistics of a monitored server
+ */
+typedef struct mon_server_stats
+{
+    SPINLOCK lock;
+    TS_LATENCY_SNAPSHOT probe;    /**< Durations of the probes of the server */
+    uint64_t n_connect_failures;  /**< Failed connection attempts */
+    uint64_t n_state_changes;     /**< Detected state changes */
+    uint64_t probe_start;         /**< Start of the last probe, in microseconds */
+    uint64_t prev_probe_start;    /**< Start of the probe before the last one */
+    uint64_t last_detect;         /**< Time to detect the last state change */
+    uint64_t max_detect;          /**< Longest time to detect a state change */
+} MON_SERVER_STATS;
+
 /**
  * The linked list of servers that are being monitored by the monitor module.
  */
@@ -161,6 +180,8 @@ typedef struct monitor_servers
     int mon_err_count;
     unsigned int mon_prev_status;
     unsigned int pending_status;  /**< Pending Status flag bitmap */
+    bool drained;                 /**< Draining server has no connections left */
+    MON_SERVER_STATS stats;       /**< Probing statistics */
     struct monitor_servers *next; /**< The next server in the list */
 } MONITOR_SERVERS;
 
@@ -188,6 +209,13 @@ typedef struct monitor
     MONITOR_OBJECT *module;       /**< The "monitor object" */
     void *handle;                 /**< Handle returned from startMonitor */
     size_t interval;              /**< The monitor interval */
+    struct monitor_probe_pool *probe_pool; /**< Threads that probe the servers concurrently */
+    int script_timeout;           /**< Seconds a monitor script may run before it is killed */
+    int script_max_concurrency;   /**< Maximum number of monitor scripts running at a time */
+    struct monitor_script_executor *script_executor; /**< Thread that runs the monitor scripts */
+    SPINLOCK stats_lock;          /**< Protects tick_latency */
+    TS_LATENCY_SNAPSHOT tick_latency; /**< Durations of the monitoring cycles */
+    uint64_t tick_start;          /**< Start of the current cycle, in microseconds */
     struct monitor *next;         /**< Next monitor in the linked list */
 } MONITOR;
 
@@ -206,7 +234,11 @@ extern void monitorShow(DCB *, MONITOR *);
 extern void monitorList(DCB *);
 extern void monitorSetInterval (MONITOR *, unsigned long);
 extern bool monitorSetNetworkTimeout(MONITOR *, int, int);
+extern bool monitorSetScriptTimeout(MONITOR *, int);
+extern bool monitorSetScriptMaxConcurrency(MONITOR *, int);
 extern RESULTSET *monitorGetList();
+extern RESULTSET *monitorGetStatistics(MONITOR *);
+extern void monitor_metrics(METRICS *metrics);
 extern bool check_monitor_permissions(MONITOR* monitor, const char* query);
 
 monitor_event_t mon_name_to_event(const char* tok);
@@ -219,6 +251,10 @@ bool mon_print_fail_status(MONITOR_SERVERS* mon_srv);
 void monitor_launch_script(MONITOR* mon, MONITOR_SERVERS* ptr, char* script);
 int mon_parse_event_string(bool* events, size_t count, char* string);
 connect_result_t mon_connect_to_db(MONITOR* mon, MONITOR_SERVERS *database);
+bool mon_connection_is_alive(MONITOR_SERVERS *database);
+connect_result_t mon_reuse_connection(MONITOR* mon, MONITOR_SERVERS *database);
+MYSQL_RES* mon_query_reconnect(MONITOR* mon, MONITOR_SERVERS *database, const char *query,
+                               connect_result_t *rval);
 void mon_log_connect_error(MONITOR_SERVERS* database, connect_result_t rval);
 void mon_log_state_change(MONITOR_SERVERS *ptr);
 
@@ -231,4 +267,125 @@ void mon_log_state_change(MONITOR_SERVERS *ptr);
  */
 void mon_hangup_failed_servers(MONITOR *monitor);
 
+/**
+ * The global status variables that a monitor samples as the load metrics of
+ * the servers
+ */
+typedef struct mon_load_metrics
+{
+    char *query;                    /**< The query that reads the variables */
+    int n_metrics;                  /**< Number of variables */
+    char names[MAX_LOAD_METRICS][LOAD_METRIC_NAME_LEN]; /**< Names of the variables */
+    bool rate[MAX_LOAD_METRICS];    /**< Whether the variable is a counter */
+} MON_LOAD_METRICS;
+
+/**
+ * @brief Parse a list of load metrics
+ *
+ * The list is a comma separated list of global status variables. A variable
+ * with the suffix /s is a counter and its rate per second is used as the metric,
+ * the value of other variables is used as such.
+ *
+ * @param list The list of variables
+ * @return The load metrics or NULL if the list was invalid
+ */
+MON_LOAD_METRICS* mon_load_metrics_parse(const char *list);
+
+/**
+ * @brief Free load metrics
+ *
+ * @param metrics The load metrics, can be NULL
+ */
+void mon_load_metrics_free(MON_LOAD_METRICS *metrics);
+
+/**
+ * @brief Sample the load metrics of a server
+ *
+ * Reads the variables from the server and stores the metrics and their sum,
+ * the load of the server, in the server structure.
+ *
+ * @param metrics  The load metrics
+ * @param database The monitored server, must be connected
+ */
+void mon_sample_load(MON_LOAD_METRICS *metrics, MONITOR_SERVERS *database);
+
+/**
+ * @brief Sample the cached global variables of a server
+ *
+ * Reads the global variables that are used to answer the probe queries of
+ * the clients and stores them in the server structure.
+ *
+ * @param database The monitored server, must be connected
+ */
+void mon_sample_variables(MONITOR_SERVERS *database);
+
+/**
+ * @brief Publish the state of the monitored servers
+ *
+ * Publishes a snapshot of the state of each monitored server for the routers.
+ * Called at the end of each monitoring cycle.
+ *
+ * @param monitor Monitor object
+ */
+void mon_publish_server_states(MONITOR *monitor);
+
+/** Maximum number of threads that probe the servers of one monitor */
+#define MON_MAX_PROBE_THREADS 16
+
+/**
+ * @brief Probe all servers of a monitor concurrently
+ *
+ * The probe function is called once for each monitored server. The calls are
+ * made by a pool of threads of the monitor and by the calling thread, so the
+ * probe function may only modify the server it is given. The function returns
+ * when all servers have been probed.
+ *
+ * @param monitor Monitor object
+ * @param probe Function that probes one server
+ */
+void mon_probe_servers(MONITOR *monitor, void (*probe)(MONITOR*, MONITOR_SERVERS*));
+
+/**
+ * @brief Stop the probe threads of a monitor
+ *
+ * Must only be called when the monitor thread has stopped.
+ *
+ * @param monitor Monitor object
+ */
+void mon_probe_pool_free(MONITOR *monitor);
+
+/**
+ * @brief Stop the script executor of a monitor
+ *
+ * Scripts that are still queued are discarded and the running scripts are
+ * waited for, killing them when their timeout is reached.
+ *
+ * @param monitor Monitor object
+ */
+void mon_script_executor_free(MONITOR *monitor);
+
+/**
+ * @brief Start timing a monitoring cycle
+ *
+ * @param monitor Monitor object
+ */
+void mon_tick_start(MONITOR *monitor);
+
+/**
+ * @brief End timing a monitoring cycle
+ *
+ * @param monitor Monitor object
+ */
+void mon_tick_end(MONITOR *monitor);
+
+/**
+ * @brief Record the duration of a probe of a server
+ *
+ * The servers probed with mon_probe_servers() are recorded automatically.
+ *
+ * @param database Monitored server
+ * @param start Start of the probe, from ts_clock_us()
+ */
+void mon_record_probe(MONITOR_SERVERS *database, uint64_t start);
+
 #endif
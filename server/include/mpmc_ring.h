@@ -0,0 +1,57 @@
+#ifndef _MPMC_RING_H
+#define _MPMC_RING_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file mpmc_ring.h  - Bounded lock-free multi-producer, multi-consumer ring
+ *
+ * The ring holds a fixed number of fixed-size elements that are copied in
+ * and out of it. Any thread can push and pop without locking and without
+ * allocating memory. A push to a full ring and a pop from an empty ring
+ * fail instead of waiting.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <skygw_debug.h>
+
+EXTERN_C_BLOCK_BEGIN
+
+typedef struct mpmc_ring
+{
+    size_t  capacity;   /*< Number of elements the ring holds */
+    size_t  elem_size;  /*< Size of an element */
+    size_t  cell_size;  /*< Size of a cell, the sequence number and the element */
+    char   *cells;      /*< The cells */
+    int64_t push_pos __attribute__((aligned(64))); /*< Position of the next push */
+    int64_t pop_pos __attribute__((aligned(64)));  /*< Position of the next pop */
+} MPMC_RING;
+
+extern bool mpmc_ring_init(MPMC_RING *ring, size_t capacity, size_t elem_size);
+extern void mpmc_ring_done(MPMC_RING *ring);
+extern bool mpmc_ring_push(MPMC_RING *ring, const void *elem);
+extern bool mpmc_ring_pop(MPMC_RING *ring, void *dest);
+extern size_t mpmc_ring_count(MPMC_RING *ring);
+
+EXTERN_C_BLOCK_END
+
+#endif
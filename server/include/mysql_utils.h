@@ -15,6 +15,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <mysql.h>
 #include <server.h>
 
@@ -30,4 +31,7 @@ char* lestr_consume(uint8_t** c, size_t *size);
 
 MYSQL *mxs_mysql_real_connect(MYSQL *mysql, SERVER *server, const char *user, const char *passwd);
 
+struct service;
+bool mxs_mysql_kill_query(struct service *service, SERVER *server, unsigned long tid);
+
 #endif
@@ -0,0 +1,57 @@
+#ifndef _PROFILER_H
+#define _PROFILER_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file profiler.h - A sampling profiler of the polling threads
+ *
+ * When the profiler is running, each registered thread has a timer that
+ * sends it SIGPROF at the given frequency of its CPU time. The signal handler
+ * records the instruction pointer of the thread and optionally the return
+ * addresses found by following the frame pointers, into a buffer of the
+ * thread. The samples are shown as folded stacks that flame graph tools
+ * can read.
+ *
+ * Following the frame pointers only gives complete stacks for code that is
+ * compiled with -fno-omit-frame-pointer.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/2016   MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdbool.h>
+
+struct dcb;
+
+/** Maximum number of frames recorded for one sample */
+#define PROFILER_MAX_DEPTH 32
+
+/** Size of the sample buffer of each thread in words */
+#define PROFILER_BUFFER_WORDS (256 * 1024)
+
+/** Maximum sampling frequency in samples per second */
+#define PROFILER_MAX_FREQUENCY 10000
+
+extern void profiler_thread_init(int thread_id);
+extern bool profiler_start(int frequency, bool stacks);
+extern void profiler_stop();
+extern bool profiler_running();
+extern void dprintProfile(struct dcb *dcb);
+
+#endif
@@ -72,6 +72,48 @@ typedef enum qc_parse_result
     QC_QUERY_PARSED           = 3  /*< The query was fully parsed; completely classified. */
 } qc_parse_result_t;
 
+/**
+ * What information a classifier collects when parsing a statement. The type
+ * mask, the operation and the other properties that do not require the names
+ * used in the statement are always collected.
+ */
+typedef enum qc_collect_info
+{
+    QC_COLLECT_ESSENTIALS = 0x00, /*< Collect only the essentials. */
+    QC_COLLECT_TABLES     = 0x01, /*< Collect the table names. */
+    QC_COLLECT_DATABASES  = 0x02, /*< Collect the database names. */
+    QC_COLLECT_FIELDS     = 0x04, /*< Collect the affected fields. */
+    QC_COLLECT_FIELD_VALUES = 0x08, /*< Collect the values of the fields, see qc_get_field_values(). */
+
+    /** The field values are specific to each statement and are not part of QC_COLLECT_ALL. */
+    QC_COLLECT_ALL = (QC_COLLECT_TABLES | QC_COLLECT_DATABASES | QC_COLLECT_FIELDS)
+} qc_collect_info_t;
+
+/**
+ * A literal value of a column in a statement, see qc_get_field_values().
+ */
+typedef struct qc_field_value
+{
+    char* table;  /*< The table or alias qualifying the column, NULL if none. */
+    char* column; /*< The name of the column. */
+    char* value;  /*< The value, strings without the quotes. */
+} QC_FIELD_VALUE;
+
+typedef enum qc_literal_type
+{
+    QC_LITERAL_STRING,  /*< A string in single quotes. */
+    QC_LITERAL_INTEGER, /*< A decimal integer. */
+    QC_LITERAL_DECIMAL, /*< A number with a fraction or an exponent. */
+    QC_LITERAL_HEX      /*< A hexadecimal number, 0x... */
+} qc_literal_type_t;
+
+typedef struct qc_literal
+{
+    qc_literal_type_t type; /*< The type of the literal. */
+    const char* value;      /*< The literal in the statement, strings without the quotes. */
+    size_t len;             /*< The length of the value. */
+} QC_LITERAL;
+
 #define QUERY_IS_TYPE(mask,type) ((mask & type) == type)
 
 bool qc_init(const char* plugin_name, const char* plugin_args);
@@ -85,7 +127,7 @@ void qc_unload(QUERY_CLASSIFIER* classifier);
 bool qc_thread_init(void);
 void qc_thread_end(void);
 
-qc_parse_result_t qc_parse(GWBUF* querybuf);
+qc_parse_result_t qc_parse(GWBUF* querybuf, uint32_t collect);
 
 uint32_t qc_get_type(GWBUF* querybuf);
 qc_query_op_t qc_get_operation(GWBUF* querybuf);
@@ -94,16 +136,47 @@ char* qc_get_created_table_name(GWBUF* querybuf);
 bool qc_is_drop_table_query(GWBUF* querybuf);
 bool qc_is_real_query(GWBUF* querybuf);
 char** qc_get_table_names(GWBUF* querybuf, int* tblsize, bool fullnames);
+bool qc_peek_table_names(GWBUF* querybuf, const char* const** names, int* tblsize);
 char* qc_get_canonical(GWBUF* querybuf);
+uint64_t qc_get_canonical_hash(GWBUF* querybuf);
+const QC_LITERAL* qc_get_literals(GWBUF* querybuf, int* size);
 bool qc_query_has_clause(GWBUF* buf);
 char* qc_get_qtype_str(qc_query_type_t qtype);
 char* qc_get_affected_fields(GWBUF* buf);
 char** qc_get_database_names(GWBUF* querybuf, int* size);
+QC_FIELD_VALUE* qc_get_field_values(GWBUF* querybuf, int* size);
+void qc_free_field_values(QC_FIELD_VALUE* values, int size);
 
 const char* qc_op_to_string(qc_query_op_t op);
 const char* qc_type_to_string(qc_query_type_t type);
 char* qc_types_to_string(uint32_t types);
 
+/**
+ * Statistics of the query classification caches, summed over all threads
+ */
+typedef struct qc_cache_stats
+{
+    uint64_t hits;      /*< Classifications served from a cache */
+    uint64_t misses;    /*< Cacheable statements that had to be classified */
+    uint64_t evictions; /*< Entries evicted from a full cache */
+    uint64_t entries;   /*< Entries currently in the caches */
+} QC_CACHE_STATS;
+
+void qc_get_cache_stats(QC_CACHE_STATS* stats);
+
+/**
+ * The binary protocol prepared statements of a session. A statement is
+ * classified once, when the server has prepared it, and its executions are
+ * classified by looking up the statement by the id in the command.
+ */
+typedef struct qc_ps_registry QC_PS_REGISTRY;
+
+QC_PS_REGISTRY* qc_ps_registry_alloc(void);
+void qc_ps_registry_free(QC_PS_REGISTRY* registry);
+bool qc_ps_add(QC_PS_REGISTRY* registry, GWBUF* prepare, GWBUF* reply);
+GWBUF* qc_ps_get(QC_PS_REGISTRY* registry, GWBUF* command);
+void qc_ps_remove(QC_PS_REGISTRY* registry, GWBUF* command);
+
 struct query_classifier
 {
     bool (*qc_init)(const char* args);
@@ -112,7 +185,7 @@ struct query_classifier
     bool (*qc_thread_init)(void);
     void (*qc_thread_end)(void);
 
-    qc_parse_result_t (*qc_parse)(GWBUF* querybuf);
+    qc_parse_result_t (*qc_parse)(GWBUF* querybuf, uint32_t collect);
 
     uint32_t (*qc_get_type)(GWBUF* querybuf);
     qc_query_op_t (*qc_get_operation)(GWBUF* querybuf);
@@ -125,9 +198,10 @@ struct query_classifier
     bool (*qc_query_has_clause)(GWBUF* buf);
     char* (*qc_get_affected_fields)(GWBUF* buf);
     char** (*qc_get_database_names)(GWBUF* querybuf, int* size);
+    QC_FIELD_VALUE* (*qc_get_field_values)(GWBUF* querybuf, int* size);
 };
 
-#define QUERY_CLASSIFIER_VERSION {1, 0, 0}
+#define QUERY_CLASSIFIER_VERSION {2, 1, 0}
 
 EXTERN_C_BLOCK_END
 
@@ -22,11 +22,12 @@
  *
  * Date         Who                     Description
  * 27/04/2016   Martin Brampton         Initial implementation
+ * 14/10/2016   MariaDB Corporation     Lock-free queue
  *
  * @endverbatim
  */
 
-#include <spinlock.h>
+#include <mpmc_ring.h>
 #include <skygw_debug.h>
 
 #define CONNECTION_QUEUE_LIMIT 1000
@@ -39,25 +40,20 @@ typedef struct queue_entry
 
 typedef struct queue_config
 {
-    int             queue_size;
     int             queue_limit;
-    int             start;
-    int             end;
     int             timeout;
-    SPINLOCK        queue_lock;
-    QUEUE_ENTRY     queue_array[CONNECTION_QUEUE_LIMIT];
+    MPMC_RING       queue_ring;     /*< The QUEUE_ENTRY elements of the queue */
 } QUEUE_CONFIG;
 
 QUEUE_CONFIG *mxs_queue_alloc(int limit, int timeout);
 void mxs_queue_free(QUEUE_CONFIG *queue_config);
 bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry);
-QUEUE_ENTRY *mxs_dequeue(QUEUE_CONFIG *queue_config);
+bool mxs_dequeue(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *entry);
 
 static inline int
 mxs_queue_count(QUEUE_CONFIG *queue_config)
 {
-    int count = queue_config->end - queue_config->start;
-    return count < 0 ? (count + queue_config->queue_size) : count;
+    return mpmc_ring_count(&queue_config->queue_ring);
 }
 
 #endif /* QUEUEMANAGER_H */
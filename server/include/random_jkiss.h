@@ -24,6 +24,7 @@
 extern "C" {
 #endif
 
+/** Return a pseudo-random number from the generator of the calling thread */
 extern unsigned int random_jkiss(void);
 
 #ifdef  __cplusplus
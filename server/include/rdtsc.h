@@ -27,10 +27,13 @@
  *
  * Date         Who             Description
  * 19/09/2014   Mark Riddoch    Initial implementation
+ * 14/10/2016   MariaDB Corporation Read both halves of the counter on x86_64
  *
  * @endverbatim
  */
 
+#include <time.h>
+
 typedef unsigned long long CYCLES;
 
 /**
@@ -45,12 +48,22 @@ typedef unsigned long long CYCLES;
  * obtian accurate timing. This may be done by setting pocessor affinity for
  * the thread. See sched_setaffinity/sched_getaffinity.
  *
+ * The "=A" constraint only means the edx:eax pair on 32-bit x86, on x86_64
+ * the two halves are read separately. Other processors use the monotonic
+ * clock in nanoseconds instead.
+ *
  * @return CPU cycle count
  */
 static __inline__ CYCLES rdtsc(void)
 {
-    unsigned long long int x;
-    __asm__ volatile (".byte 0x0f, 0x31" : "=A" (x));
-    return x;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+    __asm__ volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((CYCLES)hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (CYCLES)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
 }
 #endif
@@ -25,11 +25,13 @@
  * 16/07/2013   Massimiliano Pinto  Added router commands values
  * 22/10/2013   Massimiliano Pinto  Added router errorReply entry point
  * 27/10/2015   Martin Brampton     Add RCAP_TYPE_NO_RSESSION
+ * 14/10/2016   MariaDB Corporation Add the optional getStatistics entry point
  *
  */
 #include <service.h>
 #include <session.h>
 #include <buffer.h>
+#include <resultset.h>
 #include <stdint.h>
 
 /**
@@ -57,6 +59,7 @@ typedef enum error_action
  *  clientReply     Called to reply to client the data from one or all backends
  *  errorReply      Called to reply to client errors with optional closeSession or make a request for
  *                  a new backend connection
+ *  getStatistics   Optional, called to get the router specific statistics as a result set
  *
  * @endverbatim
  *
@@ -78,6 +81,7 @@ typedef struct router_object
                            error_action_t action,
                            bool*          succp);
     int     (*getCapabilities)();
+    RESULTSET *(*getStatistics)(ROUTER *instance);
 } ROUTER_OBJECT;
 
 /**
@@ -85,7 +89,7 @@ typedef struct router_object
  * must update these versions numbers in accordance with the rules in
  * modinfo.h.
  */
-#define ROUTER_VERSION  { 1, 0, 0 }
+#define ROUTER_VERSION  { 1, 1, 0 }
 
 /**
  * Router capability type. Indicates what kind of input router accepts.
@@ -95,7 +99,9 @@ typedef enum router_capability_t
     RCAP_TYPE_UNDEFINED    = 0x00,
     RCAP_TYPE_STMT_INPUT   = 0x01,  /*< statement per buffer */
     RCAP_TYPE_PACKET_INPUT = 0x02,  /*< data as it was read from DCB */
-    RCAP_TYPE_NO_RSESSION  = 0x04   /*< router does not use router sessions */
+    RCAP_TYPE_NO_RSESSION  = 0x04,  /*< router does not use router sessions */
+    RCAP_TYPE_STREAM_OUTPUT = 0x08  /*< replies as they are read from DCB, not
+                                     * as complete packets */
 } router_capability_t;
 
 
@@ -0,0 +1,121 @@
+#ifndef _RWLOCK_H
+#define _RWLOCK_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file rwlock.h
+ *
+ * Readers-writer locks and sequence locks for read-mostly data.
+ *
+ * A readers-writer lock can be held by any number of readers at the same time
+ * or by one writer. The lock prefers readers: a reader gets the lock whenever
+ * no writer holds it, even if a writer is waiting, so a reader may take the
+ * lock again while it already holds it. A waiting thread spins for a short
+ * while and then sleeps on a futex until the lock is released.
+ *
+ * A sequence lock never blocks the readers. A reader reads the sequence
+ * number, copies the data and checks that the sequence number did not change.
+ * If it changed, a writer modified the data during the copy and the reader
+ * must copy it again. The protected data must not contain pointers that a
+ * writer can free, as a reader may follow them at any time.
+ *
+ * @verbatim
+ * SEQLOCK lock = SEQLOCK_INIT;
+ * int seq;
+ *
+ * do
+ * {
+ *     seq = seqlock_read_begin(&lock);
+ *     copy = data;
+ * }
+ * while (seqlock_read_retry(&lock, seq));
+ * @endverbatim
+ */
+#include <spinlock.h>
+
+/**
+ * The readers-writer lock structure.
+ */
+typedef struct rwlock
+{
+    int state;   /*< Number of readers, -1 if a writer holds the lock */
+    int waiters; /*< Number of threads sleeping on the lock */
+#if SPINLOCK_COUNTERS
+    int contended; /*< No. of times acquire was contended */
+#endif
+} RWLOCK;
+
+#if SPINLOCK_COUNTERS
+#define RWLOCK_INIT { 0, 0, 0 }
+#else
+#define RWLOCK_INIT { 0, 0 }
+#endif
+
+#define RWLOCK_IS_WRITE_LOCKED(l) ((l)->state < 0 ? true : false)
+
+extern void rwlock_init(RWLOCK *lock);
+extern void rwlock_read_acquire(RWLOCK *lock);
+extern void rwlock_read_release(RWLOCK *lock);
+extern void rwlock_write_acquire(RWLOCK *lock);
+extern void rwlock_write_release(RWLOCK *lock);
+
+/**
+ * The sequence lock structure. The spinlock serializes the writers.
+ */
+typedef struct seqlock
+{
+    int      sequence; /*< Odd while a writer modifies the data */
+    SPINLOCK lock;     /*< Held by the writer */
+} SEQLOCK;
+
+#define SEQLOCK_INIT { 0, SPINLOCK_INIT }
+
+extern void seqlock_init(SEQLOCK *lock);
+extern void seqlock_write_begin(SEQLOCK *lock);
+extern void seqlock_write_end(SEQLOCK *lock);
+
+/**
+ * Start reading the data protected by a sequence lock. Waits until no
+ * writer modifies the data.
+ *
+ * @param lock The sequence lock
+ * @return The sequence number to pass to seqlock_read_retry
+ */
+static inline int seqlock_read_begin(SEQLOCK *lock)
+{
+    int sequence;
+
+    while ((sequence = *(volatile int*)&lock->sequence) & 1)
+    {
+        ;
+    }
+
+    __sync_synchronize();
+    return sequence;
+}
+
+/**
+ * Check whether the data was modified while it was read.
+ *
+ * @param lock     The sequence lock
+ * @param sequence The value returned by seqlock_read_begin
+ * @return True if the data must be read again
+ */
+static inline bool seqlock_read_retry(SEQLOCK *lock, int sequence)
+{
+    __sync_synchronize();
+    return *(volatile int*)&lock->sequence != sequence;
+}
+
+#endif
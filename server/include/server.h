@@ -14,6 +14,8 @@
  */
 #include <dcb.h>
 #include <resultset.h>
+#include <statistics.h>
+#include <metrics.h>
 
 /**
  * @file service.h
@@ -40,12 +42,16 @@
  * 19/02/15     Mark Riddoch            Addition of serverGetList
  * 01/06/15     Massimiliano Pinto      Addition of server_update_address/port
  * 19/06/15     Martin Brampton         Extra fields for persistent connections, CHK_SERVER
+ * 14/10/16     MariaDB Corporation     Addition of server state snapshots
+ * 14/10/16     MariaDB Corporation     Addition of load metrics
+ * 14/10/16     MariaDB Corporation     Addition of query latency histogram
  *
  * @endverbatim
  */
 
 #define MAX_SERVER_NAME_LEN 1024
 #define MAX_NUM_SLAVES 128 /**< Maximum number of slaves under a single server*/
+#define MAX_GTID_DOMAINS 16 /**< Maximum number of replication domains in a GTID position */
 
 /**
  * The server parameters used for weighting routing decissions
@@ -58,6 +64,17 @@ typedef struct server_params
     struct server_params *next; /**< Next Paramter in the linked list */
 } SERVER_PARAM;
 
+/**
+ * How a connection taken from the persistent pool is reset for a new session
+ */
+typedef enum
+{
+    PERSIST_RESET_NONE,        /**< Only connections of the same user are reused as they are */
+    PERSIST_RESET_CHANGE_USER, /**< Any connection is reused after a COM_CHANGE_USER */
+    PERSIST_RESET_CONNECTION   /**< As above, a connection of the same user gets a
+                                * COM_RESET_CONNECTION instead */
+} persist_reset_t;
+
 /**
  * The server statistics structure
  *
@@ -70,6 +87,80 @@ typedef struct
     int n_persistent;  /**< Current persistent pool */
 } SERVER_STATS;
 
+/**
+ * A pool of unused persistent connections to a server. Each polling thread
+ * takes connections from and returns them to a pool of its own.
+ */
+typedef struct server_persistent_pool
+{
+    DCB            *dcbs;          /**< List of unused persistent connections */
+    SPINLOCK       lock;           /**< Lock for adjusting the list */
+    int            n_dcbs;         /**< Number of connections in the list */
+    int            n_hits;         /**< Number of connections taken from the pool */
+    int            n_misses;       /**< Number of times no usable connection was found */
+    int            n_evictions;    /**< Number of connections closed by the pool */
+} __attribute__((aligned(64))) SERVER_PERSISTENT_POOL;
+
+/**
+ * The last GTID of one replication domain, as used by MariaDB 10
+ */
+typedef struct server_gtid
+{
+    uint32_t domain;   /**< Replication domain */
+    uint32_t server_id; /**< Server id of the transaction */
+    uint64_t sequence; /**< Sequence number of the transaction */
+} SERVER_GTID;
+
+#define MAX_LOAD_METRICS 8 /**< Maximum number of load metrics sampled from a server */
+#define LOAD_METRIC_NAME_LEN 64 /**< Maximum length of the name of a load metric */
+
+/**
+ * A load metric of a server, the value of a global status variable sampled by
+ * the monitor. For counters the rate per second of the variable is used.
+ */
+typedef struct server_load_metric
+{
+    char          name[LOAD_METRIC_NAME_LEN]; /**< Name of the global status variable */
+    bool          rate;           /**< The variable is a counter */
+    int64_t       value;          /**< The value, or the rate per second of a counter */
+    int64_t       raw;            /**< The last sampled value of a counter */
+    uint64_t      sampled;        /**< When the counter was last sampled, in milliseconds */
+} SERVER_LOAD_METRIC;
+
+#define SERVER_STATE_SLOTS 4 /**< Number of snapshots of the state kept for each server */
+
+/**
+ * The global variables of a server that the monitor caches so that the probe
+ * queries of the connectors can be answered without the server. The session
+ * variables may be changed by a session, the others are the same in every
+ * session.
+ */
+#define SERVER_N_VARIABLES 14
+#define SERVER_VARIABLE_INIT_CONNECT 0 /**< Index of init_connect */
+
+/**
+ * A snapshot of the state of a server. The monitors publish a new snapshot
+ * after each monitoring cycle and the routers get a consistent copy of it
+ * with server_get_state() without locking the server.
+ */
+typedef struct server_state
+{
+    uint64_t       version;        /**< Version of the snapshot, 0 while it is written */
+    unsigned int   status;         /**< Status flag bitmap of the server */
+    int            rlag;           /**< Replication lag in seconds */
+    int64_t        rlag_us;        /**< Smoothed replication lag in microseconds */
+    long           node_id;        /**< Node id of the server */
+    long           master_id;      /**< Master server id of the server */
+    int            depth;          /**< Replication level in the tree */
+    int            n_current;      /**< Current number of connections */
+    int            n_current_ops;  /**< Current number of operations */
+    int64_t        load;           /**< Sum of the load metrics */
+    SERVER_GTID    gtid_pos[MAX_GTID_DOMAINS]; /**< The executed GTIDs */
+    int            n_gtid_pos;     /**< Number of domains in gtid_pos */
+    SERVER_GTID    gtid_io_pos[MAX_GTID_DOMAINS]; /**< The GTIDs received from the masters */
+    int            n_gtid_io_pos;  /**< Number of domains in gtid_io_pos */
+} SERVER_STATE;
+
 /**
  * The SERVER structure defines a backend server. Each server has a name
  * or IP address for the server, a port that the server listens on and
@@ -96,6 +187,8 @@ typedef struct server
     char           *server_string; /**< Server version string, i.e. MySQL server version */
     long           node_id;        /**< Node id, server_id for M/S or local_index for Galera */
     int            rlag;           /**< Replication Lag for Master / Slave replication */
+    int64_t        rlag_us;        /**< Smoothed replication lag in microseconds, -1 if not
+                                    * available. Read with atomic_load_int64. */
     unsigned long  node_ts;        /**< Last timestamp set from M/S monitor module */
     SERVER_PARAM   *parameters;    /**< Parameters of a server that may be used to weight routing decisions */
     long           master_id;      /**< Master server id of this node */
@@ -104,12 +197,30 @@ typedef struct server
     bool           master_err_is_logged; /*< If node failed, this indicates whether it is logged */
     bool           slave_configured; /**< Server is configured as a replication slave
                                       * TODO: Remove this for 2.1 */
-    DCB            *persistent;    /**< List of unused persistent connections to the server */
-    SPINLOCK       persistlock;    /**< Lock for adjusting the persistent connections list */
+    SERVER_PERSISTENT_POOL *persistent; /**< Per-thread pools of unused persistent connections */
+    int            n_persistent_pools; /**< Number of persistent connection pools */
     long           persistpoolmax; /**< Maximum size of persistent connections pool */
     long           persistmaxtime; /**< Maximum number of seconds connection can live */
     int            persistmax;     /**< Maximum pool size actually achieved since startup */
+    persist_reset_t persistreset;  /**< How a pooled connection is reset for a new session */
     uint8_t        charset;        /**< Default server character set */
+    bool           compression;    /**< Use the compressed protocol with the server */
+    SERVER_GTID    gtid_pos[MAX_GTID_DOMAINS]; /**< The executed GTIDs, as reported by the monitor */
+    int            n_gtid_pos;     /**< Number of domains in gtid_pos */
+    unsigned long  gtid_sample;    /**< Incremented each time gtid_pos is updated, 0 if never */
+    SERVER_GTID    gtid_io_pos[MAX_GTID_DOMAINS]; /**< The GTIDs received from the masters by
+                                                   * the slave connections of the server */
+    int            n_gtid_io_pos;  /**< Number of domains in gtid_io_pos */
+    SERVER_LOAD_METRIC load_metrics[MAX_LOAD_METRICS]; /**< The sampled load metrics */
+    int            n_load_metrics; /**< Number of load metrics */
+    int64_t        load;           /**< Sum of the load metrics, -1 if not sampled. Read
+                                    * with atomic_load_int64. */
+    SERVER_STATE   states[SERVER_STATE_SLOTS]; /**< The published snapshots, reused in turn */
+    SERVER_STATE   *state;         /**< The newest snapshot, NULL if none is published */
+    uint64_t       state_version;  /**< Version of the newest snapshot */
+    TS_LATENCY     *latency;       /**< Query latencies, NULL until the first is recorded */
+    char           *variables[SERVER_N_VARIABLES]; /**< The cached global variables, NULL
+                                    * if not known. Protected by lock. */
 #if defined(SS_DEBUG)
     skygw_chk_t    server_chk_tail;
 #endif
@@ -132,6 +243,7 @@ typedef struct server
 #define SERVER_MASTER_STICKINESS 0x0100  /**<< Server Master stickiness */
 #define SERVER_AUTH_ERROR        0x1000  /**<< Authentication error from monitor */
 #define SERVER_STALE_SLAVE       0x2000  /**<< Slave status is possible even without a master */
+#define SERVER_DRAINING          0x4000  /**<< Server is being drained, no new sessions or reads */
 
 /**
  * Is the server running - the macro returns true if the server is marked as running
@@ -185,6 +297,12 @@ typedef struct server
  */
 #define SERVER_IN_MAINT(server)         ((server)->status & SERVER_MAINT)
 
+/**
+ * Is the server being drained. A draining server is not given new sessions and
+ * the existing sessions move away from it when the routers can do so.
+ */
+#define SERVER_IS_DRAINING(server)      ((server)->status & SERVER_DRAINING)
+
 /** server is not master, slave or joined */
 #define SERVER_NOT_IN_CLUSTER(s) (((s)->status & (SERVER_MASTER|SERVER_SLAVE|SERVER_JOINED|SERVER_NDB)) == 0)
 
@@ -203,6 +321,7 @@ extern void printAllServers();
 extern void dprintAllServers(DCB *);
 extern void dprintAllServersJson(DCB *);
 extern void dprintServer(DCB *, SERVER *);
+extern void dprintLatency(DCB *dcb, const char *title, TS_LATENCY *latency);
 extern void dprintPersistentDCBs(DCB *, SERVER *);
 extern void dListServers(DCB *);
 extern char *server_status(SERVER *);
@@ -210,16 +329,35 @@ extern void server_clear_set_status(SERVER *server, int specified_bits, int bits
 extern void server_set_status(SERVER *, int);
 extern void server_clear_status(SERVER *, int);
 extern void server_transfer_status(SERVER *dest_server, SERVER *source_server);
+extern int server_status_generation();
 extern void serverAddMonUser(SERVER *, char *, char *);
 extern void serverAddParameter(SERVER *, char *, char *);
 extern char *serverGetParameter(SERVER *, char *);
 extern void server_update(SERVER *, char *, char *, char *);
 extern void server_set_unique_name(SERVER *, char *);
 extern DCB  *server_get_persistent(SERVER *, char *, const char *);
+extern SERVER_PERSISTENT_POOL *server_persistent_pool(SERVER *server, int thread_id);
+extern int  server_persistent_pool_limit(SERVER *server);
 extern void server_update_address(SERVER *, char *);
 extern void server_update_port(SERVER *,  unsigned short);
 extern RESULTSET *serverGetList();
+extern RESULTSET *serverGetLatencyList();
+extern void server_metrics(METRICS *metrics);
+extern void latency_add_columns(RESULTSET *set);
+extern void latency_row_set(RESULT_ROW *row, int col, TS_LATENCY *latency);
 extern unsigned int server_map_status(char *str);
 extern bool server_set_version_string(SERVER* server, const char* string);
+extern bool server_set_gtid_pos(SERVER* server, const char* gtid_list);
+extern unsigned long server_get_gtid_pos(SERVER* server, SERVER_GTID* gtids, int* n_gtids);
+extern bool server_set_gtid_io_pos(SERVER* server, const char* gtid_list);
+extern void server_get_gtid_io_pos(SERVER* server, SERVER_GTID* gtids, int* n_gtids);
+extern bool server_gtid_pos_reached(SERVER* server, const SERVER_GTID* gtids, int n_gtids);
+extern void server_publish_state(SERVER* server);
+extern bool server_get_state(SERVER* server, SERVER_STATE* state);
+extern const char *server_variable_name(int index);
+extern bool server_variable_is_session(int index);
+extern int server_variable_index(const char* name, size_t len);
+extern bool server_set_variable(SERVER* server, int index, const char* value);
+extern bool server_get_variable(SERVER* server, int index, char* dest, size_t size);
 
 #endif
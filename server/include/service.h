@@ -50,6 +50,7 @@
  * 09/09/14     Massimiliano Pinto      Added service option for localhost authentication
  * 09/10/14     Massimiliano Pinto      Added service resources via hashtable
  * 31/05/16     Martin Brampton         Add fields to support connection throttling
+ * 14/10/16     MariaDB Corporation     Add query latency histogram
  *
  * @endverbatim
  */
@@ -67,6 +68,7 @@ typedef struct
     int    n_failed_starts; /**< Number of times this service has failed to start */
     int    n_sessions;      /**< Number of sessions created on service since start */
     int    n_current;       /**< Current number of sessions */
+    int    n_probes;        /**< Number of probe queries answered locally */
 } SERVICE_STATS;
 
 /**
@@ -108,6 +110,16 @@ typedef struct server_ref_t
  */
 #define SERVICE_PARAM_UNINIT -1
 
+/**
+ * A client that waits for the users of a service to be loaded
+ */
+typedef struct service_users_waiter
+{
+    DCB *dcb;                            /**< The client DCB */
+    GWBUF *packet;                       /**< Packet delivered to the DCB after the load */
+    struct service_users_waiter *next;   /**< The next waiting client */
+} SERVICE_USERS_WAITER;
+
 /**
  * Defines a service within the gateway.
  *
@@ -147,6 +159,8 @@ typedef struct service
                                         * to escape at least the underscore character. */
     SPINLOCK users_table_spin;         /**< The spinlock for users data refresh */
     SERVICE_REFRESH_RATE rate_limit;   /**< The refresh rate limit for users table */
+    bool users_loading;                /**< Users are being loaded in the background */
+    SERVICE_USERS_WAITER *users_waiters; /**< Clients waiting for the background load */
     FILTER_DEF **filters;              /**< Ordered list of filters */
     int n_filters;                     /**< Number of filters */
     uint64_t conn_idle_timeout;        /**< Session timeout in seconds */
@@ -154,8 +168,22 @@ typedef struct service
     struct service *next;              /**< The next service in the linked list */
     bool retry_start;                  /*< If starting of the service should be retried later */
     bool log_auth_warnings;            /*< Log authentication failures and warnings */
+    TS_LATENCY *latency;               /**< Query latencies, NULL until the first is recorded */
+    int dedicated_threads;             /**< Polling threads reserved for the service, 0 for none */
+    int poll_group;                    /**< The thread group polling the listeners, 0 is shared */
+    int max_execution_time;            /**< Milliseconds a query may run before it is
+                                        * killed, 0 for no limit */
+    struct governor *governor;         /**< Limits the active queries, NULL for no limits */
+    int local_probes;                  /**< The probe queries answered without a backend,
+                                        * a bitmask of SERVICE_PROBE_* values */
 } SERVICE;
 
+/** The probe queries of the connectors that the client protocol answers itself */
+#define SERVICE_PROBE_VARIABLES 0x01 /**< SELECT @@variable and SHOW VARIABLES LIKE */
+#define SERVICE_PROBE_DATABASE  0x02 /**< SELECT DATABASE() */
+#define SERVICE_PROBE_SET_NAMES 0x04 /**< SET NAMES that keeps the character set */
+#define SERVICE_PROBE_ALL       0x07
+
 typedef enum count_spec_t
 {
     COUNT_NONE = 0,
@@ -176,18 +204,25 @@ extern int service_isvalid(SERVICE *);
 extern int serviceAddProtocol(SERVICE *, char *, char *, unsigned short, char *, SSL_LISTENER *);
 extern int serviceHasProtocol(SERVICE *service, const char *protocol,
                               const char* address, unsigned short port);
+extern SERV_LISTENER *serviceFindListener(SERVICE *service, const char *protocol,
+                                          const char* address, unsigned short port);
 extern void serviceAddBackend(SERVICE *, SERVER *);
 extern int serviceHasBackend(SERVICE *, SERVER *);
 extern void serviceAddRouterOption(SERVICE *, char *);
 extern void serviceClearRouterOptions(SERVICE *);
+extern bool serviceUpdateRouterOptions(SERVICE *service, char *options);
 extern int serviceStart(SERVICE *);
 extern int serviceStartAll();
 extern void serviceStartProtocol(SERVICE *, char *, int);
 extern int serviceStop(SERVICE *);
 extern int serviceRestart(SERVICE *);
+extern bool serviceStopListener(SERV_LISTENER *port);
+extern bool serviceRestartListener(SERV_LISTENER *port);
+extern SERV_LISTENER **serviceStopAllListeners(int *n_ports);
 extern int serviceSetUser(SERVICE *, char *, char *);
 extern int serviceGetUser(SERVICE *, char **, char **);
 extern bool serviceSetFilters(SERVICE *, char *);
+extern bool serviceUpdateFilters(SERVICE *service, char *filters);
 extern int serviceSetSSL(SERVICE *service, char* action);
 extern int serviceSetSSLVersion(SERVICE *service, char* version);
 extern int serviceSetSSLVerifyDepth(SERVICE* service, int depth);
@@ -200,9 +235,12 @@ extern void serviceWeightBy(SERVICE *, char *);
 extern char *serviceGetWeightingParameter(SERVICE *);
 extern int serviceEnableLocalhostMatchWildcardHost(SERVICE *, int);
 extern int serviceStripDbEsc(SERVICE* service, int action);
+extern bool serviceSetLocalProbes(SERVICE* service, const char* value);
 extern int serviceAuthAllServers(SERVICE *service, int action);
 extern void service_update(SERVICE *, char *, char *, char *);
 extern int service_refresh_users(SERVICE *);
+extern bool service_refresh_users_async(SERVICE *service, DCB *dcb, GWBUF *packet);
+extern void service_refresh_users_cancel(SERVICE *service, DCB *dcb);
 extern void printService(SERVICE *);
 extern void printAllServices();
 extern void dprintAllServices(DCB *);
@@ -212,12 +250,16 @@ extern bool service_set_param_value(SERVICE*            service,
                                     count_spec_t        count_spec,
                                     config_param_type_t type);
 extern void dprintService(DCB *, SERVICE *);
+extern void service_record_latency(SERVICE *service, SERVER *server, uint64_t us);
 extern void dListServices(DCB *);
+extern void dprintServicesMemory(DCB *);
 extern void dListListeners(DCB *);
 extern char* service_get_name(SERVICE* svc);
 extern void service_shutdown();
 extern int serviceSessionCountAll();
 extern RESULTSET *serviceGetList();
+extern RESULTSET *serviceGetLatencyList();
+extern void service_metrics(METRICS *metrics);
 extern RESULTSET *serviceGetListenerList();
 extern bool service_all_services_have_listeners();
 
@@ -29,6 +29,12 @@
  * 29-05-2014   Mark Riddoch            Support for filter mechanism
  *                                      added
  * 20-02-2015   Markus Mäkelä           Added session timeouts
+ * 14-10-2016   MariaDB Corporation     Added the trace of the current query
+ * 14-10-2016   MariaDB Corporation     Idle timeouts are checked with a timer
+ * 14-10-2016   MariaDB Corporation     Added the free list link
+ * 14-10-2016   MariaDB Corporation     Added the memory arena
+ * 14-10-2016   MariaDB Corporation     Added the state in the concurrency governor
+ * 14-10-2016   MariaDB Corporation     Added the key of the resource usage
  *
  * @endverbatim
  */
@@ -37,8 +43,11 @@
 #include <buffer.h>
 #include <spinlock.h>
 #include <resultset.h>
+#include <timer.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <trace.h>
+#include <governor.h>
 
 struct dcb;
 struct service;
@@ -108,6 +117,36 @@ typedef enum
     SESSION_LIST_CONNECTION
 } SESSIONLISTFILTER;
 
+/** Size of the chunks of the memory arena of a session */
+#define SESSION_ARENA_CHUNK_SIZE 2048
+
+/** Alignment of the allocations made from the arena */
+#define SESSION_ARENA_ALIGN 16
+
+/**
+ * A chunk of the memory arena of a session, the memory handed out follows
+ * the header
+ */
+typedef struct session_arena_chunk
+{
+    struct session_arena_chunk *next; /*< The next chunk */
+    size_t size;                      /*< Bytes in the chunk */
+    size_t used;                      /*< Bytes handed out from the chunk */
+} SESSION_ARENA_CHUNK;
+
+/**
+ * The memory arena of a session. The memory that lives as long as the session
+ * is allocated from the arena in larger chunks and freed at once when the
+ * session is freed.
+ */
+typedef struct session_arena
+{
+    SPINLOCK             lock;      /*< Protects the arena */
+    SESSION_ARENA_CHUNK *chunks;    /*< The chunks, small allocations come from the first */
+    size_t               used;      /*< Bytes handed out */
+    size_t               allocated; /*< Bytes in the chunks */
+} SESSION_ARENA;
+
 /**
  * The session status block
  *
@@ -134,20 +173,26 @@ typedef struct session
     DOWNSTREAM      head;             /*< Head of the filter chain */
     UPSTREAM        tail;             /*< The tail of the filter chain */
     struct session  *next;            /*< Linked list of all sessions */
+    struct session  *free_next;       /*< Next session in a list of free sessions */
     int             refcount;         /*< Reference count on the session */
     bool            ses_is_child;     /*< this is a child session */
+    TRACE_STATE     trace;            /*< The trace of the current query */
+    TIMER           idle_timer;       /*< Checks whether the session has been idle too long */
+    SESSION_ARENA   arena;            /*< Memory that is freed with the session */
+    governor_state_t gov_state;       /*< State in the concurrency governor of the service */
+    GOVERNOR_USER   *gov_user;        /*< The governor counters of the user, NULL until known */
+    GWBUF           *gov_queued;      /*< The queries waiting for a slot */
+    uint64_t        gov_wait_start;   /*< When the session started to wait for a slot */
+    struct session  *gov_next;        /*< The next session waiting for a slot */
+    bool            gov_backend;      /*< The query of the slot was written to a backend */
+    struct dcb      *reply_dcb;       /*< The backend whose reply is being routed,
+                                       * NULL when no reply is */
+    int             usage_key;        /*< The key of the resource usage of the user */
 #if defined(SS_DEBUG)
     skygw_chk_t     ses_chk_tail;
 #endif
 } SESSION;
 
-/** Whether to do session timeout checks */
-extern bool check_timeouts;
-
-/** When the next timeout check is done. This is compared to hkheartbeat in
- * hk_heartbeat.h */
-extern long next_timeout_check;
-
 #define SESSION_PROTOCOL(x, type)       DCB_PROTOCOL((x)->client_dcb, type)
 
 /**
@@ -171,6 +216,8 @@ SESSION *get_all_sessions();
 SESSION *session_alloc(struct service *, struct dcb *);
 SESSION *session_set_dummy(struct dcb *);
 bool session_free(SESSION *);
+void *session_arena_alloc(SESSION *, size_t);
+size_t session_memory_usage(SESSION *);
 int session_isvalid(SESSION *);
 int session_reply(void *inst, void *session, GWBUF *data);
 char *session_get_remote(SESSION *);
@@ -178,14 +225,15 @@ char *session_getUser(SESSION *);
 void printAllSessions();
 void printSession(SESSION *);
 void dprintAllSessions(struct dcb *);
+void dprintSessionsPage(struct dcb *, int, int);
 void dprintSession(struct dcb *, SESSION *);
 void dListSessions(struct dcb *);
+void dListSessionsPage(struct dcb *, int, int);
 char *session_state(session_state_t);
 bool session_link_dcb(SESSION *, struct dcb *);
 SESSION* get_session_by_router_ses(void* rses);
 void session_enable_log_priority(SESSION* ses, int priority);
 void session_disable_log_priority(SESSION* ses, int priority);
 RESULTSET *sessionGetList(SESSIONLISTFILTER);
-void process_idle_sessions();
 void enable_session_timeouts();
 #endif
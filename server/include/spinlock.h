@@ -18,21 +18,31 @@
  *
  * Spinlock implementation for MaxScale.
  *
- * Spinlocks are cheap locks that can be used to protect short code blocks, they are
- * generally wasteful as any blocked threads will spin, consuming CPU cycles, waiting
- * for the lock to be released. However they are useful in that they do not involve
- * system calls and are light weight when the expected wait time for a lock is low.
+ * Spinlocks are cheap locks that can be used to protect short code blocks. They
+ * do not involve system calls and are light weight when the expected wait time
+ * for a lock is low. A blocked thread spins for a short while with an
+ * exponential backoff and then sleeps on a futex until the lock is released,
+ * so that a long wait does not consume CPU cycles or starve the lock holder.
  */
 #include <thread.h>
 #include <stdbool.h>
 
 #define SPINLOCK_PROFILE 0
 
+/**
+ * Count the contended acquires of each lock. The counters are only updated
+ * when a thread had to wait for the lock.
+ */
+#define SPINLOCK_COUNTERS 1
+
 /**
  * The spinlock structure.
  *
- * In normal builds the structure merely contains a lock value which
- * is 0 if the spinlock is not taken and greater than zero if it is held.
+ * The lock value is 0 if the spinlock is not taken, 1 if it is held and 2 if
+ * it is held and threads may be sleeping on it.
+ *
+ * In builds with the SPINLOCK_COUNTERS option set the structure also counts
+ * the acquires that had to wait and the acquires that slept.
  *
  * In builds with the SPINLOCK_PROFILE option set this structure also holds
  * a number of profile related fields that count the number of spins, number
@@ -41,13 +51,16 @@
 typedef struct spinlock
 {
     int lock;         /*< Is the lock held? */
+#if SPINLOCK_COUNTERS || SPINLOCK_PROFILE
+    int contended;    /*< No. of times acquire was contended */
+    int parked;       /*< No. of times acquire slept on the lock */
+#endif
 #if SPINLOCK_PROFILE
     int spins;        /*< Number of spins on this lock */
     int maxspins;     /*< Max no of spins to acquire lock */
     int acquired;     /*< No. of times lock was acquired */
     int waiting;      /*< No. of threads acquiring this lock */
     int max_waiting;  /*< Max no of threads waiting for lock */
-    int contended;    /*< No. of times acquire was contended */
     THREAD owner;     /*< Last owner of this lock */
 #endif
 } SPINLOCK;
@@ -60,7 +73,9 @@ typedef struct spinlock
 #endif
 
 #if SPINLOCK_PROFILE
-#define SPINLOCK_INIT { 0, 0, 0, 0, 0, 0, 0, 0 }
+#define SPINLOCK_INIT { 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+#elif SPINLOCK_COUNTERS
+#define SPINLOCK_INIT { 0, 0, 0 }
 #else
 #define SPINLOCK_INIT { 0 }
 #endif
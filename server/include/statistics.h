@@ -16,29 +16,102 @@
 /**
  * @file statistics.h  - Lock-free statistics gathering
  *
+ * Each thread has a block of 64-bit slots of its own, aligned to a cache line.
+ * A statistic is one slot in the block of every thread, so a thread only writes
+ * to its own block and the threads never share a cache line. Reading a
+ * statistic sums the slots of all threads.
+ *
+ * Threads that have not set a thread id share one extra block that is
+ * updated with atomic operations.
+ *
  * @verbatim
  * Revision History
  *
- * Date         Who              Description
- * 21/01/16     Markus Makela    Initial implementation
+ * Date         Who                     Description
+ * 21/01/16     Markus Makela           Initial implementation
+ * 14/10/16     MariaDB Corporation     Per-thread blocks of 64-bit slots, gauges and histograms
+ * 14/10/16     MariaDB Corporation     Per-thread latency histograms
  * @endverbatim
  */
 
+#include <stdint.h>
+#include <stdbool.h>
+
+/** The per-thread blocks are aligned to and padded to this size */
+#define TS_STATS_CACHE_LINE 64
+
+/** Maximum number of slots, a counter or a gauge uses one slot and a histogram
+ * one slot for each bucket */
+#define TS_STATS_MAX_SLOTS 1024
+
+/** Maximum number of buckets in a histogram */
+#define TS_STATS_MAX_BUCKETS 64
+
+/** Number of buckets in a latency histogram */
+#define TS_LATENCY_BUCKETS 312
+
 typedef void* ts_stats_t;
 
+/** A histogram of values, counted per thread */
+typedef struct ts_histogram TS_HISTOGRAM;
+
+/** A latency histogram, recorded per thread */
+typedef struct ts_latency TS_LATENCY;
+
+/**
+ * The values of a latency histogram
+ *
+ * The latencies are in microseconds. The histogram has 16 linear buckets for
+ * the first 16 microseconds and then 8 buckets for each power of two, so
+ * a percentile is accurate to within 12.5%.
+ *
+ * This holds the merged values of a TS_LATENCY. Code that records latencies
+ * under its own lock, or in a single thread, can also use it directly as a
+ * histogram with ts_latency_record().
+ */
+typedef struct ts_latency_snapshot
+{
+    uint64_t count;                    /**< Number of samples */
+    uint64_t total;                    /**< Sum of the samples */
+    uint64_t max;                      /**< Largest sample */
+    uint64_t hist[TS_LATENCY_BUCKETS]; /**< Number of samples in each bucket */
+} TS_LATENCY_SNAPSHOT;
+
 /** stats_init should be called only once */
 void ts_stats_init();
 
-/** No-op for now */
+/** Frees the per-thread blocks */
 void ts_stats_end();
 
 /** Every thread should call set_current_thread_id only once */
 void ts_stats_set_thread_id(int id);
+int ts_stats_get_thread_id();
 
+/** Counters and gauges */
 ts_stats_t ts_stats_alloc();
 void ts_stats_free(ts_stats_t stats);
-void ts_stats_add(ts_stats_t stats, int value);
-void ts_stats_set(ts_stats_t stats, int value);
-int ts_stats_sum(ts_stats_t stats);
+void ts_stats_add(ts_stats_t stats, int64_t value);
+void ts_stats_set(ts_stats_t stats, int64_t value);
+int64_t ts_stats_sum(ts_stats_t stats);
+int64_t ts_stats_max(ts_stats_t stats);
+void ts_stats_snapshot(ts_stats_t *stats, int n_stats, int64_t *values);
+
+/** Histograms */
+TS_HISTOGRAM* ts_histogram_alloc(const int64_t *bounds, int n_bounds);
+void ts_histogram_free(TS_HISTOGRAM *hist);
+void ts_histogram_add(TS_HISTOGRAM *hist, int64_t value);
+int ts_histogram_snapshot(TS_HISTOGRAM *hist, int64_t *counts);
+
+/** Latency histograms */
+uint64_t ts_clock_us();
+TS_LATENCY* ts_latency_alloc();
+TS_LATENCY* ts_latency_get(TS_LATENCY **latency);
+void ts_latency_free(TS_LATENCY *latency);
+void ts_latency_add(TS_LATENCY *latency, uint64_t us);
+void ts_latency_snapshot(TS_LATENCY *latency, TS_LATENCY_SNAPSHOT *snapshot);
+void ts_latency_record(TS_LATENCY_SNAPSHOT *snapshot, uint64_t us);
+void ts_latency_merge(TS_LATENCY_SNAPSHOT *dest, const TS_LATENCY_SNAPSHOT *src);
+uint64_t ts_latency_percentile(const TS_LATENCY_SNAPSHOT *snapshot, double fraction);
+uint64_t ts_latency_value(int bucket);
 
 #endif
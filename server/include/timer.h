@@ -0,0 +1,95 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file timer.h A hierarchical timer wheel
+ *
+ * A timer wheel keeps timers in slots indexed by their expiry tick. The
+ * first level has one slot per tick, each of the higher levels has one slot
+ * per a full rotation of the level below it. When the first level wraps
+ * around, the timers of the next slot of the second level are moved down to
+ * the first level and so on. Adding and cancelling a timer is O(1) and
+ * running the wheel only touches the timers that are about to expire.
+ *
+ * The timer structure is embedded in the object that owns the timer, no
+ * memory is allocated when a timer is added.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdbool.h>
+#include <pthread.h>
+#include <spinlock.h>
+
+/** Number of bits of the expiry tick used to index the slots of a level */
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer_wheel;
+
+/**
+ * A timer
+ */
+typedef struct timer
+{
+    struct timer *next;           /*< Next timer in the slot */
+    struct timer *prev;           /*< Previous timer in the slot */
+    struct timer_wheel *wheel;    /*< The wheel the timer was added to */
+    long expires;                 /*< The tick when the timer expires */
+    long interval;                /*< Interval in ticks of a repeating timer, 0 for one-shot */
+    void (*fn)(void *data);       /*< The function to call */
+    void *data;                   /*< Data passed to the function */
+} TIMER;
+
+/**
+ * A timer wheel
+ */
+typedef struct timer_wheel
+{
+    SPINLOCK lock;                /*< Protects the wheel and the timers in it */
+    int resolution;               /*< Length of one tick in milliseconds */
+    long current;                 /*< The next tick to process */
+    int count;                    /*< Number of timers in the wheel */
+    TIMER *running;               /*< The timer whose function is being called */
+    pthread_t runner;             /*< The thread calling the function */
+    TIMER slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; /*< List heads of the slots */
+} TIMER_WHEEL;
+
+extern void timer_wheel_init(TIMER_WHEEL *wheel, int resolution);
+extern int  timer_wheel_run(TIMER_WHEEL *wheel);
+extern int  timer_wheel_next(TIMER_WHEEL *wheel);
+extern void timer_init(TIMER *timer, void (*fn)(void *), void *data);
+extern void timer_add(TIMER_WHEEL *wheel, TIMER *timer, int delay, int interval);
+extern bool timer_cancel(TIMER *timer);
+extern long timer_clock();
+
+/**
+ * Check whether a timer is waiting to expire
+ *
+ * @param timer The timer
+ * @return True if the timer is in a wheel
+ */
+static inline bool timer_pending(TIMER *timer)
+{
+    return timer->next != NULL;
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file trace.h - Sampled tracing of the stages of the request pipeline
+ *
+ * One query in every trace_sample_rate is traced. The stages of a traced
+ * query are timed with the time-stamp counter and each stage is recorded in
+ * a ring buffer of the thread that ended it and in the per-stage totals.
+ *
+ * A stage ends when the next one starts, so the protocol modules and the
+ * routers only mark the boundaries:
+ *
+ * @verbatim
+ * client     trace_begin      reading the query in the client protocol
+ * filters    before routing   the filter chain
+ * classify   router entry     query classification in the router
+ * route      after classify   choosing the target and preparing the query
+ * write      before write     writing the query to the backend
+ * backend    after write      waiting for the reply of the backend
+ * reply      reply entry      processing the reply, until trace_end
+ * @endverbatim
+ *
+ * Routers that do not classify the queries skip the classify stage.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/2016   MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <rdtsc.h>
+
+struct dcb;
+struct resultset;
+
+/** Number of events in the ring buffer of each thread */
+#define TRACE_RING_SIZE 4096
+
+typedef enum
+{
+    TRACE_CLIENT,   /**< Reading the query in the client protocol */
+    TRACE_FILTERS,  /**< The filter chain */
+    TRACE_CLASSIFY, /**< Query classification in the router */
+    TRACE_ROUTE,    /**< Choosing the target and preparing the query */
+    TRACE_WRITE,    /**< Writing the query to the backend */
+    TRACE_BACKEND,  /**< Waiting for the reply of the backend */
+    TRACE_REPLY,    /**< Processing the reply and sending it to the client */
+    TRACE_N_STAGES
+} trace_stage_t;
+
+/**
+ * The trace of the current query of a session
+ */
+typedef struct trace_state
+{
+    CYCLES        stage_start; /**< When the current stage started, 0 if not traced */
+    trace_stage_t stage;       /**< The current stage */
+} TRACE_STATE;
+
+/** One query in every trace_sample_rate is traced, 0 disables tracing */
+extern int trace_sample_rate;
+
+extern void trace_init();
+extern void trace_sample(TRACE_STATE *trace);
+extern void trace_record(TRACE_STATE *trace, uint64_t session, trace_stage_t next, bool end);
+extern void dprintTrace(struct dcb *dcb);
+extern struct resultset *traceGetStageList();
+
+/**
+ * Start the trace of a query, if the query is sampled
+ *
+ * A query that is still in the client stage is restarted, as the previous
+ * read did not contain a complete query.
+ *
+ * @param trace The trace of the session
+ */
+static inline void trace_begin(TRACE_STATE *trace)
+{
+    if (trace_sample_rate)
+    {
+        trace_sample(trace);
+    }
+}
+
+/**
+ * End the current stage of a traced query and start the next one
+ *
+ * The stages only move forward. The boundaries reached by the next query of
+ * a pipeline before the traced query is complete are ignored.
+ *
+ * @param trace   The trace of the session
+ * @param session Id of the session
+ * @param next    The next stage
+ */
+static inline void trace_stage(TRACE_STATE *trace, uint64_t session, trace_stage_t next)
+{
+    if (trace->stage_start && next > trace->stage)
+    {
+        trace_record(trace, session, next, false);
+    }
+}
+
+/**
+ * End the last stage of a traced query
+ *
+ * @param trace   The trace of the session
+ * @param session Id of the session
+ */
+static inline void trace_end(TRACE_STATE *trace, uint64_t session)
+{
+    if (trace->stage_start)
+    {
+        trace_record(trace, session, TRACE_N_STAGES, true);
+    }
+}
+
+#endif
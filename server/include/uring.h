@@ -0,0 +1,53 @@
+#ifndef _URING_H
+#define _URING_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file uring.h  - The io_uring I/O engine
+ *
+ * With the io_uring engine, each polling thread has an io_uring instance
+ * through which the writes done by the thread are submitted. The sends
+ * queued while the thread processes its events are submitted with one
+ * system call at the end of the iteration of the polling loop and the
+ * completions are handled when the ring becomes readable in epoll.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdbool.h>
+#include <skygw_debug.h>
+
+EXTERN_C_BLOCK_BEGIN
+
+struct dcb;
+struct gwbuf;
+
+extern bool uring_init(int n_threads);
+extern bool uring_in_use();
+extern int  uring_fd(int thread_id);
+extern void *uring_event_ptr(int thread_id);
+extern int  uring_event_thread(void *ptr);
+extern bool uring_write(struct dcb *dcb, struct gwbuf *queue);
+extern void uring_submit(int thread_id);
+extern void uring_complete(int thread_id);
+extern void uring_stats(struct dcb *pdcb);
+
+EXTERN_C_BLOCK_END
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef _USAGE_H
+#define _USAGE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file usage.h  - Accounting of the resources used by each user of a service
+ *
+ * The queries, the bytes the clients send and receive, the time the backend
+ * servers are busy with the queries and the time the polling threads spend
+ * processing the events of the sessions are counted for each user of each
+ * service. The totals of a service are the sums over its users.
+ *
+ * Each service and user pair is given a key the first time one of its
+ * sessions is accounted and the session keeps the key. Each thread counts into
+ * arrays of its own that are indexed by the key, so counting takes no locks
+ * and does not share cache lines between threads. The times are measured with
+ * the time-stamp counter, which is calibrated when the accounting is
+ * initialized.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <session.h>
+#include <resultset.h>
+
+struct dcb;
+struct service;
+struct metrics;
+
+/** The session has not been given a key, its user is not known yet */
+#define USAGE_KEY_UNKNOWN -1
+
+/** The session is not accounted */
+#define USAGE_KEY_NONE -2
+
+/** Maximum number of service and user pairs that are accounted */
+#define USAGE_MAX_KEYS 65536
+
+/** The accounted resources */
+typedef enum
+{
+    USAGE_QUERIES,          /*< Queries routed to the service */
+    USAGE_BYTES_IN,         /*< Bytes read from the client */
+    USAGE_BYTES_OUT,        /*< Bytes written to the client */
+    USAGE_BACKEND_CYCLES,   /*< Time the backends were executing the queries */
+    USAGE_PROXY_CYCLES,     /*< Time the polling threads processed the events */
+    USAGE_N_COUNTERS
+} usage_counter_t;
+
+/**
+ * The resources used by a user of a service
+ */
+typedef struct usage
+{
+    uint64_t counters[USAGE_N_COUNTERS];
+} USAGE;
+
+extern void usage_init();
+extern int usage_session_key(SESSION *session);
+extern void usage_add_key(int key, usage_counter_t counter, uint64_t value);
+extern bool usage_get(int key, struct service **service, const char **user, USAGE *usage);
+extern uint64_t usage_cycles_to_us(uint64_t cycles);
+extern void dShowUsage(struct dcb *dcb);
+extern RESULTSET *usageGetList();
+extern RESULTSET *usageGetServiceList();
+extern void usage_metrics(struct metrics *metrics);
+
+/**
+ * Count the use of a resource by a session
+ *
+ * @param session The session
+ * @param counter The resource
+ * @param value   The amount used
+ */
+static inline void usage_add(SESSION *session, usage_counter_t counter, uint64_t value)
+{
+    int key = session->usage_key >= 0 ? session->usage_key : usage_session_key(session);
+
+    if (key >= 0)
+    {
+        usage_add_key(key, counter, value);
+    }
+}
+
+#endif
@@ -28,6 +28,8 @@
  * 26/02/14     Massimiliano Pinto      Added checksum to users' table with SHA1
  * 27/02/14     Massimiliano Pinto      Added USERS_HASHTABLE_DEFAULT_SIZE
  * 28/02/14     Massimiliano Pinto      Added usersCustomUserFormat, optional username format routine
+ * 14/10/16     MariaDB Corporation     Added the optional lookup index
+ * 14/10/16     MariaDB Corporation     Added the fingerprint of the source tables
  *
  * @endverbatim
  */
@@ -53,8 +55,13 @@ typedef struct users
 {
     HASHTABLE *data;                        /**< The hashtable containing the actual data */
     char *(*usersCustomUserFormat)(void *); /**< Optional username format routine */
+    void *index;                            /**< Optional lookup index built from the data */
+    void (*usersIndexFree)(void *);         /**< Frees the lookup index */
     USERS_STATS stats;                      /**< The statistics for the users table */
     unsigned char cksum[SHA_DIGEST_LENGTH]; /**< The users' table ckecksum */
+    unsigned char fingerprint[SHA_DIGEST_LENGTH]; /**< Digest of the tables the users
+                                                   * were loaded from */
+    bool has_fingerprint;                   /**< Whether the fingerprint is set */
 } USERS;
 
 extern USERS *users_alloc();                      /**< Allocate a users table */
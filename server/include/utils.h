@@ -21,13 +21,16 @@
  *
  * Date     Who                 Description
  * 22/03/16 Martin Brampton     Initial implementation
+ * 14/10/16 MariaDB Corporation FNV-1a hash
  *
  * @endverbatim
  */
 
+#include <stddef.h>
+#include <stdint.h>
+
 int setnonblocking(int fd);
 char  *gw_strend(register const char *s);
-static char gw_randomchar();
 int gw_generate_random_str(char *output, int len);
 int gw_hex2bin(uint8_t *out, const char *in, unsigned int len);
 char *gw_bin2hex(char *out, const uint8_t *in, unsigned int len);
@@ -37,4 +40,56 @@ void gw_sha1_2_str(const uint8_t *in, int in_len, const uint8_t *in2, int in2_le
 int gw_getsockerrno(int fd);
 char *create_hex_sha1_sha1_passwd(char *passwd);
 
+/** The initial value of a 64-bit FNV-1a hash */
+#define MXS_FNV1A64_INIT 14695981039346656037ULL
+
+/**
+ * Add a byte to a 64-bit FNV-1a hash
+ *
+ * @param hash The hash so far, MXS_FNV1A64_INIT for a new hash
+ * @param byte The byte
+ * @return The hash
+ */
+static inline uint64_t mxs_fnv1a64_byte(uint64_t hash, uint8_t byte)
+{
+    return (hash ^ byte) * 1099511628211ULL;
+}
+
+/**
+ * Add bytes to a 64-bit FNV-1a hash
+ *
+ * @param hash The hash so far, MXS_FNV1A64_INIT for a new hash
+ * @param data The bytes
+ * @param len  Number of bytes
+ * @return The hash
+ */
+static inline uint64_t mxs_fnv1a64(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *ptr = (const uint8_t *)data;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = mxs_fnv1a64_byte(hash, ptr[i]);
+    }
+
+    return hash;
+}
+
+/**
+ * Add a null terminated string to a 64-bit FNV-1a hash
+ *
+ * @param hash The hash so far, MXS_FNV1A64_INIT for a new hash
+ * @param str  The string, the terminating null is not hashed
+ * @return The hash
+ */
+static inline uint64_t mxs_fnv1a64_str(uint64_t hash, const char *str)
+{
+    for (const uint8_t *ptr = (const uint8_t *)str; *ptr; ptr++)
+    {
+        hash = mxs_fnv1a64_byte(hash, *ptr);
+    }
+
+    return hash;
+}
+
 #endif
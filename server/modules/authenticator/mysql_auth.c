@@ -21,6 +21,7 @@
  * Revision History
  * Date         Who                     Description
  * 02/02/2016   Martin Brampton         Initial version
+ * 14/10/2016   MariaDB Corporation     Added the cache of successful logins
  *
  * @endverbatim
  */
@@ -29,6 +30,34 @@
 #include <mysql_client_server_protocol.h>
 #include <gw_authenticator.h>
 #include <maxscale/poll.h>
+#include <platform.h>
+#include <users.h>
+#include <utils.h>
+
+/** Number of entries in the login cache of each thread, a power of two */
+#define MYSQL_AUTH_CACHE_SIZE 256
+
+/** Seconds a successful login is remembered */
+#define MYSQL_AUTH_CACHE_TTL 10
+
+/**
+ * A successful login. The entry is valid only for the users table it was
+ * found in, so a reload of the users invalidates it.
+ */
+typedef struct mysql_auth_cache_entry
+{
+    SERVICE       *service;                          /*< The service of the login */
+    USERS         *users;                            /*< The users table of the login */
+    unsigned char cksum[SHA_DIGEST_LENGTH];          /*< Checksum of the users table */
+    time_t        expires;                           /*< When the entry expires */
+    char          user[MYSQL_USER_MAXLEN + 1];       /*< The user */
+    char          host[MYSQL_HOST_MAXLEN + 1];       /*< The client address */
+    char          db[MYSQL_DATABASE_MAXLEN + 1];     /*< The default database */
+    uint8_t       password[SHA_DIGEST_LENGTH];       /*< SHA1(SHA1(password)) of the user */
+} MYSQL_AUTH_CACHE_ENTRY;
+
+/** The login cache of the calling thread, allocated on first use */
+static thread_local MYSQL_AUTH_CACHE_ENTRY *this_auth_cache = NULL;
 
 /* @see function load_module in load_utils.c for explanation of the following
  * lint directives.
@@ -74,6 +103,13 @@ static int mysql_auth_set_client_data(
     MYSQL_session *client_data,
     MySQLProtocol *protocol,
     GWBUF         *buffer);
+static int mysql_auth_check_token(uint8_t *token,
+                                  unsigned int token_len,
+                                  uint8_t *mxs_scramble,
+                                  unsigned int scramble_len,
+                                  char *username,
+                                  uint8_t *password,
+                                  uint8_t *stage1_hash);
 
 /**
  * Implementation of the mandatory version entry point
@@ -117,8 +153,9 @@ GWAUTHENTICATOR* GetModuleObject()
  * First call the SSL authentication function, passing the DCB and a boolean
  * indicating whether the client is SSL capable. If SSL authentication is
  * successful, check whether connection is complete. Fail if we do not have a
- * user name.  Call other functions to validate the user, reloading the user
- * data if the first attempt fails.
+ * user name.  Call other functions to validate the user. If the first attempt
+ * fails, MYSQL_AUTH_USERS_OUTDATED is returned so that the protocol can reload
+ * the users and authenticate the client again.
  *
  * @param dcb Request handler DCB connected to the client
  * @return Authentication status
@@ -170,16 +207,15 @@ mysql_auth_authenticate(DCB *dcb)
         auth_ret = combined_auth_check(dcb, client_data->auth_token, client_data->auth_token_len,
                                        protocol, client_data->user, client_data->client_sha1, client_data->db);
 
-        /* On failed authentication try to load user table from backend database */
-        /* Success for service_refresh_users returns 0 */
-        if (MYSQL_AUTH_SUCCEEDED != auth_ret && 0 == service_refresh_users(dcb->service))
+        /* On failed authentication the user table is loaded from the backend
+         * database in the background and the client is authenticated again */
+        if (MYSQL_AUTH_SUCCEEDED != auth_ret && !protocol->users_refreshed)
         {
-            auth_ret = combined_auth_check(dcb, client_data->auth_token, client_data->auth_token_len, protocol,
-                                           client_data->user, client_data->client_sha1, client_data->db);
+            protocol->users_refreshed = true;
+            auth_ret = MYSQL_AUTH_USERS_OUTDATED;
         }
-
         /* on successful authentication, set user into dcb field */
-        if (MYSQL_AUTH_SUCCEEDED == auth_ret)
+        else if (MYSQL_AUTH_SUCCEEDED == auth_ret)
         {
             dcb->user = strdup(client_data->user);
         }
@@ -281,12 +317,12 @@ mysql_auth_set_protocol_data(DCB *dcb, GWBUF *buf)
  *
  * The caller has created the data structure pointed to by the DCB, and this
  * function fills in the details. If problems are found with the data, the
- * return code indicates failure.
+ * return code indicates failure. The packet is read in place, every field is
+ * checked against the end of the packet.
  *
  * @param client_data The data structure for the DCB
  * @param protocol The protocol structure for this connection
- * @param client_auth_packet The data from the buffer received from client
- * @param client_auth_packet size An integer giving the size of the data
+ * @param buffer The buffer received from client
  * @return Authentication status
  * @note Authentication status codes are defined in mysql_client_server_protocol.h
  * @see https://dev.mysql.com/doc/internals/en/client-server-protocol.html
@@ -298,17 +334,28 @@ mysql_auth_set_client_data(
     GWBUF         *buffer)
 {
     size_t client_auth_packet_size = gwbuf_length(buffer);
-    uint8_t client_auth_packet[client_auth_packet_size];
-    gwbuf_copy_data(buffer, 0, client_auth_packet_size, client_auth_packet);
+    uint8_t *client_auth_packet = GWBUF_DATA(buffer);
+    /** The packet is only copied if it is not contiguous */
+    uint8_t copy[buffer->next ? client_auth_packet_size : 1];
+    MYSQL_READER r;
+    size_t user_length;
+    size_t database_length;
+
+    if (buffer->next)
+    {
+        gwbuf_copy_data(buffer, 0, client_auth_packet_size, copy);
+        client_auth_packet = copy;
+    }
 
-    /* The numbers are the fixed elements in the client handshake packet */
-    int auth_packet_base_size = 4 + 4 + 4 + 1 + 23;
-    int packet_length_used = 0;
+    mysql_reader_init(&r, client_auth_packet, client_auth_packet_size);
 
     /* Take data from fixed locations first */
-    memcpy(&protocol->client_capabilities, client_auth_packet + 4, 4);
-    protocol->charset = 0;
-    memcpy(&protocol->charset, client_auth_packet + 4 + 4 + 4, 1);
+    mysql_reader_bytes(&r, MYSQL_HEADER_LEN);
+    memcpy(&protocol->client_capabilities, mysql_reader_bytes(&r, 4), 4);
+    mysql_reader_bytes(&r, 4);
+    protocol->charset = mysql_reader_int(&r, 1);
+    mysql_reader_bytes(&r, 23);
+    ss_dassert(!r.failed);
 
     /* Make username and database a null string in case none is provided */
     client_data->user[0] = 0;
@@ -317,74 +364,54 @@ mysql_auth_set_client_data(
     client_data->auth_token_len = 0;
     client_data->auth_token = NULL;
 
-    if (client_auth_packet_size > auth_packet_base_size)
+    if (mysql_reader_left(&r) > 0)
     {
         /* Should have a username */
-        char *first_letter_of_username = (char *)(client_auth_packet + auth_packet_base_size);
-        int user_length = strlen(first_letter_of_username);
-        if (client_auth_packet_size > (auth_packet_base_size + user_length)
-            && user_length <= MYSQL_USER_MAXLEN)
-        {
-            strcpy(client_data->user, first_letter_of_username);
-        }
-        else
+        char *user = mysql_reader_string(&r, &user_length);
+
+        if (user == NULL || user_length > MYSQL_USER_MAXLEN)
         {
             /* Packet has incomplete or too long username */
             return MYSQL_FAILED_AUTH;
         }
-        if (client_auth_packet_size > (auth_packet_base_size + user_length + 1))
+        memcpy(client_data->user, user, user_length + 1);
+
+        if (mysql_reader_left(&r) > 0)
         {
-            /* Extra 1 is for the terminating null after user name */
-            packet_length_used = auth_packet_base_size + user_length + 1;
             /* We should find an authentication token next */
             /* One byte of packet is the length of authentication token */
-            memcpy(&client_data->auth_token_len,
-                   client_auth_packet + packet_length_used,
-                   1);
-            if (client_auth_packet_size >
-                (packet_length_used + client_data->auth_token_len))
+            client_data->auth_token_len = mysql_reader_int(&r, 1);
+            uint8_t *token = mysql_reader_bytes(&r, client_data->auth_token_len);
+
+            if (token == NULL)
             {
-                /* Packet is large enough for authentication token */
-                if (NULL != (client_data->auth_token = (uint8_t *)malloc(client_data->auth_token_len)))
-                {
-                    /* The extra 1 is for the token length byte, just extracted*/
-                    memcpy(client_data->auth_token,
-                           client_auth_packet + auth_packet_base_size + user_length + 1 + 1,
-                           client_data->auth_token_len);
-                }
-                else
-                {
-                    /* Failed to allocate space for authentication token string */
-                    return MYSQL_FAILED_AUTH;
-                }
+                /* Packet was too small to contain authentication token */
+                return MYSQL_FAILED_AUTH;
             }
-            else
+
+            if (NULL == (client_data->auth_token = (uint8_t *)malloc(client_data->auth_token_len)))
             {
-                /* Packet was too small to contain authentication token */
+                /* Failed to allocate space for authentication token string */
                 return MYSQL_FAILED_AUTH;
             }
-            packet_length_used += 1 + client_data->auth_token_len;
+            memcpy(client_data->auth_token, token, client_data->auth_token_len);
+
             /*
              * Note: some clients may pass empty database, CONNECT_WITH_DB !=0 but database =""
              */
             if ((uint32_t)GW_MYSQL_CAPABILITIES_CONNECT_WITH_DB &
                 gw_mysql_get_byte4((uint8_t *)&protocol->client_capabilities)
-                && client_auth_packet_size > packet_length_used)
+                && mysql_reader_left(&r) > 0)
             {
-                char *database = (char *)(client_auth_packet + packet_length_used);
-                int database_length = strlen(database);
-                if (client_auth_packet_size >
-                    (packet_length_used + database_length)
-                    && strlen(database) <= MYSQL_DATABASE_MAXLEN)
-                {
-                    strcpy(client_data->db, database);
-                }
-                else
+                char *database = mysql_reader_string(&r, &database_length);
+
+                if (database == NULL || database_length > MYSQL_DATABASE_MAXLEN)
                 {
                     /* Packet is too short to contain database string */
                     /* or database string in packet is too long */
                     return MYSQL_FAILED_AUTH;
                 }
+                memcpy(client_data->db, database, database_length + 1);
             }
         }
     }
@@ -446,6 +473,10 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
     {
         strcpy(key.hostname, dcb->remote);
     }
+    else
+    {
+        key.hostname[0] = '\0';
+    }
 
     MXS_DEBUG("%lu [MySQL Client Auth], checking user [%s@%s]%s%s",
               pthread_self(),
@@ -454,101 +485,20 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
               key.resource != NULL ? " db: " : "",
               key.resource != NULL ? key.resource : "");
 
-    /* look for user@current_ipv4 now */
-    user_password = mysql_users_fetch(service->users, &key);
+    /* look for user@current_ipv4 and the networks and wildcard hosts that match it */
+    user_password = mysql_users_find(service->users, &key,
+                                     service->localhost_match_wildcard_host != 0);
 
     if (!user_password)
     {
-        /* The user is not authenticated @ current IPv4 */
-
-        while (1)
-        {
-            /*
-             * (1) Check for localhost first: 127.0.0.1 (IPv4 only)
-             */
-
-            if ((key.ipv4.sin_addr.s_addr == 0x0100007F) &&
-                !dcb->service->localhost_match_wildcard_host)
-            {
-                /* Skip the wildcard check and return 1 */
-                break;
-            }
-
-            /*
-             * (2) check for possible IPv4 class C,B,A networks
-             */
-
-            /* Class C check */
-            key.ipv4.sin_addr.s_addr &= 0x00FFFFFF;
-            key.netmask -= 8;
-
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            /* Class B check */
-            key.ipv4.sin_addr.s_addr &= 0x0000FFFF;
-            key.netmask -= 8;
-
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            /* Class A check */
-            key.ipv4.sin_addr.s_addr &= 0x000000FF;
-            key.netmask -= 8;
-
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            /*
-             * (3) Continue check for wildcard host, user@%
-             */
-
-            memset(&key.ipv4, 0, sizeof(struct sockaddr_in));
-            key.netmask = 0;
-
-            MXS_DEBUG("%lu [MySQL Client Auth], checking user [%s@%s] with "
-                      "wildcard host [%%]",
-                      pthread_self(),
-                      key.user,
-                      dcb->remote);
-
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            if (!user_password)
-            {
-                /*
-                 * user@% not found.
-                 */
-
-                MXS_DEBUG("%lu [MySQL Client Auth], user [%s@%s] not existent",
-                          pthread_self(),
-                          key.user,
-                          dcb->remote);
-
-                MXS_INFO("Authentication Failed: user [%s@%s] not found.",
-                         key.user,
-                         dcb->remote);
-                break;
-            }
-
-        }
+        MXS_DEBUG("%lu [MySQL Client Auth], user [%s@%s] not existent",
+                  pthread_self(),
+                  key.user,
+                  dcb->remote);
+
+        MXS_INFO("Authentication Failed: user [%s@%s] not found.",
+                 key.user,
+                 dcb->remote);
     }
 
     /* If user@host has been found we get the the password in binary format*/
@@ -598,13 +548,7 @@ gw_check_mysql_scramble_data(DCB *dcb,
                              char *username,
                              uint8_t *stage1_hash)
 {
-    uint8_t step1[GW_MYSQL_SCRAMBLE_SIZE] = "";
-    uint8_t step2[GW_MYSQL_SCRAMBLE_SIZE + 1] = "";
-    uint8_t check_hash[GW_MYSQL_SCRAMBLE_SIZE] = "";
-    char hex_double_sha1[2 * GW_MYSQL_SCRAMBLE_SIZE + 1] = "";
     uint8_t password[GW_MYSQL_SCRAMBLE_SIZE] = "";
-    /* The following can be compared using memcmp to detect a null password */
-    uint8_t null_client_sha1[MYSQL_SCRAMBLE_LEN] = "";
 
 
     if ((username == NULL) || (mxs_scramble == NULL) || (stage1_hash == NULL))
@@ -630,6 +574,38 @@ gw_check_mysql_scramble_data(DCB *dcb,
         return MYSQL_FAILED_AUTH;
     }
 
+    return mysql_auth_check_token(token, token_len, mxs_scramble, scramble_len,
+                                  username, password, stage1_hash);
+}
+
+/**
+ * @brief Check the authentication token against the password of the user
+ *
+ * @param token         The token sent by the client in the authentication request
+ * @param token_len     The token size in bytes
+ * @param scramble      The scramble data sent by the server during handshake
+ * @param scramble_len  The scramble size in bytes
+ * @param username      The current username in the authentication request
+ * @param password      The SHA1(SHA1(password)) of the user
+ * @param stage1_hash   The SHA1(candidate_password) decoded by this routine
+ * @return Authentication status
+ */
+static int
+mysql_auth_check_token(uint8_t *token,
+                       unsigned int token_len,
+                       uint8_t *mxs_scramble,
+                       unsigned int scramble_len,
+                       char *username,
+                       uint8_t *password,
+                       uint8_t *stage1_hash)
+{
+    uint8_t step1[GW_MYSQL_SCRAMBLE_SIZE] = "";
+    uint8_t step2[GW_MYSQL_SCRAMBLE_SIZE + 1] = "";
+    uint8_t check_hash[GW_MYSQL_SCRAMBLE_SIZE] = "";
+    char hex_double_sha1[2 * GW_MYSQL_SCRAMBLE_SIZE + 1] = "";
+    /* The following can be compared using memcmp to detect a null password */
+    uint8_t null_client_sha1[MYSQL_SCRAMBLE_LEN] = "";
+
     if (token && token_len)
     {
         /*<
@@ -754,6 +730,91 @@ check_db_name_after_auth(DCB *dcb, char *database, int auth_ret)
     return auth_ret;
 }
 
+/**
+ * @brief Find the cache slot of a login
+ *
+ * @param dcb Request handler DCB connected to the client
+ * @param username The user
+ * @param database The default database
+ * @return The slot or NULL if the cache could not be allocated
+ */
+static MYSQL_AUTH_CACHE_ENTRY *
+mysql_auth_cache_slot(DCB *dcb, const char *username, const char *database)
+{
+    if (this_auth_cache == NULL &&
+        (this_auth_cache = calloc(MYSQL_AUTH_CACHE_SIZE, sizeof(MYSQL_AUTH_CACHE_ENTRY))) == NULL)
+    {
+        return NULL;
+    }
+
+    const char *parts[] = {username, dcb->remote, database};
+    uint64_t hash = MXS_FNV1A64_INIT;
+
+    for (int i = 0; i < 3; i++)
+    {
+        hash = mxs_fnv1a64_byte(mxs_fnv1a64_str(hash, parts[i]), '@');
+    }
+
+    return &this_auth_cache[hash & (MYSQL_AUTH_CACHE_SIZE - 1)];
+}
+
+/**
+ * @brief Find the password of a recently successful login
+ *
+ * @param dcb Request handler DCB connected to the client
+ * @param username The user
+ * @param database The default database
+ * @param password Where the SHA1(SHA1(password)) of the user is copied
+ * @return True if the login was found in the cache
+ */
+static bool
+mysql_auth_cache_get(DCB *dcb, const char *username, const char *database, uint8_t *password)
+{
+    USERS *users = dcb->service->users;
+    MYSQL_AUTH_CACHE_ENTRY *entry = mysql_auth_cache_slot(dcb, username, database);
+
+    if (entry && users && entry->service == dcb->service && entry->users == users &&
+        entry->expires > time(NULL) &&
+        memcmp(entry->cksum, users->cksum, SHA_DIGEST_LENGTH) == 0 &&
+        strcmp(entry->user, username) == 0 && strcmp(entry->host, dcb->remote) == 0 &&
+        strcmp(entry->db, database) == 0)
+    {
+        memcpy(password, entry->password, SHA_DIGEST_LENGTH);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Remember a successful login
+ *
+ * @param dcb Request handler DCB connected to the client
+ * @param username The user
+ * @param database The default database
+ * @param password The SHA1(SHA1(password)) of the user
+ */
+static void
+mysql_auth_cache_put(DCB *dcb, const char *username, const char *database, const uint8_t *password)
+{
+    USERS *users = dcb->service->users;
+    MYSQL_AUTH_CACHE_ENTRY *entry;
+
+    if (users && strlen(username) <= MYSQL_USER_MAXLEN && strlen(dcb->remote) <= MYSQL_HOST_MAXLEN &&
+        strlen(database) <= MYSQL_DATABASE_MAXLEN &&
+        (entry = mysql_auth_cache_slot(dcb, username, database)))
+    {
+        entry->service = dcb->service;
+        entry->users = users;
+        memcpy(entry->cksum, users->cksum, SHA_DIGEST_LENGTH);
+        entry->expires = time(NULL) + MYSQL_AUTH_CACHE_TTL;
+        strcpy(entry->user, username);
+        strcpy(entry->host, dcb->remote);
+        strcpy(entry->db, database);
+        memcpy(entry->password, password, SHA_DIGEST_LENGTH);
+    }
+}
+
 /**
  * @brief Function to easily call authentication and database checks.
  *
@@ -761,6 +822,11 @@ check_db_name_after_auth(DCB *dcb, char *database, int auth_ret)
  * the first passed to the second. For convenience and clarity this function
  * combines the calls.
  *
+ * The password of a user who recently logged in from the same address to the
+ * same database is taken from the login cache of the thread, which skips the
+ * matching of the user against the hosts and the database grants. The token
+ * is always checked against the scramble of the connection.
+ *
  * @param dcb Request handler DCB connected to the client
  * @param auth_token A string of bytes containing the authentication token
  * @param auth_token_len An integer, the length of the preceding parameter
@@ -782,17 +848,36 @@ static int combined_auth_check(
 )
 {
     int     auth_ret;
+    uint8_t password[GW_MYSQL_SCRAMBLE_SIZE] = "";
+    bool    cached = mysql_auth_cache_get(dcb, username, database, password);
 
-    auth_ret = gw_check_mysql_scramble_data(dcb,
-                                            auth_token,
-                                            auth_token_len,
-                                            protocol->scramble,
-                                            sizeof(protocol->scramble),
-                                            username,
-                                            stage1_hash);
+    if (cached || gw_find_mysql_user_password_sha1(username, password, dcb) == 0)
+    {
+        auth_ret = mysql_auth_check_token(auth_token, auth_token_len, protocol->scramble,
+                                          sizeof(protocol->scramble), username,
+                                          password, stage1_hash);
+    }
+    else
+    {
+        /* if password was sent, fill stage1_hash with at least 1 byte in order
+         * to create right error message: (using password: YES|NO)
+         */
+        if (auth_token_len)
+        {
+            memcpy(stage1_hash, (char *)"_", 1);
+        }
+
+        auth_ret = MYSQL_FAILED_AUTH;
+    }
 
     /* check for database name match in resource hashtable */
     auth_ret = check_db_name_after_auth(dcb, database, auth_ret);
+
+    if (MYSQL_AUTH_SUCCEEDED == auth_ret && !cached)
+    {
+        mysql_auth_cache_put(dcb, username, database, password);
+    }
+
     return auth_ret;
 }
 
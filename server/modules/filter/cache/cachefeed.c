@@ -0,0 +1,793 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file cachefeed.c - The binlog invalidation feed of the cache filter
+ *
+ * The feed has a thread of its own. The connection to the master is opened
+ * and authenticated with the client library, after which COM_BINLOG_DUMP is
+ * written to the socket of the connection and the events are read from it
+ * directly, as the client library has no public interface for that.
+ *
+ * Only the events that tell which tables are modified are looked at:
+ * a TABLE_MAP event maps a table id to the name of a table and the row events
+ * that follow refer to the id; statements, both DDL and statement based
+ * replication, are classified with the query classifier. The data of the rows
+ * is never decoded.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ * @endverbatim
+ */
+
+#include "cachefeed.h"
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <mysql.h>
+#include <blr.h>
+#include <log_manager.h>
+#include <modutil.h>
+#include <mysql_binlog.h>
+#include <query_classifier.h>
+#include <spinlock.h>
+#include <thread.h>
+
+/** Seconds between the heartbeats the master sends when there are no events */
+#define CACHE_FEED_HEARTBEAT 10
+
+/** Seconds to wait before connecting again after a failure */
+#define CACHE_FEED_RETRY 5
+
+/** The most tables one statement can map */
+#define CACHE_FEED_MAX_TABLES 64
+
+/** A payload of this length is continued in the next packet */
+#define CACHE_FEED_MAX_PAYLOAD 0xffffff
+
+/** The event flag of the events that are not in the binlog file */
+#define CACHE_FEED_ARTIFICIAL 0x0020
+
+typedef struct cache_feed_table
+{
+    uint64_t id;                                                  /*< The table id */
+    char     name[MYSQL_DATABASE_MAXLEN + MYSQL_TABLE_MAXLEN + 2]; /*< db.table */
+} CACHE_FEED_TABLE;
+
+struct cache_feed
+{
+    LRU_STORAGE     *storage;     /*< The storage that is invalidated */
+    SERVER          *server;      /*< The master */
+    char            *user;        /*< The replication user */
+    char            *password;    /*< The password of user */
+    uint32_t         server_id;   /*< The server id of the feed */
+    THREAD           thread;      /*< The thread of the feed */
+    SPINLOCK         lock;        /*< Protects stats */
+    CACHE_FEED_STATS stats;       /*< The statistics */
+    /** The rest is only used by the thread of the feed */
+    char             file[BINLOG_FNAMELEN + 1]; /*< The binlog file, empty if not known */
+    uint64_t         pos;          /*< The position in file */
+    bool             checksum;     /*< Whether the events end with a checksum */
+    int              table_id_len; /*< The length of a table id in the events */
+    CACHE_FEED_TABLE tables[CACHE_FEED_MAX_TABLES]; /*< The tables of the statement */
+    int              n_tables;     /*< The number of tables */
+    uint8_t         *packet;       /*< The packet being read */
+    size_t           packet_size;  /*< The allocated size of packet */
+};
+
+static void cache_feed_main(void *data);
+
+/**
+ * Start following the binlog of a master
+ *
+ * @param storage   The storage to invalidate
+ * @param server    The master
+ * @param user      The user, it needs the REPLICATION SLAVE and REPLICATION
+ *                  CLIENT privileges
+ * @param password  The password of the user, in clear text
+ * @param server_id The server id the feed uses, it must be unique in the
+ *                  replication topology
+ * @return The new feed, or NULL on error
+ */
+CACHE_FEED* cache_feed_start(LRU_STORAGE* storage, SERVER* server, const char* user,
+                             const char* password, uint32_t server_id)
+{
+    CACHE_FEED* feed = calloc(1, sizeof(CACHE_FEED));
+
+    if (feed == NULL ||
+        (feed->user = strdup(user)) == NULL ||
+        (feed->password = strdup(password)) == NULL)
+    {
+        if (feed)
+        {
+            free(feed->user);
+            free(feed);
+        }
+
+        return NULL;
+    }
+
+    feed->storage = storage;
+    feed->server = server;
+    feed->server_id = server_id;
+    spinlock_init(&feed->lock);
+
+    if (thread_start(&feed->thread, cache_feed_main, feed) == NULL)
+    {
+        free(feed->password);
+        free(feed->user);
+        free(feed);
+        return NULL;
+    }
+
+    return feed;
+}
+
+/**
+ * Get the statistics of a feed
+ *
+ * @param feed  The feed
+ * @param stats Where the statistics are stored
+ */
+void cache_feed_get_stats(CACHE_FEED* feed, CACHE_FEED_STATS* stats)
+{
+    spinlock_acquire(&feed->lock);
+    *stats = feed->stats;
+    spinlock_release(&feed->lock);
+}
+
+static uint64_t cache_feed_get_le(const uint8_t* ptr, int bytes)
+{
+    uint64_t value = 0;
+
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        value = (value << 8) | ptr[i];
+    }
+
+    return value;
+}
+
+static void cache_feed_set_le(uint8_t* ptr, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        *ptr++ = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static void cache_feed_set_connected(CACHE_FEED* feed, bool connected)
+{
+    spinlock_acquire(&feed->lock);
+    feed->stats.connected = connected;
+
+    if (connected)
+    {
+        feed->stats.connects++;
+    }
+    spinlock_release(&feed->lock);
+}
+
+/**
+ * Clear the whole storage, when the modified tables are not known.
+ */
+static void cache_feed_clear(CACHE_FEED* feed)
+{
+    lru_storage_clear(feed->storage);
+
+    spinlock_acquire(&feed->lock);
+    feed->stats.clears++;
+    spinlock_release(&feed->lock);
+}
+
+static void cache_feed_invalidate(CACHE_FEED* feed, const char* table)
+{
+    lru_storage_invalidate(feed->storage, table);
+
+    spinlock_acquire(&feed->lock);
+    feed->stats.invalidations++;
+    spinlock_release(&feed->lock);
+}
+
+/**
+ * Execute a statement and optionally get the first row of the result.
+ *
+ * @param con   The connection
+ * @param sql   The statement
+ * @param row   If not NULL, the values of the first row are copied here
+ * @param n_row The number of values that fit in row
+ * @return True, if the statement succeeded and, if row is not NULL, there
+ *         was a row with at least n_row values
+ */
+static bool cache_feed_query(MYSQL* con, const char* sql, char** row, int n_row)
+{
+    if (mysql_query(con, sql) != 0)
+    {
+        return false;
+    }
+
+    bool rval = true;
+    MYSQL_RES* result = mysql_store_result(con);
+
+    if (row)
+    {
+        MYSQL_ROW values;
+        rval = false;
+
+        if (result && mysql_num_fields(result) >= (unsigned int) n_row &&
+            (values = mysql_fetch_row(result)) != NULL)
+        {
+            rval = true;
+
+            for (int i = 0; i < n_row; i++)
+            {
+                row[i] = values[i] ? strdup(values[i]) : NULL;
+            }
+        }
+    }
+
+    if (result)
+    {
+        mysql_free_result(result);
+    }
+
+    return rval;
+}
+
+/**
+ * Connect to the master and prepare the connection for the binlog dump.
+ *
+ * @param feed The feed
+ * @return The connection, or NULL on error
+ */
+static MYSQL* cache_feed_connect(CACHE_FEED* feed)
+{
+    MYSQL* con = mysql_init(NULL);
+    unsigned int timeout = CACHE_FEED_RETRY * 2;
+
+    if (con == NULL)
+    {
+        MXS_ERROR("cache: mysql_init failed for the invalidation feed.");
+        return NULL;
+    }
+
+    mysql_options(con, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    mysql_options(con, MYSQL_OPT_READ_TIMEOUT, &timeout);
+    mysql_options(con, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+#if !defined(LIBMARIADB)
+    mysql_options(con, MYSQL_OPT_USE_REMOTE_CONNECTION, NULL);
+#endif
+
+    // SSL is not used, as the events are read from the socket directly.
+    if (mysql_real_connect(con, feed->server->name, feed->user, feed->password,
+                           NULL, feed->server->port, NULL, 0) == NULL)
+    {
+        MXS_ERROR("cache: The invalidation feed could not connect to %s:%d: %s",
+                  feed->server->name, feed->server->port, mysql_error(con));
+        mysql_close(con);
+        return NULL;
+    }
+
+    char *value = NULL;
+    char heartbeat[80];
+    snprintf(heartbeat, sizeof(heartbeat), "SET @master_heartbeat_period = %d000000000",
+             CACHE_FEED_HEARTBEAT);
+
+    // The variables are not known by all servers, so the errors are ignored.
+    cache_feed_query(con, heartbeat, NULL, 0);
+    cache_feed_query(con, "SET @mariadb_slave_capability=4", NULL, 0);
+    cache_feed_query(con, "SET @master_binlog_checksum = @@global.binlog_checksum", NULL, 0);
+    feed->checksum = cache_feed_query(con, "SELECT @master_binlog_checksum", &value, 1) &&
+        value && strcasecmp(value, "NONE") != 0;
+    free(value);
+
+    if (*feed->file == '\0')
+    {
+        char *status[2] = {NULL, NULL};
+
+        if (!cache_feed_query(con, "SHOW MASTER STATUS", status, 2) || !status[0] || !status[1])
+        {
+            MXS_ERROR("cache: Could not get the binlog position of %s:%d, "
+                      "the binary log must be enabled for the invalidation feed.",
+                      feed->server->name, feed->server->port);
+            free(status[0]);
+            free(status[1]);
+            mysql_close(con);
+            return NULL;
+        }
+
+        snprintf(feed->file, sizeof(feed->file), "%s", status[0]);
+        feed->pos = strtoull(status[1], NULL, 10);
+        free(status[0]);
+        free(status[1]);
+
+        // What was modified before this position is not known.
+        cache_feed_clear(feed);
+    }
+
+    return con;
+}
+
+/**
+ * Read bytes from the socket, waiting for at most the heartbeat timeout.
+ */
+static bool cache_feed_read(int fd, uint8_t* buf, size_t len)
+{
+    while (len > 0)
+    {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int rc = poll(&pfd, 1, CACHE_FEED_HEARTBEAT * 3 * 1000);
+
+        if (rc == 0)
+        {
+            MXS_ERROR("cache: No events or heartbeats from the master in %d seconds.",
+                      CACHE_FEED_HEARTBEAT * 3);
+            return false;
+        }
+
+        ssize_t n = rc > 0 ? recv(fd, buf, len, 0) : -1;
+
+        if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN))
+        {
+            return false;
+        }
+
+        if (n > 0)
+        {
+            buf += n;
+            len -= n;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Read a complete packet, joining the packets of a payload of 16MB or more.
+ *
+ * @param feed The feed, the payload is read to feed->packet
+ * @param fd   The socket
+ * @param len  The length of the payload
+ * @return True on success
+ */
+static bool cache_feed_read_packet(CACHE_FEED* feed, int fd, size_t* len)
+{
+    size_t packet_len;
+    *len = 0;
+
+    do
+    {
+        uint8_t header[MYSQL_HEADER_LEN];
+
+        if (!cache_feed_read(fd, header, sizeof(header)))
+        {
+            return false;
+        }
+
+        packet_len = cache_feed_get_le(header, 3);
+
+        if (*len + packet_len > feed->packet_size)
+        {
+            size_t size = *len + packet_len;
+            uint8_t* packet = realloc(feed->packet, size);
+
+            if (packet == NULL)
+            {
+                return false;
+            }
+
+            feed->packet = packet;
+            feed->packet_size = size;
+        }
+
+        if (!cache_feed_read(fd, feed->packet + *len, packet_len))
+        {
+            return false;
+        }
+
+        *len += packet_len;
+    }
+    while (packet_len == CACHE_FEED_MAX_PAYLOAD);
+
+    return true;
+}
+
+/**
+ * Request the binlog events from the current position.
+ */
+static bool cache_feed_dump(CACHE_FEED* feed, int fd)
+{
+    size_t file_len = strlen(feed->file);
+    size_t len = 1 + 4 + 2 + 4 + file_len;
+    uint8_t packet[MYSQL_HEADER_LEN + len];
+    uint8_t* ptr = packet;
+
+    cache_feed_set_le(ptr, len, 3);
+    ptr[3] = 0;
+    ptr += MYSQL_HEADER_LEN;
+    *ptr++ = MYSQL_COM_BINLOG_DUMP;
+    cache_feed_set_le(ptr, feed->pos, 4);
+    ptr += 4;
+    cache_feed_set_le(ptr, 0, 2);
+    ptr += 2;
+    cache_feed_set_le(ptr, feed->server_id, 4);
+    ptr += 4;
+    memcpy(ptr, feed->file, file_len);
+
+    return send(fd, packet, sizeof(packet), MSG_NOSIGNAL) == (ssize_t) sizeof(packet);
+}
+
+static const char* cache_feed_find_table(CACHE_FEED* feed, uint64_t id)
+{
+    for (int i = 0; i < feed->n_tables; i++)
+    {
+        if (feed->tables[i].id == id)
+        {
+            return feed->tables[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Record the table a TABLE_MAP event maps to an id.
+ */
+static void cache_feed_table_map(CACHE_FEED* feed, const uint8_t* body, size_t len)
+{
+    size_t id_len = feed->table_id_len;
+
+    if (len < id_len + 2 + 1)
+    {
+        return;
+    }
+
+    uint64_t id = cache_feed_get_le(body, id_len);
+    const uint8_t* ptr = body + id_len + 2;
+    const uint8_t* end = body + len;
+    size_t db_len = *ptr++;
+
+    if (ptr + db_len + 2 > end || ptr + db_len + 2 + ptr[db_len + 1] > end)
+    {
+        return;
+    }
+
+    const uint8_t* db = ptr;
+    size_t table_len = ptr[db_len + 1];
+    const uint8_t* table = ptr + db_len + 2;
+
+    if (cache_feed_find_table(feed, id) == NULL)
+    {
+        if (feed->n_tables == CACHE_FEED_MAX_TABLES ||
+            db_len > MYSQL_DATABASE_MAXLEN || table_len > MYSQL_TABLE_MAXLEN)
+        {
+            // The row events of an unknown table clear the whole storage.
+            return;
+        }
+
+        CACHE_FEED_TABLE* t = &feed->tables[feed->n_tables++];
+        t->id = id;
+        snprintf(t->name, sizeof(t->name), "%.*s.%.*s",
+                 (int) db_len, (const char*) db, (int) table_len, (const char*) table);
+    }
+}
+
+/**
+ * Invalidate the table a row event modifies.
+ */
+static void cache_feed_rows(CACHE_FEED* feed, const uint8_t* body, size_t len)
+{
+    size_t id_len = feed->table_id_len;
+
+    if (len < id_len + 2)
+    {
+        cache_feed_clear(feed);
+        return;
+    }
+
+    uint64_t id = cache_feed_get_le(body, id_len);
+    uint16_t flags = cache_feed_get_le(body + id_len, 2);
+    const char* table = cache_feed_find_table(feed, id);
+
+    if (table)
+    {
+        cache_feed_invalidate(feed, table);
+    }
+    else if (id != TABLE_DUMMY_ID)
+    {
+        cache_feed_clear(feed);
+    }
+
+    if (flags & ROW_EVENT_END_STATEMENT)
+    {
+        feed->n_tables = 0;
+    }
+}
+
+/**
+ * Check whether a statement only controls a transaction
+ */
+static bool cache_feed_is_trx_control(const char* sql)
+{
+    static const char* words[] = {"BEGIN", "COMMIT", "ROLLBACK", "SAVEPOINT", "XA", NULL};
+
+    while (isspace((unsigned char)*sql))
+    {
+        sql++;
+    }
+
+    for (int i = 0; words[i]; i++)
+    {
+        size_t len = strlen(words[i]);
+
+        if (strncasecmp(sql, words[i], len) == 0 &&
+            !isalnum((unsigned char)sql[len]) && sql[len] != '_')
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Invalidate the tables a statement in a QUERY event modifies.
+ */
+static void cache_feed_query_event(CACHE_FEED* feed, const uint8_t* body, size_t len)
+{
+    if (len < 13)
+    {
+        return;
+    }
+
+    size_t db_len = body[8];
+    size_t status_len = cache_feed_get_le(body + 11, 2);
+    size_t offset = 13 + status_len + db_len + 1;
+
+    if (offset > len)
+    {
+        return;
+    }
+
+    char db[db_len + 1];
+    memcpy(db, body + 13 + status_len, db_len);
+    db[db_len] = '\0';
+
+    char sql[len - offset + 1];
+    memcpy(sql, body + offset, len - offset);
+    sql[len - offset] = '\0';
+
+    if (cache_feed_is_trx_control(sql))
+    {
+        return;
+    }
+
+    GWBUF* query = modutil_create_query(sql);
+    int n_tables = 0;
+    char** tables = query ? qc_get_table_names(query, &n_tables, true) : NULL;
+
+    if (tables && n_tables > 0)
+    {
+        for (int i = 0; i < n_tables; i++)
+        {
+            if (strchr(tables[i], '.') == NULL && *db)
+            {
+                char name[db_len + 1 + strlen(tables[i]) + 1];
+                sprintf(name, "%s.%s", db, tables[i]);
+                cache_feed_invalidate(feed, name);
+            }
+            else
+            {
+                cache_feed_invalidate(feed, tables[i]);
+            }
+        }
+    }
+    else
+    {
+        cache_feed_clear(feed);
+    }
+
+    for (int i = 0; tables && i < n_tables; i++)
+    {
+        free(tables[i]);
+    }
+
+    free(tables);
+    gwbuf_free(query);
+}
+
+/**
+ * Handle one binlog event
+ *
+ * @param feed  The feed
+ * @param event The event, starting from the event header
+ * @param len   The length of the event
+ */
+static void cache_feed_event(CACHE_FEED* feed, const uint8_t* event, size_t len)
+{
+    if (len < BINLOG_EVENT_HDR_LEN)
+    {
+        return;
+    }
+
+    uint8_t type = event[4];
+    uint64_t next_pos = cache_feed_get_le(event + 13, 4);
+    uint16_t flags = cache_feed_get_le(event + 17, 2);
+    const uint8_t* body = event + BINLOG_EVENT_HDR_LEN;
+    size_t body_len = len - BINLOG_EVENT_HDR_LEN;
+
+    if (feed->checksum && body_len >= MYSQL_CHECKSUM_LEN)
+    {
+        body_len -= MYSQL_CHECKSUM_LEN;
+    }
+
+    spinlock_acquire(&feed->lock);
+    feed->stats.events++;
+    spinlock_release(&feed->lock);
+
+    switch (type)
+    {
+    case FORMAT_DESCRIPTION_EVENT:
+        // The post-header lengths start at offset 57, indexed by the type - 1.
+        if (body_len >= 57 + TABLE_MAP_EVENT)
+        {
+            feed->table_id_len = body[57 + TABLE_MAP_EVENT - 1] == 6 ? 4 : 6;
+        }
+        break;
+
+    case ROTATE_EVENT:
+        if (body_len >= 8)
+        {
+            size_t file_len = body_len - 8;
+
+            if (file_len > BINLOG_FNAMELEN)
+            {
+                file_len = BINLOG_FNAMELEN;
+            }
+
+            memcpy(feed->file, body + 8, file_len);
+            feed->file[file_len] = '\0';
+            feed->pos = cache_feed_get_le(body, 8);
+        }
+        return;
+
+    case TABLE_MAP_EVENT:
+        cache_feed_table_map(feed, body, body_len);
+        break;
+
+    case WRITE_ROWS_EVENTv0:
+    case UPDATE_ROWS_EVENTv0:
+    case DELETE_ROWS_EVENTv0:
+    case WRITE_ROWS_EVENTv1:
+    case UPDATE_ROWS_EVENTv1:
+    case DELETE_ROWS_EVENTv1:
+    case WRITE_ROWS_EVENTv2:
+    case UPDATE_ROWS_EVENTv2:
+    case DELETE_ROWS_EVENTv2:
+        cache_feed_rows(feed, body, body_len);
+        break;
+
+    case QUERY_EVENT:
+        cache_feed_query_event(feed, body, body_len);
+        break;
+
+    case HEARTBEAT_EVENT:
+        return;
+
+    default:
+        break;
+    }
+
+    if (next_pos != 0 && (flags & CACHE_FEED_ARTIFICIAL) == 0)
+    {
+        feed->pos = next_pos;
+    }
+}
+
+/**
+ * Follow the binlog until the connection is lost
+ *
+ * @param feed The feed
+ * @param con  The connection
+ */
+static void cache_feed_follow(CACHE_FEED* feed, MYSQL* con)
+{
+    int fd = mysql_get_socket(con);
+    size_t len;
+
+    feed->table_id_len = 6;
+    feed->n_tables = 0;
+
+    if (!cache_feed_dump(feed, fd))
+    {
+        MXS_ERROR("cache: Could not request the binlog events from %s:%d.",
+                  feed->server->name, feed->server->port);
+        return;
+    }
+
+    MXS_NOTICE("cache: The invalidation feed follows the binlog of %s:%d from %s:%lu.",
+               feed->server->name, feed->server->port, feed->file, (unsigned long) feed->pos);
+    cache_feed_set_connected(feed, true);
+
+    while (cache_feed_read_packet(feed, fd, &len) && len > 0)
+    {
+        uint8_t* packet = feed->packet;
+
+        if (packet[0] == 0x00)
+        {
+            cache_feed_event(feed, packet + 1, len - 1);
+
+            spinlock_acquire(&feed->lock);
+            snprintf(feed->stats.file, sizeof(feed->stats.file), "%s", feed->file);
+            feed->stats.pos = feed->pos;
+            spinlock_release(&feed->lock);
+        }
+        else if (packet[0] == 0xff)
+        {
+            // An error packet: 2 bytes of error code, '#' and the SQL state.
+            int offset = len > 9 && packet[3] == '#' ? 9 : 3;
+
+            MXS_ERROR("cache: The master %s:%d stopped the binlog dump: %.*s",
+                      feed->server->name, feed->server->port,
+                      len > offset ? (int) (len - offset) : 0, packet + offset);
+
+            // Most likely the binlog file has been purged. The feed continues
+            // from the current position, after clearing the storage.
+            *feed->file = '\0';
+            break;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    cache_feed_set_connected(feed, false);
+}
+
+static void cache_feed_main(void *data)
+{
+    CACHE_FEED* feed = (CACHE_FEED*) data;
+
+    if (mysql_thread_init() || !qc_thread_init())
+    {
+        MXS_ERROR("cache: Could not initialize the thread of the invalidation feed.");
+        return;
+    }
+
+    while (true)
+    {
+        MYSQL* con = cache_feed_connect(feed);
+
+        if (con)
+        {
+            cache_feed_follow(feed, con);
+            mysql_close(con);
+
+            // The modifications made meanwhile are invalidated when the feed
+            // has reconnected and read the events.
+            MXS_WARNING("cache: The invalidation feed lost the connection to %s:%d.",
+                        feed->server->name, feed->server->port);
+        }
+
+        thread_millisleep(CACHE_FEED_RETRY * 1000);
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef _CACHEFEED_H
+#define _CACHEFEED_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file cachefeed.h - The binlog invalidation feed of the cache filter
+ *
+ * The feed connects to a master as a replication slave and follows its
+ * binary log. The entries of the storage are invalidated by the tables the
+ * row events and the statements in the binary log modify, so modifications
+ * that do not pass through the filter are detected as well.
+ *
+ * If the feed loses the connection, it continues from the position it had
+ * reached. If that is no longer possible, the whole storage is cleared and the
+ * feed continues from the current position of the master.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <server.h>
+#include "lrustorage.h"
+
+typedef struct cache_feed CACHE_FEED;
+
+typedef struct cache_feed_stats
+{
+    bool     connected;     /*< Whether the feed is following the binlog */
+    uint64_t connects;      /*< Successful connections to the master */
+    uint64_t events;        /*< Binlog events received */
+    uint64_t invalidations; /*< Tables invalidated */
+    uint64_t clears;        /*< Times the whole storage was cleared */
+    char     file[256];     /*< The current binlog file */
+    uint64_t pos;           /*< The current position in the binlog file */
+} CACHE_FEED_STATS;
+
+CACHE_FEED* cache_feed_start(LRU_STORAGE* storage, SERVER* server, const char* user,
+                             const char* password, uint32_t server_id);
+void        cache_feed_get_stats(CACHE_FEED* feed, CACHE_FEED_STATS* stats);
+
+#endif
@@ -0,0 +1,1435 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file cachefilter.c - A result set cache
+ * @verbatim
+ *
+ * The cache filter stores the complete result sets of read-only SELECT
+ * statements and returns them to the client without involving the servers,
+ * when the same statement is executed again. The key of a result is the
+ * user, the default database and the text of the statement.
+ *
+ * A result is returned from the cache for at most 'ttl' seconds after it was
+ * stored. When a statement modifying a table passes through the filter, all
+ * results read from that table are removed. Modifications made through other
+ * routes, e.g. directly on the servers, are only covered by the 'ttl', unless
+ * the invalidation feed follows the binlog of the master.
+ *
+ * Results are not cached inside transactions, when autocommit is disabled or
+ * when the statement reads variables, locks rows, uses SQL_NO_CACHE or calls
+ * non-deterministic functions such as NOW() or RAND().
+ *
+ * The filter parameters are:
+ *   ttl                  The time to live of a result in seconds, default 10
+ *   max_size             The maximum size of the cache in bytes, default 64MB
+ *   max_resultset_size   The maximum size of a cached result, default 1MB
+ *   invalidation_server  The master whose binlog the invalidation feed follows
+ *   invalidation_user    The replication user of the feed
+ *   invalidation_password The password of the user
+ *   invalidation_server_id The server id of the feed
+ *
+ * @endverbatim
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <query_classifier.h>
+#include <mysql_client_server_protocol.h>
+#include <secrets.h>
+#include "cachefeed.h"
+#include "lrustorage.h"
+
+MODULE_INFO info =
+{
+    MODULE_API_FILTER,
+    MODULE_IN_DEVELOPMENT,
+    FILTER_VERSION,
+    "A result set cache"
+};
+
+static char *version_str = "V1.0.0";
+
+#define CACHE_DEFAULT_TTL                10
+#define CACHE_DEFAULT_MAX_SIZE           (64 * 1024 * 1024)
+#define CACHE_DEFAULT_MAX_RESULTSET_SIZE (1024 * 1024)
+
+/*
+ * The filter entry points
+ */
+static FILTER *createInstance(char **options, FILTER_PARAMETER **);
+static void *newSession(FILTER *instance, SESSION *session);
+static void closeSession(FILTER *instance, void *session);
+static void freeSession(FILTER *instance, void *session);
+static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+
+
+static FILTER_OBJECT MyObject =
+{
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+};
+
+/**
+ * The instance structure
+ */
+typedef struct
+{
+    int          ttl;                /*< The time to live of a result in seconds */
+    size_t       max_size;           /*< The maximum size of the cache */
+    size_t       max_resultset_size; /*< The maximum size of a single result */
+    LRU_STORAGE *storage;            /*< The cached results */
+    CACHE_FEED  *feed;               /*< The binlog invalidation feed, if any */
+} CACHE_INSTANCE;
+
+/**
+ * What a session is waiting for
+ */
+typedef enum
+{
+    CACHE_EXPECTING_NOTHING,  /*< Nothing that concerns the filter */
+    CACHE_EXPECTING_RESULT,   /*< A result that will be stored */
+    CACHE_EXPECTING_DB_CHANGE, /*< The response to a change of the default database */
+    CACHE_EXPECTING_PREPARE   /*< The response to a COM_STMT_PREPARE */
+} cache_state_t;
+
+/**
+ * The phases of a result set
+ */
+typedef enum
+{
+    CACHE_REPLY_HEADER, /*< Expecting the first packet of the response */
+    CACHE_REPLY_FIELDS, /*< Expecting column definitions */
+    CACHE_REPLY_ROWS    /*< Expecting rows */
+} cache_reply_phase_t;
+
+typedef enum
+{
+    CACHE_REPLY_INCOMPLETE, /*< More packets are needed */
+    CACHE_REPLY_RESULTSET,  /*< A complete, single result set */
+    CACHE_REPLY_OTHER       /*< Something that is not cached */
+} cache_reply_result_t;
+
+/** A payload of this length is continued in the next packet */
+#define CACHE_MAX_PACKET_LEN 0xffffff
+
+/** The payload bytes a packet is classified by; the status of an EOF packet ends at 5 */
+#define CACHE_REPLY_PEEK 5
+
+/**
+ * The state of the response parser. The packets may be split in any way
+ * between the buffers, so only the header and the first bytes of the payload
+ * of each packet are copied and the rest of the packet is skipped.
+ */
+typedef struct
+{
+    cache_reply_phase_t phase;                                /*< The phase of the result */
+    uint64_t            n_fields;                             /*< Column definitions still expected */
+    uint8_t             header[MYSQL_HEADER_LEN + CACHE_REPLY_PEEK]; /*< Start of current packet */
+    size_t              header_len;                           /*< Bytes in header */
+    size_t              payload_len;                          /*< Payload length of current packet */
+    size_t              peek;                                 /*< Payload bytes copied to header */
+    size_t              skip;                                 /*< Payload bytes still to skip */
+    bool                continued;                            /*< Current packet continues the previous one */
+} CACHE_REPLY;
+
+/**
+ * The session structure
+ */
+typedef struct
+{
+    DOWNSTREAM    down;
+    UPSTREAM      up;
+    SESSION      *session;
+    char         *user;                               /*< The user of the session */
+    char          db[MYSQL_DATABASE_MAXLEN + 1];      /*< The default database */
+    char          new_db[MYSQL_DATABASE_MAXLEN + 1];  /*< The database being changed to */
+    bool          autocommit;                         /*< Whether autocommit is on */
+    bool          in_trx;                             /*< Whether a transaction is active */
+    cache_state_t state;                              /*< What the session is waiting for */
+    char         *key;                                /*< The key of the result being stored */
+    size_t        key_len;                            /*< The length of key */
+    uint64_t      generation;                         /*< The storage generation of the query */
+    char        **tables;                             /*< The tables of the result being stored */
+    int           n_tables;                           /*< The number of tables */
+    GWBUF        *result;                             /*< The result being stored */
+    size_t        result_len;                         /*< The length of result */
+    CACHE_REPLY   reply;                              /*< The state of the response parser */
+    char        **trx_tables;                         /*< Tables modified in the transaction */
+    int           n_trx_tables;                       /*< The number of trx_tables */
+    char        **stmt_tables;                        /*< Tables modified by prepared statements */
+    int           n_stmt_tables;                      /*< The number of stmt_tables */
+    QC_PS_REGISTRY *ps;                               /*< The statements prepared by the server */
+    GWBUF        *prepare;                            /*< The COM_STMT_PREPARE being answered */
+    int           hits;                               /*< Results returned from the cache */
+    int           misses;                             /*< Results fetched from the servers */
+} CACHE_SESSION;
+
+static void cache_free_tables(char **tables, int n_tables);
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+    return &MyObject;
+}
+
+/**
+ * Parse a non-negative integer parameter
+ *
+ * @param param The parameter
+ * @param value Where the value is stored
+ * @return True, if the value was valid
+ */
+static bool
+cache_get_size_param(FILTER_PARAMETER *param, size_t *value)
+{
+    char *end;
+    long long v = strtoll(param->value, &end, 10);
+
+    if (*end != '\0' || v < 0)
+    {
+        MXS_ERROR("cache: The value of '%s' must be a non-negative integer, not '%s'.",
+                  param->name, param->value);
+        return false;
+    }
+
+    *value = v;
+    return true;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options   The options for this filter
+ * @param params    The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static FILTER *
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+    CACHE_INSTANCE *my_instance;
+
+    if ((my_instance = calloc(1, sizeof(CACHE_INSTANCE))) != NULL)
+    {
+        size_t ttl = CACHE_DEFAULT_TTL;
+        size_t server_id = 0;
+        SERVER *feed_server = NULL;
+        char *feed_user = NULL;
+        char *feed_password = NULL;
+        my_instance->max_size = CACHE_DEFAULT_MAX_SIZE;
+        my_instance->max_resultset_size = CACHE_DEFAULT_MAX_RESULTSET_SIZE;
+        bool error = false;
+
+        for (int i = 0; params && params[i]; i++)
+        {
+            if (!strcmp(params[i]->name, "ttl"))
+            {
+                error |= !cache_get_size_param(params[i], &ttl);
+            }
+            else if (!strcmp(params[i]->name, "max_size"))
+            {
+                error |= !cache_get_size_param(params[i], &my_instance->max_size);
+            }
+            else if (!strcmp(params[i]->name, "max_resultset_size"))
+            {
+                error |= !cache_get_size_param(params[i], &my_instance->max_resultset_size);
+            }
+            else if (!strcmp(params[i]->name, "invalidation_server"))
+            {
+                if ((feed_server = server_find_by_unique_name(params[i]->value)) == NULL)
+                {
+                    MXS_ERROR("cache: Unknown server '%s' in 'invalidation_server'.",
+                              params[i]->value);
+                    error = true;
+                }
+            }
+            else if (!strcmp(params[i]->name, "invalidation_user"))
+            {
+                feed_user = params[i]->value;
+            }
+            else if (!strcmp(params[i]->name, "invalidation_password"))
+            {
+                feed_password = params[i]->value;
+            }
+            else if (!strcmp(params[i]->name, "invalidation_server_id"))
+            {
+                error |= !cache_get_size_param(params[i], &server_id);
+            }
+            else if (!filter_standard_parameter(params[i]->name))
+            {
+                MXS_ERROR("cache: Unexpected parameter '%s'.", params[i]->name);
+                error = true;
+            }
+        }
+
+        for (int i = 0; options && options[i]; i++)
+        {
+            MXS_ERROR("cache: Unsupported option '%s'.", options[i]);
+            error = true;
+        }
+
+        my_instance->ttl = ttl;
+
+        if (feed_server && (feed_user == NULL || feed_password == NULL ||
+                            server_id == 0 || server_id > UINT32_MAX))
+        {
+            MXS_ERROR("cache: The invalidation feed needs 'invalidation_user', "
+                      "'invalidation_password' and an 'invalidation_server_id' "
+                      "between 1 and %u.", UINT32_MAX);
+            error = true;
+        }
+
+        if (!error && (my_instance->storage = lru_storage_create(my_instance->max_size)) == NULL)
+        {
+            MXS_ERROR("cache: Could not allocate the storage.");
+            error = true;
+        }
+
+        if (!error && feed_server)
+        {
+            char *password = decryptPassword(feed_password);
+
+            if (password == NULL ||
+                (my_instance->feed = cache_feed_start(my_instance->storage, feed_server, feed_user,
+                                                      password, server_id)) == NULL)
+            {
+                MXS_ERROR("cache: Could not start the invalidation feed.");
+                lru_storage_free(my_instance->storage);
+                error = true;
+            }
+
+            free(password);
+        }
+
+        if (error)
+        {
+            free(my_instance);
+            my_instance = NULL;
+        }
+    }
+
+    return (FILTER *) my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session itself
+ * @return Session specific data for this session
+ */
+static void *
+newSession(FILTER *instance, SESSION *session)
+{
+    CACHE_SESSION *my_session;
+    char *user;
+
+    if ((my_session = calloc(1, sizeof(CACHE_SESSION))) != NULL)
+    {
+        my_session->session = session;
+        my_session->autocommit = true;
+        my_session->state = CACHE_EXPECTING_NOTHING;
+        // Without the registry, executions are handled as if the statements were unknown.
+        my_session->ps = qc_ps_registry_alloc();
+
+        if ((user = session_getUser(session)) != NULL)
+        {
+            my_session->user = strdup(user);
+        }
+
+        MYSQL_session *data = session->client_dcb ? session->client_dcb->data : NULL;
+
+        if (data)
+        {
+            strncpy(my_session->db, data->db, MYSQL_DATABASE_MAXLEN);
+        }
+    }
+
+    return my_session;
+}
+
+/**
+ * Forget the result that is being collected, if any.
+ *
+ * @param my_session The session
+ */
+static void
+cache_discard_result(CACHE_SESSION *my_session)
+{
+    gwbuf_free(my_session->result);
+    my_session->result = NULL;
+    my_session->result_len = 0;
+    free(my_session->key);
+    my_session->key = NULL;
+    cache_free_tables(my_session->tables, my_session->n_tables);
+    my_session->tables = NULL;
+    my_session->n_tables = 0;
+    gwbuf_free(my_session->prepare);
+    my_session->prepare = NULL;
+    my_session->state = CACHE_EXPECTING_NOTHING;
+}
+
+/**
+ * Close a session with the filter
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+closeSession(FILTER *instance, void *session)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    cache_discard_result(my_session);
+}
+
+/**
+ * Free the memory associated with the session
+ *
+ * @param instance  The filter instance
+ * @param session   The filter session
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    cache_free_tables(my_session->trx_tables, my_session->n_trx_tables);
+    cache_free_tables(my_session->stmt_tables, my_session->n_stmt_tables);
+    qc_ps_registry_free(my_session->ps);
+    free(my_session->user);
+    free(my_session);
+}
+
+/**
+ * Set the downstream filter or router to which queries will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param downstream    The downstream filter or router.
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param upstream  The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    my_session->up = *upstream;
+}
+
+static void
+cache_free_tables(char **tables, int n_tables)
+{
+    for (int i = 0; i < n_tables; i++)
+    {
+        free(tables[i]);
+    }
+
+    free(tables);
+}
+
+/**
+ * Get the tables used by a statement. Names that are not qualified are
+ * qualified with the default database of the session.
+ *
+ * @param my_session The session
+ * @param queue      The statement
+ * @param n_tables   On return, the number of tables
+ * @return The names of the tables, or NULL if there are none
+ */
+static char **
+cache_get_tables(CACHE_SESSION *my_session, GWBUF *queue, int *n_tables)
+{
+    char **tables = qc_get_table_names(queue, n_tables, true);
+
+    for (int i = 0; tables && i < *n_tables; i++)
+    {
+        if (strchr(tables[i], '.') == NULL && *my_session->db)
+        {
+            char *name = malloc(strlen(my_session->db) + 1 + strlen(tables[i]) + 1);
+
+            if (name)
+            {
+                sprintf(name, "%s.%s", my_session->db, tables[i]);
+                free(tables[i]);
+                tables[i] = name;
+            }
+        }
+    }
+
+    if (tables == NULL)
+    {
+        *n_tables = 0;
+    }
+
+    return tables;
+}
+
+/**
+ * Append tables to a list of tables
+ */
+static void
+cache_add_tables(char ***list, int *n_list, char **tables, int n_tables)
+{
+    char **new_list = realloc(*list, (*n_list + n_tables) * sizeof(char*));
+
+    if (new_list)
+    {
+        for (int i = 0; i < n_tables; i++)
+        {
+            if ((new_list[*n_list] = strdup(tables[i])) != NULL)
+            {
+                (*n_list)++;
+            }
+        }
+
+        *list = new_list;
+    }
+}
+
+static void
+cache_invalidate_tables(CACHE_INSTANCE *my_instance, char **tables, int n_tables)
+{
+    for (int i = 0; i < n_tables; i++)
+    {
+        lru_storage_invalidate(my_instance->storage, tables[i]);
+    }
+}
+
+/**
+ * Invalidate the results that a modifying statement may affect. If the tables
+ * cannot be determined, the whole cache is cleared.
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The session
+ * @param queue       The statement
+ * @param tables      If not NULL, the tables are appended to this list
+ * @param n_tables    The number of tables in the list
+ */
+static void
+cache_invalidate(CACHE_INSTANCE *my_instance, CACHE_SESSION *my_session, GWBUF *queue,
+                 char ***list, int *n_list)
+{
+    int n_tables;
+    char **tables = cache_get_tables(my_session, queue, &n_tables);
+
+    if (n_tables > 0)
+    {
+        cache_invalidate_tables(my_instance, tables, n_tables);
+
+        if (list)
+        {
+            cache_add_tables(list, n_list, tables, n_tables);
+        }
+    }
+    else
+    {
+        lru_storage_clear(my_instance->storage);
+    }
+
+    cache_free_tables(tables, n_tables);
+}
+
+/**
+ * Check whether a sequence of words appears in an SQL statement. The words
+ * must be separated by whitespace and delimited by non-identifier characters.
+ *
+ * @param sql   The statement
+ * @param len   The length of the statement
+ * @param words The words, NULL terminated
+ * @return True, if the words were found
+ */
+static bool
+cache_sql_has_words(const char *sql, size_t len, const char **words)
+{
+    const char *end = sql + len;
+
+    for (const char *p = sql; p < end; p++)
+    {
+        const char *s = p;
+        const char **w = words;
+
+        if (s > sql && (isalnum((unsigned char)s[-1]) || s[-1] == '_'))
+        {
+            continue;
+        }
+
+        while (*w)
+        {
+            size_t wlen = strlen(*w);
+
+            if (end - s < (ptrdiff_t) wlen || strncasecmp(s, *w, wlen) != 0 ||
+                (s + wlen < end && (isalnum((unsigned char)s[wlen]) || s[wlen] == '_')))
+            {
+                break;
+            }
+
+            s += wlen;
+            w++;
+
+            if (*w)
+            {
+                if (s == end || !isspace((unsigned char)*s))
+                {
+                    break;
+                }
+
+                while (s < end && isspace((unsigned char)*s))
+                {
+                    s++;
+                }
+            }
+        }
+
+        if (*w == NULL)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Check whether a word is in a list, ignoring the case
+ *
+ * @param word  The word
+ * @param len   The length of the word
+ * @param words The list, NULL terminated
+ * @return True, if the word is in the list
+ */
+static bool
+cache_word_in(const char *word, size_t len, const char **words)
+{
+    for (const char **w = words; *w; w++)
+    {
+        if (strlen(*w) == len && strncasecmp(word, *w, len) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Check whether a statement calls functions whose results change between
+ * executions or depend on the session, or uses user variables. The string
+ * literals, quoted identifiers and comments are skipped. As with the query
+ * cache of the server, such statements are not cached.
+ *
+ * @param sql The statement
+ * @param len The length of the statement
+ * @return True, if the statement is not deterministic
+ */
+static bool
+cache_sql_is_nondeterministic(const char *sql, size_t len)
+{
+    /** Functions that are only recognized when called */
+    static const char *functions[] =
+    {
+        "NOW", "SYSDATE", "CURDATE", "CURTIME", "UNIX_TIMESTAMP", "RAND", "UUID",
+        "UUID_SHORT", "CONNECTION_ID", "USER", "SESSION_USER", "SYSTEM_USER",
+        "DATABASE", "SCHEMA", "LAST_INSERT_ID", "FOUND_ROWS", "ROW_COUNT",
+        "SLEEP", "BENCHMARK", "GET_LOCK", "RELEASE_LOCK", "IS_FREE_LOCK",
+        "IS_USED_LOCK", "MASTER_POS_WAIT", "LOAD_FILE", NULL
+    };
+    /** Functions that may also be used without parentheses */
+    static const char *keywords[] =
+    {
+        "CURRENT_TIMESTAMP", "CURRENT_DATE", "CURRENT_TIME", "CURRENT_USER",
+        "LOCALTIME", "LOCALTIMESTAMP", "UTC_DATE", "UTC_TIME", "UTC_TIMESTAMP", NULL
+    };
+    const char *end = sql + len;
+    const char *p = sql;
+
+    while (p < end)
+    {
+        char c = *p;
+
+        if (c == '\'' || c == '"' || c == '`')
+        {
+            for (p++; p < end && *p != c; p++)
+            {
+                if (*p == '\\' && c != '`')
+                {
+                    p++;
+                }
+            }
+            p++;
+        }
+        else if (c == '#' || (c == '-' && end - p >= 3 && p[1] == '-' && isspace((unsigned char)p[2])))
+        {
+            while (p < end && *p != '\n')
+            {
+                p++;
+            }
+        }
+        else if (c == '/' && end - p >= 2 && p[1] == '*' && (end - p < 3 || p[2] != '!'))
+        {
+            for (p += 2; p < end && !(*p == '*' && p + 1 < end && p[1] == '/'); p++)
+            {
+            }
+            p += 2;
+        }
+        else if (c == '@')
+        {
+            return true;
+        }
+        else if (isalpha((unsigned char)c) || c == '_')
+        {
+            const char *word = p;
+
+            while (p < end && (isalnum((unsigned char)*p) || *p == '_' || *p == '$'))
+            {
+                p++;
+            }
+
+            /** A qualified name, e.g. t.now, is not a function */
+            bool qualified = word > sql && word[-1] == '.';
+            const char *next = p;
+
+            while (next < end && isspace((unsigned char)*next))
+            {
+                next++;
+            }
+
+            if (!qualified &&
+                (cache_word_in(word, p - word, keywords) ||
+                 (next < end && *next == '(' && cache_word_in(word, p - word, functions))))
+            {
+                return true;
+            }
+        }
+        else
+        {
+            p++;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Check whether the result of a SELECT may be cached.
+ *
+ * @param sql The statement
+ * @param len The length of the statement
+ * @return True, if the statement has no clauses or functions that prevent caching
+ */
+static bool
+cache_sql_is_cacheable(const char *sql, size_t len)
+{
+    static const char *no_cache[] = { "SQL_NO_CACHE", NULL };
+    static const char *calc_found_rows[] = { "SQL_CALC_FOUND_ROWS", NULL };
+    static const char *for_update[] = { "FOR", "UPDATE", NULL };
+    static const char *share_mode[] = { "LOCK", "IN", "SHARE", "MODE", NULL };
+
+    return !cache_sql_has_words(sql, len, no_cache) &&
+           !cache_sql_has_words(sql, len, calc_found_rows) &&
+           !cache_sql_has_words(sql, len, for_update) &&
+           !cache_sql_has_words(sql, len, share_mode) &&
+           !cache_sql_is_nondeterministic(sql, len);
+}
+
+/**
+ * Create the key of a statement: the user, the default database and the
+ * statement separated by NUL characters.
+ *
+ * @param my_session The session
+ * @param sql        The statement
+ * @param len        The length of the statement
+ * @param key_len    On return, the length of the key
+ * @return The key or NULL on memory allocation failure
+ */
+static char *
+cache_make_key(CACHE_SESSION *my_session, const char *sql, size_t len, size_t *key_len)
+{
+    const char *user = my_session->user ? my_session->user : "";
+    size_t user_len = strlen(user) + 1;
+    size_t db_len = strlen(my_session->db) + 1;
+    char *key = malloc(user_len + db_len + len);
+
+    if (key)
+    {
+        memcpy(key, user, user_len);
+        memcpy(key + user_len, my_session->db, db_len);
+        memcpy(key + user_len + db_len, sql, len);
+        *key_len = user_len + db_len + len;
+    }
+
+    return key;
+}
+
+/**
+ * Copy the database name of a USE statement.
+ *
+ * @param sql The statement
+ * @param len The length of the statement
+ * @param db  Buffer of MYSQL_DATABASE_MAXLEN + 1 bytes
+ * @return True, if the name could be extracted
+ */
+static bool
+cache_get_use_db(const char *sql, size_t len, char *db)
+{
+    const char *end = sql + len;
+    const char *p = sql;
+
+    while (p < end && isspace((unsigned char)*p))
+    {
+        p++;
+    }
+
+    if (end - p < 4 || strncasecmp(p, "USE", 3) != 0 || !isspace((unsigned char)p[3]))
+    {
+        return false;
+    }
+
+    p += 3;
+
+    while (p < end && isspace((unsigned char)*p))
+    {
+        p++;
+    }
+
+    while (end > p && (isspace((unsigned char)end[-1]) || end[-1] == ';'))
+    {
+        end--;
+    }
+
+    if (end - p >= 2 && *p == '`' && end[-1] == '`')
+    {
+        p++;
+        end--;
+    }
+
+    if (end == p || end - p > MYSQL_DATABASE_MAXLEN)
+    {
+        return false;
+    }
+
+    memcpy(db, p, end - p);
+    db[end - p] = '\0';
+
+    return true;
+}
+
+/**
+ * Handle a COM_QUERY
+ *
+ * Keeps track of the transaction state and of the default database,
+ * invalidates the results affected by modifications and looks up the
+ * results of cacheable statements.
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The session
+ * @param queue       The statement
+ * @return The cached result of the statement or NULL if it was not found
+ */
+static GWBUF *
+cache_handle_query(CACHE_INSTANCE *my_instance, CACHE_SESSION *my_session, GWBUF *queue)
+{
+    char *sql;
+    int len;
+
+    if (modutil_extract_SQL(queue, &sql, &len) == 0)
+    {
+        return NULL;
+    }
+
+    uint32_t types = qc_get_type(queue);
+    qc_query_op_t op = qc_get_operation(queue);
+
+    if (op == QUERY_OP_CHANGE_DB && cache_get_use_db(sql, len, my_session->new_db))
+    {
+        my_session->state = CACHE_EXPECTING_DB_CHANGE;
+    }
+
+    if (types & QUERY_TYPE_WRITE)
+    {
+        bool in_trx = my_session->in_trx || !my_session->autocommit;
+
+        // Within a transaction the tables are invalidated also at the end of the
+        // transaction, since other sessions may read the old data in the meantime.
+        cache_invalidate(my_instance, my_session, queue,
+                         in_trx ? &my_session->trx_tables : NULL, &my_session->n_trx_tables);
+    }
+
+    if (types & (QUERY_TYPE_COMMIT | QUERY_TYPE_ROLLBACK))
+    {
+        cache_invalidate_tables(my_instance, my_session->trx_tables, my_session->n_trx_tables);
+        cache_free_tables(my_session->trx_tables, my_session->n_trx_tables);
+        my_session->trx_tables = NULL;
+        my_session->n_trx_tables = 0;
+        my_session->in_trx = false;
+    }
+
+    if (types & QUERY_TYPE_ENABLE_AUTOCOMMIT)
+    {
+        my_session->autocommit = true;
+    }
+
+    if (types & QUERY_TYPE_DISABLE_AUTOCOMMIT)
+    {
+        my_session->autocommit = false;
+    }
+    else if (types & QUERY_TYPE_BEGIN_TRX)
+    {
+        my_session->in_trx = true;
+    }
+
+    GWBUF *result = NULL;
+
+    if (op == QUERY_OP_SELECT &&
+        (types & QUERY_TYPE_READ) &&
+        (types & ~(QUERY_TYPE_READ | QUERY_TYPE_LOCAL_READ)) == 0 &&
+        my_session->autocommit && !my_session->in_trx &&
+        qc_parse(queue, QC_COLLECT_TABLES) == QC_QUERY_PARSED &&
+        cache_sql_is_cacheable(sql, len))
+    {
+        int n_tables;
+        char **tables = cache_get_tables(my_session, queue, &n_tables);
+        size_t key_len;
+        char *key;
+
+        // Without tables the result is most likely computed, e.g. SELECT NOW().
+        if (n_tables > 0 && (key = cache_make_key(my_session, sql, len, &key_len)) != NULL)
+        {
+            if ((result = lru_storage_get(my_instance->storage, key, key_len,
+                                          my_instance->ttl)) != NULL)
+            {
+                my_session->hits++;
+                free(key);
+                cache_free_tables(tables, n_tables);
+            }
+            else
+            {
+                my_session->misses++;
+                my_session->key = key;
+                my_session->key_len = key_len;
+                my_session->generation = lru_storage_generation(my_instance->storage);
+                my_session->tables = tables;
+                my_session->n_tables = n_tables;
+                memset(&my_session->reply, 0, sizeof(my_session->reply));
+                my_session->state = CACHE_EXPECTING_RESULT;
+            }
+        }
+        else
+        {
+            cache_free_tables(tables, n_tables);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Handle a COM_STMT_EXECUTE
+ *
+ * The results a registered statement may affect are invalidated like those
+ * of a COM_QUERY. If the statement is not known, the tables of all prepared
+ * modifications are invalidated.
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The session
+ * @param queue       The execution
+ */
+static void
+cache_handle_execute(CACHE_INSTANCE *my_instance, CACHE_SESSION *my_session, GWBUF *queue)
+{
+    GWBUF *stmt = my_session->ps ? qc_ps_get(my_session->ps, queue) : NULL;
+
+    if (stmt == NULL)
+    {
+        cache_invalidate_tables(my_instance, my_session->stmt_tables, my_session->n_stmt_tables);
+    }
+    else if (qc_get_type(stmt) & QUERY_TYPE_WRITE)
+    {
+        bool in_trx = my_session->in_trx || !my_session->autocommit;
+
+        cache_invalidate(my_instance, my_session, stmt,
+                         in_trx ? &my_session->trx_tables : NULL, &my_session->n_trx_tables);
+    }
+}
+
+/**
+ * The routeQuery entry point. This is passed the query buffer
+ * to which the filter should be applied. Once applied the
+ * query should normally be passed to the downstream component
+ * (filter or router) in the filter chain.
+ *
+ * If the result of the query is found in the cache, it is returned
+ * to the client and the query is not passed downstream.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param queue     The query data
+ */
+static int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+    GWBUF *result = NULL;
+
+    if (my_session->state == CACHE_EXPECTING_RESULT ||
+        my_session->state == CACHE_EXPECTING_PREPARE)
+    {
+        // A new statement before the previous response was complete.
+        cache_discard_result(my_session);
+    }
+
+    my_session->state = CACHE_EXPECTING_NOTHING;
+
+    if (queue->next != NULL)
+    {
+        queue = gwbuf_make_contiguous(queue);
+    }
+
+    if (GWBUF_LENGTH(queue) > MYSQL_HEADER_LEN)
+    {
+        uint8_t *data = GWBUF_DATA(queue);
+        size_t len = MIN(MYSQL_GET_PACKET_LEN(data), GWBUF_LENGTH(queue) - MYSQL_HEADER_LEN);
+
+        switch (MYSQL_GET_COMMAND(data))
+        {
+        case MYSQL_COM_INIT_DB:
+            if (len - 1 <= MYSQL_DATABASE_MAXLEN)
+            {
+                memcpy(my_session->new_db, data + MYSQL_HEADER_LEN + 1, len - 1);
+                my_session->new_db[len - 1] = '\0';
+                my_session->state = CACHE_EXPECTING_DB_CHANGE;
+            }
+            break;
+
+        case MYSQL_COM_QUERY:
+            result = cache_handle_query(my_instance, my_session, queue);
+            break;
+
+        case MYSQL_COM_STMT_PREPARE:
+            // The statement id is only known from the response. The tables of all
+            // prepared modifications are invalidated when a statement that could not
+            // be registered is executed.
+            if (qc_get_type(queue) & QUERY_TYPE_WRITE)
+            {
+                cache_invalidate(my_instance, my_session, queue,
+                                 &my_session->stmt_tables, &my_session->n_stmt_tables);
+            }
+
+            if (my_session->ps && (my_session->prepare = gwbuf_clone(queue)) != NULL)
+            {
+                my_session->state = CACHE_EXPECTING_PREPARE;
+            }
+            break;
+
+        case MYSQL_COM_STMT_EXECUTE:
+            cache_handle_execute(my_instance, my_session, queue);
+            break;
+
+        case MYSQL_COM_STMT_CLOSE:
+            if (my_session->ps)
+            {
+                qc_ps_remove(my_session->ps, queue);
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (result)
+    {
+        gwbuf_free(queue);
+        return my_session->up.clientReply(my_session->up.instance,
+                                          my_session->up.session, result);
+    }
+
+    /* Pass the query downstream */
+    return my_session->down.routeQuery(my_session->down.instance,
+                                       my_session->down.session, queue);
+}
+
+/**
+ * Classify a packet of a response.
+ *
+ * @param reply The parser state, with the start of the packet in the header
+ * @return The state of the response after the packet
+ */
+static cache_reply_result_t
+cache_reply_packet(CACHE_REPLY *reply)
+{
+    uint8_t *payload = reply->header + MYSQL_HEADER_LEN;
+    bool continued = reply->continued;
+    cache_reply_result_t rval = CACHE_REPLY_INCOMPLETE;
+
+    // A packet of the maximum length is followed by the rest of the same payload.
+    reply->continued = (reply->payload_len == CACHE_MAX_PACKET_LEN);
+
+    if (continued)
+    {
+        return rval;
+    }
+
+    bool is_eof = reply->payload_len < 9 && reply->peek > 0 && payload[0] == 0xfe;
+
+    switch (reply->phase)
+    {
+    case CACHE_REPLY_HEADER:
+        if (reply->peek == 0 || payload[0] == 0x00 || payload[0] == 0xfb ||
+            payload[0] == 0xff || payload[0] == 0xfe)
+        {
+            // OK, LOCAL INFILE request or error.
+            rval = CACHE_REPLY_OTHER;
+        }
+        else if (payload[0] < 0xfb)
+        {
+            reply->n_fields = payload[0];
+            reply->phase = CACHE_REPLY_FIELDS;
+        }
+        else if (payload[0] == 0xfc && reply->peek >= 3)
+        {
+            reply->n_fields = gw_mysql_get_byte2(payload + 1);
+            reply->phase = CACHE_REPLY_FIELDS;
+        }
+        else if (payload[0] == 0xfd && reply->peek >= 4)
+        {
+            reply->n_fields = gw_mysql_get_byte3(payload + 1);
+            reply->phase = CACHE_REPLY_FIELDS;
+        }
+        else
+        {
+            rval = CACHE_REPLY_OTHER;
+        }
+        break;
+
+    case CACHE_REPLY_FIELDS:
+        if (reply->n_fields > 0)
+        {
+            reply->n_fields--;
+        }
+        else if (is_eof)
+        {
+            reply->phase = CACHE_REPLY_ROWS;
+        }
+        else
+        {
+            rval = CACHE_REPLY_OTHER;
+        }
+        break;
+
+    case CACHE_REPLY_ROWS:
+        if (is_eof)
+        {
+            uint16_t status = reply->peek >= 5 ? gw_mysql_get_byte2(payload + 3) : 0;
+
+            // Multiple result sets, e.g. from a stored procedure, are not cached.
+            rval = (status & SERVER_MORE_RESULTS_EXIST) ? CACHE_REPLY_OTHER : CACHE_REPLY_RESULTSET;
+        }
+        else if (reply->peek > 0 && payload[0] == 0xff)
+        {
+            rval = CACHE_REPLY_OTHER;
+        }
+        break;
+    }
+
+    return rval;
+}
+
+/**
+ * Feed buffers of a response to the parser.
+ *
+ * @param reply The parser state
+ * @param queue The buffers
+ * @return The state of the response after the buffers
+ */
+static cache_reply_result_t
+cache_parse_reply(CACHE_REPLY *reply, GWBUF *queue)
+{
+    for (GWBUF *buf = queue; buf; buf = buf->next)
+    {
+        uint8_t *ptr = GWBUF_DATA(buf);
+        size_t len = GWBUF_LENGTH(buf);
+
+        while (len > 0)
+        {
+            if (reply->skip > 0)
+            {
+                size_t n = MIN(reply->skip, len);
+                reply->skip -= n;
+                ptr += n;
+                len -= n;
+                continue;
+            }
+
+            reply->header[reply->header_len++] = *ptr++;
+            len--;
+
+            if (reply->header_len == MYSQL_HEADER_LEN)
+            {
+                reply->payload_len = gw_mysql_get_byte3(reply->header);
+                reply->peek = MIN(reply->payload_len, CACHE_REPLY_PEEK);
+            }
+
+            if (reply->header_len >= MYSQL_HEADER_LEN &&
+                reply->header_len == MYSQL_HEADER_LEN + reply->peek)
+            {
+                cache_reply_result_t rval = cache_reply_packet(reply);
+
+                reply->skip = reply->payload_len - reply->peek;
+                reply->header_len = 0;
+
+                if (rval != CACHE_REPLY_INCOMPLETE)
+                {
+                    return rval;
+                }
+            }
+        }
+    }
+
+    return CACHE_REPLY_INCOMPLETE;
+}
+
+/**
+ * Collect a part of a result that is to be stored and store the result
+ * when it is complete.
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The session
+ * @param reply       The part of the result
+ */
+static void
+cache_collect_result(CACHE_INSTANCE *my_instance, CACHE_SESSION *my_session, GWBUF *reply)
+{
+    my_session->result_len += gwbuf_length(reply);
+
+    if (my_session->result_len > my_instance->max_resultset_size)
+    {
+        cache_discard_result(my_session);
+        return;
+    }
+
+    // The buffers are passed on to the client, so only the data is shared.
+    for (GWBUF *buf = reply; buf; buf = buf->next)
+    {
+        GWBUF *clone = gwbuf_clone(buf);
+
+        if (clone == NULL)
+        {
+            cache_discard_result(my_session);
+            return;
+        }
+
+        my_session->result = gwbuf_append(my_session->result, clone);
+    }
+
+    switch (cache_parse_reply(&my_session->reply, reply))
+    {
+    case CACHE_REPLY_INCOMPLETE:
+        break;
+
+    case CACHE_REPLY_RESULTSET:
+        if ((my_session->result = gwbuf_make_contiguous(my_session->result)) != NULL &&
+            lru_storage_put(my_instance->storage, my_session->key, my_session->key_len,
+                            my_session->result, my_session->tables, my_session->n_tables,
+                            my_session->generation))
+        {
+            my_session->result = NULL;
+        }
+        cache_discard_result(my_session);
+        break;
+
+    case CACHE_REPLY_OTHER:
+        cache_discard_result(my_session);
+        break;
+    }
+}
+
+/**
+ * The clientReply entry point. The results of cacheable statements
+ * are collected and stored, changes of the default database are
+ * recorded once the server has accepted them and prepared statements
+ * are registered with the id the server gave them.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param reply     The response data
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    switch (my_session->state)
+    {
+    case CACHE_EXPECTING_RESULT:
+        cache_collect_result(my_instance, my_session, reply);
+        break;
+
+    case CACHE_EXPECTING_DB_CHANGE:
+        {
+            uint8_t cmd;
+
+            if (gwbuf_copy_data(reply, MYSQL_HEADER_LEN, 1, &cmd) == 1 && cmd == 0x00)
+            {
+                strcpy(my_session->db, my_session->new_db);
+
+                // The unqualified tables of the statements prepared so far are in
+                // the previous database, so their executions are handled as unknown.
+                qc_ps_registry_free(my_session->ps);
+                my_session->ps = qc_ps_registry_alloc();
+            }
+
+            my_session->state = CACHE_EXPECTING_NOTHING;
+        }
+        break;
+
+    case CACHE_EXPECTING_PREPARE:
+        qc_ps_add(my_session->ps, my_session->prepare, reply);
+        gwbuf_free(my_session->prepare);
+        my_session->prepare = NULL;
+        my_session->state = CACHE_EXPECTING_NOTHING;
+        break;
+
+    default:
+        break;
+    }
+
+    /* Pass the result upstream */
+    return my_session->up.clientReply(my_session->up.instance,
+                                      my_session->up.session, reply);
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param   instance    The filter instance
+ * @param   fsession    Filter session, may be NULL
+ * @param   dcb         The DCB for diagnostic output
+ */
+static void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *) fsession;
+    LRU_STORAGE_STATS stats;
+
+    lru_storage_get_stats(my_instance->storage, &stats);
+
+    dcb_printf(dcb, "\t\tTime to live                   %d seconds\n", my_instance->ttl);
+    dcb_printf(dcb, "\t\tMaximum size                   %lu bytes\n",
+               (unsigned long) my_instance->max_size);
+    dcb_printf(dcb, "\t\tMaximum result set size        %lu bytes\n",
+               (unsigned long) my_instance->max_resultset_size);
+    dcb_printf(dcb, "\t\tCached results                 %lu\n", (unsigned long) stats.entries);
+    dcb_printf(dcb, "\t\tCurrent size                   %lu bytes\n", (unsigned long) stats.size);
+    dcb_printf(dcb, "\t\tHits                           %lu\n", (unsigned long) stats.hits);
+    dcb_printf(dcb, "\t\tMisses                         %lu\n", (unsigned long) stats.misses);
+    dcb_printf(dcb, "\t\tExpired results                %lu\n", (unsigned long) stats.expirations);
+    dcb_printf(dcb, "\t\tEvicted results                %lu\n", (unsigned long) stats.evictions);
+    dcb_printf(dcb, "\t\tInvalidated results            %lu\n", (unsigned long) stats.invalidations);
+
+    if (my_instance->feed)
+    {
+        CACHE_FEED_STATS feed_stats;
+        cache_feed_get_stats(my_instance->feed, &feed_stats);
+
+        dcb_printf(dcb, "\t\tInvalidation feed              %s\n",
+                   feed_stats.connected ? "Following the binlog" : "Not connected");
+        dcb_printf(dcb, "\t\tFeed binlog position           %s:%lu\n",
+                   feed_stats.file, (unsigned long) feed_stats.pos);
+        dcb_printf(dcb, "\t\tFeed connections               %lu\n",
+                   (unsigned long) feed_stats.connects);
+        dcb_printf(dcb, "\t\tFeed binlog events             %lu\n",
+                   (unsigned long) feed_stats.events);
+        dcb_printf(dcb, "\t\tFeed table invalidations       %lu\n",
+                   (unsigned long) feed_stats.invalidations);
+        dcb_printf(dcb, "\t\tFeed cache clears              %lu\n",
+                   (unsigned long) feed_stats.clears);
+    }
+
+    if (my_session)
+    {
+        dcb_printf(dcb, "\t\tSession hits                   %d\n", my_session->hits);
+        dcb_printf(dcb, "\t\tSession misses                 %d\n", my_session->misses);
+    }
+}
@@ -0,0 +1,606 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file lrustorage.c - The in-memory LRU storage of the cache filter
+ *
+ * The entries are kept in a hash table and in a doubly linked list in LRU
+ * order. Every table that is used by some entry has a record of its own, in a
+ * second hash table, and the record links together the references of all
+ * entries that use the table. Thus, invalidating a table only touches the
+ * entries that actually use it.
+ *
+ * The names of the tables are compared case-insensitively, so that an
+ * invalidation never misses an entry because of the case of a name.
+ *
+ * A result that is being read from a server when one of its tables is
+ * invalidated may still contain the old data. Every invalidation therefore
+ * increments a generation and the hashes of the most recently invalidated
+ * tables are remembered, so that a result whose tables were invalidated after
+ * the generation it was read at can be refused.
+ */
+
+#include "lrustorage.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <spinlock.h>
+#include <skygw_debug.h>
+#include <utils.h>
+
+#define LRU_MIN_BUCKETS 256
+#define LRU_MAX_BUCKETS 65536
+
+/** The number of invalidated tables that are remembered, a power of two */
+#define LRU_INVALIDATION_LOG 64
+
+struct lru_entry;
+
+typedef struct lru_table_ref
+{
+    struct lru_table     *table; /*< The table that is referred to */
+    struct lru_entry     *entry; /*< The entry that refers to the table */
+    struct lru_table_ref *prev;  /*< The previous reference to the same table */
+    struct lru_table_ref *next;  /*< The next reference to the same table */
+} LRU_TABLE_REF;
+
+typedef struct lru_table
+{
+    uint64_t         hash;  /*< The hash of the name */
+    char            *name;  /*< The lowercase name of the table */
+    LRU_TABLE_REF   *refs;  /*< The references of the entries using the table */
+    struct lru_table *hnext; /*< The next table in the hash bucket */
+} LRU_TABLE;
+
+typedef struct lru_entry
+{
+    uint64_t         hash;    /*< The hash of the key */
+    char            *key;     /*< The key */
+    size_t           key_len; /*< The length of the key */
+    GWBUF           *result;  /*< The result, a single contiguous buffer */
+    size_t           size;    /*< The size accounted for the entry */
+    time_t           created; /*< When the entry was stored */
+    int              n_refs;  /*< The number of tables used by the result */
+    LRU_TABLE_REF   *refs;    /*< The table references, one per table */
+    struct lru_entry *hnext;  /*< The next entry in the hash bucket */
+    struct lru_entry *prev;   /*< The previous, more recently used entry */
+    struct lru_entry *next;   /*< The next, less recently used entry */
+} LRU_ENTRY;
+
+struct lru_storage
+{
+    SPINLOCK          lock;            /*< Protects everything below */
+    size_t            max_size;        /*< The maximum total size of the entries */
+    LRU_ENTRY       **entries;         /*< The hash buckets of the entries */
+    size_t            n_entry_buckets; /*< The number of entry buckets, a power of two */
+    LRU_TABLE       **tables;          /*< The hash buckets of the tables */
+    size_t            n_table_buckets; /*< The number of table buckets, a power of two */
+    LRU_ENTRY        *head;            /*< The most recently used entry */
+    LRU_ENTRY        *tail;            /*< The least recently used entry */
+    LRU_STORAGE_STATS stats;           /*< The statistics */
+    uint64_t          generation;      /*< Incremented by each invalidation */
+    uint64_t          cleared;         /*< The generation of the last clear */
+    uint64_t          invalidated[LRU_INVALIDATION_LOG]; /*< The hashes of the last
+                                                          * invalidated tables */
+};
+
+static uint64_t lru_hash(const char* data, size_t len)
+{
+    return mxs_fnv1a64(MXS_FNV1A64_INIT, data, len);
+}
+
+static void lru_tolower(const char* name, char* lname)
+{
+    while (*name)
+    {
+        *lname++ = tolower((unsigned char)*name++);
+    }
+
+    *lname = 0;
+}
+
+static LRU_TABLE** lru_find_table(LRU_STORAGE* storage, const char* lname, uint64_t hash)
+{
+    LRU_TABLE** pp = &storage->tables[hash & (storage->n_table_buckets - 1)];
+
+    while (*pp && ((*pp)->hash != hash || strcmp((*pp)->name, lname) != 0))
+    {
+        pp = &(*pp)->hnext;
+    }
+
+    return pp;
+}
+
+static LRU_ENTRY** lru_find_entry(LRU_STORAGE* storage, const char* key, size_t key_len, uint64_t hash)
+{
+    LRU_ENTRY** pp = &storage->entries[hash & (storage->n_entry_buckets - 1)];
+
+    while (*pp && ((*pp)->hash != hash || (*pp)->key_len != key_len ||
+                   memcmp((*pp)->key, key, key_len) != 0))
+    {
+        pp = &(*pp)->hnext;
+    }
+
+    return pp;
+}
+
+static void lru_unlink(LRU_STORAGE* storage, LRU_ENTRY* entry)
+{
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        storage->head = entry->next;
+    }
+
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        storage->tail = entry->prev;
+    }
+}
+
+static void lru_push_front(LRU_STORAGE* storage, LRU_ENTRY* entry)
+{
+    entry->prev = NULL;
+    entry->next = storage->head;
+
+    if (storage->head)
+    {
+        storage->head->prev = entry;
+    }
+    else
+    {
+        storage->tail = entry;
+    }
+
+    storage->head = entry;
+}
+
+/**
+ * Remove a table reference of an entry and free the table if no other entry
+ * refers to it.
+ */
+static void lru_unref_table(LRU_STORAGE* storage, LRU_TABLE_REF* ref)
+{
+    LRU_TABLE* table = ref->table;
+
+    if (ref->prev)
+    {
+        ref->prev->next = ref->next;
+    }
+    else
+    {
+        table->refs = ref->next;
+    }
+
+    if (ref->next)
+    {
+        ref->next->prev = ref->prev;
+    }
+
+    if (table->refs == NULL)
+    {
+        LRU_TABLE** pp = lru_find_table(storage, table->name, table->hash);
+        *pp = table->hnext;
+        free(table->name);
+        free(table);
+    }
+}
+
+/**
+ * Add a reference to a table, creating the table record if needed.
+ *
+ * @return True, if the reference could be added
+ */
+static bool lru_ref_table(LRU_STORAGE* storage, LRU_TABLE_REF* ref, const char* name)
+{
+    char lname[strlen(name) + 1];
+    lru_tolower(name, lname);
+
+    uint64_t hash = lru_hash(lname, strlen(lname));
+    LRU_TABLE** pp = lru_find_table(storage, lname, hash);
+    LRU_TABLE* table = *pp;
+
+    if (table == NULL)
+    {
+        if ((table = malloc(sizeof(LRU_TABLE))) == NULL ||
+            (table->name = strdup(lname)) == NULL)
+        {
+            free(table);
+            return false;
+        }
+
+        table->hash = hash;
+        table->refs = NULL;
+        table->hnext = NULL;
+        *pp = table;
+    }
+
+    ref->table = table;
+    ref->prev = NULL;
+    ref->next = table->refs;
+
+    if (table->refs)
+    {
+        table->refs->prev = ref;
+    }
+
+    table->refs = ref;
+
+    return true;
+}
+
+static void lru_remove(LRU_STORAGE* storage, LRU_ENTRY* entry)
+{
+    LRU_ENTRY** pp = lru_find_entry(storage, entry->key, entry->key_len, entry->hash);
+    *pp = entry->hnext;
+
+    lru_unlink(storage, entry);
+
+    for (int i = 0; i < entry->n_refs; i++)
+    {
+        lru_unref_table(storage, &entry->refs[i]);
+    }
+
+    storage->stats.entries--;
+    storage->stats.size -= entry->size;
+
+    gwbuf_free(entry->result);
+    free(entry->refs);
+    free(entry->key);
+    free(entry);
+}
+
+static size_t lru_buckets(size_t n)
+{
+    size_t buckets = LRU_MIN_BUCKETS;
+
+    while (buckets < n && buckets < LRU_MAX_BUCKETS)
+    {
+        buckets *= 2;
+    }
+
+    return buckets;
+}
+
+/**
+ * Create a new storage
+ *
+ * @param max_size The maximum total size of the stored entries in bytes
+ * @return The new storage or NULL on memory allocation failure
+ */
+LRU_STORAGE* lru_storage_create(size_t max_size)
+{
+    LRU_STORAGE* storage = calloc(1, sizeof(LRU_STORAGE));
+
+    if (storage)
+    {
+        // Assume an average entry of a few kilobytes.
+        storage->n_entry_buckets = lru_buckets(max_size / 4096);
+        storage->n_table_buckets = lru_buckets(storage->n_entry_buckets / 4);
+        storage->entries = calloc(storage->n_entry_buckets, sizeof(LRU_ENTRY*));
+        storage->tables = calloc(storage->n_table_buckets, sizeof(LRU_TABLE*));
+        storage->max_size = max_size;
+        spinlock_init(&storage->lock);
+
+        if (storage->entries == NULL || storage->tables == NULL)
+        {
+            free(storage->entries);
+            free(storage->tables);
+            free(storage);
+            storage = NULL;
+        }
+    }
+
+    return storage;
+}
+
+/**
+ * Free a storage and all the entries in it
+ *
+ * @param storage The storage to free
+ */
+void lru_storage_free(LRU_STORAGE* storage)
+{
+    if (storage)
+    {
+        lru_storage_clear(storage);
+        free(storage->entries);
+        free(storage->tables);
+        free(storage);
+    }
+}
+
+/**
+ * Look up a result
+ *
+ * An entry that is older than @c ttl seconds is removed and not returned.
+ *
+ * @param storage The storage
+ * @param key     The key
+ * @param key_len The length of the key
+ * @param ttl     The time to live of the entries in seconds, 0 for no limit
+ * @return A clone of the stored result, or NULL if there is no valid entry
+ */
+GWBUF* lru_storage_get(LRU_STORAGE* storage, const char* key, size_t key_len, int ttl)
+{
+    GWBUF* result = NULL;
+    uint64_t hash = lru_hash(key, key_len);
+
+    spinlock_acquire(&storage->lock);
+
+    LRU_ENTRY* entry = *lru_find_entry(storage, key, key_len, hash);
+
+    if (entry && ttl > 0 && time(NULL) - entry->created >= ttl)
+    {
+        lru_remove(storage, entry);
+        storage->stats.expirations++;
+        entry = NULL;
+    }
+
+    if (entry && (result = gwbuf_clone(entry->result)) != NULL)
+    {
+        if (entry != storage->head)
+        {
+            lru_unlink(storage, entry);
+            lru_push_front(storage, entry);
+        }
+
+        storage->stats.hits++;
+    }
+    else
+    {
+        storage->stats.misses++;
+    }
+
+    spinlock_release(&storage->lock);
+
+    return result;
+}
+
+/**
+ * Check whether a table of a result has been invalidated after a generation.
+ * The caller must hold the lock.
+ */
+static bool lru_is_stale(LRU_STORAGE* storage, char** tables, int n_tables, uint64_t generation)
+{
+    if (generation == storage->generation)
+    {
+        return false;
+    }
+
+    if (storage->cleared > generation || storage->generation - generation > LRU_INVALIDATION_LOG)
+    {
+        return true;
+    }
+
+    for (int i = 0; i < n_tables; i++)
+    {
+        char lname[strlen(tables[i]) + 1];
+        lru_tolower(tables[i], lname);
+        uint64_t hash = lru_hash(lname, strlen(lname));
+
+        for (uint64_t g = generation + 1; g <= storage->generation; g++)
+        {
+            if (storage->invalidated[g & (LRU_INVALIDATION_LOG - 1)] == hash)
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Store a result
+ *
+ * If there is already an entry with the same key, it is replaced. The least
+ * recently used entries are evicted until the new entry fits.
+ *
+ * @param storage  The storage
+ * @param key      The key
+ * @param key_len  The length of the key
+ * @param result   The complete result in a single contiguous buffer. On
+ *                 success the storage takes the ownership of the buffer.
+ * @param tables   The tables the result was read from
+ * @param n_tables The number of tables
+ * @param generation The generation when the statement was sent to the server
+ * @return True, if the result was stored
+ */
+bool lru_storage_put(LRU_STORAGE* storage, const char* key, size_t key_len,
+                     GWBUF* result, char** tables, int n_tables, uint64_t generation)
+{
+    ss_dassert(result->next == NULL);
+
+    size_t size = sizeof(LRU_ENTRY) + key_len + GWBUF_LENGTH(result) +
+                  n_tables * sizeof(LRU_TABLE_REF);
+
+    if (size > storage->max_size)
+    {
+        return false;
+    }
+
+    LRU_ENTRY* entry = calloc(1, sizeof(LRU_ENTRY));
+
+    if (entry == NULL ||
+        (entry->key = malloc(key_len)) == NULL ||
+        (n_tables > 0 && (entry->refs = calloc(n_tables, sizeof(LRU_TABLE_REF))) == NULL))
+    {
+        if (entry)
+        {
+            free(entry->key);
+            free(entry);
+        }
+
+        return false;
+    }
+
+    memcpy(entry->key, key, key_len);
+    entry->key_len = key_len;
+    entry->hash = lru_hash(key, key_len);
+    entry->result = result;
+    entry->size = size;
+    entry->created = time(NULL);
+
+    bool stored = true;
+
+    spinlock_acquire(&storage->lock);
+
+    if (lru_is_stale(storage, tables, n_tables, generation))
+    {
+        spinlock_release(&storage->lock);
+        free(entry->refs);
+        free(entry->key);
+        free(entry);
+        return false;
+    }
+
+    LRU_ENTRY* old = *lru_find_entry(storage, key, key_len, entry->hash);
+
+    if (old)
+    {
+        lru_remove(storage, old);
+    }
+
+    while (storage->stats.size + size > storage->max_size)
+    {
+        lru_remove(storage, storage->tail);
+        storage->stats.evictions++;
+    }
+
+    for (int i = 0; i < n_tables; i++)
+    {
+        entry->refs[i].entry = entry;
+
+        if (!lru_ref_table(storage, &entry->refs[i], tables[i]))
+        {
+            while (--i >= 0)
+            {
+                lru_unref_table(storage, &entry->refs[i]);
+            }
+
+            stored = false;
+            break;
+        }
+
+        entry->n_refs++;
+    }
+
+    if (stored)
+    {
+        LRU_ENTRY** bucket = &storage->entries[entry->hash & (storage->n_entry_buckets - 1)];
+        entry->hnext = *bucket;
+        *bucket = entry;
+        lru_push_front(storage, entry);
+
+        storage->stats.entries++;
+        storage->stats.size += size;
+    }
+
+    spinlock_release(&storage->lock);
+
+    if (!stored)
+    {
+        free(entry->refs);
+        free(entry->key);
+        free(entry);
+    }
+
+    return stored;
+}
+
+/**
+ * Remove all entries whose result was read from a particular table
+ *
+ * @param storage The storage
+ * @param table   The qualified name of the table
+ */
+void lru_storage_invalidate(LRU_STORAGE* storage, const char* table)
+{
+    char lname[strlen(table) + 1];
+    lru_tolower(table, lname);
+    uint64_t hash = lru_hash(lname, strlen(lname));
+
+    spinlock_acquire(&storage->lock);
+
+    storage->generation++;
+    storage->invalidated[storage->generation & (LRU_INVALIDATION_LOG - 1)] = hash;
+
+    LRU_TABLE* t;
+
+    // The table record is freed when its last reference is removed.
+    while ((t = *lru_find_table(storage, lname, hash)) != NULL)
+    {
+        lru_remove(storage, t->refs->entry);
+        storage->stats.invalidations++;
+    }
+
+    spinlock_release(&storage->lock);
+}
+
+/**
+ * Remove all entries
+ *
+ * @param storage The storage
+ */
+void lru_storage_clear(LRU_STORAGE* storage)
+{
+    spinlock_acquire(&storage->lock);
+
+    storage->cleared = ++storage->generation;
+
+    while (storage->head)
+    {
+        lru_remove(storage, storage->head);
+        storage->stats.invalidations++;
+    }
+
+    spinlock_release(&storage->lock);
+}
+
+/**
+ * Get the current generation of a storage. A result read from a server after
+ * this call is stored only if none of its tables is invalidated meanwhile.
+ *
+ * @param storage The storage
+ * @return The generation
+ */
+uint64_t lru_storage_generation(LRU_STORAGE* storage)
+{
+    spinlock_acquire(&storage->lock);
+    uint64_t generation = storage->generation;
+    spinlock_release(&storage->lock);
+
+    return generation;
+}
+
+/**
+ * Get the statistics of a storage
+ *
+ * @param storage The storage
+ * @param stats   Where the statistics are stored
+ */
+void lru_storage_get_stats(LRU_STORAGE* storage, LRU_STORAGE_STATS* stats)
+{
+    spinlock_acquire(&storage->lock);
+    *stats = storage->stats;
+    spinlock_release(&storage->lock);
+}
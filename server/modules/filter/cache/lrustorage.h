@@ -0,0 +1,56 @@
+#ifndef _LRUSTORAGE_H
+#define _LRUSTORAGE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file lrustorage.h - The in-memory LRU storage of the cache filter
+ *
+ * The storage maps keys to complete result sets. The total size of the stored
+ * data never exceeds the limit given when the storage is created; to make
+ * room for a new entry, the least recently used entries are evicted. Each
+ * entry also records the tables its result was read from, so that the entries
+ * can be invalidated when one of the tables is modified.
+ *
+ * All functions are thread-safe.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <buffer.h>
+
+typedef struct lru_storage LRU_STORAGE;
+
+typedef struct lru_storage_stats
+{
+    uint64_t hits;          /*< Lookups that found a valid entry */
+    uint64_t misses;        /*< Lookups that did not find a valid entry */
+    uint64_t expirations;   /*< Entries removed because they were too old */
+    uint64_t evictions;     /*< Entries evicted to make room for new ones */
+    uint64_t invalidations; /*< Entries removed because a table they use was modified */
+    uint64_t entries;       /*< Current number of entries */
+    uint64_t size;          /*< Current size of the entries in bytes */
+} LRU_STORAGE_STATS;
+
+LRU_STORAGE* lru_storage_create(size_t max_size);
+void         lru_storage_free(LRU_STORAGE* storage);
+GWBUF*       lru_storage_get(LRU_STORAGE* storage, const char* key, size_t key_len, int ttl);
+bool         lru_storage_put(LRU_STORAGE* storage, const char* key, size_t key_len,
+                             GWBUF* result, char** tables, int n_tables, uint64_t generation);
+void         lru_storage_invalidate(LRU_STORAGE* storage, const char* table);
+void         lru_storage_clear(LRU_STORAGE* storage);
+uint64_t     lru_storage_generation(LRU_STORAGE* storage);
+void         lru_storage_get_stats(LRU_STORAGE* storage, LRU_STORAGE_STATS* stats);
+
+#endif
@@ -75,6 +75,8 @@
 #include <assert.h>
 #include <regex.h>
 #include <maxscale_pcre2.h>
+#include <maxscale/poll.h>
+#include <maxconfig.h>
 #include <dbfwfilter.h>
 #include <ruleparser.yy.h>
 #include <lex.yy.h>
@@ -163,19 +165,40 @@ typedef struct timerange_t
     struct tm end; /*< End of the time range */
 } TIMERANGE;
 
+/**
+ * The queries of one thread that are counted against a limit_queries rule
+ *
+ * A thread takes the queries it is allowed to do from the shared window in
+ * batches and counts them down locally, so the threads do not contend on the
+ * shared counter for every query.
+ */
+typedef struct queryspeed_shard_t
+{
+    int64_t window; /*< The window the queries were taken from */
+    int tokens; /*< Queries left of the batch */
+} __attribute__((aligned(64))) QUERYSPEED_SHARD;
+
 /**
  * Query speed measurement and limitation structure
+ *
+ * The rule definition only uses the limits and the id. The state of a user is
+ * a copy of the definition with a shard for each thread.
  */
 typedef struct queryspeed_t
 {
-    time_t first_query; /*< Time when the first query occurred */
+    time_t first_query; /*< Time when the current window started */
     time_t triggered; /*< Time when the limit was exceeded */
     int period; /*< Measurement interval in seconds */
     int cooldown; /*< Time the user is denied access for */
-    int count; /*< Number of queries done */
+    int count; /*< Number of queries taken from the current window */
     int limit; /*< Maximum number of queries */
     long id; /*< Unique id of the rule */
     bool active; /*< If the rule has been triggered */
+    int64_t window; /*< Number of the current window */
+    int batch; /*< Number of queries a thread takes from the window at a time */
+    int n_shards; /*< Number of shards, one for each thread and one for others */
+    QUERYSPEED_SHARD* shards; /*< The queries of each thread */
+    SPINLOCK lock; /*< Protects the change of the window */
     struct queryspeed_t* next; /*< Next node in the list */
 } QUERYSPEED;
 
@@ -193,6 +216,7 @@ typedef struct rule_t
     qc_query_op_t on_queries; /*< Types of queries to inspect */
     int times_matched; /*< Number of times this rule has been matched */
     TIMERANGE* active; /*< List of times when this rule is active */
+    char* regex_source; /*< Pattern of a regex rule, used by the rule indexes */
     struct rule_t *next;
 } RULE;
 
@@ -202,9 +226,41 @@ typedef struct rule_t
 typedef struct rulelist_t
 {
     RULE* rule; /*< The rule structure */
+    int position; /*< Position of the rule in the list */
+    bool indexed; /*< Whether the rule is a part of the index of the list */
     struct rulelist_t* next; /*< Next node in the list */
 } RULELIST;
 
+/**
+ * The rules of one rule list compiled for matching
+ *
+ * The indexed regex rules are combined into one pattern. If the query does not
+ * match it, none of the indexed regex rules match. The column rules are
+ * indexed by column name so that the affected fields of a query are looked up
+ * once instead of once for each column rule.
+ */
+typedef struct rule_index_t
+{
+    pcre2_code* regex; /*< Combined pattern of the indexed regex rules */
+    HASHTABLE* columns; /*< Column name to a bitmask of the column rules */
+    int n_words; /*< Number of words in a bitmask */
+} RULE_INDEX;
+
+/**
+ * Properties of a query that are computed once for all the rules of a list
+ */
+typedef struct match_state_t
+{
+    const char* query; /*< The SQL of the query, not null terminated, can be NULL */
+    int query_len; /*< Length of the SQL */
+    char* fields; /*< Affected fields of the query */
+    bool have_fields; /*< Whether the affected fields have been resolved */
+    bool regex_done; /*< Whether the combined pattern has been matched */
+    bool regex_matched; /*< Whether the query matched the combined pattern */
+    uint64_t* columns; /*< Bitmask of the column rules that match a field */
+    bool columns_done; /*< Whether the column bitmask has been computed */
+} MATCH_STATE;
+
 typedef struct user_template
 {
     char *name;
@@ -222,7 +278,9 @@ typedef struct user_t
     RULELIST* rules_and; /*< All of these rules must match for the action to trigger */
     RULELIST* rules_strict_and; /*< rules that skip the rest of the rules if one of them
                  * fails. This is only for rules paired with 'match strict_all'. */
-
+    RULE_INDEX* index_or; /*< Index of rules_or */
+    RULE_INDEX* index_and; /*< Index of rules_and */
+    RULE_INDEX* index_strict_and; /*< Index of rules_strict_and */
 } USER;
 
 /**
@@ -371,6 +429,8 @@ static RULELIST* rulelist_push(RULELIST *head, RULE *rule)
     if (rval)
     {
         rval->rule = rule;
+        rval->position = 0;
+        rval->indexed = false;
         rval->next = head;
     }
     return rval;
@@ -388,6 +448,8 @@ static void* rulelist_clone(void* fval)
         RULELIST* tmp = (RULELIST*) malloc(sizeof(RULELIST));
         tmp->next = rule;
         tmp->rule = ptr->rule;
+        tmp->position = 0;
+        tmp->indexed = false;
         rule = tmp;
         ptr = ptr->next;
     }
@@ -407,6 +469,242 @@ static void* rulelist_free(void* fval)
     return NULL;
 }
 
+/**
+ * Free a rule index
+ * @param index Index to free, can be NULL
+ */
+static void rule_index_free(RULE_INDEX* index)
+{
+    if (index)
+    {
+        pcre2_code_free(index->regex);
+
+        if (index->columns)
+        {
+            hashtable_free(index->columns);
+        }
+
+        free(index);
+    }
+}
+
+/**
+ * Check if a regex rule can be a part of a combined pattern
+ *
+ * Backreferences and named groups would refer to the wrong groups and the
+ * backtracking control verbs could stop the other alternatives from being
+ * tried, so patterns that use them are matched on their own.
+ *
+ * @param rule Regex rule
+ * @return True if the pattern of the rule can be combined with others
+ */
+static bool regex_is_combinable(RULE* rule)
+{
+    uint32_t backrefs = 1;
+    uint32_t names = 1;
+
+    pcre2_pattern_info((pcre2_code*) rule->data, PCRE2_INFO_BACKREFMAX, &backrefs);
+    pcre2_pattern_info((pcre2_code*) rule->data, PCRE2_INFO_NAMECOUNT, &names);
+
+    return rule->regex_source && backrefs == 0 && names == 0 &&
+           strstr(rule->regex_source, "(*") == NULL &&
+           strstr(rule->regex_source, "\\Q") == NULL;
+}
+
+/**
+ * Combine the regex rules of a list into one pattern
+ *
+ * @param index Index of the list
+ * @param rulelist The rules
+ */
+static void rule_index_add_regex(RULE_INDEX* index, RULELIST* rulelist)
+{
+    size_t len = 1;
+
+    for (RULELIST* node = rulelist; node; node = node->next)
+    {
+        if (node->rule->type == RT_REGEX && regex_is_combinable(node->rule))
+        {
+            len += strlen(node->rule->regex_source) + sizeof("|(?:)");
+        }
+    }
+
+    char *pattern = len > 1 ? malloc(len) : NULL;
+
+    if (pattern)
+    {
+        char *ptr = pattern;
+
+        for (RULELIST* node = rulelist; node; node = node->next)
+        {
+            if (node->rule->type == RT_REGEX && regex_is_combinable(node->rule))
+            {
+                ptr += sprintf(ptr, "%s(?:%s)", ptr == pattern ? "" : "|",
+                               node->rule->regex_source);
+            }
+        }
+
+        int err;
+        size_t erroff;
+
+        /** If the combination does not compile, the rules are matched one by one */
+        if ((index->regex = pcre2_compile((PCRE2_SPTR) pattern, PCRE2_ZERO_TERMINATED,
+                                          0, &err, &erroff, NULL)))
+        {
+            pcre2_jit_compile(index->regex, PCRE2_JIT_COMPLETE);
+
+            for (RULELIST* node = rulelist; node; node = node->next)
+            {
+                if (node->rule->type == RT_REGEX && regex_is_combinable(node->rule))
+                {
+                    node->indexed = true;
+                }
+            }
+        }
+
+        free(pattern);
+    }
+}
+
+/**
+ * Copy a column name in lower case
+ *
+ * @param dest Destination buffer
+ * @param src Column name
+ * @param size Size of @c dest
+ */
+static void column_to_lower(char* dest, const char* src, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size - 1 && src[i]; i++)
+    {
+        dest[i] = tolower(src[i]);
+    }
+
+    dest[i] = '\0';
+}
+
+/**
+ * Index the column rules of a list by column name
+ *
+ * @param index Index of the list
+ * @param rulelist The rules
+ * @return True if the column rules were indexed
+ */
+static bool rule_index_add_columns(RULE_INDEX* index, RULELIST* rulelist)
+{
+    if ((index->columns = hashtable_alloc(32, simple_str_hash, strcmp)) == NULL)
+    {
+        return false;
+    }
+
+    hashtable_memory_fns(index->columns, (HASHMEMORYFN) strdup, NULL,
+                         (HASHMEMORYFN) free, (HASHMEMORYFN) free);
+
+    for (RULELIST* node = rulelist; node; node = node->next)
+    {
+        if (node->rule->type == RT_COLUMN)
+        {
+            for (STRLINK* strln = (STRLINK*) node->rule->data; strln; strln = strln->next)
+            {
+                char name[strlen(strln->value) + 1];
+                column_to_lower(name, strln->value, sizeof(name));
+                uint64_t *mask = hashtable_fetch(index->columns, name);
+
+                if (mask == NULL)
+                {
+                    if ((mask = calloc(index->n_words, sizeof(uint64_t))) == NULL ||
+                        hashtable_add(index->columns, name, mask) == 0)
+                    {
+                        free(mask);
+                        return false;
+                    }
+                }
+
+                mask[node->position / 64] |= (uint64_t) 1 << (node->position % 64);
+            }
+        }
+    }
+
+    for (RULELIST* node = rulelist; node; node = node->next)
+    {
+        if (node->rule->type == RT_COLUMN)
+        {
+            node->indexed = true;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Create the index of a rule list
+ *
+ * The rules that are not indexed are matched one by one.
+ *
+ * @param rulelist The rules
+ * @return The index or NULL if the list is empty or memory allocation failed
+ */
+static RULE_INDEX* rule_index_create(RULELIST* rulelist)
+{
+    int n_rules = 0;
+
+    for (RULELIST* node = rulelist; node; node = node->next)
+    {
+        node->position = n_rules++;
+        node->indexed = false;
+    }
+
+    RULE_INDEX* index = n_rules > 0 ? calloc(1, sizeof(RULE_INDEX)) : NULL;
+
+    if (index)
+    {
+        index->n_words = (n_rules + 63) / 64;
+        rule_index_add_regex(index, rulelist);
+
+        if (!rule_index_add_columns(index, rulelist) && index->columns)
+        {
+            hashtable_free(index->columns);
+            index->columns = NULL;
+        }
+    }
+
+    return index;
+}
+
+/**
+ * Free a list of query speed states
+ * @param qs States to free
+ */
+static void queryspeed_free(QUERYSPEED* qs)
+{
+    while (qs)
+    {
+        QUERYSPEED* next = qs->next;
+        free(qs->shards);
+        free(qs);
+        qs = next;
+    }
+}
+
+/**
+ * Find the query speed state of a rule
+ *
+ * @param qs Query speed states of a user
+ * @param id Id of the rule
+ * @return The state or NULL if it was not found
+ */
+static QUERYSPEED* queryspeed_find(QUERYSPEED* qs, long id)
+{
+    while (qs && qs->id != id)
+    {
+        qs = qs->next;
+    }
+
+    return qs;
+}
+
 static void* huserfree(void* fval)
 {
     USER* value = (USER*) fval;
@@ -414,7 +712,10 @@ static void* huserfree(void* fval)
     rulelist_free(value->rules_and);
     rulelist_free(value->rules_or);
     rulelist_free(value->rules_strict_and);
-    free(value->qs_limit);
+    rule_index_free(value->index_or);
+    rule_index_free(value->index_and);
+    rule_index_free(value->index_strict_and);
+    queryspeed_free(value->qs_limit);
     free(value->name);
     free(value);
     return NULL;
@@ -886,6 +1187,7 @@ bool create_rule(void* scanner, const char* name)
         ruledef->active = NULL;
         ruledef->times_matched = 0;
         ruledef->data = NULL;
+        ruledef->regex_source = NULL;
         rstack->rule = ruledef;
     }
     else
@@ -932,6 +1234,7 @@ static void free_rules(RULE* rule)
                 break;
         }
 
+        free(rule->regex_source);
         free(rule->name);
         rule = tmp;
     }
@@ -1143,10 +1446,12 @@ bool define_limit_queries_rule(void* scanner, int max, int timeperiod, int holdo
 {
     struct parser_stack* rstack = dbfw_yyget_extra((yyscan_t) scanner);
     ss_dassert(rstack);
-    QUERYSPEED* qs = malloc(sizeof(QUERYSPEED));
+    static int next_id = 0;
+    QUERYSPEED* qs = calloc(1, sizeof(QUERYSPEED));
 
     if (qs)
     {
+        qs->id = atomic_add(&next_id, 1);
         qs->limit = max;
         qs->period = timeperiod;
         qs->cooldown = holdoff;
@@ -1172,22 +1477,14 @@ bool define_regex_rule(void* scanner, char* pattern)
     PCRE2_SPTR start = (PCRE2_SPTR) get_regex_string(&pattern);
     ss_dassert(start);
     pcre2_code *re;
-    int err;
-    size_t offset;
-    if ((re = pcre2_compile(start, PCRE2_ZERO_TERMINATED,
-                            0, &err, &offset, NULL)))
+
+    if ((re = mxs_pcre2_compile((const char*) start, 0)))
     {
         struct parser_stack* rstack = dbfw_yyget_extra((yyscan_t) scanner);
         ss_dassert(rstack);
         rstack->rule->type = RT_REGEX;
         rstack->rule->data = (void*) re;
-    }
-    else
-    {
-        PCRE2_UCHAR errbuf[STRERROR_BUFLEN];
-        pcre2_get_error_message(err, errbuf, sizeof(errbuf));
-        MXS_ERROR("dbfwfilter: Invalid regular expression '%s': %s",
-                  start, errbuf);
+        rstack->rule->regex_source = strdup((const char*) start);
     }
 
     return re != NULL;
@@ -1214,6 +1511,97 @@ static RULE* find_rule_by_name(RULE* rules, const char* name)
     return NULL;
 }
 
+/**
+ * Create the query speed states of the limit_queries rules of a rule list
+ *
+ * @param user The user
+ * @param rulelist Rules of the user
+ * @return True on success, false if memory allocation failed
+ */
+static bool create_user_limits(USER *user, RULELIST *rulelist)
+{
+    int n_threads = config_threadcount();
+
+    for (; rulelist; rulelist = rulelist->next)
+    {
+        QUERYSPEED *rule_qs = (QUERYSPEED*) rulelist->rule->data;
+
+        if (rulelist->rule->type == RT_THROTTLE &&
+            queryspeed_find(user->qs_limit, rule_qs->id) == NULL)
+        {
+            QUERYSPEED *qs = calloc(1, sizeof(QUERYSPEED));
+
+            if (qs == NULL ||
+                (qs->shards = calloc(n_threads + 1, sizeof(QUERYSPEED_SHARD))) == NULL)
+            {
+                MXS_ERROR("Memory allocation failed when creating the query limits "
+                          "of user '%s'.", user->name);
+                free(qs);
+                return false;
+            }
+
+            qs->period = rule_qs->period;
+            qs->cooldown = rule_qs->cooldown;
+            qs->limit = rule_qs->limit;
+            qs->id = rule_qs->id;
+            qs->n_shards = n_threads + 1;
+            /** Small batches keep the early triggering of the limit small */
+            qs->batch = rule_qs->limit / (16 * n_threads);
+            qs->batch = qs->batch > 0 ? qs->batch : 1;
+            spinlock_init(&qs->lock);
+            qs->next = user->qs_limit;
+            user->qs_limit = qs;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Create the rule indexes and the query speed states of all users
+ *
+ * A user without an index matches its rules one by one.
+ *
+ * @param instance Filter instance
+ * @return True on success, false if memory allocation failed
+ */
+static bool create_user_indexes(FW_INSTANCE *instance)
+{
+    HASHITERATOR *iter = hashtable_iterator(instance->htable);
+    bool rval = iter != NULL;
+
+    if (iter)
+    {
+        void *key;
+
+        while ((key = hashtable_next(iter)))
+        {
+            USER *user = hashtable_fetch(instance->htable, key);
+
+            if (user)
+            {
+                rule_index_free(user->index_or);
+                rule_index_free(user->index_and);
+                rule_index_free(user->index_strict_and);
+                user->index_or = rule_index_create(user->rules_or);
+                user->index_and = rule_index_create(user->rules_and);
+                user->index_strict_and = rule_index_create(user->rules_strict_and);
+
+                if (!create_user_limits(user, user->rules_or) ||
+                    !create_user_limits(user, user->rules_and) ||
+                    !create_user_limits(user, user->rules_strict_and))
+                {
+                    rval = false;
+                }
+            }
+        }
+
+        hashtable_iterator_free(iter);
+    }
+
+    return rval;
+}
+
 /**
  * @brief Process the user templates into actual user definitions
  *
@@ -1239,11 +1627,8 @@ static bool process_user_templates(FW_INSTANCE *instance, user_template_t *templ
 
         if (user == NULL)
         {
-            if ((user = malloc(sizeof(USER))) && (user->name = strdup(templates->name)))
+            if ((user = calloc(1, sizeof(USER))) && (user->name = strdup(templates->name)))
             {
-                user->rules_and = NULL;
-                user->rules_or = NULL;
-                user->rules_strict_and = NULL;
                 spinlock_init(&user->lock);
                 hashtable_add(instance->htable, user->name, user);
             }
@@ -1303,6 +1688,11 @@ static bool process_user_templates(FW_INSTANCE *instance, user_template_t *templ
         templates = templates->next;
     }
 
+    if (rval)
+    {
+        rval = create_user_indexes(instance);
+    }
+
     return rval;
 }
 
@@ -1391,7 +1781,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
     spinlock_init(&my_instance->lock);
 
-    if ((ht = hashtable_alloc(100, simple_str_hash, strcmp)) == NULL)
+    if ((ht = hashtable_alloc_read_mostly(100, simple_str_hash, strcmp)) == NULL)
     {
         MXS_ERROR("Unable to allocate hashtable.");
         free(my_instance);
@@ -1654,7 +2044,8 @@ bool rule_is_active(RULE* rule)
  * Log and create an error message when a query could not be fully parsed.
  * @param my_instance The FwFilter instance.
  * @param reason The reason the query was rejected.
- * @param query The query that could not be parsed.
+ * @param query The query that could not be parsed, not null terminated.
+ * @param query_len The length of the query.
  * @param matchesp Pointer to variable that will receive the value indicating
  *                 whether the query was parsed or not.
  *
@@ -1665,6 +2056,7 @@ bool rule_is_active(RULE* rule)
 static char* create_parse_error(FW_INSTANCE* my_instance,
                                 const char* reason,
                                 const char* query,
+                                int query_len,
                                 bool* matchesp)
 {
     char *msg = NULL;
@@ -1673,7 +2065,7 @@ static char* create_parse_error(FW_INSTANCE* my_instance,
     size_t len = sizeof(format) + strlen(reason); // sizeof includes the trailing NULL as well.
     char message[len];
     sprintf(message, format, reason);
-    MXS_WARNING("%s: %s", message, query);
+    MXS_WARNING("%s: %.*s", message, query_len, query);
 
     if ((my_instance->action == FW_ACTION_ALLOW) || (my_instance->action == FW_ACTION_BLOCK))
     {
@@ -1703,22 +2095,241 @@ static char* create_parse_error(FW_INSTANCE* my_instance,
  * @param query Pointer to the null-terminated query string
  * @return true if the query matches the rule
  */
+/**
+ * Count a query against a limit_queries rule
+ *
+ * The queries of a window are handed out to the threads in batches. A thread
+ * only updates the shared counter when its batch runs out, so the limit can
+ * trigger slightly before all of the queries of the window are done if other
+ * threads still have queries left in their batches.
+ *
+ * @param qs Query speed state of the user
+ * @param now Current time
+ * @param triggered Set to true if this query exceeded the limit
+ * @return True if the query is denied
+ */
+static bool queryspeed_deny(QUERYSPEED* qs, time_t now, bool* triggered)
+{
+    if (qs->active)
+    {
+        if (difftime(now, qs->triggered) < qs->cooldown)
+        {
+            return true;
+        }
+
+        spinlock_acquire(&qs->lock);
+
+        if (qs->active && difftime(now, qs->triggered) >= qs->cooldown)
+        {
+            qs->active = false;
+            qs->first_query = now;
+            qs->count = 0;
+            qs->window++;
+        }
+
+        spinlock_release(&qs->lock);
+        return false;
+    }
+
+    if (difftime(now, qs->first_query) > qs->period)
+    {
+        spinlock_acquire(&qs->lock);
+
+        if (!qs->active && difftime(now, qs->first_query) > qs->period)
+        {
+            qs->first_query = now;
+            qs->count = 0;
+            qs->window++;
+        }
+
+        spinlock_release(&qs->lock);
+    }
+
+    int thread = poll_current_thread();
+    QUERYSPEED_SHARD* shard = &qs->shards[thread >= 0 && thread < qs->n_shards - 1 ?
+                                          thread : qs->n_shards - 1];
+    int64_t window = qs->window;
+
+    if (shard->window != window)
+    {
+        shard->window = window;
+        shard->tokens = 0;
+    }
+
+    if (shard->tokens == 0)
+    {
+        int left = qs->limit - atomic_add(&qs->count, qs->batch);
+
+        if (left <= 0)
+        {
+            spinlock_acquire(&qs->lock);
+
+            if (!qs->active)
+            {
+                qs->active = true;
+                qs->triggered = now;
+                *triggered = true;
+            }
+
+            spinlock_release(&qs->lock);
+            return true;
+        }
+
+        shard->tokens = left < qs->batch ? left : qs->batch;
+    }
+
+    shard->tokens--;
+    return false;
+}
+
+/**
+ * Get the affected fields of the query
+ *
+ * @param state Match state of the query
+ * @param queue The query
+ * @return Space separated list of fields or NULL if they are not available
+ */
+static const char* match_state_fields(MATCH_STATE* state, GWBUF* queue)
+{
+    if (!state->have_fields)
+    {
+        state->fields = qc_get_affected_fields(queue);
+        state->have_fields = true;
+    }
+
+    return state->fields;
+}
+
+/**
+ * Check if the query matches the combined pattern of the indexed regex rules
+ *
+ * @param state Match state of the query
+ * @param index Index of the rule list
+ * @return False if none of the indexed regex rules can match
+ */
+static bool match_state_regex(MATCH_STATE* state, RULE_INDEX* index)
+{
+    if (!state->regex_done)
+    {
+        state->regex_matched = state->query &&
+                               mxs_pcre2_match(index->regex, state->query, state->query_len);
+        state->regex_done = true;
+    }
+
+    return state->regex_matched;
+}
+
+/**
+ * Check if a field of the query is named in an indexed column rule
+ *
+ * The fields are looked up in the index once and the result is a bitmask of
+ * the column rules that name at least one of them.
+ *
+ * @param state Match state of the query
+ * @param index Index of the rule list
+ * @param fields Affected fields of the query
+ * @param position Position of the column rule in the list
+ * @return False if the column rule cannot match
+ */
+static bool match_state_column(MATCH_STATE* state, RULE_INDEX* index,
+                               const char* fields, int position)
+{
+    if (!state->columns_done)
+    {
+        char *copy = strdup(fields);
+        state->columns = calloc(index->n_words, sizeof(uint64_t));
+        state->columns_done = true;
+
+        if (copy && state->columns)
+        {
+            char *saveptr;
+
+            for (char *tok = strtok_r(copy, " ,", &saveptr); tok; tok = strtok_r(NULL, " ,", &saveptr))
+            {
+                char name[strlen(tok) + 1];
+                column_to_lower(name, tok, sizeof(name));
+                uint64_t *mask = hashtable_fetch(index->columns, name);
+
+                for (int i = 0; mask && i < index->n_words; i++)
+                {
+                    state->columns[i] |= mask[i];
+                }
+            }
+        }
+        else
+        {
+            /** Without the bitmask, all the column rules are checked */
+            free(state->columns);
+            state->columns = NULL;
+        }
+
+        free(copy);
+    }
+
+    return state->columns == NULL ||
+           (state->columns[position / 64] >> (position % 64)) & 1;
+}
+
+/**
+ * Free the resources of a match state
+ * @param state Match state to free
+ */
+static void match_state_free(MATCH_STATE* state)
+{
+    free(state->fields);
+    free(state->columns);
+}
+
+/**
+ * Find the first field of a query that a column rule denies
+ *
+ * @param rule Column rule
+ * @param fields Affected fields of the query
+ * @param column Buffer where the column name is stored
+ * @param size Size of @c column
+ * @return True if one of the fields is denied by the rule
+ */
+static bool column_rule_match(RULE* rule, const char* fields, char* column, size_t size)
+{
+    char copy[strlen(fields) + 1];
+    char *saveptr;
+    strcpy(copy, fields);
+
+    for (char *tok = strtok_r(copy, " ,", &saveptr); tok; tok = strtok_r(NULL, " ,", &saveptr))
+    {
+        for (STRLINK* strln = (STRLINK*) rule->data; strln; strln = strln->next)
+        {
+            if (strcasecmp(tok, strln->value) == 0)
+            {
+                snprintf(column, size, "%s", strln->value);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
 bool rule_matches(FW_INSTANCE* my_instance,
                   FW_SESSION* my_session,
                   GWBUF *queue,
                   USER* user,
                   RULELIST *rulelist,
-                  char* query)
+                  RULE_INDEX* index,
+                  MATCH_STATE* state)
 {
-    char *ptr, *where, *msg = NULL;
+    const char* query = state->query;
+    int query_len = state->query_len;
+    char *msg = NULL;
+    const char *fields;
     char emsg[512];
 
     unsigned char* memptr = (unsigned char*) queue->start;
     bool is_sql, is_real, matches;
     qc_query_op_t optype = QUERY_OP_UNDEFINED;
-    STRLINK* strln = NULL;
     QUERYSPEED* queryspeed = NULL;
     QUERYSPEED* rule_qs = NULL;
+    bool triggered = false;
     time_t time_now;
     struct tm tm_now;
 
@@ -1730,11 +2341,11 @@ bool rule_matches(FW_INSTANCE* my_instance,
 
     if (is_sql)
     {
-        qc_parse_result_t parse_result = qc_parse(queue);
+        qc_parse_result_t parse_result = qc_parse(queue, QC_COLLECT_ALL);
 
         if (parse_result == QC_QUERY_INVALID)
         {
-            msg = create_parse_error(my_instance, "tokenized", query, &matches);
+            msg = create_parse_error(my_instance, "tokenized", query, query_len, &matches);
             goto queryresolved;
         }
         else
@@ -1756,7 +2367,7 @@ bool rule_matches(FW_INSTANCE* my_instance,
                     case QUERY_OP_DELETE:
                         // In these cases, we have to be able to trust what qc_get_affected_fields
                         // returns. Unless the query was parsed completely, we cannot do that.
-                        msg = create_parse_error(my_instance, "parsed completely", query, &matches);
+                        msg = create_parse_error(my_instance, "parsed completely", query, query_len, &matches);
                         goto queryresolved;
 
                     default:
@@ -1783,31 +2394,15 @@ bool rule_matches(FW_INSTANCE* my_instance,
                 break;
 
             case RT_REGEX:
-                if (query)
+                if (query && (!rulelist->indexed || match_state_regex(state, index)))
                 {
-                    pcre2_match_data *mdata = pcre2_match_data_create_from_pattern(
-                                                  rulelist->rule->data, NULL);
-
-                    if (mdata)
-                    {
-                        if (pcre2_match((pcre2_code*) rulelist->rule->data,
-                                        (PCRE2_SPTR) query, PCRE2_ZERO_TERMINATED,
-                                        0, 0, mdata, NULL) > 0)
-                        {
-                            matches = true;
-                        }
-                        pcre2_match_data_free(mdata);
-                        if (matches)
-                        {
-                            msg = strdup("Permission denied, query matched regular expression.");
-                            MXS_INFO("dbfwfilter: rule '%s': regex matched on query", rulelist->rule->name);
-                            goto queryresolved;
-                        }
-                    }
-                    else
+                    if (mxs_pcre2_match((pcre2_code*) rulelist->rule->data,
+                                        query, query_len))
                     {
-                        MXS_ERROR("Allocation of matching data for PCRE2 failed."
-                                  " This is most likely caused by a lack of memory");
+                        matches = true;
+                        msg = strdup("Permission denied, query matched regular expression.");
+                        MXS_INFO("dbfwfilter: rule '%s': regex matched on query", rulelist->rule->name);
+                        goto queryresolved;
                     }
                 }
                 break;
@@ -1824,146 +2419,66 @@ bool rule_matches(FW_INSTANCE* my_instance,
                 break;
 
             case RT_COLUMN:
-                if (is_sql && is_real)
+                if (is_sql && is_real && (fields = match_state_fields(state, queue)))
                 {
-                    where = qc_get_affected_fields(queue);
-                    if (where != NULL)
+                    char column[256];
+
+                    if ((!rulelist->indexed ||
+                         match_state_column(state, index, fields, rulelist->position)) &&
+                        column_rule_match(rulelist->rule, fields, column, sizeof(column)))
                     {
-                        char* saveptr;
-                        char* tok = strtok_r(where, " ", &saveptr);
-                        while (tok)
-                        {
-                            strln = (STRLINK*) rulelist->rule->data;
-                            while (strln)
-                            {
-                                if (strcasecmp(tok, strln->value) == 0)
-                                {
-                                    matches = true;
-
-                                    sprintf(emsg, "Permission denied to column '%s'.", strln->value);
-                                    MXS_INFO("dbfwfilter: rule '%s': query targets forbidden column: %s",
-                                             rulelist->rule->name, strln->value);
-                                    msg = strdup(emsg);
-                                    free(where);
-                                    goto queryresolved;
-                                }
-                                strln = strln->next;
-                            }
-                            tok = strtok_r(NULL, ",", &saveptr);
-                        }
-                        free(where);
+                        matches = true;
+
+                        sprintf(emsg, "Permission denied to column '%s'.", column);
+                        MXS_INFO("dbfwfilter: rule '%s': query targets forbidden column: %s",
+                                 rulelist->rule->name, column);
+                        msg = strdup(emsg);
+                        goto queryresolved;
                     }
                 }
                 break;
 
             case RT_WILDCARD:
-                if (is_sql && is_real)
+                if (is_sql && is_real && (fields = match_state_fields(state, queue)))
                 {
-                    char * strptr;
-                    where = qc_get_affected_fields(queue);
-
-                    if (where != NULL)
+                    if (strchr(fields, '*'))
                     {
-                        strptr = where;
-
-                        if (strchr(strptr, '*'))
-                        {
-                            matches = true;
-                            msg = strdup("Usage of wildcard denied.");
-                            MXS_INFO("dbfwfilter: rule '%s': query contains a wildcard.",
-                                     rulelist->rule->name);
-                            free(where);
-                            goto queryresolved;
-                        }
-                        free(where);
+                        matches = true;
+                        msg = strdup("Usage of wildcard denied.");
+                        MXS_INFO("dbfwfilter: rule '%s': query contains a wildcard.",
+                                 rulelist->rule->name);
+                        goto queryresolved;
                     }
                 }
                 break;
 
             case RT_THROTTLE:
-                /**
-                 * Check if this is the first time this rule is matched and if so, allocate
-                 * and initialize a new QUERYSPEED struct for this session.
-                 */
-                spinlock_acquire(&my_instance->lock);
                 rule_qs = (QUERYSPEED*) rulelist->rule->data;
-                spinlock_release(&my_instance->lock);
-
-                spinlock_acquire(&user->lock);
-                queryspeed = user->qs_limit;
-                spinlock_release(&user->lock);
+                queryspeed = queryspeed_find(user->qs_limit, rule_qs->id);
 
-                while (queryspeed)
+                if (queryspeed && queryspeed_deny(queryspeed, time_now, &triggered))
                 {
-                    if (queryspeed->id == rule_qs->id)
-                    {
-                        break;
-                    }
-                    queryspeed = queryspeed->next;
-                }
-
-                if (queryspeed == NULL)
-                {
-
-                    /**No match found*/
-                    queryspeed = (QUERYSPEED*) calloc(1, sizeof(QUERYSPEED));
-                    queryspeed->period = rule_qs->period;
-                    queryspeed->cooldown = rule_qs->cooldown;
-                    queryspeed->limit = rule_qs->limit;
-                    queryspeed->id = rule_qs->id;
-                    queryspeed->next = user->qs_limit;
-                    user->qs_limit = queryspeed;
-                }
-
-                if (queryspeed->active)
-                {
-                    if (difftime(time_now, queryspeed->triggered) < queryspeed->cooldown)
-                    {
+                    double blocked_for =
+                        queryspeed->cooldown - difftime(time_now, queryspeed->triggered);
 
-                        double blocked_for =
-                            queryspeed->cooldown - difftime(time_now, queryspeed->triggered);
-
-                        sprintf(emsg, "Queries denied for %f seconds", blocked_for);
-                        MXS_INFO("dbfwfilter: rule '%s': user denied for %f seconds",
-                                 rulelist->rule->name, blocked_for);
-                        msg = strdup(emsg);
-                        matches = true;
-                    }
-                    else
-                    {
-                        queryspeed->active = false;
-                        queryspeed->count = 0;
-                    }
-                }
-                else
-                {
-                    if (queryspeed->count >= queryspeed->limit)
+                    if (triggered)
                     {
-                        queryspeed->triggered = time_now;
-                        matches = true;
-                        queryspeed->active = true;
-
                         MXS_INFO("dbfwfilter: rule '%s': query limit triggered (%d queries in %d seconds), "
                                  "denying queries from user for %d seconds.",
                                  rulelist->rule->name,
                                  queryspeed->limit,
                                  queryspeed->period,
                                  queryspeed->cooldown);
-                        double blocked_for =
-                            queryspeed->cooldown - difftime(time_now, queryspeed->triggered);
-                        sprintf(emsg, "Queries denied for %f seconds", blocked_for);
-                        msg = strdup(emsg);
-                    }
-                    else if (queryspeed->count > 0 &&
-                             difftime(time_now, queryspeed->first_query) <= queryspeed->period)
-                    {
-                        queryspeed->count++;
                     }
                     else
                     {
-                        queryspeed->first_query = time_now;
-                        queryspeed->count = 1;
+                        MXS_INFO("dbfwfilter: rule '%s': user denied for %f seconds",
+                                 rulelist->rule->name, blocked_for);
                     }
+
+                    sprintf(emsg, "Queries denied for %f seconds", blocked_for);
+                    msg = strdup(emsg);
+                    matches = true;
                 }
                 break;
 
@@ -2021,7 +2536,9 @@ bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
         (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue) ||
          MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(queue))))
     {
-        char *fullquery = modutil_get_SQL(queue);
+        MATCH_STATE state = {.query = NULL};
+        modutil_get_SQL_view(queue, &state.query, &state.query_len);
+
         while (rulelist)
         {
             if (!rule_is_active(rulelist->rule))
@@ -2029,7 +2546,8 @@ bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
                 rulelist = rulelist->next;
                 continue;
             }
-            if (rule_matches(my_instance, my_session, queue, user, rulelist, fullquery))
+            if (rule_matches(my_instance, my_session, queue, user, rulelist,
+                             user->index_or, &state))
             {
                 *rulename = strdup(rulelist->rule->name);
                 rval = true;
@@ -2038,7 +2556,7 @@ bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
             rulelist = rulelist->next;
         }
 
-        free(fullquery);
+        match_state_free(&state);
     }
     return rval;
 }
@@ -2093,12 +2611,14 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
     bool rval = false;
     bool have_active_rule = false;
     RULELIST* rulelist = strict_all ? user->rules_strict_and : user->rules_and;
+    RULE_INDEX* index = strict_all ? user->index_strict_and : user->index_and;
     char *matched_rules = NULL;
     size_t size = 0;
 
     if (rulelist && (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue)))
     {
-        char *fullquery = modutil_get_SQL(queue);
+        MATCH_STATE state = {.query = NULL};
+        modutil_get_SQL_view(queue, &state.query, &state.query_len);
         rval = true;
         while (rulelist)
         {
@@ -2110,7 +2630,7 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
 
             have_active_rule = true;
 
-            if (rule_matches(my_instance, my_session, queue, user, rulelist, fullquery))
+            if (rule_matches(my_instance, my_session, queue, user, rulelist, index, &state))
             {
                 append_string(&matched_rules, &size, rulelist->rule->name);
             }
@@ -2131,7 +2651,8 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
             /** No active rules */
             rval = false;
         }
-        free(fullquery);
+
+        match_state_free(&state);
     }
 
     /** Set the list of matched rule names */
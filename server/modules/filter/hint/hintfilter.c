@@ -166,6 +166,8 @@ closeSession(FILTER *instance, void *session)
 
     while ((hint_stack = free_hint_stack(hint_stack)) != NULL)
         ;
+
+    free_hint_cache(my_session);
 }
 
 /**
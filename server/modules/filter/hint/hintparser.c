@@ -23,6 +23,10 @@
 /**
  * hintparser.c - Find any comment in the SQL packet and look for MAXSCALE
  * hints in that comment.
+ *
+ * Statements without any comment characters are skipped without parsing and
+ * the parsed comments are cached in the session so that a hint that is
+ * repeated in many statements is only parsed once.
  */
 
 /**
@@ -73,6 +77,8 @@ static void create_named_hint(HINT_SESSION *, char *, HINT *);
 static void hint_push(HINT_SESSION *, HINT *);
 static const char* token_get_keyword(HINT_TOKEN* token);
 static void token_free(HINT_TOKEN* token);
+static bool hint_cache_lookup(HINT_SESSION *session, char *comment, int len, HINT **hints);
+static void hint_cache_add(HINT_SESSION *session, char *comment, int len, HINT *hints);
 
 typedef enum
 {
@@ -124,6 +130,107 @@ static const char* token_get_keyword(
     }
 }
 
+/**
+ * Check whether a statement can contain a comment. All comments start with
+ * '#', "--" or a slash and a '*', so a statement without any '#', '-' or '*'
+ * characters has no comments and does not need to be parsed.
+ *
+ * @param request   The MySQL request buffer
+ * @param ptr       Start of the SQL in the first buffer
+ * @param len       Length of the SQL in the first buffer
+ * @return True if the statement can contain a comment
+ */
+static bool
+hint_may_have_comment(GWBUF *request, char *ptr, int len)
+{
+    GWBUF *buf = request;
+
+    while (buf)
+    {
+        if (memchr(ptr, '#', len) || memchr(ptr, '-', len) || memchr(ptr, '*', len))
+        {
+            return true;
+        }
+
+        if ((buf = buf->next))
+        {
+            ptr = GWBUF_DATA(buf);
+            len = GWBUF_LENGTH(buf);
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Find a parsed comment in the cache of the session
+ *
+ * @param session   The filter session
+ * @param comment   The comment
+ * @param len       Length of the comment
+ * @param hints     A copy of the cached hints is stored here
+ * @return True if the comment was found
+ */
+static bool
+hint_cache_lookup(HINT_SESSION *session, char *comment, int len, HINT **hints)
+{
+    for (int i = 0; i < HINT_CACHE_SIZE; i++)
+    {
+        HINT_CACHE_ENTRY *entry = &session->cache[i];
+
+        if (entry->comment && entry->len == len && memcmp(entry->comment, comment, len) == 0)
+        {
+            *hints = hint_dup(entry->hints);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Free a list of hints
+ *
+ * @param hint  The hints to free, can be NULL
+ */
+static void
+hint_list_free(HINT *hint)
+{
+    while (hint)
+    {
+        HINT *next = hint->next;
+        hint_free(hint);
+        hint = next;
+    }
+}
+
+/**
+ * Add a parsed comment to the cache of the session. The oldest entry is
+ * replaced when the cache is full.
+ *
+ * @param session   The filter session
+ * @param comment   The comment
+ * @param len       Length of the comment
+ * @param hints     The hints of the comment, a copy is stored
+ */
+static void
+hint_cache_add(HINT_SESSION *session, char *comment, int len, HINT *hints)
+{
+    HINT_CACHE_ENTRY *entry = &session->cache[session->cache_next];
+    char *copy = malloc(len);
+
+    if (copy)
+    {
+        memcpy(copy, comment, len);
+        free(entry->comment);
+        hint_list_free(entry->hints);
+        entry->comment = copy;
+        entry->len = len;
+        entry->hints = hint_dup(hints);
+        session->cache_next = (session->cache_next + 1) % HINT_CACHE_SIZE;
+    }
+}
+
 /**
  * Parse the hint comments in the MySQL statement passed in request.
  * Add any hints to the buffer for later processing.
@@ -141,12 +248,21 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
     int found, escape, quoted, squoted;
     HINT *rval = NULL;
     char *pname, *lvalue, *hintname = NULL;
+    char *comment = NULL;
+    int comment_len = 0;
+    bool cacheable = true;
     GWBUF *buf;
     HINT_TOKEN *tok;
     HINT_MODE mode = HM_EXECUTE;
 
     /* First look for any comment in the SQL */
     modutil_MySQL_Query(request, &ptr, &len, &residual);
+
+    if (!hint_may_have_comment(request, ptr, len))
+    {
+        goto retblock;
+    }
+
     buf = request;
     found = 0;
     escape = 0;
@@ -230,6 +346,30 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
         goto retblock;
     }
 
+    /*
+     * The hints of a comment that was parsed before are taken from the cache.
+     * Only comments in single buffer statements are cached.
+     */
+    if (buf == request && buf->next == NULL)
+    {
+        char *end = (char *)buf->end;
+
+        comment = *ptr == '#' ? ptr : ptr - 1;
+
+        if (*ptr == '*')
+        {
+            char *close = memmem(ptr + 1, end - (ptr + 1), "*/", 2);
+            end = close ? close + 2 : end;
+        }
+
+        comment_len = end - comment;
+
+        if (hint_cache_lookup(session, comment, comment_len, &rval))
+        {
+            goto retblock;
+        }
+    }
+
     /*
      * If we have got here then we have a comment, ptr point to
      * the comment character if it is a '#' comment or the second
@@ -261,6 +401,10 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
     /** This is not MaxScale hint because it doesn't start with 'maxscale' */
     if (tok->token != TOK_MAXSCALE)
     {
+        if (comment)
+        {
+            hint_cache_add(session, comment, comment_len, NULL);
+        }
         token_free(tok);
         goto retblock;
     }
@@ -286,6 +430,7 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
                     case TOK_STOP:
                         /* Action: pop active hint */
                         hint_pop(session);
+                        cacheable = false;
                         state = HS_INIT;
                         break;
                     case TOK_START:
@@ -483,6 +628,10 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
              * We have a one-off hint for the statement we are
              * currently forwarding.
              */
+            if (comment && cacheable)
+            {
+                hint_cache_add(session, comment, comment_len, rval);
+            }
             break;
     }
 
@@ -766,3 +915,19 @@ HINTSTACK* free_hint_stack(
         return NULL;
     }
 }
+
+/**
+ * Release the cached hint comments of a session.
+ *
+ * @param session The filter session
+ */
+void free_hint_cache(HINT_SESSION *session)
+{
+    for (int i = 0; i < HINT_CACHE_SIZE; i++)
+    {
+        free(session->cache[i].comment);
+        hint_list_free(session->cache[i].hints);
+        session->cache[i].comment = NULL;
+        session->cache[i].hints = NULL;
+    }
+}
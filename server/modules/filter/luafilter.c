@@ -34,6 +34,20 @@
  * is defined and valid, the matching entry point function in Lua will be called.
  * The same holds true for session script apart from no calls to createInstance
  * or diagnostic being made for the session script.
+ *
+ * The global script is loaded into a separate Lua state for each worker thread
+ * so that the threads do not wait on each other. The createInstance function
+ * is called once in each of these states and each call to the other entry points
+ * is made in the state of the calling thread. The global variables of the script
+ * are therefore not shared between the threads. Values that must be shared, for
+ * example counters, are stored with the following functions that are available
+ * to both the global and session scripts:
+ *  * (nil | number | string) shared_get(string key)
+ *  * nil shared_set(string key, nil | number | string value)
+ *  * number shared_add(string key, number increment)
+ *
+ * The shared values are stored by the filter instance and they are updated
+ * atomically. Setting a value to nil removes it.
  */
 
 #include <skygw_types.h>
@@ -44,6 +58,10 @@
 #include <filter.h>
 #include <session.h>
 #include <modutil.h>
+#include <atomic.h>
+#include <hashtable.h>
+#include <maxconfig.h>
+#include <maxscale/poll.h>
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
@@ -123,15 +141,37 @@ static int id_gen(lua_State* state)
     return 1;
 }
 
+/**
+ * The global script state of one thread. The lock is only contended by the
+ * threads that are not worker threads, as they share the last state.
+ */
+typedef struct
+{
+    SPINLOCK lock;
+    lua_State* state;
+} __attribute__((aligned(64))) LUA_THREAD_STATE;
+
+/**
+ * A value stored with shared_set or shared_add
+ */
+typedef struct
+{
+    bool is_number;
+    lua_Number number;
+    char* string;
+} LUA_SHARED_VALUE;
+
 /**
  * The Lua filter instance.
  */
 typedef struct
 {
-    lua_State* global_lua_state;
+    LUA_THREAD_STATE* global_states; /**< Global script state of each thread */
+    int n_global_states;
     char* global_script;
     char* session_script;
-    SPINLOCK lock;
+    HASHTABLE* shared; /**< Values shared by all states */
+    SPINLOCK shared_lock;
 } LUA_INSTANCE;
 
 /**
@@ -146,6 +186,239 @@ typedef struct
     UPSTREAM up;
 } LUA_SESSION;
 
+/**
+ * Free a shared value
+ * @param data The value
+ */
+static void shared_value_free(void* data)
+{
+    LUA_SHARED_VALUE* value = (LUA_SHARED_VALUE*) data;
+    free(value->string);
+    free(value);
+}
+
+/**
+ * Get the instance of a shared value function from its upvalue
+ * @param state Lua state
+ * @return The filter instance
+ */
+static LUA_INSTANCE* shared_instance(lua_State* state)
+{
+    return (LUA_INSTANCE*) lua_touserdata(state, lua_upvalueindex(1));
+}
+
+/**
+ * Push a shared value to the Lua state's stack. The argument is the key of the value.
+ * @param state Lua state
+ * @return Always 1
+ */
+static int shared_get(lua_State* state)
+{
+    LUA_INSTANCE* instance = shared_instance(state);
+    const char* key = luaL_checkstring(state, 1);
+
+    spinlock_acquire(&instance->shared_lock);
+    LUA_SHARED_VALUE* value = hashtable_fetch(instance->shared, (void*) key);
+
+    if (value == NULL)
+    {
+        lua_pushnil(state);
+    }
+    else if (value->is_number)
+    {
+        lua_pushnumber(state, value->number);
+    }
+    else
+    {
+        lua_pushstring(state, value->string);
+    }
+    spinlock_release(&instance->shared_lock);
+
+    return 1;
+}
+
+/**
+ * Store a shared value. The arguments are the key and the value which must be
+ * a number, a string or nil. A nil value removes the key.
+ * @param state Lua state
+ * @return Always 0
+ */
+static int shared_set(lua_State* state)
+{
+    LUA_INSTANCE* instance = shared_instance(state);
+    const char* key = luaL_checkstring(state, 1);
+    bool is_number = lua_type(state, 2) == LUA_TNUMBER;
+    char* string = NULL;
+
+    if (!lua_isnil(state, 2) && !is_number &&
+        (string = strdup(luaL_checkstring(state, 2))) == NULL)
+    {
+        return luaL_error(state, "Memory allocation failed");
+    }
+
+    spinlock_acquire(&instance->shared_lock);
+    LUA_SHARED_VALUE* value = hashtable_fetch(instance->shared, (void*) key);
+
+    if (lua_isnil(state, 2))
+    {
+        if (value)
+        {
+            hashtable_delete(instance->shared, (void*) key);
+        }
+    }
+    else if (value || ((value = calloc(1, sizeof(LUA_SHARED_VALUE))) &&
+                       hashtable_add(instance->shared, (void*) key, value)))
+    {
+        free(value->string);
+        value->is_number = is_number;
+        value->number = is_number ? lua_tonumber(state, 2) : 0;
+        value->string = string;
+        string = NULL;
+    }
+    else
+    {
+        free(value);
+    }
+    spinlock_release(&instance->shared_lock);
+
+    free(string);
+    return 0;
+}
+
+/**
+ * Add to a shared number and push the new value to the Lua state's stack. The
+ * arguments are the key and the increment. A missing value or a string is
+ * treated as zero.
+ * @param state Lua state
+ * @return Always 1
+ */
+static int shared_add(lua_State* state)
+{
+    LUA_INSTANCE* instance = shared_instance(state);
+    const char* key = luaL_checkstring(state, 1);
+    lua_Number increment = luaL_checknumber(state, 2);
+    lua_Number result = increment;
+
+    spinlock_acquire(&instance->shared_lock);
+    LUA_SHARED_VALUE* value = hashtable_fetch(instance->shared, (void*) key);
+
+    if (value || ((value = calloc(1, sizeof(LUA_SHARED_VALUE))) &&
+                  hashtable_add(instance->shared, (void*) key, value)))
+    {
+        result = (value->is_number ? value->number : 0) + increment;
+        free(value->string);
+        value->string = NULL;
+        value->is_number = true;
+        value->number = result;
+    }
+    else
+    {
+        free(value);
+    }
+    spinlock_release(&instance->shared_lock);
+
+    lua_pushnumber(state, result);
+    return 1;
+}
+
+/**
+ * Make the shared value functions available in a Lua state
+ * @param instance The filter instance
+ * @param state Lua state
+ */
+static void register_shared_functions(LUA_INSTANCE* instance, lua_State* state)
+{
+    lua_pushlightuserdata(state, instance);
+    lua_pushcclosure(state, shared_get, 1);
+    lua_setglobal(state, "shared_get");
+    lua_pushlightuserdata(state, instance);
+    lua_pushcclosure(state, shared_set, 1);
+    lua_setglobal(state, "shared_set");
+    lua_pushlightuserdata(state, instance);
+    lua_pushcclosure(state, shared_add, 1);
+    lua_setglobal(state, "shared_add");
+}
+
+/**
+ * Get the global script state of the calling thread
+ * @param instance The filter instance
+ * @return The state or NULL if there is no global script
+ */
+static LUA_THREAD_STATE* get_global_state(LUA_INSTANCE* instance)
+{
+    if (instance->global_states == NULL)
+    {
+        return NULL;
+    }
+
+    int thread = poll_current_thread();
+
+    if (thread < 0 || thread >= instance->n_global_states - 1)
+    {
+        thread = instance->n_global_states - 1;
+    }
+
+    return &instance->global_states[thread];
+}
+
+/**
+ * Free the filter instance and its global script states
+ * @param instance The filter instance
+ */
+static void free_instance(LUA_INSTANCE* instance)
+{
+    for (int i = 0; instance->global_states && i < instance->n_global_states; i++)
+    {
+        if (instance->global_states[i].state)
+        {
+            lua_close(instance->global_states[i].state);
+        }
+    }
+
+    hashtable_free(instance->shared);
+    free(instance->global_states);
+    free(instance->global_script);
+    free(instance->session_script);
+    free(instance);
+}
+
+/**
+ * Load the global script into a new Lua state and call its createInstance function
+ * @param instance The filter instance
+ * @return The new state or NULL if the script could not be executed
+ */
+static lua_State* create_global_state(LUA_INSTANCE* instance)
+{
+    lua_State* state = luaL_newstate();
+
+    if (state == NULL)
+    {
+        MXS_ERROR("Unable to initialize new Lua state.");
+        return NULL;
+    }
+
+    luaL_openlibs(state);
+    register_shared_functions(instance, state);
+
+    if (luaL_dofile(state, instance->global_script))
+    {
+        MXS_ERROR("luafilter: Failed to execute global script at '%s':%s.",
+                  instance->global_script, lua_tostring(state, -1));
+        lua_close(state);
+        return NULL;
+    }
+
+    lua_getglobal(state, "createInstance");
+    if (lua_pcall(state, 0, 0, 0))
+    {
+        MXS_WARNING("luafilter: Failed to get global variable 'createInstance':  %s."
+                    " The createInstance entry point will not be called for the global script.",
+                    lua_tostring(state, -1));
+    }
+
+    return state;
+}
+
 /**
  * The module initialisation routine, called when the module
  * is first loaded.
@@ -178,7 +451,16 @@ createInstance(char **options, FILTER_PARAMETER **params)
         return NULL;
     }
 
-    spinlock_init(&my_instance->lock);
+    spinlock_init(&my_instance->shared_lock);
+
+    if ((my_instance->shared = hashtable_alloc(64, simple_str_hash, strcmp)) == NULL)
+    {
+        free(my_instance);
+        return NULL;
+    }
+
+    hashtable_memory_fns(my_instance->shared, (HASHMEMORYFN) strdup, NULL,
+                         (HASHMEMORYFN) free, (HASHMEMORYFN) shared_value_free);
 
     for (int i = 0; params[i] && !error; i++)
     {
@@ -199,44 +481,32 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
     if (error)
     {
-        free(my_instance->global_script);
-        free(my_instance->session_script);
-        free(my_instance);
+        free_instance(my_instance);
         return NULL;
     }
 
     if (my_instance->global_script)
     {
-        if ((my_instance->global_lua_state = luaL_newstate()))
+        /** One state for each worker thread and one for all other threads */
+        my_instance->n_global_states = config_threadcount() + 1;
+
+        if ((my_instance->global_states = calloc(my_instance->n_global_states,
+                                                 sizeof(LUA_THREAD_STATE))) == NULL)
         {
-            luaL_openlibs(my_instance->global_lua_state);
+            free_instance(my_instance);
+            return NULL;
+        }
 
-            if (luaL_dofile(my_instance->global_lua_state, my_instance->global_script))
-            {
-                MXS_ERROR("luafilter: Failed to execute global script at '%s':%s.",
-                          my_instance->global_script, lua_tostring(my_instance->global_lua_state, -1));
-                free(my_instance->global_script);
-                free(my_instance->session_script);
-                free(my_instance);
-                my_instance = NULL;
-            }
-            else if (my_instance->global_lua_state)
+        for (int i = 0; i < my_instance->n_global_states; i++)
+        {
+            spinlock_init(&my_instance->global_states[i].lock);
+
+            if ((my_instance->global_states[i].state = create_global_state(my_instance)) == NULL)
             {
-                lua_getglobal(my_instance->global_lua_state, "createInstance");
-                if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
-                {
-                    MXS_WARNING("luafilter: Failed to get global variable 'createInstance':  %s."
-                                " The createInstance entry point will not be called for the global script.",
-                                lua_tostring(my_instance->global_lua_state, -1));
-                }
+                free_instance(my_instance);
+                return NULL;
             }
         }
-        else
-        {
-            MXS_ERROR("Unable to initialize new Lua state.");
-            free(my_instance);
-            my_instance = NULL;
-        }
     }
 
     return (FILTER *) my_instance;
@@ -262,6 +532,7 @@ static void * newSession(FILTER *instance, SESSION *session)
 {
     LUA_SESSION *my_session;
     LUA_INSTANCE *my_instance = (LUA_INSTANCE*) instance;
+    LUA_THREAD_STATE *global;
 
     if ((my_session = (LUA_SESSION*) calloc(1, sizeof(LUA_SESSION))) == NULL)
     {
@@ -275,6 +546,7 @@ static void * newSession(FILTER *instance, SESSION *session)
     {
         my_session->lua_state = luaL_newstate();
         luaL_openlibs(my_session->lua_state);
+        register_shared_functions(my_instance, my_session->lua_state);
 
         if (luaL_dofile(my_session->lua_state, my_instance->session_script))
         {
@@ -300,17 +572,17 @@ static void * newSession(FILTER *instance, SESSION *session)
         }
     }
 
-    if (my_session && my_instance->global_lua_state)
+    if (my_session && (global = get_global_state(my_instance)))
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "newSession");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        spinlock_acquire(&global->lock);
+        lua_getglobal(global->state, "newSession");
+        if (lua_pcall(global->state, 0, 0, 0))
         {
             MXS_WARNING("luafilter: Failed to get global variable 'newSession': '%s'."
                         " The newSession entry point will not be called for the global script.",
-                        lua_tostring(my_instance->global_lua_state, -1));
+                        lua_tostring(global->state, -1));
         }
-        spinlock_release(&my_instance->lock);
+        spinlock_release(&global->lock);
     }
 
     return my_session;
@@ -328,7 +600,7 @@ static void closeSession(FILTER *instance, void *session)
 {
     LUA_SESSION *my_session = (LUA_SESSION *) session;
     LUA_INSTANCE *my_instance = (LUA_INSTANCE*) instance;
-
+    LUA_THREAD_STATE *global;
 
     if (my_session->lua_state)
     {
@@ -343,17 +615,17 @@ static void closeSession(FILTER *instance, void *session)
         spinlock_release(&my_session->lock);
     }
 
-    if (my_instance->global_lua_state)
+    if ((global = get_global_state(my_instance)))
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "closeSession");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        spinlock_acquire(&global->lock);
+        lua_getglobal(global->state, "closeSession");
+        if (lua_pcall(global->state, 0, 0, 0))
         {
             MXS_WARNING("luafilter: Failed to get global variable 'closeSession': '%s'."
                         " The closeSession entry point will not be called for the global script.",
-                        lua_tostring(my_instance->global_lua_state, -1));
+                        lua_tostring(global->state, -1));
         }
-        spinlock_release(&my_instance->lock);
+        spinlock_release(&global->lock);
     }
 }
 
@@ -409,6 +681,7 @@ static int clientReply(FILTER *instance, void *session, GWBUF *queue)
 {
     LUA_SESSION *my_session = (LUA_SESSION *) session;
     LUA_INSTANCE *my_instance = (LUA_INSTANCE *) instance;
+    LUA_THREAD_STATE *global;
 
     if (my_session->lua_state)
     {
@@ -421,16 +694,16 @@ static int clientReply(FILTER *instance, void *session, GWBUF *queue)
         }
         spinlock_release(&my_session->lock);
     }
-    if (my_instance->global_lua_state)
+    if ((global = get_global_state(my_instance)))
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "clientReply");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        spinlock_acquire(&global->lock);
+        lua_getglobal(global->state, "clientReply");
+        if (lua_pcall(global->state, 0, 0, 0))
         {
             MXS_ERROR("luafilter: Global scope call to 'clientReply' failed: '%s'.",
-                      lua_tostring(my_session->lua_state, -1));
+                      lua_tostring(global->state, -1));
         }
-        spinlock_release(&my_instance->lock);
+        spinlock_release(&global->lock);
     }
 
     return my_session->up.clientReply(my_session->up.instance,
@@ -463,6 +736,7 @@ static int routeQuery(FILTER *instance, void *session, GWBUF *queue)
     char *fullquery = NULL, *ptr;
     bool route = true;
     GWBUF* forward = queue;
+    LUA_THREAD_STATE *global;
     int rc = 0;
 
     if (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue))
@@ -497,33 +771,33 @@ static int routeQuery(FILTER *instance, void *session, GWBUF *queue)
             spinlock_release(&my_session->lock);
         }
 
-        if (my_instance->global_lua_state)
+        if ((global = get_global_state(my_instance)))
         {
-            spinlock_acquire(&my_instance->lock);
-            lua_getglobal(my_instance->global_lua_state, "routeQuery");
-            lua_pushlstring(my_instance->global_lua_state, fullquery, strlen(fullquery));
-            if (lua_pcall(my_instance->global_lua_state, 1, 0, 0))
+            spinlock_acquire(&global->lock);
+            lua_getglobal(global->state, "routeQuery");
+            lua_pushlstring(global->state, fullquery, strlen(fullquery));
+            if (lua_pcall(global->state, 1, 0, 0))
             {
                 MXS_ERROR("luafilter: Global scope call to 'routeQuery' failed: '%s'.",
-                          lua_tostring(my_session->lua_state, -1));
+                          lua_tostring(global->state, -1));
             }
-            else if (lua_gettop(my_instance->global_lua_state))
+            else if (lua_gettop(global->state))
             {
-                if (lua_isstring(my_instance->global_lua_state, -1))
+                if (lua_isstring(global->state, -1))
                 {
                     if (forward)
                     {
                         gwbuf_free(forward);
                     }
                     forward = modutil_create_query((char*)
-                                                   lua_tostring(my_instance->global_lua_state, -1));
+                                                   lua_tostring(global->state, -1));
                 }
-                else if (lua_isboolean(my_instance->global_lua_state, -1))
+                else if (lua_isboolean(global->state, -1))
                 {
-                    route = lua_toboolean(my_instance->global_lua_state, -1);
+                    route = lua_toboolean(global->state, -1);
                 }
             }
-            spinlock_release(&my_instance->lock);
+            spinlock_release(&global->lock);
         }
 
         free(fullquery);
@@ -556,32 +830,34 @@ static int routeQuery(FILTER *instance, void *session, GWBUF *queue)
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb)
 {
     LUA_INSTANCE *my_instance = (LUA_INSTANCE *) instance;
+    LUA_THREAD_STATE *global;
 
     if (my_instance)
     {
-        if (my_instance->global_lua_state)
+        if ((global = get_global_state(my_instance)))
         {
-            spinlock_acquire(&my_instance->lock);
-            lua_getglobal(my_instance->global_lua_state, "diagnostic");
-            if (lua_pcall(my_instance->global_lua_state, 0, 1, 0) == 0)
+            spinlock_acquire(&global->lock);
+            lua_getglobal(global->state, "diagnostic");
+            if (lua_pcall(global->state, 0, 1, 0) == 0)
             {
-                lua_gettop(my_instance->global_lua_state);
-                if (lua_isstring(my_instance->global_lua_state, -1))
+                lua_gettop(global->state);
+                if (lua_isstring(global->state, -1))
                 {
-                    dcb_printf(dcb, lua_tostring(my_instance->global_lua_state, -1));
+                    dcb_printf(dcb, lua_tostring(global->state, -1));
                     dcb_printf(dcb, "\n");
                 }
             }
             else
             {
                 dcb_printf(dcb, "Global scope call to 'diagnostic' failed: '%s'.\n",
-                           lua_tostring(my_instance->global_lua_state, -1));
+                           lua_tostring(global->state, -1));
             }
-            spinlock_release(&my_instance->lock);
+            spinlock_release(&global->lock);
         }
         if (my_instance->global_script)
         {
-            dcb_printf(dcb, "Global script: %s\n", my_instance->global_script);
+            dcb_printf(dcb, "Global script: %s (%d thread states)\n",
+                       my_instance->global_script, my_instance->n_global_states);
         }
         if (my_instance->session_script)
         {
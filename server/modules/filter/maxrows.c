@@ -0,0 +1,637 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file maxrows.c - Limit the size of the result sets
+ * @verbatim
+ *
+ * The maxrows filter collects the result set of a statement until it is
+ * complete and then sends it to the client. If the result set grows larger
+ * than the configured limits, the collected packets are replaced with an
+ * error or with the result set truncated to the limits, the rest of the
+ * result set is discarded as it arrives and the statement is killed in the
+ * server, so that neither MaxScale nor the server spends more on it.
+ *
+ * The rows are counted and the end of the response is found by the reply
+ * tracker of the backend protocol, the filter does not parse the response.
+ *
+ * The filter parameters are:
+ *   max_resultset_rows   The maximum number of rows, default 0 for no limit
+ *   max_resultset_size   The maximum size of a result set in bytes, default 1MB
+ *   max_resultset_return What is returned instead: error, empty or truncate,
+ *                        default error
+ *   kill_query           Whether the statement is killed, default true
+ *
+ * Date         Who                     Description
+ * 14/10/16     MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <atomic.h>
+#include <mysql_utils.h>
+#include <maxconfig.h>
+#include <mysql_client_server_protocol.h>
+
+MODULE_INFO info =
+{
+    MODULE_API_FILTER,
+    MODULE_IN_DEVELOPMENT,
+    FILTER_VERSION,
+    "A filter that limits the size of the result sets"
+};
+
+static char *version_str = "V1.0.0";
+
+#define MAXROWS_DEFAULT_MAX_SIZE (1024 * 1024)
+
+/*
+ * The filter entry points
+ */
+static FILTER *createInstance(char **options, FILTER_PARAMETER **);
+static void *newSession(FILTER *instance, SESSION *session);
+static void closeSession(FILTER *instance, void *session);
+static void freeSession(FILTER *instance, void *session);
+static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+
+
+static FILTER_OBJECT MyObject =
+{
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+};
+
+/**
+ * What is returned instead of a result set that is too large
+ */
+typedef enum
+{
+    MAXROWS_RETURN_ERROR,    /*< An error */
+    MAXROWS_RETURN_EMPTY,    /*< The column definitions without rows */
+    MAXROWS_RETURN_TRUNCATE  /*< The rows that fit in the limits */
+} maxrows_return_t;
+
+/**
+ * The instance structure
+ */
+typedef struct
+{
+    uint64_t         max_rows;   /*< The maximum number of rows, 0 for no limit */
+    uint64_t         max_size;   /*< The maximum size in bytes, 0 for no limit */
+    maxrows_return_t mode;       /*< What is returned instead */
+    bool             kill_query; /*< Kill the statement in the server */
+    int              n_limited;  /*< Result sets that exceeded the limits */
+    int              n_killed;   /*< Statements killed in the servers */
+} MAXROWS_INSTANCE;
+
+/**
+ * The session structure
+ */
+typedef struct
+{
+    DOWNSTREAM      down;
+    UPSTREAM        up;
+    SESSION        *session;
+    bool            active;       /*< A response is being collected or discarded */
+    bool            discard;      /*< The limits were exceeded, the rest is discarded */
+    bool            row_limit;    /*< The row limit was exceeded, not the size limit */
+    GWBUF          *result;       /*< The collected packets */
+} MAXROWS_SESSION;
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+    return &MyObject;
+}
+
+/**
+ * Parse a non-negative integer parameter
+ *
+ * @param param The parameter
+ * @param value Where the value is stored
+ * @return True, if the value was valid
+ */
+static bool
+maxrows_get_size_param(FILTER_PARAMETER *param, uint64_t *value)
+{
+    char *end;
+    long long v = strtoll(param->value, &end, 10);
+
+    if (*end != '\0' || v < 0)
+    {
+        MXS_ERROR("maxrows: The value of '%s' must be a non-negative integer, not '%s'.",
+                  param->name, param->value);
+        return false;
+    }
+
+    *value = v;
+    return true;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options   The options for this filter
+ * @param params    The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static FILTER *
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+    MAXROWS_INSTANCE *my_instance;
+
+    if ((my_instance = calloc(1, sizeof(MAXROWS_INSTANCE))) != NULL)
+    {
+        my_instance->max_size = MAXROWS_DEFAULT_MAX_SIZE;
+        my_instance->mode = MAXROWS_RETURN_ERROR;
+        my_instance->kill_query = true;
+        bool error = false;
+
+        for (int i = 0; params && params[i]; i++)
+        {
+            if (!strcmp(params[i]->name, "max_resultset_rows"))
+            {
+                error |= !maxrows_get_size_param(params[i], &my_instance->max_rows);
+            }
+            else if (!strcmp(params[i]->name, "max_resultset_size"))
+            {
+                error |= !maxrows_get_size_param(params[i], &my_instance->max_size);
+            }
+            else if (!strcmp(params[i]->name, "max_resultset_return"))
+            {
+                if (!strcmp(params[i]->value, "error"))
+                {
+                    my_instance->mode = MAXROWS_RETURN_ERROR;
+                }
+                else if (!strcmp(params[i]->value, "empty"))
+                {
+                    my_instance->mode = MAXROWS_RETURN_EMPTY;
+                }
+                else if (!strcmp(params[i]->value, "truncate"))
+                {
+                    my_instance->mode = MAXROWS_RETURN_TRUNCATE;
+                }
+                else
+                {
+                    MXS_ERROR("maxrows: The value of 'max_resultset_return' must be "
+                              "'error', 'empty' or 'truncate', not '%s'.", params[i]->value);
+                    error = true;
+                }
+            }
+            else if (!strcmp(params[i]->name, "kill_query"))
+            {
+                my_instance->kill_query = config_truth_value(params[i]->value);
+            }
+            else if (!filter_standard_parameter(params[i]->name))
+            {
+                MXS_ERROR("maxrows: Unexpected parameter '%s'.", params[i]->name);
+                error = true;
+            }
+        }
+
+        for (int i = 0; options && options[i]; i++)
+        {
+            MXS_ERROR("maxrows: Unsupported option '%s'.", options[i]);
+            error = true;
+        }
+
+        if (!error && my_instance->max_rows == 0 && my_instance->max_size == 0)
+        {
+            MXS_ERROR("maxrows: Either 'max_resultset_rows' or 'max_resultset_size' "
+                      "must be set.");
+            error = true;
+        }
+
+        if (error)
+        {
+            free(my_instance);
+            my_instance = NULL;
+        }
+    }
+
+    return (FILTER *) my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session itself
+ * @return Session specific data for this session
+ */
+static void *
+newSession(FILTER *instance, SESSION *session)
+{
+    MAXROWS_SESSION *my_session;
+
+    if ((my_session = calloc(1, sizeof(MAXROWS_SESSION))) != NULL)
+    {
+        my_session->session = session;
+    }
+
+    return my_session;
+}
+
+/**
+ * Forget the response that is being collected, if any.
+ *
+ * @param my_session The session
+ */
+static void
+maxrows_reset(MAXROWS_SESSION *my_session)
+{
+    gwbuf_free(my_session->result);
+    my_session->result = NULL;
+    my_session->active = false;
+    my_session->discard = false;
+}
+
+/**
+ * Close a session with the filter
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+closeSession(FILTER *instance, void *session)
+{
+    MAXROWS_SESSION *my_session = (MAXROWS_SESSION *) session;
+
+    maxrows_reset(my_session);
+}
+
+/**
+ * Free the memory associated with the session
+ *
+ * @param instance  The filter instance
+ * @param session   The filter session
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+    free(session);
+}
+
+/**
+ * Set the downstream filter or router to which queries will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param downstream    The downstream filter or router.
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+    MAXROWS_SESSION *my_session = (MAXROWS_SESSION *) session;
+
+    my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param upstream  The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+    MAXROWS_SESSION *my_session = (MAXROWS_SESSION *) session;
+
+    my_session->up = *upstream;
+}
+
+/**
+ * The routeQuery entry point. The response to a query or to the execution of
+ * a prepared statement is collected.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param queue     The query data
+ */
+static int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    MAXROWS_SESSION *my_session = (MAXROWS_SESSION *) session;
+    uint8_t cmd;
+
+    if (my_session->active)
+    {
+        // A response is still being discarded, e.g. the client pipelines.
+        maxrows_reset(my_session);
+    }
+
+    if (gwbuf_copy_data(queue, MYSQL_HEADER_LEN, 1, &cmd) == 1 &&
+        (cmd == MYSQL_COM_QUERY || cmd == MYSQL_COM_STMT_EXECUTE))
+    {
+        my_session->active = true;
+        my_session->row_limit = false;
+    }
+
+    return my_session->down.routeQuery(my_session->down.instance,
+                                       my_session->down.session, queue);
+}
+
+/**
+ * Start killing the statement whose response is being read from a backend.
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The session
+ */
+static void
+maxrows_kill(MAXROWS_INSTANCE *my_instance, MAXROWS_SESSION *my_session)
+{
+    DCB *dcb = my_session->session->reply_dcb;
+    MySQLProtocol *proto = dcb ? (MySQLProtocol *) dcb->protocol : NULL;
+
+    if (proto && proto->tid && dcb->server &&
+        mxs_mysql_kill_query(my_session->session->service, dcb->server, proto->tid))
+    {
+        atomic_add(&my_instance->n_killed, 1);
+    }
+}
+
+/**
+ * Find the part of the collected response that fits in the limits and can be
+ * returned: the column definitions and the whole rows of the first result
+ * set. A row of GW_MYSQL_MAX_PACKET_LEN bytes or more is continued in the
+ * following packets.
+ *
+ * @param my_instance The filter instance
+ * @param data        The collected response
+ * @param len         Length of the response
+ * @param seq         The sequence number of the last kept packet
+ * @param status      The server status of the end of the column definitions
+ * @return Length of the part, 0 if nothing can be returned
+ */
+static uint64_t
+maxrows_fit(MAXROWS_INSTANCE *my_instance, uint8_t *data, uint64_t len,
+            uint8_t *seq, uint16_t *status)
+{
+    uint64_t offset = 0;
+    uint64_t keep = 0;
+    uint64_t n_rows = 0;
+    bool continued = false;
+    bool in_rows = false;
+
+    while (offset + MYSQL_HEADER_LEN < len)
+    {
+        uint8_t *pkt = data + offset;
+        uint32_t plen = gw_mysql_get_byte3(pkt);
+        uint64_t end = offset + MYSQL_HEADER_LEN + plen;
+        uint8_t first = plen > 0 ? pkt[MYSQL_HEADER_LEN] : 0;
+        bool is_eof = !continued && plen < 9 && first == 0xfe;
+
+        if (end > len || (my_instance->max_size && end > my_instance->max_size) ||
+            (offset == 0 && (first == 0x00 || first == 0xff)))
+        {
+            break;
+        }
+
+        if (is_eof)
+        {
+            if (in_rows)
+            {
+                // The whole result set fits, a later result exceeded the limits.
+                return 0;
+            }
+
+            in_rows = true;
+            *status = plen >= 5 ? gw_mysql_get_byte2(pkt + MYSQL_HEADER_LEN + 3) : 0;
+
+            if (my_instance->mode == MAXROWS_RETURN_EMPTY)
+            {
+                *seq = pkt[3];
+                return end;
+            }
+        }
+        else if (in_rows && !continued &&
+                 (first == 0xff || (my_instance->max_rows && ++n_rows > my_instance->max_rows)))
+        {
+            break;
+        }
+
+        continued = plen == GW_MYSQL_MAX_PACKET_LEN;
+
+        if (!continued && in_rows)
+        {
+            keep = end;
+            *seq = pkt[3];
+        }
+
+        offset = end;
+    }
+
+    return keep;
+}
+
+/**
+ * Create what is returned instead of a result set that exceeded the limits.
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The session
+ * @return The packets to send to the client
+ */
+static GWBUF *
+maxrows_replacement(MAXROWS_INSTANCE *my_instance, MAXROWS_SESSION *my_session)
+{
+    GWBUF *result = my_session->result;
+    uint64_t len = 0;
+    uint8_t seq = 0;
+    uint16_t status = 0;
+
+    my_session->result = NULL;
+
+    if (my_instance->mode != MAXROWS_RETURN_ERROR && result &&
+        (result = gwbuf_make_contiguous(result)) != NULL &&
+        (len = maxrows_fit(my_instance, GWBUF_DATA(result), gwbuf_length(result),
+                           &seq, &status)) > 0)
+    {
+        result = gwbuf_rtrim(result, gwbuf_length(result) - len);
+
+        GWBUF *eof = gwbuf_alloc(MYSQL_HEADER_LEN + 5);
+
+        if (result && eof)
+        {
+            uint8_t *ptr = GWBUF_DATA(eof);
+            gw_mysql_set_byte3(ptr, 5);
+            ptr[3] = seq + 1;
+            ptr[4] = 0xfe;
+            gw_mysql_set_byte2(ptr + 5, 0);
+            gw_mysql_set_byte2(ptr + 7, status & ~SERVER_MORE_RESULTS_EXIST);
+            return gwbuf_append(result, eof);
+        }
+
+        gwbuf_free(eof);
+    }
+
+    gwbuf_free(result);
+
+    char msg[200];
+    snprintf(msg, sizeof(msg), "The result set exceeded the limit of %s.",
+             my_session->row_limit ? "rows" : "bytes");
+
+    return modutil_create_mysql_err_msg(1, 0, 1317, "70100", msg);
+}
+
+/**
+ * The clientReply entry point. The packets of a result set are collected
+ * while it is within the limits.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param reply     The response data
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+    MAXROWS_INSTANCE *my_instance = (MAXROWS_INSTANCE *) instance;
+    MAXROWS_SESSION *my_session = (MAXROWS_SESSION *) session;
+
+    if (!my_session->active)
+    {
+        return my_session->up.clientReply(my_session->up.instance,
+                                          my_session->up.session, reply);
+    }
+
+    DCB *dcb = my_session->session->reply_dcb;
+    MySQLProtocol *proto = dcb ? (MySQLProtocol *) dcb->protocol : NULL;
+    bool done = GWBUF_IS_TYPE_RESPONSE_END(reply->tail);
+    uint8_t first = 0;
+    GWBUF *send = NULL;
+
+    if (proto == NULL || (my_session->result == NULL && !my_session->discard &&
+                          gwbuf_copy_data(reply, MYSQL_HEADER_LEN, 1, &first) == 1 &&
+                          first == 0xfb))
+    {
+        // Not a reply of a backend, or a LOCAL INFILE request that the client answers.
+        send = gwbuf_append(my_session->result, reply);
+        my_session->result = NULL;
+        maxrows_reset(my_session);
+    }
+    else if (my_session->discard)
+    {
+        gwbuf_free(reply);
+    }
+    else
+    {
+        my_session->result = gwbuf_append(my_session->result, reply);
+
+        uint64_t n_rows = proto->reply.n_reply_rows;
+        my_session->row_limit = my_instance->max_rows && n_rows > my_instance->max_rows;
+
+        if (my_session->row_limit ||
+            (my_instance->max_size && gwbuf_length(my_session->result) > my_instance->max_size))
+        {
+            send = maxrows_replacement(my_instance, my_session);
+            my_session->discard = true;
+            atomic_add(&my_instance->n_limited, 1);
+
+            if (!done && my_instance->kill_query)
+            {
+                maxrows_kill(my_instance, my_session);
+            }
+        }
+        else if (done)
+        {
+            send = my_session->result;
+            my_session->result = NULL;
+        }
+    }
+
+    if (done)
+    {
+        maxrows_reset(my_session);
+    }
+
+    return send ? my_session->up.clientReply(my_session->up.instance,
+                                             my_session->up.session, send) : 1;
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param   instance    The filter instance
+ * @param   fsession    Filter session, may be NULL
+ * @param   dcb         The DCB for diagnostic output
+ */
+static void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+    MAXROWS_INSTANCE *my_instance = (MAXROWS_INSTANCE *) instance;
+    static const char *modes[] = {"error", "empty", "truncate"};
+
+    dcb_printf(dcb, "\t\tMaximum rows                   %lu\n",
+               (unsigned long) my_instance->max_rows);
+    dcb_printf(dcb, "\t\tMaximum size                   %lu bytes\n",
+               (unsigned long) my_instance->max_size);
+    dcb_printf(dcb, "\t\tReturned instead               %s\n", modes[my_instance->mode]);
+    dcb_printf(dcb, "\t\tLimited result sets            %d\n", my_instance->n_limited);
+    dcb_printf(dcb, "\t\tKilled statements              %d\n", my_instance->n_killed);
+}
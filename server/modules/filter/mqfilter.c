@@ -46,6 +46,10 @@
  *      ssl_CA_cert     Path to the CA certificate in PEM format
  *      ssl_client_cert Path to the client cerificate in PEM format
  *      ssl_client_key  Path to the client public key in PEM format
+ *      buffer_size     Maximum number of messages waiting to be published
+ *      batch_size      Maximum number of messages published at a time
+ *      channels        Number of channels the messages are published on
+ *      publisher_confirms Wait for the server to confirm the published messages
  *
  * The logging trigger levels are:
  *      all     Log everything
@@ -55,6 +59,10 @@
  *      object  Trigger on a particular database object (table or view)
  *@endverbatim
  * See the individual struct documentations for logging trigger parameters
+ *
+ * The messages are published by a thread of their own. The routing threads
+ * only place the messages into a bounded buffer and messages that do not fit
+ * into the buffer are dropped and counted.
  */
 #include <my_config.h>
 #include <stdio.h>
@@ -75,7 +83,7 @@
 #include <query_classifier.h>
 #include <spinlock.h>
 #include <session.h>
-#include <housekeeper.h>
+#include <thread.h>
 
 MODULE_INFO info =
 {
@@ -87,7 +95,21 @@ MODULE_INFO info =
 
 static char *version_str = "V1.0.2";
 static int uid_gen;
-static int hktask_id = 0;
+
+/** Default maximum number of messages waiting to be published */
+#define MQ_DEFAULT_BUFFER_SIZE 10000
+
+/** Default maximum number of messages published at a time */
+#define MQ_DEFAULT_BATCH_SIZE 100
+
+/** Maximum number of publishing channels */
+#define MQ_MAX_CHANNELS 16
+
+/** Milliseconds the publisher sleeps when there is nothing to publish */
+#define MQ_PUBLISH_INTERVAL 50
+
+/** Seconds to wait for the confirmations of the published messages */
+#define MQ_CONFIRM_TIMEOUT 5
 /*
  * The filter entry points
  */
@@ -122,7 +144,10 @@ typedef struct mqmessage_t
 {
     amqp_basic_properties_t *prop;
     char *msg;
-    struct mqmessage_t *next;
+    char *uid; /**Copy of the correlation ID, the session can close before publishing*/
+    amqp_channel_t channel; /**The channel the message was published on*/
+    uint64_t tag; /**Delivery tag on the channel, 0 if not published*/
+    bool confirmed; /**The server has received the message*/
 } mqmessage;
 
 /**
@@ -192,6 +217,8 @@ typedef struct mqstats_t
     int n_msg; /*< Total number of messages */
     int n_sent; /*< Number of sent messages */
     int n_queued; /*< Number of unsent messages */
+    int n_dropped; /*< Number of messages dropped because the buffer was full */
+    int n_nacked; /*< Number of messages the server failed to receive and were resent */
 } MQSTATS;
 
 /**
@@ -228,8 +255,15 @@ typedef struct
     int rconn_intv; /**delay for reconnects, in seconds*/
     time_t last_rconn; /**last reconnect attempt*/
     SPINLOCK rconn_lock;
-    SPINLOCK msg_lock;
-    mqmessage* messages;
+    SPINLOCK msg_lock; /**Protects the message buffer*/
+    mqmessage* messages; /**Ring buffer of messages waiting to be published*/
+    int buffer_size; /**Size of the message buffer*/
+    uint64_t head; /**Number of messages added to the buffer*/
+    uint64_t tail; /**Number of messages taken from the buffer*/
+    int batch_size; /**Maximum number of messages published at a time*/
+    int n_channels; /**Number of publishing channels*/
+    bool confirms; /**Use publisher confirms*/
+    uint64_t next_tag[MQ_MAX_CHANNELS]; /**Last delivery tag of each channel*/
     enum log_trigger_t trgtype;
     SRC_TRIG* src_trg;
     SHM_TRIG* shm_trg;
@@ -256,7 +290,7 @@ typedef struct
     bool was_query; /**True if the previous routeQuery call had valid content*/
 } MQ_SESSION;
 
-void sendMessage(void* data);
+static void mq_publisher(void* data);
 
 /**
  * Implementation of the mandatory version entry point
@@ -453,6 +487,48 @@ cleanup:
 
 }
 
+/**
+ * Open the additional publishing channels and enable the publisher confirms
+ * on all of them. The channels follow the channel opened by init_conn.
+ * @param my_instance The filter instance
+ * @return 1 on success, 0 on error
+ */
+static int
+init_channels(MQ_INSTANCE *my_instance)
+{
+    amqp_rpc_reply_t reply;
+
+    for (int i = 0; i < my_instance->n_channels; i++)
+    {
+        amqp_channel_t channel = my_instance->channel + i;
+        my_instance->next_tag[i] = 0;
+
+        if (i > 0)
+        {
+            amqp_channel_open(my_instance->conn, channel);
+            reply = amqp_get_rpc_reply(my_instance->conn);
+            if (reply.reply_type != AMQP_RESPONSE_NORMAL)
+            {
+                MXS_ERROR("Channel creation failed.");
+                return 0;
+            }
+        }
+
+        if (my_instance->confirms)
+        {
+            amqp_confirm_select(my_instance->conn, channel);
+            reply = amqp_get_rpc_reply(my_instance->conn);
+            if (reply.reply_type != AMQP_RESPONSE_NORMAL)
+            {
+                MXS_ERROR("Failed to enable publisher confirms on channel %d.", channel);
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
 /**
  * Parse the provided string into an array of strings.
  * The caller is responsible for freeing all the allocated memory.
@@ -508,7 +584,6 @@ createInstance(char **options, FILTER_PARAMETER **params)
     int paramcount = 0, parammax = 64, i = 0, x = 0, arrsize = 0;
     FILTER_PARAMETER** paramlist;
     char** arr = NULL;
-    char taskname[512];
 
     if ((my_instance = calloc(1, sizeof(MQ_INSTANCE))))
     {
@@ -531,6 +606,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->trgtype = TRG_ALL;
         my_instance->log_all = false;
         my_instance->strict_logging = true;
+        my_instance->buffer_size = MQ_DEFAULT_BUFFER_SIZE;
+        my_instance->batch_size = MQ_DEFAULT_BATCH_SIZE;
+        my_instance->n_channels = 1;
+        my_instance->confirms = true;
 
         for (i = 0; params[i]; i++)
         {
@@ -581,6 +660,38 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
                 my_instance->ssl_CA_cert = strdup(params[i]->value);
             }
+            else if (!strcmp(params[i]->name, "buffer_size"))
+            {
+                if ((my_instance->buffer_size = atoi(params[i]->value)) <= 0)
+                {
+                    MXS_ERROR("Invalid value for 'buffer_size': %s, using default value of %d.",
+                              params[i]->value, MQ_DEFAULT_BUFFER_SIZE);
+                    my_instance->buffer_size = MQ_DEFAULT_BUFFER_SIZE;
+                }
+            }
+            else if (!strcmp(params[i]->name, "batch_size"))
+            {
+                if ((my_instance->batch_size = atoi(params[i]->value)) <= 0)
+                {
+                    MXS_ERROR("Invalid value for 'batch_size': %s, using default value of %d.",
+                              params[i]->value, MQ_DEFAULT_BATCH_SIZE);
+                    my_instance->batch_size = MQ_DEFAULT_BATCH_SIZE;
+                }
+            }
+            else if (!strcmp(params[i]->name, "channels"))
+            {
+                my_instance->n_channels = atoi(params[i]->value);
+                if (my_instance->n_channels <= 0 || my_instance->n_channels > MQ_MAX_CHANNELS)
+                {
+                    MXS_ERROR("Invalid value for 'channels': %s, the value must be between "
+                              "1 and %d. Using one channel.", params[i]->value, MQ_MAX_CHANNELS);
+                    my_instance->n_channels = 1;
+                }
+            }
+            else if (!strcmp(params[i]->name, "publisher_confirms"))
+            {
+                my_instance->confirms = config_truth_value(params[i]->value);
+            }
             else if (!strcmp(params[i]->name, "exchange_type"))
             {
 
@@ -785,11 +896,24 @@ createInstance(char **options, FILTER_PARAMETER **params)
             amqp_set_initialize_ssl_library(0);
         }
 
-        /**Connect to the server*/
-        init_conn(my_instance);
+        /**Connect to the server, the publisher reconnects if this fails*/
+        if (!init_conn(my_instance) || !init_channels(my_instance))
+        {
+            my_instance->conn_stat = AMQP_STATUS_SOCKET_ERROR;
+        }
+
+        THREAD thd;
 
-        snprintf(taskname, 511, "mqtask%d", atomic_add(&hktask_id, 1));
-        hktask_add(taskname, sendMessage, (void*) my_instance, 5);
+        if ((my_instance->messages = calloc(my_instance->buffer_size, sizeof(mqmessage))) == NULL ||
+            thread_start(&thd, mq_publisher, my_instance) == NULL)
+        {
+            MXS_ERROR("Failed to start the publisher thread.");
+            free(my_instance->messages);
+            free(my_instance);
+            return NULL;
+        }
+
+        pthread_detach(thd);
         if (arr)
         {
             for (int x = 0; x < arrsize; x++)
@@ -845,16 +969,15 @@ int declareQueue(MQ_INSTANCE *my_instance, MQ_SESSION* my_session, char* qname)
 }
 
 /**
- * Broadcasts a message on the message stack to the RabbitMQ server
- * and frees the allocated memory if successful. This function is only called by
- * the housekeeper thread.
- * @param data MQfilter instance
+ * Reconnect to the RabbitMQ server if the connection has failed. This function
+ * is only called by the publisher thread.
+ * @param instance MQfilter instance
+ * @return True if the connection is usable
  */
-void sendMessage(void* data)
+static bool
+mq_check_connection(MQ_INSTANCE *instance)
 {
-    MQ_INSTANCE *instance = (MQ_INSTANCE*) data;
-    mqmessage *tmp;
-    int err_num = AMQP_STATUS_OK;
+    int err_num;
 
     spinlock_acquire(&instance->rconn_lock);
     if (instance->conn_stat != AMQP_STATUS_OK)
@@ -863,7 +986,7 @@ void sendMessage(void* data)
         {
             instance->last_rconn = time(NULL);
 
-            if (init_conn(instance))
+            if (init_conn(instance) && init_channels(instance))
             {
                 instance->rconn_intv = 1.0;
                 instance->conn_stat = AMQP_STATUS_OK;
@@ -874,87 +997,250 @@ void sendMessage(void* data)
                 MXS_ERROR("Failed to reconnect to the MQRabbit server ");
             }
         }
-        err_num = instance->conn_stat;
     }
+    err_num = instance->conn_stat;
     spinlock_release(&instance->rconn_lock);
 
-    if (err_num != AMQP_STATUS_OK)
-    {
-        /** No connection to the broker */
-        return;
-    }
+    return err_num == AMQP_STATUS_OK;
+}
+
+/**
+ * Take messages from the message buffer
+ * @param instance MQfilter instance
+ * @param batch Array where the messages are moved
+ * @param max Maximum number of messages to take
+ * @return Number of messages taken
+ */
+static int
+mq_take_messages(MQ_INSTANCE *instance, mqmessage *batch, int max)
+{
+    int n = 0;
 
     spinlock_acquire(&instance->msg_lock);
-    tmp = instance->messages;
 
-    if (tmp == NULL)
+    while (n < max && instance->tail < instance->head)
     {
-        spinlock_release(&instance->msg_lock);
-        return;
+        batch[n++] = instance->messages[instance->tail++ % instance->buffer_size];
     }
 
-    instance->messages = instance->messages->next;
     spinlock_release(&instance->msg_lock);
 
-    while (tmp)
+    return n;
+}
+
+/**
+ * Mark the messages of a publisher confirmation
+ * @param batch The published messages
+ * @param n Number of messages
+ * @param channel The channel of the confirmation
+ * @param tag The confirmed delivery tag
+ * @param multiple All delivery tags up to the tag are confirmed
+ * @param ack True if the server received the messages, false if they are resent
+ * @return Number of resent messages
+ */
+static int
+mq_confirm(mqmessage *batch, int n, amqp_channel_t channel, uint64_t tag, bool multiple, bool ack)
+{
+    int n_nacked = 0;
+
+    for (int i = 0; i < n; i++)
     {
-        err_num = amqp_basic_publish(instance->conn, instance->channel,
+        if (batch[i].tag && batch[i].channel == channel &&
+            (batch[i].tag == tag || (multiple && batch[i].tag < tag)))
+        {
+            if (ack)
+            {
+                batch[i].confirmed = true;
+            }
+            else
+            {
+                batch[i].tag = 0;
+                n_nacked++;
+            }
+        }
+    }
+
+    return n_nacked;
+}
+
+/**
+ * Publish a batch of messages and wait for their confirmations. The messages
+ * are divided between the channels. This function is only called by the
+ * publisher thread and the caller must hold the connection lock.
+ * @param instance MQfilter instance
+ * @param batch The messages to publish
+ * @param n Number of messages
+ * @return True if no error occurred
+ */
+static bool
+mq_publish_batch(MQ_INSTANCE *instance, mqmessage *batch, int n)
+{
+    int err_num = AMQP_STATUS_OK;
+    int n_pending = 0;
+
+    for (int i = 0; i < n && err_num == AMQP_STATUS_OK; i++)
+    {
+        int ch = i % instance->n_channels;
+
+        if (batch[i].prop && batch[i].uid)
+        {
+            batch[i].prop->correlation_id = amqp_cstring_bytes(batch[i].uid);
+        }
+
+        err_num = amqp_basic_publish(instance->conn, instance->channel + ch,
                                      amqp_cstring_bytes(instance->exchange),
                                      amqp_cstring_bytes(instance->key),
-                                     0, 0, tmp->prop, amqp_cstring_bytes(tmp->msg));
-
-        spinlock_acquire(&instance->rconn_lock);
-        instance->conn_stat = err_num;
-        spinlock_release(&instance->rconn_lock);
+                                     0, 0, batch[i].prop, amqp_cstring_bytes(batch[i].msg));
 
         if (err_num == AMQP_STATUS_OK)
         {
-            /**Message was sent successfully*/
-            free(tmp->prop);
-            free(tmp->msg);
-            free(tmp);
+            batch[i].channel = instance->channel + ch;
+            batch[i].tag = ++instance->next_tag[ch];
+            batch[i].confirmed = !instance->confirms;
+            n_pending++;
+        }
+    }
 
-            atomic_add(&instance->stats.n_sent, 1);
-            atomic_add(&instance->stats.n_queued, -1);
-            spinlock_acquire(&instance->msg_lock);
-            tmp = instance->messages;
+    while (instance->confirms && n_pending > 0 && err_num == AMQP_STATUS_OK)
+    {
+        struct timeval timeout = {MQ_CONFIRM_TIMEOUT, 0};
+        amqp_frame_t frame;
 
-            if (tmp == NULL)
+        if ((err_num = amqp_simple_wait_frame_noblock(instance->conn, &frame, &timeout)) != AMQP_STATUS_OK)
+        {
+            MXS_ERROR("Failed to receive publisher confirmations: %s", amqp_error_string2(err_num));
+        }
+        else if (frame.frame_type == AMQP_FRAME_METHOD)
+        {
+            if (frame.payload.method.id == AMQP_BASIC_ACK_METHOD)
+            {
+                amqp_basic_ack_t *ack = (amqp_basic_ack_t*) frame.payload.method.decoded;
+                mq_confirm(batch, n, frame.channel, ack->delivery_tag, ack->multiple, true);
+            }
+            else if (frame.payload.method.id == AMQP_BASIC_NACK_METHOD)
             {
-                spinlock_release(&instance->msg_lock);
-                return;
+                amqp_basic_nack_t *nack = (amqp_basic_nack_t*) frame.payload.method.decoded;
+                atomic_add(&instance->stats.n_nacked,
+                           mq_confirm(batch, n, frame.channel, nack->delivery_tag, nack->multiple, false));
             }
+            else if (frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD ||
+                     frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD)
+            {
+                MXS_ERROR("The server closed the connection while publishing messages.");
+                err_num = AMQP_STATUS_CONNECTION_CLOSED;
+            }
+
+            n_pending = 0;
+
+            for (int i = 0; i < n; i++)
+            {
+                if (batch[i].tag && !batch[i].confirmed)
+                {
+                    n_pending++;
+                }
+            }
+        }
+
+        amqp_maybe_release_buffers(instance->conn);
+    }
+
+    instance->conn_stat = err_num;
+
+    return err_num == AMQP_STATUS_OK;
+}
+
+/**
+ * Free the confirmed messages of a batch. The unconfirmed messages are moved
+ * to the beginning of the batch and published again.
+ * @param instance MQfilter instance
+ * @param batch The messages
+ * @param n Number of messages
+ * @return Number of messages left in the batch
+ */
+static int
+mq_release_confirmed(MQ_INSTANCE *instance, mqmessage *batch, int n)
+{
+    int left = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (batch[i].confirmed)
+        {
+            free(batch[i].prop);
+            free(batch[i].msg);
+            free(batch[i].uid);
 
-            instance->messages = instance->messages->next;
-            spinlock_release(&instance->msg_lock);
+            atomic_add(&instance->stats.n_sent, 1);
+            atomic_add(&instance->stats.n_queued, -1);
         }
         else
         {
-            spinlock_acquire(&instance->msg_lock);
-            tmp->next = instance->messages;
-            instance->messages = tmp;
-            spinlock_release(&instance->msg_lock);
-            return;
+            batch[left] = batch[i];
+            batch[left].tag = 0;
+            left++;
         }
     }
+
+    return left;
 }
 
 /**
- * Push a new message on the stack to be broadcasted later.
+ * The publisher thread. Takes the messages from the message buffer and
+ * publishes them in batches. A message is freed only after the server has
+ * confirmed it so messages are resent after a reconnection.
+ * @param data MQfilter instance
+ */
+static void
+mq_publisher(void* data)
+{
+    MQ_INSTANCE *instance = (MQ_INSTANCE*) data;
+    mqmessage *batch = calloc(instance->batch_size, sizeof(mqmessage));
+    int n = 0;
+
+    if (batch == NULL)
+    {
+        MXS_ERROR("Cannot allocate enough memory.");
+        return;
+    }
+
+    while (true)
+    {
+        bool published = false;
+
+        if (mq_check_connection(instance))
+        {
+            n += mq_take_messages(instance, batch + n, instance->batch_size - n);
+
+            if (n > 0)
+            {
+                spinlock_acquire(&instance->rconn_lock);
+                published = mq_publish_batch(instance, batch, n);
+                spinlock_release(&instance->rconn_lock);
+
+                n = mq_release_confirmed(instance, batch, n);
+            }
+        }
+
+        if (!published)
+        {
+            thread_millisleep(MQ_PUBLISH_INTERVAL);
+        }
+    }
+}
+
+/**
+ * Add a new message to the message buffer to be published later. If the buffer
+ * is full the message is dropped.
  * The message assumes ownership of the memory allocated to the message content and properties.
  * @param prop Message properties
  * @param msg Message content
  */
 void pushMessage(MQ_INSTANCE *instance, amqp_basic_properties_t* prop, char* msg)
 {
+    char *uid = NULL;
 
-    mqmessage* newmsg = calloc(1, sizeof(mqmessage));
-    if (newmsg)
-    {
-        newmsg->msg = msg;
-        newmsg->prop = prop;
-    }
-    else
+    if (prop && (prop->_flags & AMQP_BASIC_CORRELATION_ID_FLAG) &&
+        (uid = strndup(prop->correlation_id.bytes, prop->correlation_id.len)) == NULL)
     {
         MXS_ERROR("Cannot allocate enough memory.");
         free(prop);
@@ -964,8 +1250,23 @@ void pushMessage(MQ_INSTANCE *instance, amqp_basic_properties_t* prop, char* msg
 
     spinlock_acquire(&instance->msg_lock);
 
-    newmsg->next = instance->messages;
-    instance->messages = newmsg;
+    if (instance->head - instance->tail >= (uint64_t)instance->buffer_size)
+    {
+        spinlock_release(&instance->msg_lock);
+        atomic_add(&instance->stats.n_msg, 1);
+        atomic_add(&instance->stats.n_dropped, 1);
+        free(prop);
+        free(msg);
+        free(uid);
+        return;
+    }
+
+    mqmessage *newmsg = &instance->messages[instance->head++ % instance->buffer_size];
+    newmsg->prop = prop;
+    newmsg->msg = msg;
+    newmsg->uid = uid;
+    newmsg->tag = 0;
+    newmsg->confirmed = false;
 
     spinlock_release(&instance->msg_lock);
 
@@ -1685,11 +1986,13 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
                    my_instance->vhost, my_instance->exchange,
                    my_instance->key, my_instance->queue
                   );
-        dcb_printf(dcb, "%-16s%-16s%-16s\n",
-                   "Messages", "Queued", "Sent");
-        dcb_printf(dcb, "%-16d%-16d%-16d\n",
+        dcb_printf(dcb, "%-16s%-16s%-16s%-16s%-16s\n",
+                   "Messages", "Queued", "Sent", "Dropped", "Resent");
+        dcb_printf(dcb, "%-16d%-16d%-16d%-16d%-16d\n",
                    my_instance->stats.n_msg,
                    my_instance->stats.n_queued,
-                   my_instance->stats.n_sent);
+                   my_instance->stats.n_sent,
+                   my_instance->stats.n_dropped,
+                   my_instance->stats.n_nacked);
     }
 }
@@ -12,13 +12,14 @@
  */
 
 #include <stdio.h>
+#include <ctype.h>
 #include <filter.h>
 #include <modinfo.h>
 #include <modutil.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <string.h>
-#include <regex.h>
+#include <maxscale_pcre2.h>
 #include <hint.h>
 
 /**
@@ -34,8 +35,17 @@
  *      source=<source address to limit filter>
  *      user=<username to limit filter>
  *
+ * More rules can be defined with numbered parameters, matchNN and serverNN.
+ * The rules are tried in the order of their numbers and the first matching
+ * rule decides the server.
+ *
+ * Before any regular expression is run, each statement is scanned once for
+ * a literal string that every match of a rule must contain. Only the rules
+ * whose literal is found, or that have no known literal, are matched.
+ *
  * Date         Who             Description
  * 22/01/2015   Mark Riddoch    Written as example based on regex filter
+ * 14/10/2016   MariaDB Corporation Multiple rules and literal prefiltering
  * @endverbatim
  */
 
@@ -71,6 +81,22 @@ static FILTER_OBJECT MyObject =
     diagnostic,
 };
 
+/** Maximum number of match and server pairs */
+#define REGEXHINT_MAX_RULES 25
+
+/**
+ * A regular expression and the server where matching statements are routed
+ */
+typedef struct
+{
+    char *match; /* Regular expression to match */
+    char *server; /* Server to route to */
+    pcre2_code *re; /* Compiled regex text */
+    char *literal; /* String that every match contains, NULL if not known */
+    int literal_len; /* Length of the literal */
+    int order; /* Number of the parameters, -1 for match and server */
+} REGEXHINT_RULE;
+
 /**
  * Instance structure
  */
@@ -78,9 +104,11 @@ typedef struct
 {
     char *source; /* Source address to restrict matches */
     char *user; /* User name to restrict matches */
-    char *match; /* Regular expression to match */
-    char *server; /* Server to route to */
-    regex_t re; /* Compiled regex text */
+    REGEXHINT_RULE rules[REGEXHINT_MAX_RULES]; /* The rules in the order they are tried */
+    int n_rules; /* Number of rules */
+    bool caseless; /* Letter case is ignored */
+    uint32_t first[256]; /* Rules whose literal starts with the character */
+    uint32_t no_literal; /* Rules without a literal */
 } REGEXHINT_INSTANCE;
 
 /**
@@ -131,6 +159,188 @@ GetModuleObject()
     return &MyObject;
 }
 
+/**
+ * Find the longest literal string that every match of a regular expression
+ * contains. The pattern is only analyzed up to the first construct that is
+ * not understood and patterns with alternatives have no literal.
+ *
+ * @param pattern   The regular expression
+ * @param caseless  The pattern is matched without regard to letter case
+ * @param len       The length of the literal is stored here
+ * @return The literal or NULL if no literal was found
+ */
+static char *
+regex_required_literal(const char *pattern, bool caseless, int *len)
+{
+    int plen = strlen(pattern);
+    char run[plen + 1], best[plen + 1];
+    int run_len = 0, best_len = 0;
+    bool done = false;
+
+    if (strchr(pattern, '|') || strstr(pattern, "(?") || strstr(pattern, "\\Q"))
+    {
+        return NULL;
+    }
+
+    for (const char *ptr = pattern; *ptr && !done; ptr++)
+    {
+        bool end_run = false;
+        char c = *ptr;
+
+        if (c == '\\')
+        {
+            c = *++ptr;
+
+            if (c == '\0')
+            {
+                /** A trailing backslash */
+                done = true;
+                ptr--;
+            }
+            else if (strchr("dDsSwWbBAzZGhHvVR", c))
+            {
+                /** A character class or an assertion */
+                end_run = true;
+                c = '\0';
+            }
+            else if (isalnum(c))
+            {
+                /** Other escapes can consume more characters */
+                done = true;
+                c = '\0';
+            }
+        }
+        else if (c == '.' || c == '^' || c == '$' || c == '+')
+        {
+            /** The character before a + is still required once */
+            end_run = true;
+            c = '\0';
+        }
+        else if (c == '*' || c == '?' || c == '{')
+        {
+            /** The preceding character is optional */
+            run_len = run_len > 0 ? run_len - 1 : 0;
+            end_run = true;
+
+            if (c == '{' && (ptr = strchr(ptr, '}')) == NULL)
+            {
+                break;
+            }
+            c = '\0';
+        }
+        else if (c == '[' || c == '(' || c == ')')
+        {
+            /** Classes and groups end the analysis */
+            done = true;
+            c = '\0';
+        }
+
+        if (c != '\0')
+        {
+            if (caseless && (unsigned char)c >= 0x80)
+            {
+                done = true;
+            }
+            else
+            {
+                run[run_len++] = c;
+            }
+        }
+
+        if (end_run || done)
+        {
+            if (run_len > best_len)
+            {
+                memcpy(best, run, run_len);
+                best_len = run_len;
+            }
+            run_len = 0;
+        }
+    }
+
+    if (run_len > best_len)
+    {
+        memcpy(best, run, run_len);
+        best_len = run_len;
+    }
+
+    if (best_len == 0)
+    {
+        return NULL;
+    }
+
+    *len = best_len;
+    return strndup(best, best_len);
+}
+
+/**
+ * Free the rules and the instance
+ *
+ * @param my_instance The filter instance
+ */
+static void
+free_instance(REGEXHINT_INSTANCE *my_instance)
+{
+    for (int i = 0; i < my_instance->n_rules; i++)
+    {
+        pcre2_code_free(my_instance->rules[i].re);
+        free(my_instance->rules[i].match);
+        free(my_instance->rules[i].server);
+        free(my_instance->rules[i].literal);
+    }
+
+    free(my_instance->source);
+    free(my_instance->user);
+    free(my_instance);
+}
+
+/**
+ * Get the rule of a match or server parameter
+ *
+ * @param my_instance The filter instance
+ * @param suffix   The part of the parameter name after match or server
+ * @return The rule or NULL if the suffix is not a number or there are too many rules
+ */
+static REGEXHINT_RULE *
+get_rule(REGEXHINT_INSTANCE *my_instance, const char *suffix)
+{
+    int order = -1;
+
+    if (*suffix)
+    {
+        char *end;
+        order = strtol(suffix, &end, 10);
+
+        if (*end || order < 0 || !isdigit(*suffix))
+        {
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < my_instance->n_rules; i++)
+    {
+        if (my_instance->rules[i].order == order)
+        {
+            return &my_instance->rules[i];
+        }
+    }
+
+    if (my_instance->n_rules == REGEXHINT_MAX_RULES)
+    {
+        return NULL;
+    }
+
+    REGEXHINT_RULE *rule = &my_instance->rules[my_instance->n_rules++];
+    rule->order = order;
+    return rule;
+}
+
+static int
+cmp_rule(const void *a, const void *b)
+{
+    return ((const REGEXHINT_RULE *) a)->order - ((const REGEXHINT_RULE *) b)->order;
+}
+
 /**
  * Create an instance of the filter for a particular service
  * within MaxScale.
@@ -144,25 +354,23 @@ static FILTER *
 createInstance(char **options, FILTER_PARAMETER **params)
 {
     REGEXHINT_INSTANCE *my_instance;
-    int cflags = REG_ICASE;
+    int cflags = PCRE2_CASELESS | PCRE2_DOTALL;
 
-    if ((my_instance = malloc(sizeof(REGEXHINT_INSTANCE))) != NULL)
+    if ((my_instance = calloc(1, sizeof(REGEXHINT_INSTANCE))) != NULL)
     {
-        my_instance->match = NULL;
-        my_instance->server = NULL;
-        my_instance->source = NULL;
-        my_instance->user = NULL;
         bool error = false;
 
         for (int i = 0; params && params[i]; i++)
         {
-            if (!strcmp(params[i]->name, "match"))
-            {
-                my_instance->match = strdup(params[i]->value);
-            }
-            else if (!strcmp(params[i]->name, "server"))
+            REGEXHINT_RULE *rule;
+            bool is_match = strncmp(params[i]->name, "match", 5) == 0;
+
+            if ((is_match || strncmp(params[i]->name, "server", 6) == 0) &&
+                (rule = get_rule(my_instance, params[i]->name + (is_match ? 5 : 6))))
             {
-                my_instance->server = strdup(params[i]->value);
+                char **value = is_match ? &rule->match : &rule->server;
+                free(*value);
+                *value = strdup(params[i]->value);
             }
             else if (!strcmp(params[i]->name, "source"))
             {
@@ -186,15 +394,15 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 if (!strcasecmp(options[i], "ignorecase"))
                 {
-                    cflags |= REG_ICASE;
+                    cflags |= PCRE2_CASELESS;
                 }
                 else if (!strcasecmp(options[i], "case"))
                 {
-                    cflags &= ~REG_ICASE;
+                    cflags &= ~PCRE2_CASELESS;
                 }
                 else if (!strcasecmp(options[i], "extended"))
                 {
-                    cflags |= REG_EXTENDED;
+                    /** The PCRE2 syntax is a superset of the extended syntax */
                 }
                 else
                 {
@@ -205,38 +413,67 @@ createInstance(char **options, FILTER_PARAMETER **params)
             }
         }
 
-        if (my_instance->match == NULL)
+        my_instance->caseless = cflags & PCRE2_CASELESS;
+        qsort(my_instance->rules, my_instance->n_rules, sizeof(REGEXHINT_RULE), cmp_rule);
+
+        if (my_instance->n_rules == 0)
         {
             MXS_ERROR("namedserverfilter: Missing required parameters 'match'.");
             error = true;
         }
 
-        if (my_instance->server == NULL)
-        {
-            MXS_ERROR("namedserverfilter: Missing required parameters 'server'.");
-            error = true;
-        }
-        if (my_instance->server && my_instance->match &&
-            regcomp(&my_instance->re, my_instance->match, cflags))
+        for (int i = 0; i < my_instance->n_rules; i++)
         {
-            MXS_ERROR("namedserverfilter: Invalid regular expression '%s'.\n",
-                      my_instance->match);
-            free(my_instance->match);
-            my_instance->match = NULL;
-            error = true;
+            REGEXHINT_RULE *rule = &my_instance->rules[i];
+            char suffix[20] = "";
+
+            if (rule->order >= 0)
+            {
+                snprintf(suffix, sizeof(suffix), "%02d", rule->order);
+            }
+
+            if (rule->match == NULL)
+            {
+                MXS_ERROR("namedserverfilter: Missing required parameters 'match%s'.", suffix);
+                error = true;
+            }
+
+            if (rule->server == NULL)
+            {
+                MXS_ERROR("namedserverfilter: Missing required parameters 'server%s'.", suffix);
+                error = true;
+            }
+
+            if (rule->server && rule->match &&
+                (rule->re = mxs_pcre2_compile(rule->match, cflags)) == NULL)
+            {
+                MXS_ERROR("namedserverfilter: Invalid regular expression '%s'.\n",
+                          rule->match);
+                error = true;
+            }
+
+            if (rule->re && (rule->literal = regex_required_literal(rule->match,
+                                                                    my_instance->caseless,
+                                                                    &rule->literal_len)))
+            {
+                unsigned char c = rule->literal[0];
+                my_instance->first[c] |= 1 << i;
+
+                if (my_instance->caseless)
+                {
+                    my_instance->first[tolower(c)] |= 1 << i;
+                    my_instance->first[toupper(c)] |= 1 << i;
+                }
+            }
+            else
+            {
+                my_instance->no_literal |= 1 << i;
+            }
         }
 
         if (error)
         {
-            if (my_instance->match)
-            {
-                regfree(&my_instance->re);
-                free(my_instance->match);
-            }
-            free(my_instance->server);
-            free(my_instance->source);
-            free(my_instance->user);
-            free(my_instance);
+            free_instance(my_instance);
             my_instance = NULL;
         }
 
@@ -321,6 +558,59 @@ setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
     my_session->down = *downstream;
 }
 
+/**
+ * Find the first rule that matches a statement
+ *
+ * The statement is scanned once for the literals of the rules and only the
+ * rules whose literal was found, or that have no literal, are matched with
+ * their regular expression.
+ *
+ * @param my_instance The filter instance
+ * @param sql   The SQL of the statement, not null terminated
+ * @param len   Length of the SQL
+ * @return The matching rule or NULL if no rule matched
+ */
+static REGEXHINT_RULE *
+find_matching_rule(REGEXHINT_INSTANCE *my_instance, const char *sql, int len)
+{
+    uint32_t candidates = my_instance->no_literal;
+    uint32_t pending = ~candidates & ((1u << my_instance->n_rules) - 1);
+
+    for (int i = 0; i < len && pending; i++)
+    {
+        uint32_t rules = my_instance->first[(unsigned char) sql[i]] & pending;
+
+        while (rules)
+        {
+            int r = __builtin_ctz(rules);
+            REGEXHINT_RULE *rule = &my_instance->rules[r];
+            rules &= rules - 1;
+
+            if (rule->literal_len <= len - i &&
+                (my_instance->caseless ?
+                 strncasecmp(sql + i, rule->literal, rule->literal_len) :
+                 memcmp(sql + i, rule->literal, rule->literal_len)) == 0)
+            {
+                candidates |= 1u << r;
+                pending &= ~(1u << r);
+            }
+        }
+    }
+
+    while (candidates)
+    {
+        int r = __builtin_ctz(candidates);
+        candidates &= candidates - 1;
+
+        if (mxs_pcre2_match(my_instance->rules[r].re, sql, len))
+        {
+            return &my_instance->rules[r];
+        }
+    }
+
+    return NULL;
+}
+
 /**
  * The routeQuery entry point. This is passed the query buffer
  * to which the filter should be applied. Once applied the
@@ -341,27 +631,29 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
     REGEXHINT_INSTANCE *my_instance = (REGEXHINT_INSTANCE *) instance;
     REGEXHINT_SESSION *my_session = (REGEXHINT_SESSION *) session;
     char *sql;
+    int len;
 
-    if (modutil_is_SQL(queue) && my_session->active)
+    if (my_session->active && modutil_is_SQL(queue))
     {
         if (queue->next != NULL)
         {
             queue = gwbuf_make_contiguous(queue);
         }
-        if ((sql = modutil_get_SQL(queue)) != NULL)
+        if (modutil_extract_SQL(queue, &sql, &len))
         {
-            if (regexec(&my_instance->re, sql, 0, NULL, 0) == 0)
+            REGEXHINT_RULE *rule = find_matching_rule(my_instance, sql, len);
+
+            if (rule)
             {
                 queue->hint = hint_create_route(queue->hint,
                                                 HINT_ROUTE_TO_NAMED_SERVER,
-                                                my_instance->server);
+                                                rule->server);
                 my_session->n_diverted++;
             }
             else
             {
                 my_session->n_undiverted++;
             }
-            free(sql);
         }
     }
     return my_session->down.routeQuery(my_session->down.instance,
@@ -385,8 +677,11 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
     REGEXHINT_INSTANCE *my_instance = (REGEXHINT_INSTANCE *) instance;
     REGEXHINT_SESSION *my_session = (REGEXHINT_SESSION *) fsession;
 
-    dcb_printf(dcb, "\t\tMatch and route:           /%s/ -> %s\n",
-               my_instance->match, my_instance->server);
+    for (int i = 0; i < my_instance->n_rules; i++)
+    {
+        dcb_printf(dcb, "\t\tMatch and route:           /%s/ -> %s\n",
+                   my_instance->rules[i].match, my_instance->rules[i].server);
+    }
     if (my_session)
     {
         dcb_printf(dcb, "\t\tNo. of queries diverted by filter: %d\n",
@@ -26,10 +26,16 @@
  * file to which the queries are logged. A serial number is appended to this
  * name in order that each session logs to a different file.
  *
- * Date         Who             Description
- * 03/06/2014   Mark Riddoch    Initial implementation
- * 11/06/2014   Mark Riddoch    Addition of source and match parameters
- * 19/06/2014   Mark Riddoch    Addition of user parameter
+ * With log_type=unified the queries of all sessions are logged into one file.
+ * The queries are copied into a buffer of the calling thread and a writer
+ * thread writes them into the file. A query that does not fit into the
+ * buffer is dropped instead of waiting for the writer.
+ *
+ * Date         Who                 Description
+ * 03/06/2014   Mark Riddoch        Initial implementation
+ * 11/06/2014   Mark Riddoch        Addition of source and match parameters
+ * 19/06/2014   Mark Riddoch        Addition of user parameter
+ * 14/10/2016   MariaDB Corporation Addition of the unified log
  *
  * @endverbatim
  */
@@ -44,9 +50,12 @@
 #include <log_manager.h>
 #include <time.h>
 #include <sys/time.h>
-#include <regex.h>
+#include <maxscale_pcre2.h>
 #include <string.h>
 #include <atomic.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <platform.h>
 
 MODULE_INFO info =
 {
@@ -61,6 +70,18 @@ static char *version_str = "V1.1.1";
 /** Formatting buffer size */
 #define QLA_STRING_BUFFER_SIZE 1024
 
+/** Default size of the unified log buffer of each thread */
+#define QLA_DEFAULT_BUFFER_SIZE (1024 * 1024)
+
+/** Minimum size of the unified log buffer of each thread */
+#define QLA_MIN_BUFFER_SIZE 4096
+
+/** How often the writer thread writes the unified log, in milliseconds */
+#define QLA_WRITER_INTERVAL 100
+
+/** Number of unified log buffers remembered by each thread */
+#define QLA_THREAD_BUFFERS 8
+
 /*
  * The filter entry points
  */
@@ -94,6 +115,45 @@ static FILTER_OBJECT MyObject =
  * To this base a session number is attached such that each session will
  * have a unique name.
  */
+typedef enum
+{
+    QLA_LOG_SESSION, /* One file for each session */
+    QLA_LOG_UNIFIED  /* One file for all sessions */
+} qla_log_type_t;
+
+typedef enum
+{
+    QLA_FORMAT_TEXT,  /* Comma separated text */
+    QLA_FORMAT_BINARY /* QLA_RECORD headers followed by the strings */
+} qla_log_format_t;
+
+/**
+ * A query in the unified log. The user, the client address and the SQL
+ * follow the header without terminating nul characters.
+ */
+typedef struct
+{
+    uint32_t size;       /* Size of the record with the header */
+    uint16_t user_len;   /* Length of the user */
+    uint16_t remote_len; /* Length of the client address */
+    int64_t  time_us;    /* Time of the query in microseconds since the epoch */
+} QLA_RECORD;
+
+/**
+ * The unified log buffer of one thread. The thread is the only writer of the
+ * head and the writer thread the only writer of the tail, so the buffer is
+ * used without locks.
+ */
+typedef struct qla_buffer
+{
+    char *data;              /* The buffer, the size is a power of two */
+    int64_t size;            /* Size of the buffer */
+    int64_t head;            /* Total bytes written to the buffer */
+    int64_t tail;            /* Total bytes read from the buffer */
+    pthread_t thread;        /* The thread that writes to the buffer */
+    struct qla_buffer *next; /* The buffer of the next thread */
+} QLA_BUFFER;
+
 typedef struct
 {
     int sessions; /* The count of sessions */
@@ -101,11 +161,33 @@ typedef struct
     char *source; /* The source of the client connection */
     char *userName; /* The user name to filter on */
     char *match; /* Optional text to match against */
-    regex_t re; /* Compiled regex text */
+    pcre2_code *re; /* Compiled regex text */
     char *nomatch; /* Optional text to match against for exclusion */
-    regex_t nore; /* Compiled regex nomatch text */
+    pcre2_code *nore; /* Compiled regex nomatch text */
+    qla_log_type_t log_type; /* Whether the sessions log to one file */
+    qla_log_format_t log_format; /* Format of the unified log */
+    int64_t buffer_size; /* Size of the unified log buffer of each thread */
+    long rotate_size; /* Size after which the unified log is rotated, 0 for never */
+    char *unified_filename; /* The unified log file */
+    FILE *unified_fp; /* The unified log file */
+    int rotations; /* Number of times the unified log was rotated */
+    SPINLOCK lock; /* Protects the list of buffers */
+    QLA_BUFFER *buffers; /* The unified log buffers of the threads */
+    int64_t n_logged; /* Queries written into the unified log */
+    int64_t n_dropped; /* Queries dropped because a buffer was full */
 } QLA_INSTANCE;
 
+/** The unified log buffers of the calling thread */
+static thread_local struct
+{
+    QLA_INSTANCE *instance;
+    QLA_BUFFER *buffer;
+} this_buffers[QLA_THREAD_BUFFERS];
+
+static bool qla_unified_init(QLA_INSTANCE *instance);
+static void qla_unified_log(QLA_INSTANCE *instance, const char *user,
+                            const char *remote, const char *sql);
+
 /**
  * The session structure for this QLA filter.
  * This stores the downstream filter information, such that the
@@ -183,6 +265,17 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->match = NULL;
         my_instance->nomatch = NULL;
         my_instance->filebase = NULL;
+        my_instance->log_type = QLA_LOG_SESSION;
+        my_instance->log_format = QLA_FORMAT_TEXT;
+        my_instance->buffer_size = QLA_DEFAULT_BUFFER_SIZE;
+        my_instance->rotate_size = 0;
+        my_instance->unified_filename = NULL;
+        my_instance->unified_fp = NULL;
+        my_instance->rotations = 0;
+        spinlock_init(&my_instance->lock);
+        my_instance->buffers = NULL;
+        my_instance->n_logged = 0;
+        my_instance->n_dropped = 0;
         bool error = false;
 
         if (params)
@@ -209,6 +302,72 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 {
                     my_instance->filebase = strdup(params[i]->value);
                 }
+                else if (!strcmp(params[i]->name, "log_type"))
+                {
+                    if (!strcasecmp(params[i]->value, "session"))
+                    {
+                        my_instance->log_type = QLA_LOG_SESSION;
+                    }
+                    else if (!strcasecmp(params[i]->value, "unified"))
+                    {
+                        my_instance->log_type = QLA_LOG_UNIFIED;
+                    }
+                    else
+                    {
+                        MXS_ERROR("qlafilter: Unknown value '%s' for 'log_type', "
+                                  "expected 'session' or 'unified'.", params[i]->value);
+                        error = true;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "log_format"))
+                {
+                    if (!strcasecmp(params[i]->value, "text"))
+                    {
+                        my_instance->log_format = QLA_FORMAT_TEXT;
+                    }
+                    else if (!strcasecmp(params[i]->value, "binary"))
+                    {
+                        my_instance->log_format = QLA_FORMAT_BINARY;
+                    }
+                    else
+                    {
+                        MXS_ERROR("qlafilter: Unknown value '%s' for 'log_format', "
+                                  "expected 'text' or 'binary'.", params[i]->value);
+                        error = true;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "buffer_size"))
+                {
+                    long size = atol(params[i]->value);
+
+                    if (size < QLA_MIN_BUFFER_SIZE || size > INT32_MAX)
+                    {
+                        MXS_ERROR("qlafilter: Invalid value '%s' for 'buffer_size', the "
+                                  "minimum is %d bytes.", params[i]->value, QLA_MIN_BUFFER_SIZE);
+                        error = true;
+                    }
+                    else
+                    {
+                        /** Round up to a power of two */
+                        for (my_instance->buffer_size = QLA_MIN_BUFFER_SIZE;
+                             my_instance->buffer_size < size;
+                             my_instance->buffer_size *= 2)
+                        {
+                            ;
+                        }
+                    }
+                }
+                else if (!strcmp(params[i]->name, "rotate_size"))
+                {
+                    my_instance->rotate_size = atol(params[i]->value);
+
+                    if (my_instance->rotate_size < 0)
+                    {
+                        MXS_ERROR("qlafilter: Invalid value '%s' for 'rotate_size'.",
+                                  params[i]->value);
+                        error = true;
+                    }
+                }
                 else if (!filter_standard_parameter(params[i]->name))
                 {
                     MXS_ERROR("qlafilter: Unexpected parameter '%s'.",
@@ -218,7 +377,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
             }
         }
 
-        int cflags = REG_ICASE;
+        int cflags = PCRE2_CASELESS | PCRE2_DOTALL;
 
         if (options)
         {
@@ -226,15 +385,15 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 if (!strcasecmp(options[i], "ignorecase"))
                 {
-                    cflags |= REG_ICASE;
+                    cflags |= PCRE2_CASELESS;
                 }
                 else if (!strcasecmp(options[i], "case"))
                 {
-                    cflags &= ~REG_ICASE;
+                    cflags &= ~PCRE2_CASELESS;
                 }
                 else if (!strcasecmp(options[i], "extended"))
                 {
-                    cflags |= REG_EXTENDED;
+                    /** The PCRE2 syntax is a superset of the extended syntax */
                 }
                 else
                 {
@@ -253,7 +412,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
         my_instance->sessions = 0;
         if (my_instance->match &&
-            regcomp(&my_instance->re, my_instance->match, cflags))
+            (my_instance->re = mxs_pcre2_compile(my_instance->match, cflags)) == NULL)
         {
             MXS_ERROR("qlafilter: Invalid regular expression '%s'"
                       " for the 'match' parameter.\n",
@@ -263,7 +422,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
             error = true;
         }
         if (my_instance->nomatch &&
-            regcomp(&my_instance->nore, my_instance->nomatch, cflags))
+            (my_instance->nore = mxs_pcre2_compile(my_instance->nomatch, cflags)) == NULL)
         {
             MXS_ERROR("qlafilter: Invalid regular expression '%s'"
                       " for the 'nomatch' parameter.",
@@ -273,18 +432,24 @@ createInstance(char **options, FILTER_PARAMETER **params)
             error = true;
         }
 
+        if (!error && my_instance->log_type == QLA_LOG_UNIFIED &&
+            !qla_unified_init(my_instance))
+        {
+            error = true;
+        }
+
         if (error)
         {
             if (my_instance->match)
             {
                 free(my_instance->match);
-                regfree(&my_instance->re);
+                pcre2_code_free(my_instance->re);
             }
 
             if (my_instance->nomatch)
             {
                 free(my_instance->nomatch);
-                regfree(&my_instance->nore);
+                pcre2_code_free(my_instance->nore);
             }
             free(my_instance->filebase);
             free(my_instance->source);
@@ -348,7 +513,7 @@ newSession(FILTER *instance, SESSION *session)
         // Multiple sessions can try to update my_instance->sessions simultaneously
         atomic_add(&(my_instance->sessions), 1);
 
-        if (my_session->active)
+        if (my_session->active && my_instance->log_type == QLA_LOG_SESSION)
         {
             my_session->fp = fopen(my_session->filename, "w");
 
@@ -442,6 +607,7 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 {
     QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
     QLA_SESSION *my_session = (QLA_SESSION *) session;
+    const char *sql;
     char *ptr;
     int length = 0;
     struct tm t;
@@ -453,21 +619,31 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
         {
             queue = gwbuf_make_contiguous(queue);
         }
-        if ((ptr = modutil_get_SQL(queue)) != NULL)
+        /** The statement is only copied when it is logged */
+        if (modutil_get_SQL_view(queue, &sql, &length) &&
+            (my_instance->match == NULL ||
+             mxs_pcre2_match(my_instance->re, sql, length)) &&
+            (my_instance->nomatch == NULL ||
+             !mxs_pcre2_match(my_instance->nore, sql, length)))
         {
-            if ((my_instance->match == NULL ||
-                 regexec(&my_instance->re, ptr, 0, NULL, 0) == 0) &&
-                (my_instance->nomatch == NULL ||
-                 regexec(&my_instance->nore, ptr, 0, NULL, 0) != 0))
+            if ((ptr = strndup(sql, length)) != NULL)
             {
-                char buffer[QLA_STRING_BUFFER_SIZE];
-                gettimeofday(&tv, NULL);
-                localtime_r(&tv.tv_sec, &t);
-                strftime(buffer, sizeof(buffer), "%F %T", &t);
-                fprintf(my_session->fp, "%s,%s@%s,%s\n", buffer, my_session->user,
-                        my_session->remote, trim(squeeze_whitespace(ptr)));
+                if (my_instance->log_type == QLA_LOG_UNIFIED)
+                {
+                    qla_unified_log(my_instance, my_session->user, my_session->remote,
+                                    trim(squeeze_whitespace(ptr)));
+                }
+                else
+                {
+                    char buffer[QLA_STRING_BUFFER_SIZE];
+                    gettimeofday(&tv, NULL);
+                    localtime_r(&tv.tv_sec, &t);
+                    strftime(buffer, sizeof(buffer), "%F %T", &t);
+                    fprintf(my_session->fp, "%s,%s@%s,%s\n", buffer, my_session->user,
+                            my_session->remote, trim(squeeze_whitespace(ptr)));
+                }
+                free(ptr);
             }
-            free(ptr);
         }
     }
     /* Pass the query downstream */
@@ -492,7 +668,19 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
     QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
     QLA_SESSION *my_session = (QLA_SESSION *) fsession;
 
-    if (my_session)
+    if (my_instance->log_type == QLA_LOG_UNIFIED)
+    {
+        dcb_printf(dcb, "\t\tLogging to unified file    %s.\n",
+                   my_instance->unified_filename);
+        if (my_session == NULL)
+        {
+            dcb_printf(dcb, "\t\tQueries logged             %ld\n",
+                       atomic_add_int64(&my_instance->n_logged, 0));
+            dcb_printf(dcb, "\t\tQueries dropped            %ld\n",
+                       atomic_add_int64(&my_instance->n_dropped, 0));
+        }
+    }
+    else if (my_session)
     {
         dcb_printf(dcb, "\t\tLogging to file            %s.\n",
                    my_session->filename);
@@ -518,3 +706,317 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
                    my_instance->nomatch);
     }
 }
+
+/**
+ * Copy data into a unified log buffer
+ *
+ * @param buffer    The buffer
+ * @param pos       Position of the data
+ * @param data      The data
+ * @param len       Length of the data
+ */
+static void
+qla_buffer_write(QLA_BUFFER *buffer, int64_t pos, const void *data, size_t len)
+{
+    size_t offset = pos & (buffer->size - 1);
+    size_t first = buffer->size - offset < (int64_t)len ? buffer->size - offset : len;
+
+    memcpy(buffer->data + offset, data, first);
+    memcpy(buffer->data, (const char *)data + first, len - first);
+}
+
+/**
+ * Copy data from a unified log buffer
+ *
+ * @param buffer    The buffer
+ * @param pos       Position of the data
+ * @param dest      Where the data is copied
+ * @param len       Length of the data
+ */
+static void
+qla_buffer_read(QLA_BUFFER *buffer, int64_t pos, void *dest, size_t len)
+{
+    size_t offset = pos & (buffer->size - 1);
+    size_t first = buffer->size - offset < (int64_t)len ? buffer->size - offset : len;
+
+    memcpy(dest, buffer->data + offset, first);
+    memcpy((char *)dest + first, buffer->data, len - first);
+}
+
+/**
+ * Get the unified log buffer of the calling thread
+ *
+ * @param instance  The filter instance
+ * @return The buffer or NULL if memory allocation failed
+ */
+static QLA_BUFFER *
+qla_thread_buffer(QLA_INSTANCE *instance)
+{
+    int i;
+
+    for (i = 0; i < QLA_THREAD_BUFFERS && this_buffers[i].instance; i++)
+    {
+        if (this_buffers[i].instance == instance)
+        {
+            return this_buffers[i].buffer;
+        }
+    }
+
+    pthread_t self = pthread_self();
+    QLA_BUFFER *buffer;
+
+    spinlock_acquire(&instance->lock);
+
+    for (buffer = instance->buffers; buffer && !pthread_equal(buffer->thread, self);
+         buffer = buffer->next)
+    {
+        ;
+    }
+
+    if (buffer == NULL && (buffer = calloc(1, sizeof(QLA_BUFFER))))
+    {
+        if ((buffer->data = malloc(instance->buffer_size)) == NULL)
+        {
+            free(buffer);
+            buffer = NULL;
+        }
+        else
+        {
+            buffer->size = instance->buffer_size;
+            buffer->thread = self;
+            buffer->next = instance->buffers;
+            instance->buffers = buffer;
+        }
+    }
+
+    spinlock_release(&instance->lock);
+
+    if (buffer && i < QLA_THREAD_BUFFERS)
+    {
+        this_buffers[i].instance = instance;
+        this_buffers[i].buffer = buffer;
+    }
+
+    return buffer;
+}
+
+/**
+ * Add a query to the unified log
+ *
+ * The query is dropped if the buffer of the calling thread is full.
+ *
+ * @param instance  The filter instance
+ * @param user      The user of the session
+ * @param remote    The client address of the session
+ * @param sql       The SQL of the query
+ */
+static void
+qla_unified_log(QLA_INSTANCE *instance, const char *user, const char *remote, const char *sql)
+{
+    QLA_BUFFER *buffer = qla_thread_buffer(instance);
+    QLA_RECORD record;
+    size_t user_len = strnlen(user, UINT16_MAX);
+    size_t remote_len = strnlen(remote, UINT16_MAX);
+    size_t sql_len = strlen(sql);
+    size_t size = sizeof(record) + user_len + remote_len + sql_len;
+
+    if (buffer == NULL ||
+        size > buffer->size - (buffer->head - atomic_add_int64(&buffer->tail, 0)))
+    {
+        atomic_add_int64(&instance->n_dropped, 1);
+        return;
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    record.size = size;
+    record.user_len = user_len;
+    record.remote_len = remote_len;
+    record.time_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    int64_t pos = buffer->head;
+    qla_buffer_write(buffer, pos, &record, sizeof(record));
+    pos += sizeof(record);
+    qla_buffer_write(buffer, pos, user, user_len);
+    pos += user_len;
+    qla_buffer_write(buffer, pos, remote, remote_len);
+    pos += remote_len;
+    qla_buffer_write(buffer, pos, sql, sql_len);
+
+    /** Publish the record to the writer thread */
+    atomic_add_int64(&buffer->head, size);
+}
+
+/**
+ * Write one record into the unified log file
+ *
+ * @param instance  The filter instance
+ * @param record    The record followed by its strings
+ */
+static void
+qla_unified_write(QLA_INSTANCE *instance, const QLA_RECORD *record)
+{
+    if (instance->log_format == QLA_FORMAT_BINARY)
+    {
+        fwrite(record, record->size, 1, instance->unified_fp);
+    }
+    else
+    {
+        const char *user = (const char *)(record + 1);
+        const char *remote = user + record->user_len;
+        const char *sql = remote + record->remote_len;
+        int sql_len = record->size - sizeof(*record) - record->user_len - record->remote_len;
+        char buffer[QLA_STRING_BUFFER_SIZE];
+        time_t secs = record->time_us / 1000000;
+        struct tm t;
+
+        localtime_r(&secs, &t);
+        strftime(buffer, sizeof(buffer), "%F %T", &t);
+        fprintf(instance->unified_fp, "%s,%.*s@%.*s,%.*s\n", buffer,
+                (int)record->user_len, user, (int)record->remote_len, remote,
+                sql_len, sql);
+    }
+}
+
+/**
+ * Rotate the unified log file if it has grown over the rotation size
+ *
+ * The current file is renamed by appending a serial number to it and a new
+ * file is opened.
+ *
+ * @param instance  The filter instance
+ */
+static void
+qla_unified_rotate(QLA_INSTANCE *instance)
+{
+    if (instance->rotate_size == 0 || ftell(instance->unified_fp) < instance->rotate_size)
+    {
+        return;
+    }
+
+    char newname[strlen(instance->unified_filename) + 20];
+    sprintf(newname, "%s.%d", instance->unified_filename, ++instance->rotations);
+
+    fclose(instance->unified_fp);
+
+    if (rename(instance->unified_filename, newname) != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("qlafilter: Failed to rename '%s' to '%s': %d, %s",
+                  instance->unified_filename, newname, errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+
+    if ((instance->unified_fp = fopen(instance->unified_filename, "a")) == NULL)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("qlafilter: Failed to open '%s', queries are not logged: %d, %s",
+                  instance->unified_filename, errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+}
+
+/**
+ * The writer thread of the unified log
+ *
+ * @param data  The filter instance
+ */
+static void
+qla_unified_writer(void *data)
+{
+    QLA_INSTANCE *instance = (QLA_INSTANCE *)data;
+    QLA_RECORD *record = malloc(instance->buffer_size);
+
+    if (record == NULL)
+    {
+        MXS_ERROR("qlafilter: Memory allocation failed, queries are not logged.");
+        return;
+    }
+
+    while (true)
+    {
+        bool written = false;
+
+        spinlock_acquire(&instance->lock);
+        QLA_BUFFER *buffer = instance->buffers;
+        spinlock_release(&instance->lock);
+
+        for (; buffer; buffer = buffer->next)
+        {
+            int64_t head = atomic_add_int64(&buffer->head, 0);
+
+            while (buffer->tail < head)
+            {
+                qla_buffer_read(buffer, buffer->tail, record, sizeof(*record));
+                qla_buffer_read(buffer, buffer->tail + sizeof(*record), record + 1,
+                                record->size - sizeof(*record));
+
+                if (instance->unified_fp)
+                {
+                    qla_unified_write(instance, record);
+                    atomic_add_int64(&instance->n_logged, 1);
+                }
+                else
+                {
+                    atomic_add_int64(&instance->n_dropped, 1);
+                }
+
+                atomic_add_int64(&buffer->tail, record->size);
+                written = true;
+            }
+        }
+
+        if (written && instance->unified_fp)
+        {
+            fflush(instance->unified_fp);
+            qla_unified_rotate(instance);
+        }
+
+        thread_millisleep(QLA_WRITER_INTERVAL);
+    }
+}
+
+/**
+ * Open the unified log file and start its writer thread
+ *
+ * @param instance  The filter instance
+ * @return True if the unified log was started
+ */
+static bool
+qla_unified_init(QLA_INSTANCE *instance)
+{
+    THREAD thd;
+
+    if ((instance->unified_filename = malloc(strlen(instance->filebase) + 20)) == NULL)
+    {
+        MXS_ERROR("qlafilter: Memory allocation failed.");
+        return false;
+    }
+
+    sprintf(instance->unified_filename, "%s.unified", instance->filebase);
+
+    if ((instance->unified_fp = fopen(instance->unified_filename, "a")) == NULL)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("qlafilter: Opening output file '%s' failed due to %d, %s",
+                  instance->unified_filename, errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        free(instance->unified_filename);
+        instance->unified_filename = NULL;
+        return false;
+    }
+
+    if (thread_start(&thd, qla_unified_writer, instance) == NULL)
+    {
+        MXS_ERROR("qlafilter: Failed to start the writer thread of '%s'.",
+                  instance->unified_filename);
+        fclose(instance->unified_fp);
+        free(instance->unified_filename);
+        instance->unified_filename = NULL;
+        return false;
+    }
+
+    pthread_detach(thd);
+    return true;
+}
@@ -19,8 +19,9 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <string.h>
-#include <pcre2.h>
+#include <maxscale_pcre2.h>
 #include <atomic.h>
+#include <utils.h>
 #include "maxconfig.h"
 
 /**
@@ -35,8 +36,13 @@
  *      source=<source address to limit filter>
  *      user=<username to limit filter>
  *
- * Date         Who             Description
- * 19/06/2014   Mark Riddoch    Addition of source and user parameters
+ * The results of the rewrites are cached, so a statement that is repeated
+ * is not matched again. The number of cached statements is set with
+ *      cache_size=<number of statements, 0 disables the cache>
+ *
+ * Date         Who                     Description
+ * 19/06/2014   Mark Riddoch            Addition of source and user parameters
+ * 14/10/16     MariaDB Corporation     Cache of the rewrite results
  * @endverbatim
  */
 
@@ -50,6 +56,12 @@ MODULE_INFO info =
 
 static char *version_str = "V1.1.0";
 
+/** The default number of cached statements */
+#define REGEX_CACHE_DEFAULT_SIZE 1024
+
+/** Longer statements are not cached */
+#define REGEX_CACHE_MAX_SQL 4096
+
 static FILTER *createInstance(char **options, FILTER_PARAMETER **params);
 static void *newSession(FILTER *instance, SESSION *session);
 static void closeSession(FILTER *instance, void *session);
@@ -58,7 +70,7 @@ static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstre
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
 
-static char *regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *study,
+static char *regex_replace(const char *sql, int length, pcre2_code *re,
                            const char *replace);
 
 static FILTER_OBJECT MyObject =
@@ -74,6 +86,18 @@ static FILTER_OBJECT MyObject =
     diagnostic,
 };
 
+/**
+ * A cached rewrite result
+ */
+typedef struct
+{
+    SPINLOCK lock;
+    uint64_t hash;   /*< Hash of the statement */
+    char    *sql;    /*< The statement, not null terminated, NULL if unused */
+    int      length; /*< Length of the statement */
+    char    *newsql; /*< The rewritten statement, NULL if there was no match */
+} REGEX_CACHE_SLOT;
+
 /**
  * Instance structure
  */
@@ -84,9 +108,12 @@ typedef struct
     char *match; /*< Regular expression to match */
     char *replace; /*< Replacement text */
     pcre2_code *re; /*< Compiled regex text */
-    pcre2_match_data *match_data; /*< Matching data used by the compiled regex */
     FILE* logfile; /*< Log file */
     bool log_trace; /*< Whether messages should be printed to tracelog */
+    REGEX_CACHE_SLOT *cache; /*< The rewrite results, NULL if not cached */
+    size_t cache_size; /*< Number of slots, a power of two */
+    int cache_hits; /*< Statements found in the cache */
+    int cache_misses; /*< Statements matched with the regex */
 } REGEX_INSTANCE;
 
 /**
@@ -101,8 +128,12 @@ typedef struct
     int active; /* Is filter active */
 } REGEX_SESSION;
 
-void log_match(REGEX_INSTANCE* inst, char* re, char* old, char* new);
-void log_nomatch(REGEX_INSTANCE* inst, char* re, char* old);
+static bool regex_cache_get(REGEX_INSTANCE *inst, const char *sql, int length,
+                            char **newsql);
+static void regex_cache_put(REGEX_INSTANCE *inst, const char *sql, int length,
+                            const char *newsql);
+void log_match(REGEX_INSTANCE* inst, char* re, const char* old, int old_len, char* new);
+void log_nomatch(REGEX_INSTANCE* inst, char* re, const char* old, int old_len);
 
 /**
  * Implementation of the mandatory version entry point
@@ -154,11 +185,13 @@ void free_instance(REGEX_INSTANCE *instance)
             pcre2_code_free(instance->re);
         }
 
-        if (instance->match_data)
+        for (size_t i = 0; instance->cache && i < instance->cache_size; i++)
         {
-            pcre2_match_data_free(instance->match_data);
+            free(instance->cache[i].sql);
+            free(instance->cache[i].newsql);
         }
 
+        free(instance->cache);
         free(instance->match);
         free(instance->replace);
         free(instance->source);
@@ -180,10 +213,10 @@ static FILTER *
 createInstance(char **options, FILTER_PARAMETER **params)
 {
     REGEX_INSTANCE *my_instance;
-    int i, errnumber, cflags = PCRE2_CASELESS;
-    PCRE2_SIZE erroffset;
+    int i, cflags = PCRE2_CASELESS;
     char *logfile = NULL;
     const char *errmsg;
+    int cache_size = REGEX_CACHE_DEFAULT_SIZE;
 
     if ((my_instance = calloc(1, sizeof(REGEX_INSTANCE))) != NULL)
     {
@@ -212,6 +245,19 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 my_instance->log_trace = config_truth_value(params[i]->value);
             }
+            else if (!strcmp(params[i]->name, "cache_size"))
+            {
+                char *end;
+                cache_size = strtol(params[i]->value, &end, 10);
+
+                if (*end != '\0' || cache_size < 0)
+                {
+                    MXS_ERROR("regexfilter: Invalid value '%s' for 'cache_size', "
+                              "using the default of %d.", params[i]->value,
+                              REGEX_CACHE_DEFAULT_SIZE);
+                    cache_size = REGEX_CACHE_DEFAULT_SIZE;
+                }
+            }
             else if (!strcmp(params[i]->name, "log_file"))
             {
                 if (logfile)
@@ -268,28 +314,33 @@ createInstance(char **options, FILTER_PARAMETER **params)
             return NULL;
         }
 
-        if ((my_instance->re = pcre2_compile((PCRE2_SPTR) my_instance->match,
-                                             PCRE2_ZERO_TERMINATED,
-                                             cflags,
-                                             &errnumber,
-                                             &erroffset,
-                                             NULL)) == NULL)
+        if ((my_instance->re = mxs_pcre2_compile(my_instance->match, cflags)) == NULL)
         {
-            char errbuffer[1024];
-            pcre2_get_error_message(errnumber, (PCRE2_UCHAR*) & errbuffer, sizeof(errbuffer));
-            MXS_ERROR("regexfilter: Compiling regular expression '%s' failed at %lu: %s",
-                      my_instance->match, erroffset, errbuffer);
             free_instance(my_instance);
             return NULL;
         }
 
-        if ((my_instance->match_data =
-                 pcre2_match_data_create_from_pattern(my_instance->re, NULL)) == NULL)
+        if (cache_size > 0)
         {
-            MXS_ERROR("regexfilter: Failure to create PCRE2 matching data. "
-                      "This is most likely caused by a lack of available memory.");
-            free_instance(my_instance);
-            return NULL;
+            /** Round up to a power of two so that the hash can be masked */
+            my_instance->cache_size = 1;
+            while (my_instance->cache_size < (size_t)cache_size)
+            {
+                my_instance->cache_size <<= 1;
+            }
+
+            my_instance->cache = calloc(my_instance->cache_size, sizeof(REGEX_CACHE_SLOT));
+
+            if (my_instance->cache == NULL)
+            {
+                free_instance(my_instance);
+                return NULL;
+            }
+
+            for (size_t j = 0; j < my_instance->cache_size; j++)
+            {
+                spinlock_init(&my_instance->cache[j].lock);
+            }
         }
     }
     return (FILTER *) my_instance;
@@ -387,7 +438,9 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 {
     REGEX_INSTANCE *my_instance = (REGEX_INSTANCE *) instance;
     REGEX_SESSION *my_session = (REGEX_SESSION *) session;
-    char *sql, *newsql;
+    const char *sql;
+    char *newsql;
+    int length;
 
     if (my_session->active && modutil_is_SQL(queue))
     {
@@ -395,30 +448,34 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
         {
             queue = gwbuf_make_contiguous(queue);
         }
-        if ((sql = modutil_get_SQL(queue)) != NULL)
+        if (modutil_get_SQL_view(queue, &sql, &length))
         {
-            newsql = regex_replace(sql,
-                                   my_instance->re,
-                                   my_instance->match_data,
-                                   my_instance->replace);
+            if (!regex_cache_get(my_instance, sql, length, &newsql))
+            {
+                newsql = regex_replace(sql, length,
+                                       my_instance->re,
+                                       my_instance->replace);
+                regex_cache_put(my_instance, sql, length, newsql);
+            }
+
             if (newsql)
             {
-                queue = modutil_replace_SQL(queue, newsql);
-                queue = gwbuf_make_contiguous(queue);
+                /** The old statement is logged before it is replaced */
                 spinlock_acquire(&my_session->lock);
-                log_match(my_instance, my_instance->match, sql, newsql);
+                log_match(my_instance, my_instance->match, sql, length, newsql);
                 spinlock_release(&my_session->lock);
+                queue = modutil_replace_SQL(queue, newsql);
+                queue = gwbuf_make_contiguous(queue);
                 free(newsql);
                 my_session->replacements++;
             }
             else
             {
                 spinlock_acquire(&my_session->lock);
-                log_nomatch(my_instance, my_instance->match, sql);
+                log_nomatch(my_instance, my_instance->match, sql, length);
                 spinlock_release(&my_session->lock);
                 my_session->no_change++;
             }
-            free(sql);
         }
 
     }
@@ -452,6 +509,19 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         dcb_printf(dcb, "\t\tNo. of queries altered by filter:      %d\n",
                    my_session->replacements);
     }
+    if (my_instance->cache)
+    {
+        int hits = my_instance->cache_hits;
+        int total = hits + my_instance->cache_misses;
+
+        dcb_printf(dcb, "\t\tRewrite cache size:                    %lu\n",
+                   (unsigned long)my_instance->cache_size);
+        dcb_printf(dcb, "\t\tRewrite cache hits:                    %d\n", hits);
+        dcb_printf(dcb, "\t\tRewrite cache misses:                  %d\n",
+                   my_instance->cache_misses);
+        dcb_printf(dcb, "\t\tRewrite cache hit rate:                %.1f%%\n",
+                   total ? 100.0 * hits / total : 0.0);
+    }
     if (my_instance->source)
     {
         dcb_printf(dcb,
@@ -469,26 +539,30 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
 /**
  * Perform a regular expression match and substitution on the SQL
  *
- * @param   sql The original SQL text
+ * @param   sql The original SQL text, not null terminated
+ * @param   length Length of the SQL text
  * @param   re  The compiled regular expression
- * @param   match_data The PCRE2 matching data buffer
  * @param   replace The replacement text
  * @return  The replaced text or NULL if no replacement was done.
  */
 static char *
-regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *match_data, const char *replace)
+regex_replace(const char *sql, int length, pcre2_code *re, const char *replace)
 {
     char *result = NULL;
     size_t result_size;
+    /** The matching data is private to this thread so that the sessions of
+     * different threads can be processed in parallel */
+    pcre2_match_data *match_data = mxs_pcre2_thread_match_data(re);
 
-    /** This should never fail with rc == 0 because we used pcre2_match_data_create_from_pattern() */
-    if (pcre2_match(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0, 0, match_data, NULL) > 0)
+    /** This should never fail with rc == 0 because the matching data has room
+     * for all the captured substrings of the pattern */
+    if (match_data && pcre2_match(re, (PCRE2_SPTR) sql, length, 0, 0, match_data, NULL) > 0)
     {
-        result_size = strlen(sql) + strlen(replace);
+        result_size = length + strlen(replace);
         result = malloc(result_size);
 
         while (result &&
-               pcre2_substitute(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0,
+               pcre2_substitute(re, (PCRE2_SPTR) sql, length, 0,
                                 PCRE2_SUBSTITUTE_GLOBAL, match_data, NULL,
                                 (PCRE2_SPTR) replace, PCRE2_ZERO_TERMINATED,
                                 (PCRE2_UCHAR*) result, (PCRE2_SIZE*) & result_size) == PCRE2_ERROR_NOMEMORY)
@@ -505,24 +579,120 @@ regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *match_data, con
     return result;
 }
 
+/**
+ * Calculate the hash of a statement, FNV-1a
+ *
+ * @param sql The statement, not null terminated
+ * @param length Length of the statement
+ * @return The hash
+ */
+static uint64_t
+regex_cache_hash(const char *sql, int length)
+{
+    return mxs_fnv1a64(MXS_FNV1A64_INIT, sql, length);
+}
+
+/**
+ * Look up the rewrite result of a statement
+ *
+ * @param inst Regex filter instance
+ * @param sql The statement, not null terminated
+ * @param length Length of the statement
+ * @param newsql A copy of the rewritten statement is stored here, NULL if the
+ * statement did not match
+ * @return True if the statement was in the cache
+ */
+static bool
+regex_cache_get(REGEX_INSTANCE *inst, const char *sql, int length, char **newsql)
+{
+    if (inst->cache == NULL || length > REGEX_CACHE_MAX_SQL)
+    {
+        return false;
+    }
+
+    uint64_t hash = regex_cache_hash(sql, length);
+    REGEX_CACHE_SLOT *slot = &inst->cache[hash & (inst->cache_size - 1)];
+    bool found = false;
+
+    spinlock_acquire(&slot->lock);
+
+    if (slot->sql && slot->hash == hash && slot->length == length &&
+        memcmp(slot->sql, sql, length) == 0)
+    {
+        *newsql = slot->newsql ? strdup(slot->newsql) : NULL;
+        found = slot->newsql == NULL || *newsql != NULL;
+    }
+
+    spinlock_release(&slot->lock);
+
+    atomic_add(found ? &inst->cache_hits : &inst->cache_misses, 1);
+    return found;
+}
+
+/**
+ * Store the rewrite result of a statement. The statement that used the same
+ * slot before is replaced.
+ *
+ * @param inst Regex filter instance
+ * @param sql The statement, not null terminated
+ * @param length Length of the statement
+ * @param newsql The rewritten statement, NULL if the statement did not match
+ */
+static void
+regex_cache_put(REGEX_INSTANCE *inst, const char *sql, int length, const char *newsql)
+{
+    if (inst->cache == NULL || length > REGEX_CACHE_MAX_SQL)
+    {
+        return;
+    }
+
+    char *sql_copy = malloc(length);
+    char *new_copy = newsql ? strdup(newsql) : NULL;
+
+    if (sql_copy == NULL || (newsql && new_copy == NULL))
+    {
+        free(sql_copy);
+        free(new_copy);
+        return;
+    }
+
+    memcpy(sql_copy, sql, length);
+
+    uint64_t hash = regex_cache_hash(sql, length);
+    REGEX_CACHE_SLOT *slot = &inst->cache[hash & (inst->cache_size - 1)];
+
+    spinlock_acquire(&slot->lock);
+    char *old_sql = slot->sql;
+    char *old_new = slot->newsql;
+    slot->hash = hash;
+    slot->sql = sql_copy;
+    slot->length = length;
+    slot->newsql = new_copy;
+    spinlock_release(&slot->lock);
+
+    free(old_sql);
+    free(old_new);
+}
+
 /**
  * Log a matching query to either MaxScale's trace log or a separate log file.
  * The old SQL and the new SQL statements are printed in the log.
  * @param inst Regex filter instance
  * @param re Regular expression
- * @param old Old SQL statement
+ * @param old Old SQL statement, not null terminated
+ * @param old_len Length of the old SQL statement
  * @param new New SQL statement
  */
-void log_match(REGEX_INSTANCE* inst, char* re, char* old, char* new)
+void log_match(REGEX_INSTANCE* inst, char* re, const char* old, int old_len, char* new)
 {
     if (inst->logfile)
     {
-        fprintf(inst->logfile, "Matched %s: [%s] -> [%s]\n", re, old, new);
+        fprintf(inst->logfile, "Matched %s: [%.*s] -> [%s]\n", re, old_len, old, new);
         fflush(inst->logfile);
     }
     if (inst->log_trace)
     {
-        MXS_INFO("Match %s: [%s] -> [%s]", re, old, new);
+        MXS_INFO("Match %s: [%.*s] -> [%s]", re, old_len, old, new);
     }
 }
 
@@ -530,17 +700,18 @@ void log_match(REGEX_INSTANCE* inst, char* re, char* old, char* new)
  * Log a non-matching query to either MaxScale's trace log or a separate log file.
  * @param inst Regex filter instance
  * @param re Regular expression
- * @param old SQL statement
+ * @param old SQL statement, not null terminated
+ * @param old_len Length of the SQL statement
  */
-void log_nomatch(REGEX_INSTANCE* inst, char* re, char* old)
+void log_nomatch(REGEX_INSTANCE* inst, char* re, const char* old, int old_len)
 {
     if (inst->logfile)
     {
-        fprintf(inst->logfile, "No match %s: [%s]\n", re, old);
+        fprintf(inst->logfile, "No match %s: [%.*s]\n", re, old_len, old);
         fflush(inst->logfile);
     }
     if (inst->log_trace)
     {
-        MXS_INFO("No match %s: [%s]", re, old);
+        MXS_INFO("No match %s: [%.*s]", re, old_len, old);
     }
 }
@@ -19,7 +19,7 @@
 #include <string.h>
 #include <hint.h>
 #include <query_classifier.h>
-#include <regex.h>
+#include <maxscale_pcre2.h>
 
 /**
  * @file slavelag.c - a very simple filter designed to send queries to the
@@ -97,8 +97,8 @@ typedef struct
     int count;       /*< Number of hints to add after each operation
                      * that modifies data. */
     LAGSTATS stats;
-    regex_t re;      /* Compiled regex text of match */
-    regex_t nore;    /* Compiled regex text of ignore */
+    pcre2_code *re;      /* Compiled regex text of match */
+    pcre2_code *nore;    /* Compiled regex text of ignore */
 } LAG_INSTANCE;
 
 /**
@@ -163,7 +163,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
 {
     LAG_INSTANCE *my_instance;
     int i;
-    int cflags = 0;
+    int cflags = PCRE2_DOTALL;
 
     if ((my_instance = calloc(1, sizeof(LAG_INSTANCE))) != NULL)
     {
@@ -205,11 +205,11 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 if (!strcasecmp(options[i], "ignorecase"))
                 {
-                    cflags |= REG_ICASE;
+                    cflags |= PCRE2_CASELESS;
                 }
                 else if (!strcasecmp(options[i], "case"))
                 {
-                    cflags &= ~REG_ICASE;
+                    cflags &= ~PCRE2_CASELESS;
                 }
                 else
                 {
@@ -220,7 +220,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
         if (my_instance->match)
         {
-            if (regcomp(&my_instance->re, my_instance->match, cflags))
+            if ((my_instance->re = mxs_pcre2_compile(my_instance->match, cflags)) == NULL)
             {
                 MXS_ERROR("lagfilter: Failed to compile regex '%s'.", my_instance->match);
             }
@@ -228,7 +228,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
         if (my_instance->nomatch)
         {
-            if (regcomp(&my_instance->nore, my_instance->nomatch, cflags))
+            if ((my_instance->nore = mxs_pcre2_compile(my_instance->nomatch, cflags)) == NULL)
             {
                 MXS_ERROR("lagfilter: Failed to compile regex '%s'.", my_instance->nomatch);
             }
@@ -320,7 +320,8 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 {
     LAG_INSTANCE *my_instance = (LAG_INSTANCE *)instance;
     LAG_SESSION  *my_session = (LAG_SESSION *)session;
-    char *sql;
+    const char *sql;
+    int length;
     time_t now = time(NULL);
 
     if (modutil_is_SQL(queue))
@@ -332,21 +333,19 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 
         if (qc_get_operation(queue) & (QUERY_OP_DELETE | QUERY_OP_INSERT | QUERY_OP_UPDATE))
         {
-            if ((sql = modutil_get_SQL(queue)) != NULL)
+            if (modutil_get_SQL_view(queue, &sql, &length))
             {
                 if (my_instance->nomatch == NULL ||
-                    (my_instance->nomatch && regexec(&my_instance->nore, sql, 0, NULL, 0) != 0))
+                    (my_instance->nomatch && !mxs_pcre2_match(my_instance->nore, sql, length)))
                 {
                     if (my_instance->match == NULL ||
-                        (my_instance->match && regexec(&my_instance->re, sql, 0, NULL, 0) == 0))
+                        (my_instance->match && mxs_pcre2_match(my_instance->re, sql, length)))
                     {
                         my_session->hints_left = my_instance->count;
                         my_session->last_modification = now;
                         my_instance->stats.n_modified++;
                     }
                 }
-
-                free(sql);
             }
         }
         else if (my_session->hints_left > 0)
@@ -29,6 +29,11 @@
  *          of the request (optional)
  * user     A user name to match against. If present only requests that
  *          originate from this user will be duplciated (optional)
+ * mode     Either sync or async. In async mode the duplicates are queued
+ *          for the branch and its replies are discarded (optional)
+ * queue_size   Maximum number of queued duplicates in async mode (optional)
+ * drop_policy  Either newest or oldest, the duplicate that is dropped when
+ *          the queue is full (optional)
  *
  * Revision History
  * ================
@@ -37,6 +42,7 @@
  * 20/06/2014   Mark Riddoch    Initial implementation
  * 24/06/2014   Mark Riddoch    Addition of support for multi-packet queries
  * 12/12/2014   Mark Riddoch    Add support for otehr packet types
+ * 14/10/2016   MariaDB Corporation Add the asynchronous mode
  *
  * @endverbatim
  */
@@ -49,8 +55,9 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <sys/time.h>
-#include <regex.h>
+#include <maxscale_pcre2.h>
 #include <string.h>
+#include <limits.h>
 #include <service.h>
 #include <router.h>
 #include <dcb.h>
@@ -74,6 +81,7 @@
 #define REPLY_TIMEOUT_MILLISECOND       1
 #define PARENT                          0
 #define CHILD                           1
+#define TEE_DEFAULT_QUEUE_SIZE          100
 
 #ifdef SS_DEBUG
 static int debug_seq = 0;
@@ -139,11 +147,36 @@ typedef struct
     char *source; /* The source of the client connection */
     char *userName; /* The user name to filter on */
     char *match; /* Optional text to match against */
-    regex_t re; /* Compiled regex text */
+    pcre2_code *re; /* Compiled regex text */
     char *nomatch; /* Optional text to match against for exclusion */
-    regex_t nore; /* Compiled regex nomatch text */
+    pcre2_code *nore; /* Compiled regex nomatch text */
+    bool async; /* Queue the duplicates and discard the replies of the branch */
+    int queue_size; /* Maximum number of queued duplicates in async mode */
+    bool drop_oldest; /* Drop the oldest duplicate when the queue is full */
+    int n_dropped; /* Number of dropped duplicates of all sessions */
 } TEE_INSTANCE;
 
+/**
+ * The state of the reply of the branch in async mode
+ */
+typedef enum
+{
+    BRANCH_REPLY_FIRST, /* Waiting for the first packet of a result */
+    BRANCH_REPLY_COLUMNS, /* Reading the column definitions */
+    BRANCH_REPLY_ROWS, /* Reading the rows */
+    BRANCH_REPLY_PREPARE /* Reading the definitions of a prepared statement */
+} branch_reply_t;
+
+/**
+ * A duplicate that is queued for the branch in async mode
+ */
+typedef struct tee_query_t
+{
+    GWBUF *buffer; /* The duplicate */
+    bool required; /* The duplicate keeps the branch consistent and is never dropped */
+    struct tee_query_t *next;
+} TEE_QUERY;
+
 /**
  * The session structure for this TEE filter.
  * This stores the downstream filter information, such that the
@@ -177,6 +210,15 @@ typedef struct
     GWBUF* queue;
     SPINLOCK tee_lock;
     DCB* client_dcb;
+    TEE_QUERY *branch_queue; /* Duplicates waiting for the branch in async mode */
+    TEE_QUERY *branch_queue_tail; /* Last queued duplicate */
+    int branch_queue_len; /* Number of queued duplicates */
+    int branch_queue_max; /* Highest number of queued duplicates */
+    bool branch_busy; /* The branch has not yet replied to the last duplicate */
+    unsigned char branch_command; /* Command of the last duplicate */
+    branch_reply_t branch_reply; /* State of the reply of the branch */
+    int branch_eof; /* EOF packets left in a prepared statement reply */
+    int n_dropped; /* Number of dropped duplicates */
 
 #ifdef SS_DEBUG
     long d_id;
@@ -206,8 +248,14 @@ int route_single_query(TEE_INSTANCE* my_instance,
                        TEE_SESSION* my_session,
                        GWBUF* buffer,
                        GWBUF* clone);
+int route_async_query(TEE_INSTANCE* my_instance,
+                      TEE_SESSION* my_session,
+                      GWBUF* buffer,
+                      GWBUF* clone);
 int reset_session_state(TEE_SESSION* my_session, GWBUF* buffer);
 void create_orphan(SESSION* ses);
+static void branch_reply(TEE_SESSION* my_session, GWBUF* reply);
+static void branch_queue_free(TEE_SESSION* my_session);
 
 static void
 orphan_free(void* data)
@@ -370,6 +418,9 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->userName = NULL;
         my_instance->match = NULL;
         my_instance->nomatch = NULL;
+        my_instance->queue_size = TEE_DEFAULT_QUEUE_SIZE;
+        bool error = false;
+
         if (params)
         {
             for (i = 0; params[i]; i++)
@@ -398,6 +449,48 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 {
                     my_instance->userName = strdup(params[i]->value);
                 }
+                else if (!strcmp(params[i]->name, "mode"))
+                {
+                    if (!strcasecmp(params[i]->value, "async"))
+                    {
+                        my_instance->async = true;
+                    }
+                    else if (strcasecmp(params[i]->value, "sync"))
+                    {
+                        MXS_ERROR("tee: Unknown mode '%s', expected 'sync' or 'async'.",
+                                  params[i]->value);
+                        error = true;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "queue_size"))
+                {
+                    char *end;
+                    long size = strtol(params[i]->value, &end, 10);
+
+                    if (*end != '\0' || size <= 0 || size > INT_MAX)
+                    {
+                        MXS_ERROR("tee: Invalid value for queue_size: %s",
+                                  params[i]->value);
+                        error = true;
+                    }
+                    else
+                    {
+                        my_instance->queue_size = size;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "drop_policy"))
+                {
+                    if (!strcasecmp(params[i]->value, "oldest"))
+                    {
+                        my_instance->drop_oldest = true;
+                    }
+                    else if (strcasecmp(params[i]->value, "newest"))
+                    {
+                        MXS_ERROR("tee: Unknown drop_policy '%s', expected 'newest' or 'oldest'.",
+                                  params[i]->value);
+                        error = true;
+                    }
+                }
                 else if (!filter_standard_parameter(params[i]->name))
                 {
                     MXS_ERROR("tee: Unexpected parameter '%s'.",
@@ -406,7 +499,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
             }
         }
 
-        int cflags = REG_ICASE;
+        int cflags = PCRE2_CASELESS | PCRE2_DOTALL;
 
         if (options)
         {
@@ -414,15 +507,15 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 if (!strcasecmp(options[i], "ignorecase"))
                 {
-                    cflags |= REG_ICASE;
+                    cflags |= PCRE2_CASELESS;
                 }
                 else if (!strcasecmp(options[i], "case"))
                 {
-                    cflags &= ~REG_ICASE;
+                    cflags &= ~PCRE2_CASELESS;
                 }
                 else if (!strcasecmp(options[i], "extended"))
                 {
-                    cflags |= REG_EXTENDED;
+                    /** The PCRE2 syntax is a superset of the extended syntax */
                 }
                 else
                 {
@@ -432,16 +525,18 @@ createInstance(char **options, FILTER_PARAMETER **params)
             }
         }
 
-        if (my_instance->service == NULL)
+        if (my_instance->service == NULL || error)
         {
             free(my_instance->match);
+            free(my_instance->nomatch);
+            free(my_instance->userName);
             free(my_instance->source);
             free(my_instance);
             return NULL;
         }
 
         if (my_instance->match &&
-            regcomp(&my_instance->re, my_instance->match, cflags))
+            (my_instance->re = mxs_pcre2_compile(my_instance->match, cflags)) == NULL)
         {
             MXS_ERROR("tee: Invalid regular expression '%s'"
                       " for the match parameter.",
@@ -453,14 +548,14 @@ createInstance(char **options, FILTER_PARAMETER **params)
             return NULL;
         }
         if (my_instance->nomatch &&
-            regcomp(&my_instance->nore, my_instance->nomatch, cflags))
+            (my_instance->nore = mxs_pcre2_compile(my_instance->nomatch, cflags)) == NULL)
         {
             MXS_ERROR("tee: Invalid regular expression '%s'"
                       " for the nomatch paramter.\n",
                       my_instance->nomatch);
             if (my_instance->match)
             {
-                regfree(&my_instance->re);
+                pcre2_code_free(my_instance->re);
                 free(my_instance->match);
             }
             free(my_instance->nomatch);
@@ -724,6 +819,7 @@ freeSession(FILTER *instance, void *session)
     {
         gwbuf_free(my_session->tee_replybuf);
     }
+    branch_queue_free(my_session);
     free(session);
 
     orphan_free(NULL);
@@ -836,7 +932,14 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 
     /** Route query downstream */
     spinlock_acquire(&my_session->tee_lock);
-    rval = route_single_query(my_instance, my_session, buffer, clone);
+    if (my_instance->async)
+    {
+        rval = route_async_query(my_instance, my_session, buffer, clone);
+    }
+    else
+    {
+        rval = route_single_query(my_instance, my_session, buffer, clone);
+    }
     spinlock_release(&my_session->tee_lock);
 
     return rval;
@@ -957,6 +1060,14 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
 
     branch = instance == NULL ? CHILD : PARENT;
 
+    if (branch == CHILD && my_session->instance->async)
+    {
+        /** The replies of the branch are not sent to the client */
+        branch_reply(my_session, reply);
+        spinlock_release(&my_session->tee_lock);
+        return 1;
+    }
+
     my_session->tee_partials[branch] = gwbuf_append(my_session->tee_partials[branch], reply);
     my_session->tee_partials[branch] = gwbuf_make_contiguous(my_session->tee_partials[branch]);
     complete = modutil_get_complete_packets(&my_session->tee_partials[branch]);
@@ -1063,8 +1174,17 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
         GWBUF* buffer = modutil_get_next_MySQL_packet(&my_session->queue);
         GWBUF* clone = clone_query(my_session->instance, my_session, buffer);
         reset_session_state(my_session, buffer);
-        spinlock_release(&my_session->tee_lock);
         MXS_INFO("tee: routing queued query");
+
+        if (my_session->instance->async)
+        {
+            /** The branch is routed to with the lock held */
+            rc = route_async_query(my_session->instance, my_session, buffer, clone);
+            spinlock_release(&my_session->tee_lock);
+            return rc;
+        }
+
+        spinlock_release(&my_session->tee_lock);
         return route_single_query(my_session->instance, my_session, buffer, clone);
     }
 
@@ -1111,12 +1231,27 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         dcb_printf(dcb, "\t\tExclude queries that match		%s\n",
                    my_instance->nomatch);
     }
+    if (my_instance->async)
+    {
+        dcb_printf(dcb, "\t\tAsynchronous mode, drop the %s of	%d queued statements\n",
+                   my_instance->drop_oldest ? "oldest" : "newest",
+                   my_instance->queue_size);
+        dcb_printf(dcb, "\t\tNo. of dropped statements:		%d\n",
+                   my_instance->n_dropped);
+    }
     if (my_session)
     {
         dcb_printf(dcb, "\t\tNo. of statements duplicated:	%d.\n",
                    my_session->n_duped);
         dcb_printf(dcb, "\t\tNo. of statements rejected:	%d.\n",
                    my_session->n_rejected);
+        if (my_instance->async)
+        {
+            dcb_printf(dcb, "\t\tNo. of statements dropped:	%d.\n",
+                       my_session->n_dropped);
+            dcb_printf(dcb, "\t\tNo. of queued statements:	%d (max %d).\n",
+                       my_session->branch_queue_len, my_session->branch_queue_max);
+        }
     }
 }
 
@@ -1241,9 +1376,9 @@ GWBUF* clone_query(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* bu
         else if (my_session->active && (ptr = modutil_get_SQL(buffer)) != NULL)
         {
             if ((my_instance->match == NULL ||
-                 regexec(&my_instance->re, ptr, 0, NULL, 0) == 0) &&
+                 mxs_pcre2_match(my_instance->re, ptr, PCRE2_ZERO_TERMINATED)) &&
                 (my_instance->nomatch == NULL ||
-                 regexec(&my_instance->nore, ptr, 0, NULL, 0) != 0))
+                 !mxs_pcre2_match(my_instance->nore, ptr, PCRE2_ZERO_TERMINATED)))
             {
                 clone = gwbuf_clone_all(buffer);
                 my_session->residual = residual;
@@ -1313,6 +1448,307 @@ int route_single_query(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF
     return rval;
 }
 
+/**
+ * Free the duplicates that are queued for the branch
+ * @param my_session Tee session
+ */
+static void branch_queue_free(TEE_SESSION* my_session)
+{
+    while (my_session->branch_queue)
+    {
+        TEE_QUERY *query = my_session->branch_queue;
+        my_session->branch_queue = query->next;
+        gwbuf_free(query->buffer);
+        free(query);
+    }
+
+    my_session->branch_queue_tail = NULL;
+    my_session->branch_queue_len = 0;
+}
+
+/**
+ * Count a dropped duplicate
+ * @param my_instance Tee instance
+ * @param my_session Tee session
+ */
+static void branch_count_drop(TEE_INSTANCE* my_instance, TEE_SESSION* my_session)
+{
+    my_session->n_dropped++;
+    atomic_add(&my_instance->n_dropped, 1);
+}
+
+/**
+ * Send the queued duplicates to the branch until one of them has a reply
+ *
+ * The caller must hold the lock of the session.
+ *
+ * @param my_instance Tee instance
+ * @param my_session Tee session
+ */
+static void branch_send_next(TEE_INSTANCE* my_instance, TEE_SESSION* my_session)
+{
+    while (!my_session->branch_busy && my_session->branch_queue)
+    {
+        TEE_QUERY *query = my_session->branch_queue;
+        GWBUF *buffer = query->buffer;
+
+        if ((my_session->branch_queue = query->next) == NULL)
+        {
+            my_session->branch_queue_tail = NULL;
+        }
+        my_session->branch_queue_len--;
+        free(query);
+
+        if (my_session->branch_session &&
+            my_session->branch_session->state == SESSION_STATE_ROUTER_READY)
+        {
+            unsigned char command = GWBUF_LENGTH(buffer) > 4 ?
+                                    *((unsigned char*) buffer->start + 4) : 0;
+
+            my_session->branch_command = command;
+            my_session->branch_reply = BRANCH_REPLY_FIRST;
+            /** These commands have no reply */
+            my_session->branch_busy = command != MYSQL_COM_QUIT &&
+                                      command != MYSQL_COM_STMT_SEND_LONG_DATA &&
+                                      command != MYSQL_COM_STMT_CLOSE;
+            SESSION_ROUTE_QUERY(my_session->branch_session, buffer);
+        }
+        else
+        {
+            gwbuf_free(buffer);
+            branch_count_drop(my_instance, my_session);
+        }
+    }
+}
+
+/**
+ * Queue a duplicate for the branch
+ *
+ * If the queue is full, either the new duplicate or the oldest queued one that
+ * can be dropped is dropped. The duplicates that keep the state of the branch
+ * session consistent are never dropped.
+ *
+ * @param my_instance Tee instance
+ * @param my_session Tee session
+ * @param clone The duplicate
+ */
+static void branch_queue_push(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* clone)
+{
+    bool required = packet_is_required(clone);
+
+    if (my_session->branch_queue_len >= my_instance->queue_size)
+    {
+        if (my_instance->drop_oldest)
+        {
+            TEE_QUERY *prev = NULL, *query = my_session->branch_queue;
+
+            while (query && query->required)
+            {
+                prev = query;
+                query = query->next;
+            }
+
+            if (query)
+            {
+                if (prev)
+                {
+                    prev->next = query->next;
+                }
+                else
+                {
+                    my_session->branch_queue = query->next;
+                }
+
+                if (my_session->branch_queue_tail == query)
+                {
+                    my_session->branch_queue_tail = prev;
+                }
+
+                my_session->branch_queue_len--;
+                gwbuf_free(query->buffer);
+                free(query);
+                branch_count_drop(my_instance, my_session);
+            }
+        }
+        else if (!required)
+        {
+            gwbuf_free(clone);
+            branch_count_drop(my_instance, my_session);
+            return;
+        }
+    }
+
+    TEE_QUERY *query = malloc(sizeof(TEE_QUERY));
+
+    if (query == NULL)
+    {
+        gwbuf_free(clone);
+        branch_count_drop(my_instance, my_session);
+        return;
+    }
+
+    query->buffer = clone;
+    query->required = required;
+    query->next = NULL;
+
+    if (my_session->branch_queue_tail)
+    {
+        my_session->branch_queue_tail->next = query;
+    }
+    else
+    {
+        my_session->branch_queue = query;
+    }
+
+    my_session->branch_queue_tail = query;
+    my_session->branch_queue_len++;
+
+    if (my_session->branch_queue_len > my_session->branch_queue_max)
+    {
+        my_session->branch_queue_max = my_session->branch_queue_len;
+    }
+}
+
+/**
+ * Route the main query downstream and queue the clone for the branch session
+ *
+ * The client does not wait for the branch. A branch that is not ready only
+ * causes the clones to be dropped, the main session is not affected.
+ *
+ * @param my_instance Tee instance
+ * @param my_session Tee session
+ * @param buffer Main buffer
+ * @param clone Cloned buffer or NULL if nothing is sent to the branch
+ * @return 1 on success, 0 on failure.
+ */
+int route_async_query(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* buffer, GWBUF* clone)
+{
+    /** The reply to the client is never held back for the branch */
+    my_session->waiting[CHILD] = false;
+    my_session->multipacket[CHILD] = false;
+    my_session->eof[CHILD] = 2;
+
+    if (clone)
+    {
+        my_session->n_duped++;
+        branch_queue_push(my_instance, my_session, clone);
+        branch_send_next(my_instance, my_session);
+    }
+    else
+    {
+        my_session->n_rejected++;
+    }
+
+    return my_session->down.routeQuery(my_session->down.instance,
+                                       my_session->down.session,
+                                       buffer);
+}
+
+/**
+ * Process a reply of the branch in async mode
+ *
+ * The reply is discarded. When the reply is complete the next queued duplicate
+ * is sent to the branch. The caller must hold the lock of the session.
+ *
+ * @param my_session Tee session
+ * @param reply Reply from the branch
+ */
+static void branch_reply(TEE_SESSION* my_session, GWBUF* reply)
+{
+    my_session->tee_partials[CHILD] = gwbuf_append(my_session->tee_partials[CHILD], reply);
+    my_session->tee_partials[CHILD] = gwbuf_make_contiguous(my_session->tee_partials[CHILD]);
+    GWBUF *complete = modutil_get_complete_packets(&my_session->tee_partials[CHILD]);
+
+    if (complete == NULL)
+    {
+        return;
+    }
+
+    complete = gwbuf_make_contiguous(complete);
+    uint8_t *ptr = (uint8_t*) complete->start;
+    uint8_t *end = (uint8_t*) complete->end;
+
+    while (my_session->branch_busy && ptr + 4 < end)
+    {
+        bool done = false;
+
+        switch (my_session->branch_reply)
+        {
+        case BRANCH_REPLY_FIRST:
+            if (PTR_IS_OK(ptr) && my_session->branch_command == MYSQL_COM_STMT_PREPARE)
+            {
+                /** The OK is followed by the parameter and column definitions */
+                uint16_t columns = gw_mysql_get_byte2(ptr + 9);
+                uint16_t params = gw_mysql_get_byte2(ptr + 11);
+                my_session->branch_eof = (columns > 0) + (params > 0);
+                my_session->branch_reply = BRANCH_REPLY_PREPARE;
+                done = my_session->branch_eof == 0;
+            }
+            else if (PTR_IS_OK(ptr))
+            {
+                /** Skip the affected rows and the insert ID to get the status */
+                uint8_t *status = ptr + 5;
+                status += lenenc_length(status);
+                status += lenenc_length(status);
+                done = (status[0] & SERVER_MORE_RESULTS_EXIST) == 0;
+            }
+            else if (PTR_IS_ERR(ptr) || PTR_IS_LOCAL_INFILE(ptr))
+            {
+                done = true;
+            }
+            else
+            {
+                /** COM_FIELD_LIST has only the column definitions */
+                my_session->branch_reply = my_session->branch_command == MYSQL_COM_FIELD_LIST ?
+                                           BRANCH_REPLY_ROWS : BRANCH_REPLY_COLUMNS;
+            }
+            break;
+
+        case BRANCH_REPLY_COLUMNS:
+            if (PTR_IS_EOF(ptr))
+            {
+                my_session->branch_reply = BRANCH_REPLY_ROWS;
+            }
+            break;
+
+        case BRANCH_REPLY_ROWS:
+            if (PTR_IS_EOF(ptr))
+            {
+                if (ptr[7] & SERVER_MORE_RESULTS_EXIST)
+                {
+                    my_session->branch_reply = BRANCH_REPLY_FIRST;
+                }
+                else
+                {
+                    done = true;
+                }
+            }
+            else if (PTR_IS_ERR(ptr))
+            {
+                done = true;
+            }
+            break;
+
+        case BRANCH_REPLY_PREPARE:
+            if (PTR_IS_EOF(ptr))
+            {
+                done = --my_session->branch_eof == 0;
+            }
+            break;
+        }
+
+        if (done)
+        {
+            my_session->branch_busy = false;
+        }
+
+        ptr += MYSQL_GET_PACKET_LEN(ptr) + 4;
+    }
+
+    gwbuf_free(complete);
+    branch_send_next(my_session->instance, my_session);
+}
+
 /**
  * Reset the session's internal counters.
  * @param my_session Tee session
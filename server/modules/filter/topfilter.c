@@ -26,8 +26,16 @@
  * file to which the queries are logged. A serial number is appended to this
  * name in order that each session logs to a different file.
  *
+ * In the aggregate mode the statistics of the canonical forms of the
+ * statements are collected for the whole service instead of for each
+ * session. The statistics are collected by each thread separately and merged
+ * periodically. They are shown by the diagnostics and by the
+ * "show filterStatistics" command of maxinfo.
+ *
  * Date         Who             Description
  * 18/06/2014   Mark Riddoch    Addition of source and user filters
+ * 14/10/2016   MariaDB Corporation Addition of the aggregate mode
+ * 14/10/2016   MariaDB Corporation Latency histograms of the core statistics
  *
  * @endverbatim
  */
@@ -42,8 +50,13 @@
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
-#include <regex.h>
+#include <maxscale_pcre2.h>
 #include <atomic.h>
+#include <hashtable.h>
+#include <housekeeper.h>
+#include <maxconfig.h>
+#include <maxscale/poll.h>
+#include <statistics.h>
 
 MODULE_INFO info =
 {
@@ -67,6 +80,7 @@ static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static RESULTSET *getStatistics(FILTER *instance);
 
 
 static FILTER_OBJECT MyObject =
@@ -80,8 +94,32 @@ static FILTER_OBJECT MyObject =
     routeQuery,
     clientReply,
     diagnostic,
+    getStatistics,
 };
 
+/** Maximum number of statements in the aggregated statistics */
+#define TOPN_MAX_STATEMENTS 10000
+
+/**
+ * The aggregated statistics of one canonical statement
+ *
+ * The execution times are in microseconds.
+ */
+typedef struct topn_stats
+{
+    uint64_t min; /* Shortest execution time */
+    TS_LATENCY_SNAPSHOT latency; /* Number, total, longest and histogram of the execution times */
+} TOPN_STATS;
+
+/**
+ * The statistics collected by one thread since the last merge
+ */
+typedef struct topn_shard
+{
+    SPINLOCK lock; /* Only contended when the statistics are merged */
+    HASHTABLE *stats; /* Canonical statement to TOPN_STATS */
+} __attribute__((aligned(64))) TOPN_SHARD;
+
 /**
  * A instance structure, the assumption is that the option passed
  * to the filter is simply a base for the filename to which the queries
@@ -98,9 +136,18 @@ typedef struct
     char *source; /* The source of the client connection */
     char *user; /* A user name to filter on */
     char *match; /* Optional text to match against */
-    regex_t re; /* Compiled regex text */
+    pcre2_code *re; /* Compiled regex text */
     char *exclude; /* Optional text to match against for exclusion */
-    regex_t exre; /* Compiled regex nomatch text */
+    pcre2_code *exre; /* Compiled regex nomatch text */
+    bool aggregate; /* Collect statistics for the service instead of sessions */
+    int sample_rate; /* Measure one in every sample_rate statements */
+    int merge_interval; /* Seconds between the merges of the statistics */
+    int n_shards; /* Number of thread shards */
+    TOPN_SHARD *shards; /* Statistics of each thread */
+    HASHTABLE *stats; /* Merged statistics */
+    int n_stats; /* Number of statements in the merged statistics */
+    int n_overflow; /* Samples dropped because there were too many statements */
+    SPINLOCK stats_lock; /* Protects the merged statistics */
 } TOPN_INSTANCE;
 
 /**
@@ -136,6 +183,7 @@ typedef struct
     struct timeval total;
     struct timeval connect;
     struct timeval disconnect;
+    unsigned int n_seen; /* Statements seen in the aggregate mode */
 } TOPN_SESSION;
 
 /**
@@ -174,6 +222,205 @@ GetModuleObject()
 {
     return &MyObject;
 }
+/**
+ * Calculate a percentile of the latencies of a statement
+ *
+ * @param stats The statistics of the statement
+ * @param fraction The percentile as a fraction, e.g. 0.95
+ * @return The percentile in microseconds
+ */
+static uint64_t
+topn_percentile(TOPN_STATS *stats, double fraction)
+{
+    uint64_t value = ts_latency_percentile(&stats->latency, fraction);
+    return value < stats->min ? stats->min : value;
+}
+
+/**
+ * Add the statistics of one statement to another
+ *
+ * @param dest The statistics that are added to
+ * @param src The added statistics
+ */
+static void
+topn_stats_add(TOPN_STATS *dest, TOPN_STATS *src)
+{
+    if (dest->latency.count == 0 || src->min < dest->min)
+    {
+        dest->min = src->min;
+    }
+
+    ts_latency_merge(&dest->latency, &src->latency);
+}
+
+/**
+ * Allocate a hashtable for statement statistics
+ *
+ * @return The hashtable or NULL on memory allocation error
+ */
+static HASHTABLE*
+topn_stats_alloc()
+{
+    HASHTABLE *ht = hashtable_alloc(256, simple_str_hash, strcmp);
+
+    if (ht)
+    {
+        hashtable_memory_fns(ht, (HASHMEMORYFN) strdup, NULL,
+                             (HASHMEMORYFN) free, (HASHMEMORYFN) free);
+    }
+
+    return ht;
+}
+
+/**
+ * Record the execution time of a statement in the shard of the calling thread
+ *
+ * @param my_instance The filter instance
+ * @param canonical Canonical form of the statement
+ * @param us Execution time in microseconds
+ */
+static void
+topn_record(TOPN_INSTANCE *my_instance, char *canonical, uint64_t us)
+{
+    int thread = poll_current_thread();
+    TOPN_SHARD *shard = &my_instance->shards[thread >= 0 && thread < my_instance->n_shards - 1 ?
+                                             thread : my_instance->n_shards - 1];
+
+    spinlock_acquire(&shard->lock);
+
+    if (shard->stats == NULL)
+    {
+        shard->stats = topn_stats_alloc();
+    }
+
+    TOPN_STATS *stats = shard->stats ? hashtable_fetch(shard->stats, canonical) : NULL;
+
+    if (stats == NULL && shard->stats && (stats = calloc(1, sizeof(TOPN_STATS))))
+    {
+        if (hashtable_add(shard->stats, canonical, stats) == 0)
+        {
+            free(stats);
+            stats = NULL;
+        }
+    }
+
+    if (stats)
+    {
+        if (stats->latency.count == 0 || us < stats->min)
+        {
+            stats->min = us;
+        }
+
+        ts_latency_record(&stats->latency, us);
+    }
+
+    spinlock_release(&shard->lock);
+}
+
+/**
+ * Merge the statistics of the threads into the statistics of the service
+ *
+ * The shard of each thread is locked only for the time it takes to detach
+ * its statistics.
+ *
+ * @param data The filter instance
+ */
+static void
+topn_merge(void *data)
+{
+    TOPN_INSTANCE *my_instance = (TOPN_INSTANCE *) data;
+
+    spinlock_acquire(&my_instance->stats_lock);
+
+    for (int i = 0; i < my_instance->n_shards; i++)
+    {
+        TOPN_SHARD *shard = &my_instance->shards[i];
+
+        spinlock_acquire(&shard->lock);
+        HASHTABLE *ht = shard->stats;
+        shard->stats = NULL;
+        spinlock_release(&shard->lock);
+
+        if (ht == NULL)
+        {
+            continue;
+        }
+
+        HASHITERATOR *iter = hashtable_iterator(ht);
+        char *key;
+
+        while (iter && (key = hashtable_next(iter)))
+        {
+            TOPN_STATS *src = hashtable_fetch(ht, key);
+            TOPN_STATS *dest = hashtable_fetch(my_instance->stats, key);
+
+            if (dest == NULL && src)
+            {
+                if (my_instance->n_stats < TOPN_MAX_STATEMENTS &&
+                    (dest = calloc(1, sizeof(TOPN_STATS))))
+                {
+                    if (hashtable_add(my_instance->stats, key, dest))
+                    {
+                        my_instance->n_stats++;
+                    }
+                    else
+                    {
+                        free(dest);
+                        dest = NULL;
+                    }
+                }
+
+                if (dest == NULL)
+                {
+                    my_instance->n_overflow += src->latency.count;
+                }
+            }
+
+            if (dest && src)
+            {
+                topn_stats_add(dest, src);
+            }
+        }
+
+        hashtable_iterator_free(iter);
+        hashtable_free(ht);
+    }
+
+    spinlock_release(&my_instance->stats_lock);
+}
+
+/**
+ * Initialize the aggregate mode of a filter instance
+ *
+ * @param my_instance The filter instance
+ * @return True on success
+ */
+static bool
+topn_aggregate_init(TOPN_INSTANCE *my_instance)
+{
+    char name[64];
+
+    /** One shard for each polling thread and one for other threads */
+    my_instance->n_shards = config_threadcount() + 1;
+
+    if ((my_instance->shards = calloc(my_instance->n_shards, sizeof(TOPN_SHARD))) == NULL ||
+        (my_instance->stats = topn_stats_alloc()) == NULL)
+    {
+        MXS_ERROR("topfilter: Memory allocation failed.");
+        free(my_instance->shards);
+        return false;
+    }
+
+    for (int i = 0; i < my_instance->n_shards; i++)
+    {
+        spinlock_init(&my_instance->shards[i].lock);
+    }
+
+    snprintf(name, sizeof(name), "topfilter_merge_%p", my_instance);
+    hktask_add(name, topn_merge, my_instance, my_instance->merge_interval);
+    return true;
+}
+
 /**
  * Create an instance of the filter for a particular service
  * within MaxScale.
@@ -197,6 +444,14 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->source = NULL;
         my_instance->user = NULL;
         my_instance->filebase = NULL;
+        my_instance->aggregate = false;
+        my_instance->sample_rate = 1;
+        my_instance->merge_interval = 5;
+        my_instance->shards = NULL;
+        my_instance->stats = NULL;
+        my_instance->n_stats = 0;
+        my_instance->n_overflow = 0;
+        spinlock_init(&my_instance->stats_lock);
         bool error = false;
 
         for (i = 0; params && params[i]; i++)
@@ -225,6 +480,37 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 my_instance->user = strdup(params[i]->value);
             }
+            else if (!strcmp(params[i]->name, "mode"))
+            {
+                if (!strcasecmp(params[i]->value, "aggregate"))
+                {
+                    my_instance->aggregate = true;
+                }
+                else if (strcasecmp(params[i]->value, "session"))
+                {
+                    MXS_ERROR("topfilter: Unknown mode '%s', expected 'session' or 'aggregate'.",
+                              params[i]->value);
+                    error = true;
+                }
+            }
+            else if (!strcmp(params[i]->name, "sample_rate"))
+            {
+                if ((my_instance->sample_rate = atoi(params[i]->value)) <= 0)
+                {
+                    MXS_ERROR("topfilter: Invalid value for 'sample_rate': %s",
+                              params[i]->value);
+                    error = true;
+                }
+            }
+            else if (!strcmp(params[i]->name, "merge_interval"))
+            {
+                if ((my_instance->merge_interval = atoi(params[i]->value)) <= 0)
+                {
+                    MXS_ERROR("topfilter: Invalid value for 'merge_interval': %s",
+                              params[i]->value);
+                    error = true;
+                }
+            }
             else if (!filter_standard_parameter(params[i]->name))
             {
                 MXS_ERROR("topfilter: Unexpected parameter '%s'.",
@@ -233,7 +519,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
             }
         }
 
-        int cflags = REG_ICASE;
+        int cflags = PCRE2_CASELESS | PCRE2_DOTALL;
 
         if (options)
         {
@@ -241,15 +527,15 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 if (!strcasecmp(options[i], "ignorecase"))
                 {
-                    cflags |= REG_ICASE;
+                    cflags |= PCRE2_CASELESS;
                 }
                 else if (!strcasecmp(options[i], "case"))
                 {
-                    cflags &= ~REG_ICASE;
+                    cflags &= ~PCRE2_CASELESS;
                 }
                 else if (!strcasecmp(options[i], "extended"))
                 {
-                    cflags |= REG_EXTENDED;
+                    /** The PCRE2 syntax is a superset of the extended syntax */
                 }
                 else
                 {
@@ -260,7 +546,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
             }
         }
 
-        if (my_instance->filebase == NULL)
+        if (my_instance->filebase == NULL && !my_instance->aggregate)
         {
             MXS_ERROR("topfilter: No 'filebase' parameter defined.");
             error = true;
@@ -268,38 +554,43 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
         my_instance->sessions = 0;
         if (my_instance->match &&
-            regcomp(&my_instance->re, my_instance->match, cflags))
+            (my_instance->re = mxs_pcre2_compile(my_instance->match, cflags)) == NULL)
         {
             MXS_ERROR("topfilter: Invalid regular expression '%s'"
                       " for the 'match' parameter.",
                       my_instance->match);
-            regfree(&my_instance->re);
+            pcre2_code_free(my_instance->re);
             free(my_instance->match);
             my_instance->match = NULL;
             error = true;
         }
         if (my_instance->exclude &&
-            regcomp(&my_instance->exre, my_instance->exclude, cflags))
+            (my_instance->exre = mxs_pcre2_compile(my_instance->exclude, cflags)) == NULL)
         {
             MXS_ERROR("topfilter: Invalid regular expression '%s'"
                       " for the 'nomatch' parameter.\n",
                       my_instance->exclude);
-            regfree(&my_instance->exre);
+            pcre2_code_free(my_instance->exre);
             free(my_instance->exclude);
             my_instance->exclude = NULL;
             error = true;
         }
 
+        if (!error && my_instance->aggregate && !topn_aggregate_init(my_instance))
+        {
+            error = true;
+        }
+
         if (error)
         {
             if (my_instance->exclude)
             {
-                regfree(&my_instance->exre);
+                pcre2_code_free(my_instance->exre);
                 free(my_instance->exclude);
             }
             if (my_instance->match)
             {
-                regfree(&my_instance->re);
+                pcre2_code_free(my_instance->re);
                 free(my_instance->match);
             }
             free(my_instance->filebase);
@@ -329,7 +620,23 @@ newSession(FILTER *instance, SESSION *session)
     int i;
     char *remote, *user;
 
-    if ((my_session = calloc(1, sizeof(TOPN_SESSION))) != NULL)
+    if ((my_session = calloc(1, sizeof(TOPN_SESSION))) != NULL && my_instance->aggregate)
+    {
+        /** The aggregate mode does not use the per session reports */
+        my_session->active = 1;
+        if (my_instance->source && (remote = session_get_remote(session)) &&
+            strcmp(remote, my_instance->source))
+        {
+            my_session->active = 0;
+        }
+        if (my_instance->user && (user = session_getUser(session)) &&
+            strcmp(user, my_instance->user))
+        {
+            my_session->active = 0;
+        }
+        gettimeofday(&my_session->connect, NULL);
+    }
+    else if (my_session != NULL)
     {
         if ((my_session->filename =
                  (char *) malloc(strlen(my_instance->filebase) + 20))
@@ -408,6 +715,14 @@ closeSession(FILTER *instance, void *session)
 
     gettimeofday(&my_session->disconnect, NULL);
     timersub((&my_session->disconnect), &(my_session->connect), &diff);
+
+    if (my_instance->aggregate)
+    {
+        free(my_session->current);
+        my_session->current = NULL;
+        return;
+    }
+
     if ((fp = fopen(my_session->filename, "w")) != NULL)
     {
         statements = my_session->n_statements != 0 ? my_session->n_statements : 1;
@@ -521,33 +836,50 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 {
     TOPN_INSTANCE *my_instance = (TOPN_INSTANCE *) instance;
     TOPN_SESSION *my_session = (TOPN_SESSION *) session;
-    char *ptr;
+    const char *sql;
+    int length;
 
-    if (my_session->active)
+    if (my_session->active && my_instance->aggregate)
     {
-        if (queue->next != NULL)
+        /** Only every sample_rate statement is measured */
+        if (my_session->current == NULL && modutil_is_SQL(queue) &&
+            ++my_session->n_seen % my_instance->sample_rate == 0)
         {
-            queue = gwbuf_make_contiguous(queue);
-        }
-        if ((ptr = modutil_get_SQL(queue)) != NULL)
-        {
-            if ((my_instance->match == NULL ||
-                 regexec(&my_instance->re, ptr, 0, NULL, 0) == 0) &&
+            if (queue->next != NULL)
+            {
+                queue = gwbuf_make_contiguous(queue);
+            }
+            if (modutil_get_SQL_view(queue, &sql, &length) &&
+                (my_instance->match == NULL ||
+                 mxs_pcre2_match(my_instance->re, sql, length)) &&
                 (my_instance->exclude == NULL ||
-                 regexec(&my_instance->exre, ptr, 0, NULL, 0) != 0))
+                 !mxs_pcre2_match(my_instance->exre, sql, length)))
             {
-                my_session->n_statements++;
-                if (my_session->current)
-                {
-                    free(my_session->current);
-                }
                 gettimeofday(&my_session->start, NULL);
-                my_session->current = ptr;
+                my_session->current = modutil_get_canonical(queue);
             }
-            else
+        }
+    }
+    else if (my_session->active)
+    {
+        if (queue->next != NULL)
+        {
+            queue = gwbuf_make_contiguous(queue);
+        }
+        /** The statement is only copied when it is measured */
+        if (modutil_get_SQL_view(queue, &sql, &length) &&
+            (my_instance->match == NULL ||
+             mxs_pcre2_match(my_instance->re, sql, length)) &&
+            (my_instance->exclude == NULL ||
+             !mxs_pcre2_match(my_instance->exre, sql, length)))
+        {
+            my_session->n_statements++;
+            if (my_session->current)
             {
-                free(ptr);
+                free(my_session->current);
             }
+            gettimeofday(&my_session->start, NULL);
+            my_session->current = strndup(sql, length);
         }
     }
     /* Pass the query downstream */
@@ -576,7 +908,16 @@ clientReply(FILTER *instance, void *session, GWBUF *reply)
     struct timeval tv, diff;
     int i, inserted;
 
-    if (my_session->current)
+    if (my_session->current && my_instance->aggregate)
+    {
+        gettimeofday(&tv, NULL);
+        timersub(&tv, &(my_session->start), &diff);
+        topn_record(my_instance, my_session->current,
+                    (uint64_t) diff.tv_sec * 1000000 + diff.tv_usec);
+        free(my_session->current);
+        my_session->current = NULL;
+    }
+    else if (my_session->current)
     {
         gettimeofday(&tv, NULL);
         timersub(&tv, &(my_session->start), &diff);
@@ -642,6 +983,16 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
 
     dcb_printf(dcb, "\t\tReport size            %d\n",
                my_instance->topN);
+    if (my_instance->aggregate)
+    {
+        topn_merge(my_instance);
+        dcb_printf(dcb, "\t\tAggregating statistics, sampling 1 in %d statements\n",
+                   my_instance->sample_rate);
+        dcb_printf(dcb, "\t\tDistinct statements    %d\n",
+                   my_instance->n_stats);
+        dcb_printf(dcb, "\t\tSamples not recorded   %d\n",
+                   my_instance->n_overflow);
+    }
     if (my_instance->source)
     {
         dcb_printf(dcb, "\t\tLimit logging to connections from  %s\n",
@@ -662,7 +1013,7 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         dcb_printf(dcb, "\t\tExclude queries that match     %s\n",
                    my_instance->exclude);
     }
-    if (my_session)
+    if (my_session && !my_instance->aggregate)
     {
         dcb_printf(dcb, "\t\tLogging to file %s.\n",
                    my_session->filename);
@@ -681,3 +1032,176 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         }
     }
 }
+
+/** A statement in the result set of the aggregated statistics */
+typedef struct
+{
+    char *sql;
+    TOPN_STATS *stats;
+} TOPN_ROW;
+
+/** The state of the result set of the aggregated statistics */
+typedef struct
+{
+    TOPN_ROW *rows;
+    int n_rows;
+    int index;
+} TOPN_RESULT;
+
+static int
+cmp_topn_row(const void *va, const void *vb)
+{
+    const TOPN_ROW *a = (const TOPN_ROW *) va;
+    const TOPN_ROW *b = (const TOPN_ROW *) vb;
+
+    return a->stats->latency.total < b->stats->latency.total ? 1 :
+           a->stats->latency.total > b->stats->latency.total ? -1 : 0;
+}
+
+/**
+ * Release the copied statistics of a result set
+ *
+ * @param result The result set state
+ */
+static void
+topn_result_free(TOPN_RESULT *result)
+{
+    for (int i = 0; i < result->n_rows; i++)
+    {
+        free(result->rows[i].sql);
+        free(result->rows[i].stats);
+    }
+
+    free(result->rows);
+    free(result);
+}
+
+/**
+ * Provide a row of the aggregated statistics
+ *
+ * @param set The result set
+ * @param data The result set state
+ * @return The next row or NULL if there are no more rows
+ */
+static RESULT_ROW *
+topn_statistics_row(RESULTSET *set, void *data)
+{
+    TOPN_RESULT *result = (TOPN_RESULT *) data;
+
+    if (result->index >= result->n_rows)
+    {
+        topn_result_free(result);
+        return NULL;
+    }
+
+    TOPN_ROW *row = &result->rows[result->index++];
+    TOPN_STATS *stats = row->stats;
+    RESULT_ROW *res_row = resultset_make_row(set);
+    char buf[80];
+
+    if (res_row)
+    {
+        resultset_row_set(res_row, 0, row->sql);
+        snprintf(buf, sizeof(buf), "%lu", stats->latency.count);
+        resultset_row_set(res_row, 1, buf);
+        snprintf(buf, sizeof(buf), "%.6f", stats->latency.total / 1000000.0);
+        resultset_row_set(res_row, 2, buf);
+        snprintf(buf, sizeof(buf), "%.6f", stats->latency.total / (stats->latency.count * 1000000.0));
+        resultset_row_set(res_row, 3, buf);
+        snprintf(buf, sizeof(buf), "%.6f", stats->min / 1000000.0);
+        resultset_row_set(res_row, 4, buf);
+        snprintf(buf, sizeof(buf), "%.6f", stats->latency.max / 1000000.0);
+        resultset_row_set(res_row, 5, buf);
+        snprintf(buf, sizeof(buf), "%.6f", topn_percentile(stats, 0.50) / 1000000.0);
+        resultset_row_set(res_row, 6, buf);
+        snprintf(buf, sizeof(buf), "%.6f", topn_percentile(stats, 0.95) / 1000000.0);
+        resultset_row_set(res_row, 7, buf);
+        snprintf(buf, sizeof(buf), "%.6f", topn_percentile(stats, 0.99) / 1000000.0);
+        resultset_row_set(res_row, 8, buf);
+    }
+
+    return res_row;
+}
+
+/**
+ * Return the aggregated statistics as a result set
+ *
+ * The statistics are merged first and the statements with the largest
+ * total execution time are returned, the number of statements is the
+ * value of the count parameter. The times are in seconds.
+ *
+ * @param instance The filter instance
+ * @return The result set or NULL if the filter is not in the aggregate mode
+ */
+static RESULTSET *
+getStatistics(FILTER *instance)
+{
+    TOPN_INSTANCE *my_instance = (TOPN_INSTANCE *) instance;
+    TOPN_RESULT *result;
+    RESULTSET *set;
+
+    if (!my_instance->aggregate || (result = calloc(1, sizeof(TOPN_RESULT))) == NULL)
+    {
+        return NULL;
+    }
+
+    topn_merge(my_instance);
+
+    /** Copy the statistics so that the lock is not held while the rows are sent */
+    spinlock_acquire(&my_instance->stats_lock);
+    HASHITERATOR *iter = hashtable_iterator(my_instance->stats);
+    result->rows = calloc(my_instance->n_stats + 1, sizeof(TOPN_ROW));
+    char *key;
+
+    while (iter && result->rows && result->n_rows < my_instance->n_stats &&
+           (key = hashtable_next(iter)))
+    {
+        TOPN_STATS *stats = hashtable_fetch(my_instance->stats, key);
+        TOPN_ROW *row = &result->rows[result->n_rows];
+
+        if (stats && (row->sql = strdup(key)) && (row->stats = malloc(sizeof(TOPN_STATS))))
+        {
+            memcpy(row->stats, stats, sizeof(TOPN_STATS));
+            result->n_rows++;
+        }
+        else
+        {
+            free(row->sql);
+            row->sql = NULL;
+        }
+    }
+
+    hashtable_iterator_free(iter);
+    spinlock_release(&my_instance->stats_lock);
+
+    qsort(result->rows, result->n_rows, sizeof(TOPN_ROW), cmp_topn_row);
+
+    for (int i = my_instance->topN; i < result->n_rows; i++)
+    {
+        free(result->rows[i].sql);
+        free(result->rows[i].stats);
+    }
+
+    if (result->n_rows > my_instance->topN)
+    {
+        result->n_rows = my_instance->topN;
+    }
+
+    if ((set = resultset_create(topn_statistics_row, result)) == NULL)
+    {
+        topn_result_free(result);
+        return NULL;
+    }
+
+    resultset_add_column(set, "Statement", 80, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Count", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Total", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Average", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Min", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Max", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "P50", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "P95", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "P99", 20, COL_TYPE_VARCHAR);
+
+    return set;
+}
@@ -11,10 +11,10 @@
 #include <dcb.h>
 #include <service.h>
 #include <spinlock.h>
+#include <thread.h>
 #include <mysql_binlog.h>
 #include <users.h>
 #include <dbusers.h>
-#include <avro.h>
 #include <cdc.h>
 #include <maxscale_pcre2.h>
 #include <maxavro.h>
@@ -46,6 +46,8 @@
 #define MEMORY_DATABASE_NAME   "memory"
 #define MEMORY_TABLE_NAME      MEMORY_DATABASE_NAME".mem_used_tables"
 #define INDEX_TABLE_NAME       "indexing_progress"
+#define GTID_INDEX_NAME        "gtid_file_index"
+#define SEGMENT_TABLE_NAME     "segments"
 
 /** Name of the file where the binlog to Avro conversion progress is stored */
 #define AVRO_PROGRESS_FILE "avro-conversion.ini"
@@ -69,8 +71,15 @@ static const char *avro_sequence     = "sequence";
 static const char *avro_event_number = "event_number";
 static const char *avro_event_type   = "event_type";
 static const char *avro_timestamp    = "timestamp";
+static const char *avro_primary_key  = "primary_key";
 static char *avro_client_ouput[]     = { "Undefined", "JSON", "Avro" };
 
+/** Initial size of the data block buffer of a table */
+#define AVRO_BLOCK_BUFFER_SIZE (16 * 1024)
+
+/** Data blocks larger than this are written before the next flush */
+#define AVRO_BLOCK_SIZE_MAX (1024 * 1024)
+
 
 /** How a binlog file is closed */
 typedef enum avro_binlog_end
@@ -93,6 +102,21 @@ typedef enum avro_binlog_end
 /** How many bytes each thread tries to send */
 #define AVRO_DATA_BURST_SIZE MAX_BUFFER_SIZE
 
+/** Maximum number of conversion worker threads */
+#define AVRO_MAX_WORKERS 32
+
+/** How many row events can be queued for one conversion worker */
+#define AVRO_WORKER_QUEUE_MAX 1024
+
+/** Smaller data blocks are read into memory instead of being sent with sendfile() */
+#define AVRO_SENDFILE_MIN_SIZE 16384
+
+/** Maximum number of data blocks in the block cache */
+#define AVRO_BLOCK_CACHE_MAX 4096
+
+/** How often the retention of the Avro files is checked (seconds) */
+#define AVRO_RETENTION_FREQ 60
+
 /** A CREATE TABLE abstraction */
 typedef struct table_create
 {
@@ -102,8 +126,25 @@ typedef struct table_create
     char *database;
     int version;   /**< How many versions of this table have been used */
     bool was_used; /**< Has this schema been persisted to disk */
+    char **primary_key; /**< Names of the primary key columns */
+    int n_primary_key;  /**< Number of primary key columns, 0 if there is no key */
 } TABLE_CREATE;
 
+struct table_column;
+
+/** Function that decodes a column value of a row and adds it to a data block */
+typedef uint8_t* (*COLUMN_DECODE_FN)(struct table_column *col, MAXAVRO_DATABLOCK *block,
+                                     uint8_t *ptr, int *extra_bits);
+
+/** How a column of a table is decoded, prepared from the table map event */
+typedef struct table_column
+{
+    COLUMN_DECODE_FN decode;   /*< Decoding function for the column type */
+    uint8_t          type;     /*< Column type */
+    uint8_t         *metadata; /*< Column metadata */
+    enum maxavro_value_type avro_type; /*< Type of the column in the Avro record */
+} TABLE_COLUMN;
+
 /** A representation of a table map event read from a binary log. A table map
  * maps a table to a unique ID which can be used to match row events to table map
  * events. The table map event tells us how the table is laid out and gives us
@@ -118,6 +159,7 @@ typedef struct table_map
     uint8_t *column_metadata;
     size_t column_metadata_size;
     TABLE_CREATE *table_create; /*< The definition of the table */
+    TABLE_COLUMN *column_decoders; /*< How each column is decoded */
     int version;
     char version_string[TABLE_MAP_VERSION_DIGITS + 1];
     char *table;
@@ -154,15 +196,36 @@ typedef struct
     uint64_t        lastsample;
     int             minno;
     int             minavgs[AVRO_NSTATS_MINUTES];
+    unsigned long   lastsample_bytes; /*< n_bytes at the last sample */
+    unsigned long   bytes_per_sec;    /*< Send rate during the last sample period */
 } AVRO_CLIENT_STATS;
 
+typedef struct gtid_pos
+{
+    uint32_t timestamp; /*< GTID event timestamp */
+    uint64_t domain; /*< Replication domain */
+    uint64_t server_id; /*< Server ID */
+    uint64_t seq; /*< Sequence number */
+    uint64_t event_num; /*< Subsequence number, increases monotonically. This
+                         * is an internal representation of the position of
+                         * an event inside a GTID event and it is used to
+                         * rebuild GTID events in the correct order. */
+} gtid_pos_t;
+
 typedef struct avro_table_t
 {
     char* filename; /*< Absolute filename */
     char* json_schema; /*< JSON representation of the schema */
-    avro_file_writer_t avro_file; /*< Current Avro data file */
-    avro_value_iface_t *avro_writer_iface; /*< Avro C API writer interface */
-    avro_schema_t avro_schema; /*< Native Avro schema of the table */
+    MAXAVRO_FILE *avro_file; /*< Current Avro data file */
+    MAXAVRO_DATABLOCK *avro_block; /*< The data block being written */
+    bool new_data; /*< Records were added after the clients were last notified */
+    struct avro_table_stats *stats; /*< Statistics of the table, owned by the router */
+    struct avro_kafka_topic *kafka_topic; /*< Kafka topic of the table, NULL if
+                                           * the records are not published */
+    time_t created; /*< When the file was opened for writing */
+    bool has_rows; /*< Records were written to the file after it was opened */
+    gtid_pos_t first_gtid; /*< GTID of the first record written to the file */
+    gtid_pos_t last_gtid; /*< GTID of the last record written to the file */
 } AVRO_TABLE;
 
 /** Data format used when streaming data to the clients */
@@ -173,17 +236,119 @@ enum avro_data_format
     AVRO_FORMAT_AVRO,
 };
 
-typedef struct gtid_pos
+/**
+ * Conversion statistics of a table. The statistics are kept over the versions
+ * of the table and the rates are updated every AVRO_STATS_FREQ seconds.
+ */
+typedef struct avro_table_stats
 {
-    uint32_t timestamp; /*< GTID event timestamp */
-    uint64_t domain; /*< Replication domain */
-    uint64_t server_id; /*< Server ID */
-    uint64_t seq; /*< Sequence number */
-    uint64_t event_num; /*< Subsequence number, increases monotonically. This
-                         * is an internal representation of the position of
-                         * an event inside a GTID event and it is used to
-                         * rebuild GTID events in the correct order. */
-} gtid_pos_t;
+    uint64_t        n_events;       /*< Row events converted */
+    uint64_t        n_rows;         /*< Records written */
+    uint64_t        n_bytes;        /*< Bytes written to the Avro files */
+    gtid_pos_t      gtid;           /*< GTID of the last converted row event */
+    uint32_t        lag;            /*< Seconds from the last converted row event
+                                     * being written to the binlog to its conversion */
+    uint64_t        lastsample_events; /*< Counters at the last sample */
+    uint64_t        lastsample_rows;
+    uint64_t        lastsample_bytes;
+    uint64_t        events_per_sec; /*< Rates during the last sample period */
+    uint64_t        rows_per_sec;
+    uint64_t        bytes_per_sec;
+} AVRO_TABLE_STATS;
+
+/**
+ * The GTID subsequence numbers of one transaction. The row events of the
+ * transaction are converted by different workers which take the numbers from
+ * this counter.
+ */
+typedef struct avro_trx
+{
+    int refs;      /*< The reader and the queued row events of the transaction */
+    int event_num; /*< The last subsequence number that was used */
+} AVRO_TRX;
+
+/** A row event queued for a conversion worker */
+typedef struct avro_row_event
+{
+    GWBUF        *event;    /*< The event payload */
+    REP_HEADER    hdr;      /*< Replication header of the event */
+    uint8_t       hdr_len;  /*< Post-header length of the event type */
+    gtid_pos_t    gtid;     /*< The GTID of the transaction */
+    AVRO_TRX     *trx;      /*< Subsequence numbers of the transaction */
+    TABLE_MAP    *map;      /*< Table map of the table */
+    AVRO_TABLE   *table;    /*< Avro file of the table */
+    struct avro_row_event *next;
+} AVRO_ROW_EVENT;
+
+/**
+ * A conversion worker. Each table is converted by one worker which keeps the
+ * records of the table in the order they are in the binlog.
+ */
+typedef struct avro_worker
+{
+    THREAD          thread;   /*< The worker thread */
+    pthread_mutex_t lock;     /*< Protects the queue */
+    pthread_cond_t  work;     /*< Signaled when events are queued */
+    pthread_cond_t  idle;     /*< Signaled when the queue has been processed */
+    AVRO_ROW_EVENT *head;     /*< First queued event */
+    AVRO_ROW_EVENT *tail;     /*< Last queued event */
+    int             queued;   /*< Number of queued and in-progress events */
+    uint64_t        n_events; /*< Number of row events converted */
+} AVRO_WORKER;
+
+/** A data block of an Avro file, ready to be sent to the clients */
+typedef struct avro_cached_block
+{
+    uint8_t     sync[SYNC_MARKER_SIZE]; /*< Sync marker of the file */
+    long        pos;       /*< Position of the data block in the file */
+    enum avro_data_format format; /*< Format of the data */
+    GWBUF      *data;      /*< The data sent to the clients, shared with clones */
+    gtid_pos_t  gtid;      /*< GTID of the last record in the block */
+    uint64_t    last_used; /*< When the block was last used */
+} AVRO_CACHED_BLOCK;
+
+/**
+ * Recently read data blocks of the Avro files. The clients that read the same
+ * parts of the same files share the blocks instead of reading and converting
+ * the data separately.
+ */
+typedef struct avro_block_cache
+{
+    SPINLOCK           lock;     /*< Protects the blocks */
+    AVRO_CACHED_BLOCK *blocks;   /*< The cached blocks */
+    int                size;     /*< Number of blocks that can be cached */
+    uint64_t           counter;  /*< Increases with every use of the cache */
+    uint64_t           hits;     /*< Number of blocks sent from the cache */
+    uint64_t           misses;   /*< Number of blocks read from the files */
+} AVRO_BLOCK_CACHE;
+
+/** Comparison operators of the REQUEST-DATA predicates */
+enum avro_filter_op
+{
+    AVRO_FILTER_EQ,
+    AVRO_FILTER_NE,
+    AVRO_FILTER_LT,
+    AVRO_FILTER_LE,
+    AVRO_FILTER_GT,
+    AVRO_FILTER_GE
+};
+
+/** A predicate of the form <column><operator><value> */
+typedef struct avro_predicate
+{
+    char                *column; /*< Name of the compared column */
+    enum avro_filter_op  op;     /*< The comparison operator */
+    char                *value;  /*< The value the column is compared to */
+} AVRO_PREDICATE;
+
+/** The rows and columns a client requested with REQUEST-DATA */
+typedef struct avro_row_filter
+{
+    char           **fields;       /*< Requested columns, all columns if empty */
+    int              n_fields;     /*< Number of requested columns */
+    AVRO_PREDICATE  *predicates;   /*< Predicates the rows must match */
+    int              n_predicates; /*< Number of predicates */
+} AVRO_ROW_FILTER;
 
 /**
  * The client structure used within this router.
@@ -213,11 +378,34 @@ typedef struct avro_client
     gtid_pos_t      gtid_start; /*< First sent GTID */
     unsigned int    cstate;         /*< Catch up state */
     sqlite3       *sqlite_handle;
+    AVRO_ROW_FILTER *filter;      /*< Requested rows and columns, NULL for all */
+    MAXAVRO_JSONBUF json_text;    /*< Reused buffer for the JSON text of the records */
+    char            table_ident[MYSQL_TABLE_MAXLEN + MYSQL_DATABASE_MAXLEN + 2];
+    /*< The table the client is subscribed to, empty if not subscribed */
+    struct avro_client *next_subscriber; /*< Next client subscribed to the same table */
 #if defined(SS_DEBUG)
     skygw_chk_t     rses_chk_tail;
 #endif
 } AVRO_CLIENT;
 
+/** The clients that stream one table. The clients that wait for data are woken
+ * up when new records of the table are written. */
+typedef struct avro_subscribers
+{
+    AVRO_CLIENT *clients; /*< Linked with the next_subscriber field of the clients */
+} AVRO_SUBSCRIBERS;
+
+/** Settings of the Kafka producer */
+typedef struct avro_kafka_config
+{
+    char           *brokers;      /*< The Kafka brokers, NULL if Kafka is not used */
+    char           *topic_prefix; /*< Prefix of the topic names of the tables */
+    enum avro_data_format format; /*< Format of the published records */
+    char           *compression;  /*< Compression codec of the message batches */
+    int             batch_size;   /*< Maximum number of messages in one batch, 0 for the default */
+    int             linger_ms;    /*< How long messages are collected into a batch, -1 for the default */
+} AVRO_KAFKA_CONFIG;
+
 /**
  *  * The per instance data for the AVRO router.
  *   */
@@ -249,7 +437,15 @@ typedef struct avro_instance
     HASHTABLE     *table_maps;
     HASHTABLE     *open_tables;
     HASHTABLE     *created_tables;
+    HASHTABLE     *subscribers; /*< AVRO_SUBSCRIBERS of each table */
+    HASHTABLE     *table_stats; /*< AVRO_TABLE_STATS of each table */
+    SPINLOCK       subscriber_lock; /*< Protects the subscriber lists */
     sqlite3       *sqlite_handle;
+    sqlite3_stmt  *index_insert; /*< Prepared GTID index insert */
+    sqlite3_stmt  *index_clear; /*< Prepared indexing progress removal */
+    sqlite3_stmt  *index_progress; /*< Prepared indexing progress update */
+    sqlite3_stmt  *segment_insert; /*< Prepared segment range insert */
+    sqlite3_stmt  *segment_update; /*< Prepared segment range update */
     char              prevbinlog[BINLOG_FNAMELEN + 1];
     int               rotating;     /*< Rotation in progress flag */
     SPINLOCK          fileslock;    /*< Lock for the files queue above */
@@ -261,6 +457,22 @@ typedef struct avro_instance
     uint64_t        row_count; /*< Row events processed */
     uint64_t        row_target; /*< Minimum about of row events that will trigger
                                  * a flush of all tables */
+    int             n_workers; /*< Number of conversion worker threads */
+    AVRO_WORKER     *workers; /*< The conversion workers */
+    AVRO_TRX        *trx; /*< Subsequence numbers of the current transaction */
+    AVRO_BLOCK_CACHE block_cache; /*< Data blocks shared by the clients */
+    bool            sendfile_blocks; /*< Send Avro data blocks with sendfile() */
+    enum maxavro_codec codec; /*< Compression codec of new Avro files */
+    AVRO_KAFKA_CONFIG kafka_config; /*< Settings of the Kafka producer */
+    struct avro_kafka *kafka; /*< Kafka producer, NULL if the records are not published */
+    uint64_t        rotate_size; /*< Size in bytes after which a new file is started, 0 for no limit */
+    int             rotate_time; /*< Age in seconds after which a new file is started, 0 for no limit */
+    int             retention_time; /*< Seconds after the last write when an old file
+                                     * is removed, 0 for no limit */
+    int             retention_files; /*< Number of files kept of each table, 0 for no limit */
+    time_t          retention_checked; /*< When the retention was last checked */
+    uint64_t        n_rotated; /*< Number of files closed because of their size or age */
+    uint64_t        n_removed; /*< Number of files removed by the retention */
     struct avro_instance  *next;
 } AVRO_INSTANCE;
 
@@ -278,14 +490,50 @@ extern void avro_client_rotate(AVRO_INSTANCE *router, AVRO_CLIENT *client, uint8
 extern bool avro_open_binlog(const char *binlogdir, const char *file, int *fd);
 extern void avro_close_binlog(int fd);
 extern avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router);
-extern AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema);
+extern AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema,
+                                    enum maxavro_codec codec);
 extern void* avro_table_free(AVRO_TABLE *table);
+extern bool avro_table_write_block(AVRO_TABLE *table);
+extern AVRO_TABLE_STATS* avro_get_table_stats(AVRO_INSTANCE *router, const char *table);
 extern void avro_flush_all_tables(AVRO_INSTANCE *router);
+extern void avro_update_segments(AVRO_INSTANCE *router);
+extern void avro_index_remove_file(AVRO_INSTANCE *router, const char *name);
 extern char* json_new_schema_from_table(TABLE_MAP *map);
+extern enum maxavro_value_type column_type_to_maxavro_type(uint8_t type);
 extern void save_avro_schema(const char *path, const char* schema, TABLE_MAP *map);
 extern bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr);
 extern bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr);
 extern void table_map_remap(uint8_t *ptr, uint8_t hdr_len, TABLE_MAP *map);
+extern bool table_map_init_columns(TABLE_MAP *map);
+extern bool row_event_find_table(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr,
+                                 TABLE_MAP **map, AVRO_TABLE **table, char *ident, size_t len);
+extern bool row_event_write(REP_HEADER *hdr, uint8_t hdr_len, uint8_t *ptr, TABLE_MAP *map,
+                            AVRO_TABLE *table, gtid_pos_t *gtid, int *event_num);
+extern bool avro_workers_start(AVRO_INSTANCE *router);
+extern bool avro_workers_add(AVRO_INSTANCE *router, REP_HEADER *hdr, GWBUF *event);
+extern void avro_workers_new_trx(AVRO_INSTANCE *router);
+extern void avro_workers_wait(AVRO_INSTANCE *router);
+extern bool avro_cache_init(AVRO_BLOCK_CACHE *cache, int size);
+extern GWBUF* avro_cache_get(AVRO_BLOCK_CACHE *cache, MAXAVRO_FILE *file,
+                             enum avro_data_format format, gtid_pos_t *gtid);
+extern void avro_cache_add(AVRO_BLOCK_CACHE *cache, MAXAVRO_FILE *file, long pos,
+                           enum avro_data_format format, GWBUF *data, gtid_pos_t *gtid);
+extern void avro_client_subscribe(AVRO_INSTANCE *router, AVRO_CLIENT *client);
+extern void avro_client_unsubscribe(AVRO_INSTANCE *router, AVRO_CLIENT *client);
+extern int avro_notify_subscribers(AVRO_INSTANCE *router, const char *table);
+extern AVRO_ROW_FILTER* avro_filter_alloc();
+extern void avro_filter_free(AVRO_ROW_FILTER *filter);
+extern bool avro_filter_add_fields(AVRO_ROW_FILTER *filter, const char *list);
+extern bool avro_filter_add_predicate(AVRO_ROW_FILTER *filter, const char *str);
+extern bool avro_filter_match(AVRO_ROW_FILTER *filter, json_t *row);
+extern void avro_filter_project(AVRO_ROW_FILTER *filter, json_t *row);
+extern bool avro_kafka_init(AVRO_INSTANCE *router);
+extern struct avro_kafka_topic* avro_kafka_topic_open(AVRO_INSTANCE *router, const char *table);
+extern void avro_kafka_topic_close(struct avro_kafka_topic *topic);
+extern void avro_kafka_produce(AVRO_TABLE *table, TABLE_CREATE *create,
+                               const uint8_t *data, size_t len);
+extern void avro_kafka_flush(AVRO_INSTANCE *router);
+extern void avro_kafka_diagnostics(AVRO_INSTANCE *router, DCB *dcb);
 
 #define AVRO_CLIENT_UNREGISTERED 0x0000
 #define AVRO_CLIENT_REGISTERED   0x0001
@@ -138,6 +138,51 @@
 #define DEF_SHORT_BURST         15
 #define DEF_LONG_BURST          500
 #define DEF_BURST_SIZE          1024000 /* 1 Mb */
+#define DEF_EVENT_RING_SIZE     0       /* The event ring is disabled */
+
+/**
+ * The write buffer of the binlog file. When the buffer is full, the events are
+ * written up to an offset that is a multiple of BLR_WRITE_ALIGN.
+ */
+#define DEF_WRITE_BUFFER_SIZE   0       /* Each event is written separately */
+#define BLR_WRITE_ALIGN         4096
+#define BLR_MIN_WRITE_BUFFER    (2 * BLR_WRITE_ALIGN)
+
+/**
+ * Latency histograms of binlog writes and syncs. The upper limit of the first
+ * bucket is BLR_LATENCY_BASE microseconds and each following bucket has a
+ * limit ten times larger. The last bucket has no upper limit.
+ */
+#define BLR_LATENCY_BUCKETS     7
+#define BLR_LATENCY_BASE        10
+
+/**
+ * Semi-synchronous replication. With semi-sync, each event packet from the
+ * master has a two byte header after the OK byte: the magic byte and a flag
+ * that tells whether the master waits for an acknowledgement of the event.
+ * The acknowledgement starts with the same magic byte.
+ */
+#define BLR_SEMISYNC_MAGIC      0xef
+#define BLR_SEMISYNC_ACK_REQ    0x01
+#define BLR_SEMISYNC_HDR_LEN    2
+
+/**
+ * The binlog index files. The index of a binlog file has the name of the
+ * binlog file with BLR_INDEX_SUFFIX appended.
+ */
+#define DEF_INDEX_INTERVAL      0       /* The binlog files are not indexed */
+#define BLR_INDEX_SUFFIX        ".idx"
+
+/**
+ * Compressed binlog files. A closed binlog file is compressed in blocks of
+ * BLR_COMPRESS_BLOCK_SIZE bytes into a file that has the name of the binlog
+ * file with BLR_COMPRESS_SUFFIX appended. The housekeeper compresses one file
+ * every BLR_COMPRESS_FREQ seconds.
+ */
+#define BLR_COMPRESS_SUFFIX     ".z"
+#define BLR_COMPRESS_MAGIC      "MXSBLZ01"
+#define BLR_COMPRESS_BLOCK_SIZE (64 * 1024)
+#define BLR_COMPRESS_FREQ       5
 
 /**
  * master reconnect backoff constants
@@ -273,12 +318,129 @@ typedef struct
     SPINLOCK        lock;           /*< The spinlock for the cache */
 } BLCACHE;
 
+/**
+ * A binlog file that has events in the event ring
+ */
+typedef struct blr_ring_file
+{
+    char            binlogname[BINLOG_FNAMELEN + 1]; /*< Name of the binlog file */
+    uint64_t        first;          /*< Sequence number of the first event of the file */
+    struct blr_ring_file *next;     /*< The next, newer file */
+} BLR_RING_FILE;
+
+/**
+ * The ring of the latest binlog events written by the master. It is shared by
+ * all slaves, so that the slaves near the end of the binlog don't need to read
+ * the events from the binlog files.
+ */
+typedef struct
+{
+    BLCACHE_RECORD  *records;       /*< The events in a circular array */
+    int             capacity;       /*< Size of the records array */
+    int             start;          /*< Index of the oldest event */
+    int             cnt;            /*< The number of events in the ring */
+    uint64_t        first;          /*< Sequence number of the oldest event */
+    uint64_t        end_pos;        /*< Position after the newest event */
+    unsigned long   size;           /*< Total size of the events */
+    unsigned long   max_size;       /*< Maximum total size of the events */
+    BLR_RING_FILE   *files;         /*< The files of the events, oldest first */
+    BLR_RING_FILE   *last_file;     /*< The file of the newest event */
+    SPINLOCK        lock;           /*< The spinlock for the ring */
+} BLR_EVENT_RING;
+
+/**
+ * An entry of a binlog index file. An entry is written for every
+ * index_interval events, starting from the first event of the file. The
+ * values are stored in host byte order.
+ */
+typedef struct blr_index_entry
+{
+    uint32_t        pos;                            /*< Position of the event */
+    uint32_t        timestamp;                      /*< Timestamp of the event */
+    uint64_t        gtid_seq;                       /*< Sequence of the latest MariaDB GTID */
+    uint32_t        gtid_domain;                    /*< Domain of the latest MariaDB GTID */
+    uint32_t        gtid_server;                    /*< Server id of the latest MariaDB GTID */
+} BLR_INDEX_ENTRY;
+
+/**
+ * A sync group of binlog routers. The routers of a group store their binlog
+ * files on the same filesystem and sync it with one syncfs() call for all of
+ * them. A router that needs a sync while another one is syncing waits for it
+ * and for the next sync if its events were written after the sync started.
+ */
+typedef struct blr_sync_group
+{
+    char            *name;                          /*< Name of the group */
+    pthread_mutex_t lock;                           /*< Protects the state of the group */
+    pthread_cond_t  done;                           /*< Signalled when a sync completes */
+    bool            syncing;                        /*< A sync is in progress */
+    uint64_t        requests;                       /*< Number of sync requests */
+    uint64_t        synced;                         /*< The requests up to this one are synced */
+    uint64_t        last_sync;                      /*< Start of the last sync in milliseconds */
+    uint64_t        n_syncs;                        /*< Number of filesystem syncs */
+    struct blr_sync_group *next;                    /*< Next group */
+} BLR_SYNC_GROUP;
+
+/**
+ * A MariaDB GTID, domain-server_id-sequence
+ */
+typedef struct blr_gtid
+{
+    uint32_t        domain;                         /*< Replication domain */
+    uint32_t        server_id;                      /*< Server id of the origin */
+    uint64_t        seq;                            /*< Sequence number */
+} BLR_GTID;
+
+/**
+ * A read-only memory mapping of a binlog file. The events sent from the
+ * mapping hold a reference to it so that it stays valid until they have
+ * been written to the slaves.
+ */
+typedef struct blr_map
+{
+    uint8_t         *data;                          /*< The mapped file */
+    size_t          size;                           /*< Size of the mapping */
+    int             refcount;                       /*< References to the mapping */
+    int             fd;                             /*< File used for sendfile() or -1 */
+} BLR_MAP;
+
+/**
+ * The trailer at the end of a compressed binlog file. It is preceded by the
+ * offsets of the compressed blocks, n_blocks + 1 of them, the last offset
+ * being the end of the last block.
+ */
+typedef struct blr_compress_trailer
+{
+    char            magic[8];                       /*< BLR_COMPRESS_MAGIC */
+    uint64_t        size;                           /*< Size of the binlog file */
+    uint32_t        block_size;                     /*< Uncompressed size of a block */
+    uint32_t        n_blocks;                       /*< Number of blocks */
+} BLR_COMPRESS_TRAILER;
+
+/**
+ * An open compressed binlog file. The latest decompressed block is kept so
+ * that consecutive events are decompressed only once.
+ */
+typedef struct blr_zfile
+{
+    uint64_t        size;                           /*< Size of the binlog file */
+    uint32_t        block_size;                     /*< Uncompressed size of a block */
+    uint32_t        n_blocks;                       /*< Number of blocks */
+    uint64_t        *offsets;                       /*< Offsets of the blocks */
+    uint8_t         *block;                         /*< The decompressed block */
+    uint8_t         *cbuf;                          /*< Buffer for a compressed block */
+    long            cached;                         /*< Number of the decompressed block or -1 */
+} BLR_ZFILE;
+
 typedef struct blfile
 {
     char            binlogname[BINLOG_FNAMELEN + 1]; /*< Name of the binlog file */
     int             fd;                             /*< Actual file descriptor */
     int             refcnt;                         /*< Reference count for file */
     BLCACHE         *cache;                         /*< Record cache for this file */
+    BLR_MAP         *map;                           /*< Mapping of the file, if mapped */
+    bool            map_failed;                     /*< Mapping the file has failed */
+    BLR_ZFILE       *zfile;                         /*< The compressed file, if compressed */
     SPINLOCK        lock;                           /*< The file lock */
     struct blfile   *next;                          /*< Next file in list */
 } BLFILE;
@@ -351,6 +513,8 @@ typedef struct router_slave
     SPINLOCK        catch_lock;     /*< Event catchup lock */
     unsigned int    cstate;         /*< Catch up state */
     bool            mariadb10_compat;/*< MariaDB 10.0 compatibility */
+    bool            use_gtid;       /*< The slave connects with @slave_connect_state */
+    BLR_GTID        connect_gtid;   /*< The last GTID the slave has, sequence 0 for none */
     SPINLOCK        rses_lock;      /*< Protects rses_deleted */
     pthread_t       pthread;
     struct router_instance
@@ -384,8 +548,9 @@ typedef struct
     uint64_t        n_binlogs_ses;  /*< Number of binlog records from master */
     uint64_t        n_binlog_errors;/*< Number of binlog records from master */
     uint64_t        n_rotates;      /*< Number of binlog rotate events */
-    uint64_t        n_cachehits;    /*< Number of hits on the binlog cache */
-    uint64_t        n_cachemisses;  /*< Number of misses on the binlog cache */
+    uint64_t        n_cachehits;    /*< Number of events read from the event ring */
+    uint64_t        n_cachemisses;  /*< Number of events not found in the event ring */
+    uint64_t        n_mapped;       /*< Number of events sent from mapped binlog files */
     int             n_registered;   /*< Number of registered slaves */
     int             n_masterstarts; /*< Number of times connection restarted */
     int             n_delayedreconnects;
@@ -396,6 +561,12 @@ typedef struct
     uint64_t        n_artificial;   /*< Artificial events not written to disk */
     int             n_badcrc;       /*< No. of bad CRC's from master */
     uint64_t        events[MAX_EVENT_TYPE_END + 1]; /*< Per event counters */
+    uint64_t        n_writes;       /*< Number of writes to the binlog file */
+    uint64_t        n_syncs;        /*< Number of syncs of the binlog file */
+    uint64_t        write_latency[BLR_LATENCY_BUCKETS]; /*< Write latency histogram */
+    uint64_t        sync_latency[BLR_LATENCY_BUCKETS];  /*< Sync latency histogram */
+    uint64_t        n_semisync_acks; /*< Number of semi-sync acknowledgements sent */
+    uint64_t        ack_latency[BLR_LATENCY_BUCKETS];   /*< Semi-sync acknowledgement latency histogram */
     uint64_t        lastsample;
     int             minno;
     int             minavgs[BLR_NSTATS_MINUTES];
@@ -454,6 +625,9 @@ typedef struct router_instance
     char                    *binlogdir;     /*< The directory with the binlog files */
     SPINLOCK                binlog_lock;    /*< Lock to control update of the binlog position */
     int                     trx_safe;       /*< Detect and handle partial transactions */
+    bool                    mmap_binlog;    /*< Read closed binlog files through mmap */
+    bool                    sendfile_binlog; /*< Send mapped events with sendfile() */
+    bool                    slave_pull;     /*< Slave threads read new events themselves */
     int                     pending_transaction; /*< Pending transaction */
     enum blr_event_state    master_event_state; /*< Packet read state */
     uint32_t                stored_checksum; /*< The current value of the checksum */
@@ -473,12 +647,38 @@ typedef struct router_instance
                                              *  file being written
                                              */
     uint64_t          last_written; /*< Position of the last write operation */
+    uint8_t           *wbuf;        /*< Events not yet written to the binlog file */
+    unsigned long     wbuf_size;    /*< Size of the write buffer, 0 if not used */
+    unsigned long     wbuf_len;     /*< Number of bytes in the write buffer */
+    uint64_t          wbuf_pos;     /*< Binlog file position of the write buffer */
+    SPINLOCK          wbuf_lock;    /*< Lock for the write buffer */
+    unsigned int      sync_events;  /*< Sync the binlog file every N events */
+    unsigned int      sync_interval; /*< Sync the binlog file every N milliseconds */
+    bool              sync_commit;  /*< Sync the binlog file at transaction commit */
+    unsigned int      unsynced_events; /*< Events written after the last sync */
+    uint64_t          last_sync;    /*< Time of the last sync in milliseconds */
+    BLR_SYNC_GROUP    *sync_group;  /*< The sync group of the router or NULL */
+    bool              semisync;     /*< Request semi-sync replication from the master */
+    bool              semisync_sync; /*< Sync the binlog file before acknowledging events */
+    bool              master_semisync; /*< The master sends events with the semi-sync header */
+    bool              ack_requested; /*< The event being received must be acknowledged */
+    bool              ack_pending;  /*< An acknowledgement is waiting for the batch to be written */
+    char              ack_file[BINLOG_FNAMELEN + 1]; /*< Binlog file of the pending acknowledgement */
+    uint64_t          ack_pos;      /*< Binlog position of the pending acknowledgement */
+    uint64_t          ack_start;    /*< Time the acknowledged event was received in microseconds */
+    int               index_fd;     /*< Index file of the current binlog file or -1 */
+    unsigned int      index_interval; /*< Index every N events, 0 if not indexed */
+    bool              compress_binlog; /*< Compress the closed binlog files */
+    int               compressed_upto; /*< The binlog files up to this number are compressed */
+    unsigned int      index_events; /*< Events written after the last index entry */
+    BLR_INDEX_ENTRY   index_gtid;   /*< The latest GTID in the current binlog file */
     uint64_t          last_event_pos;       /*< Position of last event written */
     uint64_t          current_safe_event;
     /*< Position of the latest safe event being sent to slaves */
     char              prevbinlog[BINLOG_FNAMELEN + 1];
     int               rotating;     /*< Rotation in progress flag */
     BLFILE            *files;       /*< Files used by the slaves */
+    BLR_EVENT_RING    event_ring;   /*< The latest events for the slaves */
     SPINLOCK          fileslock;    /*< Lock for the files queue above */
     unsigned int      low_water;    /*< Low water mark for client DCB */
     unsigned int      high_water;   /*< High water mark for client DCB */
@@ -528,8 +728,10 @@ typedef struct router_instance
 #define BLRM_BINLOGDUMP         0x0014
 #define BLRM_SLAVE_STOPPED      0x0015
 #define BLRM_MARIADB10          0x0016
+#define BLRM_CHECK_SEMISYNC     0x0017
+#define BLRM_REQUEST_SEMISYNC   0x0018
 
-#define BLRM_MAXSTATE           0x0016
+#define BLRM_MAXSTATE           0x0018
 
 static char *blrm_states[] =
 {
@@ -539,7 +741,8 @@ static char *blrm_states[] =
     "Set Slave UUID", "Set Names latin1", "Set Names utf8", "select 1",
     "select version()", "select @@version_comment", "select @@hostname",
     "select @@max_allowed_packet", "Register slave", "Binlog Dump", "Slave stopped",
-    "Set MariaDB slave capability"
+    "Set MariaDB slave capability", "Check semi-sync support",
+    "Request semi-sync replication"
 };
 
 #define BLRS_CREATED            0x0000
@@ -608,13 +811,30 @@ extern int blr_slave_request(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
 extern void blr_slave_rotate(ROUTER_INSTANCE *, ROUTER_SLAVE *, uint8_t *);
 extern int blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large);
 extern void blr_init_cache(ROUTER_INSTANCE *);
+extern void blr_ring_add(ROUTER_INSTANCE *, REP_HEADER *, uint64_t, uint8_t *, uint32_t);
+extern GWBUF *blr_ring_read(ROUTER_INSTANCE *, char *, unsigned long, REP_HEADER *);
+extern void blr_ring_clear(ROUTER_INSTANCE *);
 
 extern int  blr_file_init(ROUTER_INSTANCE *);
 extern int  blr_write_binlog_record(ROUTER_INSTANCE *, REP_HEADER *, uint32_t pos, uint8_t *);
 extern int  blr_file_rotate(ROUTER_INSTANCE *, char *, uint64_t);
 extern void blr_file_flush(ROUTER_INSTANCE *);
+extern void blr_add_latency(uint64_t *, uint64_t);
+extern bool blr_file_write_pending(ROUTER_INSTANCE *);
+extern void blr_index_open(ROUTER_INSTANCE *, bool);
+extern void blr_index_add(ROUTER_INSTANCE *, REP_HEADER *, uint64_t, uint8_t *);
+extern void blr_index_discard(ROUTER_INSTANCE *);
+extern int  blr_index_check_position(ROUTER_INSTANCE *, char *, uint32_t);
+extern int  blr_index_find_gtid(ROUTER_INSTANCE *, const BLR_GTID *, char *, uint32_t *);
+extern BLR_SYNC_GROUP *blr_sync_group_get(const char *);
+extern bool blr_sync_group_sync(BLR_SYNC_GROUP *, int);
+extern void blr_compress_start(ROUTER_INSTANCE *);
+extern BLR_ZFILE *blr_compress_open(int);
+extern void blr_compress_close(BLR_ZFILE *);
+extern int  blr_compress_read(BLR_ZFILE *, int, uint8_t *, size_t, unsigned long);
 extern BLFILE *blr_open_binlog(ROUTER_INSTANCE *, char *);
 extern GWBUF *blr_read_binlog(ROUTER_INSTANCE *, BLFILE *, unsigned long, REP_HEADER *, char *);
+extern int blr_file_read(BLFILE *, BLR_MAP *, uint8_t *, size_t, unsigned long);
 extern void blr_close_binlog(ROUTER_INSTANCE *, BLFILE *);
 extern unsigned long blr_file_size(BLFILE *);
 extern int blr_statistics(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
@@ -635,6 +855,7 @@ extern bool blr_send_event(blr_thread_role_t role,
                            uint32_t binlog_pos,
                            ROUTER_SLAVE *slave,
                            REP_HEADER *hdr,
-                           uint8_t *buf);
+                           uint8_t *buf,
+                           GWBUF *record);
 
 #endif
@@ -139,4 +139,5 @@ extern void         maxinfo_send_parse_error(DCB *, char *, PARSE_ERROR);
 extern void     maxinfo_send_error(DCB *, int, char  *);
 extern RESULTSET    *maxinfo_variables();
 extern RESULTSET    *maxinfo_status();
+extern int          maxinfo_metrics(DCB *);
 #endif
@@ -32,6 +32,8 @@
  *                  gw_find_mysql_user_password_sha1()
  * 28-02-2014   Massimiliano Pinto  MYSQL_DATABASE_MAXLEN,MYSQL_USER_MAXLEN moved to dbusers.h
  * 07-02-2016   Martin Brampton     Extend MYSQL_session type; add MYSQL_AUTH_SUCCEEDED
+ * 14-10-2016   MariaDB Corporation Add the reply tracker of the backend connections
+ * 14-10-2016   MariaDB Corporation Add the start of the busy time of the backend connections
  *
  */
 
@@ -61,6 +63,7 @@
 #include <version.h>
 #include <housekeeper.h>
 #include <mysql.h>
+#include <timer.h>
 
 #define GW_MYSQL_VERSION "5.5.5-10.0.0 " MAXSCALE_VERSION "-maxscale"
 #define GW_MYSQL_LOOP_TIMEOUT 300000000
@@ -69,6 +72,18 @@
 #define MYSQL_HEADER_LEN 4L
 #define MYSQL_CHECKSUM_LEN 4L
 
+/** The header of a compressed packet: compressed length, sequence and uncompressed length */
+#define MYSQL_COMPRESSED_HEADER_LEN 7L
+/** Largest payload of a compressed packet */
+#define MYSQL_COMPRESSED_MAX_PAYLOAD 0xffffffL
+/** Payloads shorter than this are sent without compressing them */
+#define MYSQL_COMPRESS_MIN_LEN 50
+
+/** Bytes of a reply packet needed to read the server status of an OK packet */
+#define MYSQL_REPLY_PEEK (MYSQL_HEADER_LEN + 21)
+/** Number of commands whose replies the reply tracker can wait for */
+#define MYSQL_REPLY_MAX_PENDING 64
+
 #define GW_MYSQL_PROTOCOL_VERSION 10 // version is 10
 #define GW_MYSQL_HANDSHAKE_FILLER 0x00
 #define GW_MYSQL_SERVER_CAPABILITIES_BYTE1 0xff
@@ -100,6 +115,7 @@ struct dcb;
 #define MYSQL_FAILED_AUTH_SSL 3
 #define MYSQL_AUTH_SSL_INCOMPLETE 4
 #define MYSQL_AUTH_NO_SESSION 5
+#define MYSQL_AUTH_USERS_OUTDATED 6
 
 typedef enum
 {
@@ -245,6 +261,9 @@ typedef enum enum_server_command mysql_server_cmd_t;
 
 static const mysql_server_cmd_t MYSQL_COM_UNDEFINED = (mysql_server_cmd_t) - 1;
 
+/** COM_RESET_CONNECTION of MariaDB 10.2 and MySQL 5.7, newer than the client headers */
+#define MYSQL_COM_RESET_CONNECTION 0x1f
+
 /**
  * List of server commands, and number of response packets are stored here.
  * server_command_t is used in MySQLProtocol structure, so for each DCB there is
@@ -258,6 +277,63 @@ typedef struct server_command_st
     struct server_command_st* scom_next;
 } server_command_t;
 
+/**
+ * The position in a stream of packets that arrives in arbitrary pieces. The
+ * start of each packet is gathered into a small buffer, the rest of it is
+ * skipped without being looked at.
+ */
+typedef struct mysql_packet_stream
+{
+    uint64_t    position;                   /*< Bytes of the stream seen so far */
+    uint32_t    left;                       /*< Bytes of the current packet to skip */
+    int         head_len;                   /*< Bytes gathered to head */
+    uint8_t     head[MYSQL_REPLY_PEEK];     /*< The start of the current packet */
+} MYSQL_PACKET_STREAM;
+
+/** The part of a reply that the reply tracker is reading */
+typedef enum
+{
+    MYSQL_REPLY_START,      /*< The first packet of a reply or of a result */
+    MYSQL_REPLY_FIELDS,     /*< Column definitions until an EOF packet */
+    MYSQL_REPLY_ROWS,       /*< Rows until an EOF or an ERR packet */
+    MYSQL_REPLY_PACKETS     /*< A known number of packets */
+} mysql_reply_state_t;
+
+/**
+ * The reply tracker of a backend connection. It follows the commands written
+ * to the server and the replies read from it, one packet at a time, and knows
+ * where each reply ends without the replies being parsed again.
+ */
+typedef struct mysql_reply_tracker
+{
+    MYSQL_PACKET_STREAM out;                /*< Position in the written commands */
+    MYSQL_PACKET_STREAM in;                 /*< Position in the read replies */
+    mysql_reply_state_t state;              /*< What the next packet of the reply is */
+    uint8_t     pending[MYSQL_REPLY_MAX_PENDING]; /*< Commands waiting for a reply */
+    int         first_pending;              /*< Index of the oldest pending command */
+    int         n_pending;                  /*< Number of pending commands */
+    uint64_t    n_columns;                  /*< Columns of the current result */
+    uint64_t    n_rows;                     /*< Rows of the current result so far */
+    uint64_t    n_reply_rows;               /*< Rows of all the results of the current
+                                             * reply so far */
+    bool        more_results;               /*< The last result is followed by another
+                                             * one of the same reply */
+    uint32_t    n_packets;                  /*< Packets left in MYSQL_REPLY_PACKETS */
+    uint16_t    status;                     /*< Server status of the last OK or EOF */
+    bool        error;                      /*< The last reply was an error */
+    uint32_t    stmt_id;                    /*< Statement id if the last reply was a
+                                             * COM_STMT_PREPARE OK, otherwise 0 */
+    uint64_t    n_replies;                  /*< Replies read, discarded ones excluded */
+    int         n_discard;                  /*< Replies that are not given to the router */
+    uint64_t    discard_end;                /*< Where the discarded replies end in the stream */
+    bool        reset_failed;               /*< A discarded COM_CHANGE_USER or
+                                             * COM_RESET_CONNECTION failed */
+} MYSQL_REPLY_TRACKER;
+
+/** Whether all replies to the commands written to the server have been read */
+#define MYSQL_REPLY_IS_COMPLETE(t) ((t)->n_pending == 0 && (t)->state == MYSQL_REPLY_START && \
+                                    (t)->in.left == 0 && (t)->in.head_len == 0)
+
 /**
  * MySQL Protocol specific state data.
  *
@@ -287,6 +363,21 @@ typedef struct
     unsigned        long tid;                         /*< MySQL Thread ID, in
         * handshake */
     unsigned int    charset;                          /*< MySQL character set at connect time */
+    bool            compress;                         /*< Compressed protocol is in use */
+    uint8_t         compress_seq;                     /*< Sequence number of the next
+        * compressed packet */
+    GWBUF*          compress_readq;                   /*< Partially read compressed packet */
+    MYSQL_REPLY_TRACKER reply;                        /*< Replies of a backend connection */
+    bool            users_refreshed;                  /*< Authentication has waited for
+        * a reload of the users */
+    TIMER           query_timer;                      /*< Kills a query of a backend
+        * connection that runs too long */
+    uint64_t        busy_start;                       /*< Time-stamp counter when the
+        * backend started to execute the queries, 0 if it is idle */
+    bool            probe_db_changed;                 /*< The client may have changed
+        * the default database */
+    bool            probe_vars_changed;               /*< The client may have changed
+        * the session variables */
 #if defined(SS_DEBUG)
     skygw_chk_t     protocol_chk_tail;
 #endif
@@ -320,6 +411,11 @@ typedef struct
 
 MySQLProtocol* mysql_protocol_init(DCB* dcb, int fd);
 void           mysql_protocol_done (DCB* dcb);
+GWBUF*         mysql_compress_packets(MySQLProtocol* p, GWBUF* queue);
+GWBUF*         mysql_compress_stream(MySQLProtocol* p, GWBUF* queue, int level);
+bool           mysql_decompress_packets(MySQLProtocol* p, GWBUF* queue, GWBUF** output);
+void           mysql_reply_track_commands(MySQLProtocol* p, GWBUF* queue);
+size_t         mysql_reply_track_replies(MySQLProtocol* p, GWBUF* queue, size_t offset);
 const char *gw_mysql_protocol_state2string(int state);
 int        mysql_send_com_quit(DCB* dcb, int packet_number, GWBUF* buf);
 GWBUF*     mysql_create_com_quit(GWBUF* bufparam, int packet_number);
@@ -393,4 +489,161 @@ void init_response_status (
     int* npackets,
     ssize_t* nbytes);
 
+/**
+ * A bounds-checked reader of the fields of a packet. The fields are read in
+ * place. A read that would go past the end of the data fails and marks the
+ * reader failed, so a packet can be parsed in one pass and checked once at
+ * the end.
+ */
+typedef struct mysql_reader
+{
+    uint8_t *ptr;       /*< The next byte to read */
+    uint8_t *end;       /*< The end of the data */
+    bool    failed;     /*< Whether a read went past the end */
+} MYSQL_READER;
+
+static inline void mysql_reader_init(MYSQL_READER *r, uint8_t *data, size_t len)
+{
+    r->ptr = data;
+    r->end = data + len;
+    r->failed = false;
+}
+
+/** Number of bytes left in the reader */
+static inline size_t mysql_reader_left(MYSQL_READER *r)
+{
+    return r->end - r->ptr;
+}
+
+/** Read n bytes, returns a pointer to them or NULL if there are not enough */
+static inline uint8_t *mysql_reader_bytes(MYSQL_READER *r, size_t n)
+{
+    uint8_t *rval = NULL;
+
+    if (!r->failed && mysql_reader_left(r) >= n)
+    {
+        rval = r->ptr;
+        r->ptr += n;
+    }
+    else
+    {
+        r->failed = true;
+    }
+
+    return rval;
+}
+
+/** Read a little-endian integer of n bytes, at most 4, returns 0 on failure */
+static inline uint32_t mysql_reader_int(MYSQL_READER *r, size_t n)
+{
+    uint8_t *ptr = mysql_reader_bytes(r, n);
+    uint32_t rval = 0;
+
+    for (size_t i = 0; ptr && i < n; i++)
+    {
+        rval |= (uint32_t)ptr[i] << (8 * i);
+    }
+
+    return rval;
+}
+
+/**
+ * Read a null terminated string, returns the string and stores its length
+ * without the terminator in len. Returns NULL if the string is not terminated
+ * before the end of the data.
+ */
+static inline char *mysql_reader_string(MYSQL_READER *r, size_t *len)
+{
+    uint8_t *nul = r->failed ? NULL : (uint8_t*)memchr(r->ptr, '\0', mysql_reader_left(r));
+    char *rval = NULL;
+
+    if (nul)
+    {
+        rval = (char*)r->ptr;
+        *len = nul - r->ptr;
+        r->ptr = nul + 1;
+    }
+    else
+    {
+        r->failed = true;
+    }
+
+    return rval;
+}
+
+/**
+ * A bounds-checked writer of the fields of a packet. A write that would go past
+ * the end of the buffer is not done and marks the writer failed.
+ */
+typedef struct mysql_writer
+{
+    uint8_t *ptr;       /*< Where the next byte is written */
+    uint8_t *end;       /*< The end of the buffer */
+    bool    failed;     /*< Whether a write went past the end */
+} MYSQL_WRITER;
+
+static inline void mysql_writer_init(MYSQL_WRITER *w, uint8_t *data, size_t len)
+{
+    w->ptr = data;
+    w->end = data + len;
+    w->failed = false;
+}
+
+/** Reserve n bytes, returns a pointer to them or NULL if there is no room */
+static inline uint8_t *mysql_writer_reserve(MYSQL_WRITER *w, size_t n)
+{
+    uint8_t *rval = NULL;
+
+    if (!w->failed && (size_t)(w->end - w->ptr) >= n)
+    {
+        rval = w->ptr;
+        w->ptr += n;
+    }
+    else
+    {
+        w->failed = true;
+    }
+
+    return rval;
+}
+
+static inline void mysql_writer_bytes(MYSQL_WRITER *w, const void *data, size_t n)
+{
+    uint8_t *ptr = mysql_writer_reserve(w, n);
+
+    if (ptr)
+    {
+        memcpy(ptr, data, n);
+    }
+}
+
+/** Write n zero bytes */
+static inline void mysql_writer_zeros(MYSQL_WRITER *w, size_t n)
+{
+    uint8_t *ptr = mysql_writer_reserve(w, n);
+
+    if (ptr)
+    {
+        memset(ptr, 0, n);
+    }
+}
+
+/** Write a little-endian integer of n bytes, at most 4 */
+static inline void mysql_writer_int(MYSQL_WRITER *w, uint32_t value, size_t n)
+{
+    uint8_t *ptr = mysql_writer_reserve(w, n);
+
+    for (size_t i = 0; ptr && i < n; i++)
+    {
+        ptr[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+/** Write a string of len bytes and its null terminator */
+static inline void mysql_writer_string(MYSQL_WRITER *w, const char *str, size_t len)
+{
+    mysql_writer_bytes(w, str, len);
+    mysql_writer_zeros(w, 1);
+}
+
 #endif /** _MYSQL_PROTOCOL_H */
@@ -18,6 +18,7 @@
  *
  * Date         Who             Description
  * 17-07-2014   Mark Riddoch    Initial implementation
+ * 14-10-2016   MariaDB Corporation Cache of parsed hint comments
  */
 #include <hint.h>
 
@@ -72,6 +73,20 @@ typedef struct hintstack
         *next;
 } HINTSTACK;
 
+/** Number of parsed hint comments cached in each session */
+#define HINT_CACHE_SIZE 8
+
+/**
+ * A parsed hint comment. Only comments that do not change the hint stack or
+ * the named hints of the session are cached.
+ */
+typedef struct
+{
+    char        *comment;   /*< The comment from its start to the end of the statement */
+    int         len;        /*< Length of the comment */
+    HINT        *hints;     /*< The parsed hints, NULL if the comment has no hints */
+} HINT_CACHE_ENTRY;
+
 /**
  * The hint instance structure
  */
@@ -90,6 +105,8 @@ typedef struct
     int     query_len;
     HINTSTACK   *stack;
     NAMEDHINTS  *named_hints;   /* The named hints defined in this session */
+    HINT_CACHE_ENTRY cache[HINT_CACHE_SIZE]; /* Recently parsed hint comments */
+    int         cache_next;     /* The next cache entry to replace */
 } HINT_SESSION;
 
 /* Some useful macros */
@@ -109,6 +126,7 @@ typedef struct
 extern HINT *hint_parser(HINT_SESSION *session, GWBUF *request);
 NAMEDHINTS* free_named_hint(NAMEDHINTS* named_hint);
 HINTSTACK*  free_hint_stack(HINTSTACK* hint_stack);
+void        free_hint_cache(HINT_SESSION *session);
 
 
 
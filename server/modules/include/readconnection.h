@@ -22,11 +22,16 @@
  * Date     Who     Description
  * 14/06/13 Mark Riddoch    Initial implementation
  * 27/06/14 Mark Riddoch    Addition of server weight percentage
+ * 14/10/16 MariaDB Corporation Connection multiplexing
+ * 14/10/16 MariaDB Corporation Weighted round-robin selection
  *
  * @endverbatim
  */
 #include <dcb.h>
 
+/** Maximum number of session commands replayed on a new backend connection */
+#define RCON_MAX_HISTORY 50
+
 /**
  * Internal structure used to define the set of backend servers we are routing
  * connections to. This provides the storage for routing module specific data
@@ -55,6 +60,16 @@ typedef struct router_client_session
     DCB *client_dcb; /**< Client DCB */
     struct router_client_session *next;
     int rses_capabilities; /*< input type, for example */
+    GWBUF *partial; /*< Incomplete packet held back in pipelining mode */
+    int64_t query_start; /*< When the oldest unanswered query was routed, 0 if none */
+    int n_replies; /*< Replies not yet read, when multiplexing */
+    uint64_t n_seen; /*< Replies counted by the reply tracker of the backend connection */
+    bool in_trx; /*< The server reported an open transaction or autocommit off */
+    bool pinned; /*< The session has state that can not be restored, the
+                  * backend connection is kept until the end of the session */
+    GWBUF *history; /*< Commands that restore the state of the session on
+                     * another backend connection, one packet per buffer */
+    int n_history; /*< Number of commands in the history */
 #if defined(SS_DEBUG)
     skygw_chk_t rses_chk_tail;
 #endif
@@ -67,6 +82,8 @@ typedef struct
 {
     int n_sessions; /*< Number sessions created     */
     int n_queries; /*< Number of queries forwarded */
+    int n_detached; /*< Idle backend connections returned to the pool */
+    int n_attached; /*< Backend connections taken for a session again */
 } ROUTER_STATS;
 
 /**
@@ -80,6 +97,18 @@ typedef struct router_instance
     BACKEND **servers; /*< List of backend servers                  */
     unsigned int bitmask; /*< Bitmask to apply to server->status       */
     unsigned int bitvalue; /*< Required value of server->status         */
+    bool pipeline; /*< Forward only complete packets and stream the replies */
+    bool multiplex; /*< Release the backend connections between transactions */
+    bool round_robin; /*< Select the servers in weighted round-robin order */
+    BACKEND **rr_slots; /*< The usable servers in round-robin order */
+    int rr_max_slots; /*< Size of rr_slots */
+    int rr_n_slots; /*< Number of servers in rr_slots, 0 if none is usable */
+    int rr_generation; /*< Server status generation rr_slots was built for */
+    BACKEND *rr_master; /*< The root master when rr_slots was built */
+    int *rr_weights; /*< Reduced weights of the usable servers, used by the rebuild */
+    int *rr_credit; /*< Credits of the servers, used by the rebuild */
+    unsigned int *rr_cursors; /*< Positions of the threads in rr_slots */
+    int rr_n_cursors; /*< Number of positions */
     ROUTER_STATS stats; /*< Statistics for this router               */
     struct router_instance
         *next;
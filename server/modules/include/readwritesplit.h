@@ -26,7 +26,11 @@
 
 #include <dcb.h>
 #include <hashtable.h>
+#include <query_classifier.h>
+#include <server.h>
+#include <timer.h>
 #include <math.h>
+#include <sys/time.h>
 
 #undef PREP_STMT_CACHING
 
@@ -54,7 +58,8 @@ typedef enum bref_state
     BREF_WAITING_RESULT   = 0x02, /*< for session commands only */
     BREF_QUERY_ACTIVE     = 0x04, /*< for other queries */
     BREF_CLOSED           = 0x08,
-    BREF_FATAL_FAILURE    = 0x10 /*< Backend references that should be dropped */
+    BREF_FATAL_FAILURE    = 0x10, /*< Backend references that should be dropped */
+    BREF_DISCARD_REPLY    = 0x20  /*< The reply to a hedged read that lost is drained */
 } bref_state_t;
 
 #define BREF_IS_NOT_USED(s)         ((s)->bref_state & ~BREF_IN_USE)
@@ -63,6 +68,7 @@ typedef enum bref_state
 #define BREF_IS_QUERY_ACTIVE(s)     ((s)->bref_state & BREF_QUERY_ACTIVE)
 #define BREF_IS_CLOSED(s)           ((s)->bref_state & BREF_CLOSED)
 #define BREF_HAS_FAILED(s)          ((s)->bref_state & BREF_FATAL_FAILURE)
+#define BREF_IS_DISCARDING(s)       ((s)->bref_state & BREF_DISCARD_REPLY)
 
 typedef enum backend_type_t
 {
@@ -99,8 +105,7 @@ typedef enum rses_property_type_t
     RSES_PROP_TYPE_UNDEFINED = -1,
     RSES_PROP_TYPE_SESCMD    = 0,
     RSES_PROP_TYPE_FIRST     = RSES_PROP_TYPE_SESCMD,
-    RSES_PROP_TYPE_TMPTABLES,
-    RSES_PROP_TYPE_LAST      = RSES_PROP_TYPE_TMPTABLES,
+    RSES_PROP_TYPE_LAST      = RSES_PROP_TYPE_SESCMD,
     RSES_PROP_TYPE_COUNT     = RSES_PROP_TYPE_LAST + 1
 } rses_property_type_t;
 
@@ -116,8 +121,10 @@ typedef enum select_criteria
     LEAST_ROUTER_CONNECTIONS,   /*< connections established by this router */
     LEAST_BEHIND_MASTER,
     LEAST_CURRENT_OPERATIONS,
-    DEFAULT_CRITERIA   = LEAST_CURRENT_OPERATIONS,
-    LAST_CRITERIA               /*< not used except for an index */
+    LEAST_RESPONSE_TIME,        /*< average response time, reads spread by weighted random choice */
+    LEAST_SERVER_LOAD,          /*< load metrics sampled by the monitor */
+    LAST_CRITERIA,              /*< not used except for an index */
+    DEFAULT_CRITERIA   = LEAST_CURRENT_OPERATIONS
 } select_criteria_t;
 
 
@@ -125,6 +132,12 @@ typedef enum select_criteria
 #define CONFIG_MAX_SLAVE_CONN 1
 #define CONFIG_MAX_SLAVE_RLAG -1 /*< not used */
 #define CONFIG_SQL_VARIABLES_IN TYPE_ALL
+#define CONFIG_CAUSAL_READS_TIMEOUT 10 /*< seconds */
+#define CONFIG_TRX_REPLAY_MAX_SIZE (1024 * 1024) /*< bytes */
+#define CONFIG_TRX_REPLAY_TIMEOUT 10 /*< seconds */
+
+/** Milliseconds between the checks for a new master to replay a transaction on */
+#define RWSPLIT_REPLAY_INTERVAL 20
 
 #define GET_SELECT_CRITERIA(s)                                                                  \
         (strncmp(s,"LEAST_GLOBAL_CONNECTIONS", strlen("LEAST_GLOBAL_CONNECTIONS")) == 0 ?       \
@@ -134,7 +147,29 @@ typedef enum select_criteria
         strncmp(s,"LEAST_ROUTER_CONNECTIONS", strlen("LEAST_ROUTER_CONNECTIONS")) == 0 ?        \
         LEAST_ROUTER_CONNECTIONS : (                                                            \
         strncmp(s,"LEAST_CURRENT_OPERATIONS", strlen("LEAST_CURRENT_OPERATIONS")) == 0 ?        \
-        LEAST_CURRENT_OPERATIONS : UNDEFINED_CRITERIA))))
+        LEAST_CURRENT_OPERATIONS : (                                                            \
+        strncmp(s,"LEAST_RESPONSE_TIME", strlen("LEAST_RESPONSE_TIME")) == 0 ?                  \
+        LEAST_RESPONSE_TIME : (                                                                 \
+        strncmp(s,"LEAST_SERVER_LOAD", strlen("LEAST_SERVER_LOAD")) == 0 ?                      \
+        LEAST_SERVER_LOAD : UNDEFINED_CRITERIA))))))
+
+/** Number of buckets in the table of shared session commands */
+#define SESCMD_SHARED_BUCKETS 1024
+
+/** Longest session command packet that is shared between the sessions */
+#define SESCMD_SHARED_MAX_LEN 4096
+
+/**
+ * A session command packet that the sessions which have executed the same
+ * command share in their histories
+ */
+typedef struct sescmd_shared_st
+{
+    uint64_t                 hash;     /*< Hash of the packet */
+    GWBUF*                   buf;      /*< The packet, never modified */
+    int                      refcount; /*< History entries that use the packet */
+    struct sescmd_shared_st* next;     /*< Next entry in the bucket */
+} sescmd_shared_t;
 
 /**
  * Session variable command
@@ -146,12 +181,18 @@ typedef struct mysql_sescmd_st
 #endif
     rses_property_t*   my_sescmd_prop;       /*< parent property */
     GWBUF*             my_sescmd_buf;        /*< query buffer */
+    sescmd_shared_t*   my_sescmd_shared;     /*< The shared packet that my_sescmd_buf
+                                              *  is a clone of, NULL if not shared */
     unsigned char      my_sescmd_packet_type; /*< packet type */
     bool               my_sescmd_is_replied; /*< is cmd replied to client */
     unsigned char      reply_cmd; /*< The reply command. One of OK, ERR, RESULTSET or
                                    *  LOCAL_INFILE. Slave servers are compared to this
                                    *  when they return session command replies.*/
     int      position; /*< Position of this command */
+    char*    my_sescmd_key; /*< What the command sets, e.g. "set:autocommit" or "use".
+                             *  A later command with the same key supersedes this one.
+                             *  NULL if the command can't be superseded. */
+    bool     my_sescmd_stateless; /*< The command does not change the session state */
 #if defined(SS_DEBUG)
     skygw_chk_t        my_sescmd_chk_tail;
 #endif
@@ -172,7 +213,6 @@ struct rses_property_st
     union rses_prop_data
     {
         mysql_sescmd_t   sescmd;
-        HASHTABLE*       temp_tables;
     } rses_prop_data;
     rses_property_t*     rses_prop_next; /*< next property of same type */
 #if defined(SS_DEBUG)
@@ -211,11 +251,82 @@ typedef struct backend_st
     int             backend_conn_count;  /*< Number of connections to the server */
     bool            be_valid; /*< Valid when belongs to the router's configuration */
     int             weight; /*< Desired weighting on the load. Expressed in .1% increments */
+    int             avg_response_time; /*< Moving average of response times in microseconds,
+                                        * 0 if nothing has been measured */
+    int             hedge_delay; /*< The 95th percentile of the latencies of the server in
+                                  * milliseconds, 0 if nothing has been measured */
+    time_t          hedge_delay_time; /*< When hedge_delay was calculated */
 #if defined(SS_DEBUG)
     skygw_chk_t     be_chk_tail;
 #endif
 } BACKEND;
 
+/**
+ * The packet of a reply to a statement of a split multi-statement query that
+ * comes next
+ */
+typedef enum rses_multi_state
+{
+    RSES_MULTI_START,   /*< The first packet of a result */
+    RSES_MULTI_COLUMNS, /*< Column definitions until an EOF */
+    RSES_MULTI_ROWS     /*< Rows until an EOF */
+} rses_multi_state_t;
+
+/**
+ * The replay of an open transaction after the master was lost
+ */
+typedef enum rses_replay_state
+{
+    RSES_REPLAY_NONE,   /*< Nothing is being replayed */
+    RSES_REPLAY_WAIT,   /*< Waiting for a new master */
+    RSES_REPLAY_RUN     /*< The statements are being replayed on the new master */
+} rses_replay_state_t;
+
+/**
+ * A routing rule. The first rule whose conditions all match a statement
+ * decides where the statement is routed.
+ */
+typedef struct rwsplit_rule
+{
+    route_target_t target;      /*< TARGET_MASTER, TARGET_SLAVE or TARGET_NAMED_SERVER */
+    char*          server;      /*< The server of TARGET_NAMED_SERVER */
+    char*          user;        /*< The user of the session, NULL for any */
+    char*          table;       /*< A table of the statement, NULL for any */
+    uint32_t       qtype;       /*< The statement has one of these types, 0 for any */
+    uint64_t       canonical;   /*< Hash of the canonical form, 0 for any */
+    int            line;        /*< Line of the rule in the file */
+} rwsplit_rule_t;
+
+/**
+ * The statement id of a prepared statement in one backend connection
+ */
+typedef struct rwsplit_ps_backend
+{
+    unsigned int    conn;   /*< The bref_conn_seq of the connection the id belongs to */
+    uint32_t        id;     /*< The statement id, 0 if not prepared in the connection */
+} rwsplit_ps_backend_t;
+
+/**
+ * A prepared statement of a router session. The client knows the statement
+ * by the id the master gave it. The statement is prepared in the other
+ * backends when it is first executed there.
+ */
+typedef struct rwsplit_ps
+{
+    uint32_t        id;         /*< The id the client uses */
+    qc_query_type_t qtype;      /*< The type of the statement, classified when prepared */
+    bool            read_only;  /*< Whether the executions can be routed to slaves */
+    bool            long_data;  /*< Parameters were sent to the master with
+                                 * COM_STMT_SEND_LONG_DATA */
+    bool            cacheable;  /*< The reply of the master is stored in reply */
+    bool            closed;     /*< The client closed it, it is in rses_ps_cache */
+    GWBUF*          prepare;    /*< The COM_STMT_PREPARE of the statement */
+    GWBUF*          reply;      /*< The reply of the master to the COM_STMT_PREPARE */
+    struct rwsplit_ps* cache_next; /*< The next statement in rses_ps_cache */
+    rwsplit_ps_backend_t backends[]; /*< The ids in the backends, indexed like
+                                      * rses_backend_ref */
+} rwsplit_ps_t;
+
 /**
  * Reference to BACKEND.
  *
@@ -232,6 +343,14 @@ typedef struct backend_ref_st
     int             bref_num_result_wait;
     sescmd_cursor_t bref_sescmd_cur;
     GWBUF*          bref_pending_cmd; /**< For stmt which can't be routed due active sescmd execution */
+    unsigned int    bref_conn_seq; /**< Incremented for each new connection to the backend */
+    rwsplit_ps_t*   bref_ps_new;  /**< Statement prepared by the client, its id is not known yet */
+    uint32_t        bref_ps_id;   /**< Client id of the statement prepared for bref_ps_exec */
+    GWBUF*          bref_ps_exec; /**< COM_STMT_EXECUTE waiting for the statement to be prepared */
+    uint64_t        bref_ps_mark; /**< Reply count of the backend when the prepare is finished */
+    struct timeval  bref_query_start; /**< When the active query was sent */
+    uint64_t        bref_hedge_mark; /**< Reply count of the backend once it has replied
+                                      * to the hedged read */
     unsigned char   reply_cmd;  /**< The reply the backend server sent to a session command.
                                  * Used to detect slaves that fail to execute session command. */
 #if defined(SS_DEBUG)
@@ -261,11 +380,37 @@ typedef struct rwsplit_config_st
                                                 * to master or all nodes */
     int               rw_max_sescmd_history_size; /**< Maximum amount of session commands to store */
     bool              rw_disable_sescmd_hist; /**< Disable session command history */
+    bool              rw_compact_sescmd_hist; /**< Remove superseded session commands
+                                               * from the history */
     bool              rw_master_reads; /**< Use master for reads */
     bool              rw_strict_multi_stmt; /**< Force non-multistatement queries to be routed
                                              * to the master after a multistatement query. */
     enum failure_mode rw_master_failure_mode; /**< Master server failure handling mode.
                                                * @see enum failure_mode */
+    bool              rw_causal_reads; /**< Read from slaves only once they have replicated
+                                        * the session's own writes */
+    int               rw_causal_reads_timeout; /**< How long to wait for a slave to catch up,
+                                                * in seconds */
+    bool              rw_async_sescmd; /**< Don't route reads to slaves that are still
+                                        * executing session commands */
+    bool              rw_thread_affinity; /**< Don't lock sessions whose DCBs are all
+                                           * owned by the same thread */
+    int               rw_ps_cache_size; /**< Closed prepared statements kept open
+                                         * for reuse, 0 if none */
+    bool              rw_split_multi_stmt; /**< Split read-only multi-statement queries
+                                            * and route the statements separately */
+    bool              rw_ro_trx; /**< Route read-only transactions to a slave */
+    bool              rw_write_affinity; /**< Route autocommit writes to a Galera node
+                                          * chosen by the table */
+    bool              rw_hedged_reads; /**< Send slow reads to a second slave */
+    bool              rw_lazy_slaves; /**< Connect to the slaves at the first read */
+    int               rw_hedged_reads_delay; /**< Milliseconds before a read is hedged,
+                                              * 0 for the 95th percentile of the slave */
+    bool              rw_trx_replay; /**< Replay open transactions on a new master */
+    int               rw_trx_replay_max_size; /**< Largest transaction that is recorded,
+                                               * in bytes */
+    int               rw_trx_replay_timeout; /**< How long to wait for a new master,
+                                              * in seconds */
 } rwsplit_config_t;
 
 #if defined(PREP_STMT_CACHING)
@@ -301,6 +446,8 @@ struct router_client_session
     SPINLOCK         rses_lock;      /*< protects rses_deleted */
     int              rses_versno;    /*< even = no active update, else odd. not used 4/14 */
     bool             rses_closed;    /*< true when closeSession is called */
+    bool             rses_lockfree;  /*< Only the thread owning the DCBs uses the session,
+                                      * rses_lock is not taken */
     rses_property_t* rses_properties[RSES_PROP_TYPE_COUNT]; /*< Properties listed by their type */
     backend_ref_t*   rses_master_ref;
     backend_ref_t*   rses_backend_ref; /*< Pointer to backend reference array */
@@ -310,11 +457,61 @@ struct router_client_session
     bool             rses_autocommit_enabled;
     bool             rses_transaction_active;
     bool             rses_load_active; /*< If LOAD DATA LOCAL INFILE is being currently executed */
-    bool             have_tmp_tables;
+    uint64_t*        rses_tmp_tables; /*< Hashes of the qualified names of the
+                                       * temporary tables */
+    int              rses_n_tmp_tables; /*< Number of temporary tables, the tables
+                                         * are not checked if there are none */
+    int              rses_tmp_tables_size; /*< Size of rses_tmp_tables */
     uint64_t         rses_load_data_sent; /*< How much data has been sent */
     DCB*             client_dcb;
     int              pos_generator;
     backend_ref_t    *forced_node; /*< Current server where all queries should be sent */
+    unsigned long    rses_causal_sample; /*< Master GTID sample that includes the last write,
+                                          * 0 if reads are not restricted */
+    SERVER_GTID      rses_causal_pos[MAX_GTID_DOMAINS]; /*< GTID position of the last write */
+    int              rses_causal_n_pos; /*< Domains in rses_causal_pos, -1 if not yet known */
+    time_t           rses_causal_deadline; /*< When to stop waiting for slaves to catch up */
+    HASHTABLE*       rses_ps;       /*< Prepared statements by the client ids, NULL if none */
+    rwsplit_ps_t*    rses_ps_cache; /*< Statements the client closed, the latest first */
+    int              rses_ps_cache_len; /*< Number of statements in rses_ps_cache */
+    bool             rses_multi_active; /*< A split multi-statement query is being executed */
+    GWBUF*           rses_multi_stmt; /*< Its statements that are not yet routed */
+    backend_ref_t*   rses_multi_bref; /*< The backend executing the current statement */
+    rses_multi_state_t rses_multi_state; /*< The next packet of the reply to the statement */
+    uint8_t          rses_multi_seq; /*< Sequence number of the next packet to the client */
+    backend_ref_t*   rses_ro_trx_bref; /*< The server of the read-only transaction */
+    unsigned int     rses_ro_trx_conn; /*< bref_conn_seq of the connection to it */
+    bool             rses_ro_trx_pending; /*< SET TRANSACTION READ ONLY was routed to
+                                           * rses_ro_trx_bref, the transaction has
+                                           * not started yet */
+    backend_ref_t*   rses_affinity_bref; /*< The node of the last write routed by its
+                                          * table, NULL if it went to the master */
+    unsigned int     rses_affinity_conn; /*< bref_conn_seq of the connection to it */
+    GWBUF*           rses_hedge_query; /*< The read that may be hedged, NULL if none */
+    backend_ref_t*   rses_hedge_primary; /*< The slave the read was routed to */
+    backend_ref_t*   rses_hedge_secondary; /*< The slave the read was hedged to, NULL if
+                                            * it was not yet hedged */
+    TIMER            rses_hedge_timer; /*< Hedges the read when it expires */
+    bool             rses_lazy_slaves; /*< The slaves are connected when the session
+                                        * first reads */
+    bool             rses_trx_recording; /*< The open transaction is in rses_trx_log */
+    bool             rses_trx_ended; /*< A COMMIT or a ROLLBACK ended the last transaction
+                                      * while autocommit was disabled */
+    GWBUF**          rses_trx_log;  /*< The statements of the transaction sent to the master */
+    int              rses_trx_n_log; /*< Number of statements in rses_trx_log */
+    int              rses_trx_log_size; /*< Size of rses_trx_log */
+    size_t           rses_trx_log_bytes; /*< Bytes of the statements in rses_trx_log */
+    uint64_t         rses_trx_checksum; /*< Checksum of the replies the client got to
+                                         * the completed statements */
+    bool             rses_trx_in_flight; /*< The reply to the last statement is not complete */
+    bool             rses_trx_partial; /*< Part of that reply was sent to the client */
+    rses_replay_state_t rses_replay_state; /*< Where the replay of the transaction is */
+    int              rses_replay_pos; /*< The next statement to replay */
+    uint64_t         rses_replay_checksum; /*< Checksum of the replies to the replayed
+                                            * statements */
+    time_t           rses_replay_deadline; /*< When to stop waiting for a new master */
+    GWBUF*           rses_replay_queue; /*< Queries of the client held during the replay */
+    TIMER            rses_replay_timer; /*< Looks for the new master */
 #if defined(PREP_STMT_CACHING)
     HASHTABLE*       rses_prep_stmt[2];
 #endif
@@ -335,6 +532,14 @@ typedef struct
     int     n_master;   /*< Number of stmts sent to master */
     int     n_slave;    /*< Number of stmts sent to slave */
     int     n_all;      /*< Number of stmts sent to all */
+    int     n_ro_trx;   /*< Number of read-only transactions routed to a slave */
+    int     n_hedged;   /*< Number of reads hedged to a second slave */
+    int     n_hedge_won; /*< Number of hedged reads the second slave replied to first */
+    int     n_lazy_connect; /*< Number of sessions that connected to the slaves late */
+    int     n_trx_replayed; /*< Number of transactions replayed on a new master */
+    int     n_trx_replay_failed; /*< Number of replays that did not match or found no master */
+    int     n_rule_routed; /*< Number of statements routed by a routing rule */
+    int     n_write_affinity; /*< Number of writes routed to a node by their table */
 } ROUTER_STATS;
 
 /**
@@ -352,6 +557,10 @@ typedef struct router_instance
     ROUTER_STATS            stats;       /*< Statistics for this router */
     struct router_instance* next;        /*< Next router on the list */
     bool                    available_slaves; /*< The router has some slaves avialable */
+    rwsplit_rule_t*         rules;       /*< Routing rules in the order of the file */
+    int                     n_rules;     /*< Number of routing rules */
+    BACKEND*                root_master; /*< The root master found for root_master_generation */
+    int                     root_master_generation; /*< Server status generation of root_master */
 } ROUTER_INSTANCE;
 
 #define BACKEND_TYPE(b) (SERVER_IS_MASTER((b)->backend_server) ? BE_MASTER :    \
@@ -59,8 +59,33 @@ enum shard_map_state
     SHMAP_STALE /*< The shard map has old data or has not been updated recently */
 };
 
+/**
+ * An entry of the lookup table of a shard map
+ */
+typedef struct shard_map_entry
+{
+    unsigned int hash;     /*< Hash of the database name */
+    const char*  database; /*< Database name, NULL if the slot is empty */
+    const char*  server;   /*< Server that has the database */
+} shard_map_entry_t;
+
+/**
+ * An immutable open addressing table of the databases of a shard map. The table
+ * is built once the map is ready and it is read without locking.
+ */
+typedef struct shard_map_index
+{
+    unsigned int       mask;    /*< Number of slots minus one, the number is a power of two */
+    int                n_dbs;   /*< Number of databases in the table */
+    shard_map_entry_t* entries; /*< The slots */
+} shard_map_index_t;
+
 /**
  * A map of the shards tied to a single user.
+ *
+ * The router keeps the newest version of the map of each user and the sessions
+ * of the user take a reference to it. A map is not modified once it has been
+ * given to the router, an update replaces it with a new version.
  */
 typedef struct shard_map
 {
@@ -69,6 +94,11 @@ typedef struct shard_map
     SPINLOCK lock;
     time_t last_updated;
     enum shard_map_state state; /*< State of the shard map */
+    int refcount; /*< Number of references to this map */
+    unsigned int version; /*< Version of the map, increased on each update */
+    time_t refresh_started; /*< When a session last started to refresh this map */
+    shard_map_index_t *index; /*< Lookup table of a ready map, NULL while the map
+                               * is being built */
 } shard_map_t;
 
 /**
@@ -94,6 +124,39 @@ typedef enum bref_state
 #define SCHEMA_ERRSTR_DUPLICATEDB "DUPDB"
 #define SCHEMA_ERR_DBNOTFOUND 1049
 #define SCHEMA_ERRSTR_DBNOTFOUND "42000"
+#define SCHEMA_ERR_SHARDING 1105
+#define SCHEMA_ERRSTR_SHARDING "HY000"
+
+/**
+ * The type of a table sharding rule
+ */
+typedef enum shard_rule_type
+{
+    SHARD_RULE_HASH, /*< The values of the key are hashed over the servers */
+    SHARD_RULE_RANGE /*< Each server has a range of integer values of the key */
+} shard_rule_type_t;
+
+/**
+ * A rule that divides the rows of a table between servers by the value of
+ * one column, the sharding key.
+ */
+typedef struct shard_rule
+{
+    char* database; /*< Database of the table */
+    char* table; /*< The sharded table */
+    char* column; /*< The sharding key column */
+    shard_rule_type_t type; /*< How the values are mapped to the servers */
+    char** servers; /*< The server of each shard */
+    long long* lower; /*< Range rules only, the smallest value of each shard
+                       * in ascending order */
+    int n_servers; /*< Number of shards */
+    struct shard_rule* next; /*< Next rule */
+} shard_rule_t;
+
+/**
+ * Merger of the replies of several shards to one statement
+ */
+typedef struct shard_merge shard_merge_t;
 /**
  * The type of the backend server
  */
@@ -267,6 +330,8 @@ typedef struct backend_ref_st
     int             bref_num_result_wait; /*< Number of not yet received results */
     sescmd_cursor_t bref_sescmd_cur; /*< Session command cursor */
     GWBUF*          bref_pending_cmd; /*< For stmt which can't be routed due active sescmd execution */
+    bool            bref_scatter; /*< Waiting for a reply to a statement routed to several shards */
+    int             bref_scatter_shard; /*< Index of the shard in the reply merger */
 #if defined(SS_DEBUG)
     skygw_chk_t     bref_chk_tail;
 #endif
@@ -286,6 +351,7 @@ typedef struct schemarouter_config_st
     double refresh_min_interval; /*< Minimum required interval between refreshes of databases */
     bool refresh_databases; /*< Are databases refreshed when they are not found in the hashtable */
     bool debug; /*< Enable verbose debug messages to clients */
+    bool lazy_connect; /*< Connect to the shards when they are first used */
 } schemarouter_config_t;
 
 /**
@@ -304,6 +370,10 @@ typedef struct
     double          ses_average; /*< Average session length */
     int             shmap_cache_hit; /*< Shard map was found from the cache */
     int             shmap_cache_miss;/*< No shard map found from the cache */
+    int             n_shard_key;    /*< Statements routed by the sharding key */
+    int             n_scatter;      /*< Statements routed to several shards */
+    int             n_shard_errors; /*< Statements rejected by the sharding rules */
+    int             n_lazy_connects; /*< Shard connections opened on first use */
 } ROUTER_STATS;
 
 /**
@@ -333,7 +403,12 @@ struct router_client_session
     shardmap; /*< Database hash containing names of the databases mapped to the servers that contain them */
     char            connect_db[MYSQL_DATABASE_MAXLEN + 1]; /*< Database the user was trying to connect to */
     char            current_db[MYSQL_DATABASE_MAXLEN + 1]; /*< Current active database */
+    char            mapping_db[MYSQL_DATABASE_MAXLEN + 1]; /*< Database looked up by the
+                                                           * current mapping, empty if all
+                                                           * databases are mapped */
     init_mask_t    init; /*< Initialization state bitmask */
+    shard_merge_t*  scatter; /*< Merger of the replies to a statement routed to
+                              * several shards, NULL if none is in progress */
     GWBUF*          queue; /*< Query that was received before the session was ready */
     DCB*            dcb_route; /*< Internal DCB used to trigger re-routing of buffers */
     DCB*            dcb_reply; /*< Internal DCB used to send replies to the client */
@@ -371,10 +446,21 @@ typedef struct router_instance
                                            * not cause the session to be terminated
                                            * if they are found on more than one server. */
     pcre2_match_data*             ignore_match_data;
+    shard_rule_t*           shard_rules; /*< Table sharding rules, NULL if not used */
 
 } ROUTER_INSTANCE;
 
 #define BACKEND_TYPE(b) (SERVER_IS_MASTER((b)->backend_server) ? BE_MASTER :    \
         (SERVER_IS_SLAVE((b)->backend_server) ? BE_SLAVE :  BE_UNDEFINED));
 
+shard_rule_t* shard_rules_load(const char* filename);
+void shard_rules_free(shard_rule_t* rules);
+shard_rule_t* shard_rules_find(shard_rule_t* rules, const char* database, const char* table);
+const char* shard_rule_get_server(const shard_rule_t* rule, const char* value);
+shard_merge_t* shard_merge_create(GWBUF* query, int n_shards);
+void shard_merge_free(shard_merge_t* merge);
+GWBUF* shard_merge_add(shard_merge_t* merge, int shard, GWBUF* packets, bool* complete);
+GWBUF* shard_merge_fail(shard_merge_t* merge, int shard, GWBUF* error);
+bool shard_merge_is_done(shard_merge_t* merge);
+
 #endif /*< _SCHEMAROUTER_H */
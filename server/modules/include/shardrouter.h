@@ -81,6 +81,7 @@ typedef enum rses_property_type_t
 #define SUBSVC_IS_CLOSED(s)         (s->state & SUBSVC_CLOSED)
 #define SUBSVC_IS_OK(s)         (s->state & SUBSVC_OK)
 #define SUBSVC_IS_WAITING(s)         (s->state & SUBSVC_WAITING_RESULT)
+#define SUBSVC_IS_PENDING(s)         (s->state & SUBSVC_PENDING)
 
 /**
  * Session variable command
@@ -141,6 +142,7 @@ typedef struct shardrouter_config_st
     int               rw_max_slave_conn_percent;
     int               rw_max_slave_conn_count;
     target_t          rw_use_sql_variables_in;
+    bool              lazy_connect; /*< Open the subsessions when they are first used */
 } shard_config_t;
 
 typedef enum
@@ -151,7 +153,8 @@ typedef enum
     SUBSVC_FAILED = (1 << 2), /* This is when something went wrong */
     SUBSVC_QUERY_ACTIVE = (1 << 3),
     SUBSVC_WAITING_RESULT = (1 << 4),
-    SUBSVC_MAPPED = (1 << 5)
+    SUBSVC_MAPPED = (1 << 5),
+    SUBSVC_PENDING = (1 << 6) /* The subsession is opened when it is first used */
 } subsvc_state_t;
 
 typedef struct subservice_t
@@ -163,6 +166,7 @@ typedef struct subservice_t
     sescmd_cursor_t* scur;
     int state;
     int n_res_waiting;
+    int n_replay; /*< Replies to the replayed session command history still to discard */
     bool mapped;
 } SUBSERVICE;
 
@@ -226,6 +230,7 @@ typedef struct
     int     n_master;   /*< Number of stmts sent to master */
     int     n_slave;    /*< Number of stmts sent to slave  */
     int     n_all;      /*< Number of stmts sent to all    */
+    int     n_lazy_opens; /*< Number of subsessions opened on first use */
 } ROUTER_STATS;
 
 
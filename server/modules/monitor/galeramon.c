@@ -29,6 +29,8 @@
  * 22/04/15 Martin Brampton     Addition of disableMasterRoleSetting
  * 08/05/15 Markus Makela       Addition of launchable scripts
  * 17/10/15 Martin Brampton     Change DCB callback to hangup
+ * 14/10/16 MariaDB Corporation Probe the servers concurrently
+ * 14/10/16 MariaDB Corporation One status query per node, connections kept open
  *
  * @endverbatim
  */
@@ -303,7 +305,8 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
 {
     GALERA_MONITOR* handle = (GALERA_MONITOR*) mon->handle;
     MYSQL_ROW row;
-    MYSQL_RES *result, *result2;
+    MYSQL_RES *result = NULL, *result2;
+    char *local_index = NULL;
     int isjoined = 0;
     char *server_string;
     SERVER temp_server;
@@ -322,7 +325,16 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
     /* Also clear Joined */
     server_clear_status(&temp_server, SERVER_JOINED);
 
-    connect_result_t rval = mon_connect_to_db(mon, database);
+    /** The connection is kept open between the cycles and checked without a
+     * round trip, a lost connection is noticed by the status query */
+    connect_result_t rval = mon_reuse_connection(mon, database);
+
+    if (rval == MONITOR_CONN_OK)
+    {
+        result = mon_query_reconnect(mon, database, "SHOW STATUS WHERE Variable_name IN "
+                                     "('wsrep_local_state', 'wsrep_local_index')", &rval);
+    }
+
     if (rval != MONITOR_CONN_OK)
     {
         if (mysql_errno(database->con) == ER_ACCESS_DENIED_ERROR)
@@ -357,20 +369,24 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
     }
 
     /* Check if the the Galera FSM shows this node is joined to the cluster */
-    if (mysql_query(database->con, "SHOW STATUS LIKE 'wsrep_local_state'") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    if (result)
     {
         if (mysql_field_count(database->con) < 2)
         {
             mysql_free_result(result);
-            MXS_ERROR("Unexpected result for \"SHOW STATUS LIKE 'wsrep_local_state'\". "
+            MXS_ERROR("Unexpected result for \"SHOW STATUS WHERE Variable_name IN "
+                      "('wsrep_local_state', 'wsrep_local_index')\". "
                       "Expected 2 columns. MySQL Version: %s", version_str);
             return;
         }
 
         while ((row = mysql_fetch_row(result)))
         {
-            if (strcmp(row[1], "4") == 0)
+            if (strcasecmp(row[0], "wsrep_local_index") == 0)
+            {
+                local_index = row[1];
+            }
+            else if (strcmp(row[1], "4") == 0)
             {
                 isjoined = 1;
             }
@@ -401,42 +417,29 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
                 }
             }
         }
-        mysql_free_result(result);
     }
 
     if (isjoined)
     {
         /* Check the the Galera node index in the cluster */
-        if (mysql_query(database->con, "SHOW STATUS LIKE 'wsrep_local_index'") == 0
-            && (result = mysql_store_result(database->con)) != NULL)
+        if (local_index)
         {
-            if (mysql_field_count(database->con) < 2)
+            char* endchar;
+            errno = 0;
+            long index = strtol(local_index, &endchar, 10);
+            if (*endchar != '\0' ||
+                (errno == ERANGE && (index == LONG_MAX || index == LONG_MIN)))
             {
-                mysql_free_result(result);
-                MXS_ERROR("Unexpected result for \"SHOW STATUS LIKE 'wsrep_local_index'\". "
-                          "Expected 2 columns. MySQL Version: %s", version_str);
-                return;
-            }
-
-            while ((row = mysql_fetch_row(result)))
-            {
-                char* endchar;
-                long local_index = strtol(row[1], &endchar, 10);
-                if (*endchar != '\0' ||
-                    (errno == ERANGE && (local_index == LONG_MAX || local_index == LONG_MIN)))
+                /** TODO: Create a mechanism to log warnings on a per server basis */
+                if (warn_erange_on_local_index)
                 {
-                    /** TODO: Create a mechanism to log warnings on a per server basis */
-                    if (warn_erange_on_local_index)
-                    {
-                        MXS_WARNING("Invalid 'wsrep_local_index' on server '%s': %s",
-                                    database->server->unique_name, row[1]);
-                        warn_erange_on_local_index = false;
-                    }
-                    local_index = -1;
+                    MXS_WARNING("Invalid 'wsrep_local_index' on server '%s': %s",
+                                database->server->unique_name, local_index);
+                    warn_erange_on_local_index = false;
                 }
-                database->server->node_id = local_index;
+                index = -1;
             }
-            mysql_free_result(result);
+            database->server->node_id = index;
         }
 
         server_set_status(&temp_server, SERVER_JOINED);
@@ -446,6 +449,11 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
         server_clear_status(&temp_server, SERVER_JOINED);
     }
 
+    if (result)
+    {
+        mysql_free_result(result);
+    }
+
     /* clear bits for non member nodes */
     if (!SERVER_IN_MAINT(database->server) && (!SERVER_IS_JOINED(&temp_server)))
     {
@@ -518,17 +526,23 @@ monitorMain(void *arg)
 
         nrounds += 1;
 
+        mon_tick_start(mon);
+
         /* reset cluster members counter */
         is_cluster = 0;
 
-        ptr = mon->databases;
-
-        while (ptr)
+        for (ptr = mon->databases; ptr; ptr = ptr->next)
         {
             ptr->mon_prev_status = ptr->server->status;
+        }
+
+        /* monitor all nodes concurrently */
+        mon_probe_servers(mon, monitorDatabase);
 
-            monitorDatabase(mon, ptr);
+        ptr = mon->databases;
 
+        while (ptr)
+        {
             /* Log server status change */
             if (mon_status_changed(ptr))
             {
@@ -647,7 +661,9 @@ monitorMain(void *arg)
             ptr = ptr->next;
         }
 
+        mon_publish_server_states(mon);
         mon_hangup_failed_servers(mon);
+        mon_tick_end(mon);
     }
 }
 
@@ -21,6 +21,7 @@
  * 08/09/14 Massimiliano Pinto  Initial implementation
  * 08/05/15 Markus Makela       Addition of launchable scripts
  * 17/10/15 Martin Brampton     Change DCB callback to hangup
+ * 14/10/16 MariaDB Corporation Probe the servers concurrently
  *
  * @endverbatim
  */
@@ -587,18 +588,22 @@ monitorMain(void *arg)
             continue;
         }
         nrounds += 1;
+        mon_tick_start(mon);
 
-        /* start from the first server in the list */
-        ptr = mon->databases;
-
-        while (ptr)
+        for (ptr = mon->databases; ptr; ptr = ptr->next)
         {
             /* copy server status into monitor pending_status */
             ptr->pending_status = ptr->server->status;
+        }
 
-            /* monitor current node */
-            monitorDatabase(mon, ptr);
+        /* monitor all nodes concurrently */
+        mon_probe_servers(mon, monitorDatabase);
 
+        /* start from the first server in the list */
+        ptr = mon->databases;
+
+        while (ptr)
+        {
             if (mon_status_changed(ptr) ||
                 mon_print_fail_status(ptr))
             {
@@ -646,7 +651,7 @@ monitorMain(void *arg)
                 }
                 else
                 {
-                    ptr->server->status = ptr->pending_status;
+                    server_clear_set_status(ptr->server, ~0, ptr->pending_status);
                 }
             }
             ptr = ptr->next;
@@ -671,7 +676,9 @@ monitorMain(void *arg)
             ptr = ptr->next;
         }
 
+        mon_publish_server_states(mon);
         mon_hangup_failed_servers(mon);
+        mon_tick_end(mon);
     }
 }
 
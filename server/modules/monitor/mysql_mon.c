@@ -41,6 +41,10 @@
  *                              be present in mysql_mon and in router sections as well.
  * 08/05/15 Markus Makela       Added launchable scripts
  * 17/10/15 Martin Brampton     Change DCB callback to hangup
+ * 14/10/16 MariaDB Corporation Probe the servers concurrently
+ * 14/10/16 MariaDB Corporation Added fast failure detection
+ * 14/10/16 MariaDB Corporation Microsecond replication heartbeats
+ * 14/10/16 MariaDB Corporation Sampling of load metrics
  *
  * @endverbatim
  */
@@ -48,6 +52,7 @@
 #include <mysqlmon.h>
 #include <dcb.h>
 #include <modutil.h>
+#include <atomic.h>
 
 extern char *strcasestr(const char *haystack, const char *needle);
 
@@ -78,6 +83,8 @@ static void set_master_heartbeat(MYSQL_MONITOR *, MONITOR_SERVERS *);
 static void set_slave_heartbeat(MONITOR *, MONITOR_SERVERS *);
 static int add_slave_to_master(long *, int, long);
 static bool isMySQLEvent(monitor_event_t event);
+static bool check_server_liveness(MONITOR *, MYSQL_MONITOR *);
+static void update_replication_heartbeat(MONITOR *, MONITOR_SERVERS *);
 void check_maxscale_schema_replication(MONITOR *monitor);
 static bool report_version_err = true;
 static const char* hb_table_name = "maxscale_schema.replication_heartbeat";
@@ -164,6 +171,10 @@ startMonitor(void *arg, void* opt)
         handle->master = NULL;
         handle->script = NULL;
         handle->mysql51_replication = false;
+        handle->fast_detection_interval = 0;
+        handle->fast_detection_ping = false;
+        handle->heartbeat_interval = 0;
+        handle->load_metrics = NULL;
         memset(handle->events, false, sizeof(handle->events));
         spinlock_init(&handle->lock);
     }
@@ -209,9 +220,55 @@ startMonitor(void *arg, void* opt)
         {
             handle->mysql51_replication = config_truth_value(params->value);
         }
+        else if (!strcmp(params->name, "fast_detection_interval"))
+        {
+            handle->fast_detection_interval = atoi(params->value);
+
+            if (handle->fast_detection_interval != 0 &&
+                handle->fast_detection_interval < MON_FAST_DETECTION_MIN_MS)
+            {
+                MXS_ERROR("The value of 'fast_detection_interval' for the monitor '%s' "
+                          "must be 0 or at least %d milliseconds, fast failure detection "
+                          "is disabled.", monitor->name, MON_FAST_DETECTION_MIN_MS);
+                handle->fast_detection_interval = 0;
+            }
+        }
+        else if (!strcmp(params->name, "load_metrics"))
+        {
+            mon_load_metrics_free(handle->load_metrics);
+
+            if ((handle->load_metrics = mon_load_metrics_parse(params->value)) == NULL)
+            {
+                MXS_ERROR("The load metrics of the monitor '%s' are not sampled, "
+                          "see earlier errors for more information.", monitor->name);
+            }
+        }
+        else if (!strcmp(params->name, "heartbeat_interval"))
+        {
+            handle->heartbeat_interval = atoi(params->value);
+
+            if (handle->heartbeat_interval != 0 &&
+                handle->heartbeat_interval < MON_FAST_DETECTION_MIN_MS)
+            {
+                MXS_ERROR("The value of 'heartbeat_interval' for the monitor '%s' "
+                          "must be 0 or at least %d milliseconds, the heartbeats are "
+                          "sent once per monitoring cycle.", monitor->name,
+                          MON_FAST_DETECTION_MIN_MS);
+                handle->heartbeat_interval = 0;
+            }
+        }
+        else if (!strcmp(params->name, "fast_detection_ping"))
+        {
+            handle->fast_detection_ping = config_truth_value(params->value);
+        }
         params = params->next;
     }
 
+    handle->heartbeat_master = NULL;
+    handle->heartbeat_table_ok = false;
+    handle->heartbeat_purged = 0;
+    handle->heartbeat_us = 0;
+
     if (!check_monitor_permissions(monitor, "SHOW SLAVE STATUS"))
     {
         MXS_ERROR("Failed to start monitor. See earlier errors for more information.");
@@ -285,7 +342,30 @@ static void diagnostics(DCB *dcb, void *arg)
     dcb_printf(dcb, "\tSampling interval:\t%lu milliseconds\n", mon->interval);
     dcb_printf(dcb, "\tMaxScale MonitorId:\t%lu\n", handle->id);
     dcb_printf(dcb, "\tReplication lag:\t%s\n", (handle->replicationHeartbeat == 1) ? "enabled" : "disabled");
+    if (handle->load_metrics)
+    {
+        dcb_printf(dcb, "\tLoad metrics:\t\t");
+        for (int i = 0; i < handle->load_metrics->n_metrics; i++)
+        {
+            dcb_printf(dcb, "%s%s%s", i ? ", " : "", handle->load_metrics->names[i],
+                       handle->load_metrics->rate[i] ? "/s" : "");
+        }
+        dcb_printf(dcb, "\n");
+    }
+    if (handle->replicationHeartbeat == 1 && handle->heartbeat_interval > 0)
+    {
+        dcb_printf(dcb, "\tHeartbeat interval:\t%d milliseconds\n", handle->heartbeat_interval);
+    }
     dcb_printf(dcb, "\tDetect Stale Master:\t%s\n", (handle->detectStaleMaster == 1) ? "enabled" : "disabled");
+    if (handle->fast_detection_interval)
+    {
+        dcb_printf(dcb, "\tFast Detection:\t\t%d milliseconds%s\n", handle->fast_detection_interval,
+                   handle->fast_detection_ping ? ", ping" : "");
+    }
+    else
+    {
+        dcb_printf(dcb, "\tFast Detection:\t\tdisabled\n");
+    }
     dcb_printf(dcb, "\tConnect Timeout:\t%i seconds\n", mon->connect_timeout);
     dcb_printf(dcb, "\tRead Timeout:\t\t%i seconds\n", mon->read_timeout);
     dcb_printf(dcb, "\tWrite Timeout:\t\t%i seconds\n", mon->write_timeout);
@@ -302,11 +382,61 @@ static void diagnostics(DCB *dcb, void *arg)
     dcb_printf(dcb, "\n");
 }
 
+/**
+ * Read the executed GTID position of a MariaDB 10 server. Routers use the
+ * position to find out whether a slave has replicated a given transaction.
+ *
+ * @param database The server to query
+ */
+static inline void monitor_gtid_pos(MONITOR_SERVERS* database)
+{
+    MYSQL_RES* result;
+    MYSQL_ROW row;
+
+    if (mysql_query(database->con, "SELECT @@gtid_current_pos") == 0
+        && (result = mysql_store_result(database->con)) != NULL)
+    {
+        if ((row = mysql_fetch_row(result)) && row[0] &&
+            !server_set_gtid_pos(database->server, row[0]))
+        {
+            MXS_ERROR("Could not parse the GTID position '%s' of server %s:%d.",
+                      row[0], database->server->name, database->server->port);
+        }
+        mysql_free_result(result);
+    }
+}
+
+/**
+ * Find the index of a column in a result set.
+ *
+ * @param result The result set
+ * @param name   Name of the column
+ * @return Index of the column or -1 if the result has no such column
+ */
+static int monitor_find_column(MYSQL_RES* result, const char* name)
+{
+    MYSQL_FIELD* fields = mysql_fetch_fields(result);
+    int n_fields = mysql_num_fields(result);
+
+    for (int i = 0; i < n_fields; i++)
+    {
+        if (strcasecmp(fields[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
 static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
 {
     int isslave = 0;
     MYSQL_RES* result;
     MYSQL_ROW row;
+    /** The Gtid_IO_Pos values of all slave connections, at most one GTID of
+     * each domain in each row */
+    char io_pos[MAX_GTID_DOMAINS * 64] = "";
 
     if (mysql_query(database->con, "SHOW ALL SLAVES STATUS") == 0
         && (result = mysql_store_result(database->con)) != NULL)
@@ -324,6 +454,8 @@ static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
         }
 
         database->server->slave_configured = false;
+        int io_pos_col = monitor_find_column(result, "Gtid_IO_Pos");
+        size_t io_pos_len = 0;
 
         while ((row = mysql_fetch_row(result)))
         {
@@ -335,6 +467,13 @@ static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
                 isslave += 1;
             }
 
+            if (io_pos_col >= 0 && row[io_pos_col] && *row[io_pos_col])
+            {
+                io_pos_len += snprintf(io_pos + io_pos_len,
+                                       io_pos_len < sizeof(io_pos) ? sizeof(io_pos) - io_pos_len : 0,
+                                       "%s%s", io_pos_len ? "," : "", row[io_pos_col]);
+            }
+
             /* If Slave_IO_Running = Yes, assign the master_id to current server: this allows building
              * the replication tree, slaves ids will be added to master(s) and we will have at least the
              * root master server.
@@ -357,6 +496,15 @@ static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
 
         mysql_free_result(result);
 
+        /** Multi-source slaves replicating the same domain from several
+         * masters list it more than once, the most advanced GTID is kept */
+        if (io_pos_len >= sizeof(io_pos) ||
+            !server_set_gtid_io_pos(database->server, io_pos))
+        {
+            MXS_ERROR("Could not parse the slave GTID IO position '%s' of server %s:%d.",
+                      io_pos, database->server->name, database->server->port);
+        }
+
         /* If all configured slaves are running set this node as slave */
         if (isslave > 0 && isslave == i)
         {
@@ -696,6 +844,7 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
                 mon_log_connect_error(database, rval);
             }
 
+            atomic_store_int64(&database->server->load, -1);
             return;
         }
     }
@@ -703,6 +852,13 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
     server_set_status(database->server, SERVER_RUNNING);
     monitor_set_pending_status(database, SERVER_RUNNING);
 
+    if (handle->load_metrics)
+    {
+        mon_sample_load(handle->load_metrics, database);
+    }
+
+    mon_sample_variables(database);
+
     /* get server version from current server */
     server_version = mysql_get_server_version(database->con);
 
@@ -743,6 +899,7 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
     /* Check first for MariaDB 10.x.x and get status for multi-master replication */
     if (server_version >= 100000)
     {
+        monitor_gtid_pos(database);
         monitor_mysql100_db(database);
     }
     else if (server_version >= 5 * 10000 + 5 * 100)
@@ -766,6 +923,117 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
 
 }
 
+/**
+ * Check that the monitor connection of a server is still alive
+ *
+ * An idle monitor connection is never readable, so any event on it means
+ * that the server closed the connection or sent an error before closing it.
+ * The check does not block. With @c ping the server is also pinged, which
+ * detects servers that no longer respond but whose host did not close the
+ * connection.
+ *
+ * @param database  The server to check
+ * @param ping      Ping the server
+ * @return False if the connection has failed
+ */
+static bool
+server_is_alive(MONITOR_SERVERS *database, bool ping)
+{
+    return mon_connection_is_alive(database) &&
+           (!ping || mysql_ping(database->con) == 0);
+}
+
+/**
+ * Run the liveness checks of the fast failure detection
+ *
+ * A running server whose monitor connection has failed loses its running
+ * state and its client connections are closed right away instead of at the
+ * next monitoring cycle. The state change is logged and the monitor script
+ * is launched here, the next monitoring cycle only refreshes the topology.
+ *
+ * @param mon       The monitor
+ * @param handle    The MySQL monitor handle
+ * @return True if a server failed the check
+ */
+static bool
+check_server_liveness(MONITOR *mon, MYSQL_MONITOR *handle)
+{
+    bool failed = false;
+
+    for (MONITOR_SERVERS *ptr = mon->databases; ptr; ptr = ptr->next)
+    {
+        if (ptr->con == NULL || SERVER_IN_MAINT(ptr->server) ||
+            !SERVER_IS_RUNNING(ptr->server) ||
+            server_is_alive(ptr, handle->fast_detection_ping))
+        {
+            continue;
+        }
+
+        MXS_WARNING("Liveness check of server '%s' (%s:%d) failed.",
+                    ptr->server->unique_name, ptr->server->name, ptr->server->port);
+
+        mysql_close(ptr->con);
+        ptr->con = NULL;
+
+        ptr->mon_prev_status = ptr->server->status;
+        server_clear_status(ptr->server, SERVER_RUNNING | SERVER_MASTER | SERVER_SLAVE |
+                            SERVER_SLAVE_OF_EXTERNAL_MASTER | SERVER_STALE_STATUS |
+                            SERVER_STALE_SLAVE);
+        ptr->pending_status = ptr->server->status;
+        ptr->mon_err_count += 1;
+
+        monitor_event_t evtype = mon_get_event_type(ptr);
+
+        if (isMySQLEvent(evtype))
+        {
+            mon_log_state_change(ptr);
+
+            if (handle->script && handle->events[evtype])
+            {
+                monitor_launch_script(mon, ptr, handle->script);
+            }
+        }
+
+        server_publish_state(ptr->server);
+        dcb_hangup_foreach(ptr->server);
+        failed = true;
+    }
+
+    return failed;
+}
+
+/**
+ * Write a replication heartbeat to the master and read it from the slaves
+ *
+ * @param mon           The monitor
+ * @param root_master   The master found in the last monitoring cycle
+ */
+static void
+update_replication_heartbeat(MONITOR *mon, MONITOR_SERVERS *root_master)
+{
+    MYSQL_MONITOR *handle = (MYSQL_MONITOR*) mon->handle;
+
+    if (root_master && root_master->con &&
+        (SERVER_IS_MASTER(root_master->server) ||
+         SERVER_IS_RELAY_SERVER(root_master->server)))
+    {
+        set_master_heartbeat(handle, root_master);
+
+        for (MONITOR_SERVERS *ptr = mon->databases; ptr; ptr = ptr->next)
+        {
+            if ((!SERVER_IN_MAINT(ptr->server)) && SERVER_IS_RUNNING(ptr->server) && ptr->con)
+            {
+                if (ptr->server->node_id != root_master->server->node_id &&
+                    (SERVER_IS_SLAVE(ptr->server) ||
+                     SERVER_IS_RELAY_SERVER(ptr->server)))
+                {
+                    set_slave_heartbeat(mon, ptr);
+                }
+            }
+        }
+    }
+}
+
 /**
  * The entry point for the monitoring module thread
  *
@@ -784,6 +1052,7 @@ monitorMain(void *arg)
     size_t nrounds = 0;
     int log_no_master = 1;
     bool heartbeat_checked = false;
+    int tick = MON_BASE_INTERVAL_MS;
 
     spinlock_acquire(&mon->lock);
     handle = (MYSQL_MONITOR *) mon->handle;
@@ -791,6 +1060,19 @@ monitorMain(void *arg)
     replication_heartbeat = handle->replicationHeartbeat;
     detect_stale_master = handle->detectStaleMaster;
 
+    /** The fast failure detection can check the servers more often than
+     * the base interval */
+    if (handle->fast_detection_interval > 0 && handle->fast_detection_interval < tick)
+    {
+        tick = handle->fast_detection_interval;
+    }
+
+    if (replication_heartbeat && handle->heartbeat_interval > 0 &&
+        handle->heartbeat_interval < tick)
+    {
+        tick = handle->heartbeat_interval;
+    }
+
     if (mysql_thread_init())
     {
         MXS_ERROR("mysql_thread_init failed in monitor module. Exiting.");
@@ -808,7 +1090,7 @@ monitorMain(void *arg)
             return;
         }
         /** Wait base interval */
-        thread_millisleep(MON_BASE_INTERVAL_MS);
+        thread_millisleep(tick);
 
         if (handle->replicationHeartbeat && !heartbeat_checked)
         {
@@ -820,32 +1102,55 @@ monitorMain(void *arg)
          * Calculate how far away the monitor interval is from its full
          * cycle and if monitor interval time further than the base
          * interval, then skip monitoring checks. Excluding the first
-         * round.
+         * round. Between the monitoring checks, only the liveness of the
+         * servers is checked if fast failure detection is enabled.
          */
         if (nrounds != 0 &&
-            ((nrounds * MON_BASE_INTERVAL_MS) % mon->interval) >=
-            MON_BASE_INTERVAL_MS)
+            ((nrounds * tick) % mon->interval) >= tick)
         {
+            bool check_liveness = handle->fast_detection_interval > 0 &&
+                ((nrounds * tick) % handle->fast_detection_interval) < tick;
+            bool send_heartbeat = replication_heartbeat && handle->heartbeat_interval > 0 &&
+                ((nrounds * tick) % handle->heartbeat_interval) < tick;
             nrounds += 1;
-            continue;
+
+            if (send_heartbeat)
+            {
+                update_replication_heartbeat(mon, root_master);
+                mon_publish_server_states(mon);
+            }
+
+            /** A failed liveness check refreshes the topology right away */
+            if (!check_liveness || !check_server_liveness(mon, handle))
+            {
+                continue;
+            }
         }
-        nrounds += 1;
+        else
+        {
+            nrounds += 1;
+        }
+        mon_tick_start(mon);
+
         /* reset num_servers */
         num_servers = 0;
 
-        /* start from the first server in the list */
-        ptr = mon->databases;
-
-        while (ptr)
+        for (ptr = mon->databases; ptr; ptr = ptr->next)
         {
             ptr->mon_prev_status = ptr->server->status;
 
             /* copy server status into monitor pending_status */
             ptr->pending_status = ptr->server->status;
+        }
 
-            /* monitor current node */
-            monitorDatabase(mon, ptr);
+        /* monitor all nodes concurrently */
+        mon_probe_servers(mon, monitorDatabase);
 
+        /* start from the first server in the list */
+        ptr = mon->databases;
+
+        while (ptr)
+        {
             /* reset the slave list of current node */
             memset(&ptr->server->slaves, 0, sizeof(ptr->server->slaves));
 
@@ -994,7 +1299,7 @@ monitorMain(void *arg)
                     }
                 }
 
-                ptr->server->status = ptr->pending_status;
+                server_clear_set_status(ptr->server, ~0, ptr->pending_status);
             }
             ptr = ptr->next;
         }
@@ -1052,30 +1357,14 @@ monitorMain(void *arg)
         }
 
         /* Do now the heartbeat replication set/get for MySQL Replication Consistency */
-        if (replication_heartbeat &&
-            root_master &&
-            (SERVER_IS_MASTER(root_master->server) ||
-             SERVER_IS_RELAY_SERVER(root_master->server)))
+        if (replication_heartbeat)
         {
-            set_master_heartbeat(handle, root_master);
-            ptr = mon->databases;
-
-            while (ptr)
-            {
-                if ((!SERVER_IN_MAINT(ptr->server)) && SERVER_IS_RUNNING(ptr->server))
-                {
-                    if (ptr->server->node_id != root_master->server->node_id &&
-                        (SERVER_IS_SLAVE(ptr->server) ||
-                         SERVER_IS_RELAY_SERVER(ptr->server)))
-                    {
-                        set_slave_heartbeat(mon, ptr);
-                    }
-                }
-                ptr = ptr->next;
-            }
+            update_replication_heartbeat(mon, root_master);
         }
 
+        mon_publish_server_states(mon);
         mon_hangup_failed_servers(mon);
+        mon_tick_end(mon);
     } /*< while (1) */
 }
 
@@ -1125,19 +1414,96 @@ getSlaveOfNodeId(MONITOR_SERVERS *ptr, long node_id)
     return NULL;
 }
 
+/**
+ * Current time of the replication heartbeats
+ *
+ * @return Microseconds since the epoch
+ */
+static uint64_t heartbeat_clock_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Create the maxscale_schema.replication_heartbeat table on the master
+ *
+ * Tables created by older versions do not have the master_timestamp_us column
+ * and it is added to them.
+ *
+ * @param database The master server
+ * @return True if the table is ready for the heartbeats
+ */
+static bool create_heartbeat_table(MONITOR_SERVERS *database)
+{
+    MYSQL_RES *result;
+
+    /* create the maxscale_schema database */
+    if (mysql_query(database->con, "CREATE DATABASE IF NOT EXISTS maxscale_schema"))
+    {
+        MXS_ERROR("[mysql_mon]: Error creating maxscale_schema database in Master server"
+                  ": %s", mysql_error(database->con));
+        return false;
+    }
+
+    /* create repl_heartbeat table in maxscale_schema database */
+    if (mysql_query(database->con, "CREATE TABLE IF NOT EXISTS "
+                    "maxscale_schema.replication_heartbeat "
+                    "(maxscale_id INT NOT NULL, "
+                    "master_server_id INT NOT NULL, "
+                    "master_timestamp INT UNSIGNED NOT NULL, "
+                    "master_timestamp_us BIGINT UNSIGNED NOT NULL DEFAULT 0, "
+                    "PRIMARY KEY ( master_server_id, maxscale_id ) ) "
+                    "ENGINE=MYISAM DEFAULT CHARSET=latin1"))
+    {
+        MXS_ERROR("[mysql_mon]: Error creating maxscale_schema.replication_heartbeat "
+                  "table in Master server: %s", mysql_error(database->con));
+        return false;
+    }
+
+    if (mysql_query(database->con, "SELECT 1 FROM information_schema.columns "
+                    "WHERE table_schema = 'maxscale_schema' "
+                    "AND table_name = 'replication_heartbeat' "
+                    "AND column_name = 'master_timestamp_us'") ||
+        (result = mysql_store_result(database->con)) == NULL)
+    {
+        MXS_ERROR("[mysql_mon]: Error reading the columns of "
+                  "maxscale_schema.replication_heartbeat: %s", mysql_error(database->con));
+        return false;
+    }
+
+    bool have_column = mysql_num_rows(result) > 0;
+    mysql_free_result(result);
+
+    if (!have_column &&
+        mysql_query(database->con, "ALTER TABLE maxscale_schema.replication_heartbeat "
+                    "ADD COLUMN master_timestamp_us BIGINT UNSIGNED NOT NULL DEFAULT 0"))
+    {
+        MXS_ERROR("[mysql_mon]: Error adding the master_timestamp_us column to "
+                  "maxscale_schema.replication_heartbeat: %s", mysql_error(database->con));
+        return false;
+    }
+
+    return true;
+}
+
 /*******
  * This function sets the replication heartbeat
  * into the maxscale_schema.replication_heartbeat table in the current master.
  * The inserted values will be seen from all slaves replication from this master.
  *
+ * The heartbeat table is created only when the master changes and old values
+ * are purged once an hour, so that a heartbeat is a single update.
+ *
  * @param handle    The monitor handle
  * @param database      The number database server
  */
 static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *database)
 {
     unsigned long id = handle->id;
-    time_t heartbeat;
-    time_t purge_time;
+    uint64_t heartbeat;
+    time_t now;
     char heartbeat_insert_query[512] = "";
     char heartbeat_purge_query[512] = "";
 
@@ -1147,58 +1513,61 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
         return;
     }
 
-    /* create the maxscale_schema database */
-    if (mysql_query(database->con, "CREATE DATABASE IF NOT EXISTS maxscale_schema"))
+    if (handle->heartbeat_master != database->server)
     {
-        MXS_ERROR("[mysql_mon]: Error creating maxscale_schema database in Master server"
-                  ": %s", mysql_error(database->con));
-
-        database->server->rlag = -1;
+        handle->heartbeat_master = database->server;
+        handle->heartbeat_table_ok = false;
     }
 
-    /* create repl_heartbeat table in maxscale_schema database */
-    if (mysql_query(database->con, "CREATE TABLE IF NOT EXISTS "
-                    "maxscale_schema.replication_heartbeat "
-                    "(maxscale_id INT NOT NULL, "
-                    "master_server_id INT NOT NULL, "
-                    "master_timestamp INT UNSIGNED NOT NULL, "
-                    "PRIMARY KEY ( master_server_id, maxscale_id ) ) "
-                    "ENGINE=MYISAM DEFAULT CHARSET=latin1"))
+    if (!handle->heartbeat_table_ok)
     {
-        MXS_ERROR("[mysql_mon]: Error creating maxscale_schema.replication_heartbeat "
-                  "table in Master server: %s", mysql_error(database->con));
+        if (!create_heartbeat_table(database))
+        {
+            database->server->rlag = -1;
+            atomic_store_int64(&database->server->rlag_us, -1);
+            return;
+        }
 
-        database->server->rlag = -1;
+        handle->heartbeat_table_ok = true;
     }
 
+    now = time(0);
+
     /* auto purge old values after 48 hours*/
-    purge_time = time(0) - (3600 * 48);
+    if (now - handle->heartbeat_purged >= MON_HEARTBEAT_PURGE_INTERVAL)
+    {
+        sprintf(heartbeat_purge_query,
+                "DELETE FROM maxscale_schema.replication_heartbeat WHERE master_timestamp < %lu",
+                now - (3600 * 48));
 
-    sprintf(heartbeat_purge_query,
-            "DELETE FROM maxscale_schema.replication_heartbeat WHERE master_timestamp < %lu", purge_time);
+        if (mysql_query(database->con, heartbeat_purge_query))
+        {
+            MXS_ERROR("[mysql_mon]: Error deleting from maxscale_schema.replication_heartbeat "
+                      "table: [%s], %s",
+                      heartbeat_purge_query,
+                      mysql_error(database->con));
+        }
 
-    if (mysql_query(database->con, heartbeat_purge_query))
-    {
-        MXS_ERROR("[mysql_mon]: Error deleting from maxscale_schema.replication_heartbeat "
-                  "table: [%s], %s",
-                  heartbeat_purge_query,
-                  mysql_error(database->con));
+        handle->heartbeat_purged = now;
     }
 
-    heartbeat = time(0);
+    heartbeat = heartbeat_clock_us();
 
     /* set node_ts for master as time(0) */
-    database->server->node_ts = heartbeat;
+    database->server->node_ts = heartbeat / 1000000;
 
     sprintf(heartbeat_insert_query,
-            "UPDATE maxscale_schema.replication_heartbeat SET master_timestamp = %lu WHERE master_server_id = %li AND maxscale_id = %lu",
-            heartbeat, handle->master->server->node_id, id);
+            "UPDATE maxscale_schema.replication_heartbeat SET master_timestamp = %lu, "
+            "master_timestamp_us = %lu WHERE master_server_id = %li AND maxscale_id = %lu",
+            heartbeat / 1000000, heartbeat, handle->master->server->node_id, id);
 
     /* Try to insert MaxScale timestamp into master */
     if (mysql_query(database->con, heartbeat_insert_query))
     {
 
         database->server->rlag = -1;
+        atomic_store_int64(&database->server->rlag_us, -1);
+        handle->heartbeat_table_ok = false;
 
         MXS_ERROR("[mysql_mon]: Error updating maxscale_schema.replication_heartbeat table: [%s], %s",
                   heartbeat_insert_query,
@@ -1208,15 +1577,17 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
     {
         if (mysql_affected_rows(database->con) == 0)
         {
-            heartbeat = time(0);
             sprintf(heartbeat_insert_query,
-                    "REPLACE INTO maxscale_schema.replication_heartbeat (master_server_id, maxscale_id, master_timestamp ) VALUES ( %li, %lu, %lu)",
-                    handle->master->server->node_id, id, heartbeat);
+                    "REPLACE INTO maxscale_schema.replication_heartbeat (master_server_id, maxscale_id, "
+                    "master_timestamp, master_timestamp_us ) VALUES ( %li, %lu, %lu, %lu)",
+                    handle->master->server->node_id, id, heartbeat / 1000000, heartbeat);
 
             if (mysql_query(database->con, heartbeat_insert_query))
             {
 
                 database->server->rlag = -1;
+                atomic_store_int64(&database->server->rlag_us, -1);
+                handle->heartbeat_table_ok = false;
 
                 MXS_ERROR("[mysql_mon]: Error inserting into "
                           "maxscale_schema.replication_heartbeat table: [%s], %s",
@@ -1227,6 +1598,8 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
             {
                 /* Set replication lag to 0 for the master */
                 database->server->rlag = 0;
+                atomic_store_int64(&database->server->rlag_us, 0);
+                handle->heartbeat_us = heartbeat;
 
                 MXS_DEBUG("[mysql_mon]: heartbeat table inserted data for %s:%i",
                           database->server->name, database->server->port);
@@ -1236,6 +1609,8 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
         {
             /* Set replication lag as 0 for the master */
             database->server->rlag = 0;
+            atomic_store_int64(&database->server->rlag_us, 0);
+            handle->heartbeat_us = heartbeat;
 
             MXS_DEBUG("[mysql_mon]: heartbeat table updated for Master %s:%i",
                       database->server->name, database->server->port);
@@ -1248,6 +1623,11 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
  * from the maxscale_schema.replication_heartbeat table in the current slave
  * and stores the timestamp and replication lag in the slave server struct
  *
+ * The lag is the time since the newest heartbeat the slave has applied was
+ * written, and zero if the slave has applied the newest heartbeat. Both the
+ * written and the current time are from the MaxScale clock. The lag is
+ * smoothed with an exponential moving average before it is published.
+ *
  * @param handle    The monitor handle
  * @param database      The number database server
  */
@@ -1255,7 +1635,6 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
 {
     MYSQL_MONITOR *handle = (MYSQL_MONITOR*) mon->handle;
     unsigned long id = handle->id;
-    time_t heartbeat;
     char select_heartbeat_query[256] = "";
     MYSQL_ROW row;
     MYSQL_RES *result;
@@ -1268,7 +1647,7 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
 
     /* Get the master_timestamp value from maxscale_schema.replication_heartbeat table */
 
-    sprintf(select_heartbeat_query, "SELECT master_timestamp "
+    sprintf(select_heartbeat_query, "SELECT master_timestamp, master_timestamp_us "
             "FROM maxscale_schema.replication_heartbeat "
             "WHERE maxscale_id = %lu AND master_server_id = %li",
             id, handle->master->server->node_id);
@@ -1281,47 +1660,61 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
 
         while ((row = mysql_fetch_row(result)))
         {
-            int rlag = -1;
-            time_t slave_read;
+            int64_t lag = -1;
+            uint64_t slave_read;
 
             rows_found = 1;
 
-            heartbeat = time(0);
-            slave_read = strtoul(row[0], NULL, 10);
+            errno = 0;
+            slave_read = row[1] ? strtoull(row[1], NULL, 10) : 0;
 
-            if ((errno == ERANGE && (slave_read == LONG_MAX || slave_read == LONG_MIN)) || (errno != 0 &&
-                                                                                            slave_read == 0))
+            if (slave_read == 0 || errno != 0)
             {
-                slave_read = 0;
+                /** Written before the table had the microsecond column */
+                errno = 0;
+                slave_read = row[0] ? strtoull(row[0], NULL, 10) * 1000000 : 0;
+                slave_read = errno == 0 ? slave_read : 0;
             }
 
             if (slave_read)
             {
+                uint64_t heartbeat = heartbeat_clock_us();
+
                 /* set the replication lag */
-                rlag = heartbeat - slave_read;
+                lag = slave_read >= handle->heartbeat_us || heartbeat < slave_read ?
+                    0 : heartbeat - slave_read;
             }
 
             /* set this node_ts as master_timestamp read from replication_heartbeat table */
-            database->server->node_ts = slave_read;
+            database->server->node_ts = slave_read / 1000000;
 
-            if (rlag >= 0)
+            if (lag >= 0)
             {
-                /* store rlag only if greater than monitor sampling interval */
-                database->server->rlag = ((unsigned int)rlag > (mon->interval / 1000)) ? rlag : 0;
+                int64_t prev = database->server->rlag_us;
+
+                if (prev >= 0)
+                {
+                    lag = prev + (lag - prev) / MON_HEARTBEAT_SMOOTHING;
+                }
+
+                atomic_store_int64(&database->server->rlag_us, lag);
+                database->server->rlag = lag / 1000000;
             }
             else
             {
+                atomic_store_int64(&database->server->rlag_us, -1);
                 database->server->rlag = -1;
             }
 
-            MXS_DEBUG("Slave %s:%i has %i seconds lag",
+            MXS_DEBUG("Slave %s:%i has %ld microseconds lag",
                       database->server->name,
                       database->server->port,
-                      database->server->rlag);
+                      database->server->rlag_us);
         }
         if (!rows_found)
         {
             database->server->rlag = -1;
+            atomic_store_int64(&database->server->rlag_us, -1);
             database->server->node_ts = 0;
         }
 
@@ -1330,6 +1723,7 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
     else
     {
         database->server->rlag = -1;
+        atomic_store_int64(&database->server->rlag_us, -1);
         database->server->node_ts = 0;
 
         if (handle->master->server->node_id < 0)
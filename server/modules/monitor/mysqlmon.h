@@ -46,9 +46,23 @@
  * 20/04/15 Guillaume Lefranc   Addition of availableWhenDonor
  * 22/04/15 Martin Brampton     Addition of disableMasterRoleSetting
  * 07/05/15 Markus Makela       Addition of command execution on Master server failure
+ * 14/10/16 MariaDB Corporation Addition of fast failure detection
+ * 14/10/16 MariaDB Corporation Addition of sub-second replication heartbeats
+ * 14/10/16 MariaDB Corporation Addition of load metrics
  * @endverbatim
  */
 
+/** The smallest interval of the fast failure detection in milliseconds */
+#define MON_FAST_DETECTION_MIN_MS 10
+
+/** How often old replication heartbeats are purged, in seconds */
+#define MON_HEARTBEAT_PURGE_INTERVAL 3600
+
+/** Weight of the previous replication lag in the smoothed lag, a new
+ * measurement moves the smoothed lag by 1/MON_HEARTBEAT_SMOOTHING of the
+ * difference */
+#define MON_HEARTBEAT_SMOOTHING 4
+
 /**
  * The handle for an instance of a MySQL Monitor module
  */
@@ -66,6 +80,14 @@ typedef struct
     int availableWhenDonor; /**< Monitor flag for Galera Cluster Donor availability */
     int disableMasterRoleSetting; /**< Monitor flag to disable setting master role */
     bool mysql51_replication; /**< Use MySQL 5.1 replication */
+    int fast_detection_interval; /**< Interval of the liveness checks in milliseconds, 0 if disabled */
+    bool fast_detection_ping; /**< Ping the servers in the liveness checks */
+    MON_LOAD_METRICS *load_metrics; /**< Sampled load metrics, NULL if disabled */
+    int heartbeat_interval; /**< Interval of the replication heartbeats in milliseconds, 0 for once per cycle */
+    SERVER *heartbeat_master; /**< Master the heartbeats were last written to */
+    bool heartbeat_table_ok; /**< The heartbeat table is ready on heartbeat_master */
+    time_t heartbeat_purged; /**< When old heartbeats were last purged */
+    uint64_t heartbeat_us; /**< The newest written heartbeat in microseconds */
     MONITOR_SERVERS *master; /**< Master server for MySQL Master/Slave replication */
     char* script; /*< Script to call when state changes occur on servers */
     bool events[MAX_MONITOR_EVENT]; /*< enabled events */
@@ -21,6 +21,7 @@
  * 25/07/14 Massimiliano Pinto  Initial implementation
  * 10/11/14 Massimiliano Pinto  Added setNetworkTimeout for connect,read,write
  * 08/05/15 Markus Makela       Addition of launchable scripts
+ * 14/10/16 MariaDB Corporation Probe the servers concurrently
  *
  * @endverbatim
  */
@@ -250,10 +251,11 @@ diagnostics(DCB *dcb, void *arg)
 /**
  * Monitor an individual server
  *
+ * @param mon       The monitor
  * @param database  The database to probe
  */
 static void
-monitorDatabase(MONITOR_SERVERS *database, char *defaultUser, char *defaultPasswd, MONITOR *mon)
+monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
 {
     MYSQL_ROW row;
     MYSQL_RES *result;
@@ -408,13 +410,20 @@ monitorMain(void *arg)
             continue;
         }
         nrounds += 1;
-        ptr = mon->databases;
+        mon_tick_start(mon);
 
-        while (ptr)
+        for (ptr = mon->databases; ptr; ptr = ptr->next)
         {
             ptr->mon_prev_status = ptr->server->status;
-            monitorDatabase(ptr, mon->user, mon->password, mon);
+        }
+
+        /* monitor all nodes concurrently */
+        mon_probe_servers(mon, monitorDatabase);
 
+        ptr = mon->databases;
+
+        while (ptr)
+        {
             if (ptr->server->status != ptr->mon_prev_status ||
                 SERVER_IS_DOWN(ptr->server))
             {
@@ -448,7 +457,9 @@ monitorMain(void *arg)
             ptr = ptr->next;
         }
 
+        mon_publish_server_states(mon);
         mon_hangup_failed_servers(mon);
+        mon_tick_end(mon);
     }
 }
 
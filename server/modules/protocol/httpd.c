@@ -28,6 +28,7 @@
  * Date         Who                     Description
  * 08/07/2013   Massimiliano Pinto      Initial version
  * 09/07/2013   Massimiliano Pinto      Added /show?dcb|session for all dcbs|sessions
+ * 14/10/2016   MariaDB Corporation     Content type of the maxinfo /metrics URL
  *
  * @endverbatim
  */
@@ -65,7 +66,7 @@ static int httpd_accept(DCB *dcb);
 static int httpd_close(DCB *dcb);
 static int httpd_listen(DCB *dcb, char *config);
 static int httpd_get_line(int sock, char *buf, int size);
-static void httpd_send_headers(DCB *dcb, int final);
+static void httpd_send_headers(DCB *dcb, int final, const char *content_type);
 static char *httpd_default_auth();
 
 /**
@@ -252,8 +253,10 @@ static int httpd_read_event(DCB* dcb)
      * Now begins the server reply
      */
 
-    /* send all the basic headers and close with \r\n */
-    httpd_send_headers(dcb, 1);
+    /* send all the basic headers and close with \r\n, maxinfo sends
+     * the metrics in the Prometheus text format */
+    httpd_send_headers(dcb, 1, strcmp(url, "/metrics") == 0 ?
+                       "text/plain; version=0.0.4" : "application/json");
 
 #if 0
     /**
@@ -451,8 +454,12 @@ static int httpd_get_line(int sock, char *buf, int size)
 
 /**
  * HTTPD send basic headers with 200 OK
+ *
+ * @param dcb           The client DCB
+ * @param final         Whether to close the headers
+ * @param content_type  The type of the content that follows
  */
-static void httpd_send_headers(DCB *dcb, int final)
+static void httpd_send_headers(DCB *dcb, int final, const char *content_type)
 {
     char date[64] = "";
     const char *fmt = "%a, %d %b %Y %H:%M:%S GMT";
@@ -464,8 +471,8 @@ static void httpd_send_headers(DCB *dcb, int final)
 
     dcb_printf(dcb,
                "HTTP/1.1 200 OK\r\nDate: %s\r\nServer: %s\r\nConnection: "
-               "close\r\nContent-Type: application/json\r\n",
-               date, HTTP_SERVER_STRING);
+               "close\r\nContent-Type: %s\r\n",
+               date, HTTP_SERVER_STRING, content_type);
 
     /* close the headers */
     if (final)
@@ -49,11 +49,19 @@ uint8_t null_client_sha1[MYSQL_SCRAMBLE_LEN]="";
  * 07/10/2015   Martin Brampton         Remove calls to dcb_close - should be done by routers
  * 27/10/2015   Martin Brampton         Test for RCAP_TYPE_NO_RSESSION before calling clientReply
  * 23/05/2016   Martin Brampton         Provide for backend SSL
+ * 14/10/2016   MariaDB Corporation     Release the governor slot when the reply is complete
+ * 14/10/2016   MariaDB Corporation     Kill the queries that run longer than max_execution_time
+ * 14/10/2016   MariaDB Corporation     The busy time of the backend is counted in the resource usage
  *
  */
 #include <modinfo.h>
 #include <gw_protocol.h>
 #include <mysql_auth.h>
+#include <governor.h>
+#include <usage.h>
+#include <rdtsc.h>
+#include <maxscale/poll.h>
+#include <mysql_utils.h>
 
  /* @see function load_module in load_utils.c for explanation of the following
   * lint directives.
@@ -84,14 +92,20 @@ extern char* create_auth_failed_msg(GWBUF* readbuf, char* hostaddr, uint8_t* sha
 static bool sescmd_response_complete(DCB* dcb);
 static int gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session);
 static int gw_read_and_write(DCB *dcb, MYSQL_session local_session);
+static void gw_backend_read_failed(DCB *dcb, const char *msg);
+static GWBUF *gw_reset_pooled_connection(DCB *dcb, GWBUF *queue);
+static void backend_start_query_timer(DCB *dcb);
+static void backend_stop_query_timer(DCB *dcb);
+static void backend_kill_query(DCB *dcb);
 static int gw_read_backend_handshake(MySQLProtocol *conn);
-static int gw_decode_mysql_server_handshake(MySQLProtocol *conn, uint8_t *payload);
+static int gw_decode_mysql_server_handshake(MySQLProtocol *conn, uint8_t *payload, size_t len);
 static int gw_receive_backend_auth(MySQLProtocol *protocol);
 static mysql_auth_state_t gw_send_authentication_to_backend(char *dbname,
                                       char *user,
                                       uint8_t *passwd,
                                       MySQLProtocol *conn);
 static uint32_t create_capabilities(MySQLProtocol *conn, bool db_specified, bool compress);
+static bool use_compression(MySQLProtocol *conn);
 static int response_length(MySQLProtocol *conn, char *user, uint8_t *passwd, char *dbname);
 static uint8_t *load_hashed_password(MySQLProtocol *conn, uint8_t *payload, uint8_t *passwd);
 static int gw_do_connect_to_backend(char *host, int port, int *fd);
@@ -386,6 +400,8 @@ gw_do_connect_to_backend(char *host, int port, int *fd)
         goto return_rv;
     }
 
+    dcb_set_busy_poll(so);
+
     /* set socket to as non-blocking here */
     setnonblocking(so);
     rv = connect(so, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
@@ -650,6 +666,7 @@ gw_read_backend_handshake(MySQLProtocol *conn)
                               dcb->server->port);
 
                     server_set_status(dcb->server, SERVER_MAINT);
+                    server_publish_state(dcb->server);
                 }
 
                 free(bufstr);
@@ -679,7 +696,7 @@ gw_read_backend_handshake(MySQLProtocol *conn)
             payload += 4;
 
             //Now decode mysql handshake
-            success = gw_decode_mysql_server_handshake(conn, payload);
+            success = gw_decode_mysql_server_handshake(conn, payload, packet_len);
 
             if (success < 0)
             {
@@ -747,7 +764,7 @@ gw_send_authentication_to_backend(char *dbname,
         return MYSQL_AUTH_FAILED;
     }
 
-    capabilities = create_capabilities(conn, (dbname && strlen(dbname)), false);
+    capabilities = create_capabilities(conn, (dbname && strlen(dbname)), use_compression(conn));
     gw_mysql_set_byte4(client_capabilities, capabilities);
 
     bytes = response_length(conn, user, passwd, dbname);
@@ -901,6 +918,8 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
                     break;
                 case 1:
                     backend_protocol->protocol_auth_state = MYSQL_IDLE;
+                    /** All packets after the authentication are compressed */
+                    backend_protocol->compress = use_compression(backend_protocol);
                     MXS_DEBUG("%lu [gw_read_backend_event] "
                           "gw_receive_backend_auth succeed. "
                           "dcb %p fd %d, user %s.",
@@ -945,7 +964,7 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
             if (backend_protocol->protocol_auth_state == MYSQL_AUTH_FAILED &&
                 dcb->session->state != SESSION_STATE_STOPPING)
             {
-                service_refresh_users(dcb->session->service);
+                service_refresh_users_async(dcb->session->service, NULL, NULL);
             }
 #if defined(SS_DEBUG)
             MXS_DEBUG("%lu [gw_read_backend_event] "
@@ -1025,32 +1044,58 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
 
         CHK_SESSION(session);
 
+        /**
+         * Leave the data in the socket while the client can't keep up with it,
+         * a read event is generated once its write queue has drained.
+         */
+        if (dcb_throttle_read(dcb))
+        {
+            return 0;
+        }
+
+        MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+        GWBUF *decompressed = NULL;
+
+        if (proto->compress)
+        {
+            /**
+             * The read queue holds data that is already decompressed, keep
+             * it apart from the compressed data read from the network.
+             */
+            spinlock_acquire(&dcb->authlock);
+            decompressed = dcb->dcb_readqueue;
+            dcb->dcb_readqueue = NULL;
+            spinlock_release(&dcb->authlock);
+        }
+
+        /** The reply tracker has already seen the data in the read queue */
+        size_t seen = gwbuf_length(proto->compress ? decompressed : dcb->dcb_readqueue);
+
         /* read available backend data */
         return_code = dcb_read(dcb, &read_buffer, 0);
 
-        if (return_code < 0)
+        if (proto->compress)
         {
-            GWBUF* errbuf;
-            bool succp;
-            errbuf = mysql_create_custom_error(1,
-                                               0,
-                                               "Read from backend failed");
-
-            session->service->router->handleError(
-                session->service->router_instance,
-                                session->router_session,
-                                errbuf,
-                                dcb,
-                                ERRACT_NEW_CONNECTION,
-                                &succp);
-            gwbuf_free(errbuf);
+            if (return_code >= 0 && !mysql_decompress_packets(proto, read_buffer, &decompressed))
+            {
+                /** The data that was read is now owned by compress_readq */
+                read_buffer = NULL;
+                return_code = -1;
+            }
 
-            if (!succp)
+            if (return_code < 0)
             {
-                spinlock_acquire(&session->ses_lock);
-                session->state = SESSION_STATE_STOPPING;
-                spinlock_release(&session->ses_lock);
+                /** The read queue and the packets decompressed so far */
+                gwbuf_free(read_buffer);
+                gwbuf_free(decompressed);
+                decompressed = NULL;
             }
+            read_buffer = decompressed;
+        }
+
+        if (return_code < 0)
+        {
+            gw_backend_read_failed(dcb, "Read from backend failed");
             return_code = 0;
             goto return_rc;
         }
@@ -1066,13 +1111,59 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
             ss_dassert(read_buffer != NULL);
         }
 
-        if (nbytes_read < 3)
+        size_t discard = mysql_reply_track_replies(proto, read_buffer, seen);
+
+        if (MYSQL_REPLY_IS_COMPLETE(&proto->reply))
+        {
+            backend_stop_query_timer(dcb);
+
+            if (dcb->session->service->governor)
+            {
+                /** The query of the session is done, its slot goes to the next query */
+                governor_query_done(dcb->session);
+            }
+        }
+
+        if (discard > 0)
+        {
+            /** Replies that a router asked not to get */
+            read_buffer = gwbuf_consume(read_buffer, discard);
+
+            if (proto->reply.reset_failed)
+            {
+                MXS_ERROR("Failed to reset a connection to server '%s' for user '%s'.",
+                          dcb->server->unique_name, local_session.user);
+                gwbuf_free(read_buffer);
+                gw_backend_read_failed(dcb, "Lost connection to backend server.");
+                return_code = 0;
+                goto return_rc;
+            }
+
+            if (read_buffer == NULL)
+            {
+                return_code = 0;
+                goto return_rc;
+            }
+            nbytes_read = gwbuf_length(read_buffer);
+        }
+
+        /**
+         * Routers that stream the replies get the data as it was read, unless
+         * the response to a session command needs to be assembled.
+         */
+        bool stream = (session->service->router->getCapabilities(
+                           session->service->router_instance, session->router_session) &
+                       (int)RCAP_TYPE_STREAM_OUTPUT) &&
+                      protocol_get_srv_command((MySQLProtocol *)dcb->protocol, false) == MYSQL_COM_UNDEFINED;
+
+        if (!stream && nbytes_read < 3)
         {
             dcb->dcb_readqueue = read_buffer;
             return_code = 0;
             goto return_rc;
         }
 
+        if (!stream)
         {
             GWBUF *tmp = modutil_get_complete_packets(&read_buffer);
             /* Put any residue into the read queue */
@@ -1130,6 +1221,12 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
         {
             stmt = read_buffer;
             read_buffer = NULL;
+
+            if (dcb->dcb_readqueue == NULL && MYSQL_REPLY_IS_COMPLETE(&proto->reply))
+            {
+                /** The data ends with the last packet of a reply */
+                gwbuf_set_type(stmt->tail, GWBUF_TYPE_RESPONSE_END);
+            }
         }
 
         /**
@@ -1140,7 +1237,9 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
             dcb->session->client_dcb != NULL &&
             dcb->session->client_dcb->state == DCB_STATE_POLLING &&
             (session->router_session ||
-             session->service->router->getCapabilities() & (int)RCAP_TYPE_NO_RSESSION))
+             session->service->router->getCapabilities(session->service->router_instance,
+                                                       session->router_session) &
+             (int)RCAP_TYPE_NO_RSESSION))
         {
             MySQLProtocol *client_protocol = (MySQLProtocol *)dcb->session->client_dcb->protocol;
             if (client_protocol != NULL)
@@ -1151,18 +1250,22 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
                 {
                     gwbuf_set_type(stmt, GWBUF_TYPE_MYSQL);
 
+                    session->reply_dcb = dcb;
                     session->service->router->clientReply(session->service->router_instance,
                                                           session->router_session,
                                                           stmt, dcb);
+                    session->reply_dcb = NULL;
                     return_code = 1;
                 }
             }
             else if (dcb->session->client_dcb->dcb_role == DCB_ROLE_INTERNAL)
             {
                 gwbuf_set_type(stmt, GWBUF_TYPE_MYSQL);
+                session->reply_dcb = dcb;
                 session->service->router->clientReply(session->service->router_instance,
                                                       session->router_session,
                                                       stmt, dcb);
+                session->reply_dcb = NULL;
                 return_code = 1;
             }
         }
@@ -1177,6 +1280,36 @@ return_rc:
     return return_code;
 }
 
+/**
+ * Give an error of a backend connection to the router. The session is closed
+ * if the router can't continue without the connection.
+ *
+ * @param dcb   The backend DCB
+ * @param msg   The message of the error given to the router
+ */
+static void
+gw_backend_read_failed(DCB *dcb, const char *msg)
+{
+    SESSION *session = dcb->session;
+    GWBUF *errbuf = mysql_create_custom_error(1, 0, msg);
+    bool succp;
+
+    session->service->router->handleError(session->service->router_instance,
+                                          session->router_session,
+                                          errbuf,
+                                          dcb,
+                                          ERRACT_NEW_CONNECTION,
+                                          &succp);
+    gwbuf_free(errbuf);
+
+    if (!succp)
+    {
+        spinlock_acquire(&session->ses_lock);
+        session->state = SESSION_STATE_STOPPING;
+        spinlock_release(&session->ses_lock);
+    }
+}
+
 /*
  * EPOLLOUT handler for the MySQL Backend protocol module.
  *
@@ -1260,6 +1393,13 @@ static int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
     int rc = 0;
 
     CHK_DCB(dcb);
+
+    if (dcb->session->service && dcb->session->service->governor)
+    {
+        /** The slot of the query is released when the reply has been read */
+        governor_backend_write(dcb->session, queue);
+    }
+
     spinlock_acquire(&dcb->authlock);
     /**
      * Pick action according to state of protocol.
@@ -1303,6 +1443,40 @@ static int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
                       STRPROTOCOLSTATE(backend_protocol->protocol_auth_state));
 
             spinlock_release(&dcb->authlock);
+
+            if (dcb->flags & DCBF_RESET)
+            {
+                if (MYSQL_IS_CHANGE_USER(ptr) && MYSQL_GET_PACKET_LEN(ptr) == 1)
+                {
+                    /** The router resets the connection itself */
+                    dcb->flags &= ~(DCBF_RESET | DCBF_RESET_SAME_USER);
+                }
+                else if ((queue = gw_reset_pooled_connection(dcb, queue)) == NULL)
+                {
+                    break;
+                }
+            }
+
+            if (MYSQL_IS_CHANGE_USER(ptr) && MYSQL_GET_PACKET_LEN(ptr) == 1)
+            {
+                /**
+                 * An empty COM_CHANGE_USER written by a router resets the
+                 * connection to the user and database of the client. As in
+                 * the delay queue, the packet is created here with the
+                 * scramble of this connection.
+                 */
+                MYSQL_session mses;
+                GWBUF *new_packet;
+
+                gw_get_shared_session_auth_info(dcb, &mses);
+                new_packet = gw_create_change_user_packet(&mses, backend_protocol);
+                queue = gwbuf_consume(queue, GWBUF_LENGTH(queue));
+                queue = gwbuf_append(new_packet, queue);
+            }
+
+            mysql_reply_track_commands(backend_protocol, queue);
+            backend_start_query_timer(dcb);
+
             /**
              * Statement type is used in readwrite split router.
              * Command is *not* set for readconn router.
@@ -1316,8 +1490,13 @@ static int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
                 /** Record the command to backend's protocol */
                 protocol_add_srv_command(backend_protocol, cmd);
             }
+
+            if (backend_protocol->compress)
+            {
+                queue = mysql_compress_packets(backend_protocol, queue);
+            }
             /** Write to backend */
-            rc = dcb_write(dcb, queue);
+            rc = queue ? dcb_write(dcb, queue) : 0;
         }
         break;
 
@@ -1602,6 +1781,14 @@ static int gw_backend_close(DCB *dcb)
     quitbuf = mysql_create_com_quit(NULL, 0);
     gwbuf_set_type(quitbuf, GWBUF_TYPE_MYSQL);
 
+    /** A query that is still running would keep the server busy, unless the
+     * server closed the connection */
+    if (timer_cancel(&((MySQLProtocol *)dcb->protocol)->query_timer) &&
+        !(dcb->flags & DCBF_HUNG))
+    {
+        backend_kill_query(dcb);
+    }
+
     /** Send COM_QUIT to the backend being closed */
     mysql_send_com_quit(dcb, 0, quitbuf);
 
@@ -1695,7 +1882,17 @@ static int backend_write_delayqueue(DCB *dcb)
             localq = gwbuf_consume(localq, GWBUF_LENGTH(localq));
             localq = gwbuf_append(localq, new_packet);
         }
-        rc = dcb_write(dcb, localq);
+
+        MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+        mysql_reply_track_commands(proto, localq);
+        backend_start_query_timer(dcb);
+
+        if (proto->compress)
+        {
+            localq = mysql_compress_packets(proto, localq);
+        }
+        rc = localq ? dcb_write(dcb, localq) : 0;
     }
 
     if (rc == 0)
@@ -2124,73 +2321,58 @@ static bool sescmd_response_complete(DCB* dcb)
 /**
  * gw_decode_mysql_server_handshake
  *
- * Decode mysql server handshake
+ * Decode mysql server handshake. The packet is read in one pass and every
+ * field is checked against the end of the packet.
  *
  * @param conn The MySQLProtocol structure
  * @param payload The bytes just read from the net
+ * @param len The length of the payload
  * @return 0 on success, < 0 on failure
  *
  */
 static int
-gw_decode_mysql_server_handshake(MySQLProtocol *conn, uint8_t *payload)
+gw_decode_mysql_server_handshake(MySQLProtocol *conn, uint8_t *payload, size_t len)
 {
-    uint8_t *server_version_end = NULL;
-    uint16_t mysql_server_capabilities_one = 0;
-    uint16_t mysql_server_capabilities_two = 0;
-    unsigned long tid = 0;
-    uint8_t scramble_data_1[GW_SCRAMBLE_LENGTH_323] = "";
-    uint8_t scramble_data_2[GW_MYSQL_SCRAMBLE_SIZE - GW_SCRAMBLE_LENGTH_323] = "";
-    uint8_t capab_ptr[4] = "";
-    int scramble_len = 0;
-    uint8_t mxs_scramble[GW_MYSQL_SCRAMBLE_SIZE] = "";
-    int protocol_version = 0;
+    MYSQL_READER r;
+    size_t version_len;
+    int scramble_len = GW_MYSQL_SCRAMBLE_SIZE;
 
-    protocol_version = payload[0];
+    mysql_reader_init(&r, payload, len);
 
-    if (protocol_version != GW_MYSQL_PROTOCOL_VERSION)
+    if (mysql_reader_int(&r, 1) != GW_MYSQL_PROTOCOL_VERSION)
     {
         return -1;
     }
 
-    payload++;
-
-    // Get server version (string)
-    server_version_end = (uint8_t *) gw_strend((char*) payload);
+    // server version (string), thread id
+    mysql_reader_string(&r, &version_len);
+    uint32_t tid = mysql_reader_int(&r, 4);
 
-    payload = server_version_end + 1;
-
-    // get ThreadID: 4 bytes
-    tid = gw_mysql_get_byte4(payload);
-    memcpy(&conn->tid, &tid, 4);
-
-    payload += 4;
-
-    // scramble_part 1
-    memcpy(scramble_data_1, payload, GW_SCRAMBLE_LENGTH_323);
-    payload += GW_SCRAMBLE_LENGTH_323;
+    uint8_t *scramble_data_1 = mysql_reader_bytes(&r, GW_SCRAMBLE_LENGTH_323);
 
     // 1 filler
-    payload++;
+    mysql_reader_bytes(&r, 1);
 
-    mysql_server_capabilities_one = gw_mysql_get_byte2(payload);
+    uint32_t mysql_server_capabilities_one = mysql_reader_int(&r, 2);
 
-    //Get capabilities_part 1 (2 bytes) + 1 language + 2 server_status
-    payload += 5;
+    // 1 language + 2 server_status
+    mysql_reader_bytes(&r, 3);
 
-    mysql_server_capabilities_two = gw_mysql_get_byte2(payload);
+    uint32_t mysql_server_capabilities_two = mysql_reader_int(&r, 2);
+    uint32_t scramble_len_byte = mysql_reader_int(&r, 1);
 
-    memcpy(capab_ptr, &mysql_server_capabilities_one, 2);
-
-    // get capabilities part 2 (2 bytes)
-    memcpy(&capab_ptr[2], &mysql_server_capabilities_two, 2);
+    // skip 10 zero bytes
+    mysql_reader_bytes(&r, 10);
 
-    // 2 bytes shift
-    payload += 2;
+    if (r.failed)
+    {
+        return -1;
+    }
 
     // get scramble len
-    if (payload[0] > 0)
+    if (scramble_len_byte > 0)
     {
-        scramble_len = payload[0] -1;
+        scramble_len = scramble_len_byte - 1;
         ss_dassert(scramble_len > GW_SCRAMBLE_LENGTH_323);
         ss_dassert(scramble_len <= GW_MYSQL_SCRAMBLE_SIZE);
 
@@ -2201,21 +2383,23 @@ gw_decode_mysql_server_handshake(MySQLProtocol *conn, uint8_t *payload)
             return -2;
         }
     }
-    else
+
+    // the second part of the scramble
+    uint8_t *scramble_data_2 = mysql_reader_bytes(&r, scramble_len - GW_SCRAMBLE_LENGTH_323);
+
+    if (r.failed)
     {
-        scramble_len = GW_MYSQL_SCRAMBLE_SIZE;
+        return -1;
     }
-    // skip 10 zero bytes
-    payload += 11;
-
-    // copy the second part of the scramble
-    memcpy(scramble_data_2, payload, scramble_len - GW_SCRAMBLE_LENGTH_323);
 
-    memcpy(mxs_scramble, scramble_data_1, GW_SCRAMBLE_LENGTH_323);
-    memcpy(mxs_scramble + GW_SCRAMBLE_LENGTH_323, scramble_data_2, scramble_len - GW_SCRAMBLE_LENGTH_323);
+    conn->tid = tid;
+    conn->server_capabilities = mysql_server_capabilities_one |
+        (mysql_server_capabilities_two << 16);
 
     // full 20 bytes scramble is ready
-    memcpy(conn->scramble, mxs_scramble, GW_MYSQL_SCRAMBLE_SIZE);
+    memset(conn->scramble, 0, GW_MYSQL_SCRAMBLE_SIZE);
+    memcpy(conn->scramble, scramble_data_1, GW_SCRAMBLE_LENGTH_323);
+    memcpy(conn->scramble + GW_SCRAMBLE_LENGTH_323, scramble_data_2, scramble_len - GW_SCRAMBLE_LENGTH_323);
 
     return 0;
 }
@@ -2343,13 +2527,13 @@ gw_receive_backend_auth(MySQLProtocol *protocol)
  * We start by taking the default bitmask and removing any bits not set in
  * the bitmask contained in the connection structure. Then add SSL flag if
  * the connection requires SSL (set from the MaxScale configuration). The
- * compression flag may be set, although compression is NOT SUPPORTED. If a
+ * compression flag may be set if the compressed protocol is used. If a
  * database name has been specified in the function call, the relevant flag
  * is set.
  *
  * @param conn  The MySQLProtocol structure for the connection
  * @param db_specified Whether the connection request specified a database
- * @param compress Whether compression is requested - NOT SUPPORTED
+ * @param compress Whether compression is requested
  * @return Bit mask (32 bits)
  * @note Capability bits are defined in mysql_client_server_protocol.h
  */
@@ -2369,7 +2553,6 @@ create_capabilities(MySQLProtocol *conn, bool db_specified, bool compress)
         /* final_capabilities |= (uint32_t)GW_MYSQL_CAPABILITIES_SSL_VERIFY_SERVER_CERT; */
     }
 
-    /* Compression is not currently supported */
     if (compress)
     {
         final_capabilities |= (uint32_t)GW_MYSQL_CAPABILITIES_COMPRESS;
@@ -2394,6 +2577,20 @@ create_capabilities(MySQLProtocol *conn, bool db_specified, bool compress)
     return final_capabilities;
 }
 
+/**
+ * Check whether the compressed protocol should be used with the backend
+ *
+ * @param conn The MySQLProtocol structure for the connection
+ * @return True if compression is enabled for the server and the server
+ * supports it
+ */
+static bool
+use_compression(MySQLProtocol *conn)
+{
+    return conn->owner_dcb->server->compression &&
+           (conn->server_capabilities & (uint32_t)GW_MYSQL_CAPABILITIES_COMPRESS);
+}
+
 /**
  * @brief Computes the size of the response to the DB initial handshake
  *
@@ -2703,3 +2900,183 @@ gw_send_change_user_to_backend(char          *dbname,
     }
     return rc;
 }
+
+/**
+ * Create a packet of a command with an optional argument
+ *
+ * @param cmd   The command
+ * @param arg   The argument or NULL
+ * @return The packet or NULL on memory allocation failure
+ */
+static GWBUF *
+gw_create_command_packet(uint8_t cmd, const char *arg)
+{
+    size_t len = arg ? strlen(arg) : 0;
+    GWBUF *buffer = gwbuf_alloc(MYSQL_HEADER_LEN + 1 + len);
+
+    if (buffer)
+    {
+        uint8_t *ptr = GWBUF_DATA(buffer);
+        gw_mysql_set_byte3(ptr, 1 + len);
+        ptr[3] = 0;
+        ptr[MYSQL_HEADER_LEN] = cmd;
+        memcpy(ptr + MYSQL_HEADER_LEN + 1, arg, len);
+    }
+
+    return buffer;
+}
+
+/**
+ * Reset a connection that was taken from the persistent pool for the session
+ * that writes to it for the first time. The commands that reset it are put
+ * in front of the written data and their replies are not given to the router.
+ *
+ * A connection of another user is changed to the user and database of the
+ * client with a COM_CHANGE_USER. With persistreset=reset_connection, a
+ * connection of the same user gets a COM_RESET_CONNECTION and a COM_INIT_DB,
+ * which do not authenticate the user again. A client without a default
+ * database still needs a COM_CHANGE_USER to leave the database of the
+ * previous session.
+ *
+ * @param dcb   The backend DCB
+ * @param queue The data written by the router
+ * @return The data to write or NULL on error, the queue is freed
+ */
+static GWBUF *
+gw_reset_pooled_connection(DCB *dcb, GWBUF *queue)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+    bool same_user = dcb->flags & DCBF_RESET_SAME_USER;
+    MYSQL_session mses;
+    GWBUF *reset = NULL;
+    int n_reset = 0;
+
+    dcb->flags &= ~(DCBF_RESET | DCBF_RESET_SAME_USER);
+
+    if (!gw_get_shared_session_auth_info(dcb, &mses))
+    {
+        gwbuf_free(queue);
+        return NULL;
+    }
+
+    if (same_user && dcb->server->persistreset == PERSIST_RESET_CONNECTION && *mses.db)
+    {
+        GWBUF *init_db = gw_create_command_packet(MYSQL_COM_INIT_DB, mses.db);
+
+        if (init_db && (reset = gw_create_command_packet(MYSQL_COM_RESET_CONNECTION, NULL)))
+        {
+            reset = gwbuf_append(reset, init_db);
+        }
+        else
+        {
+            gwbuf_free(init_db);
+        }
+        n_reset = 2;
+    }
+    else
+    {
+        reset = gw_create_change_user_packet(&mses, proto);
+        n_reset = 1;
+    }
+
+    if (reset == NULL)
+    {
+        MXS_ERROR("Failed to reset a connection to server '%s' for user '%s'.",
+                  dcb->server->unique_name, mses.user);
+        gwbuf_free(queue);
+        return NULL;
+    }
+
+    /** The replies to the discarded commands come before the rest */
+    proto->reply.n_discard += n_reset;
+
+    return gwbuf_append(reset, queue);
+}
+
+/**
+ * Kill the query that a backend connection is running
+ *
+ * @param dcb The backend DCB
+ */
+static void backend_kill_query(DCB *dcb)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    if (dcb->session && dcb->session->service && proto->tid)
+    {
+        mxs_mysql_kill_query(dcb->session->service, dcb->server, proto->tid);
+    }
+}
+
+/**
+ * Called when a query of a backend connection has run for max_execution_time
+ *
+ * @param data The backend DCB
+ */
+static void backend_query_timeout(void *data)
+{
+    DCB *dcb = (DCB *)data;
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    if (dcb->state == DCB_STATE_POLLING && dcb->session && dcb->session->service &&
+        !MYSQL_REPLY_IS_COMPLETE(&proto->reply))
+    {
+        MXS_WARNING("A query of service '%s' has run on server '%s' for longer than "
+                    "%d milliseconds, killing it.", dcb->session->service->name,
+                    dcb->server->unique_name, dcb->session->service->max_execution_time);
+        backend_kill_query(dcb);
+    }
+}
+
+/**
+ * Start measuring the execution time of the query written to a backend
+ * connection, unless an earlier query is still running. The time the backend
+ * is busy is counted in the resource usage of the user.
+ *
+ * @param dcb The backend DCB
+ */
+static void backend_start_query_timer(DCB *dcb)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+    int timeout = dcb->session && dcb->session->service ?
+                  dcb->session->service->max_execution_time : 0;
+
+    if (proto->busy_start == 0 && !MYSQL_REPLY_IS_COMPLETE(&proto->reply))
+    {
+        proto->busy_start = rdtsc();
+    }
+
+    if (timeout > 0 && !MYSQL_REPLY_IS_COMPLETE(&proto->reply) &&
+        !timer_pending(&proto->query_timer))
+    {
+        if (proto->query_timer.fn == NULL)
+        {
+            timer_init(&proto->query_timer, backend_query_timeout, dcb);
+        }
+        poll_add_timer(&proto->query_timer, timeout, 0);
+    }
+}
+
+/**
+ * Stop measuring the execution time, all replies have been read
+ *
+ * @param dcb The backend DCB
+ */
+static void backend_stop_query_timer(DCB *dcb)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    if (timer_pending(&proto->query_timer))
+    {
+        timer_cancel(&proto->query_timer);
+    }
+
+    if (proto->busy_start)
+    {
+        if (dcb->session)
+        {
+            usage_add(dcb->session, USAGE_BACKEND_CYCLES, rdtsc() - proto->busy_start);
+        }
+        proto->busy_start = 0;
+    }
+}
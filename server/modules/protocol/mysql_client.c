@@ -44,6 +44,12 @@
  *                                      replace gwbuf_consume by gwbuf_free (multiple).
  * 07/02/2016   Martin Brampton         Split off authentication and SSL.
  * 31/05/2016   Martin Brampton         Implement connection throttling
+ * 14/10/2016   MariaDB Corporation     Wait for the users to be loaded in the background
+ * 14/10/2016   MariaDB Corporation     Queries are admitted by the concurrency governor
+ * 14/10/2016   MariaDB Corporation     Common probe queries of the connectors are answered locally
+ * 14/10/2016   MariaDB Corporation     Compressed protocol if the listener offers it
+ * 14/10/2016   MariaDB Corporation     Routed queries are counted in the resource usage
+ * 14/10/2016   MariaDB Corporation     Local replies release the governor slot
  */
 #include <gw_protocol.h>
 #include <skygw_utils.h>
@@ -57,6 +63,13 @@
 #include <sys/stat.h>
 #include <modutil.h>
 #include <netinet/tcp.h>
+#include <governor.h>
+#include <usage.h>
+#include <resultset.h>
+#include <atomic.h>
+#include <ctype.h>
+#include <strings.h>
+#include <time.h>
 
 #include "gw_authenticator.h"
 
@@ -88,6 +101,8 @@ static int gw_connection_limit(DCB *dcb, int limit);
 static int mysql_send_ok(DCB *dcb, int packet_number, int in_affected_rows, const char* mysql_message);
 static int MySQLSendHandshake(DCB* dcb);
 static int route_by_statement(SESSION *, GWBUF **);
+static bool governor_allows(SESSION *session, GWBUF *query, GWBUF **p_readbuf);
+static bool probe_answer(SESSION *session, GWBUF *query, bool more);
 static void mysql_client_auth_error_handling(DCB *dcb, int auth_val);
 static int gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read);
 static int gw_read_normal_data(DCB *dcb, GWBUF *read_buffer, int nbytes_read);
@@ -250,187 +265,195 @@ int mysql_send_ok(DCB *dcb, int packet_number, int in_affected_rows, const char*
 /**
  * MySQLSendHandshake
  *
+ * The handshake is written in one pass into a buffer of the exact size.
+ *
  * @param dcb The descriptor control block to use for sending the handshake request
  * @return      The packet length sent
  */
 int MySQLSendHandshake(DCB* dcb)
 {
-    uint8_t *outbuf = NULL;
-    uint32_t mysql_payload_size = 0;
-    uint8_t mysql_packet_header[4];
-    uint8_t mysql_packet_id = 0;
-    /* uint8_t mysql_filler = GW_MYSQL_HANDSHAKE_FILLER; not needed*/
-    uint8_t mysql_protocol_version = GW_MYSQL_PROTOCOL_VERSION;
-    uint8_t *mysql_handshake_payload = NULL;
-    uint8_t mysql_thread_id_num[4];
-    uint8_t mysql_scramble_buf[9] = "";
-    uint8_t mysql_plugin_data[13] = "";
-    uint8_t mysql_server_capabilities_one[2];
-    uint8_t mysql_server_capabilities_two[2];
+    static const char plugin_name[] = "mysql_native_password";
     uint8_t mysql_server_language = 8;
-    uint8_t mysql_server_status[2];
-    uint8_t mysql_scramble_len = 21;
-    uint8_t mysql_filler_ten[10];
-    /* uint8_t mysql_last_byte = 0x00; not needed */
-    char server_scramble[GW_MYSQL_SCRAMBLE_SIZE + 1]="";
-    char *version_string;
-    int len_version_string = 0;
-    int id_num;
+    const char *version_string = GW_MYSQL_VERSION;
+    size_t len_version_string;
+    MySQLProtocol *protocol = DCB_PROTOCOL(dcb, MySQLProtocol);
+    MYSQL_WRITER w;
+    GWBUF *buf;
 
     if (dcb->service->dbref)
     {
         mysql_server_language = dcb->service->dbref->server->charset;
     }
 
-    MySQLProtocol *protocol = DCB_PROTOCOL(dcb, MySQLProtocol);
-    GWBUF *buf;
-
     /* get the version string from service property if available*/
     if (dcb->service->version_string != NULL)
     {
         version_string = dcb->service->version_string;
-        len_version_string = strlen(version_string);
-    }
-    else
-    {
-        version_string = GW_MYSQL_VERSION;
-        len_version_string = strlen(GW_MYSQL_VERSION);
     }
+    len_version_string = strlen(version_string);
 
+    char server_scramble[GW_MYSQL_SCRAMBLE_SIZE + 1];
     gw_generate_random_str(server_scramble, GW_MYSQL_SCRAMBLE_SIZE);
 
     // copy back to the caller
     memcpy(protocol->scramble, server_scramble, GW_MYSQL_SCRAMBLE_SIZE);
 
-    // fill the handshake packet
-
-    memset(mysql_filler_ten, 0x00, sizeof(mysql_filler_ten));
-
-    // thread id, now put thePID
-    id_num = getpid() + dcb->fd;
-    gw_mysql_set_byte4(mysql_thread_id_num, id_num);
-
-    memcpy(mysql_scramble_buf, server_scramble, 8);
-
-    memcpy(mysql_plugin_data, server_scramble + 8, 12);
-
-    mysql_payload_size =
-        sizeof(mysql_protocol_version) + (len_version_string + 1) + sizeof(mysql_thread_id_num) + 8 +
-        sizeof(/* mysql_filler */ uint8_t) + sizeof(mysql_server_capabilities_one) + sizeof(mysql_server_language) +
-        sizeof(mysql_server_status) + sizeof(mysql_server_capabilities_two) + sizeof(mysql_scramble_len) +
-        sizeof(mysql_filler_ten) + 12 + sizeof(/* mysql_last_byte */ uint8_t) + strlen("mysql_native_password") +
-        sizeof(/* mysql_last_byte */ uint8_t);
+    /**
+     * Protocol version, server version, thread id, first 8 bytes of the scramble,
+     * filler, capabilities, language, status, upper capabilities, scramble length,
+     * 10 reserved bytes, the rest of the scramble and the authentication plugin
+     */
+    uint32_t mysql_payload_size = 1 + len_version_string + 1 + 4 + GW_SCRAMBLE_LENGTH_323 + 1 + 2 +
+        1 + 2 + 2 + 1 + 10 + (GW_MYSQL_SCRAMBLE_SIZE - GW_SCRAMBLE_LENGTH_323) + 1 +
+        sizeof(plugin_name);
 
     // allocate memory for packet header + payload
-    if ((buf = gwbuf_alloc(sizeof(mysql_packet_header) + mysql_payload_size)) == NULL)
+    if ((buf = gwbuf_alloc(MYSQL_HEADER_LEN + mysql_payload_size)) == NULL)
     {
         ss_dassert(buf != NULL);
         return 0;
     }
-    outbuf = GWBUF_DATA(buf);
-
-    // write packet header with mysql_payload_size
-    gw_mysql_set_byte3(mysql_packet_header, mysql_payload_size);
-
-    // write packet number, now is 0
-    mysql_packet_header[3]= mysql_packet_id;
-    memcpy(outbuf, mysql_packet_header, sizeof(mysql_packet_header));
-
-    // current buffer pointer
-    mysql_handshake_payload = outbuf + sizeof(mysql_packet_header);
-
-    // write protocol version
-    memcpy(mysql_handshake_payload, &mysql_protocol_version, sizeof(mysql_protocol_version));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_protocol_version);
-
-    // write server version plus 0 filler
-    strcpy((char *)mysql_handshake_payload, version_string);
-    mysql_handshake_payload = mysql_handshake_payload + len_version_string;
-
-    *mysql_handshake_payload = 0x00;
-
-    mysql_handshake_payload++;
-
-    // write thread id
-    memcpy(mysql_handshake_payload, mysql_thread_id_num, sizeof(mysql_thread_id_num));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_thread_id_num);
-
-    // write scramble buf
-    memcpy(mysql_handshake_payload, mysql_scramble_buf, 8);
-    mysql_handshake_payload = mysql_handshake_payload + 8;
-    *mysql_handshake_payload = GW_MYSQL_HANDSHAKE_FILLER;
-    mysql_handshake_payload++;
-
-    // write server capabilities part one
-    mysql_server_capabilities_one[0] = GW_MYSQL_SERVER_CAPABILITIES_BYTE1;
-    mysql_server_capabilities_one[1] = GW_MYSQL_SERVER_CAPABILITIES_BYTE2;
 
+    uint8_t mysql_server_capabilities_one[2] =
+    {
+        GW_MYSQL_SERVER_CAPABILITIES_BYTE1 & ~(int)GW_MYSQL_CAPABILITIES_COMPRESS,
+        GW_MYSQL_SERVER_CAPABILITIES_BYTE2
+    };
 
-    mysql_server_capabilities_one[0] &= ~(int)GW_MYSQL_CAPABILITIES_COMPRESS;
+    if (dcb->listener && dcb->listener->compression)
+    {
+        mysql_server_capabilities_one[0] |= (int)GW_MYSQL_CAPABILITIES_COMPRESS;
+    }
 
     if (ssl_required_by_dcb(dcb))
     {
         mysql_server_capabilities_one[1] |= (int)GW_MYSQL_CAPABILITIES_SSL >> 8;
     }
 
-    memcpy(mysql_handshake_payload, mysql_server_capabilities_one, sizeof(mysql_server_capabilities_one));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_capabilities_one);
+    mysql_writer_init(&w, GWBUF_DATA(buf), GWBUF_LENGTH(buf));
 
-    // write server language
-    memcpy(mysql_handshake_payload, &mysql_server_language, sizeof(mysql_server_language));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_language);
+    // packet header, the packet number is 0
+    mysql_writer_int(&w, mysql_payload_size, 3);
+    mysql_writer_int(&w, 0, 1);
 
-    //write server status
-    mysql_server_status[0] = 2;
-    mysql_server_status[1] = 0;
-    memcpy(mysql_handshake_payload, mysql_server_status, sizeof(mysql_server_status));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_status);
+    mysql_writer_int(&w, GW_MYSQL_PROTOCOL_VERSION, 1);
+    mysql_writer_string(&w, version_string, len_version_string);
 
-    //write server capabilities part two
-    mysql_server_capabilities_two[0] = 15;
-    mysql_server_capabilities_two[1] = 128;
+    // thread id, now put thePID
+    mysql_writer_int(&w, getpid() + dcb->fd, 4);
 
-    memcpy(mysql_handshake_payload, mysql_server_capabilities_two, sizeof(mysql_server_capabilities_two));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_capabilities_two);
+    mysql_writer_bytes(&w, protocol->scramble, GW_SCRAMBLE_LENGTH_323);
+    mysql_writer_int(&w, GW_MYSQL_HANDSHAKE_FILLER, 1);
+    mysql_writer_bytes(&w, mysql_server_capabilities_one, sizeof(mysql_server_capabilities_one));
+    mysql_writer_int(&w, mysql_server_language, 1);
 
-    // write scramble_len
-    memcpy(mysql_handshake_payload, &mysql_scramble_len, sizeof(mysql_scramble_len));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_scramble_len);
+    // server status: autocommit
+    mysql_writer_int(&w, 2, 2);
 
-    //write 10 filler
-    memcpy(mysql_handshake_payload, mysql_filler_ten, sizeof(mysql_filler_ten));
-    mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_filler_ten);
+    // server capabilities part two
+    mysql_writer_int(&w, 15 | (128 << 8), 2);
 
-    // write plugin data
-    memcpy(mysql_handshake_payload, mysql_plugin_data, 12);
-    mysql_handshake_payload = mysql_handshake_payload + 12;
+    mysql_writer_int(&w, GW_MYSQL_SCRAMBLE_SIZE + 1, 1);
+    mysql_writer_zeros(&w, 10);
 
-    //write last byte, 0
-    *mysql_handshake_payload = 0x00;
-    mysql_handshake_payload++;
+    mysql_writer_bytes(&w, protocol->scramble + GW_SCRAMBLE_LENGTH_323,
+                       GW_MYSQL_SCRAMBLE_SIZE - GW_SCRAMBLE_LENGTH_323);
+    mysql_writer_zeros(&w, 1);
 
-    // to be understanded ????
-    memcpy(mysql_handshake_payload, "mysql_native_password", strlen("mysql_native_password"));
-    mysql_handshake_payload = mysql_handshake_payload + strlen("mysql_native_password");
+    mysql_writer_string(&w, plugin_name, sizeof(plugin_name) - 1);
 
-    //write last byte, 0
-    *mysql_handshake_payload = 0x00;
+    ss_dassert(!w.failed && w.ptr == w.end);
 
     // writing data in the Client buffer queue
     dcb->func.write(dcb, buf);
 
-    return sizeof(mysql_packet_header) + mysql_payload_size;
+    return MYSQL_HEADER_LEN + mysql_payload_size;
+}
+
+/**
+ * The CPU time used by the calling thread
+ *
+ * @return The CPU time in nanoseconds
+ */
+static int64_t thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 /**
  * Write function for client DCB: writes data from MaxScale to Client
  *
+ * If the client uses the compressed protocol, the data is compressed here
+ * in the calling thread before it is written.
+ *
  * @param dcb   The DCB of the client
  * @param queue Queue of buffers to write
  */
 int gw_MySQLWrite_client(DCB *dcb, GWBUF *queue)
 {
-    return dcb_write(dcb, queue);
+    MySQLProtocol *protocol = (MySQLProtocol *)dcb->protocol;
+
+    if (protocol->compress && queue)
+    {
+        SERV_LISTENER *port = dcb->listener;
+        int64_t plain = gwbuf_length(queue);
+        int64_t start = thread_cpu_ns();
+
+        if ((queue = mysql_compress_stream(protocol, queue, port->compression)) == NULL)
+        {
+            MXS_ERROR("Failed to compress the data for client '%s'.",
+                      dcb->remote ? dcb->remote : "<unknown>");
+            return 0;
+        }
+
+        atomic_add_int64(&port->compress_cpu_ns, thread_cpu_ns() - start);
+        atomic_add_int64(&port->compress_plain, plain);
+        atomic_add_int64(&port->compress_sent, gwbuf_length(queue));
+    }
+
+    int rc = dcb_write(dcb, queue);
+
+    if (dcb->session && dcb->session->service && dcb->session->service->governor)
+    {
+        /** A reply that was generated without a backend ends the query */
+        governor_client_write(dcb->session);
+    }
+
+    return rc;
+}
+
+/**
+ * Decompress the data read from a client that uses the compressed protocol
+ *
+ * @param dcb           The DCB of the client
+ * @param read_buffer   The data read from the network, freed by this function
+ * @param decompressed  Decompressed data that was read before, the newly
+ *                      decompressed data is appended to it
+ * @return False if the data could not be decompressed, *decompressed is
+ * freed and set to NULL then
+ */
+static bool client_decompress(DCB *dcb, GWBUF *read_buffer, GWBUF **decompressed)
+{
+    MySQLProtocol *protocol = (MySQLProtocol *)dcb->protocol;
+    SERV_LISTENER *port = dcb->listener;
+    int64_t compressed = gwbuf_length(read_buffer);
+    int64_t before = gwbuf_length(*decompressed);
+    int64_t start = thread_cpu_ns();
+
+    if (!mysql_decompress_packets(protocol, read_buffer, decompressed))
+    {
+        gwbuf_free(*decompressed);
+        *decompressed = NULL;
+        return false;
+    }
+
+    atomic_add_int64(&port->compress_cpu_ns, thread_cpu_ns() - start);
+    atomic_add_int64(&port->decompress_read, compressed);
+    atomic_add_int64(&port->decompress_plain, gwbuf_length(*decompressed) - before);
+
+    return true;
 }
 
 /**
@@ -457,6 +480,11 @@ int gw_read_client_event(DCB* dcb)
     protocol = (MySQLProtocol *)dcb->protocol;
     CHK_PROTOCOL(protocol);
 
+    if (protocol->protocol_auth_state == MYSQL_IDLE && dcb->session)
+    {
+        trace_begin(&dcb->session->trace);
+    }
+
 #ifdef SS_DEBUG
     MXS_DEBUG("[gw_read_client_event] Protocol state: %s",
               gw_mysql_protocol_state2string(protocol->protocol_auth_state));
@@ -485,7 +513,32 @@ int gw_read_client_event(DCB* dcb)
     {
         max_bytes = 36;
     }
+
+    GWBUF *decompressed = NULL;
+
+    if (protocol->compress)
+    {
+        /**
+         * The read queue holds data that is already decompressed, keep
+         * it apart from the compressed data read from the network.
+         */
+        spinlock_acquire(&dcb->authlock);
+        decompressed = dcb->dcb_readqueue;
+        dcb->dcb_readqueue = NULL;
+        spinlock_release(&dcb->authlock);
+    }
+
     return_code = dcb_read(dcb, &read_buffer, max_bytes);
+
+    if (protocol->compress)
+    {
+        if (!client_decompress(dcb, read_buffer, &decompressed))
+        {
+            return_code = -1;
+        }
+        read_buffer = decompressed;
+    }
+
     if (return_code < 0)
     {
         dcb_close(dcb);
@@ -588,6 +641,25 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
         auth_val = dcb->authfunc.authenticate(dcb);
     }
 
+    /**
+     * If the users of the service may be outdated, they are loaded in the
+     * background and the packet is processed again once they are loaded.
+     * If the load cannot be started, the client is authenticated again
+     * with the current users to get the real result.
+     */
+    if (MYSQL_AUTH_USERS_OUTDATED == auth_val)
+    {
+        if (service_refresh_users_async(dcb->service, dcb, read_buffer))
+        {
+            return 0;
+        }
+
+        if (MYSQL_AUTH_SUCCEEDED == (auth_val = dcb->authfunc.extract(dcb, read_buffer)))
+        {
+            auth_val = dcb->authfunc.authenticate(dcb);
+        }
+    }
+
     /**
      * At this point, if the auth_val return code indicates success
      * the user authentication has been successfully completed.
@@ -624,6 +696,10 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
              * packet sequence is # packet_number
              */
             mysql_send_ok(dcb, packet_number, 0, NULL);
+
+            /** All packets after the authentication are compressed */
+            protocol->compress = dcb->listener && dcb->listener->compression &&
+                (protocol->client_capabilities & GW_MYSQL_CAPABILITIES_COMPRESS);
         }
         else
         {
@@ -916,7 +992,12 @@ gw_read_finish_processing(DCB *dcb, GWBUF *read_buffer, uint8_t capabilities)
             /** Feed whole packet to router, which will free it
              *  and return 1 for success, 0 for failure
              */
-            return_code = SESSION_ROUTE_QUERY(session, read_buffer) ? 0 : 1;
+            if (governor_allows(session, read_buffer, NULL))
+            {
+                usage_add(session, USAGE_QUERIES, 1);
+                trace_stage(&session->trace, session->ses_id, TRACE_FILTERS);
+                return_code = SESSION_ROUTE_QUERY(session, read_buffer) ? 0 : 1;
+            }
         }
         /* else return_code is still 0 from when it was originally set */
         /* Note that read_buffer has been freed or transferred by this point */
@@ -1267,6 +1348,12 @@ gw_client_close(DCB *dcb)
     }
 #endif
     MXS_DEBUG("%lu [gw_client_close]", pthread_self());
+
+    if (dcb->service)
+    {
+        service_refresh_users_cancel(dcb->service, dcb);
+    }
+
     mysql_protocol_done(dcb);
     session = dcb->session;
     /**
@@ -1389,8 +1476,24 @@ static int route_by_statement(SESSION* session, GWBUF** p_readbuf)
              * sure it is set to each (MySQL) packet.
              */
             gwbuf_set_type(packetbuf, GWBUF_TYPE_SINGLE_STMT);
-            /** Route query */
-            rc = SESSION_ROUTE_QUERY(session, packetbuf);
+
+            if (probe_answer(session, packetbuf, *p_readbuf != NULL))
+            {
+                /** The query was answered without routing it */
+                rc = 1;
+            }
+            else if (!governor_allows(session, packetbuf, p_readbuf))
+            {
+                /** The query was queued or rejected, the session continues */
+                rc = 1;
+            }
+            else
+            {
+                /** Route query */
+                usage_add(session, USAGE_QUERIES, 1);
+                trace_stage(&session->trace, session->ses_id, TRACE_FILTERS);
+                rc = SESSION_ROUTE_QUERY(session, packetbuf);
+            }
         }
         else
         {
@@ -1404,6 +1507,558 @@ return_rc:
     return rc;
 }
 
+/**
+ * Check whether the concurrency governor of the service lets a query be
+ * routed now.
+ *
+ * A query that has to wait for a slot is queued together with the data that
+ * was read after it, the governor puts them back into the read queue of the
+ * DCB when the session gets a slot. A query that can not be queued is
+ * answered with an error.
+ *
+ * @param session   The session
+ * @param query     The query, queued or freed if it can not be routed now
+ * @param p_readbuf The data read after the query or NULL, queued with the query
+ *
+ * @return True if the query can be routed now
+ */
+static bool governor_allows(SESSION *session, GWBUF *query, GWBUF **p_readbuf)
+{
+    if (session->service->governor == NULL)
+    {
+        return true;
+    }
+
+    GWBUF *rest = p_readbuf ? *p_readbuf : NULL;
+    bool rval = false;
+
+    switch (governor_admit(session, query, rest))
+    {
+    case GOVERNOR_ADMIT:
+        rval = true;
+        break;
+
+    case GOVERNOR_QUEUE:
+        if (p_readbuf)
+        {
+            *p_readbuf = NULL;
+        }
+        break;
+
+    case GOVERNOR_REJECT:
+        {
+            char msg[256];
+
+            snprintf(msg, sizeof(msg), "Too many queries are waiting in service '%s'",
+                     session->service->name);
+            modutil_send_mysql_err_packet(session->client_dcb, 1, 0, 1040, "08004", msg);
+            gwbuf_free(query);
+        }
+        break;
+    }
+
+    return rval;
+}
+
+/** The default collations of the character sets that SET NAMES keeps */
+static const struct
+{
+    unsigned int id;    /*< Id of the collation in the handshake */
+    const char *name;   /*< Name of the character set */
+} probe_charsets[] =
+{
+    {8, "latin1"},
+    {11, "ascii"},
+    {33, "utf8"},
+    {45, "utf8mb4"},
+    {63, "binary"}
+};
+
+/** The longest value that fits into a one byte length of a result set row */
+#define PROBE_MAX_VALUE 250
+
+/**
+ * The row of a locally answered probe query
+ */
+typedef struct probe_result
+{
+    const char *values[2]; /*< The values of the row */
+    int n_values;          /*< Number of values */
+    bool sent;             /*< The row has been sent */
+} PROBE_RESULT;
+
+/** Skip whitespace and comments, except the executable comments */
+static const char *probe_skip_space(const char *ptr, const char *end)
+{
+    while (ptr < end)
+    {
+        if (isspace((unsigned char)*ptr))
+        {
+            ptr++;
+        }
+        else if (end - ptr >= 3 && ptr[0] == '/' && ptr[1] == '*' && ptr[2] != '!')
+        {
+            const char *close = ptr + 2;
+
+            while (close + 1 < end && !(close[0] == '*' && close[1] == '/'))
+            {
+                close++;
+            }
+
+            ptr = close + 1 < end ? close + 2 : end;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return ptr;
+}
+
+/** Check whether the SQL at ptr starts with a keyword */
+static bool probe_is_word(const char *ptr, const char *end, const char *word)
+{
+    size_t len = strlen(word);
+
+    return (size_t)(end - ptr) >= len && strncasecmp(ptr, word, len) == 0 &&
+           ((size_t)(end - ptr) == len || !(isalnum((unsigned char)ptr[len]) || ptr[len] == '_'));
+}
+
+/** Return the end of a name at ptr */
+static const char *probe_name_end(const char *ptr, const char *end)
+{
+    while (ptr < end && (isalnum((unsigned char)*ptr) || *ptr == '_'))
+    {
+        ptr++;
+    }
+
+    return ptr;
+}
+
+/**
+ * Return the row of a probe query
+ *
+ * @param set  The result set
+ * @param data The row
+ * @return The row the first time, NULL after it
+ */
+static RESULT_ROW *probe_row(RESULTSET *set, void *data)
+{
+    PROBE_RESULT *result = (PROBE_RESULT *)data;
+    RESULT_ROW *row = NULL;
+
+    if (!result->sent && (row = resultset_make_row(set)) != NULL)
+    {
+        for (int i = 0; i < result->n_values; i++)
+        {
+            resultset_row_set(row, i, (char *)result->values[i]);
+        }
+    }
+
+    result->sent = true;
+    return row;
+}
+
+/**
+ * Send a result set of one row to the client
+ *
+ * @param dcb     The client DCB
+ * @param names   Names of the columns
+ * @param values  Values of the columns, NULL for a NULL value
+ * @param n       Number of columns
+ * @return True if the result set was sent
+ */
+static bool probe_send(DCB *dcb, char **names, const char **values, int n)
+{
+    PROBE_RESULT result = {{NULL, NULL}, n, false};
+    RESULTSET *set;
+
+    for (int i = 0; i < n; i++)
+    {
+        result.values[i] = values[i];
+    }
+
+    if ((set = resultset_create(probe_row, &result)) == NULL)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        resultset_add_column(set, names[i], PROBE_MAX_VALUE, COL_TYPE_VARCHAR);
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+    return true;
+}
+
+/**
+ * Get the value of a cached global variable of the servers of the service.
+ * The value of the master is used if there is one.
+ *
+ * @param session The session
+ * @param index   Index of the variable
+ * @param global  The global value was asked for
+ * @param value   Where the value is stored, PROBE_MAX_VALUE + 1 bytes
+ * @return True if the value is known
+ */
+static bool probe_variable(SESSION *session, int index, bool global, char *value)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)session->client_dcb->protocol;
+    bool session_value = !global && server_variable_is_session(index);
+
+    if (session_value && proto->probe_vars_changed)
+    {
+        return false;
+    }
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (SERVER_REF *ref = session->service->dbref; ref; ref = ref->next)
+        {
+            SERVER *server = ref->server;
+            char init_connect[2];
+
+            if (!SERVER_IS_RUNNING(server) || (pass == 0 && !SERVER_IS_MASTER(server)))
+            {
+                continue;
+            }
+
+            /** The session values differ from the global ones if init_connect sets them */
+            if (session_value &&
+                (!server_get_variable(server, SERVER_VARIABLE_INIT_CONNECT,
+                                      init_connect, sizeof(init_connect)) || *init_connect))
+            {
+                continue;
+            }
+
+            if (server_get_variable(server, index, value, PROBE_MAX_VALUE + 1))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Answer SELECT @@variable [LIMIT 1], SELECT DATABASE() and
+ * SHOW [GLOBAL | SESSION] VARIABLES LIKE 'variable'
+ *
+ * @param session The session
+ * @param ptr     The SQL after SELECT or SHOW
+ * @param end     End of the SQL
+ * @param show    The statement is SHOW
+ * @return True if the query was answered
+ */
+static bool probe_answer_select(SESSION *session, const char *ptr, const char *end, bool show)
+{
+    int probes = session->service->local_probes;
+    MySQLProtocol *proto = (MySQLProtocol *)session->client_dcb->protocol;
+    char name[MYSQL_DATABASE_MAXLEN + 1];
+    char value[PROBE_MAX_VALUE + 1];
+    const char *val = value;
+    bool global = false;
+    int index;
+
+    if (show)
+    {
+        if (probe_is_word(ptr, end, "GLOBAL") || probe_is_word(ptr, end, "SESSION"))
+        {
+            global = probe_is_word(ptr, end, "GLOBAL");
+            ptr = probe_skip_space(probe_name_end(ptr, end), end);
+        }
+
+        if (!probe_is_word(ptr, end, "VARIABLES"))
+        {
+            return false;
+        }
+
+        ptr = probe_skip_space(ptr + 9, end);
+
+        if (!probe_is_word(ptr, end, "LIKE"))
+        {
+            return false;
+        }
+
+        ptr = probe_skip_space(ptr + 4, end);
+
+        if (ptr >= end || (*ptr != '\'' && *ptr != '"'))
+        {
+            return false;
+        }
+
+        /** Only patterns that match a single variable are answered */
+        char quote = *ptr++;
+        size_t len = 0;
+
+        while (ptr < end && *ptr != quote && *ptr != '%' && len < sizeof(name) - 1)
+        {
+            if (*ptr == '\\' && ptr + 1 < end)
+            {
+                ptr++;
+            }
+            name[len++] = *ptr++;
+        }
+
+        name[len] = '\0';
+
+        if (ptr >= end || *ptr != quote || probe_skip_space(ptr + 1, end) != end ||
+            !(probes & SERVICE_PROBE_VARIABLES) ||
+            (index = server_variable_index(name, len)) < 0 ||
+            !probe_variable(session, index, global, value))
+        {
+            return false;
+        }
+
+        char *names[] = {"Variable_name", "Value"};
+        const char *values[] = {server_variable_name(index), value};
+        return probe_send(session->client_dcb, names, values, 2);
+    }
+
+    const char *expr = ptr;
+
+    if (probe_is_word(ptr, end, "DATABASE"))
+    {
+        ptr = probe_skip_space(ptr + 8, end);
+
+        if (ptr >= end || *ptr != '(')
+        {
+            return false;
+        }
+
+        ptr = probe_skip_space(ptr + 1, end);
+
+        if (ptr >= end || *ptr != ')' || probe_skip_space(ptr + 1, end) != end ||
+            !(probes & SERVICE_PROBE_DATABASE) || proto->probe_db_changed)
+        {
+            return false;
+        }
+
+        const char *db = ((MYSQL_session *)session->client_dcb->data)->db;
+        strcpy(name, "DATABASE()");
+        val = *db ? db : NULL;
+    }
+    else if (end - ptr > 2 && ptr[0] == '@' && ptr[1] == '@')
+    {
+        ptr += 2;
+
+        if (probe_is_word(ptr, end, "GLOBAL") || probe_is_word(ptr, end, "SESSION") ||
+            probe_is_word(ptr, end, "LOCAL"))
+        {
+            global = probe_is_word(ptr, end, "GLOBAL");
+            ptr = probe_name_end(ptr, end);
+
+            if (ptr >= end || *ptr != '.')
+            {
+                return false;
+            }
+            ptr++;
+        }
+
+        const char *var = ptr;
+        ptr = probe_name_end(ptr, end);
+
+        /** The column is named by the expression as it was written */
+        size_t len = ptr - expr;
+
+        if (len >= sizeof(name) || !(probes & SERVICE_PROBE_VARIABLES) ||
+            (index = server_variable_index(var, ptr - var)) < 0)
+        {
+            return false;
+        }
+
+        memcpy(name, expr, len);
+        name[len] = '\0';
+        ptr = probe_skip_space(ptr, end);
+
+        if (probe_is_word(ptr, end, "LIMIT"))
+        {
+            ptr = probe_skip_space(ptr + 5, end);
+
+            if (!probe_is_word(ptr, end, "1"))
+            {
+                return false;
+            }
+
+            ptr = probe_skip_space(ptr + 1, end);
+        }
+
+        if (ptr != end || !probe_variable(session, index, global, value))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    char *names[] = {name};
+    const char *values[] = {val};
+    return probe_send(session->client_dcb, names, values, 1);
+}
+
+/**
+ * Answer SET NAMES that sets the character set the session already uses
+ *
+ * @param session The session
+ * @param ptr     The SQL after SET NAMES
+ * @param end     End of the SQL
+ * @return True if the statement was answered
+ */
+static bool probe_answer_set_names(SESSION *session, const char *ptr, const char *end)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)session->client_dcb->protocol;
+    char quote = ptr < end && (*ptr == '\'' || *ptr == '"' || *ptr == '`') ? *ptr++ : 0;
+    const char *name = ptr;
+
+    ptr = probe_name_end(ptr, end);
+    size_t len = ptr - name;
+
+    if (quote)
+    {
+        if (ptr >= end || *ptr != quote)
+        {
+            return false;
+        }
+        ptr++;
+    }
+
+    if (!(session->service->local_probes & SERVICE_PROBE_SET_NAMES) ||
+        proto->probe_vars_changed || probe_skip_space(ptr, end) != end)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(probe_charsets) / sizeof(probe_charsets[0]); i++)
+    {
+        if (probe_charsets[i].id == proto->charset)
+        {
+            return strlen(probe_charsets[i].name) == len &&
+                   strncasecmp(probe_charsets[i].name, name, len) == 0 &&
+                   mysql_send_ok(session->client_dcb, 1, 0, NULL) > 0;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Answer a probe query of a connector without routing it
+ *
+ * The connectors query the version, the session variables and the current
+ * database, and set the character set they already connected with, when
+ * they connect. The queries that the service is configured to answer
+ * locally are answered from the global variables the monitor has read from
+ * the servers and from the state of the session.
+ *
+ * The session variables and the database are assumed to be unchanged until
+ * the client executes a statement that may change them. After that, the
+ * queries that need them are routed normally. A query that arrives with
+ * other data is routed to keep the order of the replies.
+ *
+ * @param session The session
+ * @param query   The query, freed if it was answered
+ * @param more    More data follows the query
+ * @return True if the query was answered
+ */
+static bool probe_answer(SESSION *session, GWBUF *query, bool more)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)session->client_dcb->protocol;
+    uint8_t *data = GWBUF_DATA(query);
+    char *sql;
+    int sql_len;
+
+    if (session->service->local_probes == 0 || GWBUF_LENGTH(query) <= MYSQL_HEADER_LEN)
+    {
+        return false;
+    }
+
+    switch (MYSQL_GET_COMMAND(data))
+    {
+    case MYSQL_COM_INIT_DB:
+        proto->probe_db_changed = true;
+        return false;
+
+    case MYSQL_COM_CHANGE_USER:
+        proto->probe_db_changed = true;
+        proto->probe_vars_changed = true;
+        return false;
+
+    case MYSQL_COM_QUERY:
+    case MYSQL_COM_STMT_PREPARE:
+        break;
+
+    default:
+        return false;
+    }
+
+    /** The packet was copied into a contiguous buffer */
+    sql = (char *)data + MYSQL_HEADER_LEN + 1;
+    sql_len = GWBUF_LENGTH(query) - MYSQL_HEADER_LEN - 1;
+
+    const char *end = sql + sql_len;
+    const char *ptr = probe_skip_space(sql, end);
+
+    while (end > ptr && (isspace((unsigned char)end[-1]) || end[-1] == ';'))
+    {
+        end--;
+    }
+
+    bool answered = false;
+
+    if (memchr(ptr, ';', end - ptr) || (end - ptr >= 3 && strncmp(ptr, "/*!", 3) == 0))
+    {
+        /** Multiple statements or an executable comment, the effects are not known */
+        proto->probe_db_changed = true;
+        proto->probe_vars_changed = true;
+    }
+    else if (probe_is_word(ptr, end, "USE"))
+    {
+        proto->probe_db_changed = true;
+    }
+    else if (probe_is_word(ptr, end, "SET"))
+    {
+        const char *names = probe_skip_space(ptr + 3, end);
+
+        if (MYSQL_GET_COMMAND(data) == MYSQL_COM_QUERY && !more &&
+            session->gov_queued == NULL && probe_is_word(names, end, "NAMES"))
+        {
+            answered = probe_answer_set_names(session, probe_skip_space(names + 5, end), end);
+        }
+
+        if (!answered)
+        {
+            proto->probe_vars_changed = true;
+        }
+    }
+    else if (probe_is_word(ptr, end, "CALL") || probe_is_word(ptr, end, "PREPARE") ||
+             probe_is_word(ptr, end, "EXECUTE"))
+    {
+        proto->probe_vars_changed = true;
+    }
+    else if (MYSQL_GET_COMMAND(data) == MYSQL_COM_QUERY && !more &&
+             session->gov_queued == NULL &&
+             (probe_is_word(ptr, end, "SELECT") || probe_is_word(ptr, end, "SHOW")))
+    {
+        bool show = probe_is_word(ptr, end, "SHOW");
+        answered = probe_answer_select(session, probe_skip_space(ptr + (show ? 4 : 6), end),
+                                       end, show);
+    }
+
+    if (answered)
+    {
+        atomic_add(&session->service->stats.n_probes, 1);
+        gwbuf_free(query);
+    }
+
+    return answered;
+}
+
 /**
  * if read queue existed appent read to it. if length of read buffer is less
  * than 3 or less than mysql packet then return.  else copy mysql packets to
@@ -39,6 +39,9 @@
  * 07/07/2015   Martin Brampton         Fix problem recognising null password
  * 07/02/2016   Martin Brampton         Remove authentication functions to mysql_auth.c
  * 31/05/2016   Martin Brampton         Add mysql_create_standard_error function
+ * 14/10/2016   MariaDB Corporation     Add the compressed protocol framing
+ * 14/10/2016   MariaDB Corporation     Add the reply tracker
+ * 14/10/2016   MariaDB Corporation     Add the streaming compression of client data
  *
  */
 
@@ -47,8 +50,11 @@
 #include "mysql_client_server_protocol.h"
 #include <skygw_types.h>
 #include <skygw_utils.h>
+#include <mysql_utils.h>
 #include <log_manager.h>
 #include <netinet/tcp.h>
+#include <zlib.h>
+#include <platform.h>
 
 static server_command_t* server_command_init(server_command_t* srvcmd, mysql_server_cmd_t cmd);
 
@@ -90,6 +96,7 @@ MySQLProtocol* mysql_protocol_init(DCB* dcb, int fd)
     p->protocol_command.scom_cmd = MYSQL_COM_UNDEFINED;
     p->protocol_command.scom_nresponse_packets = 0;
     p->protocol_command.scom_nbytes_to_read = 0;
+    p->reply.status = SERVER_STATUS_AUTOCOMMIT;
 #if defined(SS_DEBUG)
     p->protocol_chk_top = CHK_NUM_PROTOCOL;
     p->protocol_chk_tail = CHK_NUM_PROTOCOL;
@@ -133,12 +140,728 @@ void mysql_protocol_done(DCB* dcb)
         free(scmd);
         scmd = scmd2;
     }
+    gwbuf_free(p->compress_readq);
+    p->compress_readq = NULL;
     p->protocol_state = MYSQL_PROTOCOL_DONE;
 
 retblock:
     spinlock_release(&p->protocol_lock);
 }
 
+/**
+ * Create one packet of the compressed protocol
+ *
+ * The payload is compressed only if it is long enough and compressing it
+ * makes it smaller. Otherwise it is stored as is and the uncompressed length
+ * in the header is set to zero.
+ *
+ * @param seq  Sequence number of the compressed packet
+ * @param data Payload of the packet
+ * @param len  Length of the payload, at most MYSQL_COMPRESSED_MAX_PAYLOAD bytes
+ * @return The compressed packet or NULL on memory allocation failure
+ */
+static GWBUF* mysql_create_compressed_packet(uint8_t seq, uint8_t* data, size_t len)
+{
+    uLongf complen = 0;
+    GWBUF* buf = NULL;
+
+    if (len >= MYSQL_COMPRESS_MIN_LEN)
+    {
+        uLongf bound = compressBound(len);
+
+        if ((buf = gwbuf_alloc(MYSQL_COMPRESSED_HEADER_LEN + bound)) == NULL)
+        {
+            return NULL;
+        }
+
+        complen = bound;
+
+        if (compress(GWBUF_DATA(buf) + MYSQL_COMPRESSED_HEADER_LEN, &complen, data, len) != Z_OK ||
+            complen >= len)
+        {
+            /** Not worth it, send the payload uncompressed */
+            gwbuf_free(buf);
+            buf = NULL;
+            complen = 0;
+        }
+    }
+
+    uint8_t* ptr;
+
+    if (buf)
+    {
+        buf = gwbuf_rtrim(buf, GWBUF_LENGTH(buf) - MYSQL_COMPRESSED_HEADER_LEN - complen);
+        ptr = GWBUF_DATA(buf);
+        gw_mysql_set_byte3(ptr, complen);
+        gw_mysql_set_byte3(ptr + 4, len);
+    }
+    else
+    {
+        if ((buf = gwbuf_alloc(MYSQL_COMPRESSED_HEADER_LEN + len)) == NULL)
+        {
+            return NULL;
+        }
+        ptr = GWBUF_DATA(buf);
+        memcpy(ptr + MYSQL_COMPRESSED_HEADER_LEN, data, len);
+        gw_mysql_set_byte3(ptr, len);
+        gw_mysql_set_byte3(ptr + 4, 0);
+    }
+
+    ptr[3] = seq;
+    return buf;
+}
+
+/**
+ * Convert MySQL packets to the compressed protocol
+ *
+ * Each packet is sent in compressed packets of its own. The sequence of the
+ * compressed packets starts from zero when a packet with sequence number zero,
+ * i.e. a new command, is written. Otherwise it continues from the last packet
+ * that was read or written.
+ *
+ * @param p     Protocol of the connection
+ * @param queue The MySQL packets, freed by this function
+ * @return The compressed packets or NULL on memory allocation failure
+ */
+GWBUF* mysql_compress_packets(MySQLProtocol* p, GWBUF* queue)
+{
+    GWBUF* rval = NULL;
+    GWBUF* buf = gwbuf_make_contiguous(queue);
+
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+
+    uint8_t* data = GWBUF_DATA(buf);
+    size_t len = GWBUF_LENGTH(buf);
+    size_t packet_left = 0;
+
+    while (len > 0)
+    {
+        if (packet_left == 0)
+        {
+            if (len >= MYSQL_HEADER_LEN)
+            {
+                packet_left = MYSQL_GET_PACKET_LEN(data) + MYSQL_HEADER_LEN;
+
+                if (MYSQL_GET_PACKET_NO(data) == 0)
+                {
+                    p->compress_seq = 0;
+                }
+            }
+            else
+            {
+                packet_left = len;
+            }
+        }
+
+        size_t chunk = MIN(MIN(packet_left, len), MYSQL_COMPRESSED_MAX_PAYLOAD);
+        GWBUF* packet = mysql_create_compressed_packet(p->compress_seq++, data, chunk);
+
+        if (packet == NULL)
+        {
+            gwbuf_free(rval);
+            rval = NULL;
+            break;
+        }
+
+        rval = gwbuf_append(rval, packet);
+        data += chunk;
+        len -= chunk;
+        packet_left -= chunk;
+    }
+
+    gwbuf_free(buf);
+    return rval;
+}
+
+/** The deflate stream of the thread, reset for each compressed packet */
+static thread_local z_stream* this_deflate = NULL;
+static thread_local int this_deflate_level = 0;
+
+/**
+ * Get the deflate stream of the calling thread
+ *
+ * The stream is allocated once per thread and compression level, so that
+ * compressing a packet only resets the state of the stream.
+ *
+ * @param level The zlib compression level
+ * @return The stream or NULL on failure
+ */
+static z_stream* mysql_thread_deflate(int level)
+{
+    if (this_deflate && this_deflate_level != level)
+    {
+        deflateEnd(this_deflate);
+        free(this_deflate);
+        this_deflate = NULL;
+    }
+
+    if (this_deflate == NULL)
+    {
+        z_stream* strm = calloc(1, sizeof(z_stream));
+
+        if (strm == NULL || deflateInit(strm, level) != Z_OK)
+        {
+            free(strm);
+            return NULL;
+        }
+
+        this_deflate = strm;
+        this_deflate_level = level;
+    }
+    else if (deflateReset(this_deflate) != Z_OK)
+    {
+        return NULL;
+    }
+
+    return this_deflate;
+}
+
+/**
+ * Deflate data from a chain of buffers into one block
+ *
+ * @param strm   The deflate stream, reset
+ * @param buf    The buffer where the data starts
+ * @param offset The offset in the buffer
+ * @param len    The amount of data
+ * @param out    Where the compressed data is stored
+ * @param outlen Size of out, set to the length of the compressed data
+ * @return True if all the data was compressed into out
+ */
+static bool mysql_deflate_chain(z_stream* strm, GWBUF* buf, size_t offset, size_t len,
+                                uint8_t* out, size_t* outlen)
+{
+    int zrc = Z_OK;
+
+    strm->next_out = out;
+    strm->avail_out = *outlen;
+
+    while (len > 0 && zrc == Z_OK)
+    {
+        size_t n = MIN(len, GWBUF_LENGTH(buf) - offset);
+
+        if (n > 0)
+        {
+            strm->next_in = (Bytef*)GWBUF_DATA(buf) + offset;
+            strm->avail_in = n;
+            len -= n;
+            zrc = deflate(strm, len ? Z_NO_FLUSH : Z_FINISH);
+        }
+
+        buf = buf->next;
+        offset = 0;
+    }
+
+    *outlen -= strm->avail_out;
+    return zrc == Z_STREAM_END;
+}
+
+/**
+ * Convert a stream of MySQL packets to the compressed protocol
+ *
+ * Unlike mysql_compress_packets(), the packets are not split at their
+ * boundaries: each compressed packet holds as much of the stream as fits in
+ * it, so the many small packets of a result set are compressed together. The
+ * data is read directly from the buffer chain and the deflate stream of the
+ * thread is reused, so no large allocations are made for each packet. The
+ * sequence of the compressed packets continues from the last packet that was
+ * read or written.
+ *
+ * @param p     Protocol of the connection
+ * @param queue The MySQL packets, freed by this function
+ * @param level The zlib compression level
+ * @return The compressed packets or NULL on memory allocation failure
+ */
+GWBUF* mysql_compress_stream(MySQLProtocol* p, GWBUF* queue, int level)
+{
+    GWBUF* rval = NULL;
+    GWBUF* buf = queue;
+    size_t offset = 0;
+    size_t total = gwbuf_length(queue);
+
+    while (total > 0)
+    {
+        /** Skip the buffers that were consumed by the previous packet */
+        while (offset == GWBUF_LENGTH(buf))
+        {
+            buf = buf->next;
+            offset = 0;
+        }
+
+        size_t chunk = MIN(total, MYSQL_COMPRESSED_MAX_PAYLOAD);
+        z_stream* strm = chunk >= MYSQL_COMPRESS_MIN_LEN ? mysql_thread_deflate(level) : NULL;
+        GWBUF* packet = NULL;
+        size_t complen = 0;
+
+        if (strm)
+        {
+            complen = deflateBound(strm, chunk);
+
+            if ((packet = gwbuf_alloc(MYSQL_COMPRESSED_HEADER_LEN + complen)) != NULL &&
+                (!mysql_deflate_chain(strm, buf, offset, chunk,
+                                      (uint8_t*)GWBUF_DATA(packet) + MYSQL_COMPRESSED_HEADER_LEN,
+                                      &complen) ||
+                 complen >= chunk))
+            {
+                /** Not worth it, send the payload uncompressed */
+                gwbuf_free(packet);
+                packet = NULL;
+            }
+        }
+
+        uint8_t* header;
+
+        if (packet)
+        {
+            packet = gwbuf_rtrim(packet, GWBUF_LENGTH(packet) - MYSQL_COMPRESSED_HEADER_LEN - complen);
+            header = GWBUF_DATA(packet);
+            gw_mysql_set_byte3(header, complen);
+            gw_mysql_set_byte3(header + 4, chunk);
+        }
+        else if ((packet = gwbuf_alloc(MYSQL_COMPRESSED_HEADER_LEN + chunk)) != NULL)
+        {
+            header = GWBUF_DATA(packet);
+            uint8_t* ptr = header + MYSQL_COMPRESSED_HEADER_LEN;
+            GWBUF* b = buf;
+            size_t off = offset;
+
+            for (size_t left = chunk; left > 0; b = b->next, off = 0)
+            {
+                size_t n = MIN(left, GWBUF_LENGTH(b) - off);
+                memcpy(ptr, (uint8_t*)GWBUF_DATA(b) + off, n);
+                ptr += n;
+                left -= n;
+            }
+
+            gw_mysql_set_byte3(header, chunk);
+            gw_mysql_set_byte3(header + 4, 0);
+        }
+        else
+        {
+            gwbuf_free(rval);
+            rval = NULL;
+            break;
+        }
+
+        header[3] = p->compress_seq++;
+        rval = gwbuf_append(rval, packet);
+        total -= chunk;
+
+        /** Advance to the end of the chunk */
+        for (size_t left = chunk; left > 0;)
+        {
+            size_t n = MIN(left, GWBUF_LENGTH(buf) - offset);
+            left -= n;
+            offset += n;
+
+            if (left > 0)
+            {
+                buf = buf->next;
+                offset = 0;
+            }
+        }
+    }
+
+    gwbuf_free(queue);
+    return rval;
+}
+
+/**
+ * Convert compressed packets back to MySQL packets
+ *
+ * A compressed packet that has not been read completely is stored in the
+ * protocol and processed once the rest of it is read.
+ *
+ * @param p      Protocol of the connection
+ * @param queue  Data read from the network, freed by this function
+ * @param output The MySQL packets in the complete compressed packets are
+ *               appended to this buffer
+ * @return False if the data is not valid compressed protocol, true otherwise
+ */
+bool mysql_decompress_packets(MySQLProtocol* p, GWBUF* queue, GWBUF** output)
+{
+    uint8_t header[MYSQL_COMPRESSED_HEADER_LEN];
+    bool rval = true;
+
+    p->compress_readq = gwbuf_append(p->compress_readq, queue);
+
+    while (rval && gwbuf_copy_data(p->compress_readq, 0, MYSQL_COMPRESSED_HEADER_LEN,
+                                   header) == MYSQL_COMPRESSED_HEADER_LEN)
+    {
+        size_t complen = gw_mysql_get_byte3(header);
+        size_t len = gw_mysql_get_byte3(header + 4);
+
+        if (gwbuf_length(p->compress_readq) < MYSQL_COMPRESSED_HEADER_LEN + complen)
+        {
+            break;
+        }
+
+        p->compress_readq = gwbuf_consume(p->compress_readq, MYSQL_COMPRESSED_HEADER_LEN);
+        GWBUF* packet = complen ? gwbuf_split(&p->compress_readq, complen) : NULL;
+        p->compress_seq = header[3] + 1;
+
+        if (packet && len)
+        {
+            GWBUF* plain = gwbuf_alloc(len);
+            uLongf plainlen = len;
+
+            if ((packet = gwbuf_make_contiguous(packet)) == NULL || plain == NULL ||
+                uncompress(GWBUF_DATA(plain), &plainlen, GWBUF_DATA(packet), complen) != Z_OK ||
+                plainlen != len)
+            {
+                MXS_ERROR("Failed to decompress a packet of the compressed protocol "
+                          "read from '%s'.", p->owner_dcb->remote ?
+                          p->owner_dcb->remote : "<unknown>");
+                gwbuf_free(plain);
+                plain = NULL;
+                rval = false;
+            }
+            gwbuf_free(packet);
+            packet = plain;
+        }
+
+        if (packet)
+        {
+            *output = gwbuf_append(*output, packet);
+        }
+    }
+
+    return rval;
+}
+
+/**
+ * Feed data to a packet stream. The function is called for each packet whose
+ * start has been gathered: the header and up to peek bytes of the packet, or
+ * all of it if it is shorter.
+ *
+ * @param p      The protocol
+ * @param s      The packet stream
+ * @param buffer The data
+ * @param offset Bytes at the start of the buffer that the stream has already seen
+ * @param peek   How many bytes of a packet to gather
+ * @param fn     Function called with the protocol, the start of a packet, the
+ *               number of bytes gathered and the length of the packet
+ */
+static void mysql_packet_stream(MySQLProtocol* p, MYSQL_PACKET_STREAM* s, GWBUF* buffer,
+                                size_t offset, size_t peek,
+                                void (*fn)(MySQLProtocol*, uint8_t*, size_t, uint32_t))
+{
+    for (; buffer; buffer = buffer->next)
+    {
+        size_t len = GWBUF_LENGTH(buffer);
+        uint8_t* ptr = GWBUF_DATA(buffer);
+
+        if (offset >= len)
+        {
+            offset -= len;
+            continue;
+        }
+
+        ptr += offset;
+        len -= offset;
+        offset = 0;
+
+        while (len > 0)
+        {
+            if (s->left > 0)
+            {
+                size_t n = MIN(s->left, len);
+                s->left -= n;
+                s->position += n;
+                ptr += n;
+                len -= n;
+                continue;
+            }
+
+            size_t need = MYSQL_HEADER_LEN;
+
+            if (s->head_len >= MYSQL_HEADER_LEN)
+            {
+                need = MIN(peek, MYSQL_HEADER_LEN + gw_mysql_get_byte3(s->head));
+            }
+
+            size_t n = MIN(need - s->head_len, len);
+            memcpy(s->head + s->head_len, ptr, n);
+            s->head_len += n;
+            s->position += n;
+            ptr += n;
+            len -= n;
+
+            if (s->head_len == MYSQL_HEADER_LEN)
+            {
+                need = MIN(peek, MYSQL_HEADER_LEN + gw_mysql_get_byte3(s->head));
+            }
+
+            if (s->head_len == need)
+            {
+                uint32_t packet_len = MYSQL_HEADER_LEN + gw_mysql_get_byte3(s->head);
+                s->left = packet_len - s->head_len;
+                s->head_len = 0;
+                fn(p, s->head, need, packet_len);
+            }
+        }
+    }
+}
+
+/**
+ * Record the command of a packet written to the server
+ */
+static void mysql_reply_command(MySQLProtocol* p, uint8_t* head, size_t len, uint32_t packet_len)
+{
+    MYSQL_REPLY_TRACKER* t = &p->reply;
+
+    /** Only the first packet of a command has the sequence number 0 */
+    if (len > MYSQL_HEADER_LEN && head[3] == 0)
+    {
+        uint8_t cmd = head[MYSQL_HEADER_LEN];
+
+        if (cmd != MYSQL_COM_QUIT && cmd != MYSQL_COM_STMT_SEND_LONG_DATA &&
+            cmd != MYSQL_COM_STMT_CLOSE && t->n_pending < MYSQL_REPLY_MAX_PENDING)
+        {
+            t->pending[(t->first_pending + t->n_pending) % MYSQL_REPLY_MAX_PENDING] = cmd;
+            t->n_pending++;
+        }
+    }
+}
+
+/**
+ * End a result of a reply. The reply is complete unless the server status
+ * tells that more results follow.
+ *
+ * @param t      The reply tracker
+ * @param status The server status or -1 if the packet had none
+ * @param error  Whether the result was an error
+ */
+static void mysql_reply_done(MYSQL_REPLY_TRACKER* t, int status, bool error)
+{
+    uint8_t cmd = t->n_pending > 0 ? t->pending[t->first_pending] : MYSQL_COM_QUERY;
+
+    t->state = MYSQL_REPLY_START;
+    t->error = error;
+    t->more_results = false;
+
+    if (status != -1)
+    {
+        t->status = status;
+
+        if (status & SERVER_MORE_RESULTS_EXIST)
+        {
+            t->more_results = true;
+            return;
+        }
+    }
+
+    if (t->n_pending > 0)
+    {
+        t->first_pending = (t->first_pending + 1) % MYSQL_REPLY_MAX_PENDING;
+        t->n_pending--;
+    }
+
+    if (t->n_discard > 0)
+    {
+        /** The connection is left as the old user if the reset failed */
+        if (error && (cmd == MYSQL_COM_CHANGE_USER || cmd == MYSQL_COM_RESET_CONNECTION))
+        {
+            t->reset_failed = true;
+        }
+        t->n_discard--;
+    }
+    else
+    {
+        t->n_replies++;
+    }
+}
+
+/**
+ * Follow a packet read from the server
+ */
+static void mysql_reply_packet(MySQLProtocol* p, uint8_t* head, size_t len, uint32_t packet_len)
+{
+    MYSQL_REPLY_TRACKER* t = &p->reply;
+    uint8_t* payload = head + MYSQL_HEADER_LEN;
+    size_t peek = len - MYSQL_HEADER_LEN;
+    uint32_t payload_len = packet_len - MYSQL_HEADER_LEN;
+    uint8_t cmd = t->n_pending > 0 ? t->pending[t->first_pending] : MYSQL_COM_QUERY;
+    bool is_eof = peek > 0 && payload[0] == 0xfe && payload_len < 9;
+    bool is_err = peek > 0 && payload[0] == 0xff;
+    int eof_status = peek >= 5 ? gw_mysql_get_byte2(payload + 3) : -1;
+
+    if (t->n_discard > 0)
+    {
+        /** The stream is at the end of the gathered start of the packet */
+        t->discard_end = t->in.position - len + packet_len;
+    }
+
+    switch (t->state)
+    {
+    case MYSQL_REPLY_START:
+        t->stmt_id = 0;
+
+        if (!t->more_results)
+        {
+            t->n_reply_rows = 0;
+        }
+
+        if (peek == 0 || is_err || cmd == MYSQL_COM_STATISTICS)
+        {
+            mysql_reply_done(t, -1, is_err);
+        }
+        else if (payload[0] == 0x00 && cmd == MYSQL_COM_STMT_PREPARE)
+        {
+            /** The parameter and column definitions follow, each with an EOF */
+            uint32_t n_columns = peek >= 7 ? gw_mysql_get_byte2(payload + 5) : 0;
+            uint32_t n_params = peek >= 9 ? gw_mysql_get_byte2(payload + 7) : 0;
+
+            t->stmt_id = peek >= 5 ? gw_mysql_get_byte4(payload + 1) : 0;
+            t->n_packets = n_params + (n_params ? 1 : 0) + n_columns + (n_columns ? 1 : 0);
+
+            if (t->n_packets > 0)
+            {
+                t->state = MYSQL_REPLY_PACKETS;
+            }
+            else
+            {
+                mysql_reply_done(t, -1, false);
+            }
+        }
+        else if (payload[0] == 0x00 && cmd != MYSQL_COM_STMT_FETCH)
+        {
+            /** The affected rows and the last insert ID precede the status */
+            size_t pos = 1;
+            int status = -1;
+
+            pos += leint_bytes(payload + pos);
+
+            if (pos < peek)
+            {
+                pos += leint_bytes(payload + pos);
+            }
+
+            if (pos + 2 <= peek)
+            {
+                status = gw_mysql_get_byte2(payload + pos);
+            }
+
+            mysql_reply_done(t, status, false);
+        }
+        else if (is_eof)
+        {
+            mysql_reply_done(t, eof_status, false);
+        }
+        else if (payload[0] == 0xfb)
+        {
+            /** LOCAL INFILE, the reply follows the contents of the file */
+        }
+        else if (cmd == MYSQL_COM_STMT_FETCH)
+        {
+            t->n_rows = 1;
+            t->n_reply_rows++;
+            t->state = MYSQL_REPLY_ROWS;
+        }
+        else if (cmd == MYSQL_COM_FIELD_LIST)
+        {
+            t->n_columns = 1;
+            t->state = MYSQL_REPLY_FIELDS;
+        }
+        else if (cmd == MYSQL_COM_QUERY || cmd == MYSQL_COM_STMT_EXECUTE)
+        {
+            t->n_columns = leint_value(payload);
+            t->n_rows = 0;
+            t->state = MYSQL_REPLY_FIELDS;
+        }
+        else
+        {
+            /** An authentication switch or some other single packet */
+            mysql_reply_done(t, -1, false);
+        }
+        break;
+
+    case MYSQL_REPLY_FIELDS:
+        if (is_eof)
+        {
+            if (cmd == MYSQL_COM_FIELD_LIST || (eof_status != -1 &&
+                                                (eof_status & SERVER_STATUS_CURSOR_EXISTS)))
+            {
+                /** The column definitions are the whole reply */
+                mysql_reply_done(t, eof_status, false);
+            }
+            else
+            {
+                t->state = MYSQL_REPLY_ROWS;
+            }
+        }
+        else if (is_err)
+        {
+            mysql_reply_done(t, -1, true);
+        }
+        else if (cmd == MYSQL_COM_FIELD_LIST)
+        {
+            t->n_columns++;
+        }
+        break;
+
+    case MYSQL_REPLY_ROWS:
+        if (is_eof)
+        {
+            mysql_reply_done(t, eof_status, false);
+        }
+        else if (is_err)
+        {
+            mysql_reply_done(t, -1, true);
+        }
+        else
+        {
+            t->n_rows++;
+            t->n_reply_rows++;
+        }
+        break;
+
+    case MYSQL_REPLY_PACKETS:
+        if (--t->n_packets == 0)
+        {
+            mysql_reply_done(t, -1, false);
+        }
+        break;
+    }
+}
+
+/**
+ * @brief Follow the commands written to the server
+ *
+ * The commands are remembered so that their replies can be followed. The
+ * data may contain partial packets.
+ *
+ * @param p     The protocol of a backend connection
+ * @param queue The data written to the server, before compression
+ */
+void mysql_reply_track_commands(MySQLProtocol* p, GWBUF* queue)
+{
+    mysql_packet_stream(p, &p->reply.out, queue, 0, MYSQL_HEADER_LEN + 1, mysql_reply_command);
+}
+
+/**
+ * @brief Follow the replies read from the server
+ *
+ * Each packet is looked at once, so the data may contain partial packets and
+ * the bytes that were already seen are skipped.
+ *
+ * @param p      The protocol of a backend connection
+ * @param queue  The data read from the server, after decompression
+ * @param offset Bytes at the start of queue that have already been followed
+ * @return Bytes at the start of queue that belong to discarded replies
+ */
+size_t mysql_reply_track_replies(MySQLProtocol* p, GWBUF* queue, size_t offset)
+{
+    MYSQL_REPLY_TRACKER* t = &p->reply;
+    uint64_t start = t->in.position - offset;
+
+    mysql_packet_stream(p, &t->in, queue, offset, MYSQL_REPLY_PEEK, mysql_reply_packet);
+
+    return t->discard_end > start ? MIN(t->discard_end, t->in.position) - start : 0;
+}
+
 /**
  * Return a string representation of a MySQL protocol state.
  *
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testmysqlcompress.c - Tests of the MySQL compressed protocol
+ *
+ * Streams of MySQL packets are compressed with mysql_compress_stream() and
+ * converted back with mysql_decompress_packets().
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 14/10/2016   MariaDB Corporation     Initial implementation
+ *
+ * @endverbatim
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <buffer.h>
+#include <dcb.h>
+#include <skygw_debug.h>
+#include <mysql_client_server_protocol.h>
+
+/** Size of a payload that does not fit in one packet */
+#define LARGE_LEN (MYSQL_COMPRESSED_MAX_PAYLOAD + 1000000)
+
+static DCB dcb;
+
+/**
+ * Initialize the protocol of a connection
+ */
+static void
+init_protocol(MySQLProtocol *proto)
+{
+    memset(proto, 0, sizeof(*proto));
+    proto->owner_dcb = &dcb;
+}
+
+/**
+ * Fill data with bytes that compress well, or that do not compress at all
+ */
+static void
+fill(uint8_t *data, size_t len, bool compressible)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        data[i] = compressible ? "SELECT * FROM t1 WHERE id = "[i % 28] : random();
+    }
+}
+
+/**
+ * Allocate a chain of MySQL packets with a payload of len bytes each
+ *
+ * @param data Where the bytes of the packets are stored, must fit them all
+ */
+static GWBUF *
+alloc_packets(int n_packets, size_t len, bool compressible, uint8_t *data)
+{
+    GWBUF *queue = NULL;
+
+    for (int i = 0; i < n_packets; i++)
+    {
+        GWBUF *buf = gwbuf_alloc(MYSQL_HEADER_LEN + len);
+        uint8_t *ptr = GWBUF_DATA(buf);
+
+        gw_mysql_set_byte3(ptr, len);
+        ptr[3] = i;
+        fill(ptr + MYSQL_HEADER_LEN, len, compressible);
+        memcpy(data, ptr, MYSQL_HEADER_LEN + len);
+        data += MYSQL_HEADER_LEN + len;
+        queue = gwbuf_append(queue, buf);
+    }
+
+    return queue;
+}
+
+/**
+ * Feed compressed packets to the decompression in pieces of step bytes
+ *
+ * @return The MySQL packets, NULL if the decompression failed
+ */
+static GWBUF *
+decompress(MySQLProtocol *proto, GWBUF *queue, size_t step)
+{
+    GWBUF *output = NULL;
+
+    while (queue)
+    {
+        GWBUF *part = gwbuf_split(&queue, MIN(step, gwbuf_length(queue)));
+
+        if (!mysql_decompress_packets(proto, part, &output))
+        {
+            gwbuf_free(queue);
+            gwbuf_free(output);
+            return NULL;
+        }
+    }
+
+    ss_info_dassert(proto->compress_readq == NULL, "No partial packet should be left");
+    return output;
+}
+
+/**
+ * Check that a compressed packet has the expected header
+ *
+ * @param packet  The start of the packet
+ * @param seq     The expected sequence number
+ * @param len     The expected length of the uncompressed payload
+ * @param deflate True if the payload should be compressed
+ * @return Length of the compressed packet with its header
+ */
+static size_t
+check_header(const uint8_t *packet, uint8_t seq, size_t len, bool deflate)
+{
+    size_t complen = gw_mysql_get_byte3(packet);
+    size_t plainlen = gw_mysql_get_byte3(packet + 4);
+
+    ss_info_dassert(packet[3] == seq, "The packets should be numbered in sequence");
+
+    if (deflate)
+    {
+        ss_info_dassert(plainlen == len && complen < len,
+                        "The payload should be compressed");
+    }
+    else
+    {
+        ss_info_dassert(plainlen == 0 && complen == len,
+                        "The payload should be sent uncompressed");
+    }
+
+    return MYSQL_COMPRESSED_HEADER_LEN + complen;
+}
+
+/**
+ * Check that the MySQL packets match the original bytes
+ */
+static void
+check_output(GWBUF *output, const uint8_t *data, size_t len)
+{
+    output = gwbuf_make_contiguous(output);
+    ss_info_dassert(output && gwbuf_length(output) == len &&
+                    memcmp(GWBUF_DATA(output), data, len) == 0,
+                    "The decompressed packets should match the original ones");
+    gwbuf_free(output);
+}
+
+/**
+ * test1    Payloads below the threshold and payloads that do not compress are
+ *          sent uncompressed
+ */
+static int
+test1()
+{
+    MySQLProtocol writer;
+    MySQLProtocol reader;
+    size_t small = MYSQL_COMPRESS_MIN_LEN - MYSQL_HEADER_LEN - 1;
+    uint8_t data[MYSQL_HEADER_LEN + 1000];
+
+    init_protocol(&writer);
+    init_protocol(&reader);
+
+    GWBUF *queue = mysql_compress_stream(&writer, alloc_packets(1, small, true, data), 6);
+    queue = gwbuf_make_contiguous(queue);
+    ss_info_dassert(queue, "Compressing should succeed");
+    ss_info_dassert(check_header(GWBUF_DATA(queue), 0, MYSQL_HEADER_LEN + small, false) ==
+                    gwbuf_length(queue), "One packet should be sent");
+    ss_info_dassert(memcmp(GWBUF_DATA(queue) + MYSQL_COMPRESSED_HEADER_LEN, data,
+                           MYSQL_HEADER_LEN + small) == 0,
+                    "The payload should be sent as it is");
+    check_output(decompress(&reader, queue, 3), data, MYSQL_HEADER_LEN + small);
+
+    queue = mysql_compress_stream(&writer, alloc_packets(1, 1000, false, data), 6);
+    queue = gwbuf_make_contiguous(queue);
+    ss_info_dassert(queue, "Compressing should succeed");
+    ss_info_dassert(check_header(GWBUF_DATA(queue), 1, MYSQL_HEADER_LEN + 1000, false) ==
+                    gwbuf_length(queue), "One packet should be sent");
+    check_output(decompress(&reader, queue, 100), data, MYSQL_HEADER_LEN + 1000);
+
+    ss_info_dassert(writer.compress_seq == 2 && reader.compress_seq == 2,
+                    "Both sides should expect the same sequence number");
+
+    return 0;
+}
+
+/**
+ * test2    Many small packets are compressed together
+ */
+static int
+test2()
+{
+    MySQLProtocol writer;
+    MySQLProtocol reader;
+    int n_packets = 200;
+    size_t len = MYSQL_HEADER_LEN + 20;
+    uint8_t data[n_packets * len];
+
+    init_protocol(&writer);
+    init_protocol(&reader);
+
+    GWBUF *queue = mysql_compress_stream(&writer, alloc_packets(n_packets, 20, true, data), 6);
+    queue = gwbuf_make_contiguous(queue);
+    ss_info_dassert(queue, "Compressing should succeed");
+    ss_info_dassert(check_header(GWBUF_DATA(queue), 0, n_packets * len, true) ==
+                    gwbuf_length(queue), "The packets should be sent in one compressed packet");
+    check_output(decompress(&reader, queue, 7), data, n_packets * len);
+
+    return 0;
+}
+
+/**
+ * test3    A payload larger than a packet is split into several packets
+ */
+static int
+test3()
+{
+    MySQLProtocol writer;
+    MySQLProtocol reader;
+    size_t len = LARGE_LEN;
+    uint8_t *data = malloc(len);
+
+    ss_info_dassert(data, "Memory allocation should succeed");
+    init_protocol(&writer);
+    init_protocol(&reader);
+
+    /** The MySQL packets can be as large as the compressed ones, one of them
+     * is split between the compressed packets */
+    size_t packet_len = (len - 2 * MYSQL_HEADER_LEN) / 2;
+    GWBUF *queue = alloc_packets(2, packet_len, true, data);
+    len = gwbuf_length(queue);
+
+    queue = mysql_compress_stream(&writer, queue, 1);
+    queue = gwbuf_make_contiguous(queue);
+    ss_info_dassert(queue, "Compressing should succeed");
+
+    uint8_t *ptr = GWBUF_DATA(queue);
+    ptr += check_header(ptr, 0, MYSQL_COMPRESSED_MAX_PAYLOAD, true);
+    ptr += check_header(ptr, 1, len - MYSQL_COMPRESSED_MAX_PAYLOAD, true);
+    ss_info_dassert(ptr == (uint8_t *)GWBUF_DATA(queue) + gwbuf_length(queue),
+                    "Two packets should be sent");
+
+    check_output(decompress(&reader, queue, 65536), data, len);
+    ss_info_dassert(writer.compress_seq == 2 && reader.compress_seq == 2,
+                    "Both sides should expect the same sequence number");
+
+    free(data);
+    return 0;
+}
+
+/**
+ * test4    The sequence continues from the last packet read and wraps around
+ */
+static int
+test4()
+{
+    MySQLProtocol writer;
+    MySQLProtocol reader;
+    uint8_t data[MYSQL_HEADER_LEN + 100];
+
+    init_protocol(&writer);
+    init_protocol(&reader);
+    writer.compress_seq = 254;
+
+    for (int i = 0; i < 3; i++)
+    {
+        GWBUF *queue = mysql_compress_stream(&writer, alloc_packets(1, 100, true, data), 6);
+        queue = gwbuf_make_contiguous(queue);
+        ss_info_dassert(queue, "Compressing should succeed");
+        check_header(GWBUF_DATA(queue), (uint8_t)(254 + i), MYSQL_HEADER_LEN + 100, true);
+        check_output(decompress(&reader, queue, 1), data, MYSQL_HEADER_LEN + 100);
+        ss_info_dassert(reader.compress_seq == (uint8_t)(255 + i),
+                        "The reader should expect the next sequence number");
+    }
+
+    /** The reply to a packet continues its sequence */
+    GWBUF *queue = mysql_compress_stream(&reader, alloc_packets(1, 100, true, data), 6);
+    ss_info_dassert(queue, "Compressing should succeed");
+    queue = gwbuf_make_contiguous(queue);
+    check_header(GWBUF_DATA(queue), 1, MYSQL_HEADER_LEN + 100, true);
+    gwbuf_free(queue);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+    result += test3();
+    result += test4();
+
+    exit(result);
+}
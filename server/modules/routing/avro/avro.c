@@ -28,6 +28,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <strings.h>
 #include <time.h>
 #include <service.h>
 #include <server.h>
@@ -50,7 +52,6 @@
 #include <avrorouter.h>
 #include <random_jkiss.h>
 #include <binlog_common.h>
-#include <avro/errors.h>
 
 #ifndef BINLOG_NAMEFMT
 #define BINLOG_NAMEFMT      "%s.%06d"
@@ -81,6 +82,7 @@ static void clientReply(ROUTER *instance, void *router_session, GWBUF *queue,
 static void errorReply(ROUTER *instance, void *router_session, GWBUF *message,
                        DCB *backend_dcb, error_action_t action, bool *succp);
 static int getCapabilities();
+static RESULTSET *getStatistics(ROUTER *instance);
 extern int MaxScaleUptime();
 extern void avro_get_used_tables(AVRO_INSTANCE *router, DCB *dcb);
 void converter_func(void* data);
@@ -91,6 +93,7 @@ void avro_load_metadata_from_schemas(AVRO_INSTANCE *router);
 int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata);
 static bool ensure_dir_ok(const char* path, int mode);
 bool avro_save_conversion_state(AVRO_INSTANCE *router);
+void notify_table_clients(AVRO_INSTANCE *router);
 static void stats_func(void *);
 void avro_index_file(AVRO_INSTANCE *router, const char* path);
 void avro_update_index(AVRO_INSTANCE* router);
@@ -106,7 +109,8 @@ static ROUTER_OBJECT MyObject =
     diagnostics,
     clientReply,
     errorReply,
-    getCapabilities
+    getCapabilities,
+    getStatistics
 };
 
 static SPINLOCK instlock;
@@ -187,6 +191,18 @@ bool create_tables(sqlite3* handle)
         return false;
     }
 
+    /** Allows the closest indexed GTID of a file to be found with an index lookup */
+    rc = sqlite3_exec(handle, "CREATE INDEX IF NOT EXISTS "GTID_INDEX_NAME" ON "
+                      GTID_TABLE_NAME"(avrofile, domain, server_id, sequence);",
+                      NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to create GTID index '"GTID_INDEX_NAME"': %s",
+                  sqlite3_errmsg(handle));
+        sqlite3_free(errmsg);
+        return false;
+    }
+
     rc = sqlite3_exec(handle, "CREATE TABLE IF NOT EXISTS "
                       USED_TABLES_TABLE_NAME"(domain int, server_id int, "
                       "sequence bigint, binlog_timestamp bigint, "
@@ -211,6 +227,23 @@ bool create_tables(sqlite3* handle)
         return false;
     }
 
+    /** The GTID range of each Avro file, looked up by the table and the first GTID */
+    rc = sqlite3_exec(handle, "CREATE TABLE IF NOT EXISTS "
+                      SEGMENT_TABLE_NAME"(filename varchar(255) primary key, "
+                      "table_name varchar(255), "
+                      "first_domain int, first_server_id int, first_sequence bigint, "
+                      "last_domain int, last_server_id int, last_sequence bigint);"
+                      "CREATE INDEX IF NOT EXISTS "SEGMENT_TABLE_NAME"_index ON "
+                      SEGMENT_TABLE_NAME"(table_name, first_domain, first_sequence);",
+                      NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to create file range table '"SEGMENT_TABLE_NAME"': %s",
+                  sqlite3_errmsg(handle));
+        sqlite3_free(errmsg);
+        return false;
+    }
+
     rc = sqlite3_exec(handle, "ATTACH DATABASE ':memory:' AS "MEMORY_DATABASE_NAME,
                       NULL, NULL, &errmsg);
     if (rc != SQLITE_OK)
@@ -288,6 +321,33 @@ void read_source_service_options(AVRO_INSTANCE *inst, const char** options)
     }
 }
 
+/**
+ * Parse a router option that is a non-negative number
+ *
+ * @param service Service of the router, used for logging
+ * @param name Name of the option
+ * @param value Value of the option
+ * @param max Largest allowed value
+ * @param dest Where the value is stored
+ * @return True if the value was valid
+ */
+static bool parse_option_number(SERVICE *service, const char *name, const char *value,
+                                long long max, long long *dest)
+{
+    char *end;
+    long long number = strtoll(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0' || number < 0 || number > max)
+    {
+        MXS_ERROR("[%s] Invalid value for '%s': %s. The value must be a number "
+                  "between 0 and %lld.", service->name, name, value, max);
+        return false;
+    }
+
+    *dest = number;
+    return true;
+}
+
 /**
  * Create an instance of the router for a particular service
  * within MaxScale.
@@ -317,6 +377,7 @@ createInstance(SERVICE *service, char **options)
     memset(&inst->stats, 0, sizeof(AVRO_ROUTER_STATS));
     spinlock_init(&inst->lock);
     spinlock_init(&inst->fileslock);
+    spinlock_init(&inst->subscriber_lock);
     inst->service = service;
     inst->binlog_fd = -1;
     inst->binlogdir = NULL;
@@ -332,7 +393,10 @@ createInstance(SERVICE *service, char **options)
     inst->trx_count = 0;
     inst->row_target = AVRO_DEFAULT_BLOCK_ROW_COUNT;
     inst->trx_target = AVRO_DEFAULT_BLOCK_TRX_COUNT;
+    inst->kafka_config.format = AVRO_FORMAT_JSON;
+    inst->kafka_config.linger_ms = -1;
     int first_file = 1;
+    int block_cache = 0;
     bool err = false;
 
     CONFIG_PARAMETER *param = config_get_param(service->svc_config_param, "source");
@@ -402,6 +466,140 @@ createInstance(SERVICE *service, char **options)
                 {
                     first_file = MAX(1, atoi(value));
                 }
+                else if (strcmp(options[i], "worker_threads") == 0)
+                {
+                    inst->n_workers = atoi(value);
+
+                    if (inst->n_workers < 0 || inst->n_workers > AVRO_MAX_WORKERS)
+                    {
+                        MXS_ERROR("[%s] Invalid value for 'worker_threads': %s. The value "
+                                  "must be between 0 and %d.", service->name, value,
+                                  AVRO_MAX_WORKERS);
+                        err = true;
+                    }
+                }
+                else if (strcmp(options[i], "codec") == 0)
+                {
+                    if ((inst->codec = maxavro_codec_from_string(value)) == MAXAVRO_CODEC_UNKNOWN)
+                    {
+                        MXS_ERROR("[%s] Invalid value for 'codec': %s. The value "
+                                  "must be either 'null' or 'deflate'.", service->name, value);
+                        err = true;
+                    }
+                }
+                else if (strcmp(options[i], "sendfile_blocks") == 0)
+                {
+                    inst->sendfile_blocks = config_truth_value(value) == 1;
+                }
+                else if (strcmp(options[i], "block_cache") == 0)
+                {
+                    block_cache = atoi(value);
+
+                    if (block_cache < 0 || block_cache > AVRO_BLOCK_CACHE_MAX)
+                    {
+                        MXS_ERROR("[%s] Invalid value for 'block_cache': %s. The value "
+                                  "must be between 0 and %d.", service->name, value,
+                                  AVRO_BLOCK_CACHE_MAX);
+                        err = true;
+                    }
+                }
+                else if (strcmp(options[i], "kafka_brokers") == 0)
+                {
+                    /** The router options are separated by commas so each broker
+                     * is given with an option of its own */
+                    char *brokers = inst->kafka_config.brokers;
+                    size_t len = (brokers ? strlen(brokers) + 1 : 0) + strlen(value) + 1;
+
+                    if ((inst->kafka_config.brokers = malloc(len)))
+                    {
+                        snprintf(inst->kafka_config.brokers, len, "%s%s%s", brokers ? brokers : "",
+                                 brokers ? "," : "", value);
+                    }
+                    else
+                    {
+                        MXS_ERROR("[%s] Failed to allocate memory for 'kafka_brokers'.",
+                                  service->name);
+                        err = true;
+                    }
+                    free(brokers);
+                }
+                else if (strcmp(options[i], "kafka_topic_prefix") == 0)
+                {
+                    free(inst->kafka_config.topic_prefix);
+                    inst->kafka_config.topic_prefix = strdup(value);
+                }
+                else if (strcmp(options[i], "kafka_format") == 0)
+                {
+                    if (strcasecmp(value, "json") == 0)
+                    {
+                        inst->kafka_config.format = AVRO_FORMAT_JSON;
+                    }
+                    else if (strcasecmp(value, "avro") == 0)
+                    {
+                        inst->kafka_config.format = AVRO_FORMAT_AVRO;
+                    }
+                    else
+                    {
+                        MXS_ERROR("[%s] Invalid value for 'kafka_format': %s. The value "
+                                  "must be either 'json' or 'avro'.", service->name, value);
+                        err = true;
+                    }
+                }
+                else if (strcmp(options[i], "kafka_compression") == 0)
+                {
+                    free(inst->kafka_config.compression);
+                    inst->kafka_config.compression = strdup(value);
+                }
+                else if (strcmp(options[i], "kafka_batch_size") == 0)
+                {
+                    if ((inst->kafka_config.batch_size = atoi(value)) <= 0)
+                    {
+                        MXS_ERROR("[%s] Invalid value for 'kafka_batch_size': %s. The value "
+                                  "must be a positive integer.", service->name, value);
+                        err = true;
+                    }
+                }
+                else if (strcmp(options[i], "kafka_linger") == 0)
+                {
+                    char *end;
+                    long linger = strtol(value, &end, 10);
+
+                    if (*value == '\0' || *end != '\0' || linger < 0 || linger > INT_MAX)
+                    {
+                        MXS_ERROR("[%s] Invalid value for 'kafka_linger': %s. The value "
+                                  "must be a non-negative number of milliseconds.",
+                                  service->name, value);
+                        err = true;
+                    }
+                    else
+                    {
+                        inst->kafka_config.linger_ms = linger;
+                    }
+                }
+                else if (strcmp(options[i], "rotate_size") == 0)
+                {
+                    long long size = 0;
+                    err |= !parse_option_number(service, options[i], value, LLONG_MAX, &size);
+                    inst->rotate_size = size;
+                }
+                else if (strcmp(options[i], "rotate_time") == 0)
+                {
+                    long long number = 0;
+                    err |= !parse_option_number(service, options[i], value, INT_MAX, &number);
+                    inst->rotate_time = number;
+                }
+                else if (strcmp(options[i], "retention_time") == 0)
+                {
+                    long long number = 0;
+                    err |= !parse_option_number(service, options[i], value, INT_MAX, &number);
+                    inst->retention_time = number;
+                }
+                else if (strcmp(options[i], "retention_files") == 0)
+                {
+                    long long number = 0;
+                    err |= !parse_option_number(service, options[i], value, INT_MAX, &number);
+                    inst->retention_files = number;
+                }
                 else
                 {
                     MXS_WARNING("[avrorouter] Unknown router option: '%s'", options[i]);
@@ -457,7 +655,9 @@ createInstance(SERVICE *service, char **options)
 
     if ((inst->table_maps = hashtable_alloc(1000, simple_str_hash, strcmp)) &&
         (inst->open_tables = hashtable_alloc(1000, simple_str_hash, strcmp)) &&
-        (inst->created_tables = hashtable_alloc(1000, simple_str_hash, strcmp)))
+        (inst->created_tables = hashtable_alloc(1000, simple_str_hash, strcmp)) &&
+        (inst->subscribers = hashtable_alloc(1000, simple_str_hash, strcmp)) &&
+        (inst->table_stats = hashtable_alloc(1000, simple_str_hash, strcmp)))
     {
         hashtable_memory_fns(inst->table_maps, (HASHMEMORYFN)strdup, NULL,
                              safe_key_free, (HASHMEMORYFN)table_map_free);
@@ -465,6 +665,10 @@ createInstance(SERVICE *service, char **options)
                              safe_key_free, (HASHMEMORYFN)avro_table_free);
         hashtable_memory_fns(inst->created_tables, (HASHMEMORYFN)strdup, NULL,
                              safe_key_free, (HASHMEMORYFN)table_create_free);
+        hashtable_memory_fns(inst->subscribers, (HASHMEMORYFN)strdup, NULL,
+                             safe_key_free, safe_key_free);
+        hashtable_memory_fns(inst->table_stats, (HASHMEMORYFN)strdup, NULL,
+                             safe_key_free, safe_key_free);
     }
     else
     {
@@ -512,15 +716,30 @@ createInstance(SERVICE *service, char **options)
         err = true;
     }
 
+    if (!err && !avro_cache_init(&inst->block_cache, block_cache))
+    {
+        err = true;
+    }
+
+    if (!err && !avro_kafka_init(inst))
+    {
+        err = true;
+    }
+
     if (err)
     {
         sqlite3_close_v2(inst->sqlite_handle);
         hashtable_free(inst->table_maps);
         hashtable_free(inst->open_tables);
         hashtable_free(inst->created_tables);
+        hashtable_free(inst->subscribers);
+        hashtable_free(inst->table_stats);
         free(inst->avrodir);
         free(inst->binlogdir);
         free(inst->fileroot);
+        free(inst->kafka_config.brokers);
+        free(inst->kafka_config.topic_prefix);
+        free(inst->kafka_config.compression);
         free(inst);
         return NULL;
     }
@@ -538,13 +757,18 @@ createInstance(SERVICE *service, char **options)
     avro_load_conversion_state(inst);
     avro_load_metadata_from_schemas(inst);
 
+    if (inst->n_workers > 0 && avro_workers_start(inst))
+    {
+        MXS_NOTICE("[%s] Converting row events with %d worker threads.",
+                   service->name, inst->n_workers);
+    }
+
     /*
      * Add tasks for statistic computation
      */
-    /** Not used currenly
+    char task_name[BLRM_TASK_NAME_LEN + 1];
     snprintf(task_name, BLRM_TASK_NAME_LEN, "%s stats", service->name);
     hktask_add(task_name, stats_func, inst, AVRO_STATS_FREQ);
-     */
 
     /* Start the scan, read, convert AVRO task */
     add_conversion_task(inst);
@@ -651,6 +875,9 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
     (void) prev_val;
 
     free(client->uuid);
+    avro_client_unsubscribe(router, client);
+    avro_filter_free(client->filter);
+    maxavro_jsonbuf_free(&client->json_text);
     maxavro_file_close(client->file_handle);
     sqlite3_close_v2(client->sqlite_handle);
 
@@ -816,6 +1043,72 @@ diagnostics(ROUTER *router, DCB *dcb)
     dcb_printf(dcb, "\tCurrent GTID #events:                %lu\n",
                router_inst->gtid.event_num);
 
+    for (int w = 0; w < router_inst->n_workers; w++)
+    {
+        AVRO_WORKER *worker = &router_inst->workers[w];
+        pthread_mutex_lock(&worker->lock);
+        dcb_printf(dcb, "\tConversion worker %-2d:                %lu events, %d queued\n",
+                   w, worker->n_events, worker->queued);
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    if (router_inst->block_cache.size > 0)
+    {
+        dcb_printf(dcb, "\tBlock cache hits:                    %lu\n",
+                   router_inst->block_cache.hits);
+        dcb_printf(dcb, "\tBlock cache misses:                  %lu\n",
+                   router_inst->block_cache.misses);
+    }
+
+    if (router_inst->rotate_size > 0 || router_inst->rotate_time > 0)
+    {
+        dcb_printf(dcb, "\tFiles rotated by size or age:        %lu\n",
+                   router_inst->n_rotated);
+    }
+
+    if (router_inst->retention_time > 0 || router_inst->retention_files > 0)
+    {
+        dcb_printf(dcb, "\tFiles removed by retention:          %lu\n",
+                   router_inst->n_removed);
+    }
+
+    avro_kafka_diagnostics(router_inst, dcb);
+
+    dcb_printf(dcb, "\tTransactions not yet flushed:        %lu\n",
+               router_inst->trx_count);
+    dcb_printf(dcb, "\tRow events not yet flushed:          %lu\n",
+               router_inst->row_count);
+
+    HASHITERATOR *iter = hashtable_iterator(router_inst->table_stats);
+
+    if (iter)
+    {
+        char *key;
+        dcb_printf(dcb, "\tTables (rates are averages over the last %d seconds):\n",
+                   AVRO_STATS_FREQ);
+
+        while ((key = (char*)hashtable_next(iter)))
+        {
+            AVRO_TABLE_STATS *stats = hashtable_fetch(router_inst->table_stats, key);
+
+            if (stats)
+            {
+                dcb_printf(dcb, "\t\tTable:                       %s\n", key);
+                dcb_printf(dcb, "\t\tRow events converted:        %lu (%lu/s)\n",
+                           stats->n_events, stats->events_per_sec);
+                dcb_printf(dcb, "\t\tRecords written:             %lu (%lu/s)\n",
+                           stats->n_rows, stats->rows_per_sec);
+                dcb_printf(dcb, "\t\tBytes written:               %lu (%lu/s)\n",
+                           stats->n_bytes, stats->bytes_per_sec);
+                dcb_printf(dcb, "\t\tLast converted GTID:         %lu-%lu-%lu\n",
+                           stats->gtid.domain, stats->gtid.server_id, stats->gtid.seq);
+                dcb_printf(dcb, "\t\tConversion lag (seconds):    %u\n", stats->lag);
+                dcb_printf(dcb, "\t\t--------------------\n\n");
+            }
+        }
+        hashtable_iterator_free(iter);
+    }
+
     dcb_printf(dcb, "\tCurrent GTID affected tables: ");
     avro_get_used_tables(router_inst, dcb);
     dcb_printf(dcb, "\n");
@@ -866,6 +1159,13 @@ diagnostics(ROUTER *router, DCB *dcb)
                        session->gtid.domain, session->gtid.server_id,
                        session->gtid.seq);
 
+            int last = (session->stats.minno + AVRO_NSTATS_MINUTES - 1) % AVRO_NSTATS_MINUTES;
+            dcb_printf(dcb, "\t\tRecords sent:                %d (%d/s)\n",
+                       session->stats.n_events,
+                       session->stats.minavgs[last] / AVRO_STATS_FREQ);
+            dcb_printf(dcb, "\t\tBytes sent:                  %lu (%lu/s)\n",
+                       session->stats.n_bytes, session->stats.bytes_per_sec);
+
             // TODO: Add real value for this
             //dcb_printf(dcb, "\t\tAvro Transaction ID:         %u\n", 0);
             // TODO: Add real value for this
@@ -951,13 +1251,163 @@ static int getCapabilities()
     return RCAP_TYPE_NO_RSESSION;
 }
 
+/** A row of the router statistics result set */
+typedef struct
+{
+    char        name[AVRO_MAX_FILENAME_LEN + 1]; /*< Table name or client UUID */
+    const char *type;                            /*< "table" or "client" */
+    char        values[8][40];                   /*< Formatted statistics */
+} AVRO_STATS_ROW;
+
+/** The rows of the router statistics result set */
+typedef struct
+{
+    AVRO_STATS_ROW *rows;   /*< The rows */
+    int             n_rows; /*< Number of rows */
+    int             current; /*< The next row to send */
+} AVRO_STATS_SET;
+
+static RESULT_ROW* stats_row_callback(RESULTSET *set, void *data)
+{
+    AVRO_STATS_SET *stats = (AVRO_STATS_SET*)data;
+
+    if (stats->current >= stats->n_rows)
+    {
+        free(stats->rows);
+        free(stats);
+        return NULL;
+    }
+
+    AVRO_STATS_ROW *src = &stats->rows[stats->current++];
+    RESULT_ROW *row = resultset_make_row(set);
+
+    if (row)
+    {
+        resultset_row_set(row, 0, src->name);
+        resultset_row_set(row, 1, (char*)src->type);
+
+        for (int i = 0; i < 8; i++)
+        {
+            resultset_row_set(row, i + 2, src->values[i]);
+        }
+    }
+
+    return row;
+}
+
+/**
+ * Add a row to the statistics
+ *
+ * @param set The statistics
+ * @return The new row or NULL on memory allocation error
+ */
+static AVRO_STATS_ROW* add_stats_row(AVRO_STATS_SET *set)
+{
+    AVRO_STATS_ROW *rows = realloc(set->rows, (set->n_rows + 1) * sizeof(AVRO_STATS_ROW));
+
+    if (rows == NULL)
+    {
+        return NULL;
+    }
+
+    set->rows = rows;
+    memset(&rows[set->n_rows], 0, sizeof(AVRO_STATS_ROW));
+    return &rows[set->n_rows++];
+}
+
+/**
+ * Return the conversion statistics of the tables and the send statistics of
+ * the clients as a result set
+ *
+ * @param instance The router instance
+ * @return The result set or NULL on memory allocation error
+ */
+static RESULTSET *getStatistics(ROUTER *instance)
+{
+    AVRO_INSTANCE *router = (AVRO_INSTANCE *) instance;
+    AVRO_STATS_SET *set = calloc(1, sizeof(AVRO_STATS_SET));
+    AVRO_STATS_ROW *row;
+    RESULTSET *rval;
+
+    if (set == NULL)
+    {
+        return NULL;
+    }
+
+    /** The statistics are copied so that no locks are held while the rows are sent */
+    HASHITERATOR *iter = hashtable_iterator(router->table_stats);
+
+    if (iter)
+    {
+        char *key;
+        while ((key = (char*)hashtable_next(iter)))
+        {
+            AVRO_TABLE_STATS *stats = hashtable_fetch(router->table_stats, key);
+
+            if (stats && (row = add_stats_row(set)))
+            {
+                snprintf(row->name, sizeof(row->name), "%s", key);
+                row->type = "table";
+                snprintf(row->values[0], sizeof(row->values[0]), "%lu", stats->n_events);
+                snprintf(row->values[1], sizeof(row->values[1]), "%lu", stats->events_per_sec);
+                snprintf(row->values[2], sizeof(row->values[2]), "%lu", stats->n_rows);
+                snprintf(row->values[3], sizeof(row->values[3]), "%lu", stats->rows_per_sec);
+                snprintf(row->values[4], sizeof(row->values[4]), "%lu", stats->n_bytes);
+                snprintf(row->values[5], sizeof(row->values[5]), "%lu", stats->bytes_per_sec);
+                snprintf(row->values[6], sizeof(row->values[6]), "%lu-%lu-%lu",
+                         stats->gtid.domain, stats->gtid.server_id, stats->gtid.seq);
+                snprintf(row->values[7], sizeof(row->values[7]), "%u", stats->lag);
+            }
+        }
+        hashtable_iterator_free(iter);
+    }
+
+    spinlock_acquire(&router->lock);
+    for (AVRO_CLIENT *client = router->clients; client; client = client->next)
+    {
+        if ((row = add_stats_row(set)))
+        {
+            int last = (client->stats.minno + AVRO_NSTATS_MINUTES - 1) % AVRO_NSTATS_MINUTES;
+            snprintf(row->name, sizeof(row->name), "%s", client->uuid ? client->uuid : "");
+            row->type = "client";
+            snprintf(row->values[2], sizeof(row->values[2]), "%d", client->stats.n_events);
+            snprintf(row->values[3], sizeof(row->values[3]), "%d",
+                     client->stats.minavgs[last] / AVRO_STATS_FREQ);
+            snprintf(row->values[4], sizeof(row->values[4]), "%lu", client->stats.n_bytes);
+            snprintf(row->values[5], sizeof(row->values[5]), "%lu", client->stats.bytes_per_sec);
+            snprintf(row->values[6], sizeof(row->values[6]), "%lu-%lu-%lu",
+                     client->gtid.domain, client->gtid.server_id, client->gtid.seq);
+        }
+    }
+    spinlock_release(&router->lock);
+
+    if ((rval = resultset_create(stats_row_callback, set)) == NULL)
+    {
+        free(set->rows);
+        free(set);
+        return NULL;
+    }
+
+    resultset_add_column(rval, "Name", AVRO_MAX_FILENAME_LEN, COL_TYPE_VARCHAR);
+    resultset_add_column(rval, "Type", 6, COL_TYPE_VARCHAR);
+    resultset_add_column(rval, "Events", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(rval, "Events_per_second", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(rval, "Records", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(rval, "Records_per_second", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(rval, "Bytes", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(rval, "Bytes_per_second", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(rval, "GTID", 40, COL_TYPE_VARCHAR);
+    resultset_add_column(rval, "Lag", 10, COL_TYPE_VARCHAR);
+
+    return rval;
+}
+
 /**
  * The stats gathering function called from the housekeeper so that we
  * can get timed averages of binlog records shippped
  *
  * @param inst  The router instance
  */
-/*
 static void
 stats_func(void *inst)
 {
@@ -972,6 +1422,32 @@ stats_func(void *inst)
         router->stats.minno = 0;
     }
 
+    HASHITERATOR *iter = hashtable_iterator(router->table_stats);
+
+    if (iter)
+    {
+        char *key;
+        while ((key = (char*)hashtable_next(iter)))
+        {
+            AVRO_TABLE_STATS *stats = hashtable_fetch(router->table_stats, key);
+
+            if (stats)
+            {
+                /** The counters are updated by the conversion without locking */
+                uint64_t events = stats->n_events;
+                uint64_t rows = stats->n_rows;
+                uint64_t bytes = stats->n_bytes;
+                stats->events_per_sec = (events - stats->lastsample_events) / AVRO_STATS_FREQ;
+                stats->rows_per_sec = (rows - stats->lastsample_rows) / AVRO_STATS_FREQ;
+                stats->bytes_per_sec = (bytes - stats->lastsample_bytes) / AVRO_STATS_FREQ;
+                stats->lastsample_events = events;
+                stats->lastsample_rows = rows;
+                stats->lastsample_bytes = bytes;
+            }
+        }
+        hashtable_iterator_free(iter);
+    }
+
     spinlock_acquire(&router->lock);
     client = router->clients;
     while (client)
@@ -983,11 +1459,13 @@ stats_func(void *inst)
         {
             client->stats.minno = 0;
         }
+        unsigned long bytes = client->stats.n_bytes;
+        client->stats.bytes_per_sec = (bytes - client->stats.lastsample_bytes) / AVRO_STATS_FREQ;
+        client->stats.lastsample_bytes = bytes;
         client = client->next;
     }
     spinlock_release(&router->lock);
 }
-*/
 
 /**
  * Conversion task: MySQL binlogs to AVRO files
@@ -1023,6 +1501,7 @@ void converter_func(void* data)
     {
         avro_flush_all_tables(router);
         avro_save_conversion_state(router);
+        notify_table_clients(router);
     }
 
     if (binlog_end == AVRO_LAST_FILE)
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_cache.c - Data blocks shared by the CDC clients
+ *
+ * With the block_cache option, the data blocks that the clients read from the
+ * Avro files are stored in a cache shared by all clients of the router. The
+ * blocks are stored in the format they are sent in: the raw Avro data block
+ * for Avro clients and the rendered JSON records for JSON clients. A client
+ * that is about to read a whole data block that is in the cache sends a clone
+ * of the cached buffer and skips the block in the file.
+ *
+ * The blocks are identified by the sync marker of the file and the position
+ * of the block, so a recreated file never matches the blocks of the old file.
+ * Only complete data blocks are stored. When the cache is full, the least
+ * recently used block is replaced. The clones of a replaced block that are
+ * still queued for the clients keep the data alive until they are sent.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                 Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <avrorouter.h>
+#include <log_manager.h>
+
+/**
+ * @brief Initialize the block cache
+ *
+ * @param cache Cache to initialize
+ * @param size Number of blocks to cache, 0 disables the cache
+ * @return True on success, false if memory allocation failed
+ */
+bool avro_cache_init(AVRO_BLOCK_CACHE *cache, int size)
+{
+    spinlock_init(&cache->lock);
+    cache->size = 0;
+
+    if (size > 0)
+    {
+        if ((cache->blocks = calloc(size, sizeof(AVRO_CACHED_BLOCK))) == NULL)
+        {
+            MXS_ERROR("Failed to allocate memory for the block cache.");
+            return false;
+        }
+        cache->size = size;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Find a cached block
+ *
+ * The caller must hold the lock of the cache.
+ *
+ * @param cache Block cache
+ * @param sync Sync marker of the file
+ * @param pos Position of the block
+ * @param format Format of the data
+ * @return The cached block or NULL if it is not in the cache
+ */
+static AVRO_CACHED_BLOCK* find_block(AVRO_BLOCK_CACHE *cache, const uint8_t *sync,
+                                     long pos, enum avro_data_format format)
+{
+    for (int i = 0; i < cache->size; i++)
+    {
+        AVRO_CACHED_BLOCK *block = &cache->blocks[i];
+
+        if (block->data && block->pos == pos && block->format == format &&
+            memcmp(block->sync, sync, SYNC_MARKER_SIZE) == 0)
+        {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Get the current data block of a file from the cache
+ *
+ * A block is only returned if no records of it have been read from the file.
+ * The caller must skip the block in the file with maxavro_next_block() and
+ * send or free the returned buffer.
+ *
+ * @param cache Block cache
+ * @param file File whose current block is looked up
+ * @param format Format of the data
+ * @param gtid If not NULL, set to the GTID of the last record in the block
+ * @return A clone of the cached data or NULL if the block is not in the cache
+ */
+GWBUF* avro_cache_get(AVRO_BLOCK_CACHE *cache, MAXAVRO_FILE *file,
+                      enum avro_data_format format, gtid_pos_t *gtid)
+{
+    GWBUF *rval = NULL;
+
+    if (cache->size > 0 && file->metadata_read && file->records_read_from_block == 0)
+    {
+        spinlock_acquire(&cache->lock);
+        AVRO_CACHED_BLOCK *block = find_block(cache, file->sync, file->block_start_pos, format);
+
+        if (block && (rval = gwbuf_clone(block->data)))
+        {
+            block->last_used = ++cache->counter;
+            cache->hits++;
+
+            if (gtid)
+            {
+                *gtid = block->gtid;
+            }
+        }
+        else
+        {
+            cache->misses++;
+        }
+        spinlock_release(&cache->lock);
+    }
+
+    return rval;
+}
+
+/**
+ * @brief Add a data block to the cache
+ *
+ * The cache takes the ownership of @c data.
+ *
+ * @param cache Block cache
+ * @param file File where the block was read from
+ * @param pos Position of the block in the file
+ * @param format Format of the data
+ * @param data The data of the whole block
+ * @param gtid GTID of the last record in the block or NULL if not known
+ */
+void avro_cache_add(AVRO_BLOCK_CACHE *cache, MAXAVRO_FILE *file, long pos,
+                    enum avro_data_format format, GWBUF *data, gtid_pos_t *gtid)
+{
+    /** The cached data is cloned as one buffer */
+    if (cache->size == 0 || (data = gwbuf_make_contiguous(data)) == NULL)
+    {
+        gwbuf_free(data);
+        return;
+    }
+
+    spinlock_acquire(&cache->lock);
+
+    if (find_block(cache, file->sync, pos, format) == NULL)
+    {
+        AVRO_CACHED_BLOCK *block = &cache->blocks[0];
+
+        for (int i = 1; i < cache->size && block->data; i++)
+        {
+            if (cache->blocks[i].data == NULL ||
+                cache->blocks[i].last_used < block->last_used)
+            {
+                block = &cache->blocks[i];
+            }
+        }
+
+        if (block->data)
+        {
+            gwbuf_free(block->data);
+        }
+
+        memcpy(block->sync, file->sync, SYNC_MARKER_SIZE);
+        block->pos = pos;
+        block->format = format;
+        block->data = data;
+        block->last_used = ++cache->counter;
+
+        if (gtid)
+        {
+            block->gtid = *gtid;
+        }
+        else
+        {
+            memset(&block->gtid, 0, sizeof(block->gtid));
+        }
+
+        data = NULL;
+    }
+
+    spinlock_release(&cache->lock);
+
+    /** Another client added the same block first */
+    gwbuf_free(data);
+}
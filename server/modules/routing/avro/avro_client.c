@@ -28,6 +28,10 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glob.h>
 #include <service.h>
 #include <server.h>
 #include <router.h>
@@ -55,7 +59,8 @@ void avro_notify_client(AVRO_CLIENT *client);
 void poll_fake_write_event(DCB *dcb);
 GWBUF* read_avro_json_schema(const char *avrofile, const char* dir);
 GWBUF* read_avro_binary_schema(const char *avrofile, const char* dir);
-const char* get_avrofile_name(const char *file_ptr, int data_len, char *dest);
+const char* get_avrofile_name(const char *file_ptr, int data_len, char *dest, bool *versioned);
+static void select_first_file(AVRO_CLIENT *client);
 
 /**
  * Process a request packet from the slave server.
@@ -433,6 +438,92 @@ bool file_in_dir(const char *dir, const char *file)
     return access(path, F_OK) == 0;
 }
 
+/**
+ * @brief Parse the optional parts of a REQUEST-DATA command
+ *
+ * The table name can be followed by the GTID to start from, the FIELDS clause
+ * with a comma separated list of columns and the WHERE clause with predicates
+ * that are combined with AND, e.g. `0-1-15 FIELDS id,name WHERE id>10 AND name!=x`.
+ * The requested GTID and the row filter are stored in the client. An
+ * error is sent to the client if the options are invalid.
+ *
+ * @param client The client that sent the command
+ * @param options The options after the table name
+ * @param len Length of @p options
+ * @return True if the options were valid
+ */
+static bool parse_request_options(AVRO_CLIENT *client, const char *options, int len)
+{
+    char buf[len + 1];
+    char *saved, *tok;
+    AVRO_ROW_FILTER *filter = NULL;
+    bool in_where = false;
+    bool rval = true;
+
+    memcpy(buf, options, len);
+    buf[len] = '\0';
+    tok = strtok_r(buf, " \t\r\n", &saved);
+
+    if (tok && isdigit(*tok))
+    {
+        client->requested_gtid = true;
+        extract_gtid_request(&client->gtid, tok, strlen(tok));
+        memcpy(&client->gtid_start, &client->gtid, sizeof(client->gtid_start));
+        tok = strtok_r(NULL, " \t\r\n", &saved);
+    }
+
+    while (tok && rval)
+    {
+        const char *arg = NULL;
+        bool is_fields = strcasecmp(tok, "FIELDS") == 0;
+
+        if (is_fields || strcasecmp(tok, "WHERE") == 0 ||
+            (in_where && strcasecmp(tok, "AND") == 0))
+        {
+            arg = strtok_r(NULL, " \t\r\n", &saved);
+        }
+
+        if (arg == NULL)
+        {
+            dcb_printf(client->dcb, "ERR REQUEST-DATA Unexpected '%s'.", tok);
+            rval = false;
+        }
+        else if (filter == NULL && (filter = avro_filter_alloc()) == NULL)
+        {
+            dcb_printf(client->dcb, "ERR REQUEST-DATA Out of memory.");
+            rval = false;
+        }
+        else if (is_fields ? !avro_filter_add_fields(filter, arg) :
+                 !avro_filter_add_predicate(filter, arg))
+        {
+            dcb_printf(client->dcb, "ERR REQUEST-DATA Invalid %s '%s'.",
+                       is_fields ? "FIELDS" : "WHERE", arg);
+            rval = false;
+        }
+
+        in_where = !is_fields;
+        tok = strtok_r(NULL, " \t\r\n", &saved);
+    }
+
+    if (rval && filter && client->format != AVRO_FORMAT_JSON)
+    {
+        dcb_printf(client->dcb, "ERR REQUEST-DATA FIELDS and WHERE are only supported "
+                   "with the JSON format.");
+        rval = false;
+    }
+
+    if (rval)
+    {
+        client->filter = filter;
+    }
+    else
+    {
+        avro_filter_free(filter);
+    }
+
+    return rval;
+}
+
 /**
  * Process command from client
  *
@@ -461,26 +552,36 @@ avro_client_process_command(AVRO_INSTANCE *router, AVRO_CLIENT *client, GWBUF *q
 
         if (data_len > 1)
         {
-            const char *gtid_ptr = get_avrofile_name(file_ptr, data_len, client->avro_binfile);
+            bool versioned;
+            const char *gtid_ptr = get_avrofile_name(file_ptr, data_len, client->avro_binfile,
+                                                     &versioned);
 
-            if (gtid_ptr)
-            {
-                client->requested_gtid = true;
-                extract_gtid_request(&client->gtid, gtid_ptr, data_len - (gtid_ptr - file_ptr));
-                memcpy(&client->gtid_start, &client->gtid, sizeof(client->gtid_start));
-            }
+            avro_filter_free(client->filter);
+            client->filter = NULL;
 
-            if (file_in_dir(router->avrodir, client->avro_binfile))
+            if (gtid_ptr == NULL ||
+                parse_request_options(client, gtid_ptr, data_len - (gtid_ptr - file_ptr)))
             {
-                /* set callback routine for data sending */
-                dcb_add_callback(client->dcb, DCB_REASON_DRAINED, avro_client_callback, client);
+                if (!versioned)
+                {
+                    select_first_file(client);
+                }
 
-                /* Add fake event that will call the avro_client_callback() routine */
-                poll_fake_write_event(client->dcb);
-            }
-            else
-            {
-                dcb_printf(client->dcb, "ERR NO-FILE File '%s' not found.", client->avro_binfile);
+                if (file_in_dir(router->avrodir, client->avro_binfile))
+                {
+                    /** Wake up the client when new data is written to the table */
+                    avro_client_subscribe(router, client);
+
+                    /* set callback routine for data sending */
+                    dcb_add_callback(client->dcb, DCB_REASON_DRAINED, avro_client_callback, client);
+
+                    /* Add fake event that will call the avro_client_callback() routine */
+                    poll_fake_write_event(client->dcb);
+                }
+                else
+                {
+                    dcb_printf(client->dcb, "ERR NO-FILE File '%s' not found.", client->avro_binfile);
+                }
             }
         }
         else
@@ -517,8 +618,9 @@ avro_client_process_command(AVRO_INSTANCE *router, AVRO_CLIENT *client, GWBUF *q
  * @param data_len Length of string pointed by @p file_ptr
  * @param dest Destination where the file name is stored. Must be at least
  * @p data_len + 1 bytes.
+ * @param versioned Set to true if the request names a version of the file
  */
-const char* get_avrofile_name(const char *file_ptr, int data_len, char *dest)
+const char* get_avrofile_name(const char *file_ptr, int data_len, char *dest, bool *versioned)
 {
     while (isspace(*file_ptr))
     {
@@ -545,37 +647,131 @@ const char* get_avrofile_name(const char *file_ptr, int data_len, char *dest)
         strlen(cmd_sep + 1) > 0)
     {
         snprintf(dest, AVRO_MAX_FILENAME_LEN, "%s.avro", avro_file);
+        *versioned = true;
     }
     /** No version specified, send all files */
     else
     {
         snprintf(dest, AVRO_MAX_FILENAME_LEN, "%s.000001.avro", avro_file);
+        *versioned = false;
     }
 
     return rval;
 }
 
-static int send_row(DCB *dcb, json_t* row)
+/** The newest file of a table that starts before the requested GTID */
+static const char segment_sql[] = "SELECT filename FROM "SEGMENT_TABLE_NAME" WHERE table_name=? "
+                                  "AND first_domain=? AND first_sequence <= ? "
+                                  "ORDER BY first_sequence DESC LIMIT 1;";
+
+/**
+ * @brief Select the file where the streaming of a table starts
+ *
+ * If the client requested a GTID, the file is looked up from the GTID ranges
+ * of the files in the index. Otherwise, or if none of the files start before
+ * the GTID, the streaming starts from the oldest file of the table as the
+ * files before it may have been removed by the retention.
+ *
+ * @param client Client whose @c avro_binfile is the first version of the table
+ */
+static void select_first_file(AVRO_CLIENT *client)
+{
+    AVRO_INSTANCE *router = client->router;
+
+    /** The name of the first version is <database>.<table>.000001.avro */
+    static const char first_version[] = ".000001.avro";
+    size_t len = strlen(client->avro_binfile);
+
+    if (len <= sizeof(first_version) - 1)
+    {
+        return;
+    }
+
+    char table[len + 1];
+    strcpy(table, client->avro_binfile);
+    table[len - (sizeof(first_version) - 1)] = '\0';
+
+    sqlite3_stmt *stmt;
+
+    if (client->requested_gtid &&
+        sqlite3_prepare_v2(client->sqlite_handle, segment_sql, -1, &stmt, NULL) == SQLITE_OK)
+    {
+        sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, client->gtid.domain);
+        sqlite3_bind_int64(stmt, 3, client->gtid.seq);
+
+        bool found = false;
+
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            const char *name = (const char*)sqlite3_column_text(stmt, 0);
+
+            if (name && file_in_dir(router->avrodir, name))
+            {
+                snprintf(client->avro_binfile, sizeof(client->avro_binfile), "%s", name);
+                found = true;
+            }
+        }
+
+        sqlite3_finalize(stmt);
+
+        if (found)
+        {
+            return;
+        }
+    }
+
+    char path[PATH_MAX + 1];
+    snprintf(path, sizeof(path), "%s/%s.[0-9][0-9][0-9][0-9][0-9][0-9].avro",
+             router->avrodir, table);
+    glob_t files;
+
+    /** The files are sorted by their version */
+    if (glob(path, 0, NULL, &files) == 0)
+    {
+        snprintf(client->avro_binfile, sizeof(client->avro_binfile), "%s",
+                 strrchr(files.gl_pathv[0], '/') + 1);
+    }
+
+    globfree(&files);
+}
+
+/**
+ * @brief Convert a JSON record into a newline terminated buffer
+ *
+ * @param row The record
+ * @return The buffer or NULL on error
+ */
+static GWBUF* row_to_buffer(json_t* row)
 {
     char *json = json_dumps(row, JSON_PRESERVE_ORDER);
-    size_t len = strlen(json);
-    GWBUF *buf = gwbuf_alloc(len + 1);
-    int rc = 0;
+    GWBUF *buf = NULL;
 
-    if (json && buf)
+    if (json)
     {
-        uint8_t *data = GWBUF_DATA(buf);
-        memcpy(data, json, len);
-        data[len] = '\n';
-        rc = dcb->func.write(dcb, buf);
+        size_t len = strlen(json);
+
+        if ((buf = gwbuf_alloc(len + 1)))
+        {
+            uint8_t *data = GWBUF_DATA(buf);
+            memcpy(data, json, len);
+            data[len] = '\n';
+        }
     }
-    else
+
+    if (buf == NULL)
     {
         MXS_ERROR("Failed to dump JSON value.");
-        rc = 0;
     }
+
     free(json);
-    return rc;
+    return buf;
+}
+
+static int send_row(DCB *dcb, json_t* row)
+{
+    GWBUF *buf = row_to_buffer(row);
+    return buf ? dcb->func.write(dcb, buf) : 0;
 }
 
 static void set_current_gtid(AVRO_CLIENT *client, json_t *row)
@@ -593,28 +789,135 @@ static void set_current_gtid(AVRO_CLIENT *client, json_t *row)
     client->gtid.domain = json_integer_value(obj);
 }
 
+/**
+ * @brief Send the JSON text of the records read so far
+ *
+ * @param client Client to send to
+ * @param block If not NULL, a copy of the sent data is appended here
+ * @return Return value of the DCB write, 0 if memory allocation failed
+ */
+static int send_json_text(AVRO_CLIENT *client, GWBUF **block)
+{
+    GWBUF *buf = gwbuf_alloc_and_load(client->json_text.len, client->json_text.data);
+    client->json_text.len = 0;
+
+    if (buf == NULL)
+    {
+        MXS_ERROR("Failed to allocate a buffer for the JSON records.");
+        return 0;
+    }
+
+    if (block)
+    {
+        *block = gwbuf_append(*block, gwbuf_clone(buf));
+    }
+
+    client->stats.n_bytes += GWBUF_LENGTH(buf);
+    return client->dcb->func.write(client->dcb, buf);
+}
+
 /**
  * @brief Stream Avro data in JSON format
  *
- * @param file File to stream from
- * @param dcb DCB to stream to
+ * The blocks that are in the block cache are sent from the cache. The other
+ * blocks are read from the file and, if the whole block was sent, added to
+ * the cache. Without a row filter, the records are decoded straight into JSON
+ * text and sent in large buffers instead of one buffer per record.
+ *
+ * @param client Client to stream to
  * @return True if more data is readable, false if all data was sent
  */
 static bool stream_json(AVRO_CLIENT *client)
 {
     int bytes = 0;
     MAXAVRO_FILE *file = client->file_handle;
+    AVRO_BLOCK_CACHE *cache = &client->router->block_cache;
     DCB *dcb = client->dcb;
 
     do
     {
-        json_t *row;
-        int rc = 1;
-        while (rc > 0 && (row = maxavro_record_read_json(file)))
+        /** The cached blocks contain all rows and columns */
+        GWBUF *cached = client->filter ? NULL :
+                        avro_cache_get(cache, file, AVRO_FORMAT_JSON, &client->gtid);
+
+        if (cached)
         {
-            rc = send_row(dcb, row);
-            set_current_gtid(client, row);
-            json_decref(row);
+            client->stats.n_events += file->records_in_block;
+            client->stats.n_bytes += gwbuf_length(cached);
+            dcb->func.write(dcb, cached);
+        }
+        else if (client->filter)
+        {
+            json_t *row;
+            int rc = 1;
+
+            while (rc > 0 && (row = maxavro_record_read_json(file)))
+            {
+                set_current_gtid(client, row);
+
+                if (avro_filter_match(client->filter, row))
+                {
+                    avro_filter_project(client->filter, row);
+                    GWBUF *buf = row_to_buffer(row);
+
+                    if (buf)
+                    {
+                        client->stats.n_events++;
+                        client->stats.n_bytes += GWBUF_LENGTH(buf);
+                    }
+
+                    rc = buf ? dcb->func.write(dcb, buf) : 0;
+                }
+
+                json_decref(row);
+            }
+        }
+        else
+        {
+            /** Only blocks that are sent from the start are cached */
+            bool whole_block = cache->size > 0 && file->records_read_from_block == 0;
+            GWBUF *block = NULL;
+            int domain = maxavro_schema_field_index(file->schema, avro_domain);
+            int server_id = maxavro_schema_field_index(file->schema, avro_server_id);
+            int sequence = maxavro_schema_field_index(file->schema, avro_sequence);
+            uint64_t integers[file->schema->num_fields + 1];
+            int rc = 1;
+
+            ss_dassert(domain >= 0 && server_id >= 0 && sequence >= 0);
+            client->json_text.len = 0;
+
+            while (rc > 0 && maxavro_record_read_text(file, &client->json_text, integers))
+            {
+                client->stats.n_events++;
+
+                if (domain >= 0 && server_id >= 0 && sequence >= 0)
+                {
+                    client->gtid.domain = integers[domain];
+                    client->gtid.server_id = integers[server_id];
+                    client->gtid.seq = integers[sequence];
+                }
+
+                if (client->json_text.len >= AVRO_DATA_BURST_SIZE)
+                {
+                    rc = send_json_text(client, whole_block ? &block : NULL);
+                }
+            }
+
+            if (rc > 0 && client->json_text.len > 0)
+            {
+                rc = send_json_text(client, whole_block ? &block : NULL);
+            }
+
+            if (whole_block && rc > 0 && maxavro_get_error(file) == MAXAVRO_ERR_NONE &&
+                file->records_read_from_block == file->records_in_block)
+            {
+                avro_cache_add(cache, file, file->block_start_pos, AVRO_FORMAT_JSON,
+                               block, &client->gtid);
+            }
+            else
+            {
+                gwbuf_free(block);
+            }
         }
         bytes += file->block_size;
     }
@@ -623,11 +926,82 @@ static bool stream_json(AVRO_CLIENT *client)
     return bytes >= AVRO_DATA_BURST_SIZE;
 }
 
+/** A data block mapped from an Avro file */
+typedef struct
+{
+    void   *data; /*< Start of the mapping */
+    size_t  size; /*< Size of the mapping */
+    int     fd;   /*< Descriptor of the file, used by sendfile() */
+} AVRO_MAPPED_BLOCK;
+
+static void release_mapped_block(void *arg)
+{
+    AVRO_MAPPED_BLOCK *block = (AVRO_MAPPED_BLOCK*)arg;
+    munmap(block->data, block->size);
+    close(block->fd);
+    free(block);
+}
+
+/**
+ * @brief Map the current data block of a file
+ *
+ * The data block is followed by the sync marker in the file so the block can
+ * be sent as it is. The returned buffer refers to the file and is written to
+ * the client with sendfile(). The file position is not changed.
+ *
+ * @param file File to map
+ * @return Buffer with the block and the sync marker or NULL if the start of the
+ * block has not been read, the block is too small to be mapped, is not
+ * completely written or could not be mapped
+ */
+static GWBUF* map_data_block(MAXAVRO_FILE *file)
+{
+    int fd = fileno(file->file);
+    off_t start = file->block_start_pos;
+    size_t len = (file->data_start_pos - file->block_start_pos) + file->block_size + SYNC_MARKER_SIZE;
+    off_t map_start = start - start % sysconf(_SC_PAGESIZE);
+    struct stat statb;
+    AVRO_MAPPED_BLOCK *block;
+    GWBUF *rval = NULL;
+
+    if (!file->metadata_read || len < AVRO_SENDFILE_MIN_SIZE || fstat(fd, &statb) == -1 ||
+        statb.st_size < start + (off_t)len ||
+        (block = (AVRO_MAPPED_BLOCK*)malloc(sizeof(AVRO_MAPPED_BLOCK))) == NULL)
+    {
+        return NULL;
+    }
+
+    block->size = len + (start - map_start);
+    block->data = mmap(NULL, block->size, PROT_READ, MAP_SHARED, fd, map_start);
+    block->fd = block->data != MAP_FAILED ? dup(fd) : -1;
+
+    if (block->fd != -1)
+    {
+        uint8_t *data = (uint8_t*)block->data + (start - map_start);
+
+        if (memcmp(data + len - SYNC_MARKER_SIZE, file->sync, SYNC_MARKER_SIZE) == 0 &&
+            (rval = gwbuf_alloc_external(len, data, release_mapped_block, block)))
+        {
+            gwbuf_set_file(rval, block->fd, start);
+            return rval;
+        }
+
+        close(block->fd);
+    }
+
+    if (block->data != MAP_FAILED)
+    {
+        munmap(block->data, block->size);
+    }
+
+    free(block);
+    return NULL;
+}
+
 /**
  * @brief Stream Avro data in native Avro format
  *
- * @param file File to stream from
- * @param dcb DCB to stream to
+ * @param client Client to stream to
  * @return True if streaming was successful, false if an error occurred
  */
 static bool stream_binary(AVRO_CLIENT *client)
@@ -636,68 +1010,101 @@ static bool stream_binary(AVRO_CLIENT *client)
     uint64_t bytes = 0;
     int rc = 1;
     MAXAVRO_FILE *file = client->file_handle;
+    AVRO_BLOCK_CACHE *cache = &client->router->block_cache;
     DCB *dcb = client->dcb;
+    uint64_t records = file->records_read;
 
     while (rc > 0 && bytes < AVRO_DATA_BURST_SIZE)
     {
         bytes += file->block_size;
-        if ((buffer = maxavro_record_read_binary(file)))
+
+        /** The position is only known if the block start has been read */
+        long pos = file->metadata_read ? file->block_start_pos : -1;
+
+        if ((buffer = avro_cache_get(cache, file, AVRO_FORMAT_AVRO, NULL)))
         {
-            rc = dcb->func.write(dcb, buffer);
+            maxavro_next_block(file);
         }
         else
         {
-            rc = 0;
-        }
-    }
+            if (client->router->sendfile_blocks && (buffer = map_data_block(file)))
+            {
+                maxavro_next_block(file);
+            }
+            else
+            {
+                buffer = maxavro_record_read_binary(file);
+            }
 
-    return bytes >= AVRO_DATA_BURST_SIZE;
-}
+            if (buffer && cache->size > 0 && pos != -1)
+            {
+                avro_cache_add(cache, file, pos, AVRO_FORMAT_AVRO, gwbuf_clone(buffer), NULL);
+            }
+        }
 
-static int sqlite_cb(void* data, int rows, char** values, char** names)
-{
-    for (int i = 0; i < rows; i++)
-    {
-        if (values[i])
+        if (buffer)
         {
-            *((long*)data) = strtol(values[i], NULL, 10);
-            return 0;
+            client->stats.n_bytes += gwbuf_length(buffer);
         }
+
+        rc = buffer ? dcb->func.write(dcb, buffer) : 0;
     }
-    return 0;
+
+    client->stats.n_events += file->records_read - records;
+    return bytes >= AVRO_DATA_BURST_SIZE;
 }
 
-static const char select_template[] = "SELECT max(position) FROM gtid WHERE domain=%lu "
-                                      "AND server_id=%lu AND sequence <= %lu AND avrofile=\"%s\";";
+/** The GTID index of the file is ordered by sequence so the closest
+ * indexed position is found with one index lookup */
+static const char select_sql[] = "SELECT position FROM "GTID_TABLE_NAME" WHERE avrofile=? "
+                                 "AND domain=? AND server_id=? AND sequence <= ? "
+                                 "ORDER BY sequence DESC LIMIT 1;";
 
+/**
+ * @brief Seek to the data block of the closest indexed GTID
+ *
+ * @param client Client whose requested GTID is looked up
+ * @param file File to seek
+ * @return True if the index was read and the file position is valid
+ */
 static bool seek_to_index_pos(AVRO_CLIENT *client, MAXAVRO_FILE* file)
 {
     char *name = strrchr(client->file_handle->filename, '/');
     ss_dassert(name);
     name++;
 
-    char sql[sizeof(select_template) + NAME_MAX + 80];
-    snprintf(sql, sizeof(sql), select_template, client->gtid.domain,
-             client->gtid.server_id, client->gtid.seq, name);
-
-    long offset = -1;
-    char *errmsg = NULL;
+    sqlite3_stmt *stmt;
     bool rval = false;
 
-    if (sqlite3_exec(client->sqlite_handle, sql, sqlite_cb, &offset, &errmsg) == SQLITE_OK)
+    if (sqlite3_prepare_v2(client->sqlite_handle, select_sql, -1, &stmt, NULL) == SQLITE_OK)
     {
-        rval = true;
-        if (offset > 0 && !maxavro_record_set_pos(file, offset))
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, client->gtid.domain);
+        sqlite3_bind_int64(stmt, 3, client->gtid.server_id);
+        sqlite3_bind_int64(stmt, 4, client->gtid.seq);
+
+        int rc = sqlite3_step(stmt);
+
+        if (rc == SQLITE_ROW)
         {
-            rval = false;
+            long offset = sqlite3_column_int64(stmt, 0);
+            rval = offset <= 0 || maxavro_record_set_pos(file, offset);
+        }
+        else if (rc == SQLITE_DONE)
+        {
+            rval = true;
         }
+
+        sqlite3_finalize(stmt);
     }
-    else
+
+    if (!rval)
     {
         MXS_ERROR("Failed to query index position for GTID %lu-%lu-%lu: %s",
-                  client->gtid.domain, client->gtid.server_id, client->gtid.seq, errmsg);
+                  client->gtid.domain, client->gtid.server_id, client->gtid.seq,
+                  sqlite3_errmsg(client->sqlite_handle));
     }
-    sqlite3_free(errmsg);
+
     return rval;
 }
 
@@ -744,8 +1151,9 @@ static bool seek_to_gtid(AVRO_CLIENT *client, MAXAVRO_FILE* file)
 
             /** We'll send the first found row immediately since we have already
              * read the row into memory */
-            if (!seeking)
+            if (!seeking && avro_filter_match(client->filter, row))
             {
+                avro_filter_project(client->filter, row);
                 send_row(client->dcb, row);
             }
 
@@ -1048,3 +1456,126 @@ void avro_notify_client(AVRO_CLIENT *client)
     poll_fake_write_event(client->dcb);
     client->cstate &= ~AVRO_WAIT_DATA;
 }
+
+/**
+ * @brief Subscribe a client to the table it streams
+ *
+ * The subscribed clients are woken up when new records of the table are
+ * written. Any earlier subscription of the client is removed.
+ *
+ * @param router Avro router instance
+ * @param client Client that streams the table of its current file
+ */
+void avro_client_subscribe(AVRO_INSTANCE *router, AVRO_CLIENT *client)
+{
+    avro_client_unsubscribe(router, client);
+
+    /** The file name is of the form database.table.version.avro */
+    snprintf(client->table_ident, sizeof(client->table_ident), "%s", client->avro_binfile);
+    char *ptr = strrchr(client->table_ident, '.');
+
+    if (ptr)
+    {
+        *ptr = '\0';
+
+        if ((ptr = strrchr(client->table_ident, '.')))
+        {
+            *ptr = '\0';
+        }
+    }
+
+    spinlock_acquire(&router->subscriber_lock);
+    AVRO_SUBSCRIBERS *subs = hashtable_fetch(router->subscribers, client->table_ident);
+
+    if (subs == NULL && (subs = calloc(1, sizeof(AVRO_SUBSCRIBERS))) &&
+        !hashtable_add(router->subscribers, client->table_ident, subs))
+    {
+        free(subs);
+        subs = NULL;
+    }
+
+    if (subs)
+    {
+        client->next_subscriber = subs->clients;
+        subs->clients = client;
+    }
+    else
+    {
+        MXS_ERROR("Failed to allocate memory for the subscribers of '%s'.",
+                  client->table_ident);
+        client->table_ident[0] = '\0';
+    }
+    spinlock_release(&router->subscriber_lock);
+}
+
+/**
+ * @brief Remove the subscription of a client
+ *
+ * @param router Avro router instance
+ * @param client Client to unsubscribe, does nothing if it is not subscribed
+ */
+void avro_client_unsubscribe(AVRO_INSTANCE *router, AVRO_CLIENT *client)
+{
+    if (*client->table_ident)
+    {
+        spinlock_acquire(&router->subscriber_lock);
+        AVRO_SUBSCRIBERS *subs = hashtable_fetch(router->subscribers, client->table_ident);
+
+        if (subs)
+        {
+            AVRO_CLIENT **prev = &subs->clients;
+
+            while (*prev && *prev != client)
+            {
+                prev = &(*prev)->next_subscriber;
+            }
+
+            if (*prev)
+            {
+                *prev = client->next_subscriber;
+            }
+
+            if (subs->clients == NULL)
+            {
+                hashtable_delete(router->subscribers, client->table_ident);
+            }
+        }
+
+        client->table_ident[0] = '\0';
+        client->next_subscriber = NULL;
+        spinlock_release(&router->subscriber_lock);
+    }
+}
+
+/**
+ * @brief Notify the subscribers of a table that new data is available
+ *
+ * Only the clients that are waiting for data are notified, the other
+ * subscribers will read the new data when they continue streaming.
+ *
+ * @param router Avro router instance
+ * @param table The table in database.table format
+ * @return Number of notified clients
+ */
+int avro_notify_subscribers(AVRO_INSTANCE *router, const char *table)
+{
+    int notified = 0;
+
+    spinlock_acquire(&router->subscriber_lock);
+    AVRO_SUBSCRIBERS *subs = hashtable_fetch(router->subscribers, (void*)table);
+
+    for (AVRO_CLIENT *client = subs ? subs->clients : NULL; client;
+         client = client->next_subscriber)
+    {
+        spinlock_acquire(&client->catch_lock);
+        if (client->cstate & AVRO_WAIT_DATA)
+        {
+            notified++;
+            avro_notify_client(client);
+        }
+        spinlock_release(&client->catch_lock);
+    }
+    spinlock_release(&router->subscriber_lock);
+
+    return notified;
+}
@@ -26,6 +26,7 @@
  *
  * Date         Who             Description
  * 25/02/2016   Markus Mäkelä   Initial implementation
+ * 14/10/2016   MariaDB Corporation   Rotation and retention of the Avro files
  *
  * @endverbatim
  */
@@ -46,7 +47,6 @@ void handle_query_event(AVRO_INSTANCE *router, REP_HEADER *hdr,
                         int *pending_transaction, uint8_t *ptr);
 bool is_create_table_statement(AVRO_INSTANCE *router, char* ptr, size_t len);
 void avro_flush_all_tables(AVRO_INSTANCE *router);
-void avro_notify_client(AVRO_CLIENT *client);
 void avro_update_index(AVRO_INSTANCE* router);
 void update_used_tables(AVRO_INSTANCE* router);
 TABLE_CREATE* table_create_from_schema(const char* file, const char* db,
@@ -104,50 +104,32 @@ void avro_close_binlog(int fd)
  * Create an Aro table and prepare it for writing.
  * @param filepath Path to the created file
  * @param json_schema The schema of the table in JSON format
+ * @param codec Compression codec of a new file
  */
-AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema)
+AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema,
+                             enum maxavro_codec codec)
 {
     AVRO_TABLE *table = calloc(1, sizeof(AVRO_TABLE));
     if (table)
     {
-        if (avro_schema_from_json_length(json_schema, strlen(json_schema),
-                                         &table->avro_schema))
+        if ((table->avro_file = maxavro_file_create(filepath, json_schema, codec)) == NULL)
         {
-            MXS_ERROR("Avro error: %s", avro_strerror());
             free(table);
             return NULL;
         }
 
-        int rc = 0;
-
-        if (access(filepath, F_OK) == 0)
-        {
-            rc = avro_file_writer_open(filepath, &table->avro_file);
-        }
-        else
-        {
-            rc = avro_file_writer_create(filepath, table->avro_schema, &table->avro_file);
-        }
-
-        if (rc)
-        {
-            MXS_ERROR("Avro error: %s", avro_strerror());
-            avro_schema_decref(table->avro_schema);
-            free(table);
-            return NULL;
-        }
-
-        if ((table->avro_writer_iface = avro_generic_class_from_schema(table->avro_schema)) == NULL)
+        if ((table->avro_block = maxavro_datablock_allocate(table->avro_file,
+                                                            AVRO_BLOCK_BUFFER_SIZE)) == NULL)
         {
-            MXS_ERROR("Avro error: %s", avro_strerror());
-            avro_schema_decref(table->avro_schema);
-            avro_file_writer_close(table->avro_file);
+            MXS_ERROR("Failed to allocate Avro data block for '%s'.", filepath);
+            maxavro_file_close(table->avro_file);
             free(table);
             return NULL;
         }
 
         table->json_schema = strdup(json_schema);
         table->filename = strdup(filepath);
+        table->created = time(NULL);
     }
     return table;
 }
@@ -298,6 +280,50 @@ bool avro_load_conversion_state(AVRO_INSTANCE *router)
     return rval;
 }
 
+/**
+ * @brief Get the statistics of a table
+ *
+ * The statistics are created when they are first requested and they are kept
+ * until the router instance is freed.
+ *
+ * @param router Avro router instance
+ * @param table The table in database.table format
+ * @return The statistics or NULL on memory allocation error
+ */
+AVRO_TABLE_STATS* avro_get_table_stats(AVRO_INSTANCE *router, const char *table)
+{
+    AVRO_TABLE_STATS *stats = hashtable_fetch(router->table_stats, (void*)table);
+
+    if (stats == NULL && (stats = calloc(1, sizeof(AVRO_TABLE_STATS))) &&
+        !hashtable_add(router->table_stats, (void*)table, stats))
+    {
+        free(stats);
+        stats = NULL;
+    }
+
+    return stats;
+}
+
+/**
+ * @brief Write the current data block of a table to its file
+ *
+ * @param table Table to write
+ * @return True if the block was written or it was empty
+ */
+bool avro_table_write_block(AVRO_TABLE *table)
+{
+    long start = ftell(table->avro_file->file);
+    bool rval = maxavro_datablock_finalize(table->avro_block);
+    long end = ftell(table->avro_file->file);
+
+    if (table->stats && start >= 0 && end > start)
+    {
+        table->stats->n_bytes += end - start;
+    }
+
+    return rval;
+}
+
 /**
  * @brief Free an AVRO_TABLE
  *
@@ -308,12 +334,13 @@ void* avro_table_free(AVRO_TABLE *table)
 {
     if (table)
     {
-        avro_file_writer_flush(table->avro_file);
-        avro_file_writer_close(table->avro_file);
-        avro_value_iface_decref(table->avro_writer_iface);
-        avro_schema_decref(table->avro_schema);
+        avro_table_write_block(table);
+        avro_kafka_topic_close(table->kafka_topic);
+        maxavro_datablock_free(table->avro_block);
+        maxavro_file_close(table->avro_file);
         free(table->json_schema);
         free(table->filename);
+        free(table);
     }
     return NULL;
 }
@@ -436,22 +463,34 @@ static GWBUF* read_event_data(AVRO_INSTANCE *router, REP_HEADER* hdr, uint64_t p
     return result;
 }
 
-void notify_all_clients(AVRO_INSTANCE *router)
+/**
+ * @brief Notify the clients of the tables that have new records
+ *
+ * Only the clients that are subscribed to a table that was written to since
+ * the last notification are woken up. This must be called after the tables
+ * have been flushed.
+ *
+ * @param router Avro router instance
+ */
+void notify_table_clients(AVRO_INSTANCE *router)
 {
-    AVRO_CLIENT *client = router->clients;
+    HASHITERATOR *iter = hashtable_iterator(router->open_tables);
     int notified = 0;
 
-    while (client)
+    if (iter)
     {
-        spinlock_acquire(&client->catch_lock);
-        if (client->cstate & AVRO_WAIT_DATA)
+        char *key;
+        while ((key = (char*)hashtable_next(iter)))
         {
-            notified++;
-            avro_notify_client(client);
-        }
-        spinlock_release(&client->catch_lock);
+            AVRO_TABLE *table = hashtable_fetch(router->open_tables, key);
 
-        client = client->next;
+            if (table && table->new_data)
+            {
+                table->new_data = false;
+                notified += avro_notify_subscribers(router, key);
+            }
+        }
+        hashtable_iterator_free(iter);
     }
 
     if (notified > 0)
@@ -665,7 +704,16 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
                  (hdr.event_type >= WRITE_ROWS_EVENTv2 && hdr.event_type <= DELETE_ROWS_EVENTv2))
         {
             router->row_count++;
-            handle_row_event(router, &hdr, ptr);
+
+            if (router->n_workers == 0)
+            {
+                handle_row_event(router, &hdr, ptr);
+            }
+            else if (avro_workers_add(router, &hdr, result))
+            {
+                /** A worker frees the event once it is converted */
+                result = NULL;
+            }
         }
         /* Decode ROTATE EVENT */
         else if (hdr.event_type == ROTATE_EVENT)
@@ -702,6 +750,7 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
             router->gtid.seq = n_sequence;
             router->gtid.event_num = 0;
             router->gtid.timestamp = hdr.timestamp;
+            avro_workers_new_trx(router);
 
             /* GTID event flags check, for 10.0 and 10.1 */
             if ((flags & (MARIADB_FL_DDL | MARIADB_FL_STANDALONE)) == 0)
@@ -737,7 +786,7 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
                 update_used_tables(router);
                 avro_flush_all_tables(router);
                 avro_save_conversion_state(router);
-                notify_all_clients(router);
+                notify_table_clients(router);
                 total_rows += router->row_count;
                 total_commits += router->trx_count;
                 router->row_count = router->trx_count = 0;
@@ -845,13 +894,129 @@ void avro_load_metadata_from_schemas(AVRO_INSTANCE *router)
     globfree(&files);
 }
 
+/**
+ * @brief Start a new file for a table if its file is too large or too old
+ *
+ * The version of the table is incremented in the same way as when the table
+ * is altered. The new file is created by the next table map event of the
+ * table, so the records of a transaction are never split between files.
+ *
+ * @param router Avro router instance
+ * @param ident Table identifier
+ * @param table The table being written
+ * @param now Current time
+ */
+static void rotate_if_needed(AVRO_INSTANCE *router, char *ident, AVRO_TABLE *table, time_t now)
+{
+    long size = ftell(table->avro_file->file);
+
+    if (size > table->avro_file->header_end_pos &&
+        ((router->rotate_size > 0 && (uint64_t)size >= router->rotate_size) ||
+         (router->rotate_time > 0 && now - table->created >= router->rotate_time)))
+    {
+        TABLE_CREATE *create = hashtable_fetch(router->created_tables, ident);
+
+        /** An unused version is already waiting for the next table map event */
+        if (create && create->was_used && create->version < TABLE_MAP_VERSION_MAX)
+        {
+            create->version++;
+            create->was_used = false;
+            router->n_rotated++;
+            MXS_INFO("Starting a new file for table %s, the size of '%s' is %ld bytes.",
+                     ident, table->filename, size);
+        }
+    }
+}
+
+/**
+ * @brief Remove an Avro file, its schema and its index entries
+ *
+ * @param router Avro router instance
+ * @param path Absolute path to the Avro file
+ */
+static void remove_avro_file(AVRO_INSTANCE *router, const char *path)
+{
+    char schema[PATH_MAX + 1];
+    char err[STRERROR_BUFLEN];
+
+    /** The schema has the same name with the .avsc suffix */
+    snprintf(schema, sizeof(schema), "%s", path);
+    char *suffix = strrchr(schema, '.');
+    ss_dassert(suffix);
+    strcpy(suffix, ".avsc");
+
+    if (unlink(path) == -1)
+    {
+        MXS_ERROR("Failed to remove Avro file '%s': %d, %s", path,
+                  errno, strerror_r(errno, err, sizeof(err)));
+        return;
+    }
+
+    if (unlink(schema) == -1 && errno != ENOENT)
+    {
+        MXS_ERROR("Failed to remove Avro schema '%s': %d, %s", schema,
+                  errno, strerror_r(errno, err, sizeof(err)));
+    }
+
+    avro_index_remove_file(router, strrchr(path, '/') + 1);
+    router->n_removed++;
+    MXS_NOTICE("Removed old Avro file '%s'.", path);
+}
+
+/**
+ * @brief Remove the old files of a table
+ *
+ * A file is removed if the table has more than @c retention_files newer files
+ * or if it was last written over @c retention_time seconds ago. The newest
+ * file of a table is never removed as it is the file being written.
+ *
+ * @param router Avro router instance
+ * @param ident Table identifier
+ * @param now Current time
+ */
+static void remove_old_files(AVRO_INSTANCE *router, const char *ident, time_t now)
+{
+    char path[PATH_MAX + 1];
+    snprintf(path, sizeof(path), "%s/%s.[0-9][0-9][0-9][0-9][0-9][0-9].avro",
+             router->avrodir, ident);
+    glob_t files;
+
+    if (glob(path, 0, NULL, &files) == 0)
+    {
+        /** The files are sorted by their version */
+        for (size_t i = 0; i + 1 < files.gl_pathc; i++)
+        {
+            struct stat st;
+
+            if ((router->retention_files > 0 &&
+                 files.gl_pathc - i > (size_t)router->retention_files) ||
+                (router->retention_time > 0 && stat(files.gl_pathv[i], &st) == 0 &&
+                 now - st.st_mtime >= router->retention_time))
+            {
+                remove_avro_file(router, files.gl_pathv[i]);
+            }
+        }
+    }
+
+    globfree(&files);
+}
+
 /**
  * @brief Flush all Avro records to disk
+ *
+ * The files that have grown too large or too old are rotated after the
+ * records are written and the old files are removed if a retention policy
+ * is configured.
+ *
  * @param router Avro router instance
  */
 void avro_flush_all_tables(AVRO_INSTANCE *router)
 {
+    /** Only the records the workers have written can be flushed */
+    avro_workers_wait(router);
+
     HASHITERATOR *iter = hashtable_iterator(router->open_tables);
+    time_t now = time(NULL);
 
     if (iter)
     {
@@ -862,14 +1027,39 @@ void avro_flush_all_tables(AVRO_INSTANCE *router)
 
             if (table)
             {
-                avro_file_writer_flush(table->avro_file);
+                if (!avro_table_write_block(table))
+                {
+                    MXS_ERROR("Failed to write Avro data block to '%s'.", table->filename);
+                }
+                else if (router->rotate_size > 0 || router->rotate_time > 0)
+                {
+                    rotate_if_needed(router, key, table, now);
+                }
             }
         }
         hashtable_iterator_free(iter);
     }
 
-    /** Update the GTID index */
+    /** The records must be delivered before the conversion state is saved */
+    avro_kafka_flush(router);
+
+    /** Update the GTID index and the GTID ranges of the files */
     avro_update_index(router);
+    avro_update_segments(router);
+
+    if ((router->retention_time > 0 || router->retention_files > 0) &&
+        now - router->retention_checked >= AVRO_RETENTION_FREQ &&
+        (iter = hashtable_iterator(router->created_tables)))
+    {
+        router->retention_checked = now;
+
+        char *key;
+        while ((key = (char*)hashtable_next(iter)))
+        {
+            remove_old_files(router, key, now);
+        }
+        hashtable_iterator_free(iter);
+    }
 }
 
 /**
@@ -1000,6 +1190,8 @@ void handle_query_event(AVRO_INSTANCE *router, REP_HEADER *hdr, int *pending_tra
 
     if (is_create_table_statement(router, sql, len))
     {
+        /** The workers must not use the old table definition */
+        avro_workers_wait(router);
         TABLE_CREATE *created = table_create_alloc(sql, db);
 
         if (created && !save_and_replace_table_create(router, created))
@@ -1024,6 +1216,7 @@ void handle_query_event(AVRO_INSTANCE *router, REP_HEADER *hdr, int *pending_tra
 
         TABLE_CREATE *created = hashtable_fetch(router->created_tables, full_ident);
         ss_dassert(created);
+        avro_workers_wait(router);
 
         if (created)
         {
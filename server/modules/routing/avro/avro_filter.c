@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_filter.c - Row filtering and column projection for CDC clients
+ *
+ * A client can limit the records it receives with the FIELDS and WHERE
+ * clauses of the REQUEST-DATA command. The records that do not match the
+ * predicates are not sent and the columns that were not requested are
+ * removed from the records before they are converted into JSON. The GTID,
+ * event number, event type and timestamp fields are always sent.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                 Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <avrorouter.h>
+#include <log_manager.h>
+
+/**
+ * @brief Allocate a new row filter
+ *
+ * @return New filter that matches all rows, or NULL on memory allocation error
+ */
+AVRO_ROW_FILTER* avro_filter_alloc()
+{
+    AVRO_ROW_FILTER *filter = calloc(1, sizeof(AVRO_ROW_FILTER));
+
+    if (filter == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for a row filter.");
+    }
+
+    return filter;
+}
+
+/**
+ * @brief Free a row filter
+ *
+ * @param filter Filter to free, can be NULL
+ */
+void avro_filter_free(AVRO_ROW_FILTER *filter)
+{
+    if (filter)
+    {
+        for (int i = 0; i < filter->n_fields; i++)
+        {
+            free(filter->fields[i]);
+        }
+
+        for (int i = 0; i < filter->n_predicates; i++)
+        {
+            free(filter->predicates[i].column);
+            free(filter->predicates[i].value);
+        }
+
+        free(filter->fields);
+        free(filter->predicates);
+        free(filter);
+    }
+}
+
+/**
+ * @brief Add columns to the projection of a filter
+ *
+ * @param filter Filter to modify
+ * @param list Comma separated list of column names
+ * @return True if at least one column was added
+ */
+bool avro_filter_add_fields(AVRO_ROW_FILTER *filter, const char *list)
+{
+    char buf[strlen(list) + 1];
+    char *saved, *tok;
+    bool rval = false;
+
+    strcpy(buf, list);
+
+    for (tok = strtok_r(buf, ",", &saved); tok; tok = strtok_r(NULL, ",", &saved))
+    {
+        char **fields = realloc(filter->fields, (filter->n_fields + 1) * sizeof(char*));
+
+        if (fields == NULL || (fields[filter->n_fields] = strdup(tok)) == NULL)
+        {
+            MXS_ERROR("Failed to allocate memory for a row filter.");
+            filter->fields = fields ? fields : filter->fields;
+            return false;
+        }
+
+        filter->fields = fields;
+        filter->n_fields++;
+        rval = true;
+    }
+
+    return rval;
+}
+
+/**
+ * @brief Add a predicate to a filter
+ *
+ * The predicate is of the form <column><operator><value> where the operator
+ * is one of =, !=, <, <=, > and >=. All predicates of a filter must match.
+ *
+ * @param filter Filter to modify
+ * @param str The predicate
+ * @return True if the predicate was valid and added to the filter
+ */
+bool avro_filter_add_predicate(AVRO_ROW_FILTER *filter, const char *str)
+{
+    size_t len = strcspn(str, "!<>=");
+    const char *value = str + len;
+    enum avro_filter_op op;
+
+    if (len == 0 || *value == '\0')
+    {
+        return false;
+    }
+
+    if (strncmp(value, "!=", 2) == 0)
+    {
+        op = AVRO_FILTER_NE;
+        value += 2;
+    }
+    else if (strncmp(value, "<=", 2) == 0)
+    {
+        op = AVRO_FILTER_LE;
+        value += 2;
+    }
+    else if (strncmp(value, ">=", 2) == 0)
+    {
+        op = AVRO_FILTER_GE;
+        value += 2;
+    }
+    else if (*value == '<')
+    {
+        op = AVRO_FILTER_LT;
+        value++;
+    }
+    else if (*value == '>')
+    {
+        op = AVRO_FILTER_GT;
+        value++;
+    }
+    else if (*value == '=')
+    {
+        op = AVRO_FILTER_EQ;
+        value++;
+    }
+    else
+    {
+        return false;
+    }
+
+    AVRO_PREDICATE *preds = realloc(filter->predicates,
+                                    (filter->n_predicates + 1) * sizeof(AVRO_PREDICATE));
+
+    if (preds == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for a row filter.");
+        return false;
+    }
+
+    filter->predicates = preds;
+    AVRO_PREDICATE *pred = &preds[filter->n_predicates];
+
+    pred->op = op;
+    pred->column = strndup(str, len);
+    pred->value = strdup(value);
+
+    if (pred->column == NULL || pred->value == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for a row filter.");
+        free(pred->column);
+        free(pred->value);
+        return false;
+    }
+
+    filter->n_predicates++;
+    return true;
+}
+
+/**
+ * @brief Check the result of a comparison against an operator
+ *
+ * @param op The operator
+ * @param cmp Result of the comparison, less than, equal to or greater than zero
+ * @return True if the comparison satisfies the operator
+ */
+static bool op_matches(enum avro_filter_op op, int cmp)
+{
+    switch (op)
+    {
+        case AVRO_FILTER_EQ:
+            return cmp == 0;
+        case AVRO_FILTER_NE:
+            return cmp != 0;
+        case AVRO_FILTER_LT:
+            return cmp < 0;
+        case AVRO_FILTER_LE:
+            return cmp <= 0;
+        case AVRO_FILTER_GT:
+            return cmp > 0;
+        case AVRO_FILTER_GE:
+            return cmp >= 0;
+        default:
+            ss_dassert(false);
+            return false;
+    }
+}
+
+/**
+ * @brief Check if a value matches a predicate
+ *
+ * Numbers are compared numerically and strings are compared byte by byte.
+ * A NULL value only matches the predicates `column=NULL` and `column!=value`.
+ *
+ * @param pred The predicate
+ * @param value The value of the column, NULL if the record has no such column
+ * @return True if the value matches
+ */
+static bool predicate_matches(AVRO_PREDICATE *pred, json_t *value)
+{
+    char *end;
+
+    if (value == NULL)
+    {
+        return false;
+    }
+    else if (json_is_null(value))
+    {
+        bool is_null = strcasecmp(pred->value, "NULL") == 0;
+        return pred->op == AVRO_FILTER_EQ ? is_null : pred->op == AVRO_FILTER_NE && !is_null;
+    }
+    else if (json_is_integer(value))
+    {
+        long long a = json_integer_value(value);
+        long long b = strtoll(pred->value, &end, 10);
+
+        if (*end == '\0' && end != pred->value)
+        {
+            return op_matches(pred->op, (a > b) - (a < b));
+        }
+
+        double d = strtod(pred->value, &end);
+        return *end == '\0' && end != pred->value &&
+               op_matches(pred->op, (a > d) - (a < d));
+    }
+    else if (json_is_real(value))
+    {
+        double a = json_real_value(value);
+        double b = strtod(pred->value, &end);
+        return *end == '\0' && end != pred->value &&
+               op_matches(pred->op, (a > b) - (a < b));
+    }
+    else if (json_is_string(value))
+    {
+        return op_matches(pred->op, strcmp(json_string_value(value), pred->value));
+    }
+
+    return false;
+}
+
+/**
+ * @brief Check if a record matches all predicates of a filter
+ *
+ * @param filter The filter, NULL matches all records
+ * @param row The record
+ * @return True if the record should be sent
+ */
+bool avro_filter_match(AVRO_ROW_FILTER *filter, json_t *row)
+{
+    if (filter)
+    {
+        for (int i = 0; i < filter->n_predicates; i++)
+        {
+            AVRO_PREDICATE *pred = &filter->predicates[i];
+
+            if (!predicate_matches(pred, json_object_get(row, pred->column)))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Check if a field of a record is sent to the client
+ *
+ * @param filter The filter
+ * @param name Name of the field
+ * @return True if the field is kept in the record
+ */
+static bool is_projected_field(AVRO_ROW_FILTER *filter, const char *name)
+{
+    if (strcmp(name, avro_domain) == 0 || strcmp(name, avro_server_id) == 0 ||
+        strcmp(name, avro_sequence) == 0 || strcmp(name, avro_event_number) == 0 ||
+        strcmp(name, avro_event_type) == 0 || strcmp(name, avro_timestamp) == 0)
+    {
+        return true;
+    }
+
+    for (int i = 0; i < filter->n_fields; i++)
+    {
+        if (strcmp(name, filter->fields[i]) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Remove the fields that were not requested from a record
+ *
+ * The order of the remaining fields is not changed.
+ *
+ * @param filter The filter, if NULL or if it has no fields the record is
+ * not modified
+ * @param row The record
+ */
+void avro_filter_project(AVRO_ROW_FILTER *filter, json_t *row)
+{
+    if (filter && filter->n_fields > 0)
+    {
+        const char *removed[json_object_size(row) + 1];
+        int n_removed = 0;
+
+        for (void *iter = json_object_iter(row); iter; iter = json_object_iter_next(row, iter))
+        {
+            const char *key = json_object_iter_key(iter);
+
+            if (!is_projected_field(filter, key))
+            {
+                removed[n_removed++] = key;
+            }
+        }
+
+        /** The keys are owned by the object, so they are removed only after
+         * the object has been iterated */
+        for (int i = 0; i < n_removed; i++)
+        {
+            json_object_del(row, removed[i]);
+        }
+    }
+}
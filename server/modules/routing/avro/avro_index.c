@@ -38,8 +38,20 @@
 
 void* safe_key_free(void *data);
 
-static const char insert_template[] = "INSERT INTO gtid(domain, server_id, "
-                                      "sequence, avrofile, position) values (%lu, %lu, %lu, \"%s\", %ld);";
+static const char index_insert_sql[] = "INSERT OR IGNORE INTO "GTID_TABLE_NAME"(domain, server_id, "
+                                       "sequence, avrofile, position) values (?, ?, ?, ?, ?);";
+
+static const char index_clear_sql[] = "DELETE FROM "INDEX_TABLE_NAME" WHERE filename=?;";
+
+static const char index_progress_sql[] = "INSERT INTO "INDEX_TABLE_NAME" values (?, ?);";
+
+static const char segment_insert_sql[] = "INSERT OR IGNORE INTO "SEGMENT_TABLE_NAME"(filename, "
+                                         "table_name, first_domain, first_server_id, first_sequence, "
+                                         "last_domain, last_server_id, last_sequence) "
+                                         "values (?, ?, ?, ?, ?, ?, ?, ?);";
+
+static const char segment_update_sql[] = "UPDATE "SEGMENT_TABLE_NAME" SET last_domain=?, "
+                                         "last_server_id=?, last_sequence=? WHERE filename=?;";
 
 static void set_gtid(gtid_pos_t *gtid, json_t *row)
 {
@@ -69,6 +81,112 @@ int index_query_cb(void *data, int rows, char** values, char** names)
     return 0;
 }
 
+/**
+ * @brief Prepare the statements used to update the index
+ *
+ * The statements are prepared once and reused for all indexed files.
+ *
+ * @param router Avro router instance
+ * @return True if the statements are prepared
+ */
+static bool prepare_index_statements(AVRO_INSTANCE *router)
+{
+    if (router->index_insert == NULL &&
+        sqlite3_prepare_v2(router->sqlite_handle, index_insert_sql, -1,
+                           &router->index_insert, NULL) != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to prepare GTID index insert: %s",
+                  sqlite3_errmsg(router->sqlite_handle));
+        return false;
+    }
+
+    if (router->index_clear == NULL &&
+        sqlite3_prepare_v2(router->sqlite_handle, index_clear_sql, -1,
+                           &router->index_clear, NULL) != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to prepare indexing progress update: %s",
+                  sqlite3_errmsg(router->sqlite_handle));
+        return false;
+    }
+
+    if (router->index_progress == NULL &&
+        sqlite3_prepare_v2(router->sqlite_handle, index_progress_sql, -1,
+                           &router->index_progress, NULL) != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to prepare indexing progress update: %s",
+                  sqlite3_errmsg(router->sqlite_handle));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Add the position of a GTID into the index
+ *
+ * @param router Avro router instance
+ * @param gtid GTID to add
+ * @param name Name of the Avro file
+ * @param pos Position of the data block where the GTID starts
+ */
+static void insert_gtid(AVRO_INSTANCE *router, gtid_pos_t *gtid, const char *name, long pos)
+{
+    sqlite3_stmt *stmt = router->index_insert;
+
+    sqlite3_bind_int64(stmt, 1, gtid->domain);
+    sqlite3_bind_int64(stmt, 2, gtid->server_id);
+    sqlite3_bind_int64(stmt, 3, gtid->seq);
+    sqlite3_bind_text(stmt, 4, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, pos);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+    {
+        MXS_ERROR("Failed to insert GTID %lu-%lu-%lu for %s into index database: %s",
+                  gtid->domain, gtid->server_id, gtid->seq, name,
+                  sqlite3_errmsg(router->sqlite_handle));
+    }
+
+    sqlite3_reset(stmt);
+}
+
+/**
+ * @brief Store the position up to which a file is indexed
+ *
+ * @param router Avro router instance
+ * @param name Name of the Avro file
+ * @param pos Position of the first data block that is not indexed
+ */
+static void update_index_progress(AVRO_INSTANCE *router, const char *name, long pos)
+{
+    /** The progress table has no key on the file name so the old row is
+     * removed before the new one is inserted */
+    sqlite3_stmt *clear = router->index_clear;
+    sqlite3_stmt *stmt = router->index_progress;
+
+    sqlite3_bind_text(clear, 1, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 1, pos);
+    sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+
+    if (sqlite3_step(clear) != SQLITE_DONE || sqlite3_step(stmt) != SQLITE_DONE)
+    {
+        MXS_ERROR("Failed to update indexing progress: %s",
+                  sqlite3_errmsg(router->sqlite_handle));
+    }
+
+    sqlite3_reset(clear);
+    sqlite3_reset(stmt);
+}
+
+/**
+ * @brief Index the new data blocks of an Avro file
+ *
+ * The first GTID of each data block is stored in the index. All of the
+ * inserts and the updated indexing progress of the file are done in one
+ * transaction.
+ *
+ * @param router Avro router instance
+ * @param filename Path to the Avro file
+ */
 void avro_index_file(AVRO_INSTANCE *router, const char* filename)
 {
     MAXAVRO_FILE *file = maxavro_file_open(filename);
@@ -85,7 +203,8 @@ void avro_index_file(AVRO_INSTANCE *router, const char* filename)
             long pos = -1;
             name++;
 
-            snprintf(sql, sizeof(sql), "SELECT position FROM "INDEX_TABLE_NAME
+            /** Older versions stored more than one row per file */
+            snprintf(sql, sizeof(sql), "SELECT max(position) FROM "INDEX_TABLE_NAME
                      " WHERE filename=\"%s\";", name);
 
             if (sqlite3_exec(router->sqlite_handle, sql, index_query_cb, &pos, &errmsg) != SQLITE_OK)
@@ -98,7 +217,8 @@ void avro_index_file(AVRO_INSTANCE *router, const char* filename)
             }
 
             /** Continue from last position */
-            if (pos > 0 && !maxavro_record_set_pos(file, pos))
+            if ((pos > 0 && !maxavro_record_set_pos(file, pos)) ||
+                !prepare_index_statements(router))
             {
                 maxavro_file_close(file);
                 return;
@@ -120,23 +240,13 @@ void avro_index_file(AVRO_INSTANCE *router, const char* filename)
                 {
                     gtid_pos_t gtid;
                     set_gtid(&gtid, row);
+                    json_decref(row);
 
                     if (prev_gtid.domain != gtid.domain ||
                         prev_gtid.server_id != gtid.server_id ||
                         prev_gtid.seq != gtid.seq)
                     {
-                        snprintf(sql, sizeof(sql), insert_template, gtid.domain,
-                                 gtid.server_id, gtid.seq, name, file->block_start_pos);
-                        if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL,
-                                         &errmsg) != SQLITE_OK)
-                        {
-                            MXS_ERROR("Failed to insert GTID %lu-%lu-%lu for %s "
-                                      "into index database: %s", gtid.domain,
-                                      gtid.server_id, gtid.seq, name, errmsg);
-
-                        }
-                        sqlite3_free(errmsg);
-                        errmsg = NULL;
+                        insert_gtid(router, &gtid, name, file->block_start_pos);
                         prev_gtid = gtid;
                     }
                 }
@@ -147,21 +257,13 @@ void avro_index_file(AVRO_INSTANCE *router, const char* filename)
             }
             while (maxavro_next_block(file));
 
+            update_index_progress(router, name, file->block_start_pos);
+
             if (sqlite3_exec(router->sqlite_handle, "COMMIT", NULL, NULL, &errmsg) != SQLITE_OK)
             {
                 MXS_ERROR("Failed to commit transaction: %s", errmsg);
             }
             sqlite3_free(errmsg);
-
-            snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO "INDEX_TABLE_NAME
-                     " values (%lu, \"%s\");", file->block_start_pos, name);
-            if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL,
-                             &errmsg) != SQLITE_OK)
-            {
-                MXS_ERROR("Failed to update indexing progress: %s", errmsg);
-            }
-            sqlite3_free(errmsg);
-            errmsg = NULL;
         }
         else
         {
@@ -201,6 +303,124 @@ void avro_update_index(AVRO_INSTANCE* router)
     globfree(&files);
 }
 
+/**
+ * @brief Store the GTID ranges of the files written since the last flush
+ *
+ * The first GTID of a file is stored when the file is first flushed and the
+ * last GTID is updated on every flush. The clients use the ranges to find the
+ * file where a GTID is without reading the older files.
+ *
+ * @param router Avro router instance
+ */
+void avro_update_segments(AVRO_INSTANCE *router)
+{
+    if ((router->segment_insert == NULL &&
+         sqlite3_prepare_v2(router->sqlite_handle, segment_insert_sql, -1,
+                            &router->segment_insert, NULL) != SQLITE_OK) ||
+        (router->segment_update == NULL &&
+         sqlite3_prepare_v2(router->sqlite_handle, segment_update_sql, -1,
+                            &router->segment_update, NULL) != SQLITE_OK))
+    {
+        MXS_ERROR("Failed to prepare file range update: %s",
+                  sqlite3_errmsg(router->sqlite_handle));
+        return;
+    }
+
+    HASHITERATOR *iter = hashtable_iterator(router->open_tables);
+
+    if (iter)
+    {
+        sqlite3_stmt *insert = router->segment_insert;
+        sqlite3_stmt *update = router->segment_update;
+        bool in_trx = false;
+        char *key;
+
+        while ((key = (char*)hashtable_next(iter)))
+        {
+            AVRO_TABLE *table = hashtable_fetch(router->open_tables, key);
+
+            if (table == NULL || !table->has_rows || !table->new_data)
+            {
+                continue;
+            }
+
+            if (!in_trx)
+            {
+                char *errmsg;
+                if (sqlite3_exec(router->sqlite_handle, "BEGIN", NULL, NULL, &errmsg) != SQLITE_OK)
+                {
+                    MXS_ERROR("Failed to start transaction: %s", errmsg);
+                }
+                sqlite3_free(errmsg);
+                in_trx = true;
+            }
+
+            const char *name = strrchr(table->filename, '/');
+            name = name ? name + 1 : table->filename;
+
+            sqlite3_bind_text(insert, 1, name, -1, SQLITE_STATIC);
+            sqlite3_bind_text(insert, 2, key, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(insert, 3, table->first_gtid.domain);
+            sqlite3_bind_int64(insert, 4, table->first_gtid.server_id);
+            sqlite3_bind_int64(insert, 5, table->first_gtid.seq);
+            sqlite3_bind_int64(insert, 6, table->last_gtid.domain);
+            sqlite3_bind_int64(insert, 7, table->last_gtid.server_id);
+            sqlite3_bind_int64(insert, 8, table->last_gtid.seq);
+
+            sqlite3_bind_int64(update, 1, table->last_gtid.domain);
+            sqlite3_bind_int64(update, 2, table->last_gtid.server_id);
+            sqlite3_bind_int64(update, 3, table->last_gtid.seq);
+            sqlite3_bind_text(update, 4, name, -1, SQLITE_STATIC);
+
+            if (sqlite3_step(insert) != SQLITE_DONE || sqlite3_step(update) != SQLITE_DONE)
+            {
+                MXS_ERROR("Failed to update the GTID range of file '%s': %s",
+                          name, sqlite3_errmsg(router->sqlite_handle));
+            }
+
+            sqlite3_reset(insert);
+            sqlite3_reset(update);
+        }
+
+        hashtable_iterator_free(iter);
+
+        if (in_trx)
+        {
+            char *errmsg;
+            if (sqlite3_exec(router->sqlite_handle, "COMMIT", NULL, NULL, &errmsg) != SQLITE_OK)
+            {
+                MXS_ERROR("Failed to commit transaction: %s", errmsg);
+            }
+            sqlite3_free(errmsg);
+        }
+    }
+}
+
+/**
+ * @brief Remove the index entries of a removed file
+ *
+ * @param router Avro router instance
+ * @param name Name of the Avro file without the directory
+ */
+void avro_index_remove_file(AVRO_INSTANCE *router, const char *name)
+{
+    char sql[AVRO_SQL_BUFFER_SIZE];
+    char *errmsg;
+
+    snprintf(sql, sizeof(sql), "BEGIN;"
+             "DELETE FROM "GTID_TABLE_NAME" WHERE avrofile=\"%s\";"
+             "DELETE FROM "INDEX_TABLE_NAME" WHERE filename=\"%s\";"
+             "DELETE FROM "SEGMENT_TABLE_NAME" WHERE filename=\"%s\";"
+             "COMMIT;", name, name, name);
+
+    if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to remove file '%s' from the index: %s", name, errmsg);
+        sqlite3_exec(router->sqlite_handle, "ROLLBACK", NULL, NULL, NULL);
+    }
+    sqlite3_free(errmsg);
+}
+
 /** The SQL for the in-memory used_tables table */
 static const char *insert_sql = "INSERT OR IGNORE INTO "MEMORY_TABLE_NAME
                                 "(domain, server_id, sequence, binlog_timestamp, table_name)"
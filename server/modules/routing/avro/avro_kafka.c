@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_kafka.c - Publishing of the converted records to Kafka
+ *
+ * With the kafka_brokers option, every record that the conversion adds to an
+ * Avro file is also published to Kafka. Each table has a topic of its own and
+ * the records are keyed with the primary key of the table, so all changes to
+ * a row go to the same partition in the order they were converted. Records of
+ * tables without a primary key have no key.
+ *
+ * The records are published either in the Avro binary encoding, which is the
+ * record exactly as it is stored in the Avro file, or as the same JSON objects
+ * that the CDC clients receive. Batching and compression are done by
+ * librdkafka. The producer is flushed before the conversion state is saved,
+ * so a record that was converted before a restart has been delivered.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                 Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <avrorouter.h>
+#include <log_manager.h>
+#include <atomic.h>
+#include <dcb.h>
+
+#if defined(HAVE_LIBRDKAFKA)
+
+#include <librdkafka/rdkafka.h>
+
+/** How long a flush waits for the queued records to be delivered, in milliseconds */
+#define AVRO_KAFKA_FLUSH_TIMEOUT 10000
+
+/** How long to wait for room in a full producer queue, in milliseconds */
+#define AVRO_KAFKA_POLL_TIMEOUT 100
+
+/** The Kafka producer of a router */
+struct avro_kafka
+{
+    rd_kafka_t            *producer;     /*< The librdkafka producer */
+    enum avro_data_format  format;       /*< Format of the published records */
+    const char            *topic_prefix; /*< Prefix of the topic names */
+    int64_t                n_queued;     /*< Records handed to the producer */
+    int64_t                n_delivered;  /*< Records acknowledged by the brokers */
+    int64_t                n_failed;     /*< Records that could not be published */
+    int64_t                n_bytes;      /*< Bytes of the delivered records */
+};
+
+/** The Kafka topic of a table */
+struct avro_kafka_topic
+{
+    struct avro_kafka *kafka;  /*< The producer */
+    rd_kafka_topic_t  *topic;  /*< The librdkafka topic */
+};
+
+/**
+ * @brief Count the delivery reports of the records
+ *
+ * This is called by librdkafka from the threads that poll the producer.
+ */
+static void delivery_report(rd_kafka_t *rk, const rd_kafka_message_t *msg, void *opaque)
+{
+    struct avro_kafka *kafka = (struct avro_kafka*)opaque;
+
+    if (msg->err)
+    {
+        MXS_ERROR("Failed to deliver a record to Kafka topic '%s': %s",
+                  rd_kafka_topic_name(msg->rkt), rd_kafka_err2str(msg->err));
+        atomic_add_int64(&kafka->n_failed, 1);
+    }
+    else
+    {
+        atomic_add_int64(&kafka->n_delivered, 1);
+        atomic_add_int64(&kafka->n_bytes, msg->len);
+    }
+}
+
+/**
+ * @brief Set a librdkafka configuration value
+ *
+ * @param conf The configuration
+ * @param name Name of the value
+ * @param value The value
+ * @return True if the value was accepted
+ */
+static bool set_kafka_option(rd_kafka_conf_t *conf, const char *name, const char *value)
+{
+    char errstr[512];
+
+    if (rd_kafka_conf_set(conf, name, value, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK)
+    {
+        MXS_ERROR("Invalid Kafka setting '%s=%s': %s", name, value, errstr);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Create the Kafka producer of a router
+ *
+ * @param router Avro router instance
+ * @return True if the producer was created or Kafka is not used, false on error
+ */
+bool avro_kafka_init(AVRO_INSTANCE *router)
+{
+    AVRO_KAFKA_CONFIG *config = &router->kafka_config;
+
+    if (config->brokers == NULL)
+    {
+        return true;
+    }
+
+    struct avro_kafka *kafka = calloc(1, sizeof(struct avro_kafka));
+    rd_kafka_conf_t *conf = rd_kafka_conf_new();
+
+    if (kafka == NULL || conf == NULL)
+    {
+        MXS_ERROR("[%s] Failed to allocate memory for the Kafka producer.",
+                  router->service->name);
+        free(kafka);
+        if (conf)
+        {
+            rd_kafka_conf_destroy(conf);
+        }
+        return false;
+    }
+
+    char value[32];
+    bool ok = set_kafka_option(conf, "metadata.broker.list", config->brokers) &&
+              (config->compression == NULL ||
+               set_kafka_option(conf, "compression.codec", config->compression));
+
+    if (ok && config->batch_size > 0)
+    {
+        snprintf(value, sizeof(value), "%d", config->batch_size);
+        ok = set_kafka_option(conf, "batch.num.messages", value);
+    }
+
+    if (ok && config->linger_ms >= 0)
+    {
+        snprintf(value, sizeof(value), "%d", config->linger_ms);
+        ok = set_kafka_option(conf, "queue.buffering.max.ms", value);
+    }
+
+    if (ok)
+    {
+        char errstr[512];
+        rd_kafka_conf_set_opaque(conf, kafka);
+        rd_kafka_conf_set_dr_msg_cb(conf, delivery_report);
+
+        /** On success, the producer takes the ownership of the configuration */
+        if ((kafka->producer = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr))))
+        {
+            conf = NULL;
+        }
+        else
+        {
+            MXS_ERROR("[%s] Failed to create the Kafka producer: %s",
+                      router->service->name, errstr);
+            ok = false;
+        }
+    }
+
+    if (conf)
+    {
+        rd_kafka_conf_destroy(conf);
+    }
+
+    if (!ok)
+    {
+        free(kafka);
+        return false;
+    }
+
+    kafka->format = config->format;
+    kafka->topic_prefix = config->topic_prefix ? config->topic_prefix : "";
+    router->kafka = kafka;
+
+    MXS_NOTICE("[%s] Publishing %s records to the Kafka brokers at %s.", router->service->name,
+               config->format == AVRO_FORMAT_AVRO ? "Avro" : "JSON", config->brokers);
+    return true;
+}
+
+/**
+ * @brief Open the Kafka topic of a table
+ *
+ * @param router Avro router instance
+ * @param table Fully qualified name of the table
+ * @return The topic or NULL if Kafka is not used or an error occurred
+ */
+struct avro_kafka_topic* avro_kafka_topic_open(AVRO_INSTANCE *router, const char *table)
+{
+    struct avro_kafka *kafka = router->kafka;
+    struct avro_kafka_topic *topic = NULL;
+
+    if (kafka)
+    {
+        char name[strlen(kafka->topic_prefix) + strlen(table) + 1];
+        sprintf(name, "%s%s", kafka->topic_prefix, table);
+
+        if ((topic = malloc(sizeof(struct avro_kafka_topic))) == NULL)
+        {
+            MXS_ERROR("Failed to allocate memory for Kafka topic '%s'.", name);
+        }
+        else if ((topic->topic = rd_kafka_topic_new(kafka->producer, name, NULL)) == NULL)
+        {
+            MXS_ERROR("Failed to create Kafka topic '%s': %s", name,
+                      rd_kafka_err2str(rd_kafka_last_error()));
+            free(topic);
+            topic = NULL;
+        }
+        else
+        {
+            topic->kafka = kafka;
+        }
+    }
+
+    return topic;
+}
+
+/**
+ * @brief Close the Kafka topic of a table
+ *
+ * The records of the topic that are still queued are delivered by the producer.
+ *
+ * @param topic Topic to close, may be NULL
+ */
+void avro_kafka_topic_close(struct avro_kafka_topic *topic)
+{
+    if (topic)
+    {
+        rd_kafka_topic_destroy(topic->topic);
+        free(topic);
+    }
+}
+
+/**
+ * @brief Build the message key of a record from the primary key columns
+ *
+ * @param record The record
+ * @param create The table definition
+ * @return The key as a JSON object or NULL if memory allocation failed
+ */
+static char* record_key(json_t *record, TABLE_CREATE *create)
+{
+    char *rval = NULL;
+    json_t *key = json_object();
+
+    if (key)
+    {
+        for (int i = 0; i < create->n_primary_key; i++)
+        {
+            json_t *value = json_object_get(record, create->primary_key[i]);
+
+            if (value)
+            {
+                json_object_set(key, create->primary_key[i], value);
+            }
+        }
+
+        rval = json_dumps(key, JSON_PRESERVE_ORDER | JSON_COMPACT);
+        json_decref(key);
+    }
+
+    return rval;
+}
+
+/**
+ * @brief Publish a record to the Kafka topic of its table
+ *
+ * This is called by the thread that converts the table, so the records of a
+ * table are queued in the order they are in the Avro file. When the queue of
+ * the producer is full, the conversion waits until there is room in it.
+ *
+ * @param table Avro file of the table
+ * @param create The table definition
+ * @param data The Avro binary encoding of the record
+ * @param len Length of @c data
+ */
+void avro_kafka_produce(AVRO_TABLE *table, TABLE_CREATE *create, const uint8_t *data, size_t len)
+{
+    struct avro_kafka_topic *topic = table->kafka_topic;
+
+    if (topic == NULL)
+    {
+        return;
+    }
+
+    struct avro_kafka *kafka = topic->kafka;
+    json_t *record = NULL;
+    char *key = NULL;
+    void *payload = (void*)data;
+    size_t payload_len = len;
+    int flags = RD_KAFKA_MSG_F_COPY;
+
+    /** The JSON format and the key need the values of the record */
+    if ((kafka->format == AVRO_FORMAT_JSON || create->n_primary_key > 0) &&
+        (record = maxavro_record_decode_json(table->avro_file->schema, data, len)) == NULL)
+    {
+        MXS_ERROR("Failed to decode a record of '%s' for Kafka.", table->filename);
+        atomic_add_int64(&kafka->n_failed, 1);
+        return;
+    }
+
+    if (create->n_primary_key > 0 && (key = record_key(record, create)) == NULL)
+    {
+        MXS_ERROR("Failed to create the Kafka key of a record of '%s'.", table->filename);
+        atomic_add_int64(&kafka->n_failed, 1);
+        json_decref(record);
+        return;
+    }
+
+    if (kafka->format == AVRO_FORMAT_JSON)
+    {
+        if ((payload = json_dumps(record, JSON_PRESERVE_ORDER | JSON_COMPACT)) == NULL)
+        {
+            MXS_ERROR("Failed to create the JSON of a record of '%s'.", table->filename);
+            atomic_add_int64(&kafka->n_failed, 1);
+            json_decref(record);
+            free(key);
+            return;
+        }
+
+        /** The producer frees the JSON once the record is delivered */
+        payload_len = strlen(payload);
+        flags = RD_KAFKA_MSG_F_FREE;
+    }
+
+    int rc;
+
+    while ((rc = rd_kafka_produce(topic->topic, RD_KAFKA_PARTITION_UA, flags, payload,
+                                  payload_len, key, key ? strlen(key) : 0, NULL)) == -1 &&
+           rd_kafka_last_error() == RD_KAFKA_RESP_ERR__QUEUE_FULL)
+    {
+        rd_kafka_poll(kafka->producer, AVRO_KAFKA_POLL_TIMEOUT);
+    }
+
+    if (rc == -1)
+    {
+        MXS_ERROR("Failed to publish a record to Kafka topic '%s': %s",
+                  rd_kafka_topic_name(topic->topic), rd_kafka_err2str(rd_kafka_last_error()));
+        atomic_add_int64(&kafka->n_failed, 1);
+
+        if (flags == RD_KAFKA_MSG_F_FREE)
+        {
+            free(payload);
+        }
+    }
+    else
+    {
+        atomic_add_int64(&kafka->n_queued, 1);
+    }
+
+    /** Serve the delivery reports */
+    rd_kafka_poll(kafka->producer, 0);
+
+    json_decref(record);
+    free(key);
+}
+
+/**
+ * @brief Wait for the queued records to be delivered
+ *
+ * @param router Avro router instance
+ */
+void avro_kafka_flush(AVRO_INSTANCE *router)
+{
+    if (router->kafka)
+    {
+        rd_kafka_resp_err_t err = rd_kafka_flush(router->kafka->producer, AVRO_KAFKA_FLUSH_TIMEOUT);
+
+        if (err != RD_KAFKA_RESP_ERR_NO_ERROR)
+        {
+            MXS_WARNING("[%s] %d records were not delivered to Kafka in %d seconds: %s",
+                        router->service->name, rd_kafka_outq_len(router->kafka->producer),
+                        AVRO_KAFKA_FLUSH_TIMEOUT / 1000, rd_kafka_err2str(err));
+        }
+    }
+}
+
+/**
+ * @brief Print the statistics of the Kafka producer
+ *
+ * @param router Avro router instance
+ * @param dcb DCB to print to
+ */
+void avro_kafka_diagnostics(AVRO_INSTANCE *router, DCB *dcb)
+{
+    struct avro_kafka *kafka = router->kafka;
+
+    if (kafka)
+    {
+        dcb_printf(dcb, "\tKafka brokers:                       %s\n",
+                   router->kafka_config.brokers);
+        dcb_printf(dcb, "\tKafka records queued:                %ld\n", kafka->n_queued);
+        dcb_printf(dcb, "\tKafka records delivered:             %ld\n", kafka->n_delivered);
+        dcb_printf(dcb, "\tKafka records failed:                %ld\n", kafka->n_failed);
+        dcb_printf(dcb, "\tKafka bytes delivered:               %ld\n", kafka->n_bytes);
+        dcb_printf(dcb, "\tKafka records waiting for delivery:  %d\n",
+                   rd_kafka_outq_len(kafka->producer));
+    }
+}
+
+#else
+
+bool avro_kafka_init(AVRO_INSTANCE *router)
+{
+    if (router->kafka_config.brokers)
+    {
+        MXS_ERROR("[%s] The avrorouter was built without librdkafka, the "
+                  "'kafka_brokers' option can not be used.", router->service->name);
+        return false;
+    }
+
+    return true;
+}
+
+struct avro_kafka_topic* avro_kafka_topic_open(AVRO_INSTANCE *router, const char *table)
+{
+    return NULL;
+}
+
+void avro_kafka_topic_close(struct avro_kafka_topic *topic)
+{
+}
+
+void avro_kafka_produce(AVRO_TABLE *table, TABLE_CREATE *create, const uint8_t *data, size_t len)
+{
+}
+
+void avro_kafka_flush(AVRO_INSTANCE *router)
+{
+}
+
+void avro_kafka_diagnostics(AVRO_INSTANCE *router, DCB *dcb)
+{
+}
+
+#endif
@@ -16,6 +16,7 @@
 #include <jansson.h>
 #include <avrorouter.h>
 #include <strings.h>
+#include <atomic.h>
 
 #define WRITE_EVENT         0
 #define UPDATE_EVENT        1
@@ -28,9 +29,8 @@ static bool warn_large_enumset = false; /**< Remove when support for ENUM/SET va
                                          * larger than 255 is added */
 
 uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create,
-                                avro_value_t *record, uint8_t *ptr,
+                                MAXAVRO_DATABLOCK *block, uint8_t *ptr,
                                 uint8_t *columns_present);
-void notify_all_clients(AVRO_INSTANCE *router);
 void add_used_table(AVRO_INSTANCE* router, const char* table);
 
 /**
@@ -102,13 +102,18 @@ bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr
                     snprintf(filepath, sizeof(filepath), "%s/%s.%06d.avro",
                              router->avrodir, table_ident, map->version);
 
+                    /** The workers must not use the old file and table map */
+                    avro_workers_wait(router);
+
                     /** Close the file and open a new one */
                     hashtable_delete(router->open_tables, table_ident);
-                    AVRO_TABLE *avro_table = avro_table_alloc(filepath, json_schema);
+                    AVRO_TABLE *avro_table = avro_table_alloc(filepath, json_schema, router->codec);
 
                     if (avro_table)
                     {
                         bool notify = old != NULL;
+                        avro_table->stats = avro_get_table_stats(router, table_ident);
+                        avro_table->kafka_topic = avro_kafka_topic_open(router, table_ident);
 
                         if (old)
                         {
@@ -124,7 +129,8 @@ bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr
 
                         if (notify)
                         {
-                            notify_all_clients(router);
+                            /** The clients of the old version move to the new file */
+                            avro_notify_subscribers(router, table_ident);
                         }
                     }
                     else
@@ -165,55 +171,101 @@ bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr
 }
 
 /**
- * @brief Set common field values and update the GTID subsequence counter
+ * @brief Add the common field values of a record
  *
- * This sets the domain, server ID, sequence and event position fields of
- * the GTID. It also sets the event timestamp and event type fields.
+ * This adds the domain, server ID, sequence and event position fields of
+ * the GTID. It also adds the event timestamp and event type fields.
  *
- * @param router Avro router instance
+ * @param gtid GTID of the transaction
+ * @param event_num GTID subsequence number of the record
  * @param hdr Replication header
  * @param event_type Event type
- * @param record Record to prepare
+ * @param block Data block where the record is added
  */
-static void prepare_record(AVRO_INSTANCE *router, REP_HEADER *hdr,
-                           int event_type, avro_value_t *record)
+static void prepare_record(gtid_pos_t *gtid, int event_num, REP_HEADER *hdr,
+                           int event_type, MAXAVRO_DATABLOCK *block)
 {
-    avro_value_t field;
-    avro_value_get_by_name(record, avro_domain, &field, NULL);
-    avro_value_set_int(&field, router->gtid.domain);
+    /** The GTID fields are of type int */
+    maxavro_datablock_add_integer(block, (int32_t)gtid->domain);
+    maxavro_datablock_add_integer(block, (int32_t)gtid->server_id);
+    maxavro_datablock_add_integer(block, (int32_t)gtid->seq);
+    maxavro_datablock_add_integer(block, event_num);
+    maxavro_datablock_add_integer(block, (int32_t)hdr->timestamp);
+
+    /** Enums are stored as the index of the symbol */
+    maxavro_datablock_add_integer(block, event_type);
+}
 
-    avro_value_get_by_name(record, avro_server_id, &field, NULL);
-    avro_value_set_int(&field, router->gtid.server_id);
+/**
+ * @brief Add one record of a row event to the data block of a table
+ *
+ * If the record could not be added, the data block is left as it was before
+ * the record. When the data block grows large, it is written to the file.
+ *
+ * @param table Avro file of the table
+ * @param map Table map of the table
+ * @param hdr Replication header
+ * @param event_type Event type of the record
+ * @param gtid GTID of the transaction
+ * @param event_num The last used GTID subsequence number, updated atomically
+ * @param ptr Pointer to the start of the row
+ * @param col_present The bitfield of the columns that are present in the row
+ * @return Pointer to the first byte after the row
+ */
+static uint8_t* add_record(AVRO_TABLE *table, TABLE_MAP *map, REP_HEADER *hdr, int event_type,
+                           gtid_pos_t *gtid, int *event_num, uint8_t *ptr, uint8_t *col_present)
+{
+    MAXAVRO_DATABLOCK *block = table->avro_block;
+    size_t start = block->datasize;
 
-    avro_value_get_by_name(record, avro_sequence, &field, NULL);
-    avro_value_set_int(&field, router->gtid.seq);
+    prepare_record(gtid, atomic_add(event_num, 1) + 1, hdr, event_type, block);
+    ptr = process_row_event_data(map, map->table_create, block, ptr, col_present);
 
-    router->gtid.event_num++;
-    avro_value_get_by_name(record, avro_event_number, &field, NULL);
-    avro_value_set_int(&field, router->gtid.event_num);
+    if (maxavro_get_error(table->avro_file) != MAXAVRO_ERR_NONE)
+    {
+        MXS_ERROR("Failed to add record to '%s': %s", table->filename,
+                  maxavro_get_error_string(table->avro_file));
+        table->avro_file->last_error = MAXAVRO_ERR_NONE;
+        block->datasize = start;
+    }
+    else
+    {
+        block->records++;
+        table->new_data = true;
+
+        if (table->stats)
+        {
+            table->stats->n_rows++;
+        }
 
-    avro_value_get_by_name(record, avro_timestamp, &field, NULL);
-    avro_value_set_int(&field, hdr->timestamp);
+        avro_kafka_produce(table, map->table_create, block->buffer + start,
+                           block->datasize - start);
 
-    avro_value_get_by_name(record, avro_event_type, &field, NULL);
-    avro_value_set_enum(&field, event_type);
+        if (block->datasize >= AVRO_BLOCK_SIZE_MAX && !avro_table_write_block(table))
+        {
+            MXS_ERROR("Failed to write Avro data block to '%s'.", table->filename);
+            table->avro_file->last_error = MAXAVRO_ERR_NONE;
+        }
+    }
+
+    return ptr;
 }
 
 /**
- * @brief Handle a single RBR row event
- *
- * These events contain the changes in the data. This function assumes that full
- * row image is sent in every row event.
+ * @brief Find the table of a RBR row event
  *
  * @param router Avro router instance
  * @param hdr Replication header
  * @param ptr Pointer to the start of the event
- * @return True on succcess, false on error
+ * @param map The table map of the event is stored here, NULL for dummy events
+ * @param table The Avro file of the table is stored here
+ * @param ident The table identifier is stored here
+ * @param len Size of @c ident
+ * @return True if the event can be processed, false on error
  */
-bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
+bool row_event_find_table(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr,
+                          TABLE_MAP **map, AVRO_TABLE **table, char *ident, size_t len)
 {
-    bool rval = false;
-    uint8_t *start = ptr;
     uint8_t table_id_size = router->event_type_hdr_lens[hdr->event_type] == 6 ? 4 : 6;
     uint64_t table_id = 0;
 
@@ -226,7 +278,9 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
     /** Replication flags, currently ignored for the most part. */
     uint16_t flags = 0;
     memcpy(&flags, ptr, 2);
-    ptr += 2;
+
+    *map = NULL;
+    *table = NULL;
 
     if (table_id == TABLE_DUMMY_ID && flags & ROW_EVENT_END_STATEMENT)
     {
@@ -235,6 +289,54 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
         return true;
     }
 
+    /** There should always be a table map event prior to a row event.
+     * TODO: Make the active_maps dynamic */
+    TABLE_MAP *tmap = router->active_maps[table_id % sizeof(router->active_maps)];
+    ss_dassert(tmap);
+
+    if (tmap == NULL)
+    {
+        MXS_ERROR("Row event for unknown table mapped to ID %lu. Data will not "
+                  "be processed.", table_id);
+        return false;
+    }
+
+    snprintf(ident, len, "%s.%s", tmap->database, tmap->table);
+
+    if ((*table = hashtable_fetch(router->open_tables, ident)) == NULL)
+    {
+        MXS_ERROR("Avro file handle was not found for table %s.%s. See earlier"
+                  " errors for more details.", tmap->database, tmap->table);
+        return false;
+    }
+
+    *map = tmap;
+    return true;
+}
+
+/**
+ * @brief Write the rows of a RBR row event into the Avro file of the table
+ *
+ * This function assumes that full row image is sent in every row event.
+ *
+ * @param hdr Replication header
+ * @param hdr_len Post-header length of the event type
+ * @param ptr Pointer to the start of the event
+ * @param map Table map of the table
+ * @param table Avro file of the table
+ * @param gtid GTID of the transaction
+ * @param event_num The last used GTID subsequence number, updated atomically
+ * @return True on succcess, false on error
+ */
+bool row_event_write(REP_HEADER *hdr, uint8_t hdr_len, uint8_t *ptr, TABLE_MAP *map,
+                     AVRO_TABLE *table, gtid_pos_t *gtid, int *event_num)
+{
+    uint8_t *start = ptr;
+    TABLE_CREATE* create = map->table_create;
+
+    /** Skip the table ID and the replication flags */
+    ptr += (hdr_len == 6 ? 4 : 6) + 2;
+
     /** Newer replication events have extra data stored in the header. MariaDB
      * 10.1 does not use these and instead use the v1 events */
     if (hdr->event_type > DELETE_ROWS_EVENTv1)
@@ -268,152 +370,92 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
         ptr += coldata_size;
     }
 
-    /** There should always be a table map event prior to a row event.
-     * TODO: Make the active_maps dynamic */
-    TABLE_MAP *map = router->active_maps[table_id % sizeof(router->active_maps)];
-    ss_dassert(map);
+    if (create == NULL)
+    {
+        MXS_ERROR("Create table statement for %s.%s was not found from the "
+                  "binary logs or the stored schema was not correct.",
+                  map->database, map->table);
+        return false;
+    }
 
-    if (map)
+    if (ncolumns != map->columns)
     {
-        char table_ident[MYSQL_TABLE_MAXLEN + MYSQL_DATABASE_MAXLEN + 2];
-        snprintf(table_ident, sizeof(table_ident), "%s.%s", map->database, map->table);
-        AVRO_TABLE* table = hashtable_fetch(router->open_tables, table_ident);
-        TABLE_CREATE* create = map->table_create;
+        MXS_ERROR("Row event and table map event have different column counts."
+                  " Only full row image is currently supported.");
+        return false;
+    }
 
-        if (table && create && ncolumns == map->columns)
-        {
-            avro_value_t record;
-            avro_generic_value_new(table->avro_writer_iface, &record);
-
-            /** Each event has one or more rows in it. The number of rows is not known
-             * beforehand so we must continue processing them until we reach the end
-             * of the event. */
-            int rows = 0;
-            while (ptr - start < hdr->event_size - BINLOG_EVENT_HDR_LEN)
-            {
-                /** Add the current GTID and timestamp */
-                int event_type = get_event_type(hdr->event_type);
-                prepare_record(router, hdr, event_type, &record);
-                ptr = process_row_event_data(map, create, &record, ptr, col_present);
-                avro_file_writer_append_value(table->avro_file, &record);
-
-                /** Update rows events have the before and after images of the
-                 * affected rows so we'll process them as another record with
-                 * a different type */
-                if (event_type == UPDATE_EVENT)
-                {
-                    prepare_record(router, hdr, UPDATE_EVENT_AFTER, &record);
-                    ptr = process_row_event_data(map, create, &record, ptr, col_present);
-                    avro_file_writer_append_value(table->avro_file, &record);
-                }
+    if (table->stats)
+    {
+        time_t now = time(NULL);
+        table->stats->n_events++;
+        table->stats->gtid = *gtid;
+        table->stats->lag = now > hdr->timestamp ? now - hdr->timestamp : 0;
+    }
 
-                rows++;
-            }
+    /** The GTID range of the file is stored in the index when it is flushed */
+    if (!table->has_rows)
+    {
+        table->first_gtid = *gtid;
+        table->has_rows = true;
+    }
+    table->last_gtid = *gtid;
 
-            add_used_table(router, table_ident);
-            avro_value_decref(&record);
-            rval = true;
-        }
-        else if (table == NULL)
-        {
-            MXS_ERROR("Avro file handle was not found for table %s.%s. See earlier"
-                      " errors for more details.", map->database, map->table);
-        }
-        else if (create == NULL)
-        {
-            MXS_ERROR("Create table statement for %s.%s was not found from the "
-                      "binary logs or the stored schema was not correct.",
-                      map->database, map->table);
-        }
-        else
+    /** Each event has one or more rows in it. The number of rows is not known
+     * beforehand so we must continue processing them until we reach the end
+     * of the event. */
+    while (ptr - start < hdr->event_size - BINLOG_EVENT_HDR_LEN)
+    {
+        /** Add the current GTID and timestamp */
+        int event_type = get_event_type(hdr->event_type);
+        ptr = add_record(table, map, hdr, event_type, gtid, event_num, ptr, col_present);
+
+        /** Update rows events have the before and after images of the
+         * affected rows so we'll process them as another record with
+         * a different type */
+        if (event_type == UPDATE_EVENT)
         {
-            MXS_ERROR("Row event and table map event have different column counts."
-                      " Only full row image is currently supported.");
+            ptr = add_record(table, map, hdr, UPDATE_EVENT_AFTER, gtid, event_num,
+                             ptr, col_present);
         }
     }
-    else
-    {
-        MXS_ERROR("Row event for unknown table mapped to ID %lu. Data will not "
-                  "be processed.", table_id);
-    }
 
-    return rval;
+    return true;
 }
 
 /**
- * @brief Unpack numeric types
+ * @brief Handle a single RBR row event
  *
- * Convert the stored value into an Avro value and pack it in the record.
+ * These events contain the changes in the data. This function assumes that full
+ * row image is sent in every row event.
  *
- * @param field Avro value in a record
- * @param type Type of the field
- * @param metadata Field metadata
- * @param value Pointer to the start of the in-memory representation of the data
+ * @param router Avro router instance
+ * @param hdr Replication header
+ * @param ptr Pointer to the start of the event
+ * @return True on succcess, false on error
  */
-void set_numeric_field_value(avro_value_t *field, uint8_t type, uint8_t *metadata, uint8_t *value)
+bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
 {
-    switch (type)
-    {
-        case TABLE_COL_TYPE_TINY:
-        {
-            char c = *value;
-            avro_value_set_int(field, c);
-            break;
-        }
-
-        case TABLE_COL_TYPE_SHORT:
-        {
-            short s =  gw_mysql_get_byte2(value);
-            avro_value_set_int(field, s);
-            break;
-        }
-
-        case TABLE_COL_TYPE_INT24:
-        {
-            int x = gw_mysql_get_byte3(value);
-
-            if (x & 0x800000)
-            {
-                x = -((0xffffff & (~x)) + 1);
-            }
-
-            avro_value_set_int(field, x);
-            break;
-        }
-
-        case TABLE_COL_TYPE_LONG:
-        {
-            int x = gw_mysql_get_byte4(value);
-            avro_value_set_int(field, x);
-            break;
-        }
-
-        case TABLE_COL_TYPE_LONGLONG:
-        {
-            long l = gw_mysql_get_byte8(value);
-            avro_value_set_long(field, l);
-            break;
-        }
+    char table_ident[MYSQL_TABLE_MAXLEN + MYSQL_DATABASE_MAXLEN + 2];
+    TABLE_MAP *map;
+    AVRO_TABLE *table;
+    bool rval = row_event_find_table(router, hdr, ptr, &map, &table,
+                                     table_ident, sizeof(table_ident));
 
-        case TABLE_COL_TYPE_FLOAT:
-        {
-            float f = 0;
-            memcpy(&f, value, 4);
-            avro_value_set_float(field, f);
-            break;
-        }
+    if (rval && map)
+    {
+        int event_num = router->gtid.event_num;
+        rval = row_event_write(hdr, router->event_type_hdr_lens[hdr->event_type],
+                               ptr, map, table, &router->gtid, &event_num);
+        router->gtid.event_num = event_num;
 
-        case TABLE_COL_TYPE_DOUBLE:
+        if (rval)
         {
-            double d = 0;
-            memcpy(&d, value, 8);
-            avro_value_set_double(field, d);
-            break;
+            add_used_table(router, table_ident);
         }
-
-        default:
-            break;
     }
+
+    return rval;
 }
 
 /**
@@ -468,25 +510,355 @@ int get_metadata_len(uint8_t type)
     }
 }
 
+/**
+ * @brief Add the default value of a column
+ *
+ * The fields of the generated schemas are not nullable so NULL values and
+ * values that are not in the row image are stored as zeroes and empty strings.
+ *
+ * @param col Column whose value is added
+ * @param block Data block where the value is added
+ */
+static void add_default_value(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block)
+{
+    switch (col->avro_type)
+    {
+        case MAXAVRO_TYPE_INT:
+        case MAXAVRO_TYPE_LONG:
+            maxavro_datablock_add_integer(block, 0);
+            break;
+
+        case MAXAVRO_TYPE_FLOAT:
+            maxavro_datablock_add_float(block, 0);
+            break;
+
+        case MAXAVRO_TYPE_DOUBLE:
+            maxavro_datablock_add_double(block, 0);
+            break;
+
+        case MAXAVRO_TYPE_STRING:
+        case MAXAVRO_TYPE_BYTES:
+            maxavro_datablock_add_bytes(block, "", 0);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief Decode an ENUM or a SET value
+ */
+static uint8_t* decode_enum(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr, int *extra_bits)
+{
+    uint8_t val[col->metadata[1]];
+    uint64_t bytes = unpack_enum(ptr, col->metadata, val);
+    char strval[32];
+
+    /** Right now only ENUMs/SETs with less than 256 values
+     * are printed correctly */
+    snprintf(strval, sizeof(strval), "%hhu", val[0]);
+    if (bytes > 1 && warn_large_enumset)
+    {
+        warn_large_enumset = true;
+        MXS_WARNING("ENUM/SET values larger than 255 values aren't supported.");
+    }
+    maxavro_datablock_add_string(block, strval);
+    return ptr + bytes;
+}
+
+/**
+ * @brief Decode a fixed length string
+ */
+static uint8_t* decode_fixed_string(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr,
+                                    int *extra_bits)
+{
+    uint8_t bytes = *ptr;
+    maxavro_datablock_add_bytes(block, ptr + 1, bytes);
+    return ptr + bytes + 1;
+}
+
+/**
+ * @brief Decode a BIT value
+ */
+static uint8_t* decode_bit(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr, int *extra_bits)
+{
+    uint64_t value = 0;
+    int width = col->metadata[0] + col->metadata[1] * 8;
+    int bits_in_nullmap = MIN(width, *extra_bits);
+    *extra_bits -= bits_in_nullmap;
+    width -= bits_in_nullmap;
+    size_t bytes = width / 8;
+
+    // TODO: extract the bytes
+    if (!warn_bit)
+    {
+        warn_bit = true;
+        MXS_WARNING("BIT is not currently supported, values are stored as 0.");
+    }
+    maxavro_datablock_add_integer(block, value);
+    return ptr + bytes;
+}
+
+/**
+ * @brief Decode a DECIMAL value
+ */
+static uint8_t* decode_decimal(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr,
+                               int *extra_bits)
+{
+    double f_value = 0.0;
+    ptr += unpack_decimal_field(ptr, col->metadata, &f_value);
+    maxavro_datablock_add_double(block, f_value);
+    return ptr;
+}
+
+/**
+ * @brief Decode a variable length string
+ */
+static uint8_t* decode_variable_string(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr,
+                                       int *extra_bits)
+{
+    size_t sz;
+    char *str = lestr_consume(&ptr, &sz);
+    maxavro_datablock_add_bytes(block, str, sz);
+    return ptr;
+}
+
+/**
+ * @brief Decode a BLOB value
+ */
+static uint8_t* decode_blob(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr, int *extra_bits)
+{
+    uint8_t bytes = col->metadata[0];
+    uint64_t len = 0;
+    memcpy(&len, ptr, bytes);
+    ptr += bytes;
+    maxavro_datablock_add_bytes(block, ptr, len);
+    return ptr + len;
+}
+
+/**
+ * @brief Decode a temporal value
+ */
+static uint8_t* decode_temporal(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr,
+                                int *extra_bits)
+{
+    char buf[80];
+    struct tm tm;
+    ptr += unpack_temporal_value(col->type, ptr, col->metadata, &tm);
+    format_temporal_value(buf, sizeof(buf), col->type, &tm);
+    maxavro_datablock_add_string(block, buf);
+    return ptr;
+}
+
+/**
+ * @brief Decode a TINYINT value
+ */
+static uint8_t* decode_tiny(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr, int *extra_bits)
+{
+    char c = *ptr;
+    maxavro_datablock_add_integer(block, c);
+    return ptr + 1;
+}
+
+/**
+ * @brief Decode a SMALLINT value
+ */
+static uint8_t* decode_short(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr, int *extra_bits)
+{
+    short s = gw_mysql_get_byte2(ptr);
+    maxavro_datablock_add_integer(block, s);
+    return ptr + 2;
+}
+
+/**
+ * @brief Decode a MEDIUMINT value
+ */
+static uint8_t* decode_int24(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr, int *extra_bits)
+{
+    int x = gw_mysql_get_byte3(ptr);
+
+    if (x & 0x800000)
+    {
+        x = -((0xffffff & (~x)) + 1);
+    }
+
+    maxavro_datablock_add_integer(block, x);
+    return ptr + 3;
+}
+
+/**
+ * @brief Decode an INT value
+ */
+static uint8_t* decode_long(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr, int *extra_bits)
+{
+    int x = gw_mysql_get_byte4(ptr);
+    maxavro_datablock_add_integer(block, x);
+    return ptr + 4;
+}
+
+/**
+ * @brief Decode a BIGINT value
+ */
+static uint8_t* decode_longlong(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr,
+                                int *extra_bits)
+{
+    long l = gw_mysql_get_byte8(ptr);
+    maxavro_datablock_add_integer(block, l);
+    return ptr + 8;
+}
+
+/**
+ * @brief Decode a FLOAT value
+ */
+static uint8_t* decode_float(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr, int *extra_bits)
+{
+    float f = 0;
+    memcpy(&f, ptr, 4);
+    maxavro_datablock_add_float(block, f);
+    return ptr + 4;
+}
+
+/**
+ * @brief Decode a DOUBLE value
+ */
+static uint8_t* decode_double(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr,
+                              int *extra_bits)
+{
+    double d = 0;
+    memcpy(&d, ptr, 8);
+    maxavro_datablock_add_double(block, d);
+    return ptr + 8;
+}
+
+/**
+ * @brief Decode a value of any other numeric type
+ */
+static uint8_t* decode_numeric(TABLE_COLUMN *col, MAXAVRO_DATABLOCK *block, uint8_t *ptr,
+                               int *extra_bits)
+{
+    uint8_t lval[16];
+    memset(lval, 0, sizeof(lval));
+    ptr += unpack_numeric_field(ptr, col->type, col->metadata, lval);
+    add_default_value(col, block);
+    return ptr;
+}
+
+/**
+ * @brief Choose the decoding function of a column
+ *
+ * @param type Column type
+ * @param metadata Column metadata
+ * @return The decoding function
+ */
+static COLUMN_DECODE_FN get_column_decoder(uint8_t type, uint8_t *metadata)
+{
+    if (column_is_fixed_string(type))
+    {
+        /** ENUM and SET are stored as STRING types with the type stored
+         * in the metadata. */
+        return fixed_string_is_enum(metadata[0]) ? decode_enum : decode_fixed_string;
+    }
+    else if (column_is_bit(type))
+    {
+        return decode_bit;
+    }
+    else if (column_is_decimal(type))
+    {
+        return decode_decimal;
+    }
+    else if (column_is_variable_string(type))
+    {
+        return decode_variable_string;
+    }
+    else if (column_is_blob(type))
+    {
+        return decode_blob;
+    }
+    else if (column_is_temporal(type))
+    {
+        return decode_temporal;
+    }
+
+    /** All numeric types (INT, LONG, FLOAT etc.) */
+    switch (type)
+    {
+        case TABLE_COL_TYPE_TINY:
+            return decode_tiny;
+
+        case TABLE_COL_TYPE_SHORT:
+            return decode_short;
+
+        case TABLE_COL_TYPE_INT24:
+            return decode_int24;
+
+        case TABLE_COL_TYPE_LONG:
+            return decode_long;
+
+        case TABLE_COL_TYPE_LONGLONG:
+            return decode_longlong;
+
+        case TABLE_COL_TYPE_FLOAT:
+            return decode_float;
+
+        case TABLE_COL_TYPE_DOUBLE:
+            return decode_double;
+
+        default:
+            return decode_numeric;
+    }
+}
+
+/**
+ * @brief Prepare the decoding of the columns of a table map
+ *
+ * The column types and the metadata of a table only change with a new table
+ * map, so the decoding function and the metadata of each column are resolved
+ * once instead of for every row.
+ *
+ * @param map Table map with the column types and metadata
+ * @return True on success, false if memory allocation failed
+ */
+bool table_map_init_columns(TABLE_MAP *map)
+{
+    size_t metadata_offset = 0;
+
+    /** Allocate at least one column */
+    if ((map->column_decoders = malloc(MAX(map->columns, 1) * sizeof(TABLE_COLUMN))) == NULL)
+    {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < map->columns; i++)
+    {
+        TABLE_COLUMN *col = &map->column_decoders[i];
+        col->type = map->column_types[i];
+        col->metadata = &map->column_metadata[metadata_offset];
+        col->avro_type = column_type_to_maxavro_type(col->type);
+        col->decode = get_column_decoder(col->type, col->metadata);
+        metadata_offset += get_metadata_len(col->type);
+        ss_dassert(metadata_offset <= map->column_metadata_size);
+    }
+
+    return true;
+}
+
 /**
  * @brief Extract the values from a single row  in a row event
  *
  * @param map Table map event associated with this row
  * @param create Table creation associated with this row
- * @param record Avro record used for storing this row
+ * @param block Data block where the values are added
  * @param ptr Pointer to the start of the row data, should be after the row event header
  * @param columns_present The bitfield holding the columns that are present for
  * this row event. Currently this should be a bitfield which has all bits set.
  * @return Pointer to the first byte after the current row event
  */
-uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value_t *record,
+uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, MAXAVRO_DATABLOCK *block,
                                 uint8_t *ptr, uint8_t *columns_present)
 {
-    int npresent = 0;
-    avro_value_t field;
     long ncolumns = map->columns;
-    uint8_t *metadata = map->column_metadata;
-    size_t metadata_offset = 0;
+    TABLE_COLUMN *columns = map->column_decoders;
 
     /** BIT type values use the extra bits in the row event header */
     int extra_bits = (((ncolumns + 7) / 8) * 8) - ncolumns;
@@ -494,111 +866,18 @@ uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value
     /** Store the null value bitmap */
     uint8_t *null_bitmap = ptr;
     ptr += (ncolumns + 7) / 8;
+    ss_dassert(create->columns == map->columns);
 
-    for (long i = 0; i < map->columns && npresent < ncolumns; i++)
+    /** The record must have a value for every field of the schema */
+    for (long i = 0; i < ncolumns; i++)
     {
-        ss_dassert(create->columns == map->columns);
-        avro_value_get_by_name(record, create->column_names[i], &field, NULL);
-
-        if (bit_is_set(columns_present, ncolumns, i))
+        if (bit_is_set(columns_present, ncolumns, i) && !bit_is_set(null_bitmap, ncolumns, i))
         {
-            npresent++;
-            if (bit_is_set(null_bitmap, ncolumns, i))
-            {
-                avro_value_set_null(&field);
-            }
-            else if (column_is_fixed_string(map->column_types[i]))
-            {
-                /** ENUM and SET are stored as STRING types with the type stored
-                 * in the metadata. */
-                if (fixed_string_is_enum(metadata[metadata_offset]))
-                {
-                    uint8_t val[metadata[metadata_offset + 1]];
-                    uint64_t bytes = unpack_enum(ptr, &metadata[metadata_offset], val);
-                    char strval[32];
-
-                    /** Right now only ENUMs/SETs with less than 256 values
-                     * are printed correctly */
-                    snprintf(strval, sizeof(strval), "%hhu", val[0]);
-                    if (bytes > 1 && warn_large_enumset)
-                    {
-                        warn_large_enumset = true;
-                        MXS_WARNING("ENUM/SET values larger than 255 values aren't supported.");
-                    }
-                    avro_value_set_string(&field, strval);
-                    ptr += bytes;
-                }
-                else
-                {
-                    uint8_t bytes = *ptr;
-                    char str[bytes + 1];
-                    memcpy(str, ptr + 1, bytes);
-                    str[bytes] = '\0';
-                    avro_value_set_string(&field, str);
-                    ptr += bytes + 1;
-                }
-            }
-            else if (column_is_bit(map->column_types[i]))
-            {
-                uint64_t value = 0;
-                int width = metadata[metadata_offset] + metadata[metadata_offset + 1] * 8;
-                int bits_in_nullmap = MIN(width, extra_bits);
-                extra_bits -= bits_in_nullmap;
-                width -= bits_in_nullmap;
-                size_t bytes = width / 8;
-
-                // TODO: extract the bytes
-                if (!warn_bit)
-                {
-                    warn_bit = true;
-                    MXS_WARNING("BIT is not currently supported, values are stored as 0.");
-                }
-                avro_value_set_int(&field, value);
-                ptr += bytes;
-            }
-            else if (column_is_decimal(map->column_types[i]))
-            {
-                double f_value = 0.0;
-                ptr += unpack_decimal_field(ptr, metadata + metadata_offset, &f_value);
-                avro_value_set_double(&field, f_value);
-            }
-            else if (column_is_variable_string(map->column_types[i]))
-            {
-                size_t sz;
-                char *str = lestr_consume(&ptr, &sz);
-                char buf[sz + 1];
-                memcpy(buf, str, sz);
-                buf[sz] = '\0';
-                avro_value_set_string(&field, buf);
-            }
-            else if (column_is_blob(map->column_types[i]))
-            {
-                uint8_t bytes = metadata[metadata_offset];
-                uint64_t len = 0;
-                memcpy(&len, ptr, bytes);
-                ptr += bytes;
-                avro_value_set_bytes(&field, ptr, len);
-                ptr += len;
-            }
-            else if (column_is_temporal(map->column_types[i]))
-            {
-                char buf[80];
-                struct tm tm;
-                ptr += unpack_temporal_value(map->column_types[i], ptr, &metadata[metadata_offset], &tm);
-                format_temporal_value(buf, sizeof(buf), map->column_types[i], &tm);
-                avro_value_set_string(&field, buf);
-            }
-            /** All numeric types (INT, LONG, FLOAT etc.) */
-            else
-            {
-                uint8_t lval[16];
-                memset(lval, 0, sizeof(lval));
-                ptr += unpack_numeric_field(ptr, map->column_types[i],
-                                            &metadata[metadata_offset], lval);
-                set_numeric_field_value(&field, map->column_types[i], &metadata[metadata_offset], lval);
-            }
-            ss_dassert(metadata_offset <= map->column_metadata_size);
-            metadata_offset += get_metadata_len(map->column_types[i]);
+            ptr = columns[i].decode(&columns[i], block, ptr, &extra_bits);
+        }
+        else
+        {
+            add_default_value(&columns[i], block);
         }
     }
 
@@ -38,9 +38,9 @@
  * Some fields are larger than they need to be but since the Avro integer
  * compression is quite efficient, the real loss in performance is negligible.
  * @param type MySQL column type
- * @return String representation of the Avro type
+ * @return The Avro type
  */
-static const char* column_type_to_avro_type(uint8_t type)
+enum maxavro_value_type column_type_to_maxavro_type(uint8_t type)
 {
     switch (type)
     {
@@ -49,25 +49,58 @@ static const char* column_type_to_avro_type(uint8_t type)
         case TABLE_COL_TYPE_LONG:
         case TABLE_COL_TYPE_INT24:
         case TABLE_COL_TYPE_BIT:
-            return "int";
+            return MAXAVRO_TYPE_INT;
 
         case TABLE_COL_TYPE_FLOAT:
-            return "float";
+            return MAXAVRO_TYPE_FLOAT;
 
         case TABLE_COL_TYPE_DOUBLE:
         case TABLE_COL_TYPE_NEWDECIMAL:
-            return "double";
+            return MAXAVRO_TYPE_DOUBLE;
 
         case TABLE_COL_TYPE_NULL:
-            return "null";
+            return MAXAVRO_TYPE_NULL;
 
         case TABLE_COL_TYPE_LONGLONG:
-            return "long";
+            return MAXAVRO_TYPE_LONG;
 
         case TABLE_COL_TYPE_TINY_BLOB:
         case TABLE_COL_TYPE_MEDIUM_BLOB:
         case TABLE_COL_TYPE_LONG_BLOB:
         case TABLE_COL_TYPE_BLOB:
+            return MAXAVRO_TYPE_BYTES;
+
+        default:
+            return MAXAVRO_TYPE_STRING;
+    }
+}
+
+/**
+ * @brief Convert the MySQL column type to the name of a compatible Avro type
+ *
+ * @param type MySQL column type
+ * @return String representation of the Avro type
+ */
+static const char* column_type_to_avro_type(uint8_t type)
+{
+    switch (column_type_to_maxavro_type(type))
+    {
+        case MAXAVRO_TYPE_INT:
+            return "int";
+
+        case MAXAVRO_TYPE_FLOAT:
+            return "float";
+
+        case MAXAVRO_TYPE_DOUBLE:
+            return "double";
+
+        case MAXAVRO_TYPE_NULL:
+            return "null";
+
+        case MAXAVRO_TYPE_LONG:
+            return "long";
+
+        case MAXAVRO_TYPE_BYTES:
             return "bytes";
 
         default:
@@ -126,9 +159,21 @@ char* json_new_schema_from_table(TABLE_MAP *map)
 
     for (uint64_t i = 0; i < map->columns; i++)
     {
-        json_array_append(array, json_pack_ex(&err, 0, "{s:s, s:s}", "name",
-                                              create->column_names[i], "type",
-                                              column_type_to_avro_type(map->column_types[i])));
+        json_t *field = json_pack_ex(&err, 0, "{s:s, s:s}", "name",
+                                     create->column_names[i], "type",
+                                     column_type_to_avro_type(map->column_types[i]));
+
+        /** The primary key is kept in the schema so that it is known when
+         * the table is loaded from the stored schemas */
+        for (int k = 0; field && k < create->n_primary_key; k++)
+        {
+            if (strcmp(create->primary_key[k], create->column_names[i]) == 0)
+            {
+                json_object_set_new(field, avro_primary_key, json_integer(k));
+            }
+        }
+
+        json_array_append_new(array, field);
     }
     json_object_set_new(schema, "fields", array);
     char* rval = json_dumps(schema, JSON_PRESERVE_ORDER);
@@ -174,8 +219,10 @@ bool json_extract_field_names(const char* filename, TABLE_CREATE *table)
         {
             int array_size = json_array_size(arr);
             table->column_names = (char**)malloc(sizeof(char*) * (array_size));
+            table->primary_key = (char**)calloc(array_size + 1, sizeof(char*));
+            table->n_primary_key = 0;
 
-            if (table->column_names)
+            if (table->column_names && table->primary_key)
             {
                 int columns = 0;
                 rval = true;
@@ -193,6 +240,15 @@ bool json_extract_field_names(const char* filename, TABLE_CREATE *table)
                             if (not_generated_field(name_str))
                             {
                                 table->column_names[columns++] = strdup(name_str);
+                                json_t *key = json_object_get(val, avro_primary_key);
+
+                                if (json_is_integer(key) && json_integer_value(key) >= 0 &&
+                                    json_integer_value(key) < array_size &&
+                                    table->primary_key[json_integer_value(key)] == NULL)
+                                {
+                                    table->primary_key[json_integer_value(key)] = strdup(name_str);
+                                    table->n_primary_key++;
+                                }
                             }
                         }
                         else
@@ -210,6 +266,26 @@ bool json_extract_field_names(const char* filename, TABLE_CREATE *table)
                     }
                 }
                 table->columns = columns;
+
+                /** A key with gaps in the column positions is not usable */
+                bool gaps = false;
+
+                for (int k = 0; k < table->n_primary_key; k++)
+                {
+                    gaps = gaps || table->primary_key[k] == NULL;
+                }
+
+                if (gaps)
+                {
+                    MXS_WARNING("Incomplete primary key in file '%s'.", filename);
+
+                    for (int k = 0; k < array_size; k++)
+                    {
+                        free(table->primary_key[k]);
+                        table->primary_key[k] = NULL;
+                    }
+                    table->n_primary_key = 0;
+                }
             }
         }
         else
@@ -444,6 +520,19 @@ const char* next_field_definition(const char* ptr)
     return ptr;
 }
 
+/**
+ * Check if a field definition defines an index or a constraint instead of a column
+ * @param ptr Start of the field definition
+ * @return True if the definition is not a column definition
+ */
+static bool is_key_definition(const char* ptr)
+{
+    return strncasecmp(ptr, "constraint", 10) == 0 || strncasecmp(ptr, "index", 5) == 0 ||
+           strncasecmp(ptr, "key", 3) == 0 || strncasecmp(ptr, "fulltext", 8) == 0 ||
+           strncasecmp(ptr, "spatial", 7) == 0 || strncasecmp(ptr, "foreign", 7) == 0 ||
+           strncasecmp(ptr, "unique", 6) == 0 || strncasecmp(ptr, "primary", 7) == 0;
+}
+
 static const char *extract_field_name(const char* ptr, char* dest, size_t size)
 {
     bool bt = false;
@@ -453,10 +542,7 @@ static const char *extract_field_name(const char* ptr, char* dest, size_t size)
         ptr++;
     }
 
-    if (strncasecmp(ptr, "constraint", 10) == 0 || strncasecmp(ptr, "index", 5) == 0 ||
-        strncasecmp(ptr, "key", 3) == 0 || strncasecmp(ptr, "fulltext", 8) == 0 ||
-        strncasecmp(ptr, "spatial", 7) == 0 || strncasecmp(ptr, "foreign", 7) == 0 ||
-        strncasecmp(ptr, "unique", 6) == 0 || strncasecmp(ptr, "primary", 7) == 0)
+    if (is_key_definition(ptr))
     {
         return NULL;
     }
@@ -561,6 +647,161 @@ static int process_column_definition(const char *nameptr, char*** dest)
     return i;
 }
 
+/**
+ * Find the words PRIMARY KEY in a field definition
+ * @param ptr Start of the definition
+ * @param end End of the definition
+ * @return Pointer to the first byte after the words or NULL if they were not found
+ */
+static const char* find_primary_key(const char* ptr, const char* end)
+{
+    for (const char* p = ptr; p + 7 < end; p++)
+    {
+        if ((p == ptr || (!isalnum(p[-1]) && p[-1] != '_')) && strncasecmp(p, "primary", 7) == 0)
+        {
+            const char* q = p + 7;
+
+            while (q < end && isspace(*q))
+            {
+                q++;
+            }
+
+            if (q > p + 7 && q + 3 <= end && strncasecmp(q, "key", 3) == 0 &&
+                (q + 3 == end || (!isalnum(q[3]) && q[3] != '_')))
+            {
+                return q + 3;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Add a column to the primary key
+ * @param names The key column names, reallocated
+ * @param n Number of key columns, incremented
+ * @param name Name of the column
+ * @param len Length of @c name
+ * @return True on success, false if memory allocation failed
+ */
+static bool add_key_column(char*** names, int* n, const char* name, size_t len)
+{
+    char** tmp = realloc(*names, sizeof(char*) * (*n + 1));
+
+    if (tmp == NULL || (tmp[*n] = strndup(name, len)) == NULL)
+    {
+        *names = tmp ? tmp : *names;
+        return false;
+    }
+
+    make_valid_avro_identifier(tmp[*n]);
+    *names = tmp;
+    (*n)++;
+    return true;
+}
+
+/**
+ * Process the primary key of a table definition. The key is either defined
+ * with a PRIMARY KEY definition or with the PRIMARY KEY attribute of a column.
+ * Prefix lengths of the key parts are ignored.
+ *
+ * @param nameptr Table definition
+ * @param columns Column names of the table
+ * @param n_columns Number of columns
+ * @param dest The names of the key columns are stored here
+ * @return Number of key columns, 0 if the table has no primary key or -1 on error
+ */
+static int process_primary_key(const char *nameptr, char **columns, int n_columns, char*** dest)
+{
+    char **names = NULL;
+    int n = 0, col = 0;
+    bool ok = true;
+
+    while (*nameptr && n == 0 && ok)
+    {
+        const char *end = next_field_definition(nameptr);
+
+        while (nameptr < end && isspace(*nameptr))
+        {
+            nameptr++;
+        }
+
+        const char *key = find_primary_key(nameptr, end);
+
+        if (!is_key_definition(nameptr))
+        {
+            if (key && col < n_columns)
+            {
+                ok = add_key_column(&names, &n, columns[col], strlen(columns[col]));
+            }
+            col++;
+        }
+        else if (key)
+        {
+            /** The key parts are listed inside the next parentheses */
+            while (key < end && *key != '(')
+            {
+                key++;
+            }
+
+            int depth = 0;
+            const char *part = NULL;
+
+            for (const char *p = key; p < end && ok; p++)
+            {
+                if (*p == '(' && ++depth == 1)
+                {
+                    part = p + 1;
+                }
+                else if ((*p == ',' && depth == 1) || (*p == ')' && depth-- == 1))
+                {
+                    while (part < p && (isspace(*part) || *part == '`'))
+                    {
+                        part++;
+                    }
+
+                    size_t len = 0;
+
+                    while (part + len < p && part[len] != '`' && part[len] != '(' &&
+                           !isspace(part[len]))
+                    {
+                        len++;
+                    }
+
+                    if (len > 0)
+                    {
+                        ok = add_key_column(&names, &n, part, len);
+                    }
+
+                    part = p + 1;
+
+                    if (depth == 0)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+
+        nameptr = end;
+    }
+
+    if (!ok)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            free(names[i]);
+        }
+        free(names);
+        MXS_ERROR("Memory allocation failed when processing the primary key.");
+        return -1;
+    }
+
+    *dest = names;
+    return n;
+}
+
 TABLE_CREATE* table_create_from_schema(const char* file, const char* db,
                                        const char* table, int version)
 {
@@ -572,9 +813,13 @@ TABLE_CREATE* table_create_from_schema(const char* file, const char* db,
         newtable->database = strdup(db);
         newtable->version = version;
         newtable->was_used = true;
+        newtable->column_names = NULL;
+        newtable->primary_key = NULL;
+        newtable->n_primary_key = 0;
 
         if (!newtable->table || !newtable->database || !json_extract_field_names(file, newtable))
         {
+            free(newtable->primary_key);
             free(newtable->table);
             free(newtable->database);
             free(newtable);
@@ -637,12 +882,21 @@ TABLE_CREATE* table_create_alloc(const char* sql, const char* event_db)
             rval->columns = n_columns;
             rval->database = strdup(db);
             rval->table = strdup(table);
+            rval->primary_key = NULL;
+            rval->n_primary_key = process_primary_key(statement_sql, names, n_columns,
+                                                      &rval->primary_key);
         }
 
-        if (rval == NULL || rval->database == NULL || rval->table == NULL)
+        if (rval == NULL || rval->database == NULL || rval->table == NULL ||
+            rval->n_primary_key < 0)
         {
             if (rval)
             {
+                for (int i = 0; i < rval->n_primary_key; i++)
+                {
+                    free(rval->primary_key[i]);
+                }
+                free(rval->primary_key);
                 free(rval->database);
                 free(rval->table);
                 free(rval);
@@ -678,6 +932,11 @@ void* table_create_free(TABLE_CREATE* value)
             free(value->column_names[i]);
         }
         free(value->column_names);
+        for (int i = 0; i < value->n_primary_key; i++)
+        {
+            free(value->primary_key[i]);
+        }
+        free(value->primary_key);
         free(value->table);
         free(value->database);
         free(value);
@@ -987,6 +1246,7 @@ TABLE_MAP *table_map_alloc(uint8_t *ptr, uint8_t hdr_len, TABLE_CREATE* create)
         map->database = strdup(schema_name);
         map->table = strdup(table_name);
         map->table_create = create;
+        map->column_decoders = NULL;
         if (map->column_types && map->database && map->table &&
             map->column_metadata && map->null_bitmap)
         {
@@ -1011,6 +1271,12 @@ TABLE_MAP *table_map_alloc(uint8_t *ptr, uint8_t hdr_len, TABLE_CREATE* create)
         map = NULL;
     }
 
+    if (map && !table_map_init_columns(map))
+    {
+        table_map_free(map);
+        map = NULL;
+    }
+
     return map;
 }
 
@@ -1023,6 +1289,9 @@ void* table_map_free(TABLE_MAP *map)
     if (map)
     {
         free(map->column_types);
+        free(map->column_metadata);
+        free(map->null_bitmap);
+        free(map->column_decoders);
         free(map->database);
         free(map->table);
         free(map);
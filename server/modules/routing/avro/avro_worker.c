@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_worker.c - Conversion of row events in worker threads
+ *
+ * With the worker_threads option, the conversion task only reads the binlog
+ * events and the row events are converted into Avro records by a pool of
+ * worker threads. The tables are divided between the workers by the table
+ * name, so the records of a table are always written by the same worker and
+ * in the order they are in the binlog.
+ *
+ * The conversion task waits for the workers to finish the queued events
+ * before it flushes the Avro files and stores the conversion state. The
+ * stored position is therefore never ahead of the slowest worker. The task
+ * also waits before a DDL statement or a new table map replaces a table
+ * definition or an Avro file that the workers may still be using.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                 Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <avrorouter.h>
+#include <atomic.h>
+#include <log_manager.h>
+#include <skygw_utils.h>
+
+void add_used_table(AVRO_INSTANCE* router, const char* table);
+
+/**
+ * @brief Release a reference to the subsequence numbers of a transaction
+ *
+ * @param trx Transaction to release
+ */
+static void avro_trx_release(AVRO_TRX *trx)
+{
+    if (trx && atomic_add(&trx->refs, -1) == 1)
+    {
+        free(trx);
+    }
+}
+
+/**
+ * @brief The conversion worker thread
+ *
+ * @param data The worker
+ */
+static void avro_worker_main(void *data)
+{
+    AVRO_WORKER *worker = (AVRO_WORKER*)data;
+
+    pthread_mutex_lock(&worker->lock);
+
+    while (true)
+    {
+        while (worker->head == NULL)
+        {
+            pthread_cond_wait(&worker->work, &worker->lock);
+        }
+
+        AVRO_ROW_EVENT *ev = worker->head;
+        worker->head = ev->next;
+
+        if (worker->head == NULL)
+        {
+            worker->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&worker->lock);
+
+        row_event_write(&ev->hdr, ev->hdr_len, GWBUF_DATA(ev->event), ev->map,
+                        ev->table, &ev->gtid, &ev->trx->event_num);
+        gwbuf_free(ev->event);
+        avro_trx_release(ev->trx);
+        free(ev);
+
+        pthread_mutex_lock(&worker->lock);
+        worker->n_events++;
+
+        if (--worker->queued == 0 || worker->queued == AVRO_WORKER_QUEUE_MAX - 1)
+        {
+            pthread_cond_broadcast(&worker->idle);
+        }
+    }
+}
+
+/**
+ * @brief Start the conversion workers
+ *
+ * @param router Avro router instance with @c n_workers set
+ * @return True if all workers were started
+ */
+bool avro_workers_start(AVRO_INSTANCE *router)
+{
+    if ((router->workers = calloc(router->n_workers, sizeof(AVRO_WORKER))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the conversion workers.");
+        return false;
+    }
+
+    for (int i = 0; i < router->n_workers; i++)
+    {
+        AVRO_WORKER *worker = &router->workers[i];
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->work, NULL);
+        pthread_cond_init(&worker->idle, NULL);
+
+        if (thread_start(&worker->thread, avro_worker_main, worker) == NULL)
+        {
+            MXS_ERROR("[%s] Failed to start conversion worker thread %d.",
+                      router->service->name, i);
+            /** The started workers are left idle and the events are
+             * converted by the conversion task */
+            router->n_workers = 0;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Queue a row event for a conversion worker
+ *
+ * The worker takes the ownership of @c event if the event was queued.
+ *
+ * @param router Avro router instance
+ * @param hdr Replication header
+ * @param event The event payload
+ * @return True if the event was queued, false if it was ignored or on error
+ */
+bool avro_workers_add(AVRO_INSTANCE *router, REP_HEADER *hdr, GWBUF *event)
+{
+    char table_ident[MYSQL_TABLE_MAXLEN + MYSQL_DATABASE_MAXLEN + 2];
+    TABLE_MAP *map;
+    AVRO_TABLE *table;
+    AVRO_ROW_EVENT *ev;
+
+    if (!row_event_find_table(router, hdr, GWBUF_DATA(event), &map, &table,
+                              table_ident, sizeof(table_ident)) || map == NULL)
+    {
+        return false;
+    }
+
+    if (router->trx == NULL)
+    {
+        if ((router->trx = calloc(1, sizeof(AVRO_TRX))) == NULL)
+        {
+            MXS_ERROR("Failed to allocate memory for a row event.");
+            return false;
+        }
+        router->trx->refs = 1;
+        router->trx->event_num = router->gtid.event_num;
+    }
+
+    if ((ev = malloc(sizeof(AVRO_ROW_EVENT))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for a row event.");
+        return false;
+    }
+
+    ev->event = event;
+    ev->hdr = *hdr;
+    ev->hdr_len = router->event_type_hdr_lens[hdr->event_type];
+    ev->gtid = router->gtid;
+    ev->trx = router->trx;
+    ev->map = map;
+    ev->table = table;
+    ev->next = NULL;
+    atomic_add(&router->trx->refs, 1);
+
+    /** The same table is always converted by the same worker */
+    AVRO_WORKER *worker = &router->workers[(unsigned int)simple_str_hash(table_ident) %
+                                           router->n_workers];
+
+    pthread_mutex_lock(&worker->lock);
+
+    while (worker->queued >= AVRO_WORKER_QUEUE_MAX)
+    {
+        pthread_cond_wait(&worker->idle, &worker->lock);
+    }
+
+    if (worker->tail)
+    {
+        worker->tail->next = ev;
+    }
+    else
+    {
+        worker->head = ev;
+    }
+
+    worker->tail = ev;
+    worker->queued++;
+    pthread_cond_signal(&worker->work);
+    pthread_mutex_unlock(&worker->lock);
+
+    add_used_table(router, table_ident);
+    return true;
+}
+
+/**
+ * @brief Start the subsequence numbering of a new transaction
+ *
+ * @param router Avro router instance
+ */
+void avro_workers_new_trx(AVRO_INSTANCE *router)
+{
+    avro_trx_release(router->trx);
+    router->trx = NULL;
+}
+
+/**
+ * @brief Wait until the workers have converted all queued row events
+ *
+ * When this function returns, the GTID of the router is the position of the
+ * last converted record.
+ *
+ * @param router Avro router instance
+ */
+void avro_workers_wait(AVRO_INSTANCE *router)
+{
+    for (int i = 0; i < router->n_workers; i++)
+    {
+        AVRO_WORKER *worker = &router->workers[i];
+
+        pthread_mutex_lock(&worker->lock);
+
+        while (worker->queued > 0)
+        {
+            pthread_cond_wait(&worker->idle, &worker->lock);
+        }
+
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    if (router->trx)
+    {
+        router->gtid.event_num = router->trx->event_num;
+    }
+}
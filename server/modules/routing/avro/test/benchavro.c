@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file benchavro.c - The avrorouter conversion benchmark
+ *
+ * A set of recorded binlog files is converted into Avro files with the same
+ * code that the conversion task uses. The router instance is created with
+ * the module entry point and the given router options, so the conversion
+ * options such as worker_threads, group_rows and codec can be compared.
+ *
+ * The binlog files must follow the naming of the filestem option and the
+ * conversion starts from the file given with the start_index option, as
+ * with the avrorouter itself. The Avro files are written to a temporary
+ * directory unless an Avro directory is given.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                 Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <service.h>
+#include <router.h>
+#include <avrorouter.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+#define BENCH_MAX_OPTIONS 16
+
+extern ROUTER_OBJECT *GetModuleObject();
+extern bool avro_save_conversion_state(AVRO_INSTANCE *router);
+
+static struct option long_options[] =
+{
+    {"filestem",       required_argument, 0, 'f'},
+    {"start-index",    required_argument, 0, 's'},
+    {"avrodir",        required_argument, 0, 'a'},
+    {"worker-threads", required_argument, 0, 'w'},
+    {"group-rows",     required_argument, 0, 'r'},
+    {"group-trx",      required_argument, 0, 't'},
+    {"codec",          required_argument, 0, 'c'},
+    {"help",           no_argument,       0, '?'},
+    {0, 0, 0, 0}
+};
+
+static uint64_t
+bench_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Add a router option
+ *
+ * @param options   The options, NULL terminated
+ * @param n         Number of options, updated
+ * @param name      Name of the option
+ * @param value     Value of the option
+ */
+static void
+bench_add_option(char **options, int *n, const char *name, const char *value)
+{
+    if (*n < BENCH_MAX_OPTIONS)
+    {
+        char buf[strlen(name) + strlen(value) + 2];
+        sprintf(buf, "%s=%s", name, value);
+        options[(*n)++] = strdup(buf);
+        options[*n] = NULL;
+    }
+}
+
+/**
+ * Calculate the size of the binlog files that are converted
+ *
+ * @param dir       The binlog directory
+ * @param filestem  The base name of the binlog files
+ * @param index     The index of the first binlog file
+ * @return          Total size of the consecutive binlog files
+ */
+static uint64_t
+bench_binlog_size(const char *dir, const char *filestem, int index)
+{
+    uint64_t total = 0;
+    struct stat statb;
+    char path[PATH_MAX + 1];
+
+    snprintf(path, sizeof(path), "%s/%s.%06d", dir, filestem, index);
+
+    while (stat(path, &statb) == 0)
+    {
+        total += statb.st_size;
+        snprintf(path, sizeof(path), "%s/%s.%06d", dir, filestem, ++index);
+    }
+
+    return total;
+}
+
+static void
+printUsage(const char *progname)
+{
+    printf("Usage: %s [options] binlogdir\n\n", progname);
+    printf("  -f|--filestem=NAME      Base name of the binlog files, default mysql-bin\n");
+    printf("  -s|--start-index=N      Index of the first binlog file, default 1\n");
+    printf("  -a|--avrodir=DIR        Directory for the Avro files, default is a\n"
+           "                          temporary directory\n");
+    printf("  -w|--worker-threads=N   Number of conversion worker threads\n");
+    printf("  -r|--group-rows=N       Row events grouped into one data block\n");
+    printf("  -t|--group-trx=N        Transactions grouped into one data block\n");
+    printf("  -c|--codec=CODEC        Codec of the data blocks, null or deflate\n");
+    printf("  -?|--help               Print this help text\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    SERVICE service;
+    AVRO_INSTANCE *router;
+    struct rusage ru_start, ru_end;
+    char template[] = "/tmp/benchavro.XXXXXX";
+    char *options[BENCH_MAX_OPTIONS + 1] = {NULL};
+    char *filestem = "mysql-bin";
+    char *avrodir = NULL;
+    int start_index = 1;
+    int n_options = 0;
+    int c, option_index = 0;
+
+    while ((c = getopt_long(argc, argv, "f:s:a:w:r:t:c:?", long_options, &option_index)) >= 0)
+    {
+        switch (c)
+        {
+        case 'f':
+            filestem = optarg;
+            break;
+        case 's':
+            start_index = atoi(optarg);
+            break;
+        case 'a':
+            avrodir = optarg;
+            break;
+        case 'w':
+            bench_add_option(options, &n_options, "worker_threads", optarg);
+            break;
+        case 'r':
+            bench_add_option(options, &n_options, "group_rows", optarg);
+            break;
+        case 't':
+            bench_add_option(options, &n_options, "group_trx", optarg);
+            break;
+        case 'c':
+            bench_add_option(options, &n_options, "codec", optarg);
+            break;
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    if (avrodir == NULL && (avrodir = mkdtemp(template)) == NULL)
+    {
+        fprintf(stderr, "Failed to create a temporary directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    char index[20];
+    snprintf(index, sizeof(index), "%d", start_index);
+    bench_add_option(options, &n_options, "binlogdir", argv[optind]);
+    bench_add_option(options, &n_options, "avrodir", avrodir);
+    bench_add_option(options, &n_options, "filestem", filestem);
+    bench_add_option(options, &n_options, "start_index", index);
+
+    mxs_log_init(NULL, avrodir, MXS_LOG_TARGET_FS);
+    mxs_log_set_priority_enabled(LOG_INFO, false);
+    mxs_log_set_priority_enabled(LOG_NOTICE, false);
+
+    memset(&service, 0, sizeof(service));
+    service.name = "benchmark";
+
+    /** The housekeeper is not started, so the conversion is done here */
+    if ((router = (AVRO_INSTANCE*)GetModuleObject()->createInstance(&service, options)) == NULL)
+    {
+        fprintf(stderr, "Failed to create the router instance, see the log in '%s'\n", avrodir);
+        return 1;
+    }
+
+    uint64_t binlog_bytes = bench_binlog_size(router->binlogdir, router->fileroot, start_index);
+    avro_binlog_end_t binlog_end = AVRO_OK;
+
+    getrusage(RUSAGE_SELF, &ru_start);
+    uint64_t start = bench_clock_ns();
+
+    while (binlog_end == AVRO_OK &&
+           avro_open_binlog(router->binlogdir, router->binlog_name, &router->binlog_fd))
+    {
+        binlog_end = avro_read_all_events(router);
+        avro_close_binlog(router->binlog_fd);
+    }
+
+    avro_flush_all_tables(router);
+    avro_save_conversion_state(router);
+
+    uint64_t elapsed = bench_clock_ns() - start;
+    getrusage(RUSAGE_SELF, &ru_end);
+
+    uint64_t events = 0, rows = 0, bytes = 0;
+    int tables = 0;
+    HASHITERATOR *iter = hashtable_iterator(router->table_stats);
+
+    if (iter)
+    {
+        char *key;
+        while ((key = (char*)hashtable_next(iter)))
+        {
+            AVRO_TABLE_STATS *stats = hashtable_fetch(router->table_stats, key);
+
+            if (stats)
+            {
+                events += stats->n_events;
+                rows += stats->n_rows;
+                bytes += stats->n_bytes;
+                tables++;
+            }
+        }
+        hashtable_iterator_free(iter);
+    }
+
+    double secs = elapsed / 1e9;
+    double cpu = (ru_end.ru_utime.tv_sec - ru_start.ru_utime.tv_sec) +
+                 (ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) +
+                 ((ru_end.ru_utime.tv_usec - ru_start.ru_utime.tv_usec) +
+                  (ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec)) / 1e6;
+
+    printf("Binlog files:            %s/%s.%06d - %s\n", router->binlogdir,
+           router->fileroot, start_index, router->binlog_name);
+    printf("Avro directory:          %s\n", avrodir);
+    printf("Result:                  %s\n",
+           binlog_end == AVRO_LAST_FILE ? "converted all files" : "stopped on error");
+    printf("Tables:                  %d\n", tables);
+    printf("Row events:              %lu\n", events);
+    printf("Records:                 %lu\n", rows);
+    printf("Elapsed time (s):        %.3f\n", secs);
+    printf("Binlog read (bytes/s):   %.0f\n", secs > 0 ? binlog_bytes / secs : 0);
+    printf("Row events/s:            %.0f\n", secs > 0 ? events / secs : 0);
+    printf("Records/s:               %.0f\n", secs > 0 ? rows / secs : 0);
+    printf("Avro written (bytes/s):  %.0f\n", secs > 0 ? bytes / secs : 0);
+    printf("CPU per record (us):     %.3f\n", rows ? cpu * 1e6 / rows : 0);
+
+    for (int i = 0; i < n_options; i++)
+    {
+        free(options[i]);
+    }
+
+    mxs_log_finish();
+    return binlog_end == AVRO_LAST_FILE ? 0 : 1;
+}
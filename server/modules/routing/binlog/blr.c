@@ -240,8 +240,11 @@ createInstance(SERVICE *service, char **options)
     inst->files = NULL;
     spinlock_init(&inst->fileslock);
     spinlock_init(&inst->binlog_lock);
+    spinlock_init(&inst->event_ring.lock);
+    spinlock_init(&inst->wbuf_lock);
 
     inst->binlog_fd = -1;
+    inst->index_fd = -1;
     inst->master_chksum = true;
     inst->master_uuid = NULL;
 
@@ -255,6 +258,9 @@ createInstance(SERVICE *service, char **options)
     inst->short_burst = DEF_SHORT_BURST;
     inst->long_burst = DEF_LONG_BURST;
     inst->burst_size = DEF_BURST_SIZE;
+    inst->event_ring.max_size = DEF_EVENT_RING_SIZE;
+    inst->wbuf_size = DEF_WRITE_BUFFER_SIZE;
+    inst->index_interval = DEF_INDEX_INTERVAL;
     inst->retry_backoff = 1;
     inst->binlogdir = NULL;
     inst->heartbeat = BLR_HEARTBEAT_DEFAULT_INTERVAL;
@@ -409,6 +415,18 @@ createInstance(SERVICE *service, char **options)
                 {
                     inst->trx_safe = config_truth_value(value);
                 }
+                else if (strcmp(options[i], "mmap_binlog") == 0)
+                {
+                    inst->mmap_binlog = config_truth_value(value) == 1;
+                }
+                else if (strcmp(options[i], "sendfile_binlog") == 0)
+                {
+                    inst->sendfile_binlog = config_truth_value(value) == 1;
+                }
+                else if (strcmp(options[i], "slave_pull") == 0)
+                {
+                    inst->slave_pull = config_truth_value(value) == 1;
+                }
                 else if (strcmp(options[i], "lowwater") == 0)
                 {
                     inst->low_water = atoi(value);
@@ -451,6 +469,85 @@ createInstance(SERVICE *service, char **options)
                     inst->burst_size = size;
 
                 }
+                else if (strcmp(options[i], "event_ring_size") == 0)
+                {
+                    char *endptr;
+                    long mb = strtol(value, &endptr, 10);
+
+                    if (*endptr != '\0' || mb < 0)
+                    {
+                        MXS_WARNING("Invalid event ring size %s."
+                                    " The event ring is disabled.", value);
+                    }
+                    else
+                    {
+                        inst->event_ring.max_size = (unsigned long)mb * 1024 * 1024;
+                    }
+                }
+                else if (strcmp(options[i], "write_buffer_size") == 0)
+                {
+                    char *ptr;
+                    unsigned long size = strtoul(value, &ptr, 10);
+
+                    switch (*ptr)
+                    {
+                    case 'G':
+                    case 'g':
+                        size *= 1024;
+                    case 'M':
+                    case 'm':
+                        size *= 1024;
+                    case 'K':
+                    case 'k':
+                        size *= 1024;
+                        break;
+                    }
+
+                    if (size && size < BLR_MIN_WRITE_BUFFER)
+                    {
+                        MXS_WARNING("Write buffer size %s is too small."
+                                    " Setting it to the minimum of %d bytes.",
+                                    value, BLR_MIN_WRITE_BUFFER);
+                        size = BLR_MIN_WRITE_BUFFER;
+                    }
+                    inst->wbuf_size = size;
+                }
+                else if (strcmp(options[i], "sync_events") == 0)
+                {
+                    inst->sync_events = atoi(value);
+                }
+                else if (strcmp(options[i], "sync_interval") == 0)
+                {
+                    inst->sync_interval = atoi(value);
+                }
+                else if (strcmp(options[i], "sync_group") == 0)
+                {
+                    if ((inst->sync_group = blr_sync_group_get(value)) == NULL)
+                    {
+                        free_instance(inst);
+                        return NULL;
+                    }
+                }
+                else if (strcmp(options[i], "index_interval") == 0)
+                {
+                    inst->index_interval = atoi(value);
+                }
+                else if (strcmp(options[i], "compress_binlog") == 0)
+                {
+                    inst->compress_binlog = config_truth_value(value) == 1;
+                }
+                else if (strcmp(options[i], "sync_commit") == 0)
+                {
+                    inst->sync_commit = config_truth_value(value) == 1;
+                }
+                else if (strcmp(options[i], "semisync") == 0)
+                {
+                    inst->semisync = config_truth_value(value) == 1;
+                }
+                else if (strcmp(options[i], "semisync_sync") == 0)
+                {
+                    inst->semisync_sync = config_truth_value(value) == 1;
+                }
                 else if (strcmp(options[i], "heartbeat") == 0)
                 {
                     int h_val = (int)strtol(value, NULL, 10);
@@ -493,6 +590,19 @@ createInstance(SERVICE *service, char **options)
     {
         inst->fileroot = strdup(BINLOG_NAME_ROOT);
     }
+
+    /* The events are sent with sendfile() from the mapped binlog files */
+    if (inst->sendfile_binlog)
+    {
+        inst->mmap_binlog = true;
+    }
+
+    if (inst->wbuf_size && (inst->wbuf = malloc(inst->wbuf_size)) == NULL)
+    {
+        MXS_ERROR("%s: Failed to allocate the binlog write buffer, "
+                  "each event is written separately.", service->name);
+        inst->wbuf_size = 0;
+    }
     inst->active_logs = 0;
     inst->reconnect_pending = 0;
     inst->handling_threads = 0;
@@ -692,6 +802,11 @@ createInstance(SERVICE *service, char **options)
     snprintf(task_name, BLRM_TASK_NAME_LEN, "%s stats", service->name);
     hktask_add(task_name, stats_func, inst, BLR_STATS_FREQ);
 
+    if (inst->compress_binlog)
+    {
+        blr_compress_start(inst);
+    }
+
     /* Log whether the transaction safety option value is on*/
     if (inst->trx_safe)
     {
@@ -744,6 +859,7 @@ free_instance(ROUTER_INSTANCE *instance)
     free(instance->set_master_hostname);
     free(instance->fileroot);
     free(instance->binlogdir);
+    free(instance->wbuf);
     free(instance);
 }
 
@@ -799,6 +915,8 @@ newSession(ROUTER *instance, SESSION *session)
     slave->connect_time = time(0);
     slave->lastEventTimestamp = 0;
     slave->mariadb10_compat = false;
+    slave->use_gtid = false;
+    memset(&slave->connect_gtid, 0, sizeof(slave->connect_gtid));
     slave->heartbeat = 0;
     slave->lastEventReceived = 0;
 
@@ -1154,6 +1272,82 @@ diagnostics(ROUTER *router, DCB *dcb)
     dcb_printf(dcb, "\tAverage events per packet:                   %.1f\n",
                router_inst->stats.n_reads != 0 ?
                ((double)router_inst->stats.n_binlogs / router_inst->stats.n_reads) : 0);
+    if (router_inst->index_interval)
+    {
+        dcb_printf(dcb, "\tBinlog index interval (events):              %u\n",
+                   router_inst->index_interval);
+    }
+    if (router_inst->slave_pull)
+    {
+        dcb_printf(dcb, "\tNew events are read by the slave threads\n");
+    }
+    if (router_inst->mmap_binlog)
+    {
+        dcb_printf(dcb, "\tEvents sent from mapped binlog files:        %lu\n",
+                   router_inst->stats.n_mapped);
+    }
+    if (router_inst->semisync)
+    {
+        dcb_printf(dcb, "\tSemi-sync replication:                       %s\n",
+                   router_inst->master_semisync ? "Active" : "Inactive");
+        dcb_printf(dcb, "\tNumber of semi-sync acknowledgements:        %lu\n",
+                   router_inst->stats.n_semisync_acks);
+    }
+    dcb_printf(dcb, "\tNumber of binlog file writes:                %lu\n",
+               router_inst->stats.n_writes);
+    dcb_printf(dcb, "\tNumber of binlog file syncs:                 %lu\n",
+               router_inst->stats.n_syncs);
+    if (router_inst->sync_group)
+    {
+        dcb_printf(dcb, "\tSync group:                                  %s\n",
+                   router_inst->sync_group->name);
+        dcb_printf(dcb, "\tNumber of sync group syncs:                  %lu\n",
+                   router_inst->sync_group->n_syncs);
+    }
+    dcb_printf(dcb, "\tBinlog write and sync latency (microseconds)\n");
+    dcb_printf(dcb, "\t       ");
+    unsigned long limit = BLR_LATENCY_BASE;
+    for (i = 0; i < BLR_LATENCY_BUCKETS - 1; i++)
+    {
+        snprintf(buf, sizeof(buf), "<%lu", limit);
+        dcb_printf(dcb, "%-10s", buf);
+        limit *= 10;
+    }
+    dcb_printf(dcb, ">=%lu\n", limit / 10);
+    dcb_printf(dcb, "\tWrite  ");
+    for (i = 0; i < BLR_LATENCY_BUCKETS; i++)
+    {
+        dcb_printf(dcb, "%-10lu", router_inst->stats.write_latency[i]);
+    }
+    dcb_printf(dcb, "\n\tSync   ");
+    for (i = 0; i < BLR_LATENCY_BUCKETS; i++)
+    {
+        dcb_printf(dcb, "%-10lu", router_inst->stats.sync_latency[i]);
+    }
+    if (router_inst->semisync)
+    {
+        dcb_printf(dcb, "\n\tAck    ");
+        for (i = 0; i < BLR_LATENCY_BUCKETS; i++)
+        {
+            dcb_printf(dcb, "%-10lu", router_inst->stats.ack_latency[i]);
+        }
+    }
+    dcb_printf(dcb, "\n");
+    if (router_inst->event_ring.max_size)
+    {
+        spinlock_acquire(&router_inst->event_ring.lock);
+        dcb_printf(dcb, "\tEvent ring size limit (MB):                  %lu\n",
+                   router_inst->event_ring.max_size / (1024 * 1024));
+        dcb_printf(dcb, "\tEvents in event ring:                        %d\n",
+                   router_inst->event_ring.cnt);
+        dcb_printf(dcb, "\tSize of events in event ring:                %lu\n",
+                   router_inst->event_ring.size);
+        dcb_printf(dcb, "\tEvents read from event ring:                 %lu\n",
+                   router_inst->stats.n_cachehits);
+        dcb_printf(dcb, "\tEvents read from binlog files:               %lu\n",
+                   router_inst->stats.n_cachemisses);
+        spinlock_release(&router_inst->event_ring.lock);
+    }
 
     spinlock_acquire(&router_inst->lock);
     if (router_inst->stats.lastReply)
@@ -1296,6 +1490,12 @@ diagnostics(ROUTER *router, DCB *dcb)
             {
                 dcb_printf(dcb, "\t\tSlave UUID:                              %s\n", session->uuid);
             }
+            if (session->use_gtid)
+            {
+                dcb_printf(dcb, "\t\tConnect GTID:                            %u-%u-%lu\n",
+                           session->connect_gtid.domain, session->connect_gtid.server_id,
+                           (unsigned long)session->connect_gtid.seq);
+            }
             dcb_printf(dcb,
                        "\t\tSlave_host_port:                         %s:%d\n",
                        session->dcb->remote, ntohs((session->dcb->ipv4).sin_port));
@@ -28,6 +28,7 @@
  *
  * Date     Who     Description
  * 07/04/2014   Mark Riddoch        Initial implementation
+ * 14/10/2016   MariaDB Corporation Addition of the event ring
  *
  * @endverbatim
  */
@@ -59,3 +60,295 @@ void
 blr_init_cache(ROUTER_INSTANCE *router)
 {
 }
+
+/** Initial number of events the event ring has room for */
+#define BLR_RING_INITIAL_CAPACITY 256
+
+/**
+ * Free all events and files of the event ring. The caller must hold the
+ * lock of the ring.
+ *
+ * @param   ring        The event ring
+ */
+static void
+blr_ring_free_events(BLR_EVENT_RING *ring)
+{
+    for (int i = 0; i < ring->cnt; i++)
+    {
+        gwbuf_free(ring->records[(ring->start + i) % ring->capacity].pkt);
+    }
+
+    while (ring->files)
+    {
+        BLR_RING_FILE *file = ring->files;
+        ring->files = file->next;
+        free(file);
+    }
+
+    ring->last_file = NULL;
+    ring->first += ring->cnt;
+    ring->start = 0;
+    ring->cnt = 0;
+    ring->size = 0;
+    ring->end_pos = 0;
+}
+
+/**
+ * Remove the oldest event from the event ring. The caller must hold the
+ * lock of the ring.
+ *
+ * @param   ring        The event ring, must not be empty
+ */
+static void
+blr_ring_remove_oldest(BLR_EVENT_RING *ring)
+{
+    BLCACHE_RECORD *record = &ring->records[ring->start];
+
+    ring->size -= GWBUF_LENGTH(record->pkt);
+    gwbuf_free(record->pkt);
+    record->pkt = NULL;
+    ring->start = (ring->start + 1) % ring->capacity;
+    ring->cnt--;
+    ring->first++;
+
+    if (ring->cnt == 0)
+    {
+        blr_ring_free_events(ring);
+        return;
+    }
+
+    /* Remove the files that no longer have events in the ring */
+    while (ring->files->next && ring->files->next->first <= ring->first)
+    {
+        BLR_RING_FILE *file = ring->files;
+        ring->files = file->next;
+        free(file);
+    }
+}
+
+/**
+ * Double the number of events the event ring has room for. The caller must
+ * hold the lock of the ring.
+ *
+ * @param   ring        The event ring
+ * @return  True on success, false on memory allocation failure
+ */
+static bool
+blr_ring_grow(BLR_EVENT_RING *ring)
+{
+    int capacity = ring->capacity ? ring->capacity * 2 : BLR_RING_INITIAL_CAPACITY;
+    BLCACHE_RECORD *records = malloc(capacity * sizeof(BLCACHE_RECORD));
+
+    if (records == NULL)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < ring->cnt; i++)
+    {
+        records[i] = ring->records[(ring->start + i) % ring->capacity];
+    }
+
+    free(ring->records);
+    ring->records = records;
+    ring->capacity = capacity;
+    ring->start = 0;
+    return true;
+}
+
+/**
+ * Add an event written to the current binlog file to the event ring. The
+ * oldest events are removed to keep the ring within its size limit.
+ *
+ * @param   router      The router instance
+ * @param   hdr         The header of the event
+ * @param   pos         The position of the event in the current binlog file
+ * @param   buf         The event
+ * @param   size        The size of the event
+ */
+void
+blr_ring_add(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint64_t pos, uint8_t *buf, uint32_t size)
+{
+    BLR_EVENT_RING *ring = &router->event_ring;
+    GWBUF *pkt;
+
+    /*
+     * Events that don't fit into the ring or whose next position does not
+     * match the file are left out, the slaves read them from the file.
+     */
+    if (size > ring->max_size ||
+        (hdr->event_type != ROTATE_EVENT && hdr->next_pos != pos + size) ||
+        (pkt = gwbuf_alloc_and_load(size, buf)) == NULL)
+    {
+        return;
+    }
+
+    spinlock_acquire(&ring->lock);
+
+    if (ring->last_file && strcmp(ring->last_file->binlogname, router->binlog_name) == 0)
+    {
+        if (pos < ring->end_pos)
+        {
+            /* The file has been truncated and is written again */
+            blr_ring_free_events(ring);
+        }
+    }
+    else
+    {
+        BLR_RING_FILE *file = ring->files;
+
+        while (file && strcmp(file->binlogname, router->binlog_name) != 0)
+        {
+            file = file->next;
+        }
+
+        if (file)
+        {
+            /* An older file is written again */
+            blr_ring_free_events(ring);
+        }
+    }
+
+    while (ring->cnt > 0 && ring->size + size > ring->max_size)
+    {
+        blr_ring_remove_oldest(ring);
+    }
+
+    if (ring->cnt == ring->capacity && !blr_ring_grow(ring))
+    {
+        spinlock_release(&ring->lock);
+        gwbuf_free(pkt);
+        return;
+    }
+
+    if (ring->last_file == NULL || strcmp(ring->last_file->binlogname, router->binlog_name) != 0)
+    {
+        BLR_RING_FILE *file = malloc(sizeof(BLR_RING_FILE));
+
+        if (file == NULL)
+        {
+            spinlock_release(&ring->lock);
+            gwbuf_free(pkt);
+            return;
+        }
+
+        strcpy(file->binlogname, router->binlog_name);
+        file->first = ring->first + ring->cnt;
+        file->next = NULL;
+
+        if (ring->last_file)
+        {
+            ring->last_file->next = file;
+        }
+        else
+        {
+            ring->files = file;
+        }
+        ring->last_file = file;
+    }
+
+    BLCACHE_RECORD *record = &ring->records[(ring->start + ring->cnt) % ring->capacity];
+    record->position = pos;
+    record->pkt = pkt;
+    record->hdr = *hdr;
+    ring->cnt++;
+    ring->size += size;
+    ring->end_pos = pos + size;
+
+    spinlock_release(&ring->lock);
+}
+
+/**
+ * Read an event from the event ring. Only the events before the last safe
+ * position are returned, like blr_read_binlog() does.
+ *
+ * @param   router      The router instance
+ * @param   binlog      The binlog file of the event
+ * @param   pos         The position of the event
+ * @param   hdr         The header of the event is copied here
+ * @return  The event or NULL if it is not in the ring
+ */
+GWBUF *
+blr_ring_read(ROUTER_INSTANCE *router, char *binlog, unsigned long pos, REP_HEADER *hdr)
+{
+    BLR_EVENT_RING *ring = &router->event_ring;
+    GWBUF *rval = NULL;
+
+    if (ring->max_size == 0)
+    {
+        return NULL;
+    }
+
+    spinlock_acquire(&router->binlog_lock);
+    bool safe = strcmp(router->binlog_name, binlog) != 0 || pos < router->binlog_position;
+    spinlock_release(&router->binlog_lock);
+
+    if (!safe)
+    {
+        return NULL;
+    }
+
+    spinlock_acquire(&ring->lock);
+
+    BLR_RING_FILE *file = ring->files;
+
+    while (file && strcmp(file->binlogname, binlog) != 0)
+    {
+        file = file->next;
+    }
+
+    if (file)
+    {
+        /* The events of a file are in the order of their positions */
+        uint64_t low = MAX(file->first, ring->first);
+        uint64_t high = file->next ? file->next->first : ring->first + ring->cnt;
+
+        while (low < high)
+        {
+            uint64_t mid = low + (high - low) / 2;
+            BLCACHE_RECORD *record = &ring->records[(ring->start + (mid - ring->first)) % ring->capacity];
+
+            if (record->position < pos)
+            {
+                low = mid + 1;
+            }
+            else if (record->position > pos)
+            {
+                high = mid;
+            }
+            else
+            {
+                rval = gwbuf_clone(record->pkt);
+                *hdr = record->hdr;
+                hdr->ok = SLAVE_POS_READ_OK;
+                break;
+            }
+        }
+    }
+
+    if (rval)
+    {
+        router->stats.n_cachehits++;
+    }
+    else
+    {
+        router->stats.n_cachemisses++;
+    }
+
+    spinlock_release(&ring->lock);
+
+    return rval;
+}
+
+/**
+ * Remove all events from the event ring
+ *
+ * @param   router      The router instance
+ */
+void
+blr_ring_clear(ROUTER_INSTANCE *router)
+{
+    spinlock_acquire(&router->event_ring.lock);
+    blr_ring_free_events(&router->event_ring);
+    spinlock_release(&router->event_ring.lock);
+}
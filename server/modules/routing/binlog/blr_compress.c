@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file blr_compress.c - binlog router compressed binlog files
+ *
+ * With the compress_binlog option, the housekeeper compresses the binlog
+ * files that are no longer written to. The binlog file and the file before
+ * it are never compressed, as the router may still truncate the previous
+ * file when the replication is restarted.
+ *
+ * The file is compressed with zlib in blocks of BLR_COMPRESS_BLOCK_SIZE bytes.
+ * The blocks are followed by the offsets of the blocks and a trailer, so an
+ * event at any position can be read by decompressing only the blocks that
+ * contain it. The compressed file replaces the binlog file once it has been
+ * completely written and synced.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date     Who     Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <service.h>
+#include <housekeeper.h>
+#include <blr.h>
+#include <skygw_types.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/**
+ * Write a compressed binlog file
+ *
+ * @param src   The binlog file
+ * @param size  Size of the binlog file
+ * @param fd    The file to write the compressed file to
+ * @return      True if the file was written
+ */
+static bool
+blr_compress_write(int src, uint64_t size, int fd)
+{
+    BLR_COMPRESS_TRAILER trailer;
+    uint32_t n_blocks = (size + BLR_COMPRESS_BLOCK_SIZE - 1) / BLR_COMPRESS_BLOCK_SIZE;
+    uLong bound = compressBound(BLR_COMPRESS_BLOCK_SIZE);
+    uint8_t *block = malloc(BLR_COMPRESS_BLOCK_SIZE);
+    uint8_t *cbuf = malloc(bound);
+    uint64_t *offsets = malloc((n_blocks + 1) * sizeof(uint64_t));
+    uint64_t offset = 0;
+    bool rval = block && cbuf && offsets;
+    uint32_t i;
+
+    for (i = 0; rval && i < n_blocks; i++)
+    {
+        size_t len = MIN(BLR_COMPRESS_BLOCK_SIZE, size - (uint64_t)i * BLR_COMPRESS_BLOCK_SIZE);
+        uLongf clen = bound;
+
+        rval = pread(src, block, len, (uint64_t)i * BLR_COMPRESS_BLOCK_SIZE) == len &&
+               compress2(cbuf, &clen, block, len, Z_DEFAULT_COMPRESSION) == Z_OK &&
+               write(fd, cbuf, clen) == clen;
+        offsets[i] = offset;
+        offset += clen;
+    }
+
+    if (rval)
+    {
+        offsets[n_blocks] = offset;
+        memcpy(trailer.magic, BLR_COMPRESS_MAGIC, sizeof(trailer.magic));
+        trailer.size = size;
+        trailer.block_size = BLR_COMPRESS_BLOCK_SIZE;
+        trailer.n_blocks = n_blocks;
+
+        rval = write(fd, offsets, (n_blocks + 1) * sizeof(uint64_t)) ==
+               (n_blocks + 1) * sizeof(uint64_t) &&
+               write(fd, &trailer, sizeof(trailer)) == sizeof(trailer) &&
+               fsync(fd) == 0;
+    }
+
+    free(block);
+    free(cbuf);
+    free(offsets);
+    return rval;
+}
+
+/**
+ * Compress a binlog file and replace it with the compressed file
+ *
+ * @param router    The router instance
+ * @param binlog    The binlog file name
+ * @return          True if the file was compressed
+ */
+static bool
+blr_compress_binlog(ROUTER_INSTANCE *router, const char *binlog)
+{
+    char path[PATH_MAX + 1];
+    char zpath[PATH_MAX + 1];
+    char tmp_path[PATH_MAX + 1];
+    struct stat statb;
+    bool rval = false;
+    int src, fd;
+
+    snprintf(path, sizeof(path), "%s/%s", router->binlogdir, binlog);
+    snprintf(zpath, sizeof(zpath), "%s%s", path, BLR_COMPRESS_SUFFIX);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", zpath);
+
+    if ((src = open(path, O_RDONLY)) == -1)
+    {
+        return false;
+    }
+
+    /* The readers open the binlog file until the compressed file is complete */
+    if (fstat(src, &statb) == 0 && (fd = mkstemp(tmp_path)) != -1)
+    {
+        if (blr_compress_write(src, statb.st_size, fd) && rename(tmp_path, zpath) == 0)
+        {
+            unlink(path);
+            MXS_NOTICE("%s: Compressed binlog file '%s'.", router->service->name, binlog);
+            rval = true;
+        }
+        else
+        {
+            char err_msg[STRERROR_BUFLEN];
+            MXS_ERROR("%s: Failed to compress binlog file '%s': %s",
+                      router->service->name, binlog,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
+            unlink(tmp_path);
+        }
+        close(fd);
+    }
+
+    close(src);
+    return rval;
+}
+
+/**
+ * The housekeeper task that compresses the closed binlog files. One file is
+ * compressed on each call.
+ *
+ * @param inst  The router instance
+ */
+static void
+blr_compress_task(void *inst)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)inst;
+    char binlog[BINLOG_FNAMELEN + 1];
+    char path[PATH_MAX + 1];
+    char *sptr;
+    int last = 0;
+
+    spinlock_acquire(&router->binlog_lock);
+    if ((sptr = strrchr(router->binlog_name, '.')) != NULL)
+    {
+        /* The current and the previous binlog file are not compressed */
+        last = atoi(sptr + 1) - 2;
+    }
+    spinlock_release(&router->binlog_lock);
+
+    while (router->compressed_upto < last)
+    {
+        snprintf(binlog, sizeof(binlog), BINLOG_NAMEFMT, router->fileroot,
+                 router->compressed_upto + 1);
+        snprintf(path, sizeof(path), "%s/%s", router->binlogdir, binlog);
+        router->compressed_upto++;
+
+        if (access(path, R_OK) == 0)
+        {
+            blr_compress_binlog(router, binlog);
+            break;
+        }
+    }
+}
+
+/**
+ * Start compressing the closed binlog files with the housekeeper
+ *
+ * @param router    The router instance
+ */
+void
+blr_compress_start(ROUTER_INSTANCE *router)
+{
+    char task_name[BLRM_TASK_NAME_LEN + 1];
+
+    snprintf(task_name, BLRM_TASK_NAME_LEN, "%s binlog compression", router->service->name);
+    hktask_add(task_name, blr_compress_task, router, BLR_COMPRESS_FREQ);
+}
+
+/**
+ * Open a compressed binlog file for reading
+ *
+ * @param fd    The compressed file
+ * @return      The compressed file or NULL if the file could not be read
+ */
+BLR_ZFILE *
+blr_compress_open(int fd)
+{
+    BLR_COMPRESS_TRAILER trailer;
+    BLR_ZFILE *zfile;
+    struct stat statb;
+    size_t len;
+
+    if (fstat(fd, &statb) == -1 || statb.st_size < (off_t)sizeof(trailer) ||
+        pread(fd, &trailer, sizeof(trailer), statb.st_size - sizeof(trailer)) != sizeof(trailer) ||
+        memcmp(trailer.magic, BLR_COMPRESS_MAGIC, sizeof(trailer.magic)) != 0 ||
+        trailer.block_size == 0)
+    {
+        return NULL;
+    }
+
+    len = (trailer.n_blocks + 1) * sizeof(uint64_t);
+
+    if ((uint64_t)statb.st_size < sizeof(trailer) + len ||
+        (zfile = (BLR_ZFILE *)calloc(1, sizeof(BLR_ZFILE))) == NULL)
+    {
+        return NULL;
+    }
+
+    zfile->size = trailer.size;
+    zfile->block_size = trailer.block_size;
+    zfile->n_blocks = trailer.n_blocks;
+    zfile->cached = -1;
+    zfile->offsets = malloc(len);
+    zfile->block = malloc(trailer.block_size);
+    zfile->cbuf = malloc(compressBound(trailer.block_size));
+
+    if (zfile->offsets == NULL || zfile->block == NULL || zfile->cbuf == NULL ||
+        pread(fd, zfile->offsets, len, statb.st_size - sizeof(trailer) - len) != len)
+    {
+        blr_compress_close(zfile);
+        return NULL;
+    }
+
+    return zfile;
+}
+
+/**
+ * Close a compressed binlog file
+ *
+ * @param zfile The compressed file
+ */
+void
+blr_compress_close(BLR_ZFILE *zfile)
+{
+    free(zfile->offsets);
+    free(zfile->block);
+    free(zfile->cbuf);
+    free(zfile);
+}
+
+/**
+ * Read from a compressed binlog file. The caller must hold the lock of the
+ * binlog file, as the decompressed block is shared.
+ *
+ * @param zfile The compressed file
+ * @param fd    The file descriptor of the compressed file
+ * @param buf   Buffer where the data is read
+ * @param len   Number of bytes to read
+ * @param pos   Position to read from in the binlog file
+ * @return      Number of bytes read, 0 at the end of the file, -1 on error
+ */
+int
+blr_compress_read(BLR_ZFILE *zfile, int fd, uint8_t *buf, size_t len, unsigned long pos)
+{
+    size_t n = 0;
+
+    if (pos >= zfile->size)
+    {
+        return 0;
+    }
+
+    len = MIN(len, zfile->size - pos);
+
+    while (n < len)
+    {
+        long block = (pos + n) / zfile->block_size;
+        uint32_t offset = (pos + n) % zfile->block_size;
+
+        if (block != zfile->cached)
+        {
+            uint64_t clen = zfile->offsets[block + 1] - zfile->offsets[block];
+            uLongf blen = zfile->block_size;
+
+            zfile->cached = -1;
+
+            if (clen > compressBound(zfile->block_size) ||
+                pread(fd, zfile->cbuf, clen, zfile->offsets[block]) != clen ||
+                uncompress(zfile->block, &blen, zfile->cbuf, clen) != Z_OK)
+            {
+                errno = EIO;
+                return -1;
+            }
+
+            zfile->cached = block;
+        }
+
+        size_t count = MIN(len - n, zfile->block_size - offset);
+        memcpy(buf + n, zfile->block + offset, count);
+        n += count;
+    }
+
+    return n;
+}
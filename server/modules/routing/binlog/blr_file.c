@@ -43,9 +43,11 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include <service.h>
 #include <server.h>
 #include <router.h>
@@ -237,6 +239,7 @@ blr_file_create(ROUTER_INSTANCE *router, char *file)
     {
         if (blr_file_add_magic(fd))
         {
+            blr_file_write_pending(router);
             close(router->binlog_fd);
             spinlock_acquire(&router->binlog_lock);
             strncpy(router->binlog_name, file, BINLOG_FNAMELEN);
@@ -247,6 +250,7 @@ blr_file_create(ROUTER_INSTANCE *router, char *file)
             router->last_written = BINLOG_MAGIC_SIZE;
             spinlock_release(&router->binlog_lock);
 
+            blr_index_open(router, true);
             created = 1;
         }
         else
@@ -294,6 +298,7 @@ blr_file_append(ROUTER_INSTANCE *router, char *file)
         return;
     }
     fsync(fd);
+    blr_file_write_pending(router);
     close(router->binlog_fd);
     spinlock_acquire(&router->binlog_lock);
     memmove(router->binlog_name, file, BINLOG_FNAMELEN);
@@ -327,28 +332,57 @@ blr_file_append(ROUTER_INSTANCE *router, char *file)
     }
     router->binlog_fd = fd;
     spinlock_release(&router->binlog_lock);
+
+    blr_index_open(router, false);
 }
 
 /**
- * Write a binlog entry to disk.
+ * Add the time elapsed since an earlier time to a latency histogram
+ *
+ * @param histogram The latency histogram
+ * @param start     The earlier time in microseconds
+ */
+void
+blr_add_latency(uint64_t *histogram, uint64_t start)
+{
+    uint64_t elapsed = ts_clock_us() - start;
+    uint64_t limit = BLR_LATENCY_BASE;
+    int i = 0;
+
+    while (i < BLR_LATENCY_BUCKETS - 1 && elapsed >= limit)
+    {
+        limit *= 10;
+        i++;
+    }
+
+    histogram[i]++;
+}
+
+/**
+ * Write data to the current binlog file. If the write fails, the partially
+ * written transaction is removed from the file.
  *
  * @param router The router instance
- * @param buf    The binlog record
- * @param len    The length of the binlog record
- * @return       Return the number of bytes written
+ * @param buf    The data to write
+ * @param size   The size of the data
+ * @param pos    The file position to write to
+ * @return       True on success, false on failure
  */
-int
-blr_write_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint32_t size, uint8_t *buf)
+static bool
+blr_file_pwrite(ROUTER_INSTANCE *router, uint8_t *buf, uint32_t size, uint64_t pos)
 {
-    int n;
+    uint64_t start = ts_clock_us();
+    ssize_t n = pwrite(router->binlog_fd, buf, size, pos);
 
-    if ((n = pwrite(router->binlog_fd, buf, size,
-                    router->last_written)) != size)
+    blr_add_latency(router->stats.write_latency, start);
+    router->stats.n_writes++;
+
+    if (n != size)
     {
         char err_msg[STRERROR_BUFLEN];
         MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
                   "Truncating to previous record.",
-                  router->service->name, router->last_written,
+                  router->service->name, pos,
                   router->binlog_name,
                   strerror_r(errno, err_msg, sizeof(err_msg)));
         /* Remove any partial event that was written */
@@ -359,25 +393,255 @@ blr_write_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint32_t size,
                       router->binlog_name,
                       strerror_r(errno, err_msg, sizeof(err_msg)));
         }
+        blr_ring_clear(router);
+        blr_index_discard(router);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Write the start of the write buffer to the binlog file. The caller must
+ * hold the lock of the write buffer. If the write fails, the buffer is
+ * emptied.
+ *
+ * @param router The router instance
+ * @param len    Number of bytes to write
+ * @return       True on success, false on failure
+ */
+static bool
+blr_file_write_buffer(ROUTER_INSTANCE *router, unsigned long len)
+{
+    if (len == 0)
+    {
+        return true;
+    }
+
+    if (!blr_file_pwrite(router, router->wbuf, len, router->wbuf_pos))
+    {
+        router->wbuf_len = 0;
+        return false;
+    }
+
+    router->wbuf_len -= len;
+    router->wbuf_pos += len;
+    memmove(router->wbuf, router->wbuf + len, router->wbuf_len);
+    return true;
+}
+
+/**
+ * Write all buffered events to the binlog file. This must be done before the
+ * file is read or closed.
+ *
+ * @param router The router instance
+ * @return       True on success, false if the write failed
+ */
+bool
+blr_file_write_pending(ROUTER_INSTANCE *router)
+{
+    bool rval = true;
+
+    if (router->wbuf_size)
+    {
+        spinlock_acquire(&router->wbuf_lock);
+        rval = blr_file_write_buffer(router, router->wbuf_len);
+        spinlock_release(&router->wbuf_lock);
+    }
+
+    return rval;
+}
+
+/**
+ * Add an event to the write buffer. When the buffer is full, the events are
+ * written up to the last aligned file offset and the rest stays in the buffer.
+ * Events that are larger than the buffer are written directly.
+ *
+ * @param router The router instance
+ * @param buf    The event
+ * @param size   The size of the event
+ * @param pos    The file position of the event
+ * @return       True on success, false if a write failed
+ */
+static bool
+blr_file_buffer_event(ROUTER_INSTANCE *router, uint8_t *buf, uint32_t size, uint64_t pos)
+{
+    bool rval = true;
+
+    spinlock_acquire(&router->wbuf_lock);
+    ss_dassert(router->wbuf_len == 0 || router->wbuf_pos + router->wbuf_len == pos);
+
+    if (router->wbuf_len + size > router->wbuf_size)
+    {
+        uint64_t aligned = (router->wbuf_pos + router->wbuf_len) & ~((uint64_t)BLR_WRITE_ALIGN - 1);
+
+        if (aligned > router->wbuf_pos)
+        {
+            rval = blr_file_write_buffer(router, aligned - router->wbuf_pos);
+        }
+
+        if (rval && router->wbuf_len + size > router->wbuf_size)
+        {
+            rval = blr_file_write_buffer(router, router->wbuf_len);
+        }
+    }
+
+    if (rval)
+    {
+        if (size > router->wbuf_size)
+        {
+            rval = blr_file_pwrite(router, buf, size, pos);
+        }
+        else
+        {
+            if (router->wbuf_len == 0)
+            {
+                router->wbuf_pos = pos;
+            }
+            memcpy(router->wbuf + router->wbuf_len, buf, size);
+            router->wbuf_len += size;
+        }
+    }
+
+    spinlock_release(&router->wbuf_lock);
+    return rval;
+}
+
+/**
+ * Sync the current binlog file to disk. With a sync group, the filesystem
+ * is synced together with the other routers of the group.
+ *
+ * @param router The router instance
+ */
+static void
+blr_file_sync(ROUTER_INSTANCE *router)
+{
+    uint64_t start = ts_clock_us();
+
+    if (router->sync_group)
+    {
+        blr_sync_group_sync(router->sync_group, router->binlog_fd);
+    }
+    else
+    {
+        fsync(router->binlog_fd);
+    }
+    blr_add_latency(router->stats.sync_latency, start);
+    router->stats.n_syncs++;
+    router->unsynced_events = 0;
+    router->last_sync = ts_clock_us() / 1000;
+}
+
+/**
+ * Check whether an event commits a transaction
+ *
+ * @param hdr  The event header
+ * @param buf  The event
+ * @param size The size of the event
+ * @return     True for XID events and COMMIT query events
+ */
+static bool
+blr_is_commit_event(REP_HEADER *hdr, uint8_t *buf, uint32_t size)
+{
+    if (hdr->event_type == XID_EVENT)
+    {
+        return true;
+    }
+
+    if (hdr->event_type == QUERY_EVENT && size > BINLOG_EVENT_HDR_LEN + 13)
+    {
+        /* Thread id, execution time, database length, error code and status variable length */
+        uint8_t *ptr = buf + BINLOG_EVENT_HDR_LEN;
+        uint32_t offset = BINLOG_EVENT_HDR_LEN + 13 + EXTRACT16(ptr + 11) + ptr[8] + 1;
+
+        return offset + 6 <= size && strncmp((char *)buf + offset, "COMMIT", 6) == 0;
+    }
+
+    return false;
+}
+
+/**
+ * Write a binlog entry to disk.
+ *
+ * If the write buffer is used, the entry may stay in the buffer until the
+ * buffer is full or blr_file_write_pending() is called.
+ *
+ * @param router The router instance
+ * @param buf    The binlog record
+ * @param len    The length of the binlog record
+ * @return       Return the number of bytes written
+ */
+int
+blr_write_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint32_t size, uint8_t *buf)
+{
+    uint64_t pos = router->last_written;
+
+    if (router->wbuf_size ?
+        !blr_file_buffer_event(router, buf, size, pos) :
+        !blr_file_pwrite(router, buf, size, pos))
+    {
         return 0;
     }
+    blr_ring_add(router, hdr, pos, buf, size);
+    blr_index_add(router, hdr, pos, buf);
     spinlock_acquire(&router->binlog_lock);
     router->current_pos = hdr->next_pos;
     router->last_written += size;
     router->last_event_pos = hdr->next_pos - hdr->event_size;
     spinlock_release(&router->binlog_lock);
-    return n;
+
+    router->unsynced_events++;
+
+    if ((router->sync_events && router->unsynced_events >= router->sync_events) ||
+        (router->sync_commit && blr_is_commit_event(hdr, buf, size)))
+    {
+        if (blr_file_write_pending(router))
+        {
+            blr_file_sync(router);
+        }
+    }
+
+    return size;
 }
 
 /**
- * Flush the content of the binlog file to disk.
+ * Flush the content of the binlog file to disk. This is called after each
+ * batch of events from the master.
+ *
+ * The buffered events are always written. Unless one of the sync_events,
+ * sync_interval or sync_commit options is used, the file is also synced.
+ * With sync_interval, the file is synced if the interval has passed since
+ * the last sync. With semisync_sync, the file is also synced before a
+ * semi-sync acknowledgement is sent. In a sync group, the interval is from
+ * the last sync of the group, as it synced the file too.
  *
  * @param   router  The binlog router
  */
 void
 blr_file_flush(ROUTER_INSTANCE *router)
 {
-    fsync(router->binlog_fd);
+    uint64_t last_sync = router->sync_group ?
+                         MAX(router->sync_group->last_sync, router->last_sync) : router->last_sync;
+
+    if (!blr_file_write_pending(router))
+    {
+        /* The events were not written, they must not be acknowledged */
+        router->ack_pending = false;
+    }
+
+    if (router->sync_events == 0 && router->sync_interval == 0 && !router->sync_commit)
+    {
+        blr_file_sync(router);
+    }
+    else if (router->sync_interval && router->unsynced_events &&
+             ts_clock_us() / 1000 - last_sync >= router->sync_interval)
+    {
+        blr_file_sync(router);
+    }
+    else if (router->ack_pending && router->semisync_sync && router->unsynced_events)
+    {
+        blr_file_sync(router);
+    }
 }
 
 /**
@@ -421,7 +685,21 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
     strncat(path, "/", PATH_MAX - strlen(path));
     strncat(path, binlog, PATH_MAX - strlen(path));
 
-    if ((file->fd = open(path, O_RDONLY, 0666)) == -1)
+    if ((file->fd = open(path, O_RDONLY, 0666)) == -1 && errno == ENOENT)
+    {
+        /* The file may have been compressed */
+        strncat(path, BLR_COMPRESS_SUFFIX, PATH_MAX - strlen(path));
+
+        if ((file->fd = open(path, O_RDONLY, 0666)) != -1 &&
+            (file->zfile = blr_compress_open(file->fd)) == NULL)
+        {
+            MXS_ERROR("Compressed binlog file %s is not valid", path);
+            close(file->fd);
+            file->fd = -1;
+        }
+    }
+
+    if (file->fd == -1)
     {
         MXS_ERROR("Failed to open binlog file %s", path);
         free(file);
@@ -436,9 +714,130 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
     return file;
 }
 
+/**
+ * Release a reference to a binlog file mapping. The file is unmapped when
+ * the last reference is released.
+ *
+ * @param arg   The mapping
+ */
+static void
+blr_map_release(void *arg)
+{
+    BLR_MAP *map = (BLR_MAP *)arg;
+
+    if (atomic_add(&map->refcount, -1) == 1)
+    {
+        if (map->fd != -1)
+        {
+            close(map->fd);
+        }
+        munmap(map->data, map->size);
+        free(map);
+    }
+}
+
+/**
+ * Get the memory mapping of a binlog file, mapping the file if it is not
+ * yet mapped. Only files that are no longer written to may be mapped.
+ *
+ * With the sendfile_binlog option, the mapping keeps its own descriptor of
+ * the file open for sending the events that refer to it.
+ *
+ * @param router    The router instance
+ * @param file      The binlog file
+ * @return          The mapping, or NULL if the file could not be mapped
+ */
+static BLR_MAP *
+blr_file_map(ROUTER_INSTANCE *router, BLFILE *file)
+{
+    BLR_MAP *map;
+
+    spinlock_acquire(&file->lock);
+
+    if (file->map == NULL && !file->map_failed)
+    {
+        struct stat statb;
+        void *data = MAP_FAILED;
+
+        if (fstat(file->fd, &statb) == 0 && statb.st_size > 0)
+        {
+            data = mmap(NULL, statb.st_size, PROT_READ, MAP_SHARED, file->fd, 0);
+        }
+
+        if (data != MAP_FAILED && (map = (BLR_MAP *)malloc(sizeof(BLR_MAP))) != NULL)
+        {
+            madvise(data, statb.st_size, MADV_SEQUENTIAL);
+            map->data = data;
+            map->size = statb.st_size;
+            map->refcount = 1;
+            map->fd = router->sendfile_binlog ? dup(file->fd) : -1;
+            file->map = map;
+        }
+        else
+        {
+            char err_msg[STRERROR_BUFLEN];
+            MXS_WARNING("%s: Failed to map binlog file '%s', reading it without "
+                        "mmap: %s", router->service->name, file->binlogname,
+                        strerror_r(errno, err_msg, sizeof(err_msg)));
+
+            if (data != MAP_FAILED)
+            {
+                munmap(data, statb.st_size);
+            }
+            file->map_failed = true;
+        }
+    }
+
+    map = file->map;
+    spinlock_release(&file->lock);
+
+    return map;
+}
+
+/**
+ * Read from a binlog file, either from its mapping, with pread() or by
+ * decompressing it if the file is compressed.
+ *
+ * @param file  The binlog file
+ * @param map   The mapping of the file or NULL
+ * @param buf   Buffer where the data is read
+ * @param len   Number of bytes to read
+ * @param pos   File position to read from
+ * @return      Number of bytes read, 0 at the end of the file, -1 on error
+ */
+int
+blr_file_read(BLFILE *file, BLR_MAP *map, uint8_t *buf, size_t len, unsigned long pos)
+{
+    if (file->zfile)
+    {
+        spinlock_acquire(&file->lock);
+        int n = blr_compress_read(file->zfile, file->fd, buf, len, pos);
+        spinlock_release(&file->lock);
+        return n;
+    }
+
+    if (map == NULL)
+    {
+        return pread(file->fd, buf, len, pos);
+    }
+
+    if (pos >= map->size)
+    {
+        return 0;
+    }
+
+    len = MIN(len, map->size - pos);
+    memcpy(buf, map->data + pos, len);
+    return len;
+}
+
 /**
  * Read a replication event into a GWBUF structure.
  *
+ * If the mmap_binlog option is used and the file is no longer written to,
+ * the returned buffer refers to the mapped file instead of a copy of the
+ * event and it must not be modified.
+ *
  * @param router    The router instance
  * @param file      File record
  * @param pos       Position of binlog record to read
@@ -455,6 +854,8 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
     int n;
     unsigned long filelen = 0;
     struct stat statb;
+    bool closed;
+    BLR_MAP *map = NULL;
 
     memset(hdbuf, '\0', BINLOG_EVENT_HDR_LEN);
 
@@ -468,8 +869,25 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
         return NULL;
     }
 
+    /* The latest events of the current binlog can still be in the write buffer */
+    if (router->wbuf_size)
+    {
+        spinlock_acquire(&router->binlog_lock);
+        bool current = strcmp(router->binlog_name, file->binlogname) == 0;
+        spinlock_release(&router->binlog_lock);
+
+        if (current)
+        {
+            blr_file_write_pending(router);
+        }
+    }
+
     spinlock_acquire(&file->lock);
-    if (fstat(file->fd, &statb) == 0)
+    if (file->zfile)
+    {
+        filelen = file->zfile->size;
+    }
+    else if (fstat(file->fd, &statb) == 0)
     {
         filelen = statb.st_size;
     }
@@ -517,8 +935,9 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
     spinlock_acquire(&router->binlog_lock);
     spinlock_acquire(&file->lock);
 
-    if (strcmp(router->binlog_name, file->binlogname) == 0 &&
-        pos >= router->binlog_position)
+    closed = strcmp(router->binlog_name, file->binlogname) != 0;
+
+    if (!closed && pos >= router->binlog_position)
     {
         if (pos > router->binlog_position)
         {
@@ -542,8 +961,13 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
     spinlock_release(&file->lock);
     spinlock_release(&router->binlog_lock);
 
+    if (closed && router->mmap_binlog && file->zfile == NULL)
+    {
+        map = blr_file_map(router, file);
+    }
+
     /* Read the header information from the file */
-    if ((n = pread(file->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+    if ((n = blr_file_read(file, map, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
     {
         switch (n)
         {
@@ -627,7 +1051,7 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                   pos, file->binlogname, filelen, router->binlog_position,
                   router->binlog_name);
 
-        if ((n = pread(file->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+        if ((n = blr_file_read(file, map, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
         {
             switch (n)
             {
@@ -682,6 +1106,32 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                       "rereading");
         }
     }
+
+    /* Send the event straight from the mapped file */
+    if (map && pos + hdr->event_size <= map->size)
+    {
+        atomic_add(&map->refcount, 1);
+
+        if ((result = gwbuf_alloc_external(hdr->event_size, map->data + pos,
+                                           blr_map_release, map)) == NULL)
+        {
+            blr_map_release(map);
+            snprintf(errmsg, BINLOG_ERROR_MSG_LEN,
+                     "Failed to allocate memory for binlog entry, size %d, event at %lu in binlog file '%s'",
+                     hdr->event_size, pos, file->binlogname);
+            return NULL;
+        }
+
+        if (map->fd != -1)
+        {
+            gwbuf_set_file(result, map->fd, pos);
+        }
+
+        router->stats.n_mapped++;
+        hdr->ok = SLAVE_POS_READ_OK;
+        return result;
+    }
+
     if ((result = gwbuf_alloc(hdr->event_size)) == NULL)
     {
         snprintf(errmsg, BINLOG_ERROR_MSG_LEN,
@@ -694,8 +1144,8 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
 
     memcpy(data, hdbuf, BINLOG_EVENT_HDR_LEN);  // Copy the header in
 
-    if ((n = pread(file->fd, &data[BINLOG_EVENT_HDR_LEN], hdr->event_size - BINLOG_EVENT_HDR_LEN,
-                   pos + BINLOG_EVENT_HDR_LEN))
+    if ((n = blr_file_read(file, NULL, &data[BINLOG_EVENT_HDR_LEN], hdr->event_size - BINLOG_EVENT_HDR_LEN,
+                           pos + BINLOG_EVENT_HDR_LEN))
         != hdr->event_size - BINLOG_EVENT_HDR_LEN)  // Read the balance
     {
         if (n == -1)
@@ -776,6 +1226,14 @@ blr_close_binlog(ROUTER_INSTANCE *router, BLFILE *file)
 
     if (file)
     {
+        if (file->map)
+        {
+            blr_map_release(file->map);
+        }
+        if (file->zfile)
+        {
+            blr_compress_close(file->zfile);
+        }
         close(file->fd);
         file->fd = -1;
         free(file);
@@ -815,6 +1273,10 @@ blr_file_size(BLFILE *file)
 {
     struct stat statb;
 
+    if (file->zfile)
+    {
+        return file->zfile->size;
+    }
     if (fstat(file->fd, &statb) == 0)
     {
         return statb.st_size;
@@ -925,7 +1387,12 @@ blr_file_next_exists(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
     sprintf(bigbuf, "%s/%s", router->binlogdir, buf);
     if (access(bigbuf, R_OK) == -1)
     {
-        return 0;
+        /* The next file may already have been compressed */
+        strcat(bigbuf, BLR_COMPRESS_SUFFIX);
+        if (access(bigbuf, R_OK) == -1)
+        {
+            return 0;
+        }
     }
     return 1;
 }
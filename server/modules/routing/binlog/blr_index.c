@@ -0,0 +1,895 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file blr_index.c - binlog router index files
+ *
+ * With the index_interval option, an index file is written next to each
+ * binlog file. The index has an entry for every index_interval events with
+ * the position and the timestamp of the event and the latest MariaDB GTID
+ * seen in the file at that point. The entries are in position order so the
+ * entry closest to a position can be found with a binary search, after which
+ * at most index_interval event headers have to be read to reach the position.
+ *
+ * The index of a binlog file that has no index is built by reading the
+ * headers of all the events in the file.
+ *
+ * The GTIDs in the entries are used to find where a slave that connects with
+ * a MariaDB GTID continues. The binlog files are searched with a binary search
+ * on the first GTID of each file and the file with a binary search of its
+ * index entries. Only one replication domain is supported.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date     Who     Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <service.h>
+#include <blr.h>
+#include <skygw_types.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/** Length of the sequence number and the domain at the start of a GTID event */
+#define BLR_GTID_DATA_LEN 12
+
+/**
+ * A binlog file and its index opened for a GTID search
+ */
+typedef struct
+{
+    char        name[BINLOG_FNAMELEN + 1];  /*< The binlog file name */
+    bool        current;                    /*< The file is the current binlog file */
+    uint64_t    stop;                       /*< End of the events that can be read */
+    BLFILE      *file;                      /*< The binlog file */
+    int         idx_fd;                     /*< The index file */
+} BLR_GTID_FILE;
+
+/**
+ * Build the path of the index file of a binlog file
+ *
+ * @param router    The router instance
+ * @param binlog    The binlog file name
+ * @param path      Buffer of PATH_MAX + 1 bytes for the path
+ */
+static void
+blr_index_path(ROUTER_INSTANCE *router, const char *binlog, char *path)
+{
+    snprintf(path, PATH_MAX + 1, "%s/%s%s", router->binlogdir, binlog, BLR_INDEX_SUFFIX);
+}
+
+/**
+ * Use a file descriptor of an uncompressed binlog file as a binlog file record
+ *
+ * @param file  The file record to initialise
+ * @param fd    The binlog file
+ * @return      The file record
+ */
+static BLFILE *
+blr_index_file(BLFILE *file, int fd)
+{
+    memset(file, 0, sizeof(*file));
+    file->fd = fd;
+    return file;
+}
+
+/**
+ * Read the header of an event, and the GTID of a MariaDB GTID event
+ *
+ * @param file  The binlog file
+ * @param pos   Position of the event
+ * @param hdr   The header to populate
+ * @param gtid  Updated with the GTID of a GTID event
+ * @return      1 if the header was read, 0 at the end of the file
+ *              and -1 if the event is not valid
+ */
+static int
+blr_index_read_event(BLFILE *file, uint64_t pos, REP_HEADER *hdr, BLR_INDEX_ENTRY *gtid)
+{
+    uint8_t hdbuf[BINLOG_EVENT_HDR_LEN + BLR_GTID_DATA_LEN];
+    int n = blr_file_read(file, NULL, hdbuf, BINLOG_EVENT_HDR_LEN, pos);
+
+    if (n != BINLOG_EVENT_HDR_LEN)
+    {
+        /* A partially written event at the end of the file is not an error */
+        return n >= 0 ? 0 : -1;
+    }
+
+    hdr->timestamp = EXTRACT32(hdbuf);
+    hdr->event_type = hdbuf[4];
+    hdr->serverid = EXTRACT32(&hdbuf[5]);
+    hdr->event_size = extract_field(&hdbuf[9], 32);
+
+    if (hdr->event_size < BINLOG_EVENT_HDR_LEN)
+    {
+        return -1;
+    }
+
+    if (hdr->event_type == MARIADB10_GTID_EVENT &&
+        hdr->event_size >= BINLOG_EVENT_HDR_LEN + BLR_GTID_DATA_LEN)
+    {
+        if (blr_file_read(file, NULL, hdbuf + BINLOG_EVENT_HDR_LEN, BLR_GTID_DATA_LEN,
+                          pos + BINLOG_EVENT_HDR_LEN) != BLR_GTID_DATA_LEN)
+        {
+            return 0;
+        }
+
+        gtid->gtid_seq = (uint64_t)EXTRACT32(hdbuf + BINLOG_EVENT_HDR_LEN) |
+                         (uint64_t)EXTRACT32(hdbuf + BINLOG_EVENT_HDR_LEN + 4) << 32;
+        gtid->gtid_domain = EXTRACT32(hdbuf + BINLOG_EVENT_HDR_LEN + 8);
+        gtid->gtid_server = hdr->serverid;
+    }
+
+    return 1;
+}
+
+/**
+ * Write an index entry
+ *
+ * @param fd    The index file
+ * @param pos   Position of the event
+ * @param hdr   Header of the event
+ * @param gtid  The latest GTID
+ * @return      True if the entry was written
+ */
+static bool
+blr_index_write_entry(int fd, uint64_t pos, REP_HEADER *hdr, BLR_INDEX_ENTRY *gtid)
+{
+    BLR_INDEX_ENTRY entry = *gtid;
+
+    entry.pos = pos;
+    entry.timestamp = hdr->timestamp;
+
+    return write(fd, &entry, sizeof(entry)) == sizeof(entry);
+}
+
+/**
+ * Read the events of a binlog file from a position onwards
+ *
+ * The events are counted in @c events and an index entry is written to
+ * @c idx_fd whenever the count is a multiple of the index interval.
+ *
+ * @param router    The router instance
+ * @param file      The binlog file
+ * @param pos       Position of the first event
+ * @param stop      Stop at the first event at or after this position
+ * @param idx_fd    Index file to write the entries to, or -1
+ * @param events    Number of events after the last index entry, updated
+ * @param gtid      The latest GTID, updated
+ * @return          The position where reading stopped, or 0 on error
+ */
+static uint64_t
+blr_index_scan(ROUTER_INSTANCE *router, BLFILE *file, uint64_t pos, uint64_t stop, int idx_fd,
+               unsigned int *events, BLR_INDEX_ENTRY *gtid)
+{
+    REP_HEADER hdr;
+    int rc;
+
+    while (pos < stop && (rc = blr_index_read_event(file, pos, &hdr, gtid)) == 1)
+    {
+        if (*events == 0 && idx_fd != -1 && !blr_index_write_entry(idx_fd, pos, &hdr, gtid))
+        {
+            return 0;
+        }
+
+        *events = (*events + 1) % router->index_interval;
+        pos += hdr.event_size;
+    }
+
+    return pos < stop && rc == -1 ? 0 : pos;
+}
+
+/**
+ * Build the index of a binlog file from its events
+ *
+ * @param router    The router instance
+ * @param binlog    The binlog file name
+ * @param events    Set to the number of events after the last index entry
+ * @param gtid      Set to the latest GTID in the file
+ * @return          True if the index was built
+ */
+static bool
+blr_index_build(ROUTER_INSTANCE *router, const char *binlog, unsigned int *events,
+                BLR_INDEX_ENTRY *gtid)
+{
+    char path[PATH_MAX + 1];
+    char binlog_path[PATH_MAX + 1];
+    char tmp_path[PATH_MAX + 1];
+    bool rval = false;
+    BLFILE file;
+    int fd, idx_fd;
+
+    blr_index_path(router, binlog, path);
+    snprintf(binlog_path, sizeof(binlog_path), "%s/%s", router->binlogdir, binlog);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+
+    if ((fd = open(binlog_path, O_RDONLY)) == -1)
+    {
+        return false;
+    }
+
+    /* Build the index into a temporary file so that readers never see a partial index */
+    if ((idx_fd = mkstemp(tmp_path)) != -1)
+    {
+        *events = 0;
+        memset(gtid, 0, sizeof(*gtid));
+
+        if (blr_index_scan(router, blr_index_file(&file, fd), BINLOG_MAGIC_SIZE, UINT64_MAX,
+                           idx_fd, events, gtid) &&
+            rename(tmp_path, path) == 0)
+        {
+            MXS_NOTICE("%s: Built the binlog index of '%s'.", router->service->name, binlog);
+            rval = true;
+        }
+        else
+        {
+            char err_msg[STRERROR_BUFLEN];
+            MXS_ERROR("%s: Failed to build the binlog index of '%s': %s",
+                      router->service->name, binlog,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
+            unlink(tmp_path);
+        }
+        close(idx_fd);
+    }
+
+    close(fd);
+    return rval;
+}
+
+/**
+ * Continue the index of the current binlog file when an existing binlog file
+ * is appended to. The events after the last index entry are read to restore
+ * the event count and the latest GTID.
+ *
+ * @param router    The router instance
+ * @param path      Path of the index file
+ * @return          True if the index can be appended to
+ */
+static bool
+blr_index_resume(ROUTER_INSTANCE *router, const char *path)
+{
+    BLR_INDEX_ENTRY last;
+    struct stat statb;
+    BLFILE file;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+    {
+        return false;
+    }
+
+    bool rval = fstat(fd, &statb) == 0 && statb.st_size >= (off_t)sizeof(last) &&
+                statb.st_size % sizeof(last) == 0 &&
+                pread(fd, &last, sizeof(last), statb.st_size - sizeof(last)) == sizeof(last) &&
+                last.pos < router->current_pos;
+    close(fd);
+
+    if (rval)
+    {
+        /* The last entry must still be at an event of the binlog file */
+        router->index_events = 0;
+        router->index_gtid = last;
+        rval = blr_index_scan(router, blr_index_file(&file, router->binlog_fd), last.pos,
+                              UINT64_MAX, -1, &router->index_events,
+                              &router->index_gtid) == router->current_pos;
+    }
+
+    return rval;
+}
+
+/**
+ * Open the index of the current binlog file for writing
+ *
+ * @param router    The router instance
+ * @param created   True if the binlog file is new, false if it is appended to
+ */
+void
+blr_index_open(ROUTER_INSTANCE *router, bool created)
+{
+    char path[PATH_MAX + 1];
+
+    if (router->index_interval == 0)
+    {
+        return;
+    }
+
+    if (router->index_fd != -1)
+    {
+        close(router->index_fd);
+        router->index_fd = -1;
+    }
+
+    blr_index_path(router, router->binlog_name, path);
+
+    if (created)
+    {
+        router->index_events = 0;
+        memset(&router->index_gtid, 0, sizeof(router->index_gtid));
+        router->index_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+    }
+    else if (blr_index_resume(router, path) ||
+             blr_index_build(router, router->binlog_name, &router->index_events,
+                             &router->index_gtid))
+    {
+        router->index_fd = open(path, O_WRONLY | O_APPEND);
+    }
+
+    if (router->index_fd == -1)
+    {
+        char err_msg[STRERROR_BUFLEN];
+        MXS_ERROR("%s: Failed to open binlog index file %s, the binlog file is "
+                  "not indexed: %s", router->service->name, path,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+    }
+}
+
+/**
+ * Add an event written to the current binlog file to its index
+ *
+ * @param router    The router instance
+ * @param hdr       Header of the event
+ * @param pos       Position of the event
+ * @param buf       The event
+ */
+void
+blr_index_add(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint64_t pos, uint8_t *buf)
+{
+    if (router->index_interval == 0 || router->index_fd == -1)
+    {
+        return;
+    }
+
+    if (hdr->event_type == MARIADB10_GTID_EVENT &&
+        hdr->event_size >= BINLOG_EVENT_HDR_LEN + BLR_GTID_DATA_LEN)
+    {
+        uint8_t *ptr = buf + BINLOG_EVENT_HDR_LEN;
+        router->index_gtid.gtid_seq = (uint64_t)EXTRACT32(ptr) | (uint64_t)EXTRACT32(ptr + 4) << 32;
+        router->index_gtid.gtid_domain = EXTRACT32(ptr + 8);
+        router->index_gtid.gtid_server = hdr->serverid;
+    }
+
+    if (router->index_events == 0 &&
+        !blr_index_write_entry(router->index_fd, pos, hdr, &router->index_gtid))
+    {
+        char err_msg[STRERROR_BUFLEN];
+        MXS_ERROR("%s: Failed to write the binlog index of %s: %s",
+                  router->service->name, router->binlog_name,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+        blr_index_discard(router);
+        return;
+    }
+
+    router->index_events = (router->index_events + 1) % router->index_interval;
+}
+
+/**
+ * Remove the index of the current binlog file. This is done when events
+ * have been removed from the file so that the index no longer matches it.
+ * The current binlog file is not indexed after this.
+ *
+ * @param router    The router instance
+ */
+void
+blr_index_discard(ROUTER_INSTANCE *router)
+{
+    char path[PATH_MAX + 1];
+
+    if (router->index_interval == 0 || router->index_fd == -1)
+    {
+        return;
+    }
+
+    close(router->index_fd);
+    router->index_fd = -1;
+    blr_index_path(router, router->binlog_name, path);
+    unlink(path);
+}
+
+/**
+ * Open the index of a binlog file for reading. The index of a binlog file
+ * that is not the current one is built if it is missing.
+ *
+ * @param router    The router instance
+ * @param binlog    The binlog file name
+ * @param current   True if the binlog file is the current binlog file
+ * @return          The index file descriptor or -1 if there is no index
+ */
+static int
+blr_index_open_read(ROUTER_INSTANCE *router, const char *binlog, bool current)
+{
+    char path[PATH_MAX + 1];
+    int idx_fd;
+
+    if (current)
+    {
+        blr_file_write_pending(router);
+    }
+
+    blr_index_path(router, binlog, path);
+
+    if ((idx_fd = open(path, O_RDONLY)) == -1)
+    {
+        BLR_INDEX_ENTRY gtid;
+        unsigned int events;
+
+        /* The index of the current binlog file is only written by the master thread */
+        if (current || errno != ENOENT || !blr_index_build(router, binlog, &events, &gtid) ||
+            (idx_fd = open(path, O_RDONLY)) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return idx_fd;
+}
+
+/**
+ * Get the number of entries in an index file
+ *
+ * @param idx_fd    The index file
+ * @return          Number of complete entries in the index
+ */
+static long
+blr_index_entries(int idx_fd)
+{
+    struct stat statb;
+
+    return fstat(idx_fd, &statb) == 0 ? statb.st_size / sizeof(BLR_INDEX_ENTRY) : 0;
+}
+
+/**
+ * Check that a position of a binlog file is the start of an event
+ *
+ * @param router    The router instance
+ * @param binlog    The binlog file name
+ * @param pos       The position
+ * @return          1 if the position is the start of an event, 0 if it is not
+ *                  and -1 if it is not known, because there is no index or the
+ *                  position is beyond the end of the file
+ */
+int
+blr_index_check_position(ROUTER_INSTANCE *router, char *binlog, uint32_t pos)
+{
+    char path[PATH_MAX + 1];
+    BLR_INDEX_ENTRY entry;
+    BLFILE file;
+    int idx_fd, fd;
+
+    if (router->index_interval == 0 || strchr(binlog, '/') || pos < BINLOG_MAGIC_SIZE)
+    {
+        return -1;
+    }
+
+    spinlock_acquire(&router->binlog_lock);
+    bool current = strcmp(router->binlog_name, binlog) == 0;
+    bool unsafe = current && pos >= router->binlog_position;
+    spinlock_release(&router->binlog_lock);
+
+    if (unsafe)
+    {
+        /* The latest position is checked when the events are read */
+        return -1;
+    }
+
+    if ((idx_fd = blr_index_open_read(router, binlog, current)) == -1)
+    {
+        return -1;
+    }
+
+    /* Find the last entry at or before the position */
+    long lo = 0, hi = blr_index_entries(idx_fd) - 1;
+    uint64_t start = 0;
+    memset(&entry, 0, sizeof(entry));
+
+    while (lo <= hi)
+    {
+        long mid = lo + (hi - lo) / 2;
+
+        if (pread(idx_fd, &entry, sizeof(entry), mid * sizeof(entry)) != sizeof(entry))
+        {
+            break;
+        }
+
+        if (entry.pos <= pos)
+        {
+            start = entry.pos;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    close(idx_fd);
+
+    if (start == 0)
+    {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", router->binlogdir, binlog);
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+    {
+        return -1;
+    }
+
+    unsigned int events = 0;
+    uint64_t end = blr_index_scan(router, blr_index_file(&file, fd), start, pos, -1, &events, &entry);
+    close(fd);
+
+    if (end == 0 || end < pos)
+    {
+        return -1;
+    }
+
+    return end == pos ? 1 : 0;
+}
+
+/**
+ * Read the MariaDB GTID events of a binlog file from a position onwards
+ *
+ * @param file      The binlog file
+ * @param pos       Position of the next event, updated past the GTID event
+ * @param stop      Stop at the first event at or after this position
+ * @param domain    Only the GTIDs of this replication domain are returned
+ * @param gtid_pos  Set to the position of the GTID event
+ * @param gtid      Set to the GTID
+ * @return          1 if a GTID event was read, 0 if there are no more GTID
+ *                  events before the end of the events and -1 on error
+ */
+static int
+blr_index_next_gtid(BLFILE *file, uint64_t *pos, uint64_t stop, uint32_t domain,
+                    uint64_t *gtid_pos, BLR_INDEX_ENTRY *gtid)
+{
+    REP_HEADER hdr;
+    int rc;
+
+    while (*pos < stop && (rc = blr_index_read_event(file, *pos, &hdr, gtid)) == 1)
+    {
+        uint64_t event_pos = *pos;
+        *pos += hdr.event_size;
+
+        if (hdr.event_type == MARIADB10_GTID_EVENT &&
+            hdr.event_size >= BINLOG_EVENT_HDR_LEN + BLR_GTID_DATA_LEN &&
+            gtid->gtid_domain == domain)
+        {
+            *gtid_pos = event_pos;
+            return 1;
+        }
+    }
+
+    return *pos < stop && rc == -1 ? -1 : 0;
+}
+
+/**
+ * Open a binlog file and its index for a GTID search
+ *
+ * @param router    The router instance
+ * @param filenum   Number of the binlog file
+ * @param gf        The file to open
+ * @return          True if the binlog file and its index were opened
+ */
+static bool
+blr_index_gtid_open(ROUTER_INSTANCE *router, int filenum, BLR_GTID_FILE *gf)
+{
+    snprintf(gf->name, sizeof(gf->name), BINLOG_NAMEFMT, router->fileroot, filenum);
+
+    spinlock_acquire(&router->binlog_lock);
+    gf->current = strcmp(router->binlog_name, gf->name) == 0;
+    gf->stop = gf->current ? router->binlog_position : UINT64_MAX;
+    spinlock_release(&router->binlog_lock);
+
+    if ((gf->idx_fd = blr_index_open_read(router, gf->name, gf->current)) == -1)
+    {
+        MXS_ERROR("%s: The binlog file %s has no index, GTIDs in it can not be searched.",
+                  router->service->name, gf->name);
+        return false;
+    }
+
+    if ((gf->file = blr_open_binlog(router, gf->name)) == NULL)
+    {
+        close(gf->idx_fd);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Close a binlog file opened for a GTID search
+ *
+ * @param router    The router instance
+ * @param gf        The file to close
+ */
+static void
+blr_index_gtid_close(ROUTER_INSTANCE *router, BLR_GTID_FILE *gf)
+{
+    blr_close_binlog(router, gf->file);
+    close(gf->idx_fd);
+}
+
+/**
+ * Find the first GTID of a replication domain in a binlog file
+ *
+ * @param gf        The binlog file
+ * @param domain    The replication domain
+ * @param gtid      Set to the first GTID
+ * @return          1 if the GTID was found, 0 if the file has no GTIDs of
+ *                  the domain and -1 on error
+ */
+static int
+blr_index_gtid_first(BLR_GTID_FILE *gf, uint32_t domain, BLR_INDEX_ENTRY *gtid)
+{
+    BLR_INDEX_ENTRY entry;
+    uint64_t start = BINLOG_MAGIC_SIZE;
+    uint64_t gtid_pos;
+
+    /* The entries before the first GTID of the file have no GTID */
+    long lo = 0, hi = blr_index_entries(gf->idx_fd) - 1;
+
+    while (lo <= hi)
+    {
+        long mid = lo + (hi - lo) / 2;
+
+        if (pread(gf->idx_fd, &entry, sizeof(entry), mid * sizeof(entry)) != sizeof(entry))
+        {
+            return -1;
+        }
+
+        if (entry.gtid_seq == 0)
+        {
+            start = entry.pos;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    memset(gtid, 0, sizeof(*gtid));
+    return blr_index_next_gtid(gf->file, &start, gf->stop, domain, &gtid_pos, gtid);
+}
+
+/**
+ * Find the first event after a GTID in a binlog file. The GTID must be in the
+ * file or the file must start after it.
+ *
+ * @param gf        The binlog file
+ * @param target    The GTID
+ * @param pos       Set to the position of the first GTID event after the GTID
+ *                  or to the end of the events
+ * @param at_end    Set to true if there are no GTID events after the GTID
+ * @return          1 if the GTID is in the file, 0 if it is not and -1 on error
+ */
+static int
+blr_index_gtid_search(BLR_GTID_FILE *gf, const BLR_GTID *target, uint64_t *pos, bool *at_end)
+{
+    BLR_INDEX_ENTRY entry, gtid;
+    uint64_t start = BINLOG_MAGIC_SIZE;
+    uint64_t gtid_pos;
+    int rc;
+
+    /* Find the last entry whose GTID is not after the target */
+    long lo = 0, hi = blr_index_entries(gf->idx_fd) - 1;
+    memset(&gtid, 0, sizeof(gtid));
+
+    while (lo <= hi)
+    {
+        long mid = lo + (hi - lo) / 2;
+
+        if (pread(gf->idx_fd, &entry, sizeof(entry), mid * sizeof(entry)) != sizeof(entry))
+        {
+            return -1;
+        }
+
+        if (entry.gtid_seq <= target->seq)
+        {
+            start = entry.pos;
+            gtid = entry;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    bool found = gtid.gtid_seq == target->seq && gtid.gtid_domain == target->domain &&
+                 gtid.gtid_server == target->server_id;
+
+    while ((rc = blr_index_next_gtid(gf->file, &start, gf->stop, target->domain,
+                                     &gtid_pos, &gtid)) == 1)
+    {
+        if (gtid.gtid_seq > target->seq)
+        {
+            *pos = gtid_pos;
+            *at_end = false;
+            return found ? 1 : 0;
+        }
+
+        found = gtid.gtid_seq == target->seq && gtid.gtid_server == target->server_id;
+    }
+
+    *pos = start;
+    *at_end = true;
+    return rc == -1 ? -1 : found ? 1 : 0;
+}
+
+/**
+ * Find the number of the oldest binlog file
+ *
+ * @param router    The router instance
+ * @param last      Number of the current binlog file
+ * @return          Number of the oldest binlog file
+ */
+static int
+blr_index_first_binlog(ROUTER_INSTANCE *router, int last)
+{
+    size_t root_len = strlen(router->fileroot);
+    size_t suffix_len = strlen(BLR_INDEX_SUFFIX);
+    struct dirent *dp;
+    DIR *dirp;
+    int first = last;
+
+    if ((dirp = opendir(router->binlogdir)) == NULL)
+    {
+        return first;
+    }
+
+    while ((dp = readdir(dirp)) != NULL)
+    {
+        size_t len = strlen(dp->d_name);
+
+        /* Index files of binlog files that have been removed are ignored */
+        if (strncmp(dp->d_name, router->fileroot, root_len) == 0 &&
+            dp->d_name[root_len] == '.' && isdigit(dp->d_name[root_len + 1]) &&
+            (len < suffix_len || strcmp(dp->d_name + len - suffix_len, BLR_INDEX_SUFFIX) != 0))
+        {
+            int n = atoi(dp->d_name + root_len + 1);
+
+            if (n > 0 && n < first)
+            {
+                first = n;
+            }
+        }
+    }
+    closedir(dirp);
+
+    return first;
+}
+
+/**
+ * Find where a slave that has a MariaDB GTID continues replicating
+ *
+ * The binlog file is found with a binary search on the first GTID of each file
+ * and the position in it with a binary search on the index entries of the file,
+ * after which at most index_interval events are read. Only one replication
+ * domain is supported.
+ *
+ * @param router    The router instance
+ * @param target    The last GTID of the slave, a sequence of 0 for none
+ * @param binlog    Set to the binlog file name, BINLOG_FNAMELEN + 1 bytes
+ * @param pos       Set to the position of the first event to send
+ * @return          1 if the binlog position was found, 0 if the GTID is not
+ *                  in the binlog files and -1 if the files can not be searched
+ */
+int
+blr_index_find_gtid(ROUTER_INSTANCE *router, const BLR_GTID *target, char *binlog, uint32_t *pos)
+{
+    BLR_GTID_FILE gf;
+    BLR_INDEX_ENTRY gtid;
+    uint64_t end;
+    bool at_end;
+    int rc;
+
+    if (router->index_interval == 0)
+    {
+        return -1;
+    }
+
+    spinlock_acquire(&router->binlog_lock);
+    char *dot = strrchr(router->binlog_name, '.');
+    int last = dot ? atoi(dot + 1) : 0;
+    spinlock_release(&router->binlog_lock);
+
+    int first = blr_index_first_binlog(router, last);
+
+    if (target->seq == 0)
+    {
+        /* A slave without any GTIDs starts from the oldest binlog file */
+        snprintf(binlog, BINLOG_FNAMELEN + 1, BINLOG_NAMEFMT, router->fileroot, first);
+        *pos = BINLOG_MAGIC_SIZE;
+        return 1;
+    }
+
+    /* Find the last binlog file whose first GTID is not after the target */
+    int lo = first, hi = last, found = -1;
+
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        int filenum = mid;
+
+        /* Binlog files without GTIDs take the first GTID of the next file */
+        do
+        {
+            if (!blr_index_gtid_open(router, filenum, &gf))
+            {
+                return -1;
+            }
+
+            rc = blr_index_gtid_first(&gf, target->domain, &gtid);
+            blr_index_gtid_close(router, &gf);
+        }
+        while (rc == 0 && ++filenum <= hi);
+
+        if (rc == -1)
+        {
+            return -1;
+        }
+
+        if (rc == 1 && gtid.gtid_seq <= target->seq)
+        {
+            found = filenum;
+            lo = filenum + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    if (found == -1)
+    {
+        return 0;
+    }
+
+    if (!blr_index_gtid_open(router, found, &gf))
+    {
+        return -1;
+    }
+
+    rc = blr_index_gtid_search(&gf, target, &end, &at_end);
+    bool current = gf.current;
+    blr_index_gtid_close(router, &gf);
+
+    if (rc != 1)
+    {
+        return rc;
+    }
+
+    if (at_end && !current && found < last)
+    {
+        /* The GTID is the last one of a binlog file that is no longer written to */
+        found++;
+        end = BINLOG_MAGIC_SIZE;
+    }
+
+    snprintf(binlog, BINLOG_FNAMELEN + 1, BINLOG_NAMEFMT, router->fileroot, found);
+    *pos = end;
+    return 1;
+}
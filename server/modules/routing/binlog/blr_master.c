@@ -103,6 +103,8 @@ static void blr_distribute_error_message(ROUTER_INSTANCE *router, char *message,
 int blr_write_data_into_binlog(ROUTER_INSTANCE *router, uint32_t data_len, uint8_t *buf);
 void extract_checksum(ROUTER_INSTANCE* router, uint8_t *cksumptr, uint8_t len);
 static void blr_terminate_master_replication(ROUTER_INSTANCE *router, uint8_t* ptr, int len);
+static void blr_send_semisync_ack(ROUTER_INSTANCE *router);
+static void blr_signal_slaves(ROUTER_INSTANCE *router);
 
 static int keepalive = 1;
 
@@ -681,6 +683,57 @@ blr_master_response(ROUTER_INSTANCE *router, GWBUF *buf)
         }
         router->saved_master.map = buf;
         blr_cache_response(router, "map", buf);
+        router->master_semisync = false;
+        router->ack_requested = false;
+        router->ack_pending = false;
+        if (router->semisync)
+        {
+            // Check that the master has the semi-sync plugin
+            buf = blr_make_query("SHOW VARIABLES LIKE 'rpl_semi_sync_master_enabled'");
+            router->master_state = BLRM_CHECK_SEMISYNC;
+        }
+        else
+        {
+            buf = blr_make_registration(router);
+            router->master_state = BLRM_REGISTER;
+        }
+        router->master->func.write(router->master, buf);
+        break;
+    case BLRM_CHECK_SEMISYNC:
+        {
+            char *val = blr_extract_column(buf, 2);
+
+            // Response to the semi-sync variable, no need to save this
+            gwbuf_free(buf);
+
+            if (val)
+            {
+                if (strcasecmp(val, "ON") != 0)
+                {
+                    MXS_WARNING("%s: Semi-sync replication is disabled in the master "
+                                "server, the binlog events are sent asynchronously "
+                                "until it is enabled.",
+                                router->service->name);
+                }
+                free(val);
+                buf = blr_make_query("SET @rpl_semi_sync_slave = 1");
+                router->master_state = BLRM_REQUEST_SEMISYNC;
+            }
+            else
+            {
+                MXS_WARNING("%s: The master server does not have the semi-sync "
+                            "replication plugin, using asynchronous replication.",
+                            router->service->name);
+                buf = blr_make_registration(router);
+                router->master_state = BLRM_REGISTER;
+            }
+            router->master->func.write(router->master, buf);
+            break;
+        }
+    case BLRM_REQUEST_SEMISYNC:
+        // Response to the SET @rpl_semi_sync_slave, no need to save this
+        gwbuf_free(buf);
+        router->master_semisync = true;
         buf = blr_make_registration(router);
         router->master_state = BLRM_REGISTER;
         router->master->func.write(router->master, buf);
@@ -884,6 +937,8 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
      */
     while (pkt && pkt_length > 24)
     {
+        unsigned int semisync_len = 0;
+
         reslen = GWBUF_LENGTH(pkt);
         pdata = GWBUF_DATA(pkt);
         if (reslen < 3) // Payload length straddles buffers
@@ -991,6 +1046,33 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
          * copy if the message straddles GWBUF's.
          */
 
+        if (router->master_semisync && router->master_event_state == BLR_EVENT_DONE &&
+            len > MYSQL_HEADER_LEN + 1 + BLR_SEMISYNC_HDR_LEN &&
+            ptr[MYSQL_HEADER_LEN] == 0 && ptr[MYSQL_HEADER_LEN + 1] == BLR_SEMISYNC_MAGIC)
+        {
+            /*
+             * Remove the semi-sync header that follows the OK byte by
+             * moving the packet header and the OK byte over it. The
+             * rest of the packet is then handled as if semi-sync was
+             * not used.
+             */
+            if (ptr[MYSQL_HEADER_LEN + 2] & BLR_SEMISYNC_ACK_REQ)
+            {
+                router->ack_requested = true;
+                router->ack_start = ts_clock_us();
+            }
+
+            semisync_len = BLR_SEMISYNC_HDR_LEN;
+            memmove(ptr + semisync_len, ptr, MYSQL_HEADER_LEN + 1);
+            ptr += semisync_len;
+            len -= semisync_len;
+            encode_value(ptr, len - MYSQL_HEADER_LEN, 24);
+
+            pkt = gwbuf_consume(pkt, semisync_len);
+            pkt_length -= semisync_len;
+            reslen = GWBUF_LENGTH(pkt);
+        }
+
         if (len < BINLOG_EVENT_HDR_LEN && router->master_event_state != BLR_EVENT_ONGOING)
         {
             char *event_msg = "";
@@ -1020,7 +1102,8 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                 /* Sanity check */
                 if (hdr.ok == 0)
                 {
-                    if (hdr.event_size != len - 5 && (hdr.event_size + 1) < MYSQL_PACKET_LENGTH_MAX)
+                    if (hdr.event_size != len - 5 &&
+                        (hdr.event_size + 1 + semisync_len) < MYSQL_PACKET_LENGTH_MAX)
                     {
                         MXS_ERROR("Packet length is %d, but event size is %d, "
                                   "binlog file %s position %lu "
@@ -1048,7 +1131,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
 
                         break;
                     }
-                    else if ((hdr.event_size + 1) >= MYSQL_PACKET_LENGTH_MAX)
+                    else if ((hdr.event_size + 1 + semisync_len) >= MYSQL_PACKET_LENGTH_MAX)
                     {
                         router->master_event_state = BLR_EVENT_STARTED;
 
@@ -1103,7 +1186,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
             /* pending large event */
             if (router->master_event_state != BLR_EVENT_DONE)
             {
-                if (len - MYSQL_HEADER_LEN < MYSQL_PACKET_LENGTH_MAX)
+                if (len + semisync_len - MYSQL_HEADER_LEN < MYSQL_PACKET_LENGTH_MAX)
                 {
                     /** This is the last packet, we can now proceed to distribute
                      * the event afer it has been written to disk */
@@ -1455,6 +1538,15 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                             return;
                         }
 
+                        /* The event is acknowledged once the batch has been written */
+                        if (router->ack_requested)
+                        {
+                            router->ack_requested = false;
+                            router->ack_pending = true;
+                            strcpy(router->ack_file, router->binlog_name);
+                            router->ack_pos = hdr.next_pos;
+                        }
+
                         /* Check for rotete event */
                         if (hdr.event_type == ROTATE_EVENT)
                         {
@@ -1717,6 +1809,48 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
         ss_dassert(pkt_length == 0);
     }
     blr_file_flush(router);
+
+    if (router->ack_pending)
+    {
+        blr_send_semisync_ack(router);
+    }
+}
+
+/**
+ * Send a semi-sync acknowledgement of the pending binlog position to the
+ * master. The position must have been written to the binlog file, and
+ * synced if semisync_sync is used, before it is acknowledged.
+ *
+ * @param router    The router instance
+ */
+static void
+blr_send_semisync_ack(ROUTER_INSTANCE *router)
+{
+    GWBUF *buf;
+    uint8_t *data;
+    int len = 1 + 8 + strlen(router->ack_file);
+
+    router->ack_pending = false;
+
+    if ((buf = gwbuf_alloc(len + MYSQL_HEADER_LEN)) == NULL)
+    {
+        MXS_ERROR("%s: Failed to allocate the semi-sync acknowledgement "
+                  "of binlog %s @ %lu.", router->service->name,
+                  router->ack_file, router->ack_pos);
+        return;
+    }
+
+    data = GWBUF_DATA(buf);
+    encode_value(&data[0], len, 24);    // Payload length
+    data[3] = 0;                        // Sequence ID
+    data[4] = BLR_SEMISYNC_MAGIC;       // Semi-sync magic byte
+    encode_value(&data[5], router->ack_pos, 32);
+    encode_value(&data[9], router->ack_pos >> 32, 32);
+    memcpy(&data[13], router->ack_file, strlen(router->ack_file));
+
+    router->master->func.write(router->master, buf);
+    blr_add_latency(router->stats.ack_latency, router->ack_start);
+    router->stats.n_semisync_acks++;
 }
 
 /**
@@ -1850,6 +1984,12 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
     int action;
     unsigned int cstate;
 
+    if (router->slave_pull)
+    {
+        blr_signal_slaves(router);
+        return;
+    }
+
     spinlock_acquire(&router->lock);
     slave = router->slaves;
     while (slave)
@@ -1999,7 +2139,7 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
                     blr_slave_rotate(router, slave, ptr);
                 }
 
-                if (blr_send_event(role, binlog_name, binlog_pos, slave, hdr, ptr))
+                if (blr_send_event(role, binlog_name, binlog_pos, slave, hdr, ptr, NULL))
                 {
                     spinlock_acquire(&slave->catch_lock);
                     if (hdr->event_type != ROTATE_EVENT)
@@ -2085,6 +2225,45 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
     spinlock_release(&router->lock);
 }
 
+/**
+ * Signal the slaves that a new binlog event is available. Nothing is sent to
+ * the slaves here: each slave that is not already sending events is put into
+ * catchup mode and a fake write event is added for its DCB. The thread of
+ * the slave DCB then reads the events from the event ring or the binlog file.
+ *
+ * @param router    The router instance
+ */
+static void
+blr_signal_slaves(ROUTER_INSTANCE *router)
+{
+    ROUTER_SLAVE *slave;
+
+    spinlock_acquire(&router->lock);
+    for (slave = router->slaves; slave; slave = slave->next)
+    {
+        if (slave->state == BLRS_DUMPING)
+        {
+            bool signal = false;
+
+            spinlock_acquire(&slave->catch_lock);
+            if ((slave->cstate & (CS_EXPECTCB | CS_BUSY)) == 0)
+            {
+                slave->cstate &= ~CS_UPTODATE;
+                slave->cstate |= CS_EXPECTCB;
+                signal = true;
+            }
+            slave->stats.n_actions[2]++;
+            spinlock_release(&slave->catch_lock);
+
+            if (signal)
+            {
+                poll_fake_write_event(slave->dcb);
+            }
+        }
+    }
+    spinlock_release(&router->lock);
+}
+
 /**
  * Write a raw event (the first 40 bytes at most) to a log file
  *
@@ -2229,6 +2408,9 @@ GWBUF
     int n;
     int event_limit;
 
+    /* Read the events in the write buffer from the file */
+    blr_file_write_pending(router);
+
     /* Get current binnlog position */
     end_pos = pos_end;
 
@@ -2596,6 +2778,12 @@ blr_write_data_into_binlog(ROUTER_INSTANCE *router, uint32_t data_len, uint8_t *
 {
     int n;
 
+    /* Keep the file in order, the buffered events come first */
+    if (!blr_file_write_pending(router))
+    {
+        return 0;
+    }
+
     if ((n = pwrite(router->binlog_fd, buf, data_len,
                     router->last_written)) != data_len)
     {
@@ -2614,6 +2802,8 @@ blr_write_data_into_binlog(ROUTER_INSTANCE *router, uint32_t data_len, uint8_t *
                       router->binlog_name,
                       strerror_r(errno, err_msg, sizeof(err_msg)));
         }
+        blr_ring_clear(router);
+        blr_index_discard(router);
         return 0;
     }
     router->last_written += data_len;
@@ -2629,17 +2819,43 @@ blr_write_data_into_binlog(ROUTER_INSTANCE *router, uint32_t data_len, uint8_t *
  * and part of the replication event is already sent, @c first must be set to
  * false so that the first status byte is not sent again.
  *
+ * If @c record is given, @c buf points into it and the data is not copied:
+ * the packet refers to the data of @c record.
+ *
  * @param slave Slave where the packet is sent to
  * @param buf Buffer containing the data
  * @param len Length of the data
  * @param first If this is the first packet of a multi-packet event
+ * @param record The buffer that contains @c buf, or NULL to copy the data
  * @return True on success, false when memory allocation fails
  */
-bool blr_send_packet(ROUTER_SLAVE *slave, uint8_t *buf, uint32_t len, bool first)
+bool blr_send_packet(ROUTER_SLAVE *slave, uint8_t *buf, uint32_t len, bool first, GWBUF *record)
 {
     bool rval = true;
     unsigned int datalen = len + (first ? 1 : 0);
-    GWBUF *buffer = gwbuf_alloc(datalen + MYSQL_HEADER_LEN);
+    GWBUF *buffer;
+
+    if (record && len > 0)
+    {
+        GWBUF *body;
+
+        if ((buffer = gwbuf_alloc(datalen - len + MYSQL_HEADER_LEN)) == NULL ||
+            (body = gwbuf_clone(record)) == NULL)
+        {
+            gwbuf_free(buffer);
+            MXS_ERROR("failed to allocate memory when writing an event.");
+            return false;
+        }
+
+        body->start = buf;
+        body->end = buf + len;
+        buffer = gwbuf_append(buffer, body);
+    }
+    else
+    {
+        buffer = gwbuf_alloc(datalen + MYSQL_HEADER_LEN);
+    }
+
     if (buffer)
     {
         uint8_t *data = GWBUF_DATA(buffer);
@@ -2652,12 +2868,12 @@ bool blr_send_packet(ROUTER_SLAVE *slave, uint8_t *buf, uint32_t len, bool first
             *data++ = 0; // OK byte
         }
 
-        if (len > 0)
+        if (len > 0 && record == NULL)
         {
             memcpy(data, buf, len);
         }
 
-        slave->stats.n_bytes += GWBUF_LENGTH(buffer);
+        slave->stats.n_bytes += gwbuf_length(buffer);
         slave->dcb->func.write(slave->dcb, buffer);
     }
     else
@@ -2681,6 +2897,8 @@ bool blr_send_packet(ROUTER_SLAVE *slave, uint8_t *buf, uint32_t len, bool first
  * @param slave Slave where the event is sent to
  * @param hdr   Replication header
  * @param buf   Pointer to the replication event as it was read from the disk
+ * @param record The buffer that contains the event, or NULL if the event
+ *              is to be copied into the packets
  * @return True on success, false if memory allocation failed
  */
 bool blr_send_event(blr_thread_role_t role,
@@ -2688,7 +2906,8 @@ bool blr_send_event(blr_thread_role_t role,
                     uint32_t binlog_pos,
                     ROUTER_SLAVE *slave,
                     REP_HEADER *hdr,
-                    uint8_t *buf)
+                    uint8_t *buf,
+                    GWBUF *record)
 {
     bool rval = true;
 
@@ -2716,7 +2935,7 @@ bool blr_send_event(blr_thread_role_t role,
     /** Check if the event and the OK byte fit into a single packet  */
     if (hdr->event_size + 1 < MYSQL_PACKET_LENGTH_MAX)
     {
-        rval = blr_send_packet(slave, buf, hdr->event_size, true);
+        rval = blr_send_packet(slave, buf, hdr->event_size, true, record);
     }
     else
     {
@@ -2729,13 +2948,13 @@ bool blr_send_event(blr_thread_role_t role,
             uint64_t payload_len = first ? MYSQL_PACKET_LENGTH_MAX - 1 :
                                    MIN(MYSQL_PACKET_LENGTH_MAX, len);
 
-            if (blr_send_packet(slave, buf, payload_len, first))
+            if (blr_send_packet(slave, buf, payload_len, first, record))
             {
                 /** The check for exactly 0x00ffffff bytes needs to be done
                  * here as well */
                 if (len == MYSQL_PACKET_LENGTH_MAX)
                 {
-                    blr_send_packet(slave, buf, 0, false);
+                    blr_send_packet(slave, buf, 0, false, NULL);
                 }
 
                 /** Add the extra byte written by blr_send_packet */
@@ -96,6 +96,7 @@ static void encode_value(unsigned char *data, unsigned int value, int len);
 static int blr_slave_query(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue);
 static int blr_slave_replay(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *master);
 static void blr_slave_send_error(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, char  *msg);
+static bool blr_slave_parse_gtid(char *value, BLR_GTID *gtid);
 static int blr_slave_send_timestamp(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 static int blr_slave_register(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue);
 static int blr_slave_binlog_dump(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue);
@@ -297,6 +298,7 @@ blr_slave_request(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
  *  SELECT @@[GLOBAL.]server_id
  *  SELECT @@version
  *  SELECT @@[GLOBAL.]server_uuid
+ *  SELECT @@GLOBAL.gtid_domain_id
  *  SELECT USER()
  *
  * Eight show commands are supported:
@@ -317,6 +319,9 @@ blr_slave_request(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
  *  SET NAMES utf8
  *  SET NAMES XXX
  *  SET mariadb_slave_capability=...
+ *  SET @slave_connect_state=...
+ *  SET @slave_gtid_strict_mode=...
+ *  SET @slave_gtid_ignore_duplicates=...
  *
  * Four administrative commands are supported:
  *  STOP SLAVE
@@ -524,6 +529,18 @@ blr_slave_query(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
 
             return blr_slave_send_var_value(router, slave, heading, server_id, BLR_TYPE_INT);
         }
+        else if (strcasecmp(word, "@@GLOBAL.gtid_domain_id") == 0)
+        {
+            char    domain_id[40];
+            char    heading[40]; /* to ensure we match the case in query and response */
+
+            sprintf(domain_id, "%u", router->index_gtid.gtid_domain);
+            strcpy(heading, word);
+
+            free(query_text);
+
+            return blr_slave_send_var_value(router, slave, heading, domain_id, BLR_TYPE_INT);
+        }
     }
     else if (strcasecmp(word, "SHOW") == 0)
     {
@@ -792,6 +809,30 @@ blr_slave_query(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
             free(query_text);
             return blr_slave_replay(router, slave, router->saved_master.setslaveuuid);
         }
+        else if (strcasecmp(word, "@slave_connect_state") == 0)
+        {
+            /* The GTID list is split at the commas, only one domain is supported */
+            word = strtok_r(NULL, sep, &brkb);
+
+            if (blr_slave_parse_gtid(word, &slave->connect_gtid) &&
+                strtok_r(NULL, sep, &brkb) == NULL)
+            {
+                slave->use_gtid = true;
+                free(query_text);
+                return blr_slave_send_ok(router, slave);
+            }
+
+            free(query_text);
+            blr_slave_send_error(router, slave, "Invalid @slave_connect_state, only a single "
+                                 "MariaDB GTID is supported");
+            return 1;
+        }
+        else if ((strcasecmp(word, "@slave_gtid_strict_mode") == 0) ||
+                 (strcasecmp(word, "@slave_gtid_ignore_duplicates") == 0))
+        {
+            free(query_text);
+            return blr_slave_send_ok(router, slave);
+        }
         else if (strcasecmp(word, "NAMES") == 0)
         {
             if ((word = strtok_r(NULL, sep, &brkb)) == NULL)
@@ -1158,6 +1199,56 @@ blr_slave_replay(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *master)
     }
 }
 
+/**
+ * Parse the GTID of a SET @slave_connect_state statement
+ *
+ * @param value The quoted value, 'domain-server_id-sequence' or ''
+ * @param gtid  Set to the GTID, a sequence of 0 if the value is empty
+ * @return      True if the value is a single GTID or empty
+ */
+static bool
+blr_slave_parse_gtid(char *value, BLR_GTID *gtid)
+{
+    char *end;
+
+    memset(gtid, 0, sizeof(*gtid));
+
+    if (value == NULL)
+    {
+        return false;
+    }
+
+    if (*value == '\'')
+    {
+        value++;
+    }
+
+    if (*value == '\0' || strcmp(value, "'") == 0)
+    {
+        return true;
+    }
+
+    gtid->domain = strtoul(value, &end, 10);
+
+    if (end == value || *end != '-')
+    {
+        return false;
+    }
+
+    value = end + 1;
+    gtid->server_id = strtoul(value, &end, 10);
+
+    if (end == value || *end != '-')
+    {
+        return false;
+    }
+
+    value = end + 1;
+    gtid->seq = strtoull(value, &end, 10);
+
+    return end != value && gtid->seq > 0 && (*end == '\0' || strcmp(end, "'") == 0);
+}
+
 /**
  * Construct an error response
  *
@@ -1964,6 +2055,62 @@ blr_slave_binlog_dump(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue
     strncpy(slave->binlogfile, (char *)ptr, binlognamelen);
     slave->binlogfile[binlognamelen] = 0;
 
+    if (slave->use_gtid)
+    {
+        /* The binlog file and position of a slave that connects with a GTID are looked up */
+        char err_msg[BINLOG_ERROR_MSG_LEN + 1];
+        int rc = -1;
+
+        if (!router->mariadb10_compat)
+        {
+            snprintf(err_msg, BINLOG_ERROR_MSG_LEN, "Connecting with a GTID requires "
+                     "the mariadb10-compatibility option");
+        }
+        else if ((rc = blr_index_find_gtid(router, &slave->connect_gtid,
+                                           slave->binlogfile, &slave->binlog_pos)) == 0)
+        {
+            snprintf(err_msg, BINLOG_ERROR_MSG_LEN, "Could not find GTID %u-%u-%lu "
+                     "requested by the slave in any binlog file",
+                     slave->connect_gtid.domain, slave->connect_gtid.server_id,
+                     (unsigned long)slave->connect_gtid.seq);
+        }
+        else if (rc == -1)
+        {
+            snprintf(err_msg, BINLOG_ERROR_MSG_LEN, "Could not search the binlog files "
+                     "for GTID %u-%u-%lu, the binlog index is required",
+                     slave->connect_gtid.domain, slave->connect_gtid.server_id,
+                     (unsigned long)slave->connect_gtid.seq);
+        }
+
+        if (rc != 1)
+        {
+            MXS_ERROR("%s: Slave %s:%i, server-id %d, blr_slave_binlog_dump failure: %s",
+                      router->service->name,
+                      slave->dcb->remote,
+                      ntohs((slave->dcb->ipv4).sin_port),
+                      slave->serverid,
+                      err_msg);
+
+            slave->state = BLRS_ERRORED;
+            blr_send_custom_error(slave->dcb, 1, 0, err_msg, "HY000", 1236);
+            dcb_close(slave->dcb);
+
+            return 1;
+        }
+
+        binlognamelen = strlen(slave->binlogfile);
+
+        MXS_NOTICE("%s: Slave %s:%i, server-id %d, GTID %u-%u-%lu is followed by "
+                   "position %lu in binlog file '%s'",
+                   router->service->name,
+                   slave->dcb->remote,
+                   ntohs((slave->dcb->ipv4).sin_port),
+                   slave->serverid,
+                   slave->connect_gtid.domain, slave->connect_gtid.server_id,
+                   (unsigned long)slave->connect_gtid.seq,
+                   (unsigned long)slave->binlog_pos, slave->binlogfile);
+    }
+
     if (router->trx_safe)
     {
         /**
@@ -2005,6 +2152,30 @@ blr_slave_binlog_dump(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue
         }
     }
 
+    /* With the binlog index, a position that is not the start of an event is refused */
+    if (slave->binlog_pos != BINLOG_MAGIC_SIZE &&
+        blr_index_check_position(router, slave->binlogfile, slave->binlog_pos) == 0)
+    {
+        char err_msg[BINLOG_ERROR_MSG_LEN + 1];
+
+        snprintf(err_msg, BINLOG_ERROR_MSG_LEN, "Requested position %lu is not the "
+                 "start of an event in binlog file '%s'",
+                 (unsigned long)slave->binlog_pos, slave->binlogfile);
+
+        MXS_ERROR("%s: Slave %s:%i, server-id %d, blr_slave_binlog_dump failure: %s",
+                  router->service->name,
+                  slave->dcb->remote,
+                  ntohs((slave->dcb->ipv4).sin_port),
+                  slave->serverid,
+                  err_msg);
+
+        slave->state = BLRS_ERRORED;
+        blr_send_custom_error(slave->dcb, 1, 0, err_msg, "HY000", 1236);
+        dcb_close(slave->dcb);
+
+        return 1;
+    }
+
     MXS_DEBUG("%s: COM_BINLOG_DUMP: binlog name '%s', length %d, "
               "from position %lu.", router->service->name,
               slave->binlogfile, binlognamelen,
@@ -2152,6 +2323,31 @@ blr_build_header(GWBUF  *pkt, REP_HEADER *hdr)
     return ptr;
 }
 
+/**
+ * Read the next event for a slave in catchup mode. The event is taken from
+ * the event ring if it is there, otherwise it is read from the binlog file.
+ *
+ * @param   router      The binlog router
+ * @param   slave       The slave
+ * @param   file        The binlog file the slave is reading
+ * @param   hdr         Binlog header to populate
+ * @param   errmsg      Allocated BINLOG_ERROR_MSG_LEN bytes message error buffer
+ * @return  The event or NULL if it could not be read
+ */
+static GWBUF *
+blr_slave_read_event(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, BLFILE *file,
+                     REP_HEADER *hdr, char *errmsg)
+{
+    GWBUF *record = blr_ring_read(router, slave->binlogfile, slave->binlog_pos, hdr);
+
+    if (record == NULL)
+    {
+        record = blr_read_binlog(router, file, slave->binlog_pos, hdr, errmsg);
+    }
+
+    return record;
+}
+
 /**
  * We have a registered slave that is behind the current leading edge of the
  * binlog. We must replay the log entries to bring this node up to speed.
@@ -2278,7 +2474,7 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
     int events_before = slave->stats.n_events;
 
     while (burst-- && burst_size > 0 &&
-           (record = blr_read_binlog(router, file, slave->binlog_pos, &hdr, read_errmsg)) != NULL)
+           (record = blr_slave_read_event(router, slave, file, &hdr, read_errmsg)) != NULL)
     {
         char binlog_name[BINLOG_FNAMELEN + 1];
         uint32_t binlog_pos;
@@ -2341,7 +2537,7 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
         }
 
         if (blr_send_event(BLR_THREAD_ROLE_SLAVE, binlog_name, binlog_pos,
-                           slave, &hdr, (uint8_t*) record->start))
+                           slave, &hdr, (uint8_t*) record->start, record))
         {
             if (hdr.event_type != ROTATE_EVENT)
             {
@@ -2834,6 +3030,19 @@ blr_slave_send_fde(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
         return;
     }
     blr_close_binlog(router, file);
+
+    /* The event is modified below, it must not refer to a mapped binlog file */
+    if (record->sbuf->size_class == GWBUF_EXTERNAL_DATA)
+    {
+        GWBUF *copy = gwbuf_alloc_and_load(GWBUF_LENGTH(record), GWBUF_DATA(record));
+        gwbuf_free(record);
+
+        if ((record = copy) == NULL)
+        {
+            return;
+        }
+    }
+
     head = gwbuf_alloc(5);
     ptr = GWBUF_DATA(head);
     encode_value(ptr, hdr.event_size + 1, 24); // Payload length
@@ -3794,6 +4003,7 @@ int blr_handle_change_master(ROUTER_INSTANCE* router, char *command, char *error
             router->current_safe_event = 4;
 
             /* close current file binlog file, next start slave will create the new one */
+            blr_file_write_pending(router);
             fsync(router->binlog_fd);
             close(router->binlog_fd);
             router->binlog_fd = -1;
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file blr_sync.c - binlog router sync groups
+ *
+ * A process that runs many binlog router services, each replicating its own
+ * master, syncs each binlog file separately. With the sync_group option, the
+ * services that store their binlog files on the same filesystem share the
+ * syncs: a sync is done with syncfs(), which writes the data of all the files
+ * of the filesystem, and the services that need a sync while one is running
+ * wait for it instead of starting their own. Only one sync of a group runs at
+ * a time and the next one covers all the services that were waiting, so the
+ * number of syncs no longer grows with the number of services.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date     Who     Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <blr.h>
+#include <skygw_types.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+static SPINLOCK groups_lock = SPINLOCK_INIT;
+static BLR_SYNC_GROUP *groups = NULL;
+
+/**
+ * Get a sync group, creating it if it does not exist. The groups are never
+ * freed as the routers that use them are not freed either.
+ *
+ * @param name  Name of the group
+ * @return      The group or NULL if memory allocation failed
+ */
+BLR_SYNC_GROUP *
+blr_sync_group_get(const char *name)
+{
+    BLR_SYNC_GROUP *group;
+
+    spinlock_acquire(&groups_lock);
+
+    for (group = groups; group; group = group->next)
+    {
+        if (strcmp(group->name, name) == 0)
+        {
+            break;
+        }
+    }
+
+    if (group == NULL && (group = calloc(1, sizeof(BLR_SYNC_GROUP))) != NULL)
+    {
+        if ((group->name = strdup(name)) == NULL)
+        {
+            free(group);
+            group = NULL;
+        }
+        else
+        {
+            pthread_mutex_init(&group->lock, NULL);
+            pthread_cond_init(&group->done, NULL);
+            group->next = groups;
+            groups = group;
+        }
+    }
+
+    spinlock_release(&groups_lock);
+
+    if (group == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for binlog sync group '%s'.", name);
+    }
+
+    return group;
+}
+
+/**
+ * Sync the filesystem of a binlog file as a part of a sync group. The file is
+ * synced once a sync of the group that started after this call has completed.
+ *
+ * @param group The sync group
+ * @param fd    The binlog file
+ * @return      True if the file was synced
+ */
+bool
+blr_sync_group_sync(BLR_SYNC_GROUP *group, int fd)
+{
+    pthread_mutex_lock(&group->lock);
+    uint64_t ticket = ++group->requests;
+
+    while (group->synced < ticket)
+    {
+        if (group->syncing)
+        {
+            pthread_cond_wait(&group->done, &group->lock);
+            continue;
+        }
+
+        /* The sync covers all the requests made before it starts */
+        uint64_t upto = group->requests;
+        uint64_t start = ts_clock_us() / 1000;
+        group->syncing = true;
+        pthread_mutex_unlock(&group->lock);
+
+        int rc = syncfs(fd);
+        int err = errno;
+
+        pthread_mutex_lock(&group->lock);
+        group->syncing = false;
+
+        if (rc == 0)
+        {
+            group->synced = upto;
+            group->last_sync = start;
+            group->n_syncs++;
+        }
+
+        pthread_cond_broadcast(&group->done);
+
+        if (rc != 0)
+        {
+            /* The other routers retry the sync themselves */
+            pthread_mutex_unlock(&group->lock);
+
+            char err_msg[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to sync the binlog files of sync group '%s', syncing "
+                      "the binlog file only: %s", group->name,
+                      strerror_r(err, err_msg, sizeof(err_msg)));
+
+            return fsync(fd) == 0;
+        }
+    }
+
+    pthread_mutex_unlock(&group->lock);
+    return true;
+}
@@ -28,6 +28,7 @@
  *                  Currently MariadDB 10 starting transactions
  *                  are detected checking GTID event
  *                  with flags = 0
+ * 14/10/2016   MariaDB Corporation Check multiple files in parallel
  *
  * @endverbatim
  */
@@ -56,6 +57,7 @@
 #include <ini.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include <version.h>
 #include <gwdirs.h>
@@ -71,11 +73,30 @@ static struct option long_options[] =
     {"version",   no_argument,        0,  'V'},
     {"fix",   no_argument,        0,  'f'},
     {"mariadb10", no_argument,        0,  'M'},
+    {"jobs",  required_argument,  0,  'j'},
     {"help",  no_argument,        0,  '?'},
     {0, 0, 0, 0}
 };
 
-char *binlog_check_version = "1.1.0";
+char *binlog_check_version = "1.2.0";
+
+/** The result of checking one binlog file */
+typedef struct
+{
+    char            *path;          /*< Path of the binlog file */
+    unsigned long   size;           /*< Size of the file */
+    int             ret;            /*< Check retcode, -1 if the file could not be opened */
+    unsigned long   binlog_pos;     /*< The last safe position */
+    unsigned long   current_pos;    /*< The position of the last event */
+} BINLOG_CHECK;
+
+/** The files to check, shared by the worker threads */
+static BINLOG_CHECK *checks;
+static int n_checks;
+static int next_check = 0;
+static int fix_file = 0;
+static int debug_out = 0;
+static int mariadb10_compat = 0;
 
 int
 maxscale_uptime()
@@ -83,23 +104,155 @@ maxscale_uptime()
     return 1;
 }
 
-int main(int argc, char **argv)
+/**
+ * Check one binlog file
+ *
+ * @param check The file to check, the results are stored in it
+ */
+static void
+check_binlog(BINLOG_CHECK *check)
 {
     ROUTER_INSTANCE *inst;
-    int fd;
-    int ret;
+    struct stat statb;
     char *ptr;
-    char path[PATH_MAX + 1] = "";
-    unsigned long filelen = 0;
-    struct  stat statb;
+    int fd;
+
+    check->ret = -1;
+
+    if ((inst = calloc(1, sizeof(ROUTER_INSTANCE))) == NULL)
+    {
+        MXS_ERROR("Memory allocation failed for ROUTER_INSTANCE");
+        return;
+    }
+
+    if (fix_file)
+    {
+        fd = open(check->path, O_RDWR, 0666);
+    }
+    else
+    {
+        fd = open(check->path, O_RDONLY, 0666);
+    }
+
+    if (fd == -1)
+    {
+        char err_msg[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to open binlog file %s: %s",
+                  check->path, strerror_r(errno, err_msg, sizeof(err_msg)));
+        free(inst);
+        return;
+    }
+
+    inst->binlog_fd = fd;
+
+    if (mariadb10_compat == 1)
+    {
+        inst->mariadb10_compat = 1;
+    }
+
+    ptr = strrchr(check->path, '/');
+    if (ptr)
+    {
+        strncpy(inst->binlog_name, ptr + 1, BINLOG_FNAMELEN);
+    }
+    else
+    {
+        strncpy(inst->binlog_name, check->path, BINLOG_FNAMELEN);
+    }
+
+    if (fstat(inst->binlog_fd, &statb) == 0)
+    {
+        check->size = statb.st_size;
+    }
+
+    MXS_NOTICE("Checking %s (%s), size %lu bytes", check->path, inst->binlog_name, check->size);
+
+    /* read binary log */
+    check->ret = blr_read_events_all_events(inst, fix_file, debug_out);
+    check->binlog_pos = inst->binlog_position;
+    check->current_pos = inst->current_pos;
+
+    close(inst->binlog_fd);
+
+    MXS_NOTICE("Check retcode: %i, Binlog Pos = %lu", check->ret, inst->binlog_position);
+
+    free(inst);
+}
+
+/**
+ * The worker thread, checks files until all of them have been checked
+ *
+ * @param arg   Not used
+ */
+static void *
+check_worker(void *arg)
+{
+    int i;
+
+    while ((i = atomic_add(&next_check, 1)) < n_checks)
+    {
+        check_binlog(&checks[i]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Print the combined report of all checked files
+ *
+ * @return Number of files that could not be checked
+ */
+static int
+print_report()
+{
+    int n_failed = 0;
+    int n_errors = 0;
+
+    MXS_NOTICE("%-40s %14s %14s %14s  %s", "Binlog file", "Size", "Safe pos",
+               "Last event", "Result");
+
+    for (int i = 0; i < n_checks; i++)
+    {
+        BINLOG_CHECK *check = &checks[i];
+        const char *result;
+
+        if (check->ret == -1)
+        {
+            result = "Not checked";
+            n_failed++;
+        }
+        else if (check->ret)
+        {
+            result = "Errors found";
+            n_errors++;
+        }
+        else if (check->binlog_pos != check->current_pos)
+        {
+            result = "Open transaction at the end";
+        }
+        else
+        {
+            result = "OK";
+        }
+
+        MXS_NOTICE("%-40s %14lu %14lu %14lu  %s", check->path, check->size,
+                   check->binlog_pos, check->current_pos, result);
+    }
+
+    MXS_NOTICE("Checked %d binlog files: %d with errors, %d could not be checked",
+               n_checks - n_failed, n_errors, n_failed);
+
+    return n_failed;
+}
+
+int main(int argc, char **argv)
+{
     char c;
     int option_index = 0;
-    int num_args = 0;
-    int debug_out = 0;
-    int fix_file = 0;
-    int mariadb10_compat = 0;
+    int n_jobs = 1;
+    int n_failed;
 
-    while ((c = getopt_long(argc, argv, "dVfM?", long_options, &option_index)) >= 0)
+    while ((c = getopt_long(argc, argv, "dVfMj:?", long_options, &option_index)) >= 0)
     {
         switch (c)
         {
@@ -116,99 +269,87 @@ int main(int argc, char **argv)
         case 'M':
             mariadb10_compat = 1;
             break;
+        case 'j':
+            n_jobs = atoi(optarg);
+            if (n_jobs < 1)
+            {
+                printf("ERROR: Invalid number of jobs: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case '?':
             printUsage(*argv);
             exit(optopt ? EXIT_FAILURE : EXIT_SUCCESS);
         }
     }
 
-    num_args = optind;
-
-    mxs_log_init(NULL, NULL, MXS_LOG_TARGET_DEFAULT);
-    mxs_log_set_augmentation(0);
-    mxs_log_set_priority_enabled(LOG_DEBUG, debug_out);
-
-    if ((inst = calloc(1, sizeof(ROUTER_INSTANCE))) == NULL)
-    {
-        MXS_ERROR("Memory allocation failed for ROUTER_INSTANCE");
-
-        mxs_log_flush_sync();
-        mxs_log_finish();
-
-        return 1;
-    }
-
-    if (argv[num_args] == NULL)
+    if (argv[optind] == NULL)
     {
         printf("ERROR: No binlog file was specified\n");
         exit(EXIT_FAILURE);
     }
 
-    strncpy(path, argv[num_args], PATH_MAX);
+    n_checks = argc - optind;
 
-    if (fix_file)
+    if ((checks = calloc(n_checks, sizeof(BINLOG_CHECK))) == NULL)
     {
-        fd = open(path, O_RDWR, 0666);
-    }
-    else
-    {
-        fd = open(path, O_RDONLY, 0666);
+        printf("ERROR: Memory allocation failed\n");
+        exit(EXIT_FAILURE);
     }
 
-    if (fd == -1)
+    for (int i = 0; i < n_checks; i++)
     {
-        MXS_ERROR("Failed to open binlog file %s: %s",
-                  path, strerror(errno));
-
-        mxs_log_flush_sync();
-        mxs_log_finish();
-
-        free(inst);
-
-        return 1;
+        checks[i].path = argv[optind + i];
     }
 
-    inst->binlog_fd = fd;
+    mxs_log_init(NULL, NULL, MXS_LOG_TARGET_DEFAULT);
+    mxs_log_set_augmentation(0);
+    mxs_log_set_priority_enabled(LOG_DEBUG, debug_out);
 
-    if (mariadb10_compat == 1)
+    MXS_NOTICE("maxbinlogcheck %s", binlog_check_version);
+
+    if (n_jobs > n_checks)
     {
-        inst->mariadb10_compat = 1;
+        n_jobs = n_checks;
     }
 
-    ptr = strrchr(path, '/');
-    if (ptr)
+    if (n_jobs == 1)
     {
-        strncpy(inst->binlog_name, ptr + 1, BINLOG_FNAMELEN);
+        check_worker(NULL);
     }
     else
     {
-        strncpy(inst->binlog_name, path, BINLOG_FNAMELEN);
-    }
-
-    MXS_NOTICE("maxbinlogcheck %s", binlog_check_version);
+        pthread_t threads[n_jobs];
+        int n_threads = 0;
 
-    if (fstat(inst->binlog_fd, &statb) == 0)
-    {
-        filelen = statb.st_size;
-    }
-
-    MXS_NOTICE("Checking %s (%s), size %lu bytes", path, inst->binlog_name, filelen);
+        while (n_threads < n_jobs &&
+               pthread_create(&threads[n_threads], NULL, check_worker, NULL) == 0)
+        {
+            n_threads++;
+        }
 
-    /* read binary log */
-    ret = blr_read_events_all_events(inst, fix_file, debug_out);
+        /* Check the files in this thread if no worker threads could be started */
+        if (n_threads == 0)
+        {
+            check_worker(NULL);
+        }
 
-    close(inst->binlog_fd);
+        for (int i = 0; i < n_threads; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
 
     mxs_log_flush_sync();
 
-    MXS_NOTICE("Check retcode: %i, Binlog Pos = %lu", ret, inst->binlog_position);
+    n_failed = n_checks > 1 ? print_report() : (checks[0].ret == -1);
 
     mxs_log_flush_sync();
     mxs_log_finish();
 
-    free(inst);
+    free(checks);
 
-    return 0;
+    return n_failed ? 1 : 0;
 }
 
 /**
@@ -229,10 +370,11 @@ printUsage(const char *progname)
     printVersion(progname);
 
     printf("The MaxScale binlog check utility.\n\n");
-    printf("Usage: %s [-f] [-d] [-v] [<binlog file>]\n\n", progname);
+    printf("Usage: %s [-f] [-d] [-v] [-j <jobs>] <binlog file> [<binlog file>...]\n\n", progname);
     printf("  -f|--fix		Fix binlog file, require write permissions (truncate)\n");
     printf("  -d|--debug		Print debug messages\n");
     printf("  -M|--mariadb10	MariaDB 10 binlog compatibility\n");
+    printf("  -j|--jobs		Number of files to check in parallel\n");
     printf("  -V|--version          print version information and exit\n");
     printf("  -?|--help             Print this help text\n");
 }
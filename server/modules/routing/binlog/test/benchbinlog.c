@@ -0,0 +1,495 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file benchbinlog.c - The binlog router ingest and distribution benchmark
+ *
+ * The events of recorded binlog files are sent to blr_handle_binlog_record()
+ * in network sized batches, as if they came from a master, and distributed to
+ * a number of simulated slaves that are up to date. The simulated slaves
+ * discard the packets they are sent.
+ *
+ * The binlog files must be consecutive and each file except the last must
+ * end with a rotate event, as the router writes the events at the positions
+ * recorded in them.
+ *
+ * The distribution latency is the time from passing a batch to the router
+ * until the last slave is sent an event of the batch.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date     Who     Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <zlib.h>
+#include <service.h>
+#include <dcb.h>
+#include <spinlock.h>
+#include <blr.h>
+#include <skygw_types.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+#define BENCH_DEFAULT_SLAVES    4
+#define BENCH_DEFAULT_BATCH     16384
+
+extern void blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt);
+extern void encode_value(unsigned char *data, unsigned int value, int len);
+
+/** Distribution latencies of the last slave in nanoseconds */
+static uint64_t *latency;
+static size_t n_latency;
+static size_t latency_size;
+
+static DCB *last_dcb;           /*< DCB of the slave that is sent the events last */
+static uint64_t batch_start;    /*< Time the current batch was passed to the router */
+static uint64_t bytes_sent;     /*< Bytes written to all slaves */
+
+static struct option long_options[] =
+{
+    {"slaves",       required_argument, 0, 'n'},
+    {"rate",         required_argument, 0, 'r'},
+    {"batch",        required_argument, 0, 'b'},
+    {"write-buffer", required_argument, 0, 'w'},
+    {"sync-interval", required_argument, 0, 's'},
+    {"event-ring",   required_argument, 0, 'e'},
+    {"mariadb10",    no_argument,       0, 'm'},
+    {"trx-safe",     no_argument,       0, 't'},
+    {"directory",    required_argument, 0, 'd'},
+    {"help",         no_argument,       0, '?'},
+    {0, 0, 0, 0}
+};
+
+static uint64_t
+bench_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * The write function of the simulated slave connections
+ *
+ * @param dcb   The slave DCB
+ * @param buf   The packet sent to the slave
+ * @return      Always 1
+ */
+static int
+bench_slave_write(DCB *dcb, GWBUF *buf)
+{
+    bytes_sent += gwbuf_length(buf);
+
+    if (dcb == last_dcb)
+    {
+        if (n_latency == latency_size)
+        {
+            latency_size = latency_size ? latency_size * 2 : 1024 * 1024;
+            latency = realloc(latency, latency_size * sizeof(uint64_t));
+        }
+
+        if (latency)
+        {
+            latency[n_latency++] = bench_clock_ns() - batch_start;
+        }
+    }
+
+    gwbuf_free(buf);
+    return 1;
+}
+
+/**
+ * Add up to date slaves that discard the events they are sent
+ *
+ * @param router    The router instance
+ * @param n         Number of slaves
+ */
+static void
+bench_add_slaves(ROUTER_INSTANCE *router, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        ROUTER_SLAVE *slave = calloc(1, sizeof(ROUTER_SLAVE));
+        DCB *dcb = calloc(1, sizeof(DCB));
+
+        dcb->func.write = bench_slave_write;
+        dcb->remote = "benchmark";
+
+        spinlock_init(&slave->catch_lock);
+        spinlock_init(&slave->rses_lock);
+        slave->dcb = dcb;
+        slave->router = router;
+        slave->serverid = i + 1;
+        slave->state = BLRS_DUMPING;
+        slave->cstate = CS_UPTODATE;
+        slave->binlog_pos = BINLOG_MAGIC_SIZE;
+        strcpy(slave->binlogfile, router->binlog_name);
+
+        /* The slaves are sent the events in list order */
+        if (last_dcb == NULL)
+        {
+            last_dcb = dcb;
+        }
+        slave->next = router->slaves;
+        router->slaves = slave;
+    }
+}
+
+/**
+ * Check whether the binlog has checksums from its format description event
+ *
+ * @param ev    The format description event
+ * @param size  Size of the event
+ * @return      True if the last four bytes are the checksum of the event
+ */
+static bool
+bench_has_checksum(uint8_t *ev, uint32_t size)
+{
+    return size > BINLOG_EVENT_HDR_LEN + MYSQL_CHECKSUM_LEN &&
+           crc32(crc32(0L, NULL, 0), ev, size - MYSQL_CHECKSUM_LEN) ==
+           EXTRACT32(ev + size - MYSQL_CHECKSUM_LEN);
+}
+
+/**
+ * Append an event to the batch as replication packets
+ *
+ * @param batch The batch
+ * @param len   Length of the batch, updated
+ * @param ev    The event
+ * @param size  Size of the event
+ */
+static void
+bench_add_event(uint8_t *batch, size_t *len, uint8_t *ev, uint32_t size)
+{
+    uint8_t *ptr = batch + *len;
+    uint64_t left = (uint64_t)size + 1;
+    uint32_t plen;
+    bool first = true;
+
+    /* A packet of exactly the maximum size is followed by another, possibly empty, one */
+    do
+    {
+        plen = MIN(left, MYSQL_PACKET_LENGTH_MAX);
+
+        encode_value(ptr, plen, 24);
+        ptr[3] = 0;
+        ptr += MYSQL_HEADER_LEN;
+
+        if (first)
+        {
+            *ptr++ = 0;     // OK byte
+            memcpy(ptr, ev, plen - 1);
+            ptr += plen - 1;
+            ev += plen - 1;
+            first = false;
+        }
+        else
+        {
+            memcpy(ptr, ev, plen);
+            ptr += plen;
+            ev += plen;
+        }
+        left -= plen;
+    }
+    while (plen == MYSQL_PACKET_LENGTH_MAX);
+
+    *len = ptr - batch;
+}
+
+/**
+ * Pass a batch of events to the router
+ *
+ * @param router    The router instance
+ * @param batch     The batch
+ * @param len       Length of the batch
+ */
+static void
+bench_send_batch(ROUTER_INSTANCE *router, uint8_t *batch, size_t len)
+{
+    GWBUF *buf = gwbuf_alloc_and_load(len, batch);
+
+    if (buf)
+    {
+        router->stats.n_reads++;
+        batch_start = bench_clock_ns();
+        blr_handle_binlog_record(router, buf);
+    }
+}
+
+static int
+bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+printUsage(const char *progname)
+{
+    printf("Usage: %s [options] binlog_file...\n\n", progname);
+    printf("  -n|--slaves=N           Number of simulated slaves, default %d\n",
+           BENCH_DEFAULT_SLAVES);
+    printf("  -r|--rate=N             Events per second, default is unlimited\n");
+    printf("  -b|--batch=N            Bytes passed to the router at a time, default %d\n",
+           BENCH_DEFAULT_BATCH);
+    printf("  -w|--write-buffer=N     Size of the binlog write buffer in kilobytes\n");
+    printf("  -s|--sync-interval=N    Sync the binlog every N milliseconds instead of\n"
+           "                          after every batch\n");
+    printf("  -e|--event-ring=N       Size of the event ring in megabytes\n");
+    printf("  -m|--mariadb10          The binlog files are from MariaDB 10\n");
+    printf("  -t|--trx-safe           Enable the transaction safety\n");
+    printf("  -d|--directory=DIR      Directory for the binlog files that the router\n"
+           "                          writes, default is a temporary directory\n");
+    printf("  -?|--help               Print this help text\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    ROUTER_INSTANCE *router;
+    SERVICE service;
+    struct rusage ru_start, ru_end;
+    char template[] = "/tmp/benchbinlog.XXXXXX";
+    char *dir = NULL;
+    char *sptr;
+    int nslaves = BENCH_DEFAULT_SLAVES;
+    size_t batch_size = BENCH_DEFAULT_BATCH;
+    unsigned long rate = 0;
+    uint64_t events = 0, bytes = 0;
+    int c, option_index = 0;
+
+    if ((router = calloc(1, sizeof(ROUTER_INSTANCE))) == NULL)
+    {
+        return 1;
+    }
+
+    memset(&service, 0, sizeof(service));
+    service.name = "benchmark";
+    router->service = &service;
+    spinlock_init(&router->lock);
+    spinlock_init(&router->fileslock);
+    spinlock_init(&router->binlog_lock);
+    spinlock_init(&router->event_ring.lock);
+    spinlock_init(&router->wbuf_lock);
+    router->binlog_fd = -1;
+    router->index_fd = -1;
+    router->master_state = BLRM_BINLOGDUMP;
+
+    while ((c = getopt_long(argc, argv, "n:r:b:w:s:e:mtd:?", long_options, &option_index)) >= 0)
+    {
+        switch (c)
+        {
+        case 'n':
+            nslaves = atoi(optarg);
+            break;
+        case 'r':
+            rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            batch_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            router->wbuf_size = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 's':
+            router->sync_interval = atoi(optarg);
+            break;
+        case 'e':
+            router->event_ring.max_size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'm':
+            router->mariadb10_compat = true;
+            break;
+        case 't':
+            router->trx_safe = 1;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc || batch_size == 0)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    if (dir == NULL && (dir = mkdtemp(template)) == NULL)
+    {
+        fprintf(stderr, "Failed to create a temporary directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (router->wbuf_size && (router->wbuf = malloc(router->wbuf_size)) == NULL)
+    {
+        router->wbuf_size = 0;
+    }
+
+    mxs_log_init(NULL, dir, MXS_LOG_TARGET_FS);
+    mxs_log_set_priority_enabled(LOG_INFO, false);
+    mxs_log_set_priority_enabled(LOG_NOTICE, false);
+
+    router->binlogdir = dir;
+
+    /* Write the binlog with the name of the first recorded file */
+    sptr = strrchr(argv[optind], '/');
+    sptr = sptr ? sptr + 1 : argv[optind];
+    router->fileroot = strdup(sptr);
+    if (strrchr(router->fileroot, '.'))
+    {
+        *strrchr(router->fileroot, '.') = '\0';
+    }
+
+    if (!blr_file_rotate(router, sptr, BINLOG_MAGIC_SIZE))
+    {
+        fprintf(stderr, "Failed to create binlog file '%s' in '%s'\n", sptr, dir);
+        return 1;
+    }
+
+    bench_add_slaves(router, nslaves);
+
+    uint8_t *batch = NULL;
+    size_t batch_capacity = 0;
+    size_t len = 0;
+
+    getrusage(RUSAGE_SELF, &ru_start);
+    uint64_t start = bench_clock_ns();
+
+    for (; optind < argc; optind++)
+    {
+        struct stat statb;
+        uint8_t *data;
+        uint64_t pos = BINLOG_MAGIC_SIZE;
+        int fd = open(argv[optind], O_RDONLY);
+
+        if (fd == -1 || fstat(fd, &statb) == -1 || statb.st_size < BINLOG_MAGIC_SIZE ||
+            (data = mmap(NULL, statb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        {
+            fprintf(stderr, "Failed to read binlog file '%s': %s\n", argv[optind], strerror(errno));
+            return 1;
+        }
+
+        while (pos + BINLOG_EVENT_HDR_LEN <= (uint64_t)statb.st_size)
+        {
+            uint8_t *ev = data + pos;
+            uint32_t size = EXTRACT32(ev + 9);
+            size_t needed = size + 1 + MYSQL_HEADER_LEN * (size / MYSQL_PACKET_LENGTH_MAX + 2);
+
+            if (size < BINLOG_EVENT_HDR_LEN || pos + size > (uint64_t)statb.st_size)
+            {
+                break;
+            }
+
+            if (ev[4] == FORMAT_DESCRIPTION_EVENT)
+            {
+                router->master_chksum = bench_has_checksum(ev, size);
+            }
+
+            if (len && len + needed > batch_size)
+            {
+                bench_send_batch(router, batch, len);
+                len = 0;
+            }
+
+            if (len + needed > batch_capacity)
+            {
+                batch_capacity = MAX(batch_size, len + needed);
+                batch = realloc(batch, batch_capacity);
+            }
+
+            bench_add_event(batch, &len, ev, size);
+            events++;
+            bytes += size;
+            pos += size;
+
+            if (rate && len >= batch_size)
+            {
+                bench_send_batch(router, batch, len);
+                len = 0;
+            }
+
+            /* Wait until it is time for the next event */
+            while (rate && bench_clock_ns() - start < events * 1000000000 / rate)
+            {
+                if (len)
+                {
+                    bench_send_batch(router, batch, len);
+                    len = 0;
+                }
+                usleep(100);
+            }
+        }
+
+        munmap(data, statb.st_size);
+        close(fd);
+    }
+
+    if (len)
+    {
+        bench_send_batch(router, batch, len);
+    }
+
+    uint64_t elapsed = bench_clock_ns() - start;
+    getrusage(RUSAGE_SELF, &ru_end);
+
+    double secs = elapsed / 1e9;
+    double cpu = (ru_end.ru_utime.tv_sec - ru_start.ru_utime.tv_sec) +
+                 (ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) +
+                 ((ru_end.ru_utime.tv_usec - ru_start.ru_utime.tv_usec) +
+                  (ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec)) / 1e6;
+
+    printf("Events:                  %lu\n", events);
+    printf("Slaves:                  %d\n", nslaves);
+    printf("Elapsed time (s):        %.3f\n", secs);
+    printf("Ingest (events/s):       %.0f\n", secs > 0 ? events / secs : 0);
+    printf("Ingest (bytes/s):        %.0f\n", secs > 0 ? bytes / secs : 0);
+    printf("Sent to slaves (bytes/s): %.0f\n", secs > 0 ? bytes_sent / secs : 0);
+    printf("CPU per event (us):      %.3f\n", events ? cpu * 1e6 / events : 0);
+    printf("Binlog writes:           %lu\n", router->stats.n_writes);
+    printf("Binlog syncs:            %lu\n", router->stats.n_syncs);
+
+    if (n_latency)
+    {
+        qsort(latency, n_latency, sizeof(uint64_t), bench_compare);
+        printf("Distribution latency (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+               latency[n_latency / 2] / 1e3,
+               latency[n_latency * 90 / 100] / 1e3,
+               latency[n_latency * 99 / 100] / 1e3,
+               latency[n_latency * 999 / 1000] / 1e3,
+               latency[n_latency - 1] / 1e3);
+    }
+
+    mxs_log_finish();
+    return 0;
+}
@@ -42,6 +42,9 @@
  * 06/11/15     Martin Brampton         Add show buffers (conditional compilation)
  * 23/05/16     Massimiliano Pinto      'add user' and 'remove user'
  *                                      no longer accept password parameter
+ * 14/10/16     MariaDB Corporation     Added the sampling profiler commands
+ * 14/10/16     MariaDB Corporation     Pages of sessions, DCBs and clients
+ * 14/10/16     MariaDB Corporation     Added show usage
  *
  * @endverbatim
  */
@@ -69,6 +72,10 @@
 #include <monitor.h>
 #include <debugcli.h>
 #include <housekeeper.h>
+#include <profiler.h>
+#include <query_classifier.h>
+#include <memusage.h>
+#include <usage.h>
 
 #include <skygw_utils.h>
 #include <log_manager.h>
@@ -102,6 +109,12 @@ struct subcommand {
 };
 
 static  void    telnetdShowUsers(DCB *);
+static  void    showSessionsPage(DCB *, unsigned long, unsigned long);
+static  void    showDCBsPage(DCB *, unsigned long, unsigned long);
+static  void    listSessionsPage(DCB *, unsigned long, unsigned long);
+static  void    listDCBsPage(DCB *, unsigned long, unsigned long);
+static  void    listClientsPage(DCB *, unsigned long, unsigned long);
+static  void    dprintQcCacheStats(DCB *);
 /**
  * The subcommands of the show command
  */
@@ -116,6 +129,12 @@ struct subcommand showoptions[] = {
       "Show all descriptor control blocks (network connections)",
       "Show all descriptor control blocks (network connections)",
       {0, 0, 0} },
+    { "dcbs", 2, showDCBsPage,
+      "Show a page of the descriptor control blocks, e.g. show dcbs 101 100\n"
+      "\t\tshows 100 DCBs starting from the 101st",
+      "Show a page of the descriptor control blocks, e.g. show dcbs 101 100\n"
+      "\t\tshows 100 DCBs starting from the 101st",
+      {ARG_TYPE_NUMERIC, ARG_TYPE_NUMERIC, 0} },
     { "dcb", 1, dprintDCB,
       "Show a single descriptor control block e.g. show dcb 0x493340",
       "Show a single descriptor control block e.g. show dcb 0x493340",
@@ -150,6 +169,10 @@ struct subcommand showoptions[] = {
       "Show all filters",
       "Show all filters",
       {0, 0, 0} },
+    { "memory", 0, dShowMemory,
+      "Show the memory used by the subsystems and the services of MaxScale",
+      "Show the memory used by the subsystems and the services of MaxScale",
+      {0, 0, 0} },
     { "modules", 0, dprintAllModules,
       "Show all currently loaded modules",
       "Show all currently loaded modules",
@@ -167,6 +190,15 @@ struct subcommand showoptions[] = {
       "Show persistent pool for a server, e.g. show persistent 0x485390. "
       "The address may also be replaced with the server name from the configuration file",
       {ARG_TYPE_SERVER, 0, 0} },
+    { "profile", 0, dprintProfile,
+      "Show the samples of the profiler as folded stacks",
+      "Show the samples recorded by the profiler as folded stacks, one unique stack\n"
+      "\t\tper line followed by the number of samples, that flame graph tools can read.",
+      {0, 0, 0} },
+    { "qc_cache", 0, dprintQcCacheStats,
+      "Show the statistics of the query classification caches",
+      "Show the statistics of the query classification caches",
+      {0, 0, 0} },
     { "server", 1, dprintServer,
       "Show details for a named server, e.g. show server dbnode1",
       "Show details for a server, e.g. show server 0x485390. The address may also be "
@@ -196,6 +228,12 @@ struct subcommand showoptions[] = {
       "Show all active sessions in MaxScale",
       "Show all active sessions in MaxScale",
       {0, 0, 0} },
+    { "sessions", 2, showSessionsPage,
+      "Show a page of the active sessions, e.g. show sessions 101 100\n"
+      "\t\tshows 100 sessions starting from the 101st",
+      "Show a page of the active sessions, e.g. show sessions 101 100\n"
+      "\t\tshows 100 sessions starting from the 101st",
+      {ARG_TYPE_NUMERIC, ARG_TYPE_NUMERIC, 0} },
     { "tasks", 0, hkshow_tasks,
       "Show all active housekeeper tasks in MaxScale",
       "Show all active housekeeper tasks in MaxScale",
@@ -204,6 +242,16 @@ struct subcommand showoptions[] = {
       "Show the status of the polling threads in MaxScale",
       "Show the status of the polling threads in MaxScale",
       {0, 0, 0} },
+    { "trace", 0, dprintTrace,
+      "Show the traced stages of the queries in the Trace Event Format",
+      "Show the recorded stages of the traced queries in the Trace Event Format\n"
+      "\t\tthat trace viewers can load. Tracing is enabled with trace_sample_rate.",
+      {0, 0, 0} },
+    { "usage", 0, dShowUsage,
+      "Show the resources used by the services and by their users",
+      "Show the queries, the client bytes, the backend time and the proxy time\n"
+      "\t\tused by each service and by each user of a service",
+      {0, 0, 0} },
     { "users", 0, telnetdShowUsers,
       "Show all maxadmin enabled Linux accounts and created maxadmin users",
       "Show all maxadmin enabled Linux accounts and created maxadmin users",
@@ -220,10 +268,18 @@ struct subcommand listoptions[] = {
       "List all the client connections to MaxScale",
       "List all the client connections to MaxScale",
       {0, 0, 0} },
+    { "clients", 2, listClientsPage,
+      "List a page of the client connections, e.g. list clients 101 100",
+      "List a page of the client connections, e.g. list clients 101 100",
+      {ARG_TYPE_NUMERIC, ARG_TYPE_NUMERIC, 0} },
     { "dcbs", 0, dListDCBs,
       "List all the DCBs active within MaxScale",
       "List all the DCBs active within MaxScale",
       {0, 0, 0} },
+    { "dcbs", 2, listDCBsPage,
+      "List a page of the active DCBs, e.g. list dcbs 101 100",
+      "List a page of the active DCBs, e.g. list dcbs 101 100",
+      {ARG_TYPE_NUMERIC, ARG_TYPE_NUMERIC, 0} },
     { "filters", 0, dListFilters,
       "List all the filters defined within MaxScale",
       "List all the filters defined within MaxScale",
@@ -252,6 +308,10 @@ struct subcommand listoptions[] = {
       "List all the active sessions within MaxScale",
       "List all the active sessions within MaxScale",
       {0, 0, 0} },
+    { "sessions", 2, listSessionsPage,
+      "List a page of the active sessions, e.g. list sessions 101 100",
+      "List a page of the active sessions, e.g. list sessions 101 100",
+      {ARG_TYPE_NUMERIC, ARG_TYPE_NUMERIC, 0} },
     { "threads", 0, dShowThreads,
       "List the status of the polling threads in MaxScale",
       "List the status of the polling threads in MaxScale",
@@ -429,6 +489,9 @@ static void enable_maxlog();
 static void disable_maxlog();
 static void enable_account(DCB *, char *user);
 static void disable_account(DCB *, char *user);
+static void enable_profiler(DCB *, int frequency);
+static void enable_profiler_stacks(DCB *, int frequency);
+static void disable_profiler(DCB *);
 
 /**
  *  * The subcommands of the enable command
@@ -526,6 +589,26 @@ struct subcommand enableoptions[] = {
         "                 MaxScale> enable account alice",
         {ARG_TYPE_STRING, 0, 0}
     },
+    {
+        "profiler",
+        1,
+        enable_profiler,
+        "Start sampling the instruction pointers of the polling threads, pass the\n"
+        "number of samples per second. E.g. 'enable profiler 99'.",
+        "Start sampling the instruction pointers of the polling threads, pass the\n"
+        "number of samples per second. E.g. 'enable profiler 99'.",
+        {ARG_TYPE_NUMERIC, 0, 0}
+    },
+    {
+        "profiler-stacks",
+        1,
+        enable_profiler_stacks,
+        "Start sampling the stacks of the polling threads, pass the number of\n"
+        "samples per second. E.g. 'enable profiler-stacks 99'.",
+        "Start sampling the stacks of the polling threads by following the frame\n"
+        "pointers, pass the number of samples per second. E.g. 'enable profiler-stacks 99'.",
+        {ARG_TYPE_NUMERIC, 0, 0}
+    },
     {
         NULL,
         0,
@@ -634,6 +717,14 @@ struct subcommand disableoptions[] = {
         "                 MaxScale> disable account alice",
         {ARG_TYPE_STRING, 0, 0}
     },
+    {
+        "profiler",
+        0,
+        disable_profiler,
+        "Stop the profiler, the samples can still be shown with 'show profile'",
+        "Stop the profiler, the samples can still be shown with 'show profile'",
+        {0, 0, 0}
+    },
     {
         NULL,
         0,
@@ -1099,10 +1190,18 @@ execute_cmd(CLI_SESSION *cli)
         {
             if (strcasecmp(args[0], cmds[i].cmd) == 0)
             {
-                for (j = 0; cmds[i].options[j].arg1; j++)
+                for (j = 0; cmds[i].options[j].arg1 && !found; j++)
                 {
                     if (strcasecmp(args[1], cmds[i].options[j].arg1) == 0)
                     {
+                        /** A sub-command may have variants with different numbers
+                         * of arguments, the last one reports the mismatch */
+                        if (argc != cmds[i].options[j].n_args &&
+                            cmds[i].options[j + 1].arg1 &&
+                            strcasecmp(args[1], cmds[i].options[j + 1].arg1) == 0)
+                        {
+                            continue;
+                        }
                         found = 1; /**< command and sub-command match */
                         if (argc != cmds[i].options[j].n_args)
                         {
@@ -1246,6 +1345,7 @@ set_server(DCB *dcb, SERVER *server, char *bit)
     if ((bitvalue = server_map_status(bit)) != 0)
     {
         server_set_status(server, bitvalue);
+        server_publish_state(server);
     }
     else
     {
@@ -1269,6 +1369,7 @@ clear_server(DCB *dcb, SERVER *server, char *bit)
     if ((bitvalue = server_map_status(bit)) != 0)
     {
         server_clear_status(server, bitvalue);
+        server_publish_state(server);
     }
     else
     {
@@ -1357,6 +1458,40 @@ static void telnetdRemoveUser(DCB *dcb, char *user, char *password)
 }
 
 
+/**
+ * The page commands count the rows from one, as zero is not a valid
+ * numeric argument
+ */
+static void
+showSessionsPage(DCB *dcb, unsigned long first, unsigned long count)
+{
+    dprintSessionsPage(dcb, first - 1, count);
+}
+
+static void
+showDCBsPage(DCB *dcb, unsigned long first, unsigned long count)
+{
+    dprintDCBsPage(dcb, first - 1, count);
+}
+
+static void
+listSessionsPage(DCB *dcb, unsigned long first, unsigned long count)
+{
+    dListSessionsPage(dcb, first - 1, count);
+}
+
+static void
+listDCBsPage(DCB *dcb, unsigned long first, unsigned long count)
+{
+    dListDCBsPage(dcb, first - 1, count);
+}
+
+static void
+listClientsPage(DCB *dcb, unsigned long first, unsigned long count)
+{
+    dListClientsPage(dcb, first - 1, count);
+}
+
 /**
  * Print the adminsitration users
  *
@@ -1368,6 +1503,27 @@ telnetdShowUsers(DCB *dcb)
     dcb_PrintAdminUsers(dcb);
 }
 
+/**
+ * Print the statistics of the query classification caches
+ *
+ * @param dcb   The DCB to print the statistics to
+ */
+static void
+dprintQcCacheStats(DCB *dcb)
+{
+    QC_CACHE_STATS stats;
+    qc_get_cache_stats(&stats);
+    uint64_t total = stats.hits + stats.misses;
+
+    dcb_printf(dcb, "Query classification cache size:   %d\n", config_qc_cache_size());
+    dcb_printf(dcb, "Cached entries:                    %lu\n", stats.entries);
+    dcb_printf(dcb, "Cache hits:                        %lu\n", stats.hits);
+    dcb_printf(dcb, "Cache misses:                      %lu\n", stats.misses);
+    dcb_printf(dcb, "Cache evictions:                   %lu\n", stats.evictions);
+    dcb_printf(dcb, "Hit ratio:                         %.1f%%\n",
+               total ? 100.0 * stats.hits / total : 0.0);
+}
+
 /**
  * Command to shutdown a running monitor
  *
@@ -1854,6 +2010,47 @@ disable_maxlog()
     mxs_log_set_maxlog_enabled(false);
 }
 
+/**
+ * Start the profiler
+ *
+ * @param dcb           The DCB for messages
+ * @param frequency     Samples per second
+ */
+static void
+enable_profiler(DCB *dcb, int frequency)
+{
+    if (!profiler_start(frequency, false))
+    {
+        dcb_printf(dcb, "Failed to start the profiler, see the log for details.\n");
+    }
+}
+
+/**
+ * Start the profiler with the recording of the stacks
+ *
+ * @param dcb           The DCB for messages
+ * @param frequency     Samples per second
+ */
+static void
+enable_profiler_stacks(DCB *dcb, int frequency)
+{
+    if (!profiler_start(frequency, true))
+    {
+        dcb_printf(dcb, "Failed to start the profiler, see the log for details.\n");
+    }
+}
+
+/**
+ * Stop the profiler
+ *
+ * @param dcb           The DCB for messages
+ */
+static void
+disable_profiler(DCB *dcb)
+{
+    profiler_stop();
+}
+
 /**
  * Enable a Linux account
  *
@@ -22,6 +22,7 @@
  * 16/02/15	Mark Riddoch		Initial implementation
  * 27/02/15	Massimiliano Pinto	Added maxinfo_add_mysql_user
  * 09/09/2015   Martin Brampton         Modify error handler
+ * 14/10/2016   MariaDB Corporation     Added the /metrics URL
  *
  * @endverbatim
  */
@@ -716,6 +717,10 @@ int		i;
 RESULTSET	*set;
 
 	uri = (char *)GWBUF_DATA(queue);
+	if (strcmp(uri, "/metrics") == 0)
+	{
+		maxinfo_metrics(session->dcb);
+	}
 	for (i = 0; supported_uri[i].uri; i++)
 	{
 		if (strcmp(uri, supported_uri[i].uri) == 0)
@@ -44,6 +44,9 @@
 #include <log_manager.h>
 #include <resultset.h>
 #include <maxconfig.h>
+#include <query_classifier.h>
+#include <memusage.h>
+#include <usage.h>
 
 static void exec_show(DCB *dcb, MAXINFO_TREE *tree);
 static void exec_select(DCB *dcb, MAXINFO_TREE *tree);
@@ -241,6 +244,167 @@ exec_show_monitors(DCB *dcb, MAXINFO_TREE *tree)
     resultset_free(set);
 }
 
+/**
+ * Fetch the memory used by the subsystems and stream as a result set
+ *
+ * @param dcb   DCB to which to stream result set
+ * @param tree  Potential like clause (currently unused)
+ */
+static void
+exec_show_memory(DCB *dcb, MAXINFO_TREE *tree)
+{
+    RESULTSET   *set;
+
+    if ((set = memusageGetList()) == NULL)
+    {
+        return;
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+}
+
+/**
+ * Fetch the resources used by each user of each service and stream as a
+ * result set
+ *
+ * @param dcb   DCB to which to stream result set
+ * @param tree  Potential like clause (currently unused)
+ */
+static void
+exec_show_usage(DCB *dcb, MAXINFO_TREE *tree)
+{
+    RESULTSET   *set;
+
+    if ((set = usageGetList()) == NULL)
+    {
+        return;
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+}
+
+/**
+ * Fetch the resources used by each service and stream as a result set
+ *
+ * @param dcb   DCB to which to stream result set
+ * @param tree  Potential like clause (currently unused)
+ */
+static void
+exec_show_serviceUsage(DCB *dcb, MAXINFO_TREE *tree)
+{
+    RESULTSET   *set;
+
+    if ((set = usageGetServiceList()) == NULL)
+    {
+        return;
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+}
+
+/**
+ * Fetch the cycle and probe statistics of a monitor
+ *
+ * @param dcb   DCB to which to stream result set
+ * @param tree  The like clause with the name of the monitor
+ */
+static void
+exec_show_monitorStatistics(DCB *dcb, MAXINFO_TREE *tree)
+{
+    RESULTSET   *set;
+    MONITOR     *monitor;
+    char        errmsg[120];
+
+    if (tree == NULL)
+    {
+        maxinfo_send_error(dcb, 0, "Missing monitor name, use "
+                           "'SHOW MONITORSTATISTICS LIKE <monitor>'");
+        return;
+    }
+
+    if ((monitor = monitor_find(tree->value)) == NULL)
+    {
+        if (strlen(tree->value) > 80) // Prevent buffer overrun
+        {
+            tree->value[80] = 0;
+        }
+        sprintf(errmsg, "Invalid argument '%s'", tree->value);
+        maxinfo_send_error(dcb, 0, errmsg);
+        return;
+    }
+
+    if ((set = monitorGetStatistics(monitor)) == NULL)
+    {
+        return;
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+}
+
+/**
+ * Fetch the query latency percentiles of the services
+ *
+ * @param dcb   DCB to which to stream result set
+ * @param tree  Potential like clause (currently unused)
+ */
+static void
+exec_show_serviceLatency(DCB *dcb, MAXINFO_TREE *tree)
+{
+    RESULTSET   *set;
+
+    if ((set = serviceGetLatencyList()) == NULL)
+    {
+        return;
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+}
+
+/**
+ * Fetch the query latency percentiles of the servers
+ *
+ * @param dcb   DCB to which to stream result set
+ * @param tree  Potential like clause (currently unused)
+ */
+static void
+exec_show_serverLatency(DCB *dcb, MAXINFO_TREE *tree)
+{
+    RESULTSET   *set;
+
+    if ((set = serverGetLatencyList()) == NULL)
+    {
+        return;
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+}
+
+/**
+ * Fetch the time spent in each stage of the request pipeline by the traced queries
+ *
+ * @param dcb   DCB to which to stream result set
+ * @param tree  Potential like clause (currently unused)
+ */
+static void
+exec_show_traceStages(DCB *dcb, MAXINFO_TREE *tree)
+{
+    RESULTSET   *set;
+
+    if ((set = traceGetStageList()) == NULL)
+    {
+        return;
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+}
+
 /**
  * Fetch the event times data
  *
@@ -261,6 +425,98 @@ exec_show_eventTimes(DCB *dcb, MAXINFO_TREE *tree)
     resultset_free(set);
 }
 
+/**
+ * Fetch the router specific statistics of a service
+ *
+ * @param dcb   DCB to which to stream result set
+ * @param tree  The like clause with the name of the service
+ */
+static void
+exec_show_routerStatistics(DCB *dcb, MAXINFO_TREE *tree)
+{
+    RESULTSET   *set;
+    SERVICE     *service;
+    char        errmsg[120];
+
+    if (tree == NULL)
+    {
+        maxinfo_send_error(dcb, 0, "Missing service name, use "
+                           "'SHOW ROUTERSTATISTICS LIKE <service>'");
+        return;
+    }
+
+    if ((service = service_find(tree->value)) == NULL)
+    {
+        if (strlen(tree->value) > 80) // Prevent buffer overrun
+        {
+            tree->value[80] = 0;
+        }
+        sprintf(errmsg, "Invalid argument '%s'", tree->value);
+        maxinfo_send_error(dcb, 0, errmsg);
+        return;
+    }
+
+    if (service->router->getStatistics == NULL || service->router_instance == NULL)
+    {
+        maxinfo_send_error(dcb, 0, "The router of the service has no statistics");
+        return;
+    }
+
+    if ((set = service->router->getStatistics(service->router_instance)) == NULL)
+    {
+        return;
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+}
+
+/**
+ * Fetch the filter specific statistics of a filter
+ *
+ * @param dcb   DCB to which to stream result set
+ * @param tree  The like clause with the name of the filter
+ */
+static void
+exec_show_filterStatistics(DCB *dcb, MAXINFO_TREE *tree)
+{
+    RESULTSET   *set;
+    FILTER_DEF  *filter;
+    char        errmsg[120];
+
+    if (tree == NULL)
+    {
+        maxinfo_send_error(dcb, 0, "Missing filter name, use "
+                           "'SHOW FILTERSTATISTICS LIKE <filter>'");
+        return;
+    }
+
+    if ((filter = filter_find(tree->value)) == NULL)
+    {
+        if (strlen(tree->value) > 80) // Prevent buffer overrun
+        {
+            tree->value[80] = 0;
+        }
+        sprintf(errmsg, "Invalid argument '%s'", tree->value);
+        maxinfo_send_error(dcb, 0, errmsg);
+        return;
+    }
+
+    if (filter->obj == NULL || filter->obj->getStatistics == NULL || filter->filter == NULL)
+    {
+        maxinfo_send_error(dcb, 0, "The filter has no statistics");
+        return;
+    }
+
+    if ((set = filter->obj->getStatistics(filter->filter)) == NULL)
+    {
+        return;
+    }
+
+    resultset_stream_mysql(set, dcb);
+    resultset_free(set);
+}
+
 /**
  * The table of show commands that are supported
  */
@@ -279,7 +535,16 @@ static struct
     { "servers", exec_show_servers },
     { "modules", exec_show_modules },
     { "monitors", exec_show_monitors },
+    { "monitorStatistics", exec_show_monitorStatistics },
     { "eventTimes", exec_show_eventTimes },
+    { "serviceLatency", exec_show_serviceLatency },
+    { "serverLatency", exec_show_serverLatency },
+    { "traceStages", exec_show_traceStages },
+    { "routerStatistics", exec_show_routerStatistics },
+    { "filterStatistics", exec_show_filterStatistics },
+    { "memory", exec_show_memory },
+    { "usage", exec_show_usage },
+    { "serviceUsage", exec_show_serviceUsage },
     { NULL, NULL }
 };
 
@@ -381,6 +646,7 @@ void exec_set_server(DCB *dcb, MAXINFO_TREE *tree)
         if (status != 0)
         {
             server_set_status(server, status);
+            server_publish_state(server);
             maxinfo_send_ok(dcb);
         }
         else
@@ -462,6 +728,7 @@ void exec_clear_server(DCB *dcb, MAXINFO_TREE *tree)
         if (status != 0)
         {
             server_clear_status(server, status);
+            server_publish_state(server);
             maxinfo_send_ok(dcb);
         }
         else
@@ -1082,6 +1349,69 @@ maxinfo_max_event_exec_time()
     return poll_get_stat(POLL_STAT_MAX_EXECTIME);
 }
 
+/**
+ * Interface to the number of query classification cache hits
+ */
+static int
+maxinfo_qc_cache_hits()
+{
+    QC_CACHE_STATS stats;
+    qc_get_cache_stats(&stats);
+    return stats.hits;
+}
+
+/**
+ * Interface to the number of query classification cache misses
+ */
+static int
+maxinfo_qc_cache_misses()
+{
+    QC_CACHE_STATS stats;
+    qc_get_cache_stats(&stats);
+    return stats.misses;
+}
+
+/**
+ * Interface to the number of buffers allocated from the buffer pools
+ */
+static int
+maxinfo_buffer_pool_hits()
+{
+    GWBUF_POOL_STATS stats;
+    gwbuf_get_pool_stats(&stats);
+    return stats.alloc_pooled;
+}
+
+/**
+ * Interface to the number of buffers allocated with malloc
+ */
+static int
+maxinfo_buffer_pool_misses()
+{
+    GWBUF_POOL_STATS stats;
+    gwbuf_get_pool_stats(&stats);
+    return stats.alloc_system;
+}
+
+/**
+ * Interface to the number of bytes queued for writing in all DCBs
+ */
+static int
+maxinfo_writeq_bytes()
+{
+    int64_t bytes = dcb_writeq_total();
+    return bytes > INT_MAX ? INT_MAX : bytes;
+}
+
+/**
+ * Interface to the number of times reading from a backend was paused
+ */
+static int
+maxinfo_throttled_reads()
+{
+    return dcb_throttled_read_count();
+}
+
 /**
  * Variables that may be sent in a show status
  */
@@ -1114,6 +1444,12 @@ static struct
     { "Max_event_queue_length", VT_INT, (STATSFUNC)maxinfo_max_event_queue_length },
     { "Max_event_queue_time", VT_INT, (STATSFUNC)maxinfo_max_event_queue_time },
     { "Max_event_execution_time", VT_INT, (STATSFUNC)maxinfo_max_event_exec_time },
+    { "Buffer_pool_hits", VT_INT, (STATSFUNC)maxinfo_buffer_pool_hits },
+    { "Buffer_pool_misses", VT_INT, (STATSFUNC)maxinfo_buffer_pool_misses },
+    { "Qc_cache_hits", VT_INT, (STATSFUNC)maxinfo_qc_cache_hits },
+    { "Qc_cache_misses", VT_INT, (STATSFUNC)maxinfo_qc_cache_misses },
+    { "Write_queue_bytes", VT_INT, (STATSFUNC)maxinfo_writeq_bytes },
+    { "Throttled_reads", VT_INT, (STATSFUNC)maxinfo_throttled_reads },
     { NULL, 0,  NULL }
 };
 
@@ -1230,6 +1566,46 @@ maxinfo_status()
     return result;
 }
 
+/**
+ * Send all the statistics in the Prometheus text format
+ *
+ * The metrics are rendered into one buffer that is sent with a single write.
+ *
+ * @param dcb   The DCB of the HTTP client
+ * @return 1 if the metrics were sent, 0 on error
+ */
+int
+maxinfo_metrics(DCB *dcb)
+{
+    METRICS metrics;
+    GWBUF *buf;
+
+    metrics_init(&metrics);
+
+    metrics_family(&metrics, "maxscale_uptime_seconds", METRICS_GAUGE, "Time since MaxScale started");
+    metrics_value(&metrics, "maxscale_uptime_seconds", NULL, maxscale_uptime());
+    metrics_family(&metrics, "maxscale_threads", METRICS_GAUGE, "Number of polling threads");
+    metrics_value(&metrics, "maxscale_threads", NULL, config_threadcount());
+
+    poll_metrics(&metrics);
+    service_metrics(&metrics);
+    server_metrics(&metrics);
+    monitor_metrics(&metrics);
+    memusage_metrics(&metrics);
+    usage_metrics(&metrics);
+
+    buf = metrics_to_gwbuf(&metrics);
+    metrics_free(&metrics);
+
+    if (buf == NULL)
+    {
+        MXS_ERROR("maxinfo: Failed to render the metrics.");
+        return 0;
+    }
+
+    return dcb->func.write(dcb, buf);
+}
+
 
 /**
  * Execute a select command parse tree and return the result set
@@ -66,6 +66,9 @@
  * 09/09/2015   Martin Brampton         Modify error handler
  * 25/09/2015   Martin Brampton         Block callback processing when no router session in the DCB
  * 09/11/2015   Martin Brampton         Modified routeQuery - must free "queue" regardless of outcome
+ * 14/10/2016   MariaDB Corporation     Release the backend connections between transactions
+ *                                      with the multiplex option
+ * 14/10/2016   MariaDB Corporation     Lock-free weighted round-robin with the round_robin option
  *
  * @endverbatim
  */
@@ -82,12 +85,16 @@
 #include <dcb.h>
 #include <spinlock.h>
 #include <modinfo.h>
+#include <maxconfig.h>
+#include <maxscale/poll.h>
 
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
 #include <mysql_client_server_protocol.h>
+#include <mysql_utils.h>
+#include <query_classifier.h>
 
 #include "modutil.h"
 
@@ -112,7 +119,7 @@ static void clientReply(ROUTER *instance, void *router_session, GWBUF *queue,
                         DCB *backend_dcb);
 static void handleError(ROUTER *instance, void *router_session, GWBUF *errbuf,
                         DCB *problem_dcb, error_action_t action, bool *succp);
-static int getCapabilities();
+static int getCapabilities(ROUTER *instance, void *router_session);
 
 
 /** The module object definition */
@@ -134,7 +141,12 @@ static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES* rses);
 static void rses_end_locked_router_action(ROUTER_CLIENT_SES* rses);
 
 static BACKEND *get_root_master(BACKEND **servers);
+static BACKEND *rr_select(ROUTER_INSTANCE *inst);
+static BACKEND *select_least_connections(ROUTER_INSTANCE *inst);
 static int handle_state_switch(DCB* dcb, DCB_REASON reason, void * routersession);
+static int rcon_track_commands(ROUTER_CLIENT_SES *rses, GWBUF *queue);
+static void rcon_track_replies(ROUTER_CLIENT_SES *rses, DCB *backend);
+static DCB *rcon_attach_backend(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses);
 static SPINLOCK instlock;
 static ROUTER_INSTANCE *instances;
 
@@ -187,6 +199,10 @@ static inline void free_readconn_instance(ROUTER_INSTANCE *router)
             }
         }
         free(router->servers);
+        free(router->rr_slots);
+        free(router->rr_weights);
+        free(router->rr_credit);
+        free(router->rr_cursors);
         free(router);
     }
 }
@@ -350,12 +366,24 @@ createInstance(SERVICE *service, char **options)
                 inst->bitmask |= (SERVER_NDB);
                 inst->bitvalue |= SERVER_NDB;
             }
+            else if (!strcasecmp(options[i], "pipeline"))
+            {
+                inst->pipeline = true;
+            }
+            else if (!strcasecmp(options[i], "multiplex"))
+            {
+                inst->multiplex = true;
+            }
+            else if (!strcasecmp(options[i], "round_robin"))
+            {
+                inst->round_robin = true;
+            }
             else
             {
                 MXS_WARNING("Unsupported router "
                             "option \'%s\' for readconnroute. "
                             "Expected router options are "
-                            "[slave|master|synced|ndb|running]",
+                            "[slave|master|synced|ndb|running|pipeline|multiplex|round_robin]",
                             options[i]);
                 error = true;
             }
@@ -374,6 +402,48 @@ createInstance(SERVICE *service, char **options)
         inst->bitmask |= (SERVER_RUNNING);
         inst->bitvalue |= SERVER_RUNNING;
     }
+
+    if (inst->round_robin)
+    {
+        /** The order is never longer than the sum of the weights */
+        for (i = 0; inst->servers[i]; i++)
+        {
+            inst->rr_max_slots += inst->servers[i]->weight;
+        }
+
+        inst->rr_n_cursors = config_threadcount() + 1;
+        inst->rr_generation = -1;
+        inst->rr_slots = calloc(inst->rr_max_slots + 1, sizeof(BACKEND *));
+        inst->rr_weights = calloc(n + 1, sizeof(int));
+        inst->rr_credit = calloc(n + 1, sizeof(int));
+        inst->rr_cursors = calloc(inst->rr_n_cursors, sizeof(unsigned int));
+
+        if (!inst->rr_slots || !inst->rr_weights || !inst->rr_credit || !inst->rr_cursors)
+        {
+            free_readconn_instance(inst);
+            return NULL;
+        }
+
+        /** The threads start from different positions */
+        for (i = 0; i < inst->rr_n_cursors; i++)
+        {
+            inst->rr_cursors[i] = i;
+        }
+    }
+
+    if (inst->multiplex)
+    {
+        for (i = 0; inst->servers[i]; i++)
+        {
+            if (inst->servers[i]->server->persistpoolmax == 0)
+            {
+                MXS_WARNING("Service '%s' multiplexes the connections but server '%s' "
+                            "has no persistent connection pool. The connections to "
+                            "it are closed and opened again between transactions.",
+                            service->name, inst->servers[i]->server->unique_name);
+            }
+        }
+    }
     /*
      * We have completed the creation of the instance data, so now
      * insert this router instance into the linked list of routers
@@ -388,40 +458,17 @@ createInstance(SERVICE *service, char **options)
 }
 
 /**
- * Associate a new session with this instance of the router.
+ * Select the server with the fewest connections relative to its weight
  *
- * @param instance	The router instance data
- * @param session	The session itself
- * @return Session specific data for this session
+ * @param inst The router instance
+ * @return The server or NULL if no server can be used
  */
-static void *
-newSession(ROUTER *instance, SESSION *session)
+static BACKEND *
+select_least_connections(ROUTER_INSTANCE *inst)
 {
-    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
-    ROUTER_CLIENT_SES *client_rses;
     BACKEND *candidate = NULL;
+    BACKEND *master_host;
     int i;
-    BACKEND *master_host = NULL;
-
-    MXS_DEBUG("%lu [newSession] new router session with session "
-              "%p, and inst %p.",
-              pthread_self(),
-              session,
-              inst);
-
-
-    client_rses = (ROUTER_CLIENT_SES *) calloc(1, sizeof(ROUTER_CLIENT_SES));
-
-    if (client_rses == NULL)
-    {
-        return NULL;
-    }
-
-#if defined(SS_DEBUG)
-    client_rses->rses_chk_top = CHK_NUM_ROUTER_SES;
-    client_rses->rses_chk_tail = CHK_NUM_ROUTER_SES;
-#endif
-    client_rses->client_dcb = session->client_dcb;
 
     /**
      * Find the Master host from available servers
@@ -465,6 +512,18 @@ newSession(ROUTER *instance, SESSION *session)
             continue;
         }
 
+        /** A draining server gets no new sessions */
+        if (SERVER_IS_DRAINING(inst->servers[i]->server))
+        {
+            if (inst->servers[i] == master_host && (inst->bitvalue & SERVER_MASTER))
+            {
+                /** Relay servers must not be used instead of the root master */
+                candidate = NULL;
+                break;
+            }
+            continue;
+        }
+
         if (inst->servers[i]->weight == 0)
         {
             continue;
@@ -546,20 +605,205 @@ newSession(ROUTER *instance, SESSION *session)
      * With router_option=slave a master_host could be set, so route traffic there.
      * Otherwise, just clean up and return NULL
      */
-    if (!candidate)
+    if (!candidate && master_host && !SERVER_IS_DRAINING(master_host->server))
+    {
+        candidate = master_host;
+    }
+
+    return candidate;
+}
+
+/**
+ * Check whether a server can get new sessions. These are the rules of
+ * select_least_connections without the comparison of the connections.
+ *
+ * @param inst        The router instance
+ * @param backend     The server
+ * @param master_host The root master or NULL
+ * @return True if the server can get new sessions
+ */
+static bool
+rr_is_eligible(ROUTER_INSTANCE *inst, BACKEND *backend, BACKEND *master_host)
+{
+    SERVER *server = backend->server;
+
+    if (SERVER_IN_MAINT(server) || SERVER_IS_DRAINING(server) || backend->weight == 0 ||
+        !SERVER_IS_RUNNING(server) || (server->status & inst->bitmask & inst->bitvalue) == 0)
     {
-        if (master_host)
+        return false;
+    }
+
+    if (inst->bitvalue & SERVER_MASTER)
+    {
+        /** Relay servers must not be used instead of the root master */
+        return backend == master_host;
+    }
+
+    /** The root master can also be a slave of an external server */
+    return backend != master_host || (inst->bitvalue & SERVER_SLAVE) == 0;
+}
+
+/**
+ * Build the round-robin order of the servers that can get new sessions.
+ * Called with the instance lock held.
+ *
+ * The order is that of the smooth weighted round-robin: each server earns
+ * its weight in credit for each slot and the server with the most credit
+ * gets the slot and pays the total weight. The servers are interleaved
+ * instead of getting their share of the sessions in runs.
+ *
+ * @param inst       The router instance
+ * @param generation The server status generation the order is built for
+ */
+static void
+rr_rebuild(ROUTER_INSTANCE *inst, int generation)
+{
+    BACKEND *master_host = get_root_master(inst->servers);
+    int divisor = 0;
+    int total = 0;
+    int n_slots;
+    int i;
+
+    for (i = 0; inst->servers[i]; i++)
+    {
+        inst->rr_weights[i] = 0;
+        inst->rr_credit[i] = 0;
+
+        if (rr_is_eligible(inst, inst->servers[i], master_host))
         {
-            candidate = master_host;
+            int a = inst->servers[i]->weight;
+            int b = divisor;
+
+            while (b)
+            {
+                int r = a % b;
+                a = b;
+                b = r;
+            }
+
+            divisor = a;
+            inst->rr_weights[i] = inst->servers[i]->weight;
         }
-        else
+    }
+
+    /** Dividing by the common divisor keeps the order as short as possible */
+    for (i = 0; inst->servers[i]; i++)
+    {
+        inst->rr_weights[i] = divisor ? inst->rr_weights[i] / divisor : 0;
+        total += inst->rr_weights[i];
+    }
+
+    ss_dassert(total <= inst->rr_max_slots);
+
+    for (n_slots = 0; n_slots < total; n_slots++)
+    {
+        int best = -1;
+
+        for (i = 0; inst->servers[i]; i++)
         {
-            MXS_ERROR("Failed to create new routing session. "
-                      "Couldn't find eligible candidate server. Freeing "
-                      "allocated resources.");
-            free(client_rses);
-            return NULL;
+            if (inst->rr_weights[i])
+            {
+                inst->rr_credit[i] += inst->rr_weights[i];
+
+                if (best == -1 || inst->rr_credit[i] > inst->rr_credit[best])
+                {
+                    best = i;
+                }
+            }
         }
+
+        inst->rr_credit[best] -= total;
+        inst->rr_slots[n_slots] = inst->servers[best];
+    }
+
+    inst->rr_master = master_host;
+    inst->rr_n_slots = n_slots;
+    inst->rr_generation = generation;
+}
+
+/**
+ * Select the next server in the weighted round-robin order
+ *
+ * Each thread keeps its own position in the order, the selection takes no
+ * locks. The order is rebuilt when the status of a server has changed. A
+ * server whose status changes while the order is being used is checked
+ * before it is returned, it can not be selected before the order is rebuilt.
+ *
+ * @param inst The router instance
+ * @return The server or NULL if the order has no usable server
+ */
+static BACKEND *
+rr_select(ROUTER_INSTANCE *inst)
+{
+    int generation = server_status_generation();
+
+    if (generation != inst->rr_generation)
+    {
+        spinlock_acquire(&inst->lock);
+        if (generation != inst->rr_generation)
+        {
+            rr_rebuild(inst, generation);
+        }
+        spinlock_release(&inst->lock);
+    }
+
+    int n_slots = inst->rr_n_slots;
+
+    if (n_slots == 0)
+    {
+        return NULL;
+    }
+
+    /** The threads that do not poll share the first position */
+    unsigned int *cursor = &inst->rr_cursors[(poll_current_thread() + 1) % inst->rr_n_cursors];
+    BACKEND *backend = inst->rr_slots[(*cursor)++ % n_slots];
+
+    return backend && rr_is_eligible(inst, backend, inst->rr_master) ? backend : NULL;
+}
+
+/**
+ * Associate a new session with this instance of the router.
+ *
+ * @param instance	The router instance data
+ * @param session	The session itself
+ * @return Session specific data for this session
+ */
+static void *
+newSession(ROUTER *instance, SESSION *session)
+{
+    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
+    ROUTER_CLIENT_SES *client_rses;
+    BACKEND *candidate;
+
+    MXS_DEBUG("%lu [newSession] new router session with session "
+              "%p, and inst %p.",
+              pthread_self(),
+              session,
+              inst);
+
+
+    /** The router session lives as long as the session, it can be allocated from its arena */
+    client_rses = (ROUTER_CLIENT_SES *) session_arena_alloc(session, sizeof(ROUTER_CLIENT_SES));
+
+    if (client_rses == NULL)
+    {
+        return NULL;
+    }
+
+#if defined(SS_DEBUG)
+    client_rses->rses_chk_top = CHK_NUM_ROUTER_SES;
+    client_rses->rses_chk_tail = CHK_NUM_ROUTER_SES;
+#endif
+    client_rses->client_dcb = session->client_dcb;
+
+    candidate = inst->round_robin ? rr_select(inst) : NULL;
+
+    if (candidate == NULL && (candidate = select_least_connections(inst)) == NULL)
+    {
+        MXS_ERROR("Failed to create new routing session. "
+                  "Couldn't find eligible candidate server. Freeing "
+                  "allocated resources.");
+        return NULL;
     }
 
     client_rses->rses_capabilities = RCAP_TYPE_PACKET_INPUT;
@@ -586,7 +830,6 @@ newSession(ROUTER *instance, SESSION *session)
     if (client_rses->backend_dcb == NULL)
     {
         atomic_add(&candidate->current_connection_count, -1);
-        free(client_rses);
         return NULL;
     }
     dcb_add_callback(
@@ -663,6 +906,9 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
     }
     spinlock_release(&router->lock);
 
+    gwbuf_free(router_cli_ses->partial);
+    gwbuf_free(router_cli_ses->history);
+
     MXS_DEBUG("%lu [freeSession] Unlinked router_client_session %p from "
               "router %p and from server on port %d. Connections : %d. ",
               pthread_self(),
@@ -670,8 +916,6 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
               router,
               router_cli_ses->backend->server->port,
               prev_val - 1);
-
-    free(router_cli_ses);
 }
 
 /**
@@ -753,6 +997,13 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
         backend_dcb = router_cli_ses->backend_dcb;
         /** unlock */
         rses_end_locked_router_action(router_cli_ses);
+
+        if (backend_dcb == NULL && inst->multiplex &&
+            !SERVER_IS_DOWN(router_cli_ses->backend->server))
+        {
+            /** The connection was returned to the pool after the last transaction */
+            backend_dcb = rcon_attach_backend(inst, router_cli_ses);
+        }
     }
 
     if (rses_is_closed || backend_dcb == NULL ||
@@ -770,7 +1021,49 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
 
     }
 
+    if (inst->pipeline || inst->multiplex)
+    {
+        /**
+         * Only complete packets are forwarded, all in one write. The incomplete
+         * packet at the end is held back until the rest of it is read.
+         */
+        GWBUF *packets;
+
+        queue = gwbuf_append(router_cli_ses->partial, queue);
+        packets = modutil_get_complete_packets(&queue);
+        router_cli_ses->partial = queue;
+
+        if (packets == NULL)
+        {
+            return 1;
+        }
+
+        queue = packets;
+
+        uint8_t cmd;
+
+        if (gwbuf_copy_data(queue, MYSQL_HEADER_LEN, 1, &cmd) == 1)
+        {
+            mysql_command = cmd;
+        }
+    }
+
+    if (inst->multiplex)
+    {
+        /** The connection is not released before the replies have been read */
+        int n_replies = rcon_track_commands(router_cli_ses, queue);
+
+        if (rses_begin_locked_router_action(router_cli_ses))
+        {
+            router_cli_ses->n_replies += n_replies;
+            rses_end_locked_router_action(router_cli_ses);
+        }
+    }
+
     char* trc = NULL;
+    SESSION *session = backend_dcb->session;
+
+    trace_stage(&session->trace, session->ses_id, TRACE_ROUTE);
 
     switch (mysql_command)
     {
@@ -784,10 +1077,23 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
                 trc = modutil_get_SQL(queue);
             }
         default:
+            trace_stage(&session->trace, session->ses_id, TRACE_WRITE);
             rc = backend_dcb->func.write(backend_dcb, queue);
             break;
     }
 
+    trace_stage(&session->trace, session->ses_id, TRACE_BACKEND);
+
+    /** The latency is measured from the oldest query that has no reply yet.
+     * The commands without a reply are not measured. */
+    if (rc == 1 && mysql_command != MYSQL_COM_QUIT &&
+        mysql_command != MYSQL_COM_STMT_CLOSE &&
+        mysql_command != MYSQL_COM_STMT_SEND_LONG_DATA &&
+        atomic_load_int64(&router_cli_ses->query_start) == 0)
+    {
+        atomic_store_int64(&router_cli_ses->query_start, ts_clock_us());
+    }
+
     MXS_INFO("Routed [%s] to '%s'%s%s",
              STRPACKETTYPE(mysql_command),
              backend_dcb->server->unique_name,
@@ -829,6 +1135,17 @@ diagnostics(ROUTER *router, DCB *dcb)
     dcb_printf(dcb, "\tCurrent no. of router sessions:	%d\n", i);
     dcb_printf(dcb, "\tNumber of queries forwarded:   	%d\n",
                router_inst->stats.n_queries);
+    if (router_inst->multiplex)
+    {
+        dcb_printf(dcb, "\tConnections returned to pool:	%d\n",
+                   router_inst->stats.n_detached);
+        dcb_printf(dcb, "\tConnections taken from pool:	%d\n",
+                   router_inst->stats.n_attached);
+    }
+    if (router_inst->round_robin)
+    {
+        dcb_printf(dcb, "\tServer selection:              	weighted round-robin\n");
+    }
     if ((weightby = serviceGetWeightingParameter(router_inst->service))
         != NULL)
     {
@@ -862,8 +1179,50 @@ diagnostics(ROUTER *router, DCB *dcb)
 static void
 clientReply(ROUTER *instance, void *router_session, GWBUF *queue, DCB *backend_dcb)
 {
+    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
+    ROUTER_CLIENT_SES *router_cli_ses = (ROUTER_CLIENT_SES *) router_session;
+    int64_t start = atomic_load_int64(&router_cli_ses->query_start);
+    DCB *detached = NULL;
+
+    if (inst->multiplex && rses_begin_locked_router_action(router_cli_ses))
+    {
+        /**
+         * A connection that has no replies left to read outside of a
+         * transaction is returned to the pool
+         */
+        if (router_cli_ses->backend_dcb == backend_dcb)
+        {
+            rcon_track_replies(router_cli_ses, backend_dcb);
+
+            if (router_cli_ses->n_replies == 0 && !router_cli_ses->in_trx &&
+                !router_cli_ses->pinned && router_cli_ses->partial == NULL &&
+                MYSQL_REPLY_IS_COMPLETE(&((MySQLProtocol *)backend_dcb->protocol)->reply))
+            {
+                detached = backend_dcb;
+                router_cli_ses->backend_dcb = NULL;
+            }
+        }
+        rses_end_locked_router_action(router_cli_ses);
+    }
+
+    if (start)
+    {
+        atomic_store_int64(&router_cli_ses->query_start, 0);
+        service_record_latency(backend_dcb->session->service, backend_dcb->server,
+                               ts_clock_us() - start);
+    }
+
     ss_dassert(backend_dcb->session->client_dcb != NULL);
+    trace_stage(&backend_dcb->session->trace, backend_dcb->session->ses_id, TRACE_REPLY);
     SESSION_ROUTE_REPLY(backend_dcb->session, queue);
+    trace_end(&backend_dcb->session->trace, backend_dcb->session->ses_id);
+
+    if (detached)
+    {
+        /** The DCB goes to the persistent pool of the server when it is closed */
+        atomic_add(&inst->stats.n_detached, 1);
+        dcb_close(detached);
+    }
 }
 
 /**
@@ -899,6 +1258,16 @@ static void handleError(ROUTER *instance, void *router_session, GWBUF *errbuf,
     {
         problem_dcb->dcb_errhandle_called = true;
     }
+
+    if (router_cli_ses && ((ROUTER_INSTANCE *) instance)->multiplex &&
+        DCB_ROLE_BACKEND_HANDLER == problem_dcb->dcb_role &&
+        problem_dcb != router_cli_ses->backend_dcb)
+    {
+        /** A connection that was released, the session goes on with another one */
+        *succp = true;
+        return;
+    }
+
     spinlock_acquire(&session->ses_lock);
     sesstate = session->state;
     client_dcb = session->client_dcb;
@@ -988,9 +1357,13 @@ static void rses_end_locked_router_action(ROUTER_CLIENT_SES* rses)
     spinlock_release(&rses->rses_lock);
 }
 
-static int getCapabilities()
+static int getCapabilities(ROUTER *instance, void *router_session)
 {
-    return RCAP_TYPE_PACKET_INPUT;
+    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
+
+    /** The replies are followed as complete packets when multiplexing */
+    return RCAP_TYPE_PACKET_INPUT |
+           (inst->pipeline && !inst->multiplex ? RCAP_TYPE_STREAM_OUTPUT : 0);
 }
 
 /********************************
@@ -1079,3 +1452,252 @@ static int handle_state_switch(DCB* dcb, DCB_REASON reason, void * routersession
 
     return 0;
 }
+
+/**
+ * Add a command to the history of a session. If the history is full, the
+ * session is pinned to its backend connection instead.
+ *
+ * @param rses   The router session
+ * @param packet The command, the history takes the buffer
+ */
+static void rcon_add_history(ROUTER_CLIENT_SES *rses, GWBUF *packet)
+{
+    if (rses->n_history < RCON_MAX_HISTORY)
+    {
+        rses->history = gwbuf_append(rses->history, packet);
+        rses->n_history++;
+    }
+    else
+    {
+        MXS_INFO("The session command history is full, the session keeps "
+                 "its backend connection.");
+        rses->pinned = true;
+        gwbuf_free(packet);
+    }
+}
+
+/**
+ * Copy a packet from a buffer chain into a buffer of its own
+ *
+ * @param view The packet
+ * @return The packet or NULL if memory could not be allocated
+ */
+static GWBUF *rcon_copy_packet(MODUTIL_PACKET *view)
+{
+    GWBUF *packet = gwbuf_alloc(view->length);
+
+    if (packet)
+    {
+        modutil_packet_copy(view, 0, view->length, GWBUF_DATA(packet));
+    }
+
+    return packet;
+}
+
+/**
+ * Check how a query changes the state of the session. A statement that only
+ * sets session or user variables is added to the history, one that creates
+ * state that can not be restored by replaying it pins the session to its
+ * backend connection.
+ *
+ * @param rses   The router session
+ * @param packet The COM_QUERY packet
+ */
+static void rcon_track_query(ROUTER_CLIENT_SES *rses, GWBUF *packet)
+{
+    uint32_t type = qc_get_type(packet);
+    char *sql = modutil_get_SQL(packet);
+    bool session_state = QUERY_IS_TYPE(type, QUERY_TYPE_SESSION_WRITE) ||
+                         QUERY_IS_TYPE(type, QUERY_TYPE_USERVAR_WRITE) ||
+                         QUERY_IS_TYPE(type, QUERY_TYPE_ENABLE_AUTOCOMMIT) ||
+                         QUERY_IS_TYPE(type, QUERY_TYPE_DISABLE_AUTOCOMMIT);
+
+    if (QUERY_IS_TYPE(type, QUERY_TYPE_PREPARE_NAMED_STMT) ||
+        QUERY_IS_TYPE(type, QUERY_TYPE_PREPARE_STMT) ||
+        QUERY_IS_TYPE(type, QUERY_TYPE_CREATE_TMP_TABLE) ||
+        (session_state && QUERY_IS_TYPE(type, QUERY_TYPE_WRITE)) ||
+        (sql && strcasestr(sql, "LOCK")))
+    {
+        /** Prepared statements, temporary tables, locks and statements that
+         * would modify data if they were replayed */
+        rses->pinned = true;
+        gwbuf_free(packet);
+    }
+    else if (session_state)
+    {
+        rcon_add_history(rses, packet);
+    }
+    else
+    {
+        gwbuf_free(packet);
+    }
+
+    free(sql);
+}
+
+/**
+ * Follow the commands routed to the server when the connections are
+ * multiplexed.
+ *
+ * @param rses  The router session
+ * @param queue Complete packets from the client
+ * @return The number of replies that the server sends to the commands
+ */
+static int rcon_track_commands(ROUTER_CLIENT_SES *rses, GWBUF *queue)
+{
+    MODUTIL_PACKET_ITER iter;
+    MODUTIL_PACKET view;
+    int n_replies = 0;
+
+    modutil_packet_iter_init(&iter, queue);
+
+    while (modutil_packet_next(&iter, &view))
+    {
+        uint8_t command;
+
+        /** Only the first packet of a command has sequence number 0 */
+        if (view.seqno == 0 && !rses->pinned &&
+            modutil_packet_copy(&view, MYSQL_HEADER_LEN, 1, &command) == 1)
+        {
+            GWBUF *packet;
+
+            switch (command)
+            {
+                case MYSQL_COM_QUIT:
+                    break;
+
+                case MYSQL_COM_PING:
+                    n_replies++;
+                    break;
+
+                case MYSQL_COM_INIT_DB:
+                    if ((packet = rcon_copy_packet(&view)))
+                    {
+                        rcon_add_history(rses, packet);
+                    }
+                    else
+                    {
+                        rses->pinned = true;
+                    }
+                    n_replies++;
+                    break;
+
+                case MYSQL_COM_QUERY:
+                    if ((packet = rcon_copy_packet(&view)))
+                    {
+                        rcon_track_query(rses, packet);
+                    }
+                    else
+                    {
+                        rses->pinned = true;
+                    }
+                    n_replies++;
+                    break;
+
+                default:
+                    /** Prepared statements, COM_CHANGE_USER and the other
+                     * commands leave state in the connection or have replies
+                     * that are not followed */
+                    rses->pinned = true;
+                    break;
+            }
+        }
+    }
+
+    return n_replies;
+}
+
+/**
+ * Follow the replies of the server when the connections are multiplexed. The
+ * replies are counted and the transaction state taken from the status of the
+ * last OK or EOF packet by the reply tracker of the backend connection. The
+ * caller must hold the lock of the router session.
+ *
+ * @param rses    The router session
+ * @param backend The backend DCB that the replies were read from
+ */
+static void rcon_track_replies(ROUTER_CLIENT_SES *rses, DCB *backend)
+{
+    MYSQL_REPLY_TRACKER *reply = &((MySQLProtocol *)backend->protocol)->reply;
+    uint64_t n = reply->n_replies - rses->n_seen;
+
+    rses->n_seen = reply->n_replies;
+    rses->n_replies = n < rses->n_replies ? rses->n_replies - n : 0;
+    rses->in_trx = (reply->status & SERVER_STATUS_IN_TRANS) ||
+                   !(reply->status & SERVER_STATUS_AUTOCOMMIT);
+}
+
+/**
+ * Take a backend connection for a session whose connection was released. A
+ * connection from the persistent pool of the server is reset to the user and
+ * database of the client with a COM_CHANGE_USER. The history of the session
+ * is then replayed, the client does not get the replies to these commands.
+ *
+ * @param inst The router instance
+ * @param rses The router session
+ * @return The backend DCB or NULL on error
+ */
+static DCB *rcon_attach_backend(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses)
+{
+    SESSION *session = rses->client_dcb->session;
+    SERVER *server = rses->backend->server;
+    DCB *dcb = dcb_connect(server, session, server->protocol);
+
+    if (dcb == NULL)
+    {
+        MXS_ERROR("Failed to connect to server '%s' for a multiplexed session.",
+                  server->unique_name);
+        return NULL;
+    }
+
+    dcb_add_callback(dcb, DCB_REASON_NOT_RESPONDING, &handle_state_switch, rses);
+
+    GWBUF *replay = NULL;
+    int n_replay = 0;
+
+    if (((MySQLProtocol *)dcb->protocol)->protocol_auth_state == MYSQL_IDLE)
+    {
+        /** A pooled connection, the backend protocol fills in the credentials */
+        GWBUF *change_user = gwbuf_alloc(MYSQL_HEADER_LEN + 1);
+
+        if (change_user)
+        {
+            uint8_t *ptr = GWBUF_DATA(change_user);
+            gw_mysql_set_byte3(ptr, 1);
+            ptr[3] = 0;
+            ptr[MYSQL_HEADER_LEN] = MYSQL_COM_CHANGE_USER;
+            replay = change_user;
+            n_replay++;
+        }
+        atomic_add(&inst->stats.n_attached, 1);
+    }
+
+    for (GWBUF *buf = rses->history; buf; buf = buf->next)
+    {
+        replay = gwbuf_append(replay, gwbuf_clone(buf));
+        n_replay++;
+    }
+
+    if (!rses_begin_locked_router_action(rses))
+    {
+        gwbuf_free(replay);
+        dcb_close(dcb);
+        return NULL;
+    }
+
+    /** The backend protocol drops the replies to the replayed commands */
+    MYSQL_REPLY_TRACKER *reply = &((MySQLProtocol *)dcb->protocol)->reply;
+    reply->n_discard += n_replay;
+
+    rses->backend_dcb = dcb;
+    rses->n_seen = reply->n_replies;
+    rses->in_trx = false;
+    rses_end_locked_router_action(rses);
+
+    if (replay && dcb->func.write(dcb, replay) != 1)
+    {
+        return NULL;
+    }
+
+    return dcb;
+}
@@ -12,6 +12,7 @@
  */
 #include <my_config.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <strings.h>
 #include <string.h>
 #include <stdlib.h>
@@ -30,6 +31,10 @@
 #include <modutil.h>
 #include <mysql_client_server_protocol.h>
 #include <mysqld_error.h>
+#include <random_jkiss.h>
+#include <maxscale/poll.h>
+#include <memusage.h>
+#include <utils.h>
 
 MODULE_INFO info =
 {
@@ -43,6 +48,12 @@ MODULE_INFO info =
 
 #define RWSPLIT_TRACE_MSG_LEN 1000
 
+/** The value of rses_causal_sample while the master has not replied to a write */
+#define RSES_CAUSAL_WRITE_PENDING ULONG_MAX
+
+/** Whether the calling thread may modify the router session */
+#define RSES_IS_LOCKED(r) ((r)->rses_lockfree || SPINLOCK_IS_LOCKED(&(r)->rses_lock))
+
 /**
  * @file readwritesplit.c   The entry points for the read/write query splitting
  * router module.
@@ -136,6 +147,14 @@ int bref_cmp_behind_master(const void *bref1, const void *bref2);
 
 int bref_cmp_current_load(const void *bref1, const void *bref2);
 
+int bref_cmp_response_time(const void *bref1, const void *bref2);
+
+int bref_cmp_server_load(const void *bref1, const void *bref2);
+
+static void bref_start_response_timer(backend_ref_t *bref);
+static void bref_stop_response_timer(backend_ref_t *bref);
+static double bref_response_time_weight(backend_ref_t *bref);
+
 /**
  * The order of functions _must_ match with the order the select criteria are
  * listed in select_criteria_t definition in readwritesplit.h
@@ -146,7 +165,9 @@ int (*criteria_cmpfun[LAST_CRITERIA])(const void *, const void *) =
     bref_cmp_global_conn,
     bref_cmp_router_conn,
     bref_cmp_behind_master,
-    bref_cmp_current_load
+    bref_cmp_current_load,
+    bref_cmp_response_time,
+    bref_cmp_server_load
 };
 
 static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
@@ -158,6 +179,27 @@ static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
                                            ROUTER_INSTANCE *router,
                                            bool new_session);
 
+static void rses_causal_write(ROUTER_CLIENT_SES *rses);
+static void rses_causal_write_done(ROUTER_CLIENT_SES *rses);
+static bool rses_causal_read_ok(ROUTER_CLIENT_SES *rses, SERVER *server);
+static bool bref_sescmd_busy(ROUTER_CLIENT_SES *rses, backend_ref_t *bref);
+static bool rses_ro_trx_target(ROUTER_CLIENT_SES *rses, GWBUF *querybuf, qc_query_type_t qtype,
+                               bool trx_was_active, route_target_t *target);
+static backend_ref_t *rses_write_affinity_target(ROUTER_CLIENT_SES *rses, GWBUF *querybuf,
+                                                 qc_query_type_t qtype);
+static void rses_hedge_reply(ROUTER_CLIENT_SES *rses, backend_ref_t *bref);
+static void rses_hedge_drain(ROUTER_CLIENT_SES *rses, backend_ref_t *bref);
+static bool rses_hedge_failed(ROUTER_CLIENT_SES *rses, backend_ref_t *bref);
+static void rses_lazy_connect(ROUTER_CLIENT_SES *rses);
+static void rwsplit_free_rules(ROUTER_INSTANCE *router);
+static void rses_trx_log_reset(ROUTER_CLIENT_SES *rses);
+static bool rses_replay_start(ROUTER_CLIENT_SES *rses);
+static void rses_replay_arm(ROUTER_CLIENT_SES *rses);
+static void rses_replay_timeout(void *data);
+static bool bref_valid_for_connect(const backend_ref_t *bref);
+static bool rses_replay_hold(ROUTER_CLIENT_SES *rses, GWBUF *querybuf);
+bool connect_server(backend_ref_t *bref, SESSION *session, bool execute_history);
+
 static bool get_dcb(DCB **dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
                     char *name, int max_rlag);
 
@@ -183,8 +225,16 @@ static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES *rses);
 
 static void rses_end_locked_router_action(ROUTER_CLIENT_SES *rses);
 
+static bool rses_can_be_lockfree(ROUTER_CLIENT_SES *rses);
+
 static void mysql_sescmd_done(mysql_sescmd_t *sescmd);
 
+static char *sescmd_get_key(GWBUF *buf, unsigned char packet_type);
+
+static void rses_compact_sescmd_history(ROUTER_CLIENT_SES *rses, mysql_sescmd_t *sescmd);
+
+static int rses_sescmd_history_len(ROUTER_CLIENT_SES *rses);
+
 static mysql_sescmd_t *mysql_sescmd_init(rses_property_t *rses_prop,
                                          GWBUF *sescmd_buf,
                                          unsigned char packet_type,
@@ -246,6 +296,8 @@ static void handle_error_reply_client(SESSION *ses, ROUTER_CLIENT_SES *rses,
 static backend_ref_t *get_root_master_bref(ROUTER_CLIENT_SES *rses);
 
 static BACKEND *get_root_master(backend_ref_t *servers, int router_nservers);
+static BACKEND *get_cached_root_master(ROUTER_INSTANCE *router, backend_ref_t *servers,
+                                       int router_nservers);
 
 static bool have_enough_servers(ROUTER_CLIENT_SES **rses, const int nsrv,
                                 int router_nsrv, ROUTER_INSTANCE *router);
@@ -253,48 +305,18 @@ static bool have_enough_servers(ROUTER_CLIENT_SES **rses, const int nsrv,
 static SPINLOCK instlock;
 static ROUTER_INSTANCE *instances;
 
-static int hashkeyfun(void *key);
-static int hashcmpfun(void *, void *);
+/** The session command packets shared by the sessions of all instances */
+static struct
+{
+    SPINLOCK         lock;
+    sescmd_shared_t *entries;
+} sescmd_shared[SESCMD_SHARED_BUCKETS];
+static int sescmd_n_shared = 0;
+
 static bool check_for_multi_stmt(ROUTER_CLIENT_SES *rses, GWBUF *buf,
                                  mysql_server_cmd_t packet_type);
 static bool send_readonly_error(DCB *dcb);
-
-static int hashkeyfun(void *key)
-{
-    if (key == NULL)
-    {
-        return 0;
-    }
-
-    unsigned int hash = 0, c = 0;
-    char *ptr = (char *)key;
-
-    while ((c = *ptr++))
-    {
-        hash = c + (hash << 6) + (hash << 16) - hash;
-    }
-    return hash;
-}
-
-static int hashcmpfun(void *v1, void *v2)
-{
-    char *i1 = (char *)v1;
-    char *i2 = (char *)v2;
-
-    return strcmp(i1, i2);
-}
-
-static void *hstrdup(void *fval)
-{
-    char *str = (char *)fval;
-    return strdup(str);
-}
-
-static void *hfree(void *fval)
-{
-    free(fval);
-    return NULL;
-}
+static void *ps_free(void *fval);
 
 /**
  * Implementation of the mandatory version entry point
@@ -315,6 +337,11 @@ void ModuleInit()
     MXS_NOTICE("Initializing statemend-based read/write split router module.");
     spinlock_init(&instlock);
     instances = NULL;
+
+    for (int i = 0; i < SESCMD_SHARED_BUCKETS; i++)
+    {
+        spinlock_init(&sescmd_shared[i].lock);
+    }
 }
 
 /**
@@ -484,6 +511,7 @@ static inline void free_rwsplit_instance(ROUTER_INSTANCE *router)
             }
         }
         free(router->servers);
+        rwsplit_free_rules(router);
         free(router);
     }
 }
@@ -511,6 +539,7 @@ static ROUTER *createInstance(SERVICE *service, char **options)
     }
     router->service = service;
     spinlock_init(&router->lock);
+    router->root_master_generation = -1;
 
     /** Calculate number of servers */
     sref = service->dbref;
@@ -640,6 +669,13 @@ static ROUTER *createInstance(SERVICE *service, char **options)
     /** Enable strict multistatement handling by default */
     router->rwsplit_config.rw_strict_multi_stmt = true;
 
+    /** Remove superseded session commands from the history by default */
+    router->rwsplit_config.rw_compact_sescmd_hist = true;
+
+    router->rwsplit_config.rw_causal_reads_timeout = CONFIG_CAUSAL_READS_TIMEOUT;
+    router->rwsplit_config.rw_trx_replay_max_size = CONFIG_TRX_REPLAY_MAX_SIZE;
+    router->rwsplit_config.rw_trx_replay_timeout = CONFIG_TRX_REPLAY_TIMEOUT;
+
     /** By default, the client connection is closed immediately when a master
      * failure is detected */
     router->rwsplit_config.rw_master_failure_mode = RW_FAIL_INSTANTLY;
@@ -736,7 +772,9 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
     int i;
     const int min_nservers = 1; /*< hard-coded for now */
 
-    client_rses = (ROUTER_CLIENT_SES *)calloc(1, sizeof(ROUTER_CLIENT_SES));
+    /** The router session and the backend references live as long as the
+     * session, they are allocated from its arena */
+    client_rses = (ROUTER_CLIENT_SES *)session_arena_alloc(session, sizeof(ROUTER_CLIENT_SES));
 
     if (client_rses == NULL)
     {
@@ -774,7 +812,9 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
      */
     client_rses->rses_autocommit_enabled = true;
     client_rses->rses_transaction_active = false;
-    client_rses->have_tmp_tables = false;
+    client_rses->rses_tmp_tables = NULL;
+    client_rses->rses_n_tmp_tables = 0;
+    client_rses->rses_tmp_tables_size = 0;
     client_rses->forced_node = NULL;
 
     router_nservers = router_get_servercount(router);
@@ -786,13 +826,10 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
     /**
      * Create backend reference objects for this session.
      */
-    backend_ref = (backend_ref_t *)calloc(1, router_nservers * sizeof(backend_ref_t));
+    backend_ref = (backend_ref_t *)session_arena_alloc(session, router_nservers * sizeof(backend_ref_t));
 
     if (backend_ref == NULL)
     {
-        /** log this */
-        free(client_rses);
-        free(backend_ref);
         client_rses = NULL;
         goto return_rses;
     }
@@ -832,16 +869,28 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
 
     if (!succp)
     {
-        free(client_rses->rses_backend_ref);
-        free(client_rses);
         client_rses = NULL;
         goto return_rses;
     }
+    /** A lazy session connects only to the master, or to one slave if there is none */
+    client_rses->rses_lazy_slaves = client_rses->rses_config.rw_lazy_slaves &&
+                                    !client_rses->rses_config.rw_disable_sescmd_hist &&
+                                    max_nslaves > 0;
+
     succp = select_connect_backend_servers(&master_ref, backend_ref, router_nservers,
-                                           max_nslaves, max_slave_rlag,
+                                           client_rses->rses_lazy_slaves ? 0 : max_nslaves,
+                                           max_slave_rlag,
                                            client_rses->rses_config.rw_slave_select_criteria,
                                            session, router, false);
 
+    if (succp && client_rses->rses_lazy_slaves && master_ref == NULL)
+    {
+        succp = select_connect_backend_servers(&master_ref, backend_ref, router_nservers,
+                                               1, max_slave_rlag,
+                                               client_rses->rses_config.rw_slave_select_criteria,
+                                               session, router, false);
+    }
+
     rses_end_locked_router_action(client_rses);
 
     /**
@@ -851,8 +900,6 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
      */
     if (!succp)
     {
-        free(client_rses->rses_backend_ref);
-        free(client_rses);
         client_rses = NULL;
         goto return_rses;
     }
@@ -861,6 +908,7 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
     client_rses->rses_master_ref = master_ref;
     client_rses->rses_backend_ref = backend_ref;
     client_rses->rses_nbackends = router_nservers; /*< # of backend servers */
+    client_rses->rses_lockfree = rses_can_be_lockfree(client_rses);
 
     if (client_rses->rses_config.rw_max_slave_conn_percent)
     {
@@ -1049,13 +1097,32 @@ static void freeSession(ROUTER *router_instance, void *router_client_session)
             p = q;
         }
     }
+
+    if (router_cli_ses->rses_ps)
+    {
+        hashtable_free(router_cli_ses->rses_ps);
+    }
+
+    gwbuf_free(router_cli_ses->rses_multi_stmt);
+    free(router_cli_ses->rses_tmp_tables);
+    timer_cancel(&router_cli_ses->rses_hedge_timer);
+    gwbuf_free(router_cli_ses->rses_hedge_query);
+    timer_cancel(&router_cli_ses->rses_replay_timer);
+    rses_trx_log_reset(router_cli_ses);
+    free(router_cli_ses->rses_trx_log);
+    gwbuf_free(router_cli_ses->rses_replay_queue);
+
+    for (i = 0; i < router_cli_ses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &router_cli_ses->rses_backend_ref[i];
+        ps_free(bref->bref_ps_new);
+        gwbuf_free(bref->bref_ps_exec);
+    }
     /*
-     * We are no longer in the linked list, free
-     * all the memory and other resources associated
-     * to the client session.
+     * We are no longer in the linked list. The client session and the
+     * backend references are in the arena of the session and are freed
+     * with it.
      */
-    free(router_cli_ses->rses_backend_ref);
-    free(router_cli_ses);
     return;
 }
 
@@ -1073,6 +1140,7 @@ static void close_failed_bref(backend_ref_t *bref, bool fatal)
     }
 
     bref_clear_state(bref, BREF_QUERY_ACTIVE);
+    bref_clear_state(bref, BREF_DISCARD_REPLY);
     bref_clear_state(bref, BREF_IN_USE);
     bref_set_state(bref, BREF_CLOSED);
 
@@ -1091,6 +1159,46 @@ static void close_failed_bref(backend_ref_t *bref, bool fatal)
         gwbuf_free(bref->bref_pending_cmd);
         bref->bref_pending_cmd = NULL;
     }
+
+    ps_free(bref->bref_ps_new);
+    bref->bref_ps_new = NULL;
+    gwbuf_free(bref->bref_ps_exec);
+    bref->bref_ps_exec = NULL;
+}
+
+/**
+ * @brief Close the connections to draining slaves
+ *
+ * Called between transactions. The connections that are idle are closed so
+ * that the session moves away from the draining servers. The session continues
+ * with the remaining servers, the reads that would have gone to the closed
+ * slaves are routed to the other slaves or to the master.
+ *
+ * This must be called with router lock.
+ *
+ * @param rses Router client session
+ */
+static void rses_release_draining_slaves(ROUTER_CLIENT_SES *rses)
+{
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER *server = bref->bref_backend->backend_server;
+
+        if (BREF_IS_IN_USE(bref) && bref != rses->rses_master_ref &&
+            SERVER_IS_DRAINING(server) && !BREF_IS_WAITING_RESULT(bref) &&
+            !sescmd_cursor_is_active(&bref->bref_sescmd_cur) &&
+            bref->bref_pending_cmd == NULL)
+        {
+            MXS_INFO("Server %s:%d is draining, closing the session's connection to it.",
+                     server->name, server->port);
+            close_failed_bref(bref, false);
+            atomic_add(&bref->bref_backend->backend_conn_count, -1);
+            RW_CHK_DCB(bref, bref->bref_dcb);
+            dcb_close(bref->bref_dcb);
+            RW_CLOSE_BREF(bref);
+        }
+    }
 }
 
 /**
@@ -1168,6 +1276,9 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
     if (btype == BE_SLAVE)
     {
         backend_ref_t *candidate_bref = NULL;
+        backend_ref_t *busy_bref = NULL; /*< First slave skipped as busy with session commands */
+        backend_ref_t *draining_bref = NULL; /*< First slave skipped as draining */
+        double total_weight = 0; /*< Sum of the weights of the slaves seen, for LEAST_RESPONSE_TIME */
 
         for (i = 0; i < rses->rses_nbackends; i++)
         {
@@ -1184,6 +1295,34 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
             {
                 continue;
             }
+            /**
+             * A slave that is still executing session commands or draining
+             * the reply to a hedged read would queue the query until it
+             * has caught up.
+             */
+            else if (&backend_ref[i] != master_bref &&
+                     (bref_sescmd_busy(rses, &backend_ref[i]) || BREF_IS_DISCARDING(&backend_ref[i])))
+            {
+                MXS_INFO("Server %s:%d is still executing session commands "
+                         "and can't be chosen.", b->backend_server->name,
+                         b->backend_server->port);
+
+                if (busy_bref == NULL)
+                {
+                    busy_bref = &backend_ref[i];
+                }
+            }
+            /**
+             * Reads are moved away from a draining slave. It is used only
+             * if no other server can be chosen.
+             */
+            else if (&backend_ref[i] != master_bref && SERVER_IS_DRAINING(b->backend_server))
+            {
+                if (draining_bref == NULL)
+                {
+                    draining_bref = &backend_ref[i];
+                }
+            }
             /**
              * If there are no candidates yet accept both master or
              * slave.
@@ -1206,9 +1345,10 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
                  * or that candidate's lag doesn't exceed the
                  * maximum allowed replication lag.
                  */
-                else if (max_rlag == MAX_RLAG_UNDEFINED ||
-                         (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                          b->backend_server->rlag <= max_rlag))
+                else if ((max_rlag == MAX_RLAG_UNDEFINED ||
+                          (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
+                           b->backend_server->rlag <= max_rlag)) &&
+                         rses_causal_read_ok(rses, b->backend_server))
                 {
                     /** found slave */
                     candidate_bref = &backend_ref[i];
@@ -1224,7 +1364,8 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
                      (max_rlag == MAX_RLAG_UNDEFINED ||
                       (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
                        b->backend_server->rlag <= max_rlag)) &&
-                     !rses->rses_config.rw_master_reads)
+                     !rses->rses_config.rw_master_reads &&
+                     rses_causal_read_ok(rses, b->backend_server))
             {
                 /** found slave */
                 candidate_bref = &backend_ref[i];
@@ -1238,13 +1379,42 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
              */
             else if (SERVER_IS_SLAVE(&server))
             {
-                if (max_rlag == MAX_RLAG_UNDEFINED ||
-                    (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                     b->backend_server->rlag <= max_rlag))
+                if (!rses_causal_read_ok(rses, b->backend_server))
+                {
+                    MXS_INFO("Server %s:%d has not yet replicated the last write "
+                             "of the session and can't be chosen.",
+                             b->backend_server->name, b->backend_server->port);
+                }
+                else if (max_rlag == MAX_RLAG_UNDEFINED ||
+                         (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
+                          b->backend_server->rlag <= max_rlag))
                 {
-                    candidate_bref =
-                        check_candidate_bref(candidate_bref, &backend_ref[i],
-                                             rses->rses_config.rw_slave_select_criteria);
+                    if (rses->rses_config.rw_slave_select_criteria == LEAST_RESPONSE_TIME)
+                    {
+                        /**
+                         * Each server replaces the candidate with a probability
+                         * proportional to its weight, which gives every server
+                         * a chance of being chosen in proportion to its weight.
+                         */
+                        double weight = bref_response_time_weight(&backend_ref[i]);
+
+                        if (total_weight == 0)
+                        {
+                            total_weight = bref_response_time_weight(candidate_bref);
+                        }
+                        total_weight += weight;
+
+                        if (random_jkiss() / ((double)UINT_MAX + 1) * total_weight < weight)
+                        {
+                            candidate_bref = &backend_ref[i];
+                        }
+                    }
+                    else
+                    {
+                        candidate_bref =
+                            check_candidate_bref(candidate_bref, &backend_ref[i],
+                                                 rses->rses_config.rw_slave_select_criteria);
+                    }
                     candidate.status =
                         candidate_bref->bref_backend->backend_server->status;
                 }
@@ -1257,6 +1427,23 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
                 }
             }
         } /*<  for */
+
+        /**
+         * If all servers are busy executing session commands, the query
+         * waits in a slave until the session commands are done.
+         */
+        if (candidate_bref == NULL && busy_bref != NULL)
+        {
+            candidate_bref = busy_bref;
+            succp = true;
+        }
+
+        if (candidate_bref == NULL && draining_bref != NULL)
+        {
+            candidate_bref = draining_bref;
+            succp = true;
+        }
+
         /** Assign selected DCB's pointer value */
         if (candidate_bref != NULL)
         {
@@ -1302,6 +1489,129 @@ return_succp:
     return succp;
 }
 
+/**
+ * Check whether a backend is busy executing session commands that the other
+ * backends have already replied to.
+ *
+ * @param rses Router client session
+ * @param bref Backend reference
+ *
+ * @return True if asynchronous session commands are enabled and the backend
+ * has session commands left to execute
+ */
+static bool bref_sescmd_busy(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    return rses->rses_config.rw_async_sescmd &&
+           sescmd_cursor_is_active(&bref->bref_sescmd_cur);
+}
+
+/**
+ * Connect a lazy session to its slaves. The session command history is
+ * replayed on the new connections before they are used, a read that arrives
+ * while they are being prepared is routed like a read during the recovery
+ * of a failed slave. Called with the router session lock held.
+ *
+ * @param rses Router client session
+ */
+static void rses_lazy_connect(ROUTER_CLIENT_SES *rses)
+{
+    rses->rses_lazy_slaves = false;
+
+    /** The history may have been disabled after it grew too long */
+    if (rses->rses_config.rw_disable_sescmd_hist)
+    {
+        MXS_INFO("Session command history is disabled, the session is not "
+                 "connected to the slaves.");
+        return;
+    }
+
+    int router_nservers = router_get_servercount(rses->router);
+
+    select_connect_backend_servers(&rses->rses_master_ref, rses->rses_backend_ref,
+                                   rses->rses_nbackends,
+                                   rses_get_max_slavecount(rses, router_nservers),
+                                   rses_get_max_replication_lag(rses),
+                                   rses->rses_config.rw_slave_select_criteria,
+                                   rses->client_dcb->session, rses->router, true);
+    atomic_add(&rses->router->stats.n_lazy_connect, 1);
+}
+
+/**
+ * Record that a write was routed to the master. Until the slaves have
+ * replicated it, reads are routed to the master.
+ *
+ * @param rses Router client session
+ */
+static void rses_causal_write(ROUTER_CLIENT_SES *rses)
+{
+    rses->rses_causal_sample = RSES_CAUSAL_WRITE_PENDING;
+    rses->rses_causal_n_pos = -1;
+}
+
+/**
+ * Called when the master replies to a write. The GTID of the write is not
+ * known, so the first position of the master that the monitor is certain to
+ * have read after the write was committed is used instead. The monitor may
+ * already be waiting for the reply to a query sent before the commit, so
+ * the sample after the next one is needed.
+ *
+ * @param rses Router client session
+ */
+static void rses_causal_write_done(ROUTER_CLIENT_SES *rses)
+{
+    SERVER *master = rses->rses_master_ref->bref_backend->backend_server;
+
+    rses->rses_causal_sample = server_get_gtid_pos(master, rses->rses_causal_pos,
+                                                   &rses->rses_causal_n_pos) + 2;
+    rses->rses_causal_n_pos = -1;
+    rses->rses_causal_deadline = time(NULL) + rses->rses_config.rw_causal_reads_timeout;
+}
+
+/**
+ * Check whether a read can be routed to a slave without it missing a write
+ * made earlier in the same session.
+ *
+ * @param rses   Router client session
+ * @param server The slave
+ *
+ * @return True if the slave has replicated the last write of the session, or
+ * if no slave has done so within the configured time.
+ */
+static bool rses_causal_read_ok(ROUTER_CLIENT_SES *rses, SERVER *server)
+{
+    if (rses->rses_causal_sample == 0)
+    {
+        return true;
+    }
+
+    if (rses->rses_causal_sample != RSES_CAUSAL_WRITE_PENDING &&
+        time(NULL) >= rses->rses_causal_deadline)
+    {
+        MXS_INFO("The last write of the session was not seen to replicate in %d "
+                 "seconds, routing reads to slaves again.",
+                 rses->rses_config.rw_causal_reads_timeout);
+        rses->rses_causal_sample = 0;
+        return true;
+    }
+
+    if (rses->rses_causal_n_pos < 0)
+    {
+        SERVER *master = rses->rses_master_ref ?
+                         rses->rses_master_ref->bref_backend->backend_server : NULL;
+        int n_pos;
+
+        if (master == NULL || rses->rses_causal_sample == RSES_CAUSAL_WRITE_PENDING ||
+            server_get_gtid_pos(master, rses->rses_causal_pos, &n_pos) < rses->rses_causal_sample)
+        {
+            return false;
+        }
+
+        rses->rses_causal_n_pos = n_pos;
+    }
+
+    return server_gtid_pos_reached(server, rses->rses_causal_pos, rses->rses_causal_n_pos);
+}
+
 /**
  * Find out which of the two backend servers has smaller value for select
  * criteria property.
@@ -1531,282 +1841,301 @@ static route_target_t get_route_target(ROUTER_CLIENT_SES *rses,
 }
 
 /**
- * Check if the query is a DROP TABLE... query and
- * if it targets a temporary table, remove it from the hashtable.
- * @param router_cli_ses Router client session
- * @param querybuf GWBUF containing the query
- * @param type The type of the query resolved so far
+ * Check whether a statement refers to a table
+ *
+ * @param querybuf The statement
+ * @param table    Name of the table
+ * @return True if one of the tables of the statement has the name
  */
-void check_drop_tmp_table(ROUTER_CLIENT_SES *router_cli_ses, GWBUF *querybuf,
-                          qc_query_type_t type)
+static bool rule_match_table(GWBUF *querybuf, const char *table)
 {
+    const char * const *names;
+    char **copy = NULL;
+    int tsize = 0;
+    bool rval = false;
 
-    int tsize = 0, klen = 0, i;
-    char **tbl = NULL;
-    char *hkey, *dbname;
-    MYSQL_session *data;
-    rses_property_t *rses_prop_tmp;
-
-    if (router_cli_ses == NULL || querybuf == NULL)
+    if (!qc_peek_table_names(querybuf, &names, &tsize))
     {
-        MXS_ERROR("[%s] Error: NULL parameters passed: %p %p", __FUNCTION__,
-                  router_cli_ses, querybuf);
-        return;
+        copy = qc_get_table_names(querybuf, &tsize, false);
+        names = (const char * const *)copy;
     }
 
-    if (router_cli_ses->client_dcb == NULL)
+    for (int i = 0; names && i < tsize && !rval; i++)
     {
-        MXS_ERROR("[%s] Error: Client DCB is NULL.", __FUNCTION__);
-        return;
+        rval = names[i] && strcasecmp(names[i], table) == 0;
     }
 
-    rses_prop_tmp = router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES];
-    data = (MYSQL_session *)router_cli_ses->client_dcb->data;
-
-    if (data == NULL)
+    if (copy)
     {
-        MXS_ERROR("[%s] Error: User data in master server DBC is NULL.",
-                  __FUNCTION__);
-        return;
+        for (int i = 0; i < tsize; i++)
+        {
+            free(copy[i]);
+        }
+        free(copy);
     }
 
-    dbname = (char *)data->db;
+    return rval;
+}
 
-    if (qc_is_drop_table_query(querybuf))
+/**
+ * @brief Find the routing rule of a statement
+ *
+ * The rules are checked in their order against the type that the statement
+ * was classified as. The canonical hash and the tables of the statement are
+ * only looked up for a rule that needs them, both are kept with the
+ * classification.
+ *
+ * @param rses     Router client session
+ * @param querybuf The statement
+ * @param qtype    Type of the statement
+ * @return The first rule that matches or NULL if none does
+ */
+static const rwsplit_rule_t *rses_find_rule(ROUTER_CLIENT_SES *rses, GWBUF *querybuf,
+                                            qc_query_type_t qtype)
+{
+    ROUTER_INSTANCE *inst = rses->router;
+    const char *user = rses->client_dcb->user;
+    uint64_t canonical = 0;
+
+    for (int i = 0; i < inst->n_rules; i++)
     {
-        tbl = qc_get_table_names(querybuf, &tsize, false);
-        if (tbl != NULL)
+        const rwsplit_rule_t *rule = &inst->rules[i];
+
+        if (rule->qtype && (qtype & rule->qtype) == 0)
+        {
+            continue;
+        }
+
+        if (rule->user && (user == NULL || strcmp(user, rule->user) != 0))
+        {
+            continue;
+        }
+
+        if (rule->canonical)
         {
-            for (i = 0; i < tsize; i++)
+            if (canonical == 0)
             {
-                klen = strlen(dbname) + strlen(tbl[i]) + 2;
-                hkey = calloc(klen, sizeof(char));
-                strcpy(hkey, dbname);
-                strcat(hkey, ".");
-                strcat(hkey, tbl[i]);
+                canonical = qc_get_canonical_hash(querybuf);
+            }
 
-                if (rses_prop_tmp && rses_prop_tmp->rses_prop_data.temp_tables)
-                {
-                    if (hashtable_delete(rses_prop_tmp->rses_prop_data.temp_tables,
-                                         (void *)hkey))
-                    {
-                        MXS_INFO("Temporary table dropped: %s", hkey);
-                    }
-                }
-                free(tbl[i]);
-                free(hkey);
+            if (canonical != rule->canonical)
+            {
+                continue;
             }
+        }
 
-            free(tbl);
+        if (rule->table && !rule_match_table(querybuf, rule->table))
+        {
+            continue;
         }
+
+        MXS_INFO("Routing rule on line %d matches the statement.", rule->line);
+        return rule;
     }
+
+    return NULL;
 }
 
 /**
- * Check if the query targets a temporary table.
- * @param router_cli_ses Router client session
- * @param querybuf GWBUF containing the query
- * @param type The type of the query resolved so far
- * @return The type of the query
+ * Return the hash of the qualified name of a table
+ *
+ * @param db    The database
+ * @param table The table
+ * @return The FNV-1a hash of "db.table"
  */
-static bool is_read_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
-                                         GWBUF *querybuf,
-                                         qc_query_type_t qtype)
+static uint64_t tmp_table_hash(const char *db, const char *table)
 {
+    uint64_t hash = mxs_fnv1a64_str(MXS_FNV1A64_INIT, db);
+    hash = mxs_fnv1a64_byte(hash, '.');
+    return mxs_fnv1a64_str(hash, table);
+}
 
-    bool target_tmp_table = false;
-    int tsize = 0, klen = 0, i;
-    char **tbl = NULL;
-    char *dbname;
-    char hkey[MYSQL_DATABASE_MAXLEN + MYSQL_TABLE_MAXLEN + 2];
-    MYSQL_session *data;
-    bool rval = false;
-    rses_property_t *rses_prop_tmp;
-
-    if (router_cli_ses == NULL || querybuf == NULL)
+/**
+ * Find a temporary table of the session
+ *
+ * @param rses The router session
+ * @param hash Hash of the qualified name of the table
+ * @return Index of the table or -1 if it is not a temporary table
+ */
+static int tmp_table_find(ROUTER_CLIENT_SES *rses, uint64_t hash)
+{
+    for (int i = 0; i < rses->rses_n_tmp_tables; i++)
     {
-        MXS_ERROR("[%s] Error: NULL parameters passed: %p %p", __FUNCTION__,
-                  router_cli_ses, querybuf);
-        return false;
+        if (rses->rses_tmp_tables[i] == hash)
+        {
+            return i;
+        }
     }
 
-    if (router_cli_ses->client_dcb == NULL)
-    {
-        MXS_ERROR("[%s] Error: Client DCB is NULL.", __FUNCTION__);
-        return false;
-    }
+    return -1;
+}
 
-    rses_prop_tmp = router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES];
-    data = (MYSQL_session *)router_cli_ses->client_dcb->data;
+/**
+ * Check the tables of a statement against the temporary tables of the
+ * session. The table names of a cached statement are used without copying
+ * them.
+ *
+ * @param rses  The router session
+ * @param query The statement
+ * @param drop  Remove the temporary tables that the statement uses
+ * @return True if the statement uses a temporary table
+ */
+static bool tmp_table_match(ROUTER_CLIENT_SES *rses, GWBUF *query, bool drop)
+{
+    const char *dbname = ((MYSQL_session *)rses->client_dcb->data)->db;
+    const char * const *names;
+    char **copy = NULL;
+    int tsize = 0;
+    bool rval = false;
 
-    if (data == NULL)
+    if (!qc_peek_table_names(query, &names, &tsize))
     {
-        MXS_ERROR("[%s] Error: User data in client DBC is NULL.", __FUNCTION__);
-        return false;
+        copy = qc_get_table_names(query, &tsize, false);
+        names = (const char * const *)copy;
     }
 
-    dbname = (char *)data->db;
-
-    if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||
-        QUERY_IS_TYPE(qtype, QUERY_TYPE_LOCAL_READ) ||
-        QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||
-        QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||
-        QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ))
+    for (int i = 0; names && i < tsize && (drop || !rval); i++)
     {
-        tbl = qc_get_table_names(querybuf, &tsize, false);
+        int idx = names[i] ? tmp_table_find(rses, tmp_table_hash(dbname, names[i])) : -1;
 
-        if (tbl != NULL && tsize > 0)
+        if (idx != -1)
         {
-            /** Query targets at least one table */
-            for (i = 0; i < tsize && !target_tmp_table && tbl[i]; i++)
+            rval = true;
+
+            if (drop)
             {
-                sprintf(hkey, "%s.%s", dbname, tbl[i]);
-                if (rses_prop_tmp && rses_prop_tmp->rses_prop_data.temp_tables)
-                {
-                    if (hashtable_fetch(rses_prop_tmp->rses_prop_data.temp_tables, hkey))
-                    {
-                        /**Query target is a temporary table*/
-                        rval = true;
-                        MXS_INFO("Query targets a temporary table: %s", hkey);
-                        break;
-                    }
-                }
+                rses->rses_tmp_tables[idx] = rses->rses_tmp_tables[--rses->rses_n_tmp_tables];
+                MXS_INFO("Temporary table dropped: %s.%s", dbname, names[i]);
+            }
+            else
+            {
+                MXS_INFO("Query targets a temporary table: %s.%s", dbname, names[i]);
             }
         }
     }
 
-    if (tbl != NULL)
+    if (copy)
     {
-        for (i = 0; i < tsize; i++)
+        for (int i = 0; i < tsize; i++)
         {
-            free(tbl[i]);
+            free(copy[i]);
         }
-        free(tbl);
+        free(copy);
     }
 
     return rval;
 }
 
 /**
- * If query is of type QUERY_TYPE_CREATE_TMP_TABLE then find out
- * the database and table name, create a hashvalue and
- * add it to the router client session's property. If property
- * doesn't exist then create it first.
+ * Check if the query is a DROP TABLE... query and
+ * if it targets a temporary table, remove it from the temporary tables
+ * of the session.
  * @param router_cli_ses Router client session
  * @param querybuf GWBUF containing the query
  * @param type The type of the query resolved so far
  */
-static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
-                                   GWBUF *querybuf, qc_query_type_t type)
+void check_drop_tmp_table(ROUTER_CLIENT_SES *router_cli_ses, GWBUF *querybuf,
+                          qc_query_type_t type)
 {
-    if (!QUERY_IS_TYPE(type, QUERY_TYPE_CREATE_TMP_TABLE))
+    if (router_cli_ses->client_dcb == NULL || router_cli_ses->client_dcb->data == NULL)
     {
+        MXS_ERROR("[%s] Error: Client DCB or its user data is NULL.", __FUNCTION__);
         return;
     }
 
-    int klen = 0;
-    char *hkey, *dbname;
-    MYSQL_session *data;
-    rses_property_t *rses_prop_tmp;
-    HASHTABLE *h;
-
-    if (router_cli_ses == NULL || querybuf == NULL)
+    if (qc_is_drop_table_query(querybuf))
     {
-        MXS_ERROR("[%s] Error: NULL parameters passed: %p %p", __FUNCTION__,
-                  router_cli_ses, querybuf);
-        return;
+        tmp_table_match(router_cli_ses, querybuf, true);
     }
+}
 
-    if (router_cli_ses->client_dcb == NULL)
+/**
+ * Check if the query targets a temporary table.
+ * @param router_cli_ses Router client session
+ * @param querybuf GWBUF containing the query
+ * @param type The type of the query resolved so far
+ * @return The type of the query
+ */
+static bool is_read_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
+                                         GWBUF *querybuf,
+                                         qc_query_type_t qtype)
+{
+    if (router_cli_ses->client_dcb == NULL || router_cli_ses->client_dcb->data == NULL)
     {
-        MXS_ERROR("[%s] Error: Client DCB is NULL.", __FUNCTION__);
-        return;
+        MXS_ERROR("[%s] Error: Client DCB or its user data is NULL.", __FUNCTION__);
+        return false;
     }
 
-    router_cli_ses->have_tmp_tables = true;
-    rses_prop_tmp = router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES];
-    data = (MYSQL_session *)router_cli_ses->client_dcb->data;
+    return (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_LOCAL_READ) ||
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ)) &&
+           tmp_table_match(router_cli_ses, querybuf, false);
+}
 
-    if (data == NULL)
+/**
+ * If query is of type QUERY_TYPE_CREATE_TMP_TABLE then find out
+ * the database and table name and add the hash of the qualified
+ * name to the temporary tables of the router client session.
+ * @param router_cli_ses Router client session
+ * @param querybuf GWBUF containing the query
+ * @param type The type of the query resolved so far
+ */
+static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
+                                   GWBUF *querybuf, qc_query_type_t type)
+{
+    if (!QUERY_IS_TYPE(type, QUERY_TYPE_CREATE_TMP_TABLE))
     {
-        MXS_ERROR("[%s] Error: User data in master server DBC is NULL.",
-                  __FUNCTION__);
         return;
     }
 
-    dbname = (char *)data->db;
-
-    bool is_temp = true;
-    char *tblname = NULL;
-
-    tblname = qc_get_created_table_name(querybuf);
-
-    if (tblname && strlen(tblname) > 0)
-    {
-        klen = strlen(dbname) + strlen(tblname) + 2;
-        hkey = calloc(klen, sizeof(char));
-        strcpy(hkey, dbname);
-        strcat(hkey, ".");
-        strcat(hkey, tblname);
-    }
-    else
+    if (router_cli_ses->client_dcb == NULL || router_cli_ses->client_dcb->data == NULL)
     {
-        hkey = NULL;
+        MXS_ERROR("[%s] Error: Client DCB or its user data is NULL.", __FUNCTION__);
+        return;
     }
 
-    if (rses_prop_tmp == NULL)
+    const char *dbname = ((MYSQL_session *)router_cli_ses->client_dcb->data)->db;
+    char *tblname = qc_get_created_table_name(querybuf);
+
+    if (tblname && *tblname)
     {
-        if ((rses_prop_tmp = (rses_property_t *)calloc(1, sizeof(rses_property_t))))
+        uint64_t hash = tmp_table_hash(dbname, tblname);
+
+        if (tmp_table_find(router_cli_ses, hash) != -1)
         {
-#if defined(SS_DEBUG)
-            rses_prop_tmp->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
-            rses_prop_tmp->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
-#endif
-            rses_prop_tmp->rses_prop_rsession = router_cli_ses;
-            rses_prop_tmp->rses_prop_refcount = 1;
-            rses_prop_tmp->rses_prop_next = NULL;
-            rses_prop_tmp->rses_prop_type = RSES_PROP_TYPE_TMPTABLES;
-            router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES] = rses_prop_tmp;
+            MXS_INFO("Temporary table already exists: %s.%s", dbname, tblname);
         }
         else
         {
-            MXS_ERROR("Call to malloc() failed.");
-        }
-    }
-    if (rses_prop_tmp)
-    {
-        if (rses_prop_tmp->rses_prop_data.temp_tables == NULL)
-        {
-            h = hashtable_alloc(7, hashkeyfun, hashcmpfun);
-            hashtable_memory_fns(h, hstrdup, NULL, hfree, NULL);
-            if (h != NULL)
+            if (router_cli_ses->rses_n_tmp_tables == router_cli_ses->rses_tmp_tables_size)
             {
-                rses_prop_tmp->rses_prop_data.temp_tables = h;
+                int size = router_cli_ses->rses_tmp_tables_size ?
+                    router_cli_ses->rses_tmp_tables_size * 2 : 4;
+                uint64_t *tables = realloc(router_cli_ses->rses_tmp_tables,
+                                           size * sizeof(uint64_t));
+
+                if (tables)
+                {
+                    router_cli_ses->rses_tmp_tables = tables;
+                    router_cli_ses->rses_tmp_tables_size = size;
+                }
             }
-            else
+
+            if (router_cli_ses->rses_n_tmp_tables < router_cli_ses->rses_tmp_tables_size)
             {
-                MXS_ERROR("Failed to allocate a new hashtable.");
+                router_cli_ses->rses_tmp_tables[router_cli_ses->rses_n_tmp_tables++] = hash;
+                MXS_INFO("Temporary table added: %s.%s", dbname, tblname);
             }
-        }
-
-        if (hkey && rses_prop_tmp->rses_prop_data.temp_tables &&
-            hashtable_add(rses_prop_tmp->rses_prop_data.temp_tables, (void *)hkey,
-                          (void *)is_temp) == 0) /*< Conflict in hash table */
-        {
-            MXS_INFO("Temporary table conflict in hashtable: %s", hkey);
-        }
-#if defined(SS_DEBUG)
-        {
-            bool retkey = hashtable_fetch(rses_prop_tmp->rses_prop_data.temp_tables, hkey);
-            if (retkey)
+            else
             {
-                MXS_INFO("Temporary table added: %s", hkey);
+                MXS_ERROR("Call to realloc() failed, temporary table %s.%s is "
+                          "not tracked.", dbname, tblname);
             }
         }
-#endif
     }
 
-    free(hkey);
     free(tblname);
 }
 
@@ -1835,6 +2164,380 @@ static DCB *rses_get_client_dcb(ROUTER_CLIENT_SES *rses)
     return NULL;
 }
 
+/**
+ * Check whether a statement only reads and can be routed to the slaves
+ *
+ * @param qtype The type of the statement
+ * @return True if the statement only reads
+ */
+static bool query_is_read_only(qc_query_type_t qtype)
+{
+    const int reads = QUERY_TYPE_READ | QUERY_TYPE_SHOW_TABLES | QUERY_TYPE_USERVAR_READ |
+        QUERY_TYPE_SYSVAR_READ | QUERY_TYPE_GSYSVAR_READ;
+    const int others = QUERY_TYPE_WRITE | QUERY_TYPE_MASTER_READ | QUERY_TYPE_SESSION_WRITE |
+        QUERY_TYPE_USERVAR_WRITE | QUERY_TYPE_GSYSVAR_WRITE | QUERY_TYPE_BEGIN_TRX |
+        QUERY_TYPE_ENABLE_AUTOCOMMIT | QUERY_TYPE_DISABLE_AUTOCOMMIT | QUERY_TYPE_ROLLBACK |
+        QUERY_TYPE_COMMIT | QUERY_TYPE_PREPARE_NAMED_STMT | QUERY_TYPE_CREATE_TMP_TABLE |
+        QUERY_TYPE_READ_TMP_TABLE;
+
+    return (qtype & reads) && !(qtype & others);
+}
+
+/**
+ * Create a COM_QUERY from a part of a query
+ *
+ * @param sql The SQL
+ * @param len Length of the SQL
+ * @return The COM_QUERY or NULL if memory allocation failed
+ */
+static GWBUF *multi_stmt_create_query(const char *sql, int len)
+{
+    GWBUF *buf = gwbuf_alloc(MYSQL_HEADER_LEN + 1 + len);
+
+    if (buf)
+    {
+        uint8_t *data = (uint8_t *)GWBUF_DATA(buf);
+        gw_mysql_set_byte3(data, len + 1);
+        data[3] = 0;
+        data[MYSQL_HEADER_LEN] = MYSQL_COM_QUERY;
+        memcpy(data + MYSQL_HEADER_LEN + 1, sql, len);
+        gwbuf_set_type(buf, GWBUF_TYPE_MYSQL);
+        gwbuf_set_type(buf, GWBUF_TYPE_SINGLE_STMT);
+    }
+
+    return buf;
+}
+
+/**
+ * @brief Split a multi-statement query into its statements
+ *
+ * A query is split only if all of its statements are reads and the session
+ * could route each of them to a slave. A query with comments that end at the
+ * end of the line is not split, the statement boundaries in it are not known.
+ *
+ * @param rses     Router client session
+ * @param querybuf A contiguous COM_QUERY
+ * @return True if the statements were stored in rses_multi_stmt
+ */
+static bool rses_multi_split(ROUTER_CLIENT_SES *rses, GWBUF *querybuf)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)rses->client_dcb->protocol;
+    uint8_t *packet = (uint8_t *)GWBUF_DATA(querybuf);
+
+    if (!(proto->client_capabilities & GW_MYSQL_CAPABILITIES_MULTI_STATEMENTS) ||
+        GWBUF_LENGTH(querybuf) <= MYSQL_HEADER_LEN || packet[MYSQL_HEADER_LEN] != MYSQL_COM_QUERY ||
+        GWBUF_LENGTH(querybuf) != MYSQL_HEADER_LEN + gw_mysql_get_byte3(packet) ||
+        rses->rses_transaction_active || rses->rses_load_active || rses->forced_node ||
+        rses->rses_multi_active)
+    {
+        return false;
+    }
+
+    char *data = (char *)packet + MYSQL_HEADER_LEN + 1;
+    int len = gw_mysql_get_byte3(packet) - 1;
+    char *end = data + len;
+
+    if (strnchr_esc_mysql(data, ';', len) == NULL ||
+        memchr(data, '#', len) || memmem(data, len, "--", 2))
+    {
+        return false;
+    }
+
+    GWBUF *parts = NULL;
+    int n_parts = 0;
+    bool ok = true;
+
+    for (char *start = data; ok && start < end && !is_mysql_statement_end(start, end - start);)
+    {
+        char *semicolon = strnchr_esc_mysql(start, ';', end - start);
+        char *stmt_end = semicolon ? semicolon : end;
+        GWBUF *part = multi_stmt_create_query(start, stmt_end - start);
+
+        if (part == NULL || !query_is_read_only(qc_get_type(part)))
+        {
+            ok = false;
+        }
+
+        parts = gwbuf_append(parts, part);
+        n_parts++;
+        start = semicolon ? semicolon + 1 : end;
+    }
+
+    if (!ok || n_parts < 2)
+    {
+        gwbuf_free(parts);
+        return false;
+    }
+
+    MXS_INFO("Multi-statement query split into %d statements.", n_parts);
+    rses->rses_multi_stmt = parts;
+    rses->rses_multi_active = true;
+    rses->rses_multi_seq = 1;
+    return true;
+}
+
+/**
+ * End a split multi-statement query with an error
+ *
+ * @param rses Router client session
+ */
+static void rses_multi_fail(ROUTER_CLIENT_SES *rses)
+{
+    MXS_ERROR("Failed to route a statement of a multi-statement query.");
+    GWBUF *err = modutil_create_mysql_err_msg(rses->rses_multi_seq, 0, ER_UNKNOWN_ERROR, "HY000",
+                                              "Failed to route a statement of a "
+                                              "multi-statement query");
+    if (err)
+    {
+        rses->client_dcb->func.write(rses->client_dcb, err);
+    }
+
+    gwbuf_free(rses->rses_multi_stmt);
+    rses->rses_multi_stmt = NULL;
+    rses->rses_multi_active = false;
+    rses->rses_multi_bref = NULL;
+}
+
+/**
+ * Route the next statement of a split multi-statement query
+ *
+ * @param inst Router instance
+ * @param rses Router client session
+ * @return True if the statement was routed, false if an error was sent to the client
+ */
+static bool rses_multi_route_next(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses)
+{
+    GWBUF *part = gwbuf_make_contiguous(modutil_get_next_MySQL_packet(&rses->rses_multi_stmt));
+    bool succp = false;
+
+    if (part)
+    {
+        gwbuf_set_type(part, GWBUF_TYPE_MYSQL);
+        gwbuf_set_type(part, GWBUF_TYPE_SINGLE_STMT);
+        rses->rses_multi_bref = NULL;
+        rses->rses_multi_state = RSES_MULTI_START;
+
+        succp = route_single_stmt(inst, rses, part) && rses->rses_multi_bref;
+        gwbuf_free(part);
+    }
+
+    if (!succp)
+    {
+        rses_multi_fail(rses);
+    }
+
+    return succp;
+}
+
+/**
+ * Skip a length-encoded integer
+ *
+ * @param ptr The integer
+ * @return The first byte after the integer
+ */
+static inline uint8_t *multi_stmt_skip_leint(uint8_t *ptr)
+{
+    switch (*ptr)
+    {
+    case 0xfc:
+        return ptr + 3;
+    case 0xfd:
+        return ptr + 4;
+    case 0xfe:
+        return ptr + 9;
+    default:
+        return ptr + 1;
+    }
+}
+
+/**
+ * @brief Merge the reply to a statement of a split multi-statement query
+ *
+ * The packets are numbered as one reply to the client. The last result of a
+ * statement that is followed by other statements gets the
+ * SERVER_MORE_RESULTS_EXIST status so that the client reads the next result.
+ * If the statement fails, the error ends the reply and the remaining
+ * statements are not executed, like in the server.
+ *
+ * @param rses     Router client session
+ * @param writebuf Complete packets of the reply
+ * @return True if the reply to the statement is complete
+ */
+static bool rses_multi_reply(ROUTER_CLIENT_SES *rses, GWBUF **writebuf)
+{
+    GWBUF *buf = gwbuf_make_contiguous(*writebuf);
+    bool done = false;
+
+    *writebuf = buf;
+
+    if (buf == NULL)
+    {
+        return false;
+    }
+
+    uint8_t *data = (uint8_t *)GWBUF_DATA(buf);
+    size_t len = GWBUF_LENGTH(buf);
+    size_t pos = 0;
+
+    while (!done && pos + MYSQL_HEADER_LEN < len)
+    {
+        uint8_t *packet = data + pos;
+        uint8_t *payload = packet + MYSQL_HEADER_LEN;
+        uint32_t payload_len = gw_mysql_get_byte3(packet);
+        bool is_eof = payload[0] == 0xfe && payload_len < 9;
+        uint8_t *status = NULL;
+
+        packet[3] = rses->rses_multi_seq++;
+
+        if (payload[0] == 0xff)
+        {
+            /** The server would not execute the rest of the statements either */
+            gwbuf_free(rses->rses_multi_stmt);
+            rses->rses_multi_stmt = NULL;
+            done = true;
+        }
+        else if (rses->rses_multi_state == RSES_MULTI_START)
+        {
+            if (payload[0] == 0x00)
+            {
+                uint8_t *ptr = multi_stmt_skip_leint(payload + 1);
+                status = multi_stmt_skip_leint(ptr);
+            }
+            else
+            {
+                rses->rses_multi_state = RSES_MULTI_COLUMNS;
+            }
+        }
+        else if (is_eof && rses->rses_multi_state == RSES_MULTI_COLUMNS)
+        {
+            rses->rses_multi_state = RSES_MULTI_ROWS;
+        }
+        else if (is_eof)
+        {
+            status = payload + 3;
+        }
+
+        if (status && status + 2 <= payload + payload_len)
+        {
+            uint16_t value = gw_mysql_get_byte2(status);
+            rses->rses_multi_state = RSES_MULTI_START;
+
+            if (!(value & SERVER_MORE_RESULTS_EXIST))
+            {
+                done = true;
+
+                if (rses->rses_multi_stmt)
+                {
+                    gw_mysql_set_byte2(status, value | SERVER_MORE_RESULTS_EXIST);
+                }
+            }
+        }
+
+        pos += MYSQL_HEADER_LEN + payload_len;
+    }
+
+    return done;
+}
+
+/**
+ * Forward the contents of a LOAD DATA LOCAL INFILE file to the master
+ *
+ * The packets of the file are not statements, so they are not classified and
+ * they are written to the master as they are, without copying. When the empty
+ * packet that ends the file is found, the load ends and the reply of the master
+ * is waited for. Any packets after the empty packet are routed normally.
+ *
+ * @param inst     Router instance
+ * @param rses     Router session
+ * @param querybuf Complete packets of the file, freed by this function
+ * @return True if the packets were written to the master
+ */
+static bool route_load_data(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, GWBUF *querybuf)
+{
+    MODUTIL_PACKET_ITER iter;
+    MODUTIL_PACKET packet;
+    size_t len = 0;
+    bool end = false;
+
+    modutil_packet_iter_init(&iter, querybuf);
+
+    while (!end && modutil_packet_next(&iter, &packet))
+    {
+        len += packet.length;
+        end = packet.length == MYSQL_HEADER_LEN;
+    }
+
+    GWBUF *rest = NULL;
+
+    if (end && len < gwbuf_length(querybuf))
+    {
+        rest = querybuf;
+        querybuf = gwbuf_split(&rest, len);
+    }
+
+    if (!rses_begin_locked_router_action(rses))
+    {
+        gwbuf_free(querybuf);
+        gwbuf_free(rest);
+        return false;
+    }
+
+    backend_ref_t *bref = rses->rses_master_ref;
+    bool succp = false;
+
+    rses->rses_load_data_sent += gwbuf_length(querybuf);
+
+    if (end)
+    {
+        rses->rses_load_active = false;
+        MXS_INFO("> LOAD DATA LOCAL INFILE finished: %lu bytes sent.",
+                 rses->rses_load_data_sent);
+    }
+
+    if (bref && BREF_IS_IN_USE(bref) && !BREF_IS_CLOSED(bref))
+    {
+        DCB *dcb = bref->bref_dcb;
+
+        if (dcb->func.write(dcb, querybuf) == 1)
+        {
+            succp = true;
+
+            if (end)
+            {
+                /** Only the end of the file is answered */
+                atomic_add(&inst->stats.n_master, 1);
+                atomic_add(&inst->stats.n_queries, 1);
+                bref_set_state(bref, BREF_QUERY_ACTIVE);
+                bref_set_state(bref, BREF_WAITING_RESULT);
+                bref_start_response_timer(bref);
+            }
+        }
+        else
+        {
+            MXS_ERROR("Routing the contents of a LOAD DATA LOCAL INFILE file failed.");
+        }
+    }
+    else
+    {
+        MXS_ERROR("Could not find a valid master connection for the contents "
+                  "of a LOAD DATA LOCAL INFILE file.");
+        gwbuf_free(querybuf);
+    }
+
+    rses_end_locked_router_action(rses);
+
+    if (succp && rest)
+    {
+        gwbuf_set_type(rest, GWBUF_TYPE_MYSQL);
+        gwbuf_set_type(rest, GWBUF_TYPE_SINGLE_STMT);
+        succp = route_single_stmt(inst, rses, rest);
+    }
+
+    gwbuf_free(rest);
+
+    return succp;
+}
+
 /**
  * @brief The main routing entry point
  *
@@ -1856,6 +2559,12 @@ static int routeQuery(ROUTER *instance, void *router_session, GWBUF *querybuf)
 
     CHK_CLIENT_RSES(rses);
 
+    if (rses->client_dcb && rses->client_dcb->session)
+    {
+        SESSION *session = rses->client_dcb->session;
+        trace_stage(&session->trace, session->ses_id, TRACE_CLASSIFY);
+    }
+
     if (rses->rses_closed)
     {
         uint8_t* data = GWBUF_DATA(querybuf);
@@ -1886,7 +2595,22 @@ static int routeQuery(ROUTER *instance, void *router_session, GWBUF *querybuf)
             gwbuf_set_type(querybuf, GWBUF_TYPE_SINGLE_STMT);
         }
 
-        if (route_single_stmt(inst, rses, querybuf))
+        if (rses->rses_replay_state != RSES_REPLAY_NONE && rses_replay_hold(rses, querybuf))
+        {
+            /** Routed once the transaction has been replayed on the new master */
+            rval = 1;
+            querybuf = NULL;
+        }
+        else if (rses->rses_load_active)
+        {
+            rval = route_load_data(inst, rses, querybuf) ? 1 : 0;
+            querybuf = NULL;
+        }
+        else if (rses->rses_config.rw_split_multi_stmt && rses_multi_split(rses, querybuf))
+        {
+            rval = rses_multi_route_next(inst, rses) ? 1 : 0;
+        }
+        else if (route_single_stmt(inst, rses, querybuf))
         {
             rval = 1;
         }
@@ -1958,1546 +2682,4206 @@ static void log_master_routing_failure(ROUTER_CLIENT_SES *rses, bool found,
                 rses->client_dcb->remote, errmsg);
 }
 
-/**
- * Routing function. Find out query type, backend type, and target DCB(s).
- * Then route query to found target(s).
- * @param inst      router instance
- * @param rses      router session
- * @param querybuf  GWBUF including the query
+/** Number of slots in the prepared statement table of a session */
+#define RSES_PS_HASHSIZE 31
+
+/** The statement id in a command that refers to a prepared statement */
+#define PS_ID_OFFSET (MYSQL_HEADER_LEN + 1)
+
+/** The flags of a COM_STMT_EXECUTE, non-zero if a cursor is opened */
+#define PS_EXEC_FLAGS_OFFSET (MYSQL_HEADER_LEN + 5)
+
+static int ps_hashkeyfun(void *key)
+{
+    return (int)((uintptr_t)key & INT_MAX);
+}
+
+static int ps_hashcmpfun(void *v1, void *v2)
+{
+    return v1 == v2 ? 0 : 1;
+}
+
+static void *ps_free(void *fval)
+{
+    rwsplit_ps_t *ps = (rwsplit_ps_t *)fval;
+
+    if (ps)
+    {
+        gwbuf_free(ps->prepare);
+        gwbuf_free(ps->reply);
+        free(ps);
+    }
+    return NULL;
+}
+
+/**
+ * Find the prepared statement a command refers to
  *
- * @return true if routing succeed or if it failed due to unsupported query.
- * false if backend failure was encountered.
+ * @param rses Router client session
+ * @param buf  A contiguous command with a statement id
+ * @return The statement or NULL if the session has not prepared it
  */
-static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
-                              GWBUF *querybuf)
+static rwsplit_ps_t *rses_ps_find(ROUTER_CLIENT_SES *rses, GWBUF *buf)
 {
-    qc_query_type_t qtype = QUERY_TYPE_UNKNOWN;
-    mysql_server_cmd_t packet_type = MYSQL_COM_UNDEFINED;
-    uint8_t *packet;
-    size_t packet_len;
-    int ret = 0;
-    DCB *target_dcb = NULL;
-    route_target_t route_target;
-    bool succp = false;
-    int rlag_max = MAX_RLAG_UNDEFINED;
-    backend_type_t btype; /*< target backend type */
+    rwsplit_ps_t *ps = NULL;
 
-    ss_dassert(querybuf->next == NULL); // The buffer must be contiguous.
-    ss_dassert(!GWBUF_IS_TYPE_UNDEFINED(querybuf));
+    if (rses->rses_ps && GWBUF_LENGTH(buf) >= PS_ID_OFFSET + 4)
+    {
+        uint32_t id = gw_mysql_get_byte4((uint8_t *)GWBUF_DATA(buf) + PS_ID_OFFSET);
+        ps = (rwsplit_ps_t *)hashtable_fetch(rses->rses_ps, (void *)(uintptr_t)id);
+    }
 
-    packet = GWBUF_DATA(querybuf);
-    packet_len = gw_mysql_get_byte3(packet);
+    return ps;
+}
 
-    if (packet_len == 0)
+/**
+ * Return the id a prepared statement has in the current connection of a backend
+ *
+ * @param rses Router client session
+ * @param bref The backend
+ * @param ps   The statement
+ * @return The statement id or 0 if the statement is not prepared in the backend
+ */
+static uint32_t ps_backend_id(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, rwsplit_ps_t *ps)
+{
+    rwsplit_ps_backend_t *b = &ps->backends[bref - rses->rses_backend_ref];
+    return b->conn == bref->bref_conn_seq ? b->id : 0;
+}
+
+/**
+ * Copy a command and replace the statement id in it
+ *
+ * @param buf A contiguous command with a statement id
+ * @param id  The statement id of the backend the copy is written to
+ * @return The command for the backend or NULL if memory allocation failed
+ */
+static GWBUF *ps_translate(GWBUF *buf, uint32_t id)
+{
+    if (gw_mysql_get_byte4((uint8_t *)GWBUF_DATA(buf) + PS_ID_OFFSET) == id)
     {
-        /** Empty packet signals end of LOAD DATA LOCAL INFILE, send it to master*/
-        route_target = TARGET_MASTER;
-        packet_type = MYSQL_COM_UNDEFINED;
-        rses->rses_load_active = false;
-        route_target = TARGET_MASTER;
-        MXS_INFO("> LOAD DATA LOCAL INFILE finished: %lu bytes sent.",
-                 rses->rses_load_data_sent + gwbuf_length(querybuf));
+        return gwbuf_clone(buf);
     }
-    else
+
+    GWBUF *copy = gwbuf_alloc_and_load(GWBUF_LENGTH(buf), GWBUF_DATA(buf));
+
+    if (copy)
     {
-        packet_type = packet[4];
+        gwbuf_set_type(copy, buf->gwbuf_type);
+        gw_mysql_set_byte4((uint8_t *)GWBUF_DATA(copy) + PS_ID_OFFSET, id);
+    }
 
-        switch (packet_type)
+    return copy;
+}
+
+/**
+ * @brief Close a prepared statement in the backends that have prepared it
+ *
+ * The server does not reply to COM_STMT_CLOSE.
+ *
+ * @param rses   Router client session
+ * @param ps     The statement
+ * @param master Whether the statement is also closed in the master
+ */
+static void rses_ps_close_in_backends(ROUTER_CLIENT_SES *rses, rwsplit_ps_t *ps, bool master)
+{
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        uint32_t id;
+
+        if ((master || bref != rses->rses_master_ref) && BREF_IS_IN_USE(bref) &&
+            (id = ps_backend_id(rses, bref, ps)) != 0)
         {
-            case MYSQL_COM_QUIT:        /*< 1 QUIT will close all sessions */
-            case MYSQL_COM_INIT_DB:     /*< 2 DDL must go to the master */
-            case MYSQL_COM_REFRESH:     /*< 7 - I guess this is session but not sure */
-            case MYSQL_COM_DEBUG:       /*< 0d all servers dump debug info to stdout */
-            case MYSQL_COM_PING:        /*< 0e all servers are pinged */
-            case MYSQL_COM_CHANGE_USER: /*< 11 all servers change it accordingly */
-                qtype = QUERY_TYPE_SESSION_WRITE;
-                break;
+            GWBUF *buf = gwbuf_alloc(PS_ID_OFFSET + 4);
 
-            case MYSQL_COM_CREATE_DB:           /**< 5 DDL must go to the master */
-            case MYSQL_COM_DROP_DB:             /**< 6 DDL must go to the master */
-            case MYSQL_COM_STMT_CLOSE:          /*< free prepared statement */
-            case MYSQL_COM_STMT_SEND_LONG_DATA: /*< send data to column */
-            case MYSQL_COM_STMT_RESET: /*< resets the data of a prepared statement */
-                qtype = QUERY_TYPE_WRITE;
-                break;
+            if (buf)
+            {
+                uint8_t *data = (uint8_t *)GWBUF_DATA(buf);
+                gw_mysql_set_byte3(data, PS_ID_OFFSET + 4 - MYSQL_HEADER_LEN);
+                data[3] = 0;
+                data[MYSQL_HEADER_LEN] = MYSQL_COM_STMT_CLOSE;
+                gw_mysql_set_byte4(data + PS_ID_OFFSET, id);
+                gwbuf_set_type(buf, GWBUF_TYPE_MYSQL);
+                bref->bref_dcb->func.write(bref->bref_dcb, buf);
+            }
+        }
+    }
+}
 
-            case MYSQL_COM_QUERY:
-                qtype = qc_get_type(querybuf);
-                break;
+/**
+ * Close the oldest statement in the prepared statement cache of a session
+ *
+ * @param rses Router client session
+ */
+static void rses_ps_evict(ROUTER_CLIENT_SES *rses)
+{
+    rwsplit_ps_t **prev = &rses->rses_ps_cache;
 
-            case MYSQL_COM_STMT_PREPARE:
-                qtype = qc_get_type(querybuf);
-                qtype |= QUERY_TYPE_PREPARE_STMT;
-                break;
+    while (*prev && (*prev)->cache_next)
+    {
+        prev = &(*prev)->cache_next;
+    }
 
-            case MYSQL_COM_STMT_EXECUTE:
-                /** Parsing is not needed for this type of packet */
-                qtype = QUERY_TYPE_EXEC_STMT;
-                break;
+    rwsplit_ps_t *ps = *prev;
 
-            case MYSQL_COM_SHUTDOWN:       /**< 8 where should shutdown be routed ? */
-            case MYSQL_COM_STATISTICS:     /**< 9 ? */
-            case MYSQL_COM_PROCESS_INFO:   /**< 0a ? */
-            case MYSQL_COM_CONNECT:        /**< 0b ? */
-            case MYSQL_COM_PROCESS_KILL:   /**< 0c ? */
-            case MYSQL_COM_TIME:           /**< 0f should this be run in gateway ? */
-            case MYSQL_COM_DELAYED_INSERT: /**< 10 ? */
-            case MYSQL_COM_DAEMON:         /**< 1d ? */
-            default:
-                break;
-        } /**< switch by packet type */
+    if (ps)
+    {
+        *prev = NULL;
+        rses->rses_ps_cache_len--;
+        rses_ps_close_in_backends(rses, ps, true);
+        hashtable_delete(rses->rses_ps, (void *)(uintptr_t)ps->id);
+    }
+}
 
-        /** This might not be absolutely necessary as some parts of the code
-         * can only be executed by one thread at a time. */
-        if (!rses_begin_locked_router_action(rses))
+/**
+ * @brief Close all statements in the prepared statement cache of a session
+ *
+ * Called when the client changes the state of the session. The same text may
+ * then mean another statement, for example after the default database changes.
+ *
+ * @param rses Router client session
+ */
+static void rses_ps_flush_cache(ROUTER_CLIENT_SES *rses)
+{
+    while (rses->rses_ps_cache)
+    {
+        rses_ps_evict(rses);
+    }
+}
+
+/**
+ * @brief Close a prepared statement of the client
+ *
+ * The COM_STMT_CLOSE of the client goes to the master. The statement is
+ * closed here in the other backends that prepared it and removed from the
+ * session. If the prepared statement cache is enabled, the statement is
+ * instead kept open in all backends and the COM_STMT_CLOSE is not routed.
+ *
+ * @param rses     Router client session
+ * @param querybuf The COM_STMT_CLOSE of the client
+ * @return True if the statement was moved to the cache
+ */
+static bool rses_ps_close(ROUTER_CLIENT_SES *rses, GWBUF *querybuf)
+{
+    rwsplit_ps_t *ps = rses_ps_find(rses, querybuf);
+
+    if (ps == NULL || ps->closed)
+    {
+        return false;
+    }
+
+    if (rses->rses_config.rw_ps_cache_size > 0 && ps->cacheable && !ps->long_data)
+    {
+        ps->closed = true;
+        ps->cache_next = rses->rses_ps_cache;
+        rses->rses_ps_cache = ps;
+
+        if (++rses->rses_ps_cache_len > rses->rses_config.rw_ps_cache_size)
         {
-            succp = false;
-            goto retblock;
+            rses_ps_evict(rses);
         }
+        return true;
+    }
 
-        /** Check for multi-statement queries. If no master server is available
-         * and a multi-statement is issued, an error is returned to the client
-         * when the query is routed.
-         *
-         * If we do not have a master node, assigning the forced node is not
-         * effective since we don't have a node to force queries to. In this
-         * situation, assigning QUERY_TYPE_WRITE for the query will trigger
-         * the error processing. */
-        if (check_for_multi_stmt(rses, querybuf, packet_type) &&
-            rses->rses_master_ref == NULL)
+    rses_ps_close_in_backends(rses, ps, false);
+    hashtable_delete(rses->rses_ps, (void *)(uintptr_t)ps->id);
+    return false;
+}
+
+/**
+ * @brief Answer a COM_STMT_PREPARE from the prepared statement cache
+ *
+ * A statement with the same text that the client has closed is still open
+ * in the master. It is given back to the client with the reply the master
+ * sent when the statement was first prepared.
+ *
+ * @param rses     Router client session
+ * @param querybuf The COM_STMT_PREPARE of the client
+ * @return True if the client was answered
+ */
+static bool rses_ps_reuse(ROUTER_CLIENT_SES *rses, GWBUF *querybuf)
+{
+    bool reused = false;
+
+    if (rses->rses_ps_cache && rses_begin_locked_router_action(rses))
+    {
+        size_t len = GWBUF_LENGTH(querybuf);
+        rwsplit_ps_t **prev = &rses->rses_ps_cache;
+        rwsplit_ps_t *ps;
+
+        while ((ps = *prev) &&
+               (GWBUF_LENGTH(ps->prepare) != len ||
+                memcmp((uint8_t *)GWBUF_DATA(ps->prepare) + MYSQL_HEADER_LEN,
+                       (uint8_t *)GWBUF_DATA(querybuf) + MYSQL_HEADER_LEN,
+                       len - MYSQL_HEADER_LEN) != 0))
         {
-            qtype |= QUERY_TYPE_WRITE;
+            prev = &ps->cache_next;
         }
 
-        /**
-         * Check if the query has anything to do with temporary tables.
-         */
-        if (rses->have_tmp_tables &&
-            (packet_type == MYSQL_COM_QUERY || packet_type == MYSQL_COM_DROP_DB))
+        if (ps)
         {
-            check_drop_tmp_table(rses, querybuf, qtype);
-            if (packet_type == MYSQL_COM_QUERY && is_read_tmp_table(rses, querybuf, qtype))
+            backend_ref_t *master = rses->rses_master_ref;
+
+            *prev = ps->cache_next;
+            ps->cache_next = NULL;
+            ps->closed = false;
+            rses->rses_ps_cache_len--;
+
+            if (master && BREF_IS_IN_USE(master) && ps_backend_id(rses, master, ps) == ps->id)
             {
-                qtype |= QUERY_TYPE_MASTER_READ;
+                GWBUF *reply = gwbuf_clone_all(ps->reply);
+                reused = reply && rses->client_dcb->func.write(rses->client_dcb, reply);
+            }
+
+            if (reused)
+            {
+                MXS_INFO("Prepared statement %u was taken from the cache.", ps->id);
+            }
+            else
+            {
+                rses_ps_close_in_backends(rses, ps, true);
+                hashtable_delete(rses->rses_ps, (void *)(uintptr_t)ps->id);
             }
         }
-        check_create_tmp_table(rses, querybuf, qtype);
 
-        /**
-         * Check if this is a LOAD DATA LOCAL INFILE query. If so, send all queries
-         * to the master until the last, empty packet arrives.
-         */
-        if (rses->rses_load_active)
+        rses_end_locked_router_action(rses);
+    }
+
+    return reused;
+}
+
+/**
+ * The number of replies a backend has read once it has replied to everything
+ * that was written to it and to the next command
+ *
+ * @param bref The backend
+ * @return The reply count of the protocol of the backend
+ */
+static uint64_t bref_next_reply_mark(backend_ref_t *bref)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)bref->bref_dcb->protocol;
+    return proto->reply.n_replies + proto->reply.n_pending + 1;
+}
+
+/**
+ * @brief Start following a COM_STMT_PREPARE sent to the master
+ *
+ * The type of the statement is classified here, once, and the statement is
+ * added to the session when clientReply sees the id the master gave it.
+ *
+ * @param rses     Router client session
+ * @param bref     The master, before the command is written to it
+ * @param querybuf The COM_STMT_PREPARE
+ * @param qtype    The type of the statement
+ */
+static void rses_ps_prepare(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                            GWBUF *querybuf, qc_query_type_t qtype)
+{
+    rwsplit_ps_t *ps = calloc(1, sizeof(rwsplit_ps_t) +
+                              rses->rses_nbackends * sizeof(rwsplit_ps_backend_t));
+
+    if (ps)
+    {
+        MySQLProtocol *proto = (MySQLProtocol *)bref->bref_dcb->protocol;
+
+        ps->qtype = qtype & ~QUERY_TYPE_PREPARE_STMT;
+        ps->read_only = query_is_read_only(ps->qtype);
+        ps->prepare = gwbuf_clone(querybuf);
+        /** The reply can be stored if nothing else is read before it */
+        ps->cacheable = rses->rses_config.rw_ps_cache_size > 0 &&
+            proto->protocol_auth_state == MYSQL_IDLE && proto->reply.n_pending == 0;
+
+        ps_free(bref->bref_ps_new);
+        bref->bref_ps_new = ps;
+        bref->bref_ps_mark = bref_next_reply_mark(bref);
+    }
+}
+
+/**
+ * @brief Add a statement prepared in the master to the session
+ *
+ * Called when a reply from the master has been read. The statement is added
+ * when the reply to its COM_STMT_PREPARE is complete. If the master prepared
+ * other statements in the same read, the id is not known and the statement
+ * is forgotten. Its executions then go to the master like those of any other
+ * statement the session does not know.
+ *
+ * @param rses     Router client session
+ * @param bref     The master
+ * @param writebuf The reply data that was read
+ */
+static void rses_ps_prepared(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *writebuf)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)bref->bref_dcb->protocol;
+    MYSQL_REPLY_TRACKER *reply = &proto->reply;
+    rwsplit_ps_t *ps = bref->bref_ps_new;
+
+    if (ps->cacheable && writebuf)
+    {
+        /** A copy, the client side may modify the data that it is given */
+        size_t len = gwbuf_length(writebuf);
+        GWBUF *copy = gwbuf_alloc(len);
+
+        if (copy)
         {
-            rses->rses_load_data_sent += gwbuf_length(querybuf);
+            gwbuf_copy_data(writebuf, 0, len, GWBUF_DATA(copy));
+            gwbuf_set_type(copy, GWBUF_TYPE_MYSQL);
+            ps->reply = gwbuf_append(ps->reply, copy);
         }
-        else if (packet_type == MYSQL_COM_QUERY)
+        else
         {
-            qc_query_op_t queryop = qc_get_operation(querybuf);
-            if (queryop == QUERY_OP_LOAD)
-            {
-                rses->rses_load_active = true;
-                rses->rses_load_data_sent = 0;
-            }
+            ps->cacheable = false;
         }
+    }
 
-        rses_end_locked_router_action(rses);
-        /**
-         * If autocommit is disabled or transaction is explicitly started
-         * transaction becomes active and master gets all statements until
-         * transaction is committed and autocommit is enabled again.
-         */
-        if (rses->rses_autocommit_enabled &&
-            QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT))
+    if ((int64_t)(reply->n_replies - bref->bref_ps_mark) < 0)
+    {
+        return;
+    }
+
+    bref->bref_ps_new = NULL;
+
+    if (reply->n_replies == bref->bref_ps_mark && !reply->error && reply->stmt_id != 0)
+    {
+        if (rses->rses_ps == NULL &&
+            (rses->rses_ps = hashtable_alloc(RSES_PS_HASHSIZE, ps_hashkeyfun, ps_hashcmpfun)))
         {
-            rses->rses_autocommit_enabled = false;
+            hashtable_memory_fns(rses->rses_ps, NULL, NULL, NULL, ps_free);
+        }
 
-            if (!rses->rses_transaction_active)
+        if (rses->rses_ps)
+        {
+            void *key = (void *)(uintptr_t)reply->stmt_id;
+
+            ps->id = reply->stmt_id;
+            ps->backends[bref - rses->rses_backend_ref].conn = bref->bref_conn_seq;
+            ps->backends[bref - rses->rses_backend_ref].id = reply->stmt_id;
+
+            /** A statement the client did not close before the connection changed */
+            hashtable_delete(rses->rses_ps, key);
+
+            if (hashtable_add(rses->rses_ps, key, ps))
             {
-                rses->rses_transaction_active = true;
+                MXS_INFO("Prepared statement %u is %s.", ps->id,
+                         ps->read_only ? "read-only" : "routed to the master");
+                ps = NULL;
             }
         }
-        else if (!rses->rses_transaction_active &&
-                 QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX))
-        {
-            rses->rses_transaction_active = true;
-        }
-        /**
-         * Explicit COMMIT and ROLLBACK, implicit COMMIT.
-         */
-        if (rses->rses_autocommit_enabled && rses->rses_transaction_active &&
-            (QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
-             QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK)))
-        {
-            rses->rses_transaction_active = false;
-        }
-        else if (!rses->rses_autocommit_enabled &&
-                 QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT))
-        {
-            rses->rses_autocommit_enabled = true;
-            rses->rses_transaction_active = false;
-        }
+    }
 
-        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+    ps_free(ps);
+}
+
+/**
+ * Write a command to a backend and wait for its result
+ *
+ * @param bref The backend
+ * @param buf  The command, freed by this function
+ * @return True if the command was written
+ */
+static bool bref_write_query(backend_ref_t *bref, GWBUF *buf)
+{
+    if (buf && bref->bref_dcb->func.write(bref->bref_dcb, buf) == 1)
+    {
+        bref_set_state(bref, BREF_QUERY_ACTIVE);
+        bref_set_state(bref, BREF_WAITING_RESULT);
+        bref_start_response_timer(bref);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Execute a prepared statement in a backend that has not prepared it
+ *
+ * The COM_STMT_PREPARE of the statement is written to the backend and the
+ * execution waits in bref_ps_exec until clientReply has seen the reply and
+ * knows the id of the statement in the backend. A backend that is busy with
+ * something else does not prepare the statement, the execution goes to the
+ * master instead.
+ *
+ * @param rses     Router client session
+ * @param bref     The backend where the statement should be executed
+ * @param ps       The statement
+ * @param querybuf The COM_STMT_EXECUTE of the client
+ * @return True if the statement will be executed
+ */
+static bool rses_ps_execute_lazily(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                                   rwsplit_ps_t *ps, GWBUF *querybuf)
+{
+    if (!sescmd_cursor_is_active(&bref->bref_sescmd_cur) && !BREF_IS_WAITING_RESULT(bref) &&
+        bref->bref_pending_cmd == NULL && bref->bref_ps_exec == NULL)
+    {
+        uint64_t mark = bref_next_reply_mark(bref);
+
+        if (bref_write_query(bref, gwbuf_clone(ps->prepare)))
         {
-            if (!rses->rses_load_active)
-            {
-                uint8_t *packet = GWBUF_DATA(querybuf);
-                unsigned char ptype = packet[4];
-                size_t len = MIN(GWBUF_LENGTH(querybuf),
-                                 MYSQL_GET_PACKET_LEN((unsigned char *)querybuf->start) - 1);
-                char *data = (char *)&packet[5];
-                char *contentstr = strndup(data, MIN(len, RWSPLIT_TRACE_MSG_LEN));
-                char *qtypestr = qc_get_qtype_str(qtype);
-                MXS_INFO("> Autocommit: %s, trx is %s, cmd: %s, type: %s, stmt: %s%s %s",
-                         (rses->rses_autocommit_enabled ? "[enabled]" : "[disabled]"),
-                         (rses->rses_transaction_active ? "[open]" : "[not open]"),
-                         STRPACKETTYPE(ptype), (qtypestr == NULL ? "N/A" : qtypestr),
-                         contentstr, (querybuf->hint == NULL ? "" : ", Hint:"),
-                         (querybuf->hint == NULL ? "" : STRHINTTYPE(querybuf->hint->type)));
-                free(contentstr);
-                free(qtypestr);
-            }
-            else
-            {
-                MXS_INFO("> Processing LOAD DATA LOCAL INFILE: %lu bytes sent.",
-                         rses->rses_load_data_sent);
-            }
+            MXS_INFO("Preparing statement %u in %s before executing it.", ps->id,
+                     bref->bref_backend->backend_server->unique_name);
+            bref->bref_ps_id = ps->id;
+            bref->bref_ps_exec = gwbuf_clone(querybuf);
+            bref->bref_ps_mark = mark;
+            return true;
         }
-        /**
-         * Find out where to route the query. Result may not be clear; it is
-         * possible to have a hint for routing to a named server which can
-         * be either slave or master.
-         * If query would otherwise be routed to slave then the hint determines
-         * actual target server if it exists.
-         *
-         * route_target is a bitfield and may include :
-         * TARGET_ALL
-         * - route to all connected backend servers
-         * TARGET_SLAVE[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
-         * - route primarily according to hints, then to slave and if those
-         *   failed, eventually to master
-         * TARGET_MASTER[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
-         * - route primarily according to the hints and if they failed,
-         *   eventually to master
-         */
-        route_target = get_route_target(rses, qtype, querybuf->hint);
+    }
 
-        if (TARGET_IS_ALL(route_target))
-        {
-            /** Multiple, conflicting routing target. Return error */
-            if (TARGET_IS_MASTER(route_target) || TARGET_IS_SLAVE(route_target))
-            {
-                backend_ref_t *bref = rses->rses_backend_ref;
+    backend_ref_t *master = rses->rses_master_ref;
+    uint32_t id;
 
-                char *query_str = modutil_get_query(querybuf);
-                char *qtype_str = qc_get_qtype_str(qtype);
+    if (master && master != bref && BREF_IS_IN_USE(master) &&
+        (id = ps_backend_id(rses, master, ps)) != 0)
+    {
+        return bref_write_query(master, ps_translate(querybuf, id));
+    }
 
-                MXS_ERROR("Can't route %s:%s:\"%s\". SELECT with session data "
-                          "modification is not supported if configuration parameter "
-                          "use_sql_variables_in=all .", STRPACKETTYPE(packet_type),
-                          qtype_str, (query_str == NULL ? "(empty)" : query_str));
+    return false;
+}
 
-                MXS_INFO("Unable to route the query without losing session data "
-                         "modification from other servers. <");
+/**
+ * @brief Write the execution that waits for a statement to be prepared
+ *
+ * Called with the replies of a backend where a statement is being prepared
+ * for an execution. The replies are not for the client. Once the statement
+ * is prepared, its id in the backend is stored and the execution is written
+ * to the backend. If the statement could not be prepared, it is executed in
+ * the master.
+ *
+ * @param rses Router client session
+ * @param bref The backend
+ */
+static void rses_ps_execute_prepared(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)bref->bref_dcb->protocol;
+    MYSQL_REPLY_TRACKER *reply = &proto->reply;
 
-                while (bref != NULL && !BREF_IS_IN_USE(bref))
-                {
-                    bref++;
-                }
+    if ((int64_t)(reply->n_replies - bref->bref_ps_mark) < 0)
+    {
+        return;
+    }
 
-                if (bref != NULL && BREF_IS_IN_USE(bref))
-                {
-                    /** Create and add MySQL error to eventqueue */
-                    modutil_reply_parse_error(bref->bref_dcb,
-                                              strdup("Routing query to backend failed. "
-                                                     "See the error log for further "
-                                                     "details."), 0);
-                    succp = true;
-                }
-                else
-                {
-                    /**
-                     * If there were no available backend references
-                     * available return false - session will be closed
-                     */
-                    MXS_ERROR("Sending error message to client "
-                              "failed. Router doesn't have any "
-                              "available backends. Session will be "
-                              "closed.");
-                    succp = false;
-                }
-                if (query_str)
-                {
-                    free(query_str);
-                }
-                if (qtype_str)
-                {
-                    free(qtype_str);
-                }
-                goto retblock;
-            }
-            /**
-             * It is not sure if the session command in question requires
-             * response. Statement is examined in route_session_write.
-             * Router locking is done inside the function.
-             */
-            succp = route_session_write(rses, gwbuf_clone(querybuf), inst,
-                                        packet_type, qtype);
+    GWBUF *exec = bref->bref_ps_exec;
+    bref->bref_ps_exec = NULL;
 
-            if (succp)
-            {
-                atomic_add(&inst->stats.n_all, 1);
-            }
-            goto retblock;
-        }
+    void *key = (void *)(uintptr_t)bref->bref_ps_id;
+    rwsplit_ps_t *ps = rses->rses_ps ? (rwsplit_ps_t *)hashtable_fetch(rses->rses_ps, key) : NULL;
+    backend_ref_t *target = bref;
+    uint32_t id = 0;
+
+    if (ps && !reply->error && reply->stmt_id != 0)
+    {
+        ps->backends[bref - rses->rses_backend_ref].conn = bref->bref_conn_seq;
+        ps->backends[bref - rses->rses_backend_ref].id = reply->stmt_id;
+        id = reply->stmt_id;
     }
-    /** Lock router session */
-    if (!rses_begin_locked_router_action(rses))
+    else
     {
-        if (packet_type != MYSQL_COM_QUIT)
-        {
-            char *query_str = modutil_get_query(querybuf);
+        MXS_WARNING("Failed to prepare statement %u in %s, executing it in the master.",
+                    bref->bref_ps_id, bref->bref_backend->backend_server->unique_name);
+        bref_stop_response_timer(bref);
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+        target = rses->rses_master_ref;
 
-            MXS_ERROR("Can't route %s:%s:\"%s\" to "
-                      "backend server. Router is closed.",
-                      STRPACKETTYPE(packet_type), STRQTYPE(qtype),
-                      (query_str == NULL ? "(empty)" : query_str));
-            free(query_str);
+        if (ps && target && BREF_IS_IN_USE(target))
+        {
+            id = ps_backend_id(rses, target, ps);
         }
-        succp = false;
-        goto retblock;
     }
 
-    DCB *master_dcb = rses->rses_master_ref ? rses->rses_master_ref->bref_dcb : NULL;
+    bool written = false;
 
-    /**
-     * There is a hint which either names the target backend or
-     * hint which sets maximum allowed replication lag for the
-     * backend.
-     */
-    if (TARGET_IS_NAMED_SERVER(route_target) ||
-        TARGET_IS_RLAG_MAX(route_target))
+    if (id != 0)
     {
-        HINT *hint;
-        char *named_server = NULL;
-
-        hint = querybuf->hint;
+        GWBUF *buf = ps_translate(exec, id);
 
-        while (hint != NULL)
+        if (target == bref)
         {
-            if (hint->type == HINT_ROUTE_TO_NAMED_SERVER)
-            {
-                /**
-                 * Set the name of searched
-                 * backend server.
-                 */
-                named_server = hint->data;
-                MXS_INFO("Hint: route to server "
-                         "'%s'",
-                         named_server);
-            }
-            else if (hint->type == HINT_PARAMETER &&
-                     (strncasecmp((char *)hint->data, "max_slave_replication_lag",
-                                  strlen("max_slave_replication_lag")) == 0))
-            {
-                int val = (int)strtol((char *)hint->value, (char **)NULL, 10);
+            /** The backend already waits for the result of the execution */
+            written = buf && bref->bref_dcb->func.write(bref->bref_dcb, buf) == 1;
+        }
+        else
+        {
+            written = bref_write_query(target, buf);
+        }
+    }
 
-                if (val != 0 || errno == 0)
-                {
-                    /** Set max. acceptable replication lag value for backend srv */
-                    rlag_max = val;
-                    MXS_INFO("Hint: max_slave_replication_lag=%d", rlag_max);
-                }
-            }
-            hint = hint->next;
-        } /*< while */
+    if (!written)
+    {
+        MXS_ERROR("Failed to route the execution of prepared statement %u.", bref->bref_ps_id);
+        bref_stop_response_timer(bref);
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        bref_clear_state(bref, BREF_WAITING_RESULT);
 
-        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
+        GWBUF *err = modutil_create_mysql_err_msg(1, 0, ER_UNKNOWN_ERROR, "HY000",
+                                                  "Failed to execute the prepared statement");
+        if (err)
         {
-            rlag_max = rses_get_max_replication_lag(rses);
+            SESSION_ROUTE_REPLY(bref->bref_dcb->session, err);
         }
+    }
 
-        /** target may be master or slave */
-        btype = route_target & TARGET_SLAVE ? BE_SLAVE : BE_MASTER;
+    gwbuf_free(exec);
+}
 
-        /**
-         * Search backend server by name or replication lag.
-         * If it fails, then try to find valid slave or master.
-         */
-        succp = get_dcb(&target_dcb, rses, btype, named_server, rlag_max);
+/**
+ * @brief The delay after which a read routed to a slave is hedged
+ *
+ * The configured delay is used if there is one. Otherwise it is the 95th
+ * percentile of the latencies the slave has had, calculated at most once a
+ * second. Like avg_response_time, the cached value may be updated by several
+ * threads at the same time.
+ *
+ * @param rses Router client session
+ * @param bref The slave
+ * @return The delay in milliseconds, 0 if the read should not be hedged
+ */
+static int rses_hedge_delay(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    BACKEND *backend = bref->bref_backend;
+    SERVER *server = backend->backend_server;
+    time_t now = time(NULL);
 
-        if (!succp)
+    if (rses->rses_config.rw_hedged_reads_delay > 0)
+    {
+        return rses->rses_config.rw_hedged_reads_delay;
+    }
+
+    if (backend->hedge_delay_time != now)
+    {
+        int delay = 0;
+
+        if (server->latency)
         {
-            if (TARGET_IS_NAMED_SERVER(route_target))
-            {
-                MXS_INFO("Was supposed to route to named server "
-                         "%s but couldn't find the server in a "
-                         "suitable state.", named_server);
-            }
-            else if (TARGET_IS_RLAG_MAX(route_target))
+            TS_LATENCY_SNAPSHOT snapshot;
+            ts_latency_snapshot(server->latency, &snapshot);
+
+            if (snapshot.count > 0)
             {
-                MXS_INFO("Was supposed to route to server with "
-                         "replication lag at most %d but couldn't "
-                         "find such a slave.", rlag_max);
+                delay = (ts_latency_percentile(&snapshot, 0.95) + 999) / 1000;
             }
         }
+
+        backend->hedge_delay = delay;
+        backend->hedge_delay_time = now;
     }
-    else if (TARGET_IS_SLAVE(route_target))
-    {
-        btype = BE_SLAVE;
 
-        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
-        {
-            rlag_max = rses_get_max_replication_lag(rses);
-        }
-        /**
-         * Search suitable backend server, get DCB in target_dcb
-         */
-        succp = get_dcb(&target_dcb, rses, BE_SLAVE, NULL, rlag_max);
+    return backend->hedge_delay;
+}
 
-        if (succp)
-        {
-#if defined(SS_EXTRA_DEBUG)
-            MXS_INFO("Found DCB for slave.");
-#endif
-            atomic_add(&inst->stats.n_slave, 1);
-        }
-        else
-        {
-            MXS_INFO("Was supposed to route to slave but finding suitable one failed.");
-        }
-    }
-    else if (TARGET_IS_MASTER(route_target))
-    {
-        DCB *curr_master_dcb = NULL;
+/**
+ * @brief Check whether a read can be hedged
+ *
+ * Only autocommit reads that are routed to a slave are hedged. The slave must
+ * be idle so that the first reply to it is the reply to the read.
+ *
+ * @param rses        Router client session
+ * @param bref        The slave the read is routed to
+ * @param target      The route target of the read
+ * @param packet_type The command
+ * @param qtype       The type of the query
+ * @return True if the read can be hedged
+ */
+static bool rses_hedge_eligible(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                                route_target_t target, mysql_server_cmd_t packet_type,
+                                qc_query_type_t qtype)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)bref->bref_dcb->protocol;
+
+    return rses->rses_config.rw_hedged_reads && target == TARGET_SLAVE &&
+           packet_type == MYSQL_COM_QUERY && bref != rses->rses_master_ref &&
+           rses->rses_hedge_query == NULL && rses->rses_autocommit_enabled &&
+           !rses->rses_transaction_active && !rses->rses_multi_active &&
+           !rses->rses_load_active && query_is_read_only(qtype) &&
+           !BREF_IS_WAITING_RESULT(bref) && !BREF_IS_DISCARDING(bref) &&
+           proto->protocol_auth_state == MYSQL_IDLE;
+}
 
-        succp = get_dcb(&curr_master_dcb, rses, BE_MASTER, NULL, MAX_RLAG_UNDEFINED);
+/**
+ * @brief Start following a read that was routed to a slave
+ *
+ * @param rses     Router client session
+ * @param bref     The slave
+ * @param querybuf The read
+ * @param mark     The reply mark of the slave before the read was written
+ * @return True if the read can be hedged
+ */
+static bool rses_hedge_start(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                             GWBUF *querybuf, uint64_t mark)
+{
+    if ((rses->rses_hedge_query = gwbuf_clone(querybuf)) == NULL)
+    {
+        return false;
+    }
 
-        if (succp && master_dcb == curr_master_dcb)
-        {
-            atomic_add(&inst->stats.n_master, 1);
-            target_dcb = master_dcb;
-        }
-        else
-        {
-            /** The original master is not available, we can't route the write */
-            if (rses->rses_config.rw_master_failure_mode == RW_ERROR_ON_WRITE)
-            {
-                succp = send_readonly_error(rses->client_dcb);
+    rses->rses_hedge_primary = bref;
+    rses->rses_hedge_secondary = NULL;
+    bref->bref_hedge_mark = mark;
+    return true;
+}
 
-                if (rses->rses_master_ref && BREF_IS_IN_USE(rses->rses_master_ref))
-                {
-                    close_failed_bref(rses->rses_master_ref, true);
-                    RW_CHK_DCB(rses->rses_master_ref, rses->rses_master_ref->bref_dcb);
-                    dcb_close(rses->rses_master_ref->bref_dcb);
-                    RW_CLOSE_BREF(rses->rses_master_ref);
-                }
-            }
-            else
-            {
-                log_master_routing_failure(rses, succp, master_dcb, curr_master_dcb);
-                succp = false;
-            }
+/**
+ * @brief Stop following the hedged read
+ *
+ * The timer is not cancelled, it does nothing once the read is gone.
+ *
+ * @param rses Router client session
+ */
+static void rses_hedge_end(ROUTER_CLIENT_SES *rses)
+{
+    gwbuf_free(rses->rses_hedge_query);
+    rses->rses_hedge_query = NULL;
+    rses->rses_hedge_primary = NULL;
+    rses->rses_hedge_secondary = NULL;
+}
 
-            rses_end_locked_router_action(rses);
-            goto retblock;
-        }
-    }
+/**
+ * @brief Choose the slave a read is hedged to
+ *
+ * The slave must be idle and meet the same replication lag and causal read
+ * requirements as the slave the read was routed to. Of those, the one with
+ * the lowest average response time is chosen.
+ *
+ * @param rses    Router client session
+ * @param primary The slave the read was routed to
+ * @return The slave or NULL if there is none
+ */
+static backend_ref_t *rses_hedge_choose(ROUTER_CLIENT_SES *rses, backend_ref_t *primary)
+{
+    int rlag_max = rses_get_max_replication_lag(rses);
+    backend_ref_t *best = NULL;
 
-    if (succp) /*< Have DCB of the target backend */
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        backend_ref_t *bref;
-        sescmd_cursor_t *scur;
-
-        bref = get_bref_from_dcb(rses, target_dcb);
-        scur = &bref->bref_sescmd_cur;
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER *server = bref->bref_backend->backend_server;
 
-        ss_dassert(target_dcb != NULL);
-
-        MXS_INFO("Route query to %s \t%s:%d <",
-                 (SERVER_IS_MASTER(bref->bref_backend->backend_server) ? "master"
-                  : "slave"), bref->bref_backend->backend_server->name,
-                 bref->bref_backend->backend_server->port);
-        /**
-         * Store current stmt if execution of previous session command
-         * hasn't completed yet.
-         */
-        if (sescmd_cursor_is_active(scur) && bref != rses->rses_master_ref)
+        if (bref == primary || bref == rses->rses_master_ref || !BREF_IS_IN_USE(bref) ||
+            !SERVER_IS_SLAVE(server) || SERVER_IS_DRAINING(server) ||
+            BREF_IS_WAITING_RESULT(bref) || BREF_IS_DISCARDING(bref) ||
+            sescmd_cursor_is_active(&bref->bref_sescmd_cur) ||
+            bref->bref_pending_cmd != NULL || bref->bref_ps_exec != NULL ||
+            ((MySQLProtocol *)bref->bref_dcb->protocol)->protocol_auth_state != MYSQL_IDLE ||
+            !rses_causal_read_ok(rses, server))
         {
-            bref->bref_pending_cmd = gwbuf_append(bref->bref_pending_cmd, gwbuf_clone(querybuf));
-            rses_end_locked_router_action(rses);
-            goto retblock;
+            continue;
         }
 
-        if ((ret = target_dcb->func.write(target_dcb, gwbuf_clone(querybuf))) == 1)
-        {
-            backend_ref_t *bref;
-
-            atomic_add(&inst->stats.n_queries, 1);
-            /**
-             * Add one query response waiter to backend reference
-             */
-            bref = get_bref_from_dcb(rses, target_dcb);
-            bref_set_state(bref, BREF_QUERY_ACTIVE);
-            bref_set_state(bref, BREF_WAITING_RESULT);
-        }
-        else
+        if (rlag_max != MAX_RLAG_UNDEFINED &&
+            (server->rlag == MAX_RLAG_NOT_AVAILABLE || server->rlag > rlag_max))
         {
-            MXS_ERROR("Routing query failed.");
-            succp = false;
+            continue;
         }
-    }
-    rses_end_locked_router_action(rses);
-
-retblock :
-#if defined(SS_DEBUG2)
-    {
-        char *canonical_query_str;
-
-        canonical_query_str = skygw_get_canonical(querybuf);
 
-        if (canonical_query_str != NULL)
+        if (best == NULL ||
+            bref->bref_backend->avg_response_time < best->bref_backend->avg_response_time)
         {
-            MXS_INFO("Canonical version: %s", canonical_query_str);
-            free(canonical_query_str);
+            best = bref;
         }
     }
-#endif
-    return succp;
+
+    return best;
 }
 
 /**
- * @node Acquires lock to router client session if it is not closed.
- *
- * Parameters:
- * @param rses - in, use
- *
- *
- * @return true if router session was not closed. If return value is true
- * it means that router is locked, and must be unlocked later. False, if
- * router was closed before lock was acquired.
- *
+ * @brief Hedge a read whose slave has not replied in time
  *
- * @details (write detailed description here)
+ * Called by the timer of the session. The read is written to a second slave
+ * and the slave that replies first gets to send the reply to the client.
  *
+ * @param data Router client session
  */
-static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES *rses)
+static void rses_hedge_timeout(void *data)
 {
-    bool succp = false;
+    ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *)data;
 
-    if (rses == NULL)
+    if (!rses_begin_locked_router_action(rses))
     {
-        return false;
+        return;
     }
 
-    CHK_CLIENT_RSES(rses);
+    backend_ref_t *primary = rses->rses_hedge_primary;
 
-    if (rses->rses_closed)
+    if (rses->rses_hedge_query && rses->rses_hedge_secondary == NULL &&
+        BREF_IS_IN_USE(primary) && BREF_IS_QUERY_ACTIVE(primary))
     {
+        backend_ref_t *bref = rses_hedge_choose(rses, primary);
 
-        goto return_succp;
-    }
-    spinlock_acquire(&rses->rses_lock);
-    if (rses->rses_closed)
-    {
-        spinlock_release(&rses->rses_lock);
-        goto return_succp;
+        if (bref)
+        {
+            uint64_t mark = bref_next_reply_mark(bref);
+
+            if (bref_write_query(bref, gwbuf_clone(rses->rses_hedge_query)))
+            {
+                MXS_INFO("%s has not replied, hedging the read to %s.",
+                         primary->bref_backend->backend_server->unique_name,
+                         bref->bref_backend->backend_server->unique_name);
+                bref->bref_hedge_mark = mark;
+                rses->rses_hedge_secondary = bref;
+                atomic_add(&rses->router->stats.n_hedged, 1);
+            }
+        }
+
+        if (rses->rses_hedge_secondary == NULL)
+        {
+            /** The first slave is left to reply alone */
+            rses_hedge_end(rses);
+        }
     }
-    succp = true;
 
-return_succp:
-    return succp;
+    rses_end_locked_router_action(rses);
 }
 
-/** to be inline'd */
-
 /**
- * @node Releases router client session lock.
- *
- * Parameters:
- * @param rses - <usage>
- *          <description>
- *
- * @return void
- *
+ * @brief Arm the timer that hedges the read
  *
- * @details (write detailed description here)
+ * Called without holding the lock of the session as re-arming the timer
+ * waits for a callback that is running in another thread.
  *
+ * @param rses  Router client session
+ * @param delay Delay in milliseconds
  */
-static void rses_end_locked_router_action(ROUTER_CLIENT_SES *rses)
+static void rses_hedge_arm(ROUTER_CLIENT_SES *rses, int delay)
 {
-    CHK_CLIENT_RSES(rses);
-    spinlock_release(&rses->rses_lock);
+    if (rses->rses_hedge_timer.fn == NULL)
+    {
+        timer_init(&rses->rses_hedge_timer, rses_hedge_timeout, rses);
+    }
+
+    poll_add_timer(&rses->rses_hedge_timer, delay, 0);
 }
 
 /**
- * Diagnostics routine
+ * @brief Handle the first reply to the hedged read
  *
- * Print query router statistics to the DCB passed in
+ * The backend that replied first wins and the reply of the other one is
+ * discarded when it arrives.
  *
- * @param   instance    The router instance
- * @param   dcb     The DCB for diagnostic output
+ * @param rses Router client session
+ * @param bref The backend that replied
  */
-static void diagnostic(ROUTER *instance, DCB *dcb)
+static void rses_hedge_reply(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
 {
-    ROUTER_CLIENT_SES *router_cli_ses;
-    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)instance;
-    int i = 0;
-    BACKEND *backend;
-    char *weightby;
+    backend_ref_t *other = bref == rses->rses_hedge_primary ?
+                           rses->rses_hedge_secondary : rses->rses_hedge_primary;
 
-    spinlock_acquire(&router->lock);
-    router_cli_ses = router->connections;
-    while (router_cli_ses)
+    if (other && BREF_IS_IN_USE(other) && BREF_IS_WAITING_RESULT(other))
     {
-        i++;
-        router_cli_ses = router_cli_ses->next;
+        MXS_INFO("%s replied first to the hedged read, discarding the reply of %s.",
+                 bref->bref_backend->backend_server->unique_name,
+                 other->bref_backend->backend_server->unique_name);
+        bref_set_state(other, BREF_DISCARD_REPLY);
     }
-    spinlock_release(&router->lock);
-
-    double master_pct = 0.0, slave_pct = 0.0, all_pct = 0.0;
 
-    if (router->stats.n_queries > 0)
+    if (bref == rses->rses_hedge_secondary)
     {
-        master_pct = ((double)router->stats.n_master / (double)router->stats.n_queries) * 100.0;
-        slave_pct = ((double)router->stats.n_slave / (double)router->stats.n_queries) * 100.0;
-        all_pct = ((double)router->stats.n_all / (double)router->stats.n_queries) * 100.0;
+        atomic_add(&rses->router->stats.n_hedge_won, 1);
     }
 
-    dcb_printf(dcb, "\tNumber of router sessions:           	%d\n",
-               router->stats.n_sessions);
-    dcb_printf(dcb, "\tCurrent no. of router sessions:      	%d\n", i);
-    dcb_printf(dcb, "\tNumber of queries forwarded:          	%d\n",
-               router->stats.n_queries);
-    dcb_printf(dcb, "\tNumber of queries forwarded to master:	%d (%.2f%%)\n",
-               router->stats.n_master, master_pct);
-    dcb_printf(dcb, "\tNumber of queries forwarded to slave: 	%d (%.2f%%)\n",
-               router->stats.n_slave, slave_pct);
-    dcb_printf(dcb, "\tNumber of queries forwarded to all:   	%d (%.2f%%)\n",
-               router->stats.n_all, all_pct);
-
-    if ((weightby = serviceGetWeightingParameter(router->service)) != NULL)
-    {
-        dcb_printf(dcb, "\tConnection distribution based on %s "
-                   "server parameter.\n",
-                   weightby);
-        dcb_printf(dcb, "\t\tServer               Target %%    Connections  "
-                   "Operations\n");
-        dcb_printf(dcb, "\t\t                               Global  Router\n");
-        for (i = 0; router->servers[i]; i++)
-        {
-            backend = router->servers[i];
-            dcb_printf(dcb, "\t\t%-20s %3.1f%%     %-6d  %-6d  %d\n",
-                       backend->backend_server->unique_name, (float)backend->weight / 10,
-                       backend->backend_server->stats.n_current, backend->backend_conn_count,
-                       backend->backend_server->stats.n_current_ops);
-        }
-    }
+    rses_hedge_end(rses);
 }
 
 /**
- * Client Reply routine
+ * @brief Drain the reply of a backend that lost the hedged read
  *
- * The routine will reply to client for session change with master server data
+ * Once the whole reply has been read, the commands that were queued for the
+ * backend while it was draining are sent to it.
  *
- * @param   instance    The router instance
- * @param   router_session  The router session
- * @param   backend_dcb The backend DCB
- * @param   queue       The GWBUF with reply data
+ * @param rses Router client session
+ * @param bref The backend
  */
-static void clientReply(ROUTER *instance, void *router_session, GWBUF *writebuf,
-                        DCB *backend_dcb)
+static void rses_hedge_drain(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
 {
-    DCB *client_dcb;
-    ROUTER_INSTANCE *router_inst;
-    ROUTER_CLIENT_SES *router_cli_ses;
-    sescmd_cursor_t *scur = NULL;
-    backend_ref_t *bref;
+    MYSQL_REPLY_TRACKER *reply = &((MySQLProtocol *)bref->bref_dcb->protocol)->reply;
 
-    router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
-    router_inst = (ROUTER_INSTANCE *)instance;
-    CHK_CLIENT_RSES(router_cli_ses);
+    if (BREF_IS_QUERY_ACTIVE(bref))
+    {
+        bref_stop_response_timer(bref);
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+    }
 
-    /**
-     * Lock router client session for secure read of router session members.
-     * Note that this could be done without lock by using version #
-     */
-    if (!rses_begin_locked_router_action(router_cli_ses))
+    if ((int64_t)(reply->n_replies - bref->bref_hedge_mark) < 0)
     {
-        print_error_packet(router_cli_ses, writebuf, backend_dcb);
-        goto lock_failed;
+        return;
     }
-    /** Holding lock ensures that router session remains open */
-    ss_dassert(backend_dcb->session != NULL);
-    client_dcb = backend_dcb->session->client_dcb;
 
-    /** Unlock */
-    rses_end_locked_router_action(router_cli_ses);
-    /**
-     * 1. Check if backend received reply to sescmd.
-     * 2. Check sescmd's state whether OK_PACKET has been
-     *    sent to client already and if not, lock property cursor,
-     *    reply to client, and move property cursor forward. Finally
-     *    release the lock.
-     * 3. If reply for this sescmd is sent, lock property cursor
-     *    and
-     */
-    if (client_dcb == NULL)
+    bref_clear_state(bref, BREF_DISCARD_REPLY);
+    sescmd_cursor_t *scur = &bref->bref_sescmd_cur;
+
+    if (scur->scmd_cur_ptr_property && *scur->scmd_cur_ptr_property)
     {
-        gwbuf_free(writebuf);
-        /** Log that client was closed before reply */
-        goto lock_failed;
+        /** Session commands were routed while the reply was drained */
+        if (!execute_sescmd_in_backend(bref))
+        {
+            MXS_ERROR("Failed to execute session command in %s.",
+                      bref->bref_backend->backend_server->unique_name);
+        }
     }
-    /** Lock router session */
-    if (!rses_begin_locked_router_action(router_cli_ses))
+    else
     {
-        /** Log to debug that router was closed */
-        goto lock_failed;
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+
+        if (bref->bref_pending_cmd)
+        {
+            GWBUF *buf = bref->bref_pending_cmd;
+            bref->bref_pending_cmd = NULL;
+
+            if (bref_write_query(bref, buf))
+            {
+                atomic_add(&rses->router->stats.n_queries, 1);
+            }
+            else
+            {
+                MXS_ERROR("Routing query failed.");
+            }
+        }
     }
-    bref = get_bref_from_dcb(router_cli_ses, backend_dcb);
+}
 
-#if !defined(FOR_BUG548_FIX_ONLY)
-    /** This makes the issue becoming visible in poll.c */
-    if (bref == NULL)
+/**
+ * @brief Handle the failure of a backend that takes part in a hedged read
+ *
+ * @param rses Router client session
+ * @param bref The failed backend
+ * @return True if the client does not wait for the reply of the backend
+ */
+static bool rses_hedge_failed(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    if (BREF_IS_DISCARDING(bref))
     {
-        /** Unlock router session */
-        rses_end_locked_router_action(router_cli_ses);
-        goto lock_failed;
+        bref_clear_state(bref, BREF_DISCARD_REPLY);
+        return true;
     }
-#endif
 
-    CHK_BACKEND_REF(bref);
-    scur = &bref->bref_sescmd_cur;
-    /**
-     * Active cursor means that reply is from session command
-     * execution.
-     */
-    if (sescmd_cursor_is_active(scur))
+    if (rses->rses_hedge_query &&
+        (bref == rses->rses_hedge_primary || bref == rses->rses_hedge_secondary))
     {
-        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_ERR) &&
-            MYSQL_IS_ERROR_PACKET(((uint8_t *)GWBUF_DATA(writebuf))))
-        {
-            uint8_t *buf = (uint8_t *)GWBUF_DATA((scur->scmd_cur_cmd->my_sescmd_buf));
-            uint8_t *replybuf = (uint8_t *)GWBUF_DATA(writebuf);
-            size_t len = MYSQL_GET_PACKET_LEN(buf);
-            size_t replylen = MYSQL_GET_PACKET_LEN(replybuf);
-            char *err = strndup(&((char *)replybuf)[8], 5);
-            char *replystr = strndup(&((char *)replybuf)[13], replylen - 4 - 5);
+        backend_ref_t *other = bref == rses->rses_hedge_primary ?
+                               rses->rses_hedge_secondary : rses->rses_hedge_primary;
+        bool replied_by_other = other && BREF_IS_IN_USE(other) && BREF_IS_WAITING_RESULT(other);
 
-            ss_dassert(len + 4 == GWBUF_LENGTH(scur->scmd_cur_cmd->my_sescmd_buf));
+        /** If the read was hedged, the other backend is left to reply alone */
+        rses_hedge_end(rses);
+        return replied_by_other;
+    }
 
-            MXS_ERROR("Failed to execute session command in %s:%d. Error was: %s %s",
-                      bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port, err, replystr);
-            free(err);
-            free(replystr);
-        }
+    return false;
+}
 
-        if (GWBUF_IS_TYPE_SESCMD_RESPONSE(writebuf))
+/**
+ * Fold a reply into a checksum of replies
+ *
+ * @param sum The checksum so far
+ * @param buf The reply
+ * @return The FNV-1a hash of the bytes of the replies
+ */
+static uint64_t trx_checksum(uint64_t sum, GWBUF *buf)
+{
+    for (; buf; buf = buf->next)
+    {
+        sum = mxs_fnv1a64(sum, GWBUF_DATA(buf), GWBUF_LENGTH(buf));
+    }
+
+    return sum;
+}
+
+/**
+ * Check whether a backend has sent all of the reply to the last command
+ *
+ * @param bref The backend
+ * @return True if nothing of the reply is left to read
+ */
+static bool bref_reply_complete(backend_ref_t *bref)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)bref->bref_dcb->protocol;
+    return MYSQL_REPLY_IS_COMPLETE(&proto->reply) && bref->bref_dcb->dcb_readqueue == NULL;
+}
+
+/**
+ * Forget the recorded statements of the transaction
+ *
+ * @param rses Router client session
+ */
+static void rses_trx_log_reset(ROUTER_CLIENT_SES *rses)
+{
+    for (int i = 0; i < rses->rses_trx_n_log; i++)
+    {
+        gwbuf_free(rses->rses_trx_log[i]);
+    }
+
+    rses->rses_trx_n_log = 0;
+    rses->rses_trx_log_bytes = 0;
+    rses->rses_trx_checksum = MXS_FNV1A64_INIT;
+    rses->rses_trx_in_flight = false;
+    rses->rses_trx_partial = false;
+}
+
+/**
+ * @brief Start or stop recording the transaction before a statement is routed
+ *
+ * The recording starts with the statement that opens a transaction and ends
+ * when the transaction does. A COMMIT ends it even if autocommit is disabled
+ * as the outcome of a COMMIT that was lost with the master is not known. Only
+ * plain queries that do not commit implicitly can be replayed: other commands
+ * refer to state that a new master does not have and a session command in the
+ * middle of the transaction would be replayed out of order from the history.
+ *
+ * This must be called with router lock.
+ *
+ * @param rses           Router client session
+ * @param querybuf       The statement
+ * @param qtype          Type of the statement
+ * @param packet_type    The command
+ * @param trx_was_active Whether a transaction was open before the statement
+ * @param sescmd         Whether the statement is a session command
+ */
+static void rses_trx_log_update(ROUTER_CLIENT_SES *rses, GWBUF *querybuf, qc_query_type_t qtype,
+                                mysql_server_cmd_t packet_type, bool trx_was_active, bool sescmd)
+{
+    if (!rses->rses_config.rw_trx_replay)
+    {
+        return;
+    }
+
+    if (!rses->rses_transaction_active || !trx_was_active || rses->rses_trx_ended)
+    {
+        rses_trx_log_reset(rses);
+        rses->rses_trx_recording = rses->rses_transaction_active;
+    }
+
+    rses->rses_trx_ended = false;
+
+    if (!rses->rses_trx_recording)
+    {
+        return;
+    }
+
+    if (QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) || QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK))
+    {
+        /** With autocommit disabled the next statement starts a new transaction */
+        rses_trx_log_reset(rses);
+        rses->rses_trx_recording = false;
+        rses->rses_trx_ended = true;
+    }
+    else if (sescmd ? rses->rses_trx_n_log > 0 :
+             packet_type != MYSQL_COM_QUERY || rses->rses_load_active || rses->rses_multi_active ||
+             (qc_get_operation(querybuf) & (QUERY_OP_TRUNCATE | QUERY_OP_ALTER | QUERY_OP_CREATE |
+                                            QUERY_OP_DROP | QUERY_OP_GRANT | QUERY_OP_REVOKE)))
+    {
+        MXS_INFO("The transaction can not be replayed, it is no longer recorded.");
+        rses_trx_log_reset(rses);
+        rses->rses_trx_recording = false;
+    }
+}
+
+/**
+ * @brief Record a statement of the transaction that was written to the master
+ *
+ * A transaction that grows too large, or a statement that is sent before the
+ * master has replied to the previous one, ends the recording.
+ *
+ * This must be called with router lock.
+ *
+ * @param rses     Router client session
+ * @param querybuf The statement
+ */
+static void rses_trx_log_add(ROUTER_CLIENT_SES *rses, GWBUF *querybuf)
+{
+    size_t len = gwbuf_length(querybuf);
+
+    if (rses->rses_trx_in_flight ||
+        rses->rses_trx_log_bytes + len > (size_t)rses->rses_config.rw_trx_replay_max_size)
+    {
+        MXS_INFO("The transaction is too large or pipelined, it can not be replayed.");
+        rses_trx_log_reset(rses);
+        rses->rses_trx_recording = false;
+        return;
+    }
+
+    if (rses->rses_trx_n_log == rses->rses_trx_log_size)
+    {
+        int size = rses->rses_trx_log_size ? rses->rses_trx_log_size * 2 : 8;
+        GWBUF **log = realloc(rses->rses_trx_log, size * sizeof(GWBUF *));
+
+        if (log == NULL)
         {
-            /**
-             * Discard all those responses that have already been sent to
-             * the client. Return with buffer including response that
-             * needs to be sent to client or NULL.
-             */
-            bool rconn = false;
-            writebuf = sescmd_cursor_process_replies(writebuf, bref, &rconn);
+            rses_trx_log_reset(rses);
+            rses->rses_trx_recording = false;
+            return;
+        }
 
-            if (rconn && !router_inst->rwsplit_config.rw_disable_sescmd_hist)
-            {
-                select_connect_backend_servers(
-                    &router_cli_ses->rses_master_ref, router_cli_ses->rses_backend_ref,
-                    router_cli_ses->rses_nbackends,
-                    router_cli_ses->rses_config.rw_max_slave_conn_count,
-                    router_cli_ses->rses_config.rw_max_slave_replication_lag,
-                    router_cli_ses->rses_config.rw_slave_select_criteria,
-                    router_cli_ses->rses_master_ref->bref_dcb->session,
-                    router_cli_ses->router,
-                    true);
-            }
+        rses->rses_trx_log = log;
+        rses->rses_trx_log_size = size;
+    }
+
+    rses->rses_trx_log[rses->rses_trx_n_log++] = gwbuf_clone(querybuf);
+    rses->rses_trx_log_bytes += len;
+    rses->rses_trx_in_flight = true;
+    rses->rses_trx_partial = false;
+}
+
+/**
+ * @brief Fold a reply of the master into the checksum of the transaction
+ *
+ * This must be called with router lock.
+ *
+ * @param rses     Router client session
+ * @param bref     The master
+ * @param writebuf The reply that is sent to the client
+ */
+static void rses_trx_log_reply(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *writebuf)
+{
+    rses->rses_trx_checksum = trx_checksum(rses->rses_trx_checksum, writebuf);
+
+    if (bref_reply_complete(bref))
+    {
+        rses->rses_trx_in_flight = false;
+        rses->rses_trx_partial = false;
+    }
+    else
+    {
+        rses->rses_trx_partial = true;
+    }
+}
+
+/**
+ * @brief Start waiting for a new master after the master was lost
+ *
+ * A recorded transaction is replayed if the master did not execute a COMMIT,
+ * which ends the recording, and the client has not received a part of the
+ * reply to the statement that was being executed. The replay is started by
+ * the timer that the caller arms once it has released the router lock.
+ *
+ * This must be called with router lock.
+ *
+ * @param rses Router client session
+ * @return True if the transaction will be replayed
+ */
+static bool rses_replay_start(ROUTER_CLIENT_SES *rses)
+{
+    if (!rses->rses_config.rw_trx_replay || rses->rses_config.rw_disable_sescmd_hist ||
+        !rses->rses_trx_recording || rses->rses_trx_partial)
+    {
+        return false;
+    }
+
+    if (rses->rses_replay_state == RSES_REPLAY_NONE)
+    {
+        rses->rses_replay_deadline = time(NULL) + rses->rses_config.rw_trx_replay_timeout;
+    }
+
+    MXS_NOTICE("Master lost in the middle of a transaction of %d statements, "
+               "waiting for a new master to replay it on.", rses->rses_trx_n_log);
+    rses->rses_replay_state = RSES_REPLAY_WAIT;
+    return true;
+}
+
+/**
+ * @brief Arm the timer that looks for the new master
+ *
+ * Called without holding the lock of the session as re-arming the timer
+ * waits for a callback that is running in another thread.
+ *
+ * @param rses Router client session
+ */
+static void rses_replay_arm(ROUTER_CLIENT_SES *rses)
+{
+    if (rses->rses_replay_timer.fn == NULL)
+    {
+        timer_init(&rses->rses_replay_timer, rses_replay_timeout, rses);
+    }
+
+    poll_add_timer(&rses->rses_replay_timer, RWSPLIT_REPLAY_INTERVAL, 0);
+}
+
+/**
+ * @brief Give up the replay and close the session
+ *
+ * This must be called with router lock.
+ *
+ * @param rses Router client session
+ */
+static void rses_replay_fail(ROUTER_CLIENT_SES *rses)
+{
+    rses->rses_replay_state = RSES_REPLAY_NONE;
+    rses->rses_trx_recording = false;
+    rses_trx_log_reset(rses);
+    gwbuf_free(rses->rses_replay_queue);
+    rses->rses_replay_queue = NULL;
+    atomic_add(&rses->router->stats.n_trx_replay_failed, 1);
+
+    GWBUF *err = modutil_create_mysql_err_msg(1, 0, ER_UNKNOWN_ERROR, "HY000",
+                                              "Lost connection to the master in a transaction.");
+
+    if (err)
+    {
+        rses->client_dcb->func.write(rses->client_dcb, err);
+    }
+
+    poll_fake_hangup_event(rses->client_dcb);
+}
+
+/**
+ * @brief Write the next statement of the transaction to the new master
+ *
+ * Once the completed statements have been replayed and their replies match
+ * the ones the client got, the statement that the client is waiting for is
+ * written like any other one and its reply goes to the client.
+ *
+ * This must be called with router lock.
+ *
+ * @param rses Router client session
+ * @return False if replaying the transaction failed
+ */
+static bool rses_replay_next(ROUTER_CLIENT_SES *rses)
+{
+    backend_ref_t *bref = rses->rses_master_ref;
+    int n_done = rses->rses_trx_in_flight ? rses->rses_trx_n_log - 1 : rses->rses_trx_n_log;
+
+    if (rses->rses_replay_pos < n_done)
+    {
+        if (!bref_write_query(bref, gwbuf_clone(rses->rses_trx_log[rses->rses_replay_pos++])))
+        {
+            MXS_ERROR("Failed to replay the transaction on '%s', writing to the server failed. "
+                      "Closing the session.", bref->bref_backend->backend_server->unique_name);
+            return false;
         }
-        /**
-         * If response will be sent to client, decrease waiter count.
-         * This applies to session commands only. Counter decrement
-         * for other type of queries is done outside this block.
-         */
+        return true;
+    }
 
-        /** Set response status as replied */
-        bref_clear_state(bref, BREF_WAITING_RESULT);
+    if (rses->rses_replay_checksum != rses->rses_trx_checksum)
+    {
+        MXS_ERROR("Failed to replay the transaction on '%s', the results differ from the "
+                  "original ones. Closing the session.",
+                  bref->bref_backend->backend_server->unique_name);
+        return false;
     }
-    /**
-     * Clear BREF_QUERY_ACTIVE flag and decrease waiter counter.
-     * This applies for queries  other than session commands.
+
+    rses->rses_replay_state = RSES_REPLAY_NONE;
+    atomic_add(&rses->router->stats.n_trx_replayed, 1);
+    MXS_NOTICE("Replayed a transaction of %d statements on '%s'.", n_done,
+               bref->bref_backend->backend_server->unique_name);
+
+    if (rses->rses_trx_in_flight &&
+        !bref_write_query(bref, gwbuf_clone(rses->rses_trx_log[n_done])))
+    {
+        MXS_ERROR("Failed to route the statement that was being executed when the master "
+                  "was lost to '%s'. Closing the session.",
+                  bref->bref_backend->backend_server->unique_name);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Find the new master and connect to it
+ *
+ * The session command history is executed on a new connection before the
+ * transaction.
+ *
+ * This must be called with router lock.
+ *
+ * @param rses Router client session
+ * @return The master once it is connected and idle, NULL if not yet
+ */
+static backend_ref_t *rses_replay_master(ROUTER_CLIENT_SES *rses)
+{
+    BACKEND *master = get_cached_root_master(rses->router, rses->rses_backend_ref,
+                                             rses->rses_nbackends);
+    backend_ref_t *bref = NULL;
+
+    for (int i = 0; master && i < rses->rses_nbackends; i++)
+    {
+        if (rses->rses_backend_ref[i].bref_backend == master)
+        {
+            bref = &rses->rses_backend_ref[i];
+        }
+    }
+
+    if (bref == NULL)
+    {
+        return NULL;
+    }
+
+    if (!BREF_IS_IN_USE(bref))
+    {
+        if (!bref_valid_for_connect(bref) ||
+            !connect_server(bref, rses->client_dcb->session, true))
+        {
+            return NULL;
+        }
+    }
+
+    rses->rses_master_ref = bref;
+
+    if (sescmd_cursor_is_active(&bref->bref_sescmd_cur) ||
+        BREF_IS_WAITING_RESULT(bref) || BREF_IS_DISCARDING(bref))
+    {
+        return NULL;
+    }
+
+    return bref;
+}
+
+/**
+ * @brief Route the queries that the client sent during the replay
+ *
+ * Called without holding the lock of the session.
+ *
+ * @param inst Router instance
+ * @param rses Router client session
+ */
+static void rses_replay_release(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses)
+{
+    while (rses_begin_locked_router_action(rses))
+    {
+        GWBUF *querybuf = NULL;
+
+        if (rses->rses_replay_state == RSES_REPLAY_NONE && rses->rses_replay_queue)
+        {
+            querybuf = gwbuf_split(&rses->rses_replay_queue, GWBUF_LENGTH(rses->rses_replay_queue));
+        }
+
+        rses_end_locked_router_action(rses);
+
+        if (querybuf == NULL)
+        {
+            break;
+        }
+
+        if (routeQuery((ROUTER *)inst, rses, querybuf) == 0)
+        {
+            poll_fake_hangup_event(rses->client_dcb);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Look for the new master and start the replay on it
+ *
+ * @param data The router client session
+ */
+static void rses_replay_timeout(void *data)
+{
+    ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *)data;
+    bool release = false;
+
+    if (!rses_begin_locked_router_action(rses))
+    {
+        return;
+    }
+
+    if (rses->rses_replay_state == RSES_REPLAY_WAIT)
+    {
+        backend_ref_t *bref = rses_replay_master(rses);
+
+        if (bref)
+        {
+            rses->rses_replay_state = RSES_REPLAY_RUN;
+            rses->rses_replay_pos = 0;
+            rses->rses_replay_checksum = MXS_FNV1A64_INIT;
+
+            if (!rses_replay_next(rses))
+            {
+                rses_replay_fail(rses);
+            }
+            else
+            {
+                release = rses->rses_replay_state == RSES_REPLAY_NONE;
+            }
+        }
+        else if (time(NULL) > rses->rses_replay_deadline)
+        {
+            MXS_ERROR("Failed to replay the transaction, no master was found in %d seconds. "
+                      "Closing the session.", rses->rses_config.rw_trx_replay_timeout);
+            rses_replay_fail(rses);
+        }
+        else
+        {
+            poll_add_timer(&rses->rses_replay_timer, RWSPLIT_REPLAY_INTERVAL, 0);
+        }
+    }
+
+    rses_end_locked_router_action(rses);
+
+    if (release)
+    {
+        rses_replay_release(rses->router, rses);
+    }
+}
+
+/**
+ * @brief Hold a query of the client until the transaction has been replayed
+ *
+ * @param rses     Router client session
+ * @param querybuf The query
+ * @return True if the query was held
+ */
+static bool rses_replay_hold(ROUTER_CLIENT_SES *rses, GWBUF *querybuf)
+{
+    bool held = false;
+
+    if (rses_begin_locked_router_action(rses))
+    {
+        if (rses->rses_replay_state != RSES_REPLAY_NONE)
+        {
+            rses->rses_replay_queue = gwbuf_append(rses->rses_replay_queue, querybuf);
+            held = true;
+        }
+        rses_end_locked_router_action(rses);
+    }
+
+    return held;
+}
+
+/**
+ * Routing function. Find out query type, backend type, and target DCB(s).
+ * Then route query to found target(s).
+ * @param inst      router instance
+ * @param rses      router session
+ * @param querybuf  GWBUF including the query
+ *
+ * @return true if routing succeed or if it failed due to unsupported query.
+ * false if backend failure was encountered.
+ */
+static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                              GWBUF *querybuf)
+{
+    qc_query_type_t qtype = QUERY_TYPE_UNKNOWN;
+    mysql_server_cmd_t packet_type = MYSQL_COM_UNDEFINED;
+    uint8_t *packet;
+    size_t packet_len;
+    int ret = 0;
+    DCB *target_dcb = NULL;
+    route_target_t route_target;
+    bool succp = false;
+    int rlag_max = MAX_RLAG_UNDEFINED;
+    backend_type_t btype; /*< target backend type */
+    rwsplit_ps_t *ps = NULL; /*< prepared statement of an execution */
+    int hedge_delay = 0; /*< milliseconds before the read is hedged, 0 for no hedging */
+    bool trx_was_active = rses->rses_transaction_active;
+    bool ro_trx_pin = false; /*< use the target for the rest of the read-only transaction */
+    char *rule_server = NULL; /*< the server that a routing rule named */
+    bool rule_matched = false; /*< a routing rule chose the target */
+    backend_ref_t *affinity_bref = NULL; /*< the node a write is routed to by its table */
+
+    ss_dassert(querybuf->next == NULL); // The buffer must be contiguous.
+    ss_dassert(!GWBUF_IS_TYPE_UNDEFINED(querybuf));
+
+    packet = GWBUF_DATA(querybuf);
+    packet_len = gw_mysql_get_byte3(packet);
+
+    if (packet_len == 0)
+    {
+        /** Empty packet signals end of LOAD DATA LOCAL INFILE, send it to master*/
+        route_target = TARGET_MASTER;
+        packet_type = MYSQL_COM_UNDEFINED;
+        rses->rses_load_active = false;
+        route_target = TARGET_MASTER;
+        MXS_INFO("> LOAD DATA LOCAL INFILE finished: %lu bytes sent.",
+                 rses->rses_load_data_sent + gwbuf_length(querybuf));
+    }
+    else
+    {
+        packet_type = packet[4];
+
+        switch (packet_type)
+        {
+            case MYSQL_COM_QUIT:        /*< 1 QUIT will close all sessions */
+            case MYSQL_COM_INIT_DB:     /*< 2 DDL must go to the master */
+            case MYSQL_COM_REFRESH:     /*< 7 - I guess this is session but not sure */
+            case MYSQL_COM_DEBUG:       /*< 0d all servers dump debug info to stdout */
+            case MYSQL_COM_PING:        /*< 0e all servers are pinged */
+            case MYSQL_COM_CHANGE_USER: /*< 11 all servers change it accordingly */
+                qtype = QUERY_TYPE_SESSION_WRITE;
+                break;
+
+            case MYSQL_COM_CREATE_DB:           /**< 5 DDL must go to the master */
+            case MYSQL_COM_DROP_DB:             /**< 6 DDL must go to the master */
+            case MYSQL_COM_STMT_CLOSE:          /*< free prepared statement */
+            case MYSQL_COM_STMT_SEND_LONG_DATA: /*< send data to column */
+            case MYSQL_COM_STMT_RESET: /*< resets the data of a prepared statement */
+                qtype = QUERY_TYPE_WRITE;
+                break;
+
+            case MYSQL_COM_QUERY:
+                qtype = qc_get_type(querybuf);
+                break;
+
+            case MYSQL_COM_STMT_PREPARE:
+                if (rses_ps_reuse(rses, querybuf))
+                {
+                    succp = true;
+                    goto retblock;
+                }
+                qtype = qc_get_type(querybuf);
+                qtype |= QUERY_TYPE_PREPARE_STMT;
+                break;
+
+            case MYSQL_COM_STMT_EXECUTE:
+                /** The type of a known statement was classified when it was prepared.
+                 * Executions that open a cursor stay in the master where the
+                 * rows are fetched from. */
+                qtype = QUERY_TYPE_EXEC_STMT;
+                ps = rses_ps_find(rses, querybuf);
+
+                if (ps && ps->read_only && !ps->long_data &&
+                    GWBUF_LENGTH(querybuf) > PS_EXEC_FLAGS_OFFSET &&
+                    packet[PS_EXEC_FLAGS_OFFSET] == 0)
+                {
+                    qtype |= ps->qtype;
+                }
+                break;
+
+            case MYSQL_COM_SHUTDOWN:       /**< 8 where should shutdown be routed ? */
+            case MYSQL_COM_STATISTICS:     /**< 9 ? */
+            case MYSQL_COM_PROCESS_INFO:   /**< 0a ? */
+            case MYSQL_COM_CONNECT:        /**< 0b ? */
+            case MYSQL_COM_PROCESS_KILL:   /**< 0c ? */
+            case MYSQL_COM_TIME:           /**< 0f should this be run in gateway ? */
+            case MYSQL_COM_DELAYED_INSERT: /**< 10 ? */
+            case MYSQL_COM_DAEMON:         /**< 1d ? */
+            default:
+                break;
+        } /**< switch by packet type */
+
+        /** This might not be absolutely necessary as some parts of the code
+         * can only be executed by one thread at a time. */
+        if (!rses_begin_locked_router_action(rses))
+        {
+            succp = false;
+            goto retblock;
+        }
+
+        /** Move away from draining slaves at transaction boundaries */
+        if (!rses->rses_transaction_active && !rses->rses_load_active)
+        {
+            rses_release_draining_slaves(rses);
+        }
+
+        /** Check for multi-statement queries. If no master server is available
+         * and a multi-statement is issued, an error is returned to the client
+         * when the query is routed.
+         *
+         * If we do not have a master node, assigning the forced node is not
+         * effective since we don't have a node to force queries to. In this
+         * situation, assigning QUERY_TYPE_WRITE for the query will trigger
+         * the error processing. */
+        if (check_for_multi_stmt(rses, querybuf, packet_type) &&
+            rses->rses_master_ref == NULL)
+        {
+            qtype |= QUERY_TYPE_WRITE;
+        }
+
+        /**
+         * Check if the query has anything to do with temporary tables.
+         */
+        if (rses->rses_n_tmp_tables > 0 &&
+            (packet_type == MYSQL_COM_QUERY || packet_type == MYSQL_COM_DROP_DB))
+        {
+            check_drop_tmp_table(rses, querybuf, qtype);
+            if (packet_type == MYSQL_COM_QUERY && is_read_tmp_table(rses, querybuf, qtype))
+            {
+                qtype |= QUERY_TYPE_MASTER_READ;
+            }
+        }
+        else if (rses->rses_n_tmp_tables > 0 && packet_type == MYSQL_COM_STMT_PREPARE &&
+                 is_read_tmp_table(rses, querybuf, qtype))
+        {
+            qtype |= QUERY_TYPE_MASTER_READ;
+        }
+        check_create_tmp_table(rses, querybuf, qtype);
+
+        /** The statements are otherwise only known by the master */
+        if (packet_type == MYSQL_COM_STMT_CLOSE && rses_ps_close(rses, querybuf))
+        {
+            /** The statement stays open for a later COM_STMT_PREPARE */
+            rses_end_locked_router_action(rses);
+            succp = true;
+            goto retblock;
+        }
+        else if (packet_type == MYSQL_COM_STMT_SEND_LONG_DATA ||
+                 packet_type == MYSQL_COM_STMT_RESET)
+        {
+            rwsplit_ps_t *long_ps = rses_ps_find(rses, querybuf);
+
+            if (long_ps)
+            {
+                long_ps->long_data = packet_type == MYSQL_COM_STMT_SEND_LONG_DATA;
+            }
+        }
+
+        /**
+         * Check if this is a LOAD DATA LOCAL INFILE query. If so, the contents
+         * of the file are sent to the master by route_load_data until the last,
+         * empty packet arrives.
+         */
+        if (packet_type == MYSQL_COM_QUERY)
+        {
+            qc_query_op_t queryop = qc_get_operation(querybuf);
+            if (queryop == QUERY_OP_LOAD)
+            {
+                rses->rses_load_active = true;
+                rses->rses_load_data_sent = 0;
+            }
+        }
+
+        rses_end_locked_router_action(rses);
+        /**
+         * If autocommit is disabled or transaction is explicitly started
+         * transaction becomes active and master gets all statements until
+         * transaction is committed and autocommit is enabled again.
+         */
+        if (rses->rses_autocommit_enabled &&
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT))
+        {
+            rses->rses_autocommit_enabled = false;
+
+            if (!rses->rses_transaction_active)
+            {
+                rses->rses_transaction_active = true;
+            }
+        }
+        else if (!rses->rses_transaction_active &&
+                 QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX))
+        {
+            rses->rses_transaction_active = true;
+        }
+        /**
+         * Explicit COMMIT and ROLLBACK, implicit COMMIT.
+         */
+        if (rses->rses_autocommit_enabled && rses->rses_transaction_active &&
+            (QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
+             QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK)))
+        {
+            rses->rses_transaction_active = false;
+        }
+        else if (!rses->rses_autocommit_enabled &&
+                 QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT))
+        {
+            rses->rses_autocommit_enabled = true;
+            rses->rses_transaction_active = false;
+        }
+
+        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        {
+            if (!rses->rses_load_active)
+            {
+                uint8_t *packet = GWBUF_DATA(querybuf);
+                unsigned char ptype = packet[4];
+                size_t len = MIN(GWBUF_LENGTH(querybuf),
+                                 MYSQL_GET_PACKET_LEN((unsigned char *)querybuf->start) - 1);
+                char *data = (char *)&packet[5];
+                char *contentstr = strndup(data, MIN(len, RWSPLIT_TRACE_MSG_LEN));
+                char *qtypestr = qc_get_qtype_str(qtype);
+                MXS_INFO("> Autocommit: %s, trx is %s, cmd: %s, type: %s, stmt: %s%s %s",
+                         (rses->rses_autocommit_enabled ? "[enabled]" : "[disabled]"),
+                         (rses->rses_transaction_active ? "[open]" : "[not open]"),
+                         STRPACKETTYPE(ptype), (qtypestr == NULL ? "N/A" : qtypestr),
+                         contentstr, (querybuf->hint == NULL ? "" : ", Hint:"),
+                         (querybuf->hint == NULL ? "" : STRHINTTYPE(querybuf->hint->type)));
+                free(contentstr);
+                free(qtypestr);
+            }
+            else
+            {
+                MXS_INFO("> Processing LOAD DATA LOCAL INFILE: %lu bytes sent.",
+                         rses->rses_load_data_sent);
+            }
+        }
+        /**
+         * Find out where to route the query. Result may not be clear; it is
+         * possible to have a hint for routing to a named server which can
+         * be either slave or master.
+         * If query would otherwise be routed to slave then the hint determines
+         * actual target server if it exists.
+         *
+         * route_target is a bitfield and may include :
+         * TARGET_ALL
+         * - route to all connected backend servers
+         * TARGET_SLAVE[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
+         * - route primarily according to hints, then to slave and if those
+         *   failed, eventually to master
+         * TARGET_MASTER[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
+         * - route primarily according to the hints and if they failed,
+         *   eventually to master
+         */
+        if (rses->client_dcb && rses->client_dcb->session)
+        {
+            SESSION *session = rses->client_dcb->session;
+            trace_stage(&session->trace, session->ses_id, TRACE_ROUTE);
+        }
+
+        route_target = get_route_target(rses, qtype, querybuf->hint);
+
+        if (rses->rses_config.rw_ro_trx)
+        {
+            ro_trx_pin = rses_ro_trx_target(rses, querybuf, qtype, trx_was_active, &route_target);
+        }
+
+        /** The rules are overridden by hints like the targets of the router */
+        if (inst->n_rules > 0 && !ro_trx_pin && querybuf->hint == NULL &&
+            packet_type == MYSQL_COM_QUERY && !rses->rses_load_active &&
+            !TARGET_IS_ALL(route_target))
+        {
+            const rwsplit_rule_t *rule = rses_find_rule(rses, querybuf, qtype);
+
+            if (rule && rule->target == TARGET_NAMED_SERVER)
+            {
+                route_target |= TARGET_NAMED_SERVER;
+                rule_server = rule->server;
+            }
+            else if (rule)
+            {
+                route_target = rule->target;
+            }
+
+            if (rule)
+            {
+                atomic_add(&inst->stats.n_rule_routed, 1);
+                rule_matched = true;
+            }
+        }
+
+        if (TARGET_IS_ALL(route_target))
+        {
+            if (rses->rses_ps_cache && rses_begin_locked_router_action(rses))
+            {
+                rses_ps_flush_cache(rses);
+                rses_end_locked_router_action(rses);
+            }
+
+            /** Multiple, conflicting routing target. Return error */
+            if (TARGET_IS_MASTER(route_target) || TARGET_IS_SLAVE(route_target))
+            {
+                backend_ref_t *bref = rses->rses_backend_ref;
+
+                char *query_str = modutil_get_query(querybuf);
+                char *qtype_str = qc_get_qtype_str(qtype);
+
+                MXS_ERROR("Can't route %s:%s:\"%s\". SELECT with session data "
+                          "modification is not supported if configuration parameter "
+                          "use_sql_variables_in=all .", STRPACKETTYPE(packet_type),
+                          qtype_str, (query_str == NULL ? "(empty)" : query_str));
+
+                MXS_INFO("Unable to route the query without losing session data "
+                         "modification from other servers. <");
+
+                while (bref != NULL && !BREF_IS_IN_USE(bref))
+                {
+                    bref++;
+                }
+
+                if (bref != NULL && BREF_IS_IN_USE(bref))
+                {
+                    /** Create and add MySQL error to eventqueue */
+                    modutil_reply_parse_error(bref->bref_dcb,
+                                              strdup("Routing query to backend failed. "
+                                                     "See the error log for further "
+                                                     "details."), 0);
+                    succp = true;
+                }
+                else
+                {
+                    /**
+                     * If there were no available backend references
+                     * available return false - session will be closed
+                     */
+                    MXS_ERROR("Sending error message to client "
+                              "failed. Router doesn't have any "
+                              "available backends. Session will be "
+                              "closed.");
+                    succp = false;
+                }
+                if (query_str)
+                {
+                    free(query_str);
+                }
+                if (qtype_str)
+                {
+                    free(qtype_str);
+                }
+                goto retblock;
+            }
+            if (rses->rses_config.rw_trx_replay && rses_begin_locked_router_action(rses))
+            {
+                rses_trx_log_update(rses, querybuf, qtype, packet_type, trx_was_active, true);
+                rses_end_locked_router_action(rses);
+            }
+
+            /**
+             * It is not sure if the session command in question requires
+             * response. Statement is examined in route_session_write.
+             * Router locking is done inside the function.
+             */
+            succp = route_session_write(rses, gwbuf_clone(querybuf), inst,
+                                        packet_type, qtype);
+
+            if (succp)
+            {
+                atomic_add(&inst->stats.n_all, 1);
+            }
+            goto retblock;
+        }
+    }
+    /** Lock router session */
+    if (!rses_begin_locked_router_action(rses))
+    {
+        if (packet_type != MYSQL_COM_QUIT)
+        {
+            char *query_str = modutil_get_query(querybuf);
+
+            MXS_ERROR("Can't route %s:%s:\"%s\" to "
+                      "backend server. Router is closed.",
+                      STRPACKETTYPE(packet_type), STRQTYPE(qtype),
+                      (query_str == NULL ? "(empty)" : query_str));
+            free(query_str);
+        }
+        succp = false;
+        goto retblock;
+    }
+
+    rses_trx_log_update(rses, querybuf, qtype, packet_type, trx_was_active, false);
+
+    if (rses->rses_lazy_slaves &&
+        (TARGET_IS_SLAVE(route_target) || TARGET_IS_NAMED_SERVER(route_target)))
+    {
+        rses_lazy_connect(rses);
+    }
+
+    DCB *master_dcb = rses->rses_master_ref ? rses->rses_master_ref->bref_dcb : NULL;
+
+    if (rses->rses_config.rw_write_affinity && route_target == TARGET_MASTER &&
+        packet_type == MYSQL_COM_QUERY && querybuf->hint == NULL && !rses->rses_load_active &&
+        !rule_matched)
+    {
+        affinity_bref = rses_write_affinity_target(rses, querybuf, qtype);
+    }
+
+    /**
+     * The server of a read-only transaction was chosen by its first statement.
+     */
+    if (TARGET_IS_SLAVE(route_target) && rses->rses_ro_trx_bref)
+    {
+        backend_ref_t *bref = rses->rses_ro_trx_bref;
+
+        if (BREF_IS_IN_USE(bref) && bref->bref_conn_seq == rses->rses_ro_trx_conn)
+        {
+            atomic_add(SERVER_IS_MASTER(bref->bref_backend->backend_server) ?
+                       &inst->stats.n_master : &inst->stats.n_slave, 1);
+            target_dcb = bref->bref_dcb;
+            succp = true;
+        }
+        else
+        {
+            MXS_ERROR("The connection to server '%s' of the read-only transaction was lost.",
+                      bref->bref_backend->backend_server->unique_name);
+        }
+    }
+    /**
+     * There is a hint which either names the target backend or
+     * hint which sets maximum allowed replication lag for the
+     * backend.
+     */
+    else if (TARGET_IS_NAMED_SERVER(route_target) ||
+             TARGET_IS_RLAG_MAX(route_target))
+    {
+        HINT *hint;
+        char *named_server = rule_server;
+
+        hint = querybuf->hint;
+
+        while (hint != NULL)
+        {
+            if (hint->type == HINT_ROUTE_TO_NAMED_SERVER)
+            {
+                /**
+                 * Set the name of searched
+                 * backend server.
+                 */
+                named_server = hint->data;
+                MXS_INFO("Hint: route to server "
+                         "'%s'",
+                         named_server);
+            }
+            else if (hint->type == HINT_PARAMETER &&
+                     (strncasecmp((char *)hint->data, "max_slave_replication_lag",
+                                  strlen("max_slave_replication_lag")) == 0))
+            {
+                int val = (int)strtol((char *)hint->value, (char **)NULL, 10);
+
+                if (val != 0 || errno == 0)
+                {
+                    /** Set max. acceptable replication lag value for backend srv */
+                    rlag_max = val;
+                    MXS_INFO("Hint: max_slave_replication_lag=%d", rlag_max);
+                }
+            }
+            hint = hint->next;
+        } /*< while */
+
+        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
+        {
+            rlag_max = rses_get_max_replication_lag(rses);
+        }
+
+        /** target may be master or slave */
+        btype = route_target & TARGET_SLAVE ? BE_SLAVE : BE_MASTER;
+
+        /**
+         * Search backend server by name or replication lag.
+         * If it fails, then try to find valid slave or master.
+         */
+        succp = get_dcb(&target_dcb, rses, btype, named_server, rlag_max);
+
+        if (!succp)
+        {
+            if (TARGET_IS_NAMED_SERVER(route_target))
+            {
+                MXS_INFO("Was supposed to route to named server "
+                         "%s but couldn't find the server in a "
+                         "suitable state.", named_server);
+            }
+            else if (TARGET_IS_RLAG_MAX(route_target))
+            {
+                MXS_INFO("Was supposed to route to server with "
+                         "replication lag at most %d but couldn't "
+                         "find such a slave.", rlag_max);
+            }
+        }
+    }
+    else if (TARGET_IS_SLAVE(route_target))
+    {
+        btype = BE_SLAVE;
+
+        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
+        {
+            rlag_max = rses_get_max_replication_lag(rses);
+        }
+        /**
+         * Search suitable backend server, get DCB in target_dcb
+         */
+        succp = get_dcb(&target_dcb, rses, BE_SLAVE, NULL, rlag_max);
+
+        if (succp)
+        {
+#if defined(SS_EXTRA_DEBUG)
+            MXS_INFO("Found DCB for slave.");
+#endif
+            atomic_add(&inst->stats.n_slave, 1);
+        }
+        else if (rses->rses_causal_sample != 0 &&
+                 get_dcb(&target_dcb, rses, BE_MASTER, NULL, MAX_RLAG_UNDEFINED))
+        {
+            /** No slave has replicated the last write yet */
+            atomic_add(&inst->stats.n_master, 1);
+            succp = true;
+        }
+        else
+        {
+            MXS_INFO("Was supposed to route to slave but finding suitable one failed.");
+        }
+    }
+    else if (affinity_bref)
+    {
+        atomic_add(&inst->stats.n_write_affinity, 1);
+        target_dcb = affinity_bref->bref_dcb;
+        succp = true;
+    }
+    else if (TARGET_IS_MASTER(route_target))
+    {
+        DCB *curr_master_dcb = NULL;
+
+        succp = get_dcb(&curr_master_dcb, rses, BE_MASTER, NULL, MAX_RLAG_UNDEFINED);
+
+        if (succp && master_dcb == curr_master_dcb)
+        {
+            atomic_add(&inst->stats.n_master, 1);
+            target_dcb = master_dcb;
+        }
+        else
+        {
+            /** The write waits until the transaction has been replayed on the new master */
+            if (rses_replay_start(rses))
+            {
+                if (rses->rses_master_ref && BREF_IS_IN_USE(rses->rses_master_ref))
+                {
+                    close_failed_bref(rses->rses_master_ref, true);
+                    RW_CHK_DCB(rses->rses_master_ref, rses->rses_master_ref->bref_dcb);
+                    dcb_close(rses->rses_master_ref->bref_dcb);
+                    RW_CLOSE_BREF(rses->rses_master_ref);
+                }
+
+                rses->rses_replay_queue = gwbuf_append(rses->rses_replay_queue,
+                                                       gwbuf_clone(querybuf));
+                rses_end_locked_router_action(rses);
+                rses_replay_arm(rses);
+                succp = true;
+                goto retblock;
+            }
+
+            /** The original master is not available, we can't route the write */
+            if (rses->rses_config.rw_master_failure_mode == RW_ERROR_ON_WRITE)
+            {
+                succp = send_readonly_error(rses->client_dcb);
+
+                if (rses->rses_master_ref && BREF_IS_IN_USE(rses->rses_master_ref))
+                {
+                    close_failed_bref(rses->rses_master_ref, true);
+                    RW_CHK_DCB(rses->rses_master_ref, rses->rses_master_ref->bref_dcb);
+                    dcb_close(rses->rses_master_ref->bref_dcb);
+                    RW_CLOSE_BREF(rses->rses_master_ref);
+                }
+            }
+            else
+            {
+                log_master_routing_failure(rses, succp, master_dcb, curr_master_dcb);
+                succp = false;
+            }
+
+            rses_end_locked_router_action(rses);
+            goto retblock;
+        }
+    }
+
+    if (ro_trx_pin)
+    {
+        rses->rses_ro_trx_bref = succp ? get_bref_from_dcb(rses, target_dcb) : NULL;
+        rses->rses_ro_trx_conn = succp ? rses->rses_ro_trx_bref->bref_conn_seq : 0;
+        rses->rses_ro_trx_pending = rses->rses_ro_trx_pending && succp;
+    }
+
+    if (succp) /*< Have DCB of the target backend */
+    {
+        backend_ref_t *bref;
+        sescmd_cursor_t *scur;
+
+        bref = get_bref_from_dcb(rses, target_dcb);
+        scur = &bref->bref_sescmd_cur;
+
+        ss_dassert(target_dcb != NULL);
+
+        if (rses->rses_multi_active)
+        {
+            rses->rses_multi_bref = bref;
+        }
+
+        MXS_INFO("Route query to %s \t%s:%d <",
+                 (SERVER_IS_MASTER(bref->bref_backend->backend_server) ? "master"
+                  : "slave"), bref->bref_backend->backend_server->name,
+                 bref->bref_backend->backend_server->port);
+
+        GWBUF *sendbuf = NULL;
+
+        if (ps)
+        {
+            uint32_t id = ps_backend_id(rses, bref, ps);
+
+            if (id == 0)
+            {
+                succp = rses_ps_execute_lazily(rses, bref, ps, querybuf);
+
+                if (succp)
+                {
+                    atomic_add(&inst->stats.n_queries, 1);
+                }
+                else
+                {
+                    MXS_ERROR("Routing the execution of prepared statement %u failed.", ps->id);
+                }
+                rses_end_locked_router_action(rses);
+                goto retblock;
+            }
+
+            ps->long_data = false;
+            sendbuf = ps_translate(querybuf, id);
+        }
+        else
+        {
+            sendbuf = gwbuf_clone(querybuf);
+        }
+
+        if (packet_type == MYSQL_COM_STMT_PREPARE && bref == rses->rses_master_ref)
+        {
+            rses_ps_prepare(rses, bref, querybuf, qtype);
+        }
+        /**
+         * Store current stmt if execution of previous session command
+         * hasn't completed yet or the reply to a hedged read is being drained.
+         */
+        if ((sescmd_cursor_is_active(scur) || BREF_IS_DISCARDING(bref)) &&
+            bref != rses->rses_master_ref)
+        {
+            bref->bref_pending_cmd = gwbuf_append(bref->bref_pending_cmd, sendbuf);
+            rses_end_locked_router_action(rses);
+            goto retblock;
+        }
+
+        uint64_t hedge_mark = 0;
+
+        if (rses_hedge_eligible(rses, bref, route_target, packet_type, qtype) &&
+            (hedge_delay = rses_hedge_delay(rses, bref)) > 0)
+        {
+            hedge_mark = bref_next_reply_mark(bref);
+        }
+
+        trace_stage(&target_dcb->session->trace, target_dcb->session->ses_id, TRACE_WRITE);
+        ret = sendbuf ? target_dcb->func.write(target_dcb, sendbuf) : 0;
+        trace_stage(&target_dcb->session->trace, target_dcb->session->ses_id, TRACE_BACKEND);
+
+        if (ret == 1)
+        {
+            backend_ref_t *bref;
+
+            atomic_add(&inst->stats.n_queries, 1);
+            /**
+             * Add one query response waiter to backend reference
+             */
+            bref = get_bref_from_dcb(rses, target_dcb);
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+            bref_start_response_timer(bref);
+
+            if (hedge_delay > 0 && !rses_hedge_start(rses, bref, querybuf, hedge_mark))
+            {
+                hedge_delay = 0;
+            }
+
+            if (rses->rses_trx_recording && bref == rses->rses_master_ref)
+            {
+                rses_trx_log_add(rses, querybuf);
+            }
+
+            if (rses->rses_config.rw_causal_reads && bref == rses->rses_master_ref &&
+                (QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) || !QUERY_IS_TYPE(qtype, QUERY_TYPE_READ)))
+            {
+                rses_causal_write(rses);
+            }
+        }
+        else
+        {
+            MXS_ERROR("Routing query failed.");
+            succp = false;
+            hedge_delay = 0;
+
+            if (packet_type == MYSQL_COM_STMT_PREPARE)
+            {
+                ps_free(bref->bref_ps_new);
+                bref->bref_ps_new = NULL;
+            }
+        }
+    }
+    rses_end_locked_router_action(rses);
+
+    if (hedge_delay > 0)
+    {
+        rses_hedge_arm(rses, hedge_delay);
+    }
+
+retblock :
+#if defined(SS_DEBUG2)
+    {
+        char *canonical_query_str;
+
+        canonical_query_str = skygw_get_canonical(querybuf);
+
+        if (canonical_query_str != NULL)
+        {
+            MXS_INFO("Canonical version: %s", canonical_query_str);
+            free(canonical_query_str);
+        }
+    }
+#endif
+    return succp;
+}
+
+/**
+ * @node Acquires lock to router client session if it is not closed.
+ *
+ * Parameters:
+ * @param rses - in, use
+ *
+ *
+ * @return true if router session was not closed. If return value is true
+ * it means that router is locked, and must be unlocked later. False, if
+ * router was closed before lock was acquired.
+ *
+ *
+ * @details (write detailed description here)
+ *
+ */
+static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES *rses)
+{
+    bool succp = false;
+
+    if (rses == NULL)
+    {
+        return false;
+    }
+
+    CHK_CLIENT_RSES(rses);
+
+    if (rses->rses_closed)
+    {
+
+        goto return_succp;
+    }
+    if (rses->rses_lockfree)
+    {
+        /** Only the owning thread of the session's DCBs gets here */
+        ss_dassert(poll_current_thread() == rses->client_dcb->poll_thread);
+        succp = true;
+        goto return_succp;
+    }
+    spinlock_acquire(&rses->rses_lock);
+    if (rses->rses_closed)
+    {
+        spinlock_release(&rses->rses_lock);
+        goto return_succp;
+    }
+    succp = true;
+
+return_succp:
+    return succp;
+}
+
+/** to be inline'd */
+
+/**
+ * @node Releases router client session lock.
+ *
+ * Parameters:
+ * @param rses - <usage>
+ *          <description>
+ *
+ * @return void
+ *
+ *
+ * @details (write detailed description here)
+ *
+ */
+static void rses_end_locked_router_action(ROUTER_CLIENT_SES *rses)
+{
+    CHK_CLIENT_RSES(rses);
+
+    if (!rses->rses_lockfree)
+    {
+        spinlock_release(&rses->rses_lock);
+    }
+}
+
+/**
+ * Check whether a router session can be used without locking it. This is
+ * possible if the DCBs of the session are processed only by the thread owning
+ * them and the client and all backend DCBs have the same owner. Backend
+ * connections created later in the session are created by that same thread
+ * and therefore also get it as their owner.
+ *
+ * @param rses Router client session
+ *
+ * @return True if the session needs no locking
+ */
+static bool rses_can_be_lockfree(ROUTER_CLIENT_SES *rses)
+{
+    if (!rses->rses_config.rw_thread_affinity || !poll_thread_affinity() ||
+        rses->client_dcb->poll_thread == -1 ||
+        rses->client_dcb->poll_thread != poll_current_thread())
+    {
+        return false;
+    }
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref) && bref->bref_dcb->poll_thread != rses->client_dcb->poll_thread)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Diagnostics routine
+ *
+ * Print query router statistics to the DCB passed in
+ *
+ * @param   instance    The router instance
+ * @param   dcb     The DCB for diagnostic output
+ */
+static void diagnostic(ROUTER *instance, DCB *dcb)
+{
+    ROUTER_CLIENT_SES *router_cli_ses;
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)instance;
+    int i = 0;
+    BACKEND *backend;
+    char *weightby;
+
+    spinlock_acquire(&router->lock);
+    router_cli_ses = router->connections;
+    while (router_cli_ses)
+    {
+        i++;
+        router_cli_ses = router_cli_ses->next;
+    }
+    spinlock_release(&router->lock);
+
+    double master_pct = 0.0, slave_pct = 0.0, all_pct = 0.0;
+
+    if (router->stats.n_queries > 0)
+    {
+        master_pct = ((double)router->stats.n_master / (double)router->stats.n_queries) * 100.0;
+        slave_pct = ((double)router->stats.n_slave / (double)router->stats.n_queries) * 100.0;
+        all_pct = ((double)router->stats.n_all / (double)router->stats.n_queries) * 100.0;
+    }
+
+    dcb_printf(dcb, "\tNumber of router sessions:           	%d\n",
+               router->stats.n_sessions);
+    dcb_printf(dcb, "\tCurrent no. of router sessions:      	%d\n", i);
+    dcb_printf(dcb, "\tNumber of queries forwarded:          	%d\n",
+               router->stats.n_queries);
+    dcb_printf(dcb, "\tNumber of queries forwarded to master:	%d (%.2f%%)\n",
+               router->stats.n_master, master_pct);
+    dcb_printf(dcb, "\tNumber of queries forwarded to slave: 	%d (%.2f%%)\n",
+               router->stats.n_slave, slave_pct);
+    dcb_printf(dcb, "\tNumber of queries forwarded to all:   	%d (%.2f%%)\n",
+               router->stats.n_all, all_pct);
+    dcb_printf(dcb, "\tRead-only transactions sent to slaves:	%d\n",
+               router->stats.n_ro_trx);
+    dcb_printf(dcb, "\tNumber of hedged reads:               	%d\n",
+               router->stats.n_hedged);
+    dcb_printf(dcb, "\tHedged reads won by the second slave: 	%d\n",
+               router->stats.n_hedge_won);
+    dcb_printf(dcb, "\tSessions that connected slaves late: 	%d\n",
+               router->stats.n_lazy_connect);
+    dcb_printf(dcb, "\tSession commands shared by sessions: 	%d\n",
+               sescmd_n_shared);
+    dcb_printf(dcb, "\tTransactions replayed on a new master:	%d\n",
+               router->stats.n_trx_replayed);
+    dcb_printf(dcb, "\tTransaction replays that failed:      	%d\n",
+               router->stats.n_trx_replay_failed);
+    dcb_printf(dcb, "\tStatements routed by routing rules:   	%d\n",
+               router->stats.n_rule_routed);
+
+    if ((weightby = serviceGetWeightingParameter(router->service)) != NULL)
+    {
+        dcb_printf(dcb, "\tConnection distribution based on %s "
+                   "server parameter.\n",
+                   weightby);
+        dcb_printf(dcb, "\t\tServer               Target %%    Connections  "
+                   "Operations\n");
+        dcb_printf(dcb, "\t\t                               Global  Router\n");
+        for (i = 0; router->servers[i]; i++)
+        {
+            backend = router->servers[i];
+            dcb_printf(dcb, "\t\t%-20s %3.1f%%     %-6d  %-6d  %d\n",
+                       backend->backend_server->unique_name, (float)backend->weight / 10,
+                       backend->backend_server->stats.n_current, backend->backend_conn_count,
+                       backend->backend_server->stats.n_current_ops);
+        }
+    }
+}
+
+/**
+ * Client Reply routine
+ *
+ * The routine will reply to client for session change with master server data
+ *
+ * @param   instance    The router instance
+ * @param   router_session  The router session
+ * @param   backend_dcb The backend DCB
+ * @param   queue       The GWBUF with reply data
+ */
+static void clientReply(ROUTER *instance, void *router_session, GWBUF *writebuf,
+                        DCB *backend_dcb)
+{
+    DCB *client_dcb;
+    ROUTER_INSTANCE *router_inst;
+    ROUTER_CLIENT_SES *router_cli_ses;
+    sescmd_cursor_t *scur = NULL;
+    backend_ref_t *bref;
+    bool multi_next = false;
+    bool replay_next = false; /*< the master replied to a replayed statement */
+    bool replay_release = false; /*< the held queries can be routed */
+
+    router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
+    router_inst = (ROUTER_INSTANCE *)instance;
+    CHK_CLIENT_RSES(router_cli_ses);
+
+    /**
+     * Lock router client session for secure read of router session members.
+     * Note that this could be done without lock by using version #
+     */
+    if (!rses_begin_locked_router_action(router_cli_ses))
+    {
+        print_error_packet(router_cli_ses, writebuf, backend_dcb);
+        goto lock_failed;
+    }
+    /** Holding lock ensures that router session remains open */
+    ss_dassert(backend_dcb->session != NULL);
+    client_dcb = backend_dcb->session->client_dcb;
+    trace_stage(&backend_dcb->session->trace, backend_dcb->session->ses_id, TRACE_REPLY);
+
+    /** Unlock */
+    rses_end_locked_router_action(router_cli_ses);
+    /**
+     * 1. Check if backend received reply to sescmd.
+     * 2. Check sescmd's state whether OK_PACKET has been
+     *    sent to client already and if not, lock property cursor,
+     *    reply to client, and move property cursor forward. Finally
+     *    release the lock.
+     * 3. If reply for this sescmd is sent, lock property cursor
+     *    and
+     */
+    if (client_dcb == NULL)
+    {
+        gwbuf_free(writebuf);
+        /** Log that client was closed before reply */
+        goto lock_failed;
+    }
+    /** Lock router session */
+    if (!rses_begin_locked_router_action(router_cli_ses))
+    {
+        /** Log to debug that router was closed */
+        goto lock_failed;
+    }
+    bref = get_bref_from_dcb(router_cli_ses, backend_dcb);
+
+#if !defined(FOR_BUG548_FIX_ONLY)
+    /** This makes the issue becoming visible in poll.c */
+    if (bref == NULL)
+    {
+        /** Unlock router session */
+        rses_end_locked_router_action(router_cli_ses);
+        goto lock_failed;
+    }
+#endif
+
+    CHK_BACKEND_REF(bref);
+    scur = &bref->bref_sescmd_cur;
+
+    /** The reply to a hedged read that the other backend replied to first */
+    if (BREF_IS_DISCARDING(bref))
+    {
+        gwbuf_free(writebuf);
+        rses_hedge_drain(router_cli_ses, bref);
+        rses_end_locked_router_action(router_cli_ses);
+        goto lock_failed;
+    }
+
+    if (router_cli_ses->rses_hedge_query &&
+        (bref == router_cli_ses->rses_hedge_primary || bref == router_cli_ses->rses_hedge_secondary))
+    {
+        rses_hedge_reply(router_cli_ses, bref);
+    }
+
+    /** A statement is being prepared for an execution, the reply is not for the client */
+    if (bref->bref_ps_exec)
+    {
+        gwbuf_free(writebuf);
+        rses_ps_execute_prepared(router_cli_ses, bref);
+        rses_end_locked_router_action(router_cli_ses);
+        goto lock_failed;
+    }
+
+    if (bref->bref_ps_new)
+    {
+        rses_ps_prepared(router_cli_ses, bref, writebuf);
+    }
+
+    /** A LOAD DATA LOCAL INFILE that the master refused has no file to send */
+    if (router_cli_ses->rses_load_active && bref == router_cli_ses->rses_master_ref &&
+        !sescmd_cursor_is_active(scur) && writebuf && GWBUF_LENGTH(writebuf) > MYSQL_HEADER_LEN &&
+        MYSQL_IS_ERROR_PACKET((uint8_t *)GWBUF_DATA(writebuf)))
+    {
+        router_cli_ses->rses_load_active = false;
+    }
+
+    if (router_cli_ses->rses_multi_active && bref == router_cli_ses->rses_multi_bref &&
+        !sescmd_cursor_is_active(scur) && writebuf &&
+        rses_multi_reply(router_cli_ses, &writebuf))
+    {
+        /** The next statement is routed once the reply has been written */
+        multi_next = router_cli_ses->rses_multi_stmt != NULL;
+        router_cli_ses->rses_multi_active = multi_next;
+        router_cli_ses->rses_multi_bref = NULL;
+    }
+    if (bref == router_cli_ses->rses_master_ref && writebuf && !sescmd_cursor_is_active(scur))
+    {
+        if (router_cli_ses->rses_replay_state == RSES_REPLAY_RUN)
+        {
+            /** The client already got the reply when the statement was first executed */
+            router_cli_ses->rses_replay_checksum = trx_checksum(router_cli_ses->rses_replay_checksum,
+                                                                writebuf);
+            replay_next = bref_reply_complete(bref);
+            gwbuf_free(writebuf);
+            writebuf = NULL;
+        }
+        else if (router_cli_ses->rses_trx_in_flight)
+        {
+            rses_trx_log_reply(router_cli_ses, bref, writebuf);
+        }
+    }
+    /**
+     * Active cursor means that reply is from session command
+     * execution.
+     */
+    if (sescmd_cursor_is_active(scur))
+    {
+        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_ERR) &&
+            MYSQL_IS_ERROR_PACKET(((uint8_t *)GWBUF_DATA(writebuf))))
+        {
+            uint8_t *buf = (uint8_t *)GWBUF_DATA((scur->scmd_cur_cmd->my_sescmd_buf));
+            uint8_t *replybuf = (uint8_t *)GWBUF_DATA(writebuf);
+            size_t len = MYSQL_GET_PACKET_LEN(buf);
+            size_t replylen = MYSQL_GET_PACKET_LEN(replybuf);
+            char *err = strndup(&((char *)replybuf)[8], 5);
+            char *replystr = strndup(&((char *)replybuf)[13], replylen - 4 - 5);
+
+            ss_dassert(len + 4 == GWBUF_LENGTH(scur->scmd_cur_cmd->my_sescmd_buf));
+
+            MXS_ERROR("Failed to execute session command in %s:%d. Error was: %s %s",
+                      bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port, err, replystr);
+            free(err);
+            free(replystr);
+        }
+
+        if (GWBUF_IS_TYPE_SESCMD_RESPONSE(writebuf))
+        {
+            /**
+             * Discard all those responses that have already been sent to
+             * the client. Return with buffer including response that
+             * needs to be sent to client or NULL.
+             */
+            bool rconn = false;
+            writebuf = sescmd_cursor_process_replies(writebuf, bref, &rconn);
+
+            if (rconn && !router_inst->rwsplit_config.rw_disable_sescmd_hist)
+            {
+                select_connect_backend_servers(
+                    &router_cli_ses->rses_master_ref, router_cli_ses->rses_backend_ref,
+                    router_cli_ses->rses_nbackends,
+                    router_cli_ses->rses_config.rw_max_slave_conn_count,
+                    router_cli_ses->rses_config.rw_max_slave_replication_lag,
+                    router_cli_ses->rses_config.rw_slave_select_criteria,
+                    router_cli_ses->rses_master_ref->bref_dcb->session,
+                    router_cli_ses->router,
+                    true);
+            }
+        }
+        /**
+         * If response will be sent to client, decrease waiter count.
+         * This applies to session commands only. Counter decrement
+         * for other type of queries is done outside this block.
+         */
+
+        /** Set response status as replied */
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+    }
+    /**
+     * Clear BREF_QUERY_ACTIVE flag and decrease waiter counter.
+     * This applies for queries  other than session commands.
      */
     else if (BREF_IS_QUERY_ACTIVE(bref))
     {
-        bref_clear_state(bref, BREF_QUERY_ACTIVE);
-        /** Set response status as replied */
-        bref_clear_state(bref, BREF_WAITING_RESULT);
+        bref_stop_response_timer(bref);
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        /** Set response status as replied */
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+
+        if (bref == router_cli_ses->rses_master_ref &&
+            router_cli_ses->rses_causal_sample == RSES_CAUSAL_WRITE_PENDING)
+        {
+            rses_causal_write_done(router_cli_ses);
+        }
+    }
+
+    if (writebuf != NULL && client_dcb != NULL)
+    {
+        /** Write reply to client DCB */
+        SESSION_ROUTE_REPLY(backend_dcb->session, writebuf);
+        trace_end(&backend_dcb->session->trace, backend_dcb->session->ses_id);
+    }
+    /** Unlock router session */
+    rses_end_locked_router_action(router_cli_ses);
+
+    /** Lock router session */
+    if (!rses_begin_locked_router_action(router_cli_ses))
+    {
+        /** Log to debug that router was closed */
+        goto lock_failed;
+    }
+    if (replay_next && router_cli_ses->rses_replay_state == RSES_REPLAY_RUN)
+    {
+        if (rses_replay_next(router_cli_ses))
+        {
+            replay_release = router_cli_ses->rses_replay_state == RSES_REPLAY_NONE;
+        }
+        else
+        {
+            rses_replay_fail(router_cli_ses);
+        }
+    }
+    /** There is one pending session command to be executed. */
+    else if (sescmd_cursor_is_active(scur))
+    {
+        bool succp;
+
+        MXS_INFO("Backend %s:%d processed reply and starts to execute "
+                 "active cursor.", bref->bref_backend->backend_server->name,
+                 bref->bref_backend->backend_server->port);
+
+        succp = execute_sescmd_in_backend(bref);
+
+        if (!succp)
+        {
+            MXS_INFO("Backend %s:%d failed to execute session command.",
+                     bref->bref_backend->backend_server->name,
+                     bref->bref_backend->backend_server->port);
+        }
+    }
+    else if (bref->bref_pending_cmd != NULL) /*< non-sescmd is waiting to be routed */
+    {
+        int ret;
+
+        CHK_GWBUF(bref->bref_pending_cmd);
+
+        if ((ret = bref->bref_dcb->func.write(bref->bref_dcb,
+                       gwbuf_clone(bref->bref_pending_cmd))) == 1)
+        {
+            ROUTER_INSTANCE* inst = (ROUTER_INSTANCE *)instance;
+            atomic_add(&inst->stats.n_queries, 1);
+            /**
+             * Add one query response waiter to backend reference
+             */
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+            bref_start_response_timer(bref);
+        }
+        else
+        {
+            char* sql = modutil_get_SQL(bref->bref_pending_cmd);
+
+            if (sql)
+            {
+                MXS_ERROR("Routing query \"%s\" failed.", sql);
+                free(sql);
+            }
+            else
+            {
+                MXS_ERROR("Failed to route query.");
+            }
+        }
+        gwbuf_free(bref->bref_pending_cmd);
+        bref->bref_pending_cmd = NULL;
+    }
+    /** Unlock router session */
+    rses_end_locked_router_action(router_cli_ses);
+
+    if (multi_next)
+    {
+        rses_multi_route_next(router_inst, router_cli_ses);
+    }
+
+    if (replay_release)
+    {
+        rses_replay_release(router_inst, router_cli_ses);
+    }
+
+lock_failed:
+    return;
+}
+
+/** Compare nunmber of connections from this router in backend servers */
+int bref_cmp_router_conn(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    if (b1->weight == 0 && b2->weight == 0)
+    {
+        return b1->backend_server->stats.n_current -
+               b2->backend_server->stats.n_current;
+    }
+    else if (b1->weight == 0)
+    {
+        return 1;
+    }
+    else if (b2->weight == 0)
+    {
+        return -1;
+    }
+
+    return ((1000 + 1000 * b1->backend_conn_count) / b1->weight) -
+           ((1000 + 1000 * b2->backend_conn_count) / b2->weight);
+}
+
+/** Compare nunmber of global connections in backend servers */
+int bref_cmp_global_conn(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    if (b1->weight == 0 && b2->weight == 0)
+    {
+        return b1->backend_server->stats.n_current -
+               b2->backend_server->stats.n_current;
+    }
+    else if (b1->weight == 0)
+    {
+        return 1;
+    }
+    else if (b2->weight == 0)
+    {
+        return -1;
+    }
+
+    return ((1000 + 1000 * b1->backend_server->stats.n_current) / b1->weight) -
+           ((1000 + 1000 * b2->backend_server->stats.n_current) / b2->weight);
+}
+
+/** Compare relication lag between backend servers */
+int bref_cmp_behind_master(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    return ((b1->backend_server->rlag < b2->backend_server->rlag) ? -1
+            : ((b1->backend_server->rlag > b2->backend_server->rlag) ? 1 : 0));
+}
+
+/** Compare nunmber of current operations in backend servers */
+int bref_cmp_current_load(const void *bref1, const void *bref2)
+{
+    SERVER *s1 = ((backend_ref_t *)bref1)->bref_backend->backend_server;
+    SERVER *s2 = ((backend_ref_t *)bref2)->bref_backend->backend_server;
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    if (b1->weight == 0 && b2->weight == 0)
+    {
+        return b1->backend_server->stats.n_current -
+               b2->backend_server->stats.n_current;
+    }
+    else if (b1->weight == 0)
+    {
+        return 1;
+    }
+    else if (b2->weight == 0)
+    {
+        return -1;
+    }
+
+    return ((1000 * s1->stats.n_current_ops) - b1->weight) -
+           ((1000 * s2->stats.n_current_ops) - b2->weight);
+}
+
+/** Compare the average response times of backend servers */
+int bref_cmp_response_time(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    return b1->avg_response_time - b2->avg_response_time;
+}
+
+/**
+ * Compare the load of backend servers as sampled by the monitor. Servers whose
+ * load is not known are placed after the others.
+ */
+int bref_cmp_server_load(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+    int64_t l1 = atomic_load_int64(&b1->backend_server->load);
+    int64_t l2 = atomic_load_int64(&b2->backend_server->load);
+
+    if (l1 < 0 || l2 < 0)
+    {
+        return (l1 < 0) - (l2 < 0);
+    }
+    else if (b1->weight == 0 && b2->weight == 0)
+    {
+        return (l1 > l2) - (l1 < l2);
+    }
+    else if (b1->weight == 0)
+    {
+        return 1;
+    }
+    else if (b2->weight == 0)
+    {
+        return -1;
+    }
+
+    int64_t w1 = (1000 + 1000 * l1) / b1->weight;
+    int64_t w2 = (1000 + 1000 * l2) / b2->weight;
+
+    return (w1 > w2) - (w1 < w2);
+}
+
+/**
+ * The weight of a server in the weighted random choice of LEAST_RESPONSE_TIME
+ * is the inverse of its average response time. A server whose response time
+ * has not been measured yet is treated as a very fast one, so that it soon
+ * gets measured.
+ *
+ * @param bref Backend reference
+ * @return The weight of the server
+ */
+static double bref_response_time_weight(backend_ref_t *bref)
+{
+    int avg = bref->bref_backend->avg_response_time;
+
+    return 1.0 / (avg > 0 ? avg : 1);
+}
+
+/**
+ * Start measuring the response time of the query that was just sent to
+ * a backend.
+ *
+ * @param bref Backend reference
+ */
+static void bref_start_response_timer(backend_ref_t *bref)
+{
+    gettimeofday(&bref->bref_query_start, NULL);
+}
+
+/**
+ * Add the time between sending the active query to a backend and the arrival
+ * of the first part of the response to the moving average of the backend.
+ * The average is not protected by a lock: if two sessions update it at the
+ * same time, one of the measurements is lost, which only makes the average
+ * react a little slower. The time is also recorded in the query latency
+ * histograms of the service and the server.
+ *
+ * @param bref Backend reference
+ */
+static void bref_stop_response_timer(backend_ref_t *bref)
+{
+    struct timeval now, elapsed;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &bref->bref_query_start, &elapsed);
+
+    long usec = elapsed.tv_sec * 1000000 + elapsed.tv_usec;
+    BACKEND *b = bref->bref_backend;
+    int avg = b->avg_response_time;
+
+    if (usec >= 0)
+    {
+        service_record_latency(bref->bref_dcb->session->service, b->backend_server, usec);
+    }
+
+    if (usec < 1)
+    {
+        usec = 1;
+    }
+    else if (usec > INT_MAX)
+    {
+        usec = INT_MAX;
+    }
+
+    /** The weight of a new measurement is 1/8 */
+    b->avg_response_time = avg == 0 ? usec : avg + (usec - avg) / 8;
+}
+
+static void bref_clear_state(backend_ref_t *bref, bref_state_t state)
+{
+    if (bref == NULL)
+    {
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return;
+    }
+
+    if ((state & BREF_WAITING_RESULT) && (bref->bref_state & BREF_WAITING_RESULT))
+    {
+        int prev1;
+        int prev2;
+
+        /** Decrease waiter count */
+        prev1 = atomic_add(&bref->bref_num_result_wait, -1);
+
+        if (prev1 <= 0)
+        {
+            atomic_add(&bref->bref_num_result_wait, 1);
+        }
+        else
+        {
+            /** Decrease global operation count */
+            prev2 = atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, -1);
+            ss_dassert(prev2 > 0);
+            if (prev2 <= 0)
+            {
+                MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
+                          __FUNCTION__, bref->bref_backend->backend_server->name,
+                          bref->bref_backend->backend_server->port);
+            }
+        }
+    }
+
+    bref->bref_state &= ~state;
+}
+
+static void bref_set_state(backend_ref_t *bref, bref_state_t state)
+{
+    if (bref == NULL)
+    {
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return;
+    }
+
+    if ((state & BREF_WAITING_RESULT) && (bref->bref_state & BREF_WAITING_RESULT) == 0)
+    {
+        int prev1;
+        int prev2;
+
+        /** Increase waiter count */
+        prev1 = atomic_add(&bref->bref_num_result_wait, 1);
+        ss_dassert(prev1 >= 0);
+        if (prev1 < 0)
+        {
+            MXS_ERROR("[%s] Error: negative number of connections waiting for "
+                      "results in backend %s:%u",
+                      __FUNCTION__, bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
+        }
+        /** Increase global operation count */
+        prev2 =
+            atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, 1);
+        ss_dassert(prev2 >= 0);
+        if (prev2 < 0)
+        {
+            MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
+                      __FUNCTION__, bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
+        }
+    }
+
+    bref->bref_state |= state;
+}
+
+/**
+ * @brief Connect a server
+ *
+ * Connects to a server, adds callbacks to the created DCB and updates
+ * router statistics. If @p execute_history is true, the session command
+ * history will be executed on this server.
+ *
+ * @param b Router's backend structure for the server
+ * @param session Client's session object
+ * @param execute_history Execute session command history
+ * @return True if successful, false if an error occurred
+ */
+bool connect_server(backend_ref_t *bref, SESSION *session, bool execute_history)
+{
+    SERVER *serv = bref->bref_backend->backend_server;
+    bool rval = false;
+
+    bref->bref_dcb = dcb_connect(serv, session, serv->protocol);
+
+    if (bref->bref_dcb != NULL)
+    {
+        bref_clear_state(bref, BREF_CLOSED);
+        bref->closed_at = 0;
+        /** The statements prepared in the old connection are gone */
+        bref->bref_conn_seq++;
+
+        if (!execute_history || execute_sescmd_history(bref))
+        {
+            /** Add a callback for unresponsive server */
+            dcb_add_callback(bref->bref_dcb, DCB_REASON_NOT_RESPONDING,
+                             &router_handle_state_switch, (void *) bref);
+            bref->bref_state = 0;
+            bref_set_state(bref, BREF_IN_USE);
+            atomic_add(&bref->bref_backend->backend_conn_count, 1);
+            rval = true;
+        }
+        else
+        {
+            MXS_ERROR("Failed to execute session command in %s (%s:%d). See earlier "
+                      "errors for more details.",
+                      bref->bref_backend->backend_server->unique_name,
+                      bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
+            RW_CHK_DCB(bref, bref->bref_dcb);
+            dcb_close(bref->bref_dcb);
+            RW_CLOSE_BREF(bref);
+            bref->bref_dcb = NULL;
+        }
+    }
+    else
+    {
+        MXS_ERROR("Unable to establish connection with server %s:%d",
+                  serv->name, serv->port);
+    }
+
+    return rval;
+}
+
+/**
+ * @brief Log server connections
+ *
+ * @param select_criteria Slave selection criteria
+ * @param backend_ref Backend reference array
+ * @param router_nservers Number of backends in @p backend_ref
+ */
+void log_server_connections(select_criteria_t select_criteria,
+                            backend_ref_t *backend_ref, int router_nservers)
+{
+    if (select_criteria == LEAST_GLOBAL_CONNECTIONS ||
+        select_criteria == LEAST_ROUTER_CONNECTIONS ||
+        select_criteria == LEAST_BEHIND_MASTER ||
+        select_criteria == LEAST_CURRENT_OPERATIONS ||
+        select_criteria == LEAST_RESPONSE_TIME ||
+        select_criteria == LEAST_SERVER_LOAD)
+    {
+        MXS_INFO("Servers and %s connection counts:",
+                 select_criteria == LEAST_GLOBAL_CONNECTIONS ? "all MaxScale"
+                 : "router");
+
+        for (int i = 0; i < router_nservers; i++)
+        {
+            BACKEND *b = backend_ref[i].bref_backend;
+
+            switch (select_criteria)
+            {
+                case LEAST_GLOBAL_CONNECTIONS:
+                    MXS_INFO("MaxScale connections : %d in \t%s:%d %s",
+                             b->backend_server->stats.n_current, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                case LEAST_ROUTER_CONNECTIONS:
+                    MXS_INFO("RWSplit connections : %d in \t%s:%d %s",
+                             b->backend_conn_count, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                case LEAST_CURRENT_OPERATIONS:
+                    MXS_INFO("current operations : %d in \t%s:%d %s",
+                             b->backend_server->stats.n_current_ops,
+                             b->backend_server->name, b->backend_server->port,
+                             STRSRVSTATUS(b->backend_server));
+                    break;
+
+                case LEAST_BEHIND_MASTER:
+                    MXS_INFO("replication lag : %d in \t%s:%d %s",
+                             b->backend_server->rlag, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                case LEAST_RESPONSE_TIME:
+                    MXS_INFO("average response time : %d us in \t%s:%d %s",
+                             b->avg_response_time, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                case LEAST_SERVER_LOAD:
+                    MXS_INFO("server load : %ld in \t%s:%d %s",
+                             atomic_load_int64(&b->backend_server->load), b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Check whether it's possible to connect to this server
+ *
+ * @param bref Backend reference
+ * @return True if a connection to this server can be attempted
+ */
+static bool bref_valid_for_connect(const backend_ref_t *bref)
+{
+    return !BREF_HAS_FAILED(bref) &&
+        SERVER_IS_RUNNING(bref->bref_backend->backend_server);
+}
+
+/**
+ * Check whether it's possible to use this server as a slave
+ *
+ * Draining servers are not connected to as slaves.
+ *
+ * @param bref Backend reference
+ * @param master_host The master server
+ * @return True if this server is a valid slave candidate
+ */
+static bool bref_valid_for_slave(const backend_ref_t *bref, const SERVER *master_host)
+{
+    SERVER *server = bref->bref_backend->backend_server;
+
+    return (SERVER_IS_SLAVE(server) || SERVER_IS_RELAY_SERVER(server)) &&
+        !SERVER_IS_DRAINING(server) &&
+        (master_host == NULL || (server != master_host));
+}
+
+/**
+ * @brief Find the best slave candidate
+ *
+ * This function iterates through @c bref and tries to find the best backend
+ * reference that is not in use. @c cmpfun will be called to compare the backends.
+ *
+ * @param bref Backend reference
+ * @param n Size of @c bref
+ * @param master The master server
+ * @param cmpfun qsort() compatible comparison function
+ * @return The best slave backend reference or NULL if no candidates could be found
+ */
+backend_ref_t* get_slave_candidate(backend_ref_t *bref, int n, const SERVER *master,
+                                   int (*cmpfun)(const void *, const void *))
+{
+    backend_ref_t *candidate = NULL;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (!BREF_IS_IN_USE(&bref[i]) &&
+            bref_valid_for_connect(&bref[i]) &&
+            bref_valid_for_slave(&bref[i], master))
+        {
+            if (candidate)
+            {
+                if (cmpfun(candidate, &bref[i]) > 0)
+                {
+                    candidate = &bref[i];
+                }
+            }
+            else
+            {
+                candidate = &bref[i];
+            }
+        }
+    }
+
+    return candidate;
+}
+
+/**
+ * @brief Search suitable backend servers from those of router instance
+ *
+ * It is assumed that there is only one master among servers of a router instance.
+ * As a result, the first master found is chosen. There will possibly be more
+ * backend references than connected backends because only those in correct state
+ * are connected to.
+ *
+ * @param p_master_ref Pointer to location where master's backend reference is to  be stored
+ * @param backend_ref Pointer to backend server reference object array
+ * @param router_nservers Number of backend server pointers pointed to by @p backend_ref
+ * @param max_nslaves Upper limit for the number of slaves
+ * @param max_slave_rlag Maximum allowed replication lag for any slave
+ * @param select_criteria Slave selection criteria
+ * @param session Client session
+ * @param router Router instance
+ * @return true, if at least one master and one slave was found.
+ */
+static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
+                                           backend_ref_t *backend_ref,
+                                           int router_nservers, int max_nslaves,
+                                           int max_slave_rlag,
+                                           select_criteria_t select_criteria,
+                                           SESSION *session,
+                                           ROUTER_INSTANCE *router,
+                                           bool active_session)
+{
+    if (p_master_ref == NULL || backend_ref == NULL)
+    {
+        MXS_ERROR("Master reference (%p) or backend reference (%p) is NULL.",
+                  p_master_ref, backend_ref);
+        ss_dassert(false);
+        return false;
     }
 
-    if (writebuf != NULL && client_dcb != NULL)
+    /* get the root Master */
+    BACKEND *master_backend = get_cached_root_master(router, backend_ref, router_nservers);
+    SERVER  *master_host = master_backend ? master_backend->backend_server : NULL;
+
+    if (router->rwsplit_config.rw_master_failure_mode == RW_FAIL_INSTANTLY &&
+        (master_host == NULL || SERVER_IS_DOWN(master_host)))
     {
-        /** Write reply to client DCB */
-        SESSION_ROUTE_REPLY(backend_dcb->session, writebuf);
+        MXS_ERROR("Couldn't find suitable Master from %d candidates.", router_nservers);
+        return false;
     }
-    /** Unlock router session */
-    rses_end_locked_router_action(router_cli_ses);
 
-    /** Lock router session */
-    if (!rses_begin_locked_router_action(router_cli_ses))
+    /**
+     * New session:
+     *
+     * Connect to both master and slaves
+     *
+     * Existing session:
+     *
+     * Master is already connected or we don't have a master. The function was
+     * called because new slaves must be selected to replace failed ones.
+     */
+    bool master_connected = active_session || *p_master_ref != NULL;
+
+    /** Check slave selection criteria and set compare function */
+    int (*p)(const void *, const void *) = criteria_cmpfun[select_criteria];
+    ss_dassert(p);
+
+    SERVER *old_master = *p_master_ref ? (*p_master_ref)->bref_backend->backend_server : NULL;
+
+    if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
     {
-        /** Log to debug that router was closed */
-        goto lock_failed;
+        log_server_connections(select_criteria, backend_ref, router_nservers);
     }
-    /** There is one pending session command to be executed. */
-    if (sescmd_cursor_is_active(scur))
-    {
-        bool succp;
 
-        MXS_INFO("Backend %s:%d processed reply and starts to execute "
-                 "active cursor.", bref->bref_backend->backend_server->name,
-                 bref->bref_backend->backend_server->port);
+    int slaves_found = 0;
+    int slaves_connected = 0;
+    const int min_nslaves = 0; /*< not configurable at the time */
+    bool succp = false;
 
-        succp = execute_sescmd_in_backend(bref);
+    if (!master_connected)
+    {
+        /** Find a master server */
+        for (int i = 0; i < router_nservers; i++)
+        {
+            SERVER *serv = backend_ref[i].bref_backend->backend_server;
 
-        if (!succp)
+            if (bref_valid_for_connect(&backend_ref[i]) &&
+                master_host && serv == master_host)
+            {
+                if (connect_server(&backend_ref[i], session, false))
+                {
+                    *p_master_ref = &backend_ref[i];
+                    break;
+                }
+            }
+        }
+    }
+
+    /** Calculate how many connections we already have */
+    for (int i = 0; i < router_nservers; i++)
+    {
+        if (bref_valid_for_connect(&backend_ref[i]) &&
+            bref_valid_for_slave(&backend_ref[i], master_host))
         {
-            MXS_INFO("Backend %s:%d failed to execute session command.",
-                     bref->bref_backend->backend_server->name,
-                     bref->bref_backend->backend_server->port);
+            slaves_found += 1;
+
+            if (BREF_IS_IN_USE(&backend_ref[i]))
+            {
+                slaves_connected += 1;
+            }
         }
     }
-    else if (bref->bref_pending_cmd != NULL) /*< non-sescmd is waiting to be routed */
+
+    ss_dassert(slaves_connected < max_nslaves || max_nslaves == 0);
+
+    if (max_nslaves > 0 && slaves_connected == max_nslaves)
     {
-        int ret;
+        MXS_ERROR("Unexpected reconnection of slave servers. Found %d slaves with "
+                  "a maximum of %d connected slaves.", slaves_found, max_nslaves);
+    }
 
-        CHK_GWBUF(bref->bref_pending_cmd);
+    backend_ref_t *bref = get_slave_candidate(backend_ref, router_nservers, master_host, p);
 
-        if ((ret = bref->bref_dcb->func.write(bref->bref_dcb,
-                       gwbuf_clone(bref->bref_pending_cmd))) == 1)
+    /** Connect to all possible slaves */
+    while (bref && slaves_connected < max_nslaves)
+    {
+        if (connect_server(bref, session, true))
         {
-            ROUTER_INSTANCE* inst = (ROUTER_INSTANCE *)instance;
-            atomic_add(&inst->stats.n_queries, 1);
-            /**
-             * Add one query response waiter to backend reference
-             */
-            bref_set_state(bref, BREF_QUERY_ACTIVE);
-            bref_set_state(bref, BREF_WAITING_RESULT);
+            slaves_connected += 1;
         }
         else
         {
-            char* sql = modutil_get_SQL(bref->bref_pending_cmd);
+            /** Failed to connect, mark server as failed */
+            bref_set_state(bref, BREF_FATAL_FAILURE);
+        }
 
-            if (sql)
+        bref = get_slave_candidate(backend_ref, router_nservers, master_host, p);
+    }
+
+    /**
+     * Successful cases
+     */
+    if (slaves_connected >= min_nslaves && slaves_connected <= max_nslaves)
+    {
+        succp = true;
+
+        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        {
+            if (slaves_connected < max_nslaves)
             {
-                MXS_ERROR("Routing query \"%s\" failed.", sql);
-                free(sql);
+                MXS_INFO("Couldn't connect to maximum number of "
+                         "slaves. Connected successfully to %d slaves "
+                         "of %d of them.", slaves_connected, slaves_found);
             }
-            else
+
+            for (int i = 0; i < router_nservers; i++)
             {
-                MXS_ERROR("Failed to route query.");
+                if (BREF_IS_IN_USE((&backend_ref[i])))
+                {
+                    MXS_INFO("Selected %s in \t%s:%d",
+                             STRSRVSTATUS(backend_ref[i].bref_backend->backend_server),
+                             backend_ref[i].bref_backend->backend_server->name,
+                             backend_ref[i].bref_backend->backend_server->port);
+                }
+            } /* for */
+        }
+    }
+        /** Failure cases */
+    else
+    {
+        MXS_ERROR("Couldn't establish required amount of slave connections for "
+                  "router session. Would need between %d and %d slaves but only have %d.",
+                  min_nslaves, max_nslaves, slaves_connected);
+
+        /** Clean up connections */
+        for (int i = 0; i < router_nservers; i++)
+        {
+            if (BREF_IS_IN_USE((&backend_ref[i])))
+            {
+                ss_dassert(backend_ref[i].bref_backend->backend_conn_count > 0);
+
+                close_failed_bref(&backend_ref[i], true);
+
+                /** Decrease backend's connection counter. */
+                atomic_add(&backend_ref[i].bref_backend->backend_conn_count, -1);
+                RW_CHK_DCB(&backend_ref[i], backend_ref[i].bref_dcb);
+                dcb_close(backend_ref[i].bref_dcb);
+                RW_CLOSE_BREF(&backend_ref[i]);
             }
         }
-        gwbuf_free(bref->bref_pending_cmd);
-        bref->bref_pending_cmd = NULL;
     }
-    /** Unlock router session */
-    rses_end_locked_router_action(router_cli_ses);
 
-lock_failed:
-    return;
+    return succp;
 }
 
-/** Compare nunmber of connections from this router in backend servers */
-int bref_cmp_router_conn(const void *bref1, const void *bref2)
+/**
+ * Create a generic router session property strcture.
+ */
+static rses_property_t *rses_property_init(rses_property_type_t prop_type)
 {
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+    rses_property_t *prop;
 
-    if (b1->weight == 0 && b2->weight == 0)
-    {
-        return b1->backend_server->stats.n_current -
-               b2->backend_server->stats.n_current;
-    }
-    else if (b1->weight == 0)
-    {
-        return 1;
-    }
-    else if (b2->weight == 0)
+    prop = (rses_property_t *)calloc(1, sizeof(rses_property_t));
+    if (prop == NULL)
     {
-        return -1;
+        MXS_ERROR("Error: Malloc returned NULL. (%s:%d)", __FILE__, __LINE__);
+        return NULL;
     }
+    prop->rses_prop_type = prop_type;
+    memusage_alloc(MEMUSAGE_SESCMD, sizeof(rses_property_t));
+#if defined(SS_DEBUG)
+    prop->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
+    prop->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
+#endif
 
-    return ((1000 + 1000 * b1->backend_conn_count) / b1->weight) -
-           ((1000 + 1000 * b2->backend_conn_count) / b2->weight);
+    CHK_RSES_PROP(prop);
+    return prop;
 }
 
-/** Compare nunmber of global connections in backend servers */
-int bref_cmp_global_conn(const void *bref1, const void *bref2)
+/**
+ * Property is freed at the end of router client session.
+ */
+static void rses_property_done(rses_property_t *prop)
 {
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+    if (prop == NULL)
+    {
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return;
+    }
+    CHK_RSES_PROP(prop);
 
-    if (b1->weight == 0 && b2->weight == 0)
+    switch (prop->rses_prop_type)
     {
-        return b1->backend_server->stats.n_current -
-               b2->backend_server->stats.n_current;
+        case RSES_PROP_TYPE_SESCMD:
+            mysql_sescmd_done(&prop->rses_prop_data.sescmd);
+            break;
+
+        default:
+            MXS_DEBUG("%lu [rses_property_done] Unknown property type %d "
+                      "in property %p", pthread_self(), prop->rses_prop_type, prop);
+
+            ss_dassert(false);
+            break;
     }
-    else if (b1->weight == 0)
+    memusage_free(MEMUSAGE_SESCMD, sizeof(rses_property_t));
+    free(prop);
+}
+
+/**
+ * Add property to the router_client_ses structure's rses_properties
+ * array. The slot is determined by the type of property.
+ * In each slot there is a list of properties of similar type.
+ *
+ * Router client session must be locked.
+ */
+static int rses_property_add(ROUTER_CLIENT_SES *rses, rses_property_t *prop)
+{
+    if (rses == NULL)
     {
-        return 1;
+        MXS_ERROR("Router client session is NULL. (%s:%d)", __FILE__, __LINE__);
+        return -1;
     }
-    else if (b2->weight == 0)
+    if (prop == NULL)
     {
+        MXS_ERROR("Router client session property is NULL. (%s:%d)", __FILE__, __LINE__);
         return -1;
     }
+    rses_property_t *p;
 
-    return ((1000 + 1000 * b1->backend_server->stats.n_current) / b1->weight) -
-           ((1000 + 1000 * b2->backend_server->stats.n_current) / b2->weight);
-}
+    CHK_CLIENT_RSES(rses);
+    CHK_RSES_PROP(prop);
+    ss_dassert(RSES_IS_LOCKED(rses));
 
-/** Compare relication lag between backend servers */
-int bref_cmp_behind_master(const void *bref1, const void *bref2)
-{
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+    prop->rses_prop_rsession = rses;
+    p = rses->rses_properties[prop->rses_prop_type];
 
-    return ((b1->backend_server->rlag < b2->backend_server->rlag) ? -1
-            : ((b1->backend_server->rlag > b2->backend_server->rlag) ? 1 : 0));
+    if (p == NULL)
+    {
+        rses->rses_properties[prop->rses_prop_type] = prop;
+    }
+    else
+    {
+        while (p->rses_prop_next != NULL)
+        {
+            p = p->rses_prop_next;
+        }
+        p->rses_prop_next = prop;
+    }
+    return 0;
 }
 
-/** Compare nunmber of current operations in backend servers */
-int bref_cmp_current_load(const void *bref1, const void *bref2)
+/**
+ * Router session must be locked.
+ * Return session command pointer if succeed, NULL if failed.
+ */
+static mysql_sescmd_t *rses_property_get_sescmd(rses_property_t *prop)
 {
-    SERVER *s1 = ((backend_ref_t *)bref1)->bref_backend->backend_server;
-    SERVER *s2 = ((backend_ref_t *)bref2)->bref_backend->backend_server;
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+    mysql_sescmd_t *sescmd;
 
-    if (b1->weight == 0 && b2->weight == 0)
-    {
-        return b1->backend_server->stats.n_current -
-               b2->backend_server->stats.n_current;
-    }
-    else if (b1->weight == 0)
+    if (prop == NULL)
     {
-        return 1;
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return NULL;
     }
-    else if (b2->weight == 0)
+
+    CHK_RSES_PROP(prop);
+    ss_dassert(prop->rses_prop_rsession == NULL ||
+               RSES_IS_LOCKED(prop->rses_prop_rsession));
+
+    sescmd = &prop->rses_prop_data.sescmd;
+
+    if (sescmd != NULL)
     {
-        return -1;
+        CHK_MYSQL_SESCMD(sescmd);
     }
-
-    return ((1000 * s1->stats.n_current_ops) - b1->weight) -
-           ((1000 * s2->stats.n_current_ops) - b2->weight);
+    return sescmd;
 }
 
-static void bref_clear_state(backend_ref_t *bref, bref_state_t state)
+/**
+ * Create session command property.
+ */
+/**
+ * Return the shared copy of a session command packet. A packet that is not
+ * in the table of shared session commands yet is copied into it.
+ *
+ * Only COM_QUERY and COM_INIT_DB packets are shared. A COM_CHANGE_USER
+ * carries the credentials of the session and is kept as it is.
+ *
+ * @param buf         The packet, freed if the shared copy is returned
+ * @param packet_type Command of the packet
+ * @param shared      Where the shared entry is stored, NULL if the packet
+ *                    is not shared
+ * @return A clone of the shared copy, or buf
+ */
+static GWBUF *sescmd_share(GWBUF *buf, unsigned char packet_type, sescmd_shared_t **shared)
 {
-    if (bref == NULL)
+    *shared = NULL;
+
+    if ((packet_type != MYSQL_COM_QUERY && packet_type != MYSQL_COM_INIT_DB) ||
+        buf->next != NULL || GWBUF_LENGTH(buf) > SESCMD_SHARED_MAX_LEN)
     {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return;
+        return buf;
     }
 
-    if ((state & BREF_WAITING_RESULT) && (bref->bref_state & BREF_WAITING_RESULT))
-    {
-        int prev1;
-        int prev2;
+    const uint8_t *data = GWBUF_DATA(buf);
+    size_t len = GWBUF_LENGTH(buf);
+    uint64_t hash = mxs_fnv1a64(MXS_FNV1A64_INIT, data, len);
+    int bucket = hash % SESCMD_SHARED_BUCKETS;
+    sescmd_shared_t *entry;
+    GWBUF *clone = NULL;
 
-        /** Decrease waiter count */
-        prev1 = atomic_add(&bref->bref_num_result_wait, -1);
+    spinlock_acquire(&sescmd_shared[bucket].lock);
 
-        if (prev1 <= 0)
+    for (entry = sescmd_shared[bucket].entries; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && GWBUF_LENGTH(entry->buf) == len &&
+            memcmp(GWBUF_DATA(entry->buf), data, len) == 0)
         {
-            atomic_add(&bref->bref_num_result_wait, 1);
+            break;
+        }
+    }
+
+    /** The copy has none of the parsing information that the query carries */
+    if (entry == NULL && (entry = malloc(sizeof(sescmd_shared_t))) != NULL)
+    {
+        if ((entry->buf = gwbuf_alloc_and_load(len, (void *)data)) != NULL)
+        {
+            gwbuf_set_type(entry->buf, GWBUF_TYPE_MYSQL | GWBUF_TYPE_SINGLE_STMT);
+            entry->hash = hash;
+            entry->refcount = 0;
+            entry->next = sescmd_shared[bucket].entries;
+            sescmd_shared[bucket].entries = entry;
+            atomic_add(&sescmd_n_shared, 1);
+            memusage_alloc(MEMUSAGE_SESCMD, sizeof(sescmd_shared_t) + len);
         }
         else
         {
-            /** Decrease global operation count */
-            prev2 = atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, -1);
-            ss_dassert(prev2 > 0);
-            if (prev2 <= 0)
-            {
-                MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                          __FUNCTION__, bref->bref_backend->backend_server->name,
-                          bref->bref_backend->backend_server->port);
-            }
+            free(entry);
+            entry = NULL;
         }
     }
 
-    bref->bref_state &= ~state;
-}
-
-static void bref_set_state(backend_ref_t *bref, bref_state_t state)
-{
-    if (bref == NULL)
+    if (entry && (clone = gwbuf_clone(entry->buf)) != NULL)
     {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return;
+        entry->refcount++;
     }
 
-    if ((state & BREF_WAITING_RESULT) && (bref->bref_state & BREF_WAITING_RESULT) == 0)
-    {
-        int prev1;
-        int prev2;
+    spinlock_release(&sescmd_shared[bucket].lock);
 
-        /** Increase waiter count */
-        prev1 = atomic_add(&bref->bref_num_result_wait, 1);
-        ss_dassert(prev1 >= 0);
-        if (prev1 < 0)
-        {
-            MXS_ERROR("[%s] Error: negative number of connections waiting for "
-                      "results in backend %s:%u",
-                      __FUNCTION__, bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
-        }
-        /** Increase global operation count */
-        prev2 =
-            atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, 1);
-        ss_dassert(prev2 >= 0);
-        if (prev2 < 0)
-        {
-            MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                      __FUNCTION__, bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
-        }
+    if (clone == NULL)
+    {
+        /** An unused entry is taken by the next session that executes the command */
+        return buf;
     }
 
-    bref->bref_state |= state;
+    gwbuf_free(buf);
+    *shared = entry;
+    return clone;
 }
 
 /**
- * @brief Connect a server
- *
- * Connects to a server, adds callbacks to the created DCB and updates
- * router statistics. If @p execute_history is true, the session command
- * history will be executed on this server.
+ * Release a shared session command. The last history entry that uses it
+ * removes it from the table.
  *
- * @param b Router's backend structure for the server
- * @param session Client's session object
- * @param execute_history Execute session command history
- * @return True if successful, false if an error occurred
+ * @param shared The shared entry
  */
-bool connect_server(backend_ref_t *bref, SESSION *session, bool execute_history)
+static void sescmd_unshare(sescmd_shared_t *shared)
 {
-    SERVER *serv = bref->bref_backend->backend_server;
-    bool rval = false;
+    int bucket = shared->hash % SESCMD_SHARED_BUCKETS;
+    sescmd_shared_t *removed = NULL;
 
-    bref->bref_dcb = dcb_connect(serv, session, serv->protocol);
+    spinlock_acquire(&sescmd_shared[bucket].lock);
 
-    if (bref->bref_dcb != NULL)
+    if (--shared->refcount == 0)
     {
-        bref_clear_state(bref, BREF_CLOSED);
-        bref->closed_at = 0;
+        sescmd_shared_t **pentry = &sescmd_shared[bucket].entries;
 
-        if (!execute_history || execute_sescmd_history(bref))
-        {
-            /** Add a callback for unresponsive server */
-            dcb_add_callback(bref->bref_dcb, DCB_REASON_NOT_RESPONDING,
-                             &router_handle_state_switch, (void *) bref);
-            bref->bref_state = 0;
-            bref_set_state(bref, BREF_IN_USE);
-            atomic_add(&bref->bref_backend->backend_conn_count, 1);
-            rval = true;
-        }
-        else
+        while (*pentry != shared)
         {
-            MXS_ERROR("Failed to execute session command in %s (%s:%d). See earlier "
-                      "errors for more details.",
-                      bref->bref_backend->backend_server->unique_name,
-                      bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
-            RW_CHK_DCB(bref, bref->bref_dcb);
-            dcb_close(bref->bref_dcb);
-            RW_CLOSE_BREF(bref);
-            bref->bref_dcb = NULL;
+            pentry = &(*pentry)->next;
         }
+
+        *pentry = shared->next;
+        removed = shared;
     }
-    else
+
+    spinlock_release(&sescmd_shared[bucket].lock);
+
+    if (removed)
     {
-        MXS_ERROR("Unable to establish connection with server %s:%d",
-                  serv->name, serv->port);
+        /** The queries that are being written hold their own references to the data */
+        memusage_free(MEMUSAGE_SESCMD, sizeof(sescmd_shared_t) + GWBUF_LENGTH(removed->buf));
+        atomic_add(&sescmd_n_shared, -1);
+        gwbuf_free(removed->buf);
+        free(removed);
     }
-
-    return rval;
 }
 
-/**
- * @brief Log server connections
- *
- * @param select_criteria Slave selection criteria
- * @param backend_ref Backend reference array
- * @param router_nservers Number of backends in @p backend_ref
- */
-void log_server_connections(select_criteria_t select_criteria,
-                            backend_ref_t *backend_ref, int router_nservers)
+static mysql_sescmd_t *mysql_sescmd_init(rses_property_t *rses_prop,
+                                         GWBUF *sescmd_buf,
+                                         unsigned char packet_type,
+                                         ROUTER_CLIENT_SES *rses)
 {
-    if (select_criteria == LEAST_GLOBAL_CONNECTIONS ||
-        select_criteria == LEAST_ROUTER_CONNECTIONS ||
-        select_criteria == LEAST_BEHIND_MASTER ||
-        select_criteria == LEAST_CURRENT_OPERATIONS)
-    {
-        MXS_INFO("Servers and %s connection counts:",
-                 select_criteria == LEAST_GLOBAL_CONNECTIONS ? "all MaxScale"
-                 : "router");
+    mysql_sescmd_t *sescmd;
 
-        for (int i = 0; i < router_nservers; i++)
-        {
-            BACKEND *b = backend_ref[i].bref_backend;
+    CHK_RSES_PROP(rses_prop);
+    /** Can't call rses_property_get_sescmd with uninitialized sescmd */
+    sescmd = &rses_prop->rses_prop_data.sescmd;
+    sescmd->my_sescmd_prop = rses_prop; /*< reference to owning property */
+#if defined(SS_DEBUG)
+    sescmd->my_sescmd_chk_top = CHK_NUM_MY_SESCMD;
+    sescmd->my_sescmd_chk_tail = CHK_NUM_MY_SESCMD;
+#endif
+    sescmd->my_sescmd_packet_type = packet_type;
+    sescmd->position = atomic_add(&rses->pos_generator, 1);
 
-            switch (select_criteria)
-            {
-                case LEAST_GLOBAL_CONNECTIONS:
-                    MXS_INFO("MaxScale connections : %d in \t%s:%d %s",
-                             b->backend_server->stats.n_current, b->backend_server->name,
-                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
-                    break;
+    if (rses->rses_config.rw_compact_sescmd_hist)
+    {
+        sescmd->my_sescmd_key = sescmd_get_key(sescmd_buf, packet_type);
+        sescmd->my_sescmd_stateless = (packet_type == MYSQL_COM_PING ||
+                                       packet_type == MYSQL_COM_DEBUG ||
+                                       packet_type == MYSQL_COM_REFRESH);
+    }
 
-                case LEAST_ROUTER_CONNECTIONS:
-                    MXS_INFO("RWSplit connections : %d in \t%s:%d %s",
-                             b->backend_conn_count, b->backend_server->name,
-                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
-                    break;
+    /** Set session command buffer, shared with the other sessions if possible */
+    sescmd->my_sescmd_buf = sescmd_share(sescmd_buf, packet_type, &sescmd->my_sescmd_shared);
 
-                case LEAST_CURRENT_OPERATIONS:
-                    MXS_INFO("current operations : %d in \t%s:%d %s",
-                             b->backend_server->stats.n_current_ops,
-                             b->backend_server->name, b->backend_server->port,
-                             STRSRVSTATUS(b->backend_server));
-                    break;
+    return sescmd;
+}
 
-                case LEAST_BEHIND_MASTER:
-                    MXS_INFO("replication lag : %d in \t%s:%d %s",
-                             b->backend_server->rlag, b->backend_server->name,
-                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
-                default:
-                    break;
-            }
-        }
+static void mysql_sescmd_done(mysql_sescmd_t *sescmd)
+{
+    if (sescmd == NULL)
+    {
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return;
+    }
+    CHK_RSES_PROP(sescmd->my_sescmd_prop);
+    gwbuf_free(sescmd->my_sescmd_buf);
+    if (sescmd->my_sescmd_shared)
+    {
+        sescmd_unshare(sescmd->my_sescmd_shared);
     }
+    free(sescmd->my_sescmd_key);
+    memset(sescmd, 0, sizeof(mysql_sescmd_t));
 }
 
-/**
- * @brief Check whether it's possible to connect to this server
- *
- * @param bref Backend reference
- * @return True if a connection to this server can be attempted
- */
-static bool bref_valid_for_connect(const backend_ref_t *bref)
+static const char *sescmd_skip_space(const char *ptr, const char *end)
 {
-    return !BREF_HAS_FAILED(bref) &&
-        SERVER_IS_RUNNING(bref->bref_backend->backend_server);
+    while (ptr < end && isspace((unsigned char)*ptr))
+    {
+        ptr++;
+    }
+    return ptr;
 }
 
-/**
- * Check whether it's possible to use this server as a slave
- *
- * @param bref Backend reference
- * @param master_host The master server
- * @return True if this server is a valid slave candidate
- */
-static bool bref_valid_for_slave(const backend_ref_t *bref, const SERVER *master_host)
+/** Check whether the SQL at ptr starts with a keyword */
+static bool sescmd_is_word(const char *ptr, const char *end, const char *word)
 {
-    SERVER *server = bref->bref_backend->backend_server;
+    size_t len = strlen(word);
 
-    return (SERVER_IS_SLAVE(server) || SERVER_IS_RELAY_SERVER(server)) &&
-        (master_host == NULL || (server != master_host));
+    return (size_t)(end - ptr) >= len && strncasecmp(ptr, word, len) == 0 &&
+           ((size_t)(end - ptr) == len || !(isalnum((unsigned char)ptr[len]) || ptr[len] == '_'));
 }
 
 /**
- * @brief Find the best slave candidate
- *
- * This function iterates through @c bref and tries to find the best backend
- * reference that is not in use. @c cmpfun will be called to compare the backends.
+ * Check that the value assigned to a variable does not depend on earlier
+ * session state: it must not refer to variables or to the variable being
+ * set, and there must be no further assignments.
  *
- * @param bref Backend reference
- * @param n Size of @c bref
- * @param master The master server
- * @param cmpfun qsort() compatible comparison function
- * @return The best slave backend reference or NULL if no candidates could be found
+ * @param ptr  Start of the value
+ * @param end  End of the statement
+ * @param name Name of the variable being set
+ * @param len  Length of the name
+ * @return True if the value is independent of the session state
  */
-backend_ref_t* get_slave_candidate(backend_ref_t *bref, int n, const SERVER *master,
-                                   int (*cmpfun)(const void *, const void *))
+static bool sescmd_value_is_independent(const char *ptr, const char *end,
+                                        const char *name, size_t len)
 {
-    backend_ref_t *candidate = NULL;
-
-    for (int i = 0; i < n; i++)
+    while (ptr < end)
     {
-        if (!BREF_IS_IN_USE(&bref[i]) &&
-            bref_valid_for_connect(&bref[i]) &&
-            bref_valid_for_slave(&bref[i], master))
+        if (*ptr == '\'' || *ptr == '"')
         {
-            if (candidate)
+            char quote = *ptr++;
+
+            while (ptr < end && *ptr != quote)
             {
-                if (cmpfun(candidate, &bref[i]) > 0)
+                if (*ptr == '\\')
                 {
-                    candidate = &bref[i];
+                    ptr++;
                 }
+                ptr++;
             }
-            else
+            ptr++;
+        }
+        else if (*ptr == ',' || *ptr == '@')
+        {
+            return false;
+        }
+        else if (isalnum((unsigned char)*ptr) || *ptr == '_')
+        {
+            const char *word = ptr;
+
+            while (ptr < end && (isalnum((unsigned char)*ptr) || *ptr == '_' || *ptr == '$'))
             {
-                candidate = &bref[i];
+                ptr++;
             }
+
+            if ((size_t)(ptr - word) == len && strncasecmp(word, name, len) == 0)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            ptr++;
         }
     }
 
-    return candidate;
+    return true;
 }
 
 /**
- * @brief Search suitable backend servers from those of router instance
- *
- * It is assumed that there is only one master among servers of a router instance.
- * As a result, the first master found is chosen. There will possibly be more
- * backend references than connected backends because only those in correct state
- * are connected to.
+ * Get the key of a session command. Commands with the same key set the same
+ * part of the session state, so only the last one of them needs to be kept
+ * in the history. Only simple statements are recognized: USE, COM_INIT_DB,
+ * SET NAMES and SET of a single variable to a value that does not depend on
+ * the session state.
  *
- * @param p_master_ref Pointer to location where master's backend reference is to  be stored
- * @param backend_ref Pointer to backend server reference object array
- * @param router_nservers Number of backend server pointers pointed to by @p backend_ref
- * @param max_nslaves Upper limit for the number of slaves
- * @param max_slave_rlag Maximum allowed replication lag for any slave
- * @param select_criteria Slave selection criteria
- * @param session Client session
- * @param router Router instance
- * @return true, if at least one master and one slave was found.
+ * @param buf         The session command
+ * @param packet_type The command byte
+ * @return The key, or NULL if the command can not be superseded
  */
-static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
-                                           backend_ref_t *backend_ref,
-                                           int router_nservers, int max_nslaves,
-                                           int max_slave_rlag,
-                                           select_criteria_t select_criteria,
-                                           SESSION *session,
-                                           ROUTER_INSTANCE *router,
-                                           bool active_session)
+static char *sescmd_get_key(GWBUF *buf, unsigned char packet_type)
 {
-    if (p_master_ref == NULL || backend_ref == NULL)
+    char *sql;
+    int sql_len;
+
+    if (packet_type == MYSQL_COM_INIT_DB)
     {
-        MXS_ERROR("Master reference (%p) or backend reference (%p) is NULL.",
-                  p_master_ref, backend_ref);
-        ss_dassert(false);
-        return false;
+        return strdup("use");
     }
 
-    /* get the root Master */
-    BACKEND *master_backend = get_root_master(backend_ref, router_nservers);
-    SERVER  *master_host = master_backend ? master_backend->backend_server : NULL;
-
-    if (router->rwsplit_config.rw_master_failure_mode == RW_FAIL_INSTANTLY &&
-        (master_host == NULL || SERVER_IS_DOWN(master_host)))
+    if (packet_type != MYSQL_COM_QUERY || !modutil_extract_SQL(buf, &sql, &sql_len))
     {
-        MXS_ERROR("Couldn't find suitable Master from %d candidates.", router_nservers);
-        return false;
+        return NULL;
     }
 
-    /**
-     * New session:
-     *
-     * Connect to both master and slaves
-     *
-     * Existing session:
-     *
-     * Master is already connected or we don't have a master. The function was
-     * called because new slaves must be selected to replace failed ones.
-     */
-    bool master_connected = active_session || *p_master_ref != NULL;
+    const char *end = sql + sql_len;
+    const char *ptr = sescmd_skip_space(sql, end);
 
-    /** Check slave selection criteria and set compare function */
-    int (*p)(const void *, const void *) = criteria_cmpfun[select_criteria];
-    ss_dassert(p);
+    while (end > ptr && (isspace((unsigned char)end[-1]) || end[-1] == ';'))
+    {
+        end--;
+    }
 
-    SERVER *old_master = *p_master_ref ? (*p_master_ref)->bref_backend->backend_server : NULL;
+    if (sescmd_is_word(ptr, end, "USE"))
+    {
+        return strdup("use");
+    }
 
-    if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+    if (!sescmd_is_word(ptr, end, "SET"))
     {
-        log_server_connections(select_criteria, backend_ref, router_nservers);
+        return NULL;
     }
 
-    int slaves_found = 0;
-    int slaves_connected = 0;
-    const int min_nslaves = 0; /*< not configurable at the time */
-    bool succp = false;
+    ptr = sescmd_skip_space(ptr + 3, end);
 
-    if (!master_connected)
+    if (sescmd_is_word(ptr, end, "SESSION"))
     {
-        /** Find a master server */
-        for (int i = 0; i < router_nservers; i++)
-        {
-            SERVER *serv = backend_ref[i].bref_backend->backend_server;
+        ptr = sescmd_skip_space(ptr + 7, end);
+    }
+    else if (sescmd_is_word(ptr, end, "LOCAL"))
+    {
+        ptr = sescmd_skip_space(ptr + 5, end);
+    }
+    else if (end - ptr >= 2 && ptr[0] == '@' && ptr[1] == '@')
+    {
+        ptr += 2;
 
-            if (bref_valid_for_connect(&backend_ref[i]) &&
-                master_host && serv == master_host)
-            {
-                if (connect_server(&backend_ref[i], session, false))
-                {
-                    *p_master_ref = &backend_ref[i];
-                    break;
-                }
-            }
+        if (end - ptr >= 8 && strncasecmp(ptr, "session.", 8) == 0)
+        {
+            ptr += 8;
+        }
+        else if (end - ptr >= 6 && strncasecmp(ptr, "local.", 6) == 0)
+        {
+            ptr += 6;
         }
     }
 
-    /** Calculate how many connections we already have */
-    for (int i = 0; i < router_nservers; i++)
+    bool user_var = ptr < end && *ptr == '@';
+    const char *name;
+    size_t name_len;
+
+    if (user_var)
     {
-        if (bref_valid_for_connect(&backend_ref[i]) &&
-            bref_valid_for_slave(&backend_ref[i], master_host))
+        ptr++;
+    }
+
+    if (ptr < end && *ptr == '`')
+    {
+        name = ++ptr;
+
+        while (ptr < end && *ptr != '`')
         {
-            slaves_found += 1;
+            ptr++;
+        }
 
-            if (BREF_IS_IN_USE(&backend_ref[i]))
-            {
-                slaves_connected += 1;
-            }
+        name_len = ptr - name;
+        ptr++;
+    }
+    else
+    {
+        name = ptr;
+
+        while (ptr < end && (isalnum((unsigned char)*ptr) || *ptr == '_' || *ptr == '$'))
+        {
+            ptr++;
         }
+
+        name_len = ptr - name;
     }
 
-    ss_dassert(slaves_connected < max_nslaves || max_nslaves == 0);
+    if (name_len == 0 || ptr > end || (!user_var && (strncasecmp(name, "global", name_len) == 0 ||
+                                                     strncasecmp(name, "transaction", name_len) == 0)))
+    {
+        return NULL;
+    }
 
-    if (max_nslaves > 0 && slaves_connected == max_nslaves)
+    ptr = sescmd_skip_space(ptr, end);
+
+    if (!user_var && name_len == 5 && strncasecmp(name, "names", 5) == 0)
     {
-        MXS_ERROR("Unexpected reconnection of slave servers. Found %d slaves with "
-                  "a maximum of %d connected slaves.", slaves_found, max_nslaves);
+        /** SET NAMES charset [COLLATE collation] */
+        name_len = 0;
+    }
+    else if (end - ptr >= 2 && ptr[0] == ':' && ptr[1] == '=')
+    {
+        ptr += 2;
+    }
+    else if (ptr < end && *ptr == '=')
+    {
+        ptr++;
+    }
+    else
+    {
+        return NULL;
     }
 
-    backend_ref_t *bref = get_slave_candidate(backend_ref, router_nservers, master_host, p);
+    if (!sescmd_value_is_independent(ptr, end, name, name_len))
+    {
+        return NULL;
+    }
 
-    /** Connect to all possible slaves */
-    while (bref && slaves_connected < max_nslaves)
+    char *key = malloc(sizeof("set:@") + (name_len ? name_len : sizeof("names")));
+
+    if (key)
     {
-        if (connect_server(bref, session, true))
+        char *dest = key + sprintf(key, "set:%s", user_var ? "@" : "");
+
+        if (name_len == 0)
         {
-            slaves_connected += 1;
+            strcpy(dest, "names");
         }
         else
         {
-            /** Failed to connect, mark server as failed */
-            bref_set_state(bref, BREF_FATAL_FAILURE);
+            for (size_t i = 0; i < name_len; i++)
+            {
+                dest[i] = tolower((unsigned char)name[i]);
+            }
+            dest[name_len] = '\0';
         }
-
-        bref = get_slave_candidate(backend_ref, router_nservers, master_host, p);
     }
 
-    /**
-     * Successful cases
-     */
-    if (slaves_connected >= min_nslaves && slaves_connected <= max_nslaves)
+    return key;
+}
+
+/**
+ * Check whether a statement makes a transaction read-only. START TRANSACTION
+ * READ ONLY and SET TRANSACTION READ ONLY are recognized, also with the other
+ * characteristics of the transaction separated by commas. SET GLOBAL and SET
+ * SESSION TRANSACTION change the default of the session, they are not
+ * recognized.
+ *
+ * @param buf The statement
+ * @param set Set to true if the statement is SET TRANSACTION
+ * @return True if the statement makes the transaction read-only
+ */
+static bool trx_is_read_only(GWBUF *buf, bool *set)
+{
+    char *sql;
+    int sql_len;
+
+    if (!modutil_extract_SQL(buf, &sql, &sql_len))
     {
-        succp = true;
+        return false;
+    }
 
-        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
-        {
-            if (slaves_connected < max_nslaves)
-            {
-                MXS_INFO("Couldn't connect to maximum number of "
-                         "slaves. Connected successfully to %d slaves "
-                         "of %d of them.", slaves_connected, slaves_found);
-            }
+    const char *end = sql + sql_len;
+    const char *ptr = sescmd_skip_space(sql, end);
 
-            for (int i = 0; i < router_nservers; i++)
-            {
-                if (BREF_IS_IN_USE((&backend_ref[i])))
-                {
-                    MXS_INFO("Selected %s in \t%s:%d",
-                             STRSRVSTATUS(backend_ref[i].bref_backend->backend_server),
-                             backend_ref[i].bref_backend->backend_server->name,
-                             backend_ref[i].bref_backend->backend_server->port);
-                }
-            } /* for */
-        }
+    while (end > ptr && (isspace((unsigned char)end[-1]) || end[-1] == ';'))
+    {
+        end--;
+    }
+
+    if (sescmd_is_word(ptr, end, "START"))
+    {
+        *set = false;
+        ptr += 5;
+    }
+    else if (sescmd_is_word(ptr, end, "SET"))
+    {
+        *set = true;
+        ptr += 3;
     }
-        /** Failure cases */
     else
     {
-        MXS_ERROR("Couldn't establish required amount of slave connections for "
-                  "router session. Would need between %d and %d slaves but only have %d.",
-                  min_nslaves, max_nslaves, slaves_connected);
+        return false;
+    }
 
-        /** Clean up connections */
-        for (int i = 0; i < router_nservers; i++)
+    ptr = sescmd_skip_space(ptr, end);
+
+    if (!sescmd_is_word(ptr, end, "TRANSACTION"))
+    {
+        return false;
+    }
+
+    ptr += 11;
+    bool read_only = false;
+
+    while ((ptr = sescmd_skip_space(ptr, end)) < end)
+    {
+        if (*ptr == ',')
+        {
+            ptr++;
+        }
+        else if (sescmd_is_word(ptr, end, "READ"))
+        {
+            ptr = sescmd_skip_space(ptr + 4, end);
+
+            if (sescmd_is_word(ptr, end, "ONLY"))
+            {
+                read_only = true;
+                ptr += 4;
+            }
+            else if (sescmd_is_word(ptr, end, "WRITE"))
+            {
+                read_only = false;
+                ptr += 5;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else if (!*set && sescmd_is_word(ptr, end, "WITH"))
         {
-            if (BREF_IS_IN_USE((&backend_ref[i])))
+            /** WITH CONSISTENT SNAPSHOT */
+            ptr = sescmd_skip_space(ptr + 4, end);
+
+            if (!sescmd_is_word(ptr, end, "CONSISTENT"))
             {
-                ss_dassert(backend_ref[i].bref_backend->backend_conn_count > 0);
+                return false;
+            }
 
-                close_failed_bref(&backend_ref[i], true);
+            ptr = sescmd_skip_space(ptr + 10, end);
 
-                /** Decrease backend's connection counter. */
-                atomic_add(&backend_ref[i].bref_backend->backend_conn_count, -1);
-                RW_CHK_DCB(&backend_ref[i], backend_ref[i].bref_dcb);
-                dcb_close(backend_ref[i].bref_dcb);
-                RW_CLOSE_BREF(&backend_ref[i]);
+            if (!sescmd_is_word(ptr, end, "SNAPSHOT"))
+            {
+                return false;
+            }
+
+            ptr += 8;
+        }
+        else if (*set && sescmd_is_word(ptr, end, "ISOLATION"))
+        {
+            /** ISOLATION LEVEL level, the level is not needed */
+            while (ptr < end && *ptr != ',')
+            {
+                ptr++;
             }
         }
+        else
+        {
+            return false;
+        }
     }
 
-    return succp;
+    return read_only;
 }
 
 /**
- * Create a generic router session property strcture.
+ * @brief Route read-only transactions to a slave
+ *
+ * A transaction started with START TRANSACTION READ ONLY, or a transaction
+ * that follows SET TRANSACTION READ ONLY, is routed as a whole to the slave
+ * that was chosen for its first statement. SET TRANSACTION READ ONLY itself
+ * is routed to that slave because it only affects the next transaction of
+ * the server that executes it. Statements routed to all servers, such as
+ * session commands, are still routed to all of them.
+ *
+ * Called after the transaction state of the session has been updated.
+ *
+ * @param rses           Router client session
+ * @param querybuf       The statement
+ * @param qtype          The type of the statement
+ * @param trx_was_active Whether a transaction was active before the statement
+ * @param target         The route target, changed to TARGET_SLAVE if the
+ *                       statement belongs to a read-only transaction
+ * @return True if the slave the statement is routed to should be used for the
+ *         rest of the transaction
  */
-static rses_property_t *rses_property_init(rses_property_type_t prop_type)
+static bool rses_ro_trx_target(ROUTER_CLIENT_SES *rses, GWBUF *querybuf, qc_query_type_t qtype,
+                               bool trx_was_active, route_target_t *target)
 {
-    rses_property_t *prop;
+    if (rses->rses_ro_trx_pending)
+    {
+        /** The statement after SET TRANSACTION READ ONLY */
+        rses->rses_ro_trx_pending = false;
 
-    prop = (rses_property_t *)calloc(1, sizeof(rses_property_t));
-    if (prop == NULL)
+        if (!trx_was_active && rses->rses_transaction_active &&
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX))
+        {
+            atomic_add(&rses->router->stats.n_ro_trx, 1);
+            *target = TARGET_SLAVE;
+            return false;
+        }
+
+        rses->rses_ro_trx_bref = NULL;
+    }
+    else if (rses->rses_ro_trx_bref && !trx_was_active)
     {
-        MXS_ERROR("Error: Malloc returned NULL. (%s:%d)", __FILE__, __LINE__);
-        return NULL;
+        /** The transaction was committed or rolled back by the previous statement */
+        rses->rses_ro_trx_bref = NULL;
     }
-    prop->rses_prop_type = prop_type;
-#if defined(SS_DEBUG)
-    prop->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
-    prop->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
-#endif
 
-    CHK_RSES_PROP(prop);
-    return prop;
+    if (rses->rses_ro_trx_bref)
+    {
+        if (!TARGET_IS_ALL(*target))
+        {
+            *target = TARGET_SLAVE;
+        }
+        return false;
+    }
+
+    bool set = false;
+
+    if (trx_was_active || !rses->rses_autocommit_enabled || TARGET_IS_ALL(*target) ||
+        (rses->rses_config.rw_strict_multi_stmt && rses->forced_node &&
+         rses->forced_node == rses->rses_master_ref) ||
+        !trx_is_read_only(querybuf, &set))
+    {
+        return false;
+    }
+
+    if (set)
+    {
+        rses->rses_ro_trx_pending = true;
+    }
+    else if (QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX))
+    {
+        atomic_add(&rses->router->stats.n_ro_trx, 1);
+    }
+    else
+    {
+        return false;
+    }
+
+    *target = TARGET_SLAVE;
+    return true;
 }
 
 /**
- * Property is freed at the end of router client session.
+ * Return the hash of the qualified name of the table a write is routed by.
+ * A write to several tables is routed by the first one, which is the table
+ * that INSERT, UPDATE and DELETE modify.
+ *
+ * @param rses     Router client session
+ * @param querybuf The statement
+ * @param hash     The hash of the name
+ * @return True if the statement has a table
  */
-static void rses_property_done(rses_property_t *prop)
+static bool write_affinity_table(ROUTER_CLIENT_SES *rses, GWBUF *querybuf, uint64_t *hash)
 {
-    if (prop == NULL)
-    {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return;
-    }
-    CHK_RSES_PROP(prop);
+    const char *dbname = ((MYSQL_session *)rses->client_dcb->data)->db;
+    int tsize = 0;
+    char **names = qc_get_table_names(querybuf, &tsize, true);
+    bool rval = false;
 
-    switch (prop->rses_prop_type)
+    if (names && tsize > 0 && names[0])
     {
-        case RSES_PROP_TYPE_SESCMD:
-            mysql_sescmd_done(&prop->rses_prop_data.sescmd);
-            break;
+        char *dot = strchr(names[0], '.');
 
-        case RSES_PROP_TYPE_TMPTABLES:
-            hashtable_free(prop->rses_prop_data.temp_tables);
-            break;
-
-        default:
-            MXS_DEBUG("%lu [rses_property_done] Unknown property type %d "
-                      "in property %p", pthread_self(), prop->rses_prop_type, prop);
+        if (dot)
+        {
+            *dot = '\0';
+            *hash = tmp_table_hash(names[0], dot + 1);
+        }
+        else
+        {
+            *hash = tmp_table_hash(dbname, names[0]);
+        }
+        rval = true;
+    }
 
-            ss_dassert(false);
-            break;
+    for (int i = 0; names && i < tsize; i++)
+    {
+        free(names[i]);
     }
-    free(prop);
+    free(names);
+
+    return rval;
 }
 
 /**
- * Add property to the router_client_ses structure's rses_properties
- * array. The slot is determined by the type of property.
- * In each slot there is a list of properties of similar type.
+ * @brief Choose the Galera node of a write by its table
  *
- * Router client session must be locked.
+ * The writes to the same table are routed to the same synced node so that
+ * concurrent writes to a table do not fail in the certification of each
+ * other. The node is chosen with rendezvous hashing: every synced node gets
+ * a score from the table and the name of the node and the one with the
+ * highest score is used. Every session and every MaxScale thus choose the
+ * same node, and when a node leaves the cluster, only the tables of that
+ * node move to other nodes.
+ *
+ * Only autocommit writes outside transactions are routed this way, as the
+ * node of a transaction would have to be known at its start. A statement that
+ * reads the state of the last write, e.g. LAST_INSERT_ID(), is routed to the
+ * node of the last write.
+ *
+ * @param rses     Router client session
+ * @param querybuf The statement, routed to the master otherwise
+ * @param qtype    The type of the statement
+ * @return The node or NULL if the statement should be routed to the master
  */
-static int rses_property_add(ROUTER_CLIENT_SES *rses, rses_property_t *prop)
+static backend_ref_t *rses_write_affinity_target(ROUTER_CLIENT_SES *rses, GWBUF *querybuf,
+                                                 qc_query_type_t qtype)
 {
-    if (rses == NULL)
+    backend_ref_t *last = rses->rses_affinity_bref;
+
+    if (last && (!BREF_IS_IN_USE(last) || last->bref_conn_seq != rses->rses_affinity_conn))
     {
-        MXS_ERROR("Router client session is NULL. (%s:%d)", __FILE__, __LINE__);
-        return -1;
+        last = rses->rses_affinity_bref = NULL;
     }
-    if (prop == NULL)
+
+    if (rses->rses_transaction_active || !rses->rses_autocommit_enabled ||
+        rses->forced_node || rses->rses_multi_active || rses->rses_n_tmp_tables > 0 ||
+        QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX) ||
+        QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
+        QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK) ||
+        (rses->rses_config.rw_use_sql_variables_in == TYPE_MASTER &&
+         QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ)))
     {
-        MXS_ERROR("Router client session property is NULL. (%s:%d)", __FILE__, __LINE__);
-        return -1;
+        rses->rses_affinity_bref = NULL;
+        return NULL;
     }
-    rses_property_t *p;
 
-    CHK_CLIENT_RSES(rses);
-    CHK_RSES_PROP(prop);
-    ss_dassert(SPINLOCK_IS_LOCKED(&rses->rses_lock));
+    if (!QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE))
+    {
+        return QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) ? last : NULL;
+    }
 
-    prop->rses_prop_rsession = rses;
-    p = rses->rses_properties[prop->rses_prop_type];
+    uint64_t table;
 
-    if (p == NULL)
+    if (!write_affinity_table(rses, querybuf, &table))
     {
-        rses->rses_properties[prop->rses_prop_type] = prop;
+        rses->rses_affinity_bref = NULL;
+        return NULL;
     }
-    else
+
+    backend_ref_t *best = NULL;
+    uint64_t best_score = 0;
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        while (p->rses_prop_next != NULL)
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER *server = bref->bref_backend->backend_server;
+
+        if (!SERVER_IS_JOINED(server) || SERVER_IS_DRAINING(server) || BREF_HAS_FAILED(bref))
         {
-            p = p->rses_prop_next;
+            continue;
+        }
+
+        uint64_t score = mxs_fnv1a64_str(table, server->unique_name);
+
+        if (best == NULL || score > best_score)
+        {
+            best = bref;
+            best_score = score;
         }
-        p->rses_prop_next = prop;
     }
-    return 0;
+
+    /** A node that the session has no connection to is left to the master */
+    if (best && (!BREF_IS_IN_USE(best) || BREF_IS_CLOSED(best)))
+    {
+        MXS_INFO("Node '%s' of the write is not connected, routing to the master.",
+                 best->bref_backend->backend_server->unique_name);
+        best = NULL;
+    }
+
+    if (best == rses->rses_master_ref)
+    {
+        best = NULL;
+    }
+
+    rses->rses_affinity_bref = best;
+    rses->rses_affinity_conn = best ? best->bref_conn_seq : 0;
+
+    return best;
 }
 
 /**
+ * Check whether a session command of the history may be removed. A command
+ * may be removed once all backends in use have moved past it.
+ *
  * Router session must be locked.
- * Return session command pointer if succeed, NULL if failed.
  */
-static mysql_sescmd_t *rses_property_get_sescmd(rses_property_t *prop)
+static bool rses_sescmd_is_executed(ROUTER_CLIENT_SES *rses, rses_property_t *prop)
 {
-    mysql_sescmd_t *sescmd;
-
-    if (prop == NULL)
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return NULL;
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref) &&
+            bref->bref_sescmd_cur.position <= prop->rses_prop_data.sescmd.position + 1)
+        {
+            return false;
+        }
     }
 
-    CHK_RSES_PROP(prop);
-    ss_dassert(prop->rses_prop_rsession == NULL ||
-               SPINLOCK_IS_LOCKED(&prop->rses_prop_rsession->rses_lock));
+    return true;
+}
 
-    sescmd = &prop->rses_prop_data.sescmd;
+/** Number of session commands in the history. Router session must be locked. */
+static int rses_sescmd_history_len(ROUTER_CLIENT_SES *rses)
+{
+    int n = 0;
 
-    if (sescmd != NULL)
+    for (rses_property_t *prop = rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+         prop; prop = prop->rses_prop_next)
     {
-        CHK_MYSQL_SESCMD(sescmd);
+        n++;
     }
-    return sescmd;
+
+    return n;
 }
 
 /**
- * Create session command property.
+ * Compact the session command history before a new session command is added
+ * to it. The commands that the new command supersedes are removed and, if the
+ * history is full, the oldest commands that do not change the session state.
+ *
+ * Router session must be locked.
+ *
+ * @param rses   Router client session
+ * @param sescmd The new session command
  */
-static mysql_sescmd_t *mysql_sescmd_init(rses_property_t *rses_prop,
-                                         GWBUF *sescmd_buf,
-                                         unsigned char packet_type,
-                                         ROUTER_CLIENT_SES *rses)
+static void rses_compact_sescmd_history(ROUTER_CLIENT_SES *rses, mysql_sescmd_t *sescmd)
 {
-    mysql_sescmd_t *sescmd;
-
-    CHK_RSES_PROP(rses_prop);
-    /** Can't call rses_property_get_sescmd with uninitialized sescmd */
-    sescmd = &rses_prop->rses_prop_data.sescmd;
-    sescmd->my_sescmd_prop = rses_prop; /*< reference to owning property */
-#if defined(SS_DEBUG)
-    sescmd->my_sescmd_chk_top = CHK_NUM_MY_SESCMD;
-    sescmd->my_sescmd_chk_tail = CHK_NUM_MY_SESCMD;
-#endif
-    /** Set session command buffer */
-    sescmd->my_sescmd_buf = sescmd_buf;
-    sescmd->my_sescmd_packet_type = packet_type;
-    sescmd->position = atomic_add(&rses->pos_generator, 1);
-
-    return sescmd;
-}
+    int max_len = rses->rses_config.rw_max_sescmd_history_size;
+    int len = max_len > 0 ? rses_sescmd_history_len(rses) : 0;
+    rses_property_t **pprop = &rses->rses_properties[RSES_PROP_TYPE_SESCMD];
 
-static void mysql_sescmd_done(mysql_sescmd_t *sescmd)
-{
-    if (sescmd == NULL)
+    while (*pprop)
     {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return;
+        rses_property_t *prop = *pprop;
+        mysql_sescmd_t *old = &prop->rses_prop_data.sescmd;
+        bool superseded = sescmd->my_sescmd_key && old->my_sescmd_key &&
+                          strcmp(sescmd->my_sescmd_key, old->my_sescmd_key) == 0;
+
+        if ((superseded || (old->my_sescmd_stateless && max_len > 0 && len >= max_len)) &&
+            rses_sescmd_is_executed(rses, prop))
+        {
+            *pprop = prop->rses_prop_next;
+            rses_property_done(prop);
+            len--;
+        }
+        else
+        {
+            pprop = &prop->rses_prop_next;
+        }
     }
-    CHK_RSES_PROP(sescmd->my_sescmd_prop);
-    gwbuf_free(sescmd->my_sescmd_buf);
-    memset(sescmd, 0, sizeof(mysql_sescmd_t));
 }
 
 /**
@@ -3529,7 +6913,7 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
     ROUTER_CLIENT_SES *ses;
 
     scur = &bref->bref_sescmd_cur;
-    ss_dassert(SPINLOCK_IS_LOCKED(&(scur->scmd_cur_rses->rses_lock)));
+    ss_dassert(RSES_IS_LOCKED(scur->scmd_cur_rses));
     scmd = sescmd_cursor_get_command(scur);
     ses = (*scur->scmd_cur_ptr_property)->rses_prop_rsession;
     CHK_GWBUF(replybuf);
@@ -3668,7 +7052,7 @@ static mysql_sescmd_t *sescmd_cursor_get_command(sescmd_cursor_t *scur)
 {
     mysql_sescmd_t *scmd;
 
-    ss_dassert(SPINLOCK_IS_LOCKED(&(scur->scmd_cur_rses->rses_lock)));
+    ss_dassert(RSES_IS_LOCKED(scur->scmd_cur_rses));
     scur->scmd_cur_cmd = rses_property_get_sescmd(*scur->scmd_cur_ptr_property);
 
     CHK_MYSQL_SESCMD(scur->scmd_cur_cmd);
@@ -3688,7 +7072,7 @@ static bool sescmd_cursor_is_active(sescmd_cursor_t *sescmd_cursor)
         MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
         return false;
     }
-    ss_dassert(SPINLOCK_IS_LOCKED(&sescmd_cursor->scmd_cur_rses->rses_lock));
+    ss_dassert(RSES_IS_LOCKED(sescmd_cursor->scmd_cur_rses));
 
     succp = sescmd_cursor->scmd_cur_active;
     return succp;
@@ -3698,7 +7082,7 @@ static bool sescmd_cursor_is_active(sescmd_cursor_t *sescmd_cursor)
 static void sescmd_cursor_set_active(sescmd_cursor_t *sescmd_cursor,
                                      bool value)
 {
-    ss_dassert(SPINLOCK_IS_LOCKED(&sescmd_cursor->scmd_cur_rses->rses_lock));
+    ss_dassert(RSES_IS_LOCKED(sescmd_cursor->scmd_cur_rses));
     /** avoid calling unnecessarily */
     ss_dassert(sescmd_cursor->scmd_cur_active != value);
     sescmd_cursor->scmd_cur_active = value;
@@ -3915,8 +7299,7 @@ static bool sescmd_cursor_next(sescmd_cursor_t *scur)
 
     ss_dassert(scur != NULL);
     ss_dassert(*(scur->scmd_cur_ptr_property) != NULL);
-    ss_dassert(SPINLOCK_IS_LOCKED(
-                   &(*(scur->scmd_cur_ptr_property))->rses_prop_rsession->rses_lock));
+    ss_dassert(RSES_IS_LOCKED((*(scur->scmd_cur_ptr_property))->rses_prop_rsession));
 
     /** Illegal situation */
     if (scur == NULL || *scur->scmd_cur_ptr_property == NULL ||
@@ -4133,8 +7516,28 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
         goto return_succp;
     }
 
+    /**
+     * Additional reference is created to querybuf to
+     * prevent it from being released before properties
+     * are cleaned up as a part of router sessionclean-up.
+     */
+    if ((prop = rses_property_init(RSES_PROP_TYPE_SESCMD)) == NULL)
+    {
+        MXS_ERROR("Router session property initialization failed");
+        rses_end_locked_router_action(router_cli_ses);
+        return false;
+    }
+
+    mysql_sescmd_init(prop, querybuf, packet_type, router_cli_ses);
+
+    if (router_cli_ses->rses_config.rw_compact_sescmd_hist)
+    {
+        rses_compact_sescmd_history(router_cli_ses, &prop->rses_prop_data.sescmd);
+    }
+
     if (router_cli_ses->rses_config.rw_max_sescmd_history_size > 0 &&
-        router_cli_ses->rses_nsescmd >=
+        (router_cli_ses->rses_config.rw_compact_sescmd_hist ?
+         rses_sescmd_history_len(router_cli_ses) : router_cli_ses->rses_nsescmd) >=
         router_cli_ses->rses_config.rw_max_sescmd_history_size)
     {
         MXS_WARNING("Router session exceeded session command history limit. "
@@ -4147,55 +7550,17 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
 
     if (router_cli_ses->rses_config.rw_disable_sescmd_hist)
     {
-        rses_property_t *prop, *tmp;
-        backend_ref_t *bref;
-        bool conflict;
-
-        prop = router_cli_ses->rses_properties[RSES_PROP_TYPE_SESCMD];
-        while (prop)
-        {
-            conflict = false;
-
-            for (i = 0; i < router_cli_ses->rses_nbackends; i++)
-            {
-                bref = &backend_ref[i];
-                if (BREF_IS_IN_USE(bref))
-                {
-
-                    if (bref->bref_sescmd_cur.position <=
-                        prop->rses_prop_data.sescmd.position + 1)
-                    {
-                        conflict = true;
-                        break;
-                    }
-                }
-            }
-
-            if (conflict)
-            {
-                break;
-            }
-
-            tmp = prop;
-            router_cli_ses->rses_properties[RSES_PROP_TYPE_SESCMD] = prop->rses_prop_next;
-            rses_property_done(tmp);
-            prop = router_cli_ses->rses_properties[RSES_PROP_TYPE_SESCMD];
-        }
-    }
-
-    /**
-     * Additional reference is created to querybuf to
-     * prevent it from being released before properties
-     * are cleaned up as a part of router sessionclean-up.
-     */
-    if ((prop = rses_property_init(RSES_PROP_TYPE_SESCMD)) == NULL)
-    {
-        MXS_ERROR("Router session property initialization failed");
-        rses_end_locked_router_action(router_cli_ses);
-        return false;
-    }
+        rses_property_t *head, *tmp;
 
-    mysql_sescmd_init(prop, querybuf, packet_type, router_cli_ses);
+        head = router_cli_ses->rses_properties[RSES_PROP_TYPE_SESCMD];
+        while (head && rses_sescmd_is_executed(router_cli_ses, head))
+        {
+            tmp = head;
+            router_cli_ses->rses_properties[RSES_PROP_TYPE_SESCMD] = head->rses_prop_next;
+            rses_property_done(tmp);
+            head = router_cli_ses->rses_properties[RSES_PROP_TYPE_SESCMD];
+        }
+    }
 
     /** Add sescmd property to router client session */
     if (rses_property_add(router_cli_ses, prop) != 0)
@@ -4242,6 +7607,14 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
                          backend_ref[i].bref_backend->backend_server->name,
                          backend_ref[i].bref_backend->backend_server->port);
             }
+            /** Executed once the reply to the hedged read has been drained */
+            else if (BREF_IS_DISCARDING(&backend_ref[i]))
+            {
+                nsucc += 1;
+                MXS_INFO("Backend %s:%d is draining a reply, deferring sescmd.",
+                         backend_ref[i].bref_backend->backend_server->name,
+                         backend_ref[i].bref_backend->backend_server->port);
+            }
             else
             {
                 if (execute_sescmd_in_backend(&backend_ref[i]))
@@ -4308,6 +7681,287 @@ static bool router_option_configured(ROUTER_INSTANCE *router,
 }
 #endif /*< NOT_USED */
 
+/**
+ * Free routing rules
+ *
+ * @param rules   The rules
+ * @param n_rules Number of rules
+ */
+static void rules_free(rwsplit_rule_t *rules, int n_rules)
+{
+    for (int i = 0; i < n_rules; i++)
+    {
+        free(rules[i].server);
+        free(rules[i].user);
+        free(rules[i].table);
+    }
+
+    free(rules);
+}
+
+/**
+ * Free the routing rules of a router
+ *
+ * @param router The router instance
+ */
+static void rwsplit_free_rules(ROUTER_INSTANCE *router)
+{
+    rules_free(router->rules, router->n_rules);
+    router->rules = NULL;
+    router->n_rules = 0;
+}
+
+/**
+ * Parse the query types of a routing rule
+ *
+ * @param value Names of the types without the QUERY_TYPE_ prefix separated
+ *              by '|', e.g. "read|show_tables"
+ * @return The types or 0 if a type is not known
+ */
+static uint32_t rule_parse_qtype(char *value)
+{
+    const size_t prefix_len = strlen("QUERY_TYPE_");
+    uint32_t qtype = 0;
+    char *saveptr;
+
+    for (char *tok = strtok_r(value, "|", &saveptr); tok; tok = strtok_r(NULL, "|", &saveptr))
+    {
+        uint32_t bit = 0;
+
+        for (int i = 0; i < 32 && bit == 0; i++)
+        {
+            const char *name = qc_type_to_string((qc_query_type_t)(1u << i));
+
+            if (name && strncmp(name, "QUERY_TYPE_", prefix_len) == 0 &&
+                strcasecmp(name + prefix_len, tok) == 0)
+            {
+                bit = 1u << i;
+            }
+        }
+
+        if (bit == 0)
+        {
+            return 0;
+        }
+
+        qtype |= bit;
+    }
+
+    return qtype;
+}
+
+/**
+ * @brief Parse a routing rule
+ *
+ * A rule is a target followed by the conditions of the rule:
+ *
+ * master|slave|server=<name> [user=<user>] [table=<table>] [type=<type>[|<type>...]]
+ *                            [canonical=<statement>]
+ *
+ * The statement of the canonical condition is the rest of the line, its
+ * canonical form is hashed here so that a statement is matched only by a
+ * comparison of the hashes.
+ *
+ * @param rule   The rule to fill
+ * @param line   The line, modified by the parsing
+ * @param file   Name of the rule file
+ * @param lineno Number of the line
+ * @return True if the rule was parsed
+ */
+static bool rule_parse(rwsplit_rule_t *rule, char *line, const char *file, int lineno)
+{
+    char *saveptr;
+    char *tok = strtok_r(line, " \t", &saveptr);
+    char *canonical = NULL;
+
+    memset(rule, 0, sizeof(*rule));
+    rule->line = lineno;
+
+    if (strcasecmp(tok, "master") == 0)
+    {
+        rule->target = TARGET_MASTER;
+    }
+    else if (strcasecmp(tok, "slave") == 0)
+    {
+        rule->target = TARGET_SLAVE;
+    }
+    else if (strncasecmp(tok, "server=", strlen("server=")) == 0 && tok[strlen("server=")])
+    {
+        rule->target = TARGET_NAMED_SERVER;
+        rule->server = strdup(tok + strlen("server="));
+    }
+    else
+    {
+        MXS_ERROR("%s:%d: Unknown routing rule target '%s', expected master, slave "
+                  "or server=<name>.", file, lineno, tok);
+        return false;
+    }
+
+    while ((tok = strtok_r(NULL, " \t", &saveptr)) != NULL)
+    {
+        char *value = strchr(tok, '=');
+
+        if (value == NULL || value[1] == '\0')
+        {
+            MXS_ERROR("%s:%d: Expected <condition>=<value> instead of '%s'.", file, lineno, tok);
+            return false;
+        }
+
+        *value++ = '\0';
+
+        if (strcasecmp(tok, "user") == 0 && rule->user == NULL)
+        {
+            rule->user = strdup(value);
+        }
+        else if (strcasecmp(tok, "table") == 0 && rule->table == NULL)
+        {
+            rule->table = strdup(value);
+        }
+        else if (strcasecmp(tok, "type") == 0 && rule->qtype == 0)
+        {
+            if ((rule->qtype = rule_parse_qtype(value)) == 0)
+            {
+                MXS_ERROR("%s:%d: Unknown query type in '%s'.", file, lineno, value);
+                return false;
+            }
+        }
+        else if (strcasecmp(tok, "canonical") == 0)
+        {
+            /** The statement may contain spaces, it is the rest of the line */
+            if (*saveptr)
+            {
+                value[strlen(value)] = ' ';
+            }
+            canonical = value;
+            break;
+        }
+        else
+        {
+            MXS_ERROR("%s:%d: Unknown or repeated routing rule condition '%s'.",
+                      file, lineno, tok);
+            return false;
+        }
+    }
+
+    if (canonical)
+    {
+        GWBUF *buf = modutil_create_query(canonical);
+        rule->canonical = buf ? qc_get_canonical_hash(buf) : 0;
+        gwbuf_free(buf);
+
+        if (rule->canonical == 0)
+        {
+            MXS_ERROR("%s:%d: Failed to compute the canonical form of '%s'.",
+                      file, lineno, canonical);
+            return false;
+        }
+    }
+
+    if ((rule->server == NULL && rule->target == TARGET_NAMED_SERVER) ||
+        (rule->user == NULL && rule->table == NULL && rule->qtype == 0 && rule->canonical == 0))
+    {
+        MXS_ERROR("%s:%d: A routing rule needs at least one condition.", file, lineno);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Load the routing rules of a router
+ *
+ * Empty lines and lines starting with '#' are ignored. The rules are loaded
+ * once, when the service starts, as sessions read them without locking.
+ * When the options are processed again after a configuration change the
+ * rules that were loaded are kept.
+ *
+ * @param router The router instance
+ * @param file   The rule file
+ * @return True if all rules were loaded
+ */
+static bool rwsplit_load_rules(ROUTER_INSTANCE *router, const char *file)
+{
+    if (router->rules)
+    {
+        return true;
+    }
+
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to open routing rule file '%s': %d, %s", file, errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    rwsplit_rule_t *rules = NULL;
+    int n_rules = 0;
+    int n_alloc = 0;
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0;
+    bool success = true;
+
+    while (success && getline(&line, &size, fp) != -1)
+    {
+        char *ptr = line;
+        char *end = line + strlen(line);
+
+        lineno++;
+
+        while (isspace(*ptr))
+        {
+            ptr++;
+        }
+
+        while (end > ptr && isspace(end[-1]))
+        {
+            *--end = '\0';
+        }
+
+        if (*ptr == '\0' || *ptr == '#')
+        {
+            continue;
+        }
+
+        if (n_rules == n_alloc)
+        {
+            int n = n_alloc ? n_alloc * 2 : 8;
+            rwsplit_rule_t *tmp = realloc(rules, n * sizeof(rwsplit_rule_t));
+
+            if (tmp == NULL)
+            {
+                success = false;
+                break;
+            }
+
+            rules = tmp;
+            n_alloc = n;
+        }
+
+        /** A rule that fails to parse is freed with the others */
+        success = rule_parse(&rules[n_rules++], ptr, file, lineno);
+    }
+
+    free(line);
+    fclose(fp);
+
+    if (success)
+    {
+        MXS_NOTICE("Loaded %d routing rules from '%s'.", n_rules, file);
+        router->n_rules = n_rules;
+        router->rules = rules;
+    }
+    else
+    {
+        rules_free(rules, n_rules);
+    }
+
+    return success;
+}
+
 /**
  * @brief Process router options
  *
@@ -4345,14 +7999,16 @@ static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
                 c = GET_SELECT_CRITERIA(value);
                 ss_dassert(c == LEAST_GLOBAL_CONNECTIONS ||
                            c == LEAST_ROUTER_CONNECTIONS || c == LEAST_BEHIND_MASTER ||
-                           c == LEAST_CURRENT_OPERATIONS || c == UNDEFINED_CRITERIA);
+                           c == LEAST_CURRENT_OPERATIONS || c == LEAST_RESPONSE_TIME ||
+                           c == LEAST_SERVER_LOAD || c == UNDEFINED_CRITERIA);
 
                 if (c == UNDEFINED_CRITERIA)
                 {
                     MXS_ERROR("Unknown slave selection criteria \"%s\". "
                                 "Allowed values are LEAST_GLOBAL_CONNECTIONS, "
-                                "LEAST_ROUTER_CONNECTIONS, LEAST_BEHIND_MASTER,"
-                                "and LEAST_CURRENT_OPERATIONS.",
+                                "LEAST_ROUTER_CONNECTIONS, LEAST_BEHIND_MASTER, "
+                                "LEAST_CURRENT_OPERATIONS, LEAST_RESPONSE_TIME and "
+                                "LEAST_SERVER_LOAD.",
                                 STRCRITERIA(router->rwsplit_config.rw_slave_select_criteria));
                     success = false;
                 }
@@ -4369,14 +8025,133 @@ static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
             {
                 router->rwsplit_config.rw_disable_sescmd_hist = config_truth_value(value);
             }
+            else if (strcmp(options[i], "compact_sescmd_history") == 0)
+            {
+                router->rwsplit_config.rw_compact_sescmd_hist = config_truth_value(value);
+            }
             else if (strcmp(options[i], "master_accept_reads") == 0)
             {
                 router->rwsplit_config.rw_master_reads = config_truth_value(value);
             }
+            else if (strcmp(options[i], "thread_affinity") == 0)
+            {
+                router->rwsplit_config.rw_thread_affinity = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "async_session_commands") == 0)
+            {
+                router->rwsplit_config.rw_async_sescmd = config_truth_value(value);
+            }
             else if (strcmp(options[i], "strict_multi_stmt") == 0)
             {
                 router->rwsplit_config.rw_strict_multi_stmt = config_truth_value(value);
             }
+            else if (strcmp(options[i], "split_multi_statements") == 0)
+            {
+                router->rwsplit_config.rw_split_multi_stmt = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "prepared_statement_cache") == 0)
+            {
+                char *end;
+                long size = strtol(value, &end, 10);
+
+                if (*end != '\0' || size < 0 || size > INT_MAX)
+                {
+                    MXS_ERROR("Invalid value for 'prepared_statement_cache': %s", value);
+                    success = false;
+                }
+                else
+                {
+                    router->rwsplit_config.rw_ps_cache_size = size;
+                }
+            }
+            else if (strcmp(options[i], "read_only_transactions") == 0)
+            {
+                router->rwsplit_config.rw_ro_trx = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "galera_write_affinity") == 0)
+            {
+                router->rwsplit_config.rw_write_affinity = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "lazy_slave_connections") == 0)
+            {
+                router->rwsplit_config.rw_lazy_slaves = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "hedged_reads") == 0)
+            {
+                router->rwsplit_config.rw_hedged_reads = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "hedged_reads_delay") == 0)
+            {
+                char *end;
+                long delay = strtol(value, &end, 10);
+
+                if (*end != '\0' || delay < 0 || delay > INT_MAX)
+                {
+                    MXS_ERROR("Invalid value for 'hedged_reads_delay': %s", value);
+                    success = false;
+                }
+                else
+                {
+                    router->rwsplit_config.rw_hedged_reads_delay = delay;
+                }
+            }
+            else if (strcmp(options[i], "routing_rules") == 0)
+            {
+                success = rwsplit_load_rules(router, value) && success;
+            }
+            else if (strcmp(options[i], "transaction_replay") == 0)
+            {
+                router->rwsplit_config.rw_trx_replay = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "transaction_replay_max_size") == 0)
+            {
+                char *end;
+                long size = strtol(value, &end, 10);
+
+                if (*end != '\0' || size <= 0 || size > INT_MAX)
+                {
+                    MXS_ERROR("Invalid value for 'transaction_replay_max_size': %s", value);
+                    success = false;
+                }
+                else
+                {
+                    router->rwsplit_config.rw_trx_replay_max_size = size;
+                }
+            }
+            else if (strcmp(options[i], "transaction_replay_timeout") == 0)
+            {
+                char *end;
+                long timeout = strtol(value, &end, 10);
+
+                if (*end != '\0' || timeout <= 0 || timeout > INT_MAX)
+                {
+                    MXS_ERROR("Invalid value for 'transaction_replay_timeout': %s", value);
+                    success = false;
+                }
+                else
+                {
+                    router->rwsplit_config.rw_trx_replay_timeout = timeout;
+                }
+            }
+            else if (strcmp(options[i], "causal_reads") == 0)
+            {
+                router->rwsplit_config.rw_causal_reads = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "causal_reads_timeout") == 0)
+            {
+                char *end;
+                long timeout = strtol(value, &end, 10);
+
+                if (*end != '\0' || timeout <= 0 || timeout > INT_MAX)
+                {
+                    MXS_ERROR("Invalid value for 'causal_reads_timeout': %s", value);
+                    success = false;
+                }
+                else
+                {
+                    router->rwsplit_config.rw_causal_reads_timeout = timeout;
+                }
+            }
             else if (strcmp(options[i], "master_failure_mode") == 0)
             {
                 if (strcasecmp(value, "fail_instantly") == 0)
@@ -4433,6 +8208,7 @@ static void handleError(ROUTER *instance, void *router_session,
     SESSION *session;
     ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *)instance;
     ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *)router_session;
+    bool replay = false; /*< the transaction is replayed on a new master */
 
     CHK_DCB(problem_dcb);
 
@@ -4493,7 +8269,13 @@ static void handleError(ROUTER *instance, void *router_session,
                     SERVER *srv = rses->rses_master_ref->bref_backend->backend_server;
                     bool can_continue = false;
 
-                    if (rses->rses_config.rw_master_failure_mode != RW_FAIL_INSTANTLY &&
+                    if (rses_replay_start(rses))
+                    {
+                        /** The client waits while a new master is looked for */
+                        replay = true;
+                        can_continue = true;
+                    }
+                    else if (rses->rses_config.rw_master_failure_mode != RW_FAIL_INSTANTLY &&
                         (bref == NULL || !BREF_IS_WAITING_RESULT(bref)))
                     {
                         /** The failure of a master is not considered a critical
@@ -4576,6 +8358,11 @@ static void handleError(ROUTER *instance, void *router_session,
     }
 
     rses_end_locked_router_action(rses);
+
+    if (replay)
+    {
+        rses_replay_arm(rses);
+    }
 }
 
 static void handle_error_reply_client(SESSION *ses, ROUTER_CLIENT_SES *rses,
@@ -4643,7 +8430,7 @@ static bool handle_error_new_connection(ROUTER_INSTANCE *inst,
     bool succp;
 
     myrses = *rses;
-    ss_dassert(SPINLOCK_IS_LOCKED(&myrses->rses_lock));
+    ss_dassert(RSES_IS_LOCKED(myrses));
 
     ses = backend_dcb->session;
     CHK_SESSION(ses);
@@ -4664,9 +8451,11 @@ static bool handle_error_new_connection(ROUTER_INSTANCE *inst,
     /**
      * If query was sent through the bref and it is waiting for reply from
      * the backend server it is necessary to send an error to the client
-     * because it is waiting for reply.
+     * because it is waiting for reply. The client does not wait for
+     * the backend if it lost a hedged read or the other backend of the
+     * hedged read can still reply.
      */
-    if (BREF_IS_WAITING_RESULT(bref))
+    if (!rses_hedge_failed(myrses, bref) && BREF_IS_WAITING_RESULT(bref))
     {
         DCB *client_dcb = ses->client_dcb;
         client_dcb->func.write(client_dcb, gwbuf_clone(errmsg));
@@ -4804,7 +8593,6 @@ static bool have_enough_servers(ROUTER_CLIENT_SES **p_rses, const int min_nsrv,
                           (*p_rses)->rses_config.rw_max_slave_conn_percent, dbgpct);
             }
         }
-        free(*p_rses);
         *p_rses = NULL;
         succp = false;
     }
@@ -5026,10 +8814,12 @@ static BACKEND *get_root_master(backend_ref_t *servers, int router_nservers)
 {
     int i = 0;
     BACKEND *master_host = NULL;
+    int master_depth = 0;
 
     for (i = 0; i < router_nservers; i++)
     {
         BACKEND *b;
+        SERVER_STATE state;
 
         if (servers[i].bref_backend == NULL)
         {
@@ -5038,18 +8828,77 @@ static BACKEND *get_root_master(backend_ref_t *servers, int router_nservers)
 
         b = servers[i].bref_backend;
 
-        if (SERVER_IS_MASTER(b->backend_server))
+        /** The status and the depth are from the same monitoring cycle */
+        server_get_state(b->backend_server, &state);
+
+        if (SRV_MASTER_STATUS(state.status))
         {
-            if (master_host == NULL ||
-                (b->backend_server->depth < master_host->backend_server->depth))
+            if (master_host == NULL || state.depth < master_depth)
             {
                 master_host = b;
+                master_depth = state.depth;
             }
         }
     }
     return master_host;
 }
 
+/**
+ * Get the root master of the servers of the router
+ *
+ * The root master is searched again only when the status generation of the
+ * servers has changed, which the published states of the servers change when
+ * the status or the replication topology of a server changes. While the
+ * topology is stable, the sessions share the root master found by the first
+ * of them.
+ *
+ * @param router          The router instance
+ * @param servers         The backend references of a session
+ * @param router_nservers The number of backend references
+ * @return The root master or NULL if there is none
+ */
+static BACKEND *get_cached_root_master(ROUTER_INSTANCE *router, backend_ref_t *servers,
+                                       int router_nservers)
+{
+    int generation = server_status_generation();
+    BACKEND *master = NULL;
+    bool cached = false;
+
+    spinlock_acquire(&router->lock);
+    if (generation == router->root_master_generation)
+    {
+        master = router->root_master;
+        cached = true;
+    }
+    spinlock_release(&router->lock);
+
+    if (cached)
+    {
+        /** The session must have a reference to the cached master */
+        for (int i = 0; master && i < router_nservers; i++)
+        {
+            if (servers[i].bref_backend == master)
+            {
+                return master;
+            }
+        }
+
+        if (master == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    master = get_root_master(servers, router_nservers);
+
+    spinlock_acquire(&router->lock);
+    router->root_master = master;
+    router->root_master_generation = generation;
+    spinlock_release(&router->lock);
+
+    return master;
+}
+
 /********************************
  * This routine returns the root master server from MySQL replication tree
  * Get the root Master rule:
@@ -94,6 +94,7 @@ static route_target_t get_shard_route_target(qc_query_type_t qtype,
 
 static int getCapabilities();
 
+static bool connect_backend(backend_ref_t* bref, SESSION* session);
 static bool connect_backend_servers(backend_ref_t*   backend_ref,
                                     int              router_nservers,
                                     SESSION*         session,
@@ -175,6 +176,8 @@ int inspect_backend_mapping_states(ROUTER_CLIENT_SES *router_cli_ses,
                                    backend_ref_t *bref,
                                    GWBUF** wbuf);
 bool handle_default_db(ROUTER_CLIENT_SES *router_cli_ses);
+bool have_servers(ROUTER_CLIENT_SES* rses);
+static bool have_running_servers(ROUTER_CLIENT_SES* rses);
 void route_queued_query(ROUTER_CLIENT_SES *router_cli_ses);
 void synchronize_shard_map(ROUTER_CLIENT_SES *client);
 
@@ -226,6 +229,10 @@ shard_map_t* shard_map_alloc()
             spinlock_init(&rval->lock);
             rval->last_updated = 0;
             rval->state = SHMAP_UNINIT;
+            rval->refcount = 1;
+            rval->version = 0;
+            rval->refresh_started = 0;
+            rval->index = NULL;
         }
         else
         {
@@ -236,6 +243,207 @@ shard_map_t* shard_map_alloc()
     return rval;
 }
 
+/**
+ * Take a reference to a shard map.
+ * @param map Shard map
+ */
+void shard_map_ref(shard_map_t *map)
+{
+    atomic_add(&map->refcount, 1);
+}
+
+/**
+ * Release a reference to a shard map. The map is freed when the last
+ * reference is released.
+ * @param map Shard map or NULL
+ */
+void shard_map_release(shard_map_t *map)
+{
+    if (map && atomic_add(&map->refcount, -1) == 1)
+    {
+        hashtable_free(map->hash);
+        free(map->index);
+        free(map);
+    }
+}
+
+/**
+ * Build the lookup table of a shard map. This is done once all databases have
+ * been added to the map, the map must not be modified after this.
+ *
+ * The table and the names are allocated as one block so that a lookup reads
+ * only the table and the names it compares.
+ * @param map Shard map
+ * @return True if the table was built, false on memory allocation error
+ */
+bool shard_map_build_index(shard_map_t *map)
+{
+    bool rval = false;
+    size_t n_dbs = 0, strsize = 0;
+    char *key;
+
+    spinlock_acquire(&map->lock);
+    HASHITERATOR *iter = hashtable_iterator(map->hash);
+
+    if (iter)
+    {
+        while ((key = hashtable_next(iter)))
+        {
+            n_dbs++;
+            strsize += strlen(key) + strlen((char*)hashtable_fetch(map->hash, key)) + 2;
+        }
+        hashtable_iterator_free(iter);
+
+        unsigned int size = 8;
+
+        while (size < n_dbs * 2)
+        {
+            size *= 2;
+        }
+
+        shard_map_index_t *index = calloc(1, sizeof(shard_map_index_t) +
+                                          size * sizeof(shard_map_entry_t) + strsize);
+
+        if (index && (iter = hashtable_iterator(map->hash)))
+        {
+            char *strings;
+
+            index->mask = size - 1;
+            index->n_dbs = n_dbs;
+            index->entries = (shard_map_entry_t*)(index + 1);
+            strings = (char*)(index->entries + size);
+
+            while ((key = hashtable_next(iter)))
+            {
+                char *server = hashtable_fetch(map->hash, key);
+                unsigned int hash = (unsigned int)hashkeyfun(key);
+                unsigned int i = hash & index->mask;
+
+                while (index->entries[i].database)
+                {
+                    i = (i + 1) & index->mask;
+                }
+
+                index->entries[i].hash = hash;
+                index->entries[i].database = strcpy(strings, key);
+                strings += strlen(key) + 1;
+                index->entries[i].server = strcpy(strings, server);
+                strings += strlen(server) + 1;
+            }
+            hashtable_iterator_free(iter);
+
+            free(map->index);
+            map->index = index;
+            rval = true;
+        }
+        else
+        {
+            free(index);
+        }
+    }
+    spinlock_release(&map->lock);
+
+    if (!rval)
+    {
+        MXS_ERROR("Failed to allocate memory for the lookup table of a shard map, "
+                  "the databases are looked up from the shard map.");
+    }
+
+    return rval;
+}
+
+/**
+ * Find the server of a database. The lookup table of a ready map is read
+ * without locking, other maps are read under the lock of the map.
+ * @param map Shard map
+ * @param db Database name
+ * @return Name of the server or NULL if the database is not in the map
+ */
+const char* shard_map_find(shard_map_t *map, const char *db)
+{
+    shard_map_index_t *index = map->index;
+    const char *rval = NULL;
+
+    if (index)
+    {
+        unsigned int hash = (unsigned int)hashkeyfun((void*)db);
+
+        for (unsigned int i = hash & index->mask; index->entries[i].database;
+             i = (i + 1) & index->mask)
+        {
+            if (index->entries[i].hash == hash && strcmp(index->entries[i].database, db) == 0)
+            {
+                rval = index->entries[i].server;
+                break;
+            }
+        }
+    }
+    else
+    {
+        spinlock_acquire(&map->lock);
+        rval = hashtable_fetch(map->hash, (void*)db);
+        spinlock_release(&map->lock);
+    }
+
+    return rval;
+}
+
+/**
+ * Value free function for the router's hashtable of shard maps.
+ * @param data Shard map
+ * @return Always NULL
+ */
+void* shard_map_free_fn(void* data)
+{
+    shard_map_release((shard_map_t*)data);
+    return NULL;
+}
+
+/**
+ * Add the databases of one shard map to another. Databases which are already
+ * in the target map keep their old location.
+ * @param target Shard map to modify
+ * @param source Shard map whose databases are added
+ * @return True if all databases were added, false on memory allocation error
+ */
+bool shard_map_merge(shard_map_t *target, shard_map_t *source)
+{
+    bool rval = false;
+
+    spinlock_acquire(&source->lock);
+    HASHITERATOR *iter = hashtable_iterator(source->hash);
+
+    if (iter)
+    {
+        char *key;
+        rval = true;
+
+        while ((key = hashtable_next(iter)))
+        {
+            if (hashtable_fetch(target->hash, key) == NULL &&
+                !hashtable_add(target->hash, key, hashtable_fetch(source->hash, key)))
+            {
+                rval = false;
+            }
+        }
+        hashtable_iterator_free(iter);
+    }
+    spinlock_release(&source->lock);
+
+    return rval;
+}
+
+/**
+ * Check if a database is in a shard map.
+ * @param map Shard map
+ * @param db Database name
+ * @return True if the location of the database is known
+ */
+bool shard_map_has_database(shard_map_t *map, const char *db)
+{
+    return shard_map_find(map, db) != NULL;
+}
+
 /**
  * Convert a length encoded string into a C string.
  * @param data Pointer to the first byte of the string
@@ -362,6 +570,7 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
         int payloadlen = gw_mysql_get_byte3(ptr);
         int packetlen = payloadlen + 4;
         char* data = get_lenenc_str(ptr + 4);
+        char* other;
 
         if (data)
         {
@@ -369,7 +578,8 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
             {
                 MXS_INFO("schemarouter: <%s, %s>", target, data);
             }
-            else
+            else if ((other = hashtable_fetch(rses->shardmap->hash, data)) == NULL ||
+                     strcmp(other, target) != 0)
             {
                 if (!(hashtable_fetch(rses->router->ignored_dbs, data) ||
                       (rses->router->ignore_regex &&
@@ -379,8 +589,7 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
                 {
                     duplicate_found = true;
                     MXS_ERROR("Database '%s' found on servers '%s' and '%s' for user %s@%s.",
-                              data, target,
-                              (char*)hashtable_fetch(rses->shardmap->hash, data),
+                              data, target, other ? other : "",
                               rses->rses_client_dcb->user,
                               rses->rses_client_dcb->remote);
                 }
@@ -422,14 +631,19 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
  * SHOW DATABASES query to each valid backend server. This sets the session
  * into the mapping state where it queues further queries until all the database
  * servers have returned a result.
+ *
+ * If a database name is given, only the location of that database is looked up
+ * with SHOW DATABASES LIKE and the result is merged into the router's shard map
+ * of the user once the mapping is complete.
  * @param inst Router instance
  * @param session Router client session
+ * @param db Database to look up or NULL to map all databases
  * @return 1 if all writes to backends were succesful and 0 if one or more errors occurred
  */
-int gen_databaselist(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* session)
+int gen_databaselist(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* session, const char* db)
 {
     DCB* dcb;
-    const char* query = "SHOW DATABASES";
+    char query[2 * MYSQL_DATABASE_MAXLEN + sizeof("SHOW DATABASES LIKE ''")];
     GWBUF *buffer, *clone;
     int i, rval = 0;
     unsigned int len;
@@ -440,6 +654,26 @@ int gen_databaselist(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* session)
         session->rses_backend_ref[i].n_mapping_eof = 0;
     }
 
+    strcpy(query, "SHOW DATABASES");
+    session->mapping_db[0] = '\0';
+
+    if (db && *db)
+    {
+        char *ptr = query + sprintf(query, "SHOW DATABASES LIKE '");
+
+        /** Escape the quotes and the LIKE wildcards in the name */
+        for (i = 0; db[i] && i < MYSQL_DATABASE_MAXLEN; i++)
+        {
+            if (strchr("\\'%_", db[i]))
+            {
+                *ptr++ = '\\';
+            }
+            *ptr++ = db[i];
+        }
+        strcpy(ptr, "'");
+        snprintf(session->mapping_db, sizeof(session->mapping_db), "%s", db);
+    }
+
     session->init |= INIT_MAPPING;
     session->init &= ~INIT_UNINT;
     len = strlen(query) + 1;
@@ -460,7 +694,7 @@ int gen_databaselist(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* session)
             clone = gwbuf_clone(buffer);
             dcb = session->rses_backend_ref[i].bref_dcb;
             rval |= !dcb->func.write(dcb, clone);
-            MXS_DEBUG("schemarouter: Wrote SHOW DATABASES to %s for session %p: returned %d",
+            MXS_DEBUG("schemarouter: Wrote %s to %s for session %p: returned %d", query,
                       session->rses_backend_ref[i].bref_backend->backend_server->unique_name,
                       session->rses_client_dcb->session,
                       rval);
@@ -470,6 +704,45 @@ int gen_databaselist(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* session)
     return !rval;
 }
 
+/**
+ * Look up the location of a database which is not in the shard map of the
+ * session. The session keeps its current databases and queues queries until
+ * the lookup is complete.
+ * @param inst Router instance
+ * @param session Router client session
+ * @param db Database to look up
+ * @return True if the lookup was started, false on memory allocation error
+ */
+bool start_database_lookup(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* session, const char* db)
+{
+    shard_map_t *map = shard_map_alloc();
+
+    if (map == NULL || !shard_map_merge(map, session->shardmap))
+    {
+        MXS_ERROR("Failed to allocate memory for the shard map of user '%s'.",
+                  session->rses_client_dcb->user);
+        shard_map_release(map);
+        return false;
+    }
+
+    MXS_INFO("schemarouter: Looking up the location of database '%s' for session %p",
+             db, session->rses_client_dcb->session);
+
+    shard_map_release(session->shardmap);
+    session->shardmap = map;
+    session->rses_config.last_refresh = time(NULL);
+
+    if (session->rses_config.lazy_connect)
+    {
+        /** The database can be on any of the servers */
+        connect_backend_servers(session->rses_backend_ref, session->rses_nbackends,
+                                session->rses_client_dcb->session, inst);
+    }
+
+    gen_databaselist(inst, session, db);
+    return true;
+}
+
 /**
  * Check the hashtable for the right backend for this query.
  * @param router Router instance
@@ -489,14 +762,14 @@ char* get_shard_target_name(ROUTER_INSTANCE* router,
 
     dbnms = qc_get_database_names(buffer, &sz);
 
-    HASHTABLE* ht = client->shardmap->hash;
+    shard_map_t* map = client->shardmap;
 
     if (sz > 0)
     {
         for (i = 0; i < sz; i++)
         {
             char* name;
-            if ((name = (char*)hashtable_fetch(ht, dbnms[i])))
+            if ((name = (char*)shard_map_find(map, dbnms[i])))
             {
                 if (strcmp(dbnms[i], "information_schema") == 0 && rval == NULL)
                 {
@@ -535,7 +808,7 @@ char* get_shard_target_name(ROUTER_INSTANCE* router,
             char *saved, *tok = strtok_r(tmp, delim, &saved);
             tok = strtok_r(NULL, delim, &saved);
             ss_dassert(tok != NULL);
-            tmp = (char*) hashtable_fetch(ht, tok);
+            tmp = (char*) shard_map_find(map, tok);
 
             if (tmp)
             {
@@ -546,7 +819,7 @@ char* get_shard_target_name(ROUTER_INSTANCE* router,
 
         if (tmp == NULL)
         {
-            rval = (char*) hashtable_fetch(ht, client->current_db);
+            rval = (char*) shard_map_find(map, client->current_db);
             MXS_INFO("schemarouter: SHOW TABLES query, current database '%s' on server '%s'",
                      client->current_db, rval);
         }
@@ -579,7 +852,7 @@ char* get_shard_target_name(ROUTER_INSTANCE* router,
              * active database, set is as the target
              */
 
-            rval = (char*) hashtable_fetch(ht, client->current_db);
+            rval = (char*) shard_map_find(map, client->current_db);
             if (rval)
             {
                 MXS_INFO("schemarouter: Using active database '%s'", client->current_db);
@@ -718,7 +991,8 @@ static ROUTER* createInstance(SERVICE *service, char **options)
                          (HASHMEMORYFN)free,
                          NULL);
 
-    if ((router->shard_maps = hashtable_alloc(SCHEMAROUTER_USERHASH_SIZE, hashkeyfun, hashcmpfun)) == NULL)
+    if ((router->shard_maps = hashtable_alloc_read_mostly(SCHEMAROUTER_USERHASH_SIZE, hashkeyfun,
+                                                          hashcmpfun)) == NULL)
     {
         MXS_ERROR("Memory allocation failed when allocating schemarouter database ignore list.");
         hashtable_free(router->ignored_dbs);
@@ -727,7 +1001,7 @@ static ROUTER* createInstance(SERVICE *service, char **options)
     }
 
     hashtable_memory_fns(router->shard_maps, (HASHMEMORYFN)strdup,
-                         NULL, (HASHMEMORYFN)keyfreefun, NULL);
+                         NULL, (HASHMEMORYFN)keyfreefun, shard_map_free_fn);
 
     /** Add default system databases to ignore */
     hashtable_add(router->ignored_dbs, "mysql","");
@@ -838,6 +1112,20 @@ static ROUTER* createInstance(SERVICE *service, char **options)
         {
             router->schemarouter_config.debug = config_truth_value(value);
         }
+        else if (strcmp(options[i], "lazy_connect") == 0)
+        {
+            router->schemarouter_config.lazy_connect = config_truth_value(value);
+        }
+        else if (strcmp(options[i], "sharding_rules") == 0)
+        {
+            shard_rules_free(router->shard_rules);
+
+            if ((router->shard_rules = shard_rules_load(value)) == NULL)
+            {
+                failure = true;
+                break;
+            }
+        }
         else
         {
             MXS_ERROR("Unknown router options for Schemarouter: %s", options[i]);
@@ -852,8 +1140,42 @@ static ROUTER* createInstance(SERVICE *service, char **options)
         router->schemarouter_config.max_sescmd_hist = 0;
     }
 
+    /** Connections opened later must be able to replay the whole history */
+    if (router->schemarouter_config.disable_sescmd_hist && router->schemarouter_config.lazy_connect)
+    {
+        MXS_WARNING("Schemarouter: lazy_connect cannot be used when the session command "
+                    "history is disabled, connecting to all servers at session start.");
+        router->schemarouter_config.lazy_connect = false;
+    }
+
+    /** All servers of the sharded tables must be servers of the service */
+    for (shard_rule_t* rule = router->shard_rules; rule && !failure; rule = rule->next)
+    {
+        for (i = 0; i < rule->n_servers; i++)
+        {
+            SERVER_REF* ref;
+
+            for (ref = service->dbref; ref; ref = ref->next)
+            {
+                if (strcmp(ref->server->unique_name, rule->servers[i]) == 0)
+                {
+                    break;
+                }
+            }
+
+            if (ref == NULL)
+            {
+                MXS_ERROR("Shard '%s' of table '%s.%s' is not a server of service '%s'.",
+                          rule->servers[i], rule->database, rule->table, service->name);
+                failure = true;
+                break;
+            }
+        }
+    }
+
     if (failure)
     {
+        shard_rules_free(router->shard_rules);
         free(router);
         return NULL;
     }
@@ -939,6 +1261,7 @@ clean_up:
         free(router->servers[i]);
     }
     free(router->servers);
+    shard_rules_free(router->shard_rules);
     free(router);
     router = NULL;
     /** Fallthrough */
@@ -1032,16 +1355,30 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
     spinlock_acquire(&router->lock);
 
     shard_map_t *map = hashtable_fetch(router->shard_maps, session->client_dcb->user);
-    enum shard_map_state state;
 
     if (map)
     {
-        state = shard_map_update_state(map, router);
+        time_t now = time(NULL);
+
+        /**
+         * A stale map is refreshed by one session at a time. The other
+         * sessions keep using the stale map until the new one is ready.
+         */
+        if (shard_map_update_state(map, router) == SHMAP_STALE &&
+            difftime(now, map->refresh_started) > router->schemarouter_config.refresh_min_interval)
+        {
+            map->refresh_started = now;
+            map = NULL;
+        }
+        else
+        {
+            shard_map_ref(map);
+        }
     }
 
     spinlock_release(&router->lock);
 
-    if (map == NULL || state != SHMAP_READY)
+    if (map == NULL)
     {
         if ((map = shard_map_alloc()) == NULL)
         {
@@ -1096,6 +1433,7 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
     if (backend_ref == NULL)
     {
         /** log this */
+        shard_map_release(client_rses->shardmap);
         free(client_rses);
         free(backend_ref);
         client_rses = NULL;
@@ -1135,17 +1473,27 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
     if (!(succp = rses_begin_locked_router_action(client_rses)))
     {
         free(client_rses->rses_backend_ref);
+        shard_map_release(client_rses->shardmap);
         free(client_rses);
         client_rses = NULL;
         goto return_rses;
     }
     /**
-     * Connect to all backend servers
+     * Connect to all backend servers. With lazy_connect, the servers are
+     * connected when they are first used if the databases do not need to
+     * be mapped.
      */
-    succp = connect_backend_servers(backend_ref,
-                                    router_nservers,
-                                    session,
-                                    router);
+    if (client_rses->rses_config.lazy_connect && client_rses->init == INIT_READY)
+    {
+        succp = true;
+    }
+    else
+    {
+        succp = connect_backend_servers(backend_ref,
+                                        router_nservers,
+                                        session,
+                                        router);
+    }
 
     rses_end_locked_router_action(client_rses);
 
@@ -1154,6 +1502,7 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
      */
     if (!succp) {
         free(client_rses->rses_backend_ref);
+        shard_map_release(client_rses->shardmap);
         free(client_rses);
         client_rses = NULL;
         goto return_rses;
@@ -1165,6 +1514,7 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
     if (!(succp = rses_begin_locked_router_action(client_rses)))
     {
         free(client_rses->rses_backend_ref);
+        shard_map_release(client_rses->shardmap);
         free(client_rses);
 
         client_rses = NULL;
@@ -1339,6 +1689,7 @@ static void freeSession(ROUTER* router_instance, void* router_client_session)
             ;
         }
     }
+    shard_merge_free(router_cli_ses->scatter);
     spinlock_acquire(&router->lock);
 
     if (router->connections == router_cli_ses)
@@ -1382,6 +1733,7 @@ static void freeSession(ROUTER* router_instance, void* router_client_session)
      * all the memory and other resources associated
      * to the client session.
      */
+    shard_map_release(router_cli_ses->shardmap);
     free(router_cli_ses->rses_backend_ref);
     free(router_cli_ses);
     return;
@@ -1422,6 +1774,20 @@ static bool get_shard_dcb(DCB**              p_dcb,
     for (i = 0; i < rses->rses_nbackends; i++)
     {
         BACKEND* b = backend_ref[i].bref_backend;
+
+        /** With lazy_connect, the server is connected when it is first used */
+        if (rses->rses_config.lazy_connect && !BREF_IS_IN_USE((&backend_ref[i])) &&
+            (strncasecmp(name, b->backend_server->unique_name, PATH_MAX) == 0) &&
+            SERVER_IS_RUNNING(b->backend_server))
+        {
+            if (!connect_backend(&backend_ref[i], rses->rses_client_dcb->session))
+            {
+                goto return_succp;
+            }
+
+            atomic_add(&rses->router->stats.n_lazy_connects, 1);
+        }
+
         /**
          * To become chosen:
          * backend must be in use, name must match, and
@@ -1485,6 +1851,310 @@ static route_target_t get_shard_route_target(qc_query_type_t qtype,
     return target;
 }
 
+/**
+ * Add a target server to a list of servers if it is not already in it
+ *
+ * @param targets The servers
+ * @param n_targets Number of servers, updated
+ * @param server Server to add
+ */
+static void add_shard_target(const char** targets, int* n_targets, const char* server)
+{
+    for (int i = 0; i < *n_targets; i++)
+    {
+        if (strcmp(targets[i], server) == 0)
+        {
+            return;
+        }
+    }
+
+    targets[(*n_targets)++] = server;
+}
+
+/**
+ * Find the shards of the sharded tables that a statement uses
+ *
+ * The values of the sharding key are extracted from the statement with
+ * qc_get_field_values(). If a statement has no value for the key of a table,
+ * the statement is routed to all shards of the table.
+ *
+ * @param inst Router instance
+ * @param client Router session
+ * @param buffer The statement
+ * @param op Operation of the statement
+ * @param targets The shards, the names are owned by the sharding rules
+ * @param errmsg Error message if the statement cannot be routed
+ * @param errlen Size of @c errmsg
+ * @return Number of shards, 0 if the statement uses no sharded tables or -1
+ * if the statement cannot be routed with the sharding rules
+ */
+static int get_sharded_targets(ROUTER_INSTANCE* inst,
+                               ROUTER_CLIENT_SES* client,
+                               GWBUF* buffer,
+                               qc_query_op_t op,
+                               const char** targets,
+                               char* errmsg,
+                               size_t errlen)
+{
+    int n_tables = 0, n_values = 0, n_sharded = 0, n_targets = 0;
+    char** tables = qc_get_table_names(buffer, &n_tables, true);
+    QC_FIELD_VALUE* values = NULL;
+    bool error = false;
+
+    for (int i = 0; i < n_tables && !error; i++)
+    {
+        char db[MYSQL_DATABASE_MAXLEN + 1];
+        char* table = strchr(tables[i], '.');
+
+        if (table)
+        {
+            snprintf(db, sizeof(db), "%.*s", (int)(table - tables[i]), tables[i]);
+            table++;
+        }
+        else
+        {
+            strcpy(db, client->current_db);
+            table = tables[i];
+        }
+
+        shard_rule_t* rule = shard_rules_find(inst->shard_rules, db, table);
+
+        if (rule == NULL)
+        {
+            continue;
+        }
+
+        if (n_sharded++ == 0)
+        {
+            values = qc_get_field_values(buffer, &n_values);
+        }
+
+        bool has_key = false;
+
+        for (int j = 0; j < n_values && !error; j++)
+        {
+            if (strcasecmp(values[j].column, rule->column) == 0 &&
+                (values[j].table == NULL || strcmp(values[j].table, rule->table) == 0))
+            {
+                const char* server = shard_rule_get_server(rule, values[j].value);
+
+                if (server == NULL)
+                {
+                    snprintf(errmsg, errlen, "Value '%s' of column '%s' of table '%s.%s' "
+                             "does not belong to any shard", values[j].value,
+                             rule->column, rule->database, rule->table);
+                    error = true;
+                }
+                else
+                {
+                    add_shard_target(targets, &n_targets, server);
+                    has_key = true;
+                }
+            }
+        }
+
+        if (!error && !has_key)
+        {
+            if (op == QUERY_OP_INSERT || op == QUERY_OP_LOAD)
+            {
+                snprintf(errmsg, errlen, "The rows inserted into table '%s.%s' must have "
+                         "a value for column '%s'", rule->database, rule->table, rule->column);
+                error = true;
+            }
+            else
+            {
+                for (int j = 0; j < rule->n_servers; j++)
+                {
+                    add_shard_target(targets, &n_targets, rule->servers[j]);
+                }
+            }
+        }
+    }
+
+    if (!error && n_targets > 1)
+    {
+        if (modutil_count_statements(buffer) > 1)
+        {
+            snprintf(errmsg, errlen, "Several statements in one query cannot be "
+                     "routed to several shards");
+            error = true;
+        }
+        else if (op == QUERY_OP_INSERT || op == QUERY_OP_LOAD)
+        {
+            snprintf(errmsg, errlen, "The rows inserted with one statement must "
+                     "belong to the same shard");
+            error = true;
+        }
+        else if (n_sharded > 1)
+        {
+            snprintf(errmsg, errlen, "A statement that uses several sharded tables "
+                     "must use only one shard");
+            error = true;
+        }
+    }
+
+    for (int i = 0; i < n_tables; i++)
+    {
+        free(tables[i]);
+    }
+
+    free(tables);
+    qc_free_field_values(values, n_values);
+
+    return error ? -1 : n_targets;
+}
+
+/**
+ * Process the output of the reply merger of a statement routed to several shards
+ *
+ * @param rses Router session
+ * @param bref The shard whose reply was processed
+ * @param complete True if the reply of the shard is complete
+ * @param reply The packets to send to the client
+ * @return The packets to send to the client
+ */
+static GWBUF* scatter_reply_progress(ROUTER_CLIENT_SES* rses, backend_ref_t* bref,
+                                     bool complete, GWBUF* reply)
+{
+    if (complete)
+    {
+        bref->bref_scatter = false;
+    }
+
+    if (shard_merge_is_done(rses->scatter))
+    {
+        shard_merge_free(rses->scatter);
+        rses->scatter = NULL;
+    }
+
+    return reply;
+}
+
+/**
+ * End the reply of a shard to a statement that was routed to several shards
+ * with an error
+ *
+ * @param rses Router session
+ * @param bref The shard
+ * @param error The error, freed by this function
+ * @return The packets to send to the client or NULL if there is nothing to send
+ */
+static GWBUF* scatter_reply_error(ROUTER_CLIENT_SES* rses, backend_ref_t* bref, GWBUF* error)
+{
+    GWBUF* reply = shard_merge_fail(rses->scatter, bref->bref_scatter_shard, error);
+    return scatter_reply_progress(rses, bref, true, reply);
+}
+
+/**
+ * Process the reply of a shard to a statement that was routed to several shards
+ *
+ * @param rses Router session
+ * @param bref The shard
+ * @param buffer The next packets of the reply
+ * @return The packets to send to the client or NULL if there is nothing to send
+ */
+static GWBUF* process_scatter_reply(ROUTER_CLIENT_SES* rses, backend_ref_t* bref, GWBUF* buffer)
+{
+    bool complete = false;
+    GWBUF* reply = shard_merge_add(rses->scatter, bref->bref_scatter_shard,
+                                   gwbuf_make_contiguous(buffer), &complete);
+
+    if (complete)
+    {
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+    }
+
+    return scatter_reply_progress(rses, bref, complete, reply);
+}
+
+/**
+ * Route a statement to several shards
+ *
+ * The replies of the shards are merged into one reply while they arrive.
+ *
+ * @param inst Router instance
+ * @param rses Router session, locked
+ * @param querybuf The statement
+ * @param targets The shards
+ * @param n_targets Number of shards
+ * @return True if the statement was routed, false if a shard was not available
+ */
+static bool route_scatter_query(ROUTER_INSTANCE* inst,
+                                ROUTER_CLIENT_SES* rses,
+                                GWBUF* querybuf,
+                                const char** targets,
+                                int n_targets)
+{
+    backend_ref_t* brefs[n_targets];
+
+    if (rses->scatter)
+    {
+        MXS_ERROR("Schemarouter: A statement was received before the shards "
+                  "replied to the previous statement.");
+        return false;
+    }
+
+    for (int i = 0; i < n_targets; i++)
+    {
+        DCB* dcb = NULL;
+
+        if (!get_shard_dcb(&dcb, rses, (char*)targets[i]))
+        {
+            MXS_ERROR("Schemarouter: Shard '%s' is not available.", targets[i]);
+            return false;
+        }
+
+        brefs[i] = get_bref_from_dcb(rses, dcb);
+    }
+
+    if ((rses->scatter = shard_merge_create(querybuf, n_targets)) == NULL)
+    {
+        return false;
+    }
+
+    MXS_INFO("schemarouter: Routing query to %d shards", n_targets);
+
+    for (int i = 0; i < n_targets; i++)
+    {
+        brefs[i]->bref_scatter = true;
+        brefs[i]->bref_scatter_shard = i;
+    }
+
+    for (int i = 0; i < n_targets && rses->scatter; i++)
+    {
+        backend_ref_t* bref = brefs[i];
+
+        if (sescmd_cursor_is_active(&bref->bref_sescmd_cur))
+        {
+            /** Routed once the session command has been executed */
+            bref->bref_pending_cmd = gwbuf_clone(querybuf);
+        }
+        else if (bref->bref_dcb->func.write(bref->bref_dcb, gwbuf_clone(querybuf)) == 1)
+        {
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+            atomic_add(&bref->bref_backend->stats.queries, 1);
+        }
+        else
+        {
+            MXS_ERROR("Routing query to shard '%s' failed.", targets[i]);
+            GWBUF* err = modutil_create_mysql_err_msg(1, 0, SCHEMA_ERR_SHARDING, SCHEMA_ERRSTR_SHARDING,
+                                                      "Failed to route the statement to a shard");
+            GWBUF* reply = scatter_reply_error(rses, bref, err);
+
+            if (reply)
+            {
+                rses->rses_client_dcb->func.write(rses->rses_client_dcb, reply);
+            }
+        }
+    }
+
+    atomic_add(&inst->stats.n_queries, 1);
+    atomic_add(&inst->stats.n_scatter, 1);
+    return true;
+}
+
 /**
  * Check if the query is a DROP TABLE... query and
  * if it targets a temporary table, remove it from the hashtable.
@@ -1846,6 +2516,8 @@ static int routeQuery(ROUTER* instance,
     GWBUF* querybuf = qbuf;
     char db[MYSQL_DATABASE_MAXLEN + 1];
     char errbuf[26+MYSQL_DATABASE_MAXLEN];
+    const char** shard_targets = NULL;
+    int n_shard_targets = 0;
     CHK_CLIENT_RSES(router_cli_ses);
 
         ss_dassert(!GWBUF_IS_TYPE_UNDEFINED(querybuf));
@@ -1862,7 +2534,7 @@ static int routeQuery(ROUTER* instance,
         if (router_cli_ses->init & INIT_UNINT)
         {
             /* Generate database list */
-            gen_databaselist(inst, router_cli_ses);
+            gen_databaselist(inst, router_cli_ses, NULL);
 
         }
 
@@ -1902,9 +2574,18 @@ static int routeQuery(ROUTER* instance,
             {
                 /**
                  * This state is possible if a client connects with a default database
-                 * and the shard map was found from the router cache
+                 * and the shard map was found from the router cache. If the database
+                 * is not in the cached map, its location is looked up first.
                  */
-                if (!handle_default_db(router_cli_ses))
+                if (router_cli_ses->rses_config.refresh_databases &&
+                    !shard_map_has_database(router_cli_ses->shardmap, router_cli_ses->connect_db))
+                {
+                    if (!start_database_lookup(inst, router_cli_ses, router_cli_ses->connect_db))
+                    {
+                        init_rval = 0;
+                    }
+                }
+                else if (!handle_default_db(router_cli_ses))
                 {
                     init_rval = 0;
                 }
@@ -2038,33 +2719,21 @@ static int routeQuery(ROUTER* instance,
         spinlock_release(&router_cli_ses->shardmap->lock);
         if (!change_successful)
         {
-            time_t now = time(NULL);
+            extract_database(querybuf, db);
+
             if (router_cli_ses->rses_config.refresh_databases &&
-                difftime(now, router_cli_ses->rses_config.last_refresh) >
+                difftime(time(NULL), router_cli_ses->rses_config.last_refresh) >
                 router_cli_ses->rses_config.refresh_min_interval)
             {
-                spinlock_acquire(&router_cli_ses->shardmap->lock);
-                router_cli_ses->shardmap->state = SHMAP_STALE;
-                spinlock_release(&router_cli_ses->shardmap->lock);
-
                 rses_begin_locked_router_action(router_cli_ses);
 
-                router_cli_ses->rses_config.last_refresh = now;
                 router_cli_ses->queue = querybuf;
-                int rc_refresh = 1;
+                int rc_refresh = start_database_lookup(inst, router_cli_ses, db) ? 1 : 0;
 
-                if ((router_cli_ses->shardmap = shard_map_alloc()))
-                {
-                    gen_databaselist(inst, router_cli_ses);
-                }
-                else
-                {
-                    rc_refresh = 0;
-                }
                 rses_end_locked_router_action(router_cli_ses);
                 return rc_refresh;
             }
-            extract_database(querybuf, db);
+
             snprintf(errbuf, 25 + MYSQL_DATABASE_MAXLEN, "Unknown database: %s", db);
             if (router_cli_ses->rses_config.debug)
             {
@@ -2101,10 +2770,7 @@ static int routeQuery(ROUTER* instance,
     if (packet_type == MYSQL_COM_INIT_DB || op == QUERY_OP_CHANGE_DB)
     {
         route_target = TARGET_UNDEFINED;
-
-        spinlock_acquire(&router_cli_ses->shardmap->lock);
-        tname = hashtable_fetch(router_cli_ses->shardmap->hash, router_cli_ses->current_db);
-
+        tname = (char*)shard_map_find(router_cli_ses->shardmap, router_cli_ses->current_db);
 
         if (tname)
         {
@@ -2117,17 +2783,65 @@ static int routeQuery(ROUTER* instance,
         {
             MXS_INFO("schemarouter: INIT_DB with unknown database");
         }
-        spinlock_release(&router_cli_ses->shardmap->lock);
     }
     else if (route_target != TARGET_ALL)
     {
+        if (inst->shard_rules && packet_type == MYSQL_COM_QUERY)
+        {
+            char shard_err[512];
+            shard_targets = calloc(router_cli_ses->rses_nbackends, sizeof(char*));
+
+            if (shard_targets == NULL ||
+                (n_shard_targets = get_sharded_targets(inst, router_cli_ses, querybuf, op,
+                                                       shard_targets, shard_err,
+                                                       sizeof(shard_err))) < 0)
+            {
+                if (shard_targets == NULL)
+                {
+                    snprintf(shard_err, sizeof(shard_err), "Memory allocation failed");
+                }
+
+                MXS_INFO("schemarouter: %s", shard_err);
+                write_error_to_client(router_cli_ses->rses_client_dcb,
+                                      SCHEMA_ERR_SHARDING,
+                                      SCHEMA_ERRSTR_SHARDING,
+                                      shard_err);
+                atomic_add(&inst->stats.n_shard_errors, 1);
+                ret = 1;
+                goto retblock;
+            }
+            else if (n_shard_targets == 1)
+            {
+                if (check_shard_status(inst, (char*)shard_targets[0]))
+                {
+                    MXS_INFO("schemarouter: Routing query to shard '%s' by the sharding key",
+                             shard_targets[0]);
+                    route_target = TARGET_NAMED_SERVER;
+                    targetserver = strdup(shard_targets[0]);
+                    atomic_add(&inst->stats.n_shard_key, 1);
+                }
+                else
+                {
+                    MXS_ERROR("Schemarouter: Shard '%s' is not in a viable state.",
+                              shard_targets[0]);
+                    write_error_to_client(router_cli_ses->rses_client_dcb,
+                                          SCHEMA_ERR_SHARDING,
+                                          SCHEMA_ERRSTR_SHARDING,
+                                          "The shard of the statement is not available");
+                    atomic_add(&inst->stats.n_shard_errors, 1);
+                    ret = 1;
+                    goto retblock;
+                }
+            }
+        }
+
         /** If no database is found in the query and there is no active database
          * or hints in the query we need to route the query to the first available
          * server. This isn't ideal for monitoring server status but works if
          * we just want the server to send an error back. */
 
-        spinlock_acquire(&router_cli_ses->shardmap->lock);
-        if ((tname = get_shard_target_name(inst, router_cli_ses, querybuf, qtype)) != NULL)
+        if (n_shard_targets == 0 &&
+            (tname = get_shard_target_name(inst, router_cli_ses, querybuf, qtype)) != NULL)
         {
             bool shard_ok = check_shard_status(inst, tname);
 
@@ -2147,12 +2861,27 @@ static int routeQuery(ROUTER* instance,
                  */
             }
         }
-        spinlock_release(&router_cli_ses->shardmap->lock);
+    }
+
+    if (n_shard_targets > 1)
+    {
+        /** Routed to all shards of the sharded tables that the statement uses */
+        if (!rses_begin_locked_router_action(router_cli_ses))
+        {
+            MXS_INFO("Route query aborted! Routing session is closed <");
+            ret = 0;
+        }
+        else
+        {
+            ret = route_scatter_query(inst, router_cli_ses, querybuf,
+                                      shard_targets, n_shard_targets) ? 1 : 0;
+            rses_end_locked_router_action(router_cli_ses);
+        }
+        goto retblock;
     }
 
     if (TARGET_IS_UNDEFINED(route_target))
     {
-        spinlock_acquire(&router_cli_ses->shardmap->lock);
         tname = get_shard_target_name(inst, router_cli_ses, querybuf, qtype);
 
         if ((tname == NULL &&
@@ -2191,10 +2920,8 @@ static int routeQuery(ROUTER* instance,
                 /** Something else went wrong, terminate connection */
                 ret = 0;
             }
-            spinlock_release(&router_cli_ses->shardmap->lock);
             goto retblock;
         }
-        spinlock_release(&router_cli_ses->shardmap->lock);
     }
 
     if (TARGET_IS_ALL(route_target))
@@ -2324,6 +3051,7 @@ static int routeQuery(ROUTER* instance,
     rses_end_locked_router_action(router_cli_ses);
 retblock:
     free(targetserver);
+    free(shard_targets);
     gwbuf_free(querybuf);
 
     return ret;
@@ -2442,6 +3170,12 @@ static void diagnostic(ROUTER *instance, DCB *dcb)
         dcb_printf(dcb, "Session command history: disabled\n");
     }
 
+    if (router->schemarouter_config.lazy_connect)
+    {
+        dcb_printf(dcb, "Shard connections opened on first use: %d\n",
+                   router->stats.n_lazy_connects);
+    }
+
     /** Session time statistics */
 
     if (router->stats.sessions > 0)
@@ -2453,6 +3187,35 @@ static void diagnostic(ROUTER *instance, DCB *dcb)
     }
     dcb_printf(dcb, "Shard map cache hits: %d\n", router->stats.shmap_cache_hit);
     dcb_printf(dcb, "Shard map cache misses: %d\n", router->stats.shmap_cache_miss);
+
+    /** Table sharding statistics */
+    if (router->shard_rules)
+    {
+        int n_rules = 0;
+
+        for (shard_rule_t* rule = router->shard_rules; rule; rule = rule->next)
+        {
+            n_rules++;
+        }
+
+        dcb_printf(dcb, "\n\33[1;4mSharded Tables\33[0m\n");
+        dcb_printf(dcb, "Number of sharded tables: %d\n", n_rules);
+        dcb_printf(dcb, "Statements routed by the sharding key: %d\n", router->stats.n_shard_key);
+        dcb_printf(dcb, "Statements routed to several shards: %d\n", router->stats.n_scatter);
+        dcb_printf(dcb, "Statements rejected by the sharding rules: %d\n", router->stats.n_shard_errors);
+
+        for (shard_rule_t* rule = router->shard_rules; rule; rule = rule->next)
+        {
+            dcb_printf(dcb, "%s.%s: key %s, %s, shards", rule->database, rule->table,
+                       rule->column, rule->type == SHARD_RULE_HASH ? "hash" : "range");
+
+            for (i = 0; i < rule->n_servers; i++)
+            {
+                dcb_printf(dcb, "%s %s", i ? "," : "", rule->servers[i]);
+            }
+            dcb_printf(dcb, "\n");
+        }
+    }
     dcb_printf(dcb, "\n");
 }
 
@@ -2542,6 +3305,9 @@ static void clientReply(ROUTER* instance,
             router_cli_ses->shardmap->last_updated = time(NULL);
             spinlock_release(&router_cli_ses->shardmap->lock);
 
+            /** The map is no longer modified, route with the lookup table */
+            shard_map_build_index(router_cli_ses->shardmap);
+
             rses_end_locked_router_action(router_cli_ses);
 
             synchronize_shard_map(router_cli_ses);
@@ -2626,7 +3392,12 @@ static void clientReply(ROUTER* instance,
      * Active cursor means that reply is from session command
      * execution.
      */
-    if (sescmd_cursor_is_active(scur))
+    if (bref->bref_scatter && !sescmd_cursor_is_active(scur))
+    {
+        /** Reply to a statement that was routed to several shards */
+        writebuf = process_scatter_reply(router_cli_ses, bref, writebuf);
+    }
+    else if (sescmd_cursor_is_active(scur))
     {
         if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_ERR) &&
             MYSQL_IS_ERROR_PACKET(((uint8_t *) GWBUF_DATA(writebuf))))
@@ -2747,6 +3518,18 @@ static void clientReply(ROUTER* instance,
             {
                 MXS_ERROR("Routing query failed.");
             }
+
+            if (bref->bref_scatter)
+            {
+                GWBUF* reply = scatter_reply_error(router_cli_ses, bref,
+                                                   modutil_create_mysql_err_msg(1, 0, SCHEMA_ERR_SHARDING,
+                                                                                SCHEMA_ERRSTR_SHARDING,
+                                                                                "Failed to route the statement to a shard"));
+                if (reply)
+                {
+                    SESSION_ROUTE_REPLY(backend_dcb->session, reply);
+                }
+            }
         }
         gwbuf_free(bref->bref_pending_cmd);
         bref->bref_pending_cmd = NULL;
@@ -2879,6 +3662,59 @@ static void bref_set_state(backend_ref_t* bref, bref_state_t state)
     }
 }
 
+/**
+ * @brief Connect a backend reference to its server
+ *
+ * The session command history is executed in the new connection before
+ * any other statements are routed to it.
+ *
+ * @param bref Backend reference that is not in use
+ * @param session The session that owns the connection
+ * @return True if the connection was created
+ */
+static bool connect_backend(backend_ref_t* bref, SESSION* session)
+{
+    BACKEND* b = bref->bref_backend;
+
+    bref->bref_dcb = dcb_connect(b->backend_server, session, b->backend_server->protocol);
+
+    if (bref->bref_dcb == NULL)
+    {
+        MXS_ERROR("Unable to establish "
+                  "connection with slave %s:%d",
+                  b->backend_server->name,
+                  b->backend_server->port);
+        return false;
+    }
+
+    /**
+     * Start executing session command
+     * history.
+     */
+    execute_sescmd_history(bref);
+
+    bref->bref_state = 0;
+    bref_set_state(bref, BREF_IN_USE);
+    /**
+     * Increase backend connection counter.
+     * Server's stats are _increased_ in
+     * dcb.c:dcb_alloc !
+     * But decreased in the calling function
+     * of dcb_close.
+     */
+    atomic_add(&b->backend_conn_count, 1);
+
+    /**
+     * When server fails, this callback
+     * is called.
+     */
+    dcb_add_callback(bref->bref_dcb,
+                     DCB_REASON_NOT_RESPONDING,
+                     &router_handle_state_switch,
+                     (void *)bref);
+    return true;
+}
+
 /**
  * @node Search all RUNNING backend servers and connect
  *
@@ -2972,54 +3808,15 @@ static bool connect_backend_servers(backend_ref_t*   backend_ref,
                 slaves_connected += 1;
             }
             /** New server connection */
+            else if (connect_backend(&backend_ref[i], session))
+            {
+                servers_connected += 1;
+            }
             else
             {
-                backend_ref[i].bref_dcb = dcb_connect(b->backend_server,
-                                                      session,
-                                                      b->backend_server->protocol);
-
-                if (backend_ref[i].bref_dcb != NULL)
-                {
-                    servers_connected += 1;
-                    /**
-                     * Start executing session command
-                     * history.
-                     */
-                    execute_sescmd_history(&backend_ref[i]);
-                    /**
-                     * When server fails, this callback
-                     * is called.
-                     * !!! Todo, routine which removes
-                     * corresponding entries from the hash
-                     * table.
-                     */
-
-                    backend_ref[i].bref_state = 0;
-                    bref_set_state(&backend_ref[i], BREF_IN_USE);
-                    /**
-                     * Increase backend connection counter.
-                     * Server's stats are _increased_ in
-                     * dcb.c:dcb_alloc !
-                     * But decreased in the calling function
-                     * of dcb_close.
-                     */
-                    atomic_add(&b->backend_conn_count, 1);
-
-                    dcb_add_callback(backend_ref[i].bref_dcb,
-                                     DCB_REASON_NOT_RESPONDING,
-                                     &router_handle_state_switch,
-                                     (void *)&backend_ref[i]);
-                }
-                else
-                {
-                    succp = false;
-                    MXS_ERROR("Unable to establish "
-                              "connection with slave %s:%d",
-                              b->backend_server->name,
-                              b->backend_server->port);
-                    /* handle connect error */
-                    break;
-                }
+                succp = false;
+                /* handle connect error */
+                break;
             }
         }
     } /*< for */
@@ -3802,6 +4599,20 @@ static bool route_session_write(ROUTER_CLIENT_SES* router_cli_ses,
     atomic_add(&router_cli_ses->stats.longest_sescmd, 1);
     atomic_add(&router_cli_ses->n_sescmd, 1);
 
+    /**
+     * With lazy_connect, the servers that are connected later execute the
+     * command as a part of the history but one of them must reply to it now.
+     */
+    for (i = 0; i < router_cli_ses->rses_nbackends &&
+         router_cli_ses->rses_config.lazy_connect && !have_servers(router_cli_ses); i++)
+    {
+        if (SERVER_IS_RUNNING(backend_ref[i].bref_backend->backend_server) &&
+            connect_backend(&backend_ref[i], router_cli_ses->rses_client_dcb->session))
+        {
+            atomic_add(&router_cli_ses->router->stats.n_lazy_connects, 1);
+        }
+    }
+
     for (i = 0; i < router_cli_ses->rses_nbackends; i++)
     {
         if (BREF_IS_IN_USE((&backend_ref[i])))
@@ -3856,7 +4667,7 @@ static bool route_session_write(ROUTER_CLIENT_SES* router_cli_ses,
                 }
             }
         }
-        else
+        else if (!router_cli_ses->rses_config.lazy_connect)
         {
             succp = false;
         }
@@ -4015,6 +4826,24 @@ bool have_servers(ROUTER_CLIENT_SES* rses)
     return false;
 }
 
+/**
+ * Check if a router session can connect to a server
+ * @param rses Router client session
+ * @return True if any of the servers of the session is running
+ */
+static bool have_running_servers(ROUTER_CLIENT_SES* rses)
+{
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        if (SERVER_IS_RUNNING(rses->rses_backend_ref[i].bref_backend->backend_server))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /**
  * Check if there is backend reference pointing at failed DCB, and reset its
  * flags. Then clear DCB's callback and finally try to reconnect.
@@ -4065,7 +4894,21 @@ static bool handle_error_new_connection(ROUTER_INSTANCE*   inst,
     {
         DCB* client_dcb;
         client_dcb = ses->client_dcb;
-        client_dcb->func.write(client_dcb, gwbuf_clone(errmsg));
+
+        if (bref->bref_scatter)
+        {
+            /** The other shards of the statement may still be replying */
+            GWBUF* reply = scatter_reply_error(rses, bref, gwbuf_clone(errmsg));
+
+            if (reply)
+            {
+                client_dcb->func.write(client_dcb, reply);
+            }
+        }
+        else
+        {
+            client_dcb->func.write(client_dcb, gwbuf_clone(errmsg));
+        }
         bref_clear_state(bref, BREF_WAITING_RESULT);
     }
     bref_clear_state(bref, BREF_IN_USE);
@@ -4092,16 +4935,25 @@ static bool handle_error_new_connection(ROUTER_INSTANCE*   inst,
                         (void *)bref);
 
     router_nservers = router_get_servercount(inst);
+
     /**
      * Try to get replacement slave or at least the minimum
-     * number of slave connections for router session.
+     * number of slave connections for router session. With lazy_connect,
+     * the servers are connected again when they are next used.
      */
-    succp = connect_backend_servers(rses->rses_backend_ref,
-                                    router_nservers,
-                                    ses,
-                                    inst);
+    if (rses->rses_config.lazy_connect)
+    {
+        succp = true;
+    }
+    else
+    {
+        succp = connect_backend_servers(rses->rses_backend_ref,
+                                        router_nservers,
+                                        ses,
+                                        inst);
+    }
 
-    if (!have_servers(rses))
+    if (rses->rses_config.lazy_connect ? !have_running_servers(rses) : !have_servers(rses))
     {
         MXS_ERROR("No more valid servers, closing session");
         succp = false;
@@ -4551,74 +5403,73 @@ int inspect_backend_mapping_states(ROUTER_CLIENT_SES *router_cli_ses,
     return mapped ? 1 : 0;
 }
 
-/**
- * Replace a shard map with another one. This function copies the contents of
- * the source shard map to the target and frees the source memory.
- * @param target Target shard map to replace
- * @param source Source shard map to use
- */
-void replace_shard_map(shard_map_t **target, shard_map_t **source)
-{
-    shard_map_t *tgt = *target;
-    shard_map_t *src = *source;
-    tgt->last_updated = src->last_updated;
-    tgt->state = src->state;
-    hashtable_free(tgt->hash);
-    tgt->hash = src->hash;
-    free(src);
-    *source = NULL;
-}
-
 /**
  * Synchronize the router client session shard map with the global shard map for
  * this user.
  *
- * If the router doesn't have a shard map for this user then the current shard map
- * of the client session is added to the router. If the shard map in the router is
- * out of date, its contents are replaced with the contents of the current client
- * session. If the router has a usable shard map, the current shard map of the client
- * is discarded and the router's shard map is used.
+ * The shard map of the client session replaces the router's shard map as a new
+ * version of it. If only one database was looked up, the result is merged into a
+ * copy of the router's shard map instead. The client session then uses the
+ * new version of the shard map.
  * @param client Router session
  */
 void synchronize_shard_map(ROUTER_CLIENT_SES *client)
 {
-    spinlock_acquire(&client->router->lock);
+    ROUTER_INSTANCE *router = client->router;
+    char *user = client->rses_client_dcb->user;
+    shard_map_t *map = client->shardmap;
 
-    client->router->stats.shmap_cache_miss++;
+    spinlock_acquire(&router->lock);
 
-    shard_map_t *map = hashtable_fetch(client->router->shard_maps,
-                                       client->rses_client_dcb->user);
-    if (map)
+    router->stats.shmap_cache_miss++;
+
+    shard_map_t *old = hashtable_fetch(router->shard_maps, user);
+
+    if (old && client->mapping_db[0])
     {
-        spinlock_acquire(&map->lock);
-        if (map->state == SHMAP_STALE)
-        {
-            replace_shard_map(&map, &client->shardmap);
-        }
-        else if (map->state != SHMAP_READY)
+        shard_map_t *merged = shard_map_alloc();
+
+        if (merged == NULL || !shard_map_merge(merged, old) || !shard_map_merge(merged, map))
         {
-            MXS_WARNING("Shard map state is not ready but"
-                        "it is in use. Replacing it with a newer one.");
-            replace_shard_map(&map, &client->shardmap);
+            MXS_ERROR("Failed to allocate memory for the shard map of user '%s', "
+                      "the location of database '%s' is not stored.", user, client->mapping_db);
+            shard_map_release(merged);
+            merged = old;
+            shard_map_ref(merged);
         }
         else
         {
-            /**
-             * Another thread has already updated the shard map for this user
-             */
-            hashtable_free(client->shardmap->hash);
-            free(client->shardmap);
+            /** The rest of the map is as old as it was */
+            merged->last_updated = old->last_updated;
+            merged->refresh_started = old->refresh_started;
+            merged->state = SHMAP_READY;
+            shard_map_build_index(merged);
         }
-        spinlock_release(&map->lock);
+
+        shard_map_release(map);
+        map = merged;
         client->shardmap = map;
     }
-    else
+
+    if (map != old)
     {
-        hashtable_add(client->router->shard_maps,
-                      client->rses_client_dcb->user,
-                      client->shardmap);
-        ss_dassert(hashtable_fetch(client->router->shard_maps,
-                                   client->rses_client_dcb->user) == client->shardmap);
+        map->version = old ? old->version + 1 : 1;
+
+        if (old)
+        {
+            /** Releases the router's reference to the old map */
+            hashtable_delete(router->shard_maps, user);
+        }
+
+        shard_map_ref(map);
+
+        if (!hashtable_add(router->shard_maps, user, map))
+        {
+            MXS_ERROR("Failed to store the shard map of user '%s'.", user);
+            shard_map_release(map);
+        }
     }
-    spinlock_release(&client->router->lock);
+
+    client->mapping_db[0] = '\0';
+    spinlock_release(&router->lock);
 }
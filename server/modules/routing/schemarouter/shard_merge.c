@@ -0,0 +1,1249 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file shard_merge.c - Merging of the replies of several shards
+ *
+ * A statement that is routed to several shards gets one reply from each
+ * shard. The replies are merged into one reply while they arrive. The column
+ * definitions are sent to the client once every shard has sent its column
+ * definitions and the rows are sent as soon as they arrive. If the statement
+ * has an ORDER BY clause with plain column names or positions, the sorted rows
+ * of the shards are merged so that the client receives them in order.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                 Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <schemarouter.h>
+#include <modutil.h>
+#include <mysql_utils.h>
+#include <log_manager.h>
+
+/** Character set number of binary strings */
+#define SHARD_MERGE_BINARY_CHARSET 63
+
+/** The NUM_FLAG of a column definition */
+#define SHARD_MERGE_NUM_FLAG 0x8000
+
+/** Length of the fixed fields at the end of a column definition */
+#define SHARD_MERGE_COLDEF_FIXED 13
+
+typedef enum
+{
+    MERGE_START,   /*< Nothing received */
+    MERGE_COLUMNS, /*< Receiving the column definitions */
+    MERGE_ROWS,    /*< Receiving the rows */
+    MERGE_DONE     /*< The reply is complete */
+} merge_phase_t;
+
+typedef struct merge_shard
+{
+    merge_phase_t phase;
+    GWBUF*        header; /*< The column count, the column definitions and the EOF */
+    GWBUF*        rows;   /*< Rows not yet sent, each buffer holds whole packets */
+    GWBUF*        end;    /*< The packet that ended the reply */
+} merge_shard_t;
+
+typedef struct merge_order
+{
+    char* name;      /*< Column name, NULL if given as a position */
+    int   position;  /*< Column position, starting from 1 */
+    bool  desc;      /*< Descending order */
+    int   column;    /*< Index of the column in the result set */
+    bool  numeric;   /*< Compared as numbers */
+    bool  binary;    /*< Compared as binary strings */
+} merge_order_t;
+
+struct shard_merge
+{
+    int            n_shards;
+    merge_shard_t* shards;
+    int            n_done;     /*< Shards whose reply is complete */
+    bool           header_sent; /*< The column definitions have been sent */
+    bool           failed;     /*< An error has been sent, the rest is discarded */
+    bool           finished;   /*< The whole reply has been sent */
+    uint8_t        seq;        /*< Sequence number of the next packet */
+    int            n_columns;
+    merge_order_t* order;      /*< The ORDER BY columns, NULL if not sorted */
+    int            n_order;
+    uint8_t*       out;        /*< Packets to send to the client */
+    size_t         out_len;
+    size_t         out_size;
+    bool           out_error;  /*< Memory allocation of the output failed */
+};
+
+static inline size_t packet_len(uint8_t* ptr)
+{
+    return MYSQL_GET_PACKET_LEN(ptr) + MYSQL_HEADER_LEN;
+}
+
+static void free_order(merge_order_t* order, int n_order)
+{
+    for (int i = 0; i < n_order; i++)
+    {
+        free(order[i].name);
+    }
+
+    free(order);
+}
+
+/**
+ * @brief Skip whitespace and comments
+ */
+static const char* skip_space(const char* ptr)
+{
+    while (*ptr)
+    {
+        if (isspace(*ptr))
+        {
+            ptr++;
+        }
+        else if (*ptr == '#' || (ptr[0] == '-' && ptr[1] == '-' && isspace(ptr[2])))
+        {
+            while (*ptr && *ptr != '\n')
+            {
+                ptr++;
+            }
+        }
+        else if (ptr[0] == '/' && ptr[1] == '*')
+        {
+            const char* end = strstr(ptr + 2, "*/");
+            ptr = end ? end + 2 : ptr + strlen(ptr);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return ptr;
+}
+
+/**
+ * @brief Check if a keyword starts at a position
+ */
+static bool is_keyword(const char* ptr, const char* word)
+{
+    size_t len = strlen(word);
+    return strncasecmp(ptr, word, len) == 0 &&
+           !isalnum(ptr[len]) && ptr[len] != '_' && ptr[len] != '$';
+}
+
+/**
+ * @brief Find the ORDER BY clause of the outermost statement
+ *
+ * @param sql The statement
+ * @return Pointer to the first byte after ORDER BY or NULL if there is none
+ */
+static const char* find_order_by(const char* sql)
+{
+    const char* rval = NULL;
+    int depth = 0;
+
+    for (const char* ptr = skip_space(sql); *ptr; ptr = skip_space(ptr))
+    {
+        if (*ptr == '\'' || *ptr == '"' || *ptr == '`')
+        {
+            char quote = *ptr++;
+
+            while (*ptr && *ptr != quote)
+            {
+                if (*ptr == '\\' && quote != '`' && ptr[1])
+                {
+                    ptr++;
+                }
+                ptr++;
+            }
+
+            if (*ptr)
+            {
+                ptr++;
+            }
+        }
+        else if (*ptr == '(')
+        {
+            depth++;
+            ptr++;
+        }
+        else if (*ptr == ')')
+        {
+            depth--;
+            ptr++;
+        }
+        else if (isalpha(*ptr) || *ptr == '_')
+        {
+            if (depth == 0 && is_keyword(ptr, "ORDER"))
+            {
+                const char* by = skip_space(ptr + 5);
+
+                if (is_keyword(by, "BY"))
+                {
+                    rval = by + 2;
+                }
+            }
+
+            while (isalnum(*ptr) || *ptr == '_' || *ptr == '$')
+            {
+                ptr++;
+            }
+        }
+        else
+        {
+            ptr++;
+        }
+    }
+
+    return rval;
+}
+
+/**
+ * @brief Parse an identifier
+ *
+ * @param ptr Start of the identifier, updated to point after it
+ * @return The identifier or NULL if there is no identifier
+ */
+static char* parse_identifier(const char** ptr)
+{
+    const char* start = *ptr;
+    const char* end;
+
+    if (*start == '`')
+    {
+        start++;
+        end = strchr(start, '`');
+
+        if (end == NULL)
+        {
+            return NULL;
+        }
+
+        *ptr = end + 1;
+    }
+    else
+    {
+        for (end = start; isalnum(*end) || *end == '_' || *end == '$'; end++)
+        {
+            ;
+        }
+
+        *ptr = end;
+    }
+
+    return end > start ? strndup(start, end - start) : NULL;
+}
+
+/**
+ * @brief Parse the ORDER BY clause of a statement
+ *
+ * Only columns given by name or by position are supported. Expressions in the
+ * ORDER BY clause disable the sorting of the merged rows.
+ *
+ * @param sql The statement
+ * @param n_order Number of the ORDER BY columns
+ * @return The ORDER BY columns or NULL if the clause was not found or is not
+ * supported
+ */
+static merge_order_t* parse_order_by(const char* sql, int* n_order)
+{
+    const char* ptr = find_order_by(sql);
+    merge_order_t* order = NULL;
+    int n = 0;
+
+    while (ptr)
+    {
+        merge_order_t item = {.name = NULL, .position = 0, .desc = false};
+        ptr = skip_space(ptr);
+
+        if (isdigit(*ptr))
+        {
+            item.position = strtol(ptr, (char**)&ptr, 10);
+        }
+        else
+        {
+            item.name = parse_identifier(&ptr);
+
+            /** The last part of a qualified name is the column */
+            while (item.name && *ptr == '.')
+            {
+                ptr++;
+                free(item.name);
+                item.name = parse_identifier(&ptr);
+            }
+        }
+
+        if (item.name == NULL && item.position <= 0)
+        {
+            break;
+        }
+
+        ptr = skip_space(ptr);
+
+        if (is_keyword(ptr, "DESC"))
+        {
+            item.desc = true;
+            ptr = skip_space(ptr + 4);
+        }
+        else if (is_keyword(ptr, "ASC"))
+        {
+            ptr = skip_space(ptr + 3);
+        }
+
+        merge_order_t* tmp = realloc(order, (n + 1) * sizeof(merge_order_t));
+
+        if (tmp == NULL)
+        {
+            free(item.name);
+            break;
+        }
+
+        order = tmp;
+        order[n++] = item;
+
+        if (*ptr == ',')
+        {
+            ptr++;
+        }
+        else if (*ptr == '\0' || *ptr == ';' || is_keyword(ptr, "LIMIT") ||
+                 is_keyword(ptr, "FOR") || is_keyword(ptr, "LOCK") ||
+                 is_keyword(ptr, "INTO") || is_keyword(ptr, "PROCEDURE"))
+        {
+            *n_order = n;
+            return order;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    free_order(order, n);
+    *n_order = 0;
+    return NULL;
+}
+
+/**
+ * @brief Create a merger for the replies to a statement
+ *
+ * @param query The statement
+ * @param n_shards Number of shards the statement is routed to
+ * @return New merger or NULL on memory allocation error
+ */
+shard_merge_t* shard_merge_create(GWBUF* query, int n_shards)
+{
+    shard_merge_t* merge = calloc(1, sizeof(shard_merge_t));
+
+    if (merge && (merge->shards = calloc(n_shards, sizeof(merge_shard_t))) == NULL)
+    {
+        free(merge);
+        merge = NULL;
+    }
+
+    if (merge)
+    {
+        char* sql = modutil_get_SQL(query);
+
+        merge->n_shards = n_shards;
+        merge->seq = 1;
+
+        if (sql)
+        {
+            merge->order = parse_order_by(sql, &merge->n_order);
+            free(sql);
+        }
+    }
+
+    return merge;
+}
+
+/**
+ * @brief Free a merger
+ *
+ * @param merge Merger to free
+ */
+void shard_merge_free(shard_merge_t* merge)
+{
+    if (merge)
+    {
+        for (int i = 0; i < merge->n_shards; i++)
+        {
+            gwbuf_free(merge->shards[i].header);
+            gwbuf_free(merge->shards[i].rows);
+            gwbuf_free(merge->shards[i].end);
+        }
+
+        free_order(merge->order, merge->n_order);
+        free(merge->shards);
+        free(merge->out);
+        free(merge);
+    }
+}
+
+/**
+ * @brief Add a packet to the reply that is sent to the client
+ *
+ * @param merge The merger
+ * @param ptr The packet
+ * @return Pointer to the added packet or NULL on memory allocation error
+ */
+static uint8_t* emit_packet(shard_merge_t* merge, uint8_t* ptr)
+{
+    size_t len = packet_len(ptr);
+
+    if (merge->out_len + len > merge->out_size)
+    {
+        size_t size = merge->out_size ? merge->out_size : 1024;
+
+        while (size < merge->out_len + len)
+        {
+            size *= 2;
+        }
+
+        uint8_t* out = realloc(merge->out, size);
+
+        if (out == NULL)
+        {
+            merge->out_error = true;
+            return NULL;
+        }
+
+        merge->out = out;
+        merge->out_size = size;
+    }
+
+    uint8_t* dest = merge->out + merge->out_len;
+    memcpy(dest, ptr, len);
+    dest[3] = merge->seq++;
+    merge->out_len += len;
+
+    return dest;
+}
+
+/**
+ * @brief Send an error that ends the reply
+ */
+static void emit_error(shard_merge_t* merge, uint8_t* ptr)
+{
+    emit_packet(merge, ptr);
+    merge->failed = true;
+}
+
+static void emit_error_message(shard_merge_t* merge, const char* msg)
+{
+    GWBUF* err = modutil_create_mysql_err_msg(1, 0, SCHEMA_ERR_SHARDING,
+                                              SCHEMA_ERRSTR_SHARDING, msg);
+
+    if (err)
+    {
+        emit_error(merge, (uint8_t*)GWBUF_DATA(err));
+        gwbuf_free(err);
+    }
+    else
+    {
+        merge->out_error = true;
+        merge->failed = true;
+    }
+}
+
+/**
+ * @brief Get the fixed fields of a column definition
+ *
+ * @param coldef The column definition packet
+ * @return Pointer to the character set, followed by the length, type, flags
+ * and decimals of the column
+ */
+static uint8_t* coldef_fixed(uint8_t* coldef)
+{
+    return coldef + packet_len(coldef) - SHARD_MERGE_COLDEF_FIXED + 1;
+}
+
+/**
+ * @brief Get the name of a column definition
+ *
+ * @param coldef The column definition packet
+ * @param org True for the original name of the column, false for the alias
+ * @param len Length of the name
+ * @return Pointer to the name
+ */
+static uint8_t* coldef_name(uint8_t* coldef, bool org, size_t* len)
+{
+    uint8_t* ptr = coldef + MYSQL_HEADER_LEN;
+    int skip = org ? 5 : 4;
+
+    for (int i = 0; i < skip; i++)
+    {
+        uint64_t n = leint_consume(&ptr);
+        ptr += n;
+    }
+
+    *len = leint_consume(&ptr);
+    return ptr;
+}
+
+/**
+ * @brief Find the columns of the ORDER BY clause in the result set
+ *
+ * @param merge The merger
+ * @param coldefs The column definition packets
+ * @return True if all columns were found
+ */
+static bool resolve_order(shard_merge_t* merge, uint8_t** coldefs)
+{
+    for (int i = 0; i < merge->n_order; i++)
+    {
+        merge_order_t* item = &merge->order[i];
+        item->column = -1;
+
+        if (item->name == NULL)
+        {
+            if (item->position <= merge->n_columns)
+            {
+                item->column = item->position - 1;
+            }
+        }
+        else
+        {
+            size_t namelen = strlen(item->name);
+
+            for (int org = 0; org < 2 && item->column < 0; org++)
+            {
+                for (int c = 0; c < merge->n_columns; c++)
+                {
+                    size_t len;
+                    uint8_t* name = coldef_name(coldefs[c], org, &len);
+
+                    if (len == namelen && strncasecmp((char*)name, item->name, len) == 0)
+                    {
+                        item->column = c;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (item->column < 0)
+        {
+            return false;
+        }
+
+        uint8_t* fixed = coldef_fixed(coldefs[item->column]);
+
+        switch (fixed[6])
+        {
+        case MYSQL_TYPE_DECIMAL:
+        case MYSQL_TYPE_NEWDECIMAL:
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_LONGLONG:
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+        case MYSQL_TYPE_YEAR:
+            item->numeric = true;
+            break;
+
+        default:
+            item->numeric = false;
+            break;
+        }
+
+        item->binary = gw_mysql_get_byte2(fixed) == SHARD_MERGE_BINARY_CHARSET;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Send the column definitions
+ *
+ * The column definitions of the first shard are sent. If the shards disagree
+ * on the type of a column, the column is sent as a string. The lengths and the
+ * decimals are the largest of all shards.
+ *
+ * @param merge The merger
+ */
+static void send_header(shard_merge_t* merge)
+{
+    uint8_t* coldefs[merge->n_shards][merge->n_columns];
+
+    for (int i = 0; i < merge->n_shards; i++)
+    {
+        merge_shard_t* shard = &merge->shards[i];
+        shard->header = gwbuf_make_contiguous(shard->header);
+
+        if (shard->header == NULL)
+        {
+            merge->out_error = true;
+            merge->failed = true;
+            return;
+        }
+
+        uint8_t* ptr = (uint8_t*)GWBUF_DATA(shard->header);
+
+        if (leint_value(ptr + MYSQL_HEADER_LEN) != (uint64_t)merge->n_columns)
+        {
+            emit_error_message(merge, "The shards returned result sets with "
+                               "different numbers of columns");
+            return;
+        }
+
+        ptr += packet_len(ptr);
+
+        for (int c = 0; c < merge->n_columns; c++)
+        {
+            coldefs[i][c] = ptr;
+            ptr += packet_len(ptr);
+        }
+    }
+
+    uint8_t* ptr = (uint8_t*)GWBUF_DATA(merge->shards[0].header);
+    emit_packet(merge, ptr);
+
+    for (int c = 0; c < merge->n_columns; c++)
+    {
+        uint8_t* coldef = emit_packet(merge, coldefs[0][c]);
+
+        if (coldef == NULL)
+        {
+            return;
+        }
+
+        uint8_t* fixed = coldef_fixed(coldef);
+
+        for (int i = 1; i < merge->n_shards; i++)
+        {
+            uint8_t* other = coldef_fixed(coldefs[i][c]);
+
+            if (other[6] != fixed[6])
+            {
+                fixed[6] = MYSQL_TYPE_VAR_STRING;
+                gw_mysql_set_byte2(fixed + 7, gw_mysql_get_byte2(fixed + 7) & ~SHARD_MERGE_NUM_FLAG);
+            }
+
+            if (gw_mysql_get_byte4(other + 2) > gw_mysql_get_byte4(fixed + 2))
+            {
+                gw_mysql_set_byte4(fixed + 2, gw_mysql_get_byte4(other + 2));
+            }
+
+            if (other[9] > fixed[9])
+            {
+                fixed[9] = other[9];
+            }
+        }
+    }
+
+    /** The EOF packet after the column definitions */
+    uint8_t* eof = coldefs[0][merge->n_columns - 1];
+    emit_packet(merge, eof + packet_len(eof));
+
+    if (merge->out_error)
+    {
+        merge->failed = true;
+        return;
+    }
+
+    if (merge->order && !resolve_order(merge, coldefs[0]))
+    {
+        MXS_INFO("schemarouter: The ORDER BY columns are not in the result set, "
+                 "the rows of the shards are not sorted.");
+        free_order(merge->order, merge->n_order);
+        merge->order = NULL;
+        merge->n_order = 0;
+    }
+
+    merge->header_sent = true;
+}
+
+/**
+ * @brief Get a field of a row
+ *
+ * @param row The row packet
+ * @param column Index of the field
+ * @param len Length of the field
+ * @return Pointer to the field or NULL if the field is NULL
+ */
+static uint8_t* row_field(uint8_t* row, int column, size_t* len)
+{
+    uint8_t* ptr = row + MYSQL_HEADER_LEN;
+
+    for (int i = 0; i < column; i++)
+    {
+        if (*ptr == 0xfb)
+        {
+            ptr++;
+        }
+        else
+        {
+            uint64_t n = leint_consume(&ptr);
+            ptr += n;
+        }
+    }
+
+    if (*ptr == 0xfb)
+    {
+        return NULL;
+    }
+
+    *len = leint_consume(&ptr);
+    return ptr;
+}
+
+static int compare_numbers(uint8_t* a, size_t a_len, uint8_t* b, size_t b_len)
+{
+    char a_str[a_len + 1];
+    char b_str[b_len + 1];
+    char* a_end;
+    char* b_end;
+
+    memcpy(a_str, a, a_len);
+    a_str[a_len] = '\0';
+    memcpy(b_str, b, b_len);
+    b_str[b_len] = '\0';
+
+    long long a_int = strtoll(a_str, &a_end, 10);
+    long long b_int = strtoll(b_str, &b_end, 10);
+
+    if (*a_end == '\0' && *b_end == '\0')
+    {
+        return a_int < b_int ? -1 : a_int > b_int;
+    }
+
+    double a_dbl = strtod(a_str, NULL);
+    double b_dbl = strtod(b_str, NULL);
+
+    return a_dbl < b_dbl ? -1 : a_dbl > b_dbl;
+}
+
+static int compare_strings(uint8_t* a, size_t a_len, uint8_t* b, size_t b_len, bool binary)
+{
+    size_t len = a_len < b_len ? a_len : b_len;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        int x = binary ? a[i] : tolower(a[i]);
+        int y = binary ? b[i] : tolower(b[i]);
+
+        if (x != y)
+        {
+            return x < y ? -1 : 1;
+        }
+    }
+
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/**
+ * @brief Compare two rows by the ORDER BY columns
+ *
+ * @return Negative if @c a comes before @c b, positive if after and zero if
+ * the rows are equal
+ */
+static int compare_rows(shard_merge_t* merge, uint8_t* a, uint8_t* b)
+{
+    for (int i = 0; i < merge->n_order; i++)
+    {
+        merge_order_t* item = &merge->order[i];
+        size_t a_len = 0, b_len = 0;
+        uint8_t* a_val = row_field(a, item->column, &a_len);
+        uint8_t* b_val = row_field(b, item->column, &b_len);
+        int rc;
+
+        if (a_val == NULL || b_val == NULL)
+        {
+            /** NULL values come first in ascending order */
+            rc = (a_val != NULL) - (b_val != NULL);
+        }
+        else if (item->numeric)
+        {
+            rc = compare_numbers(a_val, a_len, b_val, b_len);
+        }
+        else
+        {
+            rc = compare_strings(a_val, a_len, b_val, b_len, item->binary);
+        }
+
+        if (rc != 0)
+        {
+            return item->desc ? -rc : rc;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Send the first row of a shard
+ */
+static void emit_next_row(shard_merge_t* merge, merge_shard_t* shard)
+{
+    uint8_t* ptr = (uint8_t*)GWBUF_DATA(shard->rows);
+    size_t len = packet_len(ptr);
+
+    emit_packet(merge, ptr);
+    shard->rows = gwbuf_consume(shard->rows, len);
+}
+
+/**
+ * @brief Send the rows that can be sent
+ *
+ * Without ordering, all received rows are sent. With ordering, the smallest
+ * of the first rows of the shards is sent as long as every shard has either a
+ * row or a complete reply.
+ *
+ * @param merge The merger
+ */
+static void send_rows(shard_merge_t* merge)
+{
+    if (merge->order == NULL)
+    {
+        for (int i = 0; i < merge->n_shards; i++)
+        {
+            while (merge->shards[i].rows && !merge->out_error)
+            {
+                emit_next_row(merge, &merge->shards[i]);
+            }
+        }
+
+        return;
+    }
+
+    while (!merge->out_error)
+    {
+        merge_shard_t* next = NULL;
+
+        for (int i = 0; i < merge->n_shards; i++)
+        {
+            merge_shard_t* shard = &merge->shards[i];
+
+            if (shard->rows == NULL)
+            {
+                if (shard->phase != MERGE_DONE)
+                {
+                    /** The next row of this shard could be the smallest */
+                    return;
+                }
+            }
+            else if (next == NULL ||
+                     compare_rows(merge, (uint8_t*)GWBUF_DATA(shard->rows),
+                                  (uint8_t*)GWBUF_DATA(next->rows)) < 0)
+            {
+                next = shard;
+            }
+        }
+
+        if (next == NULL)
+        {
+            return;
+        }
+
+        emit_next_row(merge, next);
+    }
+}
+
+/**
+ * @brief Write a length-encoded integer
+ *
+ * @param ptr Where to write
+ * @param value The value
+ * @return Pointer to the first byte after the integer
+ */
+static uint8_t* leint_write(uint8_t* ptr, uint64_t value)
+{
+    if (value < 251)
+    {
+        *ptr++ = value;
+    }
+    else if (value <= 0xffff)
+    {
+        *ptr++ = 0xfc;
+        gw_mysql_set_byte2(ptr, value);
+        ptr += 2;
+    }
+    else if (value <= 0xffffff)
+    {
+        *ptr++ = 0xfd;
+        gw_mysql_set_byte3(ptr, value);
+        ptr += 3;
+    }
+    else
+    {
+        *ptr++ = 0xfe;
+        for (int i = 0; i < 8; i++)
+        {
+            *ptr++ = (value >> (8 * i)) & 0xff;
+        }
+    }
+
+    return ptr;
+}
+
+/**
+ * @brief Send the OK packet that merges the OK packets of all shards
+ *
+ * The affected rows and the warnings are summed. The insert ID and the status
+ * are those of the first shard.
+ */
+static void send_ok(shard_merge_t* merge)
+{
+    uint64_t affected = 0, insert_id = 0, warnings = 0;
+    uint16_t status = 0;
+
+    for (int i = 0; i < merge->n_shards; i++)
+    {
+        uint8_t* ptr = (uint8_t*)GWBUF_DATA(merge->shards[i].end) + MYSQL_HEADER_LEN + 1;
+        affected += leint_consume(&ptr);
+        uint64_t id = leint_consume(&ptr);
+
+        if (i == 0)
+        {
+            insert_id = id;
+            status = gw_mysql_get_byte2(ptr);
+        }
+
+        warnings += gw_mysql_get_byte2(ptr + 2);
+    }
+
+    uint8_t packet[MYSQL_HEADER_LEN + 1 + 9 + 9 + 2 + 2];
+    uint8_t* ptr = packet + MYSQL_HEADER_LEN;
+
+    *ptr++ = 0x00;
+    ptr = leint_write(ptr, affected);
+    ptr = leint_write(ptr, insert_id);
+    gw_mysql_set_byte2(ptr, status);
+    ptr += 2;
+    gw_mysql_set_byte2(ptr, warnings > 0xffff ? 0xffff : warnings);
+    ptr += 2;
+
+    gw_mysql_set_byte3(packet, ptr - packet - MYSQL_HEADER_LEN);
+    emit_packet(merge, packet);
+}
+
+/**
+ * @brief Send the EOF packet that ends the merged result set
+ *
+ * The warnings are summed and the status is that of the first shard.
+ */
+static void send_eof(shard_merge_t* merge)
+{
+    uint8_t* eof = (uint8_t*)GWBUF_DATA(merge->shards[0].end);
+    uint64_t warnings = 0;
+
+    for (int i = 0; i < merge->n_shards; i++)
+    {
+        warnings += gw_mysql_get_byte2((uint8_t*)GWBUF_DATA(merge->shards[i].end) + MYSQL_HEADER_LEN + 1);
+    }
+
+    uint8_t* dest = emit_packet(merge, eof);
+
+    if (dest)
+    {
+        gw_mysql_set_byte2(dest + MYSQL_HEADER_LEN + 1, warnings > 0xffff ? 0xffff : warnings);
+    }
+}
+
+/**
+ * @brief Send what can be sent after new packets have been processed
+ *
+ * @param merge The merger
+ */
+static void merge_progress(shard_merge_t* merge)
+{
+    if (!merge->header_sent && !merge->failed)
+    {
+        int n_ok = 0, n_rset = 0;
+
+        for (int i = 0; i < merge->n_shards; i++)
+        {
+            merge_shard_t* shard = &merge->shards[i];
+            uint8_t* end = shard->end ? (uint8_t*)GWBUF_DATA(shard->end) : NULL;
+
+            if (shard->phase == MERGE_START || shard->phase == MERGE_COLUMNS)
+            {
+                /** Not all column definitions are known yet */
+                return;
+            }
+            else if (end && PTR_IS_ERR(end))
+            {
+                emit_error(merge, end);
+                break;
+            }
+            else if (shard->header)
+            {
+                n_rset++;
+                merge->n_columns = leint_value((uint8_t*)GWBUF_DATA(shard->header) + MYSQL_HEADER_LEN);
+            }
+            else if (end && PTR_IS_LOCAL_INFILE(end))
+            {
+                emit_error_message(merge, "LOAD DATA LOCAL INFILE cannot be routed "
+                                   "to several shards");
+                break;
+            }
+            else
+            {
+                n_ok++;
+            }
+        }
+
+        if (merge->failed)
+        {
+            /** Nothing else is sent */
+        }
+        else if (n_ok > 0 && n_rset > 0)
+        {
+            emit_error_message(merge, "The shards returned different types of replies");
+        }
+        else if (n_rset > 0)
+        {
+            send_header(merge);
+        }
+    }
+
+    if (merge->header_sent && !merge->failed)
+    {
+        for (int i = 0; i < merge->n_shards; i++)
+        {
+            uint8_t* end = merge->shards[i].end ? (uint8_t*)GWBUF_DATA(merge->shards[i].end) : NULL;
+
+            if (end && PTR_IS_ERR(end))
+            {
+                /** An error in the middle of the rows ends the result set */
+                emit_error(merge, end);
+                break;
+            }
+        }
+
+        if (!merge->failed)
+        {
+            send_rows(merge);
+        }
+    }
+
+    if (merge->failed)
+    {
+        for (int i = 0; i < merge->n_shards; i++)
+        {
+            gwbuf_free(merge->shards[i].rows);
+            merge->shards[i].rows = NULL;
+        }
+    }
+    else if (merge->n_done == merge->n_shards && !merge->finished)
+    {
+        if (merge->header_sent)
+        {
+            send_eof(merge);
+        }
+        else
+        {
+            send_ok(merge);
+        }
+    }
+
+    if (merge->n_done == merge->n_shards)
+    {
+        merge->finished = true;
+    }
+}
+
+/**
+ * @brief Take the packets that can be sent to the client
+ *
+ * @param merge The merger
+ * @return The packets or NULL if there is nothing to send
+ */
+static GWBUF* merge_output(shard_merge_t* merge)
+{
+    GWBUF* rval = NULL;
+
+    if (merge->out_error && !merge->finished)
+    {
+        MXS_ERROR("Memory allocation failed when merging the replies of the shards.");
+    }
+
+    if (merge->out_len > 0)
+    {
+        rval = gwbuf_alloc_and_load(merge->out_len, merge->out);
+        merge->out_len = 0;
+    }
+
+    return rval;
+}
+
+/**
+ * @brief Store a packet that ends the reply of a shard
+ */
+static void end_shard(shard_merge_t* merge, merge_shard_t* shard, uint8_t* ptr)
+{
+    if (!merge->failed)
+    {
+        shard->end = gwbuf_alloc_and_load(packet_len(ptr), ptr);
+
+        if (shard->end == NULL)
+        {
+            merge->out_error = true;
+            merge->failed = true;
+        }
+    }
+
+    shard->phase = MERGE_DONE;
+    merge->n_done++;
+}
+
+/**
+ * @brief Add the next packets of the reply of a shard
+ *
+ * @param merge The merger
+ * @param shard Index of the shard
+ * @param packets Complete and contiguous packets, freed by this function
+ * @param complete Set to true if the reply of the shard is complete
+ * @return The packets that can be sent to the client or NULL if there is
+ * nothing to send yet
+ */
+GWBUF* shard_merge_add(shard_merge_t* merge, int shard_index, GWBUF* packets, bool* complete)
+{
+    merge_shard_t* shard = &merge->shards[shard_index];
+    uint8_t* ptr = (uint8_t*)GWBUF_DATA(packets);
+    uint8_t* end = ptr + GWBUF_LENGTH(packets);
+
+    while (ptr + MYSQL_HEADER_LEN < end && shard->phase != MERGE_DONE)
+    {
+        size_t len = packet_len(ptr);
+
+        if (shard->phase == MERGE_START)
+        {
+            if (PTR_IS_OK(ptr) || PTR_IS_ERR(ptr) || PTR_IS_LOCAL_INFILE(ptr))
+            {
+                end_shard(merge, shard, ptr);
+            }
+            else
+            {
+                shard->header = gwbuf_append(shard->header, gwbuf_alloc_and_load(len, ptr));
+                shard->phase = MERGE_COLUMNS;
+            }
+            ptr += len;
+        }
+        else if (shard->phase == MERGE_COLUMNS)
+        {
+            if (PTR_IS_EOF(ptr))
+            {
+                shard->phase = MERGE_ROWS;
+            }
+            shard->header = gwbuf_append(shard->header, gwbuf_alloc_and_load(len, ptr));
+            ptr += len;
+        }
+        else if (PTR_IS_EOF(ptr) || PTR_IS_ERR(ptr))
+        {
+            end_shard(merge, shard, ptr);
+            ptr += len;
+        }
+        else
+        {
+            /** Queue all consecutive rows at once */
+            uint8_t* rows = ptr;
+
+            while (ptr + MYSQL_HEADER_LEN < end && !PTR_IS_EOF(ptr) && !PTR_IS_ERR(ptr))
+            {
+                ptr += packet_len(ptr);
+            }
+
+            if (!merge->failed)
+            {
+                GWBUF* buf = gwbuf_alloc_and_load(ptr - rows, rows);
+
+                if (buf == NULL)
+                {
+                    merge->out_error = true;
+                    merge->failed = true;
+                }
+
+                shard->rows = gwbuf_append(shard->rows, buf);
+            }
+        }
+
+        if ((shard->phase == MERGE_COLUMNS || shard->phase == MERGE_ROWS) && shard->header == NULL)
+        {
+            merge->out_error = true;
+            merge->failed = true;
+        }
+    }
+
+    gwbuf_free(packets);
+    *complete = shard->phase == MERGE_DONE;
+
+    merge_progress(merge);
+    return merge_output(merge);
+}
+
+/**
+ * @brief End the reply of a shard with an error
+ *
+ * This is used when the statement could not be sent to the shard or when the
+ * connection to the shard is lost.
+ *
+ * @param merge The merger
+ * @param shard Index of the shard
+ * @param error The error packet, freed by this function
+ * @return The packets that can be sent to the client or NULL if there is
+ * nothing to send yet
+ */
+GWBUF* shard_merge_fail(shard_merge_t* merge, int shard_index, GWBUF* error)
+{
+    merge_shard_t* shard = &merge->shards[shard_index];
+
+    if (error == NULL)
+    {
+        error = modutil_create_mysql_err_msg(1, 0, SCHEMA_ERR_SHARDING, SCHEMA_ERRSTR_SHARDING,
+                                             "Lost connection to a shard");
+    }
+
+    error = gwbuf_make_contiguous(error);
+
+    if (shard->phase != MERGE_DONE)
+    {
+        if (error)
+        {
+            end_shard(merge, shard, (uint8_t*)GWBUF_DATA(error));
+        }
+        else
+        {
+            shard->phase = MERGE_DONE;
+            merge->n_done++;
+            merge->out_error = true;
+            merge->failed = true;
+        }
+    }
+
+    gwbuf_free(error);
+    merge_progress(merge);
+    return merge_output(merge);
+}
+
+/**
+ * @brief Check if all shards have replied
+ *
+ * @param merge The merger
+ * @return True if the whole reply has been sent
+ */
+bool shard_merge_is_done(shard_merge_t* merge)
+{
+    return merge->finished;
+}
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file shard_rules.c - Table sharding rules of the schemarouter
+ *
+ * The rows of a sharded table are divided between servers by the value of one
+ * column, the sharding key. The rules are read from the file given with the
+ * sharding_rules router option, one rule on each line:
+ *
+ * @verbatim
+ * table <database>.<table> key <column> hash <server>[,<server>...]
+ * table <database>.<table> key <column> range <lower>:<server>[,<lower>:<server>...]
+ * @endverbatim
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                 Description
+ * 14/10/2016   MariaDB Corporation Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <schemarouter.h>
+#include <modutil.h>
+#include <mysql_utils.h>
+#include <utils.h>
+#include <log_manager.h>
+
+#define SHARD_RULE_MAX_LINE 4096
+
+/**
+ * @brief Free a sharding rule
+ *
+ * @param rule Rule to free
+ */
+static void shard_rule_free(shard_rule_t* rule)
+{
+    for (int i = 0; i < rule->n_servers; i++)
+    {
+        free(rule->servers[i]);
+    }
+
+    free(rule->servers);
+    free(rule->lower);
+    free(rule->database);
+    free(rule->table);
+    free(rule->column);
+    free(rule);
+}
+
+/**
+ * @brief Free a list of sharding rules
+ *
+ * @param rules The rules, can be NULL
+ */
+void shard_rules_free(shard_rule_t* rules)
+{
+    while (rules)
+    {
+        shard_rule_t* next = rules->next;
+        shard_rule_free(rules);
+        rules = next;
+    }
+}
+
+/**
+ * @brief Parse an integer
+ *
+ * @param str String to parse
+ * @param value The value of the integer
+ * @return True if the whole string is an integer
+ */
+static bool parse_integer(const char* str, long long* value)
+{
+    char* end;
+
+    errno = 0;
+    *value = strtoll(str, &end, 10);
+
+    return end != str && *end == '\0' && errno == 0;
+}
+
+/**
+ * @brief Add the shards of a rule
+ *
+ * @param rule The rule
+ * @param list Comma separated list of servers, or of <lower>:<server> pairs
+ * for range rules
+ * @return True if the list was valid
+ */
+static bool add_shards(shard_rule_t* rule, char* list)
+{
+    char *saved, *tok;
+
+    for (tok = strtok_r(list, ",", &saved); tok; tok = strtok_r(NULL, ",", &saved))
+    {
+        char** servers = realloc(rule->servers, (rule->n_servers + 1) * sizeof(char*));
+        long long* lower = realloc(rule->lower, (rule->n_servers + 1) * sizeof(long long));
+
+        rule->servers = servers ? servers : rule->servers;
+        rule->lower = lower ? lower : rule->lower;
+
+        if (servers == NULL || lower == NULL)
+        {
+            MXS_ERROR("Memory allocation failed when reading the sharding rules.");
+            return false;
+        }
+
+        char* server = tok;
+        lower[rule->n_servers] = 0;
+
+        if (rule->type == SHARD_RULE_RANGE)
+        {
+            char* sep = strchr(tok, ':');
+
+            if (sep == NULL)
+            {
+                MXS_ERROR("Range '%s' is not of the form <lower>:<server>.", tok);
+                return false;
+            }
+
+            *sep = '\0';
+            server = sep + 1;
+
+            if (!parse_integer(tok, &lower[rule->n_servers]))
+            {
+                MXS_ERROR("The lower bound '%s' of a range is not an integer.", tok);
+                return false;
+            }
+
+            if (rule->n_servers > 0 && lower[rule->n_servers] <= lower[rule->n_servers - 1])
+            {
+                MXS_ERROR("The ranges of table '%s.%s' are not in ascending order.",
+                          rule->database, rule->table);
+                return false;
+            }
+        }
+
+        if (*server == '\0' || (servers[rule->n_servers] = strdup(server)) == NULL)
+        {
+            MXS_ERROR("Missing server name in the shards of table '%s.%s'.",
+                      rule->database, rule->table);
+            return false;
+        }
+
+        rule->n_servers++;
+    }
+
+    return rule->n_servers > 0;
+}
+
+/**
+ * @brief Parse one rule
+ *
+ * @param line The rule, modified by the parsing
+ * @return The rule or NULL if the line was not a valid rule
+ */
+static shard_rule_t* parse_rule(char* line)
+{
+    const char *delim = " \t\r\n";
+    char *saved;
+    char *tok[6];
+
+    for (int i = 0; i < 6; i++)
+    {
+        tok[i] = strtok_r(i == 0 ? line : NULL, delim, &saved);
+
+        if (tok[i] == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    char* dot = strchr(tok[1], '.');
+
+    if (strcasecmp(tok[0], "table") != 0 || strcasecmp(tok[2], "key") != 0 ||
+        dot == NULL || dot == tok[1] || dot[1] == '\0' ||
+        (strcasecmp(tok[4], "hash") != 0 && strcasecmp(tok[4], "range") != 0) ||
+        strtok_r(NULL, delim, &saved) != NULL)
+    {
+        return NULL;
+    }
+
+    shard_rule_t* rule = calloc(1, sizeof(shard_rule_t));
+
+    if (rule == NULL)
+    {
+        MXS_ERROR("Memory allocation failed when reading the sharding rules.");
+        return NULL;
+    }
+
+    rule->database = strndup(tok[1], dot - tok[1]);
+    rule->table = strdup(dot + 1);
+    rule->column = strdup(tok[3]);
+    rule->type = strcasecmp(tok[4], "hash") == 0 ? SHARD_RULE_HASH : SHARD_RULE_RANGE;
+
+    if (rule->database == NULL || rule->table == NULL || rule->column == NULL ||
+        !add_shards(rule, tok[5]))
+    {
+        shard_rule_free(rule);
+        return NULL;
+    }
+
+    return rule;
+}
+
+/**
+ * @brief Read the sharding rules from a file
+ *
+ * Empty lines and lines starting with # are ignored.
+ *
+ * @param filename The rule file
+ * @return The rules or NULL if the file could not be read, if it contained
+ * invalid rules or if it contained no rules
+ */
+shard_rule_t* shard_rules_load(const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+
+    if (file == NULL)
+    {
+        MXS_ERROR("Failed to open sharding rule file '%s': %d, %s", filename,
+                  errno, strerror(errno));
+        return NULL;
+    }
+
+    shard_rule_t* rules = NULL;
+    shard_rule_t** tail = &rules;
+    char line[SHARD_RULE_MAX_LINE];
+    bool error = false;
+    int lineno = 0;
+
+    while (!error && fgets(line, sizeof(line), file))
+    {
+        char* ptr = line;
+        lineno++;
+
+        while (isspace(*ptr))
+        {
+            ptr++;
+        }
+
+        if (*ptr == '\0' || *ptr == '#')
+        {
+            continue;
+        }
+
+        shard_rule_t* rule = parse_rule(ptr);
+
+        if (rule == NULL)
+        {
+            MXS_ERROR("Invalid sharding rule on line %d of '%s'.", lineno, filename);
+            error = true;
+        }
+        else if (shard_rules_find(rules, rule->database, rule->table))
+        {
+            MXS_ERROR("Table '%s.%s' has more than one sharding rule in '%s'.",
+                      rule->database, rule->table, filename);
+            shard_rule_free(rule);
+            error = true;
+        }
+        else
+        {
+            *tail = rule;
+            tail = &rule->next;
+        }
+    }
+
+    fclose(file);
+
+    if (!error && rules == NULL)
+    {
+        MXS_ERROR("No sharding rules found in '%s'.", filename);
+    }
+
+    if (error)
+    {
+        shard_rules_free(rules);
+        rules = NULL;
+    }
+
+    return rules;
+}
+
+/**
+ * @brief Find the sharding rule of a table
+ *
+ * @param rules The rules
+ * @param database Database of the table
+ * @param table The table
+ * @return The rule or NULL if the table is not sharded
+ */
+shard_rule_t* shard_rules_find(shard_rule_t* rules, const char* database, const char* table)
+{
+    for (shard_rule_t* rule = rules; rule; rule = rule->next)
+    {
+        if (strcmp(rule->database, database) == 0 && strcmp(rule->table, table) == 0)
+        {
+            return rule;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Find the server of a value of the sharding key
+ *
+ * Integers are hashed by their value and other values with the FNV-1a hash
+ * of the string, so the same integer given as a number or as a string is
+ * always on the same shard.
+ *
+ * @param rule The rule of the table
+ * @param value Value of the sharding key
+ * @return Name of the server or NULL if the value belongs to no shard
+ */
+const char* shard_rule_get_server(const shard_rule_t* rule, const char* value)
+{
+    long long num;
+    bool is_integer = parse_integer(value, &num);
+    int i;
+
+    if (rule->type == SHARD_RULE_HASH)
+    {
+        unsigned long long hash;
+
+        if (is_integer)
+        {
+            hash = num < 0 ? -(unsigned long long)num : num;
+        }
+        else
+        {
+            hash = mxs_fnv1a64_str(MXS_FNV1A64_INIT, value);
+        }
+
+        return rule->servers[hash % rule->n_servers];
+    }
+
+    if (!is_integer || num < rule->lower[0])
+    {
+        return NULL;
+    }
+
+    for (i = 1; i < rule->n_servers && num >= rule->lower[i]; i++)
+    {
+        ;
+    }
+
+    return rule->servers[i - 1];
+}
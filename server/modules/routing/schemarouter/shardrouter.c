@@ -187,6 +187,10 @@ static GWBUF* sescmd_cursor_process_replies(GWBUF* replybuf, SUBSERVICE* bref);
 
 static bool execute_sescmd_in_backend(SUBSERVICE* subsvc);
 
+static bool subsvc_open(ROUTER_CLIENT_SES* rses, SUBSERVICE* subsvc);
+static bool subsvc_open_lazy(ROUTER_CLIENT_SES* rses, SUBSERVICE* subsvc);
+static void subsvc_send_pending(SUBSERVICE* subsvc);
+
 static bool route_session_write(
                                 ROUTER_CLIENT_SES* router_client_ses,
                                 GWBUF* querybuf,
@@ -703,11 +707,30 @@ filterReply(FILTER* instance, void *session, GWBUF *reply)
 
     scur = subsvc->scur;
 
+    if(subsvc->n_replay > 0)
+    {
+        /** The client already got the replies to the replayed history */
+        gwbuf_free(reply);
+        subsvc->n_replay--;
+
+        if(sescmd_cursor_next(scur))
+        {
+            execute_sescmd_in_backend(subsvc);
+        }
+        else
+        {
+            sescmd_cursor_set_active(scur, false);
+            subsvc_send_pending(subsvc);
+        }
+        goto retblock;
+    }
+
     if(sescmd_cursor_is_active(scur))
     {
         if(!sescmd_cursor_next(scur))
         {
             sescmd_cursor_set_active(scur, false);
+            subsvc_send_pending(subsvc);
         }
         else
         {
@@ -958,6 +981,28 @@ createInstance(SERVICE *service, char **options)
     router->bitmask = 0;
     router->bitvalue = 0;
 
+    for(i = 0; options && options[i]; i++)
+    {
+        char* value;
+
+        if((value = strchr(options[i], '=')) == NULL)
+        {
+            MXS_ERROR("Unknown router options for shardrouter: %s", options[i]);
+            continue;
+        }
+        *value = '\0';
+        value++;
+
+        if(strcmp(options[i], "lazy_connect") == 0)
+        {
+            router->shardrouter_config.lazy_connect = config_truth_value(value);
+        }
+        else
+        {
+            MXS_ERROR("Unknown router options for shardrouter: %s", options[i]);
+        }
+    }
+
     /**
      * Read config version number from service to inform what configuration
      * is used if any.
@@ -995,8 +1040,6 @@ newSession(
     SUBSERVICE* subsvc;
     ROUTER_CLIENT_SES* client_rses = NULL;
     ROUTER_INSTANCE* router = (ROUTER_INSTANCE *) router_inst;
-    FILTER_DEF* dummy_filterdef;
-    UPSTREAM* dummy_upstream;
 
     int i, j;
     client_rses = (ROUTER_CLIENT_SES *) calloc(1, sizeof(ROUTER_CLIENT_SES));
@@ -1013,6 +1056,7 @@ newSession(
 #endif
 
     client_rses->router = router;
+    client_rses->rses_config = router->shardrouter_config;
     client_rses->rses_mysql_session = (MYSQL_session*) session->client_dcb->data;
     client_rses->rses_client_dcb = (DCB*) session->client_dcb;
     client_rses->rses_autocommit_enabled = true;
@@ -1060,49 +1104,16 @@ newSession(
         subsvc->scur->scmd_cur_rses = client_rses;
         subsvc->scur->scmd_cur_ptr_property = client_rses->rses_properties;
         subsvc->service = router->services[i];
-        subsvc->dcb = dcb_clone(client_rses->rses_client_dcb);
-
-        if(subsvc->dcb == NULL){
-            subsvc_set_state(subsvc,SUBSVC_FAILED);
-            MXS_ERROR("Failed to clone client DCB in shardrouter.");
-            continue;
-        }
-
-        subsvc->session = session_alloc(subsvc->service,subsvc->dcb);
-
-        if(subsvc->session == NULL){
-            dcb_close(subsvc->dcb);
-            subsvc->dcb = NULL;
-            subsvc_set_state(subsvc,SUBSVC_FAILED);
-            MXS_ERROR("Failed to create subsession for service %s in shardrouter.",subsvc->service->name);
-            continue;
-        }
 
-        dummy_filterdef = filter_alloc("tee_dummy","tee_dummy");
-
-        if(dummy_filterdef == NULL)
+        /** With lazy_connect, the subsession is opened when it is first used */
+        if(client_rses->rses_config.lazy_connect)
         {
-            subsvc_set_state(subsvc,SUBSVC_FAILED);
-            MXS_ERROR("Failed to allocate filter definition in shardrouter.");
-            continue;
+            subsvc_set_state(subsvc,SUBSVC_PENDING);
         }
-        dummy_filterdef->obj = &dummyObject;
-        dummy_filterdef->filter = (FILTER*)client_rses;
-        dummy_upstream = filterUpstream(dummy_filterdef,subsvc->session,&subsvc->session->tail);
-
-        if(dummy_upstream == NULL)
+        else
         {
-           subsvc_set_state(subsvc,SUBSVC_FAILED);
-           MXS_ERROR("Failed to set filterUpstream in shardrouter.");
-            continue;
+            subsvc_open(client_rses,subsvc);
         }
-
-        subsvc->session->tail = *dummy_upstream;
-
-
-        subsvc_set_state(subsvc,SUBSVC_OK);
-
-        free(dummy_upstream);
     }
 
     router->stats.n_sessions += 1;
@@ -1755,6 +1766,17 @@ routeQuery(ROUTER* instance,
             }
         }
 
+        /** Open a subservice if none of them is open yet */
+        for(z = 0; TARGET_IS_ANY(route_target) && z < router_cli_ses->n_subservice; z++)
+        {
+            if(SUBSVC_IS_PENDING(router_cli_ses->subservice[z]) &&
+               subsvc_open_lazy(router_cli_ses, router_cli_ses->subservice[z]))
+            {
+                tname = router_cli_ses->subservice[z]->service->name;
+                route_target = TARGET_NAMED_SERVER;
+            }
+        }
+
         if(TARGET_IS_ANY(route_target))
         {
 
@@ -1775,6 +1797,14 @@ routeQuery(ROUTER* instance,
          * Search backend server by name or replication lag.
          * If it fails, then try to find valid slave or master.
          */
+        for(i = 0; i < router_cli_ses->n_subservice; i++)
+        {
+            if(SUBSVC_IS_PENDING(router_cli_ses->subservice[i]) &&
+               strcmp(router_cli_ses->subservice[i]->service->name, tname) == 0)
+            {
+                subsvc_open_lazy(router_cli_ses, router_cli_ses->subservice[i]);
+            }
+        }
 
         succp = get_shard_subsvc(&target_subsvc,router_cli_ses,tname);
 
@@ -1798,7 +1828,7 @@ routeQuery(ROUTER* instance,
          */
         if(scur && sescmd_cursor_is_active(scur))
         {
-            target_subsvc->pending_cmd = gwbuf_clone(querybuf);
+            target_subsvc->pending_cmd = querybuf;
             rses_end_locked_router_action(router_cli_ses);
             ret = 1;
             goto retblock;
@@ -1940,6 +1970,12 @@ diagnostic(ROUTER *instance, DCB *dcb)
     dcb_printf(dcb,
                "\tNumber of queries forwarded to all:   	%d\n",
                router->stats.n_all);
+    if(router->shardrouter_config.lazy_connect)
+    {
+        dcb_printf(dcb,
+                   "\tNumber of subsessions opened on use:  	%d\n",
+                   router->stats.n_lazy_opens);
+    }
     if((weightby = serviceGetWeightingParameter(router->service)) != NULL)
     {
         dcb_printf(dcb,
@@ -2332,6 +2368,143 @@ execute_sescmd_history(
     return succp;
 }
 
+/**
+ * Open the subsession of a subservice.
+ * @param rses Router client session
+ * @param subsvc The subservice
+ * @return True if the subsession was opened
+ */
+static bool
+subsvc_open(ROUTER_CLIENT_SES* rses, SUBSERVICE* subsvc)
+{
+    FILTER_DEF* dummy_filterdef;
+    UPSTREAM* dummy_upstream;
+
+    subsvc->dcb = dcb_clone(rses->rses_client_dcb);
+
+    if(subsvc->dcb == NULL){
+        subsvc_set_state(subsvc,SUBSVC_FAILED);
+        MXS_ERROR("Failed to clone client DCB in shardrouter.");
+        return false;
+    }
+
+    subsvc->session = session_alloc(subsvc->service,subsvc->dcb);
+
+    if(subsvc->session == NULL){
+        dcb_close(subsvc->dcb);
+        subsvc->dcb = NULL;
+        subsvc_set_state(subsvc,SUBSVC_FAILED);
+        MXS_ERROR("Failed to create subsession for service %s in shardrouter.",subsvc->service->name);
+        return false;
+    }
+
+    dummy_filterdef = filter_alloc("tee_dummy","tee_dummy");
+
+    if(dummy_filterdef == NULL)
+    {
+        subsvc_set_state(subsvc,SUBSVC_FAILED);
+        MXS_ERROR("Failed to allocate filter definition in shardrouter.");
+        return false;
+    }
+    dummy_filterdef->obj = &dummyObject;
+    dummy_filterdef->filter = (FILTER*)rses;
+    dummy_upstream = filterUpstream(dummy_filterdef,subsvc->session,&subsvc->session->tail);
+
+    if(dummy_upstream == NULL)
+    {
+        subsvc_set_state(subsvc,SUBSVC_FAILED);
+        MXS_ERROR("Failed to set filterUpstream in shardrouter.");
+        return false;
+    }
+
+    subsvc->session->tail = *dummy_upstream;
+
+    subsvc_set_state(subsvc,SUBSVC_OK);
+
+    free(dummy_upstream);
+    return true;
+}
+
+/**
+ * Open a subservice that is opened on first use. The session command history
+ * is replayed on the new subsession and the replies are discarded, as the
+ * client already got them from the other subservices. Statements routed to
+ * the subservice wait until the history has been replayed.
+ *
+ * Router session must be locked.
+ *
+ * @param rses Router client session
+ * @param subsvc The subservice
+ * @return True if the subservice can be used
+ */
+static bool
+subsvc_open_lazy(ROUTER_CLIENT_SES* rses, SUBSERVICE* subsvc)
+{
+    rses_property_t* prop;
+
+    if(!SUBSVC_IS_PENDING(subsvc))
+    {
+        return SUBSVC_IS_OK(subsvc);
+    }
+
+    subsvc->state &= ~SUBSVC_PENDING;
+
+    if(!subsvc_open(rses,subsvc))
+    {
+        return false;
+    }
+
+    atomic_add(&rses->router->stats.n_lazy_opens, 1);
+    subsvc->n_replay = 0;
+
+    for(prop = rses->rses_properties[RSES_PROP_TYPE_SESCMD]; prop; prop = prop->rses_prop_next)
+    {
+        subsvc->n_replay++;
+    }
+
+    if(subsvc->n_replay > 0 && !execute_sescmd_history(subsvc))
+    {
+        MXS_ERROR("Failed to replay the session command history in %s.",
+                  subsvc->service->name);
+        subsvc->n_replay = 0;
+        subsvc->state &= ~SUBSVC_OK;
+        subsvc_set_state(subsvc,SUBSVC_FAILED);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Send the statement that waited for the session commands to complete.
+ *
+ * Router session must be locked.
+ *
+ * @param subsvc The subservice
+ */
+static void
+subsvc_send_pending(SUBSERVICE* subsvc)
+{
+    GWBUF* pending = subsvc->pending_cmd;
+
+    if(pending == NULL)
+    {
+        return;
+    }
+
+    subsvc->pending_cmd = NULL;
+
+    if(SESSION_ROUTE_QUERY(subsvc->session,pending) == 1)
+    {
+        subsvc_set_state(subsvc,SUBSVC_QUERY_ACTIVE|SUBSVC_WAITING_RESULT);
+    }
+    else
+    {
+        MXS_ERROR("Routing the statement that waited for session commands to %s failed.",
+                  subsvc->service->name);
+    }
+}
+
 /**
  * If session command cursor is passive, sends the command to backend for
  * execution.
@@ -2587,6 +2760,30 @@ route_session_write(
         succp = false;
         goto return_succp;
     }
+
+    /**
+     * With lazy_connect, the session command is executed on the open
+     * subservices and replayed on the others when they are opened. One
+     * subservice is opened if none are open so that the client gets a reply.
+     */
+    for(i = 0; i < router_cli_ses->n_subservice; i++)
+    {
+        if(SUBSVC_IS_OK(router_cli_ses->subservice[i]) &&
+           !SUBSVC_IS_CLOSED(router_cli_ses->subservice[i]))
+        {
+            break;
+        }
+    }
+
+    for(int j = 0; i == router_cli_ses->n_subservice && j < router_cli_ses->n_subservice; j++)
+    {
+        if(SUBSVC_IS_PENDING(router_cli_ses->subservice[j]) &&
+           subsvc_open_lazy(router_cli_ses, router_cli_ses->subservice[j]))
+        {
+            break;
+        }
+    }
+
     /**
      * Additional reference is created to querybuf to
      * prevent it from being released before properties
@@ -2597,11 +2794,17 @@ route_session_write(
 
     /** Add sescmd property to router client session */
     rses_property_add(router_cli_ses, prop);
+    succp = false;
 
     for(i = 0; i < router_cli_ses->n_subservice; i++)
     {
         subsvc = router_cli_ses->subservice[i];
 
+        if(SUBSVC_IS_PENDING(subsvc))
+        {
+            continue;
+        }
+
         if(!SUBSVC_IS_CLOSED(subsvc))
         {
             sescmd_cursor_t* scur;
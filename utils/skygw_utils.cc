@@ -180,20 +180,33 @@ size_t get_timestamp_len_hp(void)
  */
 size_t snprint_timestamp(char* p_ts, size_t tslen)
 {
-    time_t t;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return snprint_timestamp_tv(p_ts, tslen, &tv);
+}
+
+/**
+ * @node Write the timestamp of a given time to location passed as argument
+ * by using at most tslen characters.
+ *
+ * @param p_ts  Write position in memory
+ * @param tslen Size of the write position
+ * @param tv    The time to write
+ *
+ * @return Length of string written to p_ts.
+ */
+size_t snprint_timestamp_tv(char* p_ts, size_t tslen, const struct timeval* tv)
+{
     struct tm tm;
     size_t rval;
-    struct timeval tv;
     if (p_ts == NULL)
     {
         rval = 0;
         goto retblock;
     }
 
-    /** Generate timestamp */
-
-    t = time(NULL);
-    localtime_r(&t, &tm);
+    localtime_r(&tv->tv_sec, &tm);
     snprintf(p_ts, MIN(tslen, timestamp_len), timestamp_formatstr,
              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
              tm.tm_min, tm.tm_sec);
@@ -219,10 +232,26 @@ retblock:
  */
 size_t snprint_timestamp_hp(char* p_ts, size_t tslen)
 {
-    time_t t;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return snprint_timestamp_hp_tv(p_ts, tslen, &tv);
+}
+
+/**
+ * @node Write the timestamp of a given time to location passed as argument
+ * by using at most tslen characters. This will use millisecond precision.
+ *
+ * @param p_ts  Write position in memory
+ * @param tslen Size of the write position
+ * @param tv    The time to write
+ *
+ * @return Length of string written to p_ts.
+ */
+size_t snprint_timestamp_hp_tv(char* p_ts, size_t tslen, const struct timeval* tv)
+{
     struct tm tm;
     size_t rval;
-    struct timeval tv;
     int usec;
     if (p_ts == NULL)
     {
@@ -230,11 +259,8 @@ size_t snprint_timestamp_hp(char* p_ts, size_t tslen)
         goto retblock;
     }
 
-    /** Generate timestamp */
-
-    gettimeofday(&tv, NULL);
-    localtime_r(&tv.tv_sec, &tm);
-    usec = tv.tv_usec / 1000;
+    localtime_r(&tv->tv_sec, &tm);
+    usec = tv->tv_usec / 1000;
     snprintf(p_ts, MIN(tslen, timestamp_len_hp), timestamp_formatstr_hp,
              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
              tm.tm_hour, tm.tm_min, tm.tm_sec, usec);
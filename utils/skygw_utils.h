@@ -30,6 +30,7 @@
 
 #include "skygw_types.h"
 #include "skygw_debug.h"
+#include <sys/time.h>
 
 #define DISKWRITE_LATENCY (5*MSEC_USEC)
 
@@ -125,6 +126,8 @@ size_t get_timestamp_len(void);
 size_t get_timestamp_len_hp(void);
 size_t snprint_timestamp(char* p_ts, size_t tslen);
 size_t snprint_timestamp_hp(char* p_ts, size_t tslen);
+size_t snprint_timestamp_tv(char* p_ts, size_t tslen, const struct timeval* tv);
+size_t snprint_timestamp_hp_tv(char* p_ts, size_t tslen, const struct timeval* tv);
 
 EXTERN_C_BLOCK_BEGIN
 